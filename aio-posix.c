@@ -18,6 +18,8 @@
 #include "block/block.h"
 #include "qemu/queue.h"
 #include "qemu/sockets.h"
+#include "qemu/timer.h"
+#include "trace.h"
 #ifdef CONFIG_EPOLL_CREATE1
 #include <sys/epoll.h>
 #endif
@@ -27,6 +29,7 @@ struct AioHandler
     GPollFD pfd;
     IOHandler *io_read;
     IOHandler *io_write;
+    AioPollFn *io_poll;
     int deleted;
     void *opaque;
     bool is_external;
@@ -269,6 +272,24 @@ void aio_set_event_notifier(AioContext *ctx,
                        is_external, (IOHandler *)io_read, NULL, notifier);
 }
 
+void aio_set_fd_poll(AioContext *ctx, int fd, AioPollFn *io_poll)
+{
+    AioHandler *node = find_aio_handler(ctx, fd);
+
+    assert(node || !io_poll);
+    if (node) {
+        node->io_poll = io_poll;
+        aio_notify(ctx);
+    }
+}
+
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollFn *io_poll)
+{
+    aio_set_fd_poll(ctx, event_notifier_get_fd(notifier), io_poll);
+}
+
 bool aio_prepare(AioContext *ctx)
 {
     return false;
@@ -405,12 +426,102 @@ static void add_pollfd(AioHandler *node)
     npfd++;
 }
 
+/* Polling is only worthwhile if every event source can be polled, otherwise
+ * the events of the others would wait for the polling time to expire.
+ */
+static bool aio_can_poll(AioContext *ctx)
+{
+    AioHandler *node;
+
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (!node->deleted && node->pfd.events && !node->io_poll &&
+            aio_node_check(ctx, node->is_external)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool run_poll_handlers_once(AioContext *ctx)
+{
+    bool progress = false;
+    AioHandler *node;
+
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (!node->deleted && node->io_poll &&
+            aio_node_check(ctx, node->is_external) &&
+            node->io_poll(node->opaque)) {
+            progress = true;
+        }
+
+        /* Caller handles freeing deleted nodes.  Don't do it here. */
+    }
+
+    return progress;
+}
+
+/* Busy-wait for up to MAX_NS nanoseconds until a poll handler makes
+ * progress.  Called with ctx->walking_handlers incremented.
+ */
+static bool run_poll_handlers(AioContext *ctx, int64_t max_ns)
+{
+    bool progress;
+    int64_t end_time;
+
+    assert(ctx->walking_handlers);
+
+    trace_run_poll_handlers_begin(ctx, max_ns);
+
+    end_time = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) + max_ns;
+
+    do {
+        progress = run_poll_handlers_once(ctx);
+    } while (!progress && qemu_clock_get_ns(QEMU_CLOCK_REALTIME) < end_time);
+
+    trace_run_poll_handlers_end(ctx, progress);
+
+    return progress;
+}
+
+/* Adapt the polling time to how long the last blocking wait took: grow it
+ * while events arrive shortly after polling stopped, shrink it when they
+ * take longer than poll_max_ns anyway.
+ */
+static void aio_adjust_poll_ns(AioContext *ctx, int64_t block_ns)
+{
+    int64_t old = ctx->poll_ns;
+
+    if (block_ns <= ctx->poll_ns) {
+        /* This is the sweet spot, no adjustment needed */
+        return;
+    } else if (block_ns > ctx->poll_max_ns) {
+        /* We'd have to poll for too long, poll less */
+        if (ctx->poll_shrink) {
+            ctx->poll_ns /= ctx->poll_shrink;
+        } else {
+            ctx->poll_ns = 0;
+        }
+        trace_poll_shrink(ctx, old, ctx->poll_ns);
+    } else if (ctx->poll_ns < ctx->poll_max_ns) {
+        /* There is room to grow, poll longer */
+        int64_t grow = ctx->poll_grow ? ctx->poll_grow : 2;
+
+        ctx->poll_ns = ctx->poll_ns ? ctx->poll_ns * grow : 4000;
+        if (ctx->poll_ns > ctx->poll_max_ns) {
+            ctx->poll_ns = ctx->poll_max_ns;
+        }
+        trace_poll_grow(ctx, old, ctx->poll_ns);
+    }
+}
+
 bool aio_poll(AioContext *ctx, bool blocking)
 {
     AioHandler *node;
     int i, ret;
     bool progress;
+    bool polled = false;
     int64_t timeout;
+    int64_t start = 0;
 
     aio_context_acquire(ctx);
     progress = false;
@@ -430,6 +541,23 @@ bool aio_poll(AioContext *ctx, bool blocking)
 
     assert(npfd == 0);
 
+    if (blocking && ctx->poll_max_ns) {
+        start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        if (ctx->poll_ns && aio_can_poll(ctx)) {
+            int64_t max_ns = MIN((uint64_t)ctx->poll_ns,
+                                 (uint64_t)aio_compute_timeout(ctx));
+
+            polled = true;
+            if (max_ns && run_poll_handlers(ctx, max_ns)) {
+                ctx->poll_hits++;
+                progress = true;
+                /* Events are already pending, do not block */
+                blocking = false;
+                atomic_sub(&ctx->notify_me, 2);
+            }
+        }
+    }
+
     /* fill pollfds */
     QLIST_FOREACH(node, &ctx->aio_handlers, node) {
         if (!node->deleted && node->pfd.events
@@ -463,6 +591,14 @@ bool aio_poll(AioContext *ctx, bool blocking)
         aio_context_acquire(ctx);
     }
 
+    if (blocking && ctx->poll_max_ns) {
+        if (polled) {
+            ctx->poll_misses++;
+        }
+        aio_adjust_poll_ns(ctx, qemu_clock_get_ns(QEMU_CLOCK_REALTIME) -
+                                start);
+    }
+
     aio_notify_accept(ctx);
 
     /* if we have any readable fds, dispatch event */
@@ -485,6 +621,20 @@ bool aio_poll(AioContext *ctx, bool blocking)
     return progress;
 }
 
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 int64_t grow, int64_t shrink, Error **errp)
+{
+    /* No thread synchronization here, it doesn't matter if an incorrect value
+     * is used once.
+     */
+    ctx->poll_max_ns = max_ns;
+    ctx->poll_ns = 0;
+    ctx->poll_grow = grow;
+    ctx->poll_shrink = shrink;
+
+    aio_notify(ctx);
+}
+
 void aio_context_setup(AioContext *ctx)
 {
 #ifdef CONFIG_EPOLL_CREATE1
@@ -0,0 +1,204 @@
+/*
+ * Atomic helper templates
+ *
+ * Generate the helpers of the tcg_gen_atomic_* ops for one access size
+ * (DATA_SIZE) and guest endianness (ATOMIC_BE, unused for bytes).
+ *
+ * Included from user-exec.c, where the helpers are host atomic operations
+ * on the guest memory, and from cputlb.c.  With the softmmu only one vCPU
+ * runs at a time, so a load and a store through the TLB are enough there.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#if DATA_SIZE == 8
+#define SUFFIX     q
+#define USUFFIX    q
+#define DATA_TYPE  uint64_t
+#define BSWAPFN    bswap64
+#define ABI_TYPE   uint64_t
+#elif DATA_SIZE == 4
+#define SUFFIX     l
+#define USUFFIX    ul
+#define DATA_TYPE  uint32_t
+#define BSWAPFN    bswap32
+#define ABI_TYPE   uint32_t
+#elif DATA_SIZE == 2
+#define SUFFIX     w
+#define USUFFIX    uw
+#define DATA_TYPE  uint16_t
+#define BSWAPFN    bswap16
+#define ABI_TYPE   uint32_t
+#elif DATA_SIZE == 1
+#define SUFFIX     b
+#define USUFFIX    ub
+#define DATA_TYPE  uint8_t
+#define ABI_TYPE   uint32_t
+#else
+#error unsupported data size
+#endif
+
+#if DATA_SIZE == 1
+#define END
+#elif ATOMIC_BE
+#define END        _be
+#else
+#define END        _le
+#endif
+
+#define ATOMIC_NAME(X) \
+    glue(glue(glue(helper_atomic_, X), SUFFIX), END)
+
+#ifdef CONFIG_USER_ONLY
+
+/* Guest memory order to host order, and back */
+#if DATA_SIZE == 1 || (defined(HOST_WORDS_BIGENDIAN) && ATOMIC_BE) || \
+    (!defined(HOST_WORDS_BIGENDIAN) && !ATOMIC_BE)
+#define BSWAP(X)   ((DATA_TYPE)(X))
+#define ATOMIC_NATIVE 1
+#else
+#define BSWAP(X)   BSWAPFN(X)
+#endif
+
+#if DATA_SIZE == 8 && HOST_LONG_BITS == 32
+/* No 64-bit atomics on the host, serialize on atomic_serial_lock */
+#define ATOMIC_CMPXCHG(P, O, N)  atomic_serial_cmpxchg64(P, O, N)
+#undef ATOMIC_NATIVE
+#else
+#define ATOMIC_CMPXCHG(P, O, N)  atomic_cmpxchg(P, O, N)
+#endif
+
+/* A fault is reported at the guest instruction that called the helper */
+#define ATOMIC_ENTER()  (helper_retaddr = GETPC())
+#define ATOMIC_EXIT()   (helper_retaddr = 0)
+
+ABI_TYPE ATOMIC_NAME(cmpxchg)(CPUArchState *env, target_ulong addr,
+                              ABI_TYPE cmpv, ABI_TYPE newv, uint32_t oi)
+{
+    DATA_TYPE *haddr = g2h(addr);
+    DATA_TYPE ret;
+
+    ATOMIC_ENTER();
+    ret = ATOMIC_CMPXCHG(haddr, BSWAP(cmpv), BSWAP(newv));
+    ATOMIC_EXIT();
+    return BSWAP(ret);
+}
+
+#ifdef ATOMIC_NATIVE
+
+#define GEN_ATOMIC_HELPER(X, FN, OP, NEW)                               \
+ABI_TYPE ATOMIC_NAME(X)(CPUArchState *env, target_ulong addr,           \
+                        ABI_TYPE val, uint32_t oi)                      \
+{                                                                       \
+    DATA_TYPE *haddr = g2h(addr);                                       \
+    DATA_TYPE old, new;                                                 \
+                                                                        \
+    ATOMIC_ENTER();                                                     \
+    old = FN(haddr, (DATA_TYPE)val);                                    \
+    ATOMIC_EXIT();                                                      \
+    new = OP;                                                           \
+    return NEW ? new : old;                                             \
+}
+
+#else
+
+/* Swapped or serialized accesses go through a compare-and-swap loop */
+#define GEN_ATOMIC_HELPER(X, FN, OP, NEW)                               \
+ABI_TYPE ATOMIC_NAME(X)(CPUArchState *env, target_ulong addr,           \
+                        ABI_TYPE val, uint32_t oi)                      \
+{                                                                       \
+    DATA_TYPE *haddr = g2h(addr);                                       \
+    DATA_TYPE ldo, ldn, old, new;                                       \
+                                                                        \
+    ATOMIC_ENTER();                                                     \
+    ldn = *(volatile DATA_TYPE *)haddr;                                 \
+    do {                                                                \
+        ldo = ldn;                                                      \
+        old = BSWAP(ldo);                                               \
+        new = OP;                                                       \
+        ldn = ATOMIC_CMPXCHG(haddr, ldo, BSWAP(new));                   \
+    } while (ldo != ldn);                                               \
+    ATOMIC_EXIT();                                                      \
+    return NEW ? new : old;                                             \
+}
+
+#endif /* ATOMIC_NATIVE */
+
+#else /* !CONFIG_USER_ONLY */
+
+#if DATA_SIZE == 1
+#define ATOMIC_LD  helper_ret_ldub_mmu
+#define ATOMIC_ST  helper_ret_stb_mmu
+#elif ATOMIC_BE
+#define ATOMIC_LD  glue(glue(helper_be_ld, USUFFIX), _mmu)
+#define ATOMIC_ST  glue(glue(helper_be_st, SUFFIX), _mmu)
+#else
+#define ATOMIC_LD  glue(glue(helper_le_ld, USUFFIX), _mmu)
+#define ATOMIC_ST  glue(glue(helper_le_st, SUFFIX), _mmu)
+#endif
+
+ABI_TYPE ATOMIC_NAME(cmpxchg)(CPUArchState *env, target_ulong addr,
+                              ABI_TYPE cmpv, ABI_TYPE newv, uint32_t oi)
+{
+    uintptr_t retaddr = GETPC();
+    DATA_TYPE ret;
+
+    ret = ATOMIC_LD(env, addr, oi, retaddr);
+    if (ret == (DATA_TYPE)cmpv) {
+        ATOMIC_ST(env, addr, newv, oi, retaddr);
+    }
+    return ret;
+}
+
+#define GEN_ATOMIC_HELPER(X, FN, OP, NEW)                               \
+ABI_TYPE ATOMIC_NAME(X)(CPUArchState *env, target_ulong addr,           \
+                        ABI_TYPE val, uint32_t oi)                      \
+{                                                                       \
+    uintptr_t retaddr = GETPC();                                        \
+    DATA_TYPE old, new;                                                 \
+                                                                        \
+    old = ATOMIC_LD(env, addr, oi, retaddr);                            \
+    new = OP;                                                           \
+    ATOMIC_ST(env, addr, new, oi, retaddr);                             \
+    return NEW ? new : old;                                             \
+}
+
+#endif /* CONFIG_USER_ONLY */
+
+GEN_ATOMIC_HELPER(xchg, atomic_xchg, val, 0)
+GEN_ATOMIC_HELPER(fetch_add, atomic_fetch_add, old + val, 0)
+GEN_ATOMIC_HELPER(fetch_and, atomic_fetch_and, old & val, 0)
+GEN_ATOMIC_HELPER(fetch_or, atomic_fetch_or, old | val, 0)
+GEN_ATOMIC_HELPER(fetch_xor, atomic_fetch_xor, old ^ val, 0)
+GEN_ATOMIC_HELPER(add_fetch, atomic_fetch_add, old + val, 1)
+GEN_ATOMIC_HELPER(and_fetch, atomic_fetch_and, old & val, 1)
+GEN_ATOMIC_HELPER(or_fetch, atomic_fetch_or, old | val, 1)
+GEN_ATOMIC_HELPER(xor_fetch, atomic_fetch_xor, old ^ val, 1)
+
+#undef GEN_ATOMIC_HELPER
+#undef ATOMIC_NAME
+#undef ATOMIC_NATIVE
+#undef ATOMIC_CMPXCHG
+#undef ATOMIC_ENTER
+#undef ATOMIC_EXIT
+#undef ATOMIC_LD
+#undef ATOMIC_ST
+#undef BSWAP
+#undef BSWAPFN
+#undef END
+#undef ABI_TYPE
+#undef DATA_TYPE
+#undef USUFFIX
+#undef SUFFIX
+#undef DATA_SIZE
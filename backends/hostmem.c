@@ -18,6 +18,7 @@
 #include "qapi-visit.h"
 #include "qemu/config-file.h"
 #include "qom/object_interfaces.h"
+#include "sysemu/sysemu.h"
 
 #ifdef CONFIG_NUMA
 #include <numaif.h>
@@ -224,7 +225,7 @@ static void host_memory_backend_set_prealloc(Object *obj, bool value,
         void *ptr = memory_region_get_ram_ptr(&backend->mr);
         uint64_t sz = memory_region_size(&backend->mr);
 
-        os_mem_prealloc(fd, ptr, sz, &local_err);
+        os_mem_prealloc(fd, ptr, sz, backend->prealloc_threads, &local_err);
         if (local_err) {
             error_propagate(errp, local_err);
             return;
@@ -233,6 +234,39 @@ static void host_memory_backend_set_prealloc(Object *obj, bool value,
     }
 }
 
+static void
+host_memory_backend_get_prealloc_threads(Object *obj, Visitor *v,
+                                         const char *name, void *opaque,
+                                         Error **errp)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(obj);
+
+    visit_type_uint32(v, name, &backend->prealloc_threads, errp);
+}
+
+static void
+host_memory_backend_set_prealloc_threads(Object *obj, Visitor *v,
+                                         const char *name, void *opaque,
+                                         Error **errp)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(obj);
+    Error *local_err = NULL;
+    uint32_t value;
+
+    visit_type_uint32(v, name, &value, &local_err);
+    if (local_err) {
+        goto out;
+    }
+    if (!value) {
+        error_setg(&local_err, "Property '%s.%s' doesn't take value '%"
+                   PRIu32 "'", object_get_typename(obj), name, value);
+        goto out;
+    }
+    backend->prealloc_threads = value;
+out:
+    error_propagate(errp, local_err);
+}
+
 static void host_memory_backend_init(Object *obj)
 {
     HostMemoryBackend *backend = MEMORY_BACKEND(obj);
@@ -241,6 +275,7 @@ static void host_memory_backend_init(Object *obj)
     backend->merge = machine_mem_merge(machine);
     backend->dump = machine_dump_guest_core(machine);
     backend->prealloc = mem_prealloc;
+    backend->prealloc_threads = smp_cpus;
 
     object_property_add_bool(obj, "merge",
                         host_memory_backend_get_merge,
@@ -251,6 +286,10 @@ static void host_memory_backend_init(Object *obj)
     object_property_add_bool(obj, "prealloc",
                         host_memory_backend_get_prealloc,
                         host_memory_backend_set_prealloc, NULL);
+    object_property_add(obj, "prealloc-threads", "int",
+                        host_memory_backend_get_prealloc_threads,
+                        host_memory_backend_set_prealloc_threads,
+                        NULL, NULL, NULL);
     object_property_add(obj, "size", "int",
                         host_memory_backend_get_size,
                         host_memory_backend_set_size, NULL, NULL, NULL);
@@ -348,7 +387,7 @@ host_memory_backend_memory_complete(UserCreatable *uc, Error **errp)
          */
         if (backend->prealloc) {
             os_mem_prealloc(memory_region_get_fd(&backend->mr), ptr, sz,
-                            &local_err);
+                            backend->prealloc_threads, &local_err);
             if (local_err) {
                 goto out;
             }
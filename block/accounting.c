@@ -49,6 +49,7 @@ void block_acct_cleanup(BlockAcctStats *stats)
     QSLIST_FOREACH_SAFE(s, &stats->intervals, entries, next) {
         g_free(s);
     }
+    block_latency_histograms_clear(stats);
 }
 
 void block_acct_add_interval(BlockAcctStats *stats, unsigned interval_length)
@@ -76,6 +77,73 @@ BlockAcctTimedStats *block_acct_interval_next(BlockAcctStats *stats,
     }
 }
 
+static void block_latency_histogram_account(BlockLatencyHistogram *hist,
+                                            int64_t latency_ns)
+{
+    int lo = 0, hi = hist->nbins - 1, mid;
+
+    if (!hist->bins) {
+        return;
+    }
+
+    /* Find the number of boundaries that are <= latency_ns */
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if ((uint64_t)latency_ns < hist->boundaries[mid]) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    hist->bins[lo]++;
+}
+
+int block_latency_histogram_set(BlockAcctStats *stats, enum BlockAcctType type,
+                                uint64List *boundaries)
+{
+    BlockLatencyHistogram *hist;
+    uint64List *entry;
+    uint64_t prev = 0;
+    int i, nbins = 1;
+
+    assert(type < BLOCK_MAX_IOTYPE);
+    hist = &stats->latency_histogram[type];
+
+    for (entry = boundaries; entry; entry = entry->next) {
+        if (entry->value <= prev) {
+            return -EINVAL;
+        }
+        prev = entry->value;
+        nbins++;
+    }
+
+    g_free(hist->boundaries);
+    g_free(hist->bins);
+    hist->nbins = 0;
+    hist->boundaries = NULL;
+    hist->bins = NULL;
+    if (!boundaries) {
+        return 0;
+    }
+
+    hist->nbins = nbins;
+    hist->boundaries = g_new(uint64_t, nbins - 1);
+    for (entry = boundaries, i = 0; entry; entry = entry->next, i++) {
+        hist->boundaries[i] = entry->value;
+    }
+    hist->bins = g_new0(uint64_t, nbins);
+    return 0;
+}
+
+void block_latency_histograms_clear(BlockAcctStats *stats)
+{
+    int i;
+
+    for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
+        block_latency_histogram_set(stats, i, NULL);
+    }
+}
+
 void block_acct_start(BlockAcctStats *stats, BlockAcctCookie *cookie,
                       int64_t bytes, enum BlockAcctType type)
 {
@@ -106,6 +174,8 @@ void block_acct_done(BlockAcctStats *stats, BlockAcctCookie *cookie)
     QSLIST_FOREACH(s, &stats->intervals, entries) {
         timed_average_account(&s->latency[cookie->type], latency_ns);
     }
+    block_latency_histogram_account(&stats->latency_histogram[cookie->type],
+                                    latency_ns);
 }
 
 void block_acct_failed(BlockAcctStats *stats, BlockAcctCookie *cookie)
@@ -129,6 +199,8 @@ void block_acct_failed(BlockAcctStats *stats, BlockAcctCookie *cookie)
         QSLIST_FOREACH(s, &stats->intervals, entries) {
             timed_average_account(&s->latency[cookie->type], latency_ns);
         }
+        block_latency_histogram_account(
+            &stats->latency_histogram[cookie->type], latency_ns);
     }
 }
 
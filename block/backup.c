@@ -23,14 +23,16 @@
 #include "qemu/cutils.h"
 #include "sysemu/block-backend.h"
 #include "qemu/bitmap.h"
+#include "qemu/interval-tree.h"
 
 #define BACKUP_CLUSTER_SIZE_DEFAULT (1 << 16)
+#define BACKUP_WORKERS_DEFAULT 8
+#define BACKUP_WORKERS_MAX 64
+#define BACKUP_MAX_EXTENT (64 << 20) /* bytes per block status query */
 #define SLICE_TIME 100000000ULL /* ns */
 
 typedef struct CowRequest {
-    int64_t start;
-    int64_t end;
-    QLIST_ENTRY(CowRequest) list;
+    IntervalTreeNode node; /* clusters [start, end) */
     CoQueue wait_queue; /* coroutines blocked on this request */
 } CowRequest;
 
@@ -48,9 +50,26 @@ typedef struct BackupBlockJob {
     unsigned long *done_bitmap;
     int64_t cluster_size;
     NotifierWithReturn before_write;
-    QLIST_HEAD(, CowRequest) inflight_reqs;
+    IntervalTreeRoot inflight_reqs;
+    int max_workers;
+    int nb_workers;
+    CoQueue worker_queue; /* job coroutine waiting for a worker to finish */
+    QSIMPLEQ_HEAD(, BackupWorker) failed_workers;
 } BackupBlockJob;
 
+/* Copies the clusters [cluster, cluster + nb_clusters) in a coroutine of
+ * its own, so that up to max_workers copies are in flight.
+ */
+typedef struct BackupWorker {
+    BackupBlockJob *job;
+    int64_t cluster;
+    int64_t nb_clusters;
+    bool zero; /* the source reads as zeroes */
+    int ret;
+    bool error_is_read;
+    QSIMPLEQ_ENTRY(BackupWorker) next;
+} BackupWorker;
+
 /* Size of a cluster in sectors, instead of bytes. */
 static inline int64_t cluster_size_sectors(BackupBlockJob *job)
 {
@@ -62,35 +81,29 @@ static void coroutine_fn wait_for_overlapping_requests(BackupBlockJob *job,
                                                        int64_t start,
                                                        int64_t end)
 {
+    IntervalTreeNode *node;
     CowRequest *req;
-    bool retry;
-
-    do {
-        retry = false;
-        QLIST_FOREACH(req, &job->inflight_reqs, list) {
-            if (end > req->start && start < req->end) {
-                qemu_co_queue_wait(&req->wait_queue);
-                retry = true;
-                break;
-            }
-        }
-    } while (retry);
+
+    while ((node = interval_tree_iter_first(&job->inflight_reqs, start, end))) {
+        req = container_of(node, CowRequest, node);
+        qemu_co_queue_wait(&req->wait_queue);
+    }
 }
 
 /* Keep track of an in-flight request */
 static void cow_request_begin(CowRequest *req, BackupBlockJob *job,
                                      int64_t start, int64_t end)
 {
-    req->start = start;
-    req->end = end;
+    req->node.start = start;
+    req->node.end = end;
     qemu_co_queue_init(&req->wait_queue);
-    QLIST_INSERT_HEAD(&job->inflight_reqs, req, list);
+    interval_tree_insert(&job->inflight_reqs, &req->node);
 }
 
 /* Forget about a completed request */
-static void cow_request_end(CowRequest *req)
+static void cow_request_end(BackupBlockJob *job, CowRequest *req)
 {
-    QLIST_REMOVE(req, list);
+    interval_tree_remove(&job->inflight_reqs, &req->node);
     qemu_co_queue_restart_all(&req->wait_queue);
 }
 
@@ -178,7 +191,7 @@ out:
         qemu_vfree(bounce_buffer);
     }
 
-    cow_request_end(&cow_request);
+    cow_request_end(job, &cow_request);
 
     trace_backup_do_cow_return(job, sector_num, nb_sectors, ret);
 
@@ -187,6 +200,45 @@ out:
     return ret;
 }
 
+/* Write zeroes to the target for the clusters [start, end) not copied yet */
+static int coroutine_fn backup_do_zeroes(BackupBlockJob *job,
+                                         int64_t start, int64_t end,
+                                         bool *error_is_read)
+{
+    CowRequest cow_request;
+    int64_t next, bytes;
+    int ret = 0;
+
+    qemu_co_rwlock_rdlock(&job->flush_rwlock);
+
+    wait_for_overlapping_requests(job, start, end);
+    cow_request_begin(&cow_request, job, start, end);
+
+    for (start = find_next_zero_bit(job->done_bitmap, end, start); start < end;
+         start = find_next_zero_bit(job->done_bitmap, end, next)) {
+        next = find_next_bit(job->done_bitmap, end, start);
+        bytes = MIN(next * job->cluster_size, job->common.len) -
+                start * job->cluster_size;
+
+        ret = blk_co_pwrite_zeroes(job->target, start * job->cluster_size,
+                                   bytes, BDRV_REQ_MAY_UNMAP);
+        if (ret < 0) {
+            trace_backup_do_cow_write_fail(job, start, ret);
+            *error_is_read = false;
+            break;
+        }
+
+        bitmap_set(job->done_bitmap, start, next - start);
+        job->common.offset += bytes;
+    }
+
+    cow_request_end(job, &cow_request);
+
+    qemu_co_rwlock_unlock(&job->flush_rwlock);
+
+    return ret;
+}
+
 static int coroutine_fn backup_before_write_notify(
         NotifierWithReturn *notifier,
         void *opaque)
@@ -314,26 +366,177 @@ static bool coroutine_fn yield_and_check(BackupBlockJob *job)
     return false;
 }
 
+static int coroutine_fn backup_worker_run(BackupWorker *w)
+{
+    BackupBlockJob *job = w->job;
+    int64_t sectors_per_cluster = cluster_size_sectors(job);
+
+    if (w->zero) {
+        return backup_do_zeroes(job, w->cluster, w->cluster + w->nb_clusters,
+                                &w->error_is_read);
+    }
+    return backup_do_cow(job, w->cluster * sectors_per_cluster,
+                         w->nb_clusters * sectors_per_cluster,
+                         &w->error_is_read, false);
+}
+
+static void coroutine_fn backup_worker_entry(void *opaque)
+{
+    BackupWorker *w = opaque;
+    BackupBlockJob *job = w->job;
+
+    w->ret = backup_worker_run(w);
+    if (w->ret < 0) {
+        /* The job coroutine applies the error action */
+        QSIMPLEQ_INSERT_TAIL(&job->failed_workers, w, next);
+    } else {
+        g_free(w);
+    }
+
+    job->nb_workers--;
+    qemu_co_queue_next(&job->worker_queue);
+}
+
+/* Wait until less than @limit workers are in flight */
+static void coroutine_fn backup_wait_for_workers(BackupBlockJob *job,
+                                                 int limit)
+{
+    while (job->nb_workers >= limit) {
+        qemu_co_queue_wait(&job->worker_queue);
+    }
+}
+
+static void coroutine_fn backup_start_worker(BackupBlockJob *job,
+                                             int64_t cluster,
+                                             int64_t nb_clusters, bool zero)
+{
+    BackupWorker *w;
+
+    backup_wait_for_workers(job, job->max_workers);
+
+    w = g_new0(BackupWorker, 1);
+    w->job = job;
+    w->cluster = cluster;
+    w->nb_clusters = nb_clusters;
+    w->zero = zero;
+    job->nb_workers++;
+    qemu_coroutine_enter(qemu_coroutine_create(backup_worker_entry, w));
+}
+
+/* Once the workers are done, if @drain or if one of them failed, retry the
+ * failed copies in the job coroutine as the error action says.  Return the
+ * error to report, or 0.
+ */
+static int coroutine_fn backup_check_workers(BackupBlockJob *job, bool drain)
+{
+    BackupWorker *w;
+    int ret;
+
+    if (!drain && QSIMPLEQ_EMPTY(&job->failed_workers)) {
+        return 0;
+    }
+    backup_wait_for_workers(job, 1);
+
+    while ((w = QSIMPLEQ_FIRST(&job->failed_workers))) {
+        for (ret = w->ret; ret < 0; ret = backup_worker_run(w)) {
+            if (backup_error_action(job, w->error_is_read, -ret) ==
+                BLOCK_ERROR_ACTION_REPORT) {
+                return ret;
+            }
+            if (yield_and_check(job)) {
+                return 0;
+            }
+        }
+        QSIMPLEQ_REMOVE_HEAD(&job->failed_workers, next);
+        g_free(w);
+    }
+    return 0;
+}
+
+/* sync=full and sync=top: copy the clusters in order, skipping in bulk the
+ * extents that need no reads.
+ */
+static int coroutine_fn backup_run_full(BackupBlockJob *job)
+{
+    BlockDriverState *bs = blk_bs(job->common.blk);
+    BlockDriverState *base = NULL;
+    int64_t sectors_per_cluster = cluster_size_sectors(job);
+    int64_t total_sectors = DIV_ROUND_UP(job->common.len, BDRV_SECTOR_SIZE);
+    int64_t end = DIV_ROUND_UP(job->common.len, job->cluster_size);
+    int64_t cluster, nb_clusters, sector, status;
+    int64_t data_end = 0; /* the clusters before it are to be copied */
+    int ret, n;
+
+    /* For sync=top, only the clusters allocated in the topmost image */
+    if (job->sync_mode == MIRROR_SYNC_MODE_TOP) {
+        base = backing_bs(bs);
+    }
+
+    for (cluster = 0; cluster < end; cluster += nb_clusters) {
+        if (yield_and_check(job)) {
+            return 0;
+        }
+        ret = backup_check_workers(job, false);
+        if (ret < 0) {
+            return ret;
+        }
+
+        nb_clusters = 1;
+        if (cluster < data_end) {
+            backup_start_worker(job, cluster, 1, false);
+            continue;
+        }
+
+        sector = cluster * sectors_per_cluster;
+        status = bdrv_get_block_status_above(bs, base, sector,
+                         MIN(total_sectors - sector,
+                             BACKUP_MAX_EXTENT >> BDRV_SECTOR_BITS),
+                         &n, NULL);
+        if (status >= 0 && n >= sectors_per_cluster) {
+            nb_clusters = n / sectors_per_cluster;
+        } else if (status >= 0 && sector + n == total_sectors) {
+            /* The last cluster, cut by the end of the disk */
+            nb_clusters = 1;
+        } else {
+            /* Errors and partial clusters are copied */
+            status = BDRV_BLOCK_DATA | BDRV_BLOCK_ALLOCATED;
+        }
+
+        if (job->sync_mode == MIRROR_SYNC_MODE_TOP &&
+            !(status & BDRV_BLOCK_ALLOCATED)) {
+            continue;
+        }
+        if (status & BDRV_BLOCK_ZERO) {
+            backup_start_worker(job, cluster, nb_clusters, true);
+            continue;
+        }
+
+        /* One worker per cluster */
+        data_end = cluster + nb_clusters;
+        nb_clusters = 1;
+        backup_start_worker(job, cluster, 1, false);
+    }
+
+    return backup_check_workers(job, true);
+}
+
 static int coroutine_fn backup_run_incremental(BackupBlockJob *job)
 {
-    bool error_is_read;
     int ret = 0;
-    int clusters_per_iter;
-    uint32_t granularity;
-    int64_t sector;
+    int64_t sector = 0;
+    int64_t nb_sectors;
     int64_t cluster;
     int64_t end;
     int64_t last_cluster = -1;
     int64_t sectors_per_cluster = cluster_size_sectors(job);
-    HBitmapIter hbi;
-
-    granularity = bdrv_dirty_bitmap_granularity(job->sync_bitmap);
-    clusters_per_iter = MAX((granularity / job->cluster_size), 1);
-    bdrv_dirty_iter_init(job->sync_bitmap, &hbi);
+    int64_t bitmap_size = bdrv_dirty_bitmap_size(job->sync_bitmap);
 
-    /* Find the next dirty sector(s) */
-    while ((sector = hbitmap_iter_next(&hbi)) != -1) {
+    /* Find the next extent of dirty sectors */
+    while ((sector = bdrv_dirty_bitmap_next_dirty_area(job->sync_bitmap,
+                                                       sector, bitmap_size,
+                                                       &nb_sectors)) != -1) {
         cluster = sector / sectors_per_cluster;
+        end = DIV_ROUND_UP(sector + nb_sectors, sectors_per_cluster);
 
         /* Fake progress updates for any clusters we skipped */
         if (cluster != last_cluster + 1) {
@@ -341,29 +544,26 @@ static int coroutine_fn backup_run_incremental(BackupBlockJob *job)
                                    job->cluster_size);
         }
 
-        for (end = cluster + clusters_per_iter; cluster < end; cluster++) {
-            do {
-                if (yield_and_check(job)) {
-                    return ret;
-                }
-                ret = backup_do_cow(job, cluster * sectors_per_cluster,
-                                    sectors_per_cluster, &error_is_read,
-                                    false);
-                if ((ret < 0) &&
-                    backup_error_action(job, error_is_read, -ret) ==
-                    BLOCK_ERROR_ACTION_REPORT) {
-                    return ret;
-                }
-            } while (ret < 0);
-        }
-
-        /* If the bitmap granularity is smaller than the backup granularity,
-         * we need to advance the iterator pointer to the next cluster. */
-        if (granularity < job->cluster_size) {
-            bdrv_set_dirty_iter(&hbi, cluster * sectors_per_cluster);
+        for (; cluster < end; cluster++) {
+            if (yield_and_check(job)) {
+                return ret;
+            }
+            ret = backup_check_workers(job, false);
+            if (ret < 0) {
+                return ret;
+            }
+            backup_start_worker(job, cluster, 1, false);
         }
 
+        /* The extent may end in the middle of a cluster that was just
+         * copied; resume the search at the next one. */
         last_cluster = cluster - 1;
+        sector = cluster * sectors_per_cluster;
+    }
+
+    ret = backup_check_workers(job, true);
+    if (ret < 0) {
+        return ret;
     }
 
     /* Play some final catchup with the progress meter */
@@ -381,14 +581,15 @@ static void coroutine_fn backup_run(void *opaque)
     BackupCompleteData *data;
     BlockDriverState *bs = blk_bs(job->common.blk);
     BlockBackend *target = job->target;
-    int64_t start, end;
-    int64_t sectors_per_cluster = cluster_size_sectors(job);
+    BackupWorker *w;
+    int64_t end;
     int ret = 0;
 
-    QLIST_INIT(&job->inflight_reqs);
+    job->inflight_reqs = (IntervalTreeRoot)INTERVAL_TREE_ROOT_INIT;
     qemu_co_rwlock_init(&job->flush_rwlock);
+    qemu_co_queue_init(&job->worker_queue);
+    QSIMPLEQ_INIT(&job->failed_workers);
 
-    start = 0;
     end = DIV_ROUND_UP(job->common.len, job->cluster_size);
 
     job->done_bitmap = bitmap_new(end);
@@ -406,58 +607,14 @@ static void coroutine_fn backup_run(void *opaque)
         ret = backup_run_incremental(job);
     } else {
         /* Both FULL and TOP SYNC_MODE's require copying.. */
-        for (; start < end; start++) {
-            bool error_is_read;
-            if (yield_and_check(job)) {
-                break;
-            }
+        ret = backup_run_full(job);
+    }
 
-            if (job->sync_mode == MIRROR_SYNC_MODE_TOP) {
-                int i, n;
-                int alloced = 0;
-
-                /* Check to see if these blocks are already in the
-                 * backing file. */
-
-                for (i = 0; i < sectors_per_cluster;) {
-                    /* bdrv_is_allocated() only returns true/false based
-                     * on the first set of sectors it comes across that
-                     * are are all in the same state.
-                     * For that reason we must verify each sector in the
-                     * backup cluster length.  We end up copying more than
-                     * needed but at some point that is always the case. */
-                    alloced =
-                        bdrv_is_allocated(bs,
-                                start * sectors_per_cluster + i,
-                                sectors_per_cluster - i, &n);
-                    i += n;
-
-                    if (alloced == 1 || n == 0) {
-                        break;
-                    }
-                }
-
-                /* If the above loop never found any sectors that are in
-                 * the topmost image, skip this backup. */
-                if (alloced == 0) {
-                    continue;
-                }
-            }
-            /* FULL sync mode we copy the whole drive. */
-            ret = backup_do_cow(job, start * sectors_per_cluster,
-                                sectors_per_cluster, &error_is_read, false);
-            if (ret < 0) {
-                /* Depending on error action, fail now or retry cluster */
-                BlockErrorAction action =
-                    backup_error_action(job, error_is_read, -ret);
-                if (action == BLOCK_ERROR_ACTION_REPORT) {
-                    break;
-                } else {
-                    start--;
-                    continue;
-                }
-            }
-        }
+    /* Workers still run after a cancellation or a reported error */
+    backup_wait_for_workers(job, 1);
+    while ((w = QSIMPLEQ_FIRST(&job->failed_workers))) {
+        QSIMPLEQ_REMOVE_HEAD(&job->failed_workers, next);
+        g_free(w);
     }
 
     notifier_with_return_remove(&job->before_write);
@@ -476,6 +633,7 @@ static void coroutine_fn backup_run(void *opaque)
 
 void backup_start(const char *job_id, BlockDriverState *bs,
                   BlockDriverState *target, int64_t speed,
+                  int64_t max_workers,
                   MirrorSyncMode sync_mode, BdrvDirtyBitmap *sync_bitmap,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
@@ -495,6 +653,12 @@ void backup_start(const char *job_id, BlockDriverState *bs,
         return;
     }
 
+    if (max_workers < 0 || max_workers > BACKUP_WORKERS_MAX) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "max-workers",
+                   "a value between 1 and " stringify(BACKUP_WORKERS_MAX));
+        return;
+    }
+
     if (!bdrv_is_inserted(bs)) {
         error_setg(errp, "Device is not inserted: %s",
                    bdrv_get_device_name(bs));
@@ -553,6 +717,7 @@ void backup_start(const char *job_id, BlockDriverState *bs,
     job->on_source_error = on_source_error;
     job->on_target_error = on_target_error;
     job->sync_mode = sync_mode;
+    job->max_workers = max_workers ?: BACKUP_WORKERS_DEFAULT;
     job->sync_bitmap = sync_mode == MIRROR_SYNC_MODE_INCREMENTAL ?
                        sync_bitmap : NULL;
 
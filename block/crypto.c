@@ -21,6 +21,7 @@
 #include "qemu/osdep.h"
 
 #include "block/block_int.h"
+#include "block/thread-pool.h"
 #include "sysemu/block-backend.h"
 #include "crypto/block.h"
 #include "qapi/opts-visitor.h"
@@ -38,6 +39,7 @@ typedef struct BlockCrypto BlockCrypto;
 
 struct BlockCrypto {
     QCryptoBlock *block;
+    CoMutex lock;   /* serializes use of the cipher by the thread pool */
 };
 
 
@@ -322,6 +324,7 @@ static int block_crypto_open_generic(QCryptoBlockFormat format,
 
     bs->encrypted = true;
     bs->valid_key = true;
+    qemu_co_mutex_init(&crypto->lock);
 
     ret = 0;
  cleanup:
@@ -389,6 +392,52 @@ static void block_crypto_close(BlockDriverState *bs)
 
 #define BLOCK_CRYPTO_MAX_SECTORS 32
 
+typedef struct BlockCryptoData {
+    QCryptoBlock *block;
+    uint64_t sector_num;
+    uint8_t *buf;
+    size_t len;
+    bool enc;
+} BlockCryptoData;
+
+static int block_crypto_crypt(void *opaque)
+{
+    BlockCryptoData *data = opaque;
+    int ret;
+
+    if (data->enc) {
+        ret = qcrypto_block_encrypt(data->block, data->sector_num,
+                                    data->buf, data->len, NULL);
+    } else {
+        ret = qcrypto_block_decrypt(data->block, data->sector_num,
+                                    data->buf, data->len, NULL);
+    }
+    return ret < 0 ? -EIO : 0;
+}
+
+/* Encrypt or decrypt in the thread pool, so that the event loop keeps
+ * running other requests meanwhile.  */
+static int coroutine_fn
+block_crypto_co_crypt(BlockDriverState *bs, uint64_t sector_num,
+                      uint8_t *buf, size_t len, bool enc)
+{
+    BlockCrypto *crypto = bs->opaque;
+    ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    BlockCryptoData data = {
+        .block      = crypto->block,
+        .sector_num = sector_num,
+        .buf        = buf,
+        .len        = len,
+        .enc        = enc,
+    };
+    int ret;
+
+    qemu_co_mutex_lock(&crypto->lock);
+    ret = thread_pool_submit_co(pool, block_crypto_crypt, &data);
+    qemu_co_mutex_unlock(&crypto->lock);
+    return ret;
+}
+
 static coroutine_fn int
 block_crypto_co_readv(BlockDriverState *bs, int64_t sector_num,
                       int remaining_sectors, QEMUIOVector *qiov)
@@ -433,11 +482,9 @@ block_crypto_co_readv(BlockDriverState *bs, int64_t sector_num,
             goto cleanup;
         }
 
-        if (qcrypto_block_decrypt(crypto->block,
-                                  sector_num,
-                                  cipher_data, cur_nr_sectors * 512,
-                                  NULL) < 0) {
-            ret = -EIO;
+        ret = block_crypto_co_crypt(bs, sector_num, cipher_data,
+                                    cur_nr_sectors * 512, false);
+        if (ret < 0) {
             goto cleanup;
         }
 
@@ -494,11 +541,9 @@ block_crypto_co_writev(BlockDriverState *bs, int64_t sector_num,
         qemu_iovec_to_buf(qiov, bytes_done,
                           cipher_data, cur_nr_sectors * 512);
 
-        if (qcrypto_block_encrypt(crypto->block,
-                                  sector_num,
-                                  cipher_data, cur_nr_sectors * 512,
-                                  NULL) < 0) {
-            ret = -EIO;
+        ret = block_crypto_co_crypt(bs, sector_num, cipher_data,
+                                    cur_nr_sectors * 512, true);
+        if (ret < 0) {
             goto cleanup;
         }
 
@@ -75,6 +75,8 @@ static CURLMcode __curl_multi_socket_action(CURLM *multi_handle,
 #define CURL_NUM_ACB    8
 #define SECTOR_SIZE     512
 #define READ_AHEAD_DEFAULT (256 * 1024)
+#define CURL_CACHE_BLOCK_SIZE (64 * 1024)
+#define CURL_CACHE_SIZE_DEFAULT (16 * 1024 * 1024)
 #define CURL_TIMEOUT_DEFAULT 5
 #define CURL_TIMEOUT_MAX 10000
 
@@ -84,6 +86,7 @@ static CURLMcode __curl_multi_socket_action(CURLM *multi_handle,
 
 #define CURL_BLOCK_OPT_URL       "url"
 #define CURL_BLOCK_OPT_READAHEAD "readahead"
+#define CURL_BLOCK_OPT_CACHE_SIZE "cache-size"
 #define CURL_BLOCK_OPT_SSLVERIFY "sslverify"
 #define CURL_BLOCK_OPT_TIMEOUT "timeout"
 #define CURL_BLOCK_OPT_COOKIE    "cookie"
@@ -106,12 +109,25 @@ typedef struct CURLAIOCB {
     size_t end;
 } CURLAIOCB;
 
+/* A connection, several states share it with HTTP/2 multiplexing */
+typedef struct CURLSocket {
+    struct BDRVCURLState *s;
+    curl_socket_t fd;
+    QLIST_ENTRY(CURLSocket) next;
+} CURLSocket;
+
+/* Downloaded image data, CURL_CACHE_BLOCK_SIZE aligned */
+typedef struct CURLCacheBlock {
+    gint64 index; /* offset / CURL_CACHE_BLOCK_SIZE, the hash table key */
+    QTAILQ_ENTRY(CURLCacheBlock) lru;
+    char data[];
+} CURLCacheBlock;
+
 typedef struct CURLState
 {
     struct BDRVCURLState *s;
     CURLAIOCB *acb[CURL_NUM_ACB];
     CURL *curl;
-    curl_socket_t sock_fd;
     char *orig_buf;
     size_t buf_start;
     size_t buf_off;
@@ -126,8 +142,20 @@ typedef struct BDRVCURLState {
     QEMUTimer timer;
     size_t len;
     CURLState states[CURL_NUM_STATES];
+    QLIST_HEAD(, CURLSocket) sockets;
     char *url;
     size_t readahead_size;
+    /* LRU cache of the downloaded blocks, NULL if cache-size is 0 */
+    size_t cache_size;
+    size_t cache_blocks;
+    GHashTable *cache;
+    QTAILQ_HEAD(CURLCacheLRU, CURLCacheBlock) cache_lru;
+    /* Readahead of sequential reads: the window doubles with each one, up
+     * to readahead_size, and a random read resets it.
+     */
+    size_t seq_end;
+    size_t ra_window;
+    size_t ra_end;
     bool sslverify;
     uint64_t timeout;
     char *cookie;
@@ -160,32 +188,49 @@ static int curl_timer_cb(CURLM *multi, long timeout_ms, void *opaque)
 }
 #endif
 
+static void curl_free_socket(CURLSocket *sock)
+{
+    aio_set_fd_handler(sock->s->aio_context, sock->fd, false,
+                       NULL, NULL, NULL);
+    QLIST_REMOVE(sock, next);
+    g_free(sock);
+}
+
 static int curl_sock_cb(CURL *curl, curl_socket_t fd, int action,
                         void *userp, void *sp)
 {
     BDRVCURLState *s;
     CURLState *state = NULL;
+    CURLSocket *sock = sp;
+
     curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char **)&state);
-    state->sock_fd = fd;
     s = state->s;
 
+    if (!sock) {
+        sock = g_new0(CURLSocket, 1);
+        sock->s = s;
+        sock->fd = fd;
+        QLIST_INSERT_HEAD(&s->sockets, sock, next);
+        curl_multi_assign(s->multi, fd, sock);
+    }
+
     DPRINTF("CURL (AIO): Sock action %d on fd %d\n", action, (int)fd);
     switch (action) {
         case CURL_POLL_IN:
             aio_set_fd_handler(s->aio_context, fd, false,
-                               curl_multi_read, NULL, state);
+                               curl_multi_read, NULL, sock);
             break;
         case CURL_POLL_OUT:
             aio_set_fd_handler(s->aio_context, fd, false,
-                               NULL, curl_multi_do, state);
+                               NULL, curl_multi_do, sock);
             break;
         case CURL_POLL_INOUT:
             aio_set_fd_handler(s->aio_context, fd, false,
-                               curl_multi_read, curl_multi_do, state);
+                               curl_multi_read, curl_multi_do, sock);
             break;
         case CURL_POLL_REMOVE:
-            aio_set_fd_handler(s->aio_context, fd, false,
-                               NULL, NULL, NULL);
+            curl_multi_assign(s->multi, fd, NULL);
+            curl_free_socket(sock);
             break;
     }
 
@@ -243,6 +288,85 @@ static size_t curl_read_cb(void *ptr, size_t size, size_t nmemb, void *opaque)
     return realsize;
 }
 
+static size_t curl_cache_block_len(BDRVCURLState *s, gint64 index)
+{
+    return MIN(CURL_CACHE_BLOCK_SIZE, s->len - index * CURL_CACHE_BLOCK_SIZE);
+}
+
+/* Copy [start, start + len) to QIOV if the cache has all of it */
+static bool curl_cache_read(BDRVCURLState *s, size_t start, size_t len,
+                            QEMUIOVector *qiov)
+{
+    gint64 first = start / CURL_CACHE_BLOCK_SIZE;
+    gint64 last = (start + len - 1) / CURL_CACHE_BLOCK_SIZE;
+    CURLCacheBlock *block;
+    size_t off, n;
+    gint64 i;
+
+    if (!s->cache || !len) {
+        return false;
+    }
+    for (i = first; i <= last; i++) {
+        if (!g_hash_table_lookup(s->cache, &i)) {
+            return false;
+        }
+    }
+    if (!qiov) {
+        return true;
+    }
+
+    for (i = first; i <= last; i++) {
+        block = g_hash_table_lookup(s->cache, &i);
+        off = MAX(start, i * CURL_CACHE_BLOCK_SIZE);
+        n = MIN(start + len, (i + 1) * CURL_CACHE_BLOCK_SIZE) - off;
+        qemu_iovec_from_buf(qiov, off - start,
+                            block->data + off - i * CURL_CACHE_BLOCK_SIZE, n);
+
+        QTAILQ_REMOVE(&s->cache_lru, block, lru);
+        QTAILQ_INSERT_HEAD(&s->cache_lru, block, lru);
+    }
+    return true;
+}
+
+/* Cache the whole blocks of the data downloaded at offset START */
+static void curl_cache_insert(BDRVCURLState *s, size_t start,
+                              const char *buf, size_t len)
+{
+    gint64 i = DIV_ROUND_UP(start, CURL_CACHE_BLOCK_SIZE);
+    CURLCacheBlock *block;
+    size_t off, block_len;
+
+    if (!s->cache) {
+        return;
+    }
+
+    for (; (off = i * CURL_CACHE_BLOCK_SIZE) < start + len; i++) {
+        block_len = curl_cache_block_len(s, i);
+        if (off + block_len > start + len) {
+            break;
+        }
+
+        block = g_hash_table_lookup(s->cache, &i);
+        if (block) {
+            QTAILQ_REMOVE(&s->cache_lru, block, lru);
+        } else {
+            if (s->cache_blocks * CURL_CACHE_BLOCK_SIZE >= s->cache_size) {
+                /* Recycle the least recently used block */
+                block = QTAILQ_LAST(&s->cache_lru, CURLCacheLRU);
+                QTAILQ_REMOVE(&s->cache_lru, block, lru);
+                g_hash_table_steal(s->cache, &block->index);
+            } else {
+                block = g_malloc(sizeof(*block) + CURL_CACHE_BLOCK_SIZE);
+                s->cache_blocks++;
+            }
+            block->index = i;
+            memcpy(block->data, buf + off - start, block_len);
+            g_hash_table_insert(s->cache, &block->index, block);
+        }
+        QTAILQ_INSERT_HEAD(&s->cache_lru, block, lru);
+    }
+}
+
 static int curl_find_buf(BDRVCURLState *s, size_t start, size_t len,
                          CURLAIOCB *acb)
 {
@@ -317,7 +441,10 @@ static void curl_multi_check_completion(BDRVCURLState *s)
                               (char **)&state);
 
             /* ACBs for successful messages get completed in curl_read_cb */
-            if (msg->data.result != CURLE_OK) {
+            if (msg->data.result == CURLE_OK) {
+                curl_cache_insert(s, state->buf_start, state->orig_buf,
+                                  state->buf_off);
+            } else {
                 int i;
                 static int errcount = 100;
 
@@ -352,26 +479,29 @@ static void curl_multi_check_completion(BDRVCURLState *s)
 
 static void curl_multi_do(void *arg)
 {
-    CURLState *s = (CURLState *)arg;
+    CURLSocket *sock = arg;
+    BDRVCURLState *s = sock->s;
     int running;
     int r;
 
-    if (!s->s->multi) {
+    if (!s->multi) {
         return;
     }
 
     do {
-        r = curl_multi_socket_action(s->s->multi, s->sock_fd, 0, &running);
+        r = curl_multi_socket_action(s->multi, sock->fd, 0, &running);
     } while(r == CURLM_CALL_MULTI_PERFORM);
 
 }
 
 static void curl_multi_read(void *arg)
 {
-    CURLState *s = (CURLState *)arg;
+    CURLSocket *sock = arg;
+    BDRVCURLState *s = sock->s;
 
+    /* The socket may be freed by curl_multi_do() */
     curl_multi_do(arg);
-    curl_multi_check_completion(s->s);
+    curl_multi_check_completion(s);
 }
 
 static void curl_multi_timeout_do(void *arg)
@@ -392,27 +522,24 @@ static void curl_multi_timeout_do(void *arg)
 #endif
 }
 
-static CURLState *curl_init_state(BlockDriverState *bs, BDRVCURLState *s)
+/* Return a free state if there are more than RESERVE of them */
+static CURLState *curl_find_state(BDRVCURLState *s, int reserve)
 {
     CURLState *state = NULL;
-    int i, j;
+    int i, nb_free = 0;
 
-    do {
-        for (i=0; i<CURL_NUM_STATES; i++) {
-            for (j=0; j<CURL_NUM_ACB; j++)
-                if (s->states[i].acb[j])
-                    continue;
-            if (s->states[i].in_use)
-                continue;
-
-            state = &s->states[i];
-            state->in_use = 1;
-            break;
-        }
-        if (!state) {
-            aio_poll(bdrv_get_aio_context(bs), true);
+    for (i = 0; i < CURL_NUM_STATES; i++) {
+        if (!s->states[i].in_use) {
+            state = state ?: &s->states[i];
+            nb_free++;
         }
-    } while(!state);
+    }
+    return nb_free > reserve ? state : NULL;
+}
+
+static CURLState *curl_setup_state(BDRVCURLState *s, CURLState *state)
+{
+    state->in_use = 1;
 
     if (!state->curl) {
         state->curl = curl_easy_init();
@@ -436,6 +563,17 @@ static CURLState *curl_init_state(BlockDriverState *bs, BDRVCURLState *s)
         curl_easy_setopt(state->curl, CURLOPT_ERRORBUFFER, state->errmsg);
         curl_easy_setopt(state->curl, CURLOPT_FAILONERROR, 1);
 
+        /* Multiplex the range requests of all states over one connection
+         * when the server speaks HTTP/2.
+         */
+#if LIBCURL_VERSION_NUM >= 0x072f00
+        curl_easy_setopt(state->curl, CURLOPT_HTTP_VERSION,
+                         (long)CURL_HTTP_VERSION_2TLS);
+#endif
+#if LIBCURL_VERSION_NUM >= 0x072b00
+        curl_easy_setopt(state->curl, CURLOPT_PIPEWAIT, 1L);
+#endif
+
         if (s->username) {
             curl_easy_setopt(state->curl, CURLOPT_USERNAME, s->username);
         }
@@ -472,6 +610,16 @@ static CURLState *curl_init_state(BlockDriverState *bs, BDRVCURLState *s)
     return state;
 }
 
+static CURLState *curl_init_state(BlockDriverState *bs, BDRVCURLState *s)
+{
+    CURLState *state;
+
+    while (!(state = curl_find_state(s, 0))) {
+        aio_poll(bdrv_get_aio_context(bs), true);
+    }
+    return curl_setup_state(s, state);
+}
+
 static void curl_clean_state(CURLState *s)
 {
     if (s->s->multi)
@@ -488,6 +636,7 @@ static void curl_parse_filename(const char *filename, QDict *options,
 static void curl_detach_aio_context(BlockDriverState *bs)
 {
     BDRVCURLState *s = bs->opaque;
+    CURLSocket *sock, *tmp;
     int i;
 
     for (i = 0; i < CURL_NUM_STATES; i++) {
@@ -505,6 +654,9 @@ static void curl_detach_aio_context(BlockDriverState *bs)
         curl_multi_cleanup(s->multi);
         s->multi = NULL;
     }
+    QLIST_FOREACH_SAFE(sock, &s->sockets, next, tmp) {
+        curl_free_socket(sock);
+    }
 
     timer_del(&s->timer);
 }
@@ -522,6 +674,9 @@ static void curl_attach_aio_context(BlockDriverState *bs,
     s->multi = curl_multi_init();
     s->aio_context = new_context;
     curl_multi_setopt(s->multi, CURLMOPT_SOCKETFUNCTION, curl_sock_cb);
+#ifdef CURLPIPE_MULTIPLEX
+    curl_multi_setopt(s->multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+#endif
 #ifdef NEED_CURL_TIMER_CALLBACK
     curl_multi_setopt(s->multi, CURLMOPT_TIMERDATA, s);
     curl_multi_setopt(s->multi, CURLMOPT_TIMERFUNCTION, curl_timer_cb);
@@ -542,6 +697,11 @@ static QemuOptsList runtime_opts = {
             .type = QEMU_OPT_SIZE,
             .help = "Readahead size",
         },
+        {
+            .name = CURL_BLOCK_OPT_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of the cache of downloaded data",
+        },
         {
             .name = CURL_BLOCK_OPT_SSLVERIFY,
             .type = QEMU_OPT_BOOL,
@@ -616,6 +776,9 @@ static int curl_open(BlockDriverState *bs, QDict *options, int flags,
         goto out_noclean;
     }
 
+    s->cache_size = qemu_opt_get_size(opts, CURL_BLOCK_OPT_CACHE_SIZE,
+                                      CURL_CACHE_SIZE_DEFAULT);
+
     s->timeout = qemu_opt_get_number(opts, CURL_BLOCK_OPT_TIMEOUT,
                                      CURL_TIMEOUT_DEFAULT);
     if (s->timeout > CURL_TIMEOUT_MAX) {
@@ -695,6 +858,12 @@ static int curl_open(BlockDriverState *bs, QDict *options, int flags,
 
     curl_attach_aio_context(bs, bdrv_get_aio_context(bs));
 
+    if (s->cache_size) {
+        s->cache = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+                                         NULL, g_free);
+        QTAILQ_INIT(&s->cache_lru);
+    }
+
     qemu_opts_del(opts);
     return 0;
 
@@ -714,27 +883,109 @@ static const AIOCBInfo curl_aiocb_info = {
 };
 
 
-static void curl_readv_bh_cb(void *p)
+/* Download [start, start + len) in STATE, for ACB if it is set */
+static int curl_start_transfer(BDRVCURLState *s, CURLState *state,
+                               size_t start, size_t len, CURLAIOCB *acb)
 {
-    CURLState *state;
     int running;
 
+    state->buf_off = 0;
+    g_free(state->orig_buf);
+    state->buf_start = start;
+    state->buf_len = len;
+    state->orig_buf = g_try_malloc(state->buf_len);
+    if (state->buf_len && state->orig_buf == NULL) {
+        curl_clean_state(state);
+        return -ENOMEM;
+    }
+    state->acb[0] = acb;
+
+    snprintf(state->range, 127, "%zd-%zd", start, start + len - 1);
+    DPRINTF("CURL (AIO): Reading %zd at %zd (%s)\n", len, start, state->range);
+    curl_easy_setopt(state->curl, CURLOPT_RANGE, state->range);
+
+    curl_multi_add_handle(s->multi, state->curl);
+
+    /* Tell curl it needs to kick things off */
+    curl_multi_socket_action(s->multi, CURL_SOCKET_TIMEOUT, 0, &running);
+    return 0;
+}
+
+static void curl_track_read(BDRVCURLState *s, size_t start, size_t len)
+{
+    if (start == s->seq_end) {
+        s->ra_window = MIN(MAX(s->ra_window * 2, CURL_CACHE_BLOCK_SIZE),
+                           s->readahead_size);
+    } else {
+        s->ra_window = 0;
+        s->ra_end = 0;
+    }
+    s->seq_end = start + len;
+}
+
+/* Keep a window of a sequential stream downloading ahead of the reads, in
+ * a request of its own and leaving a state free for the guest.
+ */
+static void curl_readahead(BDRVCURLState *s)
+{
+    CURLState *state;
+    size_t start, len;
+
+    if (!s->ra_window) {
+        return;
+    }
+
+    start = MAX(s->ra_end, s->seq_end);
+    if (s->cache) {
+        start = ROUND_UP(start, CURL_CACHE_BLOCK_SIZE);
+    }
+    if (start >= s->len || start - s->seq_end >= s->ra_window) {
+        return;
+    }
+    len = MIN(s->ra_window, s->len - start);
+    if (curl_cache_read(s, start, len, NULL)) {
+        s->ra_end = start + len;
+        return;
+    }
+
+    state = curl_find_state(s, 1);
+    if (!state || !curl_setup_state(s, state)) {
+        return;
+    }
+    if (curl_start_transfer(s, state, start, len, NULL) == 0) {
+        s->ra_end = start + len;
+    }
+}
+
+static void curl_readv_bh_cb(void *p)
+{
+    CURLState *state;
     CURLAIOCB *acb = p;
     BDRVCURLState *s = acb->common.bs->opaque;
+    size_t start = acb->sector_num * SECTOR_SIZE;
+    size_t len = acb->nb_sectors * SECTOR_SIZE;
+    size_t fetch_start, fetch_end;
+    int ret;
 
     qemu_bh_delete(acb->bh);
     acb->bh = NULL;
 
-    size_t start = acb->sector_num * SECTOR_SIZE;
-    size_t end;
+    curl_track_read(s, start, len);
 
     // In case we have the requested data already (e.g. read-ahead),
     // we can just call the callback and be done.
-    switch (curl_find_buf(s, start, acb->nb_sectors * SECTOR_SIZE, acb)) {
+    if (curl_cache_read(s, start, len, acb->qiov)) {
+        acb->common.cb(acb->common.opaque, 0);
+        qemu_aio_unref(acb);
+        curl_readahead(s);
+        return;
+    }
+    switch (curl_find_buf(s, start, len, acb)) {
         case FIND_RET_OK:
             qemu_aio_unref(acb);
             // fall through
         case FIND_RET_WAIT:
+            curl_readahead(s);
             return;
         default:
             break;
@@ -748,32 +999,24 @@ static void curl_readv_bh_cb(void *p)
         return;
     }
 
-    acb->start = 0;
-    acb->end = (acb->nb_sectors * SECTOR_SIZE);
+    /* Whole blocks, so that they can be cached */
+    fetch_start = start;
+    fetch_end = start + len;
+    if (s->cache) {
+        fetch_start = QEMU_ALIGN_DOWN(fetch_start, CURL_CACHE_BLOCK_SIZE);
+        fetch_end = MIN(ROUND_UP(fetch_end, CURL_CACHE_BLOCK_SIZE), s->len);
+    }
+    acb->start = start - fetch_start;
+    acb->end = acb->start + len;
 
-    state->buf_off = 0;
-    g_free(state->orig_buf);
-    state->buf_start = start;
-    state->buf_len = acb->end + s->readahead_size;
-    end = MIN(start + state->buf_len, s->len) - 1;
-    state->orig_buf = g_try_malloc(state->buf_len);
-    if (state->buf_len && state->orig_buf == NULL) {
-        curl_clean_state(state);
-        acb->common.cb(acb->common.opaque, -ENOMEM);
+    ret = curl_start_transfer(s, state, fetch_start, fetch_end - fetch_start,
+                              acb);
+    if (ret < 0) {
+        acb->common.cb(acb->common.opaque, ret);
         qemu_aio_unref(acb);
         return;
     }
-    state->acb[0] = acb;
-
-    snprintf(state->range, 127, "%zd-%zd", start, end);
-    DPRINTF("CURL (AIO): Reading %d at %zd (%s)\n",
-            (acb->nb_sectors * SECTOR_SIZE), start, state->range);
-    curl_easy_setopt(state->curl, CURLOPT_RANGE, state->range);
-
-    curl_multi_add_handle(s->multi, state->curl);
-
-    /* Tell curl it needs to kick things off */
-    curl_multi_socket_action(s->multi, CURL_SOCKET_TIMEOUT, 0, &running);
+    curl_readahead(s);
 }
 
 static BlockAIOCB *curl_aio_readv(BlockDriverState *bs,
@@ -800,6 +1043,10 @@ static void curl_close(BlockDriverState *bs)
     DPRINTF("CURL: Close\n");
     curl_detach_aio_context(bs);
 
+    if (s->cache) {
+        g_hash_table_destroy(s->cache);
+    }
+
     g_free(s->cookie);
     g_free(s->url);
 }
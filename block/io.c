@@ -143,7 +143,7 @@ bool bdrv_requests_pending(BlockDriverState *bs)
 {
     BdrvChild *child;
 
-    if (!QLIST_EMPTY(&bs->tracked_requests)) {
+    if (atomic_read(&bs->in_flight)) {
         return true;
     }
 
@@ -360,24 +360,29 @@ void bdrv_drain_all(void)
  *
  * This function should be called when a tracked request is completing.
  */
-static void tracked_request_end(BdrvTrackedRequest *req)
+static void coroutine_fn tracked_request_end(BdrvTrackedRequest *req)
 {
+    BlockDriverState *bs = req->bs;
+
+    qemu_co_mutex_lock(&bs->reqs_lock);
     if (req->serialising) {
-        req->bs->serialising_in_flight--;
+        atomic_dec(&bs->serialising_in_flight);
     }
-
     QLIST_REMOVE(req, list);
+    interval_tree_remove(&bs->tracked_overlaps, &req->overlap_node);
     qemu_co_queue_restart_all(&req->wait_queue);
+    atomic_dec(&bs->in_flight);
+    qemu_co_mutex_unlock(&bs->reqs_lock);
 }
 
 /**
  * Add an active request to the tracked requests list
  */
-static void tracked_request_begin(BdrvTrackedRequest *req,
-                                  BlockDriverState *bs,
-                                  int64_t offset,
-                                  unsigned int bytes,
-                                  enum BdrvTrackedRequestType type)
+static void coroutine_fn tracked_request_begin(BdrvTrackedRequest *req,
+                                               BlockDriverState *bs,
+                                               int64_t offset,
+                                               unsigned int bytes,
+                                               enum BdrvTrackedRequestType type)
 {
     *req = (BdrvTrackedRequest){
         .bs = bs,
@@ -388,26 +393,44 @@ static void tracked_request_begin(BdrvTrackedRequest *req,
         .serialising    = false,
         .overlap_offset = offset,
         .overlap_bytes  = bytes,
+        .overlap_node   = {
+            .start      = offset,
+            .end        = offset + bytes,
+        },
     };
 
     qemu_co_queue_init(&req->wait_queue);
 
+    qemu_co_mutex_lock(&bs->reqs_lock);
     QLIST_INSERT_HEAD(&bs->tracked_requests, req, list);
+    interval_tree_insert(&bs->tracked_overlaps, &req->overlap_node);
+    atomic_inc(&bs->in_flight);
+    qemu_co_mutex_unlock(&bs->reqs_lock);
 }
 
-static void mark_request_serialising(BdrvTrackedRequest *req, uint64_t align)
+static void coroutine_fn mark_request_serialising(BdrvTrackedRequest *req,
+                                                  uint64_t align)
 {
+    BlockDriverState *bs = req->bs;
     int64_t overlap_offset = req->offset & ~(align - 1);
     unsigned int overlap_bytes = ROUND_UP(req->offset + req->bytes, align)
                                - overlap_offset;
 
+    qemu_co_mutex_lock(&bs->reqs_lock);
     if (!req->serialising) {
-        req->bs->serialising_in_flight++;
+        atomic_inc(&bs->serialising_in_flight);
         req->serialising = true;
     }
 
     req->overlap_offset = MIN(req->overlap_offset, overlap_offset);
     req->overlap_bytes = MAX(req->overlap_bytes, overlap_bytes);
+
+    /* The tree is keyed by the overlap range, move the request */
+    interval_tree_remove(&bs->tracked_overlaps, &req->overlap_node);
+    req->overlap_node.start = req->overlap_offset;
+    req->overlap_node.end = req->overlap_offset + req->overlap_bytes;
+    interval_tree_insert(&bs->tracked_overlaps, &req->overlap_node);
+    qemu_co_mutex_unlock(&bs->reqs_lock);
 }
 
 /**
@@ -464,60 +487,58 @@ static int bdrv_get_cluster_size(BlockDriverState *bs)
     }
 }
 
-static bool tracked_request_overlaps(BdrvTrackedRequest *req,
-                                     int64_t offset, unsigned int bytes)
-{
-    /*        aaaa   bbbb */
-    if (offset >= req->overlap_offset + req->overlap_bytes) {
-        return false;
-    }
-    /* bbbb   aaaa        */
-    if (req->overlap_offset >= offset + bytes) {
-        return false;
-    }
-    return true;
-}
-
 static bool coroutine_fn wait_serialising_requests(BdrvTrackedRequest *self)
 {
     BlockDriverState *bs = self->bs;
     BdrvTrackedRequest *req;
+    IntervalTreeNode *node;
+    uint64_t start, end;
     bool retry;
     bool waited = false;
 
-    if (!bs->serialising_in_flight) {
+    if (!atomic_read(&bs->serialising_in_flight)) {
         return false;
     }
 
+    qemu_co_mutex_lock(&bs->reqs_lock);
     do {
         retry = false;
-        QLIST_FOREACH(req, &bs->tracked_requests, list) {
+        /* Only the requests overlapping ours are visited */
+        start = self->overlap_offset;
+        end = start + self->overlap_bytes;
+        for (node = interval_tree_iter_first(&bs->tracked_overlaps, start, end);
+             node;
+             node = interval_tree_iter_next(&bs->tracked_overlaps, node,
+                                            start, end)) {
+            req = container_of(node, BdrvTrackedRequest, overlap_node);
             if (req == self || (!req->serialising && !self->serialising)) {
                 continue;
             }
-            if (tracked_request_overlaps(req, self->overlap_offset,
-                                         self->overlap_bytes))
-            {
-                /* Hitting this means there was a reentrant request, for
-                 * example, a block driver issuing nested requests.  This must
-                 * never happen since it means deadlock.
-                 */
-                assert(qemu_coroutine_self() != req->co);
-
-                /* If the request is already (indirectly) waiting for us, or
-                 * will wait for us as soon as it wakes up, then just go on
-                 * (instead of producing a deadlock in the former case). */
-                if (!req->waiting_for) {
-                    self->waiting_for = req;
-                    qemu_co_queue_wait(&req->wait_queue);
-                    self->waiting_for = NULL;
-                    retry = true;
-                    waited = true;
-                    break;
-                }
+            /* Hitting this means there was a reentrant request, for
+             * example, a block driver issuing nested requests.  This must
+             * never happen since it means deadlock.
+             */
+            assert(qemu_coroutine_self() != req->co);
+
+            /* If the request is already (indirectly) waiting for us, or
+             * will wait for us as soon as it wakes up, then just go on
+             * (instead of producing a deadlock in the former case). */
+            if (!req->waiting_for) {
+                self->waiting_for = req;
+                /* Nothing runs between dropping the lock and queueing
+                 * ourselves as long as the node's requests all run in
+                 * one thread, so req cannot complete in between */
+                qemu_co_mutex_unlock(&bs->reqs_lock);
+                qemu_co_queue_wait(&req->wait_queue);
+                qemu_co_mutex_lock(&bs->reqs_lock);
+                self->waiting_for = NULL;
+                retry = true;
+                waited = true;
+                break;
             }
         }
     } while (retry);
+    qemu_co_mutex_unlock(&bs->reqs_lock);
 
     return waited;
 }
@@ -1346,7 +1367,7 @@ static int coroutine_fn bdrv_aligned_pwritev(BlockDriverState *bs,
     }
     bdrv_debug_event(bs, BLKDBG_PWRITEV_DONE);
 
-    ++bs->write_gen;
+    atomic_inc(&bs->write_gen);
     bdrv_set_dirty(bs, start_sector, end_sector - start_sector);
 
     if (bs->wr_highest_offset < offset + bytes) {
@@ -2280,7 +2301,7 @@ int coroutine_fn bdrv_co_flush(BlockDriverState *bs)
 
     tracked_request_begin(&req, bs, 0, 0, BDRV_TRACKED_FLUSH);
 
-    int current_gen = bs->write_gen;
+    int current_gen = atomic_read(&bs->write_gen);
 
     /* Wait until any previous flushes are completed */
     while (bs->active_flush_req != NULL) {
@@ -2486,7 +2507,7 @@ int coroutine_fn bdrv_co_pdiscard(BlockDriverState *bs, int64_t offset,
     }
     ret = 0;
 out:
-    ++bs->write_gen;
+    atomic_inc(&bs->write_gen);
     bdrv_set_dirty(bs, req.offset >> BDRV_SECTOR_BITS,
                    req.bytes >> BDRV_SECTOR_BITS);
     tracked_request_end(&req);
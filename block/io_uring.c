@@ -0,0 +1,334 @@
+/*
+ * Linux io_uring support.
+ *
+ * Requests are queued as submission queue entries and handed to the kernel
+ * in batches, one io_uring_enter() per batch; completions are reaped from
+ * the completion queue when the ring file descriptor becomes readable.
+ * Unlike Linux AIO this is asynchronous for buffered I/O as well.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "block/aio.h"
+#include "qemu/queue.h"
+#include "block/block.h"
+#include "block/raw-aio.h"
+#include "qemu/coroutine.h"
+
+#include <liburing.h>
+
+/* Submission queue size, and limit on requests in flight (per-AioContext) */
+#define MAX_ENTRIES 128
+
+typedef struct LuringAIOCB {
+    Coroutine *co;
+    struct io_uring_sqe sqeq;
+    ssize_t ret;
+    QEMUIOVector *qiov;
+    bool is_read;
+    QSIMPLEQ_ENTRY(LuringAIOCB) next;
+
+    /* Bytes of a read completed so far, and the part still to be read */
+    size_t total_read;
+    QEMUIOVector resubmit_qiov;
+} LuringAIOCB;
+
+typedef struct {
+    int plugged;
+    /* Requests not yet accepted by io_uring_submit() */
+    unsigned int in_queue;
+    unsigned int in_flight;
+    bool blocked;
+    QSIMPLEQ_HEAD(, LuringAIOCB) pending;
+} LuringQueue;
+
+struct LuringState {
+    AioContext *aio_context;
+
+    struct io_uring ring;
+
+    /* io queue for submit at batch */
+    LuringQueue io_q;
+
+    /* I/O completion processing */
+    QEMUBH *completion_bh;
+};
+
+static void ioq_submit(LuringState *s);
+
+static void luring_resubmit(LuringState *s, LuringAIOCB *luringcb)
+{
+    QSIMPLEQ_INSERT_TAIL(&s->io_q.pending, luringcb, next);
+    s->io_q.in_queue++;
+}
+
+/*
+ * Buffered reads may complete short before the end of the file; queue the
+ * rest of the read again.
+ */
+static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
+                                       int nread)
+{
+    QEMUIOVector *resubmit_qiov = &luringcb->resubmit_qiov;
+    size_t remaining;
+
+    luringcb->total_read += nread;
+    remaining = luringcb->qiov->size - luringcb->total_read;
+
+    if (!resubmit_qiov->iov) {
+        qemu_iovec_init(resubmit_qiov, luringcb->qiov->niov);
+    } else {
+        qemu_iovec_reset(resubmit_qiov);
+    }
+    qemu_iovec_concat(resubmit_qiov, luringcb->qiov, luringcb->total_read,
+                      remaining);
+
+    luringcb->sqeq.off += nread;
+    luringcb->sqeq.addr = (uintptr_t)resubmit_qiov->iov;
+    luringcb->sqeq.len = resubmit_qiov->niov;
+
+    luring_resubmit(s, luringcb);
+}
+
+/*
+ * Completes an I/O request, or queues again what is left of it.
+ */
+static void luring_process_completion(LuringState *s, LuringAIOCB *luringcb)
+{
+    ssize_t ret = luringcb->ret;
+
+    if (ret == -EINTR || ret == -EAGAIN) {
+        luring_resubmit(s, luringcb);
+        return;
+    }
+
+    if (ret >= 0) {
+        if (luringcb->total_read + ret == luringcb->qiov->size) {
+            ret = 0;
+        } else if (luringcb->is_read) {
+            if (ret > 0) {
+                luring_resubmit_short_read(s, luringcb, ret);
+                return;
+            }
+            /* Reading nothing means EOF, pad with zeros. */
+            qemu_iovec_memset(luringcb->qiov, luringcb->total_read, 0,
+                              luringcb->qiov->size - luringcb->total_read);
+            ret = 0;
+        } else {
+            ret = -ENOSPC;
+        }
+    }
+
+    if (luringcb->resubmit_qiov.iov) {
+        qemu_iovec_destroy(&luringcb->resubmit_qiov);
+    }
+
+    luringcb->ret = ret;
+    qemu_coroutine_enter(luringcb->co);
+}
+
+/* Reap the completion queue.
+ *
+ * As in linux-aio.c, the BH is rescheduled while completions are processed
+ * so that a nested event loop, entered from a request's coroutine, sees the
+ * completions that are still pending.
+ */
+static void luring_process_completions(LuringState *s)
+{
+    struct io_uring_cqe *cqe;
+
+    qemu_bh_schedule(s->completion_bh);
+
+    while (io_uring_peek_cqe(&s->ring, &cqe) == 0 && cqe) {
+        LuringAIOCB *luringcb = io_uring_cqe_get_data(cqe);
+
+        luringcb->ret = cqe->res;
+        io_uring_cqe_seen(&s->ring, cqe);
+        s->io_q.in_flight--;
+
+        luring_process_completion(s, luringcb);
+    }
+
+    if (!s->io_q.plugged && s->io_q.in_queue) {
+        ioq_submit(s);
+    }
+
+    qemu_bh_cancel(s->completion_bh);
+}
+
+static void qemu_luring_completion_bh(void *opaque)
+{
+    luring_process_completions(opaque);
+}
+
+static void qemu_luring_completion_cb(void *opaque)
+{
+    luring_process_completions(opaque);
+}
+
+static bool qemu_luring_poll_cb(void *opaque)
+{
+    LuringState *s = opaque;
+
+    if (!io_uring_cq_ready(&s->ring)) {
+        return false;
+    }
+
+    luring_process_completions(s);
+    return true;
+}
+
+static void ioq_init(LuringQueue *io_q)
+{
+    QSIMPLEQ_INIT(&io_q->pending);
+    io_q->plugged = 0;
+    io_q->in_queue = 0;
+    io_q->in_flight = 0;
+    io_q->blocked = false;
+}
+
+/* Move pending requests to the submission queue and submit it, keeping at
+ * most MAX_ENTRIES requests in flight so that the completion queue cannot
+ * overflow.
+ */
+static void ioq_submit(LuringState *s)
+{
+    LuringAIOCB *luringcb;
+    int ret;
+
+    while (s->io_q.in_queue && s->io_q.in_flight < MAX_ENTRIES) {
+        unsigned int queued = s->io_q.in_queue -
+                              io_uring_sq_ready(&s->ring);
+
+        while (queued &&
+               s->io_q.in_flight + s->io_q.in_queue - queued < MAX_ENTRIES) {
+            struct io_uring_sqe *sqe = io_uring_get_sqe(&s->ring);
+
+            if (!sqe) {
+                break;
+            }
+            luringcb = QSIMPLEQ_FIRST(&s->io_q.pending);
+            QSIMPLEQ_REMOVE_HEAD(&s->io_q.pending, next);
+            *sqe = luringcb->sqeq;
+            queued--;
+        }
+
+        ret = io_uring_submit(&s->ring);
+        if (ret == -EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            /* Retry once completions have freed resources */
+            break;
+        }
+        s->io_q.in_flight += ret;
+        s->io_q.in_queue -= ret;
+    }
+    s->io_q.blocked = (s->io_q.in_queue > 0);
+}
+
+void luring_io_plug(BlockDriverState *bs, LuringState *s)
+{
+    s->io_q.plugged++;
+}
+
+void luring_io_unplug(BlockDriverState *bs, LuringState *s)
+{
+    assert(s->io_q.plugged);
+    if (--s->io_q.plugged == 0 &&
+        !s->io_q.blocked && s->io_q.in_queue) {
+        ioq_submit(s);
+    }
+}
+
+static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
+                            uint64_t offset, int type)
+{
+    struct io_uring_sqe *sqes = &luringcb->sqeq;
+    QEMUIOVector *qiov = luringcb->qiov;
+
+    switch (type) {
+    case QEMU_AIO_WRITE:
+        io_uring_prep_writev(sqes, fd, qiov->iov, qiov->niov, offset);
+        break;
+    case QEMU_AIO_READ:
+        io_uring_prep_readv(sqes, fd, qiov->iov, qiov->niov, offset);
+        break;
+    default:
+        fprintf(stderr, "%s: invalid AIO request type 0x%x.\n",
+                        __func__, type);
+        return -EIO;
+    }
+    io_uring_sqe_set_data(sqes, luringcb);
+
+    luring_resubmit(s, luringcb);
+    if (!s->io_q.blocked &&
+        (!s->io_q.plugged ||
+         s->io_q.in_flight + s->io_q.in_queue >= MAX_ENTRIES)) {
+        ioq_submit(s);
+    }
+
+    return 0;
+}
+
+int coroutine_fn luring_co_submit(BlockDriverState *bs, LuringState *s,
+                                  int fd, uint64_t offset, QEMUIOVector *qiov,
+                                  int type)
+{
+    int ret;
+    LuringAIOCB luringcb = {
+        .co         = qemu_coroutine_self(),
+        .ret        = -EINPROGRESS,
+        .qiov       = qiov,
+        .is_read    = (type == QEMU_AIO_READ),
+    };
+
+    ret = luring_do_submit(fd, &luringcb, s, offset, type);
+    if (ret < 0) {
+        return ret;
+    }
+
+    qemu_coroutine_yield();
+    return luringcb.ret;
+}
+
+void luring_detach_aio_context(LuringState *s, AioContext *old_context)
+{
+    aio_set_fd_handler(old_context, s->ring.ring_fd, false,
+                       NULL, NULL, NULL);
+    qemu_bh_delete(s->completion_bh);
+    s->aio_context = NULL;
+}
+
+void luring_attach_aio_context(LuringState *s, AioContext *new_context)
+{
+    s->aio_context = new_context;
+    s->completion_bh = aio_bh_new(new_context, qemu_luring_completion_bh, s);
+    aio_set_fd_handler(new_context, s->ring.ring_fd, false,
+                       qemu_luring_completion_cb, NULL, s);
+    aio_set_fd_poll(new_context, s->ring.ring_fd, qemu_luring_poll_cb);
+}
+
+/* Returns NULL if the host kernel does not support io_uring */
+LuringState *luring_init(void)
+{
+    LuringState *s;
+
+    s = g_new0(LuringState, 1);
+    if (io_uring_queue_init(MAX_ENTRIES, &s->ring, 0) < 0) {
+        g_free(s);
+        return NULL;
+    }
+
+    ioq_init(&s->io_q);
+
+    return s;
+}
+
+void luring_cleanup(LuringState *s)
+{
+    io_uring_queue_exit(&s->ring);
+    g_free(s);
+}
@@ -48,14 +48,29 @@
 #include <scsi/sg.h>
 #endif
 
+/* One session, and TCP connection, to the target of the LUN. Libiscsi
+ * gives every context its own random ISID, so the target does not mistake
+ * a new session for the reinstatement of an existing one. */
+typedef struct IscsiSession {
+    struct IscsiLun *iscsilun;
+    struct iscsi_context *iscsi;
+    int events;
+    bool request_timed_out;
+} IscsiSession;
+
+#define ISCSI_MAX_SESSIONS 16
+
 typedef struct IscsiLun {
+    /* the first session, it also carries the control and SG_IO commands */
     struct iscsi_context *iscsi;
+    IscsiSession *sessions;
+    int num_sessions;
+    int next_session;
     AioContext *aio_context;
     int lun;
     enum scsi_inquiry_peripheral_device_type type;
     int block_size;
     uint64_t num_blocks;
-    int events;
     QEMUTimer *nop_timer;
     QEMUTimer *event_timer;
     struct scsi_inquiry_logical_block_provisioning lbp;
@@ -85,7 +100,6 @@ typedef struct IscsiLun {
     bool lbprz;
     bool dpofua;
     bool has_write_same;
-    bool request_timed_out;
 } IscsiLun;
 
 typedef struct IscsiTask {
@@ -97,6 +111,7 @@ typedef struct IscsiTask {
     Coroutine *co;
     QEMUBH *bh;
     IscsiLun *iscsilun;
+    IscsiSession *session;
     QEMUTimer retry_timer;
     int err_code;
 } IscsiTask;
@@ -278,7 +293,7 @@ iscsi_co_generic_cb(struct iscsi_context *iscsi, int status,
                     /* make sure the request is rescheduled AFTER the
                      * reconnect is initiated */
                     retry_time = EVENT_INTERVAL * 2;
-                    iTask->iscsilun->request_timed_out = true;
+                    iTask->session->request_timed_out = true;
                 }
                 error_report("iSCSI Busy/TaskSetFull/TimeOut"
                              " (retry #%u in %u ms): %s",
@@ -307,11 +322,23 @@ out:
     }
 }
 
+/* Commands are spread over the sessions in turn, each session processes
+ * the completions of its own commands in its fd handler. */
+static IscsiSession *iscsi_next_session(IscsiLun *iscsilun)
+{
+    IscsiSession *s = &iscsilun->sessions[iscsilun->next_session];
+
+    iscsilun->next_session = (iscsilun->next_session + 1) %
+                             iscsilun->num_sessions;
+    return s;
+}
+
 static void iscsi_co_init_iscsitask(IscsiLun *iscsilun, struct IscsiTask *iTask)
 {
     *iTask = (struct IscsiTask) {
         .co         = qemu_coroutine_self(),
         .iscsilun   = iscsilun,
+        .session    = iscsi_next_session(iscsilun),
     };
 }
 
@@ -351,36 +378,41 @@ static void iscsi_process_read(void *arg);
 static void iscsi_process_write(void *arg);
 
 static void
-iscsi_set_events(IscsiLun *iscsilun)
+iscsi_set_events(IscsiSession *s)
 {
-    struct iscsi_context *iscsi = iscsilun->iscsi;
+    struct iscsi_context *iscsi = s->iscsi;
     int ev = iscsi_which_events(iscsi);
 
-    if (ev != iscsilun->events) {
-        aio_set_fd_handler(iscsilun->aio_context, iscsi_get_fd(iscsi),
+    if (ev != s->events) {
+        aio_set_fd_handler(s->iscsilun->aio_context, iscsi_get_fd(iscsi),
                            false,
                            (ev & POLLIN) ? iscsi_process_read : NULL,
                            (ev & POLLOUT) ? iscsi_process_write : NULL,
-                           iscsilun);
-        iscsilun->events = ev;
+                           s);
+        s->events = ev;
     }
 }
 
 static void iscsi_timed_check_events(void *opaque)
 {
     IscsiLun *iscsilun = opaque;
+    int i;
 
-    /* check for timed out requests */
-    iscsi_service(iscsilun->iscsi, 0);
+    for (i = 0; i < iscsilun->num_sessions; i++) {
+        IscsiSession *s = &iscsilun->sessions[i];
 
-    if (iscsilun->request_timed_out) {
-        iscsilun->request_timed_out = false;
-        iscsi_reconnect(iscsilun->iscsi);
-    }
+        /* check for timed out requests */
+        iscsi_service(s->iscsi, 0);
+
+        if (s->request_timed_out) {
+            s->request_timed_out = false;
+            iscsi_reconnect(s->iscsi);
+        }
 
-    /* newer versions of libiscsi may return zero events. Ensure we are able
-     * to return to service once this situation changes. */
-    iscsi_set_events(iscsilun);
+        /* newer versions of libiscsi may return zero events. Ensure we are
+         * able to return to service once this situation changes. */
+        iscsi_set_events(s);
+    }
 
     timer_mod(iscsilun->event_timer,
               qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + EVENT_INTERVAL);
@@ -389,21 +421,19 @@ static void iscsi_timed_check_events(void *opaque)
 static void
 iscsi_process_read(void *arg)
 {
-    IscsiLun *iscsilun = arg;
-    struct iscsi_context *iscsi = iscsilun->iscsi;
+    IscsiSession *s = arg;
 
-    iscsi_service(iscsi, POLLIN);
-    iscsi_set_events(iscsilun);
+    iscsi_service(s->iscsi, POLLIN);
+    iscsi_set_events(s);
 }
 
 static void
 iscsi_process_write(void *arg)
 {
-    IscsiLun *iscsilun = arg;
-    struct iscsi_context *iscsi = iscsilun->iscsi;
+    IscsiSession *s = arg;
 
-    iscsi_service(iscsi, POLLOUT);
-    iscsi_set_events(iscsilun);
+    iscsi_service(s->iscsi, POLLOUT);
+    iscsi_set_events(s);
 }
 
 static int64_t sector_lun2qemu(int64_t sector, IscsiLun *iscsilun)
@@ -595,13 +625,15 @@ iscsi_co_writev_flags(BlockDriverState *bs, int64_t sector_num, int nb_sectors,
     iscsi_co_init_iscsitask(iscsilun, &iTask);
 retry:
     if (iscsilun->use_16_for_rw) {
-        iTask.task = iscsi_write16_task(iscsilun->iscsi, iscsilun->lun, lba,
-                                        NULL, num_sectors * iscsilun->block_size,
+        iTask.task = iscsi_write16_task(iTask.session->iscsi, iscsilun->lun,
+                                        lba, NULL,
+                                        num_sectors * iscsilun->block_size,
                                         iscsilun->block_size, 0, 0, fua, 0, 0,
                                         iscsi_co_generic_cb, &iTask);
     } else {
-        iTask.task = iscsi_write10_task(iscsilun->iscsi, iscsilun->lun, lba,
-                                        NULL, num_sectors * iscsilun->block_size,
+        iTask.task = iscsi_write10_task(iTask.session->iscsi, iscsilun->lun,
+                                        lba, NULL,
+                                        num_sectors * iscsilun->block_size,
                                         iscsilun->block_size, 0, 0, fua, 0, 0,
                                         iscsi_co_generic_cb, &iTask);
     }
@@ -611,7 +643,7 @@ retry:
     scsi_task_set_iov_out(iTask.task, (struct scsi_iovec *) iov->iov,
                           iov->niov);
     while (!iTask.complete) {
-        iscsi_set_events(iscsilun);
+        iscsi_set_events(iTask.session);
         qemu_coroutine_yield();
     }
 
@@ -666,7 +698,7 @@ static int64_t coroutine_fn iscsi_co_get_block_status(BlockDriverState *bs,
     }
 
 retry:
-    if (iscsi_get_lba_status_task(iscsilun->iscsi, iscsilun->lun,
+    if (iscsi_get_lba_status_task(iTask.session->iscsi, iscsilun->lun,
                                   sector_qemu2lun(sector_num, iscsilun),
                                   8 + 16, iscsi_co_generic_cb,
                                   &iTask) == NULL) {
@@ -675,7 +707,7 @@ retry:
     }
 
     while (!iTask.complete) {
-        iscsi_set_events(iscsilun);
+        iscsi_set_events(iTask.session);
         qemu_coroutine_yield();
     }
 
@@ -792,12 +824,12 @@ static int coroutine_fn iscsi_co_readv(BlockDriverState *bs,
     iscsi_co_init_iscsitask(iscsilun, &iTask);
 retry:
     if (iscsilun->use_16_for_rw) {
-        iTask.task = iscsi_read16_task(iscsilun->iscsi, iscsilun->lun, lba,
+        iTask.task = iscsi_read16_task(iTask.session->iscsi, iscsilun->lun, lba,
                                        num_sectors * iscsilun->block_size,
                                        iscsilun->block_size, 0, 0, 0, 0, 0,
                                        iscsi_co_generic_cb, &iTask);
     } else {
-        iTask.task = iscsi_read10_task(iscsilun->iscsi, iscsilun->lun, lba,
+        iTask.task = iscsi_read10_task(iTask.session->iscsi, iscsilun->lun, lba,
                                        num_sectors * iscsilun->block_size,
                                        iscsilun->block_size,
                                        0, 0, 0, 0, 0,
@@ -809,7 +841,7 @@ retry:
     scsi_task_set_iov_in(iTask.task, (struct scsi_iovec *) iov->iov, iov->niov);
 
     while (!iTask.complete) {
-        iscsi_set_events(iscsilun);
+        iscsi_set_events(iTask.session);
         qemu_coroutine_yield();
     }
 
@@ -837,13 +869,14 @@ static int coroutine_fn iscsi_co_flush(BlockDriverState *bs)
 
     iscsi_co_init_iscsitask(iscsilun, &iTask);
 retry:
-    if (iscsi_synchronizecache10_task(iscsilun->iscsi, iscsilun->lun, 0, 0, 0,
-                                      0, iscsi_co_generic_cb, &iTask) == NULL) {
+    if (iscsi_synchronizecache10_task(iTask.session->iscsi, iscsilun->lun,
+                                      0, 0, 0, 0, iscsi_co_generic_cb,
+                                      &iTask) == NULL) {
         return -ENOMEM;
     }
 
     while (!iTask.complete) {
-        iscsi_set_events(iscsilun);
+        iscsi_set_events(iTask.session);
         qemu_coroutine_yield();
     }
 
@@ -1022,7 +1055,7 @@ static BlockAIOCB *iscsi_aio_ioctl(BlockDriverState *bs,
         }
     }
 
-    iscsi_set_events(iscsilun);
+    iscsi_set_events(&iscsilun->sessions[0]);
 
     return &acb->common;
 }
@@ -1060,13 +1093,13 @@ coroutine_fn iscsi_co_pdiscard(BlockDriverState *bs, int64_t offset, int count)
 
     iscsi_co_init_iscsitask(iscsilun, &iTask);
 retry:
-    if (iscsi_unmap_task(iscsilun->iscsi, iscsilun->lun, 0, 0, &list, 1,
+    if (iscsi_unmap_task(iTask.session->iscsi, iscsilun->lun, 0, 0, &list, 1,
                          iscsi_co_generic_cb, &iTask) == NULL) {
         return -ENOMEM;
     }
 
     while (!iTask.complete) {
-        iscsi_set_events(iscsilun);
+        iscsi_set_events(iTask.session);
         qemu_coroutine_yield();
     }
 
@@ -1142,12 +1175,14 @@ coroutine_fn iscsi_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset,
     iscsi_co_init_iscsitask(iscsilun, &iTask);
 retry:
     if (use_16_for_ws) {
-        iTask.task = iscsi_writesame16_task(iscsilun->iscsi, iscsilun->lun, lba,
+        iTask.task = iscsi_writesame16_task(iTask.session->iscsi,
+                                            iscsilun->lun, lba,
                                             iscsilun->zeroblock, iscsilun->block_size,
                                             nb_blocks, 0, !!(flags & BDRV_REQ_MAY_UNMAP),
                                             0, 0, iscsi_co_generic_cb, &iTask);
     } else {
-        iTask.task = iscsi_writesame10_task(iscsilun->iscsi, iscsilun->lun, lba,
+        iTask.task = iscsi_writesame10_task(iTask.session->iscsi,
+                                            iscsilun->lun, lba,
                                             iscsilun->zeroblock, iscsilun->block_size,
                                             nb_blocks, 0, !!(flags & BDRV_REQ_MAY_UNMAP),
                                             0, 0, iscsi_co_generic_cb, &iTask);
@@ -1157,7 +1192,7 @@ retry:
     }
 
     while (!iTask.complete) {
-        iscsi_set_events(iscsilun);
+        iscsi_set_events(iTask.session);
         qemu_coroutine_yield();
     }
 
@@ -1346,20 +1381,45 @@ static int parse_timeout(const char *target)
     return 0;
 }
 
+static int parse_sessions(const char *target)
+{
+    QemuOptsList *list;
+    QemuOpts *opts;
+
+    list = qemu_find_opts("iscsi");
+    if (list) {
+        opts = qemu_opts_find(list, target);
+        if (!opts) {
+            opts = QTAILQ_FIRST(&list->head);
+        }
+        if (opts) {
+            return qemu_opt_get_number(opts, "sessions", 1);
+        }
+    }
+
+    return 1;
+}
+
 static void iscsi_nop_timed_event(void *opaque)
 {
     IscsiLun *iscsilun = opaque;
+    int i;
 
-    if (iscsi_get_nops_in_flight(iscsilun->iscsi) >= MAX_NOP_FAILURES) {
-        error_report("iSCSI: NOP timeout. Reconnecting...");
-        iscsilun->request_timed_out = true;
-    } else if (iscsi_nop_out_async(iscsilun->iscsi, NULL, NULL, 0, NULL) != 0) {
-        error_report("iSCSI: failed to sent NOP-Out. Disabling NOP messages.");
-        return;
+    for (i = 0; i < iscsilun->num_sessions; i++) {
+        IscsiSession *s = &iscsilun->sessions[i];
+
+        if (iscsi_get_nops_in_flight(s->iscsi) >= MAX_NOP_FAILURES) {
+            error_report("iSCSI: NOP timeout. Reconnecting...");
+            s->request_timed_out = true;
+        } else if (iscsi_nop_out_async(s->iscsi, NULL, NULL, 0, NULL) != 0) {
+            error_report("iSCSI: failed to sent NOP-Out. "
+                         "Disabling NOP messages.");
+            return;
+        }
+        iscsi_set_events(s);
     }
 
     timer_mod(iscsilun->nop_timer, qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + NOP_INTERVAL);
-    iscsi_set_events(iscsilun);
 }
 
 static void iscsi_readcapacity_sync(IscsiLun *iscsilun, Error **errp)
@@ -1487,10 +1547,15 @@ fail_with_err:
 static void iscsi_detach_aio_context(BlockDriverState *bs)
 {
     IscsiLun *iscsilun = bs->opaque;
+    int i;
 
-    aio_set_fd_handler(iscsilun->aio_context, iscsi_get_fd(iscsilun->iscsi),
-                       false, NULL, NULL, NULL);
-    iscsilun->events = 0;
+    for (i = 0; i < iscsilun->num_sessions; i++) {
+        IscsiSession *s = &iscsilun->sessions[i];
+
+        aio_set_fd_handler(iscsilun->aio_context, iscsi_get_fd(s->iscsi),
+                           false, NULL, NULL, NULL);
+        s->events = 0;
+    }
 
     if (iscsilun->nop_timer) {
         timer_del(iscsilun->nop_timer);
@@ -1508,9 +1573,12 @@ static void iscsi_attach_aio_context(BlockDriverState *bs,
                                      AioContext *new_context)
 {
     IscsiLun *iscsilun = bs->opaque;
+    int i;
 
     iscsilun->aio_context = new_context;
-    iscsi_set_events(iscsilun);
+    for (i = 0; i < iscsilun->num_sessions; i++) {
+        iscsi_set_events(&iscsilun->sessions[i]);
+    }
 
     /* Set up a timer for sending out iSCSI NOPs */
     iscsilun->nop_timer = aio_timer_new(iscsilun->aio_context,
@@ -1563,57 +1631,24 @@ out:
     }
 }
 
-/*
- * We support iscsi url's on the form
- * iscsi://[<username>%<password>@]<host>[:<port>]/<targetname>/<lun>
- */
-static int iscsi_open(BlockDriverState *bs, QDict *options, int flags,
-                      Error **errp)
+static int iscsi_session_connect(IscsiSession *s, struct iscsi_url *iscsi_url,
+                                 const char *initiator_name, int timeout,
+                                 Error **errp)
 {
-    IscsiLun *iscsilun = bs->opaque;
-    struct iscsi_context *iscsi = NULL;
-    struct iscsi_url *iscsi_url = NULL;
-    struct scsi_task *task = NULL;
-    struct scsi_inquiry_standard *inq = NULL;
-    struct scsi_inquiry_supported_pages *inq_vpd;
-    char *initiator_name = NULL;
-    QemuOpts *opts;
+    struct iscsi_context *iscsi;
     Error *local_err = NULL;
-    const char *filename;
-    int i, ret = 0, timeout = 0;
-
-    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
-    qemu_opts_absorb_qdict(opts, options, &local_err);
-    if (local_err) {
-        error_propagate(errp, local_err);
-        ret = -EINVAL;
-        goto out;
-    }
-
-    filename = qemu_opt_get(opts, "filename");
-
-    iscsi_url = iscsi_parse_full_url(iscsi, filename);
-    if (iscsi_url == NULL) {
-        error_setg(errp, "Failed to parse URL : %s", filename);
-        ret = -EINVAL;
-        goto out;
-    }
-
-    memset(iscsilun, 0, sizeof(IscsiLun));
-
-    initiator_name = parse_initiator_name(iscsi_url->target);
+    int ret;
 
     iscsi = iscsi_create_context(initiator_name);
     if (iscsi == NULL) {
         error_setg(errp, "iSCSI: Failed to create iSCSI context.");
-        ret = -ENOMEM;
-        goto out;
+        return -ENOMEM;
     }
 
     if (iscsi_set_targetname(iscsi, iscsi_url->target)) {
         error_setg(errp, "iSCSI: Failed to set target name.");
         ret = -EINVAL;
-        goto out;
+        goto fail;
     }
 
     if (iscsi_url->user[0] != '\0') {
@@ -1622,7 +1657,7 @@ static int iscsi_open(BlockDriverState *bs, QDict *options, int flags,
         if (ret != 0) {
             error_setg(errp, "Failed to set initiator username and password");
             ret = -EINVAL;
-            goto out;
+            goto fail;
         }
     }
 
@@ -1631,13 +1666,13 @@ static int iscsi_open(BlockDriverState *bs, QDict *options, int flags,
     if (local_err != NULL) {
         error_propagate(errp, local_err);
         ret = -EINVAL;
-        goto out;
+        goto fail;
     }
 
     if (iscsi_set_session_type(iscsi, ISCSI_SESSION_NORMAL) != 0) {
         error_setg(errp, "iSCSI: Failed to set session type to normal.");
         ret = -EINVAL;
-        goto out;
+        goto fail;
     }
 
     iscsi_set_header_digest(iscsi, ISCSI_HEADER_DIGEST_NONE_CRC32C);
@@ -1647,27 +1682,115 @@ static int iscsi_open(BlockDriverState *bs, QDict *options, int flags,
     if (local_err != NULL) {
         error_propagate(errp, local_err);
         ret = -EINVAL;
-        goto out;
+        goto fail;
     }
 
-    /* timeout handling is broken in libiscsi before 1.15.0 */
-    timeout = parse_timeout(iscsi_url->target);
 #if defined(LIBISCSI_API_VERSION) && LIBISCSI_API_VERSION >= 20150621
     iscsi_set_timeout(iscsi, timeout);
-#else
-    if (timeout) {
-        error_report("iSCSI: ignoring timeout value for libiscsi <1.15.0");
-    }
 #endif
 
     if (iscsi_full_connect_sync(iscsi, iscsi_url->portal, iscsi_url->lun) != 0) {
         error_setg(errp, "iSCSI: Failed to connect to LUN : %s",
             iscsi_get_error(iscsi));
         ret = -EINVAL;
+        goto fail;
+    }
+
+    s->iscsi = iscsi;
+    return 0;
+
+fail:
+    iscsi_destroy_context(iscsi);
+    return ret;
+}
+
+static void iscsi_sessions_destroy(IscsiLun *iscsilun)
+{
+    int i;
+
+    for (i = 0; i < iscsilun->num_sessions; i++) {
+        struct iscsi_context *iscsi = iscsilun->sessions[i].iscsi;
+
+        if (iscsi_is_logged_in(iscsi)) {
+            iscsi_logout_sync(iscsi);
+        }
+        iscsi_destroy_context(iscsi);
+    }
+    g_free(iscsilun->sessions);
+    iscsilun->sessions = NULL;
+    iscsilun->num_sessions = 0;
+    iscsilun->iscsi = NULL;
+}
+
+/*
+ * We support iscsi url's on the form
+ * iscsi://[<username>%<password>@]<host>[:<port>]/<targetname>/<lun>
+ */
+static int iscsi_open(BlockDriverState *bs, QDict *options, int flags,
+                      Error **errp)
+{
+    IscsiLun *iscsilun = bs->opaque;
+    struct iscsi_url *iscsi_url = NULL;
+    struct scsi_task *task = NULL;
+    struct scsi_inquiry_standard *inq = NULL;
+    struct scsi_inquiry_supported_pages *inq_vpd;
+    char *initiator_name = NULL;
+    QemuOpts *opts;
+    Error *local_err = NULL;
+    const char *filename;
+    int i, ret = 0, timeout = 0, num_sessions;
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    filename = qemu_opt_get(opts, "filename");
+
+    iscsi_url = iscsi_parse_full_url(NULL, filename);
+    if (iscsi_url == NULL) {
+        error_setg(errp, "Failed to parse URL : %s", filename);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    memset(iscsilun, 0, sizeof(IscsiLun));
+
+    initiator_name = parse_initiator_name(iscsi_url->target);
+
+    num_sessions = parse_sessions(iscsi_url->target);
+    if (num_sessions < 1 || num_sessions > ISCSI_MAX_SESSIONS) {
+        error_setg(errp, "iSCSI: sessions must be between 1 and %d",
+                   ISCSI_MAX_SESSIONS);
+        ret = -EINVAL;
         goto out;
     }
 
-    iscsilun->iscsi = iscsi;
+    /* timeout handling is broken in libiscsi before 1.15.0 */
+    timeout = parse_timeout(iscsi_url->target);
+#if !defined(LIBISCSI_API_VERSION) || LIBISCSI_API_VERSION < 20150621
+    if (timeout) {
+        error_report("iSCSI: ignoring timeout value for libiscsi <1.15.0");
+    }
+#endif
+
+    iscsilun->sessions = g_new0(IscsiSession, num_sessions);
+    for (i = 0; i < num_sessions; i++) {
+        IscsiSession *s = &iscsilun->sessions[i];
+
+        ret = iscsi_session_connect(s, iscsi_url, initiator_name, timeout,
+                                    errp);
+        if (ret) {
+            goto out;
+        }
+        s->iscsilun = iscsilun;
+        iscsilun->num_sessions++;
+    }
+
+    iscsilun->iscsi = iscsilun->sessions[0].iscsi;
     iscsilun->aio_context = bdrv_get_aio_context(bs);
     iscsilun->lun   = iscsi_url->lun;
     iscsilun->has_write_same = true;
@@ -1780,12 +1903,7 @@ out:
     }
 
     if (ret) {
-        if (iscsi != NULL) {
-            if (iscsi_is_logged_in(iscsi)) {
-                iscsi_logout_sync(iscsi);
-            }
-            iscsi_destroy_context(iscsi);
-        }
+        iscsi_sessions_destroy(iscsilun);
         memset(iscsilun, 0, sizeof(IscsiLun));
     }
     return ret;
@@ -1794,13 +1912,9 @@ out:
 static void iscsi_close(BlockDriverState *bs)
 {
     IscsiLun *iscsilun = bs->opaque;
-    struct iscsi_context *iscsi = iscsilun->iscsi;
 
     iscsi_detach_aio_context(bs);
-    if (iscsi_is_logged_in(iscsi)) {
-        iscsi_logout_sync(iscsi);
-    }
-    iscsi_destroy_context(iscsi);
+    iscsi_sessions_destroy(iscsilun);
     g_free(iscsilun->zeroblock);
     iscsi_allocmap_free(iscsilun);
     memset(iscsilun, 0, sizeof(IscsiLun));
@@ -1938,9 +2052,7 @@ static int iscsi_create(const char *filename, QemuOpts *opts, Error **errp)
 
     ret = 0;
 out:
-    if (iscsilun->iscsi != NULL) {
-        iscsi_destroy_context(iscsilun->iscsi);
-    }
+    iscsi_sessions_destroy(iscsilun);
     g_free(bs->opaque);
     bs->opaque = NULL;
     bdrv_unref(bs);
@@ -2040,6 +2152,10 @@ static QemuOptsList qemu_iscsi_opts = {
             .name = "timeout",
             .type = QEMU_OPT_NUMBER,
             .help = "Request timeout in seconds (default 0 = no timeout)",
+        },{
+            .name = "sessions",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of sessions per LUN (default 1)",
         },
         { /* end of list */ }
     },
@@ -164,6 +164,43 @@ static void qemu_laio_completion_cb(EventNotifier *e)
     }
 }
 
+/* Header of the completion ring that the kernel maps at the address of the
+ * io_context_t (see fs/aio.c).  Looking at it tells whether completions are
+ * pending without a system call.
+ */
+struct aio_ring {
+    unsigned id;
+    unsigned nr;
+    unsigned head;
+    unsigned tail;
+    unsigned magic;
+    unsigned compat_features;
+    unsigned incompat_features;
+    unsigned header_length;
+};
+
+#define AIO_RING_MAGIC 0xa10a10a1
+
+static bool qemu_laio_poll_cb(void *opaque)
+{
+    EventNotifier *e = opaque;
+    LinuxAioState *s = container_of(e, LinuxAioState, e);
+    struct aio_ring *ring = (struct aio_ring *)s->ctx;
+
+    if (s->event_idx == s->event_max) {
+        /* Unknown ring layout, leave it to the event notifier */
+        if (ring->magic != AIO_RING_MAGIC || ring->incompat_features) {
+            return false;
+        }
+        if (atomic_read(&ring->head) == atomic_read(&ring->tail)) {
+            return false;
+        }
+    }
+
+    qemu_laio_completion_bh(s);
+    return true;
+}
+
 static void laio_cancel(BlockAIOCB *blockacb)
 {
     struct qemu_laiocb *laiocb = (struct qemu_laiocb *)blockacb;
@@ -342,6 +379,7 @@ void laio_attach_aio_context(LinuxAioState *s, AioContext *new_context)
     s->completion_bh = aio_bh_new(new_context, qemu_laio_completion_bh, s);
     aio_set_event_notifier(new_context, &s->e, false,
                            qemu_laio_completion_cb);
+    aio_set_event_notifier_poll(new_context, &s->e, qemu_laio_poll_cb);
 }
 
 LinuxAioState *laio_init(void)
@@ -27,6 +27,10 @@
 #define DEFAULT_MIRROR_BUF_SIZE \
     (MAX_IN_FLIGHT * MAX_IO_SECTORS * BDRV_SECTOR_SIZE)
 
+/* A drop in throughput by more than 1/IO_SIZE_SHRINK_RATIO between two
+ * slices halves the size of data copies */
+#define IO_SIZE_SHRINK_RATIO 8
+
 /* The mirroring buffer is a list of granularity-sized chunks.
  * Free chunks are organized in a list.
  */
@@ -69,6 +73,15 @@ typedef struct MirrorBlockJob {
     bool waiting_for_io;
     int target_cluster_sectors;
     int max_iov;
+
+    /* Size of data copies, adapted to the throughput measured over each
+     * SLICE_TIME */
+    int max_io_sectors;
+    int min_io_sectors_limit;
+    int max_io_sectors_limit;
+    int64_t io_slice_start_ns;
+    uint64_t io_slice_bytes;
+    uint64_t io_last_throughput; /* bytes per ms in the previous slice */
 } MirrorBlockJob;
 
 typedef struct MirrorOp {
@@ -118,6 +131,8 @@ static void mirror_iteration_done(MirrorOp *op, int ret)
             bitmap_set(s->cow_bitmap, chunk_num, nb_chunks);
         }
         s->common.offset += (uint64_t)op->nb_sectors * BDRV_SECTOR_SIZE;
+        /* Zero and discard operations have an empty qiov */
+        s->io_slice_bytes += op->qiov.size;
     }
 
     qemu_iovec_destroy(&op->qiov);
@@ -317,6 +332,40 @@ static void mirror_do_zero_or_discard(MirrorBlockJob *s,
     }
 }
 
+/* Grow the size of data copies for as long as this increases the throughput,
+ * and shrink it when the throughput drops, e.g. because larger requests
+ * start to be split or queued on the way to the target. */
+static void mirror_adjust_io_sectors(MirrorBlockJob *s)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int64_t elapsed = now - s->io_slice_start_ns;
+    uint64_t throughput;
+
+    if (elapsed < SLICE_TIME) {
+        return;
+    }
+
+    throughput = s->io_slice_bytes / MAX(elapsed / SCALE_MS, 1);
+    if (s->io_slice_bytes == 0) {
+        /* Nothing was copied, e.g. because the job was paused or the
+         * source is clean; this slice says nothing about the link. */
+    } else if (throughput >= s->io_last_throughput) {
+        s->max_io_sectors = MIN(s->max_io_sectors * 2,
+                                s->max_io_sectors_limit);
+    } else if (throughput < s->io_last_throughput -
+                            s->io_last_throughput / IO_SIZE_SHRINK_RATIO) {
+        s->max_io_sectors = MAX(s->max_io_sectors / 2,
+                                s->min_io_sectors_limit);
+    }
+    trace_mirror_adjust_io_sectors(s, throughput, s->max_io_sectors);
+
+    if (s->io_slice_bytes) {
+        s->io_last_throughput = throughput;
+    }
+    s->io_slice_bytes = 0;
+    s->io_slice_start_ns = now;
+}
+
 static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
 {
     BlockDriverState *source = blk_bs(s->common.blk);
@@ -327,8 +376,10 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
     int64_t end = s->bdev_length / BDRV_SECTOR_SIZE;
     int sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
     bool write_zeroes_ok = bdrv_can_write_zeroes_with_unmap(blk_bs(s->target));
-    int max_io_sectors = MAX((s->buf_size >> BDRV_SECTOR_BITS) / MAX_IN_FLIGHT,
-                             MAX_IO_SECTORS);
+    int max_io_sectors;
+
+    mirror_adjust_io_sectors(s);
+    max_io_sectors = s->max_io_sectors;
 
     sector_num = hbitmap_iter_next(&s->hbi);
     if (sector_num < 0) {
@@ -552,6 +603,7 @@ static int coroutine_fn mirror_dirty_init(MirrorBlockJob *s)
     BlockDriverState *base = s->base;
     BlockDriverState *bs = blk_bs(s->common.blk);
     BlockDriverState *target_bs = blk_bs(s->target);
+    BlockDriverState *file;
     int ret, n;
 
     end = s->bdev_length / BDRV_SECTOR_SIZE;
@@ -585,11 +637,17 @@ static int coroutine_fn mirror_dirty_init(MirrorBlockJob *s)
         mirror_drain(s);
     }
 
-    /* First part, loop on the sectors and initialize the dirty bitmap.  */
+    /* First part, loop on the sectors and initialize the dirty bitmap.
+     *
+     * Without a base, the target reads as zeroes at this point, so the
+     * ranges of the source which read as zeroes are skipped as a whole even
+     * if they are allocated (e.g. holes in a raw file or zero clusters).
+     */
     for (sector_num = 0; sector_num < end; ) {
         /* Just to make sure we are not exceeding int limit. */
         int nb_sectors = MIN(INT_MAX >> BDRV_SECTOR_BITS,
                              end - sector_num);
+        bool dirty;
 
         mirror_throttle(s);
 
@@ -597,13 +655,21 @@ static int coroutine_fn mirror_dirty_init(MirrorBlockJob *s)
             return 0;
         }
 
-        ret = bdrv_is_allocated_above(bs, base, sector_num, nb_sectors, &n);
+        if (base == NULL) {
+            ret = bdrv_get_block_status_above(bs, NULL, sector_num,
+                                              nb_sectors, &n, &file);
+            dirty = (ret & BDRV_BLOCK_ALLOCATED) && !(ret & BDRV_BLOCK_ZERO);
+        } else {
+            ret = bdrv_is_allocated_above(bs, base, sector_num, nb_sectors,
+                                          &n);
+            dirty = ret == 1;
+        }
         if (ret < 0) {
             return ret;
         }
 
         assert(n > 0);
-        if (ret == 1) {
+        if (dirty) {
             bdrv_set_dirty_bitmap(s->dirty_bitmap, sector_num, n);
         }
         sector_num += n;
@@ -663,6 +729,15 @@ static void coroutine_fn mirror_run(void *opaque)
     s->target_cluster_sectors = target_cluster_size >> BDRV_SECTOR_BITS;
     s->max_iov = MIN(bs->bl.max_iov, target_bs->bl.max_iov);
 
+    /* Start with the size that used to be fixed; keep at least a few
+     * requests in flight when growing it */
+    s->max_io_sectors = MAX((s->buf_size >> BDRV_SECTOR_BITS) / MAX_IN_FLIGHT,
+                            MAX_IO_SECTORS);
+    s->min_io_sectors_limit = s->granularity >> BDRV_SECTOR_BITS;
+    s->max_io_sectors_limit = MAX((s->buf_size >> BDRV_SECTOR_BITS) / 4,
+                                  s->max_io_sectors);
+    s->io_slice_start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
     s->buf = qemu_try_blockalign(bs, s->buf_size);
     if (s->buf == NULL) {
         ret = -ENOMEM;
@@ -28,6 +28,7 @@
 
 #include "qemu/osdep.h"
 #include "nbd-client.h"
+#include "qapi/error.h"
 
 #define HANDLE_TO_INDEX(bs, handle) ((handle) ^ ((uint64_t)(intptr_t)bs))
 #define INDEX_TO_HANDLE(bs, index)  ((index)  ^ ((uint64_t)(intptr_t)bs))
@@ -43,10 +44,23 @@ static void nbd_recv_coroutines_enter_all(NbdClientSession *s)
     }
 }
 
-static void nbd_teardown_connection(BlockDriverState *bs)
+static void nbd_reply_ready(void *opaque);
+
+static void nbd_client_detach_conn(NbdClientSession *s,
+                                   AioContext *old_context)
 {
-    NbdClientSession *client = nbd_get_client_session(bs);
+    aio_set_fd_handler(old_context, s->sioc->fd, false, NULL, NULL, NULL);
+}
 
+static void nbd_client_attach_conn(NbdClientSession *s,
+                                   AioContext *new_context)
+{
+    aio_set_fd_handler(new_context, s->sioc->fd, false,
+                       nbd_reply_ready, NULL, s);
+}
+
+static void nbd_teardown_connection(NbdClientSession *client)
+{
     if (!client->ioc) { /* Already closed */
         return;
     }
@@ -57,7 +71,7 @@ static void nbd_teardown_connection(BlockDriverState *bs)
                          NULL);
     nbd_recv_coroutines_enter_all(client);
 
-    nbd_client_detach_aio_context(bs);
+    nbd_client_detach_conn(client, bdrv_get_aio_context(client->bs));
     object_unref(OBJECT(client->sioc));
     client->sioc = NULL;
     object_unref(OBJECT(client->ioc));
@@ -66,8 +80,7 @@ static void nbd_teardown_connection(BlockDriverState *bs)
 
 static void nbd_reply_ready(void *opaque)
 {
-    BlockDriverState *bs = opaque;
-    NbdClientSession *s = nbd_get_client_session(bs);
+    NbdClientSession *s = opaque;
     uint64_t i;
     int ret;
 
@@ -104,21 +117,40 @@ static void nbd_reply_ready(void *opaque)
     }
 
 fail:
-    nbd_teardown_connection(bs);
+    nbd_teardown_connection(s);
 }
 
 static void nbd_restart_write(void *opaque)
 {
-    BlockDriverState *bs = opaque;
+    NbdClientSession *s = opaque;
 
-    qemu_coroutine_enter(nbd_get_client_session(bs)->send_coroutine);
+    qemu_coroutine_enter(s->send_coroutine);
 }
 
-static int nbd_co_send_request(BlockDriverState *bs,
+/* Pick the connection with the fewest requests in flight, going round
+ * robin among equally busy ones.  */
+static NbdClientSession *nbd_client_pick(BlockDriverState *bs)
+{
+    NbdClientState *state = nbd_get_client_state(bs);
+    NbdClientSession *best = &state->conn[0];
+    int i;
+
+    for (i = 0; i < state->num_conns; i++) {
+        NbdClientSession *s;
+
+        s = &state->conn[(state->next_conn + i) % state->num_conns];
+        if (s->ioc && (!best->ioc || s->in_flight < best->in_flight)) {
+            best = s;
+        }
+    }
+    state->next_conn++;
+    return best;
+}
+
+static int nbd_co_send_request(NbdClientSession *s,
                                struct nbd_request *request,
                                QEMUIOVector *qiov)
 {
-    NbdClientSession *s = nbd_get_client_session(bs);
     AioContext *aio_context;
     int rc, ret, i;
 
@@ -141,10 +173,10 @@ static int nbd_co_send_request(BlockDriverState *bs,
     }
 
     s->send_coroutine = qemu_coroutine_self();
-    aio_context = bdrv_get_aio_context(bs);
+    aio_context = bdrv_get_aio_context(s->bs);
 
     aio_set_fd_handler(aio_context, s->sioc->fd, false,
-                       nbd_reply_ready, nbd_restart_write, bs);
+                       nbd_reply_ready, nbd_restart_write, s);
     if (qiov) {
         qio_channel_set_cork(s->ioc, true);
         rc = nbd_send_request(s->ioc, request);
@@ -160,33 +192,160 @@ static int nbd_co_send_request(BlockDriverState *bs,
         rc = nbd_send_request(s->ioc, request);
     }
     aio_set_fd_handler(aio_context, s->sioc->fd, false,
-                       nbd_reply_ready, NULL, bs);
+                       nbd_reply_ready, NULL, s);
     s->send_coroutine = NULL;
     qemu_co_mutex_unlock(&s->send_mutex);
     return rc;
 }
 
+static int nbd_co_read_payload(NbdClientSession *s, void *buf, size_t size)
+{
+    struct iovec iov = { .iov_base = buf, .iov_len = size };
+
+    return nbd_wr_syncv(s->ioc, &iov, 1, size, true) == size ? 0 : -EIO;
+}
+
+static int nbd_co_drop_payload(NbdClientSession *s, size_t size)
+{
+    char buf[256];
+
+    while (size > 0) {
+        size_t len = MIN(size, sizeof(buf));
+        if (nbd_co_read_payload(s, buf, len) < 0) {
+            return -EIO;
+        }
+        size -= len;
+    }
+    return 0;
+}
+
+/* Check that a data or hole chunk lies within the request.  */
+static bool nbd_chunk_in_request(struct nbd_request *request,
+                                 uint64_t offset, uint32_t len)
+{
+    return offset >= request->from &&
+           offset - request->from <= request->len &&
+           len <= request->len - (offset - request->from);
+}
+
+/* Process the payload of the structured reply chunk in s->reply.  Return
+ * 0 on success, a positive errno that the server reported for the request,
+ * or -EIO if the chunk is malformed or could not be read.  */
+static int nbd_co_receive_chunk(NbdClientSession *s,
+                                struct nbd_request *request,
+                                QEMUIOVector *qiov, NBDExtent *extent)
+{
+    struct nbd_reply *chunk = &s->reply;
+    QEMUIOVector sub_qiov;
+    uint8_t buf[12];
+    uint64_t offset;
+    uint32_t len, context_id;
+    int ret;
+
+    switch (chunk->type) {
+    case NBD_REPLY_TYPE_NONE:
+        if (chunk->length || !(chunk->flags & NBD_REPLY_FLAG_DONE)) {
+            return -EIO;
+        }
+        return 0;
+
+    case NBD_REPLY_TYPE_OFFSET_DATA:
+        if (!qiov || chunk->length < sizeof(offset) ||
+            nbd_co_read_payload(s, buf, sizeof(offset)) < 0) {
+            return -EIO;
+        }
+        offset = ldq_be_p(buf);
+        len = chunk->length - sizeof(offset);
+        if (!nbd_chunk_in_request(request, offset, len)) {
+            return -EIO;
+        }
+        qemu_iovec_init(&sub_qiov, qiov->niov);
+        qemu_iovec_concat(&sub_qiov, qiov, offset - request->from, len);
+        ret = nbd_wr_syncv(s->ioc, sub_qiov.iov, sub_qiov.niov, len, true);
+        qemu_iovec_destroy(&sub_qiov);
+        return ret == len ? 0 : -EIO;
+
+    case NBD_REPLY_TYPE_OFFSET_HOLE:
+        if (!qiov || chunk->length != 12 ||
+            nbd_co_read_payload(s, buf, 12) < 0) {
+            return -EIO;
+        }
+        offset = ldq_be_p(buf);
+        len = ldl_be_p(buf + 8);
+        if (!nbd_chunk_in_request(request, offset, len)) {
+            return -EIO;
+        }
+        qemu_iovec_memset(qiov, offset - request->from, 0, len);
+        return 0;
+
+    case NBD_REPLY_TYPE_BLOCK_STATUS:
+        /* We always send NBD_CMD_FLAG_REQ_ONE, so expect one extent */
+        if (!extent || chunk->length != 12 ||
+            nbd_co_read_payload(s, buf, 12) < 0) {
+            return -EIO;
+        }
+        context_id = ldl_be_p(buf);
+        extent->length = ldl_be_p(buf + 4);
+        extent->flags = ldl_be_p(buf + 8);
+        if (context_id != s->ext.base_allocation_id ||
+            extent->length == 0 || extent->length > request->len) {
+            return -EIO;
+        }
+        return 0;
+
+    default:
+        if (!NBD_REPLY_TYPE_IS_ERROR(chunk->type)) {
+            return -EIO;
+        }
+        /* NBD_REPLY_TYPE_ERROR and NBD_REPLY_TYPE_ERROR_OFFSET start with
+         * the error and the length of a message, which we do not use.  */
+        if (chunk->length < 6 || nbd_co_read_payload(s, buf, 6) < 0 ||
+            nbd_co_drop_payload(s, chunk->length - 6) < 0) {
+            return -EIO;
+        }
+        ret = nbd_errno_to_system_errno(ldl_be_p(buf));
+        return ret ? ret : EIO;
+    }
+}
+
 static void nbd_co_receive_reply(NbdClientSession *s,
                                  struct nbd_request *request,
                                  struct nbd_reply *reply,
-                                 QEMUIOVector *qiov)
+                                 QEMUIOVector *qiov,
+                                 NBDExtent *extent)
 {
     int ret;
+    bool done = false;
+
+    reply->error = 0;
+    while (!done) {
+        /* Wait until we're woken up by the read handler.  TODO: perhaps
+         * peek at the next reply and avoid yielding if it's ours?  */
+        qemu_coroutine_yield();
+        if (s->reply.handle != request->handle ||
+            !s->ioc) {
+            reply->error = EIO;
+            return;
+        }
 
-    /* Wait until we're woken up by the read handler.  TODO: perhaps
-     * peek at the next reply and avoid yielding if it's ours?  */
-    qemu_coroutine_yield();
-    *reply = s->reply;
-    if (reply->handle != request->handle ||
-        !s->ioc) {
-        reply->error = EIO;
-    } else {
-        if (qiov && reply->error == 0) {
-            ret = nbd_wr_syncv(s->ioc, qiov->iov, qiov->niov, request->len,
-                               true);
-            if (ret != request->len) {
-                reply->error = EIO;
+        if (!s->reply.structured) {
+            reply->error = s->reply.error;
+            if (qiov && reply->error == 0) {
+                ret = nbd_wr_syncv(s->ioc, qiov->iov, qiov->niov,
+                                   request->len, true);
+                if (ret != request->len) {
+                    reply->error = EIO;
+                }
             }
+            done = true;
+        } else {
+            /* A structured reply may be split into several chunks; keep
+             * the first error but read them all.  */
+            ret = nbd_co_receive_chunk(s, request, qiov, extent);
+            if (ret && !reply->error) {
+                reply->error = ret < 0 ? -ret : ret;
+            }
+            done = ret < 0 || (s->reply.flags & NBD_REPLY_FLAG_DONE);
         }
 
         /* Tell the read handler to read another header.  */
@@ -221,7 +380,7 @@ static void nbd_coroutine_end(NbdClientSession *s,
 int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
                          uint64_t bytes, QEMUIOVector *qiov, int flags)
 {
-    NbdClientSession *client = nbd_get_client_session(bs);
+    NbdClientSession *client = nbd_client_pick(bs);
     struct nbd_request request = {
         .type = NBD_CMD_READ,
         .from = offset,
@@ -234,11 +393,11 @@ int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
     assert(!flags);
 
     nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, NULL);
+    ret = nbd_co_send_request(client, &request, NULL);
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(client, &request, &reply, qiov);
+        nbd_co_receive_reply(client, &request, &reply, qiov, NULL);
     }
     nbd_coroutine_end(client, &request);
     return -reply.error;
@@ -247,7 +406,7 @@ int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
 int nbd_client_co_pwritev(BlockDriverState *bs, uint64_t offset,
                           uint64_t bytes, QEMUIOVector *qiov, int flags)
 {
-    NbdClientSession *client = nbd_get_client_session(bs);
+    NbdClientSession *client = nbd_client_pick(bs);
     struct nbd_request request = {
         .type = NBD_CMD_WRITE,
         .from = offset,
@@ -264,11 +423,11 @@ int nbd_client_co_pwritev(BlockDriverState *bs, uint64_t offset,
     assert(bytes <= NBD_MAX_BUFFER_SIZE);
 
     nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, qiov);
+    ret = nbd_co_send_request(client, &request, qiov);
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL);
+        nbd_co_receive_reply(client, &request, &reply, NULL, NULL);
     }
     nbd_coroutine_end(client, &request);
     return -reply.error;
@@ -276,7 +435,7 @@ int nbd_client_co_pwritev(BlockDriverState *bs, uint64_t offset,
 
 int nbd_client_co_flush(BlockDriverState *bs)
 {
-    NbdClientSession *client = nbd_get_client_session(bs);
+    NbdClientSession *client = nbd_client_pick(bs);
     struct nbd_request request = { .type = NBD_CMD_FLUSH };
     struct nbd_reply reply;
     ssize_t ret;
@@ -289,11 +448,11 @@ int nbd_client_co_flush(BlockDriverState *bs)
     request.len = 0;
 
     nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, NULL);
+    ret = nbd_co_send_request(client, &request, NULL);
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL);
+        nbd_co_receive_reply(client, &request, &reply, NULL, NULL);
     }
     nbd_coroutine_end(client, &request);
     return -reply.error;
@@ -301,7 +460,7 @@ int nbd_client_co_flush(BlockDriverState *bs)
 
 int nbd_client_co_pdiscard(BlockDriverState *bs, int64_t offset, int count)
 {
-    NbdClientSession *client = nbd_get_client_session(bs);
+    NbdClientSession *client = nbd_client_pick(bs);
     struct nbd_request request = {
         .type = NBD_CMD_TRIM,
         .from = offset,
@@ -315,34 +474,99 @@ int nbd_client_co_pdiscard(BlockDriverState *bs, int64_t offset, int count)
     }
 
     nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, NULL);
+    ret = nbd_co_send_request(client, &request, NULL);
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL);
+        nbd_co_receive_reply(client, &request, &reply, NULL, NULL);
     }
     nbd_coroutine_end(client, &request);
     return -reply.error;
 
 }
 
+int64_t nbd_client_co_get_block_status(BlockDriverState *bs,
+                                       int64_t sector_num,
+                                       int nb_sectors, int *pnum,
+                                       BlockDriverState **file)
+{
+    NbdClientSession *client = nbd_client_pick(bs);
+    struct nbd_request request = {
+        .type = NBD_CMD_BLOCK_STATUS | NBD_CMD_FLAG_REQ_ONE,
+        .from = sector_num << BDRV_SECTOR_BITS,
+        .len = MIN(nb_sectors, BDRV_REQUEST_MAX_SECTORS) << BDRV_SECTOR_BITS,
+    };
+    struct nbd_reply reply;
+    NBDExtent extent = { 0 };
+    int64_t ret;
+
+    *file = bs;
+    ret = BDRV_BLOCK_OFFSET_VALID | (sector_num << BDRV_SECTOR_BITS);
+    if (!client->ext.base_allocation) {
+        *pnum = nb_sectors;
+        return ret | BDRV_BLOCK_DATA;
+    }
+
+    nbd_coroutine_start(client, &request);
+    ret = nbd_co_send_request(client, &request, NULL);
+    if (ret < 0) {
+        reply.error = -ret;
+    } else {
+        nbd_co_receive_reply(client, &request, &reply, NULL, &extent);
+    }
+    nbd_coroutine_end(client, &request);
+    if (reply.error) {
+        return -reply.error;
+    }
+    if (!extent.length) {
+        return -EIO;
+    }
+
+    /* A partial sector at the end of the extent may hold data */
+    *pnum = extent.length >> BDRV_SECTOR_BITS;
+    if (*pnum == 0) {
+        *pnum = 1;
+        extent.flags = 0;
+    }
+
+    ret = BDRV_BLOCK_OFFSET_VALID | (sector_num << BDRV_SECTOR_BITS);
+    if (!(extent.flags & NBD_STATE_HOLE)) {
+        ret |= BDRV_BLOCK_DATA;
+    }
+    if (extent.flags & NBD_STATE_ZERO) {
+        ret |= BDRV_BLOCK_ZERO;
+    }
+    return ret;
+}
+
 void nbd_client_detach_aio_context(BlockDriverState *bs)
 {
-    aio_set_fd_handler(bdrv_get_aio_context(bs),
-                       nbd_get_client_session(bs)->sioc->fd,
-                       false, NULL, NULL, NULL);
+    NbdClientState *state = nbd_get_client_state(bs);
+    int i;
+
+    for (i = 0; i < state->num_conns; i++) {
+        if (state->conn[i].sioc) {
+            nbd_client_detach_conn(&state->conn[i],
+                                   bdrv_get_aio_context(bs));
+        }
+    }
 }
 
 void nbd_client_attach_aio_context(BlockDriverState *bs,
                                    AioContext *new_context)
 {
-    aio_set_fd_handler(new_context, nbd_get_client_session(bs)->sioc->fd,
-                       false, nbd_reply_ready, NULL, bs);
+    NbdClientState *state = nbd_get_client_state(bs);
+    int i;
+
+    for (i = 0; i < state->num_conns; i++) {
+        if (state->conn[i].sioc) {
+            nbd_client_attach_conn(&state->conn[i], new_context);
+        }
+    }
 }
 
-void nbd_client_close(BlockDriverState *bs)
+static void nbd_client_close_conn(NbdClientSession *client)
 {
-    NbdClientSession *client = nbd_get_client_session(bs);
     struct nbd_request request = {
         .type = NBD_CMD_DISC,
         .from = 0,
@@ -355,36 +579,46 @@ void nbd_client_close(BlockDriverState *bs)
 
     nbd_send_request(client->ioc, &request);
 
-    nbd_teardown_connection(bs);
+    nbd_teardown_connection(client);
 }
 
-int nbd_client_init(BlockDriverState *bs,
-                    QIOChannelSocket *sioc,
-                    const char *export,
-                    QCryptoTLSCreds *tlscreds,
-                    const char *hostname,
-                    Error **errp)
+void nbd_client_close(BlockDriverState *bs)
+{
+    NbdClientState *state = nbd_get_client_state(bs);
+    int i;
+
+    for (i = 0; i < state->num_conns; i++) {
+        nbd_client_close_conn(&state->conn[i]);
+    }
+}
+
+static int nbd_client_connect(BlockDriverState *bs,
+                              NbdClientSession *client,
+                              QIOChannelSocket *sioc,
+                              const char *export,
+                              QCryptoTLSCreds *tlscreds,
+                              const char *hostname,
+                              Error **errp)
 {
-    NbdClientSession *client = nbd_get_client_session(bs);
     int ret;
 
     /* NBD handshake */
     logout("session init %s\n", export);
     qio_channel_set_blocking(QIO_CHANNEL(sioc), true, NULL);
 
+    client->ext.structured_reply = true;
+    client->ext.base_allocation = true;
     ret = nbd_receive_negotiate(QIO_CHANNEL(sioc), export,
                                 &client->nbdflags,
                                 tlscreds, hostname,
                                 &client->ioc,
-                                &client->size, errp);
+                                &client->size, &client->ext, errp);
     if (ret < 0) {
         logout("Failed to negotiate with the NBD server\n");
         return ret;
     }
-    if (client->nbdflags & NBD_FLAG_SEND_FUA) {
-        bs->supported_write_flags = BDRV_REQ_FUA;
-    }
 
+    client->bs = bs;
     qemu_co_mutex_init(&client->send_mutex);
     qemu_co_mutex_init(&client->free_sema);
     client->sioc = sioc;
@@ -399,8 +633,68 @@ int nbd_client_init(BlockDriverState *bs,
      * kick the reply mechanism.  */
     qio_channel_set_blocking(QIO_CHANNEL(sioc), false, NULL);
 
-    nbd_client_attach_aio_context(bs, bdrv_get_aio_context(bs));
+    nbd_client_attach_conn(client, bdrv_get_aio_context(bs));
 
     logout("Established connection with NBD server\n");
     return 0;
 }
+
+int nbd_client_init(BlockDriverState *bs,
+                    QIOChannelSocket *sioc,
+                    const char *export,
+                    QCryptoTLSCreds *tlscreds,
+                    const char *hostname,
+                    Error **errp)
+{
+    NbdClientState *state = nbd_get_client_state(bs);
+    NbdClientSession *client = &state->conn[0];
+    int ret;
+
+    ret = nbd_client_connect(bs, client, sioc, export, tlscreds, hostname,
+                             errp);
+    if (ret < 0) {
+        return ret;
+    }
+    state->num_conns = 1;
+
+    if (client->nbdflags & NBD_FLAG_SEND_FUA) {
+        bs->supported_write_flags = BDRV_REQ_FUA;
+    }
+    return 0;
+}
+
+/* Open one more connection to the export of an initialized client.  The
+ * caller must have checked NBD_FLAG_CAN_MULTI_CONN.
+ */
+int nbd_client_add_connection(BlockDriverState *bs,
+                              QIOChannelSocket *sioc,
+                              const char *export,
+                              QCryptoTLSCreds *tlscreds,
+                              const char *hostname,
+                              Error **errp)
+{
+    NbdClientState *state = nbd_get_client_state(bs);
+    NbdClientSession *client = &state->conn[state->num_conns];
+    int ret;
+
+    assert(state->num_conns > 0 && state->num_conns < MAX_NBD_CONNECTIONS);
+    assert(state->conn[0].nbdflags & NBD_FLAG_CAN_MULTI_CONN);
+
+    ret = nbd_client_connect(bs, client, sioc, export, tlscreds, hostname,
+                             errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* Requests may go to any connection, so they must all be alike */
+    if (client->nbdflags != state->conn[0].nbdflags ||
+        client->size != state->conn[0].size ||
+        client->ext.structured_reply != state->conn[0].ext.structured_reply ||
+        client->ext.base_allocation != state->conn[0].ext.base_allocation) {
+        error_setg(errp, "NBD server changed the export between connections");
+        nbd_client_close_conn(client);
+        return -EINVAL;
+    }
+    state->num_conns++;
+    return 0;
+}
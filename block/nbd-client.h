@@ -16,12 +16,16 @@
 #endif
 
 #define MAX_NBD_REQUESTS    16
+#define MAX_NBD_CONNECTIONS 16
 
+/* One connection to the server */
 typedef struct NbdClientSession {
+    BlockDriverState *bs;
     QIOChannelSocket *sioc; /* The master data channel */
     QIOChannel *ioc; /* The current I/O channel which may differ (eg TLS) */
     uint16_t nbdflags;
     off_t size;
+    NBDExtensions ext;
 
     CoMutex send_mutex;
     CoMutex free_sema;
@@ -30,11 +34,21 @@ typedef struct NbdClientSession {
 
     Coroutine *recv_coroutine[MAX_NBD_REQUESTS];
     struct nbd_reply reply;
+} NbdClientSession;
+
+/* Requests are spread over several connections to the same export if
+ * the server sets NBD_FLAG_CAN_MULTI_CONN.  That flag promises that a
+ * flush on any connection covers writes completed on all of them.
+ */
+typedef struct NbdClientState {
+    NbdClientSession conn[MAX_NBD_CONNECTIONS];
+    int num_conns;
+    unsigned next_conn;
 
     bool is_unix;
-} NbdClientSession;
+} NbdClientState;
 
-NbdClientSession *nbd_get_client_session(BlockDriverState *bs);
+NbdClientState *nbd_get_client_state(BlockDriverState *bs);
 
 int nbd_client_init(BlockDriverState *bs,
                     QIOChannelSocket *sock,
@@ -42,6 +56,12 @@ int nbd_client_init(BlockDriverState *bs,
                     QCryptoTLSCreds *tlscreds,
                     const char *hostname,
                     Error **errp);
+int nbd_client_add_connection(BlockDriverState *bs,
+                              QIOChannelSocket *sock,
+                              const char *export_name,
+                              QCryptoTLSCreds *tlscreds,
+                              const char *hostname,
+                              Error **errp);
 void nbd_client_close(BlockDriverState *bs);
 
 int nbd_client_co_pdiscard(BlockDriverState *bs, int64_t offset, int count);
@@ -50,6 +70,10 @@ int nbd_client_co_pwritev(BlockDriverState *bs, uint64_t offset,
                           uint64_t bytes, QEMUIOVector *qiov, int flags);
 int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
                          uint64_t bytes, QEMUIOVector *qiov, int flags);
+int64_t nbd_client_co_get_block_status(BlockDriverState *bs,
+                                       int64_t sector_num,
+                                       int nb_sectors, int *pnum,
+                                       BlockDriverState **file);
 
 void nbd_client_detach_aio_context(BlockDriverState *bs);
 void nbd_client_attach_aio_context(BlockDriverState *bs,
@@ -41,7 +41,7 @@
 #define EN_OPTSTR ":exportname="
 
 typedef struct BDRVNBDState {
-    NbdClientSession client;
+    NbdClientState client;
 
     /* For nbd_refresh_filename() */
     char *path, *host, *port, *export, *tlscredsid;
@@ -235,7 +235,7 @@ static SocketAddress *nbd_config(BDRVNBDState *s, QemuOpts *opts, Error **errp)
     return saddr;
 }
 
-NbdClientSession *nbd_get_client_session(BlockDriverState *bs)
+NbdClientState *nbd_get_client_state(BlockDriverState *bs)
 {
     BDRVNBDState *s = bs->opaque;
     return &s->client;
@@ -322,6 +322,12 @@ static QemuOptsList nbd_runtime_opts = {
             .type = QEMU_OPT_STRING,
             .help = "ID of the TLS credentials to use",
         },
+        {
+            .name = "connections",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of connections to open if the server allows "
+                    "more than one (default: 1)",
+        },
     },
 };
 
@@ -335,6 +341,8 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
     SocketAddress *saddr = NULL;
     QCryptoTLSCreds *tlscreds = NULL;
     const char *hostname = NULL;
+    uint64_t connections;
+    int i;
     int ret = -EINVAL;
 
     opts = qemu_opts_create(&nbd_runtime_opts, NULL, 0, &error_abort);
@@ -364,6 +372,13 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
         hostname = saddr->u.inet.data->host;
     }
 
+    connections = qemu_opt_get_number(opts, "connections", 1);
+    if (connections < 1 || connections > MAX_NBD_CONNECTIONS) {
+        error_setg(errp, "connections must be between 1 and %d",
+                   MAX_NBD_CONNECTIONS);
+        goto error;
+    }
+
     /* establish TCP connection, return error if it fails
      * TODO: Configurable retry-until-timeout behaviour.
      */
@@ -376,6 +391,22 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
     /* NBD handshake */
     ret = nbd_client_init(bs, sioc, s->export,
                           tlscreds, hostname, errp);
+
+    /* Servers that do not allow it only get one connection */
+    for (i = 1; ret == 0 && i < connections &&
+         (s->client.conn[0].nbdflags & NBD_FLAG_CAN_MULTI_CONN); i++) {
+        object_unref(OBJECT(sioc));
+        sioc = nbd_establish_connection(saddr, errp);
+        if (!sioc) {
+            ret = -ECONNREFUSED;
+        } else {
+            ret = nbd_client_add_connection(bs, sioc, s->export,
+                                            tlscreds, hostname, errp);
+        }
+        if (ret < 0) {
+            nbd_client_close(bs);
+        }
+    }
  error:
     if (sioc) {
         object_unref(OBJECT(sioc));
@@ -423,7 +454,7 @@ static int64_t nbd_getlength(BlockDriverState *bs)
 {
     BDRVNBDState *s = bs->opaque;
 
-    return s->client.size;
+    return s->client.conn[0].size;
 }
 
 static void nbd_detach_aio_context(BlockDriverState *bs)
@@ -494,6 +525,7 @@ static BlockDriver bdrv_nbd = {
     .bdrv_close                 = nbd_close,
     .bdrv_co_flush_to_os        = nbd_co_flush,
     .bdrv_co_pdiscard           = nbd_client_co_pdiscard,
+    .bdrv_co_get_block_status   = nbd_client_co_get_block_status,
     .bdrv_refresh_limits        = nbd_refresh_limits,
     .bdrv_getlength             = nbd_getlength,
     .bdrv_detach_aio_context    = nbd_detach_aio_context,
@@ -512,6 +544,7 @@ static BlockDriver bdrv_nbd_tcp = {
     .bdrv_close                 = nbd_close,
     .bdrv_co_flush_to_os        = nbd_co_flush,
     .bdrv_co_pdiscard           = nbd_client_co_pdiscard,
+    .bdrv_co_get_block_status   = nbd_client_co_get_block_status,
     .bdrv_refresh_limits        = nbd_refresh_limits,
     .bdrv_getlength             = nbd_getlength,
     .bdrv_detach_aio_context    = nbd_detach_aio_context,
@@ -530,6 +563,7 @@ static BlockDriver bdrv_nbd_unix = {
     .bdrv_close                 = nbd_close,
     .bdrv_co_flush_to_os        = nbd_co_flush,
     .bdrv_co_pdiscard           = nbd_client_co_pdiscard,
+    .bdrv_co_get_block_status   = nbd_client_co_get_block_status,
     .bdrv_refresh_limits        = nbd_refresh_limits,
     .bdrv_getlength             = nbd_getlength,
     .bdrv_detach_aio_context    = nbd_detach_aio_context,
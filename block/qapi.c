@@ -361,6 +361,33 @@ static BlockStats *bdrv_query_stats(BlockBackend *blk,
                                     const BlockDriverState *bs,
                                     bool query_backing);
 
+static BlockLatencyHistogramInfo *
+bdrv_latency_histogram_info(BlockLatencyHistogram *hist)
+{
+    BlockLatencyHistogramInfo *info;
+    uint64List **boundaries, **bins;
+    int i;
+
+    if (!hist->bins) {
+        return NULL;
+    }
+
+    info = g_new0(BlockLatencyHistogramInfo, 1);
+    boundaries = &info->boundaries;
+    bins = &info->bins;
+    for (i = 0; i < hist->nbins; i++) {
+        *bins = g_new0(uint64List, 1);
+        (*bins)->value = hist->bins[i];
+        bins = &(*bins)->next;
+        if (i < hist->nbins - 1) {
+            *boundaries = g_new0(uint64List, 1);
+            (*boundaries)->value = hist->boundaries[i];
+            boundaries = &(*boundaries)->next;
+        }
+    }
+    return info;
+}
+
 static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
 {
     BlockAcctStats *stats = blk_get_stats(blk);
@@ -395,6 +422,16 @@ static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
     ds->account_invalid = stats->account_invalid;
     ds->account_failed = stats->account_failed;
 
+    ds->rd_latency_histogram = bdrv_latency_histogram_info(
+        &stats->latency_histogram[BLOCK_ACCT_READ]);
+    ds->has_rd_latency_histogram = ds->rd_latency_histogram != NULL;
+    ds->wr_latency_histogram = bdrv_latency_histogram_info(
+        &stats->latency_histogram[BLOCK_ACCT_WRITE]);
+    ds->has_wr_latency_histogram = ds->wr_latency_histogram != NULL;
+    ds->flush_latency_histogram = bdrv_latency_histogram_info(
+        &stats->latency_histogram[BLOCK_ACCT_FLUSH]);
+    ds->has_flush_latency_histogram = ds->flush_latency_histogram != NULL;
+
     while ((ts = block_acct_interval_next(stats, ts))) {
         BlockDeviceTimedStatsList *timed_stats =
             g_malloc0(sizeof(*timed_stats));
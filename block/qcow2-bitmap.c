@@ -0,0 +1,1110 @@
+/*
+ * Bitmaps for the QCOW version 2 format
+ *
+ * Dirty bitmaps are stored on close in the format described by the "Bitmaps
+ * extension" section of docs/specs/qcow2.txt and loaded again on open.  While
+ * the image is open read-write, the bitmaps stored in it are marked "in use"
+ * so that a crash is detected the next time the image is opened.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "block/block_int.h"
+#include "block/qcow2.h"
+#include "qemu/bswap.h"
+#include "qemu/error-report.h"
+#include "qemu/cutils.h"
+
+/* Bitmap directory entry constraints */
+#define BME_MAX_TABLE_SIZE 0x8000000
+#define BME_MAX_GRANULARITY_BITS 31
+#define BME_MIN_GRANULARITY_BITS 9
+#define BME_MAX_NAME_SIZE 1023
+
+/* Bitmap directory entry flags */
+#define BME_RESERVED_FLAGS 0xfffffff8U
+#define BME_FLAG_IN_USE (1U << 0)
+#define BME_FLAG_AUTO   (1U << 1)
+
+/* The only bitmap type defined so far */
+#define BT_DIRTY_TRACKING_BITMAP 1
+
+/* Bitmap table entries: bits [1, 8] and [56, 63] are reserved */
+#define BME_TABLE_ENTRY_RESERVED_MASK 0xff000000000001feULL
+#define BME_TABLE_ENTRY_OFFSET_MASK 0x00fffffffffffe00ULL
+#define BME_TABLE_ENTRY_FLAG_ALL_ONES (1ULL << 0)
+
+typedef struct Qcow2BitmapDirEntry {
+    /* header is 8 byte aligned */
+    uint64_t bitmap_table_offset;
+
+    uint32_t bitmap_table_size;
+    uint32_t flags;
+
+    uint8_t type;
+    uint8_t granularity_bits;
+    uint16_t name_size;
+    uint32_t extra_data_size;
+    /* extra data follows  */
+    /* name follows  */
+} QEMU_PACKED Qcow2BitmapDirEntry;
+
+typedef struct Qcow2BitmapTable {
+    uint64_t offset;
+    uint32_t size; /* number of 64bit entries */
+} Qcow2BitmapTable;
+
+typedef struct Qcow2Bitmap {
+    Qcow2BitmapTable table;
+    uint32_t flags;
+    uint8_t granularity_bits;
+    char *name;
+
+    QSIMPLEQ_ENTRY(Qcow2Bitmap) entry;
+} Qcow2Bitmap;
+typedef QSIMPLEQ_HEAD(Qcow2BitmapList, Qcow2Bitmap) Qcow2BitmapList;
+
+static inline bool can_write(BlockDriverState *bs)
+{
+    return !bs->read_only && !(bdrv_get_flags(bs) & BDRV_O_INACTIVE);
+}
+
+static int check_table_entry(uint64_t entry, int cluster_size)
+{
+    uint64_t offset;
+
+    if (entry & BME_TABLE_ENTRY_RESERVED_MASK) {
+        return -EINVAL;
+    }
+
+    offset = entry & BME_TABLE_ENTRY_OFFSET_MASK;
+    if (offset != 0) {
+        /* if offset specified, bit 0 is reserved */
+        if (entry & BME_TABLE_ENTRY_FLAG_ALL_ONES) {
+            return -EINVAL;
+        }
+
+        if (offset % cluster_size != 0) {
+            return -EINVAL;
+        }
+    }
+
+    return 0;
+}
+
+/* Number of sectors covered by one cluster of bitmap data */
+static uint64_t sectors_covered_by_bitmap_cluster(const BDRVQcow2State *s,
+                                                  int granularity_bits)
+{
+    return ((uint64_t)s->cluster_size * 8) <<
+           (granularity_bits - BDRV_SECTOR_BITS);
+}
+
+static uint64_t get_bitmap_table_size(const BDRVQcow2State *s,
+                                      int64_t nb_sectors, int granularity_bits)
+{
+    return DIV_ROUND_UP(nb_sectors,
+                        sectors_covered_by_bitmap_cluster(s,
+                                                          granularity_bits));
+}
+
+static int bitmap_table_load(BlockDriverState *bs, Qcow2BitmapTable *tb,
+                             uint64_t **bitmap_table)
+{
+    int ret;
+    BDRVQcow2State *s = bs->opaque;
+    uint32_t i;
+    uint64_t *table;
+
+    assert(tb->size != 0);
+    table = g_try_new(uint64_t, tb->size);
+    if (table == NULL) {
+        return -ENOMEM;
+    }
+
+    assert(tb->size <= BME_MAX_TABLE_SIZE);
+    ret = bdrv_pread(bs->file, tb->offset,
+                     table, tb->size * sizeof(uint64_t));
+    if (ret < 0) {
+        goto fail;
+    }
+
+    for (i = 0; i < tb->size; ++i) {
+        be64_to_cpus(&table[i]);
+        ret = check_table_entry(table[i], s->cluster_size);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    *bitmap_table = table;
+    return 0;
+
+fail:
+    g_free(table);
+
+    return ret;
+}
+
+/* Free the data clusters and the table of a bitmap which is no longer
+ * referenced by the bitmap directory */
+static void free_bitmap_clusters(BlockDriverState *bs, Qcow2BitmapTable *tb)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t *bitmap_table;
+    uint32_t i;
+    int ret;
+
+    ret = bitmap_table_load(bs, tb, &bitmap_table);
+    if (ret < 0) {
+        /* Leak the clusters; qemu-img check can recover them */
+        return;
+    }
+
+    for (i = 0; i < tb->size; ++i) {
+        uint64_t addr = bitmap_table[i] & BME_TABLE_ENTRY_OFFSET_MASK;
+
+        if (addr != 0) {
+            qcow2_free_clusters(bs, addr, s->cluster_size,
+                                QCOW2_DISCARD_OTHER);
+        }
+    }
+    g_free(bitmap_table);
+
+    qcow2_free_clusters(bs, tb->offset, tb->size * sizeof(uint64_t),
+                        QCOW2_DISCARD_OTHER);
+}
+
+/* Fill the in-memory bitmap from the image */
+static int load_bitmap_data(BlockDriverState *bs,
+                            const uint64_t *bitmap_table,
+                            uint32_t bitmap_table_size,
+                            BdrvDirtyBitmap *bitmap)
+{
+    int ret = 0;
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t sector, sbc;
+    uint64_t bm_size = bdrv_dirty_bitmap_size(bitmap);
+    uint8_t *buf = NULL;
+    uint64_t i, tab_size =
+            get_bitmap_table_size(s, bm_size,
+                                  ctz32(bdrv_dirty_bitmap_granularity(bitmap)));
+
+    if (tab_size != bitmap_table_size || tab_size > BME_MAX_TABLE_SIZE) {
+        return -EINVAL;
+    }
+
+    buf = g_malloc(s->cluster_size);
+    sbc = sectors_covered_by_bitmap_cluster(
+              s, ctz32(bdrv_dirty_bitmap_granularity(bitmap)));
+    for (i = 0, sector = 0; i < tab_size; ++i, sector += sbc) {
+        uint64_t count = MIN(bm_size - sector, sbc);
+        uint64_t entry = bitmap_table[i];
+        uint64_t offset = entry & BME_TABLE_ENTRY_OFFSET_MASK;
+
+        assert(check_table_entry(entry, s->cluster_size) == 0);
+
+        if (offset == 0) {
+            if (entry & BME_TABLE_ENTRY_FLAG_ALL_ONES) {
+                bdrv_set_dirty_bitmap(bitmap, sector, count);
+            } else {
+                bdrv_dirty_bitmap_deserialize_zeroes(bitmap, sector, count,
+                                                     false);
+            }
+        } else {
+            ret = bdrv_pread(bs->file, offset, buf, s->cluster_size);
+            if (ret < 0) {
+                goto finish;
+            }
+            bdrv_dirty_bitmap_deserialize_part(bitmap, buf, sector, count,
+                                               false);
+        }
+    }
+    ret = 0;
+
+    bdrv_dirty_bitmap_deserialize_finish(bitmap);
+
+finish:
+    g_free(buf);
+
+    return ret;
+}
+
+static BdrvDirtyBitmap *load_bitmap(BlockDriverState *bs,
+                                    Qcow2Bitmap *bm, Error **errp)
+{
+    int ret;
+    uint64_t *bitmap_table = NULL;
+    uint32_t granularity;
+    BdrvDirtyBitmap *bitmap = NULL;
+
+    ret = bitmap_table_load(bs, &bm->table, &bitmap_table);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret,
+                         "Could not read bitmap_table table from image for "
+                         "bitmap '%s'", bm->name);
+        goto fail;
+    }
+
+    granularity = 1U << bm->granularity_bits;
+    bitmap = bdrv_create_dirty_bitmap(bs, granularity, bm->name, errp);
+    if (bitmap == NULL) {
+        goto fail;
+    }
+
+    ret = load_bitmap_data(bs, bitmap_table, bm->table.size, bitmap);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read bitmap '%s' from image",
+                         bm->name);
+        goto fail;
+    }
+
+    g_free(bitmap_table);
+    return bitmap;
+
+fail:
+    g_free(bitmap_table);
+    if (bitmap != NULL) {
+        bdrv_release_dirty_bitmap(bs, bitmap);
+    }
+
+    return NULL;
+}
+
+/*
+ * Bitmap List
+ */
+
+/*
+ * Bitmap List private functions
+ * Only Bitmap List knows about bitmap directory structure in Qcow2.
+ */
+
+static inline void bitmap_dir_entry_to_cpu(Qcow2BitmapDirEntry *entry)
+{
+    be64_to_cpus(&entry->bitmap_table_offset);
+    be32_to_cpus(&entry->bitmap_table_size);
+    be32_to_cpus(&entry->flags);
+    be16_to_cpus(&entry->name_size);
+    be32_to_cpus(&entry->extra_data_size);
+}
+
+static inline void bitmap_dir_entry_to_be(Qcow2BitmapDirEntry *entry)
+{
+    cpu_to_be64s(&entry->bitmap_table_offset);
+    cpu_to_be32s(&entry->bitmap_table_size);
+    cpu_to_be32s(&entry->flags);
+    cpu_to_be16s(&entry->name_size);
+    cpu_to_be32s(&entry->extra_data_size);
+}
+
+static inline int calc_dir_entry_size(size_t name_size, size_t extra_data_size)
+{
+    return ROUND_UP(sizeof(Qcow2BitmapDirEntry) + name_size + extra_data_size,
+                    8);
+}
+
+static inline int dir_entry_size(Qcow2BitmapDirEntry *entry)
+{
+    return calc_dir_entry_size(entry->name_size, entry->extra_data_size);
+}
+
+static inline const char *dir_entry_name_field(Qcow2BitmapDirEntry *entry)
+{
+    return (const char *)(entry + 1) + entry->extra_data_size;
+}
+
+static inline char *dir_entry_copy_name(Qcow2BitmapDirEntry *entry)
+{
+    const char *name_field = dir_entry_name_field(entry);
+    return g_strndup(name_field, entry->name_size);
+}
+
+static inline Qcow2BitmapDirEntry *next_dir_entry(Qcow2BitmapDirEntry *entry)
+{
+    return (Qcow2BitmapDirEntry *)((uint8_t *)entry + dir_entry_size(entry));
+}
+
+static int check_dir_entry(BlockDriverState *bs, Qcow2BitmapDirEntry *entry)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int64_t nb_sectors = bdrv_nb_sectors(bs);
+
+    if (nb_sectors < 0) {
+        return nb_sectors;
+    }
+
+    if (entry->bitmap_table_size > BME_MAX_TABLE_SIZE ||
+        entry->granularity_bits > BME_MAX_GRANULARITY_BITS ||
+        entry->granularity_bits < BME_MIN_GRANULARITY_BITS ||
+        (entry->flags & BME_RESERVED_FLAGS) ||
+        entry->type != BT_DIRTY_TRACKING_BITMAP ||
+        entry->name_size == 0 || entry->name_size > BME_MAX_NAME_SIZE ||
+        /* Extra data is not supported */
+        entry->extra_data_size != 0 ||
+        entry->bitmap_table_size == 0 ||
+        offset_into_cluster(s, entry->bitmap_table_offset)) {
+        return -EINVAL;
+    }
+
+    /* The bitmap must cover exactly the virtual disk */
+    if (entry->bitmap_table_size !=
+        get_bitmap_table_size(s, nb_sectors, entry->granularity_bits)) {
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+/*
+ * Bitmap List public functions
+ */
+
+static void bitmap_free(Qcow2Bitmap *bm)
+{
+    g_free(bm->name);
+    g_free(bm);
+}
+
+static void bitmap_list_free(Qcow2BitmapList *bm_list)
+{
+    Qcow2Bitmap *bm;
+
+    if (bm_list == NULL) {
+        return;
+    }
+
+    while ((bm = QSIMPLEQ_FIRST(bm_list)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(bm_list, entry);
+        bitmap_free(bm);
+    }
+
+    g_free(bm_list);
+}
+
+static Qcow2BitmapList *bitmap_list_new(void)
+{
+    Qcow2BitmapList *bm_list = g_new(Qcow2BitmapList, 1);
+    QSIMPLEQ_INIT(bm_list);
+
+    return bm_list;
+}
+
+/* bitmap_list_load
+ * Get bitmap list from qcow2 image. Actually reads bitmap directory,
+ * checks it and convert to bitmap list.
+ */
+static Qcow2BitmapList *bitmap_list_load(BlockDriverState *bs, uint64_t offset,
+                                         uint64_t size, Error **errp)
+{
+    int ret;
+    BDRVQcow2State *s = bs->opaque;
+    uint8_t *dir, *dir_end;
+    Qcow2BitmapDirEntry *e;
+    uint32_t nb_dir_entries = 0;
+    Qcow2BitmapList *bm_list = NULL;
+
+    if (size == 0) {
+        error_setg(errp, "Requested bitmap directory size is zero");
+        return NULL;
+    }
+
+    if (size > QCOW2_MAX_BITMAP_DIRECTORY_SIZE) {
+        error_setg(errp, "Requested bitmap directory size is too big");
+        return NULL;
+    }
+
+    dir = g_try_malloc(size);
+    if (dir == NULL) {
+        error_setg(errp, "Failed to allocate space for bitmap directory");
+        return NULL;
+    }
+    dir_end = dir + size;
+
+    ret = bdrv_pread(bs->file, offset, dir, size);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to read bitmap directory");
+        goto fail;
+    }
+
+    bm_list = bitmap_list_new();
+    for (e = (Qcow2BitmapDirEntry *)dir;
+         e < (Qcow2BitmapDirEntry *)dir_end;
+         e = next_dir_entry(e)) {
+        Qcow2Bitmap *bm;
+
+        if ((uint8_t *)(e + 1) > dir_end) {
+            goto broken_dir;
+        }
+
+        if (++nb_dir_entries > s->nb_bitmaps) {
+            error_setg(errp, "More bitmaps found than specified in header"
+                       " extension");
+            goto fail;
+        }
+        bitmap_dir_entry_to_cpu(e);
+
+        if ((uint8_t *)next_dir_entry(e) > dir_end) {
+            goto broken_dir;
+        }
+
+        ret = check_dir_entry(bs, e);
+        if (ret < 0) {
+            error_setg(errp, "Bitmap '%.*s' doesn't satisfy the constraints",
+                       e->name_size, dir_entry_name_field(e));
+            goto fail;
+        }
+
+        bm = g_new0(Qcow2Bitmap, 1);
+        bm->table.offset = e->bitmap_table_offset;
+        bm->table.size = e->bitmap_table_size;
+        bm->flags = e->flags;
+        bm->granularity_bits = e->granularity_bits;
+        bm->name = dir_entry_copy_name(e);
+        QSIMPLEQ_INSERT_TAIL(bm_list, bm, entry);
+    }
+
+    if (nb_dir_entries != s->nb_bitmaps) {
+        error_setg(errp, "Less bitmaps found than specified in header"
+                         " extension");
+        goto fail;
+    }
+
+    if ((uint8_t *)e != dir_end) {
+        goto broken_dir;
+    }
+
+    g_free(dir);
+    return bm_list;
+
+broken_dir:
+    ret = -EINVAL;
+    error_setg(errp, "Broken bitmap directory");
+
+fail:
+    g_free(dir);
+    bitmap_list_free(bm_list);
+
+    return NULL;
+}
+
+/* Serialize the bitmap list into a newly allocated bitmap directory */
+static uint8_t *bitmap_list_to_dir(Qcow2BitmapList *bm_list,
+                                   uint64_t *dir_size, uint32_t *nb_bitmaps)
+{
+    Qcow2Bitmap *bm;
+    Qcow2BitmapDirEntry *e;
+    uint8_t *dir;
+    uint64_t size = 0;
+    uint32_t n = 0;
+
+    QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+        size += calc_dir_entry_size(strlen(bm->name), 0);
+        n++;
+    }
+
+    dir = g_malloc0(size);
+    e = (Qcow2BitmapDirEntry *)dir;
+    QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+        Qcow2BitmapDirEntry *next;
+
+        e->bitmap_table_offset = bm->table.offset;
+        e->bitmap_table_size = bm->table.size;
+        e->flags = bm->flags;
+        e->type = BT_DIRTY_TRACKING_BITMAP;
+        e->granularity_bits = bm->granularity_bits;
+        e->name_size = strlen(bm->name);
+        e->extra_data_size = 0;
+        memcpy(e + 1, bm->name, e->name_size);
+
+        next = next_dir_entry(e);
+        bitmap_dir_entry_to_be(e);
+        e = next;
+    }
+
+    *dir_size = size;
+    *nb_bitmaps = n;
+    return dir;
+}
+
+/* Rewrite the bitmap directory at its current location; the size of the
+ * directory must not change */
+static int update_bitmap_dir_in_place(BlockDriverState *bs,
+                                      Qcow2BitmapList *bm_list)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint8_t *dir;
+    uint64_t dir_size;
+    uint32_t nb_bitmaps;
+    int ret;
+
+    dir = bitmap_list_to_dir(bm_list, &dir_size, &nb_bitmaps);
+    assert(dir_size == s->bitmap_directory_size);
+    assert(nb_bitmaps == s->nb_bitmaps);
+
+    ret = qcow2_pre_write_overlap_check(bs, 0, s->bitmap_directory_offset,
+                                        dir_size);
+    if (ret < 0) {
+        goto out;
+    }
+
+    ret = bdrv_pwrite(bs->file, s->bitmap_directory_offset, dir, dir_size);
+    if (ret < 0) {
+        goto out;
+    }
+
+    ret = bdrv_flush(bs->file->bs);
+
+out:
+    g_free(dir);
+    return ret;
+}
+
+int qcow2_check_bitmaps_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
+                                  void **refcount_table,
+                                  int64_t *refcount_table_size)
+{
+    int ret;
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2BitmapList *bm_list;
+    Qcow2Bitmap *bm;
+
+    if (s->nb_bitmaps == 0) {
+        return 0;
+    }
+
+    ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table,
+                                   refcount_table_size,
+                                   s->bitmap_directory_offset,
+                                   s->bitmap_directory_size);
+    if (ret < 0) {
+        return ret;
+    }
+
+    bm_list = bitmap_list_load(bs, s->bitmap_directory_offset,
+                               s->bitmap_directory_size, NULL);
+    if (bm_list == NULL) {
+        res->corruptions++;
+        return -EINVAL;
+    }
+
+    QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+        uint64_t *bitmap_table = NULL;
+        uint32_t i;
+
+        ret = qcow2_inc_refcounts_imrt(bs, res,
+                                       refcount_table, refcount_table_size,
+                                       bm->table.offset,
+                                       bm->table.size * sizeof(uint64_t));
+        if (ret < 0) {
+            goto out;
+        }
+
+        ret = bitmap_table_load(bs, &bm->table, &bitmap_table);
+        if (ret < 0) {
+            res->corruptions++;
+            goto out;
+        }
+
+        for (i = 0; i < bm->table.size; ++i) {
+            uint64_t entry = bitmap_table[i];
+            uint64_t offset = entry & BME_TABLE_ENTRY_OFFSET_MASK;
+
+            if (offset == 0) {
+                continue;
+            }
+
+            ret = qcow2_inc_refcounts_imrt(bs, res,
+                                           refcount_table, refcount_table_size,
+                                           offset, s->cluster_size);
+            if (ret < 0) {
+                g_free(bitmap_table);
+                goto out;
+            }
+        }
+
+        g_free(bitmap_table);
+    }
+
+out:
+    bitmap_list_free(bm_list);
+
+    return ret;
+}
+
+/* qcow2_load_dirty_bitmaps()
+ * Load the bitmaps stored in the image as named dirty bitmaps of @bs and, if
+ * the image is writable, mark them in use until they are stored again on
+ * close.  Bitmaps which are already marked in use were not stored cleanly
+ * and are discarded.
+ */
+void qcow2_load_dirty_bitmaps(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2BitmapList *bm_list;
+    Qcow2Bitmap *bm;
+    GSList *created = NULL, *l;
+    bool need_update = false;
+    int ret;
+
+    if (s->nb_bitmaps == 0) {
+        /* No bitmaps - nothing to do */
+        return;
+    }
+
+    bm_list = bitmap_list_load(bs, s->bitmap_directory_offset,
+                               s->bitmap_directory_size, errp);
+    if (bm_list == NULL) {
+        return;
+    }
+
+    QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+        BdrvDirtyBitmap *bitmap;
+
+        if (bm->flags & BME_FLAG_IN_USE) {
+            error_report("WARNING: bitmap '%s' was not stored cleanly and "
+                         "is discarded; a full backup is needed", bm->name);
+            continue;
+        }
+
+        bitmap = bdrv_find_dirty_bitmap(bs, bm->name);
+        if (bitmap == NULL) {
+            bitmap = load_bitmap(bs, bm, errp);
+            if (bitmap == NULL) {
+                goto fail;
+            }
+            created = g_slist_append(created, bitmap);
+
+            if (!(bm->flags & BME_FLAG_AUTO)) {
+                bdrv_disable_dirty_bitmap(bitmap);
+            }
+        }
+        bdrv_dirty_bitmap_set_persistance(bitmap, true);
+
+        if (can_write(bs)) {
+            bm->flags |= BME_FLAG_IN_USE;
+            need_update = true;
+        }
+    }
+
+    if (need_update) {
+        ret = update_bitmap_dir_in_place(bs, bm_list);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Can't update bitmap directory");
+            goto fail;
+        }
+    }
+
+    g_slist_free(created);
+    bitmap_list_free(bm_list);
+    return;
+
+fail:
+    for (l = created; l; l = l->next) {
+        bdrv_release_dirty_bitmap(bs, l->data);
+    }
+    g_slist_free(created);
+    bitmap_list_free(bm_list);
+}
+
+/* Write the bitmap data, skipping clusters which are all zeroes, and return
+ * the table that describes it.  On failure, the clusters that were already
+ * allocated are freed again. */
+static uint64_t *store_bitmap_data(BlockDriverState *bs,
+                                   BdrvDirtyBitmap *bitmap,
+                                   uint32_t *bitmap_table_size, Error **errp)
+{
+    int ret;
+    BDRVQcow2State *s = bs->opaque;
+    int64_t sector;
+    uint64_t sbc;
+    uint64_t bm_size = bdrv_dirty_bitmap_size(bitmap);
+    const char *bm_name = bdrv_dirty_bitmap_name(bitmap);
+    uint8_t *buf = NULL;
+    uint64_t *tb;
+    uint64_t i, tb_size =
+            get_bitmap_table_size(s, bm_size,
+                                  ctz32(bdrv_dirty_bitmap_granularity(bitmap)));
+
+    if (tb_size > BME_MAX_TABLE_SIZE) {
+        error_setg(errp, "Bitmap '%s' is too big", bm_name);
+        return NULL;
+    }
+
+    tb = g_try_new0(uint64_t, tb_size);
+    if (tb == NULL) {
+        error_setg(errp, "No memory");
+        return NULL;
+    }
+
+    sbc = sectors_covered_by_bitmap_cluster(
+              s, ctz32(bdrv_dirty_bitmap_granularity(bitmap)));
+    assert(DIV_ROUND_UP(bm_size, sbc) == tb_size);
+
+    buf = g_malloc(s->cluster_size);
+    for (i = 0, sector = 0; i < tb_size; ++i, sector += sbc) {
+        uint64_t count = MIN(bm_size - sector, sbc);
+        int64_t off;
+
+        memset(buf, 0, s->cluster_size);
+        bdrv_dirty_bitmap_serialize_part(bitmap, buf, sector, count);
+        if (buffer_is_zero(buf, s->cluster_size)) {
+            continue;
+        }
+
+        off = qcow2_alloc_clusters(bs, s->cluster_size);
+        if (off < 0) {
+            error_setg_errno(errp, -off,
+                             "Failed to allocate clusters for bitmap '%s'",
+                             bm_name);
+            goto fail;
+        }
+        tb[i] = off;
+
+        ret = qcow2_pre_write_overlap_check(bs, 0, off, s->cluster_size);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Qcow2 overlap check failed");
+            goto fail;
+        }
+
+        ret = bdrv_pwrite(bs->file, off, buf, s->cluster_size);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Failed to write bitmap '%s' to file",
+                             bm_name);
+            goto fail;
+        }
+    }
+
+    *bitmap_table_size = tb_size;
+    g_free(buf);
+
+    return tb;
+
+fail:
+    for (i = 0; i < tb_size; ++i) {
+        if (tb[i]) {
+            qcow2_free_clusters(bs, tb[i], s->cluster_size,
+                                QCOW2_DISCARD_OTHER);
+        }
+    }
+    g_free(buf);
+    g_free(tb);
+
+    return NULL;
+}
+
+/* store_bitmap()
+ * Store the data and the table of @bitmap and describe them in @bm.
+ */
+static int store_bitmap(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
+                        Qcow2Bitmap *bm, Error **errp)
+{
+    int ret;
+    BDRVQcow2State *s = bs->opaque;
+    int64_t tb_offset;
+    uint32_t tb_size;
+    uint64_t *tb;
+    uint32_t i;
+
+    tb = store_bitmap_data(bs, bitmap, &tb_size, errp);
+    if (tb == NULL) {
+        return -EINVAL;
+    }
+
+    assert(tb_size <= BME_MAX_TABLE_SIZE);
+    tb_offset = qcow2_alloc_clusters(bs, tb_size * sizeof(tb[0]));
+    if (tb_offset < 0) {
+        error_setg_errno(errp, -tb_offset, "Failed to allocate clusters");
+        ret = tb_offset;
+        goto fail;
+    }
+
+    ret = qcow2_pre_write_overlap_check(bs, 0, tb_offset,
+                                        tb_size * sizeof(tb[0]));
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Qcow2 overlap check failed");
+        goto fail;
+    }
+
+    for (i = 0; i < tb_size; ++i) {
+        cpu_to_be64s(&tb[i]);
+    }
+    ret = bdrv_pwrite(bs->file, tb_offset, tb, tb_size * sizeof(tb[0]));
+    for (i = 0; i < tb_size; ++i) {
+        be64_to_cpus(&tb[i]);
+    }
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to write bitmap '%s' to file",
+                         bm->name);
+        goto fail;
+    }
+
+    g_free(tb);
+
+    bm->table.offset = tb_offset;
+    bm->table.size = tb_size;
+
+    return 0;
+
+fail:
+    for (i = 0; i < tb_size; ++i) {
+        if (tb[i]) {
+            qcow2_free_clusters(bs, tb[i], s->cluster_size,
+                                QCOW2_DISCARD_OTHER);
+        }
+    }
+    if (tb_offset > 0) {
+        qcow2_free_clusters(bs, tb_offset, tb_size * sizeof(tb[0]),
+                            QCOW2_DISCARD_OTHER);
+    }
+    g_free(tb);
+
+    return ret;
+}
+
+/* qcow2_store_persistent_dirty_bitmaps()
+ * Replace the bitmaps stored in the image with the persistent dirty bitmaps
+ * of @bs.  The new bitmaps and directory are written to newly allocated
+ * clusters and only then referenced by the header, so the old bitmaps stay
+ * valid until the header update has completed.
+ */
+int qcow2_store_persistent_dirty_bitmaps(BlockDriverState *bs, Error **errp)
+{
+    BdrvDirtyBitmap *bitmap;
+    BDRVQcow2State *s = bs->opaque;
+    uint32_t new_nb_bitmaps;
+    uint64_t new_dir_size = 0;
+    int64_t new_dir_offset = 0;
+    uint32_t old_nb_bitmaps = s->nb_bitmaps;
+    uint64_t old_dir_size = s->bitmap_directory_size;
+    uint64_t old_dir_offset = s->bitmap_directory_offset;
+    uint64_t old_autoclear_features = s->autoclear_features;
+    Qcow2BitmapList *old_list = NULL;
+    Qcow2BitmapList *new_list;
+    Qcow2Bitmap *bm;
+    uint8_t *dir = NULL;
+    int ret;
+
+    if (!can_write(bs)) {
+        return 0;
+    }
+
+    if (s->nb_bitmaps == 0 && !bdrv_has_persistent_dirty_bitmap(bs)) {
+        /* No bitmaps - nothing to do */
+        return 0;
+    }
+
+    if (s->nb_bitmaps > 0) {
+        old_list = bitmap_list_load(bs, s->bitmap_directory_offset,
+                                    s->bitmap_directory_size, errp);
+        if (old_list == NULL) {
+            return -EINVAL;
+        }
+    }
+
+    new_list = bitmap_list_new();
+    for (bitmap = bdrv_dirty_bitmap_next(bs, NULL); bitmap != NULL;
+         bitmap = bdrv_dirty_bitmap_next(bs, bitmap)) {
+        const char *name = bdrv_dirty_bitmap_name(bitmap);
+
+        if (!bdrv_dirty_bitmap_get_persistance(bitmap) || name == NULL) {
+            continue;
+        }
+
+        bm = g_new0(Qcow2Bitmap, 1);
+        bm->name = g_strdup(name);
+        bm->granularity_bits = ctz32(bdrv_dirty_bitmap_granularity(bitmap));
+        bm->flags = bdrv_dirty_bitmap_enabled(bitmap) ? BME_FLAG_AUTO : 0;
+        QSIMPLEQ_INSERT_TAIL(new_list, bm, entry);
+
+        ret = store_bitmap(bs, bitmap, bm, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    if (!QSIMPLEQ_EMPTY(new_list)) {
+        dir = bitmap_list_to_dir(new_list, &new_dir_size, &new_nb_bitmaps);
+        if (new_dir_size > QCOW2_MAX_BITMAP_DIRECTORY_SIZE) {
+            error_setg(errp, "Bitmap directory is too large");
+            ret = -EINVAL;
+            goto fail;
+        }
+
+        new_dir_offset = qcow2_alloc_clusters(bs, new_dir_size);
+        if (new_dir_offset < 0) {
+            error_setg_errno(errp, -new_dir_offset,
+                             "Failed to allocate bitmap directory");
+            ret = new_dir_offset;
+            new_dir_offset = 0;
+            goto fail;
+        }
+
+        ret = qcow2_pre_write_overlap_check(bs, 0, new_dir_offset,
+                                            new_dir_size);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Qcow2 overlap check failed");
+            goto fail;
+        }
+
+        ret = bdrv_pwrite(bs->file, new_dir_offset, dir, new_dir_size);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Failed to write bitmap directory");
+            goto fail;
+        }
+    } else {
+        new_nb_bitmaps = 0;
+    }
+
+    /* The new clusters and their refcounts must be on disk before the header
+     * points to them */
+    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to flush refcounts");
+        goto fail;
+    }
+
+    s->nb_bitmaps = new_nb_bitmaps;
+    s->bitmap_directory_size = new_dir_size;
+    s->bitmap_directory_offset = new_dir_offset;
+    if (new_nb_bitmaps > 0) {
+        s->autoclear_features |= QCOW2_AUTOCLEAR_BITMAPS;
+    } else {
+        s->autoclear_features &= ~QCOW2_AUTOCLEAR_BITMAPS;
+    }
+
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to update qcow2 header");
+        s->nb_bitmaps = old_nb_bitmaps;
+        s->bitmap_directory_size = old_dir_size;
+        s->bitmap_directory_offset = old_dir_offset;
+        s->autoclear_features = old_autoclear_features;
+        goto fail;
+    }
+
+    /* The old bitmaps are not referenced any more */
+    if (old_list != NULL) {
+        QSIMPLEQ_FOREACH(bm, old_list, entry) {
+            free_bitmap_clusters(bs, &bm->table);
+        }
+        qcow2_free_clusters(bs, old_dir_offset, old_dir_size,
+                            QCOW2_DISCARD_OTHER);
+    }
+
+    g_free(dir);
+    bitmap_list_free(old_list);
+    bitmap_list_free(new_list);
+
+    return 0;
+
+fail:
+    if (new_dir_offset > 0) {
+        qcow2_free_clusters(bs, new_dir_offset, new_dir_size,
+                            QCOW2_DISCARD_OTHER);
+    }
+    QSIMPLEQ_FOREACH(bm, new_list, entry) {
+        if (bm->table.offset) {
+            free_bitmap_clusters(bs, &bm->table);
+        }
+    }
+
+    g_free(dir);
+    bitmap_list_free(old_list);
+    bitmap_list_free(new_list);
+
+    return ret;
+}
+
+bool qcow2_can_store_new_dirty_bitmap(BlockDriverState *bs,
+                                      const char *name,
+                                      uint32_t granularity,
+                                      Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    BdrvDirtyBitmap *bitmap;
+    uint64_t dir_size;
+    uint32_t nb_bitmaps = 0;
+    int granularity_bits = ctz32(granularity);
+    int64_t nb_sectors;
+
+    if (s->qcow_version < 3) {
+        /* Without autoclear_features, we would always have to assume
+         * that a program without persistent dirty bitmap support has
+         * accessed this qcow2 file when opening it, and would thus
+         * have to drop all dirty bitmaps (defeating their purpose).
+         */
+        error_setg(errp, "Cannot store dirty bitmaps in qcow2 v2 files");
+        return false;
+    }
+
+    if (strlen(name) > BME_MAX_NAME_SIZE) {
+        error_setg(errp, "Bitmap name '%s' is longer than %d bytes",
+                   name, BME_MAX_NAME_SIZE);
+        return false;
+    }
+
+    if (granularity_bits > BME_MAX_GRANULARITY_BITS ||
+        granularity_bits < BME_MIN_GRANULARITY_BITS) {
+        error_setg(errp, "Granularity of bitmap '%s' must be between "
+                   "%llu and %llu bytes", name,
+                   1ULL << BME_MIN_GRANULARITY_BITS,
+                   1ULL << BME_MAX_GRANULARITY_BITS);
+        return false;
+    }
+
+    nb_sectors = bdrv_nb_sectors(bs);
+    if (nb_sectors < 0) {
+        error_setg_errno(errp, -nb_sectors, "Cannot get image size");
+        return false;
+    }
+    if (get_bitmap_table_size(s, nb_sectors, granularity_bits) >
+        BME_MAX_TABLE_SIZE) {
+        error_setg(errp, "Bitmap '%s' would be too big for this image; "
+                   "increase the granularity", name);
+        return false;
+    }
+
+    dir_size = calc_dir_entry_size(strlen(name), 0);
+    for (bitmap = bdrv_dirty_bitmap_next(bs, NULL); bitmap != NULL;
+         bitmap = bdrv_dirty_bitmap_next(bs, bitmap)) {
+        const char *bm_name = bdrv_dirty_bitmap_name(bitmap);
+
+        if (bdrv_dirty_bitmap_get_persistance(bitmap) && bm_name) {
+            dir_size += calc_dir_entry_size(strlen(bm_name), 0);
+            nb_bitmaps++;
+        }
+    }
+
+    if (nb_bitmaps >= QCOW2_MAX_BITMAPS) {
+        error_setg(errp, "Cannot store more than %d bitmaps in an image",
+                   QCOW2_MAX_BITMAPS);
+        return false;
+    }
+
+    if (dir_size > QCOW2_MAX_BITMAP_DIRECTORY_SIZE) {
+        error_setg(errp, "Bitmap directory would be too large for '%s'",
+                   name);
+        return false;
+    }
+
+    return true;
+}
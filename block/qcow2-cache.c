@@ -27,6 +27,7 @@
 #include "block/block_int.h"
 #include "qemu-common.h"
 #include "qcow2.h"
+#include "qemu/host-utils.h"
 #include "trace.h"
 
 typedef struct Qcow2CachedTable {
@@ -34,8 +35,17 @@ typedef struct Qcow2CachedTable {
     uint64_t lru_counter;
     int      ref;
     bool     dirty;
+    /* Next entry in the same hash bucket, or -1 */
+    int      hash_next;
+    /* Link in Qcow2Cache.lru while ref == 0 */
+    QTAILQ_ENTRY(Qcow2CachedTable) lru;
 } Qcow2CachedTable;
 
+/*
+ * Cached tables are found through a hash table on their offset, and the
+ * unreferenced ones are kept on a list in LRU order, so neither a lookup
+ * nor picking a table to evict has to scan the whole cache.
+ */
 struct Qcow2Cache {
     Qcow2CachedTable       *entries;
     struct Qcow2Cache      *depends;
@@ -44,6 +54,9 @@ struct Qcow2Cache {
     void                   *table_array;
     uint64_t                lru_counter;
     uint64_t                cache_clean_lru_counter;
+    int                    *buckets;
+    int                     hash_bits;
+    QTAILQ_HEAD(, Qcow2CachedTable) lru;
 };
 
 static inline void *qcow2_cache_get_table_addr(BlockDriverState *bs,
@@ -79,6 +92,60 @@ static void qcow2_cache_table_release(BlockDriverState *bs, Qcow2Cache *c,
 #endif
 }
 
+static inline int qcow2_cache_hash(BlockDriverState *bs, Qcow2Cache *c,
+                                   int64_t offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t h = (offset >> s->cluster_bits) * 0x9e3779b97f4a7c15ULL;
+
+    return c->hash_bits ? h >> (64 - c->hash_bits) : 0;
+}
+
+static void qcow2_cache_set_offset(BlockDriverState *bs, Qcow2Cache *c,
+                                   int i, int64_t offset)
+{
+    Qcow2CachedTable *t = &c->entries[i];
+    int *p;
+
+    if (t->offset) {
+        p = &c->buckets[qcow2_cache_hash(bs, c, t->offset)];
+        while (*p != i) {
+            p = &c->entries[*p].hash_next;
+        }
+        *p = t->hash_next;
+    }
+
+    t->offset = offset;
+    if (offset) {
+        p = &c->buckets[qcow2_cache_hash(bs, c, offset)];
+        t->hash_next = *p;
+        *p = i;
+    }
+}
+
+static int qcow2_cache_lookup(BlockDriverState *bs, Qcow2Cache *c,
+                              int64_t offset)
+{
+    int i = c->buckets[qcow2_cache_hash(bs, c, offset)];
+
+    while (i >= 0 && c->entries[i].offset != offset) {
+        i = c->entries[i].hash_next;
+    }
+    return i;
+}
+
+/* Forget the table in entry I, making it the first to be reused */
+static void qcow2_cache_entry_clear(BlockDriverState *bs, Qcow2Cache *c, int i)
+{
+    Qcow2CachedTable *t = &c->entries[i];
+
+    assert(t->ref == 0);
+    qcow2_cache_set_offset(bs, c, i, 0);
+    t->lru_counter = 0;
+    QTAILQ_REMOVE(&c->lru, t, lru);
+    QTAILQ_INSERT_HEAD(&c->lru, t, lru);
+}
+
 static inline bool can_clean_entry(Qcow2Cache *c, int i)
 {
     Qcow2CachedTable *t = &c->entries[i];
@@ -99,8 +166,7 @@ void qcow2_cache_clean_unused(BlockDriverState *bs, Qcow2Cache *c)
 
         /* And count how many we can clean in a row */
         while (i < c->size && can_clean_entry(c, i)) {
-            c->entries[i].offset = 0;
-            c->entries[i].lru_counter = 0;
+            qcow2_cache_entry_clear(bs, c, i);
             i++;
             to_clean++;
         }
@@ -117,18 +183,28 @@ Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables)
 {
     BDRVQcow2State *s = bs->opaque;
     Qcow2Cache *c;
+    int i;
 
     c = g_new0(Qcow2Cache, 1);
     c->size = num_tables;
+    c->hash_bits = ctz64(pow2ceil(num_tables));
     c->entries = g_try_new0(Qcow2CachedTable, num_tables);
+    c->buckets = g_try_new(int, 1 << c->hash_bits);
     c->table_array = qemu_try_blockalign(bs->file->bs,
                                          (size_t) num_tables * s->cluster_size);
 
-    if (!c->entries || !c->table_array) {
+    if (!c->entries || !c->buckets || !c->table_array) {
         qemu_vfree(c->table_array);
+        g_free(c->buckets);
         g_free(c->entries);
         g_free(c);
-        c = NULL;
+        return NULL;
+    }
+
+    memset(c->buckets, -1, sizeof(int) << c->hash_bits);
+    QTAILQ_INIT(&c->lru);
+    for (i = 0; i < num_tables; i++) {
+        QTAILQ_INSERT_TAIL(&c->lru, &c->entries[i], lru);
     }
 
     return c;
@@ -143,6 +219,7 @@ int qcow2_cache_destroy(BlockDriverState *bs, Qcow2Cache *c)
     }
 
     qemu_vfree(c->table_array);
+    g_free(c->buckets);
     g_free(c->entries);
     g_free(c);
 
@@ -292,9 +369,7 @@ int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
     }
 
     for (i = 0; i < c->size; i++) {
-        assert(c->entries[i].ref == 0);
-        c->entries[i].offset = 0;
-        c->entries[i].lru_counter = 0;
+        qcow2_cache_entry_clear(bs, c, i);
     }
 
     qcow2_cache_table_release(bs, c, 0, c->size);
@@ -310,37 +385,24 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     BDRVQcow2State *s = bs->opaque;
     int i;
     int ret;
-    int lookup_index;
-    uint64_t min_lru_counter = UINT64_MAX;
-    int min_lru_index = -1;
 
     trace_qcow2_cache_get(qemu_coroutine_self(), c == s->l2_table_cache,
                           offset, read_from_disk);
 
     /* Check if the table is already cached */
-    i = lookup_index = (offset / s->cluster_size * 4) % c->size;
-    do {
-        const Qcow2CachedTable *t = &c->entries[i];
-        if (t->offset == offset) {
-            goto found;
-        }
-        if (t->ref == 0 && t->lru_counter < min_lru_counter) {
-            min_lru_counter = t->lru_counter;
-            min_lru_index = i;
-        }
-        if (++i == c->size) {
-            i = 0;
-        }
-    } while (i != lookup_index);
+    i = qcow2_cache_lookup(bs, c, offset);
+    if (i >= 0) {
+        goto found;
+    }
 
-    if (min_lru_index == -1) {
+    if (QTAILQ_EMPTY(&c->lru)) {
         /* This can't happen in current synchronous code, but leave the check
          * here as a reminder for whoever starts using AIO with the cache */
         abort();
     }
 
-    /* Cache miss: write a table back and replace it */
-    i = min_lru_index;
+    /* Cache miss: write the least recently used table back and replace it */
+    i = QTAILQ_FIRST(&c->lru) - c->entries;
     trace_qcow2_cache_get_replace_entry(qemu_coroutine_self(),
                                         c == s->l2_table_cache, i);
 
@@ -351,7 +413,7 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
 
     trace_qcow2_cache_get_read(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
-    c->entries[i].offset = 0;
+    qcow2_cache_set_offset(bs, c, i, 0);
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
@@ -365,11 +427,13 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
         }
     }
 
-    c->entries[i].offset = offset;
+    qcow2_cache_set_offset(bs, c, i, offset);
 
     /* And return the right table */
 found:
-    c->entries[i].ref++;
+    if (c->entries[i].ref++ == 0) {
+        QTAILQ_REMOVE(&c->lru, &c->entries[i], lru);
+    }
     *table = qcow2_cache_get_table_addr(bs, c, i);
 
     trace_qcow2_cache_get_done(qemu_coroutine_self(),
@@ -399,6 +463,7 @@ void qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table)
 
     if (c->entries[i].ref == 0) {
         c->entries[i].lru_counter = ++c->lru_counter;
+        QTAILQ_INSERT_TAIL(&c->lru, &c->entries[i], lru);
     }
 
     assert(c->entries[i].ref >= 0);
@@ -29,6 +29,7 @@
 #include "qemu-common.h"
 #include "block/block_int.h"
 #include "block/qcow2.h"
+#include "block/thread-pool.h"
 #include "qemu/bswap.h"
 #include "trace.h"
 
@@ -346,7 +347,7 @@ static int count_contiguous_clusters_by_type(int nb_clusters,
 /* The crypt function is compatible with the linux cryptoloop
    algorithm for < 4 GB images. NOTE: out_buf == in_buf is
    supported */
-int qcow2_encrypt_sectors(BDRVQcow2State *s, int64_t sector_num,
+int qcow2_encrypt_sectors(QCryptoCipher *cipher, int64_t sector_num,
                           uint8_t *out_buf, const uint8_t *in_buf,
                           int nb_sectors, bool enc,
                           Error **errp)
@@ -361,19 +362,19 @@ int qcow2_encrypt_sectors(BDRVQcow2State *s, int64_t sector_num,
     for(i = 0; i < nb_sectors; i++) {
         ivec.ll[0] = cpu_to_le64(sector_num);
         ivec.ll[1] = 0;
-        if (qcrypto_cipher_setiv(s->cipher,
+        if (qcrypto_cipher_setiv(cipher,
                                  ivec.b, G_N_ELEMENTS(ivec.b),
                                  errp) < 0) {
             return -1;
         }
         if (enc) {
-            ret = qcrypto_cipher_encrypt(s->cipher,
+            ret = qcrypto_cipher_encrypt(cipher,
                                          in_buf,
                                          out_buf,
                                          512,
                                          errp);
         } else {
-            ret = qcrypto_cipher_decrypt(s->cipher,
+            ret = qcrypto_cipher_decrypt(cipher,
                                          in_buf,
                                          out_buf,
                                          512,
@@ -389,13 +390,127 @@ int qcow2_encrypt_sectors(BDRVQcow2State *s, int64_t sector_num,
     return 0;
 }
 
+typedef struct Qcow2CryptJobs {
+    Coroutine *co;
+    int in_flight;
+    int ret;
+} Qcow2CryptJobs;
+
+typedef struct Qcow2CryptData {
+    QCryptoCipher *cipher;
+    int64_t sector_num;
+    uint8_t *buf;
+    int nb_sectors;
+    bool enc;
+} Qcow2CryptData;
+
+static int qcow2_crypt(void *opaque)
+{
+    Qcow2CryptData *data = opaque;
+    Error *err = NULL;
+    int ret;
+
+    ret = qcow2_encrypt_sectors(data->cipher, data->sector_num, data->buf,
+                                data->buf, data->nb_sectors, data->enc, &err);
+    error_free(err);
+    return ret < 0 ? -EIO : 0;
+}
+
+static void qcow2_crypt_cb(void *opaque, int ret)
+{
+    Qcow2CryptJobs *jobs = opaque;
+
+    if (ret < 0) {
+        jobs->ret = ret;
+    }
+    if (--jobs->in_flight == 0) {
+        qemu_coroutine_enter(jobs->co);
+    }
+}
+
+/*
+ * Encrypt or decrypt a buffer in place in the thread pool, so that the
+ * event loop keeps running other requests meanwhile.  Large buffers are
+ * split at cluster boundaries into up to QCOW2_CRYPT_JOBS jobs that run
+ * in parallel, each with its own cipher.
+ */
+int coroutine_fn qcow2_co_crypt(BlockDriverState *bs, int64_t sector_num,
+                                uint8_t *buf, int nb_sectors, bool enc)
+{
+    BDRVQcow2State *s = bs->opaque;
+    ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    Qcow2CryptData data[QCOW2_CRYPT_JOBS];
+    Qcow2CryptJobs jobs = { .co = qemu_coroutine_self() };
+    int job_sectors, n, i;
+
+    assert(s->cipher);
+
+    job_sectors = DIV_ROUND_UP(nb_sectors, QCOW2_CRYPT_JOBS);
+    job_sectors = ROUND_UP(job_sectors, s->cluster_sectors);
+
+    qemu_co_mutex_lock(&s->crypt_lock);
+    for (i = 0; nb_sectors > 0; i++) {
+        n = MIN(nb_sectors, job_sectors);
+        data[i] = (Qcow2CryptData) {
+            .cipher     = i ? s->job_ciphers[i - 1] : s->cipher,
+            .sector_num = sector_num,
+            .buf        = buf,
+            .nb_sectors = n,
+            .enc        = enc,
+        };
+        jobs.in_flight++;
+        thread_pool_submit_aio(pool, qcow2_crypt, &data[i],
+                               qcow2_crypt_cb, &jobs);
+
+        sector_num += n;
+        buf += n * BDRV_SECTOR_SIZE;
+        nb_sectors -= n;
+    }
+
+    /* Completions run from a bottom half, so none has happened yet */
+    if (jobs.in_flight) {
+        qemu_coroutine_yield();
+    }
+    qemu_co_mutex_unlock(&s->crypt_lock);
+
+    return jobs.ret;
+}
+
+/* Read the guest's view of a COW region into BUF */
+static int coroutine_fn do_perform_cow_read(BlockDriverState *bs,
+                                            uint64_t src_cluster_offset,
+                                            int offset_in_cluster,
+                                            void *buf, int bytes)
+{
+    QEMUIOVector qiov;
+    struct iovec iov = { .iov_base = buf, .iov_len = bytes };
+
+    if (bytes == 0) {
+        return 0;
+    }
+
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    BLKDBG_EVENT(bs->file, BLKDBG_COW_READ);
+
+    if (!bs->drv) {
+        return -ENOMEDIUM;
+    }
+
+    /* Call .bdrv_co_readv() directly instead of using the public block-layer
+     * interface.  This avoids double I/O throttling and request tracking,
+     * which can lead to deadlock when block layer copy-on-read is enabled.
+     */
+    return bs->drv->bdrv_co_preadv(bs, src_cluster_offset + offset_in_cluster,
+                                   bytes, &qiov, 0);
+}
+
 static int coroutine_fn do_perform_cow(BlockDriverState *bs,
                                        uint64_t src_cluster_offset,
                                        uint64_t cluster_offset,
                                        int offset_in_cluster,
                                        int bytes)
 {
-    BDRVQcow2State *s = bs->opaque;
     QEMUIOVector qiov;
     struct iovec iov;
     int ret;
@@ -408,34 +523,20 @@ static int coroutine_fn do_perform_cow(BlockDriverState *bs,
 
     qemu_iovec_init_external(&qiov, &iov, 1);
 
-    BLKDBG_EVENT(bs->file, BLKDBG_COW_READ);
-
-    if (!bs->drv) {
-        ret = -ENOMEDIUM;
-        goto out;
-    }
-
-    /* Call .bdrv_co_readv() directly instead of using the public block-layer
-     * interface.  This avoids double I/O throttling and request tracking,
-     * which can lead to deadlock when block layer copy-on-read is enabled.
-     */
-    ret = bs->drv->bdrv_co_preadv(bs, src_cluster_offset + offset_in_cluster,
-                                  bytes, &qiov, 0);
+    ret = do_perform_cow_read(bs, src_cluster_offset, offset_in_cluster,
+                              iov.iov_base, bytes);
     if (ret < 0) {
         goto out;
     }
 
     if (bs->encrypted) {
-        Error *err = NULL;
         int64_t sector = (cluster_offset + offset_in_cluster)
                          >> BDRV_SECTOR_BITS;
-        assert(s->cipher);
         assert((offset_in_cluster & ~BDRV_SECTOR_MASK) == 0);
         assert((bytes & ~BDRV_SECTOR_MASK) == 0);
-        if (qcow2_encrypt_sectors(s, sector, iov.iov_base, iov.iov_base,
-                                  bytes >> BDRV_SECTOR_BITS, true, &err) < 0) {
-            ret = -EIO;
-            error_free(err);
+        ret = qcow2_co_crypt(bs, sector, iov.iov_base,
+                             bytes >> BDRV_SECTOR_BITS, true);
+        if (ret < 0) {
             goto out;
         }
     }
@@ -748,12 +849,15 @@ static int perform_cow(BlockDriverState *bs, QCowL2Meta *m, Qcow2COWRegion *r)
         return 0;
     }
 
-    qemu_co_mutex_unlock(&s->lock);
-    ret = do_perform_cow(bs, m->offset, m->alloc_offset, r->offset, r->nb_bytes);
-    qemu_co_mutex_lock(&s->lock);
+    if (!m->cow_done) {
+        qemu_co_mutex_unlock(&s->lock);
+        ret = do_perform_cow(bs, m->offset, m->alloc_offset,
+                             r->offset, r->nb_bytes);
+        qemu_co_mutex_lock(&s->lock);
 
-    if (ret < 0) {
-        return ret;
+        if (ret < 0) {
+            return ret;
+        }
     }
 
     /*
@@ -766,6 +870,111 @@ static int perform_cow(BlockDriverState *bs, QCowL2Meta *m, Qcow2COWRegion *r)
     return 0;
 }
 
+/*
+ * Write the COW regions of M together with DATA, the guest data for the
+ * range between them, as a single request.
+ */
+static int coroutine_fn do_perform_cow_merged(BlockDriverState *bs,
+                                              QCowL2Meta *m,
+                                              QEMUIOVector *data)
+{
+    Qcow2COWRegion *start = &m->cow_start;
+    Qcow2COWRegion *end = &m->cow_end;
+    QEMUIOVector qiov;
+    uint8_t *buf;
+    int ret;
+
+    buf = qemu_try_blockalign(bs, start->nb_bytes + end->nb_bytes);
+    if (buf == NULL) {
+        return -ENOMEM;
+    }
+    qemu_iovec_init(&qiov, data->niov + 2);
+
+    ret = do_perform_cow_read(bs, m->offset, start->offset,
+                              buf, start->nb_bytes);
+    if (ret < 0) {
+        goto out;
+    }
+    ret = do_perform_cow_read(bs, m->offset, end->offset,
+                              buf + start->nb_bytes, end->nb_bytes);
+    if (ret < 0) {
+        goto out;
+    }
+
+    if (start->nb_bytes) {
+        qemu_iovec_add(&qiov, buf, start->nb_bytes);
+    }
+    qemu_iovec_concat(&qiov, data, 0, data->size);
+    if (end->nb_bytes) {
+        qemu_iovec_add(&qiov, buf + start->nb_bytes, end->nb_bytes);
+    }
+
+    ret = qcow2_pre_write_overlap_check(bs, 0,
+            m->alloc_offset + start->offset, qiov.size);
+    if (ret < 0) {
+        goto out;
+    }
+
+    BLKDBG_EVENT(bs->file, BLKDBG_WRITE_AIO);
+    ret = bdrv_co_pwritev(bs->file, m->alloc_offset + start->offset,
+                          qiov.size, &qiov, 0);
+out:
+    qemu_iovec_destroy(&qiov);
+    qemu_vfree(buf);
+    return ret;
+}
+
+/*
+ * Copy the unmodified parts of the clusters allocated for M.  This is called
+ * without s->lock, together with the guest data write, so that allocating
+ * writes do their COW in parallel instead of each taking the lock for it in
+ * qcow2_alloc_cluster_link_l2().  Other requests touching the same clusters
+ * still wait for M through handle_dependencies().
+ *
+ * If DATA, the guest data written at GUEST_OFFSET, fills exactly the gap
+ * between the COW regions, it is written along with them in one request.
+ *
+ * Returns 1 if DATA was written, 0 if the caller still has to write it,
+ * -errno on failure.
+ */
+int coroutine_fn qcow2_alloc_cluster_cow(BlockDriverState *bs, QCowL2Meta *m,
+                                         uint64_t guest_offset,
+                                         QEMUIOVector *data)
+{
+    int ret;
+
+    if (data && !bs->encrypted &&
+        (m->cow_start.nb_bytes || m->cow_end.nb_bytes) &&
+        guest_offset == l2meta_cow_start(m) + m->cow_start.nb_bytes &&
+        guest_offset + data->size == m->offset + m->cow_end.offset) {
+        ret = do_perform_cow_merged(bs, m, data);
+        if (ret < 0) {
+            return ret;
+        }
+        m->cow_done = true;
+        return 1;
+    }
+
+    if (m->cow_start.nb_bytes) {
+        ret = do_perform_cow(bs, m->offset, m->alloc_offset,
+                             m->cow_start.offset, m->cow_start.nb_bytes);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    if (m->cow_end.nb_bytes) {
+        ret = do_perform_cow(bs, m->offset, m->alloc_offset,
+                             m->cow_end.offset, m->cow_end.nb_bytes);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    m->cow_done = true;
+    return 0;
+}
+
 int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
 {
     BDRVQcow2State *s = bs->opaque;
@@ -1403,9 +1612,25 @@ static int decompress_buffer(uint8_t *out_buf, int out_buf_size,
     return 0;
 }
 
+typedef struct Qcow2DecompressData {
+    uint8_t *out_buf;
+    int out_buf_size;
+    const uint8_t *buf;
+    int buf_size;
+} Qcow2DecompressData;
+
+static int qcow2_decompress(void *opaque)
+{
+    Qcow2DecompressData *data = opaque;
+
+    return decompress_buffer(data->out_buf, data->out_buf_size,
+                             data->buf, data->buf_size);
+}
+
 int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset)
 {
     BDRVQcow2State *s = bs->opaque;
+    Qcow2DecompressData data;
     int ret, csize, nb_csectors, sector_offset;
     uint64_t coffset;
 
@@ -1420,8 +1645,22 @@ int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset)
         if (ret < 0) {
             return ret;
         }
-        if (decompress_buffer(s->cluster_cache, s->cluster_size,
-                              s->cluster_data + sector_offset, csize) < 0) {
+
+        data = (Qcow2DecompressData) {
+            .out_buf        = s->cluster_cache,
+            .out_buf_size   = s->cluster_size,
+            .buf            = s->cluster_data + sector_offset,
+            .buf_size       = csize,
+        };
+        /* Keep the event loop running other requests while inflating;
+         * the cluster cache stays protected by s->lock.  */
+        if (qemu_in_coroutine()) {
+            ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+            ret = thread_pool_submit_co(pool, qcow2_decompress, &data);
+        } else {
+            ret = qcow2_decompress(&data);
+        }
+        if (ret < 0) {
             return -EIO;
         }
         s->cluster_cache_offset = coffset;
@@ -29,6 +29,9 @@
 #include "block/qcow2.h"
 #include "qemu/range.h"
 #include "qemu/bswap.h"
+#include "qemu/timer.h"
+#include "qemu/error-report.h"
+#include "trace.h"
 
 static int64_t alloc_clusters_noref(BlockDriverState *bs, uint64_t size);
 static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
@@ -120,6 +123,15 @@ int qcow2_refcount_init(BlockDriverState *bs)
 void qcow2_refcount_close(BlockDriverState *bs)
 {
     BDRVQcow2State *s = bs->opaque;
+    Qcow2PendingFree *f;
+
+    /* Anything still pending is leaked, as if we had crashed */
+    while ((f = QTAILQ_FIRST(&s->pending_frees)) != NULL) {
+        QTAILQ_REMOVE(&s->pending_frees, f, next);
+        g_free(f);
+    }
+    s->nb_pending_frees = 0;
+
     g_free(s->refcount_table);
 }
 
@@ -745,7 +757,8 @@ static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
         } else {
             refcount += addend;
         }
-        if (refcount == 0 && cluster_index < s->free_cluster_index) {
+        if (refcount == 0 && cluster_index < s->free_cluster_index &&
+            cluster_index >= s->rebuild_boundary) {
             s->free_cluster_index = cluster_index;
         }
         s->set_refcount(refcount_block, block_index, refcount);
@@ -888,6 +901,11 @@ int64_t qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
         return 0;
     }
 
+    /* Append-only during a refcount rebuild */
+    if ((offset >> s->cluster_bits) < s->rebuild_boundary) {
+        return 0;
+    }
+
     do {
         /* Check how many clusters there are free */
         cluster_index = offset >> s->cluster_bits;
@@ -977,17 +995,93 @@ int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size)
     return offset;
 }
 
+/*
+ * Freed clusters do not have their refcounts decreased right away.  The
+ * ranges are collected, adjacent ones merged, and applied in one go on
+ * flush or once QCOW2_MAX_PENDING_FREES of them have piled up, so that a
+ * discard or snapshot deletion updates each refcount block once instead
+ * of once per range.  Until then the clusters merely stay allocated: a
+ * crash in between leaks them, which qemu-img check repairs, but cannot
+ * corrupt the image.
+ */
+void qcow2_process_pending_frees(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2PendingFree *f;
+    int ret;
+
+    /* update_refcount() may free clusters itself, so take one at a time */
+    while ((f = QTAILQ_FIRST(&s->pending_frees)) != NULL) {
+        QTAILQ_REMOVE(&s->pending_frees, f, next);
+        s->nb_pending_frees--;
+
+        ret = update_refcount(bs, f->offset, f->bytes, 1, true, f->type);
+        if (ret < 0) {
+            fprintf(stderr, "qcow2_free_clusters failed: %s\n",
+                    strerror(-ret));
+            /* TODO Remember the clusters to free them later and avoid
+             * leaking */
+        }
+        g_free(f);
+    }
+}
+
 void qcow2_free_clusters(BlockDriverState *bs,
                           int64_t offset, int64_t size,
                           enum qcow2_discard_type type)
 {
-    int ret;
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2PendingFree *f;
+    int64_t boundary;
 
     BLKDBG_EVENT(bs->file, BLKDBG_CLUSTER_FREE);
-    ret = update_refcount(bs, offset, size, 1, true, type);
-    if (ret < 0) {
-        fprintf(stderr, "qcow2_free_clusters failed: %s\n", strerror(-ret));
-        /* TODO Remember the clusters to free them later and avoid leaking */
+    if (size == 0) {
+        return;
+    }
+
+    /* Below the boundary of a running refcount rebuild, the refcounts are
+     * set to what its walk counts, which may or may not include the
+     * reference dropped here: leak these clusters rather than risk freeing
+     * them twice */
+    boundary = s->rebuild_boundary << s->cluster_bits;
+    if (offset < boundary) {
+        if (offset + size <= boundary) {
+            return;
+        }
+        size -= boundary - offset;
+        offset = boundary;
+    }
+
+    /* Only whole clusters can be merged: parts of a cluster (compressed
+     * data) each hold a reference of their own */
+    if (!offset_into_cluster(s, offset) && !offset_into_cluster(s, size)) {
+        QTAILQ_FOREACH(f, &s->pending_frees, next) {
+            if (f->type != type || offset_into_cluster(s, f->offset) ||
+                offset_into_cluster(s, f->bytes)) {
+                continue;
+            }
+            if (f->offset + f->bytes == offset) {
+                f->bytes += size;
+                return;
+            }
+            if (offset + size == f->offset) {
+                f->offset = offset;
+                f->bytes += size;
+                return;
+            }
+        }
+    }
+
+    f = g_new(Qcow2PendingFree, 1);
+    *f = (Qcow2PendingFree) {
+        .offset = offset,
+        .bytes  = size,
+        .type   = type,
+    };
+    QTAILQ_INSERT_TAIL(&s->pending_frees, f, next);
+
+    if (++s->nb_pending_frees >= QCOW2_MAX_PENDING_FREES) {
+        qcow2_process_pending_frees(bs);
     }
 }
 
@@ -1051,6 +1145,10 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
 
     assert(addend >= -1 && addend <= 1);
 
+    /* QCOW_OFLAG_COPIED is derived from the refcounts, so they must be
+     * up to date */
+    qcow2_process_pending_frees(bs);
+
     l2_table = NULL;
     l1_table = NULL;
     l1_size2 = l1_size * sizeof(uint64_t);
@@ -1353,11 +1451,87 @@ static int inc_refcounts(BlockDriverState *bs,
     return 0;
 }
 
+int qcow2_inc_refcounts_imrt(BlockDriverState *bs, BdrvCheckResult *res,
+                             void **refcount_table,
+                             int64_t *refcount_table_size,
+                             int64_t offset, int64_t size)
+{
+    return inc_refcounts(bs, res, refcount_table, refcount_table_size,
+                         offset, size);
+}
+
 /* Flags for check_refcounts_l1() and check_refcounts_l2() */
 enum {
     CHECK_FRAG_INFO = 0x2,      /* update BlockFragInfo counters */
+    CHECK_REBUILD   = 0x4,      /* walk of a background refcount rebuild */
 };
 
+/*
+ * The L2 tables of an L1 table are read ahead of the walk, up to
+ * QCOW2_CHECK_L2_READS tables and QCOW2_CHECK_L2_READ_BYTES at a time, so
+ * that the protocol driver serves them in parallel (raw-posix from its
+ * thread pool) rather than one table per round trip. They are still
+ * counted one at a time and in L1 order, the refcount table is not shared.
+ */
+#define QCOW2_CHECK_L2_READS        16
+#define QCOW2_CHECK_L2_READ_BYTES   (8 * 1024 * 1024)
+
+typedef struct Qcow2CheckL2Read {
+    uint64_t *table;
+    QEMUIOVector qiov;
+    struct iovec iov;
+    Coroutine *co;      /* waiting for the read, if in coroutine context */
+    bool done;
+    int ret;
+} Qcow2CheckL2Read;
+
+static void check_l2_read_cb(void *opaque, int ret)
+{
+    Qcow2CheckL2Read *rd = opaque;
+
+    rd->ret = ret;
+    rd->done = true;
+    if (rd->co) {
+        qemu_coroutine_enter(rd->co);
+    }
+}
+
+static void check_l2_read_start(BlockDriverState *bs, Qcow2CheckL2Read *rd,
+                                uint64_t l2_offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    rd->iov.iov_base = rd->table;
+    rd->iov.iov_len = s->cluster_size;
+    qemu_iovec_init_external(&rd->qiov, &rd->iov, 1);
+    rd->co = NULL;
+    rd->done = false;
+
+    /* L1E_OFFSET_MASK leaves l2_offset sector aligned */
+    bdrv_aio_readv(bs->file, l2_offset >> BDRV_SECTOR_BITS, &rd->qiov,
+                   s->cluster_size >> BDRV_SECTOR_BITS, check_l2_read_cb, rd);
+}
+
+static int check_l2_read_wait(BlockDriverState *bs, Qcow2CheckL2Read *rd)
+{
+    if (qemu_in_coroutine()) {
+        if (!rd->done) {
+            rd->co = qemu_coroutine_self();
+            qemu_coroutine_yield();
+            rd->co = NULL;
+        }
+    } else {
+        AioContext *aio_context = bdrv_get_aio_context(bs);
+
+        while (!rd->done) {
+            aio_poll(aio_context, true);
+        }
+    }
+    return rd->ret;
+}
+
+static int rebuild_may_read(BlockDriverState *bs, int in_flight);
+
 /*
  * Increases the refcount in the given refcount table for the all clusters
  * referenced in the L2 table. While doing so, performs some checks on L2
@@ -1368,24 +1542,13 @@ enum {
  */
 static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                               void **refcount_table,
-                              int64_t *refcount_table_size, int64_t l2_offset,
-                              int flags)
+                              int64_t *refcount_table_size,
+                              uint64_t *l2_table, int flags)
 {
     BDRVQcow2State *s = bs->opaque;
-    uint64_t *l2_table, l2_entry;
+    uint64_t l2_entry;
     uint64_t next_contiguous_offset = 0;
-    int i, l2_size, nb_csectors, ret;
-
-    /* Read L2 table from disk */
-    l2_size = s->l2_size * sizeof(uint64_t);
-    l2_table = g_malloc(l2_size);
-
-    ret = bdrv_pread(bs->file, l2_offset, l2_table, l2_size);
-    if (ret < 0) {
-        fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
-        res->check_errors++;
-        goto fail;
-    }
+    int i, nb_csectors, ret;
 
     /* Do the actual checks */
     for(i = 0; i < s->l2_size; i++) {
@@ -1409,7 +1572,7 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
             ret = inc_refcounts(bs, res, refcount_table, refcount_table_size,
                                 l2_entry & ~511, nb_csectors * 512);
             if (ret < 0) {
-                goto fail;
+                return ret;
             }
 
             if (flags & CHECK_FRAG_INFO) {
@@ -1448,7 +1611,7 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
             ret = inc_refcounts(bs, res, refcount_table, refcount_table_size,
                                 offset, s->cluster_size);
             if (ret < 0) {
-                goto fail;
+                return ret;
             }
 
             /* Correct offsets are cluster aligned */
@@ -1468,12 +1631,7 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
         }
     }
 
-    g_free(l2_table);
     return 0;
-
-fail:
-    g_free(l2_table);
-    return ret;
 }
 
 /*
@@ -1493,6 +1651,8 @@ static int check_refcounts_l1(BlockDriverState *bs,
 {
     BDRVQcow2State *s = bs->opaque;
     uint64_t *l1_table = NULL, l2_offset, l1_size2;
+    Qcow2CheckL2Read *reads = NULL, *rd;
+    int nb_reads = 0, head = 0, in_flight = 0, next = 0;
     int i, ret;
 
     l1_size2 = l1_size * sizeof(uint64_t);
@@ -1522,10 +1682,51 @@ static int check_refcounts_l1(BlockDriverState *bs,
             be64_to_cpus(&l1_table[i]);
     }
 
+    nb_reads = MAX(1, MIN(QCOW2_CHECK_L2_READS,
+                          QCOW2_CHECK_L2_READ_BYTES / s->cluster_size));
+    reads = g_new0(Qcow2CheckL2Read, nb_reads);
+
     /* Do the actual checks */
     for(i = 0; i < l1_size; i++) {
         l2_offset = l1_table[i];
         if (l2_offset) {
+            /* Keep the following L2 tables being read */
+            while (in_flight < nb_reads && next < l1_size) {
+                if (!l1_table[next]) {
+                    next++;
+                    continue;
+                }
+                if (flags & CHECK_REBUILD) {
+                    ret = rebuild_may_read(bs, in_flight);
+                    if (ret <= 0) {
+                        break;
+                    }
+                }
+                rd = &reads[(head + in_flight) % nb_reads];
+                if (!rd->table) {
+                    rd->table = qemu_try_blockalign(bs->file->bs,
+                                                    s->cluster_size);
+                    if (!rd->table) {
+                        ret = -ENOMEM;
+                        res->check_errors++;
+                        goto fail;
+                    }
+                }
+                check_l2_read_start(bs, rd, l1_table[next] & L1E_OFFSET_MASK);
+                in_flight++;
+                next++;
+            }
+            if (!in_flight) {
+                /* Only a cancelled rebuild stops reading altogether */
+                assert(ret < 0);
+                goto fail;
+            }
+
+            rd = &reads[head];
+            check_l2_read_wait(bs, rd);
+            head = (head + 1) % nb_reads;
+            in_flight--;
+
             /* Mark L2 table as used */
             l2_offset &= L1E_OFFSET_MASK;
             ret = inc_refcounts(bs, res, refcount_table, refcount_table_size,
@@ -1541,18 +1742,35 @@ static int check_refcounts_l1(BlockDriverState *bs,
                 res->corruptions++;
             }
 
+            if (rd->ret < 0) {
+                fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
+                res->check_errors++;
+                ret = rd->ret;
+                goto fail;
+            }
+
             /* Process and check L2 entries */
             ret = check_refcounts_l2(bs, res, refcount_table,
-                                     refcount_table_size, l2_offset, flags);
+                                     refcount_table_size, rd->table, flags);
             if (ret < 0) {
                 goto fail;
             }
         }
     }
-    g_free(l1_table);
-    return 0;
+    ret = 0;
 
 fail:
+    /* Reads still in flight write to the buffers */
+    for (; in_flight > 0; in_flight--) {
+        check_l2_read_wait(bs, &reads[head]);
+        head = (head + 1) % nb_reads;
+    }
+    if (reads) {
+        for (i = 0; i < nb_reads; i++) {
+            qemu_vfree(reads[i].table);
+        }
+        g_free(reads);
+    }
     g_free(l1_table);
     return ret;
 }
@@ -1843,6 +2061,12 @@ static int calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
         return ret;
     }
 
+    /* bitmaps */
+    ret = qcow2_check_bitmaps_refcounts(bs, res, refcount_table, nb_clusters);
+    if (ret < 0) {
+        return ret;
+    }
+
     return check_refblocks(bs, res, fix, rebuild, refcount_table, nb_clusters);
 }
 
@@ -2305,6 +2529,407 @@ fail:
     return ret;
 }
 
+/*
+ * Background refcount rebuild
+ *
+ * An image opened with the dirty bit set (lazy refcounts, after a crash) has
+ * its refcounts rebuilt by a coroutine while it is in use instead of being
+ * repaired synchronously by qcow2_open(). Until the rebuild is done the
+ * clusters below s->rebuild_boundary, i.e. the image file at open, are
+ * frozen:
+ *
+ *  - allocation is append-only, nothing below the boundary is allocated or
+ *    gets a new reference (snapshot operations wait for the rebuild);
+ *  - frees below the boundary are dropped and leak the clusters, which the
+ *    next qemu-img check reclaims.
+ *
+ * So the references to clusters below the boundary only ever go away while
+ * the L1 and L2 tables are walked without s->lock: what is read from disk,
+ * even stale, is a superset of them and the rebuilt refcounts can at worst
+ * leak. Clusters above the boundary are allocated and freed as usual and
+ * their refcounts are left alone. The rest of the metadata is counted and
+ * the refcounts are fixed under s->lock, one refcount block at a time.
+ *
+ * The walk issues no I/O while the node is drained, nor for
+ * QCOW2_REBUILD_PAUSE_MS after a drain, unless someone is waiting for it.
+ */
+#define QCOW2_REBUILD_PAUSE_MS  100
+
+static bool rebuild_drained(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    return (s->rebuild_paused || bs->quiesce_counter) &&
+           !s->rebuild_waiters && !s->rebuild_cancel;
+}
+
+static void rebuild_timer_cb(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVQcow2State *s = bs->opaque;
+    Coroutine *co = s->rebuild_paused_co;
+
+    if (co) {
+        s->rebuild_paused_co = NULL;
+        qemu_coroutine_enter(co);
+    }
+}
+
+static void rebuild_resume(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (s->rebuild_timer) {
+        timer_del(s->rebuild_timer);
+    }
+    rebuild_timer_cb(bs);
+}
+
+static void coroutine_fn rebuild_pause_point(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    while (rebuild_drained(bs)) {
+        s->rebuild_paused = false;
+        if (!s->rebuild_timer) {
+            s->rebuild_timer = aio_timer_new(bdrv_get_aio_context(bs),
+                                             QEMU_CLOCK_REALTIME, SCALE_MS,
+                                             rebuild_timer_cb, bs);
+        }
+        timer_mod(s->rebuild_timer, qemu_clock_get_ms(QEMU_CLOCK_REALTIME) +
+                  QCOW2_REBUILD_PAUSE_MS);
+        s->rebuild_paused_co = qemu_coroutine_self();
+        qemu_coroutine_yield();
+    }
+}
+
+/*
+ * Whether the walk may issue another L2 table read: with reads in flight it
+ * merely holds back while drained, otherwise it waits for the drain to end.
+ * -ECANCELED once the rebuild is cancelled and nothing is in flight.
+ */
+static int coroutine_fn rebuild_may_read(BlockDriverState *bs, int in_flight)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (in_flight) {
+        return !s->rebuild_cancel && !rebuild_drained(bs);
+    }
+    rebuild_pause_point(bs);
+    return s->rebuild_cancel ? -ECANCELED : 1;
+}
+
+/* Metadata other than the L1 and L2 tables, called with s->lock held */
+static int rebuild_count_metadata(BlockDriverState *bs, BdrvCheckResult *res,
+                                  void **refcount_table, int64_t *nb_clusters)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t offset;
+    int64_t i;
+    int ret;
+
+    /* header */
+    ret = inc_refcounts(bs, res, refcount_table, nb_clusters,
+                        0, s->cluster_size);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* snapshot table */
+    ret = inc_refcounts(bs, res, refcount_table, nb_clusters,
+                        s->snapshots_offset, s->snapshots_size);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* refcount data */
+    ret = inc_refcounts(bs, res, refcount_table, nb_clusters,
+                        s->refcount_table_offset,
+                        s->refcount_table_size * sizeof(uint64_t));
+    if (ret < 0) {
+        return ret;
+    }
+
+    for (i = 0; i < s->refcount_table_size; i++) {
+        offset = s->refcount_table[i] & REFT_OFFSET_MASK;
+        if (offset && !offset_into_cluster(s, offset)) {
+            ret = inc_refcounts(bs, res, refcount_table, nb_clusters,
+                                offset, s->cluster_size);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+    }
+
+    /* bitmaps */
+    return qcow2_check_bitmaps_refcounts(bs, res, refcount_table, nb_clusters);
+}
+
+/* Sets the refcounts below the boundary to the ones counted by the walk */
+static int coroutine_fn rebuild_fix_refcounts(BlockDriverState *bs,
+                                              BdrvCheckResult *res,
+                                              void *refcount_table,
+                                              int64_t nb_clusters)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t start, end, i, refcount1, refcount2;
+    int ret = 0;
+
+    for (start = 0; start < s->rebuild_boundary;
+         start += s->refcount_block_size) {
+        rebuild_pause_point(bs);
+        if (s->rebuild_cancel) {
+            return -ECANCELED;
+        }
+
+        end = MIN(start + s->refcount_block_size, s->rebuild_boundary);
+
+        qemu_co_mutex_lock(&s->lock);
+        for (i = start; i < end; i++) {
+            ret = qcow2_get_refcount(bs, i, &refcount1);
+            if (ret < 0) {
+                break;
+            }
+            refcount2 = i < nb_clusters ? s->get_refcount(refcount_table, i)
+                                        : 0;
+            if (refcount1 == refcount2) {
+                continue;
+            }
+
+            ret = update_refcount(bs, i << s->cluster_bits, 1,
+                                  refcount_diff(refcount1, refcount2),
+                                  refcount1 > refcount2,
+                                  QCOW2_DISCARD_ALWAYS);
+            if (ret < 0) {
+                break;
+            }
+            if (refcount1 > refcount2) {
+                res->leaks_fixed++;
+            } else {
+                res->corruptions_fixed++;
+            }
+        }
+        qemu_co_mutex_unlock(&s->lock);
+
+        if (ret < 0) {
+            res->check_errors++;
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+static void coroutine_fn rebuild_finish(BlockDriverState *bs,
+                                        BdrvCheckResult *res, int ret)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    trace_qcow2_refcount_rebuild_done(bs, ret, res->leaks_fixed,
+                                      res->corruptions_fixed);
+
+    if (ret == -ECANCELED) {
+        /* Closing, the image stays dirty */
+        return;
+    }
+    if (ret < 0 || res->check_errors) {
+        /* Keep allocating append-only, the refcounts may be anything */
+        error_report("qcow2: Could not rebuild the refcounts of dirty image "
+                     "'%s': %s", bs->filename,
+                     strerror(ret < 0 ? -ret : EIO));
+        return;
+    }
+
+    s->rebuild_boundary = 0;
+    s->free_cluster_index = 0;
+
+    if (res->corruptions) {
+        error_report("qcow2: Image '%s' has %d corruptions the refcount "
+                     "rebuild could not repair, run 'qemu-img check -r all'",
+                     bs->filename, res->corruptions);
+        return;
+    }
+    if (s->use_lazy_refcounts) {
+        /* Marked clean on close */
+        return;
+    }
+
+    /* As qcow2_mark_clean(), but requests keep running */
+    ret = bdrv_flush(bs);
+    if (ret < 0) {
+        return;
+    }
+    qemu_co_mutex_lock(&s->lock);
+    s->incompatible_features &= ~QCOW2_INCOMPAT_DIRTY;
+    ret = qcow2_update_header(bs);
+    qemu_co_mutex_unlock(&s->lock);
+    if (ret < 0) {
+        s->incompatible_features |= QCOW2_INCOMPAT_DIRTY;
+    }
+}
+
+static void coroutine_fn qcow2_refcount_rebuild_entry(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVQcow2State *s = bs->opaque;
+    BdrvCheckResult res = {0};
+    void *refcount_table = NULL;
+    int64_t nb_clusters = 0;
+    int i, ret;
+
+    ret = realloc_refcount_array(s, &refcount_table, &nb_clusters,
+                                 s->rebuild_boundary);
+    if (ret < 0) {
+        res.check_errors++;
+        goto out;
+    }
+
+    /* L1 and L2 tables, without s->lock */
+    ret = check_refcounts_l1(bs, &res, &refcount_table, &nb_clusters,
+                             s->l1_table_offset, s->l1_size, CHECK_REBUILD);
+    for (i = 0; ret >= 0 && i < s->nb_snapshots; i++) {
+        ret = check_refcounts_l1(bs, &res, &refcount_table, &nb_clusters,
+                                 s->snapshots[i].l1_table_offset,
+                                 s->snapshots[i].l1_size, CHECK_REBUILD);
+    }
+    if (ret < 0) {
+        goto out;
+    }
+
+    rebuild_pause_point(bs);
+    if (s->rebuild_cancel) {
+        ret = -ECANCELED;
+        goto out;
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+    ret = rebuild_count_metadata(bs, &res, &refcount_table, &nb_clusters);
+    qemu_co_mutex_unlock(&s->lock);
+    if (ret < 0) {
+        goto out;
+    }
+
+    ret = rebuild_fix_refcounts(bs, &res, refcount_table, nb_clusters);
+
+out:
+    g_free(refcount_table);
+    rebuild_finish(bs, &res, ret);
+
+    s->rebuild_co = NULL;
+    qemu_co_queue_restart_all(&s->rebuild_queue);
+}
+
+/*
+ * Makes allocation append-only ahead of the rebuild of a dirty image, which
+ * qcow2_refcount_rebuild_start() then starts once the image is open.
+ */
+int qcow2_refcount_rebuild_init(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int64_t size;
+
+    size = bdrv_getlength(bs->file->bs);
+    if (size < 0) {
+        return size;
+    }
+
+    s->rebuild_boundary = MAX(size_to_clusters(s, size), 1);
+    s->free_cluster_index = MAX(s->free_cluster_index, s->rebuild_boundary);
+    s->free_byte_offset = 0;
+    qemu_co_queue_init(&s->rebuild_queue);
+    return 0;
+}
+
+void qcow2_refcount_rebuild_start(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    trace_qcow2_refcount_rebuild_start(bs, s->rebuild_boundary);
+
+    s->rebuild_cancel = false;
+    s->rebuild_co = qemu_coroutine_create(qcow2_refcount_rebuild_entry, bs);
+    qemu_coroutine_enter(s->rebuild_co);
+}
+
+static void rebuild_wait(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    s->rebuild_waiters++;
+    rebuild_resume(bs);
+    while (s->rebuild_co) {
+        if (qemu_in_coroutine()) {
+            qemu_co_queue_wait(&s->rebuild_queue);
+        } else {
+            aio_poll(bdrv_get_aio_context(bs), true);
+        }
+    }
+    s->rebuild_waiters--;
+}
+
+/*
+ * Waits for a running rebuild to finish. Operations that reference existing
+ * clusters again, like snapshots, must not run before.
+ */
+void qcow2_refcount_rebuild_wait(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (s->rebuild_co) {
+        rebuild_wait(bs);
+    }
+}
+
+/*
+ * Stops a running rebuild, the image stays dirty and allocation append-only.
+ * The node must be drained.
+ */
+void qcow2_refcount_rebuild_cancel(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (s->rebuild_co) {
+        s->rebuild_cancel = true;
+        rebuild_wait(bs);
+    }
+    qcow2_refcount_rebuild_detach_aio_context(bs);
+}
+
+/* .bdrv_drain: the walk stops issuing I/O */
+void qcow2_refcount_rebuild_pause(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (s->rebuild_co) {
+        s->rebuild_paused = true;
+    }
+}
+
+void qcow2_refcount_rebuild_detach_aio_context(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (s->rebuild_timer) {
+        timer_del(s->rebuild_timer);
+        timer_free(s->rebuild_timer);
+        s->rebuild_timer = NULL;
+    }
+}
+
+void qcow2_refcount_rebuild_attach_aio_context(BlockDriverState *bs,
+                                               AioContext *new_context)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    /* A paused walk resumes in the new context */
+    if (s->rebuild_paused_co) {
+        s->rebuild_timer = aio_timer_new(new_context, QEMU_CLOCK_REALTIME,
+                                         SCALE_MS, rebuild_timer_cb, bs);
+        timer_mod(s->rebuild_timer, qemu_clock_get_ms(QEMU_CLOCK_REALTIME) +
+                  QCOW2_REBUILD_PAUSE_MS);
+    }
+}
+
 #define overlaps_with(ofs, sz) \
     ranges_overlap(offset, size, ofs, sz)
 
@@ -2751,6 +3376,8 @@ int qcow2_change_refcount_order(BlockDriverState *bs, int refcount_order,
     assert(s->qcow_version >= 3);
     assert(refcount_order >= 0 && refcount_order <= 6);
 
+    qcow2_process_pending_frees(bs);
+
     /* see qcow2_open() */
     new_refblock_size = 1 << (s->cluster_bits - (refcount_order - 3));
 
@@ -37,6 +37,7 @@
 #include "qemu/option_int.h"
 #include "qemu/cutils.h"
 #include "qemu/bswap.h"
+#include "block/thread-pool.h"
 
 /*
   Differences with QCOW:
@@ -63,6 +64,7 @@ typedef struct {
 #define  QCOW2_EXT_MAGIC_END 0
 #define  QCOW2_EXT_MAGIC_BACKING_FORMAT 0xE2792ACA
 #define  QCOW2_EXT_MAGIC_FEATURE_TABLE 0x6803f857
+#define  QCOW2_EXT_MAGIC_BITMAPS 0x23852875
 
 static int qcow2_probe(const uint8_t *buf, int buf_size, const char *filename)
 {
@@ -162,6 +164,87 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
             }
             break;
 
+        case QCOW2_EXT_MAGIC_BITMAPS:
+        {
+            Qcow2BitmapHeaderExt bitmaps_ext;
+
+            if (ext.len != sizeof(bitmaps_ext)) {
+                error_setg(errp, "ERROR: bitmaps_ext: Invalid extension "
+                           "length");
+                return -EINVAL;
+            }
+
+            if (!(s->autoclear_features & QCOW2_AUTOCLEAR_BITMAPS)) {
+                /* The extension was written by a program that does not know
+                 * about bitmaps and may have changed the image since; the
+                 * bitmaps are then considered stale */
+                error_report("WARNING: a program lacking bitmap support "
+                             "modified this file, so all bitmaps are now "
+                             "considered inconsistent");
+                break;
+            }
+
+            if (s->qcow_version < 3) {
+                error_setg(errp, "ERROR: bitmaps_ext: "
+                           "This qcow2 version does not support bitmaps");
+                return -EINVAL;
+            }
+
+            ret = bdrv_pread(bs->file, offset, &bitmaps_ext, ext.len);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "ERROR: bitmaps_ext: "
+                                 "Could not read ext header");
+                return ret;
+            }
+
+            if (bitmaps_ext.reserved32 != 0) {
+                error_setg(errp, "ERROR: bitmaps_ext: "
+                           "Reserved field is not zero");
+                return -EINVAL;
+            }
+
+            be32_to_cpus(&bitmaps_ext.nb_bitmaps);
+            be64_to_cpus(&bitmaps_ext.bitmap_directory_size);
+            be64_to_cpus(&bitmaps_ext.bitmap_directory_offset);
+
+            if (bitmaps_ext.nb_bitmaps > QCOW2_MAX_BITMAPS) {
+                error_setg(errp, "ERROR: bitmaps_ext: "
+                           "Image has %" PRIu32 " bitmaps, exceeding the "
+                           "QEMU supported maximum of %d",
+                           bitmaps_ext.nb_bitmaps, QCOW2_MAX_BITMAPS);
+                return -EINVAL;
+            }
+
+            if (bitmaps_ext.nb_bitmaps == 0) {
+                error_setg(errp, "ERROR: bitmaps_ext: "
+                           "found bitmaps extension with zero bitmaps");
+                return -EINVAL;
+            }
+
+            if (bitmaps_ext.bitmap_directory_offset & (s->cluster_size - 1)) {
+                error_setg(errp, "ERROR: bitmaps_ext: "
+                           "invalid bitmap directory offset");
+                return -EINVAL;
+            }
+
+            if (bitmaps_ext.bitmap_directory_size >
+                QCOW2_MAX_BITMAP_DIRECTORY_SIZE) {
+                error_setg(errp, "ERROR: bitmaps_ext: "
+                           "bitmap directory size (%" PRIu64 ") exceeds "
+                           "the maximum supported size (%d)",
+                           bitmaps_ext.bitmap_directory_size,
+                           QCOW2_MAX_BITMAP_DIRECTORY_SIZE);
+                return -EINVAL;
+            }
+
+            s->nb_bitmaps = bitmaps_ext.nb_bitmaps;
+            s->bitmap_directory_offset =
+                    bitmaps_ext.bitmap_directory_offset;
+            s->bitmap_directory_size =
+                    bitmaps_ext.bitmap_directory_size;
+            break;
+        }
+
         default:
             /* unknown magic - save it in case we need to rewrite the header */
             {
@@ -273,6 +356,11 @@ static int qcow2_mark_clean(BlockDriverState *bs)
 {
     BDRVQcow2State *s = bs->opaque;
 
+    /* The refcounts are not trustworthy until the rebuild is done */
+    if (s->rebuild_boundary) {
+        return 0;
+    }
+
     if (s->incompatible_features & QCOW2_INCOMPAT_DIRTY) {
         int ret;
 
@@ -322,7 +410,12 @@ int qcow2_mark_consistent(BlockDriverState *bs)
 static int qcow2_check(BlockDriverState *bs, BdrvCheckResult *result,
                        BdrvCheckMode fix)
 {
-    int ret = qcow2_check_refcounts(bs, result, fix);
+    int ret;
+
+    qcow2_refcount_rebuild_wait(bs);
+    qcow2_process_pending_frees(bs);
+
+    ret = qcow2_check_refcounts(bs, result, fix);
     if (ret < 0) {
         return ret;
     }
@@ -461,6 +554,11 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "Clean unused cache entries after this time (in seconds)",
         },
+        {
+            .name = QCOW2_OPT_BACKGROUND_REPAIR,
+            .type = QEMU_OPT_BOOL,
+            .help = "Rebuild the refcounts of a dirty image while it is in use",
+        },
         { /* end of list */ }
     },
 };
@@ -511,12 +609,19 @@ static void cache_clean_timer_del(BlockDriverState *bs)
 static void qcow2_detach_aio_context(BlockDriverState *bs)
 {
     cache_clean_timer_del(bs);
+    qcow2_refcount_rebuild_detach_aio_context(bs);
 }
 
 static void qcow2_attach_aio_context(BlockDriverState *bs,
                                      AioContext *new_context)
 {
     cache_clean_timer_init(bs, new_context);
+    qcow2_refcount_rebuild_attach_aio_context(bs, new_context);
+}
+
+static void qcow2_drain(BlockDriverState *bs)
+{
+    qcow2_refcount_rebuild_pause(bs);
 }
 
 static void read_cache_sizes(BlockDriverState *bs, QemuOpts *opts,
@@ -585,6 +690,7 @@ typedef struct Qcow2ReopenState {
     int overlap_check;
     bool discard_passthrough[QCOW2_DISCARD_MAX];
     uint64_t cache_clean_interval;
+    bool background_repair;
 } Qcow2ReopenState;
 
 static int qcow2_update_options_prepare(BlockDriverState *bs,
@@ -639,6 +745,9 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
     }
 
     /* alloc new L2 table/refcount block cache, flush old one */
+    if (s->refcount_block_cache) {
+        qcow2_process_pending_frees(bs);
+    }
     if (s->l2_table_cache) {
         ret = qcow2_cache_flush(bs, s->l2_table_cache);
         if (ret) {
@@ -674,6 +783,10 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
         goto fail;
     }
 
+    /* Only used when opening a dirty image */
+    r->background_repair = qemu_opt_get_bool(opts, QCOW2_OPT_BACKGROUND_REPAIR,
+                                             true);
+
     /* lazy-refcounts; flush if going from enabled to disabled */
     r->use_lazy_refcounts = qemu_opt_get_bool(opts, QCOW2_OPT_LAZY_REFCOUNTS,
         (s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS));
@@ -767,6 +880,7 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
 
     s->overlap_check = r->overlap_check;
     s->use_lazy_refcounts = r->use_lazy_refcounts;
+    s->background_repair = r->background_repair;
 
     for (i = 0; i < QCOW2_DISCARD_MAX; i++) {
         s->discard_passthrough[i] = r->discard_passthrough[i];
@@ -1104,6 +1218,7 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
 
     QLIST_INIT(&s->cluster_allocs);
     QTAILQ_INIT(&s->discards);
+    QTAILQ_INIT(&s->pending_frees);
 
     /* read qcow2 extensions */
     if (qcow2_read_extensions(bs, header.header_length, ext_end, NULL,
@@ -1143,8 +1258,9 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     /* Clear unknown autoclear feature bits */
-    if (!bs->read_only && !(flags & BDRV_O_INACTIVE) && s->autoclear_features) {
-        s->autoclear_features = 0;
+    if (!bs->read_only && !(flags & BDRV_O_INACTIVE) &&
+        (s->autoclear_features & ~QCOW2_AUTOCLEAR_MASK)) {
+        s->autoclear_features &= QCOW2_AUTOCLEAR_MASK;
         ret = qcow2_update_header(bs);
         if (ret < 0) {
             error_setg_errno(errp, -ret, "Could not update qcow2 header");
@@ -1154,19 +1270,39 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
 
     /* Initialise locks */
     qemu_co_mutex_init(&s->lock);
+    qemu_co_mutex_init(&s->crypt_lock);
 
-    /* Repair image if dirty */
+    /* Repair image if dirty, in the background unless disabled: allocation
+     * is append-only from here on, the rebuild starts once the image is
+     * open */
     if (!(flags & (BDRV_O_CHECK | BDRV_O_INACTIVE)) && !bs->read_only &&
         (s->incompatible_features & QCOW2_INCOMPAT_DIRTY)) {
         BdrvCheckResult result = {0};
 
-        ret = qcow2_check(bs, &result, BDRV_FIX_ERRORS | BDRV_FIX_LEAKS);
+        if (s->background_repair) {
+            ret = qcow2_refcount_rebuild_init(bs);
+        } else {
+            ret = qcow2_check(bs, &result, BDRV_FIX_ERRORS | BDRV_FIX_LEAKS);
+        }
         if (ret < 0) {
             error_setg_errno(errp, -ret, "Could not repair dirty image");
             goto fail;
         }
     }
 
+    if (!(flags & BDRV_O_INACTIVE)) {
+        qcow2_load_dirty_bitmaps(bs, &local_err);
+        if (local_err) {
+            error_propagate(errp, local_err);
+            ret = -EINVAL;
+            goto fail;
+        }
+    }
+
+    if (s->rebuild_boundary) {
+        qcow2_refcount_rebuild_start(bs);
+    }
+
 #ifdef DEBUG_ALLOC
     {
         BdrvCheckResult result = {0};
@@ -1206,12 +1342,38 @@ static void qcow2_refresh_limits(BlockDriverState *bs, Error **errp)
     bs->bl.pwrite_zeroes_alignment = s->cluster_size;
 }
 
+static void qcow2_free_ciphers(BDRVQcow2State *s)
+{
+    int i;
+
+    qcrypto_cipher_free(s->cipher);
+    s->cipher = NULL;
+    for (i = 0; i < QCOW2_CRYPT_JOBS - 1; i++) {
+        qcrypto_cipher_free(s->job_ciphers[i]);
+        s->job_ciphers[i] = NULL;
+    }
+}
+
+static QCryptoCipher *qcow2_new_cipher(uint8_t *keybuf, size_t nkey)
+{
+    QCryptoCipher *cipher;
+    Error *err = NULL;
+
+    cipher = qcrypto_cipher_new(QCRYPTO_CIPHER_ALG_AES_128,
+                                QCRYPTO_CIPHER_MODE_CBC,
+                                keybuf, nkey, &err);
+    /* XXX would be nice if errors in this method could
+     * be properly propagate to the caller. Would need
+     * the bdrv_set_key() API signature to be fixed. */
+    error_free(err);
+    return cipher;
+}
+
 static int qcow2_set_key(BlockDriverState *bs, const char *key)
 {
     BDRVQcow2State *s = bs->opaque;
     uint8_t keybuf[16];
     int len, i;
-    Error *err = NULL;
 
     memset(keybuf, 0, 16);
     len = strlen(key);
@@ -1224,20 +1386,20 @@ static int qcow2_set_key(BlockDriverState *bs, const char *key)
     }
     assert(bs->encrypted);
 
-    qcrypto_cipher_free(s->cipher);
-    s->cipher = qcrypto_cipher_new(
-        QCRYPTO_CIPHER_ALG_AES_128,
-        QCRYPTO_CIPHER_MODE_CBC,
-        keybuf, G_N_ELEMENTS(keybuf),
-        &err);
-
+    qcow2_free_ciphers(s);
+    s->cipher = qcow2_new_cipher(keybuf, G_N_ELEMENTS(keybuf));
     if (!s->cipher) {
-        /* XXX would be nice if errors in this method could
-         * be properly propagate to the caller. Would need
-         * the bdrv_set_key() API signature to be fixed. */
-        error_free(err);
         return -1;
     }
+
+    /* The cipher keeps the IV, so each parallel job needs its own */
+    for (i = 0; i < QCOW2_CRYPT_JOBS - 1; i++) {
+        s->job_ciphers[i] = qcow2_new_cipher(keybuf, G_N_ELEMENTS(keybuf));
+        if (!s->job_ciphers[i]) {
+            qcow2_free_ciphers(s);
+            return -1;
+        }
+    }
     return 0;
 }
 
@@ -1517,13 +1679,10 @@ static coroutine_fn int qcow2_co_preadv(BlockDriverState *bs, uint64_t offset,
                 assert(s->cipher);
                 assert((offset & (BDRV_SECTOR_SIZE - 1)) == 0);
                 assert((cur_bytes & (BDRV_SECTOR_SIZE - 1)) == 0);
-                Error *err = NULL;
-                if (qcow2_encrypt_sectors(s, offset >> BDRV_SECTOR_BITS,
-                                          cluster_data, cluster_data,
-                                          cur_bytes >> BDRV_SECTOR_BITS,
-                                          false, &err) < 0) {
-                    error_free(err);
-                    ret = -EIO;
+                ret = qcow2_co_crypt(bs, offset >> BDRV_SECTOR_BITS,
+                                     cluster_data,
+                                     cur_bytes >> BDRV_SECTOR_BITS, false);
+                if (ret < 0) {
                     goto fail;
                 }
                 qemu_iovec_from_buf(qiov, bytes_done, cluster_data, cur_bytes);
@@ -1564,6 +1723,7 @@ static coroutine_fn int qcow2_co_pwritev(BlockDriverState *bs, uint64_t offset,
     uint64_t bytes_done = 0;
     uint8_t *cluster_data = NULL;
     QCowL2Meta *l2meta = NULL;
+    QCowL2Meta *m;
 
     trace_qcow2_writev_start_req(qemu_coroutine_self(), offset, bytes);
 
@@ -1598,7 +1758,6 @@ static coroutine_fn int qcow2_co_pwritev(BlockDriverState *bs, uint64_t offset,
         qemu_iovec_concat(&hd_qiov, qiov, bytes_done, cur_bytes);
 
         if (bs->encrypted) {
-            Error *err = NULL;
             assert(s->cipher);
             if (!cluster_data) {
                 cluster_data = qemu_try_blockalign(bs->file->bs,
@@ -1614,12 +1773,10 @@ static coroutine_fn int qcow2_co_pwritev(BlockDriverState *bs, uint64_t offset,
                    QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size);
             qemu_iovec_to_buf(&hd_qiov, 0, cluster_data, hd_qiov.size);
 
-            if (qcow2_encrypt_sectors(s, offset >> BDRV_SECTOR_BITS,
-                                      cluster_data, cluster_data,
-                                      cur_bytes >>BDRV_SECTOR_BITS,
-                                      true, &err) < 0) {
-                error_free(err);
-                ret = -EIO;
+            ret = qcow2_co_crypt(bs, offset >> BDRV_SECTOR_BITS,
+                                 cluster_data, cur_bytes >> BDRV_SECTOR_BITS,
+                                 true);
+            if (ret < 0) {
                 goto fail;
             }
 
@@ -1634,12 +1791,26 @@ static coroutine_fn int qcow2_co_pwritev(BlockDriverState *bs, uint64_t offset,
         }
 
         qemu_co_mutex_unlock(&s->lock);
-        BLKDBG_EVENT(bs->file, BLKDBG_WRITE_AIO);
-        trace_qcow2_writev_data(qemu_coroutine_self(),
-                                cluster_offset + offset_in_cluster);
-        ret = bdrv_co_pwritev(bs->file,
-                              cluster_offset + offset_in_cluster,
-                              cur_bytes, &hd_qiov, 0);
+        /* The clusters are reserved by l2meta; copying their unmodified
+         * parts needs no metadata, so do it without the lock as well.  A
+         * write that allocates a single run of clusters goes out in one
+         * request with its COW regions. */
+        ret = 0;
+        if (l2meta && !l2meta->next) {
+            ret = qcow2_alloc_cluster_cow(bs, l2meta, offset, &hd_qiov);
+        } else {
+            for (m = l2meta; m != NULL && ret >= 0; m = m->next) {
+                ret = qcow2_alloc_cluster_cow(bs, m, 0, NULL);
+            }
+        }
+        if (ret == 0) {
+            BLKDBG_EVENT(bs->file, BLKDBG_WRITE_AIO);
+            trace_qcow2_writev_data(qemu_coroutine_self(),
+                                    cluster_offset + offset_in_cluster);
+            ret = bdrv_co_pwritev(bs->file,
+                                  cluster_offset + offset_in_cluster,
+                                  cur_bytes, &hd_qiov, 0);
+        }
         qemu_co_mutex_lock(&s->lock);
         if (ret < 0) {
             goto fail;
@@ -1699,6 +1870,17 @@ static int qcow2_inactivate(BlockDriverState *bs)
 {
     BDRVQcow2State *s = bs->opaque;
     int ret, result = 0;
+    Error *local_err = NULL;
+
+    qcow2_refcount_rebuild_cancel(bs);
+
+    ret = qcow2_store_persistent_dirty_bitmaps(bs, &local_err);
+    if (ret < 0) {
+        result = ret;
+        error_report_err(local_err);
+    }
+
+    qcow2_process_pending_frees(bs);
 
     ret = qcow2_cache_flush(bs, s->l2_table_cache);
     if (ret) {
@@ -1724,6 +1906,8 @@ static int qcow2_inactivate(BlockDriverState *bs)
 static void qcow2_close(BlockDriverState *bs)
 {
     BDRVQcow2State *s = bs->opaque;
+
+    qcow2_refcount_rebuild_cancel(bs);
     qemu_vfree(s->l1_table);
     /* else pre-write overlap checks in cache_destroy may crash */
     s->l1_table = NULL;
@@ -1736,8 +1920,7 @@ static void qcow2_close(BlockDriverState *bs)
     qcow2_cache_destroy(bs, s->l2_table_cache);
     qcow2_cache_destroy(bs, s->refcount_block_cache);
 
-    qcrypto_cipher_free(s->cipher);
-    s->cipher = NULL;
+    qcow2_free_ciphers(s);
 
     g_free(s->unknown_header_fields);
     cleanup_unknown_header_ext(bs);
@@ -1756,6 +1939,7 @@ static void qcow2_invalidate_cache(BlockDriverState *bs, Error **errp)
     BDRVQcow2State *s = bs->opaque;
     int flags = s->flags;
     QCryptoCipher *cipher = NULL;
+    QCryptoCipher *job_ciphers[QCOW2_CRYPT_JOBS - 1];
     QDict *options;
     Error *local_err = NULL;
     int ret;
@@ -1767,6 +1951,8 @@ static void qcow2_invalidate_cache(BlockDriverState *bs, Error **errp)
 
     cipher = s->cipher;
     s->cipher = NULL;
+    memcpy(job_ciphers, s->job_ciphers, sizeof(job_ciphers));
+    memset(s->job_ciphers, 0, sizeof(s->job_ciphers));
 
     qcow2_close(bs);
 
@@ -1788,6 +1974,7 @@ static void qcow2_invalidate_cache(BlockDriverState *bs, Error **errp)
     }
 
     s->cipher = cipher;
+    memcpy(s->job_ciphers, job_ciphers, sizeof(job_ciphers));
 }
 
 static size_t header_ext_add(char *buf, uint32_t magic, const void *s,
@@ -1928,6 +2115,11 @@ int qcow2_update_header(BlockDriverState *bs)
                 .bit  = QCOW2_COMPAT_LAZY_REFCOUNTS_BITNR,
                 .name = "lazy refcounts",
             },
+            {
+                .type = QCOW2_FEAT_TYPE_AUTOCLEAR,
+                .bit  = QCOW2_AUTOCLEAR_BITMAPS_BITNR,
+                .name = "bitmaps",
+            },
         };
 
         ret = header_ext_add(buf, QCOW2_EXT_MAGIC_FEATURE_TABLE,
@@ -1939,6 +2131,25 @@ int qcow2_update_header(BlockDriverState *bs)
         buflen -= ret;
     }
 
+    /* Bitmap extension */
+    if (s->nb_bitmaps > 0) {
+        Qcow2BitmapHeaderExt bitmaps_header = {
+            .nb_bitmaps = cpu_to_be32(s->nb_bitmaps),
+            .bitmap_directory_size =
+                    cpu_to_be64(s->bitmap_directory_size),
+            .bitmap_directory_offset =
+                    cpu_to_be64(s->bitmap_directory_offset)
+        };
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_BITMAPS,
+                             &bitmaps_header, sizeof(bitmaps_header),
+                             buflen);
+        if (ret < 0) {
+            goto fail;
+        }
+        buf += ret;
+        buflen -= ret;
+    }
+
     /* Keep unknown header extensions */
     QLIST_FOREACH(uext, &s->unknown_header_ext, next) {
         ret = header_ext_add(buf, uext->magic, uext->data, uext->len, buflen);
@@ -2570,6 +2781,12 @@ static int qcow2_write(BlockDriverState *bs, int64_t sector_num,
         .nb_sectors = nb_sectors,
         .ret        = -EINPROGRESS,
     };
+
+    if (qemu_in_coroutine()) {
+        qcow2_write_co_entry(&data);
+        return data.ret;
+    }
+
     co = qemu_coroutine_create(qcow2_write_co_entry, &data);
     qemu_coroutine_enter(co);
     while (data.ret == -EINPROGRESS) {
@@ -2578,13 +2795,59 @@ static int qcow2_write(BlockDriverState *bs, int64_t sector_num,
     return data.ret;
 }
 
+typedef struct Qcow2CompressData {
+    void *dest;
+    const void *src;
+    size_t size;
+    ssize_t ret;
+} Qcow2CompressData;
+
+/*
+ * Compress one cluster.  Sets ret to the compressed size, or to -ENOSPC if
+ * the data does not compress to less than its original size.  Runs in the
+ * thread pool when called from a coroutine.
+ */
+static int qcow2_compress(void *opaque)
+{
+    Qcow2CompressData *data = opaque;
+    z_stream strm;
+    int ret;
+
+    /* best compression, small window, no zlib header */
+    memset(&strm, 0, sizeof(strm));
+    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
+                       Z_DEFLATED, -12,
+                       9, Z_DEFAULT_STRATEGY);
+    if (ret != 0) {
+        data->ret = -EINVAL;
+        return 0;
+    }
+
+    strm.avail_in = data->size;
+    strm.next_in = (uint8_t *)data->src;
+    strm.avail_out = data->size;
+    strm.next_out = data->dest;
+
+    ret = deflate(&strm, Z_FINISH);
+    if (ret == Z_STREAM_END) {
+        data->ret = (uint8_t *)strm.next_out - (uint8_t *)data->dest;
+    } else if (ret == Z_OK) {
+        data->ret = -ENOSPC;
+    } else {
+        data->ret = -EINVAL;
+    }
+
+    deflateEnd(&strm);
+    return 0;
+}
+
 /* XXX: put compressed sectors first, then all the cluster aligned
    tables to avoid losing bytes in alignment */
 static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
                                   const uint8_t *buf, int nb_sectors)
 {
     BDRVQcow2State *s = bs->opaque;
-    z_stream strm;
+    Qcow2CompressData data;
     int ret, out_len;
     uint8_t *out_buf;
     uint64_t cluster_offset;
@@ -2614,32 +2877,26 @@ static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
 
     out_buf = g_malloc(s->cluster_size);
 
-    /* best compression, small window, no zlib header */
-    memset(&strm, 0, sizeof(strm));
-    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
-                       Z_DEFLATED, -12,
-                       9, Z_DEFAULT_STRATEGY);
-    if (ret != 0) {
-        ret = -EINVAL;
-        goto fail;
-    }
-
-    strm.avail_in = s->cluster_size;
-    strm.next_in = (uint8_t *)buf;
-    strm.avail_out = s->cluster_size;
-    strm.next_out = out_buf;
+    data = (Qcow2CompressData) {
+        .dest   = out_buf,
+        .src    = buf,
+        .size   = s->cluster_size,
+    };
 
-    ret = deflate(&strm, Z_FINISH);
-    if (ret != Z_STREAM_END && ret != Z_OK) {
-        deflateEnd(&strm);
+    /* Keep the event loop running other requests while deflating */
+    if (qemu_in_coroutine()) {
+        ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+        thread_pool_submit_co(pool, qcow2_compress, &data);
+    } else {
+        qcow2_compress(&data);
+    }
+    if (data.ret == -EINVAL) {
         ret = -EINVAL;
         goto fail;
     }
-    out_len = strm.next_out - out_buf;
-
-    deflateEnd(&strm);
+    out_len = data.ret;
 
-    if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
+    if (data.ret == -ENOSPC || out_len >= s->cluster_size) {
         /* could not compress: write normal cluster */
         ret = qcow2_write(bs, sector_num, buf, s->cluster_sectors);
         if (ret < 0) {
@@ -2826,6 +3083,8 @@ static int qcow2_make_empty(BlockDriverState *bs)
     int sector_step = INT_MAX / BDRV_SECTOR_SIZE;
     int l1_clusters, ret = 0;
 
+    qcow2_refcount_rebuild_wait(bs);
+
     l1_clusters = DIV_ROUND_UP(s->l1_size, s->cluster_size / sizeof(uint64_t));
 
     if (s->qcow_version >= 3 && !s->snapshots &&
@@ -2866,6 +3125,7 @@ static coroutine_fn int qcow2_co_flush_to_os(BlockDriverState *bs)
     int ret;
 
     qemu_co_mutex_lock(&s->lock);
+    qcow2_process_pending_frees(bs);
     ret = qcow2_cache_write(bs, s->l2_table_cache);
     if (ret < 0) {
         qemu_co_mutex_unlock(&s->lock);
@@ -2993,6 +3253,11 @@ static int qcow2_downgrade(BlockDriverState *bs, int target_version,
         return -ENOTSUP;
     }
 
+    if (s->nb_bitmaps || bdrv_has_persistent_dirty_bitmap(bs)) {
+        error_report("compat=0.10 does not support persistent bitmaps");
+        return -ENOTSUP;
+    }
+
     /* clear incompatible features */
     if (s->incompatible_features & QCOW2_INCOMPAT_DIRTY) {
         ret = qcow2_mark_clean(bs);
@@ -3118,6 +3383,8 @@ static int qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
     QemuOptDesc *desc = opts->list->desc;
     Qcow2AmendHelperCBInfo helper_cb_info;
 
+    qcow2_refcount_rebuild_wait(bs);
+
     while (desc && desc->name) {
         if (!qemu_opt_find(opts, desc->name)) {
             /* only change explicitly defined options */
@@ -3433,12 +3700,15 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_invalidate_cache      = qcow2_invalidate_cache,
     .bdrv_inactivate            = qcow2_inactivate,
 
+    .bdrv_can_store_new_dirty_bitmap = qcow2_can_store_new_dirty_bitmap,
+
     .create_opts         = &qcow2_create_opts,
     .bdrv_check          = qcow2_check,
     .bdrv_amend_options  = qcow2_amend_options,
 
     .bdrv_detach_aio_context  = qcow2_detach_aio_context,
     .bdrv_attach_aio_context  = qcow2_attach_aio_context,
+    .bdrv_drain               = qcow2_drain,
 };
 
 static void bdrv_qcow2_init(void)
@@ -38,6 +38,9 @@
 #define QCOW_CRYPT_AES  1
 
 #define QCOW_MAX_CRYPT_CLUSTERS 32
+
+/* Number of worker threads that encrypt or decrypt one request */
+#define QCOW2_CRYPT_JOBS 8
 #define QCOW_MAX_SNAPSHOTS 65536
 
 /* 8 MB refcount table is enough for 2 PB images at 64k cluster size
@@ -52,6 +55,11 @@
  * space for snapshot names and IDs */
 #define QCOW_MAX_SNAPSHOTS_SIZE (1024 * QCOW_MAX_SNAPSHOTS)
 
+/* Bitmap directory entries are 24 bytes plus name and extra data; the limits
+ * below follow the recommendations of docs/specs/qcow2.txt */
+#define QCOW2_MAX_BITMAPS 65535
+#define QCOW2_MAX_BITMAP_DIRECTORY_SIZE (1024 * QCOW2_MAX_BITMAPS)
+
 /* indicate that the refcount of the referenced cluster is exactly one. */
 #define QCOW_OFLAG_COPIED     (1ULL << 63)
 /* indicate that the cluster is compressed (they never have the copied flag) */
@@ -97,6 +105,7 @@
 #define QCOW2_OPT_L2_CACHE_SIZE "l2-cache-size"
 #define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
 #define QCOW2_OPT_CACHE_CLEAN_INTERVAL "cache-clean-interval"
+#define QCOW2_OPT_BACKGROUND_REPAIR "background-repair"
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -170,6 +179,13 @@ typedef struct Qcow2UnknownHeaderExtension {
     uint8_t data[];
 } Qcow2UnknownHeaderExtension;
 
+typedef struct Qcow2BitmapHeaderExt {
+    uint32_t nb_bitmaps;
+    uint32_t reserved32;
+    uint64_t bitmap_directory_size;
+    uint64_t bitmap_directory_offset;
+} QEMU_PACKED Qcow2BitmapHeaderExt;
+
 enum {
     QCOW2_FEAT_TYPE_INCOMPATIBLE    = 0,
     QCOW2_FEAT_TYPE_COMPATIBLE      = 1,
@@ -195,6 +211,14 @@ enum {
     QCOW2_COMPAT_FEAT_MASK            = QCOW2_COMPAT_LAZY_REFCOUNTS,
 };
 
+/* Autoclear feature bits */
+enum {
+    QCOW2_AUTOCLEAR_BITMAPS_BITNR = 0,
+    QCOW2_AUTOCLEAR_BITMAPS       = 1 << QCOW2_AUTOCLEAR_BITMAPS_BITNR,
+
+    QCOW2_AUTOCLEAR_MASK          = QCOW2_AUTOCLEAR_BITMAPS,
+};
+
 enum qcow2_discard_type {
     QCOW2_DISCARD_NEVER = 0,
     QCOW2_DISCARD_ALWAYS,
@@ -217,6 +241,16 @@ typedef struct Qcow2DiscardRegion {
     QTAILQ_ENTRY(Qcow2DiscardRegion) next;
 } Qcow2DiscardRegion;
 
+/* Number of freed ranges collected before their refcounts are updated */
+#define QCOW2_MAX_PENDING_FREES 64
+
+typedef struct Qcow2PendingFree {
+    uint64_t offset;
+    uint64_t bytes;
+    enum qcow2_discard_type type;
+    QTAILQ_ENTRY(Qcow2PendingFree) next;
+} Qcow2PendingFree;
+
 typedef uint64_t Qcow2GetRefcountFunc(const void *refcount_array,
                                       uint64_t index);
 typedef void Qcow2SetRefcountFunc(void *refcount_array,
@@ -257,12 +291,19 @@ typedef struct BDRVQcow2State {
     CoMutex lock;
 
     QCryptoCipher *cipher; /* current cipher, NULL if no key yet */
+    /* Same key as cipher, one per parallel job after the first */
+    QCryptoCipher *job_ciphers[QCOW2_CRYPT_JOBS - 1];
+    CoMutex crypt_lock;    /* serializes use of the ciphers */
     uint32_t crypt_method_header;
     uint64_t snapshots_offset;
     int snapshots_size;
     unsigned int nb_snapshots;
     QCowSnapshot *snapshots;
 
+    uint32_t nb_bitmaps;
+    uint64_t bitmap_directory_size;
+    uint64_t bitmap_directory_offset;
+
     int flags;
     int qcow_version;
     bool use_lazy_refcounts;
@@ -287,6 +328,19 @@ typedef struct BDRVQcow2State {
     QLIST_HEAD(, Qcow2UnknownHeaderExtension) unknown_header_ext;
     QTAILQ_HEAD (, Qcow2DiscardRegion) discards;
     bool cache_discards;
+    QTAILQ_HEAD(, Qcow2PendingFree) pending_frees;
+    int nb_pending_frees;
+
+    /* Background refcount rebuild of a dirty image, see qcow2-refcount.c */
+    bool background_repair;
+    uint64_t rebuild_boundary;  /* in clusters, 0 if not append-only */
+    Coroutine *rebuild_co;
+    Coroutine *rebuild_paused_co;
+    QEMUTimer *rebuild_timer;
+    CoQueue rebuild_queue;
+    int rebuild_waiters;
+    bool rebuild_paused;
+    bool rebuild_cancel;
 
     /* Backing file path and format as stored in the image (this is not the
      * effective path/format, which may be the result of a runtime option
@@ -339,6 +393,9 @@ typedef struct QCowL2Meta
      */
     Qcow2COWRegion cow_end;
 
+    /** Whether cow_start and cow_end have already been copied */
+    bool cow_done;
+
     /** Pointer to next L2Meta of the same write request */
     struct QCowL2Meta *next;
 
@@ -512,10 +569,24 @@ void qcow2_free_any_clusters(BlockDriverState *bs, uint64_t l2_entry,
 int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     int64_t l1_table_offset, int l1_size, int addend);
 
+int qcow2_inc_refcounts_imrt(BlockDriverState *bs, BdrvCheckResult *res,
+                             void **refcount_table,
+                             int64_t *refcount_table_size,
+                             int64_t offset, int64_t size);
 int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
                           BdrvCheckMode fix);
 
+int qcow2_refcount_rebuild_init(BlockDriverState *bs);
+void qcow2_refcount_rebuild_start(BlockDriverState *bs);
+void qcow2_refcount_rebuild_wait(BlockDriverState *bs);
+void qcow2_refcount_rebuild_cancel(BlockDriverState *bs);
+void qcow2_refcount_rebuild_pause(BlockDriverState *bs);
+void qcow2_refcount_rebuild_detach_aio_context(BlockDriverState *bs);
+void qcow2_refcount_rebuild_attach_aio_context(BlockDriverState *bs,
+                                               AioContext *new_context);
+
 void qcow2_process_discards(BlockDriverState *bs, int ret);
+void qcow2_process_pending_frees(BlockDriverState *bs);
 
 int qcow2_check_metadata_overlap(BlockDriverState *bs, int ign, int64_t offset,
                                  int64_t size);
@@ -532,9 +603,11 @@ int qcow2_grow_l1_table(BlockDriverState *bs, uint64_t min_size,
 int qcow2_write_l1_entry(BlockDriverState *bs, int l1_index);
 void qcow2_l2_cache_reset(BlockDriverState *bs);
 int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset);
-int qcow2_encrypt_sectors(BDRVQcow2State *s, int64_t sector_num,
+int qcow2_encrypt_sectors(QCryptoCipher *cipher, int64_t sector_num,
                           uint8_t *out_buf, const uint8_t *in_buf,
                           int nb_sectors, bool enc, Error **errp);
+int coroutine_fn qcow2_co_crypt(BlockDriverState *bs, int64_t sector_num,
+                                uint8_t *buf, int nb_sectors, bool enc);
 
 int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
                              unsigned int *bytes, uint64_t *cluster_offset);
@@ -545,6 +618,9 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
                                          uint64_t offset,
                                          int compressed_size);
 
+int coroutine_fn qcow2_alloc_cluster_cow(BlockDriverState *bs, QCowL2Meta *m,
+                                         uint64_t guest_offset,
+                                         QEMUIOVector *data);
 int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m);
 int qcow2_discard_clusters(BlockDriverState *bs, uint64_t offset,
     int nb_sectors, enum qcow2_discard_type type, bool full_discard);
@@ -591,4 +667,15 @@ int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table);
 void qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table);
 
+/* qcow2-bitmap.c functions */
+int qcow2_check_bitmaps_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
+                                  void **refcount_table,
+                                  int64_t *refcount_table_size);
+void qcow2_load_dirty_bitmaps(BlockDriverState *bs, Error **errp);
+int qcow2_store_persistent_dirty_bitmaps(BlockDriverState *bs, Error **errp);
+bool qcow2_can_store_new_dirty_bitmap(BlockDriverState *bs,
+                                      const char *name,
+                                      uint32_t granularity,
+                                      Error **errp);
+
 #endif
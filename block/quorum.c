@@ -25,6 +25,7 @@
 #include "qapi/qmp/qstring.h"
 #include "qapi-event.h"
 #include "crypto/hash.h"
+#include "qemu/timer.h"
 
 #define HASH_LENGTH 32
 
@@ -32,6 +33,10 @@
 #define QUORUM_OPT_BLKVERIFY      "blkverify"
 #define QUORUM_OPT_REWRITE        "rewrite-corrupted"
 #define QUORUM_OPT_READ_PATTERN   "read-pattern"
+#define QUORUM_OPT_HEDGE_DELAY    "hedge-delay"
+
+/* Latencies older than this are probed again */
+#define QUORUM_STATS_TIMEOUT_NS   NANOSECONDS_PER_SECOND
 
 /* This union holds a vote hash value */
 typedef union QuorumVoteValue {
@@ -64,6 +69,13 @@ typedef struct QuorumVotes {
     bool (*compare)(QuorumVoteValue *a, QuorumVoteValue *b);
 } QuorumVotes;
 
+/* Read statistics of a child, for the fastest read pattern */
+typedef struct QuorumChildStats {
+    int64_t latency_ns;         /* moving average, 0 until measured */
+    int64_t last_ns;            /* when latency_ns was last updated */
+    int in_flight;
+} QuorumChildStats;
+
 /* the following structure holds the state of one quorum instance */
 typedef struct BDRVQuorumState {
     BdrvChild **children;  /* children BlockDriverStates */
@@ -87,6 +99,10 @@ typedef struct BDRVQuorumState {
                             */
 
     QuorumReadPattern read_pattern;
+    QuorumChildStats *child_stats; /* one per child */
+    int64_t hedge_delay_ns; /* fastest pattern: delay before reading
+                             * another child, 0 to never do it
+                             */
 } BDRVQuorumState;
 
 typedef struct QuorumAIOCB QuorumAIOCB;
@@ -101,6 +117,7 @@ typedef struct QuorumChildRequest {
     QEMUIOVector qiov;
     uint8_t *buf;
     int ret;
+    int64_t start_ns;
     QuorumAIOCB *parent;
 } QuorumChildRequest;
 
@@ -131,6 +148,11 @@ struct QuorumAIOCB {
     bool is_read;
     int vote_ret;
     int child_iter;             /* which child to read in fifo pattern */
+
+    /* fastest pattern */
+    int in_flight;              /* child reads not completed */
+    bool done;                  /* the caller has been completed */
+    QEMUTimer *hedge_timer;
 };
 
 static bool quorum_vote(QuorumAIOCB *acb);
@@ -154,16 +176,15 @@ static AIOCBInfo quorum_aiocb_info = {
     .cancel_async       = quorum_aio_cancel,
 };
 
-static void quorum_aio_finalize(QuorumAIOCB *acb)
+static void quorum_aio_release(QuorumAIOCB *acb)
 {
-    int i, ret = 0;
+    int i;
 
-    if (acb->vote_ret) {
-        ret = acb->vote_ret;
+    if (acb->hedge_timer) {
+        timer_del(acb->hedge_timer);
+        timer_free(acb->hedge_timer);
     }
 
-    acb->common.cb(acb->common.opaque, ret);
-
     if (acb->is_read) {
         /* on the quorum case acb->child_iter == s->num_children - 1 */
         for (i = 0; i <= acb->child_iter; i++) {
@@ -176,6 +197,18 @@ static void quorum_aio_finalize(QuorumAIOCB *acb)
     qemu_aio_unref(acb);
 }
 
+static void quorum_aio_finalize(QuorumAIOCB *acb)
+{
+    int ret = 0;
+
+    if (acb->vote_ret) {
+        ret = acb->vote_ret;
+    }
+
+    acb->common.cb(acb->common.opaque, ret);
+    quorum_aio_release(acb);
+}
+
 static bool quorum_sha256_compare(QuorumVoteValue *a, QuorumVoteValue *b)
 {
     return !memcmp(a->h, b->h, HASH_LENGTH);
@@ -209,6 +242,9 @@ static QuorumAIOCB *quorum_aio_get(BDRVQuorumState *s,
     QLIST_INIT(&acb->votes.vote_list);
     acb->is_read = false;
     acb->vote_ret = 0;
+    acb->in_flight = 0;
+    acb->done = false;
+    acb->hedge_timer = NULL;
 
     for (i = 0; i < s->num_children; i++) {
         acb->qcrs[i].buf = NULL;
@@ -269,6 +305,7 @@ static void quorum_rewrite_aio_cb(void *opaque, int ret)
 }
 
 static BlockAIOCB *read_fifo_child(QuorumAIOCB *acb);
+static bool read_fastest_child(QuorumAIOCB *acb);
 
 static void quorum_copy_qiov(QEMUIOVector *dest, QEMUIOVector *source)
 {
@@ -283,6 +320,45 @@ static void quorum_copy_qiov(QEMUIOVector *dest, QEMUIOVector *source)
     }
 }
 
+/* The first child read that succeeds completes the request, the others
+ * only update the statistics of their child.  A failed read is retried on
+ * another child unless all of them have been tried.
+ */
+static void quorum_fastest_cb(QuorumChildRequest *sacb, int ret)
+{
+    QuorumAIOCB *acb = sacb->parent;
+    BDRVQuorumState *s = acb->common.bs->opaque;
+    QuorumChildStats *stats = &s->child_stats[sacb - acb->qcrs];
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int64_t latency_ns = now - sacb->start_ns;
+
+    sacb->aiocb = NULL;
+    stats->in_flight--;
+    acb->in_flight--;
+
+    if (ret == 0) {
+        stats->latency_ns = stats->latency_ns ?
+            (stats->latency_ns * 7 + latency_ns) / 8 : latency_ns;
+        stats->last_ns = now;
+    }
+
+    if (!acb->done) {
+        if (ret == 0) {
+            quorum_copy_qiov(acb->qiov, &sacb->qiov);
+            acb->done = true;
+            acb->common.cb(acb->common.opaque, 0);
+        } else if ((ret == -ECANCELED || !read_fastest_child(acb)) &&
+                   !acb->in_flight) {
+            acb->done = true;
+            acb->common.cb(acb->common.opaque, ret);
+        }
+    }
+
+    if (acb->done && !acb->in_flight) {
+        quorum_aio_release(acb);
+    }
+}
+
 static void quorum_aio_cb(void *opaque, int ret)
 {
     QuorumChildRequest *sacb = opaque;
@@ -299,6 +375,11 @@ static void quorum_aio_cb(void *opaque, int ret)
                           sacb->aiocb->bs->node_name, ret);
     }
 
+    if (acb->is_read && s->read_pattern == QUORUM_READ_PATTERN_FASTEST) {
+        quorum_fastest_cb(sacb, ret);
+        return;
+    }
+
     if (acb->is_read && s->read_pattern == QUORUM_READ_PATTERN_FIFO) {
         /* We try to read next child in FIFO order if we fail to read */
         if (ret < 0 && (acb->child_iter + 1) < s->num_children) {
@@ -668,23 +749,103 @@ static BlockAIOCB *read_quorum_children(QuorumAIOCB *acb)
     return &acb->common;
 }
 
-static BlockAIOCB *read_fifo_child(QuorumAIOCB *acb)
+static void read_one_child(QuorumAIOCB *acb, int i)
 {
     BDRVQuorumState *s = acb->common.bs->opaque;
 
-    acb->qcrs[acb->child_iter].buf =
-        qemu_blockalign(s->children[acb->child_iter]->bs, acb->qiov->size);
-    qemu_iovec_init(&acb->qcrs[acb->child_iter].qiov, acb->qiov->niov);
-    qemu_iovec_clone(&acb->qcrs[acb->child_iter].qiov, acb->qiov,
-                     acb->qcrs[acb->child_iter].buf);
-    acb->qcrs[acb->child_iter].aiocb =
-        bdrv_aio_readv(s->children[acb->child_iter], acb->sector_num,
-                       &acb->qcrs[acb->child_iter].qiov, acb->nb_sectors,
-                       quorum_aio_cb, &acb->qcrs[acb->child_iter]);
+    acb->qcrs[i].buf = qemu_blockalign(s->children[i]->bs, acb->qiov->size);
+    qemu_iovec_init(&acb->qcrs[i].qiov, acb->qiov->niov);
+    qemu_iovec_clone(&acb->qcrs[i].qiov, acb->qiov, acb->qcrs[i].buf);
+    acb->qcrs[i].start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    acb->qcrs[i].aiocb = bdrv_aio_readv(s->children[i], acb->sector_num,
+                                        &acb->qcrs[i].qiov, acb->nb_sectors,
+                                        quorum_aio_cb, &acb->qcrs[i]);
+}
+
+static BlockAIOCB *read_fifo_child(QuorumAIOCB *acb)
+{
+    read_one_child(acb, acb->child_iter);
 
     return &acb->common;
 }
 
+/* Pick the child not read yet by @acb with the lowest expected latency,
+ * its moving average scaled by its reads in flight.  Children that are
+ * idle and were never or not recently measured are probed first.
+ */
+static int quorum_fastest_child(QuorumAIOCB *acb)
+{
+    BDRVQuorumState *s = acb->common.bs->opaque;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int64_t score, best_score = 0;
+    int i, best = -1;
+
+    for (i = 0; i < s->num_children; i++) {
+        QuorumChildStats *stats = &s->child_stats[i];
+
+        if (acb->qcrs[i].buf) {
+            continue;
+        }
+
+        if (!stats->in_flight &&
+            (!stats->latency_ns ||
+             now - stats->last_ns > QUORUM_STATS_TIMEOUT_NS)) {
+            score = 0;
+        } else if (!stats->latency_ns) {
+            /* already being probed */
+            score = INT64_MAX;
+        } else {
+            score = stats->latency_ns * (stats->in_flight + 1);
+        }
+
+        if (best < 0 || score < best_score) {
+            best = i;
+            best_score = score;
+        }
+    }
+
+    return best;
+}
+
+static void quorum_hedge_timer_cb(void *opaque)
+{
+    QuorumAIOCB *acb = opaque;
+
+    if (!acb->done) {
+        read_fastest_child(acb);
+    }
+}
+
+/* Read the best child not tried yet, and arm the hedge timer if there is
+ * another one.  Returns false if all children have been tried.
+ */
+static bool read_fastest_child(QuorumAIOCB *acb)
+{
+    BDRVQuorumState *s = acb->common.bs->opaque;
+    int i = quorum_fastest_child(acb);
+
+    if (i < 0) {
+        return false;
+    }
+
+    s->child_stats[i].in_flight++;
+    acb->in_flight++;
+    read_one_child(acb, i);
+
+    if (s->hedge_delay_ns && quorum_fastest_child(acb) >= 0) {
+        if (!acb->hedge_timer) {
+            acb->hedge_timer =
+                aio_timer_new(bdrv_get_aio_context(acb->common.bs),
+                              QEMU_CLOCK_REALTIME, SCALE_NS,
+                              quorum_hedge_timer_cb, acb);
+        }
+        timer_mod(acb->hedge_timer,
+                  qemu_clock_get_ns(QEMU_CLOCK_REALTIME) + s->hedge_delay_ns);
+    }
+
+    return true;
+}
+
 static BlockAIOCB *quorum_aio_readv(BlockDriverState *bs,
                                     int64_t sector_num,
                                     QEMUIOVector *qiov,
@@ -702,6 +863,13 @@ static BlockAIOCB *quorum_aio_readv(BlockDriverState *bs,
         return read_quorum_children(acb);
     }
 
+    if (s->read_pattern == QUORUM_READ_PATTERN_FASTEST) {
+        /* every child may be read */
+        acb->child_iter = s->num_children - 1;
+        read_fastest_child(acb);
+        return &acb->common;
+    }
+
     acb->child_iter = 0;
     return read_fifo_child(acb);
 }
@@ -844,7 +1012,14 @@ static QemuOptsList quorum_runtime_opts = {
         {
             .name = QUORUM_OPT_READ_PATTERN,
             .type = QEMU_OPT_STRING,
-            .help = "Allowed pattern: quorum, fifo. Quorum is default",
+            .help = "Allowed pattern: quorum, fifo, fastest. "
+                    "Quorum is default",
+        },
+        {
+            .name = QUORUM_OPT_HEDGE_DELAY,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Microseconds before a read-pattern=fastest read is also "
+                    "sent to another child, 0 (default) to disable",
         },
         { /* end of list */ }
     },
@@ -874,6 +1049,7 @@ static int quorum_open(BlockDriverState *bs, QDict *options, int flags,
     BDRVQuorumState *s = bs->opaque;
     Error *local_err = NULL;
     QemuOpts *opts = NULL;
+    uint64_t hedge_delay;
     bool *opened;
     int i;
     int ret = 0;
@@ -910,11 +1086,20 @@ static int quorum_open(BlockDriverState *bs, QDict *options, int flags,
 
     ret = parse_read_pattern(qemu_opt_get(opts, QUORUM_OPT_READ_PATTERN));
     if (ret < 0) {
-        error_setg(&local_err, "Please set read-pattern as fifo or quorum");
+        error_setg(&local_err,
+                   "Please set read-pattern as fifo, fastest or quorum");
         goto exit;
     }
     s->read_pattern = ret;
 
+    hedge_delay = qemu_opt_get_number(opts, QUORUM_OPT_HEDGE_DELAY, 0);
+    if (hedge_delay > INT64_MAX / SCALE_US) {
+        error_setg(&local_err, "hedge-delay is too large");
+        ret = -EINVAL;
+        goto exit;
+    }
+    s->hedge_delay_ns = hedge_delay * SCALE_US;
+
     if (s->read_pattern == QUORUM_READ_PATTERN_QUORUM) {
         /* is the driver in blkverify mode */
         if (qemu_opt_get_bool(opts, QUORUM_OPT_BLKVERIFY, false) &&
@@ -937,6 +1122,7 @@ static int quorum_open(BlockDriverState *bs, QDict *options, int flags,
 
     /* allocate the children array */
     s->children = g_new0(BdrvChild *, s->num_children);
+    s->child_stats = g_new0(QuorumChildStats, s->num_children);
     opened = g_new0(bool, s->num_children);
 
     for (i = 0; i < s->num_children; i++) {
@@ -967,6 +1153,7 @@ close_exit:
         bdrv_unref_child(bs, s->children[i]);
     }
     g_free(s->children);
+    g_free(s->child_stats);
     g_free(opened);
 exit:
     qemu_opts_del(opts);
@@ -985,6 +1172,7 @@ static void quorum_close(BlockDriverState *bs)
     }
 
     g_free(s->children);
+    g_free(s->child_stats);
 }
 
 static void quorum_add_child(BlockDriverState *bs, BlockDriverState *child_bs,
@@ -1015,6 +1203,9 @@ static void quorum_add_child(BlockDriverState *bs, BlockDriverState *child_bs,
     bdrv_ref(child_bs);
     child = bdrv_attach_child(bs, child_bs, indexstr, &child_format);
     s->children = g_renew(BdrvChild *, s->children, s->num_children + 1);
+    s->child_stats = g_renew(QuorumChildStats, s->child_stats,
+                             s->num_children + 1);
+    memset(&s->child_stats[s->num_children], 0, sizeof(QuorumChildStats));
     s->children[s->num_children++] = child;
 
     bdrv_drained_end(bs);
@@ -1047,7 +1238,11 @@ static void quorum_del_child(BlockDriverState *bs, BdrvChild *child,
     /* We can safely remove this child now */
     memmove(&s->children[i], &s->children[i + 1],
             (s->num_children - i - 1) * sizeof(BdrvChild *));
+    memmove(&s->child_stats[i], &s->child_stats[i + 1],
+            (s->num_children - i - 1) * sizeof(QuorumChildStats));
     s->children = g_renew(BdrvChild *, s->children, --s->num_children);
+    s->child_stats = g_renew(QuorumChildStats, s->child_stats,
+                             s->num_children);
     bdrv_unref_child(bs, child);
 
     bdrv_drained_end(bs);
@@ -432,6 +432,23 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     s->open_flags = open_flags;
     raw_parse_flags(bdrv_flags, &s->open_flags);
 
+#ifdef CONFIG_LINUX_IO_URING
+    if ((bdrv_flags & BDRV_O_IO_URING) &&
+        !aio_get_linux_io_uring(bdrv_get_aio_context(bs))) {
+        error_setg(errp, "aio=io_uring was specified, but io_uring is not "
+                         "supported by the host kernel.");
+        ret = -EINVAL;
+        goto fail;
+    }
+#else
+    if (bdrv_flags & BDRV_O_IO_URING) {
+        error_setg(errp, "aio=io_uring was specified, but is not supported "
+                         "in this build.");
+        ret = -EINVAL;
+        goto fail;
+    }
+#endif /* !defined(CONFIG_LINUX_IO_URING) */
+
     s->fd = -1;
     fd = qemu_open(filename, s->open_flags, 0644);
     if (fd < 0) {
@@ -1264,6 +1281,21 @@ static int coroutine_fn raw_co_prw(BlockDriverState *bs, uint64_t offset,
         }
     }
 
+#ifdef CONFIG_LINUX_IO_URING
+    /* io_uring does not need O_DIRECT, but still needs aligned buffers
+     * with it.  If no ring can be set up for the AioContext the node has
+     * moved to, the request goes to the thread pool.
+     */
+    if ((bs->open_flags & BDRV_O_IO_URING) &&
+        !(type & QEMU_AIO_MISALIGNED)) {
+        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+        if (aio) {
+            assert(qiov->size == bytes);
+            return luring_co_submit(bs, aio, s->fd, offset, qiov, type);
+        }
+    }
+#endif
+
     return paio_submit_co(bs, s->fd, offset, qiov, bytes, type);
 }
 
@@ -1290,6 +1322,14 @@ static void raw_aio_plug(BlockDriverState *bs)
         laio_io_plug(bs, aio);
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (bs->open_flags & BDRV_O_IO_URING) {
+        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+        if (aio) {
+            luring_io_plug(bs, aio);
+        }
+    }
+#endif
 }
 
 static void raw_aio_unplug(BlockDriverState *bs)
@@ -1300,6 +1340,14 @@ static void raw_aio_unplug(BlockDriverState *bs)
         laio_io_unplug(bs, aio);
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (bs->open_flags & BDRV_O_IO_URING) {
+        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+        if (aio) {
+            luring_io_unplug(bs, aio);
+        }
+    }
+#endif
 }
 
 static BlockAIOCB *raw_aio_flush(BlockDriverState *bs,
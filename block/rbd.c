@@ -18,6 +18,7 @@
 #include "block/block_int.h"
 #include "crypto/secret.h"
 #include "qemu/cutils.h"
+#include "qemu/event_notifier.h"
 
 #include <rbd/librbd.h>
 
@@ -53,6 +54,13 @@
 #undef LIBRBD_SUPPORTS_DISCARD
 #endif
 
+/* librbd defines LIBRBD_SUPPORTS_IOVEC when it has rbd_aio_readv/writev */
+#ifdef LIBRBD_SUPPORTS_IOVEC
+#define LIBRBD_USE_IOVEC 1
+#else
+#define LIBRBD_USE_IOVEC 0
+#endif
+
 #define OBJ_MAX_SIZE (1UL << OBJ_DEFAULT_OBJ_ORDER)
 
 #define RBD_MAX_CONF_NAME_SIZE 128
@@ -66,12 +74,12 @@ typedef enum {
     RBD_AIO_READ,
     RBD_AIO_WRITE,
     RBD_AIO_DISCARD,
-    RBD_AIO_FLUSH
+    RBD_AIO_FLUSH,
+    RBD_AIO_WRITE_ZEROES
 } RBDAIOCmd;
 
 typedef struct RBDAIOCB {
     BlockAIOCB common;
-    QEMUBH *bh;
     int64_t ret;
     QEMUIOVector *qiov;
     char *bounce;
@@ -86,6 +94,7 @@ typedef struct RADOSCB {
     int64_t size;
     char *buf;
     int64_t ret;
+    QSLIST_ENTRY(RADOSCB) next;
 } RADOSCB;
 
 typedef struct BDRVRBDState {
@@ -94,6 +103,11 @@ typedef struct BDRVRBDState {
     rbd_image_t image;
     char name[RBD_MAX_IMAGE_NAME_SIZE];
     char *snap;
+
+    /* librbd completes requests in its own threads, which push them here
+     * and kick completion_notifier in the BDS's AioContext.  */
+    EventNotifier completion_notifier;
+    QSLIST_HEAD(, RADOSCB) completed;
 } BDRVRBDState;
 
 static int qemu_rbd_next_tok(char *dst, int dst_len,
@@ -409,8 +423,8 @@ static int qemu_rbd_create(const char *filename, QemuOpts *opts, Error **errp)
 }
 
 /*
- * This aio completion is being called from rbd_finish_bh() and runs in qemu
- * BH context.
+ * This aio completion is being called from qemu_rbd_completion_cb() and runs
+ * in the BDS's AioContext.
  */
 static void qemu_rbd_complete_aio(RADOSCB *rcb)
 {
@@ -428,11 +442,16 @@ static void qemu_rbd_complete_aio(RADOSCB *rcb)
         }
     } else {
         if (r < 0) {
-            memset(rcb->buf, 0, rcb->size);
-            acb->ret = r;
+            r = 0;
+            acb->ret = rcb->ret;
             acb->error = 1;
-        } else if (r < rcb->size) {
-            memset(rcb->buf + r, 0, rcb->size - r);
+        }
+        if (r < rcb->size) {
+            if (LIBRBD_USE_IOVEC) {
+                qemu_iovec_memset(acb->qiov, r, 0, rcb->size - r);
+            } else {
+                memset(rcb->buf + r, 0, rcb->size - r);
+            }
             if (!acb->error) {
                 acb->ret = rcb->size;
             }
@@ -443,10 +462,12 @@ static void qemu_rbd_complete_aio(RADOSCB *rcb)
 
     g_free(rcb);
 
-    if (acb->cmd == RBD_AIO_READ) {
-        qemu_iovec_from_buf(acb->qiov, 0, acb->bounce, acb->qiov->size);
+    if (!LIBRBD_USE_IOVEC) {
+        if (acb->cmd == RBD_AIO_READ) {
+            qemu_iovec_from_buf(acb->qiov, 0, acb->bounce, acb->qiov->size);
+        }
+        qemu_vfree(acb->bounce);
     }
-    qemu_vfree(acb->bounce);
     acb->common.cb(acb->common.opaque, (acb->ret > 0 ? 0 : acb->ret));
 
     qemu_aio_unref(acb);
@@ -571,10 +592,23 @@ static int qemu_rbd_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     bs->read_only = (s->snap != NULL);
+#ifdef LIBRBD_SUPPORTS_WRITE_ZEROES
+    bs->supported_zero_flags = BDRV_REQ_MAY_UNMAP;
+#endif
+
+    r = event_notifier_init(&s->completion_notifier, false);
+    if (r < 0) {
+        error_setg_errno(errp, -r, "failed to initialize event notifier");
+        goto failed_notifier;
+    }
+    QSLIST_INIT(&s->completed);
+    qemu_rbd_attach_aio_context(bs, bdrv_get_aio_context(bs));
 
     qemu_opts_del(opts);
     return 0;
 
+failed_notifier:
+    rbd_close(s->image);
 failed_open:
     rados_ioctx_destroy(s->io_ctx);
 failed_shutdown:
@@ -590,6 +624,8 @@ static void qemu_rbd_close(BlockDriverState *bs)
     BDRVRBDState *s = bs->opaque;
 
     rbd_close(s->image);
+    qemu_rbd_detach_aio_context(bs);
+    event_notifier_cleanup(&s->completion_notifier);
     rados_ioctx_destroy(s->io_ctx);
     g_free(s->snap);
     rados_shutdown(s->cluster);
@@ -599,11 +635,19 @@ static const AIOCBInfo rbd_aiocb_info = {
     .aiocb_size = sizeof(RBDAIOCB),
 };
 
-static void rbd_finish_bh(void *opaque)
+static void qemu_rbd_completion_cb(EventNotifier *e)
 {
-    RADOSCB *rcb = opaque;
-    qemu_bh_delete(rcb->acb->bh);
-    qemu_rbd_complete_aio(rcb);
+    BDRVRBDState *s = container_of(e, BDRVRBDState, completion_notifier);
+    QSLIST_HEAD(, RADOSCB) completed;
+    RADOSCB *rcb, *next;
+
+    event_notifier_test_and_clear(e);
+
+    /* Everything that has completed so far is handled in one go */
+    QSLIST_MOVE_ATOMIC(&completed, &s->completed);
+    QSLIST_FOREACH_SAFE(rcb, &completed, next, next) {
+        qemu_rbd_complete_aio(rcb);
+    }
 }
 
 /*
@@ -611,19 +655,36 @@ static void rbd_finish_bh(void *opaque)
  *
  * Note: this function is being called from a non qemu thread so
  * we need to be careful about what we do here. Generally we only
- * schedule a BH, and do the rest of the io completion handling
- * from rbd_finish_bh() which runs in a qemu context.
+ * queue the request and kick the event notifier, and do the rest of
+ * the io completion handling from qemu_rbd_completion_cb() which runs
+ * in a qemu context.
  */
 static void rbd_finish_aiocb(rbd_completion_t c, RADOSCB *rcb)
 {
-    RBDAIOCB *acb = rcb->acb;
+    BDRVRBDState *s = rcb->s;
 
     rcb->ret = rbd_aio_get_return_value(c);
     rbd_aio_release(c);
 
-    acb->bh = aio_bh_new(bdrv_get_aio_context(acb->common.bs),
-                         rbd_finish_bh, rcb);
-    qemu_bh_schedule(acb->bh);
+    QSLIST_INSERT_HEAD_ATOMIC(&s->completed, rcb, next);
+    event_notifier_set(&s->completion_notifier);
+}
+
+static void qemu_rbd_detach_aio_context(BlockDriverState *bs)
+{
+    BDRVRBDState *s = bs->opaque;
+
+    aio_set_event_notifier(bdrv_get_aio_context(bs), &s->completion_notifier,
+                           false, NULL);
+}
+
+static void qemu_rbd_attach_aio_context(BlockDriverState *bs,
+                                        AioContext *new_context)
+{
+    BDRVRBDState *s = bs->opaque;
+
+    aio_set_event_notifier(new_context, &s->completion_notifier,
+                           false, qemu_rbd_completion_cb);
 }
 
 static int rbd_aio_discard_wrapper(rbd_image_t image,
@@ -638,6 +699,18 @@ static int rbd_aio_discard_wrapper(rbd_image_t image,
 #endif
 }
 
+static int rbd_aio_write_zeroes_wrapper(rbd_image_t image,
+                                        uint64_t off,
+                                        uint64_t len,
+                                        rbd_completion_t comp)
+{
+#ifdef LIBRBD_SUPPORTS_WRITE_ZEROES
+    return rbd_aio_write_zeroes(image, off, len, comp, 0, 0);
+#else
+    return -ENOTSUP;
+#endif
+}
+
 static int rbd_aio_flush_wrapper(rbd_image_t image,
                                  rbd_completion_t comp)
 {
@@ -668,9 +741,8 @@ static BlockAIOCB *rbd_start_aio(BlockDriverState *bs,
     acb->cmd = cmd;
     acb->qiov = qiov;
     assert(!qiov || qiov->size == size);
-    if (cmd == RBD_AIO_DISCARD || cmd == RBD_AIO_FLUSH) {
-        acb->bounce = NULL;
-    } else {
+    acb->bounce = NULL;
+    if (!LIBRBD_USE_IOVEC && (cmd == RBD_AIO_READ || cmd == RBD_AIO_WRITE)) {
         acb->bounce = qemu_try_blockalign(bs, qiov->size);
         if (acb->bounce == NULL) {
             goto failed;
@@ -679,9 +751,8 @@ static BlockAIOCB *rbd_start_aio(BlockDriverState *bs,
     acb->ret = 0;
     acb->error = 0;
     acb->s = s;
-    acb->bh = NULL;
 
-    if (cmd == RBD_AIO_WRITE) {
+    if (!LIBRBD_USE_IOVEC && cmd == RBD_AIO_WRITE) {
         qemu_iovec_to_buf(acb->qiov, 0, acb->bounce, qiov->size);
     }
 
@@ -699,14 +770,25 @@ static BlockAIOCB *rbd_start_aio(BlockDriverState *bs,
 
     switch (cmd) {
     case RBD_AIO_WRITE:
+#if LIBRBD_USE_IOVEC
+        r = rbd_aio_writev(s->image, qiov->iov, qiov->niov, off, c);
+#else
         r = rbd_aio_write(s->image, off, size, buf, c);
+#endif
         break;
     case RBD_AIO_READ:
+#if LIBRBD_USE_IOVEC
+        r = rbd_aio_readv(s->image, qiov->iov, qiov->niov, off, c);
+#else
         r = rbd_aio_read(s->image, off, size, buf, c);
+#endif
         break;
     case RBD_AIO_DISCARD:
         r = rbd_aio_discard_wrapper(s->image, off, size, c);
         break;
+    case RBD_AIO_WRITE_ZEROES:
+        r = rbd_aio_write_zeroes_wrapper(s->image, off, size, c);
+        break;
     case RBD_AIO_FLUSH:
         r = rbd_aio_flush_wrapper(s->image, c);
         break;
@@ -941,6 +1023,43 @@ static BlockAIOCB *qemu_rbd_aio_pdiscard(BlockDriverState *bs,
 }
 #endif
 
+#ifdef LIBRBD_SUPPORTS_WRITE_ZEROES
+typedef struct RBDCoData {
+    Coroutine *co;
+    int ret;
+} RBDCoData;
+
+static void qemu_rbd_co_cb(void *opaque, int ret)
+{
+    RBDCoData *data = opaque;
+
+    data->ret = ret;
+    qemu_coroutine_enter(data->co);
+}
+
+static int coroutine_fn qemu_rbd_co_pwrite_zeroes(BlockDriverState *bs,
+                                                  int64_t offset,
+                                                  int count,
+                                                  BdrvRequestFlags flags)
+{
+    RBDCoData data = {
+        .co = qemu_coroutine_self(),
+    };
+
+    /* rbd_aio_write_zeroes deallocates the range where it can */
+    if (!(flags & BDRV_REQ_MAY_UNMAP)) {
+        return -ENOTSUP;
+    }
+
+    if (!rbd_start_aio(bs, offset, NULL, count, qemu_rbd_co_cb, &data,
+                       RBD_AIO_WRITE_ZEROES)) {
+        return -EIO;
+    }
+    qemu_coroutine_yield();
+    return data.ret;
+}
+#endif
+
 #ifdef LIBRBD_SUPPORTS_INVALIDATE
 static void qemu_rbd_invalidate_cache(BlockDriverState *bs,
                                       Error **errp)
@@ -990,6 +1109,9 @@ static BlockDriver bdrv_rbd = {
     .bdrv_truncate      = qemu_rbd_truncate,
     .protocol_name      = "rbd",
 
+    .bdrv_detach_aio_context = qemu_rbd_detach_aio_context,
+    .bdrv_attach_aio_context = qemu_rbd_attach_aio_context,
+
     .bdrv_aio_readv         = qemu_rbd_aio_readv,
     .bdrv_aio_writev        = qemu_rbd_aio_writev,
 
@@ -1002,6 +1124,9 @@ static BlockDriver bdrv_rbd = {
 #ifdef LIBRBD_SUPPORTS_DISCARD
     .bdrv_aio_pdiscard      = qemu_rbd_aio_pdiscard,
 #endif
+#ifdef LIBRBD_SUPPORTS_WRITE_ZEROES
+    .bdrv_co_pwrite_zeroes  = qemu_rbd_co_pwrite_zeroes,
+#endif
 
     .bdrv_snapshot_create   = qemu_rbd_snap_create,
     .bdrv_snapshot_delete   = qemu_rbd_snap_remove,
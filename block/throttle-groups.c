@@ -23,6 +23,7 @@
  */
 
 #include "qemu/osdep.h"
+#include "qapi/error.h"
 #include "sysemu/block-backend.h"
 #include "block/throttle-groups.h"
 #include "qemu/queue.h"
@@ -52,18 +53,28 @@
  * bdrv_set_aio_context()). Therefore in this file a thread will
  * access some other BlockBackend's timers only after verifying that
  * that BlockBackend has throttled requests in the queue.
+ *
+ * Groups can be nested: the limits of a group's parent also apply to
+ * the sum of the I/O of all its children, for example a per-tenant cap
+ * above per-disk limits.  A parent does not need BlockBackends of its
+ * own, and its requests are throttled with the timers of the children.
+ * When a thread needs the locks of both a group and its parent, it
+ * takes the child's lock first.
  */
 typedef struct ThrottleGroup {
     char *name; /* This is constant during the lifetime of the group */
 
-    QemuMutex lock; /* This lock protects the following four fields */
+    QemuMutex lock; /* This lock protects the following five fields */
     ThrottleState ts;
     QLIST_HEAD(, BlockBackendPublic) head;
     BlockBackend *tokens[2];
     bool any_timer_armed[2];
+    /* Written with throttle_groups_lock held too; holds a reference */
+    struct ThrottleGroup *parent;
 
-    /* These two are protected by the global throttle_groups_lock */
+    /* These three are protected by the global throttle_groups_lock */
     unsigned refcount;
+    bool pinned; /* Configured by name, holds a reference to itself */
     QTAILQ_ENTRY(ThrottleGroup) list;
 } ThrottleGroup;
 
@@ -71,6 +82,40 @@ static QemuMutex throttle_groups_lock;
 static QTAILQ_HEAD(, ThrottleGroup) throttle_groups =
     QTAILQ_HEAD_INITIALIZER(throttle_groups);
 
+static QEMUClockType throttle_group_clock_type(void)
+{
+    if (qtest_enabled()) {
+        /* For testing block IO throttling only */
+        return QEMU_CLOCK_VIRTUAL;
+    }
+    return QEMU_CLOCK_REALTIME;
+}
+
+/* Look for a ThrottleGroup given its name, creating it if needed.  The
+ * new group has no references.
+ *
+ * This assumes that throttle_groups_lock is held.
+ */
+static ThrottleGroup *throttle_group_lookup(const char *name)
+{
+    ThrottleGroup *tg;
+
+    QTAILQ_FOREACH(tg, &throttle_groups, list) {
+        if (!strcmp(name, tg->name)) {
+            return tg;
+        }
+    }
+
+    tg = g_new0(ThrottleGroup, 1);
+    tg->name = g_strdup(name);
+    qemu_mutex_init(&tg->lock);
+    throttle_init(&tg->ts);
+    QLIST_INIT(&tg->head);
+
+    QTAILQ_INSERT_TAIL(&throttle_groups, tg, list);
+    return tg;
+}
+
 /* Increments the reference count of a ThrottleGroup given its name.
  *
  * If no ThrottleGroup is found with the given name a new one is
@@ -81,30 +126,11 @@ static QTAILQ_HEAD(, ThrottleGroup) throttle_groups =
  */
 ThrottleState *throttle_group_incref(const char *name)
 {
-    ThrottleGroup *tg = NULL;
-    ThrottleGroup *iter;
+    ThrottleGroup *tg;
 
     qemu_mutex_lock(&throttle_groups_lock);
 
-    /* Look for an existing group with that name */
-    QTAILQ_FOREACH(iter, &throttle_groups, list) {
-        if (!strcmp(name, iter->name)) {
-            tg = iter;
-            break;
-        }
-    }
-
-    /* Create a new one if not found */
-    if (!tg) {
-        tg = g_new0(ThrottleGroup, 1);
-        tg->name = g_strdup(name);
-        qemu_mutex_init(&tg->lock);
-        throttle_init(&tg->ts);
-        QLIST_INIT(&tg->head);
-
-        QTAILQ_INSERT_TAIL(&throttle_groups, tg, list);
-    }
-
+    tg = throttle_group_lookup(name);
     tg->refcount++;
 
     qemu_mutex_unlock(&throttle_groups_lock);
@@ -122,15 +148,107 @@ ThrottleState *throttle_group_incref(const char *name)
 void throttle_group_unref(ThrottleState *ts)
 {
     ThrottleGroup *tg = container_of(ts, ThrottleGroup, ts);
+    ThrottleGroup *parent = NULL;
 
     qemu_mutex_lock(&throttle_groups_lock);
     if (--tg->refcount == 0) {
+        parent = tg->parent;
         QTAILQ_REMOVE(&throttle_groups, tg, list);
         qemu_mutex_destroy(&tg->lock);
         g_free(tg->name);
         g_free(tg);
     }
     qemu_mutex_unlock(&throttle_groups_lock);
+
+    /* The group held a reference to its parent */
+    if (parent) {
+        throttle_group_unref(&parent->ts);
+    }
+}
+
+/* Make the limits of a group also apply to the I/O of another one.
+ *
+ * @name:   the name of an existing ThrottleGroup
+ * @parent: the name of the parent group, which is created if needed,
+ *          or NULL to detach the group from its parent
+ */
+void throttle_group_set_parent(const char *name, const char *parent,
+                               Error **errp)
+{
+    ThrottleGroup *tg, *new_parent = NULL, *old_parent, *iter;
+
+    qemu_mutex_lock(&throttle_groups_lock);
+
+    QTAILQ_FOREACH(tg, &throttle_groups, list) {
+        if (!strcmp(name, tg->name)) {
+            break;
+        }
+    }
+    if (!tg) {
+        error_setg(errp, "Throttle group '%s' not found", name);
+        goto out;
+    }
+
+    if (parent) {
+        new_parent = throttle_group_lookup(parent);
+        for (iter = new_parent; iter; iter = iter->parent) {
+            if (iter == tg) {
+                error_setg(errp, "Throttle group '%s' cannot be a parent "
+                           "of itself", name);
+                goto out;
+            }
+        }
+        new_parent->refcount++;
+    }
+
+    qemu_mutex_lock(&tg->lock);
+    old_parent = tg->parent;
+    tg->parent = new_parent;
+    qemu_mutex_unlock(&tg->lock);
+
+    qemu_mutex_unlock(&throttle_groups_lock);
+    if (old_parent) {
+        throttle_group_unref(&old_parent->ts);
+    }
+    return;
+
+out:
+    qemu_mutex_unlock(&throttle_groups_lock);
+}
+
+/* Set the limits of a group that has no BlockBackends, typically one that
+ * is only used as a parent.  The group is created if needed and is kept
+ * until QEMU exits.  Groups with BlockBackends are configured through one
+ * of them with throttle_group_config().
+ *
+ * @name: the name of the ThrottleGroup
+ * @cfg:  the configuration to set
+ */
+void throttle_group_set_limits(const char *name, ThrottleConfig *cfg,
+                               Error **errp)
+{
+    ThrottleGroup *tg;
+
+    qemu_mutex_lock(&throttle_groups_lock);
+
+    tg = throttle_group_lookup(name);
+    qemu_mutex_lock(&tg->lock);
+    if (!QLIST_EMPTY(&tg->head)) {
+        error_setg(errp, "Throttle group '%s' has devices, set its limits "
+                   "through one of them", name);
+        qemu_mutex_unlock(&tg->lock);
+        goto out;
+    }
+    throttle_set_config(&tg->ts, throttle_group_clock_type(), cfg);
+    qemu_mutex_unlock(&tg->lock);
+
+    if (!tg->pinned) {
+        tg->pinned = true;
+        tg->refcount++;
+    }
+
+out:
+    qemu_mutex_unlock(&throttle_groups_lock);
 }
 
 /* Get the name from a BlockBackend's ThrottleGroup. The name (and the pointer)
@@ -203,6 +321,47 @@ static BlockBackend *next_throttle_token(BlockBackend *blk, bool is_write)
     return token;
 }
 
+/* Return how long the next request of this type has to wait because of
+ * the limits of the ancestors of a group.
+ *
+ * This assumes that tg->lock is held.
+ */
+static int64_t throttle_group_parent_delay(ThrottleGroup *tg, bool is_write,
+                                           int64_t now)
+{
+    ThrottleGroup *parent = tg->parent;
+    int64_t wait;
+
+    if (!parent) {
+        return 0;
+    }
+
+    qemu_mutex_lock(&parent->lock);
+    wait = MAX(throttle_compute_delay(&parent->ts, is_write, now),
+               throttle_group_parent_delay(parent, is_write, now));
+    qemu_mutex_unlock(&parent->lock);
+    return wait;
+}
+
+/* Account an I/O request to all the ancestors of a group.
+ *
+ * This assumes that tg->lock is held.
+ */
+static void throttle_group_parent_account(ThrottleGroup *tg, bool is_write,
+                                          unsigned int bytes)
+{
+    ThrottleGroup *parent = tg->parent;
+
+    if (!parent) {
+        return;
+    }
+
+    qemu_mutex_lock(&parent->lock);
+    throttle_account(&parent->ts, is_write, bytes);
+    throttle_group_parent_account(parent, is_write, bytes);
+    qemu_mutex_unlock(&parent->lock);
+}
+
 /* Check if the next I/O request for a BlockBackend needs to be throttled or
  * not. If there's no timer set in this group, set one and update the token
  * accordingly.
@@ -219,6 +378,7 @@ static bool throttle_group_schedule_timer(BlockBackend *blk, bool is_write)
     ThrottleState *ts = blkp->throttle_state;
     ThrottleTimers *tt = &blkp->throttle_timers;
     ThrottleGroup *tg = container_of(ts, ThrottleGroup, ts);
+    int64_t now, wait;
     bool must_wait;
 
     if (blkp->io_limits_disabled) {
@@ -230,7 +390,15 @@ static bool throttle_group_schedule_timer(BlockBackend *blk, bool is_write)
         return true;
     }
 
-    must_wait = throttle_schedule_timer(ts, tt, is_write);
+    /* Like throttle_schedule_timer(), but the limits of the parents
+     * count too */
+    now = qemu_clock_get_ns(tt->clock_type);
+    wait = MAX(throttle_compute_delay(ts, is_write, now),
+               throttle_group_parent_delay(tg, is_write, now));
+    must_wait = wait > 0;
+    if (must_wait && !timer_pending(tt->timers[is_write])) {
+        timer_mod(tt->timers[is_write], now + wait);
+    }
 
     /* If a timer just got armed, set blk as the current token */
     if (must_wait) {
@@ -314,6 +482,7 @@ void coroutine_fn throttle_group_co_io_limits_intercept(BlockBackend *blk,
 
     /* The I/O will be executed, so do the accounting */
     throttle_account(blkp->throttle_state, is_write, bytes);
+    throttle_group_parent_account(tg, is_write, bytes);
 
     /* Schedule the next request */
     schedule_next_request(blk, is_write);
@@ -431,12 +600,6 @@ void throttle_group_register_blk(BlockBackend *blk, const char *groupname)
     BlockBackendPublic *blkp = blk_get_public(blk);
     ThrottleState *ts = throttle_group_incref(groupname);
     ThrottleGroup *tg = container_of(ts, ThrottleGroup, ts);
-    int clock_type = QEMU_CLOCK_REALTIME;
-
-    if (qtest_enabled()) {
-        /* For testing block IO throttling only */
-        clock_type = QEMU_CLOCK_VIRTUAL;
-    }
 
     blkp->throttle_state = ts;
 
@@ -452,7 +615,7 @@ void throttle_group_register_blk(BlockBackend *blk, const char *groupname)
 
     throttle_timers_init(&blkp->throttle_timers,
                          blk_get_aio_context(blk),
-                         clock_type,
+                         throttle_group_clock_type(),
                          read_timer_cb,
                          write_timer_cb,
                          blk);
@@ -377,6 +377,8 @@ static void extract_common_blockdev_options(QemuOpts *opts, int *bdrv_flags,
         if ((aio = qemu_opt_get(opts, "aio")) != NULL) {
             if (!strcmp(aio, "native")) {
                 *bdrv_flags |= BDRV_O_NATIVE_AIO;
+            } else if (!strcmp(aio, "io_uring")) {
+                *bdrv_flags |= BDRV_O_IO_URING;
             } else if (!strcmp(aio, "threads")) {
                 /* this is the default */
             } else {
@@ -1843,6 +1845,7 @@ static void do_drive_backup(const char *job_id, const char *device,
                             const char *format, enum MirrorSyncMode sync,
                             bool has_mode, enum NewImageMode mode,
                             bool has_speed, int64_t speed,
+                            bool has_max_workers, int64_t max_workers,
                             bool has_bitmap, const char *bitmap,
                             bool has_on_source_error,
                             BlockdevOnError on_source_error,
@@ -1884,6 +1887,7 @@ static void drive_backup_prepare(BlkActionState *common, Error **errp)
                     backup->sync,
                     backup->has_mode, backup->mode,
                     backup->has_speed, backup->speed,
+                    backup->has_max_workers, backup->max_workers,
                     backup->has_bitmap, backup->bitmap,
                     backup->has_on_source_error, backup->on_source_error,
                     backup->has_on_target_error, backup->on_target_error,
@@ -1927,6 +1931,7 @@ typedef struct BlockdevBackupState {
 static void do_blockdev_backup(const char *job_id, const char *device,
                                const char *target, enum MirrorSyncMode sync,
                                bool has_speed, int64_t speed,
+                               bool has_max_workers, int64_t max_workers,
                                bool has_on_source_error,
                                BlockdevOnError on_source_error,
                                bool has_on_target_error,
@@ -1974,6 +1979,7 @@ static void blockdev_backup_prepare(BlkActionState *common, Error **errp)
     do_blockdev_backup(backup->has_job_id ? backup->job_id : NULL,
                        backup->device, backup->target, backup->sync,
                        backup->has_speed, backup->speed,
+                       backup->has_max_workers, backup->max_workers,
                        backup->has_on_source_error, backup->on_source_error,
                        backup->has_on_target_error, backup->on_target_error,
                        common->block_job_txn, &local_err);
@@ -2031,6 +2037,7 @@ static void block_dirty_bitmap_add_prepare(BlkActionState *common,
     /* AIO context taken and released within qmp_block_dirty_bitmap_add */
     qmp_block_dirty_bitmap_add(action->node, action->name,
                                action->has_granularity, action->granularity,
+                               action->has_persistent, action->persistent,
                                &local_err);
 
     if (!local_err) {
@@ -2634,79 +2641,85 @@ fail:
 }
 
 /* throttling disk I/O limits */
-void qmp_block_set_io_throttle(BlockIOThrottle *arg, Error **errp)
+static void throttle_limits_to_config(ThrottleLimits *arg,
+                                      ThrottleConfig *cfg)
 {
-    ThrottleConfig cfg;
-    BlockDriverState *bs;
-    BlockBackend *blk;
-    AioContext *aio_context;
+    throttle_config_init(cfg);
+    cfg->buckets[THROTTLE_BPS_TOTAL].avg = arg->bps;
+    cfg->buckets[THROTTLE_BPS_READ].avg  = arg->bps_rd;
+    cfg->buckets[THROTTLE_BPS_WRITE].avg = arg->bps_wr;
 
-    blk = blk_by_name(arg->device);
-    if (!blk) {
-        error_set(errp, ERROR_CLASS_DEVICE_NOT_FOUND,
-                  "Device '%s' not found", arg->device);
-        return;
-    }
-
-    aio_context = blk_get_aio_context(blk);
-    aio_context_acquire(aio_context);
-
-    bs = blk_bs(blk);
-    if (!bs) {
-        error_setg(errp, "Device '%s' has no medium", arg->device);
-        goto out;
-    }
-
-    throttle_config_init(&cfg);
-    cfg.buckets[THROTTLE_BPS_TOTAL].avg = arg->bps;
-    cfg.buckets[THROTTLE_BPS_READ].avg  = arg->bps_rd;
-    cfg.buckets[THROTTLE_BPS_WRITE].avg = arg->bps_wr;
-
-    cfg.buckets[THROTTLE_OPS_TOTAL].avg = arg->iops;
-    cfg.buckets[THROTTLE_OPS_READ].avg  = arg->iops_rd;
-    cfg.buckets[THROTTLE_OPS_WRITE].avg = arg->iops_wr;
+    cfg->buckets[THROTTLE_OPS_TOTAL].avg = arg->iops;
+    cfg->buckets[THROTTLE_OPS_READ].avg  = arg->iops_rd;
+    cfg->buckets[THROTTLE_OPS_WRITE].avg = arg->iops_wr;
 
     if (arg->has_bps_max) {
-        cfg.buckets[THROTTLE_BPS_TOTAL].max = arg->bps_max;
+        cfg->buckets[THROTTLE_BPS_TOTAL].max = arg->bps_max;
     }
     if (arg->has_bps_rd_max) {
-        cfg.buckets[THROTTLE_BPS_READ].max = arg->bps_rd_max;
+        cfg->buckets[THROTTLE_BPS_READ].max = arg->bps_rd_max;
     }
     if (arg->has_bps_wr_max) {
-        cfg.buckets[THROTTLE_BPS_WRITE].max = arg->bps_wr_max;
+        cfg->buckets[THROTTLE_BPS_WRITE].max = arg->bps_wr_max;
     }
     if (arg->has_iops_max) {
-        cfg.buckets[THROTTLE_OPS_TOTAL].max = arg->iops_max;
+        cfg->buckets[THROTTLE_OPS_TOTAL].max = arg->iops_max;
     }
     if (arg->has_iops_rd_max) {
-        cfg.buckets[THROTTLE_OPS_READ].max = arg->iops_rd_max;
+        cfg->buckets[THROTTLE_OPS_READ].max = arg->iops_rd_max;
     }
     if (arg->has_iops_wr_max) {
-        cfg.buckets[THROTTLE_OPS_WRITE].max = arg->iops_wr_max;
+        cfg->buckets[THROTTLE_OPS_WRITE].max = arg->iops_wr_max;
     }
 
     if (arg->has_bps_max_length) {
-        cfg.buckets[THROTTLE_BPS_TOTAL].burst_length = arg->bps_max_length;
+        cfg->buckets[THROTTLE_BPS_TOTAL].burst_length = arg->bps_max_length;
     }
     if (arg->has_bps_rd_max_length) {
-        cfg.buckets[THROTTLE_BPS_READ].burst_length = arg->bps_rd_max_length;
+        cfg->buckets[THROTTLE_BPS_READ].burst_length = arg->bps_rd_max_length;
     }
     if (arg->has_bps_wr_max_length) {
-        cfg.buckets[THROTTLE_BPS_WRITE].burst_length = arg->bps_wr_max_length;
+        cfg->buckets[THROTTLE_BPS_WRITE].burst_length = arg->bps_wr_max_length;
     }
     if (arg->has_iops_max_length) {
-        cfg.buckets[THROTTLE_OPS_TOTAL].burst_length = arg->iops_max_length;
+        cfg->buckets[THROTTLE_OPS_TOTAL].burst_length = arg->iops_max_length;
     }
     if (arg->has_iops_rd_max_length) {
-        cfg.buckets[THROTTLE_OPS_READ].burst_length = arg->iops_rd_max_length;
+        cfg->buckets[THROTTLE_OPS_READ].burst_length = arg->iops_rd_max_length;
     }
     if (arg->has_iops_wr_max_length) {
-        cfg.buckets[THROTTLE_OPS_WRITE].burst_length = arg->iops_wr_max_length;
+        cfg->buckets[THROTTLE_OPS_WRITE].burst_length = arg->iops_wr_max_length;
     }
 
     if (arg->has_iops_size) {
-        cfg.op_size = arg->iops_size;
+        cfg->op_size = arg->iops_size;
     }
+}
+
+void qmp_block_set_io_throttle(BlockIOThrottle *arg, Error **errp)
+{
+    ThrottleConfig cfg;
+    BlockDriverState *bs;
+    BlockBackend *blk;
+    AioContext *aio_context;
+
+    blk = blk_by_name(arg->device);
+    if (!blk) {
+        error_set(errp, ERROR_CLASS_DEVICE_NOT_FOUND,
+                  "Device '%s' not found", arg->device);
+        return;
+    }
+
+    aio_context = blk_get_aio_context(blk);
+    aio_context_acquire(aio_context);
+
+    bs = blk_bs(blk);
+    if (!bs) {
+        error_setg(errp, "Device '%s' has no medium", arg->device);
+        goto out;
+    }
+
+    throttle_limits_to_config(qapi_BlockIOThrottle_base(arg), &cfg);
 
     if (!throttle_is_valid(&cfg, errp)) {
         goto out;
@@ -2723,6 +2736,11 @@ void qmp_block_set_io_throttle(BlockIOThrottle *arg, Error **errp)
         }
         /* Set the new throttling configuration */
         blk_set_io_limits(blk, &cfg);
+        if (arg->has_parent_group) {
+            throttle_group_set_parent(throttle_group_get_name(blk),
+                                      *arg->parent_group ?
+                                      arg->parent_group : NULL, errp);
+        }
     } else if (blk_get_public(blk)->throttle_state) {
         /* If all throttling settings are set to 0, disable I/O limits */
         blk_io_limits_disable(blk);
@@ -2732,12 +2750,87 @@ out:
     aio_context_release(aio_context);
 }
 
+void qmp_block_latency_histogram_set(const char *device,
+                                     bool has_boundaries,
+                                     uint64List *boundaries,
+                                     bool has_boundaries_read,
+                                     uint64List *boundaries_read,
+                                     bool has_boundaries_write,
+                                     uint64List *boundaries_write,
+                                     bool has_boundaries_flush,
+                                     uint64List *boundaries_flush,
+                                     Error **errp)
+{
+    static const char *const type_names[BLOCK_MAX_IOTYPE] = {
+        [BLOCK_ACCT_READ] = "read",
+        [BLOCK_ACCT_WRITE] = "write",
+        [BLOCK_ACCT_FLUSH] = "flush",
+    };
+    uint64List *lists[BLOCK_MAX_IOTYPE] = {
+        [BLOCK_ACCT_READ] = has_boundaries_read ? boundaries_read : boundaries,
+        [BLOCK_ACCT_WRITE] = has_boundaries_write ? boundaries_write
+                                                  : boundaries,
+        [BLOCK_ACCT_FLUSH] = has_boundaries_flush ? boundaries_flush
+                                                  : boundaries,
+    };
+    BlockAcctStats *stats;
+    BlockBackend *blk;
+    AioContext *aio_context;
+    int i;
+
+    blk = blk_by_name(device);
+    if (!blk) {
+        error_set(errp, ERROR_CLASS_DEVICE_NOT_FOUND,
+                  "Device '%s' not found", device);
+        return;
+    }
+
+    aio_context = blk_get_aio_context(blk);
+    aio_context_acquire(aio_context);
+
+    stats = blk_get_stats(blk);
+    for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
+        if (block_latency_histogram_set(stats, i, lists[i]) < 0) {
+            error_setg(errp, "Invalid %s latency histogram boundaries, they "
+                       "must be non-zero and strictly ascending",
+                       type_names[i]);
+            break;
+        }
+    }
+
+    aio_context_release(aio_context);
+}
+
+void qmp_block_set_throttle_group(ThrottleGroupLimits *arg, Error **errp)
+{
+    ThrottleConfig cfg;
+    Error *local_err = NULL;
+
+    throttle_limits_to_config(qapi_ThrottleGroupLimits_base(arg), &cfg);
+    if (!throttle_is_valid(&cfg, errp)) {
+        return;
+    }
+
+    throttle_group_set_limits(arg->group, &cfg, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+
+    if (arg->has_parent) {
+        throttle_group_set_parent(arg->group,
+                                  *arg->parent ? arg->parent : NULL, errp);
+    }
+}
+
 void qmp_block_dirty_bitmap_add(const char *node, const char *name,
                                 bool has_granularity, uint32_t granularity,
+                                bool has_persistent, bool persistent,
                                 Error **errp)
 {
     AioContext *aio_context;
     BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
 
     if (!name || name[0] == '\0') {
         error_setg(errp, "Bitmap name cannot be empty");
@@ -2763,7 +2856,19 @@ void qmp_block_dirty_bitmap_add(const char *node, const char *name,
         granularity = bdrv_get_default_bitmap_granularity(bs);
     }
 
-    bdrv_create_dirty_bitmap(bs, granularity, name, errp);
+    if (!has_persistent) {
+        persistent = false;
+    }
+
+    if (persistent &&
+        !bdrv_can_store_new_dirty_bitmap(bs, name, granularity, errp)) {
+        goto out;
+    }
+
+    bitmap = bdrv_create_dirty_bitmap(bs, granularity, name, errp);
+    if (bitmap != NULL) {
+        bdrv_dirty_bitmap_set_persistance(bitmap, persistent);
+    }
 
  out:
     aio_context_release(aio_context);
@@ -3160,6 +3265,7 @@ static void do_drive_backup(const char *job_id, const char *device,
                             const char *format, enum MirrorSyncMode sync,
                             bool has_mode, enum NewImageMode mode,
                             bool has_speed, int64_t speed,
+                            bool has_max_workers, int64_t max_workers,
                             bool has_bitmap, const char *bitmap,
                             bool has_on_source_error,
                             BlockdevOnError on_source_error,
@@ -3181,6 +3287,9 @@ static void do_drive_backup(const char *job_id, const char *device,
     if (!has_speed) {
         speed = 0;
     }
+    if (!has_max_workers) {
+        max_workers = 0;
+    }
     if (!has_on_source_error) {
         on_source_error = BLOCKDEV_ON_ERROR_REPORT;
     }
@@ -3276,7 +3385,7 @@ static void do_drive_backup(const char *job_id, const char *device,
         }
     }
 
-    backup_start(job_id, bs, target_bs, speed, sync, bmap,
+    backup_start(job_id, bs, target_bs, speed, max_workers, sync, bmap,
                  on_source_error, on_target_error,
                  block_job_cb, bs, txn, &local_err);
     bdrv_unref(target_bs);
@@ -3295,6 +3404,7 @@ void qmp_drive_backup(bool has_job_id, const char *job_id,
                       enum MirrorSyncMode sync,
                       bool has_mode, enum NewImageMode mode,
                       bool has_speed, int64_t speed,
+                      bool has_max_workers, int64_t max_workers,
                       bool has_bitmap, const char *bitmap,
                       bool has_on_source_error, BlockdevOnError on_source_error,
                       bool has_on_target_error, BlockdevOnError on_target_error,
@@ -3303,6 +3413,7 @@ void qmp_drive_backup(bool has_job_id, const char *job_id,
     return do_drive_backup(has_job_id ? job_id : NULL, device, target,
                            has_format, format, sync,
                            has_mode, mode, has_speed, speed,
+                           has_max_workers, max_workers,
                            has_bitmap, bitmap,
                            has_on_source_error, on_source_error,
                            has_on_target_error, on_target_error,
@@ -3317,6 +3428,7 @@ BlockDeviceInfoList *qmp_query_named_block_nodes(Error **errp)
 void do_blockdev_backup(const char *job_id, const char *device,
                         const char *target, enum MirrorSyncMode sync,
                          bool has_speed, int64_t speed,
+                         bool has_max_workers, int64_t max_workers,
                          bool has_on_source_error,
                          BlockdevOnError on_source_error,
                          bool has_on_target_error,
@@ -3332,6 +3444,9 @@ void do_blockdev_backup(const char *job_id, const char *device,
     if (!has_speed) {
         speed = 0;
     }
+    if (!has_max_workers) {
+        max_workers = 0;
+    }
     if (!has_on_source_error) {
         on_source_error = BLOCKDEV_ON_ERROR_REPORT;
     }
@@ -3370,8 +3485,9 @@ void do_blockdev_backup(const char *job_id, const char *device,
             goto out;
         }
     }
-    backup_start(job_id, bs, target_bs, speed, sync, NULL, on_source_error,
-                 on_target_error, block_job_cb, bs, txn, &local_err);
+    backup_start(job_id, bs, target_bs, speed, max_workers, sync, NULL,
+                 on_source_error, on_target_error, block_job_cb, bs, txn,
+                 &local_err);
     if (local_err != NULL) {
         error_propagate(errp, local_err);
     }
@@ -3383,6 +3499,7 @@ void qmp_blockdev_backup(bool has_job_id, const char *job_id,
                          const char *device, const char *target,
                          enum MirrorSyncMode sync,
                          bool has_speed, int64_t speed,
+                         bool has_max_workers, int64_t max_workers,
                          bool has_on_source_error,
                          BlockdevOnError on_source_error,
                          bool has_on_target_error,
@@ -3391,6 +3508,7 @@ void qmp_blockdev_backup(bool has_job_id, const char *job_id,
 {
     do_blockdev_backup(has_job_id ? job_id : NULL, device, target,
                        sync, has_speed, speed,
+                       has_max_workers, max_workers,
                        has_on_source_error, on_source_error,
                        has_on_target_error, on_target_error,
                        NULL, errp);
@@ -4146,7 +4264,7 @@ QemuOptsList qemu_common_drive_opts = {
         },{
             .name = "aio",
             .type = QEMU_OPT_STRING,
-            .help = "host AIO implementation (threads, native)",
+            .help = "host AIO implementation (threads, native, io_uring)",
         },{
             .name = BDRV_OPT_CACHE_WB,
             .type = QEMU_OPT_BOOL,
@@ -4281,7 +4399,7 @@ static QemuOptsList qemu_root_bds_opts = {
         },{
             .name = "aio",
             .type = QEMU_OPT_STRING,
-            .help = "host AIO implementation (threads, native)",
+            .help = "host AIO implementation (threads, native, io_uring)",
         },{
             .name = "read-only",
             .type = QEMU_OPT_BOOL,
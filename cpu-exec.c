@@ -21,6 +21,7 @@
 #include "trace.h"
 #include "disas/disas.h"
 #include "exec/exec-all.h"
+#include "exec/helper-proto.h"
 #include "tcg.h"
 #include "qemu/atomic.h"
 #include "sysemu/qtest.h"
@@ -162,6 +163,10 @@ static inline tcg_target_ulong cpu_tb_exec(CPUState *cpu, TranslationBlock *itb)
     }
 #endif /* DEBUG_DISAS */
 
+    if (unlikely(tb_sample_period)) {
+        tb_sample_exec(cpu, itb);
+    }
+
     cpu->can_do_io = !use_icount;
     ret = tcg_qemu_tb_exec(env, tb_ptr);
     cpu->can_do_io = 1;
@@ -278,44 +283,63 @@ static TranslationBlock *tb_find_physical(CPUState *cpu,
     return qht_lookup(&tcg_ctx.tb_ctx.htable, tb_cmp, &desc, h);
 }
 
+/* The QHT lookup needs no lock, tb_lock is only taken to translate */
 static TranslationBlock *tb_find_slow(CPUState *cpu,
                                       target_ulong pc,
                                       target_ulong cs_base,
-                                      uint32_t flags)
+                                      uint32_t flags,
+                                      bool *have_tb_lock)
 {
     TranslationBlock *tb;
 
     tb = tb_find_physical(cpu, pc, cs_base, flags);
-    if (tb) {
-        goto found;
+    if (!tb) {
+        /* mmap_lock is needed by tb_gen_code, and mmap_lock must be
+         * taken outside tb_lock.
+         */
+        mmap_lock();
+        tb_lock();
+        *have_tb_lock = true;
+
+        /* Another thread may have translated the same block while we
+         * were taking the locks, check again.
+         */
+        tb = tb_find_physical(cpu, pc, cs_base, flags);
+        if (!tb) {
+            /* if no translated code available, then translate it now */
+            tb = tb_gen_code(cpu, pc, cs_base, flags, 0);
+        }
+
+        mmap_unlock();
     }
 
-#ifdef CONFIG_USER_ONLY
-    /* mmap_lock is needed by tb_gen_code, and mmap_lock must be
-     * taken outside tb_lock.  Since we're momentarily dropping
-     * tb_lock, there's a chance that our desired tb has been
-     * translated.
-     */
-    tb_unlock();
+    /* we add the TB in the virtual pc hash table */
+    atomic_set(&cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)], tb);
+    return tb;
+}
+
+/* Replace a TB that crossed TB_HOT_THRESHOLD with a CF_HOT translation,
+ * which keeps counting from the same value.
+ */
+static TranslationBlock *tb_gen_hot(CPUState *cpu, TranslationBlock *tb)
+{
+    target_ulong pc = tb->pc, cs_base = tb->cs_base;
+    uint32_t flags = tb->flags;
+    int cflags = (tb->cflags & ~CF_USE_ICOUNT) | CF_HOT;
+    uint64_t exec_count = tb->exec_count;
+
     mmap_lock();
     tb_lock();
-    tb = tb_find_physical(cpu, pc, cs_base, flags);
-    if (tb) {
-        mmap_unlock();
-        goto found;
-    }
-#endif
 
-    /* if no translated code available, then translate it now */
-    tb = tb_gen_code(cpu, pc, cs_base, flags, 0);
+    if (!atomic_read(&tb->invalid)) {
+        tb_phys_invalidate(tb, -1);
+        tb = tb_gen_code(cpu, pc, cs_base, flags, cflags);
+        tb->exec_count = exec_count;
+        atomic_set(&cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)], tb);
+    }
 
-#ifdef CONFIG_USER_ONLY
+    tb_unlock();
     mmap_unlock();
-#endif
-
-found:
-    /* we add the TB in the virtual pc hash table */
-    cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)] = tb;
     return tb;
 }
 
@@ -327,23 +351,22 @@ static inline TranslationBlock *tb_find_fast(CPUState *cpu,
     TranslationBlock *tb;
     target_ulong cs_base, pc;
     uint32_t flags;
+    bool have_tb_lock = false;
 
     /* we record a subset of the CPU state. It will
        always be the same before a given translated block
        is executed. */
     cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
-    tb_lock();
-    tb = cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)];
+    tb = atomic_read(&cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)]);
     if (unlikely(!tb || tb->pc != pc || tb->cs_base != cs_base ||
                  tb->flags != flags)) {
-        tb = tb_find_slow(cpu, pc, cs_base, flags);
+        tb = tb_find_slow(cpu, pc, cs_base, flags, &have_tb_lock);
     }
-    if (cpu->tb_flushed) {
-        /* Ensure that no TB jump will be modified as the
-         * translation buffer has been flushed.
-         */
+    if (unlikely((tb->cflags & (CF_PROFILE | CF_HOT)) == CF_PROFILE &&
+                 tb->exec_count >= TB_HOT_THRESHOLD && !have_tb_lock)) {
+        tb = tb_gen_hot(cpu, tb);
+        /* the calling TB may have been the one replaced */
         *last_tb = NULL;
-        cpu->tb_flushed = false;
     }
 #ifndef CONFIG_USER_ONLY
     /* We don't take care of direct jumps when address mapping changes in
@@ -356,12 +379,50 @@ static inline TranslationBlock *tb_find_fast(CPUState *cpu,
 #endif
     /* See if we can patch the calling TB. */
     if (*last_tb && !qemu_loglevel_mask(CPU_LOG_TB_NOCHAIN)) {
-        tb_add_jump(*last_tb, tb_exit, tb);
+        if (!have_tb_lock) {
+            tb_lock();
+            have_tb_lock = true;
+        }
+        /* Ensure that no TB jump will be modified as the translation
+         * buffer has been flushed, nor to a TB being invalidated.
+         */
+        if (cpu->tb_flushed) {
+            cpu->tb_flushed = false;
+        } else if (!atomic_read(&tb->invalid)) {
+            tb_add_jump(*last_tb, tb_exit, tb);
+        }
+    }
+    if (have_tb_lock) {
+        tb_unlock();
     }
-    tb_unlock();
     return tb;
 }
 
+/* Target of tcg_gen_lookup_and_goto_ptr: only the lock-free tb_jmp_cache
+ * probe is done here, anything else (translation, hot TB promotion) goes
+ * through the epilogue to tb_find_fast.  Interrupts are still noticed by
+ * the exit request check at the start of every TB.
+ */
+void *HELPER(lookup_tb_ptr)(CPUArchState *env)
+{
+    CPUState *cpu = ENV_GET_CPU(env);
+    TranslationBlock *tb;
+    target_ulong cs_base, pc;
+    uint32_t flags;
+
+    cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
+    tb = atomic_read(&cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)]);
+    if (unlikely(!tb || tb->pc != pc || tb->cs_base != cs_base ||
+                 tb->flags != flags || atomic_read(&tb->invalid))) {
+        return tcg_ctx.code_gen_epilogue;
+    }
+    if (unlikely((tb->cflags & (CF_PROFILE | CF_HOT)) == CF_PROFILE &&
+                 tb->exec_count >= TB_HOT_THRESHOLD)) {
+        return tcg_ctx.code_gen_epilogue;
+    }
+    return tb->tc_ptr;
+}
+
 static inline bool cpu_handle_halt(CPUState *cpu)
 {
     if (cpu->halted) {
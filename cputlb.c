@@ -29,9 +29,11 @@
 #include "exec/memory-internal.h"
 #include "exec/ram_addr.h"
 #include "exec/exec-all.h"
+#include "exec/tb-hash.h"
 #include "tcg/tcg.h"
 #include "qemu/error-report.h"
 #include "exec/log.h"
+#include "exec/helper-proto.h"
 
 /* DEBUG defines, enable DEBUG_TLB_LOG to log to the CPU_LOG_MMU target */
 /* #define DEBUG_TLB */
@@ -61,6 +63,217 @@
 /* statistics */
 int tlb_flush_count;
 
+/* The TLB of a vCPU is only changed by the thread that runs it. Flushes
+ * requested by other threads are queued as work for the vCPU, which runs
+ * it before executing guest code again. With the TCG vCPUs sharing one
+ * thread only the main loop queues flushes.
+ */
+static bool tlb_flush_is_remote(CPUState *cpu)
+{
+    return tcg_enabled() && cpu->created && !qemu_cpu_is_self(cpu);
+}
+
+#define ALL_MMUIDX_BITS ((1 << NB_MMU_MODES) - 1)
+
+QEMU_BUILD_BUG_ON(NB_MMU_MODES > 16);
+
+typedef struct TLBFlushRangeWork {
+    CPUState *cpu;
+    target_ulong addr;
+    target_ulong len;
+    uint16_t idxmap;
+} TLBFlushRangeWork;
+
+static void tlb_flush_nocheck(CPUState *cpu, int flush_global);
+static void tlb_flush_range_nocheck(CPUState *cpu, target_ulong addr,
+                                    target_ulong len, uint16_t idxmap);
+
+static void tlb_flush_async_work(void *data)
+{
+    tlb_flush_nocheck(data, 1);
+}
+
+static void tlb_flush_range_async_work(void *data)
+{
+    TLBFlushRangeWork *work = data;
+
+    tlb_flush_range_nocheck(work->cpu, work->addr, work->len, work->idxmap);
+    g_free(work);
+}
+
+/* Second-level TLB, one per MMU index, looked up when the victim TLB
+ * misses and filled with the entries evicted from it. The size of the
+ * first-level table is built into the inline lookup of every TCG backend,
+ * this one is only accessed from here so it is sized at runtime: it grows
+ * while its working set does not fit and shrinks when flushes keep finding
+ * it mostly empty.
+ *
+ * Entries are direct-mapped by page number and tagged with a generation,
+ * so dropping the whole table is O(1). The slots that were filled are
+ * listed to walk only those when dirty tracking changes.
+ */
+#define CPU_L2TLB_MIN_BITS 8
+#define CPU_L2TLB_MAX_BITS 16
+/* Consecutive flushes with a sparse table before it shrinks */
+#define CPU_L2TLB_SHRINK_FLUSHES 16
+
+typedef struct CPUL2TLBEntry {
+    CPUTLBEntry tlb;
+    CPUIOTLBEntry iotlb;
+    uint32_t gen;
+} CPUL2TLBEntry;
+
+typedef struct CPUL2TLB {
+    CPUL2TLBEntry *table;
+    uint32_t *slots;
+    unsigned bits;
+    uint32_t gen;
+    uint32_t used;
+    /* since the last flush or resize */
+    uint32_t lookups;
+    uint32_t hits;
+    unsigned sparse_flushes;
+} CPUL2TLB;
+
+static inline CPUL2TLB *tlb_l2_get(CPUState *cpu, int mmu_idx)
+{
+    return cpu->l2tlb ? &cpu->l2tlb[mmu_idx] : NULL;
+}
+
+static inline CPUL2TLBEntry *tlb_l2_slot(CPUL2TLB *l2, target_ulong page)
+{
+    size_t i = (page >> TARGET_PAGE_BITS) & ((1u << l2->bits) - 1);
+
+    return &l2->table[i];
+}
+
+static void tlb_l2_reset_stats(CPUL2TLB *l2)
+{
+    l2->lookups = 0;
+    l2->hits = 0;
+}
+
+static void tlb_l2_resize(CPUL2TLB *l2, unsigned bits)
+{
+    tlb_debug("%u -> %u bits\n", l2->bits, bits);
+
+    g_free(l2->table);
+    g_free(l2->slots);
+    l2->table = g_new0(CPUL2TLBEntry, 1u << bits);
+    l2->slots = g_new(uint32_t, 1u << bits);
+    l2->bits = bits;
+    l2->gen = 1;
+    l2->used = 0;
+    tlb_l2_reset_stats(l2);
+}
+
+static void tlb_l2_clear(CPUL2TLB *l2)
+{
+    if (++l2->gen == 0) {
+        memset(l2->table, 0, sizeof(CPUL2TLBEntry) << l2->bits);
+        l2->gen = 1;
+    }
+    l2->used = 0;
+}
+
+/* Most slots are taken and most lookups still miss */
+static bool tlb_l2_too_small(CPUL2TLB *l2)
+{
+    uint32_t size = 1u << l2->bits;
+
+    return l2->bits < CPU_L2TLB_MAX_BITS &&
+           l2->used >= size / 4 * 3 &&
+           l2->lookups >= size / 4 &&
+           l2->hits < l2->lookups / 2;
+}
+
+static void tlb_l2_flush(CPUL2TLB *l2)
+{
+    if (!l2->table) {
+        return;
+    }
+
+    if (l2->used > (1u << l2->bits) / 8) {
+        l2->sparse_flushes = 0;
+    } else {
+        l2->sparse_flushes++;
+    }
+
+    if (tlb_l2_too_small(l2)) {
+        tlb_l2_resize(l2, l2->bits + 1);
+    } else if (l2->sparse_flushes >= CPU_L2TLB_SHRINK_FLUSHES &&
+               l2->bits > CPU_L2TLB_MIN_BITS) {
+        l2->sparse_flushes = 0;
+        tlb_l2_resize(l2, l2->bits - 1);
+    } else {
+        tlb_l2_clear(l2);
+        tlb_l2_reset_stats(l2);
+    }
+}
+
+static void tlb_l2_flush_all(CPUState *cpu)
+{
+    int mmu_idx;
+
+    if (!cpu->l2tlb) {
+        return;
+    }
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        tlb_l2_flush(&cpu->l2tlb[mmu_idx]);
+    }
+}
+
+/* Store an entry evicted from the victim TLB */
+static void tlb_l2_spill(CPUState *cpu, int mmu_idx, const CPUTLBEntry *te,
+                         const CPUIOTLBEntry *io)
+{
+    CPUL2TLB *l2;
+    CPUL2TLBEntry *e;
+    target_ulong page;
+
+    if (!(te->addr_read & TLB_INVALID_MASK)) {
+        page = te->addr_read;
+    } else if (!(te->addr_write & TLB_INVALID_MASK)) {
+        page = te->addr_write;
+    } else if (!(te->addr_code & TLB_INVALID_MASK)) {
+        page = te->addr_code;
+    } else {
+        return;
+    }
+    page &= TARGET_PAGE_MASK;
+
+    if (!cpu->l2tlb) {
+        cpu->l2tlb = g_new0(CPUL2TLB, NB_MMU_MODES);
+    }
+    l2 = &cpu->l2tlb[mmu_idx];
+    if (!l2->table) {
+        tlb_l2_resize(l2, CPU_L2TLB_MIN_BITS);
+    }
+
+    e = tlb_l2_slot(l2, page);
+    if (e->gen != l2->gen) {
+        e->gen = l2->gen;
+        l2->slots[l2->used++] = e - l2->table;
+    }
+    e->tlb = *te;
+    e->iotlb = *io;
+}
+
+void tlb_destroy(CPUState *cpu)
+{
+    int mmu_idx;
+
+    if (!cpu->l2tlb) {
+        return;
+    }
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        g_free(cpu->l2tlb[mmu_idx].table);
+        g_free(cpu->l2tlb[mmu_idx].slots);
+    }
+    g_free(cpu->l2tlb);
+    cpu->l2tlb = NULL;
+}
+
 /* NOTE:
  * If flush_global is true (the usual case), flush all tlb entries.
  * If flush_global is false, flush (at least) all tlb entries not
@@ -73,26 +286,53 @@ int tlb_flush_count;
  * entries from the TLB at any time, so flushing more entries than
  * required is only an efficiency issue, not a correctness issue.
  */
-void tlb_flush(CPUState *cpu, int flush_global)
+static void tlb_flush_nocheck(CPUState *cpu, int flush_global)
 {
     CPUArchState *env = cpu->env_ptr;
+    int mmu_idx;
 
     tlb_debug("(%d)\n", flush_global);
 
     memset(env->tlb_table, -1, sizeof(env->tlb_table));
     memset(env->tlb_v_table, -1, sizeof(env->tlb_v_table));
     memset(cpu->tb_jmp_cache, 0, sizeof(cpu->tb_jmp_cache));
+    tlb_l2_flush_all(cpu);
 
     env->vtlb_index = 0;
-    env->tlb_flush_addr = -1;
-    env->tlb_flush_mask = 0;
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        env->tlb_flush_addr[mmu_idx] = -1;
+        env->tlb_flush_mask[mmu_idx] = 0;
+    }
     tlb_flush_count++;
 }
 
-static inline void v_tlb_flush_by_mmuidx(CPUState *cpu, va_list argp)
+void tlb_flush(CPUState *cpu, int flush_global)
+{
+    if (tlb_flush_is_remote(cpu)) {
+        async_run_on_cpu(cpu, tlb_flush_async_work, cpu);
+    } else {
+        tlb_flush_nocheck(cpu, flush_global);
+    }
+}
+
+/* Flush every entry of one MMU index, the caller flushes tb_jmp_cache */
+static void tlb_flush_one_mmuidx(CPUState *cpu, int mmu_idx)
 {
     CPUArchState *env = cpu->env_ptr;
 
+    tlb_debug("%d\n", mmu_idx);
+
+    memset(env->tlb_table[mmu_idx], -1, sizeof(env->tlb_table[0]));
+    memset(env->tlb_v_table[mmu_idx], -1, sizeof(env->tlb_v_table[0]));
+    if (cpu->l2tlb) {
+        tlb_l2_flush(&cpu->l2tlb[mmu_idx]);
+    }
+    env->tlb_flush_addr[mmu_idx] = -1;
+    env->tlb_flush_mask[mmu_idx] = 0;
+}
+
+static inline void v_tlb_flush_by_mmuidx(CPUState *cpu, va_list argp)
+{
     tlb_debug("start\n");
 
     for (;;) {
@@ -102,10 +342,7 @@ static inline void v_tlb_flush_by_mmuidx(CPUState *cpu, va_list argp)
             break;
         }
 
-        tlb_debug("%d\n", mmu_idx);
-
-        memset(env->tlb_table[mmu_idx], -1, sizeof(env->tlb_table[0]));
-        memset(env->tlb_v_table[mmu_idx], -1, sizeof(env->tlb_v_table[0]));
+        tlb_flush_one_mmuidx(cpu, mmu_idx);
     }
 
     memset(cpu->tb_jmp_cache, 0, sizeof(cpu->tb_jmp_cache));
@@ -131,84 +368,164 @@ static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
     }
 }
 
-void tlb_flush_page(CPUState *cpu, target_ulong addr)
+static inline bool tlb_addr_in_range(target_ulong tlb_addr,
+                                     target_ulong first, target_ulong last)
 {
-    CPUArchState *env = cpu->env_ptr;
-    int i;
-    int mmu_idx;
+    tlb_addr &= TARGET_PAGE_MASK | TLB_INVALID_MASK;
+    return tlb_addr >= first && tlb_addr <= last;
+}
 
-    tlb_debug("page :" TARGET_FMT_lx "\n", addr);
+/* Flush the entry if it maps a page of [first, last] */
+static inline void tlb_flush_entry_range(CPUTLBEntry *tlb_entry,
+                                         target_ulong first, target_ulong last)
+{
+    if (tlb_addr_in_range(tlb_entry->addr_read, first, last) ||
+        tlb_addr_in_range(tlb_entry->addr_write, first, last) ||
+        tlb_addr_in_range(tlb_entry->addr_code, first, last)) {
+        memset(tlb_entry, -1, sizeof(*tlb_entry));
+    }
+}
 
-    /* Check if we need to flush due to large pages.  */
-    if ((addr & env->tlb_flush_mask) == env->tlb_flush_addr) {
-        tlb_debug("forcing full flush ("
-                  TARGET_FMT_lx "/" TARGET_FMT_lx ")\n",
-                  env->tlb_flush_addr, env->tlb_flush_mask);
+static void tlb_l2_flush_page(CPUState *cpu, int mmu_idx, target_ulong addr)
+{
+    CPUL2TLB *l2 = tlb_l2_get(cpu, mmu_idx);
+    CPUL2TLBEntry *e;
 
-        tlb_flush(cpu, 1);
-        return;
+    if (l2 && l2->table) {
+        e = tlb_l2_slot(l2, addr);
+        if (e->gen == l2->gen) {
+            tlb_flush_entry(&e->tlb, addr);
+        }
     }
+}
 
-    addr &= TARGET_PAGE_MASK;
-    i = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-        tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr);
+/* Whether the area covered by the large pages of the MMU index overlaps
+ * [first, last]
+ */
+static bool tlb_range_has_large_page(CPUArchState *env, int mmu_idx,
+                                     target_ulong first, target_ulong last)
+{
+    target_ulong lp_addr = env->tlb_flush_addr[mmu_idx];
+    target_ulong lp_last;
+
+    if (lp_addr == (target_ulong)-1) {
+        return false;
+    }
+    lp_last = lp_addr | ~env->tlb_flush_mask[mmu_idx];
+    return first <= lp_last && lp_addr <= last;
+}
+
+/* Flush the pages of [addr, addr + len) from the MMU indexes in idxmap.
+ * An index whose large pages overlap the range, or whose TLB has fewer
+ * entries than the range has pages, is flushed entirely.
+ */
+static void tlb_flush_range_nocheck(CPUState *cpu, target_ulong addr,
+                                    target_ulong len, uint16_t idxmap)
+{
+    CPUArchState *env = cpu->env_ptr;
+    target_ulong last, page, npages, i;
+    bool flush_jmp_cache = false;
+    int mmu_idx, k;
+
+    tlb_debug("addr " TARGET_FMT_lx " len " TARGET_FMT_lx " idxmap %x\n",
+              addr, len, idxmap);
+
+    if (len == 0) {
+        return;
     }
+    last = (addr + len - 1) | ~TARGET_PAGE_MASK;
+    addr &= TARGET_PAGE_MASK;
+    npages = ((last - addr) >> TARGET_PAGE_BITS) + 1;
 
-    /* check whether there are entries that need to be flushed in the vtlb */
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-        int k;
+        if (!(idxmap & (1 << mmu_idx))) {
+            continue;
+        }
+
+        if (npages >= CPU_TLB_SIZE ||
+            tlb_range_has_large_page(env, mmu_idx, addr, last)) {
+            tlb_debug("forcing flush of idx %d ("
+                      TARGET_FMT_lx "/" TARGET_FMT_lx ")\n", mmu_idx,
+                      env->tlb_flush_addr[mmu_idx],
+                      env->tlb_flush_mask[mmu_idx]);
+
+            tlb_flush_one_mmuidx(cpu, mmu_idx);
+            flush_jmp_cache = true;
+            continue;
+        }
+
+        for (i = 0, page = addr; i < npages; i++, page += TARGET_PAGE_SIZE) {
+            int index = (page >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+
+            tlb_flush_entry(&env->tlb_table[mmu_idx][index], page);
+            tlb_l2_flush_page(cpu, mmu_idx, page);
+        }
+
+        /* check whether there are vltb entries that need to be flushed */
         for (k = 0; k < CPU_VTLB_SIZE; k++) {
-            tlb_flush_entry(&env->tlb_v_table[mmu_idx][k], addr);
+            tlb_flush_entry_range(&env->tlb_v_table[mmu_idx][k], addr, last);
         }
     }
 
-    tb_flush_jmp_cache(cpu, addr);
+    if (flush_jmp_cache ||
+        npages > TB_JMP_CACHE_SIZE / TB_JMP_PAGE_SIZE / 2) {
+        memset(cpu->tb_jmp_cache, 0, sizeof(cpu->tb_jmp_cache));
+    } else {
+        for (i = 0, page = addr; i < npages; i++, page += TARGET_PAGE_SIZE) {
+            tb_flush_jmp_cache(cpu, page);
+        }
+    }
 }
 
-void tlb_flush_page_by_mmuidx(CPUState *cpu, target_ulong addr, ...)
+void tlb_flush_range_by_mmuidx(CPUState *cpu, target_ulong addr,
+                               target_ulong len, uint16_t idxmap)
 {
-    CPUArchState *env = cpu->env_ptr;
-    int i, k;
-    va_list argp;
-
-    va_start(argp, addr);
-
-    tlb_debug("addr "TARGET_FMT_lx"\n", addr);
+    TLBFlushRangeWork *work;
+
+    if (tlb_flush_is_remote(cpu)) {
+        work = g_new(TLBFlushRangeWork, 1);
+        work->cpu = cpu;
+        work->addr = addr;
+        work->len = len;
+        work->idxmap = idxmap;
+        async_run_on_cpu(cpu, tlb_flush_range_async_work, work);
+    } else {
+        tlb_flush_range_nocheck(cpu, addr, len, idxmap);
+    }
+}
 
-    /* Check if we need to flush due to large pages.  */
-    if ((addr & env->tlb_flush_mask) == env->tlb_flush_addr) {
-        tlb_debug("forced full flush ("
-                  TARGET_FMT_lx "/" TARGET_FMT_lx ")\n",
-                  env->tlb_flush_addr, env->tlb_flush_mask);
+void tlb_flush_range_by_mmuidx_all_cpus(CPUState *src_cpu, target_ulong addr,
+                                        target_ulong len, uint16_t idxmap)
+{
+    CPUState *cpu;
 
-        v_tlb_flush_by_mmuidx(cpu, argp);
-        va_end(argp);
-        return;
+    CPU_FOREACH(cpu) {
+        tlb_flush_range_by_mmuidx(cpu, addr, len, idxmap);
     }
+}
 
-    addr &= TARGET_PAGE_MASK;
-    i = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+void tlb_flush_page(CPUState *cpu, target_ulong addr)
+{
+    tlb_flush_range_by_mmuidx(cpu, addr, TARGET_PAGE_SIZE, ALL_MMUIDX_BITS);
+}
+
+void tlb_flush_page_by_mmuidx(CPUState *cpu, target_ulong addr, ...)
+{
+    uint16_t idxmap = 0;
+    va_list argp;
 
+    va_start(argp, addr);
     for (;;) {
         int mmu_idx = va_arg(argp, int);
 
         if (mmu_idx < 0) {
             break;
         }
-
-        tlb_debug("idx %d\n", mmu_idx);
-
-        tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr);
-
-        /* check whether there are vltb entries that need to be flushed */
-        for (k = 0; k < CPU_VTLB_SIZE; k++) {
-            tlb_flush_entry(&env->tlb_v_table[mmu_idx][k], addr);
-        }
+        idxmap |= 1 << mmu_idx;
     }
     va_end(argp);
 
-    tb_flush_jmp_cache(cpu, addr);
+    tlb_flush_range_by_mmuidx(cpu, addr, TARGET_PAGE_SIZE, idxmap);
 }
 
 /* update the TLBs so that writes to code in the virtual page 'addr'
@@ -259,7 +576,7 @@ static inline ram_addr_t qemu_ram_addr_from_host_nofail(void *ptr)
 void tlb_reset_dirty(CPUState *cpu, ram_addr_t start1, ram_addr_t length)
 {
     CPUArchState *env;
-
+    CPUL2TLB *l2;
     int mmu_idx;
 
     env = cpu->env_ptr;
@@ -275,6 +592,12 @@ void tlb_reset_dirty(CPUState *cpu, ram_addr_t start1, ram_addr_t length)
             tlb_reset_dirty_range(&env->tlb_v_table[mmu_idx][i],
                                   start1, length);
         }
+
+        l2 = tlb_l2_get(cpu, mmu_idx);
+        for (i = 0; l2 && i < l2->used; i++) {
+            tlb_reset_dirty_range(&l2->table[l2->slots[i]].tlb,
+                                  start1, length);
+        }
     }
 }
 
@@ -305,29 +628,42 @@ void tlb_set_dirty(CPUState *cpu, target_ulong vaddr)
             tlb_set_dirty1(&env->tlb_v_table[mmu_idx][k], vaddr);
         }
     }
+
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        CPUL2TLB *l2 = tlb_l2_get(cpu, mmu_idx);
+        CPUL2TLBEntry *e;
+
+        if (l2 && l2->table) {
+            e = tlb_l2_slot(l2, vaddr);
+            if (e->gen == l2->gen) {
+                tlb_set_dirty1(&e->tlb, vaddr);
+            }
+        }
+    }
 }
 
 /* Our TLB does not support large pages, so remember the area covered by
-   large pages and trigger a full TLB flush if these are invalidated.  */
-static void tlb_add_large_page(CPUArchState *env, target_ulong vaddr,
-                               target_ulong size)
+   the large pages of each MMU index and flush that index entirely if
+   these are invalidated.  */
+static void tlb_add_large_page(CPUArchState *env, int mmu_idx,
+                               target_ulong vaddr, target_ulong size)
 {
     target_ulong mask = ~(size - 1);
 
-    if (env->tlb_flush_addr == (target_ulong)-1) {
-        env->tlb_flush_addr = vaddr & mask;
-        env->tlb_flush_mask = mask;
+    if (env->tlb_flush_addr[mmu_idx] == (target_ulong)-1) {
+        env->tlb_flush_addr[mmu_idx] = vaddr & mask;
+        env->tlb_flush_mask[mmu_idx] = mask;
         return;
     }
     /* Extend the existing region to include the new page.
        This is a compromise between unnecessary flushes and the cost
        of maintaining a full variable size TLB.  */
-    mask &= env->tlb_flush_mask;
-    while (((env->tlb_flush_addr ^ vaddr) & mask) != 0) {
+    mask &= env->tlb_flush_mask[mmu_idx];
+    while (((env->tlb_flush_addr[mmu_idx] ^ vaddr) & mask) != 0) {
         mask <<= 1;
     }
-    env->tlb_flush_addr &= mask;
-    env->tlb_flush_mask = mask;
+    env->tlb_flush_addr[mmu_idx] &= mask;
+    env->tlb_flush_mask[mmu_idx] = mask;
 }
 
 /* Add a new TLB entry. At most one entry for a given virtual address
@@ -354,7 +690,7 @@ void tlb_set_page_with_attrs(CPUState *cpu, target_ulong vaddr,
 
     assert(size >= TARGET_PAGE_SIZE);
     if (size != TARGET_PAGE_SIZE) {
-        tlb_add_large_page(env, vaddr, size);
+        tlb_add_large_page(env, mmu_idx, vaddr, size);
     }
 
     sz = size;
@@ -382,7 +718,13 @@ void tlb_set_page_with_attrs(CPUState *cpu, target_ulong vaddr,
     index = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     te = &env->tlb_table[mmu_idx][index];
 
-    /* do not discard the translation in te, evict it into a victim tlb */
+    /* do not discard the translation in te, evict it into a victim tlb,
+     * whose oldest entry goes to the second-level tlb. An older
+     * translation of vaddr may be left there, drop it.
+     */
+    tlb_l2_flush_page(cpu, mmu_idx, vaddr & TARGET_PAGE_MASK);
+    tlb_l2_spill(cpu, mmu_idx, &env->tlb_v_table[mmu_idx][vidx],
+                 &env->iotlb_v[mmu_idx][vidx]);
     env->tlb_v_table[mmu_idx][vidx] = *te;
     env->iotlb_v[mmu_idx][vidx] = env->iotlb[mmu_idx][index];
 
@@ -498,6 +840,53 @@ tb_page_addr_t get_page_addr_code(CPUArchState *env1, target_ulong addr)
     return qemu_ram_addr_from_host_nofail(p);
 }
 
+/* Return true if ADDR is present in the second-level tlb, and has been
+   copied back to the main tlb. The main tlb entry moves to the victim tlb,
+   the second-level entry is left in place.  */
+static bool tlb_l2_hit(CPUArchState *env, size_t mmu_idx, size_t index,
+                       size_t elt_ofs, target_ulong page)
+{
+    CPUState *cpu = ENV_GET_CPU(env);
+    CPUL2TLB *l2 = tlb_l2_get(cpu, mmu_idx);
+    CPUL2TLBEntry *e;
+    CPUTLBEntry tmptlb;
+    CPUIOTLBEntry tmpio;
+    unsigned vidx;
+
+    if (!l2 || !l2->table) {
+        return false;
+    }
+
+    l2->lookups++;
+    e = tlb_l2_slot(l2, page);
+    if (e->gen != l2->gen ||
+        *(target_ulong *)((uintptr_t)&e->tlb + elt_ofs) != page) {
+        /* Guests that rarely flush would never get to resize */
+        if (l2->lookups >= (4u << l2->bits)) {
+            if (tlb_l2_too_small(l2)) {
+                tlb_l2_resize(l2, l2->bits + 1);
+            } else {
+                tlb_l2_reset_stats(l2);
+            }
+        }
+        return false;
+    }
+    l2->hits++;
+
+    /* The spill below may reuse the slot */
+    tmptlb = e->tlb;
+    tmpio = e->iotlb;
+
+    vidx = env->vtlb_index++ % CPU_VTLB_SIZE;
+    tlb_l2_spill(cpu, mmu_idx, &env->tlb_v_table[mmu_idx][vidx],
+                 &env->iotlb_v[mmu_idx][vidx]);
+    env->tlb_v_table[mmu_idx][vidx] = env->tlb_table[mmu_idx][index];
+    env->iotlb_v[mmu_idx][vidx] = env->iotlb[mmu_idx][index];
+    env->tlb_table[mmu_idx][index] = tmptlb;
+    env->iotlb[mmu_idx][index] = tmpio;
+    return true;
+}
+
 /* Return true if ADDR is present in the victim tlb, and has been copied
    back to the main tlb.  */
 static bool victim_tlb_hit(CPUArchState *env, size_t mmu_idx, size_t index,
@@ -519,7 +908,7 @@ static bool victim_tlb_hit(CPUArchState *env, size_t mmu_idx, size_t index,
             return true;
         }
     }
-    return false;
+    return tlb_l2_hit(env, mmu_idx, index, elt_ofs, page);
 }
 
 /* Macro to call the above, with local variables from the use context.  */
@@ -542,6 +931,31 @@ static bool victim_tlb_hit(CPUArchState *env, size_t mmu_idx, size_t index,
 #include "softmmu_template.h"
 #undef MMUSUFFIX
 
+#define ATOMIC_BE 0
+#define DATA_SIZE 1
+#include "atomic_template.h"
+
+#define DATA_SIZE 2
+#include "atomic_template.h"
+
+#define DATA_SIZE 4
+#include "atomic_template.h"
+
+#define DATA_SIZE 8
+#include "atomic_template.h"
+#undef ATOMIC_BE
+
+#define ATOMIC_BE 1
+#define DATA_SIZE 2
+#include "atomic_template.h"
+
+#define DATA_SIZE 4
+#include "atomic_template.h"
+
+#define DATA_SIZE 8
+#include "atomic_template.h"
+#undef ATOMIC_BE
+
 #define MMUSUFFIX _cmmu
 #undef GETPC_ADJ
 #define GETPC_ADJ 0
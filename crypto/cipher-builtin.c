@@ -73,6 +73,104 @@ static void qcrypto_cipher_free_aes(QCryptoCipher *cipher)
 }
 
 
+#ifdef CONFIG_AESNI_OPT
+#pragma GCC push_options
+#pragma GCC target("aes,sse2")
+#include <cpuid.h>
+#include <wmmintrin.h>
+
+/* Blocks kept in flight at once, to hide the latency of aesenc/aesdec */
+#define AESNI_PARALLEL 8
+
+static bool qcrypto_aesni;
+
+static bool aesni_support(void)
+{
+    unsigned int a, b, c, d;
+
+    if (!__get_cpuid(1, &a, &b, &c, &d)) {
+        return false;
+    }
+    return c & bit_AES;
+}
+
+/* AES_KEY holds the round keys as big-endian words, AES-NI wants bytes */
+static void aesni_load_key(__m128i *rk, const AES_KEY *key)
+{
+    uint8_t buf[AES_BLOCK_SIZE];
+    int i, j;
+
+    for (i = 0; i <= key->rounds; i++) {
+        for (j = 0; j < 4; j++) {
+            stl_be_p(buf + j * 4, key->rd_key[i * 4 + j]);
+        }
+        rk[i] = _mm_loadu_si128((const __m128i *)buf);
+    }
+}
+
+static void aesni_encrypt_blocks(const AES_KEY *key, const uint8_t *in,
+                                 uint8_t *out, size_t nblocks)
+{
+    __m128i rk[AES_MAXNR + 1], b[AESNI_PARALLEL];
+    int rounds = key->rounds;
+    size_t i, n;
+    int r;
+
+    aesni_load_key(rk, key);
+    while (nblocks) {
+        n = MIN(nblocks, AESNI_PARALLEL);
+        for (i = 0; i < n; i++) {
+            b[i] = _mm_xor_si128(_mm_loadu_si128((const __m128i *)in + i),
+                                 rk[0]);
+        }
+        for (r = 1; r < rounds; r++) {
+            for (i = 0; i < n; i++) {
+                b[i] = _mm_aesenc_si128(b[i], rk[r]);
+            }
+        }
+        for (i = 0; i < n; i++) {
+            _mm_storeu_si128((__m128i *)out + i,
+                             _mm_aesenclast_si128(b[i], rk[rounds]));
+        }
+        in += n * AES_BLOCK_SIZE;
+        out += n * AES_BLOCK_SIZE;
+        nblocks -= n;
+    }
+}
+
+/* @key comes from AES_set_decrypt_key, already in the form aesdec wants */
+static void aesni_decrypt_blocks(const AES_KEY *key, const uint8_t *in,
+                                 uint8_t *out, size_t nblocks)
+{
+    __m128i rk[AES_MAXNR + 1], b[AESNI_PARALLEL];
+    int rounds = key->rounds;
+    size_t i, n;
+    int r;
+
+    aesni_load_key(rk, key);
+    while (nblocks) {
+        n = MIN(nblocks, AESNI_PARALLEL);
+        for (i = 0; i < n; i++) {
+            b[i] = _mm_xor_si128(_mm_loadu_si128((const __m128i *)in + i),
+                                 rk[0]);
+        }
+        for (r = 1; r < rounds; r++) {
+            for (i = 0; i < n; i++) {
+                b[i] = _mm_aesdec_si128(b[i], rk[r]);
+            }
+        }
+        for (i = 0; i < n; i++) {
+            _mm_storeu_si128((__m128i *)out + i,
+                             _mm_aesdeclast_si128(b[i], rk[rounds]));
+        }
+        in += n * AES_BLOCK_SIZE;
+        out += n * AES_BLOCK_SIZE;
+        nblocks -= n;
+    }
+}
+#pragma GCC pop_options
+#endif
+
 static void qcrypto_cipher_aes_ecb_encrypt(AES_KEY *key,
                                            const void *in,
                                            void *out,
@@ -80,6 +178,17 @@ static void qcrypto_cipher_aes_ecb_encrypt(AES_KEY *key,
 {
     const uint8_t *inptr = in;
     uint8_t *outptr = out;
+
+#ifdef CONFIG_AESNI_OPT
+    if (qcrypto_aesni && len >= AES_BLOCK_SIZE) {
+        size_t done = QEMU_ALIGN_DOWN(len, AES_BLOCK_SIZE);
+
+        aesni_encrypt_blocks(key, inptr, outptr, done / AES_BLOCK_SIZE);
+        inptr += done;
+        outptr += done;
+        len -= done;
+    }
+#endif
     while (len) {
         if (len > AES_BLOCK_SIZE) {
             AES_encrypt(inptr, outptr, key);
@@ -106,6 +215,17 @@ static void qcrypto_cipher_aes_ecb_decrypt(AES_KEY *key,
 {
     const uint8_t *inptr = in;
     uint8_t *outptr = out;
+
+#ifdef CONFIG_AESNI_OPT
+    if (qcrypto_aesni && len >= AES_BLOCK_SIZE) {
+        size_t done = QEMU_ALIGN_DOWN(len, AES_BLOCK_SIZE);
+
+        aesni_decrypt_blocks(key, inptr, outptr, done / AES_BLOCK_SIZE);
+        inptr += done;
+        outptr += done;
+        len -= done;
+    }
+#endif
     while (len) {
         if (len > AES_BLOCK_SIZE) {
             AES_decrypt(inptr, outptr, key);
@@ -248,6 +368,10 @@ static int qcrypto_cipher_init_aes(QCryptoCipher *cipher,
         return -1;
     }
 
+#ifdef CONFIG_AESNI_OPT
+    qcrypto_aesni = aesni_support();
+#endif
+
     ctxt = g_new0(QCryptoCipherBuiltin, 1);
 
     if (cipher->mode == QCRYPTO_CIPHER_MODE_XTS) {
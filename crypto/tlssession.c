@@ -31,6 +31,17 @@
 
 #include <gnutls/x509.h>
 
+#ifdef CONFIG_KTLS
+#include <netinet/tcp.h>
+#include <linux/tls.h>
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+#endif
+
 
 struct QCryptoTLSSession {
     QCryptoTLSCreds *creds;
@@ -494,6 +505,80 @@ qcrypto_tls_session_get_peer_name(QCryptoTLSSession *session)
 }
 
 
+#ifdef CONFIG_KTLS
+int
+qcrypto_tls_session_offload_tx(QCryptoTLSSession *session,
+                               int fd,
+                               Error **errp)
+{
+    struct tls12_crypto_info_aes_gcm_128 info = { };
+    gnutls_protocol_t version = gnutls_protocol_get_version(session->handle);
+    gnutls_datum_t iv, key;
+    unsigned char seq[8];
+
+    if (!session->handshakeComplete) {
+        error_setg(errp, "TLS handshake is not complete");
+        return -1;
+    }
+    if (gnutls_cipher_get(session->handle) != GNUTLS_CIPHER_AES_128_GCM) {
+        error_setg(errp, "Kernel TLS needs AES-128-GCM");
+        return -1;
+    }
+    if (gnutls_record_get_state(session->handle, 0, NULL, &iv, &key,
+                                seq) < 0 ||
+        key.size != TLS_CIPHER_AES_GCM_128_KEY_SIZE) {
+        error_setg(errp, "Cannot get the TLS write state");
+        return -1;
+    }
+
+    info.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+    memcpy(info.key, key.data, TLS_CIPHER_AES_GCM_128_KEY_SIZE);
+    memcpy(info.rec_seq, seq, TLS_CIPHER_AES_GCM_128_REC_SEQ_SIZE);
+    if (version == GNUTLS_TLS1_2 &&
+        iv.size == TLS_CIPHER_AES_GCM_128_SALT_SIZE) {
+        /* The explicit nonce is the record sequence number */
+        info.info.version = TLS_1_2_VERSION;
+        memcpy(info.salt, iv.data, TLS_CIPHER_AES_GCM_128_SALT_SIZE);
+        memcpy(info.iv, seq, TLS_CIPHER_AES_GCM_128_IV_SIZE);
+#if defined(TLS_1_3_VERSION) && GNUTLS_VERSION_NUMBER >= 0x030605
+    } else if (version == GNUTLS_TLS1_3 &&
+               iv.size == TLS_CIPHER_AES_GCM_128_SALT_SIZE +
+                          TLS_CIPHER_AES_GCM_128_IV_SIZE) {
+        info.info.version = TLS_1_3_VERSION;
+        memcpy(info.salt, iv.data, TLS_CIPHER_AES_GCM_128_SALT_SIZE);
+        memcpy(info.iv, iv.data + TLS_CIPHER_AES_GCM_128_SALT_SIZE,
+               TLS_CIPHER_AES_GCM_128_IV_SIZE);
+#endif
+    } else {
+        error_setg(errp, "Kernel TLS does not support this TLS version");
+        return -1;
+    }
+
+    if (setsockopt(fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) < 0) {
+        error_setg_errno(errp, errno, "Cannot enable kernel TLS");
+        return -1;
+    }
+    if (setsockopt(fd, SOL_TLS, TLS_TX, &info, sizeof(info)) < 0) {
+        /* Without TLS_TX the socket still passes gnutls records through */
+        error_setg_errno(errp, errno, "Cannot set kernel TLS keys");
+        return -1;
+    }
+
+    trace_qcrypto_tls_session_offload_tx(session, fd);
+    return 0;
+}
+#else
+int
+qcrypto_tls_session_offload_tx(QCryptoTLSSession *session,
+                               int fd,
+                               Error **errp)
+{
+    error_setg(errp, "Kernel TLS support is not available");
+    return -1;
+}
+#endif
+
+
 #else /* ! CONFIG_GNUTLS */
 
 
@@ -585,4 +670,14 @@ qcrypto_tls_session_get_peer_name(QCryptoTLSSession *sess)
     return NULL;
 }
 
+
+int
+qcrypto_tls_session_offload_tx(QCryptoTLSSession *sess,
+                               int fd,
+                               Error **errp)
+{
+    error_setg(errp, "TLS requires GNUTLS support");
+    return -1;
+}
+
 #endif
@@ -26,6 +26,24 @@
 #include "qemu/osdep.h"
 #include "crypto/xts.h"
 
+/* Blocks handed to the cipher function in one call */
+#define XTS_PARALLEL 8
+
+static inline void xts_xor_block(uint8_t *dst, const uint8_t *src,
+                                 const uint8_t *tweak)
+{
+    uint64_t a, b;
+
+    memcpy(&a, src, 8);
+    memcpy(&b, tweak, 8);
+    a ^= b;
+    memcpy(dst, &a, 8);
+    memcpy(&a, src + 8, 8);
+    memcpy(&b, tweak + 8, 8);
+    a ^= b;
+    memcpy(dst + 8, &a, 8);
+}
+
 static void xts_mult_x(uint8_t *I)
 {
     int x;
@@ -42,6 +60,44 @@ static void xts_mult_x(uint8_t *I)
 }
 
 
+/**
+ * xts_tweak_crypt_blocks:
+ * @param ctxt: the cipher context
+ * @param func: the cipher function
+ * @src: buffer providing @nblocks blocks of input
+ * @dst: buffer to output @nblocks blocks
+ * @iv: the initialization vector tweak of XTS_BLOCK_SIZE bytes
+ * @nblocks: number of blocks, at most XTS_PARALLEL
+ *
+ * Encrypt or decrypt several full blocks with one call to @func, so that
+ * a cipher implementation can keep them all in flight at once
+ */
+static void xts_tweak_crypt_blocks(const void *ctx,
+                                   xts_cipher_func *func,
+                                   const uint8_t *src,
+                                   uint8_t *dst,
+                                   uint8_t *iv,
+                                   unsigned long nblocks)
+{
+    uint8_t T[XTS_PARALLEL][XTS_BLOCK_SIZE];
+    unsigned long i;
+
+    for (i = 0; i < nblocks; i++) {
+        memcpy(T[i], iv, XTS_BLOCK_SIZE);
+        xts_xor_block(dst + i * XTS_BLOCK_SIZE, src + i * XTS_BLOCK_SIZE,
+                      T[i]);
+        xts_mult_x(iv);
+    }
+
+    func(ctx, nblocks * XTS_BLOCK_SIZE, dst, dst);
+
+    for (i = 0; i < nblocks; i++) {
+        xts_xor_block(dst + i * XTS_BLOCK_SIZE, dst + i * XTS_BLOCK_SIZE,
+                      T[i]);
+    }
+}
+
+
 /**
  * xts_tweak_uncrypt:
  * @param ctxt: the cipher context
@@ -86,7 +142,7 @@ void xts_decrypt(const void *datactx,
                  const uint8_t *src)
 {
     uint8_t PP[XTS_BLOCK_SIZE], CC[XTS_BLOCK_SIZE], T[XTS_BLOCK_SIZE];
-    unsigned long i, m, mo, lim;
+    unsigned long i, m, mo, lim, n;
 
     /* get number of blocks */
     m = length >> 4;
@@ -104,11 +160,12 @@ void xts_decrypt(const void *datactx,
     /* encrypt the iv */
     encfunc(tweakctx, XTS_BLOCK_SIZE, T, iv);
 
-    for (i = 0; i < lim; i++) {
-        xts_tweak_decrypt(datactx, decfunc, src, dst, T);
+    for (i = 0; i < lim; i += n) {
+        n = MIN(lim - i, XTS_PARALLEL);
+        xts_tweak_crypt_blocks(datactx, decfunc, src, dst, T, n);
 
-        src += XTS_BLOCK_SIZE;
-        dst += XTS_BLOCK_SIZE;
+        src += n * XTS_BLOCK_SIZE;
+        dst += n * XTS_BLOCK_SIZE;
     }
 
     /* if length is not a multiple of XTS_BLOCK_SIZE then */
@@ -181,7 +238,7 @@ void xts_encrypt(const void *datactx,
                  const uint8_t *src)
 {
     uint8_t PP[XTS_BLOCK_SIZE], CC[XTS_BLOCK_SIZE], T[XTS_BLOCK_SIZE];
-    unsigned long i, m, mo, lim;
+    unsigned long i, m, mo, lim, n;
 
     /* get number of blocks */
     m = length >> 4;
@@ -199,11 +256,12 @@ void xts_encrypt(const void *datactx,
     /* encrypt the iv */
     encfunc(tweakctx, XTS_BLOCK_SIZE, T, iv);
 
-    for (i = 0; i < lim; i++) {
-        xts_tweak_encrypt(datactx, encfunc, src, dst, T);
+    for (i = 0; i < lim; i += n) {
+        n = MIN(lim - i, XTS_PARALLEL);
+        xts_tweak_crypt_blocks(datactx, encfunc, src, dst, T, n);
 
-        dst += XTS_BLOCK_SIZE;
-        src += XTS_BLOCK_SIZE;
+        dst += n * XTS_BLOCK_SIZE;
+        src += n * XTS_BLOCK_SIZE;
     }
 
     /* if length is not a multiple of XTS_BLOCK_SIZE then */
@@ -61,6 +61,9 @@
 #include "qemu/range.h"
 #ifndef _WIN32
 #include "qemu/mmap-alloc.h"
+#ifdef CONFIG_FALLOCATE_PUNCH_HOLE
+#include <linux/falloc.h>
+#endif
 #endif
 
 //#define DEBUG_SUBPAGE
@@ -136,10 +139,19 @@ typedef struct PhysPageMap {
     MemoryRegionSection *sections;
 } PhysPageMap;
 
+/* Number of recently used sections looked up before the radix tree.  A
+ * device usually alternates between a few regions (descriptor ring, used
+ * ring, buffers), which a single entry would keep evicting.
+ */
+#define MRU_SECTIONS 4
+
 struct AddressSpaceDispatch {
     struct rcu_head rcu;
 
-    MemoryRegionSection *mru_section;
+    /* Most recent first.  A new dispatch is built when the topology
+     * changes, so the entries never outlive the map they point into.
+     */
+    MemoryRegionSection *mru_section[MRU_SECTIONS];
     /* This is a multi-level map on the physical address space.
      * The bottom level has pointers to MemoryRegionSections.
      */
@@ -353,29 +365,53 @@ bool memory_region_is_unassigned(MemoryRegion *mr)
         && mr != &io_mem_watch;
 }
 
+/* Called from RCU critical section.  Concurrent updates may leave
+ * duplicate entries, which is harmless.
+ */
+static void address_space_mru_insert(AddressSpaceDispatch *d,
+                                     MemoryRegionSection *section)
+{
+    int i;
+
+    if (section == &d->map.sections[PHYS_SECTION_UNASSIGNED]) {
+        return;
+    }
+    for (i = MRU_SECTIONS - 1; i > 0; i--) {
+        atomic_set(&d->mru_section[i], atomic_read(&d->mru_section[i - 1]));
+    }
+    atomic_set(&d->mru_section[0], section);
+}
+
 /* Called from RCU critical section */
 static MemoryRegionSection *address_space_lookup_region(AddressSpaceDispatch *d,
                                                         hwaddr addr,
                                                         bool resolve_subpage)
 {
-    MemoryRegionSection *section = atomic_read(&d->mru_section);
+    MemoryRegionSection *section = NULL;
     subpage_t *subpage;
-    bool update;
+    bool update = true;
+    int i;
 
-    if (section && section != &d->map.sections[PHYS_SECTION_UNASSIGNED] &&
-        section_covers_addr(section, addr)) {
-        update = false;
-    } else {
+    for (i = 0; i < MRU_SECTIONS; i++) {
+        section = atomic_read(&d->mru_section[i]);
+        if (!section) {
+            break;
+        }
+        if (section_covers_addr(section, addr)) {
+            update = false;
+            break;
+        }
+    }
+    if (update) {
         section = phys_page_find(d->phys_map, addr, d->map.nodes,
                                  d->map.sections);
-        update = true;
     }
     if (resolve_subpage && section->mr->subpage) {
         subpage = container_of(section->mr, subpage_t, iomem);
         section = &d->map.sections[subpage->sub_section[SUBPAGE_IDX(addr)]];
     }
     if (update) {
-        atomic_set(&d->mru_section, section);
+        address_space_mru_insert(d, section);
     }
     return section;
 }
@@ -625,6 +661,8 @@ void cpu_exec_exit(CPUState *cpu)
     cpu->cpu_index = UNASSIGNED_CPU_INDEX;
     cpu_list_unlock();
 
+    tlb_destroy(cpu);
+
     if (cc->vmsd != NULL) {
         vmstate_unregister(NULL, cc->vmsd, cpu);
     }
@@ -1284,6 +1322,7 @@ static void *file_ram_alloc(RAMBlock *block,
     }
 
     page_size = qemu_fd_getpagesize(fd);
+    block->page_size = page_size;
     block->mr->align = MAX(page_size, QEMU_VMALLOC_ALIGN);
 
     if (memory < page_size) {
@@ -1314,7 +1353,7 @@ static void *file_ram_alloc(RAMBlock *block,
     }
 
     if (mem_prealloc) {
-        os_mem_prealloc(fd, area, memory, errp);
+        os_mem_prealloc(fd, area, memory, smp_cpus, errp);
         if (errp && *errp) {
             goto error;
         }
@@ -1407,6 +1446,11 @@ const char *qemu_ram_get_idstr(RAMBlock *rb)
     return rb->idstr;
 }
 
+size_t qemu_ram_pagesize(RAMBlock *rb)
+{
+    return rb->page_size;
+}
+
 /* Called with iothread lock held.  */
 void qemu_ram_set_idstr(RAMBlock *new_block, const char *name, DeviceState *dev)
 {
@@ -1689,6 +1733,7 @@ RAMBlock *qemu_ram_alloc_internal(ram_addr_t size, ram_addr_t max_size,
     new_block->max_length = max_size;
     assert(max_size >= size);
     new_block->fd = -1;
+    new_block->page_size = getpagesize();
     new_block->host = host;
     if (host) {
         new_block->flags |= RAM_PREALLOC;
@@ -1954,6 +1999,43 @@ RAMBlock *qemu_ram_block_by_name(const char *name)
     return NULL;
 }
 
+/*
+ * Give [start, start + length) of a RAMBlock back to the host; the range
+ * reads as zeroes afterwards.  File-backed RAM gets a hole punched in the
+ * file, private mappings are also dropped with MADV_DONTNEED.
+ *
+ * Returns: 0 on success, -errno on failure
+ */
+int ram_block_discard_range(RAMBlock *rb, uint64_t start, size_t length)
+{
+    uint8_t *host = rb->host + start;
+    int ret = 0;
+
+    if (((uintptr_t)host | length) & (qemu_host_page_size - 1)) {
+        return -EINVAL;
+    }
+    if (start + length > rb->used_length) {
+        return -EINVAL;
+    }
+
+    if (rb->fd >= 0) {
+#ifdef CONFIG_FALLOCATE_PUNCH_HOLE
+        if (fallocate(rb->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                      start, length)) {
+            ret = -errno;
+        }
+#else
+        ret = -ENOTSUP;
+#endif
+    }
+    if (!(rb->flags & RAM_SHARED) &&
+        qemu_madvise(host, length, QEMU_MADV_DONTNEED)) {
+        ret = -errno;
+    }
+
+    return ret;
+}
+
 /* Some of the softmmu routines need to translate from a host pointer
    (typically a TLB entry) back to a ram offset.  */
 ram_addr_t qemu_ram_addr_from_host(void *ptr)
@@ -2777,82 +2859,91 @@ void cpu_flush_icache_range(hwaddr start, int len)
                                            start, NULL, len, FLUSH_CACHE);
 }
 
-typedef struct {
+/* Bounce buffers are accounted per AddressSpace, see max_bounce_buffer_size */
+struct BounceBuffer {
     MemoryRegion *mr;
     void *buffer;
     hwaddr addr;
     hwaddr len;
-    bool in_use;
-} BounceBuffer;
-
-static BounceBuffer bounce;
+    QLIST_ENTRY(BounceBuffer) link;
+};
 
-typedef struct MapClient {
+struct AddressSpaceMapClient {
     QEMUBH *bh;
-    QLIST_ENTRY(MapClient) link;
-} MapClient;
-
-QemuMutex map_client_list_lock;
-static QLIST_HEAD(map_client_list, MapClient) map_client_list
-    = QLIST_HEAD_INITIALIZER(map_client_list);
+    QLIST_ENTRY(AddressSpaceMapClient) link;
+};
 
-static void cpu_unregister_map_client_do(MapClient *client)
+static void address_space_unregister_map_client_do(
+    AddressSpaceMapClient *client)
 {
     QLIST_REMOVE(client, link);
     g_free(client);
 }
 
-static void cpu_notify_map_clients_locked(void)
+static void address_space_notify_map_clients_locked(AddressSpace *as)
 {
-    MapClient *client;
+    AddressSpaceMapClient *client;
 
-    while (!QLIST_EMPTY(&map_client_list)) {
-        client = QLIST_FIRST(&map_client_list);
+    while (!QLIST_EMPTY(&as->map_client_list)) {
+        client = QLIST_FIRST(&as->map_client_list);
         qemu_bh_schedule(client->bh);
-        cpu_unregister_map_client_do(client);
+        address_space_unregister_map_client_do(client);
     }
 }
 
-void cpu_register_map_client(QEMUBH *bh)
+void address_space_register_map_client(AddressSpace *as, QEMUBH *bh)
 {
-    MapClient *client = g_malloc(sizeof(*client));
+    AddressSpaceMapClient *client = g_malloc(sizeof(*client));
 
-    qemu_mutex_lock(&map_client_list_lock);
+    qemu_mutex_lock(&as->bounce_lock);
     client->bh = bh;
-    QLIST_INSERT_HEAD(&map_client_list, client, link);
-    if (!atomic_read(&bounce.in_use)) {
-        cpu_notify_map_clients_locked();
+    QLIST_INSERT_HEAD(&as->map_client_list, client, link);
+    if (as->bounce_buffer_size < as->max_bounce_buffer_size) {
+        address_space_notify_map_clients_locked(as);
     }
-    qemu_mutex_unlock(&map_client_list_lock);
+    qemu_mutex_unlock(&as->bounce_lock);
 }
 
-void cpu_exec_init_all(void)
+void address_space_unregister_map_client(AddressSpace *as, QEMUBH *bh)
 {
-    qemu_mutex_init(&ram_list.mutex);
-    io_mem_init();
-    memory_map_init();
-    qemu_mutex_init(&map_client_list_lock);
-}
-
-void cpu_unregister_map_client(QEMUBH *bh)
-{
-    MapClient *client;
+    AddressSpaceMapClient *client;
 
-    qemu_mutex_lock(&map_client_list_lock);
-    QLIST_FOREACH(client, &map_client_list, link) {
+    qemu_mutex_lock(&as->bounce_lock);
+    QLIST_FOREACH(client, &as->map_client_list, link) {
         if (client->bh == bh) {
-            cpu_unregister_map_client_do(client);
+            address_space_unregister_map_client_do(client);
             break;
         }
     }
-    qemu_mutex_unlock(&map_client_list_lock);
+    qemu_mutex_unlock(&as->bounce_lock);
 }
 
-static void cpu_notify_map_clients(void)
+void address_space_destroy_map_clients(AddressSpace *as)
+{
+    qemu_mutex_lock(&as->bounce_lock);
+    assert(QLIST_EMPTY(&as->bounce_buffers));
+    while (!QLIST_EMPTY(&as->map_client_list)) {
+        address_space_unregister_map_client_do(
+            QLIST_FIRST(&as->map_client_list));
+    }
+    qemu_mutex_unlock(&as->bounce_lock);
+}
+
+void cpu_register_map_client(QEMUBH *bh)
 {
-    qemu_mutex_lock(&map_client_list_lock);
-    cpu_notify_map_clients_locked();
-    qemu_mutex_unlock(&map_client_list_lock);
+    address_space_register_map_client(&address_space_memory, bh);
+}
+
+void cpu_exec_init_all(void)
+{
+    qemu_mutex_init(&ram_list.mutex);
+    io_mem_init();
+    memory_map_init();
+}
+
+void cpu_unregister_map_client(QEMUBH *bh)
+{
+    address_space_unregister_map_client(&address_space_memory, bh);
 }
 
 bool address_space_access_valid(AddressSpace *as, hwaddr addr, int len, bool is_write)
@@ -2894,6 +2985,7 @@ void *address_space_map(AddressSpace *as,
     hwaddr done = 0;
     hwaddr l, xlat, base;
     MemoryRegion *mr, *this_mr;
+    BounceBuffer *bounce;
     void *ptr;
 
     if (len == 0) {
@@ -2905,26 +2997,33 @@ void *address_space_map(AddressSpace *as,
     mr = address_space_translate(as, addr, &xlat, &l, is_write);
 
     if (!memory_access_is_direct(mr, is_write)) {
-        if (atomic_xchg(&bounce.in_use, true)) {
+        /* Avoid unbounded allocations, the space left may be less than l */
+        qemu_mutex_lock(&as->bounce_lock);
+        if (as->bounce_buffer_size >= as->max_bounce_buffer_size) {
+            qemu_mutex_unlock(&as->bounce_lock);
             rcu_read_unlock();
             return NULL;
         }
-        /* Avoid unbounded allocations */
-        l = MIN(l, TARGET_PAGE_SIZE);
-        bounce.buffer = qemu_memalign(TARGET_PAGE_SIZE, l);
-        bounce.addr = addr;
-        bounce.len = l;
+        l = MIN(l, as->max_bounce_buffer_size - as->bounce_buffer_size);
+        atomic_set(&as->bounce_buffer_size, as->bounce_buffer_size + l);
+
+        bounce = g_new(BounceBuffer, 1);
+        bounce->buffer = qemu_memalign(TARGET_PAGE_SIZE, l);
+        bounce->addr = addr;
+        bounce->len = l;
+        QLIST_INSERT_HEAD(&as->bounce_buffers, bounce, link);
+        qemu_mutex_unlock(&as->bounce_lock);
 
         memory_region_ref(mr);
-        bounce.mr = mr;
+        bounce->mr = mr;
         if (!is_write) {
             address_space_read(as, addr, MEMTXATTRS_UNSPECIFIED,
-                               bounce.buffer, l);
+                               bounce->buffer, l);
         }
 
         rcu_read_unlock();
         *plen = l;
-        return bounce.buffer;
+        return bounce->buffer;
     }
 
     base = xlat;
@@ -2959,7 +3058,21 @@ void *address_space_map(AddressSpace *as,
 void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
                          int is_write, hwaddr access_len)
 {
-    if (buffer != bounce.buffer) {
+    BounceBuffer *bounce = NULL;
+
+    /* Guest RAM mappings skip the lookup while nothing is bounced */
+    if (atomic_read(&as->bounce_buffer_size)) {
+        qemu_mutex_lock(&as->bounce_lock);
+        QLIST_FOREACH(bounce, &as->bounce_buffers, link) {
+            if (bounce->buffer == buffer) {
+                QLIST_REMOVE(bounce, link);
+                break;
+            }
+        }
+        qemu_mutex_unlock(&as->bounce_lock);
+    }
+
+    if (!bounce) {
         MemoryRegion *mr;
         ram_addr_t addr1;
 
@@ -2975,14 +3088,17 @@ void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
         return;
     }
     if (is_write) {
-        address_space_write(as, bounce.addr, MEMTXATTRS_UNSPECIFIED,
-                            bounce.buffer, access_len);
-    }
-    qemu_vfree(bounce.buffer);
-    bounce.buffer = NULL;
-    memory_region_unref(bounce.mr);
-    atomic_mb_set(&bounce.in_use, false);
-    cpu_notify_map_clients();
+        address_space_write(as, bounce->addr, MEMTXATTRS_UNSPECIFIED,
+                            bounce->buffer, access_len);
+    }
+    qemu_vfree(bounce->buffer);
+    memory_region_unref(bounce->mr);
+
+    qemu_mutex_lock(&as->bounce_lock);
+    atomic_set(&as->bounce_buffer_size, as->bounce_buffer_size - bounce->len);
+    address_space_notify_map_clients_locked(as);
+    qemu_mutex_unlock(&as->bounce_lock);
+    g_free(bounce);
 }
 
 void *cpu_physical_memory_map(hwaddr addr,
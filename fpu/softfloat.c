@@ -83,6 +83,8 @@ this code that are retained.
  * target-dependent and needs the TARGET_* macros.
  */
 #include "qemu/osdep.h"
+#include <float.h>
+#include <math.h>
 
 #include "fpu/softfloat.h"
 
@@ -2158,6 +2160,161 @@ static float32 subFloat32Sigs(float32 a, float32 b, flag zSign,
 
 }
 
+/*----------------------------------------------------------------------------
+| Host FPU fast path.  With the rounding mode set to round-to-nearest-even and
+| the inexact flag already raised, an addition, subtraction, multiplication,
+| division or square root of zero or normal operands whose result is normal
+| or infinite produces the same value and the same flags on an IEEE host FPU
+| as it does in software: no NaN can be generated, no input is flushed and
+| the only flag that can still change is overflow, which is raised by hand.
+| Everything else (denormals, NaNs, infinities, tiny results, division by
+| zero, directed rounding, inexact not yet raised) falls through to the
+| emulation.  Only hosts that evaluate float and double without excess
+| precision take the fast path.
+*----------------------------------------------------------------------------*/
+#if (defined(__x86_64__) || defined(__aarch64__)) && !defined(__FAST_MATH__)
+#define SOFTFLOAT_HOST_FPU 1
+#else
+#define SOFTFLOAT_HOST_FPU 0
+#endif
+
+typedef union {
+    float32 s;
+    float h;
+} union_float32;
+
+typedef union {
+    float64 s;
+    double h;
+} union_float64;
+
+enum host_fpu_op {
+    host_fpu_add,
+    host_fpu_sub,
+    host_fpu_mul,
+    host_fpu_div,
+};
+
+static inline bool can_use_host_fpu(const float_status *status)
+{
+    return SOFTFLOAT_HOST_FPU
+        && likely(status->float_exception_flags & float_flag_inexact)
+        && likely(status->float_rounding_mode == float_round_nearest_even);
+}
+
+static inline bool float32_is_zero_or_normal(float32 a)
+{
+    int aExp = extractFloat32Exp(a);
+
+    return aExp != 0xFF && (aExp != 0 || extractFloat32Frac(a) == 0);
+}
+
+static inline bool float64_is_zero_or_normal(float64 a)
+{
+    int aExp = extractFloat64Exp(a);
+
+    return aExp != 0x7FF && (aExp != 0 || extractFloat64Frac(a) == 0);
+}
+
+/* Results that are NaN, zero or tiny are left to the emulation. */
+static inline bool float32_host_result(float r, float32 *z,
+                                       float_status *status)
+{
+    union_float32 ur;
+
+    if (unlikely(isinf(r))) {
+        float_raise(float_flag_overflow | float_flag_inexact, status);
+    } else if (unlikely(!(fabsf(r) > FLT_MIN))) {
+        return false;
+    }
+    ur.h = r;
+    *z = ur.s;
+    return true;
+}
+
+static inline bool float64_host_result(double r, float64 *z,
+                                       float_status *status)
+{
+    union_float64 ur;
+
+    if (unlikely(isinf(r))) {
+        float_raise(float_flag_overflow | float_flag_inexact, status);
+    } else if (unlikely(!(fabs(r) > DBL_MIN))) {
+        return false;
+    }
+    ur.h = r;
+    *z = ur.s;
+    return true;
+}
+
+static inline bool float32_host_op(enum host_fpu_op op, float32 a, float32 b,
+                                   float32 *z, float_status *status)
+{
+    union_float32 ua, ub;
+    float r;
+
+    if (!can_use_host_fpu(status)
+        || !float32_is_zero_or_normal(a) || !float32_is_zero_or_normal(b)) {
+        return false;
+    }
+    ua.s = a;
+    ub.s = b;
+    switch (op) {
+    case host_fpu_add:
+        r = ua.h + ub.h;
+        break;
+    case host_fpu_sub:
+        r = ua.h - ub.h;
+        break;
+    case host_fpu_mul:
+        r = ua.h * ub.h;
+        break;
+    case host_fpu_div:
+        if (float32_is_zero(b)) {
+            return false;
+        }
+        r = ua.h / ub.h;
+        break;
+    default:
+        g_assert_not_reached();
+    }
+    return float32_host_result(r, z, status);
+}
+
+static inline bool float64_host_op(enum host_fpu_op op, float64 a, float64 b,
+                                   float64 *z, float_status *status)
+{
+    union_float64 ua, ub;
+    double r;
+
+    if (!can_use_host_fpu(status)
+        || !float64_is_zero_or_normal(a) || !float64_is_zero_or_normal(b)) {
+        return false;
+    }
+    ua.s = a;
+    ub.s = b;
+    switch (op) {
+    case host_fpu_add:
+        r = ua.h + ub.h;
+        break;
+    case host_fpu_sub:
+        r = ua.h - ub.h;
+        break;
+    case host_fpu_mul:
+        r = ua.h * ub.h;
+        break;
+    case host_fpu_div:
+        if (float64_is_zero(b)) {
+            return false;
+        }
+        r = ua.h / ub.h;
+        break;
+    default:
+        g_assert_not_reached();
+    }
+    return float64_host_result(r, z, status);
+}
+
 /*----------------------------------------------------------------------------
 | Returns the result of adding the single-precision floating-point values `a'
 | and `b'.  The operation is performed according to the IEC/IEEE Standard for
@@ -2167,6 +2324,11 @@ static float32 subFloat32Sigs(float32 a, float32 b, flag zSign,
 float32 float32_add(float32 a, float32 b, float_status *status)
 {
     flag aSign, bSign;
+    float32 z;
+
+    if (float32_host_op(host_fpu_add, a, b, &z, status)) {
+        return z;
+    }
     a = float32_squash_input_denormal(a, status);
     b = float32_squash_input_denormal(b, status);
 
@@ -2190,6 +2352,11 @@ float32 float32_add(float32 a, float32 b, float_status *status)
 float32 float32_sub(float32 a, float32 b, float_status *status)
 {
     flag aSign, bSign;
+    float32 z;
+
+    if (float32_host_op(host_fpu_sub, a, b, &z, status)) {
+        return z;
+    }
     a = float32_squash_input_denormal(a, status);
     b = float32_squash_input_denormal(b, status);
 
@@ -2217,7 +2384,11 @@ float32 float32_mul(float32 a, float32 b, float_status *status)
     uint32_t aSig, bSig;
     uint64_t zSig64;
     uint32_t zSig;
+    float32 z;
 
+    if (float32_host_op(host_fpu_mul, a, b, &z, status)) {
+        return z;
+    }
     a = float32_squash_input_denormal(a, status);
     b = float32_squash_input_denormal(b, status);
 
@@ -2280,6 +2451,11 @@ float32 float32_div(float32 a, float32 b, float_status *status)
     flag aSign, bSign, zSign;
     int aExp, bExp, zExp;
     uint32_t aSig, bSig, zSig;
+    float32 z;
+
+    if (float32_host_op(host_fpu_div, a, b, &z, status)) {
+        return z;
+    }
     a = float32_squash_input_denormal(a, status);
     b = float32_squash_input_denormal(b, status);
 
@@ -2679,6 +2855,17 @@ float32 float32_sqrt(float32 a, float_status *status)
     int aExp, zExp;
     uint32_t aSig, zSig;
     uint64_t rem, term;
+    float32 z;
+
+    if (can_use_host_fpu(status) && float32_is_zero_or_normal(a)
+        && !extractFloat32Sign(a)) {
+        union_float32 ua;
+
+        ua.s = a;
+        if (float32_host_result(sqrtf(ua.h), &z, status)) {
+            return z;
+        }
+    }
     a = float32_squash_input_denormal(a, status);
 
     aSig = extractFloat32Frac( a );
@@ -3962,6 +4149,11 @@ static float64 subFloat64Sigs(float64 a, float64 b, flag zSign,
 float64 float64_add(float64 a, float64 b, float_status *status)
 {
     flag aSign, bSign;
+    float64 z;
+
+    if (float64_host_op(host_fpu_add, a, b, &z, status)) {
+        return z;
+    }
     a = float64_squash_input_denormal(a, status);
     b = float64_squash_input_denormal(b, status);
 
@@ -3985,6 +4177,11 @@ float64 float64_add(float64 a, float64 b, float_status *status)
 float64 float64_sub(float64 a, float64 b, float_status *status)
 {
     flag aSign, bSign;
+    float64 z;
+
+    if (float64_host_op(host_fpu_sub, a, b, &z, status)) {
+        return z;
+    }
     a = float64_squash_input_denormal(a, status);
     b = float64_squash_input_denormal(b, status);
 
@@ -4010,7 +4207,11 @@ float64 float64_mul(float64 a, float64 b, float_status *status)
     flag aSign, bSign, zSign;
     int aExp, bExp, zExp;
     uint64_t aSig, bSig, zSig0, zSig1;
+    float64 z;
 
+    if (float64_host_op(host_fpu_mul, a, b, &z, status)) {
+        return z;
+    }
     a = float64_squash_input_denormal(a, status);
     b = float64_squash_input_denormal(b, status);
 
@@ -4075,6 +4276,11 @@ float64 float64_div(float64 a, float64 b, float_status *status)
     uint64_t aSig, bSig, zSig;
     uint64_t rem0, rem1;
     uint64_t term0, term1;
+    float64 z;
+
+    if (float64_host_op(host_fpu_div, a, b, &z, status)) {
+        return z;
+    }
     a = float64_squash_input_denormal(a, status);
     b = float64_squash_input_denormal(b, status);
 
@@ -4487,6 +4693,17 @@ float64 float64_sqrt(float64 a, float_status *status)
     int aExp, zExp;
     uint64_t aSig, zSig, doubleZSig;
     uint64_t rem0, rem1, term0, term1;
+    float64 z;
+
+    if (can_use_host_fpu(status) && float64_is_zero_or_normal(a)
+        && !extractFloat64Sign(a)) {
+        union_float64 ua;
+
+        ua.s = a;
+        if (float64_host_result(sqrt(ua.h), &z, status)) {
+            return z;
+        }
+    }
     a = float64_squash_input_denormal(a, status);
 
     aSig = extractFloat64Frac( a );
@@ -302,6 +302,37 @@ STEXI
 @item info opcount
 @findex opcount
 Show dynamic compiler opcode counters
+ETEXI
+
+    {
+        .name       = "tb-hot",
+        .args_type  = "count:i?",
+        .params     = "[count]",
+        .help       = "show the most executed translation blocks",
+        .mhandler.cmd = hmp_info_tb_hot,
+    },
+
+STEXI
+@item info tb-hot [@var{count}]
+@findex tb-hot
+Show the @var{count} (10 by default) most executed translation blocks.
+Requires TB profiling, see @code{tb-profile}.
+ETEXI
+
+    {
+        .name       = "tb-samples",
+        .args_type  = "count:i?",
+        .params     = "[count]",
+        .help       = "show the most sampled translation blocks and pages",
+        .mhandler.cmd = hmp_info_tb_samples,
+    },
+
+STEXI
+@item info tb-samples [@var{count}]
+@findex tb-samples
+Show the @var{count} (10 by default) most sampled guest pcs and, for
+memory accesses, guest pages in the last samples of each CPU. See
+@code{tb-sample}.
 ETEXI
 
     {
@@ -823,6 +854,30 @@ ETEXI
        .mhandler.cmd = hmp_info_ox_debug,
    },
 STEXI
+@item ox-info-map-cache
+Display the size and the counters of the AppNVM mapping cache in ox
+ETEXI
+
+    {
+        .name       = "ox_map_cache",
+       .args_type  = "",
+       .params     = "",
+       .help       = "Show the size and counters of the AppNVM mapping cache in ox",
+       .mhandler.cmd = hmp_info_ox_map_cache,
+   },
+STEXI
+@item ox-info-latency
+Display the latency percentiles of each I/O pipeline stage in ox
+ETEXI
+
+    {
+        .name       = "ox_latency",
+       .args_type  = "ch:i?",
+       .params     = "[ch]",
+       .help       = "Show the I/O pipeline stage latencies in ox, of all channels or of a channel",
+       .mhandler.cmd = hmp_info_ox_latency,
+   },
+STEXI
 @item info hotpluggable-cpus
 @findex hotpluggable-cpus
 Show information about hotpluggable CPUs
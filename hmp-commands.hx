@@ -386,6 +386,47 @@ STEXI
 @findex singlestep
 Run the emulation in single step mode.
 If called with option off, the emulation returns to normal mode.
+ETEXI
+
+    {
+        .name       = "tb-profile",
+        .args_type  = "option:s?",
+        .params     = "[on|off]",
+        .help       = "count the executions of each translation block",
+        .mhandler.cmd = hmp_tb_profile,
+    },
+
+STEXI
+@item tb-profile [off]
+@findex tb-profile
+Count the executions of each translation block. The translated code is
+flushed, new blocks are translated with a counter. Blocks executed often
+are translated again with more optimization. See @code{info tb-hot}.
+If called with option off, the counters are removed.
+ETEXI
+
+    {
+        .name       = "tb-sample",
+        .args_type  = "mem:-m,option:s?,period:i?",
+        .params     = "[-m] [on|off] [period]",
+        .help       = "sample the translation blocks entered by each CPU "
+                      "(-m: and the memory accesses of the softmmu slow path)",
+        .mhandler.cmd = hmp_tb_sample,
+    },
+
+STEXI
+@item tb-sample [-m] [off] [@var{period}]
+@findex tb-sample
+Record one translation block entered from the main loop out of
+@var{period} (100 by default), in a ring buffer of each CPU. With
+@option{-m}, also record one access out of @var{period} among those that
+miss the TLB or go to I/O. See @code{info tb-samples}.
+
+While sampling is on, the host code of the translated blocks is listed in
+@file{/tmp/perf-<pid>.map}, so that @command{perf} shows the guest address
+and symbol of the generated code. Entries are not removed when the code
+buffer is flushed and reused.
+If called with option off, sampling stops and the map is closed.
 ETEXI
 
     {
@@ -1755,6 +1796,32 @@ ETEXI
        .help       = "Enables or disables debugging of ox (on/off)",
        .mhandler.cmd = hmp_ox_debug,
    },
+
+STEXI
+@item ox-map-cache
+Resizes the AppNVM mapping cache of ox (pages per channel)
+ETEXI
+
+    {
+        .name       = "ox_map_cache",
+       .args_type  = "pages:i",
+       .params     = "pages",
+       .help       = "Resizes the AppNVM mapping cache of ox (pages per channel)",
+       .mhandler.cmd = hmp_ox_map_cache,
+   },
+
+STEXI
+@item ox-latency-reset
+Clears the I/O pipeline latency histograms of ox
+ETEXI
+
+    {
+        .name       = "ox_latency_reset",
+       .args_type  = "",
+       .params     = "",
+       .help       = "Clears the I/O pipeline latency histograms of ox",
+       .mhandler.cmd = hmp_ox_latency_reset,
+   },
 STEXI
 @item qom-set @var{path} @var{property} @var{value}
 Set QOM property @var{property} of object at location @var{path} to value @var{value}
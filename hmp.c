@@ -249,6 +249,25 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->xbzrle_cache->overflow);
     }
 
+    if (info->has_rdma_reg_cache) {
+        monitor_printf(mon, "rdma reg cache size: %" PRIu64 " kbytes\n",
+                       info->rdma_reg_cache->cache_size >> 10);
+        monitor_printf(mon, "rdma registered: %" PRIu64 " kbytes\n",
+                       info->rdma_reg_cache->cached >> 10);
+        monitor_printf(mon, "rdma registrations: %" PRIu64 "\n",
+                       info->rdma_reg_cache->registrations);
+        monitor_printf(mon, "rdma registration time: %" PRIu64 " us\n",
+                       info->rdma_reg_cache->registration_time);
+        monitor_printf(mon, "rdma prefetched: %" PRIu64 "\n",
+                       info->rdma_reg_cache->prefetched);
+        monitor_printf(mon, "rdma reg cache hits: %" PRIu64 "\n",
+                       info->rdma_reg_cache->hits);
+        monitor_printf(mon, "rdma reg cache misses: %" PRIu64 "\n",
+                       info->rdma_reg_cache->misses);
+        monitor_printf(mon, "rdma reg cache evictions: %" PRIu64 "\n",
+                       info->rdma_reg_cache->evictions);
+    }
+
     if (info->has_cpu_throttle_percentage) {
         monitor_printf(mon, "cpu throttle percentage: %" PRIu64 "\n",
                        info->cpu_throttle_percentage);
@@ -306,6 +325,18 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, " %s: '%s'",
             MigrationParameter_lookup[MIGRATION_PARAMETER_TLS_HOSTNAME],
             params->tls_hostname ? : "");
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_MULTIFD_CHANNELS],
+            params->x_multifd_channels);
+        monitor_printf(mon, " %s: %s",
+            MigrationParameter_lookup[MIGRATION_PARAMETER_COMPRESS_METHOD],
+            MigrationCompressMethod_lookup[params->compress_method]);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_VCPU_DIRTY_LIMIT],
+            params->vcpu_dirty_limit);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_RDMA_REG_CACHE_SIZE],
+            params->rdma_reg_cache_size);
         monitor_printf(mon, "\n");
     }
 
@@ -1128,7 +1159,7 @@ void hmp_drive_backup(Monitor *mon, const QDict *qdict)
 
     qmp_drive_backup(false, NULL, device, filename, !!format, format,
                      full ? MIRROR_SYNC_MODE_FULL : MIRROR_SYNC_MODE_TOP,
-                     true, mode, false, 0, false, NULL,
+                     true, mode, false, 0, false, 0, false, NULL,
                      false, 0, false, 0, &err);
     hmp_handle_error(mon, &err);
 }
@@ -1262,6 +1293,11 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
     bool has_cpu_throttle_increment = false;
     bool has_tls_creds = false;
     bool has_tls_hostname = false;
+    bool has_x_multifd_channels = false;
+    bool has_compress_method = false;
+    int compress_method = 0;
+    bool has_vcpu_dirty_limit = false;
+    bool has_rdma_reg_cache_size = false;
     bool use_int_value = false;
     int i;
 
@@ -1293,6 +1329,27 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
             case MIGRATION_PARAMETER_TLS_HOSTNAME:
                 has_tls_hostname = true;
                 break;
+            case MIGRATION_PARAMETER_X_MULTIFD_CHANNELS:
+                has_x_multifd_channels = true;
+                use_int_value = true;
+                break;
+            case MIGRATION_PARAMETER_COMPRESS_METHOD:
+                compress_method = qapi_enum_parse(
+                    MigrationCompressMethod_lookup, valuestr,
+                    MIGRATION_COMPRESS_METHOD__MAX, -1, &err);
+                if (err) {
+                    goto cleanup;
+                }
+                has_compress_method = true;
+                break;
+            case MIGRATION_PARAMETER_VCPU_DIRTY_LIMIT:
+                has_vcpu_dirty_limit = true;
+                use_int_value = true;
+                break;
+            case MIGRATION_PARAMETER_RDMA_REG_CACHE_SIZE:
+                has_rdma_reg_cache_size = true;
+                use_int_value = true;
+                break;
             }
 
             if (use_int_value) {
@@ -1310,6 +1367,10 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
                                        has_cpu_throttle_increment, valueint,
                                        has_tls_creds, valuestr,
                                        has_tls_hostname, valuestr,
+                                       has_x_multifd_channels, valueint,
+                                       has_compress_method, compress_method,
+                                       has_vcpu_dirty_limit, valueint,
+                                       has_rdma_reg_cache_size, valueint,
                                        &err);
             break;
         }
@@ -2033,8 +2094,17 @@ void hmp_info_iothreads(Monitor *mon, const QDict *qdict)
     IOThreadInfoList *info;
 
     for (info = info_list; info; info = info->next) {
+        IOThreadInfo *value = info->value;
+
         monitor_printf(mon, "%s: thread_id=%" PRId64 "\n",
-                       info->value->id, info->value->thread_id);
+                       value->id, value->thread_id);
+        monitor_printf(mon, "    poll-max-ns=%" PRId64 " poll-grow=%" PRId64
+                       " poll-shrink=%" PRId64 "\n",
+                       value->poll_max_ns, value->poll_grow,
+                       value->poll_shrink);
+        monitor_printf(mon, "    poll-ns=%" PRId64 " poll-hits=%" PRId64
+                       " poll-misses=%" PRId64 "\n",
+                       value->poll_ns, value->poll_hits, value->poll_misses);
     }
 
     qapi_free_IOThreadInfoList(info_list);
@@ -2468,3 +2538,83 @@ void hmp_info_ox_debug(Monitor *mon, const QDict *qdict)
 {
         monitor_printf(mon, "OX: debugging is %s\n", core.debug ? "on" : "off");
 }
+
+void hmp_ox_map_cache(Monitor *mon, const QDict *qdict)
+{
+        int64_t pages = qdict_get_int(qdict, "pages");
+
+        if (pages <= 0 || pages > UINT32_MAX ||
+                                        nvm_ftl_map_cache_set(pages)) {
+                monitor_printf(mon, "OX: map cache not resized to %" PRId64
+                               " pages\n", pages);
+                return;
+        }
+        if (core.qemu) {
+                core.qemu->map_cache_pgs = pages;
+        }
+        monitor_printf(mon, "OX: map cache resized to %" PRId64
+                       " pages per channel\n", pages);
+}
+
+void hmp_info_ox_map_cache(Monitor *mon, const QDict *qdict)
+{
+        struct nvm_ftl_map_cache_st st;
+        uint64_t lookups;
+
+        if (nvm_ftl_map_cache_get(&st)) {
+                monitor_printf(mon, "OX: map cache not available\n");
+                return;
+        }
+        lookups = st.hit + st.miss;
+        monitor_printf(mon, "OX: map cache %u pages per channel, %u channels, "
+                       "%u KB pages\n", st.pgs_ch, st.nch, st.pg_sz / 1024);
+        monitor_printf(mon, "  used: %u/%u pages\n", st.used, st.pgs_ch * st.nch);
+        monitor_printf(mon, "  hit: %" PRIu64 ", miss: %" PRIu64
+                       ", evict: %" PRIu64 ", hit ratio: %" PRIu64 "%%\n",
+                       st.hit, st.miss, st.evict,
+                       lookups ? st.hit * 100 / lookups : 0);
+        monitor_printf(mon, "  prefetch: %" PRIu64 "\n", st.prefetch);
+}
+
+void hmp_ox_latency_reset(Monitor *mon, const QDict *qdict)
+{
+        ox_lat_reset();
+        monitor_printf(mon, "OX: latency histograms cleared\n");
+}
+
+void hmp_info_ox_latency(Monitor *mon, const QDict *qdict)
+{
+        struct ox_lat_st st;
+        int64_t ch = qdict_get_try_int(qdict, "ch", -1);
+        uint16_t lat_ch = (ch < 0) ? OX_LAT_ALL_CH : ch;
+        uint8_t stage, op;
+
+        if (!ox_lat_channels() || (ch >= ox_lat_channels())) {
+                monitor_printf(mon, "OX: latency histograms not available\n");
+                return;
+        }
+        if (ch < 0) {
+                monitor_printf(mon, "OX: stage latency (usec), all channels\n");
+        } else {
+                monitor_printf(mon, "OX: stage latency (usec), channel %"
+                               PRId64 "\n", ch);
+        }
+        monitor_printf(mon, "  %-10s %-6s %12s %10s %10s %10s %10s %10s "
+                       "%10s\n", "stage", "op", "count", "mean", "p50", "p90",
+                       "p99", "p99.9", "max");
+
+        for (stage = 0; stage < OX_LAT_STAGES; stage++) {
+                for (op = 0; op < OX_LAT_OPS; op++) {
+                        if (ox_lat_get(stage, op, lat_ch, &st) || !st.count) {
+                                continue;
+                        }
+                        monitor_printf(mon, "  %-10s %-6s %12" PRIu64
+                                       " %10.1f %10.1f %10.1f %10.1f %10.1f"
+                                       " %10.1f\n", ox_lat_stage_name(stage),
+                                       ox_lat_op_name(op), st.count,
+                                       st.mean / 1000.0, st.p50 / 1000.0,
+                                       st.p90 / 1000.0, st.p99 / 1000.0,
+                                       st.p999 / 1000.0, st.max / 1000.0);
+                }
+        }
+}
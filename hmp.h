@@ -137,5 +137,9 @@ void hmp_hotpluggable_cpus(Monitor *mon, const QDict *qdict);
 
 void hmp_ox_debug(Monitor *mon, const QDict *qdict);
 void hmp_info_ox_debug(Monitor *mon, const QDict *qdict);
+void hmp_ox_map_cache(Monitor *mon, const QDict *qdict);
+void hmp_info_ox_map_cache(Monitor *mon, const QDict *qdict);
+void hmp_ox_latency_reset(Monitor *mon, const QDict *qdict);
+void hmp_info_ox_latency(Monitor *mon, const QDict *qdict);
 
 #endif
@@ -171,6 +171,12 @@ typedef struct V9fsDir {
     QemuMutex readdir_mutex;
 } V9fsDir;
 
+/* Directory entries gathered by v9fs_co_readdir_many() */
+typedef struct V9fsDirEnt {
+    struct dirent *dent;
+    struct V9fsDirEnt *next;
+} V9fsDirEnt;
+
 static inline void v9fs_readdir_lock(V9fsDir *dir)
 {
     qemu_mutex_lock(&dir->readdir_mutex);
@@ -332,6 +338,7 @@ extern int v9fs_name_to_path(V9fsState *s, V9fsPath *dirpath,
                              const char *name, V9fsPath *path);
 extern int v9fs_device_realize_common(V9fsState *s, Error **errp);
 extern void v9fs_device_unrealize_common(V9fsState *s, Error **errp);
+extern size_t v9fs_readdir_data_size(V9fsString *name);
 
 ssize_t pdu_marshal(V9fsPDU *pdu, size_t offset, const char *fmt, ...);
 ssize_t pdu_unmarshal(V9fsPDU *pdu, size_t offset, const char *fmt, ...);
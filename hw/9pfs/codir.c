@@ -41,6 +41,86 @@ int v9fs_co_readdir(V9fsPDU *pdu, V9fsFidState *fidp, struct dirent **dent)
     return err;
 }
 
+/* Called from a worker thread */
+static int do_readdir_many(V9fsState *s, V9fsFidState *fidp,
+                           V9fsDirEnt **entries, off_t offset,
+                           int32_t maxsize)
+{
+    V9fsDirEnt **tail = entries;
+    struct dirent *dent;
+    off_t saved_dir_pos;
+    int32_t size = 0;
+    int count = 0, err = 0;
+
+    v9fs_readdir_lock(&fidp->fs.dir);
+
+    if (offset == 0) {
+        s->ops->rewinddir(&s->ctx, &fidp->fs);
+    } else {
+        s->ops->seekdir(&s->ctx, &fidp->fs, offset);
+    }
+    saved_dir_pos = s->ops->telldir(&s->ctx, &fidp->fs);
+    if (saved_dir_pos < 0) {
+        err = -errno;
+        goto out;
+    }
+
+    for (;;) {
+        V9fsString name;
+        V9fsDirEnt *e;
+
+        errno = 0;
+        dent = s->ops->readdir(&s->ctx, &fidp->fs);
+        if (!dent) {
+            err = -errno;
+            break;
+        }
+
+        name.data = dent->d_name;
+        name.size = strlen(dent->d_name);
+        if (size + v9fs_readdir_data_size(&name) > maxsize) {
+            /* Ran out of buffer, leave this one for the next request */
+            s->ops->seekdir(&s->ctx, &fidp->fs, saved_dir_pos);
+            break;
+        }
+        size += v9fs_readdir_data_size(&name);
+
+        e = g_new0(V9fsDirEnt, 1);
+        e->dent = g_memdup(dent, sizeof(struct dirent));
+        *tail = e;
+        tail = &e->next;
+        count++;
+        saved_dir_pos = dent->d_off;
+    }
+
+out:
+    v9fs_readdir_unlock(&fidp->fs.dir);
+    return err ? err : count;
+}
+
+/*
+ * Reads, from @offset on (0 rewinds the directory), as many entries as fit
+ * in @maxsize bytes of a Treaddir reply, all in one trip to a worker
+ * thread.  Returns the number of entries or -errno; the caller frees
+ * *@entries in both cases.
+ */
+int v9fs_co_readdir_many(V9fsPDU *pdu, V9fsFidState *fidp,
+                         V9fsDirEnt **entries, off_t offset, int32_t maxsize)
+{
+    int err;
+    V9fsState *s = pdu->s;
+
+    *entries = NULL;
+    if (v9fs_request_cancelled(pdu)) {
+        return -EINTR;
+    }
+    v9fs_co_run_in_worker(
+        {
+            err = do_readdir_many(s, fidp, entries, offset, maxsize);
+        });
+    return err;
+}
+
 off_t v9fs_co_telldir(V9fsPDU *pdu, V9fsFidState *fidp)
 {
     off_t err;
@@ -18,6 +18,10 @@
  * Usage: add options:
  *      -drive file=<file>,if=none,id=<drive_id>
  *      -device nvme,drive=<drive_id>,serial=<serial>,id=<id[optional]>
+ *
+ * The I/O queues can be processed in an IOThread, off the main loop:
+ *      -object iothread,id=<iothread_id>
+ *      -device nvme,drive=<drive_id>,serial=<serial>,iothread=<iothread_id>
  */
 
 #include "qemu/osdep.h"
@@ -25,6 +29,8 @@
 #include "hw/hw.h"
 #include "hw/pci/msix.h"
 #include "hw/pci/pci.h"
+#include "qemu/atomic.h"
+#include "qemu/main-loop.h"
 #include "sysemu/sysemu.h"
 #include "qapi/error.h"
 #include "qapi/visitor.h"
@@ -33,6 +39,32 @@
 #include "nvme.h"
 
 static void nvme_process_sq(void *opaque);
+static void nvme_dbbuf_init_sq(NvmeCtrl *n, NvmeSQueue *sq);
+static void nvme_dbbuf_init_cq(NvmeCtrl *n, NvmeCQueue *cq);
+
+/* I/O queues run in the IOThread, if any, the admin queues in the main loop */
+static AioContext *nvme_queue_ctx(NvmeCtrl *n, uint16_t qid)
+{
+    if (qid && n->iothread) {
+        return iothread_get_aio_context(n->iothread);
+    }
+    return qemu_get_aio_context();
+}
+
+/* Excludes the IOThread while the main loop changes the I/O queues */
+static void nvme_io_lock(NvmeCtrl *n)
+{
+    if (n->iothread) {
+        aio_context_acquire(iothread_get_aio_context(n->iothread));
+    }
+}
+
+static void nvme_io_unlock(NvmeCtrl *n)
+{
+    if (n->iothread) {
+        aio_context_release(iothread_get_aio_context(n->iothread));
+    }
+}
 
 static int nvme_check_sqid(NvmeCtrl *n, uint16_t sqid)
 {
@@ -60,12 +92,12 @@ static void nvme_inc_sq_head(NvmeSQueue *sq)
 
 static uint8_t nvme_cq_full(NvmeCQueue *cq)
 {
-    return (cq->tail + 1) % cq->size == cq->head;
+    return (cq->tail + 1) % cq->size == atomic_read(&cq->head);
 }
 
 static uint8_t nvme_sq_empty(NvmeSQueue *sq)
 {
-    return sq->head == sq->tail;
+    return sq->head == atomic_read(&sq->tail);
 }
 
 static void nvme_isr_notify(NvmeCtrl *n, NvmeCQueue *cq)
@@ -79,6 +111,69 @@ static void nvme_isr_notify(NvmeCtrl *n, NvmeCQueue *cq)
     }
 }
 
+static void nvme_irq_bh(void *opaque)
+{
+    NvmeCQueue *cq = opaque;
+
+    nvme_isr_notify(cq->ctrl, cq);
+}
+
+/* IOThread CQs raise their interrupts from the main loop, under the BQL */
+static void nvme_cq_notify(NvmeCtrl *n, NvmeCQueue *cq)
+{
+    if (cq->irq_bh) {
+        qemu_bh_schedule(cq->irq_bh);
+    } else {
+        nvme_isr_notify(n, cq);
+    }
+}
+
+static uint32_t nvme_dbbuf_read(NvmeCtrl *n, uint64_t addr)
+{
+    uint32_t val;
+
+    pci_dma_read(&n->parent_obj, addr, (void *)&val, sizeof(val));
+    return le32_to_cpu(val);
+}
+
+static void nvme_dbbuf_write(NvmeCtrl *n, uint64_t addr, uint32_t val)
+{
+    val = cpu_to_le32(val);
+    pci_dma_write(&n->parent_obj, addr, (void *)&val, sizeof(val));
+}
+
+/* Reads the shadow tail doorbell, returns 1 if the tail moved */
+static int nvme_sq_update_tail(NvmeSQueue *sq)
+{
+    uint32_t tail;
+
+    if (!sq->db_addr) {
+        return 0;
+    }
+    tail = nvme_dbbuf_read(sq->ctrl, sq->db_addr);
+    if (tail >= sq->size || tail == sq->tail) {
+        return 0;
+    }
+    atomic_set(&sq->tail, tail);
+    return 1;
+}
+
+/* Reads the shadow head doorbell, returns 1 if the head moved */
+static int nvme_cq_update_head(NvmeCQueue *cq)
+{
+    uint32_t head;
+
+    if (!cq->db_addr) {
+        return 0;
+    }
+    head = nvme_dbbuf_read(cq->ctrl, cq->db_addr);
+    if (head >= cq->size || head == cq->head) {
+        return 0;
+    }
+    atomic_set(&cq->head, head);
+    return 1;
+}
+
 static uint16_t nvme_map_prp(QEMUSGList *qsg, uint64_t prp1, uint64_t prp2,
     uint32_t len, NvmeCtrl *n)
 {
@@ -166,26 +261,47 @@ static void nvme_post_cqes(void *opaque)
     NvmeCtrl *n = cq->ctrl;
     NvmeRequest *req, *next;
 
-    QTAILQ_FOREACH_SAFE(req, &cq->req_list, entry, next) {
-        NvmeSQueue *sq;
-        hwaddr addr;
+    nvme_cq_update_head(cq);
+    for (;;) {
+        QTAILQ_FOREACH_SAFE(req, &cq->req_list, entry, next) {
+            NvmeSQueue *sq;
+            hwaddr addr;
+
+            if (nvme_cq_full(cq)) {
+                break;
+            }
 
-        if (nvme_cq_full(cq)) {
+            QTAILQ_REMOVE(&cq->req_list, req, entry);
+            sq = req->sq;
+            req->cqe.status = cpu_to_le16((req->status << 1) | cq->phase);
+            req->cqe.sq_id = cpu_to_le16(sq->sqid);
+            req->cqe.sq_head = cpu_to_le16(sq->head);
+            addr = cq->dma_addr + cq->tail * n->cqe_size;
+            nvme_inc_cq_tail(cq);
+            pci_dma_write(&n->parent_obj, addr, (void *)&req->cqe,
+                sizeof(req->cqe));
+            /* The SQ stopped fetching when it ran out of requests */
+            if (QTAILQ_EMPTY(&sq->req_list)) {
+                qemu_bh_schedule(sq->bh);
+            }
+            QTAILQ_INSERT_TAIL(&sq->req_list, req, entry);
+        }
+
+        /* The CQ is full, ask the host to ring the head doorbell. The head
+         * is read again in case it moved before the EventIdx was updated */
+        if (!cq->ei_addr || QTAILQ_EMPTY(&cq->req_list)) {
             break;
         }
+        nvme_dbbuf_write(n, cq->ei_addr, cq->head);
+        smp_mb();
+        if (!nvme_cq_update_head(cq)) {
+            break;
+        }
+    }
 
-        QTAILQ_REMOVE(&cq->req_list, req, entry);
-        sq = req->sq;
-        req->cqe.status = cpu_to_le16((req->status << 1) | cq->phase);
-        req->cqe.sq_id = cpu_to_le16(sq->sqid);
-        req->cqe.sq_head = cpu_to_le16(sq->head);
-        addr = cq->dma_addr + cq->tail * n->cqe_size;
-        nvme_inc_cq_tail(cq);
-        pci_dma_write(&n->parent_obj, addr, (void *)&req->cqe,
-            sizeof(req->cqe));
-        QTAILQ_INSERT_TAIL(&sq->req_list, req, entry);
+    if (cq->tail != atomic_read(&cq->head)) {
+        nvme_cq_notify(n, cq);
     }
-    nvme_isr_notify(n, cq);
 }
 
 static void nvme_enqueue_req_completion(NvmeCQueue *cq, NvmeRequest *req)
@@ -193,7 +309,49 @@ static void nvme_enqueue_req_completion(NvmeCQueue *cq, NvmeRequest *req)
     assert(cq->cqid == req->sq->cqid);
     QTAILQ_REMOVE(&req->sq->out_req_list, req, entry);
     QTAILQ_INSERT_TAIL(&cq->req_list, req, entry);
-    timer_mod(cq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+    qemu_bh_schedule(cq->bh);
+}
+
+static void nvme_unmap_iov(NvmeCtrl *n, NvmeRequest *req, bool done)
+{
+    AddressSpace *as = pci_get_address_space(&n->parent_obj);
+    int i;
+
+    for (i = 0; i < req->iov.niov; i++) {
+        dma_memory_unmap(as, req->iov.iov[i].iov_base, req->iov.iov[i].iov_len,
+            req->dir, done ? req->iov.iov[i].iov_len : 0);
+    }
+    qemu_iovec_reset(&req->iov);
+}
+
+/*
+ * Maps the PRP entries of a read or write into the request iovec, so the
+ * command goes straight to the block layer without the dma-helpers state
+ * machine. Fails with nothing left mapped if an entry is not directly
+ * accessible guest RAM, the command then takes the dma_blk_io path.
+ */
+static int nvme_map_iov(NvmeCtrl *n, NvmeRequest *req, DMADirection dir)
+{
+    QEMUSGList *qsg = &req->qsg;
+    dma_addr_t len;
+    void *ptr;
+    int i;
+
+    req->dir = dir;
+    qemu_iovec_reset(&req->iov);
+    for (i = 0; i < qsg->nsg; i++) {
+        len = qsg->sg[i].len;
+        ptr = dma_memory_map(qsg->as, qsg->sg[i].base, &len, dir);
+        if (!ptr || len != qsg->sg[i].len) {
+            if (ptr) {
+                dma_memory_unmap(qsg->as, ptr, len, dir, 0);
+            }
+            nvme_unmap_iov(n, req, false);
+            return -1;
+        }
+        qemu_iovec_add(&req->iov, ptr, len);
+    }
+    return 0;
 }
 
 static void nvme_rw_cb(void *opaque, int ret)
@@ -213,6 +371,9 @@ static void nvme_rw_cb(void *opaque, int ret)
     if (req->has_sg) {
         qemu_sglist_destroy(&req->qsg);
     }
+    if (req->has_iov) {
+        nvme_unmap_iov(n, req, true);
+    }
     nvme_enqueue_req_completion(cq, req);
 }
 
@@ -220,6 +381,7 @@ static uint16_t nvme_flush(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
     NvmeRequest *req)
 {
     req->has_sg = false;
+    req->has_iov = false;
     block_acct_start(blk_get_stats(n->conf.blk), &req->acct, 0,
          BLOCK_ACCT_FLUSH);
     req->aiocb = blk_aio_flush(n->conf.blk, nvme_rw_cb, req);
@@ -256,7 +418,21 @@ static uint16_t nvme_rw(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
     assert((nlb << data_shift) == req->qsg.size);
 
     req->has_sg = true;
+    req->has_iov = false;
     dma_acct_start(n->conf.blk, &req->acct, &req->qsg, acct);
+    if (!nvme_map_iov(n, req, is_write ? DMA_DIRECTION_TO_DEVICE :
+                                         DMA_DIRECTION_FROM_DEVICE)) {
+        qemu_sglist_destroy(&req->qsg);
+        req->has_sg = false;
+        req->has_iov = true;
+        req->aiocb = is_write ?
+            blk_aio_pwritev(n->conf.blk, data_offset, &req->iov, 0,
+                nvme_rw_cb, req) :
+            blk_aio_preadv(n->conf.blk, data_offset, &req->iov, 0,
+                nvme_rw_cb, req);
+        return NVME_NO_COMPLETE;
+    }
+
     req->aiocb = is_write ?
         dma_blk_write(n->conf.blk, &req->qsg, data_offset, nvme_rw_cb, req) :
         dma_blk_read(n->conf.blk, &req->qsg, data_offset, nvme_rw_cb, req);
@@ -285,11 +461,67 @@ static uint16_t nvme_io_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
     }
 }
 
+static void nvme_sq_notifier(EventNotifier *e)
+{
+    NvmeSQueue *sq = container_of(e, NvmeSQueue, notifier);
+
+    if (event_notifier_test_and_clear(e)) {
+        nvme_process_sq(sq);
+    }
+}
+
+/*
+ * With shadow doorbells, the tail doorbell of an IOThread SQ is bound to an
+ * eventfd handled in the IOThread, guest doorbell writes then kick it
+ * without exiting to the MMIO handler. The written value is not delivered,
+ * the tail is read from the shadow doorbell.
+ */
+static void nvme_init_sq_ioeventfd(NvmeCtrl *n, NvmeSQueue *sq)
+{
+    AioContext *ctx = nvme_queue_ctx(n, sq->sqid);
+
+    if (!sq->sqid || !n->iothread || !sq->db_addr || sq->ioeventfd) {
+        return;
+    }
+    if (event_notifier_init(&sq->notifier, 0)) {
+        return;
+    }
+
+    memory_region_add_eventfd(&n->iomem, 0x1000 + (sq->sqid << 3), 4, false,
+        0, &sq->notifier);
+    aio_context_acquire(ctx);
+    aio_set_event_notifier(ctx, &sq->notifier, true, nvme_sq_notifier);
+    aio_context_release(ctx);
+    sq->ioeventfd = 1;
+}
+
+static void nvme_free_sq_ioeventfd(NvmeCtrl *n, NvmeSQueue *sq)
+{
+    AioContext *ctx = nvme_queue_ctx(n, sq->sqid);
+
+    if (!sq->ioeventfd) {
+        return;
+    }
+
+    memory_region_del_eventfd(&n->iomem, 0x1000 + (sq->sqid << 3), 4, false,
+        0, &sq->notifier);
+    aio_context_acquire(ctx);
+    aio_set_event_notifier(ctx, &sq->notifier, true, NULL);
+    aio_context_release(ctx);
+    event_notifier_cleanup(&sq->notifier);
+    sq->ioeventfd = 0;
+}
+
 static void nvme_free_sq(NvmeSQueue *sq, NvmeCtrl *n)
 {
+    int i;
+
     n->sq[sq->sqid] = NULL;
-    timer_del(sq->timer);
-    timer_free(sq->timer);
+    nvme_free_sq_ioeventfd(n, sq);
+    qemu_bh_delete(sq->bh);
+    for (i = 0; i < sq->size; i++) {
+        qemu_iovec_destroy(&sq->io_req[i].iov);
+    }
     g_free(sq->io_req);
     if (sq->sqid) {
         g_free(sq);
@@ -349,14 +581,18 @@ static void nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
     QTAILQ_INIT(&sq->out_req_list);
     for (i = 0; i < sq->size; i++) {
         sq->io_req[i].sq = sq;
+        qemu_iovec_init(&sq->io_req[i].iov, 4);
         QTAILQ_INSERT_TAIL(&(sq->req_list), &sq->io_req[i], entry);
     }
-    sq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_process_sq, sq);
+    sq->bh = aio_bh_new(nvme_queue_ctx(n, sqid), nvme_process_sq, sq);
+    sq->db_addr = sq->ei_addr = 0;
+    sq->ioeventfd = 0;
 
     assert(n->cq[cqid]);
     cq = n->cq[cqid];
     QTAILQ_INSERT_TAIL(&(cq->sq_list), sq, entry);
     n->sq[sqid] = sq;
+    nvme_dbbuf_init_sq(n, sq);
 }
 
 static uint16_t nvme_create_sq(NvmeCtrl *n, NvmeCmd *cmd)
@@ -393,8 +629,10 @@ static uint16_t nvme_create_sq(NvmeCtrl *n, NvmeCmd *cmd)
 static void nvme_free_cq(NvmeCQueue *cq, NvmeCtrl *n)
 {
     n->cq[cq->cqid] = NULL;
-    timer_del(cq->timer);
-    timer_free(cq->timer);
+    qemu_bh_delete(cq->bh);
+    if (cq->irq_bh) {
+        qemu_bh_delete(cq->irq_bh);
+    }
     msix_vector_unuse(&n->parent_obj, cq->vector);
     if (cq->cqid) {
         g_free(cq);
@@ -434,7 +672,10 @@ static void nvme_init_cq(NvmeCQueue *cq, NvmeCtrl *n, uint64_t dma_addr,
     QTAILQ_INIT(&cq->sq_list);
     msix_vector_use(&n->parent_obj, cq->vector);
     n->cq[cqid] = cq;
-    cq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_post_cqes, cq);
+    cq->bh = aio_bh_new(nvme_queue_ctx(n, cqid), nvme_post_cqes, cq);
+    cq->irq_bh = (cqid && n->iothread) ? qemu_bh_new(nvme_irq_bh, cq) : NULL;
+    cq->db_addr = cq->ei_addr = 0;
+    nvme_dbbuf_init_cq(n, cq);
 }
 
 static uint16_t nvme_create_cq(NvmeCtrl *n, NvmeCmd *cmd)
@@ -575,6 +816,63 @@ static uint16_t nvme_set_feature(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
     return NVME_SUCCESS;
 }
 
+/*
+ * Shadow doorbells apply to the I/O queues, the admin queues use MMIO. The
+ * buffers are seeded with the current doorbell values, a queue that was
+ * in use before Doorbell Buffer Config would otherwise read its tail or
+ * head back as whatever the host left there.
+ */
+static void nvme_dbbuf_init_sq(NvmeCtrl *n, NvmeSQueue *sq)
+{
+    if (!n->dbbuf_dbs || !sq->sqid) {
+        return;
+    }
+    sq->db_addr = n->dbbuf_dbs + (sq->sqid << 3);
+    sq->ei_addr = n->dbbuf_eis + (sq->sqid << 3);
+    nvme_dbbuf_write(n, sq->db_addr, sq->tail);
+    nvme_dbbuf_write(n, sq->ei_addr, sq->tail);
+    nvme_init_sq_ioeventfd(n, sq);
+}
+
+static void nvme_dbbuf_init_cq(NvmeCtrl *n, NvmeCQueue *cq)
+{
+    if (!n->dbbuf_dbs || !cq->cqid) {
+        return;
+    }
+    cq->db_addr = n->dbbuf_dbs + (cq->cqid << 3) + 4;
+    cq->ei_addr = n->dbbuf_eis + (cq->cqid << 3) + 4;
+    nvme_dbbuf_write(n, cq->db_addr, cq->head);
+    nvme_dbbuf_write(n, cq->ei_addr, cq->head);
+}
+
+/*
+ * Doorbell Buffer Config: PRP1 is the shadow doorbell buffer and PRP2 the
+ * EventIdx buffer, both page aligned and laid out as the doorbell registers.
+ */
+static uint16_t nvme_dbbuf_config(NvmeCtrl *n, NvmeCmd *cmd)
+{
+    uint64_t dbs = le64_to_cpu(cmd->prp1);
+    uint64_t eis = le64_to_cpu(cmd->prp2);
+    int i;
+
+    if (!dbs || !eis || dbs & (n->page_size - 1) ||
+            eis & (n->page_size - 1)) {
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    n->dbbuf_dbs = dbs;
+    n->dbbuf_eis = eis;
+    for (i = 1; i < n->num_queues; i++) {
+        if (n->sq[i] != NULL) {
+            nvme_dbbuf_init_sq(n, n->sq[i]);
+        }
+        if (n->cq[i] != NULL) {
+            nvme_dbbuf_init_cq(n, n->cq[i]);
+        }
+    }
+    return NVME_SUCCESS;
+}
+
 static uint16_t nvme_admin_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
 {
     switch (cmd->opcode) {
@@ -592,6 +890,8 @@ static uint16_t nvme_admin_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
         return nvme_set_feature(n, cmd, req);
     case NVME_ADM_CMD_GET_FEATURES:
         return nvme_get_feature(n, cmd, req);
+    case NVME_ADM_CMD_DBBUF_CONFIG:
+        return nvme_dbbuf_config(n, cmd);
     default:
         return NVME_INVALID_OPCODE | NVME_DNR;
     }
@@ -608,30 +908,47 @@ static void nvme_process_sq(void *opaque)
     NvmeCmd cmd;
     NvmeRequest *req;
 
-    while (!(nvme_sq_empty(sq) || QTAILQ_EMPTY(&sq->req_list))) {
-        addr = sq->dma_addr + sq->head * n->sqe_size;
-        pci_dma_read(&n->parent_obj, addr, (void *)&cmd, sizeof(cmd));
-        nvme_inc_sq_head(sq);
-
-        req = QTAILQ_FIRST(&sq->req_list);
-        QTAILQ_REMOVE(&sq->req_list, req, entry);
-        QTAILQ_INSERT_TAIL(&sq->out_req_list, req, entry);
-        memset(&req->cqe, 0, sizeof(req->cqe));
-        req->cqe.cid = cmd.cid;
-
-        status = sq->sqid ? nvme_io_cmd(n, &cmd, req) :
-            nvme_admin_cmd(n, &cmd, req);
-        if (status != NVME_NO_COMPLETE) {
-            req->status = status;
-            nvme_enqueue_req_completion(cq, req);
+    nvme_sq_update_tail(sq);
+    do {
+        while (!(nvme_sq_empty(sq) || QTAILQ_EMPTY(&sq->req_list))) {
+            addr = sq->dma_addr + sq->head * n->sqe_size;
+            pci_dma_read(&n->parent_obj, addr, (void *)&cmd, sizeof(cmd));
+            nvme_inc_sq_head(sq);
+
+            req = QTAILQ_FIRST(&sq->req_list);
+            QTAILQ_REMOVE(&sq->req_list, req, entry);
+            QTAILQ_INSERT_TAIL(&sq->out_req_list, req, entry);
+            memset(&req->cqe, 0, sizeof(req->cqe));
+            req->cqe.cid = cmd.cid;
+
+            if (sq->sqid) {
+                status = nvme_io_cmd(n, &cmd, req);
+            } else {
+                nvme_io_lock(n);
+                status = nvme_admin_cmd(n, &cmd, req);
+                nvme_io_unlock(n);
+            }
+            if (status != NVME_NO_COMPLETE) {
+                req->status = status;
+                nvme_enqueue_req_completion(cq, req);
+            }
         }
-    }
+
+        /* Ask the host to ring for the next tail. The tail is read again in
+         * case it moved before the EventIdx was updated */
+        if (!sq->ei_addr) {
+            break;
+        }
+        nvme_dbbuf_write(n, sq->ei_addr, sq->tail);
+        smp_mb();
+    } while (nvme_sq_update_tail(sq));
 }
 
 static void nvme_clear_ctrl(NvmeCtrl *n)
 {
     int i;
 
+    nvme_io_lock(n);
     for (i = 0; i < n->num_queues; i++) {
         if (n->sq[i] != NULL) {
             nvme_free_sq(n->sq[i], n);
@@ -642,8 +959,10 @@ static void nvme_clear_ctrl(NvmeCtrl *n)
             nvme_free_cq(n->cq[i], n);
         }
     }
+    n->dbbuf_dbs = n->dbbuf_eis = 0;
 
     blk_flush(n->conf.blk);
+    nvme_io_unlock(n);
     n->bar.cc = 0;
 }
 
@@ -759,7 +1078,6 @@ static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
 
     if (((addr - 0x1000) >> 2) & 1) {
         uint16_t new_head = val & 0xffff;
-        int start_sqs;
         NvmeCQueue *cq;
 
         qid = (addr - (0x1000 + (1 << 2))) >> 3;
@@ -772,19 +1090,12 @@ static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
             return;
         }
 
-        start_sqs = nvme_cq_full(cq) ? 1 : 0;
-        cq->head = new_head;
-        if (start_sqs) {
-            NvmeSQueue *sq;
-            QTAILQ_FOREACH(sq, &cq->sq_list, entry) {
-                timer_mod(sq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
-            }
-            timer_mod(cq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
-        }
-
-        if (cq->tail != cq->head) {
-            nvme_isr_notify(n, cq);
+        /* The CQ owns tail and pending completions, it may be running in
+         * the IOThread. With shadow doorbells the head is read from there */
+        if (!cq->db_addr) {
+            atomic_set(&cq->head, new_head);
         }
+        qemu_bh_schedule(cq->bh);
     } else {
         uint16_t new_tail = val & 0xffff;
         NvmeSQueue *sq;
@@ -799,8 +1110,10 @@ static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
             return;
         }
 
-        sq->tail = new_tail;
-        timer_mod(sq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+        if (!sq->db_addr) {
+            atomic_set(&sq->tail, new_tail);
+        }
+        qemu_bh_schedule(sq->bh);
     }
 }
 
@@ -881,7 +1194,7 @@ static int nvme_init(PCIDevice *pci_dev)
     id->ieee[0] = 0x00;
     id->ieee[1] = 0x02;
     id->ieee[2] = 0xb3;
-    id->oacs = cpu_to_le16(0);
+    id->oacs = cpu_to_le16(NVME_OACS_DBBUF);
     id->frmw = 7 << 1;
     id->lpa = 1 << 0;
     id->sqes = (0x6 << 4) | 0x6;
@@ -919,6 +1232,11 @@ static int nvme_init(PCIDevice *pci_dev)
             cpu_to_le64(n->ns_size >>
                 id_ns->lbaf[NVME_ID_NS_FLBAS_INDEX(ns->id_ns.flbas)].ds);
     }
+
+    if (n->iothread) {
+        blk_set_aio_context(n->conf.blk,
+            iothread_get_aio_context(n->iothread));
+    }
     return 0;
 }
 
@@ -927,6 +1245,11 @@ static void nvme_exit(PCIDevice *pci_dev)
     NvmeCtrl *n = NVME(pci_dev);
 
     nvme_clear_ctrl(n);
+    if (n->iothread) {
+        nvme_io_lock(n);
+        blk_set_aio_context(n->conf.blk, qemu_get_aio_context());
+        nvme_io_unlock(n);
+    }
     g_free(n->namespaces);
     g_free(n->cq);
     g_free(n->sq);
@@ -967,6 +1290,10 @@ static void nvme_instance_init(Object *obj)
 {
     NvmeCtrl *s = NVME(obj);
 
+    object_property_add_link(obj, "iothread", TYPE_IOTHREAD,
+                             (Object **)&s->iothread,
+                             qdev_prop_allow_set_link_before_realize,
+                             OBJ_PROP_LINK_UNREF_ON_RELEASE, NULL);
     device_add_bootindex_property(obj, &s->conf.bootindex,
                                   "bootindex", "/namespace@1,0",
                                   DEVICE(obj), &error_abort);
@@ -12,7 +12,8 @@ enum cmdtypes {
     CMDARG_START = 1,
     CMDARG_TEST,
     CMDARG_DEBUG,
-    CMDARG_ADMIN
+    CMDARG_ADMIN,
+    CMDARG_BENCH
 };
 
 static char doc_global[] = "\n*** OX Controller " OX_VER " - " LABEL " ***\n"
@@ -22,6 +23,7 @@ static char doc_global[] = "\n*** OX Controller " OX_VER " - " LABEL " ***\n"
         "  debug            Start controller and print Admin/IO commands\n"
         "  test             Start controller, run tests and close\n"
         "  admin            Execute specific tasks within the controller\n"
+        "  bench            Start controller, run a load generator and close\n"
         " \n Initial release developed by Ivan L. Picoli <ivpi@itu.dk>\n\n";
 
 static char doc_test[] =
@@ -45,6 +47,19 @@ static char doc_admin[] =
         "\n  Run a specific admin task:"
         "\n    ox-ctrl admin -t <task_name>";
 
+static char doc_bench[] =
+        "\nUse this command to measure the controller without a host, it will"
+        " start the controller, submit I/Os from internal threads, print IOPS,"
+        " bandwidth, WAF and latency percentiles and close the controller.\n"
+        "\n The 'ftl' level submits LBA I/Os to the FTL (AppNVM mode), the"
+        " 'mmgr' level submits page I/Os to the media manager and WRITES"
+        " OVER the last blocks of each LUN.\n"
+        "\n Examples:"
+        "\n  Random 16 KB reads and writes (70/30), 4 jobs, QD 32:"
+        "\n    ox-ctrl bench --pattern=rand --read=70 --bs=16k --qd=32 -j 4\n"
+        "\n  Sequential page writes to the media manager for 30 seconds:"
+        "\n    ox-ctrl bench --level=mmgr --read=0 --time=30";
+
 static struct argp_option opt_test[] = {
     {"list", 'l', "list", OPTION_ARG_OPTIONAL,"Show available tests."},
     {"all", 'a', "run_all", OPTION_ARG_OPTIONAL, "Use to run all tests."},
@@ -59,6 +74,39 @@ static struct argp_option opt_admin[] = {
     {0}
 };
 
+static struct argp_option opt_bench[] = {
+    {"level", 'L', "ftl|mmgr", 0, "I/O submission level. Default: ftl"},
+    {"pattern", 'p', "seq|rand", 0, "I/O offsets. Default: seq"},
+    {"read", 'r', "0-100", 0, "Percentage of reads. Default: 100"},
+    {"bs", 'b', "bytes", 0, "I/O size (k/m suffix), FTL level. Default: 4k"},
+    {"qd", 'q', "depth", 0, "Outstanding I/Os per job. Default: 16"},
+    {"jobs", 'j', "jobs", 0, "Submitter threads. Default: 1"},
+    {"time", 't', "sec", 0, "Run time in seconds. Default: 10"},
+    {"size", 's', "bytes", 0, "Range used by all jobs (k/m/g suffix). "
+                                                      "Default: 256m"},
+    {0}
+};
+
+static uint64_t parse_size (const char *arg)
+{
+    char *end;
+    uint64_t val = strtoull (arg, &end, 10);
+
+    switch (*end) {
+        case 'g': case 'G':
+            val <<= 10;
+            /* fall through */
+        case 'm': case 'M':
+            val <<= 10;
+            /* fall through */
+        case 'k': case 'K':
+            val <<= 10;
+            end++;
+    }
+
+    return (*end) ? 0 : val;
+}
+
 static error_t parse_opt_test(int key, char *arg, struct argp_state *state)
 {
     struct nvm_init_arg *args = state->input;
@@ -145,6 +193,87 @@ static error_t parse_opt_admin(int key, char *arg, struct argp_state *state)
     return 0;
 }
 
+static error_t parse_opt_bench(int key, char *arg, struct argp_state *state)
+{
+    struct nvm_init_arg *args = state->input;
+    uint64_t val;
+
+    switch (key) {
+        case 'L':
+            if (strcmp(arg, "ftl") == 0)
+                args->bench_level = BENCH_LEVEL_FTL;
+            else if (strcmp(arg, "mmgr") == 0)
+                args->bench_level = BENCH_LEVEL_MMGR;
+            else
+                argp_usage(state);
+            break;
+        case 'p':
+            if (strcmp(arg, "seq") == 0)
+                args->bench_rand = 0;
+            else if (strcmp(arg, "rand") == 0)
+                args->bench_rand = 1;
+            else
+                argp_usage(state);
+            break;
+        case 'r':
+            val = strtoul(arg, NULL, 10);
+            if (val > 100)
+                argp_usage(state);
+            args->bench_read = val;
+            break;
+        case 'b':
+            val = parse_size(arg);
+            if (!val || val > UINT32_MAX)
+                argp_usage(state);
+            args->bench_bs = val;
+            break;
+        case 'q':
+            val = strtoul(arg, NULL, 10);
+            if (!val || val > UINT16_MAX)
+                argp_usage(state);
+            args->bench_qd = val;
+            break;
+        case 'j':
+            val = strtoul(arg, NULL, 10);
+            if (!val || val > UINT16_MAX)
+                argp_usage(state);
+            args->bench_jobs = val;
+            break;
+        case 't':
+            val = strtoul(arg, NULL, 10);
+            if (!val || val > UINT32_MAX)
+                argp_usage(state);
+            args->bench_time = val;
+            break;
+        case 's':
+            val = parse_size(arg);
+            if (!val)
+                argp_usage(state);
+            args->bench_size = val;
+            break;
+        case ARGP_KEY_INIT:
+            args->bench_level = BENCH_LEVEL_FTL;
+            args->bench_read = 100;
+            args->bench_bs = 4096;
+            args->bench_qd = 16;
+            args->bench_jobs = 1;
+            args->bench_time = 10;
+            args->bench_size = 256 * 1024 * 1024;
+            break;
+        case ARGP_KEY_ARG:
+        case ARGP_KEY_NO_ARGS:
+        case ARGP_KEY_END:
+        case ARGP_KEY_ERROR:
+        case ARGP_KEY_SUCCESS:
+        case ARGP_KEY_FINI:
+            break;
+        default:
+            return ARGP_ERR_UNKNOWN;
+    }
+
+    return 0;
+}
+
 static void cmd_prepare(struct argp_state *state, struct nvm_init_arg *args,
                                         const char *cmd, struct argp *argp_cmd)
 {
@@ -168,6 +297,7 @@ static void cmd_prepare(struct argp_state *state, struct nvm_init_arg *args,
 
 static struct argp argp_test = {opt_test, parse_opt_test, 0, doc_test};
 static struct argp argp_admin = {opt_admin, parse_opt_admin, 0, doc_admin};
+static struct argp argp_bench = {opt_bench, parse_opt_bench, 0, doc_bench};
 
 static error_t parse_opt (int key, char *arg, struct argp_state *state)
 {
@@ -186,6 +316,9 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state)
             } else if (strcmp(arg, "admin") == 0){
                 args->cmdtype = CMDARG_ADMIN;
                 cmd_prepare(state, args, "admin", &argp_admin);
+            } else if (strcmp(arg, "bench") == 0){
+                args->cmdtype = CMDARG_BENCH;
+                cmd_prepare(state, args, "bench", &argp_bench);
             }
             break;
         default:
@@ -219,6 +352,9 @@ int cmdarg_init (int argc, char **argv)
         case CMDARG_ADMIN:
             ret = nvm_admin_unit(core.args_global);
             return (!ret) ? OX_ADMIN_MODE : -1;
+        case CMDARG_BENCH:
+            ret = nvm_bench_unit(core.args_global);
+            return (!ret) ? OX_BENCH_MODE : -1;
         default:
             printf("Invalid command, please use --help to see more info.\n");
     }
@@ -45,12 +45,15 @@
 #include <mqueue.h>
 #include <pthread.h>
 #include <signal.h>
-#include <setjmp.h>
 #include <argp.h>
 #include <time.h>
 #include "hw/block/ox-ctrl/include/ssd.h"
 #include "hw/block/ox-ctrl/include/ox-mq.h"
 #include "hw/block/ox-ctrl/include/uatomic.h"
+#include "hw/block/ox-ctrl/include/ox-prot.h"
+#include "hw/block/ox-ctrl/include/ox-pcache.h"
+#include "hw/block/ox-ctrl/include/ox-fabrics.h"
+#include "hw/block/ox-ctrl/include/ox-stats.h"
 #include "hw/pci/pci.h"
 
 LIST_HEAD(mmgr_list, nvm_mmgr) mmgr_head = LIST_HEAD_INITIALIZER(mmgr_head);
@@ -169,6 +172,79 @@ int nvm_register_mmgr (struct nvm_mmgr *mmgr)
     return 0;
 }
 
+struct nvm_flush {
+    nvm_flush_fn                *fn;
+    void                        *arg;
+    u_atomic_t                  pending;
+    uint8_t                     failed;
+    struct nvm_mmgr_flush_cmd   cmd[];
+};
+
+static void nvm_flush_put (struct nvm_flush *flush)
+{
+    if (!u_atomic_dec_and_test(&flush->pending))
+        return;
+
+    flush->fn (flush->arg, (flush->failed) ? -1 : 0);
+    free (flush);
+}
+
+void nvm_flush_callback (struct nvm_mmgr_flush_cmd *cmd)
+{
+    struct nvm_flush *flush = (struct nvm_flush *) cmd->opaque;
+
+    if (cmd->status != NVM_IO_SUCCESS) {
+        log_err (" [nvm: Flush FAILED. mmgr: %s]\n", cmd->mmgr->name);
+        flush->failed = 1;
+    }
+
+    nvm_flush_put (flush);
+}
+
+/*
+ * Flushes all the media managers, fn is called when the writes completed
+ * before this call are durable. Media managers without flush are skipped.
+ */
+int nvm_flush (nvm_flush_fn *fn, void *arg)
+{
+    struct nvm_flush *flush;
+    struct nvm_mmgr *mmgr;
+    struct nvm_mmgr_flush_cmd *cmd;
+    int i = 0;
+
+    flush = malloc (sizeof (struct nvm_flush) +
+                        sizeof (struct nvm_mmgr_flush_cmd) * core.mmgr_count);
+    if (!flush)
+        return -1;
+
+    flush->fn = fn;
+    flush->arg = arg;
+    flush->failed = 0;
+
+    /* Reference held until all the flushes are submitted */
+    u_atomic_set(&flush->pending, 1);
+
+    LIST_FOREACH(mmgr, &mmgr_head, entry){
+        if (!mmgr->ops->flush)
+            continue;
+
+        cmd = &flush->cmd[i++];
+        cmd->mmgr = mmgr;
+        cmd->status = NVM_IO_NEW;
+        cmd->opaque = flush;
+
+        u_atomic_inc(&flush->pending);
+        if (mmgr->ops->flush (cmd)) {
+            cmd->status = NVM_IO_FAIL;
+            nvm_flush_callback (cmd);
+        }
+    }
+
+    nvm_flush_put (flush);
+
+    return 0;
+}
+
 static struct nvm_ftl *nvm_get_ftl_instance(uint16_t ftl_id)
 {
     struct nvm_ftl *ftl;
@@ -180,32 +256,33 @@ static struct nvm_ftl *nvm_get_ftl_instance(uint16_t ftl_id)
     return NULL;
 }
 
-static uint16_t nvm_ftl_q_schedule (struct nvm_ftl *ftl,
+static uint16_t nvm_ftl_q_schedule (struct nvm_namespace *ns,
                                       struct nvm_io_cmd *cmd, uint8_t multi_ch)
 {
+    struct nvm_ftl *ftl = ns->ftl;
     uint16_t qid;
 
     /* Separate writes and reads in different queues for AppNVM FTL */
     if (ftl->ftl_id == FTL_ID_APPNVM) {
         qid = (cmd->cmdtype == MMGR_WRITE_PG) ? 0 : 1;
 
-        ftl->next_queue[qid] = (ftl->next_queue[qid] + 1 == ftl->nq / 2) ?
-                                                  0 : ftl->next_queue[qid] + 1;
+        ns->next_queue[qid] = (ns->next_queue[qid] + 1 == ftl->nq / 2) ?
+                                                   0 : ns->next_queue[qid] + 1;
 
-        return ftl->next_queue[qid] + (qid * (ftl->nq / 2));
+        return ns->next_queue[qid] + (qid * (ftl->nq / 2));
     }
 
     if (!multi_ch)
-        return cmd->channel[0]->ch_id % ftl->nq;
+        return (cmd->channel[0]->ch_id - ns->ch_first) % ftl->nq;
     else {
-        qid = ftl->next_queue[0];
-        ftl->next_queue[0] = (ftl->next_queue[0] + 1 == ftl->nq) ?
-                                                    0 : ftl->next_queue[0] + 1;
+        qid = ns->next_queue[0];
+        ns->next_queue[0] = (ns->next_queue[0] + 1 == ftl->nq) ?
+                                                     0 : ns->next_queue[0] + 1;
         return qid;
     }
 }
 
-static void nvm_complete_to_host (struct nvm_io_cmd *cmd)
+static NvmeRequest *nvm_set_host_status (struct nvm_io_cmd *cmd)
 {
     NvmeRequest *req = (NvmeRequest *) cmd->req;
 
@@ -217,45 +294,58 @@ static void nvm_complete_to_host (struct nvm_io_cmd *cmd)
         printf(" [NVMe cmd 0x%x. cid: %d completed. Status: %x]\n",
                                    req->cmd.opcode, req->cmd.cid, req->status);
 
+    return req;
+}
+
+static void nvm_complete_to_host (struct nvm_io_cmd *cmd)
+{
+    NvmeRequest *req = nvm_set_host_status (cmd);
+
     ((core.run_flag & RUN_TESTS) && core.tests_init->complete_io) ?
         core.tests_init->complete_io(req) : nvme_rw_cb(req);
 }
 
 void nvm_complete_ftl (struct nvm_io_cmd *cmd)
 {
-    int retry, ret;
     struct ox_mq_entry *req = (struct ox_mq_entry *) cmd->mq_req;
 
-    retry = NVM_QUEUE_RETRY;
-    do {
-        ret = ox_mq_complete_req(cmd->channel[0]->ftl->mq, req);
-        if (ret) {
-            retry--;
-            usleep (NVM_QUEUE_RETRY_SLEEP);
-        }
-    } while (ret && retry);
+    cmd->lat.tdone = ox_lat_now ();
+    ox_lat_record (OX_LAT_FTL, cmd->cmdtype, cmd->lat.ch, cmd->cid,
+                                               cmd->lat.tftl, cmd->lat.tdone);
+
+    if (ox_mq_complete_req_wait (cmd->channel[0]->ns->mq, req,
+                                        NVM_QUEUE_WAIT_USEC) == OX_MQ_CQ_FULL)
+        log_err ("[nvm: FTL CQ full, cmd %lu not completed.]\n", cmd->cid);
 }
 
 static void nvm_ftl_process_sq (struct ox_mq_entry *req)
 {
     struct nvm_io_cmd *cmd = (struct nvm_io_cmd *) req->opaque;
     struct nvm_ftl *ftl = cmd->channel[0]->ftl;
-    int ret, retry;
+    int ret;
+    uint64_t wait = 1, waited = 0;
 
     cmd->mq_req = (void *) req;
 
-    retry = NVM_QUEUE_RETRY;
+    cmd->lat.tftl = ox_lat_now ();
+    ox_lat_record (OX_LAT_FTL_WAIT, cmd->cmdtype, cmd->lat.ch, cmd->cid,
+                                              cmd->lat.tsubmit, cmd->lat.tftl);
+
+    /* Queues inside the FTL and the media manager wait for room by
+     * themselves, a failed submission means the FTL has no resources for
+     * now. Back off exponentially, a short stall costs a few microseconds */
     do {
         ret = ftl->ops->submit_io(cmd);
         if (ret) {
-            retry--;
-            usleep (NVM_QUEUE_RETRY_SLEEP);
-            if (retry) {
-                cmd->status.nvme_status = NVME_SUCCESS;
-                cmd->status.status = NVM_IO_PROCESS;
-            }
+            if (waited >= NVM_QUEUE_WAIT_USEC)
+                break;
+            usleep (wait);
+            waited += wait;
+            wait = MIN(wait << 1, NVM_QUEUE_RETRY_SLEEP);
+            cmd->status.nvme_status = NVME_SUCCESS;
+            cmd->status.status = NVM_IO_PROCESS;
         }
-    } while (ret && retry);
+    } while (ret);
 
     if (ret) {
         if (core.debug)
@@ -272,6 +362,24 @@ static void nvm_ftl_process_cq (void *opaque)
     nvm_complete_to_host (cmd);
 }
 
+/* Posts a batch of CQEs, each NVMe CQ is notified once per batch */
+static void nvm_ftl_process_cq_batch (void **opaque, int counter)
+{
+    NvmeRequest *req[OX_MQ_MAX_BATCH];
+    int i;
+
+    if ((core.run_flag & RUN_TESTS) && core.tests_init->complete_io) {
+        for (i = 0; i < counter; i++)
+            nvm_complete_to_host ((struct nvm_io_cmd *) opaque[i]);
+        return;
+    }
+
+    for (i = 0; i < counter; i++)
+        req[i] = nvm_set_host_status ((struct nvm_io_cmd *) opaque[i]);
+
+    nvme_enqueue_req_completion_batch (req, counter);
+}
+
 static void nvm_ftl_process_to (void **opaque, int counter)
 {
     struct nvm_io_cmd *cmd;
@@ -284,30 +392,59 @@ static void nvm_ftl_process_to (void **opaque, int counter)
     }
 }
 
-int nvm_register_ftl (struct nvm_ftl *ftl)
+/*
+ * FTL queues of a namespace. Queue threads are pinned to the cpu list given
+ * to the device, queues of all namespaces follow each other in the list.
+ */
+static int nvm_ns_mq_init (struct nvm_namespace *ns, uint16_t ns_i)
 {
     struct ox_mq_config mq_config;
+    cpu_set_t *cpus = NULL;
+    uint16_t nq = ns->ftl->nq;
+
+    if (core.qemu && core.qemu->ftl_cpus) {
+        cpus = malloc (sizeof (cpu_set_t) * nq * (ns_i + 1));
+        if (cpus && ox_mq_parse_cpus (core.qemu->ftl_cpus, cpus,
+                                                        nq * (ns_i + 1)) < 0) {
+            log_err ("[ox: Invalid ftl_cpus list: %s]\n", core.qemu->ftl_cpus);
+            free (cpus);
+            cpus = NULL;
+        }
+    }
 
-    if (strlen(ftl->name) > MAX_NAME_SIZE)
-        return EMAX_NAME_SIZE;
-
-    /* Start FTL multi-queue */
-    sprintf(mq_config.name, "%s", ftl->name);
-    mq_config.n_queues = ftl->nq;
+    memset (&mq_config, 0, sizeof (struct ox_mq_config));
+    sprintf(mq_config.name, "%s-ns%d", ns->ftl->name, ns->nsid);
+    mq_config.n_queues = nq;
     mq_config.q_size = NVM_FTL_QUEUE_SIZE;
     mq_config.sq_fn = nvm_ftl_process_sq;
     mq_config.cq_fn = nvm_ftl_process_cq;
+    mq_config.cq_batch_fn = nvm_ftl_process_cq_batch;
+    mq_config.batch = NVM_FTL_QUEUE_BATCH;
     mq_config.to_fn = nvm_ftl_process_to;
     mq_config.to_usec = NVM_FTL_QUEUE_TO;
     mq_config.flags = OX_MQ_TO_COMPLETE;
-    ftl->mq = ox_mq_init(&mq_config);
-    if (!ftl->mq)
+    if (core.qemu && core.qemu->ftl_poll_usec) {
+        mq_config.flags |= OX_MQ_POLL;
+        mq_config.poll_usec = core.qemu->ftl_poll_usec;
+    }
+    mq_config.cpus = (cpus) ? cpus + nq * ns_i : NULL;
+    ns->mq = ox_mq_init(&mq_config);
+    free (cpus);
+    if (!ns->mq)
         return -1;
 
-    ftl->next_queue[0] = 0;
-    ftl->next_queue[1] = 0;
+    ns->next_queue[0] = 0;
+    ns->next_queue[1] = 0;
 
-    core.ftl_q_count += ftl->nq;
+    core.ftl_q_count += nq;
+
+    return 0;
+}
+
+int nvm_register_ftl (struct nvm_ftl *ftl)
+{
+    if (strlen(ftl->name) > MAX_NAME_SIZE)
+        return EMAX_NAME_SIZE;
 
     LIST_INSERT_HEAD(&ftl_head, ftl, entry);
     core.ftl_count++;
@@ -319,7 +456,7 @@ int nvm_register_ftl (struct nvm_ftl *ftl)
         log_info("    [%s cap: Set Bad Block Table]\n", ftl->name);
     if (ftl->cap & 1 << FTL_CAP_GET_L2PTBL)
         log_info("    [%s cap: Get Logical to Physical Table]\n", ftl->name);
-    if (ftl->cap & 1 << FTL_CAP_GET_L2PTBL)
+    if (ftl->cap & 1 << FTL_CAP_SET_L2PTBL)
         log_info("    [%s cap: Set Logical to Physical Table]\n", ftl->name);
     if (ftl->cap & 1 << FTL_CAP_INIT_FN)
         log_info("    [%s cap: Application Function Init]\n", ftl->name);
@@ -332,6 +469,22 @@ int nvm_register_ftl (struct nvm_ftl *ftl)
     return 0;
 }
 
+/* Media manager queue and media time, if the mmgr does not tell when it
+ * took the command, all the time is media time */
+static void nvm_mmgr_lat_record (struct nvm_mmgr_io_cmd *cmd)
+{
+    uint64_t cid = (!cmd->sync_count && cmd->nvm_io) ? cmd->nvm_io->cid : 0;
+    uint64_t tmedia = cmd->tstart;
+
+    if (cmd->tdispatch >= cmd->tstart && cmd->tdispatch <= cmd->tend) {
+        ox_lat_record (OX_LAT_MMGR_WAIT, cmd->cmdtype, cmd->ppa.g.ch, cid,
+                                                  cmd->tstart, cmd->tdispatch);
+        tmedia = cmd->tdispatch;
+    }
+    ox_lat_record (OX_LAT_MEDIA, cmd->cmdtype, cmd->ppa.g.ch, cid, tmedia,
+                                                                    cmd->tend);
+}
+
 static void nvm_debug_print_mmgr_io (struct nvm_mmgr_io_cmd *cmd)
 {
     printf (" [IO CALLBK. CMD 0x%x. mmgr_ch: %d, lun: %d, blk: %d, pl: %d, "
@@ -339,16 +492,49 @@ static void nvm_debug_print_mmgr_io (struct nvm_mmgr_io_cmd *cmd)
                       cmd->ppa.g.blk, cmd->ppa.g.pl, cmd->ppa.g.pg);
 }
 
+/*
+ * Media manager commands are tagged when submitted and the tag is taken by
+ * the completion. A completion of a command that is not in flight (NULL,
+ * completed twice or never submitted) is dropped.
+ */
+static uint32_t nvm_mmgr_tag_next;
+static uint64_t nvm_mmgr_stale;
+
+static inline void nvm_mmgr_tag (struct nvm_mmgr_io_cmd *cmd)
+{
+    uint32_t tag;
+
+    do {
+        tag = __atomic_add_fetch (&nvm_mmgr_tag_next, 1, __ATOMIC_RELAXED);
+    } while (!tag);
+
+    __atomic_store_n (&cmd->tag, tag, __ATOMIC_RELEASE);
+}
+
 void nvm_callback (struct nvm_mmgr_io_cmd *cmd)
 {
-    if (nvm_memcheck(cmd))
+    if (!cmd || !__atomic_exchange_n (&cmd->tag, 0, __ATOMIC_ACQ_REL)) {
+        if (!(__atomic_fetch_add (&nvm_mmgr_stale, 1, __ATOMIC_RELAXED) %
+                                                                    1000))
+            log_err ("[nvm: Stale media manager completion dropped.]\n");
         return;
+    }
 
-    gettimeofday(&cmd->tend,NULL);
+    cmd->tend = ox_lat_now ();
+    nvm_mmgr_lat_record (cmd);
 
     if (core.debug)
         nvm_debug_print_mmgr_io (cmd);
 
+    if (cmd->status == NVM_IO_SUCCESS && ox_prot_read (cmd))
+        cmd->status = NVM_IO_FAIL;
+
+    if (cmd->status == NVM_IO_SUCCESS)
+        ox_stats_mmgr_io (cmd);
+
+    if (cmd->sync_count)
+        ox_pcache_fill (cmd);
+
     if (cmd->status != NVM_IO_SUCCESS)
         log_err (" [FAILED 0x%x CMD. mmgr_ch: %d, lun: %d, blk: %d, pl: %d, "
                 "pg: %d]\n", cmd->cmdtype, cmd->ppa.g.ch, cmd->ppa.g.lun,
@@ -365,11 +551,22 @@ void nvm_callback (struct nvm_mmgr_io_cmd *cmd)
     }
 }
 
+/* Namespace of a NVMe nsid, 0 is the first namespace */
+struct nvm_namespace *nvm_get_ns (uint32_t nsid)
+{
+    if (!core.nvm_ns || nsid > core.nvm_ns_count)
+        return NULL;
+
+    return &core.nvm_ns[(nsid) ? nsid - 1 : 0];
+}
+
 int nvm_submit_ftl (struct nvm_io_cmd *cmd)
 {
-    struct nvm_ftl *ftl;
-    int ret, retry, qid, i;
+    struct nvm_namespace *ns;
+    int ret, qid, i;
     uint8_t ch_ppa[core.nvm_ch_count];
+    uint64_t tfetch, cid, off, stripe;
+    uint8_t cmdtype;
 
     uint8_t multi_ch = 0;
     NvmeRequest *req = (NvmeRequest *) cmd->req;
@@ -395,15 +592,17 @@ int nvm_submit_ftl (struct nvm_io_cmd *cmd)
             return NVME_CMD_ABORT_REQ;
     }
 
+    ns = nvm_get_ns (cmd->nsid);
+    if (!ns)
+        goto CH_ERR;
+
     if (core.lnvm) {
 
         /*For now, the host ppa channel must be aligned with core.nvm_ch[] */
-        /*All PPAs in the vector must address channels managed by the same FTL*/
+        /*All PPAs in the vector must address channels of the namespace */
         if (cmd->ppalist[0].g.ch >= core.nvm_ch_count)
             goto CH_ERR;
 
-        ftl = core.nvm_ch[cmd->ppalist[0].g.ch]->ftl;
-
         memset (ch_ppa, 0, sizeof (uint8_t) * core.nvm_ch_count);
 
         /* Per PPA checking */
@@ -416,7 +615,7 @@ int nvm_submit_ftl (struct nvm_io_cmd *cmd)
             if (!multi_ch && cmd->ppalist[i].g.ch != cmd->ppalist[0].g.ch)
                 multi_ch++;
 
-            if (core.nvm_ch[cmd->ppalist[i].g.ch]->ftl != ftl)
+            if (core.nvm_ch[cmd->ppalist[i].g.ch]->ns != ns)
                 goto FTL_ERR;
 
             /* Set channel per PPA */
@@ -425,46 +624,61 @@ int nvm_submit_ftl (struct nvm_io_cmd *cmd)
 
     } else {
 
-        /* For now all channels must be included in the global namespace */
-        if ((cmd->slba > (core.nvm_ns_size / cmd->sec_sz)) ||
-                (cmd->slba + (cmd->sec_sz * cmd->n_sec) > core.nvm_ns_size)) {
+        /* LBAs are already in the device space, see nvme_rw */
+        off = cmd->slba * cmd->sec_sz;
+        if (off < ns->slba ||
+                        off + (uint64_t) cmd->sec_sz * cmd->n_sec >
+                        ns->slba + ns->size) {
             syslog(LOG_INFO,"[nvm: IO out of bounds.]\n");
             req->status = NVME_LBA_RANGE;
             nvm_complete_to_host(cmd);
             return NVME_LBA_RANGE;
         }
 
-        cmd->channel[0] = core.nvm_ch[cmd->slba /
-                                       (core.nvm_ns_size / core.nvm_ch_count)];
-        multi_ch++;
-
-        ftl = nvm_get_ftl_instance(core.std_ftl);
+        /* LBAs are striped over the channels, as the FTL lays out sequential
+         * writes. The channel sets the FTL queue and the latency records, the
+         * FTL splits the command and completes it when all parts are done */
+        off -= ns->slba;
+        stripe = off / ns->stripe_sz;
+        cmd->channel[0] = core.nvm_ch[ns->ch_first + stripe % ns->nch];
+        if ((off + (uint64_t) cmd->sec_sz * cmd->n_sec - 1) / ns->stripe_sz !=
+                                                                        stripe)
+            multi_ch++;
 
     }
 
     cmd->status.status = NVM_IO_PROCESS;
-    retry = NVM_QUEUE_RETRY;
 
-    qid = nvm_ftl_q_schedule (ftl, cmd, multi_ch);
-    do {
-        ret = ox_mq_submit_req(ftl->mq, qid, cmd);
+    /* The command may be completed before the submission returns */
+    cmd->lat.ch = cmd->channel[0]->ch_id;
+    cmd->lat.tsubmit = ox_lat_now ();
+    tfetch = cmd->lat.tfetch;
+    cid = cmd->cid;
+    cmdtype = cmd->cmdtype;
+
+    /* A full FTL queue never blocks the NVMe queue processing, the command
+     * is reset to NVM_IO_NEW and the caller submits it again later */
+    qid = nvm_ftl_q_schedule (ns, cmd, multi_ch);
+    ret = ox_mq_submit_req(ns->mq, qid, cmd);
+    if (ret) {
+        cmd->status.status = NVM_IO_NEW;
+        return NVME_QUEUE_FULL;
+    }
 
-        if (ret) {
-            retry--;
-            usleep (NVM_QUEUE_RETRY_SLEEP);
-        }
-        else if (core.debug) {
-            printf(" CMD cid: %lu, type: 0x%x submitted to FTL. "
+    ox_lat_record (OX_LAT_FETCH, cmdtype, cmd->lat.ch, cid, tfetch,
+                                                             cmd->lat.tsubmit);
+
+    if (core.debug) {
+        printf(" CMD cid: %lu, type: 0x%x submitted to FTL. "
                                "FTL queue: %d\n", cmd->cid, cmd->cmdtype, qid);
-            if (core.lnvm) {
-                for (i = 0; i < core.nvm_ch_count; i++)
-                    if (ch_ppa[i] > 0)
-                        printf("  Channel: %d, PPAs: %d\n", i, ch_ppa[i]);
-            }
+        if (core.lnvm) {
+            for (i = 0; i < core.nvm_ch_count; i++)
+                if (ch_ppa[i] > 0)
+                    printf("  Channel: %d, PPAs: %d\n", i, ch_ppa[i]);
         }
-    } while (ret && retry);
+    }
 
-    return (retry) ? NVME_NO_COMPLETE : NVME_CMD_ABORT_REQ;
+    return NVME_NO_COMPLETE;
 
 CH_ERR:
     syslog(LOG_INFO,"[nvm ERROR: IO failed, channel not found.]\n");
@@ -473,7 +687,7 @@ CH_ERR:
     return NVME_CMD_ABORT_REQ;
 
 FTL_ERR:
-    syslog(LOG_INFO,"[nvm ERROR: IO failed, channels do not match FTL.]\n");
+    syslog(LOG_INFO,"[nvm ERROR: IO failed, channels out of namespace.]\n");
     req->status = NVME_INVALID_FIELD;
     nvm_complete_to_host(cmd);
     return NVME_INVALID_FIELD;
@@ -501,23 +715,124 @@ int nvm_dma (void *ptr, uint64_t prp, ssize_t size, uint8_t direction)
     return 0;
 }
 
+/*
+ * Returns a pointer to 'size' bytes at 'prp' that the media manager can copy
+ * to/from directly, or NULL if the caller must use nvm_dma. Sync directions
+ * carry controller pointers, they are returned as they are.
+ */
+void *nvm_dma_map (uint64_t prp, ssize_t size, uint8_t direction)
+{
+    if (!size || !prp)
+        return NULL;
+
+    switch (direction) {
+        case NVM_DMA_TO_HOST:
+            return nvme_map_host(prp, size, 1);
+        case NVM_DMA_FROM_HOST:
+            return nvme_map_host(prp, size, 0);
+        case NVM_DMA_SYNC_READ:
+        case NVM_DMA_SYNC_WRITE:
+            return (void *) prp;
+        default:
+            return NULL;
+    }
+}
+
+void nvm_dma_unmap (void *ptr, ssize_t size, uint8_t direction)
+{
+    if (!ptr)
+        return;
+
+    switch (direction) {
+        case NVM_DMA_TO_HOST:
+            nvme_unmap_host(ptr, size, 1);
+            break;
+        case NVM_DMA_FROM_HOST:
+            nvme_unmap_host(ptr, size, 0);
+            break;
+    }
+}
+
 int nvm_submit_mmgr (struct nvm_mmgr_io_cmd *cmd)
 {
-    gettimeofday(&cmd->tstart,NULL);
+    cmd->tstart = ox_lat_now ();
+    cmd->tdispatch = 0;
     cmd->cmdtype = cmd->nvm_io->cmdtype;
+    nvm_mmgr_tag (cmd);
 
     switch (cmd->nvm_io->cmdtype) {
         case MMGR_WRITE_PG:
+            ox_pcache_inval (cmd);
+            ox_prot_write (cmd);
             return cmd->ch->mmgr->ops->write_pg(cmd);
         case MMGR_READ_PG:
             return cmd->ch->mmgr->ops->read_pg(cmd);
         case MMGR_ERASE_BLK:
+            ox_pcache_inval (cmd);
             return cmd->ch->mmgr->ops->erase_blk(cmd);
         default:
             return -1;
     }
 }
 
+/*
+ * Completion counters of synchronous I/Os. Released contexts are kept in a
+ * free list, the sync paths do not allocate and initialize a mutex per I/O.
+ * A context of a timed out I/O is never released, late completions may still
+ * take it.
+ */
+struct nvm_sync_ctx {
+    u_atomic_t              count;  /* first, cmd->sync_count points here */
+    pthread_mutex_t         mutex;
+    struct nvm_sync_ctx     *next;
+};
+
+static struct nvm_sync_ctx *sync_ctx_free;
+static pthread_mutex_t      sync_ctx_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static struct nvm_sync_ctx *nvm_sync_ctx_get (void)
+{
+    struct nvm_sync_ctx *ctx;
+
+    pthread_mutex_lock (&sync_ctx_mutex);
+    ctx = sync_ctx_free;
+    if (ctx)
+        sync_ctx_free = ctx->next;
+    pthread_mutex_unlock (&sync_ctx_mutex);
+
+    if (!ctx) {
+        ctx = malloc (sizeof (struct nvm_sync_ctx));
+        if (!ctx)
+            return NULL;
+        pthread_mutex_init (&ctx->mutex, NULL);
+    }
+    ctx->count.counter = U_ATOMIC_INIT_RUNTIME(0);
+
+    return ctx;
+}
+
+static void nvm_sync_ctx_put (struct nvm_sync_ctx *ctx)
+{
+    pthread_mutex_lock (&sync_ctx_mutex);
+    ctx->next = sync_ctx_free;
+    sync_ctx_free = ctx;
+    pthread_mutex_unlock (&sync_ctx_mutex);
+}
+
+static void nvm_sync_ctx_exit (void)
+{
+    struct nvm_sync_ctx *ctx;
+
+    pthread_mutex_lock (&sync_ctx_mutex);
+    while (sync_ctx_free) {
+        ctx = sync_ctx_free;
+        sync_ctx_free = ctx->next;
+        pthread_mutex_destroy (&ctx->mutex);
+        free (ctx);
+    }
+    pthread_mutex_unlock (&sync_ctx_mutex);
+}
+
 static void nvm_sync_io_free (uint8_t flags, void *buf,
                                                    struct nvm_mmgr_io_cmd *cmd)
 {
@@ -531,34 +846,33 @@ static void nvm_sync_io_free (uint8_t flags, void *buf,
         free (buf);
 
     if (flags & NVM_SYNCIO_FLAG_SYNC) {
-        pthread_mutex_destroy (cmd->sync_mutex);
-        free (cmd->sync_count);
-        free (cmd->sync_mutex);
+        nvm_sync_ctx_put ((struct nvm_sync_ctx *) cmd->sync_count);
+        cmd->sync_count = NULL;
+        cmd->sync_mutex = NULL;
     }
 }
 
+/* Sets buffers and counters of a sync I/O, '*flags' gets what to release */
 static int nvm_sync_io_prepare (struct nvm_channel *ch,
-                        struct nvm_mmgr_io_cmd *cmd, void *buf, uint8_t flags)
+                    struct nvm_mmgr_io_cmd *cmd, void **bufp, uint8_t *flags)
 {
+    void *buf = *bufp;
+    struct nvm_sync_ctx *ctx;
     int i;
 
     if (!ch)
         return -1;
 
     if (!cmd->sync_count || !cmd->sync_mutex) {
-        cmd->sync_count = malloc (sizeof (u_atomic_t));
-        if (!cmd->sync_count)
+        ctx = nvm_sync_ctx_get ();
+        if (!ctx)
             return -1;
-        cmd->sync_mutex = malloc (sizeof (pthread_mutex_t));
-        if (!cmd->sync_mutex) {
-            free (cmd->sync_count);
-            return -1;
-        }
-        cmd->sync_count->counter = U_ATOMIC_INIT_RUNTIME(0);
-        pthread_mutex_init (cmd->sync_mutex, NULL);
-        flags |= NVM_SYNCIO_FLAG_SYNC;
+        cmd->sync_count = &ctx->count;
+        cmd->sync_mutex = &ctx->mutex;
+        *flags |= NVM_SYNCIO_FLAG_SYNC;
     }
 
+    cmd->ch = ch;
     cmd->ppa.g.ch = ch->ch_mmgr_id;
 
     if (cmd->cmdtype == MMGR_ERASE_BLK)
@@ -574,12 +888,14 @@ static int nvm_sync_io_prepare (struct nvm_channel *ch,
         cmd->n_sectors = ch->geometry->sec_per_pg;
 
     if (!buf) {
-        buf = malloc(ch->geometry->pg_size + ch->geometry->sec_oob_sz);
+        buf = malloc(ch->geometry->pg_size + ch->geometry->pg_oob_sz);
         if (!buf) {
-            nvm_sync_io_free (flags, NULL, cmd);
+            nvm_sync_io_free (*flags, NULL, cmd);
+            *flags = 0;
             return -1;
         }
-        flags |= NVM_SYNCIO_FLAG_BUF;
+        *bufp = buf;
+        *flags |= NVM_SYNCIO_FLAG_BUF;
     }
 
     if (cmd->cmdtype == MMGR_READ_SGL || cmd->cmdtype == MMGR_WRITE_SGL) {
@@ -603,7 +919,7 @@ OUT:
 
 /**
  * Submit an IO to a specific channel and wait for completion to return.
- * Please, use nvm_submit_multi_plane_sync_io if you have planes > 1
+ * Please, use nvm_submit_sync_io_vec if you have planes > 1
  *
  * BE CAREFUL WHEN MULTIPLE THREADS USE THE SAME ATOMIC INT: If cmd->sync_count
  * and cmd->sync_mutex are not NULL, multiple threads can share the same
@@ -625,12 +941,19 @@ int nvm_submit_sync_io (struct nvm_channel *ch, struct nvm_mmgr_io_cmd *cmd,
     char err[64];
 
     cmd->cmdtype = cmdtype;
-    if (nvm_sync_io_prepare (ch, cmd, buf, flags))
+    if (nvm_sync_io_prepare (ch, cmd, &buf, &flags))
         goto ERR;
 
     mmgr = ch->mmgr;
-    if (!mmgr)
+    if (!mmgr) {
+        nvm_sync_io_free (flags, buf, cmd);
         goto ERR;
+    }
+
+    if (cmd->cmdtype == MMGR_READ_PG && ox_pcache_read (cmd)) {
+        nvm_sync_io_free (flags, buf, cmd);
+        return 0;
+    }
 
     pthread_mutex_lock(cmd->sync_mutex);
     u_atomic_inc(cmd->sync_count);
@@ -639,16 +962,21 @@ int nvm_submit_sync_io (struct nvm_channel *ch, struct nvm_mmgr_io_cmd *cmd,
 
     cmd->status = NVM_IO_PROCESS;
 
-    gettimeofday(&cmd->tstart,NULL);
+    cmd->tstart = ox_lat_now ();
+    cmd->tdispatch = 0;
+    nvm_mmgr_tag (cmd);
 
     switch (cmd->cmdtype) {
         case MMGR_READ_PG:
             ret = mmgr->ops->read_pg(cmd);
             break;
         case MMGR_WRITE_PG:
+            ox_pcache_inval (cmd);
+            ox_prot_write (cmd);
             ret = mmgr->ops->write_pg(cmd);
             break;
         case MMGR_ERASE_BLK:
+            ox_pcache_inval (cmd);
             ret = mmgr->ops->erase_blk(cmd);
             break;
         default:
@@ -671,6 +999,7 @@ int nvm_submit_sync_io (struct nvm_channel *ch, struct nvm_mmgr_io_cmd *cmd,
     do {
         if (time(NULL) > start + NVM_SYNCIO_TO) {
             cmd->status = NVM_IO_TIMEOUT;
+            flags &= ~NVM_SYNCIO_FLAG_SYNC;
             nvm_sync_io_free (flags, buf, cmd);
             log_err ("[nvm: Sync IO cmd 0x%x TIMEOUT. Aborted.]\n",cmd->cmdtype);
             return -1;
@@ -697,53 +1026,232 @@ ERR:
     return -1;
 }
 
-static void *nvm_sub_pl_sio_th (void *arg)
+static int nvm_submit_mmgr_vec (struct nvm_mmgr *mmgr,
+                            struct nvm_mmgr_io_cmd *cmd, uint16_t n,
+                            uint8_t cmdtype, uint64_t delay)
 {
-    struct nvm_sync_io_arg *ptr = (struct nvm_sync_io_arg *) arg;
-    ptr->status = nvm_submit_sync_io(ptr->ch, ptr->cmd, ptr->buf, ptr->cmdtype);
+    nvm_mmgr_io_vec *vec_fn;
+    int i, ret;
 
-    return NULL;
+    switch (cmdtype) {
+        case MMGR_READ_PG:
+            vec_fn = mmgr->ops->read_vec;
+            break;
+        case MMGR_WRITE_PG:
+            vec_fn = mmgr->ops->write_vec;
+            break;
+        case MMGR_ERASE_BLK:
+            vec_fn = mmgr->ops->erase_vec;
+            break;
+        default:
+            return 0;
+    }
+
+    if (cmdtype == MMGR_WRITE_PG || cmdtype == MMGR_ERASE_BLK)
+        for (i = 0; i < n; i++)
+            ox_pcache_inval (&cmd[i]);
+
+    if (cmdtype == MMGR_WRITE_PG)
+        for (i = 0; i < n; i++)
+            ox_prot_write (&cmd[i]);
+
+    for (i = 0; i < n; i++)
+        nvm_mmgr_tag (&cmd[i]);
+
+    if (vec_fn && !delay)
+        return vec_fn (cmd, n);
+
+    for (i = 0; i < n; i++) {
+        if (i && delay)
+            usleep (delay);
+        switch (cmdtype) {
+            case MMGR_READ_PG:
+                ret = mmgr->ops->read_pg (&cmd[i]);
+                break;
+            case MMGR_WRITE_PG:
+                ret = mmgr->ops->write_pg (&cmd[i]);
+                break;
+            default:
+                ret = mmgr->ops->erase_blk (&cmd[i]);
+        }
+        if (ret)
+            break;
+    }
+
+    return i;
+}
+
+/**
+ * Asynchronous vector of commands to the same media manager, completed
+ * through the FTL callback as in nvm_submit_mmgr. The vector is given to the
+ * media manager in a single call if it supports vectored ops.
+ *
+ * @return number of commands taken by the media manager, the remaining ones
+ * are not submitted
+ */
+int nvm_submit_mmgr_io_vec (struct nvm_mmgr_io_cmd *cmd, uint16_t n)
+{
+    uint8_t cmdtype;
+    int i;
+
+    if (!n)
+        return 0;
+
+    cmdtype = cmd[0].nvm_io->cmdtype;
+    for (i = 0; i < n; i++) {
+        cmd[i].tstart = ox_lat_now ();
+        cmd[i].tdispatch = 0;
+        cmd[i].cmdtype = cmdtype;
+    }
+
+    return nvm_submit_mmgr_vec (cmd[0].ch->mmgr, cmd, n, cmdtype, 0);
+}
+
+static int nvm_sync_io_vec (struct nvm_channel *ch,
+                struct nvm_mmgr_io_cmd *cmd, void **buf_vec, uint8_t cmdtype,
+                uint16_t n, uint64_t delay)
+{
+    struct nvm_mmgr *mmgr = ch->mmgr;
+    struct nvm_sync_ctx *ctx;
+    u_atomic_t *count;
+    pthread_mutex_t *mutex;
+    uint8_t flags = 0;
+    void *buf;
+    int i, sub, ret = 0;
+    time_t start;
+
+    if (!mmgr || !n)
+        return -1;
+
+    ctx = nvm_sync_ctx_get ();
+    if (!ctx)
+        return -1;
+    count = &ctx->count;
+    mutex = &ctx->mutex;
+
+    for (i = 0; i < n; i++) {
+        cmd[i].cmdtype = cmdtype;
+        cmd[i].sync_count = count;
+        cmd[i].sync_mutex = mutex;
+        buf = (buf_vec) ? buf_vec[i] : NULL;
+        if ((cmdtype != MMGR_ERASE_BLK && !buf) ||
+                        nvm_sync_io_prepare (ch, &cmd[i], &buf, &flags)) {
+            ret = -1;
+            goto FREE;
+        }
+        cmd[i].status = NVM_IO_PROCESS;
+        cmd[i].tstart = ox_lat_now ();
+        cmd[i].tdispatch = 0;
+    }
+
+    /* the whole vector must be cached, misses take the bucket generation */
+    if (cmdtype == MMGR_READ_PG) {
+        for (i = 0, sub = 0; i < n; i++)
+            sub += ox_pcache_read (&cmd[i]);
+        if (sub == n)
+            goto FREE;
+    }
+
+    u_atomic_set(count, n);
+
+    sub = nvm_submit_mmgr_vec (mmgr, cmd, n, cmdtype, delay);
+
+    if (core.debug)
+        printf("[Sync IO vec: 0x%x %d/%d cmds, ppa: ch %d, lun %d, blk %d, "
+                "pg %d]\n", cmdtype, sub, n, cmd[0].ppa.g.ch, cmd[0].ppa.g.lun,
+                cmd[0].ppa.g.blk, cmd[0].ppa.g.pg);
+
+    /* Commands not taken by the media manager will never complete */
+    if (sub < n) {
+        ret = -1;
+        pthread_mutex_lock(mutex);
+        u_atomic_sub(n - sub, count);
+        pthread_mutex_unlock(mutex);
+    }
+
+    start = time(NULL);
+    do {
+        if (time(NULL) > start + NVM_SYNCIO_TO) {
+            for (i = 0; i < sub; i++)
+                cmd[i].status = NVM_IO_TIMEOUT;
+            log_err ("[nvm: Sync IO vec cmd 0x%x TIMEOUT. Aborted.]\n",
+                                                                      cmdtype);
+            /* Late completions may still take the lock, the counter and the
+             * mutex are not freed */
+            return -1;
+        }
+        pthread_mutex_lock(mutex);
+        i = u_atomic_read(count);
+        pthread_mutex_unlock(mutex);
+        if (i)
+            usleep(1);
+    } while (i);
+
+    for (i = 0; i < sub; i++)
+        if (cmd[i].status != NVM_IO_SUCCESS)
+            ret = -1;
+
+FREE:
+    for (i = 0; i < n; i++) {
+        cmd[i].sync_count = NULL;
+        cmd[i].sync_mutex = NULL;
+    }
+    nvm_sync_ctx_put (ctx);
+
+    if (ret)
+        log_err ("[ERROR: Sync IO vec cmd 0x%x with errors. Aborted.]\n",
+                                                                      cmdtype);
+    return ret;
+}
+
+/**
+ * Submit a vector of IOs to a specific channel and wait for all of them to
+ * complete. The whole vector is given to the media manager in a single call
+ * (read_vec, write_vec or erase_vec), media managers without vectored ops
+ * get the commands one by one. Use it for multi-plane pages and blocks, one
+ * command per plane.
+ *
+ * @param ch - nvm_channel pointer
+ * @param cmd - Array of n media manager commands, the ppa must be set
+ * @param buf_vec - Array of n pointers to dma data, NULL for erase
+ * @param cmdtype - MMGR_READ_PG, MMGR_WRITE_PG, MMGR_ERASE_BLK
+ * @param n - Number of commands
+ * @return 0 if all commands succeeded
+ */
+int nvm_submit_sync_io_vec (struct nvm_channel *ch,
+                struct nvm_mmgr_io_cmd *cmd, void **buf_vec, uint8_t cmdtype,
+                uint16_t n)
+{
+    return nvm_sync_io_vec (ch, cmd, buf_vec, cmdtype, n, 0);
 }
 
 /**
  * Use this function to submit a synchronous IO using multi-plane. All pages
- * within the plane-page will be asynchronous. Refer to nvm_submit_sync_io
- * for further info about synchronous IO.
+ * within the plane-page will be asynchronous. Refer to nvm_submit_sync_io_vec
+ * for further info about vectored synchronous IO.
  *
  * ENSURE YOUR *buf HAS ENOUGH SPACE FOR N_PLANES * (PAGE_SIZE + OOB) and *cmd
  * is an array of N_PLANES nvm_mmgr_io_cmd
  *
  * @params Refer to nvm_submit_sync_io
- * @pl_delay Delay between plane-page IOs in u-seconds, 0 to ignore the delay
+ * @pl_delay Delay between plane-page IOs in u-seconds, 0 to ignore the delay.
+ *           Plane-pages are submitted one by one if defined.
  */
 
 int nvm_submit_multi_plane_sync_io (struct nvm_channel *ch,
      struct nvm_mmgr_io_cmd *cmd, void *buf, uint8_t cmdtype, uint64_t pl_delay)
 {
-    int pl_i, ret = 0, pl = ch->geometry->n_of_planes;
-    pthread_t               tid[pl];
-    struct nvm_sync_io_arg  pl_arg[pl];
+    int pl_i, pl = ch->geometry->n_of_planes;
+    void *buf_vec[pl];
 
     for (pl_i = 0; pl_i < pl; pl_i++) {
         cmd[pl_i].ppa.g.pl = pl_i;
-        if (cmdtype != MMGR_ERASE_BLK)
-            pl_arg[pl_i].buf = buf + (NVM_PG_SIZE + NVM_OOB_SIZE) * pl_i;
-
-        pl_arg[pl_i].ch = ch;
-        pl_arg[pl_i].cmdtype = cmdtype;
-        pl_arg[pl_i].cmd = &cmd[pl_i];
-        pthread_create(&tid[pl_i],NULL,nvm_sub_pl_sio_th,(void *)&pl_arg[pl_i]);
-
-        if (pl_delay > 0)
-            usleep(pl_delay);
+        buf_vec[pl_i] = (cmdtype != MMGR_ERASE_BLK) ?
+                        (uint8_t *) buf + (NVM_PG_SIZE + NVM_OOB_SIZE) * pl_i :
+                        NULL;
     }
 
-    for (pl_i = 0; pl_i < pl; pl_i++) {
-        pthread_join(tid[pl_i], NULL);
-        if (pl_arg->status) ret++;
-    }
-
-    return ret;
+    return nvm_sync_io_vec (ch, cmd, buf_vec, cmdtype, pl, pl_delay);
 }
 
 static void nvm_unregister_mmgr (struct nvm_mmgr *mmgr)
@@ -764,8 +1272,6 @@ static void nvm_unregister_ftl (struct nvm_ftl *ftl)
     if (LIST_EMPTY(&ftl_head))
         return;
 
-    ox_mq_destroy(ftl->mq);
-    core.ftl_q_count -= ftl->nq;
     ftl->ops->exit();
     LIST_REMOVE(ftl, entry);
     core.ftl_count--;
@@ -792,7 +1298,7 @@ static int nvm_ch_config (void)
             ch->mmgr        = mmgr;
 
             /* For now we set all channels to be managed by the standard FTL */
-            /* For now all channels are set to the same namespace */
+            /* The namespace is set by nvm_ns_config */
             if (ch->i.in_use != NVM_CH_IN_USE) {
                 ch->i.in_use = NVM_CH_IN_USE;
                 ch->i.ns_id = 0x1;
@@ -835,6 +1341,99 @@ static int nvm_ch_config (void)
     return 0;
 }
 
+static void nvm_ns_exit (void)
+{
+    uint16_t ns_i;
+
+    for (ns_i = 0; ns_i < core.nvm_ns_count; ns_i++) {
+        if (!core.nvm_ns[ns_i].mq)
+            continue;
+        ox_mq_destroy (core.nvm_ns[ns_i].mq);
+        core.ftl_q_count -= core.nvm_ns[ns_i].ftl->nq;
+    }
+
+    free (core.nvm_ns);
+    core.nvm_ns = NULL;
+    core.nvm_ns_count = 0;
+}
+
+/*
+ * Splits the channels among the namespaces, in order. A namespace gets the
+ * share of its channels in the space exported by the FTL, the FTL may keep
+ * part of the channels for over-provisioning.
+ */
+static int nvm_ns_config (void)
+{
+    struct nvm_namespace *ns;
+    struct nvm_channel *ch;
+    uint64_t raw = 0, ns_raw, slba = 0;
+    uint16_t ns_i, ch_i, nns;
+
+    nns = (core.qemu && core.qemu->namespaces) ? core.qemu->namespaces : 1;
+    if (core.lnvm && nns > 1) {
+        log_info ("  [nvm: Open-Channel mode exports a single namespace.]\n");
+        nns = 1;
+    }
+    if (nns > core.nvm_ch_count) {
+        log_err ("[nvm: %d namespaces for %d channels.]\n", nns,
+                                                           core.nvm_ch_count);
+        return ECH_CONFIG;
+    }
+
+    core.nvm_ns = calloc (nns, sizeof (struct nvm_namespace));
+    if (nvm_memcheck (core.nvm_ns))
+        return EMEM;
+    core.nvm_ns_count = nns;
+
+    for (ch_i = 0; ch_i < core.nvm_ch_count; ch_i++)
+        raw += core.nvm_ch[ch_i]->tot_bytes / NVME_KERNEL_PG_SIZE;
+
+    for (ns_i = 0; ns_i < nns; ns_i++) {
+        ns = &core.nvm_ns[ns_i];
+        ns->nsid = ns_i + 1;
+        ns->ch_first = core.nvm_ch_count * ns_i / nns;
+        ns->nch = core.nvm_ch_count * (ns_i + 1) / nns - ns->ch_first;
+        ns->ftl = core.nvm_ch[ns->ch_first]->ftl;
+        ns->stripe_sz = core.nvm_ch[ns->ch_first]->geometry->pl_pg_size;
+        if (core.qemu && core.qemu->stripe_pgs)
+            ns->stripe_sz *= core.qemu->stripe_pgs;
+
+        ns_raw = 0;
+        for (ch_i = ns->ch_first; ch_i < ns->ch_first + ns->nch; ch_i++) {
+            ch = core.nvm_ch[ch_i];
+            if (ch->ftl != ns->ftl) {
+                log_err ("[nvm: Channels of namespace %d have different "
+                                                        "FTLs.]\n", ns->nsid);
+                goto ERR;
+            }
+            ch->ns = ns;
+            ns_raw += ch->tot_bytes / NVME_KERNEL_PG_SIZE;
+
+            if (ch->i.ns_id != ns->nsid ||
+                                    ch->i.ns_part != ch_i - ns->ch_first) {
+                ch->i.ns_id = ns->nsid;
+                ch->i.ns_part = ch_i - ns->ch_first;
+                ch->mmgr->ops->set_ch_info(ch, 1);
+            }
+        }
+
+        ns->slba = slba;
+        ns->size = (ns_i == nns - 1) ? core.nvm_ns_size - slba :
+                            ns_raw * (core.nvm_ns_size / NVME_KERNEL_PG_SIZE) /
+                            raw * NVME_KERNEL_PG_SIZE;
+        slba += ns->size;
+
+        if (nvm_ns_mq_init (ns, ns_i))
+            goto ERR;
+    }
+
+    return 0;
+
+ERR:
+    nvm_ns_exit ();
+    return ECH_CONFIG;
+}
+
 static int nvm_ftl_cap_get_bbtbl (struct nvm_channel *ch,
                                           struct nvm_ftl_cap_get_bbtbl_st *arg)
 {
@@ -882,6 +1481,24 @@ static int nvm_ftl_cap_exit_fn (struct nvm_ftl *ftl,
     return 0;
 }
 
+static int nvm_ftl_cap_get_l2ptbl (struct nvm_ftl *ftl,
+                                        struct nvm_ftl_cap_get_l2ptbl_st *arg)
+{
+    if (!arg->nlb || !ftl->ops->get_l2ptbl)
+        return -1;
+
+    return ftl->ops->get_l2ptbl (arg->slba, arg->nlb, arg->tbl);
+}
+
+static int nvm_ftl_cap_call_fn (struct nvm_ftl *ftl,
+                                                 struct nvm_ftl_cap_gl_fn *arg)
+{
+    if (!ftl->ops->call_fn)
+        return -1;
+
+    return ftl->ops->call_fn (arg->fn_id, arg->arg);
+}
+
 int nvm_ftl_cap_exec (uint8_t cap, void *arg)
 {
     struct nvm_channel *ch;
@@ -921,6 +1538,18 @@ int nvm_ftl_cap_exec (uint8_t cap, void *arg)
             break;
 
         case FTL_CAP_GET_L2PTBL:
+
+            /* The table is the one of the FTL serving the namespaces */
+            ftl = nvm_get_ftl_instance(core.std_ftl);
+            if (!ftl)
+                goto OUT;
+            if (ftl->cap & 1 << FTL_CAP_GET_L2PTBL) {
+                if (nvm_ftl_cap_get_l2ptbl(ftl, arg))
+                    goto OUT;
+                return 0;
+            }
+            break;
+
         case FTL_CAP_SET_L2PTBL:
         case FTL_CAP_INIT_FN:
 
@@ -948,6 +1577,19 @@ int nvm_ftl_cap_exec (uint8_t cap, void *arg)
             }
             break;
 
+        case FTL_CAP_CALL_FN:
+
+            gl_fn = (struct nvm_ftl_cap_gl_fn *) arg;
+            ftl = nvm_get_ftl_instance(gl_fn->ftl_id);
+            if (!ftl)
+                goto OUT;
+            if (ftl->cap & 1 << FTL_CAP_CALL_FN) {
+                if (nvm_ftl_cap_call_fn(ftl, gl_fn))
+                    goto OUT;
+                return 0;
+            }
+            break;
+
         default:
             goto OUT;
     }
@@ -957,6 +1599,88 @@ OUT:
     return -1;
 }
 
+/* Mapping cache of the standard FTL, used by the monitor and properties */
+int nvm_ftl_map_cache_set (uint32_t pgs_ch)
+{
+    struct nvm_ftl_cap_gl_fn gl_fn;
+
+    gl_fn.ftl_id = core.std_ftl;
+    gl_fn.fn_id = FTL_FN_MAP_CACHE_SET;
+    gl_fn.arg = &pgs_ch;
+
+    return nvm_ftl_cap_exec (FTL_CAP_CALL_FN, &gl_fn);
+}
+
+int nvm_ftl_map_cache_get (struct nvm_ftl_map_cache_st *st)
+{
+    struct nvm_ftl_cap_gl_fn gl_fn;
+
+    gl_fn.ftl_id = core.std_ftl;
+    gl_fn.fn_id = FTL_FN_MAP_CACHE_GET;
+    gl_fn.arg = st;
+
+    return nvm_ftl_cap_exec (FTL_CAP_CALL_FN, &gl_fn);
+}
+
+/* Erase counts of the standard FTL blocks, used by the SMART log */
+int nvm_ftl_wear_get (struct nvm_ftl_wear_st *st)
+{
+    struct nvm_ftl_cap_gl_fn gl_fn;
+
+    gl_fn.ftl_id = core.std_ftl;
+    gl_fn.fn_id = FTL_FN_WEAR_GET;
+    gl_fn.arg = st;
+
+    return nvm_ftl_cap_exec (FTL_CAP_CALL_FN, &gl_fn);
+}
+
+/* Garbage collection counters of the standard FTL, used by ox-stats */
+int nvm_ftl_gc_get (struct nvm_ftl_gc_st *st)
+{
+    struct nvm_ftl_cap_gl_fn gl_fn;
+
+    gl_fn.ftl_id = core.std_ftl;
+    gl_fn.fn_id = FTL_FN_GC_GET;
+    gl_fn.arg = st;
+
+    return nvm_ftl_cap_exec (FTL_CAP_CALL_FN, &gl_fn);
+}
+
+/* Unmaps a LBA range in the standard FTL, used by Dataset Management */
+int nvm_ftl_deallocate (uint64_t slba, uint32_t nlb)
+{
+    struct nvm_ftl_cap_gl_fn gl_fn;
+    struct nvm_ftl_lba_range range;
+
+    range.slba = slba;
+    range.nlb = nlb;
+
+    gl_fn.ftl_id = core.std_ftl;
+    gl_fn.fn_id = FTL_FN_DEALLOCATE;
+    gl_fn.arg = &range;
+
+    return nvm_ftl_cap_exec (FTL_CAP_CALL_FN, &gl_fn);
+}
+
+/* Reads a LBA range of the standard FTL to a controller buffer, used by the
+ * near-data processing jobs */
+int nvm_ftl_lba_read (uint64_t slba, uint32_t nlb, uint32_t sec_sz, void *buf)
+{
+    struct nvm_ftl_cap_gl_fn gl_fn;
+    struct nvm_ftl_lba_read rd;
+
+    rd.slba = slba;
+    rd.nlb = nlb;
+    rd.sec_sz = sec_sz;
+    rd.buf = (uint8_t *) buf;
+
+    gl_fn.ftl_id = core.std_ftl;
+    gl_fn.fn_id = FTL_FN_LBA_READ;
+    gl_fn.arg = &rd;
+
+    return nvm_ftl_cap_exec (FTL_CAP_CALL_FN, &gl_fn);
+}
+
 static int nvm_init (uint8_t start_all)
 {
     int ret;
@@ -998,11 +1722,29 @@ static int nvm_init (uint8_t start_all)
 #endif
     core.run_flag |= RUN_FTL;
 
-    /* create channels and global namespace */
+    /* create channels and namespaces */
     ret = nvm_ch_config();
     if(ret) goto OUT;
+    ret = nvm_ns_config();
+    if(ret) goto OUT;
     core.run_flag |= RUN_CH;
 
+    /* stage latency histograms, kept across restarts */
+    if (ox_lat_init (core.nvm_ch_count))
+        log_err ("[nvm: Latency histograms not available.]\n");
+
+    /* telemetry samples for QMP, kept across restarts */
+    if (ox_stats_init (core.nvm_ch_count,
+                                (core.qemu) ? core.qemu->stats_interval : 0))
+        log_err ("[nvm: Telemetry samples not available.]\n");
+
+    if (ox_pcache_init (core.nvm_ch_count,
+                                (core.qemu) ? core.qemu->pcache_pages : 0))
+        log_err ("[nvm: Page cache not available.]\n");
+
+    /* sector CRC, the OOB belongs to the host in open-channel mode */
+    ox_prot_init (core.qemu && core.qemu->oob_crc && !core.lnvm);
+
     /* pci handler */
     if (start_all) {
         ret = dfcpcie_init();
@@ -1031,6 +1773,9 @@ static void nvm_clear_all (uint8_t stop_all)
     struct nvm_ftl *ftl;
     struct nvm_mmgr *mmgr;
 
+    /* Fabrics commands complete in the FTL, stop them while it runs */
+    ox_fabrics_exit ();
+
     /* Clean PCIe handler */
     if(core.nvm_pcie && (core.run_flag & RUN_PCIE) && stop_all) {
         core.nvm_pcie->ops->exit();
@@ -1049,8 +1794,18 @@ static void nvm_clear_all (uint8_t stop_all)
     }
 #endif
 
-    /* Clean channels */
+    /* Clean namespaces and channels */
     if (core.run_flag & RUN_CH) {
+        if (ox_pcache_enabled ()) {
+            struct ox_pcache_stats pcst;
+
+            ox_pcache_get_stats (&pcst);
+            log_info ("[ox: Page cache hits: %lu, misses: %lu, fills: %lu, "
+                        "invalidated: %lu]\n", pcst.hits, pcst.misses,
+                        pcst.fills, pcst.invals);
+            ox_pcache_exit ();
+        }
+        nvm_ns_exit ();
         free(core.nvm_ch);
         core.run_flag ^= RUN_CH;
     }
@@ -1085,6 +1840,25 @@ static void nvm_clear_all (uint8_t stop_all)
         core.run_flag ^= RUN_NVME_ALLOC;
     }
 
+    if (stop_all && ox_prot_enabled ()) {
+        struct ox_prot_stats pst;
+
+        ox_prot_get_stats (&pst);
+        log_info ("[ox: CRC sectors protected: %lu, verified: %lu, "
+                "errors: %lu, unprotected: %lu]\n", pst.sec_protected,
+                pst.sec_verified, pst.sec_errors, pst.sec_unprotected);
+    }
+
+    if (stop_all && nvm_mmgr_stale)
+        log_info ("[nvm: Stale media manager completions: %lu]\n",
+                                                            nvm_mmgr_stale);
+
+    if (stop_all) {
+        nvm_sync_ctx_exit ();
+        ox_lat_exit ();
+        ox_stats_exit ();
+    }
+
     printf("OX Controller closed succesfully.\n");
 }
 
@@ -1142,23 +1916,18 @@ static void nvm_print_log (void)
                             core.nvm_ch[i]->i.ns_id, core.nvm_ch[i]->i.ns_part,
                             core.nvm_ch[i]->ns_pgs, core.nvm_ch[i]->i.in_use);
     }
-    log_info("  [nvm: namespace size: %lu bytes]\n",
-                                                core.nvm_nvme_ctrl->ns_size[0]);
-    log_info("    [nvm: total pages: %lu]\n",
-                                  core.nvm_nvme_ctrl->ns_size[0] / NVM_PG_SIZE);
-}
-
-static void nvm_jump (int signal) {
-    longjmp (core.jump, 1);
+    for(i=0; i<core.nvm_ns_count; i++){
+        log_info("  [nvm: namespace %d: channels %d-%d, size: %lu bytes]\n",
+                core.nvm_ns[i].nsid, core.nvm_ns[i].ch_first,
+                core.nvm_ns[i].ch_first + core.nvm_ns[i].nch - 1,
+                core.nvm_ns[i].size);
+        log_info("    [nvm: total pages: %lu]\n",
+                                            core.nvm_ns[i].size / NVM_PG_SIZE);
+    }
 }
 
 int nvm_memcheck (void *mem) {
-    int invalid = 0;
-    signal (SIGSEGV, nvm_jump);
-    if (setjmp (core.jump))
-        invalid = 1;
-    signal (SIGSEGV, SIG_DFL);
-    return invalid;
+    return mem == NULL;
 }
 
 int nvm_contains_ppa (struct nvm_ppa_addr *list, uint32_t list_sz,
@@ -1195,6 +1964,15 @@ int nvm_admin_unit (struct nvm_init_arg *args)
     return 0;
 }
 
+int nvm_bench_unit (struct nvm_init_arg *args)
+{
+    if (!core.tests_init->bench) {
+        printf(" OX Benchmark is not compiled.\n");
+        return -1;
+    }
+    return 0;
+}
+
 int nvm_init_ctrl (int argc, char **argv, QemuOxCtrl *qemu)
 {
     int ret, exec;
@@ -1229,6 +2007,9 @@ int nvm_init_ctrl (int argc, char **argv, QemuOxCtrl *qemu)
         case OX_ADMIN_MODE:
             modet_fn = core.tests_init->admin;
             break;
+        case OX_BENCH_MODE:
+            modet_fn = core.tests_init->bench;
+            break;
         case OX_RUN_MODE:
             core.run_flag ^= RUN_TESTS;
            // while(1) { usleep(1); } break;
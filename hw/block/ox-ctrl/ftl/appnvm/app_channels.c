@@ -29,9 +29,13 @@
 #include <stdint.h>
 #include <string.h>
 #include "hw/block/ox-ctrl/include/ssd.h"
+#include "hw/block/ox-ctrl/include/ox-bbt.h"
 
 LIST_HEAD(app_ch, app_channel) app_ch_head = LIST_HEAD_INITIALIZER(app_ch_head);
 
+/* Channels are started in parallel, protects the list and the namespace size */
+static pthread_mutex_t app_ch_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 extern struct core_struct core;
 extern pthread_spinlock_t *md_ch_spin;
 
@@ -68,6 +72,7 @@ static int app_reserve_blks (struct app_channel *lch)
     lch->bbt_blk  = ch->mmgr_rsv + APP_RSV_BBT_OFF;
     lch->meta_blk = ch->mmgr_rsv + APP_RSV_META_OFF;
     lch->map_blk  = ch->mmgr_rsv + APP_RSV_MAP_OFF;
+    lch->log_blk  = ch->mmgr_rsv + APP_RSV_LOG_OFF;
 
     return 0;
 }
@@ -88,11 +93,10 @@ static int app_init_bbt (struct app_channel *lch)
         return -1;
 
     bbt = lch->bbtbl;
-    bbt->tbl = malloc (sizeof(uint8_t) * tblks);
+    bbt->tbl = ox_bbt_alloc (tblks);
     if (!bbt->tbl)
         goto FREE_BBTBL;
 
-    memset (bbt->tbl, 0, tblks);
     bbt->magic = 0;
     bbt->bb_sz = tblks;
 
@@ -150,6 +154,7 @@ static int app_init_blk_md (struct app_channel *lch)
 
     memset (md->tbl, 0, md->entry_sz * tblks);
     md->magic = 0;
+    md->gen = 0;
     md->entries = tblks;
 
     ret = appnvm()->md->load_fn (lch);
@@ -210,6 +215,7 @@ static int app_init_map (struct app_channel *lch)
 
     memset (md->tbl, 0, md->entry_sz * ch_map_md_ent);
     md->magic = 0;
+    md->gen = 0;
     md->entries = ch_map_md_ent;
 
     ret = appnvm()->ch_map->load_fn (lch);
@@ -272,8 +278,7 @@ static int channels_init (struct nvm_channel *ch, uint16_t id)
     struct app_channel *lch;
     uint32_t blk_sz;
 
-    md_ch_spin = realloc
-                 ((void *) md_ch_spin, sizeof (pthread_spinlock_t) * (id + 1));
+    /* md_ch_spin is allocated for all channels before they are started */
     if (!md_ch_spin)
         return -1;
 
@@ -285,11 +290,14 @@ static int channels_init (struct nvm_channel *ch, uint16_t id)
         goto CH_SPIN;
 
     lch->ch = ch;
+    lch->app_ch_id = id;
 
+    pthread_mutex_lock (&app_ch_mutex);
     LIST_INSERT_HEAD(&app_ch_head, lch, entry);
-    lch->app_ch_id = id;
+    pthread_mutex_unlock (&app_ch_mutex);
 
     lch->flags.busy.counter = U_ATOMIC_INIT_RUNTIME(0);
+    lch->prov_sec.counter = U_ATOMIC_INIT_RUNTIME(0);
 
     if (pthread_spin_init (&lch->flags.busy_spin, 0))    goto FREE_LCH;
     if (pthread_spin_init (&lch->flags.active_spin, 0))  goto BUSY_SPIN;
@@ -308,23 +316,31 @@ static int channels_init (struct nvm_channel *ch, uint16_t id)
     if (app_init_blk_md (lch))
         goto FREE_BBT;
 
-    if (appnvm()->ch_prov->init_fn (lch))
+    if (app_init_map (lch))
         goto FREE_BLK_MD;
 
-    if (app_init_map (lch))
-        goto EXIT_CH_PROV;
+    /* Metadata changed after the snapshots is replayed before provisioning */
+    if (app_md_log_init (lch))
+        goto EXIT_MAP;
+
+    if (appnvm()->ch_prov->init_fn (lch))
+        goto EXIT_MD_LOG;
 
     /* Remove reserved blocks from namespace */
     blk_sz = lch->ch->geometry->pg_per_blk * lch->ch->geometry->pg_size;
+    pthread_mutex_lock (&app_ch_mutex);
     core.nvm_ns_size -= lch->ch->mmgr_rsv * blk_sz;
     core.nvm_ns_size -= lch->ch->ftl_rsv * blk_sz;
+    pthread_mutex_unlock (&app_ch_mutex);
 
     log_info("    [appnvm: channel %d started with %d bad blocks.]\n",ch->ch_id,
                                                           lch->bbtbl->bb_count);
     return 0;
 
-EXIT_CH_PROV:
-    appnvm()->ch_prov->exit_fn (lch);
+EXIT_MD_LOG:
+    app_md_log_exit (lch, 0);
+EXIT_MAP:
+    app_exit_map (lch);
 FREE_BLK_MD:
     app_exit_blk_md (lch);
 FREE_BBT:
@@ -336,7 +352,9 @@ ACT_SPIN:
 BUSY_SPIN:
     pthread_spin_destroy (&lch->flags.busy_spin);
 FREE_LCH:
+    pthread_mutex_lock (&app_ch_mutex);
     LIST_REMOVE (lch, entry);
+    pthread_mutex_unlock (&app_ch_mutex);
     free(lch);
 CH_SPIN:
     pthread_spin_destroy (&md_ch_spin[id]);
@@ -346,6 +364,9 @@ CH_SPIN:
 static void channels_exit (struct app_channel *lch)
 {
     int ret, retry;
+    uint8_t flushed = 1;
+
+    app_md_log_next_gen (lch);
 
     retry = 0;
     do {
@@ -353,11 +374,11 @@ static void channels_exit (struct app_channel *lch)
         ret = appnvm()->ch_map->flush_fn (lch);
     } while (ret && retry < APPNVM_FLUSH_RETRY);
 
-    /* TODO: Recover from last checkpoint (make a checkpoint) */
-    if (ret)
+    if (ret) {
         log_err(" [appnvm: ERROR. Mapping metadata not flushed to NVM. "
                                           "Channel %d]", lch->ch->ch_id);
-    else
+        flushed = 0;
+    } else
         log_info(" [appnvm: Mapping metadata persisted into NVM. "
                                           "Channel %d]", lch->ch->ch_id);
 
@@ -367,16 +388,18 @@ static void channels_exit (struct app_channel *lch)
         ret = appnvm()->md->flush_fn (lch);
     } while (ret && retry < APPNVM_FLUSH_RETRY);
 
-    /* TODO: Recover from last checkpoint (make a checkpoint) */
-    if (ret)
+    if (ret) {
         log_err(" [appnvm: ERROR. Block metadata not flushed to NVM. "
                                           "Channel %d]", lch->ch->ch_id);
-    else
+        flushed = 0;
+    } else
         log_info(" [appnvm: Block metadata persisted into NVM. "
                                           "Channel %d]", lch->ch->ch_id);
 
-    app_exit_map (lch);
+    /* The log is kept if a snapshot failed, it is replayed at next startup */
+    app_md_log_exit (lch, flushed);
     appnvm()->ch_prov->exit_fn (lch);
+    app_exit_map (lch);
     app_exit_blk_md (lch);
     app_exit_bbt (lch);
 
@@ -385,7 +408,9 @@ static void channels_exit (struct app_channel *lch)
     pthread_spin_destroy (&lch->flags.need_gc_spin);
     pthread_spin_destroy (&md_ch_spin[lch->app_ch_id]);
 
+    pthread_mutex_lock (&app_ch_mutex);
     LIST_REMOVE (lch, entry);
+    pthread_mutex_unlock (&app_ch_mutex);
     free(lch);
 }
 
@@ -400,16 +425,16 @@ static struct app_channel *channels_get(uint16_t ch_id)
     return NULL;
 }
 
+/* The list is indexed by the channel ID, channels are added in any order */
 static int channels_get_list (struct app_channel **list, uint16_t nch)
 {
-    int n = 0, i = nch - 1;
+    int n = 0;
     struct app_channel *lch;
 
     LIST_FOREACH(lch, &app_ch_head, entry){
-        if (i < 0)
-            break;
-        list[i] = lch;
-        i--;
+        if (lch->app_ch_id >= nch)
+            continue;
+        list[lch->app_ch_id] = lch;
         n++;
     }
 
@@ -22,6 +22,7 @@
  */
 
 #include "hw/block/ox-ctrl/include/ssd.h"
+#include "hw/block/ox-ctrl/include/ox-bbt.h"
 
 #include <syslog.h>
 #include <stdlib.h>
@@ -40,6 +41,14 @@ uint16_t app_nch;
 pthread_mutex_t     gc_ns_mutex;
 pthread_spinlock_t *md_ch_spin;
 
+/* Channels are started by APP_INIT_WORKERS threads at the global init */
+#define APP_INIT_WORKERS    8
+
+static struct nvm_channel **app_ch_pending;
+static uint16_t             app_ch_npending;
+static uint32_t             app_ch_next;
+static int                 *app_ch_ret;
+
 static int app_submit_io (struct nvm_io_cmd *);
 
 struct app_global *appnvm (void) {
@@ -264,67 +273,117 @@ int app_nvm_seq_transfer (struct app_io_data *io, struct nvm_ppa_addr *ppa,
     return 0;
 }
 
-int app_pg_io (struct app_channel *lch, uint8_t cmdtype,
-                                      void **pl_vec, struct nvm_ppa_addr *ppa)
+/**
+ *  Writes a table snapshot to a reserved block, after the newest snapshot
+ *  The block is erased if the snapshot does not fit in the remaining pages
+ *
+ * @param blk - reserved block ID
+ * @param tbl - table to be written
+ * @param entries - number of entries in the table
+ * @param entry_sz - size of an entry
+ * @param hdr - table header, stored in the OOB area. Starts with APP_MAGIC
+ * @param hdr_sz - size of the table header
+ * @return 0 on success, -1 on failure
+ */
+int app_rsv_tbl_flush (struct app_channel *lch, uint16_t blk, uint8_t *tbl,
+                 uint32_t entries, size_t entry_sz, void *hdr, size_t hdr_sz)
 {
-    int pl, ret = -1;
-    void *buf = NULL;
-    struct nvm_channel *ch = lch->ch;
-    struct nvm_mmgr_io_cmd *cmd = malloc(sizeof(struct nvm_mmgr_io_cmd));
-    if (!cmd)
-        return EMEM;
+    int pg;
+    struct nvm_ppa_addr ppa;
+
+    struct app_io_data *io = app_alloc_pg_io(lch);
+    if (io == NULL)
+        return -1;
 
-    for (pl = 0; pl < ch->geometry->n_of_planes; pl++) {
-        memset (cmd, 0, sizeof (struct nvm_mmgr_io_cmd));
-        cmd->ppa.g.blk = ppa->g.blk;
-        cmd->ppa.g.pl = pl;
-        cmd->ppa.g.ch = ch->ch_mmgr_id;
-        cmd->ppa.g.lun = ppa->g.lun;
-        cmd->ppa.g.pg = ppa->g.pg;
+    /* single page planes might be padded to avoid broken entries */
+    uint16_t ent_per_pg = (io->pg_sz / entry_sz) * io->n_pl;
+    uint16_t tbl_pgs = entries / ent_per_pg;
+    if (entries % ent_per_pg > 0)
+        tbl_pgs++;
+
+    if (tbl_pgs > io->ch->geometry->pg_per_blk || hdr_sz > io->meta_sz) {
+        log_err("[appnvm ERR: Ch %d -> Table does not fit in reserved block %d."
+                 " Maximum: %d bytes\n", io->ch->ch_id, blk,
+                 io->pg_sz * io->ch->geometry->pg_per_blk);
+        goto ERR;
+    }
 
-        if (cmdtype != MMGR_ERASE_BLK)
-            buf = pl_vec[pl];
+    pg = app_blk_current_page (lch, io, blk, tbl_pgs);
+    if (pg < 0)
+        goto ERR;
 
-        ret = nvm_submit_sync_io (ch, cmd, buf, cmdtype);
-        if (ret)
-            break;
+    if (pg >= io->ch->geometry->pg_per_blk - tbl_pgs) {
+        if (app_io_rsv_blk (lch, MMGR_ERASE_BLK, NULL, blk, 0))
+            goto ERR;
+        pg = 0;
     }
-    free(cmd);
 
-    return ret;
+    memset (io->buf, 0, io->buf_sz);
+
+    /* set info to OOB area */
+    memcpy (&io->buf[io->pg_sz], hdr, hdr_sz);
+
+    ppa.g.pg = pg;
+    ppa.g.blk = blk;
+
+    if (app_nvm_seq_transfer (io, &ppa, tbl, tbl_pgs, ent_per_pg, entries,
+                            entry_sz, APP_TRANS_TO_NVM, APP_IO_RESERVED))
+        goto ERR;
+
+    app_free_pg_io(io);
+    return 0;
+
+ERR:
+    app_free_pg_io(io);
+    return -1;
+}
+
+int app_pg_io (struct app_channel *lch, uint8_t cmdtype,
+                                      void **pl_vec, struct nvm_ppa_addr *ppa)
+{
+    int pl;
+    struct nvm_channel *ch = lch->ch;
+    int n_pl = ch->geometry->n_of_planes;
+    struct nvm_mmgr_io_cmd cmd[n_pl];
+
+    memset (cmd, 0x0, sizeof (cmd));
+
+    /* All planes in a single vectored IO */
+    for (pl = 0; pl < n_pl; pl++) {
+        cmd[pl].ppa.g.blk = ppa->g.blk;
+        cmd[pl].ppa.g.pl = pl;
+        cmd[pl].ppa.g.ch = ch->ch_mmgr_id;
+        cmd[pl].ppa.g.lun = ppa->g.lun;
+        cmd[pl].ppa.g.pg = ppa->g.pg;
+    }
+
+    return nvm_submit_sync_io_vec (ch, cmd, (cmdtype != MMGR_ERASE_BLK) ?
+                                                pl_vec : NULL, cmdtype, n_pl);
 }
 
 int app_io_rsv_blk (struct app_channel *lch, uint8_t cmdtype,
                                      void **pl_vec, uint16_t blk, uint16_t pg)
 {
-    int pl, ret = -1;
-    void *buf = NULL;
+    int pl;
     struct nvm_channel *ch = lch->ch;
-    struct nvm_mmgr_io_cmd *cmd = malloc(sizeof(struct nvm_mmgr_io_cmd));
-    if (!cmd)
-        return EMEM;
+    int n_pl = ch->geometry->n_of_planes;
+    struct nvm_mmgr_io_cmd cmd[n_pl];
 
-    for (pl = 0; pl < ch->geometry->n_of_planes; pl++) {
-        memset (cmd, 0, sizeof (struct nvm_mmgr_io_cmd));
-        cmd->ppa.g.blk = blk;
-        cmd->ppa.g.pl = pl;
-        cmd->ppa.g.ch = ch->ch_mmgr_id;
+    memset (cmd, 0x0, sizeof (cmd));
 
-        /* TODO: RAID 1 among all LUNs in the channel */
-        cmd->ppa.g.lun = 0;
+    for (pl = 0; pl < n_pl; pl++) {
+        cmd[pl].ppa.g.blk = blk;
+        cmd[pl].ppa.g.pl = pl;
+        cmd[pl].ppa.g.ch = ch->ch_mmgr_id;
 
-        cmd->ppa.g.pg = pg;
-
-        if (cmdtype != MMGR_ERASE_BLK)
-            buf = pl_vec[pl];
+        /* TODO: RAID 1 among all LUNs in the channel */
+        cmd[pl].ppa.g.lun = 0;
 
-        ret = nvm_submit_sync_io (ch, cmd, buf, cmdtype);
-        if (ret)
-            break;
+        cmd[pl].ppa.g.pg = pg;
     }
-    free(cmd);
 
-    return ret;
+    return nvm_submit_sync_io_vec (ch, cmd, (cmdtype != MMGR_ERASE_BLK) ?
+                                                pl_vec : NULL, cmdtype, n_pl);
 }
 
 static void app_callback_io (struct nvm_mmgr_io_cmd *cmd)
@@ -337,19 +396,109 @@ static int app_submit_io (struct nvm_io_cmd *cmd)
     return appnvm()->lba_io->submit_fn (cmd);
 }
 
+/*
+ * Channels are only queued here, reading the reserved blocks of all
+ * channels is done in parallel by app_init_channels.
+ */
 static int app_init_channel (struct nvm_channel *ch)
 {
-    int ret;
+    struct nvm_channel **pending;
 
-    ret = appnvm()->channels.init_fn (ch, app_nch);
-    if (ret)
-        return ret;
+    pending = realloc (app_ch_pending, sizeof (struct nvm_channel *) *
+                                                       (app_ch_npending + 1));
+    if (!pending)
+        return EMEM;
 
-    app_nch++;
+    app_ch_pending = pending;
+    app_ch_pending[app_ch_npending] = ch;
+    app_ch_npending++;
 
     return 0;
 }
 
+static void *app_init_channel_th (void *arg)
+{
+    uint32_t id;
+
+    for (;;) {
+        id = __atomic_fetch_add (&app_ch_next, 1, __ATOMIC_RELAXED);
+        if (id >= app_ch_npending)
+            break;
+
+        app_ch_ret[id] = appnvm()->channels.init_fn (app_ch_pending[id], id);
+    }
+
+    return NULL;
+}
+
+/* Starts the queued channels, channel IDs follow the queue order */
+static int app_init_channels (void)
+{
+    pthread_t tid[APP_INIT_WORKERS];
+    struct app_channel *lch;
+    int nth, th_i, ch_i, ret = 0;
+
+    if (!app_ch_npending)
+        return 0;
+
+    md_ch_spin = calloc (app_ch_npending, sizeof (pthread_spinlock_t));
+    app_ch_ret = calloc (app_ch_npending, sizeof (int));
+    if (!md_ch_spin || !app_ch_ret) {
+        ret = -1;
+        goto FREE;
+    }
+
+    app_ch_next = 0;
+    nth = MIN(app_ch_npending, APP_INIT_WORKERS);
+
+    for (th_i = 0; th_i < nth; th_i++)
+        if (pthread_create (&tid[th_i], NULL, app_init_channel_th, NULL))
+            break;
+
+    /* Without any worker, the channels are started here */
+    if (!th_i)
+        app_init_channel_th (NULL);
+
+    while (th_i) {
+        th_i--;
+        pthread_join (tid[th_i], NULL);
+    }
+
+    for (ch_i = 0; ch_i < app_ch_npending; ch_i++) {
+        if (app_ch_ret[ch_i]) {
+            log_err ("[appnvm: Channel %d NOT started.]\n",
+                                                  app_ch_pending[ch_i]->ch_id);
+            ret = app_ch_ret[ch_i];
+        }
+    }
+
+    if (ret) {
+        for (ch_i = 0; ch_i < app_ch_npending; ch_i++) {
+            if (app_ch_ret[ch_i])
+                continue;
+            lch = appnvm()->channels.get_fn (app_ch_pending[ch_i]->ch_id);
+            if (lch)
+                appnvm()->channels.exit_fn (lch);
+        }
+        goto FREE;
+    }
+
+    app_nch = app_ch_npending;
+
+FREE:
+    if (ret) {
+        free ((void *) md_ch_spin);
+        md_ch_spin = NULL;
+    }
+    free (app_ch_ret);
+    free (app_ch_pending);
+    app_ch_ret = NULL;
+    app_ch_pending = NULL;
+    app_ch_npending = 0;
+
+    return ret;
+}
+
 static int app_ftl_get_bbtbl (struct nvm_ppa_addr *ppa, uint8_t *bbtbl,
                                                                     uint32_t nb)
 {
@@ -363,7 +512,7 @@ static int app_ftl_get_bbtbl (struct nvm_ppa_addr *ppa, uint8_t *bbtbl,
                                         (ch->geometry->n_of_planes & 0xffff))
         return -1;
 
-    memcpy(bbtbl, &lch->bbtbl->tbl[l_addr], nb);
+    ox_bbt_to_bytes (bbtbl, lch->bbtbl->tbl, l_addr, nb);
 
     return 0;
 }
@@ -371,6 +520,7 @@ static int app_ftl_get_bbtbl (struct nvm_ppa_addr *ppa, uint8_t *bbtbl,
 static int app_ftl_set_bbtbl (struct nvm_ppa_addr *ppa, uint8_t value)
 {
     int l_addr, n_pl, flush, ret;
+    uint8_t state;
     struct app_channel *lch = appnvm()->channels.get_fn (ppa->g.ch);
 
     n_pl = lch->ch->geometry->n_of_planes;
@@ -382,9 +532,11 @@ static int app_ftl_set_bbtbl (struct nvm_ppa_addr *ppa, uint8_t value)
     l_addr = ppa->g.lun * lch->ch->geometry->blk_per_lun * n_pl;
 
     /* flush the table if the value changes */
-    flush = (lch->bbtbl->tbl[l_addr+(ppa->g.blk * n_pl + ppa->g.pl)] == value)
-                                                                        ? 0 : 1;
-    lch->bbtbl->tbl[l_addr + (ppa->g.blk * n_pl + ppa->g.pl)] = value;
+    state = ox_bbt_state (value);
+    flush = (ox_bbt_get (lch->bbtbl->tbl, l_addr +
+                      (ppa->g.blk * n_pl + ppa->g.pl)) == state) ? 0 : 1;
+    ox_bbt_set (lch->bbtbl->tbl, l_addr + (ppa->g.blk * n_pl + ppa->g.pl),
+                                                                        state);
 
     if (flush) {
         ret = appnvm()->bbt->flush_fn(lch);
@@ -417,10 +569,23 @@ static void app_exit (void)
         appnvm()->channels.exit_fn (lch[i]);
         app_nch--;
     }
+
+    /* Channels not started by the global init */
+    free (app_ch_pending);
+    app_ch_pending = NULL;
+    app_ch_npending = 0;
+
+    if (md_ch_spin) {
+        free ((void *)md_ch_spin);
+        md_ch_spin = NULL;
+    }
 }
 
 static int app_global_init (void)
 {
+    if (app_init_channels ())
+        return -1;
+
     if (!app_nch)
         return 0;
 
@@ -447,11 +612,18 @@ static int app_global_init (void)
         goto NS_MUTEX;
     }
 
+    if (app_md_log_start ()) {
+        log_err ("[appnvm: Metadata log NOT started.\n");
+        goto EXIT_GC;
+    }
+
     /* Limit the global namespace size for overprov space */
     core.nvm_ns_size -= core.nvm_ns_size * APPNVM_GC_OVERPROV;
 
     return 0;
 
+EXIT_GC:
+    appnvm()->gc->exit_fn ();
 NS_MUTEX:
     pthread_mutex_destroy (&gc_ns_mutex);
 EXIT_LBA_IO:
@@ -465,14 +637,15 @@ EXIT_GL_PROV:
 
 static void app_global_exit (void)
 {
+    /* LBA I/O first, buffered writes are flushed while GC still runs */
+    appnvm()->lba_io->exit_fn ();
     appnvm()->gc->exit_fn ();
     pthread_mutex_destroy (&gc_ns_mutex);
-    appnvm()->lba_io->exit_fn ();
+
+    /* Before the mapping cache is freed, snapshots are taken at channel exit */
+    app_md_log_stop ();
     appnvm()->gl_map->exit_fn ();
     appnvm()->gl_prov->exit_fn ();
-
-    if (md_ch_spin)
-        free ((void *)md_ch_spin);
 }
 
 static int app_init_fn (uint16_t fn_id, void *arg)
@@ -492,13 +665,123 @@ static void app_exit_fn (uint16_t fn_id)
 {
     switch (fn_id) {
         case APP_FN_GLOBAL:
-            return (gl_fn) ? app_global_exit() : 0;
+            if (gl_fn) {
+                gl_fn = 0;
+                app_global_exit ();
+            }
             break;
         default:
             log_info ("[appnvm (exit_fn): Function not found. id %d\n", fn_id);
     }
 }
 
+/* Reads LBAs through the mapping table, the sectors of a flash page are read
+ * from the media manager once. Unmapped LBAs read as zeros. */
+static int app_lba_read (struct nvm_ftl_lba_read *rd)
+{
+    struct nvm_mmgr_io_cmd cmd;
+    struct nvm_ppa_addr ppa, pg_ppa;
+    struct app_channel *lch;
+    struct nvm_mmgr_geometry *g;
+    uint8_t *pg = NULL;
+    uint64_t cur = AND64;
+    uint32_t i;
+    int ret = 0;
+
+    for (i = 0; i < rd->nlb; i++) {
+        ppa.ppa = appnvm()->gl_map->read_fn (rd->slba + i);
+        if (ppa.ppa == AND64) {
+            ret = -1;
+            break;
+        }
+        if (!ppa.ppa) {
+            memset (rd->buf + (uint64_t) i * rd->sec_sz, 0x0, rd->sec_sz);
+            continue;
+        }
+
+        pg_ppa.ppa = ppa.ppa;
+        pg_ppa.g.sec = 0;
+        lch = appnvm()->channels.get_fn (ppa.g.ch);
+        g = lch->ch->geometry;
+        if (g->sec_size != rd->sec_sz) {
+            ret = -1;
+            break;
+        }
+
+        if (pg_ppa.ppa != cur) {
+            if (!pg) {
+                pg = malloc (g->pg_size + g->pg_oob_sz);
+                if (!pg) {
+                    ret = -1;
+                    break;
+                }
+            }
+            memset (&cmd, 0x0, sizeof (struct nvm_mmgr_io_cmd));
+            cmd.ppa.ppa = pg_ppa.ppa;
+            if (nvm_submit_sync_io (lch->ch, &cmd, pg, MMGR_READ_PG)) {
+                ret = -1;
+                break;
+            }
+            cur = pg_ppa.ppa;
+        }
+        memcpy (rd->buf + (uint64_t) i * rd->sec_sz,
+                                  pg + ppa.g.sec * g->sec_size, g->sec_size);
+    }
+
+    free (pg);
+    return ret;
+}
+
+/* Physical addresses of a LBA range, from the global mapping table */
+static int app_ftl_get_l2ptbl (uint64_t slba, uint32_t nlb, uint64_t *tbl)
+{
+    uint64_t ppa;
+    uint32_t i;
+
+    for (i = 0; i < nlb; i++) {
+        ppa = appnvm()->gl_map->read_fn (slba + i);
+        if (ppa == AND64)
+            return -1;
+        tbl[i] = (ppa) ? ppa : LNVM_LBA_UNMAPPED;
+    }
+
+    return 0;
+}
+
+static int app_call_fn (uint16_t fn_id, void *arg)
+{
+    if (!gl_fn)
+        return -1;
+
+    switch (fn_id) {
+        case FTL_FN_MAP_CACHE_SET:
+            return appnvm()->gl_map->cache_set_fn (*(uint32_t *) arg);
+        case FTL_FN_MAP_CACHE_GET:
+            appnvm()->gl_map->cache_get_fn (
+                                        (struct nvm_ftl_map_cache_st *) arg);
+            return 0;
+        case FTL_FN_DEALLOCATE:
+            return appnvm()->lba_io->trim_fn (
+                                ((struct nvm_ftl_lba_range *) arg)->slba,
+                                ((struct nvm_ftl_lba_range *) arg)->nlb);
+        case FTL_FN_WEAR_GET:
+            if (!appnvm()->gc->wear_fn)
+                return -1;
+            appnvm()->gc->wear_fn ((struct nvm_ftl_wear_st *) arg);
+            return 0;
+        case FTL_FN_GC_GET:
+            if (!appnvm()->gc->stats_fn)
+                return -1;
+            appnvm()->gc->stats_fn ((struct nvm_ftl_gc_st *) arg);
+            return 0;
+        case FTL_FN_LBA_READ:
+            return app_lba_read ((struct nvm_ftl_lba_read *) arg);
+        default:
+            log_info ("[appnvm (call_fn): Function not found. id %d\n", fn_id);
+            return -1;
+    }
+}
+
 int appnvm_mod_set (uint8_t *modset)
 {
     int mod_i;
@@ -600,8 +883,10 @@ struct nvm_ftl_ops app_ops = {
     .exit        = app_exit,
     .get_bbtbl   = app_ftl_get_bbtbl,
     .set_bbtbl   = app_ftl_set_bbtbl,
+    .get_l2ptbl  = app_ftl_get_l2ptbl,
     .init_fn     = app_init_fn,
-    .exit_fn     = app_exit_fn
+    .exit_fn     = app_exit_fn,
+    .call_fn     = app_call_fn
 };
 
 struct nvm_ftl app_ftl = {
@@ -630,18 +915,33 @@ int ftl_appnvm_init (void)
     gl_fn = 0;
     app_nch = 0;
     md_ch_spin = NULL;
+    app_ch_pending = NULL;
+    app_ch_npending = 0;
 
     memset (appnvm()->mod_list, 0x0, sizeof (void *) *
                                            APPNVM_FN_SLOTS * APPNVM_MOD_COUNT);
 
     ftl_appnvm_mod_probe ();
+
+    /* GC victim policy chosen by the user, see APPFTL_GC* */
+    if (core.qemu && core.qemu->gc_policy) {
+        if (core.qemu->gc_policy < APPNVM_FN_SLOTS &&
+                appnvm()->mod_list[APPMOD_GC][core.qemu->gc_policy])
+            modset_appftl[APPMOD_GC] = core.qemu->gc_policy;
+        else
+            log_err ("[appnvm: Unknown GC policy %d, using greedy.]",
+                                                        core.qemu->gc_policy);
+    }
+
     if (appnvm_mod_set (modset_appftl))
         return -1;
 
     app_ftl.cap |= 1 << FTL_CAP_GET_BBTBL;
     app_ftl.cap |= 1 << FTL_CAP_SET_BBTBL;
+    app_ftl.cap |= 1 << FTL_CAP_GET_L2PTBL;
     app_ftl.cap |= 1 << FTL_CAP_INIT_FN;
     app_ftl.cap |= 1 << FTL_CAP_EXIT_FN;
+    app_ftl.cap |= 1 << FTL_CAP_CALL_FN;
     app_ftl.bbtbl_format = FTL_BBTBL_BYTE;
 
     return nvm_register_ftl(&app_ftl);
@@ -0,0 +1,569 @@
+/* OX: Open-Channel NVM Express SSD Controller
+ *  - AppNVM Flash Translation Layer (Metadata Log)
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "hw/block/ox-ctrl/include/ssd.h"
+#include "hw/block/ox-ctrl/include/ox-bbt.h"
+#include "appnvm.h"
+
+/*
+ * Block metadata and mapping metadata tables are stored as full snapshots
+ * in their reserved blocks (meta_blk, map_blk). Between snapshots, the
+ * entries changed since the last checkpoint are appended as records to the
+ * log reserved block (log_blk):
+ *
+ *  - Every APPNVM_MD_LOG_INTERVAL, the tables are compared against a shadow
+ *    copy of what is persisted, and only the changed entries are written.
+ *  - Each log page carries the generation of the snapshots it applies to.
+ *    When the log block is full, both snapshots are written with the next
+ *    generation from the shadow copies and the log block is erased.
+ *  - At startup, log pages of the snapshot generation are replayed over the
+ *    loaded tables. A crash in the middle of a compaction leaves snapshots
+ *    of different generations, pages are only applied to the table of the
+ *    same generation.
+ *
+ * Mapping entries are logged with the NVM address of the mapping page, dirty
+ * pages still in the mapping cache are not persisted by the log.
+ */
+
+extern uint16_t             app_nch;
+extern pthread_spinlock_t  *md_ch_spin;
+
+enum app_md_log_rec_types {
+    APP_MD_LOG_END = 0x0,   /* no more records in the plane page */
+    APP_MD_LOG_BLK = 0x1,   /* struct app_blk_md_entry */
+    APP_MD_LOG_MAP = 0x2    /* mapping page PPA (uint64_t) */
+};
+
+struct app_md_log_rec {
+    uint8_t     type;
+    uint32_t    index;
+} __attribute__((packed));
+
+/* Stored in the OOB area of plane 0 */
+struct app_md_log_hdr {
+    uint8_t     magic;  /* APP_MAGIC */
+    uint8_t     rsvd[3];
+    uint32_t    gen;
+    uint32_t    nrec;
+} __attribute__((packed));
+
+struct app_md_log {
+    uint8_t                 enabled;
+    uint8_t                 stale;  /* log and snapshots must be compacted */
+    uint32_t                gen;
+    uint16_t                next_pg;
+    uint8_t                *blk_shadow; /* tables as persisted */
+    struct app_map_entry   *map_shadow;
+    struct app_io_data     *io;     /* page being filled */
+    uint16_t                pl;
+    uint32_t                off;
+    uint32_t                nrec;
+    uint64_t                records;
+    uint64_t                pages;
+    uint64_t                compactions;
+};
+
+static pthread_t            md_log_tid;
+static pthread_mutex_t      md_log_mutex;
+static pthread_cond_t       md_log_cond;
+static uint8_t              md_log_stop;
+static uint8_t              md_log_run; /* mapping cache is running */
+
+static size_t md_log_rec_sz (uint8_t type)
+{
+    switch (type) {
+        case APP_MD_LOG_BLK:
+            return sizeof (struct app_blk_md_entry);
+        case APP_MD_LOG_MAP:
+            return sizeof (uint64_t);
+        default:
+            return 0;
+    }
+}
+
+static void md_log_reset_pg (struct app_md_log *log)
+{
+    memset (log->io->buf, 0, log->io->buf_sz);
+    log->pl = 0;
+    log->off = 0;
+    log->nrec = 0;
+}
+
+/* Writes the page being filled, returns -1 if the log block is full */
+static int md_log_put_pg (struct app_channel *lch)
+{
+    struct app_md_log *log = lch->md_log;
+    struct app_md_log_hdr hdr;
+    int ret;
+
+    if (!log->nrec)
+        return 0;
+
+    if (log->next_pg >= lch->ch->geometry->pg_per_blk)
+        return -1;
+
+    memset (&hdr, 0, sizeof (struct app_md_log_hdr));
+    hdr.magic = APP_MAGIC;
+    hdr.gen = log->gen;
+    hdr.nrec = log->nrec;
+    memcpy (&log->io->buf[log->io->pg_sz], &hdr, sizeof(struct app_md_log_hdr));
+
+    ret = app_io_rsv_blk (lch, MMGR_WRITE_PG, (void **) log->io->pl_vec,
+                                                   lch->log_blk, log->next_pg);
+
+    /* A failed program also takes the page */
+    log->next_pg++;
+    if (ret)
+        return -1;
+
+    log->records += log->nrec;
+    log->pages++;
+    md_log_reset_pg (log);
+
+    return 0;
+}
+
+static int md_log_add (struct app_channel *lch, uint8_t type, uint32_t index,
+                                                                    void *data)
+{
+    struct app_md_log *log = lch->md_log;
+    struct app_md_log_rec rec;
+    size_t sz = sizeof (struct app_md_log_rec) + md_log_rec_sz (type);
+
+    if (log->off + sz > log->io->pg_sz) {
+        log->pl++;
+        log->off = 0;
+    }
+
+    if (log->pl == log->io->n_pl) {
+        if (md_log_put_pg (lch))
+            return -1;
+    }
+
+    rec.type = type;
+    rec.index = index;
+    memcpy (log->io->pl_vec[log->pl] + log->off, &rec,
+                                                sizeof (struct app_md_log_rec));
+    memcpy (log->io->pl_vec[log->pl] + log->off +
+                sizeof (struct app_md_log_rec), data, md_log_rec_sz (type));
+
+    log->off += sz;
+    log->nrec++;
+
+    return 0;
+}
+
+/* Copies a block metadata entry, invalidations are done under md_ch_spin */
+static void md_log_blk_entry (struct app_channel *lch, uint32_t index,
+                                                  struct app_blk_md_entry *ent)
+{
+    struct app_blk_md *md = lch->blk_md;
+
+    pthread_spin_lock (&md_ch_spin[lch->app_ch_id]);
+    memcpy (ent, md->tbl + index * md->entry_sz, sizeof(struct app_blk_md_entry));
+    pthread_spin_unlock (&md_ch_spin[lch->app_ch_id]);
+}
+
+static uint64_t md_log_map_ppa (struct app_channel *lch, uint32_t index)
+{
+    if (md_log_run)
+        return appnvm()->gl_map->md_ppa_fn (lch, index);
+
+    return ((struct app_map_entry *) lch->map_md->tbl)[index].ppa;
+}
+
+static void md_log_refresh_shadow (struct app_channel *lch)
+{
+    struct app_md_log *log = lch->md_log;
+    uint32_t i;
+
+    for (i = 0; i < lch->blk_md->entries; i++)
+        md_log_blk_entry (lch, i, (struct app_blk_md_entry *)
+                          (log->blk_shadow + i * lch->blk_md->entry_sz));
+
+    for (i = 0; i < lch->map_md->entries; i++) {
+        log->map_shadow[i].lba =
+                            ((struct app_map_entry *) lch->map_md->tbl)[i].lba;
+        log->map_shadow[i].ppa = md_log_map_ppa (lch, i);
+    }
+}
+
+/*
+ * Writes both snapshots from the shadow copies with the next generation,
+ * then erases the log block. If it fails, the log is kept stale and the
+ * compaction is retried at the next checkpoint.
+ */
+static int md_log_compact (struct app_channel *lch)
+{
+    struct app_md_log *log = lch->md_log;
+    struct app_blk_md blk_hdr;
+    struct app_map_md map_hdr;
+    uint32_t gen = log->gen + 1;
+
+    log->stale = 1;
+    md_log_reset_pg (log);
+    md_log_refresh_shadow (lch);
+
+    memcpy (&map_hdr, lch->map_md, sizeof (struct app_map_md));
+    map_hdr.magic = APP_MAGIC;
+    map_hdr.gen = gen;
+
+    if (app_rsv_tbl_flush (lch, lch->map_blk, (uint8_t *) log->map_shadow,
+                        lch->map_md->entries, sizeof (struct app_map_entry),
+                        &map_hdr, sizeof (struct app_map_md)))
+        goto ERR;
+
+    memcpy (&blk_hdr, lch->blk_md, sizeof (struct app_blk_md));
+    blk_hdr.magic = APP_MAGIC;
+    blk_hdr.gen = gen;
+
+    if (app_rsv_tbl_flush (lch, lch->meta_blk, log->blk_shadow,
+                    lch->blk_md->entries, sizeof (struct app_blk_md_entry),
+                    &blk_hdr, sizeof (struct app_blk_md)))
+        goto ERR;
+
+    if (app_io_rsv_blk (lch, MMGR_ERASE_BLK, NULL, lch->log_blk, 0))
+        goto ERR;
+
+    log->gen = gen;
+    log->next_pg = 0;
+    log->stale = 0;
+    log->compactions++;
+    lch->blk_md->gen = gen;
+    lch->map_md->gen = gen;
+
+    return 0;
+
+ERR:
+    log_err ("[appnvm (md_log): Compaction failed. Ch %d]", lch->ch->ch_id);
+    return -1;
+}
+
+/**
+ * Appends the metadata entries changed since the last checkpoint.
+ * Only called by the checkpoint thread, or while no I/O is running.
+ * @return 0 on success, negative if metadata is not persisted
+ */
+int app_md_log_append (struct app_channel *lch)
+{
+    struct app_md_log *log = lch->md_log;
+    struct app_blk_md_entry ent;
+    struct app_blk_md *md = lch->blk_md;
+    uint8_t *shadow;
+    uint64_t ppa;
+    uint32_t i;
+
+    if (!log || !log->enabled)
+        return 0;
+
+    if (log->stale)
+        return md_log_compact (lch);
+
+    for (i = 0; i < md->entries; i++) {
+        md_log_blk_entry (lch, i, &ent);
+        shadow = log->blk_shadow + i * md->entry_sz;
+
+        if (!memcmp (shadow, &ent, sizeof (struct app_blk_md_entry)))
+            continue;
+
+        if (md_log_add (lch, APP_MD_LOG_BLK, i, &ent))
+            goto COMPACT;
+        memcpy (shadow, &ent, sizeof (struct app_blk_md_entry));
+    }
+
+    for (i = 0; i < lch->map_md->entries; i++) {
+        ppa = md_log_map_ppa (lch, i);
+        if (log->map_shadow[i].ppa == ppa)
+            continue;
+
+        if (md_log_add (lch, APP_MD_LOG_MAP, i, &ppa))
+            goto COMPACT;
+        log->map_shadow[i].ppa = ppa;
+    }
+
+    if (md_log_put_pg (lch))
+        goto COMPACT;
+
+    return 0;
+
+COMPACT:
+    /* The log block is full or a page failed, the shadow copies are ahead */
+    return md_log_compact (lch);
+}
+
+/* Applies the records of a log page to the tables of the same generation */
+static int md_log_replay_pg (struct app_channel *lch, struct app_io_data *io,
+                                                                  uint32_t gen)
+{
+    struct app_md_log_rec rec;
+    uint32_t pl, off;
+    size_t sz;
+    uint8_t *pg;
+    uint8_t blk = (gen == lch->blk_md->gen);
+    uint8_t map = (gen == lch->map_md->gen);
+
+    for (pl = 0; pl < io->n_pl; pl++) {
+        pg = io->pl_vec[pl];
+        off = 0;
+
+        while (off + sizeof (struct app_md_log_rec) <= io->pg_sz) {
+            memcpy (&rec, pg + off, sizeof (struct app_md_log_rec));
+            if (rec.type == APP_MD_LOG_END)
+                break;
+
+            sz = md_log_rec_sz (rec.type);
+            off += sizeof (struct app_md_log_rec);
+            if (!sz || off + sz > io->pg_sz)
+                return -1;
+
+            if (rec.type == APP_MD_LOG_BLK && blk &&
+                                            rec.index < lch->blk_md->entries)
+                memcpy (lch->blk_md->tbl + rec.index * lch->blk_md->entry_sz,
+                                                                pg + off, sz);
+
+            if (rec.type == APP_MD_LOG_MAP && map &&
+                                            rec.index < lch->map_md->entries)
+                memcpy (&((struct app_map_entry *)
+                                  lch->map_md->tbl)[rec.index].ppa, pg + off, sz);
+
+            off += sz;
+        }
+    }
+
+    return 0;
+}
+
+static int md_log_replay (struct app_channel *lch)
+{
+    struct app_md_log *log = lch->md_log;
+    struct app_io_data *io = log->io;
+    struct app_md_log_hdr hdr;
+    uint32_t replayed = 0;
+    int pg, ret = 0;
+
+    for (pg = 0; pg < lch->ch->geometry->pg_per_blk; pg++) {
+        memset (io->buf, 0, io->buf_sz);
+        ret = app_io_rsv_blk (lch, MMGR_READ_PG, (void **) io->pl_vec,
+                                                             lch->log_blk, pg);
+
+        /* get info from OOB area in plane 0 */
+        memcpy (&hdr, &io->buf[io->pg_sz], sizeof(struct app_md_log_hdr));
+
+        if (ret || hdr.magic != APP_MAGIC)
+            break;
+
+        /* Pages of an older generation, or of a single table after an
+         * interrupted compaction. The log must be compacted. */
+        if (hdr.gen != lch->blk_md->gen || hdr.gen != lch->map_md->gen)
+            log->stale = 1;
+
+        if (md_log_replay_pg (lch, io, hdr.gen)) {
+            log_err ("[appnvm (md_log): Broken log page %d. Ch %d]", pg,
+                                                                lch->ch->ch_id);
+            log->stale = 1;
+            break;
+        }
+        replayed++;
+    }
+
+    log->next_pg = pg;
+    md_log_reset_pg (log);
+
+    if (replayed)
+        log_info ("    [appnvm: Metadata log: %d pages replayed. Ch %d]\n",
+                                                     replayed, lch->ch->ch_id);
+
+    return ret;
+}
+
+/**
+ * Replays the log over the loaded block metadata and mapping metadata
+ * snapshots. The log is disabled if the bad block table does not reserve
+ * the log block (table created by an older layout).
+ */
+int app_md_log_init (struct app_channel *lch)
+{
+    struct app_md_log *log;
+    uint32_t n_pl = lch->ch->geometry->n_of_planes;
+
+    log = calloc (1, sizeof (struct app_md_log));
+    if (!log)
+        return -1;
+
+    lch->md_log = log;
+
+    if (ox_bbt_get (lch->bbtbl->tbl, lch->log_blk * n_pl) != OX_BBT_RSV) {
+        log_info ("    [appnvm: Metadata log disabled, block %d is not "
+                          "reserved. Ch %d]\n", lch->log_blk, lch->ch->ch_id);
+        return 0;
+    }
+
+    log->io = app_alloc_pg_io (lch);
+    if (!log->io)
+        goto FREE_LOG;
+
+    log->blk_shadow = malloc (lch->blk_md->entry_sz * lch->blk_md->entries);
+    if (!log->blk_shadow)
+        goto FREE_IO;
+
+    log->map_shadow = malloc (sizeof (struct app_map_entry) *
+                                                        lch->map_md->entries);
+    if (!log->map_shadow)
+        goto FREE_BLK;
+
+    if (md_log_replay (lch))
+        goto FREE_MAP;
+
+    log->enabled = 1;
+    log->gen = lch->blk_md->gen;
+    if (lch->blk_md->gen != lch->map_md->gen) {
+        log->gen = MAX(lch->blk_md->gen, lch->map_md->gen);
+        log->stale = 1;
+    }
+
+    /* A compaction failure here is retried at the next checkpoint */
+    if (log->stale)
+        md_log_compact (lch);
+    else
+        md_log_refresh_shadow (lch);
+
+    log_info ("    [appnvm: Metadata log started. Generation %d, page %d. "
+                         "Ch %d]\n", log->gen, log->next_pg, lch->ch->ch_id);
+
+    return 0;
+
+FREE_MAP:
+    free (log->map_shadow);
+FREE_BLK:
+    free (log->blk_shadow);
+FREE_IO:
+    app_free_pg_io (log->io);
+FREE_LOG:
+    free (log);
+    lch->md_log = NULL;
+    log_err ("[appnvm ERR: Ch %d -> Metadata log not replayed.]\n",
+                                                                lch->ch->ch_id);
+    return -1;
+}
+
+/* Snapshots written at exit start a new generation of the log */
+void app_md_log_next_gen (struct app_channel *lch)
+{
+    struct app_md_log *log = lch->md_log;
+
+    if (!log || !log->enabled)
+        return;
+
+    lch->blk_md->gen = log->gen + 1;
+    lch->map_md->gen = log->gen + 1;
+}
+
+/**
+ * Frees the log. If both snapshots were written at exit, the log block is
+ * erased and the next startup has nothing to replay.
+ */
+void app_md_log_exit (struct app_channel *lch, uint8_t flushed)
+{
+    struct app_md_log *log = lch->md_log;
+
+    if (!log)
+        return;
+
+    if (log->enabled) {
+        if (flushed && app_io_rsv_blk (lch, MMGR_ERASE_BLK, NULL,
+                                                            lch->log_blk, 0))
+            log_err ("[appnvm (md_log): Log block not erased. Ch %d]",
+                                                                lch->ch->ch_id);
+
+        log_info (" [appnvm: Metadata log: %lu records, %lu pages, "
+                    "%lu compactions. Ch %d]", log->records, log->pages,
+                    log->compactions, lch->ch->ch_id);
+
+        free (log->map_shadow);
+        free (log->blk_shadow);
+        app_free_pg_io (log->io);
+    }
+
+    free (log);
+    lch->md_log = NULL;
+}
+
+static void *md_log_th (void *arg)
+{
+    struct app_channel *lch[app_nch];
+    struct timespec ts;
+    int nch, ch_i;
+
+    nch = appnvm()->channels.get_list_fn (lch, app_nch);
+
+    pthread_mutex_lock (&md_log_mutex);
+    while (!md_log_stop) {
+        clock_gettime (CLOCK_REALTIME, &ts);
+        ts.tv_sec += APPNVM_MD_LOG_INTERVAL / SEC64;
+        ts.tv_nsec += (APPNVM_MD_LOG_INTERVAL % SEC64) * 1000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+
+        pthread_cond_timedwait (&md_log_cond, &md_log_mutex, &ts);
+        if (md_log_stop)
+            break;
+        pthread_mutex_unlock (&md_log_mutex);
+
+        for (ch_i = 0; ch_i < nch; ch_i++)
+            if (app_md_log_append (lch[ch_i]))
+                log_err ("[appnvm (md_log): Checkpoint failed. Ch %d]",
+                                                          lch[ch_i]->ch->ch_id);
+
+        pthread_mutex_lock (&md_log_mutex);
+    }
+    pthread_mutex_unlock (&md_log_mutex);
+
+    return NULL;
+}
+
+/* Starts the checkpoint thread, called when the mapping cache is running */
+int app_md_log_start (void)
+{
+    md_log_stop = 0;
+    md_log_run = 1;
+
+    if (pthread_mutex_init (&md_log_mutex, NULL))
+        goto ERR;
+
+    if (pthread_cond_init (&md_log_cond, NULL))
+        goto MUTEX;
+
+    if (pthread_create (&md_log_tid, NULL, md_log_th, NULL))
+        goto COND;
+
+    return 0;
+
+COND:
+    pthread_cond_destroy (&md_log_cond);
+MUTEX:
+    pthread_mutex_destroy (&md_log_mutex);
+ERR:
+    md_log_run = 0;
+    return -1;
+}
+
+void app_md_log_stop (void)
+{
+    pthread_mutex_lock (&md_log_mutex);
+    md_log_stop = 1;
+    pthread_cond_signal (&md_log_cond);
+    pthread_mutex_unlock (&md_log_mutex);
+    pthread_join (md_log_tid, NULL);
+
+    pthread_cond_destroy (&md_log_cond);
+    pthread_mutex_destroy (&md_log_mutex);
+    md_log_run = 0;
+}
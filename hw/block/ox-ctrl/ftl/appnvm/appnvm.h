@@ -35,7 +35,8 @@
 #define APP_RSV_BBT_OFF    0
 #define APP_RSV_META_OFF   1
 #define APP_RSV_MAP_OFF    2
-#define APP_RSV_BLK_COUNT  APP_RSV_BBT_OFF + APP_RSV_META_OFF + APP_RSV_MAP_OFF;
+#define APP_RSV_LOG_OFF    3
+#define APP_RSV_BLK_COUNT  4
 
 #define APP_MAGIC          0x3c
 
@@ -66,6 +67,8 @@ enum {
 #define APPNVM_GC_MAX_BLKS          25
 #define APPNVM_GC_MIN_FREE_BLKS     16
 #define APPNVM_GC_OVERPROV          0.25
+#define APPNVM_WL_DELTA             64      /* max erase count spread per ch */
+#define APPNVM_MD_LOG_INTERVAL      1000000 /* usec between metadata deltas */
 
 /* ------- MODULARIZED DEBUG ------- */
 
@@ -96,6 +99,17 @@ enum app_blk_md_flags {
     APP_BLK_MD_AVLB = (1 << 3)  /* Available: Good block and not reserved */
 };
 
+/*
+ * Write streams of the channel provisioning, each stream writes to its own
+ * open blocks. GC relocated data is usually cold, keeping it apart from the
+ * host writes leaves fewer valid sectors to move in the next GC rounds.
+ */
+enum app_prov_streams {
+    APP_STREAM_HOST  = 0x0,
+    APP_STREAM_GC    = 0x1
+};
+#define APP_STREAM_COUNT    2
+
 enum app_pg_type {
     APP_PG_RESERVED  = 0x0,
     APP_PG_NAMESPACE = 0x1,
@@ -144,8 +158,10 @@ enum appnvm_mod_types {
 /* Front-end LBA I/O modules */
 #define APPFTL_LBA_IO   0x1
 
-/* Garbage Collection modules */
-#define APPFTL_GC       0x1
+/* Garbage Collection modules (victim selection policies) */
+#define APPFTL_GC               0x1   /* greedy, by invalid sectors */
+#define APPFTL_GC_COST_BENEFIT  0x2   /* (1 - u) * age / (1 + u) */
+#define APPFTL_GC_WINDOWED      0x3   /* greedy among the oldest blocks */
 
 enum app_gl_functions {
     APP_FN_GLOBAL   = 0
@@ -167,13 +183,13 @@ struct app_bbtbl {
     uint32_t bb_sz;
     uint32_t bb_count;
     /* This struct is stored on NVM up to this point, *tbl is not stored */
-    uint8_t  *tbl;
+    uint64_t *tbl;      /* packed, see ox-bbt.h */
 };
 
 struct app_pg_oob {
     uint64_t    lba;
     uint8_t     pg_type;
-    uint8_t     rsv[7];
+    uint8_t     rsv[7];     /* last 4 bytes: sector CRC (ox-prot.h) */
 } __attribute__((packed));
 
 struct app_io_data {
@@ -203,6 +219,7 @@ struct app_blk_md {
     uint8_t  magic;
     uint32_t entries;
     size_t   entry_sz;
+    uint32_t gen;       /* metadata log generation of the snapshot */
     /* This struct is stored on NVM up to this point, *tbl is not stored */
     uint8_t  *tbl;
 };
@@ -232,6 +249,7 @@ struct app_map_md {
     uint8_t  magic;
     uint32_t entries;
     size_t   entry_sz;
+    uint32_t gen;       /* metadata log generation of the snapshot */
     uint8_t  *tbl;
     pthread_mutex_t *entry_mutex;
 };
@@ -247,6 +265,9 @@ struct app_channel {
     uint16_t                bbt_blk;  /* Rsvd blk ID for bad block table */
     uint16_t                meta_blk; /* Rsvd blk ID for block metadata */
     uint16_t                map_blk;  /* Rsvd blk ID for mapping metadata */
+    uint16_t                log_blk;  /* Rsvd blk ID for metadata log */
+    struct app_md_log       *md_log;
+    u_atomic_t              prov_sec; /* Sectors provisioned to host writes */
     LIST_ENTRY(app_channel) entry;
 };
 
@@ -260,7 +281,8 @@ typedef int                 (app_ch_get_list)(struct app_channel **, uint16_t);
 typedef int      (app_bbt_create)(struct app_channel *, uint8_t);
 typedef int      (app_bbt_flush) (struct app_channel *);
 typedef int      (app_bbt_load) (struct app_channel *);
-typedef uint8_t *(app_bbt_get) (struct app_channel *, uint16_t);
+typedef uint8_t  (app_bbt_get) (struct app_channel *, uint16_t lun,
+                                                  uint16_t blk, uint8_t pl);
 
 typedef int                      (app_md_create)(struct app_channel *);
 typedef int                      (app_md_flush) (struct app_channel *);
@@ -272,11 +294,12 @@ typedef void                     (app_md_invalidate)(struct app_channel *,
 typedef int  (app_ch_prov_init) (struct app_channel *);
 typedef void (app_ch_prov_exit) (struct app_channel *);
 typedef void (app_ch_prov_check_gc) (struct app_channel *);
+typedef uint32_t (app_ch_prov_free_blks) (struct app_channel *);
 typedef int  (app_ch_prov_put_blk) (struct app_channel *, uint16_t, uint16_t);
 typedef struct app_blk_md_entry *(app_ch_prov_get_blk) (struct app_channel *,
                                                                      uint16_t);
 typedef int  (app_ch_prov_get_ppas)(struct app_channel *, struct nvm_ppa_addr *,
-                                                                     uint16_t);
+                                                            uint16_t, uint8_t);
 
 typedef int                   (app_gl_prov_init) (void);
 typedef void                  (app_gl_prov_exit) (void);
@@ -294,6 +317,11 @@ typedef int         (app_gl_map_upsert) (uint64_t lba, uint64_t ppa);
 typedef uint64_t    (app_gl_map_read) (uint64_t lba);
 typedef int         (app_gl_map_upsert_md) (uint64_t index, uint64_t new_ppa,
                                                               uint64_t old_ppa);
+typedef void        (app_gl_map_prefetch) (uint64_t lba, uint32_t npgs);
+typedef int         (app_gl_map_cache_set) (uint32_t pgs_ch);
+typedef void        (app_gl_map_cache_get) (struct nvm_ftl_map_cache_st *);
+typedef uint64_t    (app_gl_map_md_ppa) (struct app_channel *, uint32_t pg_off);
+typedef int         (app_gl_map_trim) (uint64_t lba, uint32_t nlb);
 
 typedef int  (app_ppa_io_submit) (struct nvm_io_cmd *);
 typedef void (app_ppa_io_callback) (struct nvm_mmgr_io_cmd *);
@@ -302,11 +330,14 @@ typedef int  (app_lba_io_init) (void);
 typedef void (app_lba_io_exit) (void);
 typedef int  (app_lba_io_submit) (struct nvm_io_cmd *);
 typedef void (app_lba_io_callback) (struct nvm_io_cmd *);
+typedef int  (app_lba_io_trim) (uint64_t slba, uint32_t nlb);
 
 typedef int                       (app_gc_init) (void);
 typedef void                      (app_gc_exit) (void);
 typedef struct app_blk_md_entry **(app_gc_target) (struct app_channel *,
                                                                     uint32_t *);
+typedef void                      (app_gc_wear) (struct nvm_ftl_wear_st *);
+typedef void                      (app_gc_stats) (struct nvm_ftl_gc_st *);
 typedef int (app_gc_recycle_blk)(struct app_channel *,struct app_blk_md_entry *,
                                                 uint16_t tid, uint32_t *failed);
 
@@ -342,6 +373,7 @@ struct app_ch_prov {
     app_ch_prov_put_blk     *put_blk_fn;
     app_ch_prov_get_blk     *get_blk_fn;
     app_ch_prov_get_ppas    *get_ppas_fn;
+    app_ch_prov_free_blks   *free_blks_fn;
 };
 
 struct app_gl_prov {
@@ -367,6 +399,11 @@ struct app_gl_map {
     app_gl_map_upsert_md *upsert_md_fn;
     app_gl_map_upsert    *upsert_fn;
     app_gl_map_read      *read_fn;
+    app_gl_map_prefetch  *prefetch_fn;
+    app_gl_map_cache_set *cache_set_fn;
+    app_gl_map_cache_get *cache_get_fn;
+    app_gl_map_md_ppa    *md_ppa_fn;
+    app_gl_map_trim      *trim_fn;
 };
 
 struct app_ppa_io {
@@ -381,6 +418,7 @@ struct app_lba_io {
     app_lba_io_exit     *exit_fn;
     app_lba_io_submit   *submit_fn;
     app_lba_io_callback *callback_fn;
+    app_lba_io_trim     *trim_fn;
 };
 
 struct app_gc {
@@ -389,6 +427,8 @@ struct app_gc {
     app_gc_exit         *exit_fn;
     app_gc_target       *target_fn;
     app_gc_recycle_blk  *recycle_fn;
+    app_gc_wear         *wear_fn;
+    app_gc_stats        *stats_fn;
 };
 
 struct app_global {
@@ -493,6 +533,17 @@ int     app_nvm_seq_transfer (struct app_io_data *io, struct nvm_ppa_addr *ppa,
         uint8_t *user_buf, uint16_t pgs, uint16_t ent_per_pg, uint32_t ent_left,
         size_t entry_sz, uint8_t direction, uint8_t reserved);
 int     app_get_ch_list (struct app_channel **list);
+int     app_rsv_tbl_flush (struct app_channel *lch, uint16_t blk, uint8_t *tbl,
+                uint32_t entries, size_t entry_sz, void *hdr, size_t hdr_sz);
+
+/* ------- METADATA LOG ------- */
+
+int     app_md_log_init (struct app_channel *lch);
+void    app_md_log_exit (struct app_channel *lch, uint8_t flushed);
+void    app_md_log_next_gen (struct app_channel *lch);
+int     app_md_log_append (struct app_channel *lch);
+int     app_md_log_start (void);
+void    app_md_log_stop (void);
 
 /* ------- APPNVM CORE FUNCTIONS ------- */
 
@@ -22,6 +22,7 @@
  */
 
 #include "hw/block/ox-ctrl/include/ssd.h"
+#include "hw/block/ox-ctrl/include/ox-bbt.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -152,13 +153,7 @@ MARK_BLK:
 
 static uint16_t app_count_bb (struct app_channel *lch)
 {
-    int i, bb = 0;
-
-    for (i = 0; i < lch->bbtbl->bb_sz; i++)
-        if (lch->bbtbl->tbl[i] != 0x0)
-            bb++;
-
-    return bb;
+    return ox_bbt_count (lch->bbtbl->tbl, 0, lch->bbtbl->bb_sz);
 }
 
 static int bbt_byte_flush (struct app_channel *lch)
@@ -217,8 +212,8 @@ static int bbt_byte_flush (struct app_channel *lch)
     bbt->bb_count = app_count_bb (lch);
     memcpy (&buf[pg_sz], bbt, sizeof(struct app_bbtbl));
 
-    /* set bad block table */
-    memcpy (buf, bbt->tbl, bbt->bb_sz);
+    /* set bad block table, NVM keeps the byte format */
+    ox_bbt_to_bytes (buf, bbt->tbl, 0, bbt->bb_sz);
 
     ret = app_io_rsv_blk (lch, MMGR_WRITE_PG, buf_vec, lch->bbt_blk, pg);
 
@@ -240,14 +235,14 @@ static int bbt_byte_create (struct app_channel *lch, uint8_t type)
     if (!bbt_tmp)
         return -1;
 
-    memset (bbt->tbl, 0, bbt->bb_sz);
+    memset (bbt->tbl, 0, ox_bbt_size (bbt->bb_sz));
 
     /* Set FTL reserved bad blocks */
     for (rsv = 0; rsv < ch->ftl_rsv * n_pl; rsv++){
         l_addr = ch->ftl_rsv_list[rsv].g.lun * ch->geometry->blk_per_lun * n_pl;
         b_addr = ch->ftl_rsv_list[rsv].g.blk * n_pl;
         pl_addr = ch->ftl_rsv_list[rsv].g.pl;
-        bbt->tbl[l_addr + b_addr + pl_addr] = NVM_BBT_DMRK;
+        ox_bbt_set (bbt->tbl, l_addr + b_addr + pl_addr, OX_BBT_RSV);
     }
 
     /* Set MMGR reserved bad blocks */
@@ -255,7 +250,7 @@ static int bbt_byte_create (struct app_channel *lch, uint8_t type)
         l_addr = ch->mmgr_rsv_list[rsv].g.lun * ch->geometry->blk_per_lun*n_pl;
         b_addr = ch->mmgr_rsv_list[rsv].g.blk * n_pl;
         pl_addr = ch->mmgr_rsv_list[rsv].g.pl;
-        bbt->tbl[l_addr + b_addr + pl_addr] = NVM_BBT_DMRK;
+        ox_bbt_set (bbt->tbl, l_addr + b_addr + pl_addr, OX_BBT_RSV);
     }
 
     printf(" [appnvm: Channel %d. Creating bad block table...]", ch->ch_id);
@@ -282,7 +277,7 @@ static int bbt_byte_create (struct app_channel *lch, uint8_t type)
         l_addr = bbt_tmp[i].g.lun * ch->geometry->blk_per_lun * n_pl;
         b_addr = bbt_tmp[i].g.blk * n_pl;
         pl_addr = bbt_tmp[i].g.pl;
-        bbt->tbl[l_addr + b_addr + pl_addr] = NVM_BBT_DMRK;
+        ox_bbt_set (bbt->tbl, l_addr + b_addr + pl_addr, OX_BBT_RSV);
     }
 
     return 0;
@@ -327,7 +322,7 @@ static int bbt_byte_load (struct app_channel *lch)
             break;
 
         /* copy bad block table to channel */
-        memcpy(bbt->tbl, buf, bbt->bb_sz);
+        ox_bbt_from_bytes (bbt->tbl, buf, 0, bbt->bb_sz);
 
         pg++;
     } while (pg < ch->geometry->pg_per_blk);
@@ -351,16 +346,17 @@ OUT:
     return ret;
 }
 
-static uint8_t *bbt_byte_get (struct app_channel *lch, uint16_t lun)
+/* State of a plane-block, OX_BBT_GOOD if the block can be used */
+static uint8_t bbt_byte_get (struct app_channel *lch, uint16_t lun,
+                                                    uint16_t blk, uint8_t pl)
 {
-    struct app_bbtbl *bbt = lch->bbtbl;
-    size_t lun_sz = sizeof (uint8_t) * lch->ch->geometry->blk_per_lun *
-                                                lch->ch->geometry->n_of_planes;
+    struct nvm_mmgr_geometry *geo = lch->ch->geometry;
 
-    if (!bbt->tbl)
-        return NULL;
+    if (!lch->bbtbl->tbl)
+        return OX_BBT_BAD;
 
-    return bbt->tbl + (lun * lun_sz);
+    return ox_bbt_get (lch->bbtbl->tbl, (lun * geo->blk_per_lun + blk) *
+                                                      geo->n_of_planes + pl);
 }
 
 static struct app_global_bbt appftl_bbt = {
@@ -51,6 +51,7 @@ static int blk_md_load (struct app_channel *lch)
 {
     int pg;
     struct app_blk_md *md = lch->blk_md;
+    struct app_blk_md nvm_md;
     struct nvm_ppa_addr ppa;
 
     struct app_io_data *io = app_alloc_pg_io(lch);
@@ -93,6 +94,10 @@ static int blk_md_load (struct app_channel *lch)
                             md->entries, sizeof(struct app_blk_md_entry),
                             APP_TRANS_FROM_NVM, APP_IO_RESERVED))
                 goto ERR;
+
+        /* get the snapshot generation from OOB area in plane 0 */
+        memcpy (&nvm_md, &io->buf[io->pg_sz], sizeof(struct app_blk_md));
+        md->gen = nvm_md.gen;
     }
 
     md->magic = 0;
@@ -108,58 +113,13 @@ ERR:
 
 static int blk_md_flush (struct app_channel *lch)
 {
-    int pg;
     struct app_blk_md *md = lch->blk_md;
-    struct nvm_ppa_addr ppa;
-
-    struct app_io_data *io = app_alloc_pg_io(lch);
-    if (io == NULL)
-        return -1;
-
-    /* single page planes might be padded to avoid broken entries */
-    uint16_t ent_per_pg = (io->pg_sz /
-                                   sizeof (struct app_blk_md_entry)) * io->n_pl;
-    uint16_t md_pgs = md->entries / ent_per_pg;
-    if (md->entries % ent_per_pg > 0)
-        md_pgs++;
-
-    if (md_pgs > io->ch->geometry->pg_per_blk) {
-        log_err("[appnvm ERR: Ch %d -> Maximum Block Metadata: %d bytes\n",
-                       io->ch->ch_id, io->pg_sz * io->ch->geometry->pg_per_blk);
-        goto ERR;
-    }
-
-    pg = app_blk_current_page (lch, io, lch->meta_blk, md_pgs);
-    if (pg < 0)
-        goto ERR;
-
-    if (pg >= io->ch->geometry->pg_per_blk - md_pgs) {
-        if (app_io_rsv_blk (lch, MMGR_ERASE_BLK, NULL, lch->meta_blk, 0))
-            goto ERR;
-        pg = 0;
-    }
 
     md->magic = APP_MAGIC;
-    memset (io->buf, 0, io->buf_sz);
-
-    /* set info to OOB area */
-    memcpy (&io->buf[io->pg_sz], md, sizeof(struct app_blk_md));
 
     /* flush the block metadata table to nvm */
-    ppa.g.pg = pg;
-    ppa.g.blk = lch->meta_blk;
-
-    if (app_nvm_seq_transfer (io, &ppa, md->tbl, md_pgs, ent_per_pg,
-                            md->entries, sizeof(struct app_blk_md_entry),
-                            APP_TRANS_TO_NVM, APP_IO_RESERVED))
-        goto ERR;
-
-    app_free_pg_io(io);
-    return 0;
-
-ERR:
-    app_free_pg_io(io);
-    return -1;
+    return app_rsv_tbl_flush (lch, lch->meta_blk, md->tbl, md->entries,
+                    sizeof(struct app_blk_md_entry), md, sizeof(struct app_blk_md));
 }
 
 static struct app_blk_md_entry *blk_md_get (struct app_channel *lch,
@@ -53,6 +53,7 @@ static int ch_map_load (struct app_channel *lch)
 {
     int pg;
     struct app_map_md *md = lch->map_md;
+    struct app_map_md nvm_md;
     struct nvm_ppa_addr ppa;
 
     struct app_io_data *io = app_alloc_pg_io(lch);
@@ -94,6 +95,10 @@ static int ch_map_load (struct app_channel *lch)
                             md->entries, sizeof(struct app_map_entry),
                             APP_TRANS_FROM_NVM, APP_IO_RESERVED))
                 goto ERR;
+
+        /* get the snapshot generation from OOB area in plane 0 */
+        memcpy (&nvm_md, &io->buf[io->pg_sz], sizeof(struct app_map_md));
+        md->gen = nvm_md.gen;
     }
 
     md->magic = 0;
@@ -109,57 +114,13 @@ ERR:
 
 static int ch_map_flush (struct app_channel *lch)
 {
-    int pg;
     struct app_map_md *md = lch->map_md;
-    struct nvm_ppa_addr ppa;
-
-    struct app_io_data *io = app_alloc_pg_io(lch);
-    if (io == NULL)
-        return -1;
-
-    /* single page planes might be padded to avoid broken entries */
-    uint16_t ent_per_pg = (io->pg_sz / sizeof(struct app_map_entry)) * io->n_pl;
-    uint16_t md_pgs = md->entries / ent_per_pg;
-    if (md->entries % ent_per_pg > 0)
-        md_pgs++;
-
-    if (md_pgs > io->ch->geometry->pg_per_blk) {
-        log_err("[appnvm ERR: Ch %d -> Maximum Mapping Metadata: %d bytes\n",
-                       io->ch->ch_id, io->pg_sz * io->ch->geometry->pg_per_blk);
-        goto ERR;
-    }
-
-    pg = app_blk_current_page (lch, io, lch->map_blk, md_pgs);
-    if (pg < 0)
-        goto ERR;
-
-    if (pg >= io->ch->geometry->pg_per_blk - md_pgs) {
-        if (app_io_rsv_blk (lch, MMGR_ERASE_BLK, NULL, lch->map_blk, 0))
-            goto ERR;
-        pg = 0;
-    }
 
     md->magic = APP_MAGIC;
-    memset (io->buf, 0, io->buf_sz);
-
-    /* set info to OOB area */
-    memcpy (&io->buf[io->pg_sz], md, sizeof(struct app_map_md));
 
     /* flush the mapping metadata table to nvm */
-    ppa.g.pg = pg;
-    ppa.g.blk = lch->map_blk;
-
-    if (app_nvm_seq_transfer (io, &ppa, md->tbl, md_pgs, ent_per_pg,
-                            md->entries, sizeof(struct app_map_entry),
-                            APP_TRANS_TO_NVM, APP_IO_RESERVED))
-        goto ERR;
-
-    app_free_pg_io(io);
-    return 0;
-
-ERR:
-    app_free_pg_io(io);
-    return -1;
+    return app_rsv_tbl_flush (lch, lch->map_blk, md->tbl, md->entries,
+                    sizeof(struct app_map_entry), md, sizeof(struct app_map_md));
 }
 
 static struct app_map_entry *ch_map_get (struct app_channel *lch, uint32_t off)
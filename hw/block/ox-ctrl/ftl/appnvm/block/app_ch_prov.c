@@ -33,23 +33,45 @@
 
 #define APP_PROV_LINE   4
 
+/*
+ * Block allocation is per LUN, without channel-wide locks:
+ *  - Free blocks of a LUN are kept in a min-heap by erase count, protected
+ *    by its own mutex. The least worn free block is taken first (dynamic
+ *    wear leveling), blocks with the same count are taken in random order.
+ *    Cold blocks holding static data are moved by GC (static wear leveling).
+ *  - Open blocks of a LUN are kept in a list protected by the LUN mutex.
+ *  - Each stream has APP_PROV_WRITERS lines, each line is the open-block
+ *    cursor of the writer threads mapped to it, with its own mutex. A line
+ *    owns its blocks, so writers of different lines never share a block.
+ *    Lines are opened at the first write, unused lines take no blocks.
+ */
+#define APP_PROV_WRITERS    4
+
+struct ch_prov_line;
+
 struct ch_prov_blk {
     struct nvm_ppa_addr             addr;
     struct app_blk_md_entry         *blk_md;
     uint8_t                         *state;
-    CIRCLEQ_ENTRY(ch_prov_blk)      entry;
+    struct ch_prov_line             *line;   /* line using it, NULL if none */
     TAILQ_ENTRY(ch_prov_blk)        open_entry;
 };
 
+struct ch_prov_heap {
+    struct ch_prov_blk            **vblks;
+    uint32_t                        n;
+    uint32_t                        size;
+    pthread_mutex_t                 mutex;
+};
+
 struct ch_prov_lun {
     struct nvm_ppa_addr     addr;
     struct ch_prov_blk      *vblks;
-    uint32_t                nfree_blks;
-    uint32_t                nused_blks;
-    uint32_t                nopen_blks;
+    struct ch_prov_heap     free_heap;
+    u_atomic_t              nfree_blks;
+    u_atomic_t              nused_blks;
+    uint32_t                nopen_blks; /* protected by l_mutex */
     pthread_mutex_t         l_mutex;
-    CIRCLEQ_HEAD(free_blk_list, ch_prov_blk) free_blk_head;
-    CIRCLEQ_HEAD(used_blk_list, ch_prov_blk) used_blk_head;
     TAILQ_HEAD(open_blk_list, ch_prov_blk) open_blk_head;
 };
 
@@ -57,124 +79,203 @@ struct ch_prov_line {
     uint16_t              nblks;
     uint16_t              current_blk;
     struct ch_prov_blk  **vblks;
+    pthread_mutex_t       mutex;
 };
 
 struct ch_prov {
     struct ch_prov_lun  *luns;
     struct ch_prov_blk  **prov_vblks;
-    struct ch_prov_line line;
-    pthread_mutex_t     ch_mutex;
+    struct ch_prov_line line[APP_STREAM_COUNT][APP_PROV_WRITERS];
 };
 
-static struct ch_prov_blk *ch_prov_blk_rand (struct app_channel *lch,
-                                                                       int lun)
+/* Writer threads are numbered at their first write, 0 means not numbered */
+static __thread uint16_t    prov_writer;
+static u_atomic_t           prov_nwriters;
+
+static int ch_prov_heap_init (struct ch_prov_heap *h, uint32_t size)
 {
-    int blk, blk_idx;
-    struct ch_prov_blk *vblk, *tmp;
-    struct ch_prov *prov = (struct ch_prov *) lch->ch_prov;
+    h->vblks = malloc (sizeof (struct ch_prov_blk *) * size);
+    if (!h->vblks)
+        return -1;
 
-    if (prov->luns[lun].nfree_blks > 0) {
-        blk_idx = rand() % prov->luns[lun].nfree_blks;
-        vblk = CIRCLEQ_FIRST(&(prov->luns[lun].free_blk_head));
+    if (pthread_mutex_init (&h->mutex, NULL)) {
+        free (h->vblks);
+        return -1;
+    }
 
-        for (blk = 0; blk < blk_idx; blk++) {
-            tmp = CIRCLEQ_NEXT(vblk, entry);
-            vblk = tmp;
-        }
+    h->n = 0;
+    h->size = size;
+
+    return 0;
+}
+
+static void ch_prov_heap_exit (struct ch_prov_heap *h)
+{
+    pthread_mutex_destroy (&h->mutex);
+    free (h->vblks);
+}
+
+static inline uint32_t ch_prov_heap_key (struct ch_prov_heap *h, uint32_t i)
+{
+    return h->vblks[i]->blk_md->erase_count;
+}
+
+static inline void ch_prov_heap_swap (struct ch_prov_heap *h, uint32_t a,
+                                                                    uint32_t b)
+{
+    struct ch_prov_blk *vblk = h->vblks[a];
+
+    h->vblks[a] = h->vblks[b];
+    h->vblks[b] = vblk;
+}
+
+/* Returns 0 if the block is in the heap, or -1 if heap is full */
+static int ch_prov_heap_push (struct ch_prov_heap *h, struct ch_prov_blk *vblk)
+{
+    uint32_t i, parent;
+
+    pthread_mutex_lock (&h->mutex);
+    if (h->n == h->size) {
+        pthread_mutex_unlock (&h->mutex);
+        return -1;
+    }
+
+    i = h->n++;
+    h->vblks[i] = vblk;
+    while (i) {
+        parent = (i - 1) / 2;
+        if (ch_prov_heap_key (h, parent) <= ch_prov_heap_key (h, i))
+            break;
+        ch_prov_heap_swap (h, parent, i);
+        i = parent;
+    }
+    pthread_mutex_unlock (&h->mutex);
+
+    return 0;
+}
+
+/* Returns the free block with the lowest erase count, or NULL if none */
+static struct ch_prov_blk *ch_prov_heap_pop (struct ch_prov_heap *h)
+{
+    struct ch_prov_blk *vblk;
+    uint32_t i = 0, l, min;
 
-        return vblk;
+    pthread_mutex_lock (&h->mutex);
+    if (!h->n) {
+        pthread_mutex_unlock (&h->mutex);
+        return NULL;
+    }
+
+    vblk = h->vblks[0];
+    h->vblks[0] = h->vblks[--h->n];
+    for (;;) {
+        l = 2 * i + 1;
+        if (l >= h->n)
+            break;
+        min = (l + 1 < h->n && ch_prov_heap_key (h, l + 1) <
+                                        ch_prov_heap_key (h, l)) ? l + 1 : l;
+        if (ch_prov_heap_key (h, i) <= ch_prov_heap_key (h, min))
+            break;
+        ch_prov_heap_swap (h, i, min);
+        i = min;
     }
-    return NULL;
+    pthread_mutex_unlock (&h->mutex);
+
+    return vblk;
 }
 
+/* Returns 1 if the block is free, 0 if it is in use, negative if bad */
 static int ch_prov_blk_alloc(struct app_channel *lch, int lun, int blk)
 {
     int pl;
     int bad_blk = 0;
-    struct ch_prov_blk *rnd_vblk;
     int n_pl = lch->ch->geometry->n_of_planes;
     struct ch_prov *prov = (struct ch_prov *) lch->ch_prov;
     struct ch_prov_blk *vblk = &(prov->prov_vblks[lun][blk]);
 
-    uint8_t *bbt = appnvm()->bbt->get_fn (lch, lun);
-
     vblk->state = malloc(sizeof (uint8_t) * n_pl);
     if (vblk->state == NULL)
         return -1;
 
     vblk->addr.ppa = prov->luns[lun].addr.ppa;
     vblk->addr.g.blk = blk;
+    vblk->line = NULL;
     vblk->blk_md = &appnvm()->md->get_fn (lch, lun)[blk];
 
     for (pl = 0; pl < lch->ch->geometry->n_of_planes; pl++) {
-        vblk->state[pl] = bbt[n_pl * blk + pl];
+        vblk->state[pl] = appnvm()->bbt->get_fn (lch, lun, blk, pl);
         bad_blk += vblk->state[pl];
     }
 
-    if (!bad_blk) {
-
-        vblk->blk_md->flags |= APP_BLK_MD_AVLB;
-
-        if (vblk->blk_md->flags & APP_BLK_MD_USED) {
-            CIRCLEQ_INSERT_HEAD(&(prov->luns[lun].used_blk_head), vblk, entry);
-            prov->luns[lun].nused_blks++;
-
-            if (vblk->blk_md->flags & APP_BLK_MD_OPEN) {
-                TAILQ_INSERT_HEAD(&(prov->luns[lun].open_blk_head),
-                                                              vblk, open_entry);
-                prov->luns[lun].nopen_blks++;
-            }
-
-            return 0;
-        }
+    if (bad_blk) {
+        if (vblk->blk_md->flags & APP_BLK_MD_AVLB)
+            vblk->blk_md->flags ^= APP_BLK_MD_AVLB;
+        return -1;
+    }
 
-        rnd_vblk = ch_prov_blk_rand(lch, lun);
+    vblk->blk_md->flags |= APP_BLK_MD_AVLB;
 
-        if (rnd_vblk == NULL) {
-            CIRCLEQ_INSERT_HEAD(&(prov->luns[lun].free_blk_head), vblk, entry);
-        } else {
+    if (vblk->blk_md->flags & APP_BLK_MD_USED) {
+        u_atomic_inc (&prov->luns[lun].nused_blks);
 
-            if (rand() % 2)
-                CIRCLEQ_INSERT_BEFORE(&(prov->luns[lun].free_blk_head),
-                                                rnd_vblk, vblk, entry);
-            else
-                CIRCLEQ_INSERT_AFTER(&(prov->luns[lun].free_blk_head),
-                                                rnd_vblk, vblk, entry);
+        if (vblk->blk_md->flags & APP_BLK_MD_OPEN) {
+            TAILQ_INSERT_HEAD(&(prov->luns[lun].open_blk_head),
+                                                          vblk, open_entry);
+            prov->luns[lun].nopen_blks++;
         }
-        prov->luns[lun].nfree_blks++;
-    } else {
 
-        if (vblk->blk_md->flags & APP_BLK_MD_AVLB)
-            vblk->blk_md->flags ^= APP_BLK_MD_AVLB;
+        return 0;
     }
 
-    return 0;
+    return 1;
 }
 
 static int ch_prov_list_create(struct app_channel *lch, int lun)
 {
-    int blk;
+    int blk, i, nfree = 0;
     int nblk;
     struct nvm_ppa_addr addr;
     struct ch_prov *prov = (struct ch_prov *) lch->ch_prov;
+    struct ch_prov_lun *p_lun = &prov->luns[lun];
+    struct ch_prov_blk *vblk;
 
     addr.ppa = 0x0;
     addr.g.ch = lch->ch->ch_id;
 
     addr.g.lun = lun;
-    prov->luns[lun].addr.ppa = addr.ppa;
+    p_lun->addr.ppa = addr.ppa;
     nblk = lch->ch->geometry->blk_per_lun;
 
-    prov->luns[lun].nfree_blks = 0;
-    prov->luns[lun].nused_blks = 0;
-    prov->luns[lun].nopen_blks = 0;
-    CIRCLEQ_INIT(&(prov->luns[lun].free_blk_head));
-    CIRCLEQ_INIT(&(prov->luns[lun].used_blk_head));
-    TAILQ_INIT(&(prov->luns[lun].open_blk_head));
-    pthread_mutex_init(&(prov->luns[lun].l_mutex), NULL);
+    struct ch_prov_blk *free_blks[nblk];
+
+    u_atomic_set (&p_lun->nfree_blks, 0);
+    u_atomic_set (&p_lun->nused_blks, 0);
+    p_lun->nopen_blks = 0;
+    TAILQ_INIT(&p_lun->open_blk_head);
+
+    if (ch_prov_heap_init (&p_lun->free_heap, nblk))
+        return -1;
+
+    if (pthread_mutex_init(&p_lun->l_mutex, NULL)) {
+        ch_prov_heap_exit (&p_lun->free_heap);
+        return -1;
+    }
 
     for (blk = 0; blk < nblk; blk++)
-        ch_prov_blk_alloc(lch, lun, blk);
+        if (ch_prov_blk_alloc(lch, lun, blk) > 0)
+            free_blks[nfree++] = &prov->prov_vblks[lun][blk];
+
+    /* Free blocks with the same erase count are taken in random order */
+    for (blk = nfree - 1; blk > 0; blk--) {
+        i = rand() % (blk + 1);
+        vblk = free_blks[blk];
+        free_blks[blk] = free_blks[i];
+        free_blks[i] = vblk;
+    }
+
+    for (blk = 0; blk < nfree; blk++)
+        ch_prov_heap_push (&p_lun->free_heap, free_blks[blk]);
+    u_atomic_set (&p_lun->nfree_blks, nfree);
 
     return 0;
 }
@@ -193,49 +294,28 @@ static void ch_prov_blk_list_free(struct app_channel *lch, int lun)
 {
     int nblk;
     int blk;
-    struct ch_prov_blk *vblk, *tmp;
+    struct ch_prov_blk *vblk;
     struct ch_prov *prov = (struct ch_prov *) lch->ch_prov;
+    struct ch_prov_lun *p_lun = &prov->luns[lun];
 
     nblk = lch->ch->geometry->blk_per_lun;
 
-    if (prov->luns[lun].nfree_blks > 0) {
-        vblk = CIRCLEQ_FIRST(&(prov->luns[lun].free_blk_head));
+    while (ch_prov_heap_pop (&p_lun->free_heap));
+    u_atomic_set (&p_lun->nfree_blks, 0);
+    u_atomic_set (&p_lun->nused_blks, 0);
 
-        for (blk = 0; blk < prov->luns[lun].nfree_blks; blk++) {
-            tmp = CIRCLEQ_NEXT(vblk, entry);
-            CIRCLEQ_REMOVE(&(prov->luns[lun].free_blk_head), vblk, entry);
-            vblk = tmp;
-        }
-    }
-    prov->luns[lun].nfree_blks = 0;
-
-    if (prov->luns[lun].nused_blks > 0) {
-        vblk = CIRCLEQ_FIRST(&(prov->luns[lun].used_blk_head));
-
-        for (blk = 0; blk < prov->luns[lun].nused_blks; blk++) {
-            tmp = CIRCLEQ_NEXT(vblk, entry);
-            CIRCLEQ_REMOVE(&(prov->luns[lun].used_blk_head), vblk, entry);
-            vblk = tmp;
-        }
+    while (!TAILQ_EMPTY(&p_lun->open_blk_head)) {
+        vblk = TAILQ_FIRST(&p_lun->open_blk_head);
+        TAILQ_REMOVE(&p_lun->open_blk_head, vblk, open_entry);
     }
-    prov->luns[lun].nused_blks = 0;
-
-    if (prov->luns[lun].nopen_blks > 0) {
-        vblk = TAILQ_FIRST(&(prov->luns[lun].open_blk_head));
-
-        for (blk = 0; blk < prov->luns[lun].nopen_blks; blk++) {
-            tmp = TAILQ_NEXT(vblk, open_entry);
-            TAILQ_REMOVE(&(prov->luns[lun].open_blk_head), vblk, open_entry);
-            vblk = tmp;
-        }
-    }
-    prov->luns[lun].nopen_blks = 0;
+    p_lun->nopen_blks = 0;
 
     for (blk = 0; blk < nblk; blk++) {
         ch_prov_blk_free(lch, lun, blk);
     }
 
-    pthread_mutex_destroy(&(prov->luns[lun].l_mutex));
+    ch_prov_heap_exit (&p_lun->free_heap);
+    pthread_mutex_destroy(&p_lun->l_mutex);
 }
 
 static int ch_prov_init_luns (struct app_channel *lch)
@@ -316,8 +396,9 @@ static void ch_prov_check_gc (struct app_channel *lch)
 
     for (lun_i = 0; lun_i < lch->ch->geometry->lun_per_ch; lun_i++) {
         p_lun = &prov->luns[lun_i];
-        tot_blk += p_lun->nfree_blks + p_lun->nused_blks;
-        free_blk += p_lun->nfree_blks;
+        tot_blk += u_atomic_read (&p_lun->nfree_blks) +
+                                        u_atomic_read (&p_lun->nused_blks);
+        free_blk += u_atomic_read (&p_lun->nfree_blks);
     }
 
     /* If the channel runs out of blocks, disable channel and leave
@@ -329,82 +410,95 @@ static void ch_prov_check_gc (struct app_channel *lch)
         appnvm_ch_need_gc_set (lch);
 }
 
+/* Free blocks in the channel, read without locking the LUNs */
+static uint32_t ch_prov_free_blks (struct app_channel *lch)
+{
+    uint16_t lun_i;
+    uint32_t free_blk = 0;
+    struct ch_prov *prov = (struct ch_prov *) lch->ch_prov;
+
+    for (lun_i = 0; lun_i < lch->ch->geometry->lun_per_ch; lun_i++)
+        free_blk += u_atomic_read (&prov->luns[lun_i].nfree_blks);
+
+    return free_blk;
+}
+
 /**
  * Gets a new block from a LUN and mark it as open.
  * If the block fails to erase, mark it as bad and try next block.
+ * @param line - Line the block is opened for, NULL if none.
  * @return the pointer to the new open block
  */
 static struct ch_prov_blk *ch_prov_blk_get (struct app_channel *lch,
-                                                                  uint16_t lun)
+                                      uint16_t lun, struct ch_prov_line *line)
 {
     int ret, pl;
     int n_pl = lch->ch->geometry->n_of_planes;
     struct nvm_mmgr_io_cmd *cmd;
     struct ch_prov *prov = (struct ch_prov *) lch->ch_prov;
     struct ch_prov_lun *p_lun = &prov->luns[lun];
+    struct ch_prov_blk *vblk;
+
+    cmd = malloc (sizeof(struct nvm_mmgr_io_cmd));
+    if (!cmd)
+        return NULL;
 
 NEXT:
-    if (p_lun->nfree_blks > 0) {
-        struct ch_prov_blk *vblk = CIRCLEQ_FIRST(&p_lun->free_blk_head);
-
-        CIRCLEQ_REMOVE(&(p_lun->free_blk_head), vblk, entry);
-        CIRCLEQ_INSERT_TAIL(&(p_lun->used_blk_head), vblk, entry);
-        TAILQ_INSERT_HEAD(&(p_lun->open_blk_head), vblk, open_entry);
-
-        p_lun->nfree_blks--;
-        p_lun->nused_blks++;
-        p_lun->nopen_blks++;
-
-        /* Erase the block, if it fails, mark as bad and try next block */
-        cmd = malloc (sizeof(struct nvm_mmgr_io_cmd));
-        if (!cmd)
-            return NULL;
-        for (pl = 0; pl < n_pl; pl++) {
-            memset (cmd, 0x0, sizeof(struct nvm_mmgr_io_cmd));
-            cmd->ppa.ppa = vblk->addr.ppa;
-            cmd->ppa.g.pl = pl;
-
-            ret = nvm_submit_sync_io (lch->ch, cmd, NULL, MMGR_ERASE_BLK);
-            if (ret)
-                break;
-        }
+    vblk = ch_prov_heap_pop (&p_lun->free_heap);
+    if (!vblk) {
         free (cmd);
+        return NULL;
+    }
+    u_atomic_dec (&p_lun->nfree_blks);
+    u_atomic_inc (&p_lun->nused_blks);
+
+    /* Erase the block, if it fails, mark as bad and try next block */
+    for (pl = 0; pl < n_pl; pl++) {
+        memset (cmd, 0x0, sizeof(struct nvm_mmgr_io_cmd));
+        cmd->ppa.ppa = vblk->addr.ppa;
+        cmd->ppa.g.pl = pl;
 
-        vblk->blk_md->erase_count++;
+        ret = nvm_submit_sync_io (lch->ch, cmd, NULL, MMGR_ERASE_BLK);
+        if (ret)
+            break;
+    }
 
-        if (ret) {
-            for (pl = 0; pl < n_pl; pl++)
-                lch->ch->ftl->ops->set_bbtbl (&vblk->addr, NVM_BBT_BAD);
+    vblk->blk_md->erase_count++;
 
-            CIRCLEQ_REMOVE(&(p_lun->used_blk_head), vblk, entry);
-            TAILQ_REMOVE(&(p_lun->open_blk_head), vblk, open_entry);
-            p_lun->nused_blks--;
-            p_lun->nopen_blks--;
+    if (ret) {
+        for (pl = 0; pl < n_pl; pl++)
+            lch->ch->ftl->ops->set_bbtbl (&vblk->addr, NVM_BBT_BAD);
 
-            goto NEXT;
-        }
+        u_atomic_dec (&p_lun->nused_blks);
+        goto NEXT;
+    }
+    free (cmd);
 
-        vblk->blk_md->current_pg = 0;
-        vblk->blk_md->invalid_sec = 0;
-        vblk->blk_md->flags |= (APP_BLK_MD_USED | APP_BLK_MD_OPEN);
-        if (vblk->blk_md->flags & APP_BLK_MD_LINE)
-            vblk->blk_md->flags ^= APP_BLK_MD_LINE;
+    vblk->line = line;
+    vblk->blk_md->current_pg = 0;
+    vblk->blk_md->invalid_sec = 0;
+    vblk->blk_md->flags |= (APP_BLK_MD_USED | APP_BLK_MD_OPEN);
+    if (vblk->blk_md->flags & APP_BLK_MD_LINE)
+        vblk->blk_md->flags ^= APP_BLK_MD_LINE;
 
-        memset (vblk->blk_md->pg_state, 0x0, 1024);
+    memset (vblk->blk_md->pg_state, 0x0, 1024);
 
-        appnvm()->ch_prov->check_gc_fn (lch);
+    pthread_mutex_lock (&p_lun->l_mutex);
+    TAILQ_INSERT_HEAD(&(p_lun->open_blk_head), vblk, open_entry);
+    p_lun->nopen_blks++;
+    pthread_mutex_unlock (&p_lun->l_mutex);
 
-        if (APPNVM_DEBUG_CH_PROV) {
-            printf("[appnvm (ch_prov): blk GET: (%d/%d/%d/%d) - Free: %d,"
-                    " Used: %d, Open: %d]\n", vblk->addr.g.ch, vblk->addr.g.lun,
-                    vblk->addr.g.blk, vblk->blk_md->erase_count,
-                    p_lun->nfree_blks, p_lun->nused_blks, p_lun->nopen_blks);
-        }
+    appnvm()->ch_prov->check_gc_fn (lch);
 
-        return vblk;
+    if (APPNVM_DEBUG_CH_PROV) {
+        printf("[appnvm (ch_prov): blk GET: (%d/%d/%d/%d) - Free: %d,"
+                " Used: %d, Open: %d]\n", vblk->addr.g.ch, vblk->addr.g.lun,
+                vblk->addr.g.blk, vblk->blk_md->erase_count,
+                u_atomic_read (&p_lun->nfree_blks),
+                u_atomic_read (&p_lun->nused_blks), p_lun->nopen_blks);
     }
 
-    return NULL;
+    return vblk;
 }
 
 /**
@@ -423,47 +517,73 @@ static int ch_prov_blk_put(struct app_channel *lch, uint16_t lun, uint16_t blk)
     if (vblk->blk_md->flags & APP_BLK_MD_OPEN)
         return -2;
 
-    pthread_mutex_lock(&prov->ch_mutex);
-
-    if (vblk->blk_md->flags & APP_BLK_MD_USED)
-        vblk->blk_md->flags ^= APP_BLK_MD_USED;
+    vblk->blk_md->flags ^= APP_BLK_MD_USED;
 
     if (vblk->blk_md->flags & APP_BLK_MD_LINE)
         vblk->blk_md->flags ^= APP_BLK_MD_LINE;
 
-    CIRCLEQ_REMOVE(&(p_lun->used_blk_head), &prov->prov_vblks[lun][blk], entry);
-    CIRCLEQ_INSERT_TAIL(&(p_lun->free_blk_head),
-                                           &prov->prov_vblks[lun][blk], entry);
-    p_lun->nfree_blks++;
-    p_lun->nused_blks--;
-
-    pthread_mutex_unlock(&prov->ch_mutex);
+    /* The heap holds all the blocks of the LUN, it is never full */
+    u_atomic_dec (&p_lun->nused_blks);
+    ch_prov_heap_push (&p_lun->free_heap, vblk);
+    u_atomic_inc (&p_lun->nfree_blks);
 
     if (APPNVM_DEBUG_CH_PROV) {
         printf("[appnvm (ch_prov): blk PUT: (%d %d %d) - Free: %d,"
                 " Used: %d, Open: %d]\n", vblk->addr.g.ch, vblk->addr.g.lun,
-                vblk->addr.g.blk, p_lun->nfree_blks, p_lun->nused_blks,
-                                                     p_lun->nopen_blks);
+                vblk->addr.g.blk, u_atomic_read (&p_lun->nfree_blks),
+                u_atomic_read (&p_lun->nused_blks), p_lun->nopen_blks);
     }
 
     return 0;
 }
 
+/* Takes an open block of the LUN not used by any line, or NULL */
+static struct ch_prov_blk *ch_prov_blk_claim (struct ch_prov_lun *p_lun,
+                                                     struct ch_prov_line *line)
+{
+    struct ch_prov_blk *vblk;
+
+    pthread_mutex_lock (&p_lun->l_mutex);
+    TAILQ_FOREACH(vblk, &p_lun->open_blk_head, open_entry) {
+        if (!vblk->line) {
+            vblk->line = line;
+            break;
+        }
+    }
+    pthread_mutex_unlock (&p_lun->l_mutex);
+
+    return vblk;
+}
+
 /**
  * This function collects open blocks from all LUNs using round-robin.
- * It sets the line blocks (used by selecting pages to be written).
+ * It sets the blocks of a line (used by selecting pages to be written).
+ * Open blocks used by another line are not picked.
  * If a LUN has no open block, it opens a new block.
  * If a LUN has no blocks left, the line will be filled with available LUNs.
+ * Called with the line mutex held.
  * @return 0 in success, negative in failure (channel is full)
  */
-static int ch_prov_renew_line (struct app_channel *lch)
+static int ch_prov_renew_line (struct app_channel *lch,
+                                                     struct ch_prov_line *pline)
 {
-    uint32_t lun, targets, i, found, j;
+    uint32_t lun, targets, i, j;
     struct ch_prov_blk *vblk;
     struct ch_prov_blk *line[APP_PROV_LINE];
     struct ch_prov *prov = (struct ch_prov *) lch->ch_prov;
+    struct ch_prov_lun *p_lun;
     uint32_t lflag = 0x0;
 
+    /* Release the current line, its open blocks can be picked again */
+    for (i = 0; i < pline->nblks; i++) {
+        vblk = pline->vblks[i];
+        p_lun = &prov->luns[vblk->addr.g.lun];
+        pthread_mutex_lock (&p_lun->l_mutex);
+        if (vblk->line == pline)
+            vblk->line = NULL;
+        pthread_mutex_unlock (&p_lun->l_mutex);
+    }
+
     /* set all LUNS as available by setting all flags */
     for (lun = 0; lun < lch->ch->geometry->lun_per_ch; lun++)
         lflag |= (uint32_t)(1 << lun);
@@ -479,38 +599,16 @@ static int ch_prov_renew_line (struct app_channel *lch)
         if (!(lflag & (1 << lun)))
             goto NEXT_LUN;
 
-        if (TAILQ_EMPTY(&prov->luns[lun].open_blk_head)) {
-GET_BLK:
-            vblk = ch_prov_blk_get (lch, lun);
-
-            /* LUN has no available blocks, unset flag */
-            if (vblk == NULL) {
-                if (lflag & (1 << lun))
-                    lflag ^= (1 << lun);
-                goto NEXT_LUN;
-            }
-        }
+        vblk = ch_prov_blk_claim (&prov->luns[lun], pline);
+        if (!vblk)
+            vblk = ch_prov_blk_get (lch, lun, pline);
 
-        /* Avoid picking a block already present in the line */
-        TAILQ_FOREACH(vblk, &prov->luns[lun].open_blk_head, open_entry) {
-            if (!(vblk->blk_md->flags & APP_BLK_MD_LINE))
-                break;
-
-            /* Keep current line blocks in the line when renew is recalled */
-            found = 0;
-            for (i = 0; i < targets; i++) {
-                if (line[i] == vblk) {
-                    found = 1;
-                    break;
-                }
-            }
-            if (!found)
-                break;
+        /* LUN has no available blocks, unset flag */
+        if (vblk == NULL) {
+            lflag ^= (1 << lun);
+            goto NEXT_LUN;
         }
 
-        if (!vblk)
-            goto GET_BLK;
-
         line[targets] = vblk;
         line[targets]->blk_md->flags |= APP_BLK_MD_LINE;
         targets++;
@@ -519,7 +617,17 @@ NEXT_LUN:
         lun = (lun == lch->ch->geometry->lun_per_ch - 1) ? 0 : lun + 1;
     } while (targets < APP_PROV_LINE);
 
-    prov->line.nblks = targets;
+    /* Blocks left out of the line stay open for a later line */
+    for (i = 0; i < pline->nblks; i++) {
+        vblk = pline->vblks[i];
+        p_lun = &prov->luns[vblk->addr.g.lun];
+        pthread_mutex_lock (&p_lun->l_mutex);
+        if (!vblk->line && (vblk->blk_md->flags & APP_BLK_MD_LINE))
+            vblk->blk_md->flags ^= APP_BLK_MD_LINE;
+        pthread_mutex_unlock (&p_lun->l_mutex);
+    }
+
+    pline->nblks = targets;
 
     /* Check if line has at least 1 block available */
     if (targets == 0) {
@@ -531,58 +639,79 @@ NEXT_LUN:
 
     /* set the line pointers */
     for (i = 0; i < targets; i++)
-        prov->line.vblks[i] = line[i];
+        pline->vblks[i] = line[i];
 
-    if (prov->line.current_blk >= targets)
-        prov->line.current_blk = 0;
+    if (pline->current_blk >= targets)
+        pline->current_blk = 0;
 
     if (APPNVM_DEBUG_CH_PROV) {
-        printf ("[appnvm (ch_prov): Line is renewed: ");
+        printf ("[appnvm (ch_prov): Line %p is renewed: ", pline);
         for (j = 0; j < targets; j++)
-            printf ("(%d %d %d)", prov->line.vblks[j]->addr.g.ch,
-                                   prov->line.vblks[j]->addr.g.lun,
-                                   prov->line.vblks[j]->addr.g.blk);
+            printf ("(%d %d %d)", pline->vblks[j]->addr.g.ch,
+                                   pline->vblks[j]->addr.g.lun,
+                                   pline->vblks[j]->addr.g.blk);
         printf("]\n");
     }
 
     return 0;
 }
 
+static void ch_prov_free_lines (struct ch_prov *prov, uint32_t nlines)
+{
+    struct ch_prov_line *pline;
+
+    while (nlines) {
+        nlines--;
+        pline = &prov->line[nlines / APP_PROV_WRITERS]
+                                                [nlines % APP_PROV_WRITERS];
+        pthread_mutex_destroy (&pline->mutex);
+        free (pline->vblks);
+    }
+}
+
 static int ch_prov_init (struct app_channel *lch)
 {
+    uint32_t line_i;
+    struct ch_prov_line *pline;
     struct ch_prov *prov = malloc (sizeof (struct ch_prov));
     if (!prov)
         return -1;
 
-    if (pthread_mutex_init(&prov->ch_mutex, NULL))
-        goto FREE_PROV;
-
     lch->ch_prov = prov;
     if (ch_prov_init_luns (lch))
-        goto MUTEX;
+        goto FREE_PROV;
 
-    prov->line.current_blk = 0;
-    prov->line.vblks = malloc (sizeof (struct ch_prov_blk *) * APP_PROV_LINE);
-    if (!prov->line.vblks)
-        goto FREE_LUNS;
+    /* Lines are renewed at the first write */
+    for (line_i = 0; line_i < APP_STREAM_COUNT * APP_PROV_WRITERS; line_i++) {
+        pline = &prov->line[line_i / APP_PROV_WRITERS]
+                                                [line_i % APP_PROV_WRITERS];
+        pline->nblks = 0;
+        pline->current_blk = 0;
+        pline->vblks = malloc (sizeof (struct ch_prov_blk *) * APP_PROV_LINE);
+        if (!pline->vblks)
+            goto FREE_LINES;
+
+        if (pthread_mutex_init (&pline->mutex, NULL)) {
+            free (pline->vblks);
+            goto FREE_LINES;
+        }
+    }
 
-    if (ch_prov_renew_line (lch)) {
+    if (!ch_prov_free_blks (lch)) {
         log_err ("[appnvm (ch_prov): CHANNEL %d is FULL!]\n",lch->ch->ch_id);
         if (APPNVM_DEBUG_CH_PROV)
             printf ("[appnvm (ch_prov): CHANNEL %d is FULL!]\n",lch->ch->ch_id);
-        goto FREE_BLKS;
+        goto FREE_LINES;
     }
 
-    log_info("    [appnvm: Channel Provisioning started. Ch %d]\n",
-                                                                lch->ch->ch_id);
+    log_info("    [appnvm: Channel Provisioning started. Ch %d, %d streams, "
+                      "%d writers]\n", lch->ch->ch_id, APP_STREAM_COUNT,
+                      APP_PROV_WRITERS);
     return 0;
 
-FREE_BLKS:
-    free (prov->line.vblks);
-FREE_LUNS:
+FREE_LINES:
+    ch_prov_free_lines (prov, line_i);
     ch_prov_exit_luns (lch);
-MUTEX:
-    pthread_mutex_destroy (&prov->ch_mutex);
 FREE_PROV:
     free (prov);
     return -1;
@@ -592,26 +721,41 @@ static void ch_prov_exit (struct app_channel *lch)
 {
     struct ch_prov *prov = (struct ch_prov *) lch->ch_prov;
 
-    free (prov->line.vblks);
+    ch_prov_free_lines (prov, APP_STREAM_COUNT * APP_PROV_WRITERS);
     ch_prov_exit_luns (lch);
-    pthread_mutex_destroy (&prov->ch_mutex);
     free (prov);
 }
 
+/* Line of the calling thread in the stream */
+static struct ch_prov_line *ch_prov_writer_line (struct ch_prov *prov,
+                                                                uint8_t stream)
+{
+    uint16_t id = prov_writer;
+
+    if (!id) {
+        u_atomic_inc (&prov_nwriters);
+        id = prov_writer = (uint16_t) u_atomic_read (&prov_nwriters);
+    }
+
+    return &prov->line[stream][(id - 1) % APP_PROV_WRITERS];
+}
+
 /**
  * Returns a list of PPAs to be written based in the current block line. The
  * pages are collected using round-robin, and the PPAs in a page are collected
  * following write constraints (sequential sectors and planes). The minimum
- * number of PPAs returned is 'pgs * sec_per_pg * n_planes'. We assume 1 thread
- * per channel and no form of locking is needed.
+ * number of PPAs returned is 'pgs * sec_per_pg * n_planes'. Each writer
+ * thread uses the line it is mapped to, only writers of the same line wait
+ * for each other.
  *
  * @param list - Vector of PPAs. Needs enough allocated memory for
  *                                          'pgs * sec_per_pg * n_planes' PPAs.
  * @param pgs - Number of PPAs requested.
+ * @param stream - Write stream (APP_STREAM_*), selects the lines.
  * @return 0 in success, negative in failure (channel is full).
  */
 static int ch_prov_get_ppas (struct app_channel *lch, struct nvm_ppa_addr *list,
-                                                                uint16_t pgs)
+                                                uint16_t pgs, uint8_t stream)
 {
     uint16_t *li;
     uint32_t sec, pl, renew, pgs_left;
@@ -621,18 +765,23 @@ static int ch_prov_get_ppas (struct app_channel *lch, struct nvm_ppa_addr *list,
     struct ch_prov_lun *p_lun;
     struct ch_prov *prov = (struct ch_prov *) lch->ch_prov;
     struct nvm_mmgr_geometry *g = lch->ch->geometry;
+    struct ch_prov_line *pline;
 
-    /* Check if device is full (no blocks in the line) */
-    if (prov->line.nblks < 1)
+    if (stream >= APP_STREAM_COUNT)
         return -1;
+    pline = ch_prov_writer_line (prov, stream);
+
+    pthread_mutex_lock(&pline->mutex);
 
-    pthread_mutex_lock(&prov->ch_mutex);
+    /* Check if device is full (no blocks in the line) */
+    if (pline->nblks < 1 && ch_prov_renew_line (lch, pline))
+        goto FULL;
 
-    li = &prov->line.current_blk;
+    li = &pline->current_blk;
     renew = 0;
     pgs_left = pgs;
     while (pgs_left) {
-        blk = prov->line.vblks[*li];
+        blk = pline->vblks[*li];
         ppa_off = &list[g->n_of_planes * g->sec_per_pg * (pgs - pgs_left)];
 
         tppa.ppa = blk->addr.ppa;
@@ -656,41 +805,44 @@ static int ch_prov_get_ppas (struct app_channel *lch, struct nvm_ppa_addr *list,
         if (blk->blk_md->current_pg == g->pg_per_blk) {
             p_lun = &prov->luns[tppa.g.lun];
 
+            pthread_mutex_lock (&p_lun->l_mutex);
             TAILQ_REMOVE(&p_lun->open_blk_head, blk, open_entry);
             p_lun->nopen_blks--;
+            blk->line = NULL;
 
             if (blk->blk_md->flags & APP_BLK_MD_LINE)
                 blk->blk_md->flags ^= APP_BLK_MD_LINE;
             if (blk->blk_md->flags & APP_BLK_MD_OPEN)
                 blk->blk_md->flags ^= APP_BLK_MD_OPEN;
+            pthread_mutex_unlock (&p_lun->l_mutex);
 
             renew = 1;
         }
 
-        *li = (*li < prov->line.nblks - 1) ? *li + 1 : 0;
+        *li = (*li < pline->nblks - 1) ? *li + 1 : 0;
 
         /* Renew the line if a block has been closed */
         if ((*li == 0 || pgs_left == 0) && renew) {
             renew = 0;
-            if (ch_prov_renew_line (lch)) {
+            if (ch_prov_renew_line (lch, pline)) {
                 if (pgs_left > 0)
                     goto FULL;
             }
         }
     }
 
-    pthread_mutex_unlock(&prov->ch_mutex);
+    pthread_mutex_unlock(&pline->mutex);
     return 0;
 
 FULL:
-    pthread_mutex_unlock(&prov->ch_mutex);
+    pthread_mutex_unlock(&pline->mutex);
     return -1;
 }
 
 static struct app_blk_md_entry *ch_prov_get_blk (struct app_channel *lch,
                                                                   uint16_t lun)
 {
-    struct ch_prov_blk *blk = ch_prov_blk_get (lch, lun);
+    struct ch_prov_blk *blk = ch_prov_blk_get (lch, lun, NULL);
     if (!blk)
         return NULL;
 
@@ -704,10 +856,11 @@ static struct app_ch_prov appftl_ch_prov = {
     .check_gc_fn  = ch_prov_check_gc,
     .put_blk_fn   = ch_prov_blk_put,
     .get_blk_fn   = ch_prov_get_blk,
-    .get_ppas_fn  = ch_prov_get_ppas
+    .get_ppas_fn  = ch_prov_get_ppas,
+    .free_blks_fn = ch_prov_free_blks
 };
 
 void ch_prov_register (void)
 {
     appnvm_mod_register (APPMOD_CH_PROV, APPFTL_CH_PROV, &appftl_ch_prov);
-}
\ No newline at end of file
+}
@@ -29,31 +29,107 @@
 #include <time.h>
 #include <stdint.h>
 #include <string.h>
+#include <float.h>
 #include "hw/block/ox-ctrl/include/ssd.h"
 
-#define APP_GC_PARALLEL_CH   1
+/* Channels recycled at the same time, up to half of the channels */
+#define APP_GC_PARALLEL_CH   4
 #define APP_GC_DELAY_US      10000
 #define APP_GC_DELAY_CH_BUSY 1000
 
+/*
+ * Each channel has a token bucket in sectors moved by GC. The bucket is
+ * refilled by the channel host writes (APP_GC_RATE_WR tokens per sector) and
+ * by time (APP_GC_RATE_IDLE tokens per second), up to APP_GC_BUCKET_BLKS
+ * blocks. A victim is recycled when the bucket holds its valid sectors, or
+ * right away if the channel is below APPNVM_GC_MIN_FREE_BLKS free blocks.
+ */
+#define APP_GC_RATE_WR       4
+#define APP_GC_RATE_IDLE     8192
+#define APP_GC_BUCKET_BLKS   2
+
+/*
+ * Victim policies are GC modules sharing this file, only the target function
+ * differs. Blocks are aged by the channel host write clock (prov_sec): the
+ * age of a full block is the number of sectors the host wrote to the channel
+ * since the block was first seen full. Ages are kept in memory only.
+ *
+ * The windowed-greedy policy picks greedily among the oldest 1/APP_GC_WINDOW
+ * of the candidates, at least APPNVM_GC_MAX_BLKS.
+ *
+ * Blocks with no valid sector left (overwritten or deallocated by the host)
+ * cost no copy, all the policies take them first.
+ */
+#define APP_GC_POLICIES      4   /* highest GC module id + 1 */
+#define APP_GC_WINDOW        4
+
+/*
+ * Static wear leveling. Blocks are taken by the lowest erase count, so blocks
+ * holding cold data are left behind. Every APP_GC_WL_DELAY_US each channel
+ * checks its erase counts, if the least erased full block is more than
+ * APPNVM_WL_DELTA erases behind the most erased block, its data is moved
+ * and the block goes back to the free blocks. One block per check, paced by
+ * the token bucket as any victim.
+ */
+#define APP_GC_WL_DELAY_US   1000000
+
 extern uint16_t              app_nch;
 static struct app_channel  **ch;
 static pthread_t             check_th;
 static uint8_t               stop;
 static struct app_io_data ***gc_buf;
 static uint16_t              buf_pg_sz, buf_oob_sz, buf_npg;
+static uint16_t              gc_nbuf; /* concurrent channels, one buf each */
+static uint8_t              *gc_buf_used;
+static uint16_t              gc_nrun;
 
-static uint32_t gc_recycled_blks;
+static uint32_t gc_recycled_blks, gc_wl_moves;
 static uint64_t gc_moved_sec, gc_pad_sec, gc_err_sec, gc_wro_sec, gc_map_pgs;
 
-pthread_mutex_t *gc_cond_mutex;
-pthread_cond_t  *gc_cond;
+static uint32_t           **gc_age;       /* per ch/blk, full stamp, 0: none */
+static uint32_t            *gc_host_last; /* per ch, prov_sec last accounted */
+
+/* Write amplification per policy, host and GC written sectors */
+struct gc_policy_st {
+    const char *name;
+    uint64_t    host_sec;
+    uint64_t    gc_sec;
+};
+
+static struct gc_policy_st gc_pol[APP_GC_POLICIES] = {
+    [APPFTL_GC]              = { .name = "greedy" },
+    [APPFTL_GC_COST_BENEFIT] = { .name = "cost-benefit" },
+    [APPFTL_GC_WINDOWED]     = { .name = "windowed-greedy" },
+};
+static uint8_t gc_pol_id;
+
+struct gc_cand {
+    struct app_blk_md_entry *blk;
+    double                   score;
+};
+
+/* Scheduling state is protected by gc_mutex, gc_cond[ch] wakes a channel */
+static pthread_mutex_t  gc_mutex;
+static pthread_cond_t   gc_sched_cond;
+pthread_cond_t         *gc_cond;
 
 struct gc_th_arg {
     uint16_t            tid;
     uint16_t            bufid;
+    uint8_t             run;
+    uint8_t             wl;         /* check the channel wear on this run */
     struct app_channel *lch;
+
+    /* Token bucket */
+    int64_t             tokens;
+    int64_t             max_tokens;
+    uint32_t            last_sec;   /* prov_sec at the last refill */
+    uint64_t            last_ns;
+    uint64_t            throttled;  /* victims delayed by the bucket */
 };
 
+#define GC_STAT_ADD(v,n)    __atomic_fetch_add (&(v), (n), __ATOMIC_RELAXED)
+
 static int gc_bucket_sort (struct app_blk_md_entry **list,
                     uint32_t list_sz, uint32_t n_buckets, uint32_t min_invalid)
 {
@@ -99,63 +175,191 @@ FREE:
     return ret;
 }
 
-static struct app_blk_md_entry **gc_get_target_blks (struct app_channel *lch,
-                                                                   uint32_t *c)
+/*
+ * Collects the full blocks with invalid sectors and their age, also returns
+ * the minimum of invalid sectors for targeting a block.
+ */
+static struct gc_cand *gc_get_cand (struct app_channel *lch, uint32_t *c,
+                                                            uint32_t *min_inv)
 {
-    int nblks;
+    struct nvm_mmgr_geometry *geo = lch->ch->geometry;
     struct app_blk_md_entry *lun;
-    struct app_blk_md_entry **list = NULL;
-    uint32_t lun_i, blk_i, min_inv;
-    float count = 0, avlb = 0, inv_rate;
+    struct gc_cand *list;
+    uint32_t lun_i, blk_i, now, *stamp, count = 0;
+    float avlb = 0, inv_rate;
 
-    for (lun_i = 0; lun_i < lch->ch->geometry->lun_per_ch; lun_i++) {
+    list = malloc (sizeof (struct gc_cand) * geo->lun_per_ch *
+                                                            geo->blk_per_lun);
+    if (!list)
+        goto ERR;
+
+    now = (uint32_t) u_atomic_read (&lch->prov_sec);
+
+    for (lun_i = 0; lun_i < geo->lun_per_ch; lun_i++) {
 
         lun = appnvm()->md->get_fn (lch, lun_i);
-        if (!lun) {
-            *c = 0;
-            return NULL;
-        }
+        if (!lun)
+            goto FREE;
 
-        for (blk_i = 0; blk_i < lch->ch->geometry->blk_per_lun; blk_i++) {
+        for (blk_i = 0; blk_i < geo->blk_per_lun; blk_i++) {
 
             if (!(lun[blk_i].flags & APP_BLK_MD_AVLB))
                 continue;
+            avlb++;
 
-            if (    (lun[blk_i].flags & APP_BLK_MD_USED) &&
-                   !(lun[blk_i].flags & APP_BLK_MD_OPEN) &&
-                     lun[blk_i].current_pg == lch->ch->geometry->pg_per_blk &&
-                     lun[blk_i].invalid_sec > 0) {
-
-                count += 1;
-                list = realloc(list, sizeof(struct app_blk_md_entry *) *
-                                                                   (int) count);
-                if (!list)
-                    goto FREE;
-                list[(int)count - 1] = &lun[blk_i];
+            stamp = &gc_age[lch->app_ch_id][lun_i * geo->blk_per_lun + blk_i];
+
+            if (   !(lun[blk_i].flags & APP_BLK_MD_USED) ||
+                    (lun[blk_i].flags & APP_BLK_MD_OPEN) ||
+                     lun[blk_i].current_pg != geo->pg_per_blk) {
+                *stamp = 0;
+                continue;
             }
-            avlb++;
+
+            if (!*stamp)
+                *stamp = (now) ? now : 1;
+
+            if (!lun[blk_i].invalid_sec)
+                continue;
+
+            list[count].blk = &lun[blk_i];
+            list[count].score = (lun[blk_i].invalid_sec >= geo->sec_per_blk) ?
+                                DBL_MAX : (double) (uint32_t) (now - *stamp);
+            count++;
         }
     }
 
     /* Compute minimum of invalid pages for targeting a block */
-    min_inv = lch->ch->geometry->pg_per_blk * APPNVM_GC_TARGET_RATE;
-    inv_rate = 1.0 - ((count / avlb - APPNVM_GC_THRESD) /
+    *min_inv = geo->pg_per_blk * APPNVM_GC_TARGET_RATE;
+    inv_rate = 1.0 - (((float) count / avlb - APPNVM_GC_THRESD) /
                                                      (1.0 - APPNVM_GC_THRESD));
-    if ((count / avlb) >= APPNVM_GC_THRESD)
-        min_inv *= inv_rate;
+    if (((float) count / avlb) >= APPNVM_GC_THRESD)
+        *min_inv *= inv_rate;
+
+    *c = count;
+    return list;
+
+FREE:
+    free (list);
+ERR:
+    *c = 0;
+    return NULL;
+}
+
+static int gc_cand_cmp (const void *a, const void *b)
+{
+    double sa = ((const struct gc_cand *) a)->score;
+    double sb = ((const struct gc_cand *) b)->score;
+
+    return (sa < sb) - (sa > sb);
+}
+
+/* Takes up to APPNVM_GC_MAX_BLKS victims, in the candidates order */
+static struct app_blk_md_entry **gc_cand_victims (struct gc_cand *cand,
+                                uint32_t count, uint32_t min_inv, uint32_t *c)
+{
+    struct app_blk_md_entry **list;
+    uint32_t blk_i, k = 0;
+
+    list = malloc (sizeof (struct app_blk_md_entry *) * APPNVM_GC_MAX_BLKS);
+    if (!list)
+        goto OUT;
+
+    for (blk_i = 0; blk_i < count && k < APPNVM_GC_MAX_BLKS; blk_i++)
+        if (cand[blk_i].blk->invalid_sec >= min_inv)
+            list[k++] = cand[blk_i].blk;
+
+    if (!k) {
+        free (list);
+        list = NULL;
+    }
+
+OUT:
+    free (cand);
+    *c = k;
+    return list;
+}
+
+static struct app_blk_md_entry **gc_get_target_blks (struct app_channel *lch,
+                                                                   uint32_t *c)
+{
+    int nblks;
+    struct gc_cand *cand;
+    struct app_blk_md_entry **list;
+    uint32_t blk_i, count, min_inv;
+
+    *c = 0;
+    cand = gc_get_cand (lch, &count, &min_inv);
+    if (!cand)
+        return NULL;
+
+    list = malloc (sizeof (struct app_blk_md_entry *) * (count + 1));
+    if (!list) {
+        free (cand);
+        return NULL;
+    }
+
+    for (blk_i = 0; blk_i < count; blk_i++)
+        list[blk_i] = cand[blk_i].blk;
+    free (cand);
 
     nblks = gc_bucket_sort(list, count, lch->ch->geometry->sec_per_blk,min_inv);
-    if (nblks <= 0)
-        goto FREE;
+    if (nblks <= 0) {
+        free (list);
+        return NULL;
+    }
 
     *c = nblks;
     return list;
+}
+
+/* Cleaning cost-benefit, old blocks with few valid sectors go first */
+static struct app_blk_md_entry **gc_get_target_cb (struct app_channel *lch,
+                                                                   uint32_t *c)
+{
+    struct gc_cand *cand;
+    uint32_t blk_i, count, min_inv;
+    double u, sec_per_blk = lch->ch->geometry->sec_per_blk;
 
-FREE:
-    if (count > 1)
-        free (list);
     *c = 0;
-    return NULL;
+    cand = gc_get_cand (lch, &count, &min_inv);
+    if (!cand)
+        return NULL;
+
+    for (blk_i = 0; blk_i < count; blk_i++) {
+        if (cand[blk_i].score == DBL_MAX)
+            continue;
+        u = (sec_per_blk - cand[blk_i].blk->invalid_sec) / sec_per_blk;
+        cand[blk_i].score = (1.0 - u) * (cand[blk_i].score + 1.0) / (1.0 + u);
+    }
+    qsort (cand, count, sizeof (struct gc_cand), gc_cand_cmp);
+
+    return gc_cand_victims (cand, count, min_inv, c);
+}
+
+/* Greedy among the oldest blocks, hot blocks get time to invalidate more */
+static struct app_blk_md_entry **gc_get_target_win (struct app_channel *lch,
+                                                                   uint32_t *c)
+{
+    struct gc_cand *cand;
+    uint32_t blk_i, count, min_inv, win;
+
+    *c = 0;
+    cand = gc_get_cand (lch, &count, &min_inv);
+    if (!cand)
+        return NULL;
+
+    qsort (cand, count, sizeof (struct gc_cand), gc_cand_cmp);
+
+    win = MAX(count / APP_GC_WINDOW, APPNVM_GC_MAX_BLKS);
+    if (win > count)
+        win = count;
+
+    for (blk_i = 0; blk_i < win; blk_i++)
+        cand[blk_i].score = cand[blk_i].blk->invalid_sec;
+    qsort (cand, win, sizeof (struct gc_cand), gc_cand_cmp);
+
+    return gc_cand_victims (cand, win, min_inv, c);
 }
 
 static int gc_check_valid_pg (struct app_channel *lch,
@@ -180,7 +384,8 @@ static int gc_proc_mapping_pg (struct app_channel *lch, struct app_io_data *io,
 {
     struct nvm_ppa_addr ppa_list[lch->ch->geometry->sec_per_pl_pg];
 
-    if (appnvm()->ch_prov->get_ppas_fn (lch, ppa_list, 1))
+    /* Mapping pages are updated often, they go with the host writes */
+    if (appnvm()->ch_prov->get_ppas_fn (lch, ppa_list, 1, APP_STREAM_HOST))
         return -1;
 
     if (app_pg_io (lch, MMGR_WRITE_PG, (void **) io->pl_vec, ppa_list))
@@ -223,11 +428,11 @@ static int gc_read_blk (struct app_channel *lch,
             oob = (struct app_pg_oob *) io->oob_vec[0];
             if (oob->pg_type == APP_PG_MAP) {
                 if (gc_proc_mapping_pg (lch, io, &ppa, oob)) {
-                    gc_err_sec += lch->ch->geometry->sec_per_pl_pg;
+                    GC_STAT_ADD (gc_err_sec, lch->ch->geometry->sec_per_pl_pg);
                     return -1;
                 }
                 nsec += lch->ch->geometry->sec_per_pl_pg;
-                gc_map_pgs++;
+                GC_STAT_ADD (gc_map_pgs, 1);
             }
         }
     }
@@ -244,7 +449,7 @@ static uint8_t gc_process_pg (struct app_channel *lch, struct app_io_data *io,
     uint16_t sec_i = 0, ret = 0;
 
     /* Write page to the same channel to keep the parallelism */
-    if (appnvm()->ch_prov->get_ppas_fn (lch, ppa_list, 1))
+    if (appnvm()->ch_prov->get_ppas_fn (lch, ppa_list, 1, APP_STREAM_GC))
         return ret;
 
     if (app_pg_io (lch, MMGR_WRITE_PG, (void **) io->pl_vec, ppa_list)) {
@@ -299,7 +504,7 @@ static int gc_move_sector (struct app_channel *lch, struct app_io_data *w_io,
             break;
         case APP_PG_PADDING:
             appnvm()->md->invalidate_fn (lch, old_ppa, APP_INVALID_SECTOR);
-            gc_pad_sec++;
+            GC_STAT_ADD (gc_pad_sec, 1);
             return -1;
         case APP_PG_MAP:
         case APP_PG_RESERVED:
@@ -323,7 +528,7 @@ static int gc_move_sector (struct app_channel *lch, struct app_io_data *w_io,
     return 0;
 
 ERR:
-    gc_wro_sec++;
+    GC_STAT_ADD (gc_wro_sec, 1);
     log_info ("[gc: Suspicious data type (%d). LBA %lu, PPA "
             "(%d/%d/%d/%d/%d/%d)\n", sec_oob->pg_type, sec_oob->lba,
             old_ppa->g.ch, old_ppa->g.lun, old_ppa->g.blk,
@@ -418,7 +623,8 @@ static int gc_recycle_blks (struct app_channel *lch,
             log_err ("[appnvm (gc): Read block / move mapping failed.]");
             continue;
         }
-        gc_moved_sec += blk_sec;
+        GC_STAT_ADD (gc_moved_sec, blk_sec);
+        GC_STAT_ADD (gc_pol[gc_pol_id].gc_sec, blk_sec);
         count_sec += blk_sec;
 
         blk_sec = appnvm()->gc->recycle_fn (lch, list[blk_i], tid, &failed_sec);
@@ -436,13 +642,17 @@ static int gc_recycle_blks (struct app_channel *lch,
                         list[blk_i]->ppa.g.blk);
                 goto COUNT;
             }
+            gc_age[lch->app_ch_id][list[blk_i]->ppa.g.lun *
+                                    lch->ch->geometry->blk_per_lun +
+                                    list[blk_i]->ppa.g.blk] = 0;
             recycled++;
-            gc_recycled_blks++;
+            GC_STAT_ADD (gc_recycled_blks, 1);
         }
 
 COUNT:
-        gc_moved_sec += blk_sec;
-        gc_err_sec   += failed_sec;
+        GC_STAT_ADD (gc_moved_sec, blk_sec);
+        GC_STAT_ADD (gc_pol[gc_pol_id].gc_sec, blk_sec);
+        GC_STAT_ADD (gc_err_sec, failed_sec);
         count_sec    += blk_sec;
     }
 
@@ -450,151 +660,421 @@ COUNT:
     return recycled;
 }
 
+static double gc_wa (struct gc_policy_st *pol)
+{
+    return (pol->host_sec) ? (double) (pol->host_sec + pol->gc_sec) /
+                                                (double) pol->host_sec : 0.0;
+}
+
+/* Called by the GC check thread only */
+static void gc_account_host (void)
+{
+    uint16_t ch_i;
+    uint32_t sec;
+
+    for (ch_i = 0; ch_i < app_nch; ch_i++) {
+        sec = (uint32_t) u_atomic_read (&ch[ch_i]->prov_sec);
+        gc_pol[gc_pol_id].host_sec += (uint32_t) (sec - gc_host_last[ch_i]);
+        gc_host_last[ch_i] = sec;
+    }
+}
+
 static void gc_print_stats (struct app_channel *lch, uint32_t recycled,
                                                               uint32_t blk_sec)
 {
     printf (" GC (%d): (%d/%d) %.2f MB, T: (%d/%lu) %.2f MB, "
-            "(M%lu/P%lu/F%lu/W%lu) \n", lch->app_ch_id, recycled, blk_sec,
-            (4.0 * (double) blk_sec) / (double) 1024,
+            "(M%lu/P%lu/F%lu/W%lu) WA %.2f (%s)\n", lch->app_ch_id, recycled,
+            blk_sec, (4.0 * (double) blk_sec) / (double) 1024,
             gc_recycled_blks, gc_moved_sec,
             (4.0 * (double) gc_moved_sec) / (double) 1024,
-            gc_map_pgs, gc_pad_sec, gc_err_sec, gc_wro_sec);
+            gc_map_pgs, gc_pad_sec, gc_err_sec, gc_wro_sec,
+            gc_wa (&gc_pol[gc_pol_id]), gc_pol[gc_pol_id].name);
 }
 
-static void *gc_run_ch (void *arg)
+static uint64_t gc_now_ns (void)
 {
-    uint8_t  loop = 1;
-    uint32_t victims, recycled, blk_sec;
+    struct timespec ts;
 
-    struct gc_th_arg         *th_arg = (struct gc_th_arg *) arg;
-    struct app_channel       *lch = th_arg->lch;
-    struct app_blk_md_entry **list;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-    while (!stop) {
+static void gc_refill (struct gc_th_arg *arg)
+{
+    uint32_t sec = (uint32_t) u_atomic_read (&arg->lch->prov_sec);
+    uint64_t now = gc_now_ns ();
+
+    arg->tokens += (int64_t) (uint32_t) (sec - arg->last_sec) * APP_GC_RATE_WR;
+    arg->tokens += (now - arg->last_ns) * APP_GC_RATE_IDLE / 1000000000;
+    if (arg->tokens > arg->max_tokens)
+        arg->tokens = arg->max_tokens;
+
+    arg->last_sec = sec;
+    arg->last_ns = now;
+}
+
+/* Waits for the tokens of a victim, unless the channel is short of blocks */
+static void gc_throttle (struct gc_th_arg *arg, uint32_t cost)
+{
+    gc_refill (arg);
+    if (arg->tokens < cost)
+        arg->throttled++;
 
-        pthread_mutex_lock(&gc_cond_mutex[th_arg->tid]);
-        pthread_cond_signal(&gc_cond[th_arg->tid]);
-        pthread_cond_wait(&gc_cond[th_arg->tid], &gc_cond_mutex[th_arg->tid]);
-        pthread_mutex_unlock(&gc_cond_mutex[th_arg->tid]);
-        if (stop)
+    while (arg->tokens < cost && !stop) {
+        if (appnvm()->ch_prov->free_blks_fn (arg->lch) <
+                                                      APPNVM_GC_MIN_FREE_BLKS)
             break;
 
-        appnvm_ch_active_unset (lch);
+        usleep (APP_GC_DELAY_CH_BUSY);
+        gc_refill (arg);
+    }
 
-        do {
-            if (!appnvm_ch_nthreads (lch)) {
-                loop = 0;
+    /* Urgent recycling leaves the bucket in debt */
+    arg->tokens -= cost;
+}
 
-                list = appnvm()->gc->target_fn (lch, &victims);
-                if (!list || !victims) {
-                    usleep (APP_GC_DELAY_US);
-                    break;
-                }
+/*
+ * Recycles the victims of the channel one at a time. The channel is only
+ * inactive while a block is recycled, host writes use it between victims.
+ */
+static void gc_recycle_ch (struct gc_th_arg *arg)
+{
+    struct app_channel       *lch = arg->lch;
+    struct nvm_mmgr_geometry *geo = lch->ch->geometry;
+    struct app_blk_md_entry **list;
+    uint32_t victims, blk_i, recycled = 0, blk_sec, tot_sec = 0;
 
-                recycled = gc_recycle_blks (lch, list, victims,
-                                                      th_arg->bufid, &blk_sec);
-                free (list);
-
-                if (recycled != victims)
-                    log_info ("[appnvm (gc): %d recycled, %d with errors.]",
-                                                 recycled, victims - recycled);
-                if (APPNVM_DEBUG_GC)
-                    gc_print_stats (lch, recycled, blk_sec);
-            } else {
-                usleep (APP_GC_DELAY_CH_BUSY);
-            }
-        } while (loop);
+    list = appnvm()->gc->target_fn (lch, &victims);
+    if (!list || !victims)
+        goto NEED_GC;
+
+    for (blk_i = 0; blk_i < victims && !stop; blk_i++) {
+        gc_throttle (arg, geo->sec_per_blk - list[blk_i]->invalid_sec);
+
+        appnvm_ch_active_unset (lch);
+        while (appnvm_ch_nthreads (lch))
+            usleep (APP_GC_DELAY_CH_BUSY);
+
+        recycled += gc_recycle_blks (lch, &list[blk_i], 1, arg->bufid,
+                                                                     &blk_sec);
+        tot_sec += blk_sec;
 
-        appnvm_ch_need_gc_unset (lch);
-        if (victims)
-            appnvm()->ch_prov->check_gc_fn (lch);
         appnvm_ch_active_set (lch);
-    };
+    }
+    free (list);
+
+    if (recycled != blk_i)
+        log_info ("[appnvm (gc): %d recycled, %d with errors.]",
+                                                     recycled, blk_i - recycled);
+    if (APPNVM_DEBUG_GC)
+        gc_print_stats (lch, recycled, tot_sec);
+
+NEED_GC:
+    appnvm_ch_need_gc_unset (lch);
+    if (victims)
+        appnvm()->ch_prov->check_gc_fn (lch);
+}
+
+/* Erase counts of the good blocks and the least erased full block */
+static struct app_blk_md_entry *gc_wear_ch (struct app_channel *lch,
+                        uint32_t *min_ec, uint32_t *max_ec, uint64_t *tot_ec,
+                        uint32_t *nblks)
+{
+    struct nvm_mmgr_geometry *geo = lch->ch->geometry;
+    struct app_blk_md_entry *lun, *cold = NULL;
+    uint32_t lun_i, blk_i;
+
+    for (lun_i = 0; lun_i < geo->lun_per_ch; lun_i++) {
+
+        lun = appnvm()->md->get_fn (lch, lun_i);
+        if (!lun)
+            return NULL;
+
+        for (blk_i = 0; blk_i < geo->blk_per_lun; blk_i++) {
+
+            if (!(lun[blk_i].flags & APP_BLK_MD_AVLB))
+                continue;
+
+            if (!*nblks || lun[blk_i].erase_count < *min_ec)
+                *min_ec = lun[blk_i].erase_count;
+            if (!*nblks || lun[blk_i].erase_count > *max_ec)
+                *max_ec = lun[blk_i].erase_count;
+            *tot_ec += lun[blk_i].erase_count;
+            (*nblks)++;
+
+            if (   !(lun[blk_i].flags & APP_BLK_MD_USED) ||
+                    (lun[blk_i].flags & APP_BLK_MD_OPEN) ||
+                     lun[blk_i].current_pg != geo->pg_per_blk)
+                continue;
+
+            if (!cold || lun[blk_i].erase_count < cold->erase_count)
+                cold = &lun[blk_i];
+        }
+    }
+
+    return cold;
+}
+
+/* Moves the data of the coldest block if the channel wear is uneven */
+static void gc_level_ch (struct gc_th_arg *arg)
+{
+    struct app_channel       *lch = arg->lch;
+    struct nvm_mmgr_geometry *geo = lch->ch->geometry;
+    struct app_blk_md_entry  *cold;
+    uint32_t min_ec, max_ec, nblks = 0, blk_sec;
+    uint64_t tot_ec = 0;
+
+    cold = gc_wear_ch (lch, &min_ec, &max_ec, &tot_ec, &nblks);
+    if (!cold || cold->erase_count + APPNVM_WL_DELTA >= max_ec)
+        return;
+
+    if (appnvm()->ch_prov->free_blks_fn (lch) < APPNVM_GC_MIN_FREE_BLKS)
+        return;
+
+    gc_throttle (arg, geo->sec_per_blk - cold->invalid_sec);
+
+    appnvm_ch_active_unset (lch);
+    while (appnvm_ch_nthreads (lch))
+        usleep (APP_GC_DELAY_CH_BUSY);
+
+    if (gc_recycle_blks (lch, &cold, 1, arg->bufid, &blk_sec))
+        GC_STAT_ADD (gc_wl_moves, 1);
+
+    appnvm_ch_active_set (lch);
+
+    if (APPNVM_DEBUG_GC)
+        log_info ("[appnvm (gc): ch %d, wear leveling: erase count %d/%d, "
+                    "moved %d sectors]", lch->app_ch_id, cold->erase_count,
+                    max_ec, blk_sec);
+}
+
+static void *gc_run_ch (void *arg)
+{
+    struct gc_th_arg *th_arg = (struct gc_th_arg *) arg;
+
+    pthread_mutex_lock (&gc_mutex);
+    while (!stop) {
+        if (!th_arg->run) {
+            pthread_cond_wait (&gc_cond[th_arg->tid], &gc_mutex);
+            continue;
+        }
+        pthread_mutex_unlock (&gc_mutex);
+
+        if (appnvm_ch_need_gc (th_arg->lch))
+            gc_recycle_ch (th_arg);
+        if (th_arg->wl && !stop)
+            gc_level_ch (th_arg);
+
+        pthread_mutex_lock (&gc_mutex);
+        th_arg->run = 0;
+        th_arg->wl = 0;
+        gc_buf_used[th_arg->bufid] = 0;
+        gc_nrun--;
+        pthread_cond_signal (&gc_sched_cond);
+    }
+    pthread_mutex_unlock (&gc_mutex);
 
     return NULL;
 }
 
+/*
+ * Starts GC in the channels that need it or have a wear check pending, while
+ * there are free buffers.
+ */
+static void gc_schedule (struct gc_th_arg *th_arg, uint16_t *cch)
+{
+    uint16_t ch_i, buf_i;
+
+    for (ch_i = 0; ch_i < app_nch && gc_nrun < gc_nbuf; ch_i++) {
+        if (!th_arg[*cch].run && (appnvm_ch_need_gc (ch[*cch]) ||
+                                                         th_arg[*cch].wl)) {
+
+            for (buf_i = 0; gc_buf_used[buf_i]; buf_i++);
+            gc_buf_used[buf_i] = 1;
+            gc_nrun++;
+
+            th_arg[*cch].bufid = buf_i;
+            th_arg[*cch].run = 1;
+            pthread_cond_signal (&gc_cond[*cch]);
+        }
+        *cch = (*cch == app_nch - 1) ? 0 : *cch + 1;
+    }
+}
+
 static void *gc_check_fn (void *arg)
 {
-    uint8_t wait[app_nch];
-    uint16_t cch = 0, sleep = 0, n_run = 0, ch_i, th_i;
+    uint16_t cch = 0, th_i, ch_i;
     pthread_t run_th[app_nch];
     struct gc_th_arg *th_arg;
+    struct timespec ts;
+    uint64_t wl_ns;
 
-    memset (wait, 0x0, sizeof (uint8_t) * app_nch);
-
-    th_arg = malloc (sizeof (struct gc_th_arg) * app_nch);
+    th_arg = calloc (sizeof (struct gc_th_arg), app_nch);
     if (!th_arg)
         return NULL;
 
     for (th_i = 0; th_i < app_nch; th_i++) {
         th_arg[th_i].tid = th_i;
         th_arg[th_i].lch = ch[th_i];
+        th_arg[th_i].max_tokens = (int64_t) ch[th_i]->ch->geometry->sec_per_blk
+                                                        * APP_GC_BUCKET_BLKS;
+        th_arg[th_i].tokens = th_arg[th_i].max_tokens;
+        th_arg[th_i].last_sec = u_atomic_read (&ch[th_i]->prov_sec);
+        th_arg[th_i].last_ns = gc_now_ns ();
 
         if (pthread_create (&run_th[th_i], NULL, gc_run_ch,
                                                        (void *) &th_arg[th_i]))
             goto STOP;
     }
 
+    wl_ns = gc_now_ns ();
+
+    pthread_mutex_lock (&gc_mutex);
     while (!stop) {
-        if (appnvm_ch_need_gc (ch[cch])) {
-
-            th_arg[cch].bufid = n_run;
-            n_run++;
-            sleep++;
-            wait[cch]++;
-
-            pthread_mutex_lock (&gc_cond_mutex[cch]);
-            pthread_cond_signal(&gc_cond[cch]);
-            pthread_mutex_unlock (&gc_cond_mutex[cch]);
-
-            if (n_run == APP_GC_PARALLEL_CH || (cch == app_nch - 1)) {
-                for (ch_i = 0; ch_i < app_nch; ch_i++) {
-                    if (wait[ch_i]) {
-                        pthread_mutex_lock (&gc_cond_mutex[cch]);
-                        pthread_cond_signal(&gc_cond[cch]);
-                        pthread_cond_wait(&gc_cond[cch], &gc_cond_mutex[cch]);
-                        pthread_mutex_unlock (&gc_cond_mutex[cch]);
-                        wait[cch] = 0x0;
-                        n_run--;
-                    }
-                    if (!n_run)
-                        break;
-                }
+        gc_account_host ();
 
-            }
+        if (gc_now_ns () - wl_ns >= (uint64_t) APP_GC_WL_DELAY_US * 1000) {
+            for (ch_i = 0; ch_i < app_nch; ch_i++)
+                if (!th_arg[ch_i].run)
+                    th_arg[ch_i].wl = 1;
+            wl_ns = gc_now_ns ();
         }
 
-        cch = (cch == app_nch - 1) ? 0 : cch + 1;
-        if (!cch) {
-            if (!sleep)
-                usleep (APP_GC_DELAY_US);
-            sleep = 0;
+        gc_schedule (th_arg, &cch);
+
+        /* Wakes up when a channel finishes or to check the flags again */
+        clock_gettime (CLOCK_REALTIME, &ts);
+        ts.tv_nsec += APP_GC_DELAY_US * 1000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
         }
+        pthread_cond_timedwait (&gc_sched_cond, &gc_mutex, &ts);
     }
+    pthread_mutex_unlock (&gc_mutex);
 
 STOP:
+    pthread_mutex_lock (&gc_mutex);
+    stop = 1;
+    for (cch = 0; cch < th_i; cch++)
+        pthread_cond_signal (&gc_cond[cch]);
+    pthread_mutex_unlock (&gc_mutex);
+
     while (th_i) {
         th_i--;
-        pthread_mutex_lock (&gc_cond_mutex[th_i]);
-        pthread_cond_signal(&gc_cond[th_i]);
-        pthread_mutex_unlock (&gc_cond_mutex[th_i]);
         pthread_join (run_th[th_i], NULL);
+        if (APPNVM_DEBUG_GC && th_arg[th_i].throttled)
+            log_info ("[appnvm (gc): ch %d, %lu victims throttled]\n", th_i,
+                                                       th_arg[th_i].throttled);
     }
 
     free (th_arg);
     return NULL;
 }
 
+/* Called by the SMART log, the counts are read without locks */
+static void gc_wear_get (struct nvm_ftl_wear_st *st)
+{
+    uint16_t ch_i;
+    uint32_t min_ec, max_ec, nblks;
+    uint64_t tot_ec = 0;
+
+    memset (st, 0x0, sizeof (struct nvm_ftl_wear_st));
+
+    for (ch_i = 0; ch_i < app_nch; ch_i++) {
+        nblks = 0;
+        gc_wear_ch (ch[ch_i], &min_ec, &max_ec, &tot_ec, &nblks);
+        if (!nblks)
+            continue;
+
+        if (!st->blks || min_ec < st->min_ec)
+            st->min_ec = min_ec;
+        if (max_ec > st->max_ec)
+            st->max_ec = max_ec;
+        st->blks += nblks;
+    }
+
+    if (st->blks)
+        st->avg_ec = tot_ec / st->blks;
+    st->blk_life = ch[0]->ch->geometry->blk_life;
+    st->wl_moves = __atomic_load_n (&gc_wl_moves, __ATOMIC_RELAXED);
+}
+
+/* Called by ox-stats, the counters are read without locks */
+static void gc_stats_get (struct nvm_ftl_gc_st *st)
+{
+    st->recycled_blks = __atomic_load_n (&gc_recycled_blks, __ATOMIC_RELAXED);
+    st->moved_sec = __atomic_load_n (&gc_moved_sec, __ATOMIC_RELAXED);
+    st->pad_sec = __atomic_load_n (&gc_pad_sec, __ATOMIC_RELAXED);
+    st->err_sec = __atomic_load_n (&gc_err_sec, __ATOMIC_RELAXED);
+    st->wro_sec = __atomic_load_n (&gc_wro_sec, __ATOMIC_RELAXED);
+    st->map_pgs = __atomic_load_n (&gc_map_pgs, __ATOMIC_RELAXED);
+    st->wl_moves = __atomic_load_n (&gc_wl_moves, __ATOMIC_RELAXED);
+    st->host_sec = __atomic_load_n (&gc_pol[gc_pol_id].host_sec,
+                                                            __ATOMIC_RELAXED);
+    st->gc_sec = __atomic_load_n (&gc_pol[gc_pol_id].gc_sec,
+                                                            __ATOMIC_RELAXED);
+}
+
+static int gc_alloc_age (void)
+{
+    uint16_t ch_i;
+    struct nvm_mmgr_geometry *geo = ch[0]->ch->geometry;
+
+    gc_host_last = malloc (sizeof (uint32_t) * app_nch);
+    if (!gc_host_last)
+        return -1;
+
+    gc_age = calloc (sizeof (uint32_t *), app_nch);
+    if (!gc_age)
+        goto FREE_LAST;
+
+    for (ch_i = 0; ch_i < app_nch; ch_i++) {
+        gc_age[ch_i] = calloc (sizeof (uint32_t),
+                                         geo->lun_per_ch * geo->blk_per_lun);
+        if (!gc_age[ch_i])
+            goto FREE_AGE;
+        gc_host_last[ch_i] = (uint32_t) u_atomic_read (&ch[ch_i]->prov_sec);
+    }
+
+    return 0;
+
+FREE_AGE:
+    while (ch_i) {
+        ch_i--;
+        free (gc_age[ch_i]);
+    }
+    free (gc_age);
+FREE_LAST:
+    free (gc_host_last);
+    return -1;
+}
+
+static void gc_free_age (void)
+{
+    uint16_t ch_i;
+
+    for (ch_i = 0; ch_i < app_nch; ch_i++)
+        free (gc_age[ch_i]);
+    free (gc_age);
+    free (gc_host_last);
+}
+
 static int gc_alloc_buf (void)
 {
     uint32_t th_i, pg_i;
 
-    gc_buf = malloc (sizeof (void *) * APP_GC_PARALLEL_CH);
+    gc_buf = malloc (sizeof (void *) * gc_nbuf);
     if (!gc_buf)
         return -1;
 
-    for (th_i = 0; th_i < APP_GC_PARALLEL_CH; th_i++) {
+    gc_buf_used = calloc (sizeof (uint8_t), gc_nbuf);
+    if (!gc_buf_used) {
+        free (gc_buf);
+        return -1;
+    }
+
+    for (th_i = 0; th_i < gc_nbuf; th_i++) {
         gc_buf[th_i] = malloc (sizeof (uint8_t *) * buf_npg);
         if (!gc_buf[th_i])
             goto FREE_BUF;
@@ -621,13 +1101,14 @@ FREE_BUF:
             app_free_pg_io (gc_buf[th_i][pg_i]);
         free (gc_buf[th_i]);
     }
+    free (gc_buf_used);
     free (gc_buf);
     return -1;
 }
 
 static void gc_free_buf (void)
 {
-    uint32_t pg_i, th_i = APP_GC_PARALLEL_CH;
+    uint32_t pg_i, th_i = gc_nbuf;
 
     while (th_i) {
         th_i--;
@@ -635,6 +1116,7 @@ static void gc_free_buf (void)
             app_free_pg_io (gc_buf[th_i][pg_i]);
         free (gc_buf[th_i]);
     }
+    free (gc_buf_used);
     free (gc_buf);
 }
 
@@ -651,51 +1133,64 @@ static int gc_init (void)
     if (nch != app_nch)
         goto FREE_CH;
 
-    gc_recycled_blks = 0;
+    gc_recycled_blks = gc_wl_moves = 0;
     gc_moved_sec = gc_pad_sec = gc_err_sec = gc_wro_sec = gc_map_pgs = 0;
 
+    gc_pol_id = appnvm()->gc->mod_id;
+    gc_pol[gc_pol_id].host_sec = gc_pol[gc_pol_id].gc_sec = 0;
+    if (gc_alloc_age ())
+        goto FREE_CH;
+
     geo = ch[0]->ch->geometry;
     buf_pg_sz = geo->pg_size;
     buf_oob_sz = geo->pg_oob_sz;
     buf_npg = geo->pg_per_blk;
 
+    /* At least half of the channels are kept for host writes */
+    gc_nbuf = MIN(APP_GC_PARALLEL_CH, app_nch / 2);
+    if (!gc_nbuf)
+        gc_nbuf = 1;
+    gc_nrun = 0;
+
     gc_cond = malloc (sizeof (pthread_cond_t) * app_nch);
     if (!gc_cond)
-        goto FREE_CH;
-
-    gc_cond_mutex = malloc (sizeof (pthread_mutex_t) * app_nch);
-    if (!gc_cond_mutex)
-        goto FREE_COND;
+        goto FREE_AGE;
 
-    for (ch_i = 0; ch_i < app_nch; ch_i++) {
+    for (ch_i = 0; ch_i < app_nch; ch_i++)
         if (pthread_cond_init (&gc_cond[ch_i], NULL))
-            goto COND_MUTEX;
-        if (pthread_mutex_init (&gc_cond_mutex[ch_i], NULL)) {
-            pthread_cond_destroy (&gc_cond[ch_i]);
-            goto COND_MUTEX;
-        }
-    }
+            goto COND;
+
+    if (pthread_mutex_init (&gc_mutex, NULL))
+        goto COND;
+    if (pthread_cond_init (&gc_sched_cond, NULL))
+        goto MUTEX;
 
     if (gc_alloc_buf ())
-        goto COND_MUTEX;
+        goto SCHED_COND;
 
     stop = 0;
     if (pthread_create (&check_th, NULL, gc_check_fn, NULL))
         goto FREE_BUF;
 
+    log_info ("    [appnvm: GC started. %d channels at the same time, "
+                         "%s victims]\n", gc_nbuf, gc_pol[gc_pol_id].name);
+
     return 0;
 
 FREE_BUF:
     gc_free_buf ();
-COND_MUTEX:
+SCHED_COND:
+    pthread_cond_destroy (&gc_sched_cond);
+MUTEX:
+    pthread_mutex_destroy (&gc_mutex);
+COND:
     while (ch_i) {
         ch_i--;
         pthread_cond_destroy (&gc_cond[ch_i]);
-        pthread_mutex_destroy (&gc_cond_mutex[ch_i]);
     }
-    free (gc_cond_mutex);
-FREE_COND:
     free (gc_cond);
+FREE_AGE:
+    gc_free_age ();
 FREE_CH:
     free (ch);
     return -1;
@@ -705,17 +1200,27 @@ static void gc_exit (void)
 {
     uint16_t ch_i;
 
+    pthread_mutex_lock (&gc_mutex);
     stop++;
+    pthread_cond_signal (&gc_sched_cond);
+    pthread_mutex_unlock (&gc_mutex);
     pthread_join (check_th, NULL);
     gc_free_buf ();
 
-    for (ch_i = 0; ch_i < app_nch; ch_i++) {
+    gc_account_host ();
+    log_info ("    [appnvm: GC %s: %lu host sectors, %lu moved, WA %.2f, "
+                    "%d wear leveling moves]\n",
+                    gc_pol[gc_pol_id].name, gc_pol[gc_pol_id].host_sec,
+                    gc_pol[gc_pol_id].gc_sec, gc_wa (&gc_pol[gc_pol_id]),
+                    gc_wl_moves);
+
+    for (ch_i = 0; ch_i < app_nch; ch_i++)
         pthread_cond_destroy (&gc_cond[ch_i]);
-        pthread_mutex_destroy (&gc_cond_mutex[ch_i]);
-    }
 
-    free (gc_cond_mutex);
+    pthread_cond_destroy (&gc_sched_cond);
+    pthread_mutex_destroy (&gc_mutex);
     free (gc_cond);
+    gc_free_age ();
     free (ch);
 }
 
@@ -724,10 +1229,34 @@ static struct app_gc appftl_gc = {
     .init_fn    = gc_init,
     .exit_fn    = gc_exit,
     .target_fn  = gc_get_target_blks,
-    .recycle_fn = gc_process_blk
+    .recycle_fn = gc_process_blk,
+    .wear_fn    = gc_wear_get,
+    .stats_fn   = gc_stats_get
+};
+
+static struct app_gc appftl_gc_cb = {
+    .mod_id     = APPFTL_GC_COST_BENEFIT,
+    .init_fn    = gc_init,
+    .exit_fn    = gc_exit,
+    .target_fn  = gc_get_target_cb,
+    .recycle_fn = gc_process_blk,
+    .wear_fn    = gc_wear_get,
+    .stats_fn   = gc_stats_get
+};
+
+static struct app_gc appftl_gc_win = {
+    .mod_id     = APPFTL_GC_WINDOWED,
+    .init_fn    = gc_init,
+    .exit_fn    = gc_exit,
+    .target_fn  = gc_get_target_win,
+    .recycle_fn = gc_process_blk,
+    .wear_fn    = gc_wear_get,
+    .stats_fn   = gc_stats_get
 };
 
 void gc_register (void)
 {
     appnvm_mod_register (APPMOD_GC, APPFTL_GC, &appftl_gc);
+    appnvm_mod_register (APPMOD_GC, APPFTL_GC_COST_BENEFIT, &appftl_gc_cb);
+    appnvm_mod_register (APPMOD_GC, APPFTL_GC_WINDOWED, &appftl_gc_win);
 }
\ No newline at end of file
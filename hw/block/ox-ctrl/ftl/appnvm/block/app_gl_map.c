@@ -28,36 +28,93 @@
 #include <stdint.h>
 #include <string.h>
 #include <sys/queue.h>
+#include <sys/mman.h>
+#include <unistd.h>
 #include "hw/block/ox-ctrl/include/ssd.h"
 
-#define MAP_BUF_CH_PGS  128       /* 4 MB per channel */
+#define MAP_BUF_CH_PGS  128       /* default, 4 MB per channel */
+#define MAP_BUF_MIN_PGS 4
+#define MAP_BUF_MAX_PGS 65536     /* 2 GB per channel */
 #define MAP_BUF_PG_SZ   32 * 1024 /* 32 KB */
 
+/* usec, wait for a busy entry while the cache shrinks */
+#define MAP_RESIZE_WAIT     100
+
+/* Mapping pages queued for prefetching per channel, older ones are dropped */
+#define MAP_PREFETCH_QSZ    64
+
 #define MAP_ADDR_FLAG   ((1 & AND64) << 63)
 
+/* Full turns of the clock hand before giving up on finding a victim */
+#define MAP_CLOCK_SWEEPS    4
+
+extern struct core_struct  core;
 extern pthread_spinlock_t *md_ch_spin;
 extern uint8_t             map_new;
 
+enum map_cache_state {
+    MAP_CACHE_FREE = 0,
+    MAP_CACHE_LOADING,
+    MAP_CACHE_USED,
+    MAP_CACHE_EVICTING,
+    MAP_CACHE_RETIRED   /* slot out of the cache size */
+};
+
+/*
+ * The state is changed under the cache mb_spin. Page contents, dirty, ppa
+ * and md_entry are protected by the metadata page mutex.
+ *
+ * seq is odd while the entry does not hold a stable page (free, loading or
+ * being evicted). Lock-free readers take the entry from the metadata PPA,
+ * read the page and check that seq and the metadata PPA did not change.
+ *
+ * Entries are never freed while the cache is running, the buffers of
+ * retired entries are released with MADV_DONTNEED and read as zeros.
+ */
 struct map_cache_entry {
     uint8_t                     dirty;
+    volatile uint8_t            ref;    /* CLOCK reference bit */
+    uint8_t                     state;
+    volatile uint32_t           seq;
+    uint32_t                    idx;    /* slot in the CLOCK ring */
     uint8_t                    *buf;
     uint32_t                    buf_sz;
     struct nvm_ppa_addr         ppa;    /* Stores the PPA while pg is cached */
     struct app_map_entry       *md_entry;
     struct map_cache           *cache;
     pthread_mutex_t            *mutex;
+    pthread_cond_t              cond;   /* waits for MAP_CACHE_LOADING */
     LIST_ENTRY(map_cache_entry)  f_entry;
-    TAILQ_ENTRY(map_cache_entry) u_entry;
 };
 
+/*
+ * Slots from npgs to max_pgs are retired. The ring only grows, it is
+ * replaced under mb_spin and the resize mutex serializes the resizers.
+ */
 struct map_cache {
-    struct map_cache_entry                 *pg_buf;
+    struct map_cache_entry                **pg_buf; /* CLOCK ring */
     LIST_HEAD(mb_free_l, map_cache_entry)   mbf_head;
-    TAILQ_HEAD(mb_used_l, map_cache_entry)  mbu_head;
     pthread_spinlock_t                      mb_spin;
+    uint32_t                                hand;   /* CLOCK hand */
+    uint32_t                                npgs;   /* cache size */
+    uint32_t                                max_pgs;
     uint32_t                                nfree;
     uint32_t                                nused;
+    uint64_t                                hit;
+    uint64_t                                miss;
+    uint64_t                                evict;
+    uint64_t                                prefetch;
     uint16_t                                id;
+
+    /* LBAs of the mapping pages to prefetch, loaded by the prefetch thread */
+    uint64_t                                pf_lba[MAP_PREFETCH_QSZ];
+    uint32_t                                pf_head;
+    uint32_t                                pf_count;
+    uint64_t                                pf_last; /* last page queued */
+    pthread_mutex_t                         pf_mutex;
+    pthread_cond_t                          pf_cond;
+    pthread_t                               pf_tid;
+    uint8_t                                 pf_stop;
 };
 
 struct map_pg_addr {
@@ -71,6 +128,7 @@ struct map_pg_addr {
 };
 
 static struct map_cache    *map_ch_cache;
+static pthread_mutex_t      map_resize_mutex;
 extern uint16_t             app_nch;
 static struct app_channel **ch;
 
@@ -143,7 +201,7 @@ static int map_nvm_read (struct map_cache_entry *ent)
     struct app_io_data *io;
     int ret = -1;
 
-    addr.ppa = ent->md_entry->ppa;
+    addr.ppa = ent->ppa.ppa;
 
     /* TODO: Support multiple media managers for mapping the channel ID */
     lch = ch[addr.g.ch];
@@ -158,38 +216,80 @@ static int map_nvm_read (struct map_cache_entry *ent)
     if (ret)
         log_err("[appnvm (gl_map): NVM read failed. PPA 0x%016lx]", addr.ppa);
 
-    ent->ppa.ppa = addr.ppa;
     app_free_pg_io(io);
 
     return ret;
 }
 
-static int map_evict_pg_cache (struct map_cache *cache)
+/* Called with mb_spin locked. Entries out of the cache size are retired */
+static void map_put_free_entry (struct map_cache *cache,
+                                                   struct map_cache_entry *ent)
 {
-    struct nvm_ppa_addr old_ppa;
-    struct map_cache_entry *cache_ent;
+    if (ent->idx >= cache->npgs) {
+        ent->state = MAP_CACHE_RETIRED;
+        return;
+    }
 
-    cache_ent = TAILQ_FIRST(&cache->mbu_head);
-    if (!cache_ent)
-        return -1;
+    ent->state = MAP_CACHE_FREE;
+    LIST_INSERT_HEAD (&cache->mbf_head, ent, f_entry);
+    cache->nfree++;
+}
 
-    pthread_mutex_lock (cache_ent->mutex);
+/*
+ * CLOCK replacement: the hand skips and clears referenced entries, the first
+ * entry not referenced since the last turn is evicted. Entries with the page
+ * mutex taken are in use right now, they are skipped as well. Returns the
+ * victim with its page mutex locked.
+ */
+static struct map_cache_entry *map_clock_victim (struct map_cache *cache)
+{
+    struct map_cache_entry *ent;
+    uint32_t step;
 
     pthread_spin_lock (&cache->mb_spin);
-    TAILQ_REMOVE(&cache->mbu_head, cache_ent, u_entry);
-    cache->nused--;
+    for (step = 0; step < cache->npgs * MAP_CLOCK_SWEEPS; step++) {
+        ent = cache->pg_buf[cache->hand];
+        cache->hand = (cache->hand + 1) % cache->npgs;
+
+        if (ent->state != MAP_CACHE_USED)
+            continue;
+
+        /* Second chance */
+        if (__atomic_exchange_n (&ent->ref, 0, __ATOMIC_RELAXED))
+            continue;
+
+        if (pthread_mutex_trylock (ent->mutex))
+            continue;
+
+        ent->state = MAP_CACHE_EVICTING;
+        cache->nused--;
+        pthread_spin_unlock (&cache->mb_spin);
+
+        return ent;
+    }
     pthread_spin_unlock (&cache->mb_spin);
 
+    return NULL;
+}
+
+/* The entry must be MAP_CACHE_EVICTING with its page mutex locked */
+static int map_evict_pg_cache (struct map_cache *cache,
+                                             struct map_cache_entry *cache_ent)
+{
+    struct nvm_ppa_addr old_ppa;
+
     old_ppa.ppa = cache_ent->ppa.ppa;
 
     if (cache_ent->dirty) {
         if (map_nvm_write (cache_ent, cache_ent->md_entry->lba)) {
 
             pthread_spin_lock (&cache->mb_spin);
-            TAILQ_INSERT_HEAD(&cache->mbu_head, cache_ent, u_entry);
+            cache_ent->state = MAP_CACHE_USED;
             cache->nused++;
             pthread_spin_unlock (&cache->mb_spin);
 
+            pthread_mutex_unlock (cache_ent->mutex);
+
             return -1;
         }
         cache_ent->dirty = 0;
@@ -202,41 +302,58 @@ static int map_evict_pg_cache (struct map_cache *cache)
                                                              APP_INVALID_PAGE);
     }
 
-    cache_ent->md_entry->ppa = cache_ent->ppa.ppa;
+    /* Readers still holding the entry fail their check from now */
+    __atomic_store_n (&cache_ent->seq, cache_ent->seq + 1, __ATOMIC_RELEASE);
+    __atomic_store_n (&cache_ent->md_entry->ppa, cache_ent->ppa.ppa,
+                                                            __ATOMIC_RELEASE);
     cache_ent->ppa.ppa = 0;
     cache_ent->md_entry = NULL;
 
     pthread_mutex_unlock (cache_ent->mutex);
 
     pthread_spin_lock (&cache->mb_spin);
-    LIST_INSERT_HEAD (&cache->mbf_head, cache_ent, f_entry);
-    cache->nfree++;
+    map_put_free_entry (cache, cache_ent);
     pthread_spin_unlock (&cache->mb_spin);
 
+    __atomic_fetch_add (&cache->evict, 1, __ATOMIC_RELAXED);
+
     return 0;
 }
 
+/*
+ * Called with the metadata page mutex (pg_off) locked. While the page is
+ * read from NVM, the mutex is released and the entry is published as
+ * MAP_CACHE_LOADING, other threads looking for the page wait in the entry
+ * condition instead of holding the mutex.
+ */
 static int map_load_pg_cache (struct map_cache *cache,
            struct app_map_entry *md_entry, uint64_t first_lba, uint32_t pg_off)
 {
     struct map_cache_entry *cache_ent;
     struct app_map_entry *map_ent;
     uint64_t ent_id;
+    int ret;
 
-    if (LIST_EMPTY(&cache->mbf_head))
-        if (map_evict_pg_cache (cache))
+    pthread_spin_lock (&cache->mb_spin);
+    while (LIST_EMPTY(&cache->mbf_head)) {
+        pthread_spin_unlock (&cache->mb_spin);
+
+        cache_ent = map_clock_victim (cache);
+        if (!cache_ent || map_evict_pg_cache (cache, cache_ent))
             return -1;
 
-    cache_ent = LIST_FIRST(&cache->mbf_head);
-    if (!cache_ent)
-        return -1;
+        pthread_spin_lock (&cache->mb_spin);
+    }
 
-    pthread_spin_lock (&cache->mb_spin);
+    cache_ent = LIST_FIRST(&cache->mbf_head);
     LIST_REMOVE(cache_ent, f_entry);
+    cache_ent->state = MAP_CACHE_LOADING;
     cache->nfree--;
     pthread_spin_unlock (&cache->mb_spin);
 
     cache_ent->md_entry = md_entry;
+    cache_ent->mutex = &ch[cache->id]->map_md->entry_mutex[pg_off];
+    cache_ent->ref = 1;
 
     /* If metadata entry PPA is zero, mapping page does not exist yet */
     if (!md_entry->ppa) {
@@ -246,106 +363,340 @@ static int map_load_pg_cache (struct map_cache *cache,
             map_ent->ppa = 0x0;
         }
         cache_ent->dirty = 1;
-    } else {
-        if (map_nvm_read (cache_ent)) {
-            cache_ent->md_entry = NULL;
-            cache_ent->ppa.ppa = 0;
 
-            pthread_spin_lock (&cache->mb_spin);
-            LIST_INSERT_HEAD(&cache->mbf_head, cache_ent, f_entry);
-            cache->nfree++;
-            pthread_spin_unlock (&cache->mb_spin);
+        __atomic_store_n (&cache_ent->seq, cache_ent->seq + 1,
+                                                            __ATOMIC_RELEASE);
+        __atomic_store_n (&md_entry->ppa,
+                      (uint64_t) cache_ent | MAP_ADDR_FLAG, __ATOMIC_RELEASE);
+        goto USED;
+    }
 
-            return -1;
-        }
+    /* seq stays odd, lock-free readers fall back to the mutex and wait */
+    cache_ent->ppa.ppa = md_entry->ppa;
+    __atomic_store_n (&md_entry->ppa, (uint64_t) cache_ent | MAP_ADDR_FLAG,
+                                                            __ATOMIC_RELEASE);
+    pthread_mutex_unlock (cache_ent->mutex);
 
-        /* Cache entry PPA is set after the read completes */
-    }
+    ret = map_nvm_read (cache_ent);
 
-    cache_ent->mutex = &ch[cache->id]->map_md->entry_mutex[pg_off];
-    map_ent = &((struct app_map_entry *) cache_ent->buf)[0];
+    pthread_mutex_lock (cache_ent->mutex);
+    if (ret) {
+        __atomic_store_n (&md_entry->ppa, cache_ent->ppa.ppa,
+                                                            __ATOMIC_RELEASE);
+        cache_ent->md_entry = NULL;
+        cache_ent->ppa.ppa = 0;
+
+        pthread_spin_lock (&cache->mb_spin);
+        map_put_free_entry (cache, cache_ent);
+        pthread_spin_unlock (&cache->mb_spin);
+
+        pthread_cond_broadcast (&cache_ent->cond);
+        return -1;
+    }
 
-    md_entry->ppa = (uint64_t) cache_ent;
-    md_entry->ppa |= MAP_ADDR_FLAG;
+    /* The page is stable, publish the entry to lock-free readers */
+    __atomic_store_n (&cache_ent->seq, cache_ent->seq + 1, __ATOMIC_RELEASE);
 
+USED:
     pthread_spin_lock (&cache->mb_spin);
-    TAILQ_INSERT_TAIL(&cache->mbu_head, cache_ent, u_entry);
+    cache_ent->state = MAP_CACHE_USED;
     cache->nused++;
     pthread_spin_unlock (&cache->mb_spin);
 
+    pthread_cond_broadcast (&cache_ent->cond);
+
     return 0;
 }
 
-static int map_init_ch_cache (struct map_cache *cache)
+/*
+ * Called with the metadata page mutex locked. Returns the cache entry if
+ * the page is cached, or NULL if it is not. Waits if the page is loading,
+ * the mutex is released while waiting.
+ */
+static struct map_cache_entry *map_wait_cache_entry (
+                           struct app_map_entry *md_ent, pthread_mutex_t *mutex)
 {
-    uint32_t pg_i;
+    struct map_cache_entry *cache_ent;
+    struct map_pg_addr addr;
 
-    cache->pg_buf = calloc (sizeof(struct map_cache_entry) * MAP_BUF_CH_PGS, 1);
-    if (!cache->pg_buf)
-        return -1;
+    addr.addr = md_ent->ppa;
+    while (addr.g.flag) {
+        cache_ent = (struct map_cache_entry *) ((uint64_t) addr.g.addr);
+        if (cache_ent->state != MAP_CACHE_LOADING)
+            return cache_ent;
 
-    if (pthread_spin_init(&cache->mb_spin, 0))
-        goto FREE_BUF;
+        pthread_cond_wait (&cache_ent->cond, mutex);
+        addr.addr = md_ent->ppa;
+    }
 
-    cache->mbf_head.lh_first = NULL;
-    LIST_INIT(&cache->mbf_head);
-    TAILQ_INIT(&cache->mbu_head);
-    cache->nfree = 0;
-    cache->nused = 0;
+    return NULL;
+}
 
-    for (pg_i = 0; pg_i < MAP_BUF_CH_PGS; pg_i++) {
-        cache->pg_buf[pg_i].dirty = 0;
-        cache->pg_buf[pg_i].buf_sz = MAP_BUF_PG_SZ;
-        cache->pg_buf[pg_i].ppa.ppa = 0x0;
-        cache->pg_buf[pg_i].md_entry = NULL;
-        cache->pg_buf[pg_i].cache = cache;
+static struct map_cache_entry *map_alloc_cache_entry (
+                                        struct map_cache *cache, uint32_t idx)
+{
+    struct map_cache_entry *ent;
 
-        cache->pg_buf[pg_i].buf = malloc (MAP_BUF_PG_SZ);
-        if (!cache->pg_buf[pg_i].buf)
-            goto FREE_PGS;
+    ent = calloc (sizeof (struct map_cache_entry), 1);
+    if (!ent)
+        return NULL;
 
-        LIST_INSERT_HEAD (&cache->mbf_head, &cache->pg_buf[pg_i], f_entry);
-        cache->nfree++;
+    /* Page aligned, so the buffer can be released if the entry retires */
+    if (posix_memalign ((void **) &ent->buf, getpagesize (), MAP_BUF_PG_SZ)) {
+        free (ent);
+        return NULL;
     }
 
+    ent->idx = idx;
+    ent->state = MAP_CACHE_RETIRED;
+    ent->seq = 1;
+    ent->buf_sz = MAP_BUF_PG_SZ;
+    ent->cache = cache;
+    pthread_cond_init (&ent->cond, NULL);
+
+    return ent;
+}
+
+static void map_free_cache_entry (struct map_cache_entry *ent)
+{
+    pthread_cond_destroy (&ent->cond);
+    free (ent->buf);
+    free (ent);
+}
+
+/* Grows the CLOCK ring to npgs slots, new slots are retired */
+static int map_grow_ch_cache (struct map_cache *cache, uint32_t npgs)
+{
+    struct map_cache_entry **pg_buf, **old;
+    uint32_t pg_i;
+
+    pg_buf = calloc (sizeof (struct map_cache_entry *) * npgs, 1);
+    if (!pg_buf)
+        return -1;
+
+    if (cache->max_pgs)
+        memcpy (pg_buf, cache->pg_buf,
+                             sizeof (struct map_cache_entry *) * cache->max_pgs);
+
+    for (pg_i = cache->max_pgs; pg_i < npgs; pg_i++) {
+        pg_buf[pg_i] = map_alloc_cache_entry (cache, pg_i);
+        if (!pg_buf[pg_i])
+            goto FREE_PGS;
+    }
+
+    pthread_spin_lock (&cache->mb_spin);
+    old = cache->pg_buf;
+    cache->pg_buf = pg_buf;
+    cache->max_pgs = npgs;
+    pthread_spin_unlock (&cache->mb_spin);
+
+    free (old);
+
     return 0;
 
 FREE_PGS:
-    while (pg_i) {
+    while (pg_i > cache->max_pgs) {
         pg_i--;
-        LIST_REMOVE(&cache->pg_buf[pg_i], f_entry);
-        cache->nfree--;
-        free (cache->pg_buf[pg_i].buf);
+        map_free_cache_entry (pg_buf[pg_i]);
     }
-    pthread_spin_destroy (&cache->mb_spin);
-FREE_BUF:
+    free (pg_buf);
+    return -1;
+}
+
+/* Waits for the entry to leave the cache, a cached page is written back */
+static int map_retire_entry (struct map_cache *cache,
+                                                   struct map_cache_entry *ent)
+{
+    pthread_spin_lock (&cache->mb_spin);
+    while (ent->state != MAP_CACHE_RETIRED) {
+
+        if (ent->state == MAP_CACHE_USED &&
+                                        !pthread_mutex_trylock (ent->mutex)) {
+            ent->state = MAP_CACHE_EVICTING;
+            cache->nused--;
+            pthread_spin_unlock (&cache->mb_spin);
+
+            if (map_evict_pg_cache (cache, ent))
+                return -1;
+
+        } else {
+            /* Loading or in use by an I/O */
+            pthread_spin_unlock (&cache->mb_spin);
+            usleep (MAP_RESIZE_WAIT);
+        }
+
+        pthread_spin_lock (&cache->mb_spin);
+    }
+    pthread_spin_unlock (&cache->mb_spin);
+
+    /* Lock-free readers may still read the buffer, they get zeros */
+    madvise (ent->buf, ent->buf_sz, MADV_DONTNEED);
+
+    return 0;
+}
+
+/*
+ * Sets the cache size of the channel. When shrinking, the entries out of
+ * the new size are written back and their buffers are released.
+ */
+static int map_resize_ch_cache (struct map_cache *cache, uint32_t npgs)
+{
+    struct map_cache_entry *ent;
+    uint32_t pg_i, old_npgs;
+    int ret = 0;
+
+    if (npgs > cache->max_pgs && map_grow_ch_cache (cache, npgs))
+        return -1;
+
+    pthread_spin_lock (&cache->mb_spin);
+    old_npgs = cache->npgs;
+    cache->npgs = npgs;
+    if (cache->hand >= npgs)
+        cache->hand = 0;
+
+    for (pg_i = old_npgs; pg_i < npgs; pg_i++) {
+        ent = cache->pg_buf[pg_i];
+        if (ent->state == MAP_CACHE_RETIRED)
+            map_put_free_entry (cache, ent);
+    }
+
+    /* Retired entries are not loaded from now */
+    for (pg_i = npgs; pg_i < old_npgs; pg_i++) {
+        ent = cache->pg_buf[pg_i];
+        if (ent->state == MAP_CACHE_FREE) {
+            LIST_REMOVE(ent, f_entry);
+            cache->nfree--;
+            ent->state = MAP_CACHE_RETIRED;
+        }
+    }
+    pthread_spin_unlock (&cache->mb_spin);
+
+    for (pg_i = npgs; pg_i < old_npgs; pg_i++) {
+        if (map_retire_entry (cache, cache->pg_buf[pg_i])) {
+            log_err ("[appnvm (gl_map): ERROR. Cache entry not persisted "
+                                                 "in NVM. Ch %d\n", cache->id);
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+static struct map_cache_entry *map_lock_cache_entry (uint64_t,
+                                                  pthread_mutex_t **, uint8_t);
+
+static void *map_prefetch_th (void *arg)
+{
+    struct map_cache *cache = (struct map_cache *) arg;
+    struct map_cache_entry *cache_ent;
+    pthread_mutex_t *mutex;
+    uint64_t lba;
+
+    pthread_mutex_lock (&cache->pf_mutex);
+    while (!cache->pf_stop) {
+        if (!cache->pf_count) {
+            pthread_cond_wait (&cache->pf_cond, &cache->pf_mutex);
+            continue;
+        }
+
+        lba = cache->pf_lba[cache->pf_head];
+        cache->pf_head = (cache->pf_head + 1) % MAP_PREFETCH_QSZ;
+        cache->pf_count--;
+        pthread_mutex_unlock (&cache->pf_mutex);
+
+        cache_ent = map_lock_cache_entry (lba, &mutex, 1);
+        if (cache_ent)
+            pthread_mutex_unlock (mutex);
+
+        pthread_mutex_lock (&cache->pf_mutex);
+    }
+    pthread_mutex_unlock (&cache->pf_mutex);
+
+    return NULL;
+}
+
+static int map_init_ch_cache (struct map_cache *cache, uint32_t npgs)
+{
+    uint32_t pg_i;
+
+    if (pthread_spin_init(&cache->mb_spin, 0))
+        return -1;
+
+    cache->mbf_head.lh_first = NULL;
+    LIST_INIT(&cache->mbf_head);
+    cache->pg_buf = NULL;
+    cache->hand = 0;
+    cache->npgs = 0;
+    cache->max_pgs = 0;
+    cache->nfree = 0;
+    cache->nused = 0;
+    cache->hit = 0;
+    cache->miss = 0;
+    cache->evict = 0;
+    cache->prefetch = 0;
+    cache->pf_head = 0;
+    cache->pf_count = 0;
+    cache->pf_last = AND64;
+    cache->pf_stop = 0;
+
+    if (map_resize_ch_cache (cache, npgs))
+        goto SPIN;
+
+    pthread_mutex_init (&cache->pf_mutex, NULL);
+    pthread_cond_init (&cache->pf_cond, NULL);
+    if (pthread_create (&cache->pf_tid, NULL, map_prefetch_th, cache))
+        goto PF;
+
+    return 0;
+
+PF:
+    pthread_cond_destroy (&cache->pf_cond);
+    pthread_mutex_destroy (&cache->pf_mutex);
+    for (pg_i = 0; pg_i < cache->max_pgs; pg_i++)
+        map_free_cache_entry (cache->pg_buf[pg_i]);
     free (cache->pg_buf);
+SPIN:
+    pthread_spin_destroy (&cache->mb_spin);
     return -1;
 }
 
 static void map_exit_ch_cache (struct map_cache *cache)
 {
     struct map_cache_entry *ent;
+    uint32_t pg_i;
+
+    pthread_mutex_lock (&cache->pf_mutex);
+    cache->pf_stop = 1;
+    pthread_cond_signal (&cache->pf_cond);
+    pthread_mutex_unlock (&cache->pf_mutex);
+    pthread_join (cache->pf_tid, NULL);
+    pthread_cond_destroy (&cache->pf_cond);
+    pthread_mutex_destroy (&cache->pf_mutex);
 
     /* Evict all pages in the cache */
-    while (!(TAILQ_EMPTY(&cache->mbu_head))) {
-        ent = TAILQ_FIRST(&cache->mbu_head);
-        if (ent != NULL)
-            if (map_evict_pg_cache (cache))
-                log_err ("[appnvm (gl_map): ERROR. Cache entry not persisted "
+    for (pg_i = 0; pg_i < cache->max_pgs; pg_i++) {
+        ent = cache->pg_buf[pg_i];
+        if (ent->state != MAP_CACHE_USED)
+            continue;
+
+        pthread_mutex_lock (ent->mutex);
+        pthread_spin_lock (&cache->mb_spin);
+        ent->state = MAP_CACHE_EVICTING;
+        cache->nused--;
+        pthread_spin_unlock (&cache->mb_spin);
+
+        if (map_evict_pg_cache (cache, ent))
+            log_err ("[appnvm (gl_map): ERROR. Cache entry not persisted "
                                                  "in NVM. Ch %d\n", cache->id);
     }
 
     /* TODO: Check if any cache entry still remains. Retry I/Os */
 
-    while (!(LIST_EMPTY(&cache->mbf_head))) {
-        ent = LIST_FIRST(&cache->mbf_head);
-        if (ent != NULL) {
-            LIST_REMOVE(ent, f_entry);
-            cache->nfree--;
-            free (ent->buf);
-        }
-    }
+    LIST_INIT(&cache->mbf_head);
+    cache->nfree = 0;
+
+    for (pg_i = 0; pg_i < cache->max_pgs; pg_i++)
+        map_free_cache_entry (cache->pg_buf[pg_i]);
 
     pthread_spin_destroy (&cache->mb_spin);
     free (cache->pg_buf);
@@ -353,7 +704,7 @@ static void map_exit_ch_cache (struct map_cache *cache)
 
 static int map_init (void)
 {
-    uint32_t nch, ch_i, pg_sz;
+    uint32_t nch, ch_i, pg_sz, npgs;
 
     ch = malloc (sizeof (struct app_channel *) * app_nch);
     if (!ch)
@@ -367,14 +718,25 @@ static int map_init (void)
     if (!map_ch_cache)
         goto FREE_CH;
 
+    npgs = MAP_BUF_CH_PGS;
+    if (core.qemu && core.qemu->map_cache_pgs) {
+        npgs = core.qemu->map_cache_pgs;
+        if (npgs < MAP_BUF_MIN_PGS || npgs > MAP_BUF_MAX_PGS) {
+            log_err ("[appnvm (gl_map): Invalid map_cache_pgs %d, using %d]\n",
+                                                        npgs, MAP_BUF_CH_PGS);
+            npgs = MAP_BUF_CH_PGS;
+        }
+    }
+
+    pthread_mutex_init (&map_resize_mutex, NULL);
+
     pg_sz = ch[0]->ch->geometry->pl_pg_size;
     for (ch_i = 0; ch_i < app_nch; ch_i++) {
         pg_sz = MIN(ch[ch_i]->ch->geometry->pl_pg_size, pg_sz);
 
-        if (map_init_ch_cache (&map_ch_cache[ch_i]))
-            goto EXIT_BUF_CH;
-
         map_ch_cache[ch_i].id = ch_i;
+        if (map_init_ch_cache (&map_ch_cache[ch_i], npgs))
+            goto EXIT_BUF_CH;
     }
 
     map_ent_per_pg = pg_sz / sizeof (struct app_map_entry);
@@ -410,62 +772,207 @@ static void map_exit (void)
         map_exit_ch_cache (&map_ch_cache[ch_i]);
     }
 
+    pthread_mutex_destroy (&map_resize_mutex);
     free (map_ch_cache);
     free (ch);
 }
 
-static struct map_cache_entry *map_get_cache_entry (uint64_t lba)
+/*
+ * Queues npgs mapping pages for loading, starting from the page of lba.
+ * Pages already cached or loading are skipped, it never blocks.
+ */
+static void map_prefetch (uint64_t lba, uint32_t npgs)
+{
+    uint32_t ch_map, pg_off, pg_i, tail;
+    uint64_t pg;
+    struct app_map_entry *md_ent;
+    struct map_pg_addr addr;
+    struct map_cache *cache;
+
+    for (pg_i = 0; pg_i < npgs; pg_i++) {
+        pg = lba / map_ent_per_pg + pg_i;
+        ch_map = pg % app_nch;
+        pg_off = pg / app_nch;
+
+        /* Out of the namespace */
+        md_ent = appnvm()->ch_map->get_fn (ch[ch_map], pg_off);
+        if (!md_ent)
+            return;
+
+        addr.addr = __atomic_load_n (&md_ent->ppa, __ATOMIC_RELAXED);
+        if (addr.g.flag)
+            continue;
+
+        cache = &map_ch_cache[ch_map];
+        pthread_mutex_lock (&cache->pf_mutex);
+        if (cache->pf_last != pg) {
+
+            /* The queue keeps the latest requests */
+            if (cache->pf_count == MAP_PREFETCH_QSZ) {
+                cache->pf_head = (cache->pf_head + 1) % MAP_PREFETCH_QSZ;
+                cache->pf_count--;
+            }
+            tail = (cache->pf_head + cache->pf_count) % MAP_PREFETCH_QSZ;
+            cache->pf_lba[tail] = pg * map_ent_per_pg;
+            cache->pf_count++;
+            cache->pf_last = pg;
+
+            pthread_cond_signal (&cache->pf_cond);
+        }
+        pthread_mutex_unlock (&cache->pf_mutex);
+    }
+}
+
+static int map_cache_set (uint32_t npgs)
+{
+    uint32_t ch_i;
+    int ret = 0;
+
+    if (npgs < MAP_BUF_MIN_PGS || npgs > MAP_BUF_MAX_PGS) {
+        log_err ("[appnvm (gl_map): Cache size out of bounds: %d pages. "
+                   "Min %d, max %d]\n", npgs, MAP_BUF_MIN_PGS, MAP_BUF_MAX_PGS);
+        return -1;
+    }
+
+    pthread_mutex_lock (&map_resize_mutex);
+    for (ch_i = 0; ch_i < app_nch; ch_i++)
+        if (map_resize_ch_cache (&map_ch_cache[ch_i], npgs))
+            ret = -1;
+    pthread_mutex_unlock (&map_resize_mutex);
+
+    log_info ("  [appnvm (gl_map): Cache resized to %d pages per channel]\n",
+                                                                         npgs);
+    return ret;
+}
+
+static void map_cache_get (struct nvm_ftl_map_cache_st *st)
+{
+    struct map_cache *cache;
+    uint32_t ch_i;
+
+    memset (st, 0x0, sizeof (struct nvm_ftl_map_cache_st));
+    st->pg_sz = MAP_BUF_PG_SZ;
+    st->nch = app_nch;
+
+    for (ch_i = 0; ch_i < app_nch; ch_i++) {
+        cache = &map_ch_cache[ch_i];
+        st->pgs_ch = cache->npgs;
+        st->used += cache->nused;
+        st->hit += __atomic_load_n (&cache->hit, __ATOMIC_RELAXED);
+        st->miss += __atomic_load_n (&cache->miss, __ATOMIC_RELAXED);
+        st->evict += __atomic_load_n (&cache->evict, __ATOMIC_RELAXED);
+        st->prefetch += __atomic_load_n (&cache->prefetch, __ATOMIC_RELAXED);
+    }
+}
+
+static struct app_map_entry *map_get_md_entry (uint64_t lba,
+                                                uint32_t *ch_map, uint32_t *pg_off)
 {
-    uint32_t ch_map, pg_off;
-    uint64_t first_pg_lba;
     struct app_map_entry *md_ent;
-    struct map_cache_entry *cache_ent = NULL;
-    struct map_pg_addr *addr;
 
     /* Mapping metadata pages are spread among channels using round-robin */
-    ch_map = (lba / map_ent_per_pg) % app_nch;
-    pg_off = (lba / map_ent_per_pg) / app_nch;
+    *ch_map = (lba / map_ent_per_pg) % app_nch;
+    *pg_off = (lba / map_ent_per_pg) / app_nch;
+
+    md_ent = appnvm()->ch_map->get_fn (ch[*ch_map], *pg_off);
+    if (!md_ent)
+        log_err ("[appnvm (gl_map): Map MD page out of bounds. Ch %d\n",
+                                                                      *ch_map);
+    return md_ent;
+}
 
-    md_ent = appnvm()->ch_map->get_fn (ch[ch_map], pg_off);
-    if (!md_ent) {
-        log_err ("[appnvm (gl_map): Map MD page out of bounds. Ch %d\n",ch_map);
+/*
+ * Returns the cache entry of the mapping page with its metadata page mutex
+ * locked, the caller unlocks it. The page is loaded in the cache if needed.
+ * Prefetches are not counted as hits or misses.
+ */
+static struct map_cache_entry *map_lock_cache_entry (uint64_t lba,
+                                     pthread_mutex_t **mutex, uint8_t prefetch)
+{
+    uint32_t ch_map, pg_off;
+    uint64_t first_pg_lba, *counter;
+    struct app_map_entry *md_ent;
+    struct map_cache_entry *cache_ent;
+    struct map_cache *cache;
+    uint8_t loaded = 0;
+
+    md_ent = map_get_md_entry (lba, &ch_map, &pg_off);
+    if (!md_ent)
         return NULL;
-    }
 
-    addr = (struct map_pg_addr *) &md_ent->ppa;
+    cache = &map_ch_cache[ch_map];
 
-    /* If the PPA flag is zero, the mapping page is not cached yet */
     /* There is a mutex per metadata page */
-    pthread_mutex_lock (&ch[ch_map]->map_md->entry_mutex[pg_off]);
-    if (!addr->g.flag) {
+    *mutex = &ch[ch_map]->map_md->entry_mutex[pg_off];
+    pthread_mutex_lock (*mutex);
+
+    /* If the entry is not found, the mapping page is not cached yet */
+    while (!(cache_ent = map_wait_cache_entry (md_ent, *mutex))) {
 
         first_pg_lba = (lba / map_ent_per_pg) * map_ent_per_pg;
 
-        if (map_load_pg_cache (&map_ch_cache[ch_map], md_ent, first_pg_lba,
-                                                                     pg_off)) {
-            pthread_mutex_unlock (&ch[ch_map]->map_md->entry_mutex[pg_off]);
+        if (map_load_pg_cache (cache, md_ent, first_pg_lba, pg_off)) {
+            pthread_mutex_unlock (*mutex);
             log_err ("[appnvm(gl_map): Mapping page not loaded ch %d\n",ch_map);
             return NULL;
         }
+        loaded = 1;
+    }
 
-    } else {
+    if (prefetch)
+        counter = (loaded) ? &cache->prefetch : NULL;
+    else
+        counter = (loaded) ? &cache->miss : &cache->hit;
+    if (counter)
+        __atomic_fetch_add (counter, 1, __ATOMIC_RELAXED);
 
-        /* Keep cache entry as hot, in the tail of the queue */
-        cache_ent = (struct map_cache_entry *) ((uint64_t) addr->g.addr);
+    cache_ent->ref = 1;
 
-        pthread_spin_lock (&map_ch_cache[ch_map].mb_spin);
-        TAILQ_REMOVE(&map_ch_cache[ch_map].mbu_head, cache_ent, u_entry);
-        TAILQ_INSERT_TAIL(&map_ch_cache[ch_map].mbu_head, cache_ent, u_entry);
-        pthread_spin_unlock (&map_ch_cache[ch_map].mb_spin);
+    return cache_ent;
+}
 
-    }
-    pthread_mutex_unlock (&ch[ch_map]->map_md->entry_mutex[pg_off]);
+/*
+ * Lock-free lookup of a cached mapping entry. Returns 0 and the PPA if the
+ * mapping page was cached and did not change while it was read.
+ */
+static int map_read_cached (uint64_t lba, uint64_t *ppa)
+{
+    uint32_t ch_map, pg_off, seq;
+    uint64_t md_ppa, ent_lba;
+    struct app_map_entry *md_ent, *map_ent;
+    struct map_cache_entry *cache_ent;
+    struct map_pg_addr addr;
 
-    /* At this point, the PPA only points to the cache */
-    if (cache_ent == NULL)
-        cache_ent = (struct map_cache_entry *) ((uint64_t) addr->g.addr);
+    md_ent = map_get_md_entry (lba, &ch_map, &pg_off);
+    if (!md_ent)
+        return -1;
 
-    return cache_ent;
+    md_ppa = __atomic_load_n (&md_ent->ppa, __ATOMIC_ACQUIRE);
+    addr.addr = md_ppa;
+    if (!addr.g.flag)
+        return -1;
+
+    cache_ent = (struct map_cache_entry *) ((uint64_t) addr.g.addr);
+    seq = __atomic_load_n (&cache_ent->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1)
+        return -1;
+
+    map_ent = &((struct app_map_entry *) cache_ent->buf)[lba % map_ent_per_pg];
+    ent_lba = __atomic_load_n (&map_ent->lba, __ATOMIC_RELAXED);
+    *ppa = __atomic_load_n (&map_ent->ppa, __ATOMIC_RELAXED);
+
+    __atomic_thread_fence (__ATOMIC_ACQUIRE);
+    if (__atomic_load_n (&cache_ent->seq, __ATOMIC_RELAXED) != seq ||
+            __atomic_load_n (&md_ent->ppa, __ATOMIC_RELAXED) != md_ppa ||
+            ent_lba != lba)
+        return -1;
+
+    if (!cache_ent->ref)
+        cache_ent->ref = 1;
+
+    __atomic_fetch_add (&cache_ent->cache->hit, 1, __ATOMIC_RELAXED);
+
+    return 0;
 }
 
 static int map_upsert_md (uint64_t index, uint64_t new_ppa, uint64_t old_ppa)
@@ -497,9 +1004,11 @@ static int map_upsert_md (uint64_t index, uint64_t new_ppa, uint64_t old_ppa)
 
     addr = (struct map_pg_addr *) &md_ent->ppa;
 
-    /* If the PPA flag is zero, the mapping page is not cached */
+    /* If the entry is not found, the mapping page is not cached */
     pthread_mutex_lock (&ch[ch_map]->map_md->entry_mutex[pg_off]);
-    if (!addr->g.flag) {
+    cache_ent = map_wait_cache_entry (md_ent,
+                                      &ch[ch_map]->map_md->entry_mutex[pg_off]);
+    if (!cache_ent) {
 
         if (addr->addr != old_ppa)
             ret = 1;
@@ -508,7 +1017,6 @@ static int map_upsert_md (uint64_t index, uint64_t new_ppa, uint64_t old_ppa)
 
     } else {
 
-        cache_ent = (struct map_cache_entry *) ((uint64_t) addr->g.addr);
         if (cache_ent->ppa.ppa != old_ppa)
             ret = 2;
         else
@@ -530,6 +1038,7 @@ static int map_upsert (uint64_t lba, uint64_t ppa)
     struct app_map_entry *map_ent;
     struct map_cache_entry *cache_ent;
     struct nvm_ppa_addr old_ppa, addr;
+    pthread_mutex_t *mutex;
 
     ch_map = (lba / map_ent_per_pg) % app_nch;
     ent_off = lba % map_ent_per_pg;
@@ -538,7 +1047,8 @@ static int map_upsert (uint64_t lba, uint64_t ppa)
         return -1;
     }
 
-    cache_ent = map_get_cache_entry (lba);
+    /* The page mutex keeps the page in the cache until it is updated */
+    cache_ent = map_lock_cache_entry (lba, &mutex, 0);
     if (!cache_ent)
         return -1;
 
@@ -546,6 +1056,7 @@ static int map_upsert (uint64_t lba, uint64_t ppa)
 
     if (map_ent->lba != lba) {
         addr.ppa = map_ent->ppa;
+        pthread_mutex_unlock (mutex);
         log_err ("[appnvm(gl_map): WRITE LBA does not match entry. lba: %lu, "
             "map lba: %lu, map ppa: (%d/%d/%d/%d/%d/%d), Ch %d, ent_off %d\n",
             lba, map_ent->lba, addr.g.ch, addr.g.lun, addr.g.blk, addr.g.pl,
@@ -553,17 +1064,20 @@ static int map_upsert (uint64_t lba, uint64_t ppa)
         return -1;
     }
 
-    /* If LBA is not new, mark old PPA page as invalid for GC */
     old_ppa.ppa = map_ent->ppa;
-    if (map_ent->ppa)
-        appnvm()->md->invalidate_fn (ch[old_ppa.g.ch], &old_ppa,
-                                                           APP_INVALID_SECTOR);
 
     pthread_spin_lock (&md_ch_spin[old_ppa.g.ch]);
-    map_ent->ppa = ppa;
+    __atomic_store_n (&map_ent->ppa, ppa, __ATOMIC_RELAXED);
     cache_ent->dirty = 1;
     pthread_spin_unlock (&md_ch_spin[old_ppa.g.ch]);
 
+    pthread_mutex_unlock (mutex);
+
+    /* If LBA is not new, mark old PPA page as invalid for GC */
+    if (old_ppa.ppa)
+        appnvm()->md->invalidate_fn (ch[old_ppa.g.ch], &old_ppa,
+                                                           APP_INVALID_SECTOR);
+
     return 0;
 }
 
@@ -572,6 +1086,8 @@ static uint64_t map_read (uint64_t lba)
     struct map_cache_entry *cache_ent;
     struct app_map_entry *map_ent;
     struct nvm_ppa_addr ppa;
+    pthread_mutex_t *mutex;
+    uint64_t ret;
     uint32_t ent_off;
 
     ent_off = lba % map_ent_per_pg;
@@ -580,7 +1096,11 @@ static uint64_t map_read (uint64_t lba)
         return AND64;
     }
 
-    cache_ent = map_get_cache_entry (lba);
+    /* Hits do not take any lock */
+    if (!map_read_cached (lba, &ret))
+        return ret;
+
+    cache_ent = map_lock_cache_entry (lba, &mutex, 0);
     if (!cache_ent)
         return AND64;
 
@@ -588,6 +1108,7 @@ static uint64_t map_read (uint64_t lba)
 
     if (map_ent->lba != lba) {
         ppa.ppa = map_ent->ppa;
+        pthread_mutex_unlock (mutex);
         log_err ("[appnvm(gl_map): READ LBA does not match entry. lba: %lu, "
             "map lba: %lu, map ppa: (%d/%d/%d/%d/%d/%d), ent_off %d\n",
                 lba, map_ent->lba, ppa.g.ch, ppa.g.lun, ppa.g.blk, ppa.g.pl,
@@ -595,7 +1116,95 @@ static uint64_t map_read (uint64_t lba)
         return -1;
     }
 
-    return map_ent->ppa;
+    ret = map_ent->ppa;
+    pthread_mutex_unlock (mutex);
+
+    return ret;
+}
+
+/*
+ * Unmaps [lba, lba + nlb), the old sectors are invalidated for GC. Mapping
+ * pages never written back nor cached have no mapped LBA, they are skipped
+ * without being loaded.
+ */
+static int map_trim (uint64_t lba, uint32_t nlb)
+{
+    uint32_t ch_map, pg_off, ent_off, ent_n, ent_i;
+    uint64_t end = lba + nlb;
+    struct app_map_entry *md_ent, *map_ent;
+    struct map_cache_entry *cache_ent;
+    struct nvm_ppa_addr old_ppa;
+    pthread_mutex_t *mutex;
+
+    for (; lba < end; lba += ent_n) {
+        ent_off = lba % map_ent_per_pg;
+        ent_n = MIN(map_ent_per_pg - ent_off, end - lba);
+
+        md_ent = map_get_md_entry (lba, &ch_map, &pg_off);
+        if (!md_ent)
+            return -1;
+
+        if (!__atomic_load_n (&md_ent->ppa, __ATOMIC_ACQUIRE))
+            continue;
+
+        cache_ent = map_lock_cache_entry (lba, &mutex, 0);
+        if (!cache_ent)
+            return -1;
+
+        for (ent_i = 0; ent_i < ent_n; ent_i++) {
+            map_ent = &((struct app_map_entry *) cache_ent->buf)
+                                                           [ent_off + ent_i];
+            if (map_ent->lba != lba + ent_i) {
+                pthread_mutex_unlock (mutex);
+                log_err ("[appnvm(gl_map): TRIM LBA does not match entry. "
+                        "lba: %lu, map lba: %lu, Ch %d, ent_off %d\n",
+                        lba + ent_i, map_ent->lba, ch_map, ent_off + ent_i);
+                return -1;
+            }
+
+            old_ppa.ppa = map_ent->ppa;
+            if (!old_ppa.ppa)
+                continue;
+
+            pthread_spin_lock (&md_ch_spin[old_ppa.g.ch]);
+            __atomic_store_n (&map_ent->ppa, 0x0, __ATOMIC_RELAXED);
+            cache_ent->dirty = 1;
+            pthread_spin_unlock (&md_ch_spin[old_ppa.g.ch]);
+
+            appnvm()->md->invalidate_fn (ch[old_ppa.g.ch], &old_ppa,
+                                                           APP_INVALID_SECTOR);
+        }
+
+        pthread_mutex_unlock (mutex);
+    }
+
+    return 0;
+}
+
+/*
+ * Returns the NVM PPA of a mapping page, also while the page is cached.
+ * A cached page written back after the last load is stored at the cache
+ * entry PPA, dirty contents are not in NVM yet.
+ */
+static uint64_t map_md_ppa (struct app_channel *lch, uint32_t pg_off)
+{
+    struct app_map_entry *md_ent;
+    struct map_cache_entry *cache_ent;
+    struct map_pg_addr addr;
+
+    md_ent = appnvm()->ch_map->get_fn (lch, pg_off);
+    if (!md_ent)
+        return 0;
+
+    pthread_mutex_lock (&lch->map_md->entry_mutex[pg_off]);
+    addr.addr = md_ent->ppa;
+    if (addr.g.flag) {
+        cache_ent = (struct map_cache_entry *) ((uint64_t) addr.g.addr);
+        addr.addr = cache_ent->ppa.ppa;
+    }
+    pthread_mutex_unlock (&lch->map_md->entry_mutex[pg_off]);
+
+    return addr.addr;
 }
 
 static struct app_gl_map appftl_gl_map = {
@@ -604,7 +1213,12 @@ static struct app_gl_map appftl_gl_map = {
     .exit_fn        = map_exit,
     .upsert_md_fn   = map_upsert_md,
     .upsert_fn      = map_upsert,
-    .read_fn        = map_read
+    .read_fn        = map_read,
+    .prefetch_fn    = map_prefetch,
+    .cache_set_fn   = map_cache_set,
+    .cache_get_fn   = map_cache_get,
+    .md_ppa_fn      = map_md_ppa,
+    .trim_fn        = map_trim
 };
 
 void gl_map_register (void) {
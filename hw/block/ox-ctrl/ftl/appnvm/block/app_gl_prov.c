@@ -30,10 +30,13 @@
 #include <string.h>
 #include "hw/block/ox-ctrl/include/ssd.h"
 
+extern struct core_struct core;
 extern uint16_t app_nch;
 static struct app_channel **ch;
 static pthread_spinlock_t cur_ch_spin;
 static u_atomic_t cur_ch_id;
+static uint16_t cur_ch_fill; /* pages of the current stripe already given */
+static uint16_t gl_stripe;   /* plane-pages per channel before the next one */
 
 static int gl_prov_init (void)
 {
@@ -44,6 +47,9 @@ static int gl_prov_init (void)
         return -1;
 
     cur_ch_id.counter = U_ATOMIC_INIT_RUNTIME(0);
+    cur_ch_fill = 0;
+    gl_stripe = (core.qemu && core.qemu->stripe_pgs) ?
+                                                  core.qemu->stripe_pgs : 1;
     if (pthread_spin_init (&cur_ch_spin, 0))
         goto FREE;
 
@@ -51,7 +57,8 @@ static int gl_prov_init (void)
     if (nch != app_nch)
         goto SPIN_LOCK;
 
-    log_info("    [appnvm: Global Provisioning started.]\n");
+    log_info("    [appnvm: Global Provisioning started. Stripe: %d pages]\n",
+                                                                    gl_stripe);
 
     return 0;
 
@@ -71,6 +78,7 @@ static void gl_prov_exit (void)
 static struct app_prov_ppas *gl_prov_get_ppa_list (uint32_t pgs)
 {
     uint32_t ch_id, act_ch_id, nact_ch, cc, new_cc, nppas, tppas, pg_left, i;
+    uint32_t fill, quota, n;
     struct app_prov_ppas      tmp_ppa[app_nch];
     struct app_channel       *dec_ch[app_nch];
     struct nvm_ppa_addr      *list;
@@ -120,22 +128,28 @@ static struct app_prov_ppas *gl_prov_get_ppa_list (uint32_t pgs)
         return NULL;
 
 REDIST:
-    /* Collect the current ch and set the new current ch for the next thread */
+    /* Collect the current ch and set the new current ch for the next thread.
+     * The current ch takes the rest of its stripe first */
     pthread_spin_lock (&cur_ch_spin);
     cc = u_atomic_read (&cur_ch_id);
-    new_cc = (pgs % app_nch) + cc;
+    fill = cur_ch_fill;
+    new_cc = ((fill + pgs) / gl_stripe) % app_nch + cc;
     if (new_cc > app_nch - 1)
         new_cc -= app_nch;
     u_atomic_set (&cur_ch_id, new_cc);
+    cur_ch_fill = (fill + pgs) % gl_stripe;
     pthread_spin_unlock (&cur_ch_spin);
 
-    /* Distribute the pages among the active channels */
+    /* Distribute the pages among the active channels, a stripe at a time */
     pg_left = pgs;
     act_ch_id = 0;
+    quota = gl_stripe - fill;
     memset (&pgs_ch, 0x0, sizeof(uint16_t) * app_nch);
     while(pg_left) {
-        pg_left--;
-        pgs_ch[act_ch_id]++;
+        n = MIN(quota, pg_left);
+        pg_left -= n;
+        pgs_ch[act_ch_id] += n;
+        quota = gl_stripe;
         act_ch_id = (act_ch_id == nact_ch - 1) ? 0 : act_ch_id + 1;
     }
 
@@ -152,8 +166,8 @@ REDIST:
             /* Get all pages per channel at once */
             list = calloc (sizeof (struct nvm_ppa_addr) * nppas, 1);
 
-            if (appnvm()->ch_prov->get_ppas_fn (
-                                        ch[ch_id], list, pgs_ch[act_ch_id])) {
+            if (appnvm()->ch_prov->get_ppas_fn (ch[ch_id], list,
+                                        pgs_ch[act_ch_id], APP_STREAM_HOST)) {
                 /* Mark the channel as inactive and redistribute the remaining
                  * pages */
                 appnvm_ch_dec_thread(ch[ch_id]);
@@ -171,6 +185,9 @@ REDIST:
                     goto FREE_CH;
             }
 
+            /* GC is paced by the host writes of the channel */
+            u_atomic_add (nppas, &ch[ch_id]->prov_sec);
+
             tppas += nppas;
             tmp_ppa[ch_id].nppas += nppas;
             tmp_ppa[ch_id].ppa = realloc (tmp_ppa[ch_id].ppa,
@@ -190,21 +207,26 @@ REDIST:
     if (!prov_ppa->ppa)
         goto DEC_CH;
 
-    /* Reorder PPA list for maximum parallelism */
+    /* Reorder PPA list for maximum parallelism, sequential pages of the list
+     * go to the next channel after a stripe */
     nppas = tppas;
     ch_id = cc;
+    quota = gl_stripe - fill;
     while (nppas) {
         if (tmp_ppa[ch_id].nppas > 0) {
             g = ch[ch_id]->ch->geometry;
+            n = MIN(quota, tmp_ppa[ch_id].nppas /
+                        (g->sec_per_pg * g->n_of_planes)) *
+                        g->sec_per_pg * g->n_of_planes;
 
             memcpy (&prov_ppa->ppa[tppas - nppas],
                     &tmp_ppa[ch_id].ppa[tmp_ppa[ch_id].nch],
-                    sizeof (struct nvm_ppa_addr) * g->sec_per_pg *
-                    g->n_of_planes);
+                    sizeof (struct nvm_ppa_addr) * n);
 
-            tmp_ppa[ch_id].nppas -= g->sec_per_pg * g->n_of_planes;
-            tmp_ppa[ch_id].nch += g->sec_per_pg * g->n_of_planes;
-            nppas -= g->sec_per_pg * g->n_of_planes;
+            tmp_ppa[ch_id].nppas -= n;
+            tmp_ppa[ch_id].nch += n;
+            nppas -= n;
+            quota = gl_stripe;
         }
         ch_id = (ch_id == app_nch - 1) ? 0 : ch_id + 1;
     }
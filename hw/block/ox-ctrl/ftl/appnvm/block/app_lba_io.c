@@ -26,6 +26,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <pthread.h>
+#include <time.h>
 #include <sys/queue.h>
 #include "hw/block/ox-ctrl/include/ssd.h"
 #include "../appnvm.h"
@@ -75,6 +76,72 @@ struct lba_io_sec_ent {
  * next command, if time is finished, a smaller PPA I/O command is issued */
 #define LBA_IO_EMPTY_US 400
 
+/* After LBA_IO_SEQ_RUN sequential commands, the mapping pages following the
+ * command are prefetched, so the stream does not wait for map misses */
+#define LBA_IO_SEQ_RUN      2
+#define LBA_IO_PREFETCH_PGS 2
+
+/*
+ * Write buffer, disabled if 'wb_pgs' is zero. Host sectors are copied to DRAM
+ * slots and the NVMe write completes right away, a rewrite of a dirty LBA
+ * updates its slot. Flush threads write the oldest dirty sectors as full
+ * multi-plane pages once the buffer is half full, or the sectors older than
+ * LBA_IO_WB_AGE_US. Reads are served from the buffer for the LBAs it holds.
+ *
+ * Flushed slots are kept until the mapping is updated. A rewrite meanwhile
+ * takes a new slot, only flushed after the older one.
+ */
+#define LBA_IO_WB_MIN_SEC   512   /* two maximum sized commands */
+#define LBA_IO_WB_MAX_PGS   16384
+#define LBA_IO_WB_FLUSH_TH  4     /* flush threads, up to one per channel */
+#define LBA_IO_WB_AGE_US    50000
+
+/* Deallocated LBAs are unmapped in chunks, writes get the mapping between */
+#define LBA_IO_TRIM_CHUNK   4096
+
+enum lba_wb_states {
+    LBA_WB_FREE  = 0x0,
+    LBA_WB_DIRTY = 0x1,
+    LBA_WB_FLUSH = 0x2
+};
+
+struct lba_wb_slot {
+    uint64_t                    lba;
+    uint8_t                    *data;
+    uint8_t                     state;
+    int32_t                     prev;   /* older slot of the LBA, or -1 */
+    int32_t                     hnext;  /* hash chain, newest slot first */
+    uint64_t                    ts;     /* dirty since, nsec */
+    TAILQ_ENTRY(lba_wb_slot)    entry;  /* free or dirty list */
+};
+
+struct lba_wb {
+    struct lba_wb_slot         *slots;
+    uint8_t                    *data;
+    uint32_t                    nslots;
+    uint32_t                    nfree;
+    uint32_t                    ndirty;
+    uint32_t                    high;   /* dirty slots that start flushing */
+    int32_t                    *hash;
+    uint32_t                    hash_mask;
+    uint16_t                    nth;
+    pthread_t                  *tid;
+    uint8_t                     stop;
+    pthread_mutex_t             mutex;
+    pthread_cond_t              flush_cond;
+    TAILQ_HEAD(wb_free_q, lba_wb_slot)  free_head;
+    TAILQ_HEAD(wb_dirty_q, lba_wb_slot) dirty_head;
+
+    /* Protected by mutex */
+    uint64_t                    written;
+    uint64_t                    coalesced;
+    uint64_t                    read_hit;
+    uint64_t                    flushed_pgs;
+    uint64_t                    padded;
+    uint64_t                    dropped;
+    uint64_t                    trimmed;
+};
+
 STAILQ_HEAD(flba_q, lba_io_sec) flbahead = STAILQ_HEAD_INITIALIZER(flbahead);
 TAILQ_HEAD(ulba_q, lba_io_sec) ulbahead = TAILQ_HEAD_INITIALIZER(ulbahead);
 static pthread_spinlock_t sec_spin;
@@ -84,6 +151,7 @@ TAILQ_HEAD(ucmd_q, lba_io_cmd) ucmdhead = TAILQ_HEAD_INITIALIZER(ucmdhead);
 static pthread_spinlock_t cmd_spin;
 
 extern pthread_mutex_t gc_ns_mutex;
+extern struct core_struct core;
 
 static struct ox_mq        *lba_io_mq;
 
@@ -95,6 +163,15 @@ static struct app_channel **ch;
 static struct lba_io_sec   *rw_line[2][64];
 static uint8_t              rw_off[2];
 
+/* Sequential stream detection, index 0: write, index 1: read */
+static uint64_t             seq_next[2];
+static uint8_t              seq_run[2];
+
+static struct lba_wb        wb;
+
+/* Reads of unmapped LBAs return zeroes */
+static uint8_t              lba_io_zero_sec[NVME_KERNEL_PG_SIZE];
+
 static void lba_io_reset_cmd (struct lba_io_cmd *lcmd)
 {
     memset (&lcmd->cmd, 0x0, sizeof (struct nvm_io_cmd));
@@ -176,48 +253,519 @@ COMPLETE_CMD:
     pthread_spin_unlock (&cmd_spin);
 }
 
+/* Submitters race on the stream state, it is only a hint */
+static void lba_io_seq_prefetch (struct nvm_io_cmd *cmd, uint8_t type)
+{
+    uint64_t next = cmd->slba + cmd->n_sec;
+
+    if (__atomic_exchange_n (&seq_next[type], next, __ATOMIC_RELAXED) !=
+                                                                   cmd->slba) {
+        seq_run[type] = 0;
+        return;
+    }
+
+    if (seq_run[type] < LBA_IO_SEQ_RUN) {
+        seq_run[type]++;
+        return;
+    }
+
+    appnvm()->gl_map->prefetch_fn (next, LBA_IO_PREFETCH_PGS);
+}
+
+static uint64_t lba_wb_now (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Newest slot holding the LBA, or -1. Called with wb.mutex held */
+static int32_t lba_wb_lookup (uint64_t lba)
+{
+    int32_t idx = wb.hash[lba & wb.hash_mask];
+
+    while (idx >= 0 && wb.slots[idx].lba != lba)
+        idx = wb.slots[idx].hnext;
+
+    return idx;
+}
+
+static void lba_wb_hash_remove (struct lba_wb_slot *slot)
+{
+    int32_t *idx = &wb.hash[slot->lba & wb.hash_mask];
+    int32_t id = slot - wb.slots;
+
+    while (*idx != id)
+        idx = &wb.slots[*idx].hnext;
+    *idx = slot->hnext;
+}
+
+static void lba_wb_put_slot (struct lba_wb_slot *slot)
+{
+    lba_wb_hash_remove (slot);
+    slot->state = LBA_WB_FREE;
+    TAILQ_INSERT_TAIL(&wb.free_head, slot, entry);
+    wb.nfree++;
+}
+
+/*
+ * Copies the command sectors to the buffer and completes the command. If
+ * the buffer has no room, the flush threads are woken and the submission
+ * fails, the FTL queue retries it.
+ */
+static int lba_wb_write (struct nvm_io_cmd *cmd)
+{
+    uint32_t sec_i;
+    int32_t idx;
+    struct lba_wb_slot *slot;
+    uint64_t lba, now = lba_wb_now ();
+
+    pthread_mutex_lock (&wb.mutex);
+
+    /* Rewrites may not need all, a command is always smaller than the buf */
+    if (wb.nfree < cmd->n_sec) {
+        pthread_cond_broadcast (&wb.flush_cond);
+        pthread_mutex_unlock (&wb.mutex);
+        return -1;
+    }
+
+    for (sec_i = 0; sec_i < cmd->n_sec; sec_i++) {
+        lba = cmd->slba + sec_i;
+        idx = lba_wb_lookup (lba);
+
+        if (idx >= 0 && wb.slots[idx].state == LBA_WB_DIRTY) {
+            slot = &wb.slots[idx];
+            wb.coalesced++;
+        } else {
+            slot = TAILQ_FIRST(&wb.free_head);
+            TAILQ_REMOVE(&wb.free_head, slot, entry);
+            wb.nfree--;
+
+            slot->lba = lba;
+            slot->prev = idx;
+            slot->state = LBA_WB_DIRTY;
+            slot->ts = now;
+            slot->hnext = wb.hash[lba & wb.hash_mask];
+            wb.hash[lba & wb.hash_mask] = slot - wb.slots;
+
+            TAILQ_INSERT_TAIL(&wb.dirty_head, slot, entry);
+            wb.ndirty++;
+        }
+
+        if (nvm_dma (slot->data, cmd->prp[sec_i], NVME_KERNEL_PG_SIZE,
+                                                        NVM_DMA_FROM_HOST)) {
+            cmd->status.status = NVM_IO_FAIL;
+            cmd->status.nvme_status = NVME_DATA_TRAS_ERROR;
+            break;
+        }
+    }
+    wb.written += sec_i;
+
+    if (wb.ndirty >= wb.high)
+        pthread_cond_signal (&wb.flush_cond);
+
+    pthread_mutex_unlock (&wb.mutex);
+
+    if (cmd->status.status != NVM_IO_FAIL) {
+        cmd->status.status = NVM_IO_SUCCESS;
+        cmd->status.nvme_status = NVME_SUCCESS;
+    }
+    nvm_complete_ftl (cmd);
+
+    return 0;
+}
+
+/* Copies the buffered sectors to the host, sets 'hit' for each of them */
+static uint32_t lba_wb_read (struct nvm_io_cmd *cmd, uint8_t *hit)
+{
+    uint32_t sec_i, nhit = 0;
+    int32_t idx;
+
+    pthread_mutex_lock (&wb.mutex);
+    for (sec_i = 0; sec_i < cmd->n_sec; sec_i++) {
+        hit[sec_i] = 0;
+        idx = lba_wb_lookup (cmd->slba + sec_i);
+        if (idx < 0)
+            continue;
+
+        if (nvm_dma (wb.slots[idx].data, cmd->prp[sec_i], NVME_KERNEL_PG_SIZE,
+                                                          NVM_DMA_TO_HOST)) {
+            cmd->status.status = NVM_IO_FAIL;
+            cmd->status.nvme_status = NVME_DATA_TRAS_ERROR;
+        }
+        hit[sec_i] = 1;
+        nhit++;
+    }
+    wb.read_hit += nhit;
+    pthread_mutex_unlock (&wb.mutex);
+
+    return nhit;
+}
+
+/*
+ * Takes up to a page of the oldest dirty slots, if the buffer is above the
+ * watermark, the oldest slot is aged or the buffer is stopping. Slots waiting
+ * for an older slot of the same LBA are skipped. Called with wb.mutex held.
+ */
+static uint32_t lba_wb_pick (struct lba_wb_slot **pg, uint32_t max)
+{
+    uint32_t n = 0;
+    struct lba_wb_slot *slot, *next;
+
+    slot = TAILQ_FIRST(&wb.dirty_head);
+    if (!slot)
+        return 0;
+
+    if (!wb.stop && wb.ndirty < wb.high &&
+                        lba_wb_now () - slot->ts < LBA_IO_WB_AGE_US * 1000ULL)
+        return 0;
+
+    for (; slot && n < max; slot = next) {
+        next = TAILQ_NEXT(slot, entry);
+
+        if (slot->prev >= 0 && wb.slots[slot->prev].state == LBA_WB_FLUSH &&
+                                    wb.slots[slot->prev].lba == slot->lba)
+            continue;
+
+        TAILQ_REMOVE(&wb.dirty_head, slot, entry);
+        wb.ndirty--;
+        slot->state = LBA_WB_FLUSH;
+        pg[n++] = slot;
+    }
+
+    return n;
+}
+
+/*
+ * Writes the slots to a page from the global provisioning and updates the
+ * mapping. Sectors not filled by the slots are padded.
+ * @return number of slots written, negative if the page write failed
+ */
+static int lba_wb_flush_pg (struct lba_wb_slot **pg, uint32_t n)
+{
+    struct app_prov_ppas *prov;
+    struct app_channel *lch;
+    struct nvm_mmgr_geometry *geo;
+    struct app_io_data *io;
+    struct app_pg_oob *oob;
+    uint32_t sec_i;
+    int ret = -1;
+
+    prov = appnvm()->gl_prov->new_fn (1);
+    if (!prov)
+        return -1;
+
+    lch = ch[prov->ppa[0].g.ch];
+    geo = lch->ch->geometry;
+
+    io = app_alloc_pg_io (lch);
+    if (!io)
+        goto FREE_PPA;
+
+    for (sec_i = 0; sec_i < geo->sec_per_pl_pg; sec_i++) {
+        oob = (struct app_pg_oob *) io->oob_vec[sec_i];
+        if (sec_i < n) {
+            memcpy (io->sec_vec[sec_i / geo->sec_per_pg]
+                                              [sec_i % geo->sec_per_pg],
+                                        pg[sec_i]->data, NVME_KERNEL_PG_SIZE);
+            oob->lba = pg[sec_i]->lba;
+            oob->pg_type = APP_PG_NAMESPACE;
+        } else {
+            oob->lba = AND64;
+            oob->pg_type = APP_PG_PADDING;
+        }
+    }
+
+    if (app_pg_io (lch, MMGR_WRITE_PG, (void **) io->pl_vec, prov->ppa)) {
+        appnvm()->md->invalidate_fn (lch, prov->ppa, APP_INVALID_PAGE);
+        goto FREE_IO;
+    }
+
+    for (sec_i = 0; sec_i < geo->sec_per_pl_pg; sec_i++) {
+        if (sec_i < n) {
+            pthread_mutex_lock (&gc_ns_mutex);
+            ret = appnvm()->gl_map->upsert_fn (pg[sec_i]->lba,
+                                                      prov->ppa[sec_i].ppa);
+            pthread_mutex_unlock (&gc_ns_mutex);
+            if (!ret)
+                continue;
+            log_err ("[appnvm (lba_io): Write buffer upsert failed. "
+                                                "LBA %lu]", pg[sec_i]->lba);
+        }
+        appnvm()->md->invalidate_fn (lch, &prov->ppa[sec_i],
+                                                          APP_INVALID_SECTOR);
+    }
+    ret = n;
+
+FREE_IO:
+    app_free_pg_io (io);
+FREE_PPA:
+    appnvm()->gl_prov->free_fn (prov);
+    return ret;
+}
+
+static void *lba_wb_flush_th (void *arg)
+{
+    struct lba_wb_slot *pg[sec_pl_pg];
+    struct timespec ts;
+    uint32_t n, sec_i;
+    int ret;
+
+    pthread_mutex_lock (&wb.mutex);
+    while (!wb.stop || wb.ndirty) {
+        n = lba_wb_pick (pg, sec_pl_pg);
+        if (!n) {
+            clock_gettime (CLOCK_REALTIME, &ts);
+            ts.tv_nsec += LBA_IO_WB_AGE_US * 1000 / 2;
+            if (ts.tv_nsec >= 1000000000) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait (&wb.flush_cond, &wb.mutex, &ts);
+            continue;
+        }
+        pthread_mutex_unlock (&wb.mutex);
+
+        ret = lba_wb_flush_pg (pg, n);
+
+        pthread_mutex_lock (&wb.mutex);
+        for (sec_i = 0; sec_i < n; sec_i++) {
+
+            /* A failed slot is written again, unless it has been rewritten */
+            if (ret < 0 && !wb.stop && lba_wb_lookup (pg[sec_i]->lba) ==
+                                                        pg[sec_i] - wb.slots) {
+                pg[sec_i]->state = LBA_WB_DIRTY;
+                TAILQ_INSERT_HEAD(&wb.dirty_head, pg[sec_i], entry);
+                wb.ndirty++;
+                continue;
+            }
+            if (ret < 0)
+                wb.dropped++;
+            lba_wb_put_slot (pg[sec_i]);
+        }
+
+        if (ret < 0) {
+            log_err ("[appnvm (lba_io): Write buffer flush failed.]");
+            pthread_mutex_unlock (&wb.mutex);
+            usleep (LBA_IO_RETRY_DELAY);
+            pthread_mutex_lock (&wb.mutex);
+        } else {
+            wb.flushed_pgs++;
+            wb.padded += sec_pl_pg - n;
+        }
+
+        /* Slots waiting for the flushed ones can go now */
+        pthread_cond_broadcast (&wb.flush_cond);
+    }
+    pthread_mutex_unlock (&wb.mutex);
+
+    return NULL;
+}
+
+/*
+ * Drops the buffered sectors of a deallocated range. A slot being flushed
+ * can not be dropped, its mapping update is waited for and the LBA is
+ * unmapped after it.
+ */
+static void lba_wb_trim (uint64_t slba, uint32_t nlb)
+{
+    uint64_t lba;
+    int32_t idx;
+    struct lba_wb_slot *slot;
+
+    pthread_mutex_lock (&wb.mutex);
+    for (lba = slba; lba < slba + nlb; lba++) {
+        while ((idx = lba_wb_lookup (lba)) >= 0) {
+            slot = &wb.slots[idx];
+            if (slot->state == LBA_WB_FLUSH) {
+                pthread_cond_wait (&wb.flush_cond, &wb.mutex);
+                continue;
+            }
+            TAILQ_REMOVE(&wb.dirty_head, slot, entry);
+            wb.ndirty--;
+            lba_wb_put_slot (slot);
+            wb.trimmed++;
+        }
+    }
+    pthread_mutex_unlock (&wb.mutex);
+}
+
+static int lba_wb_init (uint32_t pgs)
+{
+    uint32_t i, hsz;
+
+    memset (&wb, 0x0, sizeof (struct lba_wb));
+    if (!pgs)
+        return 0;
+
+    pgs = MAX(pgs, (LBA_IO_WB_MIN_SEC + sec_pl_pg - 1) / sec_pl_pg);
+    pgs = MIN(pgs, LBA_IO_WB_MAX_PGS);
+    wb.nslots = pgs * sec_pl_pg;
+    wb.high = wb.nslots / 2;
+
+    for (hsz = 1; hsz < wb.nslots * 2; hsz <<= 1);
+    wb.hash_mask = hsz - 1;
+
+    wb.slots = calloc (wb.nslots, sizeof (struct lba_wb_slot));
+    if (!wb.slots)
+        goto ERR;
+
+    wb.hash = malloc (sizeof (int32_t) * hsz);
+    if (!wb.hash)
+        goto FREE_SLOTS;
+    memset (wb.hash, 0xff, sizeof (int32_t) * hsz);
+
+    wb.data = malloc ((uint64_t) wb.nslots * NVME_KERNEL_PG_SIZE);
+    if (!wb.data)
+        goto FREE_HASH;
+
+    TAILQ_INIT(&wb.free_head);
+    TAILQ_INIT(&wb.dirty_head);
+    for (i = 0; i < wb.nslots; i++) {
+        wb.slots[i].data = wb.data + (uint64_t) i * NVME_KERNEL_PG_SIZE;
+        wb.slots[i].prev = wb.slots[i].hnext = -1;
+        TAILQ_INSERT_TAIL(&wb.free_head, &wb.slots[i], entry);
+    }
+    wb.nfree = wb.nslots;
+
+    if (pthread_mutex_init (&wb.mutex, NULL))
+        goto FREE_DATA;
+    if (pthread_cond_init (&wb.flush_cond, NULL))
+        goto MUTEX;
+
+    wb.tid = malloc (sizeof (pthread_t) * LBA_IO_WB_FLUSH_TH);
+    if (!wb.tid)
+        goto COND;
+
+    for (wb.nth = 0; wb.nth < MIN(LBA_IO_WB_FLUSH_TH, app_nch); wb.nth++)
+        if (pthread_create (&wb.tid[wb.nth], NULL, lba_wb_flush_th, NULL))
+            goto STOP;
+
+    log_info("    [appnvm: Write buffer started. %d pages, %d flush threads]\n",
+                                                                pgs, wb.nth);
+    return 0;
+
+STOP:
+    pthread_mutex_lock (&wb.mutex);
+    wb.stop = 1;
+    pthread_cond_broadcast (&wb.flush_cond);
+    pthread_mutex_unlock (&wb.mutex);
+    while (wb.nth) {
+        wb.nth--;
+        pthread_join (wb.tid[wb.nth], NULL);
+    }
+    free (wb.tid);
+COND:
+    pthread_cond_destroy (&wb.flush_cond);
+MUTEX:
+    pthread_mutex_destroy (&wb.mutex);
+FREE_DATA:
+    free (wb.data);
+FREE_HASH:
+    free (wb.hash);
+FREE_SLOTS:
+    free (wb.slots);
+ERR:
+    wb.nslots = 0;
+    return -1;
+}
+
+/* Writes all the dirty sectors back before stopping the flush threads */
+static void lba_wb_exit (void)
+{
+    if (!wb.nslots)
+        return;
+
+    pthread_mutex_lock (&wb.mutex);
+    wb.stop = 1;
+    pthread_cond_broadcast (&wb.flush_cond);
+    pthread_mutex_unlock (&wb.mutex);
+
+    while (wb.nth) {
+        wb.nth--;
+        pthread_join (wb.tid[wb.nth], NULL);
+    }
+
+    log_info ("    [appnvm: Write buffer: %lu sectors written, %lu coalesced, "
+            "%lu read hits, %lu pages flushed, %lu padded, %lu dropped, "
+            "%lu deallocated]\n", wb.written, wb.coalesced, wb.read_hit,
+            wb.flushed_pgs, wb.padded, wb.dropped, wb.trimmed);
+
+    free (wb.tid);
+    pthread_cond_destroy (&wb.flush_cond);
+    pthread_mutex_destroy (&wb.mutex);
+    free (wb.data);
+    free (wb.hash);
+    free (wb.slots);
+    wb.nslots = 0;
+}
+
 static int lba_io_submit (struct nvm_io_cmd *cmd)
 {
-    uint32_t sec_i = 0, ch_i, qtype, ret = 0;
+    uint32_t sec_i = 0, ch_i, qtype, nlba = 0, ret = 0;
     struct lba_io_sec *lba[256];
+    uint8_t hit[256];
     qtype = (cmd->cmdtype == MMGR_WRITE_PG) ? LBA_IO_WRITE_Q : LBA_IO_READ_Q;
 
+    if (wb.nslots && qtype == LBA_IO_WRITE_Q)
+        return lba_wb_write (cmd);
+
     for (ch_i = 0; ch_i < app_nch; ch_i++)
         if (appnvm_ch_active (ch[ch_i]))
             ret++;
     if (!ret)
         goto REQUEUE;
 
+    /* Buffered sectors count as processed, the others are read from NVM */
+    memset (hit, 0x0, cmd->n_sec);
+    if (wb.nslots) {
+        cmd->status.pgs_p = lba_wb_read (cmd, hit);
+        if (cmd->status.pgs_p == cmd->n_sec) {
+            if (cmd->status.status != NVM_IO_FAIL)
+                cmd->status.status = NVM_IO_SUCCESS;
+            nvm_complete_ftl (cmd);
+            return 0;
+        }
+    }
+
     for (sec_i = 0; sec_i < cmd->n_sec; sec_i++) {
+        if (hit[sec_i])
+            continue;
+
         pthread_spin_lock (&sec_spin);
         if (STAILQ_EMPTY(&flbahead)) {
             pthread_spin_unlock (&sec_spin);
             goto REQUEUE;
         }
 
-        lba[sec_i] = STAILQ_FIRST(&flbahead);
-        if (!lba[sec_i]) {
+        lba[nlba] = STAILQ_FIRST(&flbahead);
+        if (!lba[nlba]) {
             pthread_spin_unlock (&sec_spin);
             goto REQUEUE;
         }
         STAILQ_REMOVE_HEAD (&flbahead, fentry);
-        TAILQ_INSERT_TAIL(&ulbahead, lba[sec_i], uentry);
+        TAILQ_INSERT_TAIL(&ulbahead, lba[nlba], uentry);
         pthread_spin_unlock (&sec_spin);
 
-        lba[sec_i]->lba_id = sec_i;
-        lba[sec_i]->nvme = cmd;
-        lba[sec_i]->lba = cmd->slba + sec_i;
-        lba[sec_i]->type = qtype;
-        lba[sec_i]->prov = NULL;
-        lba[sec_i]->prp = cmd->prp[sec_i];
+        lba[nlba]->lba_id = sec_i;
+        lba[nlba]->nvme = cmd;
+        lba[nlba]->lba = cmd->slba + sec_i;
+        lba[nlba]->type = qtype;
+        lba[nlba]->prov = NULL;
+        lba[nlba]->prp = cmd->prp[sec_i];
+        nlba++;
     }
 
-    for (sec_i = 0; sec_i < cmd->n_sec; sec_i++) {
-        if (ox_mq_submit_req(lba_io_mq, qtype, lba[sec_i]))
+    for (sec_i = 0; sec_i < nlba; sec_i++) {
+        if (ox_mq_submit_req_wait(lba_io_mq, qtype, lba[sec_i],
+                                                        NVM_QUEUE_WAIT_USEC))
             /* MQ_TO and callback take care of aborting submitted lbas */
             goto REQUEUE_UNPROCESSED;
     }
 
+    lba_io_seq_prefetch (cmd, qtype);
+
     return 0;
 
 REQUEUE_UNPROCESSED:
@@ -227,7 +775,9 @@ REQUEUE_UNPROCESSED:
     /* If at least 1 lba has been enqueued, let the callback
                                 completing the nvme cmd by returning success */
     ret = (sec_i) ? 0 : -1;
-    while (sec_i < cmd->n_sec) {
+    if (ret)
+        cmd->status.pgs_p = 0;
+    while (sec_i < nlba) {
         lba[sec_i]->nvme->status.pgs_p++;
         lba[sec_i]->nvme = 0x0;
         lba[sec_i]->lba = 0x0;
@@ -241,16 +791,17 @@ REQUEUE_UNPROCESSED:
     return ret;
 
 REQUEUE:
-    while (sec_i) {
-        sec_i--;
-        lba[sec_i]->nvme = 0x0;
-        lba[sec_i]->lba = 0x0;
-        lba[sec_i]->prp = 0x0;
+    while (nlba) {
+        nlba--;
+        lba[nlba]->nvme = 0x0;
+        lba[nlba]->lba = 0x0;
+        lba[nlba]->prp = 0x0;
         pthread_spin_lock (&sec_spin);
-        TAILQ_REMOVE(&ulbahead, lba[sec_i], uentry);
-        STAILQ_INSERT_TAIL(&flbahead, lba[sec_i], fentry);
+        TAILQ_REMOVE(&ulbahead, lba[nlba], uentry);
+        STAILQ_INSERT_TAIL(&flbahead, lba[nlba], fentry);
         pthread_spin_unlock (&sec_spin);
     }
+    cmd->status.pgs_p = 0;
     cmd->status.status = NVM_IO_FAIL;
     cmd->status.nvme_status = NVME_INTERNAL_DEV_ERROR;
     return -1;
@@ -429,10 +980,11 @@ FREE:
 static int lba_io_read (struct lba_io_cmd *lcmd)
 {
     int ret;
-    uint32_t sec_i, sec_oob, pgs;
+    uint32_t sec_i, sec_oob, pgs, n = 0, nzero = 0;
     struct nvm_io_cmd *cmd;
     uint32_t nlb = rw_off[LBA_IO_READ_Q];
     struct nvm_ppa_addr sec_ppa;
+    struct lba_io_sec *lba, *zero[LBA_IO_PPA_SIZE];
 
     pgs = nlb / sec_pl_pg;
     if (nlb % sec_pl_pg > 0)
@@ -448,34 +1000,64 @@ static int lba_io_read (struct lba_io_cmd *lcmd)
     if (!lcmd->oob_lba)
         return 1;
 
+    /* Mapping pages of the line are loaded in parallel, misses below wait
+     * for the prefetch threads instead of reading one page at a time */
+    for (sec_i = 0; sec_i < nlb; sec_i++)
+        appnvm()->gl_map->prefetch_fn (rw_line[LBA_IO_READ_Q][sec_i]->lba, 1);
+
     for (sec_i = 0; sec_i < nlb; sec_i++) {
+        lba = rw_line[LBA_IO_READ_Q][sec_i];
 
-        sec_ppa.ppa = appnvm()->gl_map->read_fn
-                                          (rw_line[LBA_IO_READ_Q][sec_i]->lba);
+        sec_ppa.ppa = appnvm()->gl_map->read_fn (lba->lba);
         if (sec_ppa.ppa == AND64) {
             free (lcmd->oob_lba);
             return 1;
         }
 
-        rw_line[LBA_IO_READ_Q][sec_i]->ppa.ppa = sec_ppa.ppa;
-        cmd->ppalist[sec_i].ppa = sec_ppa.ppa;
-        cmd->prp[sec_i] = rw_line[LBA_IO_READ_Q][sec_i]->prp;
+        /* Unmapped or deallocated, completed below without NVM I/O */
+        if (!sec_ppa.ppa) {
+            zero[nzero++] = lba;
+            continue;
+        }
 
-        cmd->channel[sec_i] = ch[sec_ppa.g.ch]->ch;
+        lba->ppa.ppa = sec_ppa.ppa;
+        cmd->ppalist[n].ppa = sec_ppa.ppa;
+        cmd->prp[n] = lba->prp;
 
-        lcmd->vec[sec_i] = rw_line[LBA_IO_READ_Q][sec_i];
-    }
+        cmd->channel[n] = ch[sec_ppa.g.ch]->ch;
 
-    lba_io_prepare_cmd (lcmd, LBA_IO_READ_Q);
+        lcmd->vec[n] = lba;
+        n++;
+    }
+    cmd->n_sec = n;
 
-    ret = appnvm()->ppa_io->submit_fn (cmd);
+    ret = 0;
+    if (n) {
+        lba_io_prepare_cmd (lcmd, LBA_IO_READ_Q);
+        ret = appnvm()->ppa_io->submit_fn (cmd);
+    }
 
     pthread_mutex_lock (&lcmd->mutex);
-    if (ret && lcmd->oob_lba)
+    if ((ret || !n) && lcmd->oob_lba) {
         free (lcmd->oob_lba);
+        lcmd->oob_lba = NULL;
+    }
     pthread_mutex_unlock (&lcmd->mutex);
 
-    return ret;
+    /* If the submission failed, the whole line is retried */
+    if (ret)
+        return ret;
+
+    for (sec_i = 0; sec_i < nzero; sec_i++) {
+        if (zero[sec_i]->nvme && nvm_dma (lba_io_zero_sec, zero[sec_i]->prp, NVME_KERNEL_PG_SIZE,
+                                                          NVM_DMA_TO_HOST)) {
+            zero[sec_i]->nvme->status.status = NVM_IO_FAIL;
+            zero[sec_i]->nvme->status.nvme_status = NVME_DATA_TRAS_ERROR;
+        }
+        ox_mq_complete_req (lba_io_mq, zero[sec_i]->mentry);
+    }
+
+    return 0;
 }
 
 static int lba_io_rw (uint8_t type)
@@ -500,7 +1082,8 @@ static int lba_io_rw (uint8_t type)
 
     ret = (!type) ? lba_io_write (lcmd) : lba_io_read (lcmd);
 
-    if (ret)
+    /* A read line of unmapped LBAs only does not use the command */
+    if (ret || !lcmd->cmd.n_sec)
         goto REQUEUE;
 
     return 0;
@@ -727,6 +1310,8 @@ static int lba_io_init (void)
 
     rw_off[0] = 0;
     rw_off[1] = 0;
+    seq_next[0] = seq_next[1] = AND64;
+    seq_run[0] = seq_run[1] = 0;
 
     if (pthread_spin_init(&cmd_spin, 0))
         goto FREE_CH;
@@ -759,10 +1344,16 @@ static int lba_io_init (void)
     if (!lba_io_mq)
         goto FREE_CMD;
 
+    if (lba_wb_init ((core.qemu) ? core.qemu->wb_pgs : 0))
+        goto FREE_MQ;
+
     log_info("    [appnvm: LBA I/O started.]\n");
 
     return 0;
 
+FREE_MQ:
+    ox_mq_destroy(lba_io_mq);
+
 FREE_CMD:
     lba_io_free_cmd ();
     pthread_spin_destroy (&sec_spin);
@@ -773,11 +1364,43 @@ FREE_CH:
     return -1;
 }
 
+/*
+ * Deallocates a LBA range. Buffered sectors are dropped first, so a flush
+ * does not map them again after the range is unmapped.
+ */
+static int lba_io_trim (uint64_t slba, uint32_t nlb)
+{
+    uint32_t n;
+    int ret;
+
+    if (wb.nslots)
+        lba_wb_trim (slba, nlb);
+
+    while (nlb) {
+        n = MIN(nlb, LBA_IO_TRIM_CHUNK);
+
+        pthread_mutex_lock (&gc_ns_mutex);
+        ret = appnvm()->gl_map->trim_fn (slba, n);
+        pthread_mutex_unlock (&gc_ns_mutex);
+        if (ret) {
+            log_err ("[appnvm (lba_io): Deallocate failed. LBA %lu, nlb %d]",
+                                                                     slba, n);
+            return -1;
+        }
+
+        slba += n;
+        nlb -= n;
+    }
+
+    return 0;
+}
+
 static void lba_io_exit (void)
 {
     struct lba_io_cmd *cmd;
     struct lba_io_sec *sec;
 
+    lba_wb_exit ();
     ox_mq_destroy(lba_io_mq);
 
     while (!TAILQ_EMPTY(&ucmdhead)) {
@@ -807,7 +1430,8 @@ static struct app_lba_io appftl_lba_io = {
     .init_fn     = lba_io_init,
     .exit_fn     = lba_io_exit,
     .submit_fn   = lba_io_submit,
-    .callback_fn = lba_io_callback
+    .callback_fn = lba_io_callback,
+    .trim_fn     = lba_io_trim
 };
 
 void lba_io_register (void) {
@@ -10,6 +10,7 @@
  */
 
 #include "hw/block/ox-ctrl/include/ssd.h"
+#include "hw/block/ox-ctrl/include/ox-bbt.h"
 
 #include <syslog.h>
 #include <stdlib.h>
@@ -21,7 +22,8 @@
 
 LIST_HEAD(lnvm_ch, lnvm_channel) ch_head = LIST_HEAD_INITIALIZER(ch_head);
 
-static pthread_mutex_t endio_mutex;
+extern struct core_struct core;
+
 static int lnvm_submit_io (struct nvm_io_cmd *);
 
 static struct lnvm_channel *lnvm_get_ch_instance(uint16_t ch_id)
@@ -35,15 +37,6 @@ static struct lnvm_channel *lnvm_get_ch_instance(uint16_t ch_id)
     return NULL;
 }
 
-static void lnvm_set_pgmap(uint8_t *pgmap, uint8_t index, uint8_t flag)
-{
-    pthread_mutex_lock(&endio_mutex);
-    pgmap[index / 8] = (flag)
-            ? pgmap[index / 8] | (1 << (index % 8))
-            : pgmap[index / 8] ^ (1 << (index % 8));
-    pthread_mutex_unlock(&endio_mutex);
-}
-
 static int lnvm_check_pgmap_complete (uint8_t *pgmap, uint8_t ni) {
     int sum = 0, i;
     for (i = 0; i < ni; i++)
@@ -51,82 +44,53 @@ static int lnvm_check_pgmap_complete (uint8_t *pgmap, uint8_t ni) {
     return sum;
 }
 
-static int lnvm_pg_read (struct nvm_mmgr_io_cmd *cmd)
+/* Pages still set in the map failed, only those are retried. Called once the
+ * last page of the command is completed */
+static void lnvm_end_io (struct nvm_io_cmd *cmd)
 {
-    return nvm_submit_mmgr(cmd);
-}
-
-static int lnvm_pg_write (struct nvm_mmgr_io_cmd *cmd)
-{
-    return nvm_submit_mmgr(cmd);
-}
-
-static int lnvm_erase_blk (struct nvm_mmgr_io_cmd *cmd)
-{
-    return nvm_submit_mmgr(cmd);
-}
-
-/* If all pages were processed, it checks for errors. If all succeed, finish
- * cmd. Otherwise, retry only pages with error.
- *
- * Calls to this fn come from submit_io or from end_pg_io
- */
-static int lnvm_check_end_io (struct nvm_io_cmd *cmd)
-{
-    if (cmd->status.pgs_p == cmd->status.total_pgs) {
-
-        pthread_mutex_lock(&endio_mutex);
-        /* if true, some pages failed */
-        if ( lnvm_check_pgmap_complete(cmd->status.pg_map,
+    /* if true, some pages failed */
+    if (cmd->status.total_pgs && lnvm_check_pgmap_complete(cmd->status.pg_map,
                                       ((cmd->status.total_pgs - 1) / 8) + 1)) {
 
-            cmd->status.ret_t++;
-            if (cmd->status.ret_t <= FTL_LNVM_IO_RETRY) {
-                log_err ("[FTL WARNING: Cmd resubmitted due failed pages]\n");
-                goto SUBMIT;
-            } else {
-                log_err ("[FTL WARNING: Completing FAILED command]\n");
-                cmd->status.status = NVM_IO_FAIL;
-                cmd->status.nvme_status = NVME_DATA_TRAS_ERROR;
-                goto COMPLETE;
-            }
-
-        } else {
-            cmd->status.status = NVM_IO_SUCCESS;
-            cmd->status.nvme_status = NVME_SUCCESS;
-            goto COMPLETE;
+        cmd->status.ret_t++;
+        if (cmd->status.ret_t <= FTL_LNVM_IO_RETRY) {
+            log_err ("[FTL WARNING: Cmd resubmitted due failed pages]\n");
+            lnvm_submit_io(cmd);
+            return;
         }
-    }
-    goto RETURN;
 
-SUBMIT:
-    pthread_mutex_unlock(&endio_mutex);
-    lnvm_submit_io(cmd);
-    goto RETURN;
+        log_err ("[FTL WARNING: Completing FAILED command]\n");
+        cmd->status.status = NVM_IO_FAIL;
+        cmd->status.nvme_status = NVME_DATA_TRAS_ERROR;
+    } else {
+        cmd->status.status = NVM_IO_SUCCESS;
+        cmd->status.nvme_status = NVME_SUCCESS;
+    }
 
-COMPLETE:
-    pthread_mutex_unlock(&endio_mutex);
     nvm_complete_ftl(cmd);
+}
 
-RETURN:
-    return 0;
+/* The thread releasing the last outstanding page ends the command */
+static void lnvm_put_pending (struct nvm_io_cmd *cmd, int n)
+{
+    if (u_atomic_sub_and_test(n, &cmd->status.pgs_pending))
+        lnvm_end_io(cmd);
 }
 
 static void lnvm_callback_io (struct nvm_mmgr_io_cmd *cmd)
 {
+    struct nvm_io_status *st = &cmd->nvm_io->status;
+
     if (cmd->status == NVM_IO_SUCCESS) {
-        lnvm_set_pgmap(cmd->nvm_io->status.pg_map, cmd->pg_index,FTL_PGMAP_OFF);
-        pthread_mutex_lock(&endio_mutex);
-        cmd->nvm_io->status.pgs_s++;
+        __atomic_fetch_and (&st->pg_map[cmd->pg_index / 8],
+                        (uint8_t) ~(1 << (cmd->pg_index % 8)), __ATOMIC_RELAXED);
+        __atomic_fetch_add (&st->pgs_s, 1, __ATOMIC_RELAXED);
     } else {
-        pthread_mutex_lock(&endio_mutex);
-        cmd->nvm_io->status.pg_errors++;
+        __atomic_fetch_add (&st->pg_errors, 1, __ATOMIC_RELAXED);
     }
+    __atomic_fetch_add (&st->pgs_p, 1, __ATOMIC_RELAXED);
 
-    cmd->nvm_io->status.pgs_p++;
-    pthread_mutex_unlock(&endio_mutex);
-
-    lnvm_check_end_io(cmd->nvm_io);
+    lnvm_put_pending(cmd->nvm_io, 1);
 }
 
 static int lnvm_check_pg_io (struct nvm_io_cmd *cmd, uint8_t index)
@@ -191,7 +155,7 @@ static int lnvm_check_io (struct nvm_io_cmd *cmd)
 
     if (cmd->status.pgs_p == 0) {
         for (i = 0; i < cmd->status.total_pgs; i++)
-            lnvm_set_pgmap(cmd->status.pg_map, i, FTL_PGMAP_ON);
+            cmd->status.pg_map[i / 8] |= 1 << (i % 8);
     }
 
     cmd->status.pgs_p = cmd->status.pgs_s;
@@ -207,6 +171,78 @@ static int lnvm_check_io (struct nvm_io_cmd *cmd)
     return 0;
 }
 
+/*
+ * In-device vector copy. Source pages are read once for consecutive sectors
+ * of the same page, each destination page is written when its last sector is
+ * copied. Sync I/Os to the media manager, it runs in the FTL queue thread.
+ */
+static int lnvm_copy_io (struct nvm_io_cmd *cmd)
+{
+    struct nvm_mmgr_geometry *geo = cmd->channel[0]->geometry;
+    struct nvm_mmgr_io_cmd mio;
+    struct nvm_ppa_addr *src, *dst, pg, last;
+    uint32_t sec_i, sec_sz, oob_sz, buf_sz;
+    uint8_t *rbuf, *wbuf, *rmd, *wmd;
+    int ret = -1;
+
+    sec_sz = geo->pg_size / geo->sec_per_pg;
+    oob_sz = geo->sec_oob_sz;
+    buf_sz = geo->pg_size + oob_sz * geo->sec_per_pg;
+
+    rbuf = malloc (buf_sz);
+    if (!rbuf)
+        return -1;
+    wbuf = malloc (buf_sz);
+    if (!wbuf)
+        goto FREE_R;
+
+    rmd = rbuf + sec_sz * geo->sec_per_pg;
+    wmd = wbuf + sec_sz * geo->sec_per_pg;
+    last.ppa = LNVM_PBA_UNMAPPED;
+
+    for (sec_i = 0; sec_i < cmd->n_sec; sec_i++) {
+        src = &cmd->ppalist[sec_i];
+        dst = &cmd->dst_ppalist[sec_i];
+
+        pg.ppa = src->ppa;
+        pg.g.sec = 0;
+        if (pg.ppa != last.ppa) {
+            memset (&mio, 0x0, sizeof (struct nvm_mmgr_io_cmd));
+            mio.ppa = pg;
+            if (nvm_submit_sync_io (cmd->channel[sec_i], &mio, rbuf,
+                                                               MMGR_READ_PG))
+                goto FREE_W;
+            last.ppa = pg.ppa;
+        }
+
+        memcpy (wbuf + sec_sz * dst->g.sec, rbuf + sec_sz * src->g.sec, sec_sz);
+        memcpy (wmd + oob_sz * dst->g.sec, rmd + oob_sz * src->g.sec, oob_sz);
+
+        if (dst->g.sec < geo->sec_per_pg - 1)
+            continue;
+
+        memset (&mio, 0x0, sizeof (struct nvm_mmgr_io_cmd));
+        mio.ppa = *dst;
+        mio.ppa.g.sec = 0;
+        if (nvm_submit_sync_io (core.nvm_ch[dst->g.ch], &mio, wbuf,
+                                                              MMGR_WRITE_PG))
+            goto FREE_W;
+        cmd->status.pgs_s++;
+    }
+    ret = 0;
+
+FREE_W:
+    free (wbuf);
+FREE_R:
+    free (rbuf);
+    return ret;
+}
+
+#define LNVM_PG_PENDING(cmd, i)  ((cmd)->status.pg_map[(i) / 8] & (1 << ((i) % 8)))
+
+/* Pages to process are submitted as vectors of consecutive pages of a same
+ * media manager. Completions only decrement the outstanding counter, the
+ * submission holds a reference until all the vectors are submitted. */
 static int lnvm_submit_io (struct nvm_io_cmd *cmd)
 {
     /* DEBUG: Force timeout for testing */
@@ -215,14 +251,29 @@ static int lnvm_submit_io (struct nvm_io_cmd *cmd)
         return 0;
     */
 
-    int ret, i;
+    int ret, i, first, n, sub;
+    struct nvm_mmgr *mmgr;
+
+    if (cmd->cmdtype == MMGR_COPY_PG) {
+        if (lnvm_copy_io(cmd)) {
+            log_err ("[FTL WARNING: Completing FAILED copy command]\n");
+            cmd->status.status = NVM_IO_FAIL;
+            cmd->status.nvme_status = NVME_DATA_TRAS_ERROR;
+        } else {
+            cmd->status.status = NVM_IO_SUCCESS;
+            cmd->status.nvme_status = NVME_SUCCESS;
+        }
+        nvm_complete_ftl(cmd);
+        return 0;
+    }
+
     ret = lnvm_check_io(cmd);
     if (ret) return ret;
 
     for (i = 0; i < cmd->status.total_pgs; i++) {
 
         /* if true, page not processed yet */
-        if ( cmd->status.pg_map[i / 8] & (1 << (i % 8)) ) {
+        if (LNVM_PG_PENDING(cmd, i)) {
             if (lnvm_check_pg_io(cmd, i)) {
                 cmd->status.status = NVM_IO_FAIL;
                 cmd->status.nvme_status = NVME_INVALID_FORMAT;
@@ -231,32 +282,35 @@ static int lnvm_submit_io (struct nvm_io_cmd *cmd)
         }
     }
 
-    for (i = 0; i < cmd->status.total_pgs; i++) {
-        /* if true, page not processed yet */
-        if ( cmd->status.pg_map[i / 8] & (1 << (i % 8)) ) {
-            switch (cmd->cmdtype) {
-                case MMGR_WRITE_PG:
-                    ret = lnvm_pg_write(&cmd->mmgr_io[i]);
-                    break;
-                case MMGR_READ_PG:
-                    ret = lnvm_pg_read(&cmd->mmgr_io[i]);
-                    break;
-                case MMGR_ERASE_BLK:
-                    ret = lnvm_erase_blk(&cmd->mmgr_io[i]);
-                    break;
-                default:
-                    ret = -1;
-            }
-            if (ret) {
-                pthread_mutex_lock(&endio_mutex);
-                cmd->status.pg_errors++;
-                cmd->status.pgs_p++;
-                pthread_mutex_unlock(&endio_mutex);
-                lnvm_check_end_io(cmd);
-            }
+    u_atomic_set(&cmd->status.pgs_pending, 1);
+
+    i = 0;
+    while (i < cmd->status.total_pgs) {
+        if (!LNVM_PG_PENDING(cmd, i)) {
+            i++;
+            continue;
+        }
+
+        first = i;
+        mmgr = cmd->mmgr_io[i].ch->mmgr;
+        for (i++; i < cmd->status.total_pgs && LNVM_PG_PENDING(cmd, i) &&
+                                    cmd->mmgr_io[i].ch->mmgr == mmgr; i++);
+        n = i - first;
+
+        u_atomic_add(n, &cmd->status.pgs_pending);
+        sub = nvm_submit_mmgr_io_vec (&cmd->mmgr_io[first], n);
+
+        /* Pages not taken by the media manager never complete */
+        if (sub < n) {
+            __atomic_fetch_add (&cmd->status.pg_errors, n - sub,
+                                                            __ATOMIC_RELAXED);
+            __atomic_fetch_add (&cmd->status.pgs_p, n - sub, __ATOMIC_RELAXED);
+            u_atomic_sub(n - sub, &cmd->status.pgs_pending);
         }
     }
 
+    lnvm_put_pending(cmd, 1);
+
     return 0;
 }
 
@@ -303,11 +357,10 @@ static int lnvm_init_channel (struct nvm_channel *ch)
         goto FREE_LCH;
 
     bbt = lch->bbtbl;
-    bbt->tbl = malloc (sizeof(uint8_t) * tblks);
+    bbt->tbl = ox_bbt_alloc (tblks);
     if (!bbt->tbl)
         goto FREE_BBTBL;
 
-    memset (bbt->tbl, 0, tblks);
     bbt->magic = 0;
     bbt->bb_sz = tblks;
 
@@ -354,7 +407,7 @@ static int lnvm_ftl_get_bbtbl (struct nvm_ppa_addr *ppa, uint8_t *bbtbl,
                                         (ch->geometry->n_of_planes & 0xffff))
         return -1;
 
-    memcpy(bbtbl, &lch->bbtbl->tbl[l_addr], nb);
+    ox_bbt_to_bytes (bbtbl, lch->bbtbl->tbl, l_addr, nb);
 
     return 0;
 }
@@ -362,6 +415,7 @@ static int lnvm_ftl_get_bbtbl (struct nvm_ppa_addr *ppa, uint8_t *bbtbl,
 static int lnvm_ftl_set_bbtbl (struct nvm_ppa_addr *ppa, uint8_t value)
 {
     int l_addr, n_pl, flush, ret;
+    uint8_t state;
     struct lnvm_channel *lch = lnvm_get_ch_instance(ppa->g.ch);
 
     n_pl = lch->ch->geometry->n_of_planes;
@@ -373,9 +427,11 @@ static int lnvm_ftl_set_bbtbl (struct nvm_ppa_addr *ppa, uint8_t value)
     l_addr = ppa->g.lun * lch->ch->geometry->blk_per_lun * n_pl;
 
     /* flush the table if the value changes */
-    flush = (lch->bbtbl->tbl[l_addr+(ppa->g.blk * n_pl + ppa->g.pl)] == value)
-                                                                        ? 0 : 1;
-    lch->bbtbl->tbl[l_addr + (ppa->g.blk * n_pl + ppa->g.pl)] = value;
+    state = ox_bbt_state (value);
+    flush = (ox_bbt_get (lch->bbtbl->tbl, l_addr +
+                      (ppa->g.blk * n_pl + ppa->g.pl)) == state) ? 0 : 1;
+    ox_bbt_set (lch->bbtbl->tbl, l_addr + (ppa->g.blk * n_pl + ppa->g.pl),
+                                                                        state);
 
     if (flush) {
         ret = lnvm_flush_bbt (lch, lch->bbtbl);
@@ -399,7 +455,17 @@ static void lnvm_exit (void)
         LIST_REMOVE (lch, entry);
         free(lch);
     }
-    pthread_mutex_destroy (&endio_mutex);
+}
+
+/* The host owns the mapping of the raw channels, the device maps nothing */
+static int lnvm_ftl_get_l2ptbl (uint64_t slba, uint32_t nlb, uint64_t *tbl)
+{
+    uint32_t i;
+
+    for (i = 0; i < nlb; i++)
+        tbl[i] = LNVM_LBA_UNMAPPED;
+
+    return 0;
 }
 
 struct nvm_ftl_ops lnvm_ops = {
@@ -409,6 +475,7 @@ struct nvm_ftl_ops lnvm_ops = {
     .exit        = lnvm_exit,
     .get_bbtbl   = lnvm_ftl_get_bbtbl,
     .set_bbtbl   = lnvm_ftl_set_bbtbl,
+    .get_l2ptbl  = lnvm_ftl_get_l2ptbl,
 };
 
 struct nvm_ftl lnvm = {
@@ -422,9 +489,9 @@ struct nvm_ftl lnvm = {
 int ftl_lnvm_init (void)
 {
     LIST_INIT(&ch_head);
-    pthread_mutex_init (&endio_mutex, NULL);
     lnvm.cap |= 1 << FTL_CAP_GET_BBTBL;
     lnvm.cap |= 1 << FTL_CAP_SET_BBTBL;
+    lnvm.cap |= 1 << FTL_CAP_GET_L2PTBL;
     lnvm.bbtbl_format = FTL_BBTBL_BYTE;
     return nvm_register_ftl(&lnvm);
 }
@@ -48,7 +48,7 @@ struct lnvm_bbtbl {
     uint32_t bb_sz;
     uint32_t bb_count;
     /* This struct is stored on NVM up to this point, *tbl is not stored */
-    uint8_t  *tbl;
+    uint64_t *tbl;      /* packed, see ox-bbt.h */
 };
 
 struct lnvm_channel {
@@ -10,6 +10,7 @@
  */
 
 #include "hw/block/ox-ctrl/include/ssd.h"
+#include "hw/block/ox-ctrl/include/ox-bbt.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -143,26 +144,21 @@ static int lnvm_io_rsv_blk (struct nvm_channel *ch, uint8_t cmdtype,
                                                    void **buf_vec, uint16_t pg)
 {
     int pl, ret = -1;
-    void *buf = NULL;
-    struct nvm_mmgr_io_cmd *cmd = malloc(sizeof(struct nvm_mmgr_io_cmd));
+    int n_pl = ch->geometry->n_of_planes;
+    struct nvm_mmgr_io_cmd *cmd = calloc(n_pl, sizeof(struct nvm_mmgr_io_cmd));
     if (!cmd)
         return EMEM;
 
-    for (pl = 0; pl < ch->geometry->n_of_planes; pl++) {
-        memset (cmd, 0, sizeof (struct nvm_mmgr_io_cmd));
-        cmd->ppa.g.blk = FTL_LNVM_RSV_BLK;
-        cmd->ppa.g.pl = pl;
-        cmd->ppa.g.ch = ch->ch_mmgr_id;
-        cmd->ppa.g.lun = 0;
-        cmd->ppa.g.pg = pg;
-
-        if (cmdtype != MMGR_ERASE_BLK)
-            buf = buf_vec[pl];
-
-        ret = nvm_submit_sync_io (ch, cmd, buf, cmdtype);
-        if (ret)
-            break;
+    for (pl = 0; pl < n_pl; pl++) {
+        cmd[pl].ppa.g.blk = FTL_LNVM_RSV_BLK;
+        cmd[pl].ppa.g.pl = pl;
+        cmd[pl].ppa.g.ch = ch->ch_mmgr_id;
+        cmd[pl].ppa.g.lun = 0;
+        cmd[pl].ppa.g.pg = pg;
     }
+
+    ret = nvm_submit_sync_io_vec (ch, cmd, (cmdtype != MMGR_ERASE_BLK) ?
+                                               buf_vec : NULL, cmdtype, n_pl);
     free(cmd);
 
     return ret;
@@ -170,13 +166,7 @@ static int lnvm_io_rsv_blk (struct nvm_channel *ch, uint8_t cmdtype,
 
 static uint16_t lnvm_count_bb (struct lnvm_channel *lch)
 {
-    int i, bb = 0;
-
-    for (i = 0; i < lch->bbtbl->bb_sz; i++)
-        if (lch->bbtbl->tbl[i] != 0x0)
-            bb++;
-
-    return bb;
+    return ox_bbt_count (lch->bbtbl->tbl, 0, lch->bbtbl->bb_sz);
 }
 
 int lnvm_flush_bbt (struct lnvm_channel *lch, struct lnvm_bbtbl *bbt)
@@ -235,7 +225,7 @@ int lnvm_flush_bbt (struct lnvm_channel *lch, struct lnvm_bbtbl *bbt)
     memcpy (&buf[pg_sz], bbt, sizeof(struct lnvm_bbtbl));
 
     /* set bad block table */
-    memcpy (buf, bbt->tbl, bbt->bb_sz);
+    ox_bbt_to_bytes (buf, bbt->tbl, 0, bbt->bb_sz);
 
     ret = lnvm_io_rsv_blk (ch, MMGR_WRITE_PG, buf_vec, pg);
 
@@ -257,14 +247,14 @@ int lnvm_bbt_create (struct lnvm_channel *lch, struct lnvm_bbtbl *bbt,
     if (!bbt_tmp)
         return -1;
 
-    memset (bbt->tbl, 0, bbt->bb_sz);
+    memset (bbt->tbl, 0, ox_bbt_size (bbt->bb_sz));
 
     /* Set FTL reserved bad blocks */
     for (rsv = 0; rsv < ch->ftl_rsv * n_pl; rsv++){
         l_addr = ch->ftl_rsv_list[rsv].g.lun * ch->geometry->blk_per_lun * n_pl;
         b_addr = ch->ftl_rsv_list[rsv].g.blk * n_pl;
         pl_addr = ch->ftl_rsv_list[rsv].g.pl;
-        bbt->tbl[l_addr + b_addr + pl_addr] = NVM_BBT_DMRK;
+        ox_bbt_set (bbt->tbl, l_addr + b_addr + pl_addr, OX_BBT_RSV);
     }
 
     /* Set MMGR reserved bad blocks */
@@ -272,7 +262,7 @@ int lnvm_bbt_create (struct lnvm_channel *lch, struct lnvm_bbtbl *bbt,
         l_addr = ch->mmgr_rsv_list[rsv].g.lun * ch->geometry->blk_per_lun*n_pl;
         b_addr = ch->mmgr_rsv_list[rsv].g.blk * n_pl;
         pl_addr = ch->mmgr_rsv_list[rsv].g.pl;
-        bbt->tbl[l_addr + b_addr + pl_addr] = NVM_BBT_DMRK;
+        ox_bbt_set (bbt->tbl, l_addr + b_addr + pl_addr, OX_BBT_RSV);
     }
 
     if (type == LNVM_BBT_FULL || type == LNVM_BBT_ERASE) {
@@ -294,7 +284,7 @@ int lnvm_bbt_create (struct lnvm_channel *lch, struct lnvm_bbtbl *bbt,
         l_addr = bbt_tmp[i].g.lun * ch->geometry->blk_per_lun * n_pl;
         b_addr = bbt_tmp[i].g.blk * n_pl;
         pl_addr = bbt_tmp[i].g.pl;
-        bbt->tbl[l_addr + b_addr + pl_addr] = NVM_BBT_DMRK;
+        ox_bbt_set (bbt->tbl, l_addr + b_addr + pl_addr, OX_BBT_RSV);
     }
 
     return 0;
@@ -337,7 +327,7 @@ int lnvm_get_bbt_nvm (struct lnvm_channel *lch, struct lnvm_bbtbl *bbt)
             break;
 
         /* copy bad block table to channel */
-        memcpy(bbt->tbl, buf, bbt->bb_sz);
+        ox_bbt_from_bytes (bbt->tbl, buf, 0, bbt->bb_sz);
 
         pg++;
     } while (pg < ch->geometry->pg_per_blk);
@@ -4,13 +4,14 @@
 #include <stdint.h>
 #include <stdio.h>
 
+/* PPA format, the media manager geometry must fit in it */
 #define LNVM_SEC_BITS       2
-#define LNVM_PG_BITS        6
+#define LNVM_PG_BITS        10
 #define LNVM_PL_BITS        1
-#define LNVM_BLK_BITS       6
-#define LNVM_LUN_BITS       2
-#define LNVM_CH_BITS        3
-#define LNVM_RSV_BITS       44
+#define LNVM_BLK_BITS       14
+#define LNVM_LUN_BITS       4
+#define LNVM_CH_BITS        5
+#define LNVM_RSV_BITS       28
 
 #define LNVM_SECSZ          0x1000
 #define LNVM_SEC_OOBSZ      0x10
@@ -62,6 +63,7 @@ enum LnvmDmCommands {
     LNVM_CMD_PHYS_WRITE        = 0x91,
     LNVM_CMD_PHYS_READ         = 0x92,
     LNVM_CMD_ERASE_SYNC        = 0x90,
+    LNVM_CMD_VECTOR_COPY       = 0x93,
 };
 
 typedef struct LnvmIdAddrFormat {
@@ -209,6 +211,23 @@ typedef struct LnvmRwCmd {
     uint64_t    slba;
 } LnvmRwCmd;
 
+/* Source and destination PPA lists, copied inside the device */
+typedef struct LnvmCopyCmd {
+    uint8_t     opcode;
+    uint8_t     flags;
+    uint16_t    cid;
+    uint32_t    nsid;
+    uint64_t    rsvd2;
+    uint64_t    rsvd3;
+    uint64_t    prp1;
+    uint64_t    prp2;
+    uint64_t    spba;
+    uint16_t    nlb;
+    uint16_t    control;
+    uint32_t    rsvd4;
+    uint64_t    dpba;
+} LnvmCopyCmd;
+
 typedef struct LnvmCtrl {
     LnvmParams     params;
     LnvmIdCtrl     id_ctrl;
@@ -9,6 +9,8 @@
 #include "hw/block/ox-ctrl/include/lightnvm.h"
 #include "hw/block/ox-ctrl/include/ssd.h"
 #include "qemu/timer.h"
+#include "qemu/event_notifier.h"
+#include "block/aio.h"
 
 #define PCI_VENDOR_ID_INTEL     0x8086
 #define PCI_VENDOR_ID_LNVM      0x1d1d
@@ -17,6 +19,7 @@
 #define PCI_DEVICE_ID_LNVM      0x1f1f
 
 #define NVME_MAX_QS             2047 //PCI_MSIX_FLAGS_QSIZE -TODO
+#define NVME_MAX_CQE_BATCH      64
 #define NVME_MAX_QUEUE_ENTRIES  0xffff
 #define NVME_MAX_STRIDE         12
 #define NVME_MAX_NUM_NAMESPACES 256
@@ -38,6 +41,9 @@
 
 #define NVME_KERNEL_PG_SIZE 4096
 
+/* Data pointers to controller memory (fabrics buffers), never guest RAM */
+#define NVME_LOCAL_ADDR     (1ULL << 63)
+
 enum NvmeStatusCodes {
     NVME_SUCCESS                = 0x0000,
     NVME_INVALID_OPCODE         = 0x0001,
@@ -52,6 +58,11 @@ enum NvmeStatusCodes {
     NVME_CMD_ABORT_MISSING_FUSE = 0x000a,
     NVME_INVALID_NSID           = 0x000b,
     NVME_CMD_SEQ_ERROR          = 0x000c,
+    NVME_INVALID_SGL_SEG_DESC   = 0x000d,
+    NVME_INVALID_NUM_SGL_DESCS  = 0x000e,
+    NVME_DATA_SGL_LEN_INVALID   = 0x000f,
+    NVME_MD_SGL_LEN_INVALID     = 0x0010,
+    NVME_SGL_DESC_TYPE_INVALID  = 0x0011,
     NVME_LBA_RANGE              = 0x0080,
     NVME_CAP_EXCEEDED           = 0x0081,
     NVME_NS_NOT_READY           = 0x0082,
@@ -86,6 +97,8 @@ enum NvmeStatusCodes {
     NVME_MEDIA_TIMEOUT          = 0x0287,
     NVME_MORE                   = 0x2000,
     NVME_DNR                    = 0x4000,
+    NVME_MERGE_HOLD             = 0xfffd, /* internal, held for merging */
+    NVME_QUEUE_FULL             = 0xfffe, /* internal, command stays in SQ */
     NVME_NO_COMPLETE            = 0xffff,
 };
 
@@ -149,6 +162,7 @@ enum NvmeIdCtrlOacs {
     NVME_OACS_FW        = 1 << 2,
     NVME_OACS_NS_MGMT   = 1 << 3,
     NVME_OACS_LNVM_DEV  = 1 << 4,
+    NVME_OACS_DBBUF     = 1 << 8,
 };
 
 enum NvmeIdCtrlOncs {
@@ -235,6 +249,9 @@ enum NvmeCmdPsdt {
 #define NVME_CC_IOSQES(cc) ((cc >> CC_IOSQES_SHIFT) & CC_IOSQES_MASK)
 #define NVME_CC_IOCQES(cc) ((cc >> CC_IOCQES_SHIFT) & CC_IOCQES_MASK)
 
+#define NVME_CC_AMS_RR      0
+#define NVME_CC_AMS_WRR     1   /* weighted round robin, urgent class */
+
 #define NVME_CAP_MQES(cap)  (((cap) >> CAP_MQES_SHIFT)   & CAP_MQES_MASK)
 #define NVME_CAP_CQR(cap)   (((cap) >> CAP_CQR_SHIFT)    & CAP_CQR_MASK)
 #define NVME_CAP_AMS(cap)   (((cap) >> CAP_AMS_SHIFT)    & CAP_AMS_MASK)
@@ -402,6 +419,9 @@ enum NvmeCmbszMask {
 #define NVME_CMBSZ_SET_SZ(cmbsz, val)    (cmbsz |= (uint64_t)(val & CMBSZ_SZ_MASK)  \
                                                                 << CMBSZ_SZ_SHIFT)
 
+#define NVME_CMB_BIR        2       /* BAR 0/1 registers, BAR 4/5 MSI-X */
+#define NVME_CMB_MAX_MB     1024
+
 #define NVME_CMBSZ_GETSIZE(cmbsz) (NVME_CMBSZ_SZ(cmbsz) * (1<<(12+4*NVME_CMBSZ_SZU(cmbsz))))
 
 enum NvmeSmartWarn {
@@ -425,6 +445,8 @@ enum NvmeAdminCommands {
     NVME_ADM_CMD_ASYNC_EV_REQ   = 0x0c,
     NVME_ADM_CMD_ACTIVATE_FW    = 0x10,
     NVME_ADM_CMD_DOWNLOAD_FW    = 0x11,
+    NVME_ADM_CMD_KEEP_ALIVE     = 0x18,
+    NVME_ADM_CMD_DB_BUF_CONFIG  = 0x7c,
     NVME_ADM_CMD_FORMAT_NVM     = 0x80,
     NVME_ADM_CMD_SECURITY_SEND  = 0x81,
     NVME_ADM_CMD_SECURITY_RECV  = 0x82,
@@ -465,6 +487,26 @@ enum NvmeIoCommands {
     NVME_CMD_DSM                = 0x09,
 };
 
+/* SGL descriptor, descriptor type is in bits 7:4 of 'type' */
+typedef struct NvmeSglDesc {
+    uint64_t    addr;
+    uint32_t    len;
+    uint8_t     rsvd[3];
+    uint8_t     type;
+} __attribute__((packed)) NvmeSglDesc;
+
+enum NvmeSglDescType {
+    NVME_SGL_DATA_BLOCK     = 0x0,
+    NVME_SGL_BIT_BUCKET     = 0x1,
+    NVME_SGL_SEGMENT        = 0x2,
+    NVME_SGL_LAST_SEGMENT   = 0x3,
+};
+
+#define NVME_SGL_TYPE(type)     ((type) >> 4)
+
+/* Number of SGL descriptors read from the host at once */
+#define NVME_SGL_SEG_DESCS      32
+
 typedef struct NvmeCmd {
     uint8_t     opcode;
     uint8_t     fuse : 2;
@@ -556,6 +598,20 @@ typedef struct NvmeRwCmd {
     uint16_t    appmask;
 } __attribute__((packed)) NvmeRwCmd;
 
+enum NvmeDsmAttr {
+    NVME_DSMGMT_IDR             = 1 << 0,
+    NVME_DSMGMT_IDW             = 1 << 1,
+    NVME_DSMGMT_AD              = 1 << 2,
+};
+
+typedef struct NvmeDsmRange {
+    uint32_t    cattr;
+    uint32_t    nlb;
+    uint64_t    slba;
+} __attribute__((packed)) NvmeDsmRange;
+
+#define NVME_DSM_MAX_RANGES     256
+
 typedef struct vs_reg {
     uint8_t rsvd;
     uint8_t mnr;
@@ -735,7 +791,14 @@ typedef struct NvmeSmartLog {
     uint64_t    unsafe_shutdowns[2];
     uint64_t    media_errors[2];
     uint64_t    number_of_error_log_entries[2];
-    uint8_t     reserved2[320];
+    uint8_t     reserved2[40];
+    /* Vendor specific (OX): block erase counts of the FTL */
+    uint32_t    ox_min_erase_count;
+    uint32_t    ox_max_erase_count;
+    uint32_t    ox_avg_erase_count;
+    uint32_t    ox_reserved;
+    uint64_t    ox_wl_moves;
+    uint8_t     reserved3[256];
 } NvmeSmartLog;
 
 typedef struct NvmeFwSlotInfoLog {
@@ -769,7 +832,7 @@ typedef struct NvmeSQ {
     TAILQ_ENTRY(NvmeSQ) entry;
     struct NvmeCtrl     *ctrl;
     uint8_t             phys_contig;
-    uint8_t             arb_burst;
+    uint32_t            arb_burst;
     uint16_t            sqid;
     uint16_t            cqid;
     uint32_t            head;
@@ -778,6 +841,7 @@ typedef struct NvmeSQ {
     uint64_t            dma_addr;
     uint64_t            completed;
     uint64_t            *prp_list;
+    uint8_t             *cmb_sqes; /* SQ in the CMB, else NULL */
     struct NvmeRequest  *io_req;
     QEMUTimer           *timer;
     TAILQ_HEAD (sq_reqhead, NvmeRequest) req_list;
@@ -788,6 +852,12 @@ typedef struct NvmeSQ {
     int                 fd_qmem;
     enum NvmeQFlags     prio;
     uint64_t            posted;
+    /* Merged command fetched from the SQ that found the FTL queue full */
+    struct NvmeRequest  *held;
+    /* Doorbell eventfd, set if the SQ runs in an IOThread with shadow
+     * doorbells (the tail is read from db_addr, not from the MMIO write) */
+    EventNotifier       notifier;
+    uint8_t             ioeventfd;
 } NvmeSQ;
 
 typedef struct NvmeCQ {
@@ -810,6 +880,10 @@ typedef struct NvmeCQ {
     uint64_t            eventidx_addr;
     int                 fd_qmem;
     volatile uint8_t    hold_sqs;
+    /* Interrupt coalescing, CQEs posted since the last interrupt */
+    uint32_t            coal_count;
+    uint64_t            cqes;       /* CQEs posted to the host */
+    uint64_t            irqs;       /* interrupts raised */
 } NvmeCQ;
 
 typedef struct NvmeLBAF {
@@ -831,7 +905,7 @@ typedef struct NvmeIdNs {
         uint8_t     nmic; /* Namespace Multi-path I/O and NS Sharing Cap */
         uint8_t     rescap; /* Reservation Capabilities */
         uint8_t     fpi; /* Format Progress Indicator */
-        uint8_t     rsv33;
+        uint8_t     dlfeat; /* Deallocate Logical Block Features */
         uint16_t    nawun; /* Namespace Atomic Write Unit Normal */
         uint16_t    nawupf; /* Namespace Atomic Write Unit Power Fail */
         uint16_t    nacwu; /* Namespace Atomic Compare & Write Unit */
@@ -886,9 +960,13 @@ typedef struct NvmeRequest {
     uint64_t                 meta_size;
     uint64_t                 mptr;
     void                     *meta_buf;
-    struct nvm_io_cmd        nvm_io;
+    struct nvm_io_cmd        *nvm_io; /* from NvmeCtrl->io_pool, if in use */
     uint8_t                  lba_index;
+    uint8_t                  merge; /* read/write may be held for merging */
+    struct NvmeRequest       *merged; /* completed with this request */
     QEMUBH                   *bh;
+    /* If set, completes the request to a fabrics queue, not to a CQ */
+    void                     (*fabrics_cb) (struct NvmeRequest *);
 } NvmeRequest;
 
 typedef struct NvmeFeatureVal {
@@ -1003,8 +1081,36 @@ typedef struct NvmeStats {
     uint64_t    tot_num_ReadCmd;
     uint64_t    tot_num_WriteCmd;
     uint64_t    num_active_queues;
+    uint64_t    tot_num_cqe;        /* CQEs posted to the host */
+    uint64_t    tot_num_irq;        /* interrupts raised for them */
+    uint64_t    tot_num_requeue;    /* IO cmds left in the SQ, FTL was full */
+    uint64_t    tot_num_merged;     /* IO cmds merged to the previous one */
 } NvmeStats;
 
+/*
+ * I/O descriptors are taken from slabs of NVME_IO_SLAB_CMDS entries, a
+ * descriptor is attached to a request only while the request is in flight.
+ * Slabs are allocated on demand and released at controller exit. The pool is
+ * split in NVME_IO_SHARDS shards selected by submission queue, so queues
+ * served by different threads do not share a lock. A descriptor returns to
+ * the shard it came from, whatever thread completes it.
+ */
+#define NVME_IO_SLAB_CMDS   64
+#define NVME_IO_SHARDS      8
+
+struct nvme_io_slab {
+    struct nvme_io_slab     *next;
+    struct nvm_io_cmd       cmd[NVME_IO_SLAB_CMDS];
+};
+
+typedef struct NvmeIoPool {
+    struct nvme_io_slab     *slabs;
+    struct nvm_io_cmd       *free;   /* linked by nvm_io_cmd->next */
+    uint32_t                n_slabs;
+    uint32_t                in_use;
+    pthread_mutex_t         mutex;
+} NvmeIoPool;
+
 typedef struct NvmeCtrl {
     struct nvm_memory_region   iomem;
     struct nvm_memory_region   ctrl_mem;
@@ -1045,6 +1151,9 @@ typedef struct NvmeCtrl {
     uint8_t     intc_time;
     uint8_t     outstanding_aers;
     uint8_t     temp_warn_issued;
+    uint8_t     dbbuf_enabled; /* Doorbell Buffer Config is set */
+    uint64_t    dbbuf_dbs;     /* shadow doorbell buffer */
+    uint64_t    dbbuf_eis;     /* EventIdx buffer */
     uint8_t     num_errors;
     uint8_t     cqes_pending;
     uint16_t    vid;
@@ -1073,7 +1182,10 @@ typedef struct NvmeCtrl {
     pthread_mutex_t                             qs_req_mutex;
     pthread_mutex_t                             aer_req_mutex;
     pthread_mutex_t                             req_mutex;
+    /* Held when n->sq changes and by doorbell writes outside the BQL */
+    pthread_mutex_t                             db_mutex;
     LIST_HEAD(ext_list, NvmeRequest)            ext_list;/*req allocated later*/
+    NvmeIoPool                                  io_pool[NVME_IO_SHARDS];
 
     LnvmCtrl     lightnvm_ctrl;
 } NvmeCtrl;
@@ -1081,11 +1193,18 @@ typedef struct NvmeCtrl {
 void nvme_exit(void);
 uint8_t nvme_write_to_host(void *, uint64_t, ssize_t);
 uint8_t nvme_read_from_host(void *, uint64_t, ssize_t);
+void *nvme_map_host (uint64_t, ssize_t, uint8_t);
+uint16_t nvme_map_dptr (NvmeCtrl *, uint64_t *, NvmeCmd *, uint32_t, uint32_t);
+struct nvm_io_cmd *nvme_get_io_cmd (NvmeCtrl *, uint16_t);
+void nvme_put_io_cmd (NvmeCtrl *, struct nvm_io_cmd *);
+void nvme_unmap_host (void *, ssize_t, uint8_t);
+void nvme_cmb_config (NvmeCtrl *);
 uint16_t nvme_init_cq (NvmeCQ *, NvmeCtrl *, uint64_t, uint16_t, uint16_t,
         uint16_t, uint16_t, int);
 uint16_t nvme_init_sq (NvmeSQ *, NvmeCtrl *, uint64_t, uint16_t, uint16_t,
         uint16_t, enum NvmeQFlags, int);
 void nvme_enqueue_req_completion (NvmeCQ *, NvmeRequest *);
+void nvme_enqueue_req_completion_batch (NvmeRequest **, int);
 void nvme_post_cqes (void *);
 int nvme_check_cqid (NvmeCtrl *, uint16_t);
 int nvme_check_sqid (NvmeCtrl *, uint16_t);
@@ -1105,9 +1224,13 @@ uint16_t nvme_create_cq (NvmeCtrl *, NvmeCmd *);
 uint16_t nvme_set_feature (NvmeCtrl *, NvmeCmd *, NvmeRequest *);
 uint16_t nvme_get_feature (NvmeCtrl *, NvmeCmd *, NvmeRequest *);
 uint16_t nvme_get_log(NvmeCtrl *, NvmeCmd *);
+void nvme_smart_log (NvmeCtrl *, NvmeSmartLog *);
 uint16_t nvme_async_req (NvmeCtrl *, NvmeCmd *, NvmeRequest *);
 uint16_t nvme_format (NvmeCtrl *, NvmeCmd *);
 uint16_t nvme_abort_req (NvmeCtrl *, NvmeCmd *, uint32_t *);
+uint16_t nvme_dbbuf_config (NvmeCtrl *, NvmeCmd *);
+void nvme_dbbuf_init_sq (NvmeCtrl *, NvmeSQ *);
+void nvme_dbbuf_init_cq (NvmeCtrl *, NvmeCQ *);
 
 /* NVMe IO cmd */
 uint16_t nvme_write_uncor(NvmeCtrl *,NvmeNamespace *,NvmeCmd *,NvmeRequest *);
@@ -1116,6 +1239,7 @@ uint16_t nvme_flush(NvmeCtrl *, NvmeNamespace *, NvmeCmd *, NvmeRequest *);
 uint16_t nvme_compare(NvmeCtrl *, NvmeNamespace *, NvmeCmd *, NvmeRequest *);
 uint16_t nvme_write_zeros(NvmeCtrl *,NvmeNamespace *,NvmeCmd *,NvmeRequest *);
 uint16_t nvme_rw (NvmeCtrl *, NvmeNamespace *, NvmeCmd *, NvmeRequest *);
+uint16_t nvme_rw_merge (NvmeCtrl *, NvmeRequest *, NvmeCmd *, NvmeRequest *);
 
 /* LNVM functions */
 int lnvm_init(NvmeCtrl *);
@@ -1131,7 +1255,8 @@ uint16_t lnvm_get_bb_tbl(NvmeCtrl *, NvmeCmd *, NvmeRequest *);
 uint16_t lnvm_set_bb_tbl(NvmeCtrl *, NvmeCmd *, NvmeRequest *);
 
 /* LNVM IO cmd */
-uint16_t lnvm_erase_sync(NvmeCtrl *, NvmeNamespace *, NvmeCmd *, NvmeRequest *);
+uint16_t lnvm_erase(NvmeCtrl *, NvmeNamespace *, NvmeCmd *, NvmeRequest *);
+uint16_t lnvm_copy(NvmeCtrl *, NvmeNamespace *, NvmeCmd *, NvmeRequest *);
 uint16_t lnvm_rw(NvmeCtrl *, NvmeNamespace *, NvmeCmd *, NvmeRequest *);
 
 #endif /* NVME_H */
\ No newline at end of file
@@ -0,0 +1,46 @@
+#ifndef OX_BBT_H
+#define OX_BBT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Packed bad block tables of the FTLs, 2 bits per plane-block indexed as the
+ * LightNVM byte table (lun, blk, pl), 32 entries per 64-bit word. Counts
+ * work on whole words: an entry is not good if either of its bits is set,
+ * so (w | w >> 1) & OX_BBT_LO has one bit per bad entry for popcount.
+ *
+ * Tables are converted to the byte format (FTL_BBTBL_BYTE) for the host and
+ * for the copy stored in NVM, so the format in NVM does not change. Host
+ * marked blocks (0x8) are kept as bad.
+ */
+enum ox_bbt_state {
+    OX_BBT_GOOD = 0x0,
+    OX_BBT_BAD  = 0x1,
+    OX_BBT_GBAD = 0x2,      /* grown bad */
+    OX_BBT_RSV  = 0x3       /* reserved, marked by the device */
+};
+
+#define OX_BBT_PER_WORD     32
+#define OX_BBT_LO           0x5555555555555555ULL
+
+static inline size_t ox_bbt_size (uint32_t n)
+{
+    return ((n + OX_BBT_PER_WORD - 1) / OX_BBT_PER_WORD) * sizeof (uint64_t);
+}
+
+static inline uint8_t ox_bbt_get (const uint64_t *tbl, uint32_t i)
+{
+    return (tbl[i / OX_BBT_PER_WORD] >> ((i % OX_BBT_PER_WORD) * 2)) & 0x3;
+}
+
+uint64_t   *ox_bbt_alloc (uint32_t);
+void        ox_bbt_set (uint64_t *, uint32_t, uint8_t);
+uint8_t     ox_bbt_state (uint8_t);
+uint8_t     ox_bbt_byte (uint8_t);
+void        ox_bbt_to_bytes (uint8_t *, const uint64_t *, uint32_t, uint32_t);
+void        ox_bbt_from_bytes (uint64_t *, const uint8_t *, uint32_t,
+                                                                    uint32_t);
+uint32_t    ox_bbt_count (const uint64_t *, uint32_t, uint32_t);
+
+#endif /* OX_BBT_H */
@@ -0,0 +1,143 @@
+#ifndef OX_FABRICS_H
+#define OX_FABRICS_H
+
+#include <stdint.h>
+
+/*
+ * NVMe over Fabrics, TCP transport (NVMe/TCP, no digests). OX is a single
+ * subsystem: any NQN but the discovery one is accepted, and every admin
+ * queue connection creates a fabrics controller sharing the namespaces and
+ * the FTL with the PCIe controller. Each queue is a TCP connection.
+ *
+ * Admin queues take Identify, Get Log Page, Get/Set Features, Asynchronous
+ * Event Request and Keep Alive, I/O queues take Read, Write, Flush and
+ * Dataset Management. Queue management, LightNVM and NDP commands stay on
+ * PCIe. Command data lives in controller buffers whose addresses are tagged
+ * with NVME_LOCAL_ADDR, the commands are executed as the PCIe ones are.
+ */
+
+#define OX_FABRICS_MAX_CTRLS    16
+#define OX_FABRICS_MAX_QUEUES   8           /* I/O queues per controller */
+#define OX_FABRICS_MAX_QD       128         /* queue entries */
+#define OX_FABRICS_MAX_DATA     (1 << 20)   /* bytes per command, MDTS */
+#define OX_FABRICS_INLINE       8192        /* in-capsule data bytes */
+
+#define OX_FABRICS_DISC_NQN     "nqn.2014-08.org.nvmexpress.discovery"
+
+enum OxTcpPduTypes {
+    OX_TCP_ICREQ        = 0x00,
+    OX_TCP_ICRESP       = 0x01,
+    OX_TCP_H2C_TERM     = 0x02,
+    OX_TCP_C2H_TERM     = 0x03,
+    OX_TCP_CMD          = 0x04,
+    OX_TCP_RSP          = 0x05,
+    OX_TCP_H2C_DATA     = 0x06,
+    OX_TCP_C2H_DATA     = 0x07,
+    OX_TCP_R2T          = 0x09
+};
+
+#define OX_TCP_F_DATA_LAST  0x04
+
+typedef struct OxTcpHdr {
+    uint8_t     type;
+    uint8_t     flags;
+    uint8_t     hlen;
+    uint8_t     pdo;
+    uint32_t    plen;
+} __attribute__((packed)) OxTcpHdr;
+
+typedef struct OxTcpICReq {
+    OxTcpHdr    hdr;
+    uint16_t    pfv;
+    uint8_t     hpda;
+    uint8_t     digest;
+    uint32_t    maxr2t;
+    uint8_t     rsvd[112];
+} __attribute__((packed)) OxTcpICReq;
+
+typedef struct OxTcpICResp {
+    OxTcpHdr    hdr;
+    uint16_t    pfv;
+    uint8_t     cpda;
+    uint8_t     digest;
+    uint32_t    maxdata;
+    uint8_t     rsvd[112];
+} __attribute__((packed)) OxTcpICResp;
+
+/* H2CData, C2HData and R2T */
+typedef struct OxTcpData {
+    OxTcpHdr    hdr;
+    uint16_t    cccid;
+    uint16_t    ttag;
+    uint32_t    offset;
+    uint32_t    len;
+    uint32_t    rsvd;
+} __attribute__((packed)) OxTcpData;
+
+/* SGL descriptor types used by NVMe/TCP hosts, type << 4 | subtype */
+#define OX_TCP_SGL_INCAPSULE    0x01
+#define OX_TCP_SGL_TRANSPORT    0x5a
+
+enum OxFabricsCmdTypes {
+    OX_FABRICS_CMD          = 0x7f,
+    OX_FABRICS_PROP_SET     = 0x00,
+    OX_FABRICS_CONNECT      = 0x01,
+    OX_FABRICS_PROP_GET     = 0x04
+};
+
+enum OxFabricsStatus {
+    OX_FABRICS_CONNECT_CTRL_BUSY     = 0x0181,
+    OX_FABRICS_CONNECT_INVALID_PARAM = 0x0182,
+    OX_FABRICS_CONNECT_INVALID_HOST  = 0x0184
+};
+
+typedef struct OxFabricsCmd {
+    uint8_t     opcode;
+    uint8_t     rsvd1;
+    uint16_t    cid;
+    uint8_t     fctype;
+    uint8_t     rsvd2[19];
+    uint8_t     dptr[16];
+    union {
+        struct {
+            uint16_t    recfmt;
+            uint16_t    qid;
+            uint16_t    sqsize;     /* 0's based */
+            uint8_t     cattr;
+            uint8_t     rsvd;
+            uint32_t    kato;
+        } connect;
+        struct {
+            uint8_t     attrib;     /* bits 2:0, 1 for 8 bytes */
+            uint8_t     rsvd[3];
+            uint32_t    offset;
+            uint64_t    value;
+        } prop;
+    };
+    uint8_t     rsvd3[8];
+} __attribute__((packed)) OxFabricsCmd;
+
+typedef struct OxFabricsConnectData {
+    uint8_t     hostid[16];
+    uint16_t    cntlid;
+    uint8_t     rsvd[238];
+    char        subnqn[256];
+    char        hostnqn[256];
+    uint8_t     rsvd2[256];
+} __attribute__((packed)) OxFabricsConnectData;
+
+/* NvmeIdCtrl.fabrics */
+typedef struct OxFabricsIdCtrl {
+    uint32_t    ioccsz;     /* 16 byte units */
+    uint32_t    iorcsz;
+    uint16_t    icdoff;
+    uint8_t     fcatt;
+    uint8_t     msdbd;
+} __attribute__((packed)) OxFabricsIdCtrl;
+
+struct NvmeCtrl;
+
+int  ox_fabrics_init (struct NvmeCtrl *, uint16_t port);
+void ox_fabrics_exit (void);
+
+#endif /* OX_FABRICS_H */
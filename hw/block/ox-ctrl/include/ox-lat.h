@@ -0,0 +1,93 @@
+#ifndef OX_LAT_H
+#define OX_LAT_H
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Latency histograms of the I/O pipeline stages, one per stage, operation
+ * and channel. NVMe commands go through:
+ *
+ *   FETCH     - SQE read, command parsed and PRPs mapped, until the FTL SQ
+ *   FTL_WAIT  - waiting in the FTL SQ
+ *   FTL       - FTL processing, from the FTL thread until the FTL completion
+ *   CQ        - FTL completion until the CQE is posted to the host
+ *   TOTAL     - SQE read until the CQE is posted
+ *
+ * Media manager commands, including FTL internal I/O (GC, mapping, log):
+ *
+ *   MMGR_WAIT - waiting in the media manager queue of the channel
+ *   MEDIA     - media time, until the media manager completion
+ *
+ * Buckets are log-linear (as HDR histograms): values are kept with
+ * OX_LAT_SUB_BITS significant bits, about 6% of precision, from 1 nsec up
+ * to OX_LAT_MAX_BITS bits of nsec. Updates are atomic, any thread records.
+ */
+enum ox_lat_stage {
+    OX_LAT_FETCH = 0,
+    OX_LAT_FTL_WAIT,
+    OX_LAT_FTL,
+    OX_LAT_MMGR_WAIT,
+    OX_LAT_MEDIA,
+    OX_LAT_CQ,
+    OX_LAT_TOTAL,
+    OX_LAT_STAGES
+};
+
+enum ox_lat_op {
+    OX_LAT_OP_READ = 0,
+    OX_LAT_OP_WRITE,
+    OX_LAT_OP_ERASE,
+    OX_LAT_OP_OTHER,
+    OX_LAT_OPS
+};
+
+#define OX_LAT_SUB_BITS     5
+#define OX_LAT_SUB_COUNT    (1 << OX_LAT_SUB_BITS)
+#define OX_LAT_SUB_HALF     (OX_LAT_SUB_COUNT >> 1)
+#define OX_LAT_MAX_BITS     36  /* about 68 seconds */
+#define OX_LAT_BUCKETS      ((OX_LAT_MAX_BITS - OX_LAT_SUB_BITS + 2) * \
+                                                            OX_LAT_SUB_HALF)
+#define OX_LAT_ALL_CH       0xffff
+
+struct ox_lat_hist {
+    uint64_t    count;
+    uint64_t    sum;
+    uint64_t    min;
+    uint64_t    max;
+    uint64_t    bucket[OX_LAT_BUCKETS];
+};
+
+/* Histogram summary, nsec */
+struct ox_lat_st {
+    uint64_t    count;
+    uint64_t    min;
+    uint64_t    max;
+    uint64_t    mean;
+    uint64_t    p50;
+    uint64_t    p90;
+    uint64_t    p99;
+    uint64_t    p999;
+};
+
+static inline uint64_t ox_lat_now (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int         ox_lat_init (uint16_t);
+void        ox_lat_exit (void);
+void        ox_lat_reset (void);
+void        ox_lat_record (uint8_t, uint8_t, uint16_t, uint64_t, uint64_t,
+                                                                     uint64_t);
+int         ox_lat_get (uint8_t, uint8_t, uint16_t, struct ox_lat_st *);
+void        ox_lat_hist_add (struct ox_lat_hist *, uint64_t);
+void        ox_lat_hist_summary (struct ox_lat_hist *, struct ox_lat_st *);
+uint16_t    ox_lat_channels (void);
+const char *ox_lat_stage_name (uint8_t);
+const char *ox_lat_op_name (uint8_t);
+
+#endif /* OX_LAT_H */
@@ -3,6 +3,7 @@
 
 #include <sys/queue.h>
 #include <pthread.h>
+#include <sched.h>
 #include <time.h>
 #include <stdint.h>
 #include "uatomic.h"
@@ -13,18 +14,72 @@ enum {
     OX_MQ_WAITING,
     OX_MQ_TIMEOUT,
     OX_MQ_TIMEOUT_COMPLETED,
-    OX_MQ_TIMEOUT_BACK
+    OX_MQ_TIMEOUT_BACK,
+    OX_MQ_COMPLETING /* transient, owned by the completion path */
 };
 
 struct ox_mq_entry {
     void                     *opaque;
     uint32_t                 qid;
-    uint8_t                  status;
-    struct timeval           wtime; /* timestamp for timeout */
+    volatile uint8_t         status; /* changed only by compare-and-swap */
+    uint64_t                 wtime; /* CLOCK_MONOTONIC usec, for timeout */
     uint8_t                  is_ext; /* if > 0, allocated due timeout */
-    TAILQ_ENTRY(ox_mq_entry) entry;
+    uint32_t                 slot;   /* index in the queue slot table */
+    volatile uint8_t         to_arm; /* entry is in the timer wheel arm ring */
+    uint8_t                  to_linked; /* entry is in a timer wheel slot */
+    LIST_ENTRY(ox_mq_entry)  to_entry;
     LIST_ENTRY(ox_mq_entry)  ext_entry;
-    pthread_mutex_t          entry_mutex;
+};
+
+/*
+ * Bounded lock-free ring of pointers. Any number of producers and consumers
+ * may use it concurrently, each cell carries a sequence number that tells
+ * if the cell is ready to be written or read at a given ring position.
+ */
+struct ox_mq_ring_cell {
+    volatile uint64_t        seq;
+    void                     *data;
+};
+
+#define OX_MQ_CACHE_LINE    64
+
+struct ox_mq_ring {
+    struct ox_mq_ring_cell   *cells;
+    uint64_t                 mask;
+    uint8_t                  rsv0[OX_MQ_CACHE_LINE - sizeof (uint64_t)];
+    volatile uint64_t        head;   /* consumer position */
+    uint8_t                  rsv1[OX_MQ_CACHE_LINE - sizeof (uint64_t)];
+    volatile uint64_t        tail;   /* producer position */
+    uint8_t                  rsv2[OX_MQ_CACHE_LINE - sizeof (uint64_t)];
+};
+
+/*
+ * Hierarchical timer wheel used for request timeouts, keyed on ticks of
+ * CLOCK_MONOTONIC. Each level has OX_MQ_WHEEL_SLOTS slots and each slot of
+ * level L covers OX_MQ_WHEEL_SLOTS^L ticks, entries cascade to the lower
+ * level when the wheel reaches their slot.
+ *
+ * The wheel is only touched by the timeout thread. The SQ thread hands
+ * entries that start waiting through the arm ring, and completed entries
+ * are dropped when the wheel reaches them, so the hot path never takes a
+ * lock to join or leave the wheel.
+ */
+#define OX_MQ_WHEEL_BITS    6
+#define OX_MQ_WHEEL_SLOTS   (1 << OX_MQ_WHEEL_BITS)
+#define OX_MQ_WHEEL_MASK    (OX_MQ_WHEEL_SLOTS - 1)
+#define OX_MQ_WHEEL_LEVELS  4
+
+/* Number of wheel ticks in a timeout period */
+#define OX_MQ_WHEEL_TO_TICKS    OX_MQ_WHEEL_SLOTS
+
+LIST_HEAD(ox_mq_wheel_slot, ox_mq_entry);
+
+struct ox_mq_wheel {
+    struct ox_mq_wheel_slot  slot[OX_MQ_WHEEL_LEVELS][OX_MQ_WHEEL_SLOTS];
+    struct ox_mq_ring        arm;       /* entries that started waiting */
+    uint64_t                 cur;       /* last processed tick */
+    uint64_t                 tick_usec; /* 0: timeout is disabled */
+    uint64_t                 to_ticks;  /* timeout in ticks */
 };
 
 /* Keeps a set of counters related to the multi-queue */
@@ -37,6 +92,18 @@ struct ox_mq_stats {
     u_atomic_t    ext_list; /* extended entry list size */
     u_atomic_t    timeout;  /* total timeout entries */
     u_atomic_t    to_back;  /* timeout entries asked for a late completion */
+    u_atomic_t    spin;     /* entries found while busy-polling */
+    u_atomic_t    park;     /* times a consumer thread was parked */
+};
+
+/*
+ * Producers blocked by a full ring wait here, the consumer side wakes them
+ * when it frees room. Waking costs a fence and a load if nobody waits.
+ */
+struct ox_mq_waitq {
+    pthread_mutex_t          mutex;
+    pthread_cond_t           cond;
+    volatile uint32_t        waiters;
 };
 
 typedef void (ox_mq_sq_fn)(struct ox_mq_entry *);
@@ -47,25 +114,46 @@ typedef void (ox_mq_cq_fn)(void *);
 /* void ** is an array of timeout opaque entries, int is the array size */
 typedef void (ox_mq_to_fn)(void **, int);
 
+/* Batch consumers, the arrays hold up to ox_mq_config->batch entries */
+typedef void (ox_mq_sq_batch_fn)(struct ox_mq_entry **, int);
+typedef void (ox_mq_cq_batch_fn)(void **, int);
+
+/*
+ * Each queue keeps its entries in lock-free rings:
+ *  - sq_free: free submission entries (submitters pop, completion pushes)
+ *  - sq_used: queued submission entries (submitters push, SQ thread pops)
+ *  - cq_used: opaque pointers ready for completion (CQ thread pops)
+ *
+ * Entries in OX_MQ_WAITING are tracked by the timer wheel. sq_slots always
+ * points to the entries in use by the queue, a timeout entry is replaced in
+ * its slot by a new allocated entry.
+ * The mutex/cond pairs are only used to park idle consumer threads.
+ */
 struct ox_mq_queue {
-    pthread_mutex_t                        sq_free_mutex;
-    pthread_mutex_t                        cq_free_mutex;
-    pthread_mutex_t                        sq_used_mutex;
-    pthread_mutex_t                        cq_used_mutex;
-    pthread_mutex_t                        sq_wait_mutex;
+    struct ox_mq_ring                      sq_free;
+    struct ox_mq_ring                      sq_used;
+    struct ox_mq_ring                      cq_used;
     struct ox_mq_entry                     *sq_entries;
-    struct ox_mq_entry                     *cq_entries;
-    TAILQ_HEAD (sq_free_head, ox_mq_entry) sq_free;
-    TAILQ_HEAD (sq_used_head, ox_mq_entry) sq_used;
-    TAILQ_HEAD (sq_wait_head, ox_mq_entry) sq_wait;
-    TAILQ_HEAD (cq_free_head, ox_mq_entry) cq_free;
-    TAILQ_HEAD (cq_used_head, ox_mq_entry) cq_used;
+    struct ox_mq_entry                     **sq_slots;
+    uint32_t                               size;
+    uint32_t                               poll_usec; /* 0: no polling */
+    cpu_set_t                              cpus;   /* SQ/CQ thread affinity */
+    uint8_t                                pinned; /* if 0, cpus is unused */
+    int                                    node;   /* NUMA node, -1 if any */
     ox_mq_sq_fn                            *sq_fn;
     ox_mq_cq_fn                            *cq_fn;
+    ox_mq_sq_batch_fn                      *sq_batch_fn;
+    ox_mq_cq_batch_fn                      *cq_batch_fn;
+    uint32_t                               batch;
     pthread_mutex_t                        sq_cond_m;
     pthread_mutex_t                        cq_cond_m;
     pthread_cond_t                         sq_cond;
     pthread_cond_t                         cq_cond;
+    volatile uint8_t                       sq_sleep; /* SQ thread is parked */
+    volatile uint8_t                       cq_sleep; /* CQ thread is parked */
+    struct ox_mq_waitq                     sq_space; /* waiting for sq_free */
+    struct ox_mq_waitq                     cq_space; /* waiting for the CQ */
+    struct ox_mq_wheel                     wheel;
     pthread_t                              sq_tid;
     pthread_t                              cq_tid;
     uint8_t                                running; /* if 0, kill threads */
@@ -73,6 +161,15 @@ struct ox_mq_queue {
 };
 
 #define OX_MQ_TO_COMPLETE   (1 << 0) /* Complete request after timeout */
+#define OX_MQ_POLL          (1 << 1) /* Busy-poll queues before parking */
+
+/* Max number of cpu relax instructions between two polls of an empty ring */
+#define OX_MQ_POLL_MAX_BACKOFF  1024
+
+#define OX_MQ_MAX_BATCH         64
+
+/* ox_mq_complete_req: the CQ is full, the entry can be completed again */
+#define OX_MQ_CQ_FULL           -2
 
 struct ox_mq_config {
     char                name[40];
@@ -81,7 +178,12 @@ struct ox_mq_config {
     ox_mq_sq_fn         *sq_fn;  /* submission queue consumer */
     ox_mq_cq_fn         *cq_fn;  /* completion queue consumer */
     ox_mq_to_fn         *to_fn;  /* timeout call */
+    ox_mq_sq_batch_fn   *sq_batch_fn; /* if set, used instead of sq_fn */
+    ox_mq_cq_batch_fn   *cq_batch_fn; /* if set, used instead of cq_fn */
+    uint32_t            batch;   /* max entries per batch call */
+    cpu_set_t           *cpus;   /* optional, array of n_queues cpu sets */
     uint64_t            to_usec; /* timeout in microseconds */
+    uint32_t            poll_usec; /* OX_MQ_POLL: spin budget before parking */
     uint8_t             flags;
 };
 
@@ -91,19 +193,28 @@ struct ox_mq {
     struct ox_mq_config               *config;
     pthread_t                         to_tid;       /* timeout thread */
     LIST_HEAD(oxmq_ext, ox_mq_entry)  ext_list;     /* new allocated entries */
+    pthread_mutex_t                   ext_mutex;    /* protects ext_list */
     struct ox_mq_stats                stats;
     uint8_t                           stop;         /* Set to 1, stop threads */
 };
 
+typedef void (ox_mq_foreach_fn)(struct ox_mq *, void *);
+
 struct ox_mq *ox_mq_init (struct ox_mq_config *);
 void          ox_mq_destroy (struct ox_mq *);
 int           ox_mq_submit_req (struct ox_mq *, uint32_t, void *);
 int           ox_mq_complete_req (struct ox_mq *, struct ox_mq_entry *);
+int           ox_mq_submit_req_wait (struct ox_mq *, uint32_t, void *,
+                                                                     uint64_t);
+int           ox_mq_complete_req_wait (struct ox_mq *, struct ox_mq_entry *,
+                                                                     uint64_t);
 void          ox_mq_show_mq (struct ox_mq *);
 void          ox_mq_show_all (void);
 struct ox_mq *ox_mq_get (const char *);
+void          ox_mq_foreach (ox_mq_foreach_fn *, void *);
 int           ox_mq_used_count (struct ox_mq *, uint16_t qid);
 int           ox_mq_get_status (struct ox_mq *, struct ox_mq_stats *,
                                                                   uint16_t qid);
+int           ox_mq_parse_cpus (const char *, cpu_set_t *, uint32_t);
 
 #endif /* OX_MQ_H */
\ No newline at end of file
@@ -1,6 +1,41 @@
 #ifndef OX_NDP_H
 #define OX_NDP_H
 
+#include <stdint.h>
+
+/*
+ * Near-data processing. A job runs one of the kernels built into the
+ * controller over a LBA range of a namespace, reading it through the FTL on
+ * the NDP worker threads, and only its result page is written to the host.
+ * Hosts cannot load code: a kernel only sees the records of the range and
+ * the result page of its job.
+ *
+ * The range is split in fixed size records (8 bytes to one LBA, a power of
+ * two) and every kernel tests a 64-bit little endian field of each record:
+ *
+ *   SCAN       field == arg, the result holds the matching record indexes
+ *   FILTER     field >= arg, the result holds the matching records
+ *   AGGREGATE  every record, the result only holds count, sum, min and max
+ *
+ * Run Job (I/O queue):
+ *   cdw10-11   starting LBA
+ *   cdw12      number of LBAs, 0's based
+ *   cdw13      bits 7:0 kernel, 15:8 log2 of the record size,
+ *              31:16 field offset in the record
+ *   cdw14-15   arg
+ *   prp1       result page (NdpResult)
+ *
+ * Daemon Request (I/O queue) takes the range and prp1 of Run Job, and the id
+ * of a daemon in cdw13 bits 7:0. A daemon is a kernel with its record layout
+ * and arg, installed by Install Daemon (admin, cdw13-15 as Run Job, the
+ * completion returns the id) and removed by Delete Daemon (admin, id in
+ * cdw10). NDP Info (admin) writes NdpInfo to prp1.
+ *
+ * Jobs complete with the number of matched records in dword 0 (low 32 bits).
+ *
+ * The NVMe Compare command runs on the same workers, see ox_ndp_compare.
+ */
+
 enum NdpAdminCommands {
     NDP_ADM_CMD_INFO       = 0xe6,
     NDP_ADM_CMD_INST_DAEM  = 0xd1,
@@ -12,5 +47,49 @@ enum NdpExecCommands {
     NDP_EXEC_DAEM_REQ      = 0xa3
 };
 
-#endif /* OX_NDP_H */
+enum NdpKernels {
+    NDP_KERNEL_SCAN        = 0x01,
+    NDP_KERNEL_FILTER      = 0x02,
+    NDP_KERNEL_AGGREGATE   = 0x03
+};
+
+#define NDP_VERSION         1
+#define NDP_RESULT_SZ       4096
+#define NDP_MAX_DAEMONS     16
 
+typedef struct NdpResult {
+    uint64_t    scanned;    /* records */
+    uint64_t    matched;
+    uint64_t    sum;        /* of the field of matched records, wraps */
+    uint64_t    min;
+    uint64_t    max;
+    uint32_t    nout;       /* entries in data, may be less than matched */
+    uint32_t    out_sz;     /* bytes per entry */
+    uint8_t     data[NDP_RESULT_SZ - 48];
+} __attribute__((packed)) NdpResult;
+
+typedef struct NdpInfo {
+    uint16_t    version;
+    uint16_t    nkernels;
+    uint16_t    max_daemons;
+    uint16_t    ndaemons;
+    uint32_t    lba_sz;
+    uint32_t    result_sz;
+    uint8_t     kernels[8]; /* NdpKernels, nkernels entries */
+} __attribute__((packed)) NdpInfo;
+
+struct NvmeCtrl;
+struct NvmeCmd;
+struct NvmeRequest;
+struct NvmeNamespace;
+
+int      ox_ndp_init (void);
+void     ox_ndp_exit (void);
+void     ox_ndp_drain (void);
+uint16_t ox_ndp_admin_cmd (struct NvmeCtrl *, struct NvmeCmd *,
+                                                        struct NvmeRequest *);
+uint16_t ox_ndp_exec_cmd (struct NvmeCtrl *, struct NvmeNamespace *,
+                                  struct NvmeCmd *, struct NvmeRequest *);
+uint16_t ox_ndp_compare (struct NvmeRequest *, uint64_t slba, uint32_t nlb);
+
+#endif /* OX_NDP_H */
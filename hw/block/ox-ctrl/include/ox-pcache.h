@@ -0,0 +1,34 @@
+#ifndef OX_PCACHE_H
+#define OX_PCACHE_H
+
+#include <stdint.h>
+
+/*
+ * Page cache of the media managers, one per channel. Synchronous plane-page
+ * reads of the FTL (mapping pages, block metadata, bad block tables, GC
+ * source pages) complete from the cache when the page was read recently,
+ * without going to the media manager. Entries are full pages with their
+ * OOB, keyed by PPA (sector bits cleared) and replaced by LRU.
+ *
+ * Every write and erase submitted to a media manager invalidates the pages
+ * it touches. A read that misses records the generation of its hash bucket
+ * and only fills the cache if no invalidation hit the bucket meanwhile.
+ */
+struct nvm_mmgr_io_cmd;
+
+struct ox_pcache_stats {
+    uint64_t    hits;
+    uint64_t    misses;
+    uint64_t    fills;
+    uint64_t    invals;     /* cached pages dropped by writes and erases */
+};
+
+int      ox_pcache_init (uint16_t, uint32_t);
+void     ox_pcache_exit (void);
+uint8_t  ox_pcache_enabled (void);
+int      ox_pcache_read (struct nvm_mmgr_io_cmd *);
+void     ox_pcache_fill (struct nvm_mmgr_io_cmd *);
+void     ox_pcache_inval (struct nvm_mmgr_io_cmd *);
+void     ox_pcache_get_stats (struct ox_pcache_stats *);
+
+#endif /* OX_PCACHE_H */
@@ -0,0 +1,37 @@
+#ifndef OX_PROT_H
+#define OX_PROT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Sector protection between the FTL and the media managers. Each sector
+ * written with its OOB in controller memory gets a CRC32C of the sector data
+ * and of its OOB bytes, kept in the last OX_PROT_SZ bytes of the sector OOB
+ * (the FTL OOB entries leave them reserved). Reads that bring the OOB back
+ * to controller memory, as GC and FTL recovery do, are verified and fail if
+ * the CRC does not match, so torn pages are detected.
+ *
+ * A zero CRC field means the sector was written without protection, it is
+ * not verified. Open-channel mode is never protected, the host owns the OOB.
+ */
+#define OX_PROT_SZ      4
+
+struct nvm_mmgr_io_cmd;
+
+struct ox_prot_stats {
+    uint64_t    sec_protected;
+    uint64_t    sec_verified;
+    uint64_t    sec_errors;
+    uint64_t    sec_unprotected;   /* read with a zero CRC field */
+};
+
+uint32_t    ox_crc32c (uint32_t, const void *, size_t);
+const char *ox_crc32c_impl (void);
+void        ox_prot_init (uint8_t);
+uint8_t     ox_prot_enabled (void);
+void        ox_prot_write (struct nvm_mmgr_io_cmd *);
+int         ox_prot_read (struct nvm_mmgr_io_cmd *);
+void        ox_prot_get_stats (struct ox_prot_stats *);
+
+#endif /* OX_PROT_H */
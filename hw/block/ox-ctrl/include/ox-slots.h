@@ -0,0 +1,29 @@
+#ifndef OX_SLOTS_H
+#define OX_SLOTS_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+/*
+ * Allocator of DMA staging slots. Slots are bits of an atomic bitmap, taken
+ * by find-first-zero and compare-and-swap, without locks. If all slots are
+ * busy, the caller sleeps until a slot is released, releasing only takes the
+ * mutex if there are waiters. Slot indexes are 1-based, 0 is never returned
+ * so callers can keep it as 'no slot'.
+ */
+struct ox_slots {
+    uint32_t            n_slots;
+    uint32_t            n_words;
+    uint64_t            *map;     /* bit set: slot busy */
+    uint32_t            hint;     /* word to start the search from */
+    uint32_t            waiters;
+    pthread_mutex_t     mutex;
+    pthread_cond_t      cond;
+};
+
+int      ox_slots_init (struct ox_slots *, uint32_t);
+void     ox_slots_exit (struct ox_slots *);
+uint32_t ox_slots_get (struct ox_slots *);
+void     ox_slots_put (struct ox_slots *, uint32_t);
+
+#endif /* OX_SLOTS_H */
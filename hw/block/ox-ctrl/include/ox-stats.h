@@ -0,0 +1,65 @@
+#ifndef OX_STATS_H
+#define OX_STATS_H
+
+#include <stdint.h>
+#include "hw/block/ox-ctrl/include/ssd.h"
+
+/*
+ * Controller telemetry sampled at a fixed interval into a ring of the last
+ * OX_STATS_RING samples: multi-queue depths and timeouts, GC counters, the
+ * mapping cache and the media throughput of each channel. Rates are over
+ * the interval since the previous sample.
+ *
+ * Sampling runs from a QEMU_CLOCK_REALTIME timer in the main loop, the
+ * ring is only accessed there (sampling, QMP) and needs no lock. The
+ * channel counters are updated atomically by the media completions.
+ */
+#define OX_STATS_RING       128
+
+struct ox_stats_queue {
+    uint32_t    sq_used;
+    uint32_t    sq_wait;
+    uint32_t    cq_used;
+};
+
+struct ox_stats_mq {
+    char                    name[40];
+    uint32_t                timeout;
+    uint32_t                to_back;
+    uint32_t                n_queues;
+    struct ox_stats_queue   *queues;
+};
+
+struct ox_stats_ch {
+    uint64_t    rd_bytes;
+    uint64_t    wr_bytes;
+    uint64_t    erases;
+    uint64_t    rd_bps;     /* bytes per second */
+    uint64_t    wr_bps;
+};
+
+struct ox_stats_sample {
+    uint64_t                    seq;
+    int64_t                     time_ns;    /* QEMU_CLOCK_REALTIME */
+    uint32_t                    n_mq;
+    struct ox_stats_mq          *mq;
+    uint8_t                     has_gc;
+    struct nvm_ftl_gc_st        gc;
+    uint8_t                     has_map;
+    struct nvm_ftl_map_cache_st map;
+    uint8_t                     map_hit_rate; /* percent of the lookups */
+    uint16_t                    n_ch;
+    struct ox_stats_ch          *ch;
+};
+
+typedef void (ox_stats_sample_fn) (struct ox_stats_sample *, void *);
+
+int      ox_stats_init (uint16_t, uint32_t);
+void     ox_stats_exit (void);
+void     ox_stats_mmgr_io (struct nvm_mmgr_io_cmd *);
+void     ox_stats_set_interval (uint32_t);
+uint32_t ox_stats_interval (void);
+void     ox_stats_set_notify (ox_stats_sample_fn *, void *);
+void     ox_stats_foreach (uint64_t, ox_stats_sample_fn *, void *);
+
+#endif /* OX_STATS_H */
@@ -26,16 +26,17 @@
 #include <stdint.h>
 #include <syslog.h>
 #include <pthread.h>
-#include <setjmp.h>
 #include <time.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include "hw/block/ox-ctrl/include/uatomic.h"
 #include "hw/block/ox-ctrl/include/ox-mq.h"
+#include "hw/block/ox-ctrl/include/ox-lat.h"
 #include "hw/block/ox-ctrl/include/lightnvm.h"
 #include "qemu/osdep.h"
 #include "hw/block/block.h"
 #include "hw/pci/msix.h"
+#include "sysemu/iothread.h"
 
 #define STR_HELPER(x) #x
 #define STR(x) STR_HELPER(x)
@@ -52,10 +53,11 @@
         OBJECT_CHECK(QemuOxCtrl, (obj), TYPE_OX)
 
 #define MAX_NAME_SIZE           31
-#define NVM_QUEUE_RETRY         1024
-#define NVM_QUEUE_RETRY_SLEEP   1000
+#define NVM_QUEUE_WAIT_USEC     1000000 /* max wait for room in a queue */
+#define NVM_QUEUE_RETRY_SLEEP   1000    /* max FTL resubmission backoff */
 #define NVM_FTL_QUEUE_SIZE      512
 #define NVM_FTL_QUEUE_TO        4000000
+#define NVM_FTL_QUEUE_BATCH     32
 
 #define NVM_SYNCIO_TO          10
 #define NVM_SYNCIO_FLAG_BUF    0x1
@@ -117,6 +119,7 @@ struct nvm_memory_region {
 };
 
 struct nvm_channel;
+struct nvm_namespace;
 
 struct nvm_io_status {
     uint8_t     status;       /* global status for the cmd */
@@ -127,6 +130,16 @@ struct nvm_io_status {
     uint16_t    pgs_s;        /* pages success in request */
     uint16_t    ret_t;        /* retried times */
     uint8_t     pg_map[8];    /* pgs to retry */
+    u_atomic_t  pgs_pending;  /* pgs outstanding in the mmgr */
+};
+
+/* CLOCK_MONOTONIC nsec of the pipeline stages, see ox-lat.h */
+struct nvm_io_lat {
+    uint64_t    tfetch;   /* SQE fetched */
+    uint64_t    tsubmit;  /* submitted to the FTL SQ */
+    uint64_t    tftl;     /* taken by the FTL thread */
+    uint64_t    tdone;    /* completed by the FTL */
+    uint16_t    ch;
 };
 
 struct nvm_mmgr_io_cmd {
@@ -146,8 +159,11 @@ struct nvm_mmgr_io_cmd {
     uint8_t                 force_sync_md;
     u_atomic_t              *sync_count;
     pthread_mutex_t         *sync_mutex;
-    struct timeval          tstart;
-    struct timeval          tend;
+    uint64_t                tstart;    /* CLOCK_MONOTONIC nsec */
+    uint64_t                tdispatch; /* taken by the mmgr, 0 if not set */
+    uint64_t                tend;
+    uint32_t                pcache_gen; /* page cache bucket at the miss */
+    uint32_t                tag;        /* set at submission, 0: not in flight */
 
     /* MMGR specific */
     uint8_t                 rsvd[170];
@@ -157,7 +173,9 @@ struct nvm_io_cmd {
     uint64_t                    cid;
     struct nvm_channel          *channel[64];
     struct nvm_ppa_addr         ppalist[64];
+    struct nvm_ppa_addr         dst_ppalist[64]; /* copy destination */
     struct nvm_io_status        status;
+    struct nvm_io_lat           lat;
     struct nvm_mmgr_io_cmd      mmgr_io[64];
     void                        *req;
     void                        *mq_req;
@@ -167,8 +185,11 @@ struct nvm_io_cmd {
     uint32_t                    md_sz;
     uint32_t                    n_sec;
     uint64_t                    slba;
+    uint32_t                    nsid; /* 0 is the first namespace */
     uint8_t                     cmdtype;
     pthread_mutex_t             mutex;
+    struct nvm_io_cmd           *next; /* NVMe I/O pool free list */
+    struct NvmeIoPool           *pool; /* pool shard owning the descriptor */
 };
 
 #include "hw/block/ox-ctrl/include/nvme.h"
@@ -193,7 +214,8 @@ enum {
     MMGR_BAD_BLK   = 0x5,
     MMGR_ERASE_BLK = 0x7,
     MMGR_READ_SGL  = 0x8,
-    MMGR_WRITE_SGL = 0x9
+    MMGR_WRITE_SGL = 0x9,
+    MMGR_COPY_PG   = 0xa  /* FTL only, copy ppalist to dst_ppalist */
 };
 
 enum NVM_ERROR {
@@ -225,6 +247,18 @@ enum RUN_FLAGS {
     RUN_APPNVM     = 1 << 7
 };
 
+/*
+ * Asks a media manager to make all the writes completed so far durable. The
+ * media manager calls nvm_flush_callback when it is done, possibly from
+ * another thread.
+ */
+struct nvm_mmgr_flush_cmd {
+    struct nvm_mmgr                     *mmgr;
+    uint8_t                             status;
+    void                                *opaque; /* used by the core */
+    TAILQ_ENTRY(nvm_mmgr_flush_cmd)     entry;   /* MMGR specific */
+};
+
 struct nvm_mmgr;
 typedef int     (nvm_mmgr_read_pg)(struct nvm_mmgr_io_cmd *);
 typedef int     (nvm_mmgr_write_pg)(struct nvm_mmgr_io_cmd *);
@@ -232,6 +266,12 @@ typedef int     (nvm_mmgr_erase_blk)(struct nvm_mmgr_io_cmd *);
 typedef int     (nvm_mmgr_get_ch_info)(struct nvm_channel *, uint16_t);
 typedef int     (nvm_mmgr_set_ch_info)(struct nvm_channel *, uint16_t);
 typedef void    (nvm_mmgr_exit)(struct nvm_mmgr *);
+typedef int     (nvm_mmgr_flush)(struct nvm_mmgr_flush_cmd *);
+
+/* Submits an array of commands (one per ppa, each with its own prp list),
+ * e.g. the planes of a multi-plane page. Returns the number of commands
+ * submitted, commands are completed one by one through nvm_callback */
+typedef int     (nvm_mmgr_io_vec)(struct nvm_mmgr_io_cmd *, uint16_t);
 
 struct nvm_mmgr_ops {
     nvm_mmgr_read_pg       *read_pg;
@@ -240,6 +280,10 @@ struct nvm_mmgr_ops {
     nvm_mmgr_exit          *exit;
     nvm_mmgr_get_ch_info   *get_ch_info;
     nvm_mmgr_set_ch_info   *set_ch_info;
+    nvm_mmgr_flush         *flush;      /* optional */
+    nvm_mmgr_io_vec        *read_vec;   /* optional */
+    nvm_mmgr_io_vec        *write_vec;  /* optional */
+    nvm_mmgr_io_vec        *erase_vec;  /* optional */
 };
 
 struct nvm_mmgr_geometry {
@@ -251,6 +295,7 @@ struct nvm_mmgr_geometry {
     uint8_t     n_of_planes;
     uint32_t    pg_size;
     uint32_t    sec_oob_sz;
+    uint32_t    blk_life;       /* erase cycles per block, 0 if unknown */
 
     /* calculated values */
     uint32_t    sec_per_pl_pg;
@@ -322,12 +367,79 @@ struct nvm_ftl_cap_set_bbtbl_st {
     uint16_t            bb_format;
 };
 
+/* Physical address of each LBA of a range, LNVM_LBA_UNMAPPED if unmapped */
+struct nvm_ftl_cap_get_l2ptbl_st {
+    uint64_t            slba;   /* FTL LBA */
+    uint32_t            nlb;
+    uint64_t            *tbl;   /* nlb entries */
+};
+
 struct nvm_ftl_cap_gl_fn {
     uint16_t            ftl_id;
     uint16_t            fn_id;
     void                *arg;
 };
 
+/* --- FTL FUNCTIONS (FTL_CAP_CALL_FN) --- */
+
+enum {
+    /* Mapping cache size (arg: uint32_t pages per channel) and counters */
+    FTL_FN_MAP_CACHE_SET        = 0x01,
+    FTL_FN_MAP_CACHE_GET        = 0x02,
+    /* Deallocate a LBA range (arg: struct nvm_ftl_lba_range) */
+    FTL_FN_DEALLOCATE           = 0x03,
+    /* Erase counts of the FTL blocks (arg: struct nvm_ftl_wear_st) */
+    FTL_FN_WEAR_GET             = 0x04,
+    /* Read a LBA range to a controller buffer (arg: struct nvm_ftl_lba_read) */
+    FTL_FN_LBA_READ             = 0x05,
+    /* Garbage collection counters (arg: struct nvm_ftl_gc_st) */
+    FTL_FN_GC_GET               = 0x06
+};
+
+struct nvm_ftl_lba_range {
+    uint64_t            slba;
+    uint32_t            nlb;
+};
+
+struct nvm_ftl_lba_read {
+    uint64_t            slba;
+    uint32_t            nlb;
+    uint32_t            sec_sz;     /* bytes per LBA in buf */
+    uint8_t             *buf;
+};
+
+struct nvm_ftl_map_cache_st {
+    uint32_t            pgs_ch;     /* cache pages per channel */
+    uint32_t            pg_sz;
+    uint32_t            nch;
+    uint32_t            used;       /* cached pages, all channels */
+    uint64_t            hit;
+    uint64_t            miss;
+    uint64_t            evict;
+    uint64_t            prefetch;   /* pages loaded ahead of a lookup */
+};
+
+struct nvm_ftl_wear_st {
+    uint32_t            blks;       /* good blocks, all channels */
+    uint32_t            min_ec;
+    uint32_t            max_ec;
+    uint32_t            avg_ec;
+    uint32_t            blk_life;   /* erase cycles per block, 0 if unknown */
+    uint64_t            wl_moves;   /* cold blocks moved by wear leveling */
+};
+
+struct nvm_ftl_gc_st {
+    uint64_t            recycled_blks;
+    uint64_t            moved_sec;  /* valid sectors moved out of victims */
+    uint64_t            pad_sec;
+    uint64_t            err_sec;
+    uint64_t            wro_sec;    /* sectors lost to write errors */
+    uint64_t            map_pgs;    /* mapping pages moved */
+    uint64_t            wl_moves;
+    uint64_t            host_sec;   /* written by the host, current policy */
+    uint64_t            gc_sec;     /* written by the GC, current policy */
+};
+
 /* --- FTL CAPABILITIES BIT OFFSET --- */
 
 enum {
@@ -359,6 +471,7 @@ typedef int       (nvm_ftl_init_channel)(struct nvm_channel *);
 typedef void      (nvm_ftl_exit)(void);
 typedef int       (nvm_ftl_get_bbtbl)(struct nvm_ppa_addr *,uint8_t *,uint32_t);
 typedef int       (nvm_ftl_set_bbtbl)(struct nvm_ppa_addr *, uint8_t);
+typedef int       (nvm_ftl_get_l2ptbl)(uint64_t, uint32_t, uint64_t *);
 typedef int       (nvm_ftl_init_fn)(uint16_t, void *arg);
 typedef void      (nvm_ftl_exit_fn)(uint16_t);
 typedef int       (nvm_ftl_call_fn)(uint16_t, void *arg);
@@ -370,6 +483,7 @@ struct nvm_ftl_ops {
     nvm_ftl_exit           *exit;
     nvm_ftl_get_bbtbl      *get_bbtbl;
     nvm_ftl_set_bbtbl      *set_bbtbl;
+    nvm_ftl_get_l2ptbl     *get_l2ptbl;
     nvm_ftl_init_fn        *init_fn;
     nvm_ftl_exit_fn        *exit_fn;
     nvm_ftl_call_fn        *call_fn;
@@ -381,9 +495,7 @@ struct nvm_ftl {
     struct nvm_ftl_ops      *ops;
     uint32_t                cap; /* Capability bits */
     uint16_t                bbtbl_format;
-    uint8_t                 nq; /* Number of queues/threads, up to 64 per FTL */
-    struct ox_mq            *mq;
-    uint16_t                next_queue[2];
+    uint8_t                 nq; /* Queues/threads per namespace, up to 64 */
     LIST_ENTRY(nvm_ftl)     entry;
 };
 
@@ -398,6 +510,7 @@ struct nvm_channel {
     uint16_t                    ftl_rsv;  /* number of blks reserved by ftl */
     struct nvm_mmgr             *mmgr;
     struct nvm_ftl              *ftl;
+    struct nvm_namespace        *ns;
     struct nvm_mmgr_geometry    *geometry;
     struct nvm_ppa_addr         *mmgr_rsv_list; /* list of mmgr reserved blks */
     struct nvm_ppa_addr         *ftl_rsv_list;
@@ -422,6 +535,12 @@ struct nvm_channel {
 #define OX_RUN_MODE         0x0
 #define OX_TEST_MODE        0x1
 #define OX_ADMIN_MODE       0x2
+#define OX_BENCH_MODE       0x3
+
+enum {
+    BENCH_LEVEL_FTL  = 0x0,  /* nvm_submit_ftl, LBA I/O (AppNVM) */
+    BENCH_LEVEL_MMGR = 0x1   /* nvm_submit_mmgr, page I/O */
+};
 
 struct nvm_init_arg
 {
@@ -434,6 +553,15 @@ struct nvm_init_arg
     char        test_subtest[CMDARG_LEN];
     /* CMD ADMIN */
     char        admin_task[CMDARG_LEN];
+    /* CMD BENCH */
+    uint8_t     bench_level;
+    uint8_t     bench_rand;     /* random offsets, sequential if 0 */
+    uint8_t     bench_read;     /* percentage of reads */
+    uint16_t    bench_qd;       /* outstanding I/Os per job */
+    uint16_t    bench_jobs;     /* submitter threads */
+    uint32_t    bench_bs;       /* bytes per I/O, FTL level */
+    uint32_t    bench_time;     /* seconds */
+    uint64_t    bench_size;     /* bytes of the range used by all jobs */
 };
 
 /* tests initialization functions */
@@ -441,20 +569,14 @@ typedef int (tests_init_fn)(struct nvm_init_arg *);
 typedef void *(tests_start_fn)(void *);
 typedef void *(tests_admin_fn)(void *);
 typedef void (tests_complete_io_fn)(struct NvmeRequest *);
+typedef void *(tests_bench_fn)(void *);
 
 struct tests_init_st {
     tests_init_fn           *init;
     tests_start_fn          *start;
     tests_admin_fn          *admin;
     tests_complete_io_fn    *complete_io;
-};
-
-struct nvm_sync_io_arg {
-    uint8_t                 cmdtype;
-    struct nvm_channel      *ch;
-    struct nvm_mmgr_io_cmd  *cmd;
-    void                    *buf;
-    uint8_t                 status;
+    tests_bench_fn          *bench;
 };
 
 typedef struct QemuOxCtrl {
@@ -469,15 +591,59 @@ typedef struct QemuOxCtrl {
     uint8_t         lnvm;
     uint8_t         volt;
     char            *serial;
+    char            *ftl_cpus; /* host cpus for FTL queue threads, "0-3,8" */
+    uint32_t        ftl_poll_usec; /* FTL queue busy-poll, 0: disabled */
+    IOThread        *iothread; /* if set, I/O SQs are processed there */
+    uint8_t         volt_timing; /* if set, VOLT simulates the NAND timing */
+    uint32_t        volt_tr;     /* usec, 0: default */
+    uint32_t        volt_tprog;  /* usec, 0: default */
+    uint32_t        volt_tbers;  /* usec, 0: default */
+    uint32_t        volt_xfer;   /* channel MB/s, 0: default */
+    uint32_t        volt_dma_slots; /* DMA slots per channel, 0: default */
+    uint16_t        volt_ch;     /* VOLT geometry, 0: default */
+    uint16_t        volt_luns;
+    uint32_t        volt_blks;
+    uint32_t        volt_pgs;
+    uint32_t        volt_queue;  /* VOLT queue entries per channel, 0: default */
+    uint32_t        map_cache_pgs; /* AppNVM map cache pages per ch, 0: default */
+    uint8_t         gc_policy;   /* AppNVM GC module id, 0: default */
+    uint32_t        wb_pgs;      /* AppNVM write buffer pages, 0: disabled */
+    uint16_t        namespaces;  /* channels are split among them, 0: 1 */
+    uint16_t        stripe_pgs;  /* AppNVM plane-pages per channel stripe, 0: 1 */
+    uint8_t         merge;       /* merge adjacent reads/writes of a SQ burst */
+    uint32_t        cmb_size_mb; /* Controller Memory Buffer, 0: disabled */
+    uint8_t         oob_crc;     /* sector CRC32C in the OOB */
+    uint32_t        pcache_pages; /* page cache per channel, 0: disabled */
+    uint16_t        fabrics_port; /* NVMe/TCP target port, 0: disabled */
+    uint32_t        stats_interval; /* telemetry sampling msec, 0: disabled */
 } QemuOxCtrl;
 
+/*
+ * A namespace is a set of contiguous channels in core.nvm_ch, managed by the
+ * same FTL. Each namespace has its own FTL queues, so namespaces do not wait
+ * for each other in the FTL queues. LBAs of a namespace start at 'slba' in
+ * the flat device space of the FTL.
+ */
+struct nvm_namespace {
+    uint32_t                nsid;
+    uint16_t                ch_first;
+    uint16_t                nch;
+    uint64_t                slba;       /* bytes */
+    uint64_t                size;       /* bytes */
+    uint64_t                stripe_sz;  /* bytes per channel in a stripe */
+    struct nvm_ftl          *ftl;
+    struct ox_mq            *mq;
+    uint16_t                next_queue[2];
+};
+
 struct core_struct {
     uint8_t                 mmgr_count;
     uint16_t                ftl_count;
     uint16_t                ftl_q_count;
     uint16_t                nvm_ch_count;
-    uint64_t                nvm_ns_size;
-    jmp_buf                 jump;
+    uint64_t                nvm_ns_size; /* all namespaces */
+    uint16_t                nvm_ns_count;
+    struct nvm_namespace    *nvm_ns;
     uint8_t                 run_flag;
     uint8_t                 debug;
     uint16_t                std_ftl;
@@ -491,24 +657,42 @@ struct core_struct {
     QemuOxCtrl              *qemu;
 };
 
+/* Called when all the media managers are flushed, int is 0 or -1 (failed) */
+typedef void (nvm_flush_fn)(void *, int);
+
 /* core functions */
 int  nvm_restart (void);
+int  nvm_flush (nvm_flush_fn *, void *);
+void nvm_flush_callback (struct nvm_mmgr_flush_cmd *);
 int  nvm_register_mmgr(struct nvm_mmgr *);
 int  nvm_register_pcie_handler(struct nvm_pcie *);
 int  nvm_register_ftl (struct nvm_ftl *);
 int  nvm_submit_ftl (struct nvm_io_cmd *);
+struct nvm_namespace *nvm_get_ns (uint32_t);
 int  nvm_submit_mmgr (struct nvm_mmgr_io_cmd *);
+int  nvm_submit_mmgr_io_vec (struct nvm_mmgr_io_cmd *, uint16_t);
 void nvm_complete_ftl (struct nvm_io_cmd *);
 void nvm_callback (struct nvm_mmgr_io_cmd *);
 int  nvm_dma (void *, uint64_t, ssize_t, uint8_t);
+void *nvm_dma_map (uint64_t, ssize_t, uint8_t);
+void nvm_dma_unmap (void *, ssize_t, uint8_t);
 int  nvm_memcheck (void *);
 int  nvm_contains_ppa (struct nvm_ppa_addr *, uint32_t, struct nvm_ppa_addr);
 int  nvm_ftl_cap_exec (uint8_t, void *);
+int  nvm_ftl_map_cache_set (uint32_t);
+int  nvm_ftl_map_cache_get (struct nvm_ftl_map_cache_st *);
+int  nvm_ftl_wear_get (struct nvm_ftl_wear_st *);
+int  nvm_ftl_gc_get (struct nvm_ftl_gc_st *);
+int  nvm_ftl_deallocate (uint64_t, uint32_t);
+int  nvm_ftl_lba_read (uint64_t, uint32_t, uint32_t, void *);
 int  nvm_init_ctrl (int, char **, QemuOxCtrl *);
 int  nvm_test_unit (struct nvm_init_arg *);
 int  nvm_admin_unit (struct nvm_init_arg *);
+int  nvm_bench_unit (struct nvm_init_arg *);
 int  nvm_submit_sync_io (struct nvm_channel *, struct nvm_mmgr_io_cmd *,
                                                               void *, uint8_t);
+int  nvm_submit_sync_io_vec (struct nvm_channel *, struct nvm_mmgr_io_cmd *,
+                                                  void **, uint8_t, uint16_t);
 int  nvm_submit_multi_plane_sync_io (struct nvm_channel *,
                           struct nvm_mmgr_io_cmd *, void *, uint8_t, uint64_t);
 
@@ -525,9 +709,12 @@ int  nvme_init(struct NvmeCtrl *);
 void nvme_process_reg (struct NvmeCtrl *, uint64_t, uint64_t);
 void nvme_q_scheduler (struct NvmeCtrl *, uint32_t *);
 void nvme_process_db (struct NvmeCtrl *, uint64_t, uint64_t);
+bool nvme_process_sq_db_unlocked (struct NvmeCtrl *, uint64_t, uint64_t);
 /* nvme functions used by tests */
 uint16_t nvme_admin_cmd (struct NvmeCtrl *, struct NvmeCmd *,
                                                         struct NvmeRequest *);
+uint16_t nvme_io_cmd (struct NvmeCtrl *, struct NvmeCmd *,
+                                                        struct NvmeRequest *);
 
 /* pcie handler init function */
 int dfcpcie_init(void);
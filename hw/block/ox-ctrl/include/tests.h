@@ -58,5 +58,6 @@ int testset_lnvm_init (struct nvm_init_arg *);
 int ox_admin_init (struct nvm_init_arg *);
 
 uint64_t tests_get_cmd_usec (struct nvm_mmgr_io_cmd *);
+void    *tests_bench (void *);
 
 #endif /* TESTS_H */
\ No newline at end of file
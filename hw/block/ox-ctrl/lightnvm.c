@@ -55,47 +55,97 @@ void lnvm_set_default(LnvmCtrl *ctrl)
     ctrl->err_write = LNVM_ERR_WRITE;
 }
 
-static void lnvm_tbl_initialize(uint64_t *tbl, uint32_t len)
-{
-    uint32_t i;
+/* L2P entries built and copied to the host at a time, one page */
+#define LNVM_L2P_CHUNK  (NVME_KERNEL_PG_SIZE / sizeof (uint64_t))
 
-    for (i = 0; i < len; i++)
-        tbl[i] = LNVM_LBA_UNMAPPED;
+/* Copies 'len' bytes at byte 'pos' of a table held in the host pages 'prp' */
+static uint16_t lnvm_tbl_to_host (uint64_t *prp, uint64_t pos, uint8_t *src,
+                                                                uint64_t len)
+{
+    uint64_t pg_off, sz;
+    uint16_t ret;
+
+    while (len) {
+        pg_off = pos % NVME_KERNEL_PG_SIZE;
+        sz = MIN(len, NVME_KERNEL_PG_SIZE - pg_off);
+        ret = nvme_write_to_host (src, prp[pos / NVME_KERNEL_PG_SIZE] + pg_off,
+                                                                          sz);
+        if (ret)
+            return ret;
+        pos += sz;
+        src += sz;
+        len -= sz;
+    }
+    return NVME_SUCCESS;
 }
 
+/*
+ * Returns the device address of each LBA of a namespace range, as mapped by
+ * the FTL. The table is streamed to the host chunk by chunk, the controller
+ * never holds more than a page of it.
+ */
 uint16_t lnvm_get_l2p_tbl(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
 {
     LnvmGetL2PTbl *gtbl = (LnvmGetL2PTbl*)cmd;
+    struct nvm_ftl_cap_get_l2ptbl_st arg;
+    NvmeNamespace *ns;
+    uint64_t tbl[LNVM_L2P_CHUNK];
     uint32_t nlb = gtbl->nlb;
-    uint64_t prp1 = gtbl->prp1;
     uint32_t nsid = gtbl->nsid;
-    uint64_t tbl_sz;
-    uint64_t *tbl;
-    int ret;
+    uint64_t slba = gtbl->slba;
+    uint64_t *prp, pg_off, tbl_sz;
+    uint32_t pos, cnt, n_pg;
+    uint16_t ret;
 
     if (nsid == 0 || nsid > n->num_namespaces) {
         return NVME_INVALID_NSID | NVME_DNR;
     }
+    ns = &n->namespaces[nsid - 1];
 
-    tbl_sz = nlb * sizeof(uint64_t);
-    tbl = calloc (1, tbl_sz);
-    if (!tbl) {
-        log_info("[ERROR lnvm: cannot allocate bitmap for l2p table]\n");
-        goto out;
-    }
-    lnvm_tbl_initialize(tbl, nlb);
+    if (!nlb || !gtbl->prp1)
+        return NVME_INVALID_FIELD | NVME_DNR;
+    if (slba + nlb > ns->id_ns.nsze)
+        return NVME_LBA_RANGE | NVME_DNR;
 
-    // TODO: call core (slba is the first page in a flat addr space)
+    tbl_sz = (uint64_t) nlb * sizeof (uint64_t);
+    if (n->id_ctrl.mdts &&
+                tbl_sz > ((uint64_t) NVME_KERNEL_PG_SIZE << n->id_ctrl.mdts))
+        return NVME_INVALID_FIELD | NVME_DNR;
 
-    if (prp1) {
-        ret = nvme_write_to_host((uint8_t *)tbl, prp1, tbl_sz);
-        free(tbl);
-        return ret;
+    /* One entry per host page, PRP1 may start inside its page */
+    pg_off = gtbl->prp1 % NVME_KERNEL_PG_SIZE;
+    n_pg = (pg_off + tbl_sz + NVME_KERNEL_PG_SIZE - 1) / NVME_KERNEL_PG_SIZE;
+    prp = malloc (n_pg * sizeof (uint64_t));
+    if (!prp)
+        return NVME_INTERNAL_DEV_ERROR;
+
+    ret = nvme_map_dptr (n, prp, cmd, n_pg, NVME_KERNEL_PG_SIZE);
+    if (ret)
+        goto OUT;
+    prp[0] -= pg_off;
+
+    for (pos = 0; pos < nlb; pos += cnt) {
+        cnt = MIN(LNVM_L2P_CHUNK, nlb - pos);
+
+        arg.slba = ns->start_block + slba + pos;
+        arg.nlb = cnt;
+        arg.tbl = tbl;
+        if (nvm_ftl_cap_exec (FTL_CAP_GET_L2PTBL, &arg)) {
+            log_err("[ERROR lnvm: cannot get l2p table, lba %lu]\n",
+                                                                arg.slba);
+            ret = NVME_INTERNAL_DEV_ERROR;
+            goto OUT;
+        }
+
+        ret = lnvm_tbl_to_host (prp, pg_off + pos * sizeof (uint64_t),
+                                (uint8_t *) tbl, cnt * sizeof (uint64_t));
+        if (ret)
+            goto OUT;
     }
 
-    free(tbl);
-out:
-    return NVME_INVALID_FIELD;
+OUT:
+    free (prp);
+    return ret;
 }
 
 uint16_t lnvm_set_bb_tbl(NvmeCtrl *n, NvmeCmd *nvmecmd, NvmeRequest *req)
@@ -196,18 +246,23 @@ out:
     return NVME_INVALID_FIELD;
 }
 
-uint16_t lnvm_erase_sync(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
+/*
+ * Vector erase, one PPA per plane block. The blocks are erased in parallel,
+ * the FTL gives the whole vector to the media manager and the command
+ * completes when the last block is erased.
+ */
+uint16_t lnvm_erase(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
     NvmeRequest *req)
 {
     uint8_t i;
     LnvmRwCmd *dm = (LnvmRwCmd *)cmd;
     uint64_t spba = dm->spba;
     uint32_t nlb = dm->nlb + 1;
-    struct nvm_ppa_addr *psl = req->nvm_io.ppalist;
+    struct nvm_ppa_addr *psl = req->nvm_io->ppalist;
 
-    if (nlb > LNVM_PLANES) {
+    if (nlb > LNVM_MAX_SEC_RQ) {
         log_info( "[ERROR lnvm: Wrong erase n of blocks (%d). "
-                "Max: %d supported]\n", nlb, LNVM_PLANES);
+                "Max: %d supported]\n", nlb, LNVM_MAX_SEC_RQ);
         return NVME_INVALID_FIELD | NVME_DNR;
     } else if (nlb > 1) {
         if (spba == LNVM_PBA_UNMAPPED || !spba)
@@ -219,7 +274,7 @@ uint16_t lnvm_erase_sync(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
     }
 
     /* In case of single PPA, we make the vector for multiple planes */
-    if (nlb < LNVM_PLANES) {
+    if (nlb == 1 && nlb < LNVM_PLANES) {
         nlb = LNVM_PLANES;
         for (i = 1; i < nlb; i++) {
             psl[i].ppa = psl[0].ppa;
@@ -232,33 +287,114 @@ uint16_t lnvm_erase_sync(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
     req->nlb = nlb;
     req->ns = ns;
 
-    req->nvm_io.cid = dm->cid;
-    req->nvm_io.cmdtype = MMGR_ERASE_BLK;
-    req->nvm_io.n_sec = nlb;
-    req->nvm_io.req = (void *) req;
-    req->nvm_io.status.pg_errors = 0;
-    req->nvm_io.status.ret_t = 0;
-    req->nvm_io.status.pgs_p = 0;
-    req->nvm_io.status.pgs_s = 0;
+    req->nvm_io->cid = dm->cid;
+    req->nvm_io->nsid = ns->id;
+    req->nvm_io->cmdtype = MMGR_ERASE_BLK;
+    req->nvm_io->n_sec = nlb;
+    req->nvm_io->req = (void *) req;
+    req->nvm_io->status.pg_errors = 0;
+    req->nvm_io->status.ret_t = 0;
+    req->nvm_io->status.pgs_p = 0;
+    req->nvm_io->status.pgs_s = 0;
 
-    req->nvm_io.status.total_pgs = nlb;
-    req->nvm_io.status.status = NVM_IO_NEW;
+    req->nvm_io->status.total_pgs = nlb;
+    req->nvm_io->status.status = NVM_IO_NEW;
 
     for (i = 0; i < 8; i++)
-        req->nvm_io.status.pg_map[i] = 0;
+        req->nvm_io->status.pg_map[i] = 0;
 
     for (i = 0; i < nlb; i++) {
-        req->nvm_io.mmgr_io[i].pg_index = i;
-        req->nvm_io.mmgr_io[i].status = NVM_IO_SUCCESS;
-        req->nvm_io.mmgr_io[i].nvm_io = &req->nvm_io;
-        req->nvm_io.mmgr_io[i].pg_sz = 0;
+        req->nvm_io->mmgr_io[i].pg_index = i;
+        req->nvm_io->mmgr_io[i].status = NVM_IO_SUCCESS;
+        req->nvm_io->mmgr_io[i].nvm_io = req->nvm_io;
+        req->nvm_io->mmgr_io[i].pg_sz = 0;
     }
 
     if (core.debug)
-        lnvm_debug_print_io (req->nvm_io.ppalist, req->nvm_io.prp,
-                                                req->nvm_io.md_prp, nlb, 0, 0);
+        lnvm_debug_print_io (req->nvm_io->ppalist, req->nvm_io->prp,
+                                                req->nvm_io->md_prp, nlb, 0, 0);
+
+    return nvm_submit_ftl(req->nvm_io);
+}
+
+/*
+ * Vector copy, sectors are moved from the source to the destination PPAs
+ * inside the device, no data goes to the host. Destination sectors must fill
+ * whole pages, in sector order, as for writes.
+ */
+uint16_t lnvm_copy(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
+    NvmeRequest *req)
+{
+    uint32_t i;
+    LnvmCopyCmd cp;
+    uint32_t nlb;
+    struct nvm_ppa_addr *src = req->nvm_io->ppalist;
+    struct nvm_ppa_addr *dst = req->nvm_io->dst_ppalist;
+    struct nvm_ppa_addr *pg;
+
+    /* NvmeCmd is packed, its fields are not aligned for LnvmCopyCmd */
+    memcpy(&cp, cmd, sizeof(LnvmCopyCmd));
+    nlb = cp.nlb + 1;
+
+    if (nlb > LNVM_MAX_SEC_RQ || nlb % LNVM_SEC_PG) {
+        log_info( "[ERROR lnvm: Wrong copy n of sectors (%d). Max: %d, "
+                "multiple of %d]\n", nlb, LNVM_MAX_SEC_RQ, LNVM_SEC_PG);
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    if (cp.spba == LNVM_PBA_UNMAPPED || !cp.spba ||
+                                    cp.dpba == LNVM_PBA_UNMAPPED || !cp.dpba)
+        return NVME_INVALID_FIELD | NVME_DNR;
+
+    nvme_read_from_host((void *)src, cp.spba, nlb * sizeof(uint64_t));
+    nvme_read_from_host((void *)dst, cp.dpba, nlb * sizeof(uint64_t));
+
+    /* Source channels are checked by the core, with the FTL submission.
+     * Destinations must be in the same namespace, so in the same FTL */
+    for (i = 0; i < nlb; i++) {
+        pg = &dst[i - (i % LNVM_SEC_PG)];
+        if (dst[i].g.ch >= core.nvm_ch_count ||
+                core.nvm_ch[dst[i].g.ch]->ns != nvm_get_ns (ns->id) ||
+                dst[i].g.sec != i % LNVM_SEC_PG ||
+                dst[i].g.ch != pg->g.ch || dst[i].g.lun != pg->g.lun ||
+                dst[i].g.blk != pg->g.blk || dst[i].g.pg != pg->g.pg ||
+                dst[i].g.pl != pg->g.pl) {
+            log_info( "[ERROR lnvm: Wrong copy destination sequence.]\n");
+            return NVME_INVALID_FIELD | NVME_DNR;
+        }
+    }
+
+    req->meta_size = 0;
+    req->status = NVME_SUCCESS;
+    req->nlb = nlb;
+    req->ns = ns;
+
+    req->nvm_io->cid = cp.cid;
+    req->nvm_io->nsid = ns->id;
+    req->nvm_io->sec_sz = LNVM_SECSZ;
+    req->nvm_io->md_sz = 0;
+    req->nvm_io->cmdtype = MMGR_COPY_PG;
+    req->nvm_io->n_sec = nlb;
+    req->nvm_io->req = (void *) req;
+    req->nvm_io->status.pg_errors = 0;
+    req->nvm_io->status.ret_t = 0;
+    req->nvm_io->status.pgs_p = 0;
+    req->nvm_io->status.pgs_s = 0;
+
+    req->nvm_io->status.total_pgs = nlb / LNVM_SEC_PG;
+    req->nvm_io->status.status = NVM_IO_NEW;
 
-    return nvm_submit_ftl(&req->nvm_io);
+    for (i = 0; i < 8; i++)
+        req->nvm_io->status.pg_map[i] = 0;
+
+    if (core.debug) {
+        lnvm_debug_print_io (src, req->nvm_io->prp, req->nvm_io->md_prp,
+                                                                   nlb, 0, 0);
+        lnvm_debug_print_io (dst, req->nvm_io->prp, req->nvm_io->md_prp,
+                                                                   nlb, 0, 0);
+    }
+
+    return nvm_submit_ftl(req->nvm_io);
 }
 
 static inline uint64_t nvme_gen_to_dev_addr(LnvmCtrl *ln,struct nvm_ppa_addr *r)
@@ -277,11 +413,12 @@ static inline uint64_t nvme_gen_to_dev_addr(LnvmCtrl *ln,struct nvm_ppa_addr *r)
 uint16_t lnvm_rw(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd, NvmeRequest *req)
 {
     int i, pg, nsec;
+    uint16_t ret;
     uint64_t sppa, eppa, moff;
 
     LnvmCtrl *ln = &n->lightnvm_ctrl;
     LnvmRwCmd *lrw = (LnvmRwCmd *)cmd;
-    struct nvm_ppa_addr *psl = req->nvm_io.ppalist;
+    struct nvm_ppa_addr *psl = req->nvm_io->ppalist;
 
     uint32_t nlb  = lrw->nlb + 1;
     uint64_t spba = lrw->spba;
@@ -319,13 +456,9 @@ uint16_t lnvm_rw(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd, NvmeRequest *req)
     if (n_sectors > 1)
         eppa = nvme_gen_to_dev_addr(ln, &psl[n_sectors - 1]);
 
-    req->nvm_io.prp[0] = lrw->prp1;
-
-    if (n_sectors == 2)
-        req->nvm_io.prp[1] = lrw->prp2;
-    else if (n_sectors > 2)
-        nvme_read_from_host((void *)(&req->nvm_io.prp[1]), lrw->prp2,
-                                             (n_sectors-1) * sizeof(uint64_t));
+    ret = nvme_map_dptr (n, req->nvm_io->prp, cmd, n_sectors, LNVM_SECSZ);
+    if (ret)
+        return ret;
 
     meta_size = (meta) ? meta_size : 0;
     req->slba = sppa;
@@ -334,21 +467,22 @@ uint16_t lnvm_rw(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd, NvmeRequest *req)
     req->nlb = nlb;
     req->ns = ns;
 
-    req->nvm_io.cid = lrw->cid;
-    req->nvm_io.sec_sz = (1 << data_shift);
-    req->nvm_io.md_sz = meta_size;
-    req->nvm_io.cmdtype = (req->is_write) ? MMGR_WRITE_PG : MMGR_READ_PG;
-    req->nvm_io.n_sec = nlb;
-    req->nvm_io.req = (void *) req;
+    req->nvm_io->cid = lrw->cid;
+    req->nvm_io->nsid = ns->id;
+    req->nvm_io->sec_sz = (1 << data_shift);
+    req->nvm_io->md_sz = meta_size;
+    req->nvm_io->cmdtype = (req->is_write) ? MMGR_WRITE_PG : MMGR_READ_PG;
+    req->nvm_io->n_sec = nlb;
+    req->nvm_io->req = (void *) req;
 
-    req->nvm_io.status.pg_errors = 0;
-    req->nvm_io.status.ret_t = 0;
-    req->nvm_io.status.pgs_p = 0;
-    req->nvm_io.status.pgs_s = 0;
-    req->nvm_io.status.status = NVM_IO_NEW;
+    req->nvm_io->status.pg_errors = 0;
+    req->nvm_io->status.ret_t = 0;
+    req->nvm_io->status.pgs_p = 0;
+    req->nvm_io->status.pgs_s = 0;
+    req->nvm_io->status.status = NVM_IO_NEW;
 
     for (i = 0; i < 8; i++)
-        req->nvm_io.status.pg_map[i] = 0;
+        req->nvm_io->status.pg_map[i] = 0;
 
     pg = 0;
     nsec = 0;
@@ -361,15 +495,15 @@ uint16_t lnvm_rw(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd, NvmeRequest *req)
                       psl[i].g.pg != psl[i - 1].g.pg ||
                       psl[i].g.pl != psl[i - 1].g.pl))) {
 
-            req->nvm_io.mmgr_io[pg].pg_index = pg;
-            req->nvm_io.mmgr_io[pg].status = NVM_IO_SUCCESS;
-            req->nvm_io.mmgr_io[pg].nvm_io = &req->nvm_io;
-            req->nvm_io.mmgr_io[pg].pg_sz = nsec * LNVM_SECSZ;
-            req->nvm_io.mmgr_io[pg].n_sectors = nsec;
-            req->nvm_io.mmgr_io[pg].sec_offset = i - nsec;
-            req->nvm_io.mmgr_io[pg].sync_count = NULL;
-            req->nvm_io.mmgr_io[pg].sync_mutex = NULL;
-            req->nvm_io.md_prp[pg] = (meta && meta_size) ? moff : 0;
+            req->nvm_io->mmgr_io[pg].pg_index = pg;
+            req->nvm_io->mmgr_io[pg].status = NVM_IO_SUCCESS;
+            req->nvm_io->mmgr_io[pg].nvm_io = req->nvm_io;
+            req->nvm_io->mmgr_io[pg].pg_sz = nsec * LNVM_SECSZ;
+            req->nvm_io->mmgr_io[pg].n_sectors = nsec;
+            req->nvm_io->mmgr_io[pg].sec_offset = i - nsec;
+            req->nvm_io->mmgr_io[pg].sync_count = NULL;
+            req->nvm_io->mmgr_io[pg].sync_mutex = NULL;
+            req->nvm_io->md_prp[pg] = (meta && meta_size) ? moff : 0;
 
             pg++;
             nsec = 0;
@@ -378,13 +512,13 @@ uint16_t lnvm_rw(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd, NvmeRequest *req)
         nsec++;
     }
 
-    req->nvm_io.status.total_pgs = pg;
+    req->nvm_io->status.total_pgs = pg;
 
     if (core.debug)
-        lnvm_debug_print_io (req->nvm_io.ppalist, req->nvm_io.prp,
-                                req->nvm_io.md_prp, nlb, data_size, meta_size);
+        lnvm_debug_print_io (req->nvm_io->ppalist, req->nvm_io->prp,
+                                req->nvm_io->md_prp, nlb, data_size, meta_size);
 
-    return nvm_submit_ftl(&req->nvm_io);
+    return nvm_submit_ftl(req->nvm_io);
 }
 
 static int lightnvm_flush_tbls(NvmeCtrl *n)
@@ -449,6 +583,14 @@ int lnvm_init(NvmeCtrl *n)
     if ((ln->params.num_pln > 4))
         log_info("    [lnvm: Only quad plane mode supported]\n");
 
+    /* The PPA format is the maximum, the device reports its geometry */
+    if (core.nvm_ch_count) {
+        ln->params.num_ch = core.nvm_ch_count;
+        ln->params.num_lun = core.nvm_ch[0]->geometry->lun_per_ch;
+        ln->params.num_blk = core.nvm_ch[0]->geometry->blk_per_lun;
+        ln->params.pgs_per_blk = core.nvm_ch[0]->geometry->pg_per_blk;
+    }
+
     for (i = 0; i < n->num_namespaces; i++) {
 
         /* For now we export 1 channel containing all LUNs */
@@ -18,11 +18,13 @@
 #include "dfc_nand.h"
 #include "nand_dma.h"
 #include "hw/block/ox-ctrl/include/uatomic.h"
+#include "hw/block/ox-ctrl/include/ox-slots.h"
 
-static u_atomic_t       nextprp;
-static pthread_mutex_t  prp_mutex;
-static pthread_mutex_t  prpmap_mutex;
-static uint8_t          *prp_map;
+/* DMA vectors of the NAND DMA manager, one slot per vector */
+#define DFCNAND_DMA_SLOTS   8
+#define DFCNAND_DMA_OFF     1   /* slot offsets per vector */
+
+static struct ox_slots  dma_slot;
 struct nvm_mmgr         dfcnand;
 
 static uint16_t dfcnand_vir_to_phy_lun (uint16_t vir){
@@ -40,52 +42,28 @@ static uint16_t dfcnand_vir_to_phy_lun (uint16_t vir){
 
 static int dfcnand_start_prp_map(void)
 {
-    nextprp.counter = U_ATOMIC_INIT_RUNTIME(0);
-    pthread_mutex_init (&prp_mutex, NULL);
-    pthread_mutex_init (&prpmap_mutex, NULL);
-    prp_map = calloc(sizeof(uint8_t), 2048);
-   // if (nvm_memcheck(prp_map))
-    //    return EMEM;
-    return 0;
+    return ox_slots_init (&dma_slot, DFCNAND_DMA_SLOTS * DFCNAND_DMA_OFF);
 }
 
-static void dfcnand_set_prp_map(uint32_t index, uint8_t flag)
+/* Releases the DMA slot of the command, if it still has one */
+static void dfcnand_put_prp (io_cmd *cmd)
 {
-    pthread_mutex_lock(&prpmap_mutex);
-    prp_map[index / 8] = (flag)
-            ? prp_map[index / 8] | 1 << (index % 8)
-            : prp_map[index / 8] ^ 1 << (index % 8);
-    pthread_mutex_unlock(&prpmap_mutex);
-}
+    uint32_t index = cmd->dfc_io.prp_index;
 
-static uint32_t dfcnand_get_next_prp(io_cmd *cmd){
-    uint16_t ni = 8;
-    uint16_t noff = 1;
-    uint32_t next = 0;
-    pthread_mutex_lock(&prp_mutex);
-    do {
-        next = u_atomic_read(&nextprp);
-
-        if (next >= ni*noff)
-            next = 1;
-        else
-            next++;
-
-        u_atomic_set(&nextprp, next);
-        next--;
-        if (prp_map[next / 8] & 1 << (next % 8)) {
-            usleep(1);
-            continue;
-        }
-        pthread_mutex_unlock (&prp_mutex);
+    cmd->dfc_io.prp_index = 0;
+    ox_slots_put (&dma_slot, index);
+}
 
-        dfcnand_set_prp_map(next, 0x1);
+/* Waits for a free DMA vector if all of them are busy */
+static uint32_t dfcnand_get_next_prp(io_cmd *cmd)
+{
+    uint32_t next;
 
-        cmd->dfc_io.prp_index = next;
+    cmd->dfc_io.prp_index = ox_slots_get (&dma_slot);
+    next = cmd->dfc_io.prp_index - 1;
 
-        // vector index (16 bits) + offset index (16 bits)
-        return ((next / noff)+1) << 16 | (next % noff);
-    } while (1);
+    // vector index (16 bits) + offset index (16 bits)
+    return ((next / DFCNAND_DMA_OFF) + 1) << 16 | (next % DFCNAND_DMA_OFF);
 }
 
 static int dfcnand_dma_helper (io_cmd *cmd)
@@ -174,7 +152,7 @@ static int dfcnand_read_page (struct nvm_mmgr_io_cmd *cmd_nvm)
 
 /*CLEAN:
     log_err("[MMGR Read ERROR: FPGA library returned -1]\n");
-    dfcnand_set_prp_map(cmd->dfc_io.prp_index, 0x0);
+    dfcnand_put_prp (cmd);
     cmd_nvm->status = NVM_IO_FAIL;
     return -1;*/
 }
@@ -230,7 +208,7 @@ static int dfcnand_write_page (struct nvm_mmgr_io_cmd *cmd_nvm)
 
 CLEAN:
     log_err("[MMGR Write ERROR: DMA or FPGA library returned -1]\n");
-    dfcnand_set_prp_map(cmd->dfc_io.prp_index, 0x0);
+    dfcnand_put_prp (cmd);
     cmd_nvm->status = NVM_IO_FAIL;
     return -1;
 }
@@ -264,9 +242,7 @@ static void dfcnand_exit (struct nvm_mmgr *mmgr)
 {
     int i;
    // nand_dm_deinit();
-    pthread_mutex_destroy(&prp_mutex);
-    pthread_mutex_destroy(&prpmap_mutex);
-    free(prp_map);
+    ox_slots_exit (&dma_slot);
     for (i = 0; i < mmgr->geometry->n_of_ch; i++) {
         free(mmgr->ch_info->mmgr_rsv_list);
         free(mmgr->ch_info->ftl_rsv_list);
@@ -472,13 +448,37 @@ static int dfcnand_get_ch_info (struct nvm_channel *ch, uint16_t nc)
 OUT:
     if (cmd->dfc_io.cmd_type == MMGR_WRITE_PG || cmd->dfc_io.cmd_type ==
                                                                   MMGR_READ_PG)
-        dfcnand_set_prp_map(cmd->dfc_io.prp_index, 0x0);
+        dfcnand_put_prp (cmd);
 
     nvm_callback(nvm_cmd);
 
     return 0;
 }*/
 
+/* Plane commands are issued back to back, the FPGA queues them per chip */
+static int dfcnand_io_vec (struct nvm_mmgr_io_cmd *cmd_nvm, uint16_t n)
+{
+    int i, ret = 0;
+
+    for (i = 0; i < n && !ret; i++) {
+        switch (cmd_nvm[i].cmdtype) {
+            case MMGR_READ_PG:
+                ret = dfcnand_read_page (&cmd_nvm[i]);
+                break;
+            case MMGR_WRITE_PG:
+                ret = dfcnand_write_page (&cmd_nvm[i]);
+                break;
+            case MMGR_ERASE_BLK:
+                ret = dfcnand_erase_blk (&cmd_nvm[i]);
+                break;
+            default:
+                ret = -1;
+        }
+    }
+
+    return (ret) ? i - 1 : i;
+}
+
 struct nvm_mmgr_ops dfcnand_ops = {
     .write_pg       = dfcnand_write_page,
     .read_pg        = dfcnand_read_page,
@@ -486,6 +486,9 @@ struct nvm_mmgr_ops dfcnand_ops = {
     .exit           = dfcnand_exit,
     .get_ch_info    = dfcnand_get_ch_info,
     .set_ch_info    = dfcnand_set_ch_info,
+    .read_vec       = dfcnand_io_vec,
+    .write_vec      = dfcnand_io_vec,
+    .erase_vec      = dfcnand_io_vec,
 };
 
 struct nvm_mmgr_geometry dfcnand_geo = {
@@ -1,15 +1,20 @@
 #include <stdio.h>
 #include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <mqueue.h>
 #include <syslog.h>
 #include "volt.h"
 #include "hw/block/ox-ctrl/include/uatomic.h"
 #include "hw/block/ox-ctrl/include/ssd.h"
 #include "hw/block/ox-ctrl/include/ox-mq.h"
+#include "hw/block/ox-ctrl/include/ox-slots.h"
 
-static u_atomic_t       nextprp[VOLT_CHIP_COUNT];
-static pthread_mutex_t  prpmap_mutex[VOLT_CHIP_COUNT];
-static uint32_t         prp_map[VOLT_CHIP_COUNT];
+static struct ox_slots  *dma_slot; /* one per channel */
+static uint32_t         dma_slots_ch;
+static uint32_t         dma_slots_all;
 
 static VoltCtrl             *volt;
 static struct nvm_mmgr      volt_mmgr;
@@ -17,57 +22,62 @@ static void                 **dma_buf;
 extern struct core_struct   core;
 
 static const char *volt_disk = "volt_disk";
+static const char *volt_disk_old = "volt_disk.old";
 
+/* DMA slots per channel are set by the 'volt_dma_slots' device property */
 static int volt_start_prp_map(void)
 {
     int i;
 
-    for (i = 0; i < VOLT_CHIP_COUNT; i++) {
-        nextprp[i].counter = U_ATOMIC_INIT_RUNTIME(0);
-        pthread_mutex_init (&prpmap_mutex[i], NULL);
-        atomic_mb_set(&prp_map[i], 0);
+    dma_slots_ch = (core.qemu && core.qemu->volt_dma_slots) ?
+                                core.qemu->volt_dma_slots : VOLT_DMA_SLOT_CH;
+    if (dma_slots_ch > VOLT_DMA_SLOT_MAX)
+        dma_slots_ch = VOLT_DMA_SLOT_MAX;
+    dma_slots_all = dma_slots_ch * volt_mmgr.geometry->n_of_ch;
+
+    dma_slot = g_malloc0 (sizeof (struct ox_slots) *
+                                                volt_mmgr.geometry->n_of_ch);
+    if (!dma_slot)
+        return -1;
+
+    for (i = 0; i < volt_mmgr.geometry->n_of_ch; i++) {
+        if (ox_slots_init (&dma_slot[i], dma_slots_ch)) {
+            while (i) {
+                i--;
+                ox_slots_exit (&dma_slot[i]);
+            }
+            g_free (dma_slot);
+            return -1;
+        }
     }
 
     return 0;
 }
 
-static void volt_set_prp_map(uint32_t index, uint32_t ch, uint8_t flag)
+static void volt_stop_prp_map(void)
 {
-    pthread_mutex_lock(&prpmap_mutex[ch]);
-    prp_map[ch] = (flag)
-            ? prp_map[ch] | (1 << (index - 1))
-            : prp_map[ch] ^ (1 << (index - 1));
-    pthread_mutex_unlock(&prpmap_mutex[ch]);
-}
-
-static uint32_t volt_get_next_prp(struct volt_dma *dma, uint32_t ch){
-    uint32_t next = 0;
-
-    do {
-        pthread_mutex_lock(&prpmap_mutex[ch]);
-
-        next = u_atomic_read(&nextprp[ch]);
-        if (next == VOLT_DMA_SLOT_CH)
-            next = 1;
-        else
-            next++;
-        u_atomic_set(&nextprp[ch], next);
+    int i;
 
-        if (prp_map[ch] & (1 << (next - 1))) {
-            pthread_mutex_unlock(&prpmap_mutex[ch]);
-            usleep(1);
-            continue;
-        }
+    for (i = 0; i < volt_mmgr.geometry->n_of_ch; i++)
+        ox_slots_exit (&dma_slot[i]);
+    g_free (dma_slot);
+}
 
-        /* set prp_map instantly */
-        prp_map[ch] |= 1 << (next - 1);
+/* Releases the DMA slot of the command, if it still has one */
+static void volt_put_prp (struct volt_dma *dma, uint32_t ch)
+{
+    uint32_t index = dma->prp_index;
 
-        pthread_mutex_unlock(&prpmap_mutex[ch]);
+    dma->prp_index = 0;
+    ox_slots_put (&dma_slot[ch], index);
+}
 
-        dma->prp_index = next;
+/* Waits for a free DMA slot if all slots of the channel are busy */
+static uint32_t volt_get_next_prp(struct volt_dma *dma, uint32_t ch)
+{
+    dma->prp_index = ox_slots_get (&dma_slot[ch]);
 
-        return next - 1;
-    } while (1);
+    return dma->prp_index - 1;
 }
 
 static VoltBlock *volt_get_block(struct nvm_ppa_addr addr){
@@ -104,59 +114,101 @@ static void volt_free (void *ptr, uint64_t sz)
     volt_sub_mem(sz);
 }
 
-static void volt_free_page_data(VoltPage *pg)
+/*
+ * Volatile page storage, one arena per channel. The arena keeps the data of
+ * all the channel pages followed by their OOB, so page data is page
+ * aligned. Huge pages are used if available, the arena is only populated
+ * when touched.
+ */
+static int volt_init_arenas (void)
 {
     struct nvm_mmgr_geometry *geo = volt_mmgr.geometry;
-    volt_free (pg->data, geo->pg_size + (geo->sec_oob_sz * geo->sec_per_pg));
+    uint64_t pg_ch = (uint64_t) geo->n_of_planes * geo->blk_per_lun *
+                                            geo->lun_per_ch * geo->pg_per_blk;
+    uint64_t sz = pg_ch * (geo->pg_size + geo->sec_oob_sz * geo->sec_per_pg);
+    int ch_i;
+
+    sz = (sz + VOLT_HUGE_PAGE_SZ - 1) & ~((uint64_t) VOLT_HUGE_PAGE_SZ - 1);
+
+    volt->arenas = g_malloc0 (sizeof (VoltArena) * geo->n_of_ch);
+    if (!volt->arenas)
+        return -1;
+
+    for (ch_i = 0; ch_i < geo->n_of_ch; ch_i++) {
+        VoltArena *ar = &volt->arenas[ch_i];
+
+        ar->size = sz;
+        ar->huge = 1;
+        ar->data = mmap (NULL, sz, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (ar->data == MAP_FAILED) {
+            ar->huge = 0;
+            ar->data = mmap (NULL, sz, PROT_READ | PROT_WRITE,
+                                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (ar->data == MAP_FAILED)
+                goto FREE;
+            /* Transparent huge pages, if hugetlbfs has no free pages */
+            madvise (ar->data, sz, MADV_HUGEPAGE);
+        }
+        ar->oob = ar->data + pg_ch * geo->pg_size;
+        volt_add_mem (sz);
+    }
+
+    log_info (" [volt: Page arenas: %d x %lu Mb, huge pages: %s]\n",
+             geo->n_of_ch, sz / 1048576, (volt->arenas[0].huge) ? "yes" :
+                                                        "transparent only");
+    return 0;
+
+FREE:
+    while (ch_i--) {
+        munmap (volt->arenas[ch_i].data, sz);
+        volt_sub_mem (sz);
+    }
+    g_free (volt->arenas);
+    volt->arenas = NULL;
+    return -1;
 }
 
-static void volt_free_block_data (VoltBlock *blk)
+static void volt_free_arenas (void)
 {
-    int i_pg;
+    int ch_i;
 
-    struct nvm_mmgr_geometry *geo = volt_mmgr.geometry;
+    if (!volt->arenas)
+        return;
 
-    for (i_pg = 0; i_pg < geo->pg_per_blk; i_pg++)
-        volt_free_page_data (&blk->pages[i_pg]);
-
-    volt_free (blk->pages, sizeof(VoltPage) * geo->pg_per_blk);
+    for (ch_i = 0; ch_i < volt_mmgr.geometry->n_of_ch; ch_i++) {
+        munmap (volt->arenas[ch_i].data, volt->arenas[ch_i].size);
+        volt_sub_mem (volt->arenas[ch_i].size);
+    }
+    g_free (volt->arenas);
+    volt->arenas = NULL;
 }
 
-static void volt_free_blocks (int nblk, int npg_lb, int free_pg_lb)
+static void volt_free_blocks (void)
 {
-    int i_blk, i_pg;
     struct nvm_mmgr_geometry *geo = volt_mmgr.geometry;
-
     int total_blk = geo->n_of_planes * geo->blk_per_lun * geo->lun_per_ch *
                                                                    geo->n_of_ch;
-    /* Free pages in the completed allocated blocks */
-    for (i_blk = 0; i_blk < nblk; i_blk++)
-        volt_free_block_data (&volt->blocks[i_blk]);
-
-    /* Free pages in the last failed block */
-    for (i_pg = 0; i_pg < npg_lb; i_pg++)
-        volt_free_page_data (&volt->blocks[nblk].pages[i_pg]);
-
-    if (free_pg_lb)
-        volt_free (volt->blocks[nblk].pages,sizeof(VoltPage) * geo->pg_per_blk);
 
+    volt_free (volt->pages, sizeof(VoltPage) * geo->pg_per_blk * total_blk);
     volt_free (volt->blocks, sizeof(VoltBlock) * total_blk);
+    volt_free_arenas ();
 }
 
-static void volt_free_luns (int tot_blk)
+static void volt_free_luns (void)
 {
     struct nvm_mmgr_geometry *geo = volt_mmgr.geometry;
     int total_luns = geo->lun_per_ch * geo->n_of_ch;
 
-    volt_free_blocks(tot_blk, 0, 0);
+    volt_free_blocks();
     volt_free (volt->luns, sizeof (VoltLun) * total_luns);
 }
 
-static void volt_free_channels (int tot_blk)
+static void volt_free_channels (void)
 {
     struct nvm_mmgr_geometry *geo = volt_mmgr.geometry;
 
-    volt_free_luns(tot_blk);
+    volt_free_luns();
     volt_free (volt->channels, sizeof (VoltCh) * geo->n_of_ch);
 }
 
@@ -164,30 +216,41 @@ static void volt_free_dma_buf (void)
 {
     int slots;
 
-    for (slots = 0; slots < VOLT_DMA_SLOT_INDEX; slots++)
+    for (slots = 0; slots < dma_slots_all; slots++)
         volt_free (dma_buf[slots], VOLT_PAGE_SIZE + VOLT_SECTOR_SIZE);
 
-    volt_free (dma_buf, sizeof (void *) * VOLT_DMA_SLOT_INDEX);
+    volt_free (dma_buf, sizeof (void *) * dma_slots_all);
     volt_free (volt->edma, VOLT_PAGE_SIZE + VOLT_SECTOR_SIZE);
 }
 
 static void volt_clean_mem(void)
 {
-    struct nvm_mmgr_geometry *geo = volt_mmgr.geometry;
-    int tot_blk = geo->n_of_planes * geo->blk_per_lun * geo->lun_per_ch *
-                                                                   geo->n_of_ch;
-    volt_free_channels(tot_blk);
+    volt_free_channels();
     volt_free_dma_buf();
 }
 
-static int volt_init_page(VoltPage *pg)
+/* index is the page position in the disk, blk_id * pg_per_blk + pg */
+static int volt_init_page(VoltPage *pg, uint64_t index)
 {
     struct nvm_mmgr_geometry *geo = volt_mmgr.geometry;
+    uint32_t oob_sz = geo->sec_oob_sz * geo->sec_per_pg;
+    uint64_t blk_ch;
+    VoltArena *ar;
 
     pg->state = 0;
-    pg->data = volt_alloc(geo->pg_size + (geo->sec_oob_sz * geo->sec_per_pg));
-    if (!pg->data)
-        return -1;
+
+    if (!core.volt) {
+        pg->data = volt->disk.map + volt->disk.data_off + index * geo->pg_size;
+        pg->oob = volt->disk.map + volt->disk.oob_off + index * oob_sz;
+        return 0;
+    }
+
+    blk_ch = (uint64_t) geo->n_of_planes * geo->blk_per_lun * geo->lun_per_ch;
+    ar = &volt->arenas[index / geo->pg_per_blk / blk_ch];
+    index %= blk_ch * geo->pg_per_blk;
+
+    pg->data = ar->data + index * geo->pg_size;
+    pg->oob = ar->oob + index * oob_sz;
 
     return 0;
 }
@@ -196,43 +259,45 @@ static int volt_init_blocks(void)
 {
     struct nvm_mmgr_geometry *geo = volt_mmgr.geometry;
 
-    int page_count = 0, pg_blk, blk_count = 0, free_pg;
+    int page_count = 0;
     int i_blk, i_pg;
     int total_blk = geo->n_of_planes * geo->blk_per_lun * geo->lun_per_ch *
                                                                    geo->n_of_ch;
 
+    if (core.volt && volt_init_arenas ())
+        return VOLT_MEM_ERROR;
+
     volt->blocks = volt_alloc(sizeof(VoltBlock) * total_blk);
     if (!volt->blocks)
-        return -1;
+        goto FREE_ARENAS;
+
+    volt->pages = volt_alloc(sizeof(VoltPage) * geo->pg_per_blk * total_blk);
+    if (!volt->pages)
+        goto FREE_BLOCKS;
 
     for (i_blk = 0; i_blk < total_blk; i_blk++) {
         VoltBlock *blk = &volt->blocks[i_blk];
         blk->id = i_blk;
         blk->life = VOLT_BLK_LIFE;
-
-        pg_blk = 0;
-
-        free_pg = 0;
-        blk->pages = volt_alloc(sizeof(VoltPage) * geo->pg_per_blk);
-        if (!blk->pages)
-            goto FREE;
-        free_pg = 1;
-
+        blk->pages = &volt->pages[(uint64_t) i_blk * geo->pg_per_blk];
         blk->next_pg = blk->pages;
 
         for (i_pg = 0; i_pg < geo->pg_per_blk; i_pg++) {
-            if (volt_init_page(&blk->pages[i_pg]))
+            if (volt_init_page(&blk->pages[i_pg],
+                                    (uint64_t) i_blk * geo->pg_per_blk + i_pg))
                 goto FREE;
-
             page_count++;
-            pg_blk++;
         }
-        blk_count++;
     }
     return page_count;
 
 FREE:
-    volt_free_blocks (blk_count, pg_blk, free_pg);
+    volt_free_blocks ();
+    return VOLT_MEM_ERROR;
+FREE_BLOCKS:
+    volt_free (volt->blocks, sizeof(VoltBlock) * total_blk);
+FREE_ARENAS:
+    volt_free_arenas ();
     return VOLT_MEM_ERROR;
 }
 
@@ -262,8 +327,10 @@ static int volt_init_channels(void)
     if (!volt->channels)
         return VOLT_MEM_ERROR;
 
-    for (i_ch = 0; i_ch < geo->n_of_ch; i_ch++)
+    for (i_ch = 0; i_ch < geo->n_of_ch; i_ch++) {
         volt->channels[i_ch].lun_offset = &volt->luns[i_ch * geo->lun_per_ch];
+        memset (&volt->channels[i_ch].stats, 0x0, sizeof (struct volt_ch_stats));
+    }
 
     return VOLT_MEM_OK;
 }
@@ -276,11 +343,11 @@ static int volt_init_dma_buf (void)
     if (!volt->edma)
         return -1;
 
-    dma_buf = volt_alloc(sizeof (void *) * VOLT_DMA_SLOT_INDEX);
+    dma_buf = volt_alloc(sizeof (void *) * dma_slots_all);
     if (!dma_buf)
         goto FREE;
 
-    for (slots_i = 0; slots_i < VOLT_DMA_SLOT_INDEX; slots_i++) {
+    for (slots_i = 0; slots_i < dma_slots_all; slots_i++) {
         dma_buf[slots_i] = volt_alloc(VOLT_PAGE_SIZE + VOLT_SECTOR_SIZE);
         if (!dma_buf[slots_i])
             goto FREE_SLOTS;
@@ -292,7 +359,7 @@ static int volt_init_dma_buf (void)
 FREE_SLOTS:
         for (slots_i = 0; slots_i < slots; slots_i++)
             volt_free (dma_buf[slots_i], VOLT_PAGE_SIZE + VOLT_SECTOR_SIZE);
-        volt_free (dma_buf, sizeof (void *) * VOLT_DMA_SLOT_INDEX);
+        volt_free (dma_buf, sizeof (void *) * dma_slots_all);
 FREE:
     volt_free (volt->edma, VOLT_PAGE_SIZE + VOLT_SECTOR_SIZE);
     return -1;
@@ -314,26 +381,75 @@ static void volt_oob_reorder (uint8_t *oob, uint32_t map)
             oob_off += LNVM_SEC_OOBSZ;
 }
 
-static int volt_host_dma_helper (struct nvm_mmgr_io_cmd *nvm_cmd)
+static int volt_dma_direction (struct nvm_mmgr_io_cmd *nvm_cmd)
 {
-    uint32_t dma_sz, sec_map = 0, dma_sec, c = 0, ret = 0;
-    uint64_t prp;
-    uint8_t direction;
-    uint8_t *oob_addr;
-    struct volt_dma *dma = (struct volt_dma *) nvm_cmd->rsvd;
-
     switch (nvm_cmd->cmdtype) {
         case MMGR_READ_PG:
-            direction = (nvm_cmd->sync_count) ? NVM_DMA_SYNC_READ :
+            return (nvm_cmd->sync_count) ? NVM_DMA_SYNC_READ :
                                                              NVM_DMA_TO_HOST;
-            break;
         case MMGR_WRITE_PG:
-            direction = (nvm_cmd->sync_count) ? NVM_DMA_SYNC_WRITE :
+            return (nvm_cmd->sync_count) ? NVM_DMA_SYNC_WRITE :
                                                              NVM_DMA_FROM_HOST;
-            break;
         default:
             return -1;
     }
+}
+
+static void volt_host_unmap (struct nvm_mmgr_io_cmd *nvm_cmd)
+{
+    int c;
+    struct volt_dma *dma = (struct volt_dma *) nvm_cmd->rsvd;
+    int direction = volt_dma_direction (nvm_cmd);
+
+    for (c = 0; c < VOLT_SECTOR_COUNT; c++) {
+        if (dma->host_addr[c])
+            nvm_dma_unmap (dma->host_addr[c], nvm_cmd->sec_sz, direction);
+        dma->host_addr[c] = NULL;
+    }
+    dma->direct = 0;
+}
+
+/*
+ * Maps the host sectors of the command, so the data is copied straight
+ * between the host memory and the VOLT page, without the DMA slot. The
+ * metadata still goes through the DMA slot. If any sector cannot be mapped,
+ * nothing is mapped and the command uses the DMA slot for all the data.
+ */
+static void volt_host_map (struct nvm_mmgr_io_cmd *nvm_cmd)
+{
+    int c;
+    struct volt_dma *dma = (struct volt_dma *) nvm_cmd->rsvd;
+    int direction = volt_dma_direction (nvm_cmd);
+
+    dma->direct = 0;
+    if (direction < 0 || nvm_cmd->n_sectors > VOLT_SECTOR_COUNT)
+        return;
+
+    for (c = 0; c < nvm_cmd->n_sectors; c++) {
+        if (!nvm_cmd->prp[c])
+            continue;
+
+        dma->host_addr[c] = nvm_dma_map (nvm_cmd->prp[c], nvm_cmd->sec_sz,
+                                                                    direction);
+        if (!dma->host_addr[c]) {
+            volt_host_unmap (nvm_cmd);
+            return;
+        }
+    }
+    dma->direct = 1;
+}
+
+static int volt_host_dma_helper (struct nvm_mmgr_io_cmd *nvm_cmd)
+{
+    uint32_t dma_sz, sec_map = 0, dma_sec, c = 0, ret = 0;
+    uint64_t prp;
+    int direction;
+    uint8_t *oob_addr;
+    struct volt_dma *dma = (struct volt_dma *) nvm_cmd->rsvd;
+
+    direction = volt_dma_direction (nvm_cmd);
+    if (direction < 0)
+        return -1;
 
     oob_addr = dma->virt_addr + nvm_cmd->sec_sz * nvm_cmd->n_sectors;
     dma_sec = nvm_cmd->n_sectors + 1;
@@ -347,6 +463,10 @@ static int volt_host_dma_helper (struct nvm_mmgr_io_cmd *nvm_cmd)
             continue;
         }
 
+        /* Data sectors were copied in place by volt_process_io */
+        if (dma->direct && c < dma_sec - 1)
+            continue;
+
         /* Fix metadata per sector in case of reading single sector */
         if (sec_map && nvm_cmd->cmdtype == MMGR_READ_PG &&
                                             nvm_cmd->md_sz && c == dma_sec - 1)
@@ -383,8 +503,10 @@ static void volt_callback (void *opaque)
     }
 
 OUT:
-    if (nvm_cmd->cmdtype == MMGR_WRITE_PG || nvm_cmd->cmdtype == MMGR_READ_PG)
-        volt_set_prp_map(dma->prp_index, nvm_cmd->ppa.g.ch, 0x0);
+    if (nvm_cmd->cmdtype == MMGR_WRITE_PG || nvm_cmd->cmdtype == MMGR_READ_PG) {
+        volt_host_unmap (nvm_cmd);
+        volt_put_prp (dma, nvm_cmd->ppa.g.ch);
+    }
 
     nvm_callback(nvm_cmd);
 }
@@ -401,6 +523,74 @@ static void volt_nand_dma (void *paddr, void *buf, size_t sz, uint8_t dir)
     }
 }
 
+/*
+ * Copies sz bytes at offset off of the page (data followed by OOB) to/from
+ * buf. Pages that were not written since the last erase read as 0xff.
+ */
+static void volt_page_dma (VoltPage *pg, uint32_t off, uint8_t *buf,
+                                                    uint32_t sz, uint8_t dir)
+{
+    uint32_t data_sz = volt_mmgr.geometry->pg_size, len;
+
+    if (dir == VOLT_DMA_READ && !pg->state) {
+        memset (buf, 0xff, sz);
+        return;
+    }
+
+    if (off < data_sz) {
+        len = MIN(sz, data_sz - off);
+        volt_nand_dma (pg->data + off, buf, len, dir);
+        off += len;
+        buf += len;
+        sz -= len;
+    }
+
+    if (sz)
+        volt_nand_dma (pg->oob + off - data_sz, buf, sz, dir);
+}
+
+static void volt_disk_set_dirty (VoltPage *pg)
+{
+    uint64_t index;
+
+    if (core.volt)
+        return;
+
+    index = (pg->data - volt->disk.map - volt->disk.data_off) /
+                                                    volt_mmgr.geometry->pg_size;
+    __sync_fetch_and_or (&volt->disk.dirty[index / 64], 1ULL << (index % 64));
+}
+
+/*
+ * Erased pages are only flagged, the data is not touched. In a persistent
+ * disk the block data is also released as a hole in the backing file.
+ */
+static void volt_erase_media (VoltBlock *blk)
+{
+    struct nvm_mmgr_geometry *geo = volt_mmgr.geometry;
+    uint64_t off, len = (uint64_t) geo->pg_per_blk * geo->pg_size;
+    int pg_i;
+
+    for (pg_i = 0; pg_i < geo->pg_per_blk; pg_i++)
+        blk->pages[pg_i].state = 0;
+
+    if (core.volt)
+        return;
+
+    off = blk->pages[0].data - volt->disk.map;
+#ifdef FALLOC_FL_PUNCH_HOLE
+    if (!fallocate (volt->disk.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                                                                  off, len)) {
+        volt->disk.erased = 1;
+        return;
+    }
+#endif
+    /* No hole support, erased data must not be taken as written at load */
+    memset (blk->pages[0].data, 0xff, len);
+    for (pg_i = 0; pg_i < geo->pg_per_blk; pg_i++)
+        volt_disk_set_dirty (&blk->pages[pg_i]);
+}
+
 static int volt_process_io (struct nvm_mmgr_io_cmd *cmd)
 {
     VoltBlock *blk;
@@ -408,7 +598,9 @@ static int volt_process_io (struct nvm_mmgr_io_cmd *cmd)
     struct volt_dma *dma = (struct volt_dma *) cmd->rsvd;
     uint32_t pg_size = volt_mmgr.geometry->pg_size +
             (volt_mmgr.geometry->sec_oob_sz * volt_mmgr.geometry->sec_per_pg);
-    int pg_i;
+    uint32_t off;
+    VoltPage *pg;
+    int c;
 
     blk = volt_get_block(cmd->ppa);
 
@@ -418,8 +610,25 @@ static int volt_process_io (struct nvm_mmgr_io_cmd *cmd)
         case MMGR_READ_PG:
             dir = VOLT_DMA_READ;
         case MMGR_WRITE_PG:
-            volt_nand_dma (blk->pages[cmd->ppa.g.pg].data,
-                                                dma->virt_addr, pg_size, dir);
+            pg = &blk->pages[cmd->ppa.g.pg];
+            if (!dma->direct) {
+                volt_page_dma (pg, 0, dma->virt_addr, pg_size, dir);
+            } else {
+                /* Data goes straight to/from host memory, the DMA slot only
+                 * holds the rest of the page (metadata) */
+                for (c = 0; c < cmd->n_sectors; c++)
+                    if (dma->host_addr[c])
+                        volt_page_dma (pg, cmd->sec_sz * c,
+                                          dma->host_addr[c], cmd->sec_sz, dir);
+
+                off = cmd->sec_sz * cmd->n_sectors;
+                volt_page_dma (pg, off, dma->virt_addr + off,
+                                                           pg_size - off, dir);
+            }
+            if (dir == VOLT_DMA_WRITE) {
+                pg->state = 1;
+                volt_disk_set_dirty (pg);
+            }
             break;
         case MMGR_ERASE_BLK:
             if (blk->life > 0) {
@@ -428,8 +637,7 @@ static int volt_process_io (struct nvm_mmgr_io_cmd *cmd)
                 dma->status = 0;
                 return -1;
             }
-            for (pg_i = 0; pg_i < volt_mmgr.geometry->pg_per_blk; pg_i++)
-                memset(blk->pages[pg_i].data, 0xff, pg_size);
+            volt_erase_media (blk);
 
             break;
         default:
@@ -447,12 +655,43 @@ static int volt_process_io (struct nvm_mmgr_io_cmd *cmd)
     return 0;
 }
 
+static void volt_complete_io (struct ox_mq_entry *req)
+{
+    if (ox_mq_complete_req_wait (volt->mq, req, NVM_QUEUE_WAIT_USEC) ==
+                                                                OX_MQ_CQ_FULL)
+        log_err ("[volt: Channel %d CQ full, cmd not completed]\n", req->qid);
+}
+
+static void volt_ch_account (struct nvm_mmgr_io_cmd *cmd, int failed)
+{
+    struct volt_ch_stats *st = &volt->channels[cmd->ppa.g.ch].stats;
+
+    if (failed) {
+        st->failed++;
+        return;
+    }
+
+    switch (cmd->cmdtype) {
+        case MMGR_READ_PG:
+            st->read++;
+            break;
+        case MMGR_WRITE_PG:
+            st->write++;
+            break;
+        case MMGR_ERASE_BLK:
+            st->erase++;
+            break;
+    }
+}
+
 static void volt_execute_io (struct ox_mq_entry *req)
 {
     struct nvm_mmgr_io_cmd *cmd = (struct nvm_mmgr_io_cmd *) req->opaque;
-    int ret, retry;
+    int ret;
 
+    cmd->tdispatch = ox_lat_now ();
     ret = volt_process_io(cmd);
+    volt_ch_account (cmd, ret);
 
     if (ret && core.debug) {
         log_err ("[volt: Cmd 0x%x NOT completed. (%d/%d/%d/%d/%d)]\n",
@@ -464,35 +703,38 @@ static void volt_execute_io (struct ox_mq_entry *req)
 
     cmd->status = NVM_IO_SUCCESS;
 
+    /* The completion is released at the simulated time */
+    if (volt->timing.enabled) {
+        volt_timing_schedule (&volt->timing, cmd, req);
+        return;
+    }
+
 COMPLETE:
-    retry = NVM_QUEUE_RETRY;
-    do {
-        ret = ox_mq_complete_req(volt->mq, req);
-        if (ret) {
-            retry--;
-            usleep (NVM_QUEUE_RETRY_SLEEP);
-        }
-    } while (ret && retry);
+    volt_complete_io (req);
 }
 
 static int volt_enqueue_io (struct nvm_mmgr_io_cmd *io)
 {
-    int ret, retry;
-
-    retry = 16;
-    do {
-        ret = ox_mq_submit_req(volt->mq, io->ppa.g.ch, io);
-    	if (ret < 0)
-            retry--;
-        else if (core.debug)
-            printf(" MMGR_CMD type: 0x%x submitted to VOLT.\n  "
-                    "Channel: %d, lun: %d, blk: %d, pl: %d, "
-                    "pg: %d]\n", io->cmdtype, io->ppa.g.ch, io->ppa.g.lun,
-                    io->ppa.g.blk, io->ppa.g.pl, io->ppa.g.pg);
+    int ret;
+
+    /* A full queue only delays the submitters of its own channel, they are
+     * woken as soon as a command of the channel completes */
+    ret = ox_mq_submit_req(volt->mq, io->ppa.g.ch, io);
+    if (ret < 0) {
+        u_atomic_inc(&volt->channels[io->ppa.g.ch].stats.queue_full);
+        ret = ox_mq_submit_req_wait(volt->mq, io->ppa.g.ch, io,
+                                                            VOLT_QUEUE_WAIT);
+        if (ret < 0)
+            return -1;
+    }
 
-    } while (ret < 0 && retry);
+    if (core.debug)
+        printf(" MMGR_CMD type: 0x%x submitted to VOLT.\n  "
+                "Channel: %d, lun: %d, blk: %d, pl: %d, "
+                "pg: %d]\n", io->cmdtype, io->ppa.g.ch, io->ppa.g.lun,
+                io->ppa.g.blk, io->ppa.g.pl, io->ppa.g.pg);
 
-    return (retry) ? 0 : -1;
+    return 0;
 }
 
 static int volt_prepare_rw (struct nvm_mmgr_io_cmd *cmd_nvm)
@@ -514,55 +756,67 @@ static int volt_prepare_rw (struct nvm_mmgr_io_cmd *cmd_nvm)
 
     uint32_t prp_map = volt_get_next_prp(dma, cmd_nvm->ppa.g.ch);
 
-    dma->virt_addr = dma_buf[(cmd_nvm->ppa.g.ch * VOLT_DMA_SLOT_CH) + prp_map];
+    dma->virt_addr = dma_buf[(cmd_nvm->ppa.g.ch * dma_slots_ch) + prp_map];
 
     if (cmd_nvm->cmdtype == MMGR_READ_PG)
         memset(dma->virt_addr, 0, pg_sz + sec_sz);
 
     cmd_nvm->n_sectors = cmd_nvm->pg_sz / sec_sz;
 
+    volt_host_map (cmd_nvm);
+
     if (cmd_nvm->cmdtype == MMGR_WRITE_PG) {
-        if (volt_host_dma_helper (cmd_nvm))
+        if (volt_host_dma_helper (cmd_nvm)) {
+            volt_host_unmap (cmd_nvm);
+            volt_put_prp (dma, cmd_nvm->ppa.g.ch);
             return -1;
+        }
     }
 
     return 0;
 }
 
-static int volt_read_page (struct nvm_mmgr_io_cmd *cmd_nvm)
+/* Undoes volt_prepare_rw of a command that was not queued */
+static void volt_release_rw (struct nvm_mmgr_io_cmd *cmd_nvm)
 {
     struct volt_dma *dma = (struct volt_dma *) cmd_nvm->rsvd;
 
+    volt_host_unmap (cmd_nvm);
+    volt_put_prp (dma, cmd_nvm->ppa.g.ch);
+}
+
+static int volt_read_page (struct nvm_mmgr_io_cmd *cmd_nvm)
+{
     if (volt_prepare_rw(cmd_nvm))
         goto CLEAN;
 
     if (volt_enqueue_io (cmd_nvm))
-        goto CLEAN;
+        goto RELEASE;
 
     return 0;
 
+RELEASE:
+    volt_release_rw (cmd_nvm);
 CLEAN:
     log_err("[MMGR Read ERROR: NVM  returned -1]\n");
-    volt_set_prp_map(dma->prp_index, cmd_nvm->ppa.g.ch, 0x0);
     cmd_nvm->status = NVM_IO_FAIL;
     return -1;
 }
 
 static int volt_write_page (struct nvm_mmgr_io_cmd *cmd_nvm)
 {
-    struct volt_dma *dma = (struct volt_dma *) cmd_nvm->rsvd;
-
     if (volt_prepare_rw(cmd_nvm))
         goto CLEAN;
 
     if (volt_enqueue_io (cmd_nvm))
-        goto CLEAN;
+        goto RELEASE;
 
     return 0;
 
+RELEASE:
+    volt_release_rw (cmd_nvm);
 CLEAN:
     log_err("[MMGR Write ERROR: DMA or NVM returned -1]\n");
-    volt_set_prp_map(dma->prp_index, cmd_nvm->ppa.g.ch, 0x0);
     cmd_nvm->status = NVM_IO_FAIL;
     return -1;
 }
@@ -580,6 +834,55 @@ CLEAN:
     return -1;
 }
 
+/*
+ * Multi-plane commands: the DMA of all the planes is done before the first
+ * plane is queued, so the planes reach the channel (and the timing engine)
+ * together, as in a multi-plane program/read. Longer vectors are queued one
+ * command at a time, so they cannot hold all the DMA slots of a channel.
+ */
+static int volt_io_vec (struct nvm_mmgr_io_cmd *cmd, uint16_t n)
+{
+    int i, j, prep;
+
+    if (n > volt_mmgr.geometry->n_of_planes) {
+        for (i = 0; i < n; i++) {
+            if ((cmd[i].cmdtype == MMGR_READ_PG && volt_read_page (&cmd[i])) ||
+                (cmd[i].cmdtype == MMGR_WRITE_PG && volt_write_page (&cmd[i]))
+                                                                            ||
+                (cmd[i].cmdtype == MMGR_ERASE_BLK && volt_erase_blk (&cmd[i])))
+                break;
+        }
+        return i;
+    }
+
+    for (prep = 0; prep < n; prep++) {
+        if (cmd[prep].cmdtype == MMGR_ERASE_BLK)
+            continue;
+        if (volt_prepare_rw (&cmd[prep])) {
+            log_err("[MMGR Vec ERROR: DMA or NVM returned -1]\n");
+            cmd[prep].status = NVM_IO_FAIL;
+            break;
+        }
+    }
+
+    for (i = 0; i < prep; i++) {
+        if (volt_enqueue_io (&cmd[i])) {
+            log_err("[MMGR Vec ERROR: channel %d queue is full]\n",
+                                                            cmd[i].ppa.g.ch);
+            break;
+        }
+    }
+
+    /* Commands prepared but not queued */
+    for (j = i; j < prep; j++) {
+        if (cmd[j].cmdtype != MMGR_ERASE_BLK)
+            volt_release_rw (&cmd[j]);
+        cmd[j].status = NVM_IO_FAIL;
+    }
+
+    return i;
+}
+
 static int volt_set_ch_info (struct nvm_channel *ch, uint16_t nc)
 {
     return 0;
@@ -602,10 +905,10 @@ static int volt_get_ch_info (struct nvm_channel *ch, uint16_t nc)
             ch[i].i.in_use = 0x0;
         }
 
-        ch[i].ns_pgs = VOLT_VIRTUAL_LUNS *
-                       VOLT_BLOCK_COUNT *
-                       VOLT_PLANE_COUNT *
-                       VOLT_PAGE_COUNT;
+        ch[i].ns_pgs = volt_mmgr.geometry->lun_per_ch *
+                       volt_mmgr.geometry->blk_per_lun *
+                       volt_mmgr.geometry->n_of_planes *
+                       volt_mmgr.geometry->pg_per_blk;
 
         ch[i].mmgr_rsv = VOLT_RSV_BLK;
         trsv = ch[i].mmgr_rsv * VOLT_PLANE_COUNT;
@@ -652,10 +955,12 @@ static void volt_req_timeout (void **opaque, int counter)
         cmd->status = NVM_IO_TIMEOUT;
 
         /* During request timeout dma->prp_index is freed and
-         * dma->virt_addr is redirected to the emergency pointer */
+         * dma->virt_addr is redirected to the emergency pointer. Mapped
+         * host sectors (dma->direct) cannot be redirected, the VOLT queue
+         * runs with timeout disabled (to_usec = 0) */
         if (cmd->cmdtype == MMGR_WRITE_PG || cmd->cmdtype == MMGR_READ_PG) {
             dma->virt_addr = volt->edma;
-            volt_set_prp_map(dma->prp_index, cmd->ppa.g.ch, 0x0);
+            volt_put_prp (dma, cmd->ppa.g.ch);
         }
     }
 }
@@ -683,144 +988,532 @@ static void *volt_queue_show (void *arg)
     return NULL;
 }
 
-static int volt_disk_flush (void)
+/* Starts the write back of pages [first, last) of the disk */
+static int volt_disk_write_range (uint64_t first, uint64_t last)
 {
-    FILE *file;
-    uint32_t blk_i, pg_i;
     struct nvm_mmgr_geometry *geo = volt_mmgr.geometry;
-    uint32_t pg_sz = geo->pg_size + (geo->sec_oob_sz * geo->sec_per_pg);
-    uint32_t tot_blk = geo->n_of_planes * geo->blk_per_lun * geo->lun_per_ch *
-                                                                   geo->n_of_ch;
-    file = fopen(volt_disk, "w+");
-    for (blk_i = 0; blk_i < tot_blk; blk_i++) {
-        for (pg_i = 0; pg_i < geo->pg_per_blk; pg_i++) {
-            if (fwrite(volt->blocks[blk_i].pages[pg_i].data, pg_sz, 1, file)<1){
-                fclose (file);
-                return -1;
+    VoltDisk *disk = &volt->disk;
+    uint32_t oob_sz = geo->sec_oob_sz * geo->sec_per_pg;
+
+    if (sync_file_range (disk->fd, disk->data_off + first * geo->pg_size,
+                        (last - first) * geo->pg_size, SYNC_FILE_RANGE_WRITE))
+        return -1;
+
+    if (sync_file_range (disk->fd, disk->oob_off + first * oob_sz,
+                        (last - first) * oob_sz, SYNC_FILE_RANGE_WRITE))
+        return -1;
+
+    return 0;
+}
+
+/*
+ * Writes back the dirty pages to the disk file and waits for them. Runs of
+ * contiguous dirty pages are submitted together, then fdatasync makes the
+ * data and the punched holes durable. Pages written while the flush runs
+ * stay dirty for the next flush.
+ */
+static int volt_disk_flush (void)
+{
+    VoltDisk *disk = &volt->disk;
+    uint64_t w_i, bits, pg_i, first = 0, count = 0;
+    uint64_t pg_tot = (disk->oob_off - disk->data_off) /
+                                                    volt_mmgr.geometry->pg_size;
+    int run = 0, ret = 0;
+
+    for (w_i = 0; w_i < disk->dirty_words; w_i++) {
+        bits = __sync_fetch_and_and (&disk->dirty[w_i], 0);
+
+        for (pg_i = w_i * 64; pg_i < (w_i + 1) * 64 && pg_i < pg_tot; pg_i++) {
+            if (bits & (1ULL << (pg_i % 64))) {
+                if (!run) {
+                    first = pg_i;
+                    run = 1;
+                }
+                count++;
+            } else if (run) {
+                ret |= volt_disk_write_range (first, pg_i);
+                run = 0;
             }
         }
     }
+    if (run)
+        ret |= volt_disk_write_range (first, pg_tot);
+
+    if (!count && !disk->erased)
+        return ret;
+
+    disk->erased = 0;
+    if (fdatasync (disk->fd))
+        return -1;
+
+    if (core.debug)
+        printf(" [volt: %lu dirty pages flushed.]\n", count);
+
+    return ret;
+}
+
+static void volt_flush_complete (struct volt_flush_head *list, int ret)
+{
+    struct nvm_mmgr_flush_cmd *cmd;
+
+    while (!TAILQ_EMPTY (list)) {
+        cmd = TAILQ_FIRST (list);
+        TAILQ_REMOVE (list, cmd, entry);
+        cmd->status = (ret) ? NVM_IO_FAIL : NVM_IO_SUCCESS;
+        nvm_flush_callback (cmd);
+    }
+}
+
+static void *volt_flush_thread (void *arg)
+{
+    VoltDisk *disk = &volt->disk;
+    struct volt_flush_head list;
+    int ret;
+
+    pthread_mutex_lock (&disk->flush_mutex);
+    while (!disk->flush_stop) {
+        if (TAILQ_EMPTY (&disk->flush_q)) {
+            pthread_cond_wait (&disk->flush_cond, &disk->flush_mutex);
+            continue;
+        }
+
+        /* Writes completed before these requests have set their dirty bits,
+         * requests queued from now on wait for the next round */
+        TAILQ_INIT (&list);
+        TAILQ_CONCAT (&list, &disk->flush_q, entry);
+        pthread_mutex_unlock (&disk->flush_mutex);
+
+        ret = volt_disk_flush ();
+        volt_flush_complete (&list, ret);
+
+        pthread_mutex_lock (&disk->flush_mutex);
+    }
+    pthread_mutex_unlock (&disk->flush_mutex);
+
+    return NULL;
+}
+
+static int volt_flush (struct nvm_mmgr_flush_cmd *cmd)
+{
+    VoltDisk *disk = &volt->disk;
+
+    /* Volatile storage, nothing to persist */
+    if (core.volt) {
+        cmd->status = NVM_IO_SUCCESS;
+        nvm_flush_callback (cmd);
+        return 0;
+    }
+
+    pthread_mutex_lock (&disk->flush_mutex);
+    TAILQ_INSERT_TAIL (&disk->flush_q, cmd, entry);
+    pthread_cond_signal (&disk->flush_cond);
+    pthread_mutex_unlock (&disk->flush_mutex);
 
-    fclose (file);
     return 0;
 }
 
-static int volt_disk_load (void)
+static int volt_flush_start (void)
+{
+    VoltDisk *disk = &volt->disk;
+
+    TAILQ_INIT (&disk->flush_q);
+    disk->flush_stop = 0;
+    pthread_mutex_init (&disk->flush_mutex, NULL);
+    pthread_cond_init (&disk->flush_cond, NULL);
+
+    if (pthread_create (&disk->flush_tid, NULL, volt_flush_thread, NULL)) {
+        pthread_mutex_destroy (&disk->flush_mutex);
+        pthread_cond_destroy (&disk->flush_cond);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Stops the flush thread, pending requests are served by the final flush */
+static void volt_flush_stop (struct volt_flush_head *pending)
+{
+    VoltDisk *disk = &volt->disk;
+
+    pthread_mutex_lock (&disk->flush_mutex);
+    disk->flush_stop = 1;
+    pthread_cond_signal (&disk->flush_cond);
+    pthread_mutex_unlock (&disk->flush_mutex);
+    pthread_join (disk->flush_tid, NULL);
+
+    TAILQ_INIT (pending);
+    TAILQ_CONCAT (pending, &disk->flush_q, entry);
+
+    pthread_mutex_destroy (&disk->flush_mutex);
+    pthread_cond_destroy (&disk->flush_cond);
+}
+
+static void volt_disk_hdr_fill (struct volt_disk_hdr *hdr)
+{
+    struct nvm_mmgr_geometry *geo = volt_mmgr.geometry;
+
+    memset (hdr, 0x0, sizeof (struct volt_disk_hdr));
+    hdr->magic       = VOLT_DISK_MAGIC;
+    hdr->version     = VOLT_DISK_VERSION;
+    hdr->n_of_ch     = geo->n_of_ch;
+    hdr->lun_per_ch  = geo->lun_per_ch;
+    hdr->blk_per_lun = geo->blk_per_lun;
+    hdr->n_of_planes = geo->n_of_planes;
+    hdr->pg_per_blk  = geo->pg_per_blk;
+    hdr->pg_size     = geo->pg_size;
+    hdr->pg_oob_sz   = geo->sec_oob_sz * geo->sec_per_pg;
+}
+
+/* Creates the disk file if needed and maps it, returns 1 if it is new */
+static int volt_disk_map (void)
+{
+    struct nvm_mmgr_geometry *geo = volt_mmgr.geometry;
+    struct volt_disk_hdr hdr, disk_hdr;
+    VoltDisk *disk = &volt->disk;
+    uint64_t tot_pg = (uint64_t) geo->n_of_planes * geo->blk_per_lun *
+                        geo->lun_per_ch * geo->n_of_ch * geo->pg_per_blk;
+    struct stat st;
+    int new = 0;
+
+    disk->data_off = VOLT_DISK_HDR_SZ;
+    disk->oob_off = disk->data_off + tot_pg * geo->pg_size;
+    disk->size = disk->oob_off + tot_pg * geo->sec_oob_sz * geo->sec_per_pg;
+
+    disk->fd = open (volt_disk, O_RDWR | O_CREAT, 0644);
+    if (disk->fd < 0)
+        return -1;
+
+    volt_disk_hdr_fill (&hdr);
+
+    if (fstat (disk->fd, &st))
+        goto CLOSE;
+
+    if (!st.st_size) {
+        /* Sparse file, all the blocks start as holes (erased) */
+        new = 1;
+        if (pwrite (disk->fd, &hdr, sizeof (hdr), 0) != sizeof (hdr) ||
+                                            ftruncate (disk->fd, disk->size))
+            goto CLOSE;
+    } else {
+        if (pread (disk->fd, &disk_hdr, sizeof (disk_hdr), 0) !=
+                sizeof (disk_hdr) || memcmp (&hdr, &disk_hdr, sizeof (hdr)) ||
+                                                    st.st_size != disk->size) {
+            if (disk_hdr.magic == VOLT_DISK_MAGIC &&
+                                        disk_hdr.version != VOLT_DISK_VERSION)
+                log_err ("[volt: %s has version %d, expected %d. Remove it "
+                            "to create a new disk.]\n", volt_disk,
+                            disk_hdr.version, VOLT_DISK_VERSION);
+            else
+                log_err ("[volt: %s does not match the VOLT geometry.]\n",
+                                                                    volt_disk);
+            goto CLOSE;
+        }
+    }
+
+    disk->map = mmap (NULL, disk->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                                                                 disk->fd, 0);
+    if (disk->map == MAP_FAILED)
+        goto CLOSE;
+
+    /* Page accesses follow the FTL, not the file order */
+    madvise (disk->map, disk->size, MADV_RANDOM);
+
+    disk->dirty_words = (tot_pg + 63) / 64;
+    disk->dirty = g_malloc0 (disk->dirty_words * sizeof (uint64_t));
+    if (!disk->dirty) {
+        munmap (disk->map, disk->size);
+        goto CLOSE;
+    }
+    disk->erased = 0;
+
+    return new;
+
+CLOSE:
+    close (disk->fd);
+    disk->fd = -1;
+    if (new)
+        remove (volt_disk);
+    return -1;
+}
+
+static void volt_disk_unmap (void)
+{
+    g_free (volt->disk.dirty);
+    munmap (volt->disk.map, volt->disk.size);
+    close (volt->disk.fd);
+    volt->disk.fd = -1;
+}
+
+/* Pages holding data in the file are written, holes are erased pages */
+static void volt_disk_scan (void)
+{
+    struct nvm_mmgr_geometry *geo = volt_mmgr.geometry;
+    VoltDisk *disk = &volt->disk;
+    off_t start, end;
+    uint64_t pg_i, pg_end;
+
+    start = disk->data_off;
+    while (start < disk->oob_off) {
+        start = lseek (disk->fd, start, SEEK_DATA);
+        if (start < 0 || start >= disk->oob_off)
+            break;
+        end = lseek (disk->fd, start, SEEK_HOLE);
+        if (end < 0 || end > disk->oob_off)
+            end = disk->oob_off;
+
+        pg_end = (end - disk->data_off + geo->pg_size - 1) / geo->pg_size;
+        for (pg_i = (start - disk->data_off) / geo->pg_size; pg_i < pg_end;
+                                                                      pg_i++)
+            volt->blocks[pg_i / geo->pg_per_blk].
+                                    pages[pg_i % geo->pg_per_blk].state = 1;
+        start = end;
+    }
+}
+
+/*
+ * Disks created before the mapped layout are a plain sequence of pages
+ * (data + OOB). They are copied into the new layout, pages that are still
+ * all 0xff are left as holes.
+ */
+static int volt_disk_convert (void)
 {
     FILE *file;
-    uint32_t blk_i, pg_i;
+    uint32_t blk_i, pg_i, i;
     struct nvm_mmgr_geometry *geo = volt_mmgr.geometry;
     uint32_t pg_sz = geo->pg_size + (geo->sec_oob_sz * geo->sec_per_pg);
     uint32_t tot_blk = geo->n_of_planes * geo->blk_per_lun * geo->lun_per_ch *
                                                                    geo->n_of_ch;
-    file = fopen(volt_disk, "r");
+    VoltPage *pg;
+    uint8_t *buf;
+
+    buf = g_malloc (pg_sz);
+    file = fopen (volt_disk_old, "r");
+    if (!file) {
+        g_free (buf);
+        return -1;
+    }
+
     for (blk_i = 0; blk_i < tot_blk; blk_i++) {
         for (pg_i = 0; pg_i < geo->pg_per_blk; pg_i++) {
-            if (fread(volt->blocks[blk_i].pages[pg_i].data, pg_sz, 1, file)<1) {
+            if (fread(buf, pg_sz, 1, file) < 1) {
                 fclose (file);
+                g_free (buf);
                 return -1;
             }
+            for (i = 0; i < pg_sz && buf[i] == 0xff; i++);
+            if (i == pg_sz)
+                continue;
+
+            pg = &volt->blocks[blk_i].pages[pg_i];
+            volt_page_dma (pg, 0, buf, pg_sz, VOLT_DMA_WRITE);
+            pg->state = 1;
+            volt_disk_set_dirty (pg);
         }
     }
 
     fclose (file);
-    return 0;
+    g_free (buf);
+    return volt_disk_flush ();
 }
 
-static int volt_init_disk (void)
+static int volt_disk_is_legacy (void)
 {
+    struct nvm_mmgr_geometry *geo = volt_mmgr.geometry;
+    uint64_t legacy_sz = (uint64_t) geo->n_of_planes * geo->blk_per_lun *
+                 geo->lun_per_ch * geo->n_of_ch * geo->pg_per_blk *
+                 (geo->pg_size + (geo->sec_oob_sz * geo->sec_per_pg));
+    struct stat st;
+    uint64_t magic;
     FILE *file;
+    int ret = 0;
 
-    file = fopen(volt_disk, "r");
-    if (!file){
-        printf(" [volt: Creating disk...]\n");
+    if (stat (volt_disk, &st) || st.st_size != legacy_sz)
+        return 0;
 
-        if (volt_disk_flush ())
-            goto WERR;
-    } else {
-        printf(" [volt: Loading disk...]\n");
+    file = fopen (volt_disk, "r");
+    if (!file)
+        return 0;
+    if (fread (&magic, sizeof (magic), 1, file) == 1 &&
+                                                    magic != VOLT_DISK_MAGIC)
+        ret = 1;
+    fclose (file);
+
+    return ret;
+}
+
+/* Maps the disk file, called before the blocks are initialized */
+static int volt_init_disk (void)
+{
+    int ret;
 
-        fclose (file);
-        if (volt_disk_load ())
+    if (volt_disk_is_legacy ()) {
+        printf(" [volt: Old disk format, converting...]\n");
+        if (rename (volt_disk, volt_disk_old))
             goto RERR;
     }
 
-    printf(" [volt: Disk is ready.]\n");
+    ret = volt_disk_map ();
+    if (ret < 0)
+        goto RERR;
+
+    printf(ret ? " [volt: Disk created.]\n" : " [volt: Disk mapped.]\n");
     return 0;
 
-WERR:
-    remove (volt_disk);
-    printf(" [volt: Disk creation failed!]\n");
-    return -1;
 RERR:
-    printf(" [volt: Disk loading failed!]\n");
+    printf(" [volt: Disk mapping failed!]\n");
     return -1;
 }
 
+/* Sets the page state from the disk, called after the blocks are set */
+static int volt_load_disk (void)
+{
+    if (access (volt_disk_old, F_OK) == 0) {
+        if (volt_disk_convert ()) {
+            printf(" [volt: Disk conversion failed! Old disk kept in %s]\n",
+                                                                volt_disk_old);
+            return -1;
+        }
+        remove (volt_disk_old);
+    }
+
+    volt_disk_scan ();
+    printf(" [volt: Disk is ready.]\n");
+    return 0;
+}
+
+static void volt_show_ch_stats (void)
+{
+    struct volt_ch_stats *st;
+    int ch_i;
+
+    for (ch_i = 0; ch_i < volt_mmgr.geometry->n_of_ch; ch_i++) {
+        st = &volt->channels[ch_i].stats;
+        log_info (" [volt: ch %d: read %lu, write %lu, erase %lu, failed %lu, "
+                "queue full %d]\n", ch_i, st->read, st->write, st->erase,
+                st->failed, u_atomic_read(&st->queue_full));
+    }
+}
+
 static void volt_exit (struct nvm_mmgr *mmgr)
 {
-    int i;
+    struct volt_flush_head pending;
+    int i, ret;
+
+    /* Scheduled completions are released before the buffers go away */
+    if (volt->timing.enabled)
+        volt_timing_exit (&volt->timing);
+
+    volt_show_ch_stats ();
 
     if (!core.volt) {
+        volt_flush_stop (&pending);
         printf(" [volt: Flushing disk...]\n");
-        if (volt_disk_flush ())
+        ret = volt_disk_flush ();
+        if (ret)
             printf (" [volt: Disk flush FAILED.]\n");
+        volt_flush_complete (&pending, ret);
     }
 
     volt_clean_mem();
+    if (!core.volt)
+        volt_disk_unmap ();
     volt->status.active = 0;
     ox_mq_destroy(volt->mq);
+    volt_stop_prp_map();
     for (i = 0; i < mmgr->geometry->n_of_ch; i++) {
-        pthread_mutex_destroy(&prpmap_mutex[i]);
         g_free(mmgr->ch_info[i].mmgr_rsv_list);
         free(mmgr->ch_info[i].ftl_rsv_list);
     }
     g_free (volt);
 }
 
+/* Timing is set by the 'volt_timing' device property, 0 uses the defaults */
+static int volt_init_timing (void)
+{
+    VoltTiming *tm = &volt->timing;
+    QemuOxCtrl *qemu = core.qemu;
+
+    memset (tm, 0x0, sizeof (VoltTiming));
+    if (!qemu || !qemu->volt_timing)
+        return 0;
+
+    tm->tr_ns    = (uint64_t) ((qemu->volt_tr) ? qemu->volt_tr
+                                                    : VOLT_READ_TIME) * 1000;
+    tm->tprog_ns = (uint64_t) ((qemu->volt_tprog) ? qemu->volt_tprog
+                                                    : VOLT_WRITE_TIME) * 1000;
+    tm->tbers_ns = (uint64_t) ((qemu->volt_tbers) ? qemu->volt_tbers
+                                                    : VOLT_ERASE_TIME) * 1000;
+    tm->xfer_mbs = qemu->volt_xfer;
+
+    if (volt_timing_init (tm, volt_mmgr.geometry,
+                                volt_mq.n_queues * volt_mq.q_size,
+                                volt_complete_io))
+        return -1;
+
+    tm->enabled = 1;
+    return 0;
+}
+
 static int volt_init(void)
 {
     struct nvm_mmgr_geometry *geo = volt_mmgr.geometry;
-    int tot_blk = geo->n_of_planes * geo->blk_per_lun * geo->lun_per_ch *
-                                                                   geo->n_of_ch;
 
     volt = g_malloc (sizeof (VoltCtrl));
     if (!volt)
         return -1;
 
     volt->status.allocated_memory = 0;
+    volt->arenas = NULL;
 
     if (volt_start_prp_map())
         goto OUT;
 
+    if (!core.volt && volt_init_disk())
+        goto FREE_SLOTS;
+
     if (!volt_init_blocks())
-        goto OUT;
+        goto UNMAP;
 
     if (!volt_init_luns()) {
-        volt_free_blocks(tot_blk, 0, 0);
-        goto OUT;
+        volt_free_blocks();
+        goto UNMAP;
     }
 
     if (!volt_init_channels()) {
-        volt_free_luns(tot_blk);
-        goto OUT;
+        volt_free_luns();
+        goto UNMAP;
     }
 
     if (volt_init_dma_buf()) {
-        volt_free_channels(tot_blk);
-        goto OUT;
+        volt_free_channels();
+        goto UNMAP;
     }
 
-    if (!core.volt && volt_init_disk()) {
+    if (!core.volt && (volt_load_disk() || volt_flush_start())) {
         volt_clean_mem();
-        goto OUT;
+        goto UNMAP;
     }
 
     sprintf(volt_mq.name, "%s", "VOLT_MMGR");
+    volt_mq.n_queues = geo->n_of_ch;
     volt->mq = ox_mq_init(&volt_mq);
     if (!volt->mq) {
+        if (!core.volt) {
+            struct volt_flush_head pending;
+            volt_flush_stop (&pending);
+        }
         volt_clean_mem();
-        goto OUT;
+        goto UNMAP;
+    }
+
+    if (volt_init_timing ()) {
+        ox_mq_destroy (volt->mq);
+        if (!core.volt) {
+            struct volt_flush_head pending;
+            volt_flush_stop (&pending);
+        }
+        volt_clean_mem();
+        goto UNMAP;
     }
 
     /* DEBUG: Thread to show multi-queue statistics */
@@ -833,8 +1526,16 @@ static int volt_init(void)
                                       volt->status.allocated_memory / 1048576);
     printf(" [volt: Volatile memory usage: %lu Mb]\n",
                                       volt->status.allocated_memory / 1048576);
+    if (!core.volt)
+        log_info(" [volt: Disk mapped from '%s': %lu Mb]\n", volt_disk,
+                                                   volt->disk.size / 1048576);
     return 0;
 
+UNMAP:
+    if (!core.volt)
+        volt_disk_unmap ();
+FREE_SLOTS:
+    volt_stop_prp_map();
 OUT:
     g_free (volt);
     printf(" [volt: Not initialized! Memory allocation failed.]\n");
@@ -850,6 +1551,10 @@ struct nvm_mmgr_ops volt_ops = {
     .exit           = volt_exit,
     .get_ch_info    = volt_get_ch_info,
     .set_ch_info    = volt_set_ch_info,
+    .flush          = volt_flush,
+    .read_vec       = volt_io_vec,
+    .write_vec      = volt_io_vec,
+    .erase_vec      = volt_io_vec,
 };
 
 struct nvm_mmgr_geometry volt_geo = {
@@ -860,9 +1565,51 @@ struct nvm_mmgr_geometry volt_geo = {
     .sec_per_pg     = VOLT_SECTOR_COUNT,
     .n_of_planes    = VOLT_PLANE_COUNT,
     .pg_size        = VOLT_PAGE_SIZE,
-    .sec_oob_sz     = VOLT_OOB_SIZE / VOLT_SECTOR_COUNT
+    .sec_oob_sz     = VOLT_OOB_SIZE / VOLT_SECTOR_COUNT,
+    .blk_life       = VOLT_BLK_LIFE
 };
 
+/* Geometry and queue size from the device properties, 0 keeps the default */
+static int volt_set_geometry (void)
+{
+    struct nvm_mmgr_geometry *geo = &volt_geo;
+    QemuOxCtrl *q = core.qemu;
+
+    if (!q)
+        return 0;
+
+    if (q->volt_ch > (1 << LNVM_CH_BITS) ||
+                        q->volt_luns > (1 << LNVM_LUN_BITS) ||
+                        q->volt_blks > (1 << LNVM_BLK_BITS) ||
+                        q->volt_pgs > (1 << LNVM_PG_BITS) ||
+                        q->volt_queue > VOLT_QUEUE_MAX) {
+        log_err (" [volt: Geometry out of range. Max: %d channels, %d LUNs, "
+                    "%d blocks, %d pages, queue of %d.]\n", 1 << LNVM_CH_BITS,
+                    1 << LNVM_LUN_BITS, 1 << LNVM_BLK_BITS,
+                    1 << LNVM_PG_BITS, VOLT_QUEUE_MAX);
+        return -1;
+    }
+
+    if (q->volt_ch)
+        geo->n_of_ch = q->volt_ch;
+    if (q->volt_luns)
+        geo->lun_per_ch = q->volt_luns;
+    if (q->volt_blks)
+        geo->blk_per_lun = q->volt_blks;
+    if (q->volt_pgs)
+        geo->pg_per_blk = q->volt_pgs;
+    if (q->volt_queue)
+        volt_mq.q_size = q->volt_queue;
+
+    /* Reserved blocks of the media manager and the FTLs are in LUN 0 */
+    if (geo->blk_per_lun < VOLT_BLK_MIN) {
+        log_err (" [volt: At least %d blocks per LUN.]\n", VOLT_BLK_MIN);
+        return -1;
+    }
+
+    return 0;
+}
+
 int mmgr_volt_init(void)
 {
     int ret = 0;
@@ -871,6 +1618,9 @@ int mmgr_volt_init(void)
     volt_mmgr.ops      = &volt_ops;
     volt_mmgr.geometry = &volt_geo;
 
+    if (volt_set_geometry ())
+        return -1;
+
     ret = volt_init();
     if(ret) {
         log_err(" [volt: Not possible to start VOLT.]\n");
@@ -9,18 +9,21 @@
 #define VOLT_MEM_OK         1
 #define VOLT_SECOND         1000000 /* from u-seconds */
 
+/* Default geometry, 'volt_ch', 'volt_luns', 'volt_blks' and 'volt_pgs'
+ * properties scale it up to the PPA format (lightnvm.h) */
 #define VOLT_CHIP_COUNT      8
 #define VOLT_VIRTUAL_LUNS    4
 #define VOLT_BLOCK_COUNT     64
 #define VOLT_PAGE_COUNT      64
+#define VOLT_BLK_MIN         16
 #define VOLT_SECTOR_COUNT    4
 #define VOLT_PLANE_COUNT     2
 #define VOLT_PAGE_SIZE       0x4000
 #define VOLT_SECTOR_SIZE     0x1000
 #define VOLT_OOB_SIZE        0x40
 
-#define VOLT_DMA_SLOT_CH     32
-#define VOLT_DMA_SLOT_INDEX  VOLT_DMA_SLOT_CH * VOLT_CHIP_COUNT
+#define VOLT_DMA_SLOT_CH     32   /* default, 'volt_dma_slots' property */
+#define VOLT_DMA_SLOT_MAX    4096
 #define VOLT_DMA_READ        0x1
 #define VOLT_DMA_WRITE       0x2
 
@@ -31,9 +34,13 @@
 #define VOLT_READ_TIME      50
 #define VOLT_WRITE_TIME     200
 #define VOLT_ERASE_TIME     1200
+#define VOLT_XFER_MBS       400  /* channel bus rate, MB/s */
 
+/* One queue per channel, VOLT_QUEUE_SIZE entries each ('volt_queue') */
 #define VOLT_QUEUE_SIZE     2048
+#define VOLT_QUEUE_MAX      65536
 #define VOLT_QUEUE_TO       48000
+#define VOLT_QUEUE_WAIT     3200  /* usec, max wait if a channel queue is full */
 
 typedef struct VoltStatus {
     uint8_t     ready; /* 0x00-busy, 0x01-ready to use */
@@ -44,6 +51,7 @@ typedef struct VoltStatus {
 typedef struct VoltPage {
     uint8_t         state; /* 0x00-free, 0x01-alive, 0x02-invalid */
     uint8_t         *data;
+    uint8_t         *oob;
 } VoltPage;
 
 typedef struct VoltBlock {
@@ -57,23 +65,144 @@ typedef struct VoltLun {
     VoltBlock       *blk_offset;
 } VoltLun;
 
+/* Updated by the channel SQ thread, except queue_full */
+struct volt_ch_stats {
+    uint64_t        read;
+    uint64_t        write;
+    uint64_t        erase;
+    uint64_t        failed;
+    u_atomic_t      queue_full; /* submissions delayed by a full queue */
+};
+
 typedef struct VoltCh {
-    VoltLun         *lun_offset;
+    VoltLun                 *lun_offset;
+    struct volt_ch_stats    stats;
 } VoltCh;
 
+/*
+ * Optional timing engine. Commands are executed right away, but the
+ * completion is released only at the simulated time. Each plane of each
+ * LUN keeps its own timeline (tR/tPROG/tBERS), commands to different planes
+ * of a LUN overlap as in multi-plane operations. Each channel keeps the
+ * timeline of its bus, used by the page transfers.
+ *
+ * A channel timeline is only touched by the SQ thread of the channel
+ * queue. Scheduled completions are kept in a min-heap, released by a single
+ * timer thread.
+ */
+struct nvm_mmgr_geometry;
+struct nvm_mmgr_io_cmd;
+
+typedef void (volt_tm_complete_fn)(struct ox_mq_entry *);
+
+struct volt_tm_event {
+    uint64_t                due;   /* CLOCK_MONOTONIC nsec */
+    struct ox_mq_entry      *req;
+};
+
+typedef struct VoltTiming {
+    uint8_t                 enabled;
+    uint64_t                tr_ns;
+    uint64_t                tprog_ns;
+    uint64_t                tbers_ns;
+    uint32_t                xfer_mbs;
+    uint16_t                lun_per_ch;
+    uint16_t                n_of_planes;
+    uint64_t                *ch_busy;   /* bus is free from, per channel */
+    uint64_t                *pl_busy;   /* plane is free from, per plane */
+    struct volt_tm_event    *heap;
+    uint32_t                heap_n;
+    uint32_t                heap_max;
+    pthread_mutex_t         heap_mutex;
+    pthread_cond_t          heap_cond;
+    pthread_t               tid;
+    uint8_t                 stop;
+    volt_tm_complete_fn     *complete_fn;
+    uint64_t                delay_ns;   /* total simulated latency */
+    uint64_t                events;
+} VoltTiming;
+
+int  volt_timing_init (VoltTiming *, struct nvm_mmgr_geometry *, uint32_t,
+                                                        volt_tm_complete_fn *);
+void volt_timing_exit (VoltTiming *);
+void volt_timing_schedule (VoltTiming *, struct nvm_mmgr_io_cmd *,
+                                                         struct ox_mq_entry *);
+
+/*
+ * Persistent VOLT disk: the backing file is mapped in memory and the pages
+ * point into the mapping. The file holds a header, the page data of all
+ * blocks and then the OOB of all pages, both in block order
+ * (channel/lun/block/plane). Page data is page aligned, so erased blocks
+ * are kept as holes and free pages are found from the file extents.
+ */
+#define VOLT_DISK_MAGIC     0x4b534944544c4f56ULL /* "VOLTDISK" */
+#define VOLT_DISK_VERSION   2   /* 2: wider PPA format in the FTL metadata */
+#define VOLT_DISK_HDR_SZ    0x1000
+
+struct volt_disk_hdr {
+    uint64_t        magic;
+    uint32_t        version;
+    uint32_t        n_of_ch;
+    uint32_t        lun_per_ch;
+    uint32_t        blk_per_lun;
+    uint32_t        n_of_planes;
+    uint32_t        pg_per_blk;
+    uint32_t        pg_size;
+    uint32_t        pg_oob_sz;
+};
+
+/*
+ * Pages written since the last flush are set in the dirty bitmap, a flush
+ * writes back only those pages. Flush requests are queued to the flush
+ * thread, all the requests found in the queue are served by one write back.
+ */
+TAILQ_HEAD(volt_flush_head, nvm_mmgr_flush_cmd);
+
+typedef struct VoltDisk {
+    int                     fd;
+    uint8_t                 *map;
+    uint64_t                size;
+    uint64_t                data_off;
+    uint64_t                oob_off;
+    uint64_t                *dirty;     /* one bit per page */
+    uint64_t                dirty_words;
+    volatile uint8_t        erased;     /* holes punched since the last flush */
+    struct volt_flush_head  flush_q;
+    pthread_mutex_t         flush_mutex;
+    pthread_cond_t          flush_cond;
+    pthread_t               flush_tid;
+    uint8_t                 flush_stop;
+} VoltDisk;
+
+/* Volatile page storage of a channel, see volt_init_arenas */
+#define VOLT_HUGE_PAGE_SZ   (2 * 1024 * 1024)
+
+typedef struct VoltArena {
+    uint8_t         *data;
+    uint8_t         *oob;
+    uint64_t        size;
+    uint8_t         huge;   /* backed by hugetlbfs pages */
+} VoltArena;
+
 typedef struct VoltCtrl {
     VoltStatus      status;
     VoltBlock       *blocks;
+    VoltPage        *pages; /* pages of all the blocks */
+    VoltArena       *arenas; /* one per channel, only if volatile */
     VoltLun         *luns;
     VoltCh          *channels;
     struct ox_mq    *mq;
     uint8_t         *edma; /* emergency DMA buffer for timeout requests */
+    VoltDisk        disk;  /* only used if VOLT is not volatile */
+    VoltTiming      timing;
 } VoltCtrl;
 
 struct volt_dma {
     uint8_t         *virt_addr;
     uint32_t        prp_index;
     uint8_t         status; /* nand status */
+    uint8_t         direct; /* data sectors are copied to/from host_addr */
+    uint8_t         *host_addr[VOLT_SECTOR_COUNT]; /* mapped host sectors */
 };
 
 #endif /* VOLT_SSD_H */
\ No newline at end of file
@@ -0,0 +1,237 @@
+/* OX: Open-Channel NVM Express SSD Controller
+ *  - VOLT timing engine (per plane and per channel timelines)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "volt.h"
+#include "hw/block/ox-ctrl/include/ssd.h"
+#include "hw/block/ox-ctrl/include/ox-mq.h"
+
+static uint64_t volt_tm_now (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t volt_tm_xfer_ns (VoltTiming *tm, uint32_t bytes)
+{
+    /* MB/s is bytes per usec */
+    return (uint64_t) bytes * 1000 / tm->xfer_mbs;
+}
+
+static void volt_tm_heap_push (VoltTiming *tm, uint64_t due,
+                                                       struct ox_mq_entry *req)
+{
+    struct volt_tm_event ev;
+    uint32_t i = tm->heap_n++, parent;
+
+    while (i) {
+        parent = (i - 1) / 2;
+        if (tm->heap[parent].due <= due)
+            break;
+        tm->heap[i] = tm->heap[parent];
+        i = parent;
+    }
+    ev.due = due;
+    ev.req = req;
+    tm->heap[i] = ev;
+}
+
+static struct ox_mq_entry *volt_tm_heap_pop (VoltTiming *tm)
+{
+    struct ox_mq_entry *req = tm->heap[0].req;
+    struct volt_tm_event last = tm->heap[--tm->heap_n];
+    uint32_t i = 0, child;
+
+    while ((child = 2 * i + 1) < tm->heap_n) {
+        if (child + 1 < tm->heap_n &&
+                                tm->heap[child + 1].due < tm->heap[child].due)
+            child++;
+        if (last.due <= tm->heap[child].due)
+            break;
+        tm->heap[i] = tm->heap[child];
+        i = child;
+    }
+    tm->heap[i] = last;
+
+    return req;
+}
+
+static void *volt_tm_thread (void *arg)
+{
+    VoltTiming *tm = (VoltTiming *) arg;
+    struct ox_mq_entry *req;
+    struct timespec ts;
+    uint64_t due;
+
+    pthread_mutex_lock (&tm->heap_mutex);
+    while (!tm->stop || tm->heap_n) {
+        if (!tm->heap_n) {
+            pthread_cond_wait (&tm->heap_cond, &tm->heap_mutex);
+            continue;
+        }
+
+        /* Pending completions are released right away when stopping */
+        due = tm->heap[0].due;
+        if (!tm->stop && due > volt_tm_now ()) {
+            ts.tv_sec = due / 1000000000;
+            ts.tv_nsec = due % 1000000000;
+            pthread_cond_timedwait (&tm->heap_cond, &tm->heap_mutex, &ts);
+            continue;
+        }
+
+        req = volt_tm_heap_pop (tm);
+        pthread_mutex_unlock (&tm->heap_mutex);
+
+        tm->complete_fn (req);
+
+        pthread_mutex_lock (&tm->heap_mutex);
+    }
+    pthread_mutex_unlock (&tm->heap_mutex);
+
+    return NULL;
+}
+
+/*
+ * Computes when the command completes and takes the time from the plane
+ * and channel timelines:
+ *  - read:  plane busy for tR, then the page is transferred on the bus
+ *  - write: the page is transferred on the bus, then plane busy for tPROG
+ *  - erase: plane busy for tBERS
+ */
+void volt_timing_schedule (VoltTiming *tm, struct nvm_mmgr_io_cmd *cmd,
+                                                       struct ox_mq_entry *req)
+{
+    uint64_t now, start, due, xfer, *ch_busy, *pl_busy;
+    uint32_t pl_i;
+    int signal;
+
+    pl_i = (cmd->ppa.g.ch * tm->lun_per_ch + cmd->ppa.g.lun) *
+                                            tm->n_of_planes + cmd->ppa.g.pl;
+    ch_busy = &tm->ch_busy[cmd->ppa.g.ch];
+    pl_busy = &tm->pl_busy[pl_i];
+    xfer = volt_tm_xfer_ns (tm, cmd->pg_sz + cmd->md_sz);
+
+    now = volt_tm_now ();
+    start = MAX(now, *pl_busy);
+
+    switch (cmd->cmdtype) {
+        case MMGR_READ_PG:
+            *pl_busy = start + tm->tr_ns;
+            start = MAX(*pl_busy, *ch_busy);
+            due = *ch_busy = start + xfer;
+            break;
+        case MMGR_WRITE_PG:
+            start = MAX(now, *ch_busy);
+            *ch_busy = start + xfer;
+            start = MAX(*ch_busy, *pl_busy);
+            due = *pl_busy = start + tm->tprog_ns;
+            break;
+        case MMGR_ERASE_BLK:
+            due = *pl_busy = start + tm->tbers_ns;
+            break;
+        default:
+            due = now;
+    }
+
+    pthread_mutex_lock (&tm->heap_mutex);
+
+    /* The heap holds every queue entry, it is never full */
+    if (tm->heap_n == tm->heap_max) {
+        pthread_mutex_unlock (&tm->heap_mutex);
+        tm->complete_fn (req);
+        return;
+    }
+
+    tm->delay_ns += due - now;
+    tm->events++;
+
+    /* Only wake the timer thread if its next deadline changes */
+    signal = !tm->heap_n || due < tm->heap[0].due;
+    volt_tm_heap_push (tm, due, req);
+    if (signal)
+        pthread_cond_signal (&tm->heap_cond);
+
+    pthread_mutex_unlock (&tm->heap_mutex);
+}
+
+int volt_timing_init (VoltTiming *tm, struct nvm_mmgr_geometry *geo,
+                            uint32_t max_events, volt_tm_complete_fn *fn)
+{
+    pthread_condattr_t attr;
+    uint32_t n_pl = geo->n_of_ch * geo->lun_per_ch * geo->n_of_planes;
+
+    tm->lun_per_ch = geo->lun_per_ch;
+    tm->n_of_planes = geo->n_of_planes;
+    tm->complete_fn = fn;
+    tm->heap_n = 0;
+    tm->heap_max = max_events;
+    tm->stop = 0;
+    tm->delay_ns = 0;
+    tm->events = 0;
+    if (!tm->xfer_mbs)
+        tm->xfer_mbs = VOLT_XFER_MBS;
+
+    tm->ch_busy = calloc (geo->n_of_ch, sizeof (uint64_t));
+    if (!tm->ch_busy)
+        return -1;
+
+    tm->pl_busy = calloc (n_pl, sizeof (uint64_t));
+    if (!tm->pl_busy)
+        goto FREE_CH;
+
+    tm->heap = malloc (sizeof (struct volt_tm_event) * max_events);
+    if (!tm->heap)
+        goto FREE_PL;
+
+    pthread_mutex_init (&tm->heap_mutex, NULL);
+    pthread_condattr_init (&attr);
+    pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+    pthread_cond_init (&tm->heap_cond, &attr);
+    pthread_condattr_destroy (&attr);
+
+    if (pthread_create (&tm->tid, NULL, volt_tm_thread, tm))
+        goto FREE_HEAP;
+
+    log_info (" [volt: Timing enabled. tR %lu us, tPROG %lu us, tBERS %lu us, "
+                "bus %u MB/s]\n", tm->tr_ns / 1000, tm->tprog_ns / 1000,
+                tm->tbers_ns / 1000, tm->xfer_mbs);
+
+    return 0;
+
+FREE_HEAP:
+    pthread_cond_destroy (&tm->heap_cond);
+    pthread_mutex_destroy (&tm->heap_mutex);
+    free (tm->heap);
+FREE_PL:
+    free (tm->pl_busy);
+FREE_CH:
+    free (tm->ch_busy);
+    return -1;
+}
+
+/* Releases all the pending completions and stops the timer thread */
+void volt_timing_exit (VoltTiming *tm)
+{
+    pthread_mutex_lock (&tm->heap_mutex);
+    tm->stop = 1;
+    pthread_cond_signal (&tm->heap_cond);
+    pthread_mutex_unlock (&tm->heap_mutex);
+    pthread_join (tm->tid, NULL);
+
+    if (tm->events)
+        log_info (" [volt: Timing: %lu commands, average latency %lu us]\n",
+                            tm->events, tm->delay_ns / tm->events / 1000);
+
+    pthread_cond_destroy (&tm->heap_cond);
+    pthread_mutex_destroy (&tm->heap_mutex);
+    free (tm->heap);
+    free (tm->pl_busy);
+    free (tm->ch_busy);
+}
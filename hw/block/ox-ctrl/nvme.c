@@ -10,12 +10,13 @@
 #include "hw/block/ox-ctrl/include/ssd.h"
 #include "hw/block/ox-ctrl/include/nvme.h"
 #include "hw/block/ox-ctrl/include/ox-ndp.h"
+#include "hw/block/ox-ctrl/include/ox-fabrics.h"
 #include <hw/pci/pci.h>
+#include "qemu/atomic.h"
 
 #include "hw/block/ox-ctrl/include/lightnvm.h"
 
 extern struct core_struct core;
-static uint64_t           nvm_ns_size;
 static NvmeCtrl           *nvm_nvme_ctrl;
 
 static void nvme_process_sq (void *);
@@ -29,7 +30,7 @@ static void nvme_set_default (NvmeCtrl *n)
     n->max_sqes = 0x6;
     n->db_stride = 0;
 
-    n->cqr = 1; /* Contiguous Queues Required */
+    n->cqr = 0; /* Contiguous Queues Required */
     n->intc = 0;
     n->intc_thresh = 0;
     n->intc_time = 0;
@@ -42,9 +43,7 @@ static void nvme_set_default (NvmeCtrl *n)
     n->dps = 0; /* End-to-end Data Protection Type Settings */
     n->mc = 0x2; /* Metadata Capabilities */
     n->meta = NVM_OOB_BITS;
-    n->cmb = 0; /* Controller Memory Buffer NOT IMPLEMENTED, MUST BE 0*/
-    n->cmbloc = 0;
-    n->cmbsz = 0;
+    nvme_cmb_config (n);
     n->vid = PCI_VENDOR_ID_INTEL;
     n->did = PCI_DEVICE_ID_LS2085;
 
@@ -55,6 +54,60 @@ static void nvme_set_default (NvmeCtrl *n)
     }
 }
 
+/*
+ * Controller Memory Buffer of 'cmb_size_mb' MB in BAR NVME_CMB_BIR. SQs,
+ * PRP/SGL lists and read/write data may be placed in it, the controller then
+ * accesses its own memory instead of DMA. CQs stay in host memory.
+ */
+void nvme_cmb_config (NvmeCtrl *n)
+{
+    uint32_t mb = (core.qemu) ? core.qemu->cmb_size_mb : 0;
+
+    n->cmbloc = 0;
+    n->cmbsz = 0;
+
+    if (mb > NVME_CMB_MAX_MB) {
+        log_err ("[nvme: CMB of %d MB, reduced to %d MB]\n", mb,
+                                                            NVME_CMB_MAX_MB);
+        mb = NVME_CMB_MAX_MB;
+    }
+
+    n->cmb = (mb) ? 1 : 0;
+    if (!mb)
+        return;
+
+    NVME_CMBLOC_SET_BIR(n->cmbloc, NVME_CMB_BIR);
+    NVME_CMBSZ_SET_SQS(n->cmbsz, 1);
+    NVME_CMBSZ_SET_LISTS(n->cmbsz, 1);
+    NVME_CMBSZ_SET_RDS(n->cmbsz, 1);
+    NVME_CMBSZ_SET_WDS(n->cmbsz, 1);
+    NVME_CMBSZ_SET_SZU(n->cmbsz, 2); /* 1 MB units */
+    NVME_CMBSZ_SET_SZ(n->cmbsz, mb);
+}
+
+/* Controller memory at a bus address of the CMB, NULL if it is not in it */
+static uint8_t *nvme_cmb_addr (NvmeCtrl *n, uint64_t addr, uint64_t size)
+{
+    pcibus_t base;
+
+    if (!n || !n->cmbuf || !n->cmbsz)
+        return NULL;
+
+    base = pci_get_bar_addr (&core.qemu->parent_obj,
+                                                NVME_CMBLOC_BIR(n->cmbloc));
+    if (base == PCI_BAR_UNMAPPED || addr < base ||
+                    addr + size > base + NVME_CMBSZ_GETSIZE(n->cmbsz))
+        return NULL;
+
+    return &n->cmbuf[addr - base];
+}
+
+static inline uint8_t nvme_cmb_ptr (NvmeCtrl *n, void *ptr)
+{
+    return n && n->cmbuf && (uint8_t *) ptr >= n->cmbuf &&
+            (uint8_t *) ptr < n->cmbuf + NVME_CMBSZ_GETSIZE(n->cmbsz);
+}
+
 static void nvme_regs_setup (NvmeCtrl *n)
 {
     n->nvme_regs.vBar.cap = 0;
@@ -78,6 +131,12 @@ static void nvme_regs_setup (NvmeCtrl *n)
         n->nvme_regs.vBar.vs = 0x00010200;
     else
         n->nvme_regs.vBar.vs = 0x00010100;
+
+    /* The CMB BAR is registered once with the PCI device */
+    if (n->cmbuf) {
+        n->nvme_regs.vBar.cmbloc = n->cmbloc;
+        n->nvme_regs.vBar.cmbsz = n->cmbsz;
+    }
     n->nvme_regs.vBar.intmc = n->nvme_regs.vBar.intms = 0;
 }
 
@@ -98,7 +157,7 @@ static int nvme_init_ctrl (NvmeCtrl *n)
     id->ieee[2] = 0xb3;
     id->cmic = 0;
     id->mdts = 8; /* 4k * (1 << 8) = 1 MB max transfer per NVMe I/O */
-    id->oacs = cpu_to_le16(NVME_OACS_FORMAT);
+    id->oacs = cpu_to_le16(NVME_OACS_FORMAT | NVME_OACS_DBBUF);
     id->acl = 3;
     id->aerl = 3;
     id->frmw = 7 << 1 | 1;
@@ -108,7 +167,10 @@ static int nvme_init_ctrl (NvmeCtrl *n)
     id->sqes = (n->max_sqes << 4) | 0x6;
     id->cqes = (n->max_cqes << 4) | 0x4;
     id->nn = cpu_to_le32(n->num_namespaces);
-    id->oncs = cpu_to_le16(NVME_ONCS_FEATURES);
+    id->oncs = NVME_ONCS_FEATURES;
+    if (core.std_ftl == FTL_ID_APPNVM)
+        id->oncs |= NVME_ONCS_DSM | NVME_ONCS_WRITE_ZEROS | NVME_ONCS_COMPARE;
+    id->oncs = cpu_to_le16(id->oncs);
     id->fuses = cpu_to_le16(0);
     id->fna = 0;
     id->vwc = 0;
@@ -146,7 +208,7 @@ static int nvme_init_ctrl (NvmeCtrl *n)
     id->maxcmd = 0;
     id->nvscc = 0;
     id->acwu = cpu_to_le16(0);
-    id->sgls = cpu_to_le32(0);
+    id->sgls = cpu_to_le32(1); /* SGLs supported, no alignment required */
     id->vs[0] = 0;
 
     /* Controller features */
@@ -217,6 +279,10 @@ static int nvme_init_namespaces (NvmeCtrl *n)
 	id_ns->dpc = n->dpc;
 	id_ns->dps = n->dps;
 
+        /* AppNVM reads of deallocated LBAs return zeroes */
+        if (core.std_ftl == FTL_ID_APPNVM)
+            id_ns->dlfeat = 0x1;
+
         /* TODO: if we have more than 1 namespace, the metadata size
          per sector must be the lower size among all channels related
          to the namespace. */
@@ -235,7 +301,7 @@ static int nvme_init_namespaces (NvmeCtrl *n)
 	}
 
         lba_index = NVME_ID_NS_FLBAS_INDEX(ns->id_ns.flbas);
-	blks = n->ns_size[0] / ((1 << id_ns->lbaf[lba_index].ds));
+	blks = n->ns_size[i] / ((1 << id_ns->lbaf[lba_index].ds));
 
 	id_ns->nuse = id_ns->ncap = id_ns->nsze = cpu_to_le64(blks);
 
@@ -246,11 +312,15 @@ static int nvme_init_namespaces (NvmeCtrl *n)
 
         ns->id = i + 1;
 	ns->ctrl = n;
-	ns->start_block = 0;
 
-        /* To be checked */
+        /* First LBA in the device space of the FTL, in 4 KB sectors */
+	ns->start_block = core.nvm_ns[i].slba / NVME_KERNEL_PG_SIZE;
+
+        /* To be checked, the last byte makes the ids unique */
         memcpy (id_ns->eui64, "ox-ns\0", 6);
         memcpy (id_ns->nguid, "ox-ctrl-lnvm-ns\0", 16);
+        id_ns->eui64[7] = ns->id;
+        id_ns->nguid[15] = ns->id;
 
         /* Field not defined yet */
         id_ns->nmic = 0;
@@ -290,7 +360,7 @@ static int nvme_check_constraints (NvmeCtrl *n)
 	(n->dps & DPS_TYPE_MASK && !((n->dpc & NVME_ID_NS_DPC_TYPE_MASK) &
 				     (1 << ((n->dps & DPS_TYPE_MASK) - 1)))) ||
 	(n->mpsmax > 0xf || n->mpsmax < n->mpsmin) ||
-	(n->id_ctrl.oacs & ~(NVME_OACS_FORMAT)) ||
+	(n->id_ctrl.oacs & ~(NVME_OACS_FORMAT | NVME_OACS_DBBUF)) ||
 	(n->id_ctrl.oncs & ~(NVME_ONCS_FEATURES))) {
         return -1;
     }
@@ -300,9 +370,65 @@ static int nvme_check_constraints (NvmeCtrl *n)
 static void nvme_isr_notify(void *opaque)
 {
     NvmeCQ *cq = opaque;
+
+    atomic_set(&cq->coal_count, 0);
+    atomic_inc(&cq->irqs);
+    atomic_inc(&cq->ctrl->stat.tot_num_irq);
     core.nvm_pcie->ops->isr_notify(cq);
 }
 
+/*
+ * Reads the PRP list of a queue that is not physically contiguous. The list
+ * holds one entry per queue page, the last entry of each list page points to
+ * the next list page.
+ */
+static uint64_t *nvme_setup_discontig (NvmeCtrl *n, uint64_t prp_addr,
+                                        uint16_t queue_depth, uint16_t entry_size)
+{
+    uint32_t i, ents, total, prps_per_page = n->page_size / sizeof (uint64_t);
+    uint64_t *prp_list;
+
+    total = (queue_depth * entry_size + n->page_size - 1) / n->page_size;
+
+    prp_list = calloc (total, sizeof (uint64_t));
+    if (!prp_list)
+        return NULL;
+
+    i = 0;
+    while (i < total) {
+        if (!prp_addr || prp_addr & (n->page_size - 1))
+            goto ERR;
+
+        ents = (total - i > prps_per_page) ? prps_per_page - 1 : total - i;
+        nvme_addr_read (n, prp_addr, (void *)&prp_list[i],
+                                                     ents * sizeof (uint64_t));
+        i += ents;
+
+        if (i < total)
+            nvme_addr_read (n, prp_addr + ents * sizeof (uint64_t),
+                                          (void *)&prp_addr, sizeof (uint64_t));
+    }
+
+    for (i = 0; i < total; i++)
+        if (!prp_list[i] || prp_list[i] & (n->page_size - 1))
+            goto ERR;
+
+    return prp_list;
+
+ERR:
+    free (prp_list);
+    return NULL;
+}
+
+static inline uint64_t nvme_discontig_addr (NvmeCtrl *n, uint64_t *prp_list,
+                                            uint32_t index, uint16_t entry_size)
+{
+    uint16_t entries_per_page = n->page_size / entry_size;
+
+    return prp_list[index / entries_per_page] +
+                                      (index % entries_per_page) * entry_size;
+}
+
 uint16_t nvme_init_cq (NvmeCQ *cq, NvmeCtrl *n, uint64_t dma_addr,
                     uint16_t cqid, uint16_t vector, uint16_t size,
                     uint16_t irq_enabled, int contig)
@@ -317,8 +443,10 @@ uint16_t nvme_init_cq (NvmeCQ *cq, NvmeCtrl *n, uint64_t dma_addr,
     cq->phys_contig = contig;
     if (cq->phys_contig) {
         cq->dma_addr = dma_addr;
-    } else {
         cq->prp_list = NULL;
+    } else {
+        cq->dma_addr = 0;
+        cq->prp_list = nvme_setup_discontig (n, dma_addr, size, n->cqe_size);
         if (!cq->prp_list) {
             return NVME_INVALID_FIELD | NVME_DNR;
         }
@@ -328,6 +456,11 @@ uint16_t nvme_init_cq (NvmeCQ *cq, NvmeCtrl *n, uint64_t dma_addr,
     TAILQ_INIT(&cq->sq_list);
     cq->db_addr = 0;
     cq->eventidx_addr = 0;
+    cq->coal_count = 0;
+    cq->cqes = 0;
+    cq->irqs = 0;
+    if (n->dbbuf_enabled && cqid)
+        nvme_dbbuf_init_cq (n, cq);
     msix_vector_use(&core.qemu->parent_obj, cq->vector);
     n->cq[cqid] = cq;
     cq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_isr_notify, cq);
@@ -336,23 +469,100 @@ uint16_t nvme_init_cq (NvmeCQ *cq, NvmeCtrl *n, uint64_t dma_addr,
     return NVME_SUCCESS;
 }
 
+/* I/O SQs run in the device IOThread, if any, the admin SQ in the main loop */
+static AioContext *nvme_sq_aio_context (uint16_t sqid)
+{
+    if (!sqid || !core.qemu || !core.qemu->iothread ||
+                                                (core.run_flag & RUN_TESTS))
+        return NULL;
+
+    return iothread_get_aio_context (core.qemu->iothread);
+}
+
+static void nvme_sq_notifier (EventNotifier *e)
+{
+    NvmeSQ *sq = container_of(e, NvmeSQ, notifier);
+
+    if (event_notifier_test_and_clear(e))
+        nvme_process_sq(sq);
+}
+
+/*
+ * Binds the SQ tail doorbell to an eventfd handled in the IOThread, guest
+ * doorbell writes then kick the IOThread without going through the MMIO
+ * handler. Only used with shadow doorbells, since the written value is lost.
+ */
+static void nvme_init_sq_ioeventfd (NvmeCtrl *n, NvmeSQ *sq)
+{
+    AioContext *ctx = nvme_sq_aio_context (sq->sqid);
+    hwaddr offset = 0x1000 + ((2 * sq->sqid) << (2 + n->db_stride));
+
+    if (!ctx || sq->ioeventfd)
+        return;
+
+    if (event_notifier_init(&sq->notifier, 0)) {
+        log_err("[nvme: ioeventfd not available for SQ %d]\n", sq->sqid);
+        return;
+    }
+
+    memory_region_add_eventfd(&core.qemu->iomem, offset, 4, false, 0,
+                                                                &sq->notifier);
+    aio_context_acquire(ctx);
+    aio_set_event_notifier(ctx, &sq->notifier, true, nvme_sq_notifier);
+    aio_context_release(ctx);
+    sq->ioeventfd = 1;
+}
+
+static void nvme_free_sq_ioeventfd (NvmeCtrl *n, NvmeSQ *sq)
+{
+    AioContext *ctx = nvme_sq_aio_context (sq->sqid);
+    hwaddr offset = 0x1000 + ((2 * sq->sqid) << (2 + n->db_stride));
+
+    if (!sq->ioeventfd)
+        return;
+
+    memory_region_del_eventfd(&core.qemu->iomem, offset, 4, false, 0,
+                                                                &sq->notifier);
+    aio_context_acquire(ctx);
+    aio_set_event_notifier(ctx, &sq->notifier, true, NULL);
+    aio_context_release(ctx);
+    event_notifier_cleanup(&sq->notifier);
+    sq->ioeventfd = 0;
+}
+
+/* Commands fetched from a SQ each time it is selected, AB 7 is no limit */
+static uint32_t nvme_arb_burst (NvmeCtrl *n)
+{
+    uint8_t ab = NVME_ARB_AB(n->features.arbitration);
+
+    return (ab == 7) ? UINT32_MAX : 1 << ab;
+}
+
 uint16_t nvme_init_sq (NvmeSQ *sq, NvmeCtrl *n, uint64_t dma_addr,
                     uint16_t sqid, uint16_t cqid, uint16_t size,
                     enum NvmeQFlags prio, int contig)
 {
     int i;
     NvmeCQ *cq;
+    AioContext *ctx;
 
     sq->ctrl = n;
     sq->sqid = sqid;
     sq->size = size;
     sq->cqid = cqid;
     sq->head = sq->tail = 0;
+    sq->held = NULL;
     sq->phys_contig = contig;
+    sq->cmb_sqes = NULL;
     if (sq->phys_contig) {
         sq->dma_addr = dma_addr;
-    } else {
         sq->prp_list = NULL;
+        /* SQEs are read from controller memory, not fetched by DMA */
+        sq->cmb_sqes = nvme_cmb_addr (n, dma_addr, (uint64_t) size *
+                                                                n->sqe_size);
+    } else {
+        sq->dma_addr = 0;
+        sq->prp_list = nvme_setup_discontig (n, dma_addr, size, n->sqe_size);
         if (!sq->prp_list) {
             return NVME_INVALID_FIELD | NVME_DNR;
         }
@@ -363,33 +573,36 @@ uint16_t nvme_init_sq (NvmeSQ *sq, NvmeCtrl *n, uint64_t dma_addr,
     TAILQ_INIT(&sq->out_req_list);
     for (i = 0; i < sq->size; i++) {
         sq->io_req[i].sq = sq;
-        pthread_mutex_init (&sq->io_req[i].nvm_io.mutex, NULL);
+        sq->io_req[i].nvm_io = NULL;
         TAILQ_INSERT_TAIL(&(sq->req_list), &sq->io_req[i], entry);
     }
 
-    switch (prio) {
-    case NVME_Q_PRIO_URGENT:
-        sq->arb_burst = (1 << NVME_ARB_AB(n->features.arbitration));
-        break;
-    case NVME_Q_PRIO_HIGH:
-        sq->arb_burst = NVME_ARB_HPW(n->features.arbitration) + 1;
-        break;
-    case NVME_Q_PRIO_NORMAL:
-        sq->arb_burst = NVME_ARB_MPW(n->features.arbitration) + 1;
-        break;
-    case NVME_Q_PRIO_LOW:
-    default:
-        sq->arb_burst = NVME_ARB_LPW(n->features.arbitration) + 1;
-        break;
-    }
-    sq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_process_sq, sq);
+    /* The priority class is only used with weighted round robin, the
+     * class weights are credits of the arbitration round, not bursts */
+    sq->prio = prio;
+    sq->arb_burst = nvme_arb_burst (n);
+    if (sqid) {
+        n->qsched.prio_avail[prio]++;
+        n->qsched.n_active_iosqs++;
+    }
+
+    ctx = nvme_sq_aio_context (sqid);
+    sq->timer = (ctx) ?
+            aio_timer_new(ctx, QEMU_CLOCK_VIRTUAL, SCALE_NS, nvme_process_sq, sq)
+            : timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_process_sq, sq);
     sq->db_addr = 0;
     sq->eventidx_addr = 0;
+    sq->ioeventfd = 0;
 
     assert(n->cq[cqid]);
     cq = n->cq[cqid];
     TAILQ_INSERT_TAIL(&(cq->sq_list), sq, entry);
+    pthread_mutex_lock (&n->db_mutex);
     n->sq[sqid] = sq;
+    pthread_mutex_unlock (&n->db_mutex);
+
+    if (n->dbbuf_enabled && sqid)
+        nvme_dbbuf_init_sq (n, sq);
 
     log_info("\n[nvme: init SQ qid: %d\n", sqid);
 
@@ -448,12 +661,34 @@ static int nvme_start_ctrl (NvmeCtrl *n)
 
 void nvme_free_sq (NvmeSQ *sq, NvmeCtrl *n)
 {
+    AioContext *ctx = nvme_sq_aio_context (sq->sqid);
     uint32_t i;
 
-    for (i = 0; i < sq->size; i++)
-        pthread_mutex_destroy (&sq->io_req[i].nvm_io.mutex);
+    /* nvme_process_sq may be running in the IOThread, it is excluded until
+     * the SQ is gone */
+    if (ctx)
+        aio_context_acquire(ctx);
 
+    /* Unpublish first, a doorbell write may be arming the timer */
+    pthread_mutex_lock (&n->db_mutex);
+    if (sq->sqid && n->sq[sq->sqid] == sq) {
+        n->qsched.prio_avail[sq->prio]--;
+        n->qsched.n_active_iosqs--;
+    }
     n->sq[sq->sqid] = NULL;
+    pthread_mutex_unlock (&n->db_mutex);
+
+    nvme_free_sq_ioeventfd (n, sq);
+    if (sq->timer) {
+        timer_del (sq->timer);
+        timer_free (sq->timer);
+        sq->timer = NULL;
+    }
+
+    for (i = 0; i < sq->size; i++)
+        if (sq->io_req[i].nvm_io)
+            nvme_put_io_cmd (n, sq->io_req[i].nvm_io);
+
     FREE_VALID (sq->io_req);
     FREE_VALID (sq->prp_list);
 
@@ -463,10 +698,23 @@ void nvme_free_sq (NvmeSQ *sq, NvmeCtrl *n)
     SAFE_CLOSE (sq->fd_qmem);
     if (sq->sqid)
 	FREE_VALID (sq);
+
+    if (ctx)
+        aio_context_release(ctx);
 }
 
 void nvme_free_cq (NvmeCQ *cq, NvmeCtrl *n)
 {
+    if (cq->timer) {
+        timer_del (cq->timer);
+        timer_free (cq->timer);
+        cq->timer = NULL;
+    }
+
+    if (cq->cqid)
+        log_info(" [nvme: CQ %d: %lu interrupts for %lu CQEs]\n",
+                                                cq->cqid, cq->irqs, cq->cqes);
+
     n->cq[cq->cqid] = NULL;
     if (cq->prp_list)
 	FREE_VALID (cq->prp_list);
@@ -490,6 +738,10 @@ static void nvme_clear_ctrl (NvmeCtrl *n)
     }
 
     n->running = 0;
+
+    /* NDP jobs complete to the I/O queues */
+    ox_ndp_drain ();
+
     if (n->sq)
         for (i = 0; i < n->num_queues; i++)
             if (n->sq[i] != NULL)
@@ -512,6 +764,8 @@ static void nvme_clear_ctrl (NvmeCtrl *n)
     n->features.temp_thresh = 0x14d;
     n->temp_warn_issued = 0;
     n->outstanding_aers = 0;
+    n->dbbuf_enabled = 0;
+    n->dbbuf_dbs = n->dbbuf_eis = 0;
 }
 
 void nvme_process_reg (NvmeCtrl *n, uint64_t offset, uint64_t data)
@@ -536,7 +790,10 @@ void nvme_process_reg (NvmeCtrl *n, uint64_t offset, uint64_t data)
                 } else {
                     n->nvme_regs.vBar.csts = NVME_CSTS_READY;
                 }
-                n->qsched.WRR = n->nvme_regs.vBar.cc & 0x3800;
+                n->qsched.WRR = NVME_CC_AMS(n->nvme_regs.vBar.cc) ==
+                                                            NVME_CC_AMS_WRR;
+                if (n->qsched.WRR)
+                    log_info("[nvme: weighted round robin arbitration]\n");
             } else if (!NVME_CC_EN(data) && \
 		NVME_CC_EN(n->nvme_regs.vBar.cc)) {
 		syslog(LOG_DEBUG,"[nvme: Nvme !EN]\n");
@@ -590,9 +847,15 @@ static inline uint8_t nvme_sq_empty (NvmeSQ *sq)
 
 inline uint8_t nvme_write_to_host(void *src, uint64_t prp, ssize_t size)
 {
+    uint8_t *cmb;
+
     if (prp) {
         if (core.run_flag & RUN_TESTS)
             memcpy ((void *) prp, src, size);
+        else if (prp & NVME_LOCAL_ADDR)
+            memcpy ((void *)(uintptr_t)(prp & ~NVME_LOCAL_ADDR), src, size);
+        else if ((cmb = nvme_cmb_addr (nvm_nvme_ctrl, prp, size)))
+            memcpy (cmb, src, size);
         else
             pci_dma_write(&core.qemu->parent_obj, prp, src, size);
 
@@ -603,9 +866,15 @@ inline uint8_t nvme_write_to_host(void *src, uint64_t prp, ssize_t size)
 
 inline uint8_t nvme_read_from_host(void *dest, uint64_t prp, ssize_t size)
 {
+    uint8_t *cmb;
+
     if (prp) {
         if (core.run_flag & RUN_TESTS)
             memcpy (dest, (void *) prp, size);
+        else if (prp & NVME_LOCAL_ADDR)
+            memcpy (dest, (void *)(uintptr_t)(prp & ~NVME_LOCAL_ADDR), size);
+        else if ((cmb = nvme_cmb_addr (nvm_nvme_ctrl, prp, size)))
+            memcpy (dest, cmb, size);
         else
             pci_dma_read(&core.qemu->parent_obj, prp, dest, size);
 
@@ -614,12 +883,280 @@ inline uint8_t nvme_read_from_host(void *dest, uint64_t prp, ssize_t size)
     return NVME_INVALID_FIELD;
 }
 
+/*
+ * Maps 'size' bytes of guest memory at 'prp' into the controller address
+ * space. Returns NULL if the region cannot be mapped at once (e.g. it is not
+ * guest RAM), the caller must fall back to nvme_write/read_to/from_host.
+ */
+void *nvme_map_host (uint64_t prp, ssize_t size, uint8_t to_host)
+{
+    dma_addr_t len = size;
+    void *ptr;
+
+    if (!prp || !size)
+        return NULL;
+
+    if (core.run_flag & RUN_TESTS)
+        return (void *) prp;
+
+    /* Not mapped, nvme_unmap_host could not tell it from guest RAM */
+    if (prp & NVME_LOCAL_ADDR)
+        return NULL;
+
+    /* Data in the CMB is already in controller memory */
+    ptr = nvme_cmb_addr (nvm_nvme_ctrl, prp, size);
+    if (ptr)
+        return ptr;
+
+    ptr = pci_dma_map(&core.qemu->parent_obj, prp, &len, (to_host) ?
+                        DMA_DIRECTION_FROM_DEVICE : DMA_DIRECTION_TO_DEVICE);
+    if (!ptr)
+        return NULL;
+
+    if (len < size) {
+        pci_dma_unmap(&core.qemu->parent_obj, ptr, len, (to_host) ?
+                     DMA_DIRECTION_FROM_DEVICE : DMA_DIRECTION_TO_DEVICE, 0);
+        return NULL;
+    }
+
+    return ptr;
+}
+
+void nvme_unmap_host (void *ptr, ssize_t size, uint8_t to_host)
+{
+    if (!ptr || (core.run_flag & RUN_TESTS) ||
+                                            nvme_cmb_ptr (nvm_nvme_ctrl, ptr))
+        return;
+
+    pci_dma_unmap(&core.qemu->parent_obj, ptr, size, (to_host) ?
+                  DMA_DIRECTION_FROM_DEVICE : DMA_DIRECTION_TO_DEVICE,
+                  (to_host) ? size : 0);
+}
+
+static int nvme_io_pool_grow (NvmeIoPool *pool)
+{
+    struct nvme_io_slab *slab;
+    int i;
+
+    slab = malloc (sizeof (struct nvme_io_slab));
+    if (!slab)
+        return -1;
+
+    for (i = 0; i < NVME_IO_SLAB_CMDS; i++) {
+        pthread_mutex_init (&slab->cmd[i].mutex, NULL);
+        slab->cmd[i].pool = pool;
+        slab->cmd[i].next = pool->free;
+        pool->free = &slab->cmd[i];
+    }
+
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+    pool->n_slabs++;
+
+    return 0;
+}
+
+struct nvm_io_cmd *nvme_get_io_cmd (NvmeCtrl *n, uint16_t qid)
+{
+    NvmeIoPool *pool = &n->io_pool[qid % NVME_IO_SHARDS];
+    struct nvm_io_cmd *cmd = NULL;
+
+    pthread_mutex_lock (&pool->mutex);
+    if (!pool->free && nvme_io_pool_grow (pool))
+        goto OUT;
+
+    cmd = pool->free;
+    pool->free = cmd->next;
+    cmd->next = NULL;
+    memset (&cmd->lat, 0x0, sizeof (struct nvm_io_lat));
+    pool->in_use++;
+
+OUT:
+    pthread_mutex_unlock (&pool->mutex);
+    return cmd;
+}
+
+void nvme_put_io_cmd (NvmeCtrl *n, struct nvm_io_cmd *cmd)
+{
+    NvmeIoPool *pool = cmd->pool;
+
+    pthread_mutex_lock (&pool->mutex);
+    cmd->next = pool->free;
+    pool->free = cmd;
+    pool->in_use--;
+    pthread_mutex_unlock (&pool->mutex);
+}
+
+static void nvme_io_pool_init (NvmeIoPool *pool)
+{
+    pool->slabs = NULL;
+    pool->free = NULL;
+    pool->n_slabs = 0;
+    pool->in_use = 0;
+    pthread_mutex_init (&pool->mutex, NULL);
+}
+
+static void nvme_io_pool_exit (NvmeIoPool *pool)
+{
+    struct nvme_io_slab *slab;
+    int i;
+
+    if (pool->in_use)
+        log_err ("[nvme: %u I/O descriptors still in use at exit]\n",
+                                                                pool->in_use);
+
+    while (pool->slabs) {
+        slab = pool->slabs;
+        pool->slabs = slab->next;
+        for (i = 0; i < NVME_IO_SLAB_CMDS; i++)
+            pthread_mutex_destroy (&slab->cmd[i].mutex);
+        free (slab);
+    }
+    pool->free = NULL;
+    pool->n_slabs = 0;
+    pthread_mutex_destroy (&pool->mutex);
+}
+
+/*
+ * Fills 'prp' with one host page per sector from PRP1/PRP2. If more than 2
+ * pages are used, PRP2 points to a PRP list. The list may start at any offset
+ * in a page and the last entry of a full list page points to the next one.
+ */
+static uint16_t nvme_map_prp (NvmeCtrl *n, uint64_t *prp, uint64_t prp1,
+                                                uint64_t prp2, uint32_t n_sec)
+{
+    uint32_t i, ents;
+    uint64_t list = prp2;
+
+    prp[0] = prp1;
+    if (n_sec == 1)
+        return NVME_SUCCESS;
+
+    if (!prp2)
+        return NVME_INVALID_FIELD | NVME_DNR;
+
+    if (n_sec == 2) {
+        prp[1] = prp2;
+        return NVME_SUCCESS;
+    }
+
+    /* In tests mode the list is a flat controller buffer */
+    if (core.run_flag & RUN_TESTS) {
+        nvme_read_from_host ((void *)&prp[1], prp2,
+                                                (n_sec - 1) * sizeof(uint64_t));
+        return NVME_SUCCESS;
+    }
+
+    i = 1;
+    while (i < n_sec) {
+        if (!list || list & (sizeof (uint64_t) - 1))
+            return NVME_INVALID_FIELD | NVME_DNR;
+
+        ents = (n->page_size - (list & (n->page_size - 1))) /
+                                                            sizeof (uint64_t);
+        if (n_sec - i > ents)
+            ents--; /* last entry is the pointer to the next list page */
+        else
+            ents = n_sec - i;
+
+        nvme_read_from_host ((void *)&prp[i], list, ents * sizeof (uint64_t));
+        i += ents;
+
+        if (i < n_sec)
+            nvme_read_from_host ((void *)&list, list + ents * sizeof(uint64_t),
+                                                            sizeof (uint64_t));
+    }
+
+    return NVME_SUCCESS;
+}
+
+/*
+ * Fills 'prp' with one host address per sector from the SGL in the command.
+ * Data blocks must be a multiple of the sector size, bit buckets are not
+ * supported. Every segment must carry a data block, which bounds the chain
+ * by the sector count, so a guest cannot make it loop.
+ */
+static uint16_t nvme_map_sgl (NvmeCtrl *n, uint64_t *prp, NvmeSglDesc *sgl,
+                                               uint32_t n_sec, uint32_t sec_sz)
+{
+    NvmeSglDesc seg_desc[NVME_SGL_SEG_DESCS];
+    NvmeSglDesc *desc = sgl;
+    uint64_t seg = 0, off;
+    uint32_t i = 0, c, n_desc = 1, seg_left = 0;
+    uint32_t n_seg = 0, seg_data = 0;
+    uint8_t last_seg = 0;
+
+    while (1) {
+        for (c = 0; c < n_desc; c++, desc++) {
+            switch (NVME_SGL_TYPE(desc->type)) {
+                case NVME_SGL_DATA_BLOCK:
+                    if (!desc->len || desc->len % sec_sz)
+                        return NVME_DATA_SGL_LEN_INVALID | NVME_DNR;
+
+                    for (off = 0; off < desc->len && i < n_sec; off += sec_sz)
+                        prp[i++] = desc->addr + off;
+                    seg_data++;
+                    break;
+                case NVME_SGL_SEGMENT:
+                case NVME_SGL_LAST_SEGMENT:
+                    /* Only the last descriptor of a segment may point to the
+                     * next segment, and not inside the last segment */
+                    if (last_seg || c != n_desc - 1 || seg_left || !desc->len
+                                    || desc->len % sizeof (NvmeSglDesc))
+                        return NVME_INVALID_SGL_SEG_DESC | NVME_DNR;
+
+                    if ((n_seg && !seg_data) || ++n_seg > n_sec + 1)
+                        return NVME_SGL_DESC_TYPE_INVALID | NVME_DNR;
+                    seg_data = 0;
+
+                    last_seg = NVME_SGL_TYPE(desc->type) ==
+                                                         NVME_SGL_LAST_SEGMENT;
+                    seg = desc->addr;
+                    seg_left = desc->len / sizeof (NvmeSglDesc);
+                    break;
+                default:
+                    return NVME_SGL_DESC_TYPE_INVALID | NVME_DNR;
+            }
+        }
+
+        if (i == n_sec)
+            return NVME_SUCCESS;
+
+        if (!seg_left)
+            return NVME_DATA_SGL_LEN_INVALID | NVME_DNR;
+
+        n_desc = (seg_left > NVME_SGL_SEG_DESCS) ?
+                                                NVME_SGL_SEG_DESCS : seg_left;
+        nvme_read_from_host ((void *)seg_desc, seg,
+                                             n_desc * sizeof (NvmeSglDesc));
+        seg += n_desc * sizeof (NvmeSglDesc);
+        seg_left -= n_desc;
+        desc = seg_desc;
+    }
+}
+
+/* Maps the data pointer of an I/O command to one host address per sector */
+uint16_t nvme_map_dptr (NvmeCtrl *n, uint64_t *prp, NvmeCmd *cmd,
+                                               uint32_t n_sec, uint32_t sec_sz)
+{
+    switch (cmd->psdt) {
+        case CMD_PSDT_PRP:
+        case CMD_PSDT_RSV:
+            return nvme_map_prp (n, prp, cmd->prp1, cmd->prp2, n_sec);
+        case CMD_PSDT_SGL:
+        case CMD_PSDT_SGL_MD:
+            return nvme_map_sgl (n, prp, (NvmeSglDesc *) &cmd->prp1,
+                                                                n_sec, sec_sz);
+    }
+    return NVME_INVALID_FIELD | NVME_DNR;
+}
+
 void nvme_addr_read (NvmeCtrl *n, uint64_t addr, void *buf, int size)
 {
-    if (n->cmbsz && addr >= core.qemu->ctrl_mem.addr &&
-                addr < (core.qemu->ctrl_mem.addr +
-                int128_get64(core.qemu->ctrl_mem.size))) {
-        memcpy(buf, (void *)&n->cmbuf[addr - core.qemu->ctrl_mem.addr], size);
+    uint8_t *cmb = nvme_cmb_addr (n, addr, size);
+
+    if (cmb) {
+        memcpy(buf, cmb, size);
     } else {
         pci_dma_read(&core.qemu->parent_obj, addr, buf, size);
     }
@@ -627,16 +1164,55 @@ void nvme_addr_read (NvmeCtrl *n, uint64_t addr, void *buf, int size)
 
 void nvme_addr_write (NvmeCtrl *n, uint64_t addr, void *buf, int size)
 {
-    if (n->cmbsz && addr >= core.qemu->ctrl_mem.addr &&
-                addr < (core.qemu->ctrl_mem.addr +
-                int128_get64(core.qemu->ctrl_mem.size))) {
-        memcpy((void *)&n->cmbuf[addr - core.qemu->ctrl_mem.addr], buf, size);
-        return;
+    uint8_t *cmb = nvme_cmb_addr (n, addr, size);
+
+    if (cmb) {
+        memcpy(cmb, buf, size);
     } else {
         pci_dma_write(&core.qemu->parent_obj, addr, buf, size);
     }
 }
 
+/*
+ * Shadow doorbells: queue y uses the doorbell buffer entries of its MMIO
+ * doorbells, SQ y tail at 2y and CQ y head at 2y + 1, in units of the
+ * doorbell stride. The EventIdx buffer has the same layout.
+ */
+void nvme_dbbuf_init_sq (NvmeCtrl *n, NvmeSQ *sq)
+{
+    uint64_t off = (2 * sq->sqid) * (4 << n->db_stride);
+
+    sq->db_addr = n->dbbuf_dbs + off;
+    sq->eventidx_addr = n->dbbuf_eis + off;
+
+    nvme_init_sq_ioeventfd (n, sq);
+}
+
+void nvme_dbbuf_init_cq (NvmeCtrl *n, NvmeCQ *cq)
+{
+    uint64_t off = (2 * cq->cqid + 1) * (4 << n->db_stride);
+
+    cq->db_addr = n->dbbuf_dbs + off;
+    cq->eventidx_addr = n->dbbuf_eis + off;
+}
+
+/* The host rings the MMIO doorbell only if its new tail passes the EventIdx */
+static inline void nvme_update_sq_eventidx (NvmeSQ *sq)
+{
+    if (sq->eventidx_addr) {
+        nvme_addr_write (sq->ctrl, sq->eventidx_addr, &sq->tail,
+                                                          sizeof (sq->tail));
+    }
+}
+
+static inline void nvme_update_cq_eventidx (NvmeCQ *cq)
+{
+    if (cq->eventidx_addr) {
+        nvme_addr_write (cq->ctrl, cq->eventidx_addr, &cq->head,
+                                                          sizeof (cq->head));
+    }
+}
+
 static inline void nvme_update_sq_tail (NvmeSQ *sq)
 {
     if (sq->db_addr) {
@@ -661,6 +1237,8 @@ static inline void nvme_inc_cq_tail (NvmeCQ *cq)
 static inline void nvme_update_cq_head (NvmeCQ *cq)
 {
     if (cq->db_addr) {
+        nvme_update_cq_eventidx (cq);
+        smp_mb ();
     	nvme_addr_read (cq->ctrl, cq->db_addr, &cq->head, sizeof (cq->head));
     }
 }
@@ -671,13 +1249,6 @@ static inline uint8_t nvme_cq_full (NvmeCQ *cq)
     return (cq->tail + 1) % cq->size == cq->head;
 }
 
-static inline int nvme_cqes_pending (NvmeCQ *cq)
-{
-    return cq->tail > cq->head ?
-	cq->head + (cq->size - cq->tail) :
-	cq->head - cq->tail;
-}
-
 int nvme_check_cqid (NvmeCtrl *n, uint16_t cqid)
 {
     return cqid < n->num_queues && n->cq[cqid] != NULL ? 0 : -1;
@@ -688,6 +1259,21 @@ int nvme_check_sqid (NvmeCtrl *n, uint16_t sqid)
     return sqid < n->num_queues && n->sq[sqid] != NULL ? 0 : -1;
 }
 
+/* Only commands completed by the FTL were timed */
+static void nvme_lat_record_cqe (struct nvm_io_cmd *cmd)
+{
+    uint64_t now;
+
+    if (!cmd->lat.tdone)
+        return;
+
+    now = ox_lat_now ();
+    ox_lat_record (OX_LAT_CQ, cmd->cmdtype, cmd->lat.ch, cmd->cid,
+                                                        cmd->lat.tdone, now);
+    ox_lat_record (OX_LAT_TOTAL, cmd->cmdtype, cmd->lat.ch, cmd->cid,
+                                                       cmd->lat.tfetch, now);
+}
+
 static void nvme_post_cqe (NvmeCQ *cq, NvmeRequest *req)
 {
     NvmeCtrl *n = cq->ctrl;
@@ -713,7 +1299,7 @@ static void nvme_post_cqe (NvmeCQ *cq, NvmeRequest *req)
     if (cq->phys_contig)
 	addr = cq->dma_addr + cq->tail * n->cqe_size;
     else
-	addr = 0;
+	addr = nvme_discontig_addr (n, cq->prp_list, cq->tail, n->cqe_size);
 
     cqe->status = cpu_to_le16((req->status << 1) | phase);
     cqe->sq_id = sq->sqid;
@@ -726,15 +1312,29 @@ static void nvme_post_cqe (NvmeCQ *cq, NvmeRequest *req)
     /* In case of timeout request, we have to avoid reusing the same structure
      * TODO: Replace structures in case of timeout */
 
+    if (req->nvm_io) {
+        nvme_lat_record_cqe (req->nvm_io);
+        nvme_put_io_cmd (n, req->nvm_io);
+        req->nvm_io = NULL;
+    }
     TAILQ_INSERT_TAIL (&sq->req_list, req, entry);
     if (cq->hold_sqs) cq->hold_sqs = 0;
 }
 
-void nvme_enqueue_req_completion (NvmeCQ *cq, NvmeRequest *req)
+static void nvme_cq_notify (NvmeCQ *cq)
+{
+    nvme_isr_notify(cq);
+    if (timer_pending(cq->timer)) {
+        timer_del(cq->timer);
+    }
+}
+
+/* Posts the CQE, returns 1 if the host must be notified right away */
+static int nvme_enqueue_one_cqe (NvmeCQ *cq, NvmeRequest *req)
 {
     NvmeCtrl *n = cq->ctrl;
     uint64_t time_ns = NVME_INTC_TIME(n->features.int_coalescing) * 100000;
-    uint8_t thresh = NVME_INTC_THR(n->features.int_coalescing) + 1;
+    unsigned int thresh = NVME_INTC_THR(n->features.int_coalescing) + 1;
     uint8_t coalesce_disabled =
         		(n->features.int_vector_config[cq->vector] >> 16) & 1;
     uint8_t notify;
@@ -748,27 +1348,103 @@ void nvme_enqueue_req_completion (NvmeCQ *cq, NvmeRequest *req)
     	pthread_mutex_lock(&n->req_mutex);
 	TAILQ_INSERT_TAIL (&cq->req_list, req, entry);
 	pthread_mutex_unlock(&n->req_mutex);
-	return;
+	return 0;
     }
 
+    /* The interrupt is deferred until 'thresh' CQEs are posted or the
+     * aggregation time since the first deferred CQE expires. Admin and
+     * error completions are never delayed. */
     notify = coalesce_disabled || !req->sq->sqid || !time_ns ||
-	req->status != NVME_SUCCESS || nvme_cqes_pending(cq) >= thresh;
+        req->status != NVME_SUCCESS ||
+        atomic_fetch_inc(&cq->coal_count) + 1 >= thresh;
 
     pthread_mutex_lock(&n->req_mutex);
     nvme_post_cqe (cq, req);
     pthread_mutex_unlock(&n->req_mutex);
+    atomic_inc(&cq->cqes);
+    atomic_inc(&n->stat.tot_num_cqe);
 
     if (!notify) {
         if (!timer_pending(cq->timer)) {
             timer_mod(cq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
                     time_ns);
         }
-    } else {
-        nvme_isr_notify(cq);
-        if (timer_pending(cq->timer)) {
-            timer_del(cq->timer);
+    }
+
+    return notify;
+}
+
+/* Posts the CQE of the request and of the requests merged to it, the merged
+ * requests complete with the status of the FTL command */
+static int nvme_enqueue_cqe (NvmeCQ *cq, NvmeRequest *req)
+{
+    NvmeRequest *next = req->merged;
+    uint16_t status = req->status;
+    int notify;
+
+    req->merged = NULL;
+    notify = nvme_enqueue_one_cqe (cq, req);
+
+    while (next) {
+        req = next;
+        next = req->merged;
+        req->merged = NULL;
+        req->status = status;
+        notify |= nvme_enqueue_one_cqe (cq, req);
+    }
+
+    return notify;
+}
+
+void nvme_enqueue_req_completion (NvmeCQ *cq, NvmeRequest *req)
+{
+    if (nvme_enqueue_cqe (cq, req))
+        nvme_cq_notify (cq);
+}
+
+/*
+ * Posts the CQEs of a set of requests and notifies each CQ at most once,
+ * after all the CQEs that belong to it are in host memory.
+ */
+void nvme_enqueue_req_completion_batch (NvmeRequest **req, int count)
+{
+    NvmeCQ *cq[NVME_MAX_CQE_BATCH];
+    uint8_t notify[NVME_MAX_CQE_BATCH];
+    NvmeCQ *req_cq;
+    int i, j, ncq = 0;
+
+    if (count > NVME_MAX_CQE_BATCH) {
+        nvme_enqueue_req_completion_batch (req, NVME_MAX_CQE_BATCH);
+        nvme_enqueue_req_completion_batch (&req[NVME_MAX_CQE_BATCH],
+                                                count - NVME_MAX_CQE_BATCH);
+        return;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (req[i]->fabrics_cb) {
+            req[i]->fabrics_cb (req[i]);
+            continue;
+        }
+
+        req_cq = req[i]->sq->ctrl->cq[req[i]->sq->cqid];
+
+        for (j = 0; j < ncq; j++)
+            if (cq[j] == req_cq)
+                break;
+
+        if (j == ncq) {
+            cq[ncq] = req_cq;
+            notify[ncq] = 0;
+            ncq++;
         }
+
+        if (nvme_enqueue_cqe (req_cq, req[i]))
+            notify[j] = 1;
     }
+
+    for (j = 0; j < ncq; j++)
+        if (notify[j])
+            nvme_cq_notify (cq[j]);
 }
 
 void nvme_enqueue_event (NvmeCtrl *n, uint8_t event_type,
@@ -838,14 +1514,16 @@ uint16_t nvme_admin_cmd (NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
             if (NVME_OACS_FORMAT & n->id_ctrl.oacs)
                   return nvme_format (n, cmd);
             return NVME_INVALID_OPCODE | NVME_DNR;
+        case NVME_ADM_CMD_DB_BUF_CONFIG:
+            if (NVME_OACS_DBBUF & n->id_ctrl.oacs)
+                  return nvme_dbbuf_config (n, cmd);
+            return NVME_INVALID_OPCODE | NVME_DNR;
 
         /* Near-data processing */
         case NDP_ADM_CMD_INFO:
-            return NVME_SUCCESS;
         case NDP_ADM_CMD_INST_DAEM:
-            return NVME_SUCCESS;
         case NDP_ADM_CMD_DEL_DAEM:
-            return NVME_SUCCESS;
+            return ox_ndp_admin_cmd (n, cmd, req);
 
         case LNVM_ADM_CMD_IDENTITY:
             return lnvm_identity(n, cmd);
@@ -866,11 +1544,20 @@ uint16_t nvme_admin_cmd (NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
     }
 }
 
-static uint16_t nvme_io_cmd (NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
+uint16_t nvme_io_cmd (NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
 {
     NvmeNamespace *ns;
     uint32_t nsid = cmd->nsid;
 
+    /* A requeued command keeps its nvm_io and the first fetch time */
+    if (!req->nvm_io) {
+        req->nvm_io = nvme_get_io_cmd (n, (req->sq) ? req->sq->sqid : 0);
+        if (!req->nvm_io)
+            return NVME_INTERNAL_DEV_ERROR;
+        req->nvm_io->lat.tfetch = ox_lat_now ();
+    }
+    req->nvm_io->status.status = NVM_IO_NEW;
+
     if (nsid == 0 || nsid > n->num_namespaces) {
 	log_err("[ERROR nvme: io cmd, bad nsid %d]\n", nsid);
 	return NVME_INVALID_NSID | NVME_DNR;
@@ -906,14 +1593,18 @@ static uint16_t nvme_io_cmd (NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
 
         case LNVM_CMD_ERASE_SYNC:
             if (lnvm_dev(n))
-                return lnvm_erase_sync(n, ns, cmd, req);
+                return lnvm_erase(n, ns, cmd, req);
+            return NVME_INVALID_OPCODE | NVME_DNR;
+
+        case LNVM_CMD_VECTOR_COPY:
+            if (lnvm_dev(n))
+                return lnvm_copy(n, ns, cmd, req);
             return NVME_INVALID_OPCODE | NVME_DNR;
 
         /* Near-data processing */
         case NDP_EXEC_RUN_JOB:
-            return NVME_SUCCESS;
         case NDP_EXEC_DAEM_REQ:
-            return NVME_SUCCESS;
+            return ox_ndp_exec_cmd (n, ns, cmd, req);
 
         /* Commands not supported yet */
 
@@ -927,6 +1618,7 @@ static uint16_t nvme_io_cmd (NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
             if (NVME_ONCS_DSM & n->id_ctrl.oncs) {
                 return nvme_dsm(n, ns, cmd, req);
             }
+            return NVME_INVALID_OPCODE | NVME_DNR;
 
 	case NVME_CMD_COMPARE:
             if (NVME_ONCS_COMPARE & n->id_ctrl.oncs) {
@@ -956,18 +1648,96 @@ void nvme_rw_cb (void *opaque)
 {
     NvmeRequest *req = (NvmeRequest *) opaque;
     NvmeSQ *sq = req->sq;
-    NvmeCtrl *n = sq->ctrl;
-    NvmeCQ *cq = n->cq[sq->cqid];
+
+    if (req->fabrics_cb) {
+        req->fabrics_cb (req);
+        return;
+    }
 
     /* TODO: Calculate here n->stats like bytes read/written */
 
-    nvme_enqueue_req_completion (cq, req);
+    nvme_enqueue_req_completion (sq->ctrl->cq[sq->cqid], req);
 }
 
-static void nvme_process_sq (void *opaque)
+/* Backoff before fetching again a command that found the FTL queue full */
+#define NVME_SQ_FULL_DELAY_NS   10000
+
+/*
+ * Gives back the request of a command the FTL did not accept. The SQ head
+ * was not advanced for it, so the SQE is fetched again later.
+ */
+static void nvme_sq_requeue (NvmeSQ *sq, NvmeRequest *req)
 {
-    NvmeSQ *sq = (NvmeSQ *) opaque;
+    NvmeCtrl *n = sq->ctrl;
+
+    pthread_mutex_lock(&n->req_mutex);
+    TAILQ_REMOVE (&sq->out_req_list, req, entry);
+    TAILQ_INSERT_HEAD (&sq->req_list, req, entry);
+    pthread_mutex_unlock(&n->req_mutex);
+
+    sq->posted--;
+
+    /* The command is counted again when it is fetched */
+    n->stat.tot_num_IOCmd--;
+    switch (req->cmd.opcode) {
+        case NVME_CMD_READ:
+        case LNVM_CMD_PHYS_READ:
+            n->stat.tot_num_ReadCmd--;
+            break;
+        case NVME_CMD_WRITE:
+        case LNVM_CMD_PHYS_WRITE:
+        case LNVM_CMD_HYBRID_WRITE:
+            n->stat.tot_num_WriteCmd--;
+            break;
+    }
+    n->stat.tot_num_requeue++;
+}
+
+static uint8_t nvme_rw_can_merge (NvmeSQ *sq, NvmeCmd *cmd)
+{
+    return sq->sqid && !core.lnvm && core.std_ftl == FTL_ID_APPNVM &&
+                (!core.qemu || core.qemu->merge) &&
+                (cmd->opcode == NVME_CMD_READ || cmd->opcode == NVME_CMD_WRITE);
+}
+
+/*
+ * Submits a command held for merging to the FTL. Returns -1 if the FTL queue
+ * is full. Its SQEs are consumed already, so it is kept in sq->held and
+ * submitted again before the SQ is fetched from.
+ */
+static int nvme_submit_merged (NvmeSQ *sq, NvmeRequest *req)
+{
+    NvmeCtrl *n = sq->ctrl;
+    uint16_t status;
 
+    status = nvm_submit_ftl (req->nvm_io);
+    if (status == NVME_QUEUE_FULL) {
+        sq->held = req;
+        return -1;
+    }
+    sq->held = NULL;
+
+    if (status != NVME_NO_COMPLETE && status != NVME_SUCCESS)
+        log_err (" [ERROR nvme: cmd 0x%x, with cid: %d returned an "
+                      "error status: %x\n", req->cmd.opcode, req->cmd.cid,
+                      status);
+
+    if (status != NVME_NO_COMPLETE && (
+                req->nvm_io->status.status == NVM_IO_PROCESS ||
+                req->nvm_io->status.status == NVM_IO_NEW)) {
+        req->status = status;
+        nvme_enqueue_req_completion (n->cq[sq->cqid], req);
+    }
+
+    return 0;
+}
+
+/*
+ * Fetches and processes up to 'burst' commands of the SQ. Returns the number
+ * of commands processed, or -1 if the controller restarted (AppNVM flush).
+ */
+static int nvme_process_sq_burst (NvmeSQ *sq, uint32_t burst)
+{
     NvmeCtrl *n = sq->ctrl;
     NvmeCQ *cq = n->cq[sq->cqid];
     char err[100];
@@ -976,32 +1746,56 @@ static void nvme_process_sq (void *opaque)
         cq->hold_sqs = 1;
 	log_info("[nvme: Process-SQ %d with CQ %d delayed]\n",
                                                            sq->sqid, sq->cqid);
-	return;
+	return 0;
     }
 
     uint16_t status;
     uint64_t addr = 0;
     NvmeCmd cmd;
-    NvmeRequest *req;
-    int processed = 0;
+    NvmeRequest *req, *mreq = NULL;
+    uint32_t processed = 0;
+    int full = 0;
 
     nvme_update_sq_tail (sq);
 
+    if (sq->held && nvme_submit_merged (sq, sq->held))
+        goto out;
+
     while (!(nvme_sq_empty(sq) || TAILQ_EMPTY (&sq->req_list))
-			&&	processed < sq->arb_burst) {
+			&&	processed < burst) {
 	++sq->posted;
-	if (sq->phys_contig) {
-            addr = sq->dma_addr + sq->head * n->sqe_size;
-	} else {
-            // TODO
-        }
+        if (sq->cmb_sqes) {
+            memcpy (&cmd, sq->cmb_sqes + sq->head * n->sqe_size,
+                                                            sizeof (NvmeCmd));
+        } else {
+	    if (sq->phys_contig) {
+                addr = sq->dma_addr + sq->head * n->sqe_size;
+	    } else {
+                addr = nvme_discontig_addr (n, sq->prp_list, sq->head,
+                                                                n->sqe_size);
+            }
+
+            if (addr == 0) continue;
 
-        if (addr == 0) continue;
+            nvme_addr_read (n, addr, (void *)&cmd, sizeof (NvmeCmd));
+        }
 
-        nvme_addr_read (n, addr, (void *)&cmd, sizeof (NvmeCmd));
-	nvme_inc_sq_head (sq);
+        /* The held command goes to the FTL before a command that can not be
+         * merged to it, the SQE stays in the SQ if the FTL is full */
+        if (mreq && (!nvme_rw_can_merge (sq, &cmd) ||
+                                    cmd.opcode != mreq->cmd.opcode)) {
+            if (nvme_submit_merged (sq, mreq)) {
+                sq->posted--;
+                full = 1;
+                break;
+            }
+            mreq = NULL;
+        }
 
+        /* The head only moves once the command is accepted, CQEs posted
+         * meanwhile must never report a head that goes backwards */
         if (cmd.opcode == NVME_OP_ABORTED) {
+            nvme_inc_sq_head (sq);
             continue;
 	}
 
@@ -1015,9 +1809,47 @@ static void nvme_process_sq (void *opaque)
 	req->cqe.cid = cmd.cid;
 
         memcpy (&req->cmd, &cmd, sizeof(NvmeCmd));
+        req->merged = NULL;
+
+        if (mreq && nvme_rw_merge (n, mreq, &cmd, req) == NVME_SUCCESS) {
+            nvme_inc_sq_head (sq);
+            processed++;
+            continue;
+        }
+        if (mreq) {
+            if (nvme_submit_merged (sq, mreq)) {
+                /* 'req' was not counted yet, its SQE stays in the SQ */
+                pthread_mutex_lock(&n->req_mutex);
+                TAILQ_REMOVE (&sq->out_req_list, req, entry);
+                TAILQ_INSERT_HEAD (&sq->req_list, req, entry);
+                pthread_mutex_unlock(&n->req_mutex);
+                sq->posted--;
+                mreq = NULL;
+                full = 1;
+                break;
+            }
+            mreq = NULL;
+        }
+
+        req->merge = nvme_rw_can_merge (sq, &cmd);
 
 	status = sq->sqid ?
             nvme_io_cmd (n, &cmd, req) : nvme_admin_cmd (n, &cmd, req);
+        req->merge = 0;
+
+        /* Backpressure: stop advancing the head until the FTL has room */
+        if (status == NVME_QUEUE_FULL) {
+            nvme_sq_requeue (sq, req);
+            full = 1;
+            break;
+        }
+        nvme_inc_sq_head (sq);
+
+        if (status == NVME_MERGE_HOLD) {
+            mreq = req;
+            processed++;
+            continue;
+        }
 
         /* JUMP */
         /*
@@ -1036,12 +1868,14 @@ static void nvme_process_sq (void *opaque)
             if (core.debug) printf("%s",err);
         }
 
-        /* Enqueue completion for flush command and flush everything to NVM */
-        if (sq->sqid && cmd.opcode == NVME_CMD_FLUSH) {
+        /* AppNVM: enqueue completion for flush command and flush everything
+         * to NVM, including the FTL metadata */
+        if (sq->sqid && cmd.opcode == NVME_CMD_FLUSH &&
+                                            core.std_ftl == FTL_ID_APPNVM) {
             req->status = status;
             nvme_enqueue_req_completion (cq, req);
             nvm_restart();
-            return;
+            return -1;
         }
 
         /* Enqueue completion in case of admin command */
@@ -1051,9 +1885,9 @@ static void nvme_process_sq (void *opaque)
         }
 
         /* Enqueue in case of failed IO cmd that hasn't been enqueued */
-	if (status != NVME_NO_COMPLETE && sq->sqid &&
-                (req->nvm_io.status.status == NVM_IO_PROCESS ||
-                req->nvm_io.status.status == NVM_IO_NEW)) {
+	if (status != NVME_NO_COMPLETE && sq->sqid && (!req->nvm_io ||
+                req->nvm_io->status.status == NVM_IO_PROCESS ||
+                req->nvm_io->status.status == NVM_IO_NEW)) {
             req->status = status;
             nvme_enqueue_req_completion (cq, req);
 	}
@@ -1062,12 +1896,132 @@ static void nvme_process_sq (void *opaque)
 	processed++;
     }
 
+    if (mreq && nvme_submit_merged (sq, mreq))
+        full = 1;
+
+out:
+    if (sq->held)
+        full = 1;
+
+    /* Publish the consumed tail before reading the shadow tail again, a
+     * host update after this point either is seen here or rings the MMIO
+     * doorbell */
+    if (sq->eventidx_addr) {
+        nvme_update_sq_eventidx (sq);
+        smp_mb ();
+    }
     nvme_update_sq_tail (sq);
 
     sq->completed += processed;
-    if (!nvme_sq_empty(sq)) {
-        timer_mod(sq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+    if (!nvme_sq_empty(sq) || sq->held) {
+        timer_mod(sq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+                                        ((full) ? NVME_SQ_FULL_DELAY_NS : 500));
+    }
+
+    return processed;
+}
+
+/* Next I/O SQ of a priority class with commands to fetch, round robin */
+static NvmeSQ *nvme_arb_next_sq (NvmeCtrl *n, uint8_t prio)
+{
+    NvmeQSched *qs = &n->qsched;
+    NvmeSQ *sq;
+    uint32_t i, qid;
+
+    if (!qs->prio_avail[prio] || n->num_queues < 2)
+        return NULL;
+
+    for (i = 0; i < n->num_queues - 1; i++) {
+        qid = 1 + (qs->prio_lvl_next_q[prio] + i) % (n->num_queues - 1);
+        sq = n->sq[qid];
+        if (!sq || sq->prio != prio)
+            continue;
+
+        nvme_update_sq_tail (sq);
+        if ((nvme_sq_empty (sq) && !sq->held) || TAILQ_EMPTY (&sq->req_list) ||
+                                                    n->cq[sq->cqid]->hold_sqs)
+            continue;
+
+        /* The search starts after this SQ next time */
+        qs->prio_lvl_next_q[prio] = qid;
+        return sq;
+    }
+
+    return NULL;
+}
+
+/* Serves each urgent SQ with commands once, -1 if the controller restarted */
+static int nvme_arb_urgent (NvmeCtrl *n, uint32_t burst)
+{
+    NvmeSQ *sq;
+    uint32_t i;
+
+    for (i = 0; i < n->qsched.prio_avail[NVME_Q_PRIO_URGENT]; i++) {
+        sq = nvme_arb_next_sq (n, NVME_Q_PRIO_URGENT);
+        if (!sq)
+            break;
+        if (nvme_process_sq_burst (sq, burst) < 0)
+            return -1;
     }
+
+    return 0;
+}
+
+/*
+ * One round of weighted round robin with urgent priority class among the I/O
+ * SQs (CC.AMS 1). Urgent SQs have strict priority, they are served before
+ * each selection in the weighted classes. In the round, the high, medium and
+ * low classes fetch up to HPW+1, MPW+1 and LPW+1 commands, round robin among
+ * the SQs of the class and at most 'arbitration burst' commands per selection.
+ * The admin SQ keeps its own timer, outside of the arbitration.
+ */
+static void nvme_arb_wrr (NvmeCtrl *n)
+{
+    uint32_t arb = n->features.arbitration;
+    uint32_t burst = nvme_arb_burst (n);
+    uint32_t credit[NVME_MAX_PRIORITY];
+    uint8_t prio = NVME_Q_PRIO_HIGH;
+    NvmeSQ *sq;
+    int ret;
+
+    credit[NVME_Q_PRIO_URGENT] = 0;
+    credit[NVME_Q_PRIO_HIGH] = NVME_ARB_HPW(arb) + 1;
+    credit[NVME_Q_PRIO_NORMAL] = NVME_ARB_MPW(arb) + 1;
+    credit[NVME_Q_PRIO_LOW] = NVME_ARB_LPW(arb) + 1;
+
+    while (prio <= NVME_Q_PRIO_LOW) {
+        if (nvme_arb_urgent (n, burst))
+            return;
+
+        if (!credit[prio]) {
+            prio++;
+            continue;
+        }
+
+        sq = nvme_arb_next_sq (n, prio);
+        if (!sq) {
+            prio++;
+            continue;
+        }
+
+        ret = nvme_process_sq_burst (sq, MIN(burst, credit[prio]));
+        if (ret < 0)
+            return;
+
+        /* A SQ that could not fetch (FTL full) ends the class round */
+        credit[prio] = (ret) ? credit[prio] - MIN(ret, credit[prio]) : 0;
+    }
+}
+
+static void nvme_process_sq (void *opaque)
+{
+    NvmeSQ *sq = (NvmeSQ *) opaque;
+    NvmeCtrl *n = sq->ctrl;
+
+    if (sq->sqid && n->qsched.WRR)
+        nvme_arb_wrr (n);
+    else
+        nvme_process_sq_burst (sq, sq->arb_burst);
 }
 
 void nvme_process_db (NvmeCtrl *n, uint64_t addr, uint64_t val)
@@ -1117,7 +2071,8 @@ void nvme_process_db (NvmeCtrl *n, uint64_t addr, uint64_t val)
                 }
             }
             nvme_post_cqes(cq);
-        } else if (cq->tail != cq->head) {
+        } else if (cq->tail != cq->head && !timer_pending(cq->timer)) {
+            /* if coalescing timer is armed, it raises the interrupt */
             nvme_isr_notify(cq);
         }
     } else {
@@ -1145,10 +2100,57 @@ void nvme_process_db (NvmeCtrl *n, uint64_t addr, uint64_t val)
     }
 }
 
+/* SQ tail doorbell written by a vCPU that does not hold the BQL. Storing
+ * the tail and arming the SQ timer are safe under db_mutex; anything else,
+ * including errors that post an AER, returns false and goes through
+ * nvme_process_db with the BQL held. */
+bool nvme_process_sq_db_unlocked (NvmeCtrl *n, uint64_t addr, uint64_t val)
+{
+    uint32_t qid;
+    uint16_t new_val = val & 0xffff;
+    NvmeSQ *sq;
+    bool done = false;
+
+    if (addr & ((1 << (2 + n->db_stride)) - 1) ||
+                            (((addr - 0x1000) >> (2 + n->db_stride)) & 1))
+        return false;
+
+    qid = (addr - 0x1000) >> (3 + n->db_stride);
+
+    pthread_mutex_lock (&n->db_mutex);
+    if (!nvme_check_sqid(n, qid) && new_val < n->sq[qid]->size) {
+        sq = n->sq[qid];
+        if (!sq->db_addr) {
+            atomic_set(&sq->tail, new_val);
+        }
+        if (!timer_pending(sq->timer)) {
+            timer_mod(sq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+        }
+        done = true;
+    }
+    pthread_mutex_unlock (&n->db_mutex);
+
+    return done;
+}
+
 void nvme_exit(void)
 {
     NvmeCtrl *n = nvm_nvme_ctrl;
+    int i;
+
+    log_info(" [nvm: NVME interrupts: %lu for %lu CQEs, %lu saved.]\n",
+                n->stat.tot_num_irq, n->stat.tot_num_cqe,
+                (n->stat.tot_num_cqe > n->stat.tot_num_irq) ?
+                n->stat.tot_num_cqe - n->stat.tot_num_irq : 0);
+    if (n->stat.tot_num_requeue)
+        log_info(" [nvm: NVME IO cmds left in the SQ (FTL queue full): %lu]\n",
+                                                    n->stat.tot_num_requeue);
+    if (n->stat.tot_num_merged)
+        log_info(" [nvm: NVME IO cmds merged to the previous cmd: %lu]\n",
+                                                    n->stat.tot_num_merged);
+
     nvme_clear_ctrl (n);
+    ox_ndp_exit ();
     FREE_VALID (n->sq);
     FREE_VALID (n->cq);
     FREE_VALID (n->aer_reqs);
@@ -1162,23 +2164,35 @@ void nvme_exit(void)
     pthread_mutex_destroy(&n->req_mutex);
     pthread_mutex_destroy(&n->qs_req_mutex);
     pthread_mutex_destroy(&n->aer_req_mutex);
+    pthread_mutex_destroy(&n->db_mutex);
+    for (i = 0; i < NVME_IO_SHARDS; i++)
+        nvme_io_pool_exit (&n->io_pool[i]);
 
     log_info(" [nvm: NVME standard unregistered.]\n");
 }
 
 int nvme_init(NvmeCtrl *n)
 {
-    nvm_ns_size = core.nvm_ns_size;
+    int i;
+
     nvm_nvme_ctrl = core.nvm_nvme_ctrl;
     nvme_set_default (n);
     n->start_time = time (NULL);
 
-    /* For now only 1 namespace */
-    n->ns_size = (uint64_t *)calloc(1, sizeof(uint64_t));
+    /* One NVMe namespace per core namespace */
+    n->num_namespaces = core.nvm_ns_count;
+    n->ns_size = (uint64_t *)calloc(n->num_namespaces, sizeof(uint64_t));
     if (!n->ns_size)
         return EMEM;
 
-    n->ns_size[0] = nvm_ns_size;
+    for (i = 0; i < n->num_namespaces; i++)
+        n->ns_size[i] = core.nvm_ns[i].size;
+
+    for (i = 0; i < NVME_IO_SHARDS; i++)
+        nvme_io_pool_init (&n->io_pool[i]);
+    pthread_mutex_init (&n->db_mutex, NULL);
+    n->dbbuf_enabled = 0;
+    n->dbbuf_dbs = n->dbbuf_eis = 0;
 
     if(nvme_init_ctrl(n))
         return ENVME_REGISTER;
@@ -1190,6 +2204,14 @@ int nvme_init(NvmeCtrl *n)
     if (core.lnvm && lnvm_dev(n) && lnvm_init(n))
         return ENVME_REGISTER;
 
+    /* Without the engine the NDP commands fail as invalid opcodes */
+    if (ox_ndp_init ())
+        log_err("  [nvm: NDP job engine not started]\n");
+
+    if (core.qemu && core.qemu->fabrics_port &&
+                    ox_fabrics_init (n, core.qemu->fabrics_port))
+        log_err("  [nvm: NVMe/TCP target not started]\n");
+
     log_info("  [nvm: NVME standard registered]\n");
 
     return 0;
@@ -8,6 +8,7 @@
 #include <pthread.h>
 #include "hw/block/ox-ctrl/include/lightnvm.h"
 #include "hw/block/ox-ctrl/include/nvme.h"
+#include "hw/block/ox-ctrl/include/ox-ndp.h"
 
 extern struct core_struct core;
 
@@ -38,6 +39,7 @@ uint16_t nvme_identify (NvmeCtrl *n, NvmeCmd *cmd)
     uint32_t nsid = c->nsid;
     uint64_t prp1 = c->prp1;
     uint32_t ns_list[1024];
+    uint32_t i;
 
     switch (cns) {
         case 1:
@@ -57,9 +59,10 @@ uint16_t nvme_identify (NvmeCtrl *n, NvmeCmd *cmd)
             if (nsid == 0xfffffffe || nsid == 0xffffffff)
                 return NVME_INVALID_NSID | NVME_DNR;
 
-            /* For now, only 1 valid namespace */
-            if (nsid == 0)
-                ns_list[0] = 0x1;
+            /* Active namespaces above nsid, in increasing order */
+            memset (ns_list, 0x0, sizeof (ns_list));
+            for (i = nsid; i < n->num_namespaces && i - nsid < 1024; i++)
+                ns_list[i - nsid] = cpu_to_le32(i + 1);
 
             if (prp1)
                 return nvme_write_to_host(&ns_list, prp1, 4096);
@@ -105,12 +108,10 @@ uint16_t nvme_del_sq (NvmeCtrl *n, NvmeCmd *cmd)
         pthread_mutex_unlock(&n->req_mutex);
     }
     n->qsched.SQID[(qid - 1) >> 5] &= (~(1UL << ((qid - 1) & 31)));
-    n->qsched.prio_avail[sq->prio] = n->qsched.prio_avail[sq->prio] - 1;
     n->qsched.mask_regs[sq->prio][(qid - 1) >> 6] &=
                                 (~(1UL << ((qid - 1) & (SHADOW_REG_SZ - 1))));
     n->qsched.shadow_regs[sq->prio][(qid -1) >> 6] &=
                                 (~(1UL << ((qid - 1) & (SHADOW_REG_SZ - 1))));
-    n->qsched.n_active_iosqs--;
 
     nvme_free_sq (sq, n);
     return NVME_SUCCESS;
@@ -255,7 +256,7 @@ uint16_t nvme_set_feature (NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
             n->features.volatile_wc = dw11;
             break;
 	case NVME_INTERRUPT_COALESCING:
-            n->features.int_coalescing = dw11;
+            n->features.int_coalescing = dw11 & 0xffff;
             break;
 	case NVME_INTERRUPT_VECTOR_CONF:
             if ((dw11 & 0xffff) > n->num_queues) {
@@ -342,15 +343,18 @@ static uint16_t nvme_error_log_info (NvmeCtrl *n, NvmeCmd *cmd)
     return NVME_SUCCESS;
 }
 
-static uint16_t nvme_smart_info (NvmeCtrl *n, NvmeCmd *cmd, uint32_t buf_len)
+/*
+ * Fills the SMART log page without changing the controller state, so that
+ * it can be served to fabrics hosts as well.
+ */
+void nvme_smart_log (NvmeCtrl *n, NvmeSmartLog *smart)
 {
-    uint64_t prp1 = cmd->prp1;
     time_t current_seconds;
     int Rtmp = 0,Wtmp = 0;
     int read = 0,write = 0;
-    NvmeSmartLog smart;
+    struct nvm_ftl_wear_st wear;
 
-    memset (&smart, 0x0, sizeof (smart));
+    memset (smart, 0x0, sizeof (NvmeSmartLog));
     Rtmp = n->stat.nr_bytes_read/1000;
     Wtmp = n->stat.nr_bytes_written/1000;
 
@@ -360,33 +364,52 @@ static uint16_t nvme_smart_info (NvmeCtrl *n, NvmeCmd *cmd, uint32_t buf_len)
     read = (read >= 500)?1:0;
     write = (write >=500)?1:0;
 
-    n->stat.nr_bytes_read = Rtmp + read;
-    n->stat.nr_bytes_written = Wtmp + write;
-
-    smart.data_units_read[0] = htole64(n->stat.nr_bytes_read);
-    smart.data_units_written[0] = htole64(n->stat.nr_bytes_written);
-    smart.host_read_commands[0] = htole64(n->stat.tot_num_ReadCmd);
-    smart.host_write_commands[0] = htole64(n->stat.tot_num_WriteCmd);
-    smart.number_of_error_log_entries[0] = htole64(n->num_errors);
-    smart.temperature[0] = n->temperature & 0xff;
-    smart.temperature[1] = (n->temperature >> 8) & 0xff;
+    smart->data_units_read[0] = htole64(Rtmp + read);
+    smart->data_units_written[0] = htole64(Wtmp + write);
+    smart->host_read_commands[0] = htole64(n->stat.tot_num_ReadCmd);
+    smart->host_write_commands[0] = htole64(n->stat.tot_num_WriteCmd);
+    smart->number_of_error_log_entries[0] = htole64(n->num_errors);
+    smart->temperature[0] = n->temperature & 0xff;
+    smart->temperature[1] = (n->temperature >> 8) & 0xff;
 
     current_seconds = time (NULL);
-    smart.power_on_hours[0] = htole64(
+    smart->power_on_hours[0] = htole64(
                                 ((current_seconds - n->start_time) / 60) / 60);
 
-    smart.available_spare_threshold = NVME_SPARE_THRESHOLD;
-    if (smart.available_spare <= NVME_SPARE_THRESHOLD) {
-	smart.critical_warning |= NVME_SMART_SPARE;
+    memset (&wear, 0x0, sizeof (wear));
+    if (!nvm_ftl_wear_get (&wear) && wear.blks) {
+        smart->ox_min_erase_count = htole32(wear.min_ec);
+        smart->ox_max_erase_count = htole32(wear.max_ec);
+        smart->ox_avg_erase_count = htole32(wear.avg_ec);
+        smart->ox_wl_moves = htole64(wear.wl_moves);
+
+        /* Percentage of the block life used, NVMe caps it at 255 */
+        if (wear.blk_life)
+            smart->percentage_used = MIN(255, (uint64_t) wear.avg_ec * 100 /
+                                                             wear.blk_life);
+    }
+
+    smart->available_spare_threshold = NVME_SPARE_THRESHOLD;
+    if (smart->available_spare <= NVME_SPARE_THRESHOLD) {
+	smart->critical_warning |= NVME_SMART_SPARE;
     }
     if (n->features.temp_thresh <= n->temperature) {
-	smart.critical_warning |= NVME_SMART_TEMPERATURE;
+	smart->critical_warning |= NVME_SMART_TEMPERATURE;
     }
+}
+
+static uint16_t nvme_smart_info (NvmeCtrl *n, NvmeCmd *cmd, uint32_t buf_len)
+{
+    uint64_t prp1 = cmd->prp1;
+    NvmeSmartLog smart;
+
+    nvme_smart_log (n, &smart);
+    n->stat.nr_bytes_read = le64toh(smart.data_units_read[0]);
+    n->stat.nr_bytes_written = le64toh(smart.data_units_written[0]);
 
     n->aer_mask &= ~(1 << NVME_AER_TYPE_SMART);
-    NvmeSmartLog *smrt = &smart;
     if(prp1)
-        return nvme_write_to_host(smrt, prp1, sizeof (NvmeSmartLog));
+        return nvme_write_to_host(&smart, prp1, sizeof (NvmeSmartLog));
     return NVME_SUCCESS;
 }
 
@@ -420,6 +443,36 @@ inline uint16_t nvme_get_log(NvmeCtrl *n, NvmeCmd *cmd)
     }
 }
 
+/*
+ * Doorbell Buffer Config: PRP1 is the shadow doorbell buffer and PRP2 the
+ * EventIdx buffer, both page aligned. Shadow doorbells apply to I/O queues
+ * only, the admin queue keeps using MMIO doorbells.
+ */
+uint16_t nvme_dbbuf_config (NvmeCtrl *n, NvmeCmd *cmd)
+{
+    uint64_t dbs = le64_to_cpu(cmd->prp1);
+    uint64_t eis = le64_to_cpu(cmd->prp2);
+    int i;
+
+    if (!dbs || !eis || dbs & (n->page_size - 1) || eis & (n->page_size - 1))
+        return NVME_INVALID_FIELD | NVME_DNR;
+
+    n->dbbuf_dbs = dbs;
+    n->dbbuf_eis = eis;
+    n->dbbuf_enabled = 1;
+
+    for (i = 1; i < n->num_queues; i++) {
+        if (n->sq[i])
+            nvme_dbbuf_init_sq (n, n->sq[i]);
+        if (n->cq[i])
+            nvme_dbbuf_init_cq (n, n->cq[i]);
+    }
+
+    log_info("[nvme: shadow doorbells enabled. dbs: 0x%lx, eis: 0x%lx]\n",
+                                                                    dbs, eis);
+    return NVME_SUCCESS;
+}
+
 uint16_t nvme_abort_req (NvmeCtrl *n, NvmeCmd *cmd, uint32_t *result)
 {
  /* The Abort command is used to abort a specific command previously submitted
@@ -576,11 +629,54 @@ uint16_t nvme_dsm (NvmeCtrl *n,NvmeNamespace *ns,NvmeCmd *cmd,NvmeRequest *req)
  are used. If the command uses SGLs for the data transfer, then the SGL Entry 1
  field is used. All other command specific fields are reserved.
  */
-    /* TODO: Not implemented yet */
+    NvmeDsmRange range[NVME_DSM_MAX_RANGES];
+    uint32_t nr = (cmd->cdw10 & 0xff) + 1;
+    uint32_t i, len, size = nr * sizeof (NvmeDsmRange);
+    uint64_t slba;
+
+    /* Only deallocate is supported, other attributes are advisory */
+    if (!(cmd->cdw11 & NVME_DSMGMT_AD))
+        return NVME_SUCCESS;
+
+    if (!cmd->prp1)
+        return NVME_INVALID_FIELD | NVME_DNR;
+
+    /* The range list is up to 4 KB, it may cross into the PRP2 page */
+    len = n->page_size - (cmd->prp1 & (n->page_size - 1));
+    if (len >= size) {
+        nvme_addr_read (n, cmd->prp1, range, size);
+    } else {
+        if (!cmd->prp2)
+            return NVME_INVALID_FIELD | NVME_DNR;
+        nvme_addr_read (n, cmd->prp1, range, len);
+        nvme_addr_read (n, cmd->prp2, (uint8_t *) range + len, size - len);
+    }
+
+    for (i = 0; i < nr; i++) {
+        slba = le64_to_cpu(range[i].slba);
+        if (slba + le32_to_cpu(range[i].nlb) > ns->id_ns.nsze)
+            return NVME_LBA_RANGE | NVME_DNR;
+    }
+
+    for (i = 0; i < nr; i++) {
+        if (!range[i].nlb)
+            continue;
+        if (nvm_ftl_deallocate (ns->start_block + le64_to_cpu(range[i].slba),
+                                                 le32_to_cpu(range[i].nlb)))
+            return NVME_INTERNAL_DEV_ERROR;
+    }
 
     return NVME_SUCCESS;
 }
 
+static void nvme_flush_cb (void *opaque, int ret)
+{
+    NvmeRequest *req = (NvmeRequest *) opaque;
+
+    req->status = (ret) ? NVME_INTERNAL_DEV_ERROR : NVME_SUCCESS;
+    nvme_rw_cb (req);
+}
+
 uint16_t nvme_flush(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
 		NvmeRequest *req)
 {
@@ -588,9 +684,15 @@ uint16_t nvme_flush(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
  In case of volatile write cache is enable, flush is used to store the current
  data in the cash to non-volatile memory.
  */
-    /* TODO: Not Implemented yet */
+    /* AppNVM keeps its metadata in memory, the flush restarts the controller */
+    if (core.std_ftl == FTL_ID_APPNVM)
+        return NVME_SUCCESS;
 
-    return NVME_SUCCESS;
+    /* The command completes when the media managers are flushed */
+    if (nvm_flush (nvme_flush_cb, req))
+        return NVME_INTERNAL_DEV_ERROR;
+
+    return NVME_NO_COMPLETE;
 }
 
 uint16_t nvme_compare(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
@@ -611,9 +713,27 @@ used. If the command uses SGLs for the data transfer, then the Metadata SGL
 Segment Pointer and SGL Entry 1 fields are used. All other command specific
 fields are reserved.
 */
-    /* TODO: Not implemented yet */
+    NvmeRwCmd *rw = (NvmeRwCmd *)cmd;
+    uint32_t nlb = rw->nlb + 1;
+    uint16_t ret;
 
-    return NVME_SUCCESS;
+    if (rw->slba + nlb > ns->id_ns.nsze)
+        return NVME_LBA_RANGE | NVME_DNR;
+
+    /* As in nvme_rw, one PRP per LBA in nvm_io */
+    if (nlb > 256)
+        return NVME_INVALID_FIELD | NVME_DNR;
+
+    ret = nvme_map_dptr (n, req->nvm_io->prp, cmd, nlb, NVME_KERNEL_PG_SIZE);
+    if (ret)
+        return ret;
+
+    req->slba = rw->slba;
+    req->nlb = nlb;
+    req->ns = ns;
+
+    /* Media reads and the comparison stay in the controller */
+    return ox_ndp_compare (req, ns->start_block + rw->slba, nlb);
 }
 
 uint16_t nvme_write_zeros(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
@@ -628,7 +748,15 @@ protection information is updated based on CDW12.PRINFO. The fields used are
 Command Dword 10, Command Dword 11, Command Dword 12, Command Dword 14, and
 Command Dword 15 fields
 */
-    /* TODO: Not implemented yet */
+    NvmeRwCmd *rw = (NvmeRwCmd *)cmd;
+    uint32_t nlb = rw->nlb + 1;
+
+    if (rw->slba + nlb > ns->id_ns.nsze)
+        return NVME_LBA_RANGE | NVME_DNR;
+
+    /* AppNVM reads unmapped LBAs as zeroes, nothing is programmed */
+    if (nvm_ftl_deallocate (ns->start_block + rw->slba, nlb))
+        return NVME_INTERNAL_DEV_ERROR;
 
     return NVME_SUCCESS;
 }
@@ -638,25 +766,26 @@ uint16_t nvme_rw (NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
 {
     NvmeRwCmd *rw = (NvmeRwCmd *)cmd;
     int i;
+    uint16_t ret;
 
     uint32_t nlb  = rw->nlb + 1;
     uint64_t slba = rw->slba;
-    uint64_t prp1 = rw->prp1;
-    uint64_t prp2 = rw->prp2;
 
     const uint64_t elba = slba + nlb;
     const uint8_t lba_index = NVME_ID_NS_FLBAS_INDEX(ns->id_ns.flbas);
     const uint8_t data_shift = ns->id_ns.lbaf[lba_index].ds;
     uint64_t data_size = nlb << data_shift;
 
-    req->nvm_io.status.status = NVM_IO_NEW;
+    req->nvm_io->status.status = NVM_IO_NEW;
 
     req->is_write = rw->opcode == NVME_CMD_WRITE;
 
     if (elba > (ns->id_ns.nsze))
 	return NVME_LBA_RANGE | NVME_DNR;
 
-    if (n->id_ctrl.mdts && data_size > n->page_size * (1 << n->id_ctrl.mdts))
+    /* MDTS is in CAP.MPSMIN pages, CC.MPS is not set for fabrics hosts */
+    if (n->id_ctrl.mdts && data_size > (1ULL << (12 + n->id_ctrl.mdts +
+                                    NVME_CAP_MPSMIN(n->nvme_regs.vBar.cap))))
 	return NVME_LBA_RANGE | NVME_DNR;
 
     if (nlb > 256)
@@ -674,22 +803,9 @@ uint16_t nvme_rw (NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
         return NVME_INVALID_FIELD | NVME_DNR;
     */
 
-    /* TODO: Map PRPs for SGL addresses */
-    switch (rw->psdt) {
-        case CMD_PSDT_PRP:
-        case CMD_PSDT_RSV:
-            req->nvm_io.prp[0] = prp1;
-
-            if (nlb == 2)
-                req->nvm_io.prp[1] = prp2;
-            else if (nlb > 2)
-                nvme_read_from_host((void *)(&req->nvm_io.prp[1]), prp2,
-                                                 (nlb - 1) * sizeof(uint64_t));
-            break;
-        case CMD_PSDT_SGL:
-        case CMD_PSDT_SGL_MD:
-            return NVME_INVALID_FORMAT;
-    }
+    ret = nvme_map_dptr (n, req->nvm_io->prp, cmd, nlb, NVME_KERNEL_PG_SIZE);
+    if (ret)
+        return ret;
 
     req->slba = slba;
     req->meta_size = 0;
@@ -698,28 +814,100 @@ uint16_t nvme_rw (NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
     req->ns = ns;
     req->lba_index = lba_index;
 
-    req->nvm_io.cid = rw->cid;
-    req->nvm_io.sec_sz = NVME_KERNEL_PG_SIZE;
-    req->nvm_io.md_sz = 0;
-    req->nvm_io.cmdtype = (req->is_write) ? MMGR_WRITE_PG : MMGR_READ_PG;
-    req->nvm_io.n_sec = nlb;
-    req->nvm_io.req = (void *) req;
-    req->nvm_io.slba = slba;
-
-    req->nvm_io.status.pg_errors = 0;
-    req->nvm_io.status.ret_t = 0;
-    req->nvm_io.status.total_pgs = 0;
-    req->nvm_io.status.pgs_p = 0;
-    req->nvm_io.status.pgs_s = 0;
-    req->nvm_io.status.status = NVM_IO_NEW;
+    req->nvm_io->cid = rw->cid;
+    req->nvm_io->sec_sz = NVME_KERNEL_PG_SIZE;
+    req->nvm_io->md_sz = 0;
+    req->nvm_io->cmdtype = (req->is_write) ? MMGR_WRITE_PG : MMGR_READ_PG;
+    req->nvm_io->n_sec = nlb;
+    req->nvm_io->req = (void *) req;
+    req->nvm_io->slba = ns->start_block + slba;
+    req->nvm_io->nsid = ns->id;
+
+    req->nvm_io->status.pg_errors = 0;
+    req->nvm_io->status.ret_t = 0;
+    req->nvm_io->status.total_pgs = 0;
+    req->nvm_io->status.pgs_p = 0;
+    req->nvm_io->status.pgs_s = 0;
+    req->nvm_io->status.status = NVM_IO_NEW;
 
     for (i = 0; i < 8; i++) {
-        req->nvm_io.status.pg_map[i] = 0;
+        req->nvm_io->status.pg_map[i] = 0;
     }
 
     if (core.debug)
-        nvme_debug_print_io (rw, req->nvm_io.sec_sz, data_size,
-                                     req->nvm_io.md_sz, elba, req->nvm_io.prp);
+        nvme_debug_print_io (rw, req->nvm_io->sec_sz, data_size,
+                                     req->nvm_io->md_sz, elba, req->nvm_io->prp);
 
-    return nvm_submit_ftl(&req->nvm_io);
-}
\ No newline at end of file
+    /* The SQ submits it once the following commands are not adjacent */
+    if (req->merge)
+        return NVME_MERGE_HOLD;
+
+    return nvm_submit_ftl(req->nvm_io);
+}
+
+/*
+ * Merges a read or write to 'head', a held command of the same SQ burst, if
+ * it has the same opcode and namespace and starts at the LBA following
+ * 'head'. The PRPs of 'req' follow the ones of 'head' in the FTL command,
+ * 'req' completes with 'head' and gets its status.
+ *
+ * @return NVME_SUCCESS if merged, 'req' is processed alone otherwise
+ */
+uint16_t nvme_rw_merge (NvmeCtrl *n, NvmeRequest *head, NvmeCmd *cmd,
+                                                             NvmeRequest *req)
+{
+    NvmeRwCmd *rw = (NvmeRwCmd *)cmd;
+    NvmeRwCmd *hrw = (NvmeRwCmd *)&head->cmd;
+    NvmeNamespace *ns = head->ns;
+    struct nvm_io_cmd *io = head->nvm_io;
+    NvmeRequest *tail;
+    uint16_t ret;
+
+    uint32_t nlb  = rw->nlb + 1;
+    uint64_t slba = rw->slba;
+
+    if (rw->opcode != hrw->opcode || rw->nsid != hrw->nsid ||
+                rw->control != hrw->control ||
+                ns->start_block + slba != io->slba + io->n_sec)
+        return NVME_INVALID_FIELD;
+
+    if (io->n_sec + nlb > 256 || slba + nlb > ns->id_ns.nsze)
+        return NVME_INVALID_FIELD;
+
+    ret = nvme_map_dptr (n, io->prp + io->n_sec, cmd, nlb,
+                                                        NVME_KERNEL_PG_SIZE);
+    if (ret)
+        return ret;
+
+    /* A requeued command may come back merged, its FTL command is not used */
+    if (req->nvm_io) {
+        nvme_put_io_cmd (n, req->nvm_io);
+        req->nvm_io = NULL;
+    }
+
+    req->slba = slba;
+    req->meta_size = 0;
+    req->status = NVME_SUCCESS;
+    req->nlb = nlb;
+    req->ns = ns;
+    req->lba_index = head->lba_index;
+    req->is_write = head->is_write;
+    req->merged = NULL;
+
+    for (tail = head; tail->merged; tail = tail->merged);
+    tail->merged = req;
+    io->n_sec += nlb;
+
+    n->stat.tot_num_IOCmd++;
+    if (req->is_write)
+        n->stat.tot_num_WriteCmd++;
+    else
+        n->stat.tot_num_ReadCmd++;
+    n->stat.tot_num_merged++;
+
+    if (core.debug)
+        printf(" [nvme: cmd cid: %d merged to cid: %d, %d sectors]\n",
+                                               rw->cid, hrw->cid, io->n_sec);
+
+    return NVME_SUCCESS;
+}
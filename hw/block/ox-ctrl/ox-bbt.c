@@ -0,0 +1,119 @@
+/* OX: Open-Channel NVM Express SSD Controller
+ *  - Packed bad block tables
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hw/block/ox-ctrl/include/ox-bbt.h"
+
+/* LightNVM byte values of the states */
+static const uint8_t ox_bbt_bytes[4] = {
+    [OX_BBT_GOOD] = 0x0,
+    [OX_BBT_BAD]  = 0x1,
+    [OX_BBT_GBAD] = 0x2,
+    [OX_BBT_RSV]  = 0x4
+};
+
+uint64_t *ox_bbt_alloc (uint32_t n)
+{
+    return calloc (1, ox_bbt_size (n));
+}
+
+/* Entries of a word can be set by different threads, the update is a CAS */
+void ox_bbt_set (uint64_t *tbl, uint32_t i, uint8_t state)
+{
+    uint64_t *w = &tbl[i / OX_BBT_PER_WORD];
+    uint32_t shift = (i % OX_BBT_PER_WORD) * 2;
+    uint64_t old, new;
+
+    old = __atomic_load_n (w, __ATOMIC_RELAXED);
+    do {
+        new = (old & ~(0x3ULL << shift)) | ((uint64_t) (state & 0x3) << shift);
+    } while (!__atomic_compare_exchange_n (w, &old, new, 1, __ATOMIC_RELEASE,
+                                                            __ATOMIC_RELAXED));
+}
+
+uint8_t ox_bbt_state (uint8_t byte)
+{
+    switch (byte) {
+        case 0x0:
+            return OX_BBT_GOOD;
+        case 0x2:
+            return OX_BBT_GBAD;
+        case 0x4:
+            return OX_BBT_RSV;
+        case 0x1:
+        default:
+            return OX_BBT_BAD;
+    }
+}
+
+uint8_t ox_bbt_byte (uint8_t state)
+{
+    return ox_bbt_bytes[state & 0x3];
+}
+
+/* Copies 'n' entries from entry 'off' to a byte table */
+void ox_bbt_to_bytes (uint8_t *dst, const uint64_t *tbl, uint32_t off,
+                                                                    uint32_t n)
+{
+    uint32_t i;
+    uint64_t w;
+
+    for (i = 0; i < n; i++) {
+
+        /* Good words are the common case, 32 entries at once */
+        if (!((off + i) % OX_BBT_PER_WORD) && i + OX_BBT_PER_WORD <= n) {
+            w = tbl[(off + i) / OX_BBT_PER_WORD];
+            if (!w) {
+                memset (&dst[i], 0x0, OX_BBT_PER_WORD);
+                i += OX_BBT_PER_WORD - 1;
+                continue;
+            }
+        }
+
+        dst[i] = ox_bbt_bytes[ox_bbt_get (tbl, off + i)];
+    }
+}
+
+void ox_bbt_from_bytes (uint64_t *tbl, const uint8_t *src, uint32_t off,
+                                                                    uint32_t n)
+{
+    uint32_t i;
+
+    for (i = 0; i < n; i++)
+        ox_bbt_set (tbl, off + i, ox_bbt_state (src[i]));
+}
+
+/* Bad entries of word 'w' in [from, to), one bit per entry */
+static inline uint64_t ox_bbt_bad_bits (const uint64_t *tbl, uint32_t w,
+                                                    uint32_t from, uint32_t to)
+{
+    uint64_t bits, mask = OX_BBT_LO;
+    uint32_t first = w * OX_BBT_PER_WORD;
+
+    bits = __atomic_load_n (&tbl[w], __ATOMIC_RELAXED);
+    bits = (bits | bits >> 1) & OX_BBT_LO;
+
+    if (from > first)
+        mask &= ~0ULL << ((from - first) * 2);
+    if (to < first + OX_BBT_PER_WORD)
+        mask &= (1ULL << ((to - first) * 2)) - 1;
+
+    return bits & mask;
+}
+
+/* Number of entries in [off, off + n) that are not good */
+uint32_t ox_bbt_count (const uint64_t *tbl, uint32_t off, uint32_t n)
+{
+    uint32_t w, count = 0, end = off + n;
+
+    if (!n)
+        return 0;
+
+    for (w = off / OX_BBT_PER_WORD; w <= (end - 1) / OX_BBT_PER_WORD; w++)
+        count += __builtin_popcountll (ox_bbt_bad_bits (tbl, w, off, end));
+
+    return count;
+}
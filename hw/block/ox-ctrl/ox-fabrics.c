@@ -0,0 +1,1022 @@
+/* OX: Open-Channel NVM Express SSD Controller
+ *  - NVMe over Fabrics, TCP transport
+ */
+
+#include "qemu/osdep.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <endian.h>
+#include <pthread.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "hw/block/ox-ctrl/include/ssd.h"
+#include "hw/block/ox-ctrl/include/nvme.h"
+#include "hw/block/ox-ctrl/include/ox-fabrics.h"
+
+extern struct core_struct core;
+
+#define OX_FABRICS_BACKLOG      16
+#define OX_FABRICS_FULL_US      50  /* backoff while the FTL queue is full */
+
+enum ox_fabrics_cmd_state {
+    OX_FCMD_FREE = 0,
+    OX_FCMD_NEW,        /* owned by the receiver */
+    OX_FCMD_DATA,       /* waiting for H2CData */
+    OX_FCMD_EXEC,       /* completes through ox_fabrics_done */
+    OX_FCMD_TX          /* queued to the sender */
+};
+
+struct ox_fabrics_conn;
+
+struct ox_fabrics_cmd {
+    NvmeRequest                     req;
+    struct ox_fabrics_conn          *conn;
+    uint16_t                        ttag;   /* index in conn->cmd */
+    uint8_t                         state;
+    uint8_t                         r2t;    /* sender: R2T, not the response */
+    uint8_t                         c2h;    /* buf goes to the host */
+    uint8_t                         aer;
+    uint8_t                         *buf;
+    uint32_t                        len;
+    uint32_t                        rcvd;
+    TAILQ_ENTRY(ox_fabrics_cmd)     entry;
+};
+
+struct ox_fabrics_ctrl {
+    uint8_t                         used;
+    uint8_t                         dead;   /* admin queue gone */
+    uint16_t                        cntlid;
+    uint32_t                        refs;   /* connected queues */
+    uint32_t                        cc;
+    uint32_t                        csts;
+    NvmeFeatureVal                  features; /* not shared with PCIe */
+    char                            subnqn[256];
+    char                            hostnqn[256];
+};
+
+struct ox_fabrics_conn {
+    int                             fd;
+    uint16_t                        qid;
+    uint16_t                        qsize;
+    uint16_t                        sqhd;
+    uint16_t                        hpda;   /* host PDU data alignment */
+    uint16_t                        next;   /* next slot to allocate */
+    uint8_t                         stop;
+    uint8_t                         broken; /* a send failed */
+    struct ox_fabrics_ctrl          *ctrl;
+    pthread_t                       rx_th;
+    pthread_t                       tx_th;
+    pthread_mutex_t                 mutex;
+    pthread_cond_t                  cond;   /* tx queued, busy or stop */
+    TAILQ_HEAD(, ox_fabrics_cmd)    tx;
+    uint32_t                        busy;   /* in EXEC, AERs excluded */
+    struct ox_fabrics_cmd           cmd[OX_FABRICS_MAX_QD];
+    LIST_ENTRY(ox_fabrics_conn)     entry;
+};
+
+static struct ox_fabrics {
+    NvmeCtrl                        *n;
+    int                             fd;
+    pthread_t                       th;
+    pthread_mutex_t                 mutex;
+    pthread_cond_t                  cond;   /* a connection is gone */
+    uint8_t                         stop;
+    uint8_t                         started;
+    LIST_HEAD(, ox_fabrics_conn)    conns;
+    struct ox_fabrics_ctrl          ctrl[OX_FABRICS_MAX_CTRLS];
+} fab;
+
+static const uint8_t ox_fabrics_pad[128];
+
+static int ox_fabrics_recv (int fd, void *buf, size_t len)
+{
+    ssize_t ret;
+
+    while (len) {
+        ret = recv (fd, buf, len, 0);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return -1;
+        buf = (uint8_t *) buf + ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+static int ox_fabrics_skip (int fd, size_t len)
+{
+    uint8_t buf[512];
+    size_t sz;
+
+    while (len) {
+        sz = (len > sizeof (buf)) ? sizeof (buf) : len;
+        if (ox_fabrics_recv (fd, buf, sz))
+            return -1;
+        len -= sz;
+    }
+    return 0;
+}
+
+static int ox_fabrics_send (int fd, const void *buf, size_t len, uint8_t more)
+{
+    int flags = MSG_NOSIGNAL | ((more) ? MSG_MORE : 0);
+    ssize_t ret;
+
+    while (len) {
+        ret = send (fd, buf, len, flags);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return -1;
+        buf = (const uint8_t *) buf + ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+static void ox_fabrics_hdr (OxTcpHdr *hdr, uint8_t type, uint8_t hlen,
+                                                uint8_t pdo, uint32_t plen)
+{
+    hdr->type = type;
+    hdr->flags = 0;
+    hdr->hlen = hlen;
+    hdr->pdo = pdo;
+    hdr->plen = htole32 (plen);
+}
+
+/* Queues a command to the sender, the response or a R2T */
+static void ox_fabrics_queue_tx (struct ox_fabrics_cmd *fc, uint8_t r2t)
+{
+    struct ox_fabrics_conn *conn = fc->conn;
+
+    pthread_mutex_lock (&conn->mutex);
+    if (fc->state == OX_FCMD_EXEC && !fc->aer)
+        conn->busy--;
+    fc->state = (r2t) ? OX_FCMD_DATA : OX_FCMD_TX;
+    fc->r2t = r2t;
+    TAILQ_INSERT_TAIL (&conn->tx, fc, entry);
+    pthread_cond_broadcast (&conn->cond);
+    pthread_mutex_unlock (&conn->mutex);
+}
+
+/* NvmeRequest.fabrics_cb, runs in the FTL completion threads */
+static void ox_fabrics_done (NvmeRequest *req)
+{
+    struct ox_fabrics_cmd *fc = container_of (req, struct ox_fabrics_cmd, req);
+
+    if (req->nvm_io) {
+        nvme_put_io_cmd (fab.n, req->nvm_io);
+        req->nvm_io = NULL;
+    }
+    ox_fabrics_queue_tx (fc, 0);
+}
+
+static int ox_fabrics_send_r2t (struct ox_fabrics_conn *conn,
+                                                    struct ox_fabrics_cmd *fc)
+{
+    OxTcpData r2t;
+
+    memset (&r2t, 0x0, sizeof (OxTcpData));
+    ox_fabrics_hdr (&r2t.hdr, OX_TCP_R2T, sizeof (OxTcpData), 0,
+                                                        sizeof (OxTcpData));
+    r2t.cccid = fc->req.cmd.cid;
+    r2t.ttag = htole16 (fc->ttag);
+    r2t.offset = htole32 (fc->rcvd);
+    r2t.len = htole32 (fc->len - fc->rcvd);
+
+    return ox_fabrics_send (conn->fd, &r2t, sizeof (OxTcpData), 0);
+}
+
+static int ox_fabrics_send_rsp (struct ox_fabrics_conn *conn,
+                                    struct ox_fabrics_cmd *fc, uint16_t sqhd)
+{
+    struct {
+        OxTcpHdr    hdr;
+        NvmeCqe     cqe;
+    } __attribute__((packed)) rsp;
+    OxTcpData data;
+    uint32_t pdo, pad;
+
+    /* Read data goes before the response, in one C2HData PDU */
+    if (fc->c2h && fc->req.status == NVME_SUCCESS) {
+        pdo = QEMU_ALIGN_UP (sizeof (OxTcpData), conn->hpda);
+        pad = pdo - sizeof (OxTcpData);
+
+        memset (&data, 0x0, sizeof (OxTcpData));
+        ox_fabrics_hdr (&data.hdr, OX_TCP_C2H_DATA, sizeof (OxTcpData), pdo,
+                                                                pdo + fc->len);
+        data.hdr.flags = OX_TCP_F_DATA_LAST;
+        data.cccid = fc->req.cmd.cid;
+        data.len = htole32 (fc->len);
+
+        if (ox_fabrics_send (conn->fd, &data, sizeof (OxTcpData), 1) ||
+                ox_fabrics_send (conn->fd, ox_fabrics_pad, pad, 1) ||
+                ox_fabrics_send (conn->fd, fc->buf, fc->len, 1))
+            return -1;
+    }
+
+    memset (&rsp, 0x0, sizeof (rsp));
+    ox_fabrics_hdr (&rsp.hdr, OX_TCP_RSP, sizeof (rsp), 0, sizeof (rsp));
+    rsp.cqe.res64 = fc->req.cqe.res64;
+    rsp.cqe.sq_head = htole16 (sqhd);
+    rsp.cqe.sq_id = htole16 (conn->qid);
+    rsp.cqe.cid = fc->req.cmd.cid;
+    rsp.cqe.status = htole16 (fc->req.status << 1);
+
+    return ox_fabrics_send (conn->fd, &rsp, sizeof (rsp), 0);
+}
+
+/*
+ * Sends the responses and R2Ts, so that the FTL threads never wait for the
+ * network. Exits once the receiver stopped and no command is in the FTL.
+ */
+static void *ox_fabrics_tx (void *arg)
+{
+    struct ox_fabrics_conn *conn = arg;
+    struct ox_fabrics_cmd *fc;
+    uint16_t sqhd;
+    uint8_t r2t;
+    int err;
+
+    pthread_mutex_lock (&conn->mutex);
+    while (1) {
+        while (TAILQ_EMPTY (&conn->tx) && !(conn->stop && !conn->busy))
+            pthread_cond_wait (&conn->cond, &conn->mutex);
+        if (TAILQ_EMPTY (&conn->tx))
+            break;
+
+        fc = TAILQ_FIRST (&conn->tx);
+        TAILQ_REMOVE (&conn->tx, fc, entry);
+        sqhd = conn->sqhd;
+
+        /* Once the lock is dropped the command may complete and be queued
+         * again with r2t cleared, so decide what this pass sends now */
+        r2t = fc->r2t;
+        pthread_mutex_unlock (&conn->mutex);
+
+        err = 0;
+        if (!conn->broken)
+            err = (r2t) ? ox_fabrics_send_r2t (conn, fc) :
+                                        ox_fabrics_send_rsp (conn, fc, sqhd);
+        if (err) {
+            log_err ("[ox-fabrics: qid %d, send failed]\n", conn->qid);
+            conn->broken = 1;
+            shutdown (conn->fd, SHUT_RDWR);
+        }
+
+        pthread_mutex_lock (&conn->mutex);
+        if (!r2t) {
+            free (fc->buf);
+            fc->buf = NULL;
+            fc->state = OX_FCMD_FREE;
+        }
+    }
+    pthread_mutex_unlock (&conn->mutex);
+
+    return NULL;
+}
+
+static struct ox_fabrics_cmd *ox_fabrics_get_cmd (struct ox_fabrics_conn *conn)
+{
+    struct ox_fabrics_cmd *fc = NULL;
+    uint16_t i, slot;
+
+    pthread_mutex_lock (&conn->mutex);
+    for (i = 0; i < OX_FABRICS_MAX_QD; i++) {
+        slot = (conn->next + i) % OX_FABRICS_MAX_QD;
+        if (conn->cmd[slot].state == OX_FCMD_FREE) {
+            fc = &conn->cmd[slot];
+            fc->state = OX_FCMD_NEW;
+            conn->next = slot + 1;
+            break;
+        }
+    }
+    if (fc && conn->qsize)
+        conn->sqhd = (conn->sqhd + 1) % conn->qsize;
+    pthread_mutex_unlock (&conn->mutex);
+
+    return fc;
+}
+
+/* Data direction of a command, 1: to the controller, 2: to the host */
+static uint8_t ox_fabrics_dir (NvmeCmd *cmd)
+{
+    OxFabricsCmd *fcmd = (OxFabricsCmd *) cmd;
+
+    if (cmd->opcode == OX_FABRICS_CMD)
+        return (fcmd->fctype == OX_FABRICS_CONNECT) ? 1 : 0;
+
+    return cmd->opcode & 0x3;
+}
+
+/* Tears down the I/O queues of a controller, called with fab.mutex held */
+static void ox_fabrics_kill_io (struct ox_fabrics_ctrl *ctrl)
+{
+    struct ox_fabrics_conn *conn;
+
+    LIST_FOREACH (conn, &fab.conns, entry) {
+        if (conn->ctrl == ctrl && conn->qid)
+            shutdown (conn->fd, SHUT_RDWR);
+    }
+}
+
+static uint16_t ox_fabrics_connect (struct ox_fabrics_cmd *fc)
+{
+    struct ox_fabrics_conn *conn = fc->conn;
+    OxFabricsCmd *fcmd = (OxFabricsCmd *) &fc->req.cmd;
+    OxFabricsConnectData *data = (OxFabricsConnectData *) fc->buf;
+    struct ox_fabrics_ctrl *ctrl = NULL;
+    uint16_t qid = le16toh (fcmd->connect.qid);
+    uint16_t sqsize = le16toh (fcmd->connect.sqsize);
+    int i;
+
+    if (conn->ctrl)
+        return NVME_CMD_SEQ_ERROR | NVME_DNR;
+
+    if (!data || fc->len < sizeof (OxFabricsConnectData) ||
+                fcmd->connect.recfmt || !sqsize ||
+                sqsize >= OX_FABRICS_MAX_QD || qid > OX_FABRICS_MAX_QUEUES)
+        return OX_FABRICS_CONNECT_INVALID_PARAM | NVME_DNR;
+
+    data->subnqn[sizeof (data->subnqn) - 1] = '\0';
+    data->hostnqn[sizeof (data->hostnqn) - 1] = '\0';
+
+    /* There is no discovery controller, hosts connect to a known target */
+    if (!strcmp (data->subnqn, OX_FABRICS_DISC_NQN))
+        return OX_FABRICS_CONNECT_INVALID_PARAM | NVME_DNR;
+
+    pthread_mutex_lock (&fab.mutex);
+    if (!qid) {
+        for (i = 0; i < OX_FABRICS_MAX_CTRLS; i++) {
+            if (!fab.ctrl[i].used) {
+                ctrl = &fab.ctrl[i];
+                memset (ctrl, 0x0, sizeof (struct ox_fabrics_ctrl));
+                ctrl->used = 1;
+                ctrl->cntlid = i + 1;
+                ctrl->features = fab.n->features;
+                ctrl->features.int_vector_config = NULL;
+                strcpy (ctrl->subnqn, data->subnqn);
+                strcpy (ctrl->hostnqn, data->hostnqn);
+                break;
+            }
+        }
+    } else {
+        i = le16toh (data->cntlid) - 1;
+        if (i >= 0 && i < OX_FABRICS_MAX_CTRLS && fab.ctrl[i].used &&
+                    !fab.ctrl[i].dead &&
+                    (fab.ctrl[i].csts & NVME_CSTS_READY) &&
+                    !strcmp (fab.ctrl[i].subnqn, data->subnqn) &&
+                    !strcmp (fab.ctrl[i].hostnqn, data->hostnqn))
+            ctrl = &fab.ctrl[i];
+    }
+    if (ctrl) {
+        ctrl->refs++;
+        conn->ctrl = ctrl;
+        conn->qid = qid;
+        conn->qsize = sqsize + 1;
+    }
+    pthread_mutex_unlock (&fab.mutex);
+
+    if (!ctrl)
+        return (qid) ? OX_FABRICS_CONNECT_INVALID_HOST | NVME_DNR :
+                                                OX_FABRICS_CONNECT_CTRL_BUSY;
+
+    log_info ("[ox-fabrics: cntlid %d, qid %d connected, %d entries]\n",
+                                            ctrl->cntlid, qid, conn->qsize);
+
+    fc->req.cqe.n.result = htole32 (ctrl->cntlid);
+    return NVME_SUCCESS;
+}
+
+static uint16_t ox_fabrics_prop (struct ox_fabrics_cmd *fc)
+{
+    OxFabricsCmd *fcmd = (OxFabricsCmd *) &fc->req.cmd;
+    struct ox_fabrics_ctrl *ctrl = fc->conn->ctrl;
+    uint32_t off = le32toh (fcmd->prop.offset);
+    uint32_t cc;
+    uint64_t val;
+
+    if (!ctrl)
+        return NVME_CMD_SEQ_ERROR | NVME_DNR;
+    if (fc->conn->qid)
+        return NVME_INVALID_FIELD | NVME_DNR;
+
+    if (fcmd->fctype == OX_FABRICS_PROP_GET) {
+        switch (off) {
+            case offsetof (NvmeBar, cap):
+                val = fab.n->nvme_regs.vBar.cap &
+                            ~((uint64_t) CAP_MQES_MASK << CAP_MQES_SHIFT);
+                NVME_CAP_SET_MQES (val, (OX_FABRICS_MAX_QD - 1));
+                break;
+            case offsetof (NvmeBar, vs):
+                val = fab.n->nvme_regs.vBar.vs;
+                break;
+            case offsetof (NvmeBar, cc):
+                val = ctrl->cc;
+                break;
+            case offsetof (NvmeBar, csts):
+                val = ctrl->csts;
+                break;
+            default:
+                return NVME_INVALID_FIELD | NVME_DNR;
+        }
+        fc->req.cqe.res64 = htole64 (val);
+        return NVME_SUCCESS;
+    }
+
+    if (off != offsetof (NvmeBar, cc))
+        return NVME_INVALID_FIELD | NVME_DNR;
+
+    /* The controller is ready at once, a reset drops its I/O queues */
+    cc = (uint32_t) le64toh (fcmd->prop.value);
+    pthread_mutex_lock (&fab.mutex);
+    if (NVME_CC_EN (cc) && !NVME_CC_EN (ctrl->cc)) {
+        ctrl->csts = NVME_CSTS_READY;
+    } else if (!NVME_CC_EN (cc) && NVME_CC_EN (ctrl->cc)) {
+        ctrl->csts = 0;
+        ox_fabrics_kill_io (ctrl);
+    }
+    if (NVME_CC_SHN (cc))
+        ctrl->csts |= NVME_CSTS_SHST_COMPLETE;
+    ctrl->cc = cc;
+    pthread_mutex_unlock (&fab.mutex);
+
+    return NVME_SUCCESS;
+}
+
+/* Identify Controller, as seen by a fabrics host */
+static void ox_fabrics_id_ctrl (struct ox_fabrics_ctrl *ctrl, NvmeIdCtrl *id)
+{
+    OxFabricsIdCtrl *fid = (OxFabricsIdCtrl *) id->fabrics;
+
+    id->cntlid = htole16 (ctrl->cntlid);
+    id->rsv[11] = 1; /* CNTRLTYPE: I/O controller */
+    id->kas = htole16 (10); /* 100 ms units */
+    id->maxcmd = htole16 (OX_FABRICS_MAX_QD);
+    id->sgls = htole32 ((1 << 0) | (1 << 20)); /* offsets in data blocks */
+    memset (id->subnqn, 0x0, sizeof (id->subnqn));
+    strcpy ((char *) id->subnqn, ctrl->subnqn);
+
+    memset (fid, 0x0, sizeof (OxFabricsIdCtrl));
+    fid->ioccsz = htole32 ((sizeof (NvmeCmd) + OX_FABRICS_INLINE) / 16);
+    fid->iorcsz = htole32 (sizeof (NvmeCqe) / 16);
+    fid->msdbd = 1;
+}
+
+/*
+ * Features belong to the fabrics controller. The PCIe ones are never
+ * changed from here, and interrupts or LBA ranges do not apply.
+ */
+static uint16_t ox_fabrics_feature (struct ox_fabrics_cmd *fc)
+{
+    NvmeCmd *cmd = &fc->req.cmd;
+    NvmeFeatureVal *feat = &fc->conn->ctrl->features;
+    uint32_t nq = OX_FABRICS_MAX_QUEUES - 1;
+    uint32_t *val;
+
+    switch (cmd->cdw10 & 0xff) {
+        case NVME_NUMBER_OF_QUEUES:
+            fc->req.cqe.n.result = htole32 (nq | (nq << 16));
+            return NVME_SUCCESS;
+        case NVME_ARBITRATION:
+            val = &feat->arbitration;
+            break;
+        case NVME_POWER_MANAGEMENT:
+            val = &feat->power_mgmt;
+            break;
+        case NVME_TEMPERATURE_THRESHOLD:
+            /* No event is raised, fabrics AERs never complete */
+            val = &feat->temp_thresh;
+            break;
+        case NVME_ERROR_RECOVERY:
+            val = &feat->err_rec;
+            break;
+        case NVME_VOLATILE_WRITE_CACHE:
+            val = &feat->volatile_wc;
+            break;
+        case NVME_WRITE_ATOMICITY:
+            val = &feat->write_atomicity;
+            break;
+        case NVME_ASYNCHRONOUS_EVENT_CONF:
+            val = &feat->async_config;
+            break;
+        case NVME_SOFTWARE_PROGRESS_MARKER:
+            val = &feat->sw_prog_marker;
+            break;
+        default:
+            return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    if (cmd->opcode == NVME_ADM_CMD_SET_FEATURES)
+        *val = cmd->cdw11;
+    else
+        fc->req.cqe.n.result = htole32 (*val);
+
+    return NVME_SUCCESS;
+}
+
+/* Reading a log page here does not clear the PCIe AER mask */
+static uint16_t ox_fabrics_log (struct ox_fabrics_cmd *fc)
+{
+    NvmeCmd *cmd = &fc->req.cmd;
+    NvmeSmartLog smart;
+    void *src;
+    uint32_t len;
+
+    switch (cmd->cdw10 & 0xff) {
+        case NVME_LOG_ERROR_INFO:
+            src = fab.n->elpes;
+            len = sizeof (NvmeErrorLog);
+            break;
+        case NVME_LOG_SMART_INFO:
+            nvme_smart_log (fab.n, &smart);
+            src = &smart;
+            len = sizeof (NvmeSmartLog);
+            break;
+        case NVME_LOG_FW_SLOT_INFO:
+            return NVME_SUCCESS;
+        default:
+            return NVME_INVALID_LOG_ID | NVME_DNR;
+    }
+
+    if (fc->buf)
+        memcpy (fc->buf, src, MIN (len, fc->len));
+
+    return NVME_SUCCESS;
+}
+
+static uint16_t ox_fabrics_admin (struct ox_fabrics_cmd *fc)
+{
+    NvmeCmd *cmd = &fc->req.cmd;
+    uint16_t status;
+
+    switch (cmd->opcode) {
+        case NVME_ADM_CMD_KEEP_ALIVE:
+            return NVME_SUCCESS;
+        case NVME_ADM_CMD_ASYNC_EV_REQ:
+            /* There are no fabrics events, it is held until disconnect */
+            return NVME_NO_COMPLETE;
+        case NVME_ADM_CMD_SET_FEATURES:
+        case NVME_ADM_CMD_GET_FEATURES:
+            return ox_fabrics_feature (fc);
+        case NVME_ADM_CMD_GET_LOG_PAGE:
+            return ox_fabrics_log (fc);
+        case NVME_ADM_CMD_IDENTIFY:
+            break;
+        default:
+            return NVME_INVALID_OPCODE | NVME_DNR;
+    }
+
+    status = nvme_admin_cmd (fab.n, cmd, &fc->req);
+
+    if (status == NVME_SUCCESS && cmd->opcode == NVME_ADM_CMD_IDENTIFY &&
+                    (cmd->cdw10 & 0xff) == 1 && fc->len >= sizeof (NvmeIdCtrl))
+        ox_fabrics_id_ctrl (fc->conn->ctrl, (NvmeIdCtrl *) fc->buf);
+
+    return status;
+}
+
+static uint16_t ox_fabrics_io (struct ox_fabrics_cmd *fc)
+{
+    NvmeCmd *cmd = &fc->req.cmd;
+    uint16_t status;
+
+    switch (cmd->opcode) {
+        case NVME_CMD_READ:
+            if (core.lnvm && lnvm_dev (fab.n))
+                return NVME_INVALID_OPCODE | NVME_DNR;
+            /* fall through */
+        case NVME_CMD_WRITE:
+        case NVME_CMD_FLUSH:
+        case NVME_CMD_DSM:
+            break;
+        default:
+            return NVME_INVALID_OPCODE | NVME_DNR;
+    }
+
+    /* Nothing else waits on this queue while the FTL has no room */
+    while ((status = nvme_io_cmd (fab.n, cmd, &fc->req)) == NVME_QUEUE_FULL
+                                                            && !fab.stop)
+        usleep (OX_FABRICS_FULL_US);
+
+    return (status == NVME_QUEUE_FULL) ? NVME_CMD_ABORT_REQ : status;
+}
+
+static void ox_fabrics_exec (struct ox_fabrics_cmd *fc)
+{
+    struct ox_fabrics_conn *conn = fc->conn;
+    NvmeCmd *cmd = &fc->req.cmd;
+    NvmeSglDesc *desc = (NvmeSglDesc *) &cmd->prp1;
+    uint16_t status;
+    uint8_t exec;
+
+    /* The data pointer now points to the controller buffer */
+    memset (desc, 0x0, sizeof (NvmeSglDesc));
+    if (fc->buf) {
+        cmd->psdt = CMD_PSDT_SGL;
+        desc->addr = NVME_LOCAL_ADDR | (uintptr_t) fc->buf;
+        desc->len = fc->len;
+        desc->type = NVME_SGL_DATA_BLOCK << 4;
+    }
+
+    fc->aer = !conn->qid && cmd->opcode == NVME_ADM_CMD_ASYNC_EV_REQ;
+    pthread_mutex_lock (&conn->mutex);
+    fc->state = OX_FCMD_EXEC;
+    if (!fc->aer)
+        conn->busy++;
+    pthread_mutex_unlock (&conn->mutex);
+
+    if (cmd->opcode == OX_FABRICS_CMD) {
+        switch (((OxFabricsCmd *) cmd)->fctype) {
+            case OX_FABRICS_CONNECT:
+                status = ox_fabrics_connect (fc);
+                break;
+            case OX_FABRICS_PROP_GET:
+            case OX_FABRICS_PROP_SET:
+                status = ox_fabrics_prop (fc);
+                break;
+            default:
+                status = NVME_INVALID_OPCODE | NVME_DNR;
+        }
+    } else if (!conn->ctrl) {
+        status = NVME_CMD_SEQ_ERROR | NVME_DNR;
+    } else if (!conn->qid) {
+        status = ox_fabrics_admin (fc);
+    } else {
+        status = ox_fabrics_io (fc);
+    }
+
+    if (status == NVME_NO_COMPLETE)
+        return;
+
+    /* Failed before the FTL or completed at once, see nvme_process_sq */
+    pthread_mutex_lock (&conn->mutex);
+    exec = fc->state == OX_FCMD_EXEC;
+    pthread_mutex_unlock (&conn->mutex);
+
+    if (exec) {
+        fc->req.status = status;
+        ox_fabrics_done (&fc->req);
+    }
+}
+
+static int ox_fabrics_capsule (struct ox_fabrics_conn *conn, NvmeCmd *sqe,
+                                                                uint32_t dlen)
+{
+    NvmeSglDesc *desc = (NvmeSglDesc *) &sqe->prp1;
+    struct ox_fabrics_cmd *fc;
+    uint32_t len = le32toh (desc->len);
+    uint8_t dir = ox_fabrics_dir (sqe);
+    uint8_t incapsule = desc->type == OX_TCP_SGL_INCAPSULE;
+    uint16_t status = NVME_SUCCESS;
+
+    /* The host sent more commands than queue entries */
+    fc = ox_fabrics_get_cmd (conn);
+    if (!fc)
+        return -1;
+
+    memset (&fc->req, 0x0, sizeof (NvmeRequest));
+    fc->req.cmd = *sqe;
+    fc->req.fabrics_cb = ox_fabrics_done;
+    fc->buf = NULL;
+    fc->len = fc->rcvd = 0;
+    fc->c2h = 0;
+
+    if (dir && len) {
+        if (len > OX_FABRICS_MAX_DATA)
+            status = NVME_INVALID_FIELD | NVME_DNR;
+        else if ((incapsule && (desc->addr || len != dlen || dir != 1)) ||
+                (!incapsule && (desc->type != OX_TCP_SGL_TRANSPORT || dlen)))
+            status = NVME_SGL_DESC_TYPE_INVALID | NVME_DNR;
+
+        /* Commands may copy a whole page, as Identify does */
+        if (!status) {
+            fc->buf = calloc (1, MAX (len, NVME_KERNEL_PG_SIZE));
+            if (!fc->buf)
+                status = NVME_INTERNAL_DEV_ERROR;
+            fc->len = len;
+            fc->c2h = dir == 2;
+        }
+    }
+
+    if (fc->buf && dlen) {
+        if (ox_fabrics_recv (conn->fd, fc->buf, dlen))
+            return -1;
+        fc->rcvd = dlen;
+    } else if (dlen && ox_fabrics_skip (conn->fd, dlen)) {
+        return -1;
+    }
+
+    if (status) {
+        fc->req.status = status;
+        ox_fabrics_queue_tx (fc, 0);
+        return 0;
+    }
+
+    /* Write data not in the capsule is requested with a R2T */
+    if (fc->buf && !fc->c2h && fc->rcvd < fc->len) {
+        ox_fabrics_queue_tx (fc, 1);
+        return 0;
+    }
+
+    ox_fabrics_exec (fc);
+    return 0;
+}
+
+static int ox_fabrics_h2c (struct ox_fabrics_conn *conn, OxTcpData *pdu,
+                                                                uint32_t dlen)
+{
+    struct ox_fabrics_cmd *fc;
+    uint16_t ttag = le16toh (pdu->ttag);
+    uint32_t off = le32toh (pdu->offset);
+    uint32_t len = le32toh (pdu->len);
+    uint8_t state;
+
+    if (ttag >= OX_FABRICS_MAX_QD)
+        return -1;
+    fc = &conn->cmd[ttag];
+
+    pthread_mutex_lock (&conn->mutex);
+    state = fc->state;
+    pthread_mutex_unlock (&conn->mutex);
+
+    if (state != OX_FCMD_DATA || fc->req.cmd.cid != pdu->cccid ||
+                    len != dlen || off != fc->rcvd || len > fc->len - off)
+        return -1;
+
+    if (ox_fabrics_recv (conn->fd, fc->buf + off, len))
+        return -1;
+    fc->rcvd += len;
+
+    if (fc->rcvd == fc->len)
+        ox_fabrics_exec (fc);
+
+    return 0;
+}
+
+static int ox_fabrics_icreq (struct ox_fabrics_conn *conn)
+{
+    OxTcpICReq req;
+    OxTcpICResp resp;
+
+    if (ox_fabrics_recv (conn->fd, &req, sizeof (OxTcpICReq)))
+        return -1;
+
+    if (req.hdr.type != OX_TCP_ICREQ || req.hdr.hlen != sizeof (OxTcpICReq)
+                    || le32toh (req.hdr.plen) != sizeof (OxTcpICReq)
+                    || req.pfv || req.hpda > 31)
+        return -1;
+    conn->hpda = (req.hpda + 1) * 4;
+
+    /* Digests are not supported, the host runs without them */
+    memset (&resp, 0x0, sizeof (OxTcpICResp));
+    ox_fabrics_hdr (&resp.hdr, OX_TCP_ICRESP, sizeof (OxTcpICResp), 0,
+                                                        sizeof (OxTcpICResp));
+    resp.maxdata = htole32 (OX_FABRICS_MAX_DATA);
+
+    return ox_fabrics_send (conn->fd, &resp, sizeof (OxTcpICResp), 0);
+}
+
+static void ox_fabrics_conn_exit (struct ox_fabrics_conn *conn)
+{
+    struct ox_fabrics_ctrl *ctrl = conn->ctrl;
+    int i;
+
+    /* Commands in the FTL complete first, their responses are dropped */
+    shutdown (conn->fd, SHUT_RDWR);
+    pthread_mutex_lock (&conn->mutex);
+    conn->stop = 1;
+    pthread_cond_broadcast (&conn->cond);
+    pthread_mutex_unlock (&conn->mutex);
+    pthread_join (conn->tx_th, NULL);
+
+    for (i = 0; i < OX_FABRICS_MAX_QD; i++)
+        free (conn->cmd[i].buf);
+
+    pthread_mutex_lock (&fab.mutex);
+    if (ctrl) {
+        if (!conn->qid) {
+            ctrl->dead = 1;
+            ox_fabrics_kill_io (ctrl);
+        }
+        if (!--ctrl->refs)
+            ctrl->used = 0;
+        log_info ("[ox-fabrics: cntlid %d, qid %d disconnected]\n",
+                                                    ctrl->cntlid, conn->qid);
+    }
+    LIST_REMOVE (conn, entry);
+    pthread_cond_broadcast (&fab.cond);
+    pthread_mutex_unlock (&fab.mutex);
+
+    close (conn->fd);
+    pthread_cond_destroy (&conn->cond);
+    pthread_mutex_destroy (&conn->mutex);
+    free (conn);
+}
+
+static void *ox_fabrics_rx (void *arg)
+{
+    struct ox_fabrics_conn *conn = arg;
+    union {
+        OxTcpHdr    hdr;
+        uint8_t     raw[sizeof (OxTcpHdr) + sizeof (NvmeCmd)];
+    } pdu;
+    uint32_t plen, doff, hlen;
+
+    if (ox_fabrics_icreq (conn))
+        goto OUT;
+
+    while (!fab.stop) {
+        if (ox_fabrics_recv (conn->fd, &pdu.hdr, sizeof (OxTcpHdr)))
+            break;
+
+        switch (pdu.hdr.type) {
+            case OX_TCP_CMD:
+                hlen = sizeof (OxTcpHdr) + sizeof (NvmeCmd);
+                break;
+            case OX_TCP_H2C_DATA:
+                hlen = sizeof (OxTcpData);
+                break;
+            default:
+                /* H2CTermReq or anything a host does not send */
+                goto OUT;
+        }
+
+        plen = le32toh (pdu.hdr.plen);
+        doff = (pdu.hdr.pdo) ? pdu.hdr.pdo : hlen;
+        if (pdu.hdr.hlen != hlen || doff < hlen || plen < doff ||
+                    plen - doff > OX_FABRICS_MAX_DATA)
+            goto OUT;
+
+        if (ox_fabrics_recv (conn->fd, pdu.raw + sizeof (OxTcpHdr),
+                                            hlen - sizeof (OxTcpHdr)) ||
+                    ox_fabrics_skip (conn->fd, doff - hlen))
+            goto OUT;
+
+        if (pdu.hdr.type == OX_TCP_CMD) {
+            if (plen - doff > OX_FABRICS_INLINE ||
+                    ox_fabrics_capsule (conn, (NvmeCmd *)
+                            (pdu.raw + sizeof (OxTcpHdr)), plen - doff))
+                goto OUT;
+        } else if (ox_fabrics_h2c (conn, (OxTcpData *) pdu.raw, plen - doff)) {
+            goto OUT;
+        }
+    }
+
+OUT:
+    ox_fabrics_conn_exit (conn);
+    return NULL;
+}
+
+static void ox_fabrics_conn_new (int fd)
+{
+    struct ox_fabrics_conn *conn;
+    pthread_attr_t attr;
+    int i, one = 1;
+
+    conn = calloc (1, sizeof (struct ox_fabrics_conn));
+    if (!conn) {
+        close (fd);
+        return;
+    }
+
+    conn->fd = fd;
+    conn->hpda = 4;
+    pthread_mutex_init (&conn->mutex, NULL);
+    pthread_cond_init (&conn->cond, NULL);
+    TAILQ_INIT (&conn->tx);
+    for (i = 0; i < OX_FABRICS_MAX_QD; i++) {
+        conn->cmd[i].conn = conn;
+        conn->cmd[i].ttag = i;
+    }
+    setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+
+    if (pthread_create (&conn->tx_th, NULL, ox_fabrics_tx, conn))
+        goto FREE;
+
+    pthread_attr_init (&attr);
+    pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+
+    /* The receiver owns the connection from here, even if stopping */
+    pthread_mutex_lock (&fab.mutex);
+    LIST_INSERT_HEAD (&fab.conns, conn, entry);
+    if (pthread_create (&conn->rx_th, &attr, ox_fabrics_rx, conn)) {
+        LIST_REMOVE (conn, entry);
+        pthread_mutex_unlock (&fab.mutex);
+        pthread_attr_destroy (&attr);
+
+        pthread_mutex_lock (&conn->mutex);
+        conn->stop = 1;
+        pthread_cond_broadcast (&conn->cond);
+        pthread_mutex_unlock (&conn->mutex);
+        pthread_join (conn->tx_th, NULL);
+        goto FREE;
+    }
+    if (fab.stop)
+        shutdown (fd, SHUT_RDWR);
+    pthread_mutex_unlock (&fab.mutex);
+    pthread_attr_destroy (&attr);
+    return;
+
+FREE:
+    log_err ("[ox-fabrics: connection not started]\n");
+    close (fd);
+    pthread_cond_destroy (&conn->cond);
+    pthread_mutex_destroy (&conn->mutex);
+    free (conn);
+}
+
+static void *ox_fabrics_listen (void *arg)
+{
+    int fd;
+
+    while (!fab.stop) {
+        fd = accept (fab.fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (!fab.stop)
+                log_err ("[ox-fabrics: accept failed: %d]\n", errno);
+            break;
+        }
+        ox_fabrics_conn_new (fd);
+    }
+
+    return NULL;
+}
+
+int ox_fabrics_init (NvmeCtrl *n, uint16_t port)
+{
+    struct sockaddr_in6 addr;
+    int one = 1;
+
+    memset (&fab, 0x0, sizeof (struct ox_fabrics));
+    fab.n = n;
+    LIST_INIT (&fab.conns);
+
+    fab.fd = socket (AF_INET6, SOCK_STREAM, 0);
+    if (fab.fd < 0)
+        return -1;
+    setsockopt (fab.fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+
+    memset (&addr, 0x0, sizeof (addr));
+    addr.sin6_family = AF_INET6;
+    addr.sin6_addr = in6addr_any;
+    addr.sin6_port = htons (port);
+
+    if (bind (fab.fd, (struct sockaddr *) &addr, sizeof (addr)) ||
+                                        listen (fab.fd, OX_FABRICS_BACKLOG))
+        goto CLOSE;
+
+    pthread_mutex_init (&fab.mutex, NULL);
+    pthread_cond_init (&fab.cond, NULL);
+
+    if (pthread_create (&fab.th, NULL, ox_fabrics_listen, NULL)) {
+        pthread_cond_destroy (&fab.cond);
+        pthread_mutex_destroy (&fab.mutex);
+        goto CLOSE;
+    }
+    fab.started = 1;
+
+    log_info ("  [nvm: NVMe/TCP target listening on port %d]\n", port);
+    return 0;
+
+CLOSE:
+    close (fab.fd);
+    return -1;
+}
+
+void ox_fabrics_exit (void)
+{
+    struct ox_fabrics_conn *conn;
+
+    if (!fab.started)
+        return;
+
+    /* New connections are refused, the open ones wait for the FTL */
+    pthread_mutex_lock (&fab.mutex);
+    fab.stop = 1;
+    shutdown (fab.fd, SHUT_RDWR);
+    pthread_mutex_unlock (&fab.mutex);
+    pthread_join (fab.th, NULL);
+    close (fab.fd);
+
+    pthread_mutex_lock (&fab.mutex);
+    LIST_FOREACH (conn, &fab.conns, entry)
+        shutdown (conn->fd, SHUT_RDWR);
+    while (!LIST_EMPTY (&fab.conns))
+        pthread_cond_wait (&fab.cond, &fab.mutex);
+    pthread_mutex_unlock (&fab.mutex);
+
+    pthread_cond_destroy (&fab.cond);
+    pthread_mutex_destroy (&fab.mutex);
+    fab.started = 0;
+
+    log_info ("  [nvm: NVMe/TCP target stopped]\n");
+}
@@ -0,0 +1,277 @@
+/* OX: Open-Channel NVM Express SSD Controller
+ *  - Latency histograms of the I/O pipeline stages
+ */
+
+#include "qemu/osdep.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hw/block/ox-ctrl/include/ssd.h"
+#include "hw/block/ox-ctrl/include/ox-lat.h"
+#include "trace.h"
+
+static struct ox_lat_hist *lat_hist;
+static uint16_t lat_nch;
+
+static const char *lat_stage_name[OX_LAT_STAGES] = {
+    [OX_LAT_FETCH]      = "fetch",
+    [OX_LAT_FTL_WAIT]   = "ftl_wait",
+    [OX_LAT_FTL]        = "ftl",
+    [OX_LAT_MMGR_WAIT]  = "mmgr_wait",
+    [OX_LAT_MEDIA]      = "media",
+    [OX_LAT_CQ]         = "cq",
+    [OX_LAT_TOTAL]      = "total",
+};
+
+static const char *lat_op_name[OX_LAT_OPS] = {
+    [OX_LAT_OP_READ]    = "read",
+    [OX_LAT_OP_WRITE]   = "write",
+    [OX_LAT_OP_ERASE]   = "erase",
+    [OX_LAT_OP_OTHER]   = "other",
+};
+
+const char *ox_lat_stage_name (uint8_t stage)
+{
+    return (stage < OX_LAT_STAGES) ? lat_stage_name[stage] : "unknown";
+}
+
+const char *ox_lat_op_name (uint8_t op)
+{
+    return (op < OX_LAT_OPS) ? lat_op_name[op] : "unknown";
+}
+
+uint16_t ox_lat_channels (void)
+{
+    return (lat_hist) ? lat_nch : 0;
+}
+
+static uint8_t ox_lat_op (uint8_t cmdtype)
+{
+    switch (cmdtype) {
+        case MMGR_READ_PG:
+        case MMGR_READ_OOB:
+        case MMGR_READ_SGL:
+            return OX_LAT_OP_READ;
+        case MMGR_WRITE_PG:
+        case MMGR_WRITE_SGL:
+            return OX_LAT_OP_WRITE;
+        case MMGR_ERASE_BLK:
+            return OX_LAT_OP_ERASE;
+        default:
+            return OX_LAT_OP_OTHER;
+    }
+}
+
+static inline struct ox_lat_hist *ox_lat_hist_get (uint8_t stage, uint8_t op,
+                                                                   uint16_t ch)
+{
+    return &lat_hist[((uint32_t) stage * OX_LAT_OPS + op) * lat_nch + ch];
+}
+
+static inline uint32_t ox_lat_bucket (uint64_t ns)
+{
+    uint32_t e;
+
+    if (ns < OX_LAT_SUB_COUNT)
+        return ns;
+    if (ns >> OX_LAT_MAX_BITS)
+        return OX_LAT_BUCKETS - 1;
+
+    e = 63 - __builtin_clzll (ns) - (OX_LAT_SUB_BITS - 1);
+    return e * OX_LAT_SUB_HALF + (ns >> e);
+}
+
+/* Highest value counted in the bucket */
+static inline uint64_t ox_lat_bucket_value (uint32_t b)
+{
+    uint32_t e;
+
+    if (b < OX_LAT_SUB_COUNT)
+        return b;
+
+    e = b / OX_LAT_SUB_HALF - 1;
+    return ((uint64_t) (b - e * OX_LAT_SUB_HALF + 1) << e) - 1;
+}
+
+/* Adds a sample to a histogram, any thread may add concurrently */
+void ox_lat_hist_add (struct ox_lat_hist *h, uint64_t ns)
+{
+    uint64_t old;
+
+    __atomic_fetch_add (&h->bucket[ox_lat_bucket (ns)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add (&h->sum, ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add (&h->count, 1, __ATOMIC_RELAXED);
+
+    old = __atomic_load_n (&h->min, __ATOMIC_RELAXED);
+    while ((!old || ns < old) && !__atomic_compare_exchange_n (&h->min, &old,
+                                ns, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    old = __atomic_load_n (&h->max, __ATOMIC_RELAXED);
+    while (ns > old && !__atomic_compare_exchange_n (&h->max, &old, ns, 0,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/* Sums 'n' histograms, concurrent updates may be partially seen */
+static void ox_lat_hist_merge (struct ox_lat_hist *dst,
+                                            struct ox_lat_hist *h, uint32_t n)
+{
+    uint64_t min, max;
+    uint32_t i, b;
+
+    memset (dst, 0x0, sizeof (struct ox_lat_hist));
+
+    for (i = 0; i < n; i++) {
+        if (!__atomic_load_n (&h[i].count, __ATOMIC_RELAXED))
+            continue;
+
+        for (b = 0; b < OX_LAT_BUCKETS; b++)
+            dst->bucket[b] += __atomic_load_n (&h[i].bucket[b],
+                                                             __ATOMIC_RELAXED);
+        dst->sum += __atomic_load_n (&h[i].sum, __ATOMIC_RELAXED);
+
+        min = __atomic_load_n (&h[i].min, __ATOMIC_RELAXED);
+        max = __atomic_load_n (&h[i].max, __ATOMIC_RELAXED);
+        if (!dst->min || (min && min < dst->min))
+            dst->min = min;
+        if (max > dst->max)
+            dst->max = max;
+    }
+
+    /* The count is taken from the buckets, so percentiles are consistent */
+    for (b = 0; b < OX_LAT_BUCKETS; b++)
+        dst->count += dst->bucket[b];
+}
+
+/* Summary of a histogram that is not being updated */
+void ox_lat_hist_summary (struct ox_lat_hist *h, struct ox_lat_st *st)
+{
+    static const uint32_t pct[] = { 500, 900, 990, 999 };
+    uint64_t *pval[] = { &st->p50, &st->p90, &st->p99, &st->p999 };
+    uint64_t acc = 0;
+    uint32_t b, p = 0;
+
+    memset (st, 0x0, sizeof (struct ox_lat_st));
+    for (b = 0; b < OX_LAT_BUCKETS; b++)
+        st->count += h->bucket[b];
+    if (!st->count)
+        return;
+
+    st->min = h->min;
+    st->max = h->max;
+    st->mean = h->sum / st->count;
+
+    for (b = 0; b < OX_LAT_BUCKETS && p < 4; b++) {
+        acc += h->bucket[b];
+        while (p < 4 && acc * 1000 >= st->count * pct[p]) {
+            *pval[p] = MIN(ox_lat_bucket_value (b), st->max);
+            p++;
+        }
+    }
+}
+
+/**
+ * Records the time between 'start' and 'end' to the histogram of a stage.
+ * A zero 'start' means the stage was not timed, as for commands that did not
+ * come from a NVMe queue.
+ *
+ * @param stage - OX_LAT_* stage
+ * @param cmdtype - MMGR_* command type
+ * @param ch - channel id
+ * @param cid - command id for tracing, 0 for FTL internal I/O
+ * @param start, end - CLOCK_MONOTONIC nsec
+ */
+void ox_lat_record (uint8_t stage, uint8_t cmdtype, uint16_t ch, uint64_t cid,
+                                                uint64_t start, uint64_t end)
+{
+    uint64_t ns;
+    uint8_t op;
+
+    if (!start || end < start || stage >= OX_LAT_STAGES)
+        return;
+
+    ns = end - start;
+    op = ox_lat_op (cmdtype);
+
+    trace_ox_lat_stage (cid, lat_stage_name[stage], lat_op_name[op], ch, ns);
+
+    if (!lat_hist || ch >= lat_nch)
+        return;
+
+    ox_lat_hist_add (ox_lat_hist_get (stage, op, ch), ns);
+}
+
+/**
+ * Summary of a stage and operation, of a channel or of all channels if 'ch'
+ * is OX_LAT_ALL_CH.
+ *
+ * @return 0 on success, -1 if the histograms are not available
+ */
+int ox_lat_get (uint8_t stage, uint8_t op, uint16_t ch, struct ox_lat_st *st)
+{
+    struct ox_lat_hist *agg;
+
+    if (!lat_hist || stage >= OX_LAT_STAGES || op >= OX_LAT_OPS ||
+                                        (ch >= lat_nch && ch != OX_LAT_ALL_CH))
+        return -1;
+
+    agg = malloc (sizeof (struct ox_lat_hist));
+    if (!agg)
+        return -1;
+
+    if (ch == OX_LAT_ALL_CH)
+        ox_lat_hist_merge (agg, ox_lat_hist_get (stage, op, 0), lat_nch);
+    else
+        ox_lat_hist_merge (agg, ox_lat_hist_get (stage, op, ch), 1);
+
+    ox_lat_hist_summary (agg, st);
+    free (agg);
+
+    return 0;
+}
+
+void ox_lat_reset (void)
+{
+    size_t i, n;
+
+    if (!lat_hist)
+        return;
+
+    n = (size_t) OX_LAT_STAGES * OX_LAT_OPS * lat_nch *
+                                         (sizeof (struct ox_lat_hist) / 8);
+    for (i = 0; i < n; i++)
+        __atomic_store_n (&((uint64_t *) lat_hist)[i], 0, __ATOMIC_RELAXED);
+}
+
+/*
+ * Histograms are kept across controller restarts (AppNVM restarts at every
+ * NVMe flush), they are allocated once for the number of channels.
+ */
+int ox_lat_init (uint16_t n_ch)
+{
+    struct ox_lat_hist *hist;
+
+    if (lat_hist)
+        return (n_ch <= lat_nch) ? 0 : -1;
+
+    if (!n_ch)
+        return -1;
+
+    hist = calloc ((size_t) OX_LAT_STAGES * OX_LAT_OPS * n_ch,
+                                                  sizeof (struct ox_lat_hist));
+    if (!hist)
+        return -1;
+
+    lat_nch = n_ch;
+    __atomic_store_n (&lat_hist, hist, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+void ox_lat_exit (void)
+{
+    struct ox_lat_hist *hist = lat_hist;
+
+    __atomic_store_n (&lat_hist, NULL, __ATOMIC_RELEASE);
+    lat_nch = 0;
+    free (hist);
+}
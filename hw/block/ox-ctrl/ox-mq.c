@@ -9,12 +9,17 @@
 #include "include/ox-mq.h"
 #include "include/ssd.h"
 
+#ifdef CONFIG_NUMA
+#include <numa.h>
+#endif
+
 static int mq_count = 0;
 LIST_HEAD(mq_list, ox_mq) mq_head = LIST_HEAD_INITIALIZER(mq_head);
+static pthread_mutex_t mq_mutex = PTHREAD_MUTEX_INITIALIZER; /* mq_head */
 
 int ox_mq_get_status (struct ox_mq *mq, struct ox_mq_stats *st, uint16_t qid)
 {
-    if (!mq || !st || qid > mq->config->n_queues)
+    if (!mq || !st || qid >= mq->config->n_queues)
         return -1;
 
     memcpy (st, &mq->queues[qid].stats, sizeof (struct ox_mq_stats));
@@ -29,16 +34,40 @@ int ox_mq_used_count (struct ox_mq *mq, uint16_t qid)
         return -1;
     }
 
-    if (qid > mq->config->n_queues)
+    if (qid >= mq->config->n_queues)
         return -1;
 
     return u_atomic_read(&mq->queues[qid].stats.sq_used);
 }
 
+/* Writes a cpu set as a list of ranges, e.g. "0-3,8" */
+static void ox_mq_cpus_str (cpu_set_t *cpus, char *buf, size_t size)
+{
+    int cpu, first = -1, off = 0;
+
+    buf[0] = '\0';
+    for (cpu = 0; cpu <= CPU_SETSIZE && off < size; cpu++) {
+        if (cpu < CPU_SETSIZE && CPU_ISSET (cpu, cpus)) {
+            if (first < 0)
+                first = cpu;
+            continue;
+        }
+        if (first < 0)
+            continue;
+
+        off += (first == cpu - 1) ?
+            snprintf (buf + off, size - off, "%s%d", off ? "," : "", first) :
+            snprintf (buf + off, size - off, "%s%d-%d", off ? "," : "",
+                                                              first, cpu - 1);
+        first = -1;
+    }
+}
+
 void ox_mq_show_mq (struct ox_mq *mq)
 {
     int i;
     struct ox_mq_queue *q;
+    char cpus[64];
 
     printf ("ox-mq: %s\n", mq->config->name);
     for (i = 0; i < mq->config->n_queues; i++) {
@@ -50,6 +79,21 @@ void ox_mq_show_mq (struct ox_mq *mq)
                 u_atomic_read(&q->stats.cq_free),
                 u_atomic_read(&q->stats.cq_used));
     }
+    for (i = 0; i < mq->config->n_queues; i++) {
+        q = &mq->queues[i];
+        if (!q->pinned)
+            continue;
+        ox_mq_cpus_str (&q->cpus, cpus, sizeof (cpus));
+        printf ("    Q%02d: CPU: %s, NODE: %d\n", i, cpus, q->node);
+    }
+    if (mq->config->flags & OX_MQ_POLL) {
+        for (i = 0; i < mq->config->n_queues; i++) {
+            q = &mq->queues[i];
+            printf ("    Q%02d: SPIN: %d, PARK: %d\n", i,
+                    u_atomic_read(&q->stats.spin),
+                    u_atomic_read(&q->stats.park));
+        }
+    }
     printf ("    EXT%02d: TO: %d, TO_BACK: %d\n",
                 u_atomic_read(&mq->stats.ext_list),
                 u_atomic_read(&mq->stats.timeout),
@@ -59,18 +103,34 @@ void ox_mq_show_mq (struct ox_mq *mq)
 void ox_mq_show_all (void)
 {
     struct ox_mq *mq;
+    pthread_mutex_lock (&mq_mutex);
     LIST_FOREACH (mq, &mq_head, entry) {
         ox_mq_show_mq (mq);
     }
+    pthread_mutex_unlock (&mq_mutex);
+}
+
+/* Calls fn for each running multi queue, which can't be destroyed meanwhile */
+void ox_mq_foreach (ox_mq_foreach_fn *fn, void *arg)
+{
+    struct ox_mq *mq;
+
+    pthread_mutex_lock (&mq_mutex);
+    LIST_FOREACH (mq, &mq_head, entry) {
+        fn (mq, arg);
+    }
+    pthread_mutex_unlock (&mq_mutex);
 }
 
 struct ox_mq *ox_mq_get (const char *name) {
     struct ox_mq *mq;
+    pthread_mutex_lock (&mq_mutex);
     LIST_FOREACH(mq, &mq_head, entry){
         if(!strcmp (mq->config->name, name))
-            return mq;
+            break;
     }
-    return NULL;
+    pthread_mutex_unlock (&mq_mutex);
+    return mq;
 }
 
 static void ox_mq_init_stats (struct ox_mq_stats *stats)
@@ -83,41 +143,424 @@ static void ox_mq_init_stats (struct ox_mq_stats *stats)
     stats->ext_list.counter = U_ATOMIC_INIT_RUNTIME(0);
     stats->timeout.counter = U_ATOMIC_INIT_RUNTIME(0);
     stats->to_back.counter = U_ATOMIC_INIT_RUNTIME(0);
+    stats->spin.counter = U_ATOMIC_INIT_RUNTIME(0);
+    stats->park.counter = U_ATOMIC_INIT_RUNTIME(0);
+}
+
+/*
+ * Parses a list of cpus, e.g. "0-3,8", and spreads them over n_sets cpu sets.
+ * Set i receives the cpu (i % number of cpus) of the list. Returns the
+ * number of cpus in the list, or -1 if the list is invalid.
+ */
+int ox_mq_parse_cpus (const char *list, cpu_set_t *sets, uint32_t n_sets)
+{
+    int cpu[CPU_SETSIZE];
+    int ncpu = 0, first, last, i;
+    const char *str = list;
+    char *end;
+
+    while (*str) {
+        first = strtol (str, &end, 10);
+        if (end == str || first < 0 || first >= CPU_SETSIZE)
+            return -1;
+        last = first;
+        str = end;
+
+        if (*str == '-') {
+            last = strtol (str + 1, &end, 10);
+            if (end == str + 1 || last < first || last >= CPU_SETSIZE)
+                return -1;
+            str = end;
+        }
+
+        for (i = first; i <= last && ncpu < CPU_SETSIZE; i++)
+            cpu[ncpu++] = i;
+
+        if (*str == ',')
+            str++;
+        else if (*str)
+            return -1;
+    }
+
+    if (!ncpu)
+        return -1;
+
+    for (i = 0; i < n_sets; i++) {
+        CPU_ZERO (&sets[i]);
+        CPU_SET (cpu[i % ncpu], &sets[i]);
+    }
+
+    return ncpu;
+}
+
+/* NUMA node of the first cpu in the set, or -1 if unknown */
+static int ox_mq_cpus_node (cpu_set_t *cpus)
+{
+#ifdef CONFIG_NUMA
+    int cpu;
+
+    if (numa_available () < 0)
+        return -1;
+
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        if (CPU_ISSET (cpu, cpus))
+            return numa_node_of_cpu (cpu);
+#endif
+    return -1;
+}
+
+/* Allocates zeroed memory on a NUMA node, any node if node is -1 */
+static void *ox_mq_alloc (int node, size_t size)
+{
+#ifdef CONFIG_NUMA
+    if (node >= 0)
+        return numa_alloc_onnode (size, node);
+#endif
+    return calloc (1, size);
+}
+
+static void ox_mq_free (int node, void *ptr, size_t size)
+{
+    if (!ptr)
+        return;
+#ifdef CONFIG_NUMA
+    if (node >= 0) {
+        numa_free (ptr, size);
+        return;
+    }
+#endif
+    free (ptr);
+}
+
+static int ox_mq_ring_init (struct ox_mq_ring *r, uint32_t size, int node)
+{
+    uint64_t i, n = 1;
+
+    /* Ring size must be a power of 2 */
+    while (n < size)
+        n <<= 1;
+
+    r->cells = ox_mq_alloc (node, sizeof (struct ox_mq_ring_cell) * n);
+    if (!r->cells)
+        return -1;
+
+    for (i = 0; i < n; i++) {
+        r->cells[i].seq = i;
+        r->cells[i].data = NULL;
+    }
+
+    r->mask = n - 1;
+    r->head = 0;
+    r->tail = 0;
+
+    return 0;
+}
+
+static void ox_mq_ring_free (struct ox_mq_ring *r, int node)
+{
+    ox_mq_free (node, r->cells, sizeof (struct ox_mq_ring_cell) *
+                                                                (r->mask + 1));
+    r->cells = NULL;
+}
+
+/* Returns 0 if data is in the ring, or -1 if ring is full */
+static inline int ox_mq_ring_push (struct ox_mq_ring *r, void *data)
+{
+    struct ox_mq_ring_cell *cell;
+    uint64_t pos, seq;
+    int64_t dif;
+
+    pos = __atomic_load_n (&r->tail, __ATOMIC_RELAXED);
+    for (;;) {
+        cell = &r->cells[pos & r->mask];
+        seq = __atomic_load_n (&cell->seq, __ATOMIC_ACQUIRE);
+        dif = (int64_t) seq - (int64_t) pos;
+
+        if (!dif) {
+            if (__atomic_compare_exchange_n (&r->tail, &pos, pos + 1, 1,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+                break;
+        } else if (dif < 0) {
+            return -1;
+        } else {
+            pos = __atomic_load_n (&r->tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    cell->data = data;
+    __atomic_store_n (&cell->seq, pos + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/* Returns the oldest pointer in the ring, or NULL if ring is empty */
+static inline void *ox_mq_ring_pop (struct ox_mq_ring *r)
+{
+    struct ox_mq_ring_cell *cell;
+    uint64_t pos, seq;
+    int64_t dif;
+    void *data;
+
+    pos = __atomic_load_n (&r->head, __ATOMIC_RELAXED);
+    for (;;) {
+        cell = &r->cells[pos & r->mask];
+        seq = __atomic_load_n (&cell->seq, __ATOMIC_ACQUIRE);
+        dif = (int64_t) seq - (int64_t) (pos + 1);
+
+        if (!dif) {
+            if (__atomic_compare_exchange_n (&r->head, &pos, pos + 1, 1,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+                break;
+        } else if (dif < 0) {
+            return NULL;
+        } else {
+            pos = __atomic_load_n (&r->head, __ATOMIC_RELAXED);
+        }
+    }
+
+    data = cell->data;
+    __atomic_store_n (&cell->seq, pos + r->mask + 1, __ATOMIC_RELEASE);
+
+    return data;
+}
+
+/*
+ * Pops up to n pointers with a single update of the ring head. Returns the
+ * number of pointers copied to data.
+ */
+static inline int ox_mq_ring_pop_bulk (struct ox_mq_ring *r, void **data,
+                                                                         int n)
+{
+    struct ox_mq_ring_cell *cell;
+    uint64_t pos, seq;
+    int i, count;
+
+    pos = __atomic_load_n (&r->head, __ATOMIC_RELAXED);
+    for (;;) {
+        /* Count the consecutive cells that are ready to be read */
+        for (count = 0; count < n; count++) {
+            cell = &r->cells[(pos + count) & r->mask];
+            seq = __atomic_load_n (&cell->seq, __ATOMIC_ACQUIRE);
+            if (seq != pos + count + 1)
+                break;
+        }
+
+        if (!count)
+            return 0;
+
+        if (__atomic_compare_exchange_n (&r->head, &pos, pos + count, 1,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            break;
+    }
+
+    for (i = 0; i < count; i++) {
+        cell = &r->cells[(pos + i) & r->mask];
+        data[i] = cell->data;
+        __atomic_store_n (&cell->seq, pos + i + r->mask + 1, __ATOMIC_RELEASE);
+    }
+
+    return count;
+}
+
+static inline int ox_mq_ring_empty (struct ox_mq_ring *r)
+{
+    return __atomic_load_n (&r->head, __ATOMIC_SEQ_CST) ==
+                                    __atomic_load_n (&r->tail, __ATOMIC_SEQ_CST);
+}
+
+static inline int ox_mq_cas_status (struct ox_mq_entry *entry, uint8_t old,
+                                                                   uint8_t new)
+{
+    return __sync_bool_compare_and_swap (&entry->status, old, new);
+}
+
+static inline void ox_mq_cpu_relax (void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause ();
+#else
+    __asm__ __volatile__ ("" ::: "memory");
+#endif
+}
+
+static inline uint64_t ox_mq_clock_usec (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * SEC64 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Busy-polls an empty ring for up to q->poll_usec microseconds. The pause
+ * between two polls doubles each time the ring is found empty, so a long
+ * idle period costs few cache line transfers with the producers.
+ */
+static void *ox_mq_spin_pop (struct ox_mq_queue *q, struct ox_mq_ring *r)
+{
+    uint64_t start;
+    uint32_t i, backoff = 1;
+    void *data;
+
+    start = ox_mq_clock_usec ();
+    do {
+        for (i = 0; i < backoff; i++)
+            ox_mq_cpu_relax ();
+
+        data = ox_mq_ring_pop (r);
+        if (data) {
+            u_atomic_inc(&q->stats.spin);
+            return data;
+        }
+
+        if (backoff < OX_MQ_POLL_MAX_BACKOFF)
+            backoff <<= 1;
+    } while (q->running && ox_mq_clock_usec () - start < q->poll_usec);
+
+    return NULL;
+}
+
+/*
+ * Parks a consumer thread until a producer signals the condition or 1 second
+ * passes. The sleep flag is set before the ring is checked, and producers
+ * check the flag after pushing, so a wake up cannot be lost.
+ */
+static void ox_mq_park (struct ox_mq_queue *q, struct ox_mq_ring *r,
+                pthread_mutex_t *cond_m, pthread_cond_t *cond, volatile uint8_t *sleep)
+{
+    struct timespec ts;
+    struct timeval tv;
+
+    pthread_mutex_lock (cond_m);
+    __atomic_store_n (sleep, 1, __ATOMIC_SEQ_CST);
+
+    if (q->running && ox_mq_ring_empty (r)) {
+        gettimeofday(&tv, NULL);
+        ts.tv_sec = tv.tv_sec + 1; /* 1 second timeout */
+        ts.tv_nsec = tv.tv_usec * 1000;
+        pthread_cond_timedwait(cond, cond_m, &ts);
+    }
+
+    __atomic_store_n (sleep, 0, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock (cond_m);
+
+    u_atomic_inc(&q->stats.park);
+}
+
+static inline void ox_mq_wake (pthread_mutex_t *cond_m, pthread_cond_t *cond,
+                                                       volatile uint8_t *sleep)
+{
+    __atomic_thread_fence (__ATOMIC_SEQ_CST);
+    if (__atomic_load_n (sleep, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock (cond_m);
+        pthread_cond_signal (cond);
+        pthread_mutex_unlock (cond_m);
+    }
+}
+
+static void ox_mq_waitq_init (struct ox_mq_waitq *wq)
+{
+    pthread_mutex_init (&wq->mutex, NULL);
+    pthread_cond_init (&wq->cond, NULL);
+    wq->waiters = 0;
+}
+
+static void ox_mq_waitq_destroy (struct ox_mq_waitq *wq)
+{
+    pthread_mutex_destroy (&wq->mutex);
+    pthread_cond_destroy (&wq->cond);
+}
+
+/* Same ordering as ox_mq_wake, waiters are counted before trying again */
+static inline void ox_mq_waitq_wake (struct ox_mq_waitq *wq)
+{
+    __atomic_thread_fence (__ATOMIC_SEQ_CST);
+    if (__atomic_load_n (&wq->waiters, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock (&wq->mutex);
+        pthread_cond_broadcast (&wq->cond);
+        pthread_mutex_unlock (&wq->mutex);
+    }
+}
+
+static void ox_mq_deadline (struct timespec *ts, uint64_t usec)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    usec += tv.tv_usec;
+    ts->tv_sec = tv.tv_sec + usec / 1000000;
+    ts->tv_nsec = (usec % 1000000) * 1000;
+}
+
+static int ox_mq_wheel_init (struct ox_mq_wheel *w, uint32_t size,
+                                                    uint64_t to_usec, int node)
+{
+    int l, i;
+
+    for (l = 0; l < OX_MQ_WHEEL_LEVELS; l++)
+        for (i = 0; i < OX_MQ_WHEEL_SLOTS; i++)
+            LIST_INIT (&w->slot[l][i]);
+
+    w->tick_usec = 0;
+    if (!to_usec)
+        return 0;
+
+    if (ox_mq_ring_init (&w->arm, size, node))
+        return -1;
+
+    w->to_ticks = OX_MQ_WHEEL_TO_TICKS;
+    w->tick_usec = to_usec / w->to_ticks;
+    if (!w->tick_usec) {
+        w->tick_usec = 1;
+        w->to_ticks = to_usec;
+    }
+    w->cur = ox_mq_clock_usec () / w->tick_usec;
+
+    return 0;
 }
 
 static void ox_mq_destroy_sq (struct ox_mq_queue *q)
 {
-    pthread_mutex_destroy (&q->sq_free_mutex);
-    pthread_mutex_destroy (&q->sq_used_mutex);
-    pthread_mutex_destroy (&q->sq_wait_mutex);
+    ox_mq_ring_free (&q->sq_free, q->node);
+    ox_mq_ring_free (&q->sq_used, q->node);
+    ox_mq_ring_free (&q->wheel.arm, q->node);
+    ox_mq_free (q->node, q->sq_slots, sizeof (struct ox_mq_entry *) *q->size);
+    ox_mq_free (q->node, q->sq_entries, sizeof (struct ox_mq_entry) *q->size);
+    q->sq_slots = NULL;
+    q->sq_entries = NULL;
     pthread_mutex_destroy (&q->sq_cond_m);
     pthread_cond_destroy (&q->sq_cond);
+    ox_mq_waitq_destroy (&q->sq_space);
 }
 
 static void ox_mq_destroy_cq (struct ox_mq_queue *q)
 {
-    pthread_mutex_destroy (&q->cq_free_mutex);
-    pthread_mutex_destroy (&q->cq_used_mutex);
+    ox_mq_ring_free (&q->cq_used, q->node);
     pthread_mutex_destroy (&q->cq_cond_m);
     pthread_cond_destroy (&q->cq_cond);
+    ox_mq_waitq_destroy (&q->cq_space);
 }
 
 static int ox_mq_init_sq (struct ox_mq_queue *q, uint32_t size)
 {
-    TAILQ_INIT (&q->sq_free);
-    TAILQ_INIT (&q->sq_used);
-    TAILQ_INIT (&q->sq_wait);
-    pthread_mutex_init (&q->sq_free_mutex, NULL);
-    pthread_mutex_init (&q->sq_used_mutex, NULL);
-    pthread_mutex_init (&q->sq_wait_mutex, NULL);
     pthread_mutex_init (&q->sq_cond_m, NULL);
     pthread_cond_init (&q->sq_cond, NULL);
+    ox_mq_waitq_init (&q->sq_space);
+
+    if (ox_mq_ring_init (&q->sq_free, size, q->node))
+        goto CLEAN;
 
-    q->sq_entries = malloc (sizeof (struct ox_mq_entry) * size);
+    if (ox_mq_ring_init (&q->sq_used, size, q->node))
+        goto CLEAN;
+
+    q->sq_entries = ox_mq_alloc (q->node, sizeof (struct ox_mq_entry) * size);
     if (!q->sq_entries)
         goto CLEAN;
 
-    memset (q->sq_entries, 0, sizeof (struct ox_mq_entry) * size);
+    q->sq_slots = ox_mq_alloc (q->node, sizeof (struct ox_mq_entry *) * size);
+    if (!q->sq_slots)
+        goto CLEAN;
 
     return 0;
 
@@ -128,52 +571,73 @@ CLEAN:
 
 static int ox_mq_init_cq (struct ox_mq_queue *q, uint32_t size)
 {
-    TAILQ_INIT (&q->cq_free);
-    TAILQ_INIT (&q->cq_used);
-    pthread_mutex_init (&q->cq_free_mutex, NULL);
-    pthread_mutex_init (&q->cq_used_mutex, NULL);
     pthread_mutex_init (&q->cq_cond_m, NULL);
     pthread_cond_init (&q->cq_cond, NULL);
+    ox_mq_waitq_init (&q->cq_space);
 
-    q->cq_entries = malloc (sizeof (struct ox_mq_entry) * size);
-    if (!q->cq_entries)
-        goto CLEAN;
-
-    memset (q->cq_entries, 0, sizeof (struct ox_mq_entry) * size);
+    if (ox_mq_ring_init (&q->cq_used, size, q->node)) {
+        ox_mq_destroy_cq (q);
+        return -1;
+    }
 
     return 0;
+}
 
-CLEAN:
-    ox_mq_destroy_cq (q);
-    return -1;
+static inline void ox_mq_reset_entry (struct ox_mq_entry *entry)
+{
+    entry->status = OX_MQ_FREE;
+    entry->opaque = NULL;
+    entry->qid = 0;
+    entry->wtime = 0;
 }
 
-static int ox_mq_init_queue (struct ox_mq_queue *q, uint32_t size,
-                                        ox_mq_sq_fn *sq_fn, ox_mq_cq_fn *cq_fn)
+static int ox_mq_init_queue (struct ox_mq_queue *q,
+                                     struct ox_mq_config *config, uint32_t qid)
 {
+    uint32_t size = config->q_size;
     int i;
 
-    if (!sq_fn || !cq_fn)
+    /* Entries and rings are allocated on the node of the queue threads */
+    q->node = -1;
+    if (config->cpus && CPU_COUNT (&config->cpus[qid])) {
+        memcpy (&q->cpus, &config->cpus[qid], sizeof (cpu_set_t));
+        q->pinned = 1;
+        q->node = ox_mq_cpus_node (&q->cpus);
+    }
+
+    if ((!config->sq_fn && !config->sq_batch_fn) ||
+                                    (!config->cq_fn && !config->cq_batch_fn))
         return -1;
 
-    q->sq_fn = sq_fn;
-    q->cq_fn = cq_fn;
+    q->sq_fn = config->sq_fn;
+    q->cq_fn = config->cq_fn;
+    q->sq_batch_fn = config->sq_batch_fn;
+    q->cq_batch_fn = config->cq_batch_fn;
+    q->batch = (!config->batch || config->batch > OX_MQ_MAX_BATCH) ?
+                                            OX_MQ_MAX_BATCH : config->batch;
+    q->size = size;
+    q->poll_usec = (config->flags & OX_MQ_POLL) ? config->poll_usec : 0;
 
     if (ox_mq_init_sq (q, size))
         return -1;
 
+    if (ox_mq_wheel_init (&q->wheel, size, config->to_usec, q->node))
+        goto CLEAN_SQ;
+
     if (ox_mq_init_cq (q, size))
         goto CLEAN_SQ;
 
     ox_mq_init_stats(&q->stats);
 
     for (i = 0; i < size; i++) {
-        TAILQ_INSERT_TAIL (&q->sq_free, &q->sq_entries[i], entry);
+        ox_mq_reset_entry (&q->sq_entries[i]);
+        q->sq_entries[i].slot = i;
+        q->sq_entries[i].to_arm = 0;
+        q->sq_entries[i].to_linked = 0;
+        q->sq_slots[i] = &q->sq_entries[i];
+        ox_mq_ring_push (&q->sq_free, &q->sq_entries[i]);
         u_atomic_inc(&q->stats.sq_free);
-        TAILQ_INSERT_TAIL (&q->cq_free, &q->cq_entries[i], entry);
         u_atomic_inc(&q->stats.cq_free);
-        pthread_mutex_init (&q->sq_entries[i].entry_mutex, NULL);
-        pthread_mutex_init (&q->cq_entries[i].entry_mutex, NULL);
     }
 
     q->running = 1; /* ready */
@@ -182,18 +646,9 @@ static int ox_mq_init_queue (struct ox_mq_queue *q, uint32_t size,
 
 CLEAN_SQ:
     ox_mq_destroy_sq (q);
-    free (q->sq_entries);
     return -1;
 }
 
-static inline void ox_mq_reset_entry (struct ox_mq_entry *entry)
-{
-    entry->status = OX_MQ_FREE;
-    entry->opaque = NULL;
-    entry->qid = 0;
-    memset (&entry->wtime, 0, sizeof (struct timeval));
-}
-
 static struct ox_mq_entry *ox_mq_create_ext_entry (struct ox_mq *mq)
 {
     struct ox_mq_entry *new_entry;
@@ -203,10 +658,13 @@ static struct ox_mq_entry *ox_mq_create_ext_entry (struct ox_mq *mq)
         return NULL;
 
     new_entry->is_ext = 0x1;
-    pthread_mutex_init (&new_entry->entry_mutex, NULL);
+    new_entry->to_arm = 0;
+    new_entry->to_linked = 0;
     ox_mq_reset_entry (new_entry);
 
+    pthread_mutex_lock (&mq->ext_mutex);
     LIST_INSERT_HEAD (&mq->ext_list, new_entry, ext_entry);
+    pthread_mutex_unlock (&mq->ext_mutex);
     u_atomic_inc (&mq->stats.ext_list);
 
     return new_entry;
@@ -216,7 +674,6 @@ static void ox_mq_free_entry (struct ox_mq *mq, struct ox_mq_entry *entry)
 {
     if (entry->is_ext) {
         LIST_REMOVE (entry, ext_entry);
-        pthread_mutex_destroy (&entry->entry_mutex);
         free (entry);
         u_atomic_dec (&mq->stats.ext_list);
     }
@@ -224,97 +681,99 @@ static void ox_mq_free_entry (struct ox_mq *mq, struct ox_mq_entry *entry)
 
 static void ox_mq_free_queues (struct ox_mq *mq, uint32_t n_queues)
 {
-    int i, j;
+    int i;
     struct ox_mq_queue *q;
 
     for (i = 0; i < n_queues; i++) {
         q = &mq->queues[i];
 
-        /* Wake threads if queue was empty and stop it */
+        /* Wake threads and stop it */
         q->running = 0;
-        pthread_mutex_lock (&q->sq_used_mutex);
-        if (TAILQ_EMPTY (&q->sq_used)) {
-            pthread_mutex_lock (&q->sq_cond_m);
-            pthread_cond_signal(&q->sq_cond);
-            pthread_mutex_unlock (&q->sq_cond_m);
-        }
-        pthread_mutex_unlock (&q->sq_used_mutex);
+        pthread_mutex_lock (&q->sq_cond_m);
+        pthread_cond_signal(&q->sq_cond);
+        pthread_mutex_unlock (&q->sq_cond_m);
 
-        pthread_mutex_lock (&q->cq_used_mutex);
-        if (TAILQ_EMPTY (&q->cq_used)) {
-            pthread_mutex_lock (&q->cq_cond_m);
-            pthread_cond_signal(&q->cq_cond);
-            pthread_mutex_unlock (&q->cq_cond_m);
-        }
-        pthread_mutex_unlock (&q->cq_used_mutex);
+        pthread_mutex_lock (&q->cq_cond_m);
+        pthread_cond_signal(&q->cq_cond);
+        pthread_mutex_unlock (&q->cq_cond_m);
 
         pthread_join(q->sq_tid, NULL);
         pthread_join(q->cq_tid, NULL);
 
-        for (j = 0; j < mq->config->q_size; j++) {
-            pthread_mutex_destroy (&q->sq_entries[j].entry_mutex);
-            pthread_mutex_destroy (&q->cq_entries[j].entry_mutex);
-        }
         ox_mq_destroy_sq (q);
-        free (q->sq_entries);
         ox_mq_destroy_cq (q);
-        free (q->cq_entries);
     }
 }
 
-#define OX_MQ_ENQUEUE(head, elm, mutex, stat) do {                  \
-        pthread_mutex_lock((mutex));                                \
-        TAILQ_INSERT_TAIL((head), (elm), entry);                    \
-        u_atomic_inc((stat));                                       \
-        pthread_mutex_unlock((mutex));                              \
-} while (/*CONSTCOND*/0)
+static inline void ox_mq_set_waiting (struct ox_mq_queue *q,
+                                                       struct ox_mq_entry *req)
+{
+    req->wtime = ox_mq_clock_usec ();
+
+    u_atomic_inc(&q->stats.sq_wait);
+    __atomic_store_n (&req->status, OX_MQ_WAITING, __ATOMIC_RELEASE);
 
-#define OX_MQ_DEQUEUE_H(head, elm, mutex, stats) do {               \
-        pthread_mutex_lock((mutex));                                \
-        (elm) = TAILQ_FIRST((head));                                \
-        TAILQ_REMOVE ((head), (elm), entry);                        \
-        u_atomic_dec((stats));                                      \
-        pthread_mutex_unlock ((mutex));                             \
-} while (/*CONSTCOND*/0)
+    /* Hand the entry to the timer wheel, if it is not there already */
+    if (!q->wheel.tick_usec || !__sync_bool_compare_and_swap (&req->to_arm,
+                                                                        0, 1))
+        return;
 
-#define OX_MQ_DEQUEUE(head, elm, mutex, stats) do {                 \
-        pthread_mutex_lock((mutex));                                \
-        TAILQ_REMOVE ((head), (elm), entry);                        \
-        u_atomic_dec((stats));                                      \
-        pthread_mutex_unlock ((mutex));                             \
-} while (/*CONSTCOND*/0)
+    if (ox_mq_ring_push (&q->wheel.arm, req)) {
+        req->to_arm = 0;
+        log_err (" [ox-mq: WARNING: timer wheel is full, timeout "
+                                                     "disabled for entry.]\n");
+    }
+}
+
+/* Drains up to q->batch entries and calls the batch consumer once */
+static int ox_mq_sq_batch (struct ox_mq_queue *q)
+{
+    struct ox_mq_entry *req[OX_MQ_MAX_BATCH];
+    int i, n;
+
+    n = ox_mq_ring_pop_bulk (&q->sq_used, (void **) req, q->batch);
+    if (!n && q->poll_usec) {
+        req[0] = ox_mq_spin_pop (q, &q->sq_used);
+        n = (req[0]) ? 1 + ox_mq_ring_pop_bulk (&q->sq_used,
+                                    (void **) &req[1], q->batch - 1) : 0;
+    }
+    if (!n)
+        return 0;
+
+    u_atomic_sub(n, &q->stats.sq_used);
+
+    for (i = 0; i < n; i++)
+        ox_mq_set_waiting (q, req[i]);
+
+    q->sq_batch_fn (req, n);
+
+    return n;
+}
 
 static void *ox_mq_sq_thread (void *arg)
 {
     struct ox_mq_queue *q = (struct ox_mq_queue *) arg;
     struct ox_mq_entry *req;
-    struct timespec ts;
-    struct timeval tv;
 
     while (q->running) {
-        pthread_mutex_lock(&q->sq_cond_m);
-
-        if (TAILQ_EMPTY (&q->sq_used)) {
-            gettimeofday(&tv, NULL);
-            ts.tv_sec = tv.tv_sec + 1; /* 1 second timeout */
-            ts.tv_nsec = tv.tv_usec * 1000;
-            pthread_cond_timedwait(&q->sq_cond, &q->sq_cond_m, &ts);
+        if (q->sq_batch_fn) {
+            if (!ox_mq_sq_batch (q))
+                ox_mq_park (q, &q->sq_used, &q->sq_cond_m, &q->sq_cond,
+                                                              &q->sq_sleep);
+            continue;
         }
 
-        pthread_mutex_unlock(&q->sq_cond_m);
-
-        if (!q->running)
-            pthread_exit(NULL);
-
-        if (TAILQ_EMPTY (&q->sq_used))
+        req = ox_mq_ring_pop (&q->sq_used);
+        if (!req && q->poll_usec)
+            req = ox_mq_spin_pop (q, &q->sq_used);
+        if (!req) {
+            ox_mq_park (q, &q->sq_used, &q->sq_cond_m, &q->sq_cond,
+                                                              &q->sq_sleep);
             continue;
+        }
+        u_atomic_dec(&q->stats.sq_used);
 
-        OX_MQ_DEQUEUE_H(&q->sq_used, req, &q->sq_used_mutex, &q->stats.sq_used);
-
-        gettimeofday(&req->wtime, NULL);
-
-        req->status = OX_MQ_WAITING;
-        OX_MQ_ENQUEUE (&q->sq_wait, req, &q->sq_wait_mutex, &q->stats.sq_wait);
+        ox_mq_set_waiting (q, req);
 
         q->sq_fn (req);
     }
@@ -322,39 +781,54 @@ static void *ox_mq_sq_thread (void *arg)
     return NULL;
 }
 
-static void *ox_mq_cq_thread (void *arg)
+/* Drains up to q->batch opaque pointers and calls the batch consumer once */
+static int ox_mq_cq_batch (struct ox_mq_queue *q)
 {
-    struct ox_mq_queue *q = (struct ox_mq_queue *) arg;
-    struct ox_mq_entry *req;
-    void *opaque;
-    struct timespec ts;
-    struct timeval tv;
+    void *opaque[OX_MQ_MAX_BATCH];
+    int n;
+
+    n = ox_mq_ring_pop_bulk (&q->cq_used, opaque, q->batch);
+    if (!n && q->poll_usec) {
+        opaque[0] = ox_mq_spin_pop (q, &q->cq_used);
+        n = (opaque[0]) ? 1 + ox_mq_ring_pop_bulk (&q->cq_used,
+                                              &opaque[1], q->batch - 1) : 0;
+    }
+    if (!n)
+        return 0;
 
-    while (q->running) {
-        pthread_mutex_lock(&q->cq_cond_m);
+    u_atomic_sub(n, &q->stats.cq_used);
+    u_atomic_add(n, &q->stats.cq_free);
+    ox_mq_waitq_wake (&q->cq_space);
 
-        if (TAILQ_EMPTY (&q->cq_used)) {
-            gettimeofday(&tv, NULL);
-            ts.tv_sec = tv.tv_sec + 1; /* 1 second timeout */
-            ts.tv_nsec = tv.tv_usec * 1000;
-            pthread_cond_timedwait(&q->cq_cond, &q->cq_cond_m, &ts);
-        }
+    q->cq_batch_fn (opaque, n);
 
-        pthread_mutex_unlock(&q->cq_cond_m);
+    return n;
+}
 
-        if (!q->running)
-            pthread_exit(NULL);
+static void *ox_mq_cq_thread (void *arg)
+{
+    struct ox_mq_queue *q = (struct ox_mq_queue *) arg;
+    void *opaque;
 
-        if (TAILQ_EMPTY (&q->cq_used))
+    while (q->running) {
+        if (q->cq_batch_fn) {
+            if (!ox_mq_cq_batch (q))
+                ox_mq_park (q, &q->cq_used, &q->cq_cond_m, &q->cq_cond,
+                                                              &q->cq_sleep);
             continue;
+        }
 
-        OX_MQ_DEQUEUE_H(&q->cq_used, req, &q->cq_used_mutex, &q->stats.cq_used);
-        opaque = req->opaque;
-        ox_mq_reset_entry (req);
-        OX_MQ_ENQUEUE (&q->cq_free, req, &q->cq_free_mutex, &q->stats.cq_free);
-
-        if (!opaque)
+        opaque = ox_mq_ring_pop (&q->cq_used);
+        if (!opaque && q->poll_usec)
+            opaque = ox_mq_spin_pop (q, &q->cq_used);
+        if (!opaque) {
+            ox_mq_park (q, &q->cq_used, &q->cq_cond_m, &q->cq_cond,
+                                                              &q->cq_sleep);
             continue;
+        }
+        u_atomic_dec(&q->stats.cq_used);
+        u_atomic_inc(&q->stats.cq_free);
+        ox_mq_waitq_wake (&q->cq_space);
 
         q->cq_fn (opaque);
     }
@@ -364,20 +838,35 @@ static void *ox_mq_cq_thread (void *arg)
 
 static int ox_mq_start_thread (struct ox_mq_queue *q)
 {
-    if (pthread_create(&q->sq_tid, NULL, ox_mq_sq_thread, q))
-        return -1;
+    pthread_attr_t attr, *pattr = NULL;
+    int ret = -1;
+
+    if (q->pinned) {
+        pthread_attr_init (&attr);
+        if (pthread_attr_setaffinity_np (&attr, sizeof (cpu_set_t), &q->cpus))
+            log_err (" [ox-mq: WARNING: Not possible to pin queue threads]\n");
+        else
+            pattr = &attr;
+    }
 
-    if (pthread_create(&q->cq_tid, NULL, ox_mq_cq_thread, q))
-        return -1;
+    if (pthread_create(&q->sq_tid, pattr, ox_mq_sq_thread, q))
+        goto OUT;
 
-    return 0;
+    if (pthread_create(&q->cq_tid, pattr, ox_mq_cq_thread, q))
+        goto OUT;
+
+    ret = 0;
+
+OUT:
+    if (q->pinned)
+        pthread_attr_destroy (&attr);
+    return ret;
 }
 
 int ox_mq_submit_req (struct ox_mq *mq, uint32_t qid, void *opaque)
 {
     struct ox_mq_queue *q;
     struct ox_mq_entry *req;
-    uint8_t wake = 0;
 
     if (!mq || !mq->config) {
         log_err (" [ox-mq (submission): WARNING: Suspicious null pointer]");
@@ -390,35 +879,39 @@ int ox_mq_submit_req (struct ox_mq *mq, uint32_t qid, void *opaque)
     q = &mq->queues[qid];
 
     /* If queue is full, the request is rejected */
-    pthread_mutex_lock (&q->sq_free_mutex);
-    if (TAILQ_EMPTY (&q->sq_free)) {
-        pthread_mutex_unlock (&q->sq_free_mutex);
+    req = ox_mq_ring_pop (&q->sq_free);
+    if (!req)
         return -1;
-    }
-
-    req = TAILQ_FIRST (&q->sq_free);
-    TAILQ_REMOVE (&q->sq_free, req, entry);
     u_atomic_dec(&q->stats.sq_free);
-    pthread_mutex_unlock (&q->sq_free_mutex);
 
     req->opaque = opaque;
     req->qid = qid;
-
-    pthread_mutex_lock (&q->sq_used_mutex);
-    if (TAILQ_EMPTY (&q->sq_used))
-        wake++;
-
     req->status = OX_MQ_QUEUED;
-    TAILQ_INSERT_TAIL (&q->sq_used, req, entry);
+
+    /* sq_used has room for all the entries, push cannot fail */
+    ox_mq_ring_push (&q->sq_used, req);
     u_atomic_inc(&q->stats.sq_used);
 
-    /* Wake consumer thread if queue was empty */
-    if (wake) {
-        pthread_mutex_lock (&q->sq_cond_m);
-        pthread_cond_signal(&q->sq_cond);
-        pthread_mutex_unlock (&q->sq_cond_m);
+    /* Wake consumer thread if it is parked */
+    ox_mq_wake (&q->sq_cond_m, &q->sq_cond, &q->sq_sleep);
+
+    return 0;
+}
+
+/* Posts an opaque pointer to the CQ, returns -1 if the CQ is full */
+static int ox_mq_post_cq (struct ox_mq *mq, struct ox_mq_queue *q,
+                                                                  void *opaque)
+{
+    if (ox_mq_ring_push (&q->cq_used, opaque)) {
+        log_info (" [ox-mq (%s): WARNING: CQ Full, request not completed.]\n",
+                                                              mq->config->name);
+        return -1;
     }
-    pthread_mutex_unlock (&q->sq_used_mutex);
+    u_atomic_dec(&q->stats.cq_free);
+    u_atomic_inc(&q->stats.cq_used);
+
+    /* Wake consumer thread if it is parked */
+    ox_mq_wake (&q->cq_cond_m, &q->cq_cond, &q->cq_sleep);
 
     return 0;
 }
@@ -426,158 +919,239 @@ int ox_mq_submit_req (struct ox_mq *mq, uint32_t qid, void *opaque)
 int ox_mq_complete_req (struct ox_mq *mq, struct ox_mq_entry *req_sq)
 {
     struct ox_mq_queue *q;
-    struct ox_mq_entry *req_cq;
-    uint8_t wake = 0;
+    uint8_t status;
 
     if (!mq || !mq->config) {
         log_err (" [ox-mq (completion): WARNING: Suspicious null pointer]");
         return -1;
     }
 
-    pthread_mutex_lock (&req_sq->entry_mutex);
-    /* Timeout requests are OX_MQ_TIMEOUT_BACK after the first completion try */
-    if (!req_sq || !req_sq->opaque || req_sq->status == OX_MQ_TIMEOUT_BACK) {
-        pthread_mutex_unlock (&req_sq->entry_mutex);
+    if (!req_sq || !req_sq->opaque)
         return -1;
-    }
-
-    /* Check if request is a TIMEOUT_COMPLETED but not TIMEOUT_BACK */
-    if (req_sq->status == OX_MQ_TIMEOUT_COMPLETED) {
-        req_sq->status = OX_MQ_TIMEOUT_BACK;
-        ox_mq_free_entry(mq, req_sq);
-        u_atomic_inc(&mq->stats.to_back);
-        pthread_mutex_unlock (&req_sq->entry_mutex);
-        return -1;
-    }
 
     q = &mq->queues[req_sq->qid];
-    pthread_mutex_unlock (&req_sq->entry_mutex);
-
-    /* TODO: retry user defined times if queue is full */
-    pthread_mutex_lock (&q->cq_free_mutex);
-    if (TAILQ_EMPTY (&q->cq_free)) {
-        pthread_mutex_unlock (&q->cq_free_mutex);
-        log_info (" [ox-mq (%s): WARNING: CQ Full, request not completed.]\n",
-                                                              mq->config->name);
-        return -1;
-    }
-
-    req_cq = TAILQ_FIRST (&q->cq_free);
-    TAILQ_REMOVE (&q->cq_free, req_cq, entry);
-    u_atomic_dec(&q->stats.cq_free);
-    pthread_mutex_unlock (&q->cq_free_mutex);
 
-    pthread_mutex_lock (&req_sq->entry_mutex);
-    req_cq->opaque = req_sq->opaque;
-    req_cq->qid = req_sq->qid;
-
-    if (req_sq->status == OX_MQ_WAITING) {
-        OX_MQ_DEQUEUE (&q->sq_wait,req_sq,&q->sq_wait_mutex,&q->stats.sq_wait);
+    do {
+        status = __atomic_load_n (&req_sq->status, __ATOMIC_ACQUIRE);
+
+        switch (status) {
+        case OX_MQ_WAITING:
+            /* From now the timeout thread does not touch the entry */
+            if (!ox_mq_cas_status (req_sq, OX_MQ_WAITING, OX_MQ_COMPLETING))
+                continue;
+
+            /* See ox_mq_complete_req_wait for waiting for room */
+            if (ox_mq_post_cq (mq, q, req_sq->opaque)) {
+                __atomic_store_n (&req_sq->status, OX_MQ_WAITING,
+                                                            __ATOMIC_RELEASE);
+                return OX_MQ_CQ_FULL;
+            }
+
+            u_atomic_dec(&q->stats.sq_wait);
+            ox_mq_reset_entry (req_sq);
+            ox_mq_ring_push (&q->sq_free, req_sq);
+            u_atomic_inc(&q->stats.sq_free);
+            ox_mq_waitq_wake (&q->sq_space);
+
+            return 0;
+
+        /* Late completion while the timeout thread processes the entry */
+        case OX_MQ_TIMEOUT:
+        /* Timeout requests are OX_MQ_TIMEOUT_BACK after the first try */
+        case OX_MQ_TIMEOUT_COMPLETED:
+            if (!ox_mq_cas_status (req_sq, status, OX_MQ_TIMEOUT_BACK))
+                continue;
+            u_atomic_inc(&mq->stats.to_back);
+            return -1;
+
+        default:
+            return -1;
+        }
+    } while (1);
+}
 
-        ox_mq_reset_entry (req_sq);
-        OX_MQ_ENQUEUE (&q->sq_free,req_sq,&q->sq_free_mutex,&q->stats.sq_free);
-    }
-    pthread_mutex_unlock(&req_sq->entry_mutex);
+/*
+ * Submits a request, waiting up to usec microseconds for a free entry if the
+ * queue is full. The submitter is woken as soon as an entry is completed.
+ * Returns -1 if the queue is still full.
+ */
+int ox_mq_submit_req_wait (struct ox_mq *mq, uint32_t qid, void *opaque,
+                                                                uint64_t usec)
+{
+    struct ox_mq_waitq *wq;
+    struct timespec ts;
+    int ret;
 
-    pthread_mutex_lock (&q->cq_used_mutex);
-    if (TAILQ_EMPTY (&q->cq_used))
-        wake++;
+    ret = ox_mq_submit_req (mq, qid, opaque);
+    if (!ret || !usec || !mq || !mq->config || qid >= mq->config->n_queues)
+        return ret;
 
-    req_cq->status = OX_MQ_QUEUED;
-    TAILQ_INSERT_TAIL (&q->cq_used, req_cq, entry);
-    u_atomic_inc(&q->stats.cq_used);
+    wq = &mq->queues[qid].sq_space;
+    ox_mq_deadline (&ts, usec);
 
-    /* Wake consumer thread if queue was empty */
-    if (wake) {
-        pthread_mutex_lock (&q->cq_cond_m);
-        pthread_cond_signal(&q->cq_cond);
-        pthread_mutex_unlock (&q->cq_cond_m);
+    pthread_mutex_lock (&wq->mutex);
+    __atomic_fetch_add (&wq->waiters, 1, __ATOMIC_SEQ_CST);
+    while ((ret = ox_mq_submit_req (mq, qid, opaque))) {
+        if (pthread_cond_timedwait (&wq->cond, &wq->mutex, &ts)) {
+            ret = ox_mq_submit_req (mq, qid, opaque);
+            break;
+        }
     }
-    pthread_mutex_unlock (&q->cq_used_mutex);
+    __atomic_fetch_sub (&wq->waiters, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock (&wq->mutex);
 
-    return 0;
+    return ret;
 }
 
-static int ox_mq_check_entry_to (struct ox_mq *mq, struct ox_mq_entry *entry)
+/*
+ * Completes a request, waiting up to usec microseconds for room in the CQ.
+ * Other errors are returned right away.
+ */
+int ox_mq_complete_req_wait (struct ox_mq *mq, struct ox_mq_entry *req_sq,
+                                                                uint64_t usec)
 {
-    struct timeval cur;
-    uint64_t usec_e, usec_s, tot;
+    struct ox_mq_waitq *wq;
+    struct timespec ts;
+    int ret;
 
-    gettimeofday(&cur, NULL);
+    ret = ox_mq_complete_req (mq, req_sq);
+    if (ret != OX_MQ_CQ_FULL || !usec)
+        return ret;
 
-    usec_e = cur.tv_sec * SEC64;
-    usec_e += cur.tv_usec;
-    usec_s = entry->wtime.tv_sec * SEC64;
-    usec_s += entry->wtime.tv_usec;
+    wq = &mq->queues[req_sq->qid].cq_space;
+    ox_mq_deadline (&ts, usec);
 
-    tot = usec_e - usec_s;
+    pthread_mutex_lock (&wq->mutex);
+    __atomic_fetch_add (&wq->waiters, 1, __ATOMIC_SEQ_CST);
+    while ((ret = ox_mq_complete_req (mq, req_sq)) == OX_MQ_CQ_FULL) {
+        if (pthread_cond_timedwait (&wq->cond, &wq->mutex, &ts)) {
+            ret = ox_mq_complete_req (mq, req_sq);
+            break;
+        }
+    }
+    __atomic_fetch_sub (&wq->waiters, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock (&wq->mutex);
 
-    return (tot >= mq->config->to_usec);
+    return ret;
 }
 
-static int ox_mq_process_to_entry (struct ox_mq *mq, struct ox_mq_queue *q,
+static void ox_mq_process_to_entry (struct ox_mq *mq, struct ox_mq_queue *q,
                                                       struct ox_mq_entry *req) {
     struct ox_mq_entry *new_req;
 
-    pthread_mutex_lock (&q->sq_wait_mutex);
-    TAILQ_REMOVE (&q->sq_wait, req, entry);
     u_atomic_dec(&q->stats.sq_wait);
-    pthread_mutex_unlock (&q->sq_wait_mutex);
-
-    req->status = OX_MQ_TIMEOUT;
 
+    /* The new entry takes the slot of the timeout entry */
     new_req = ox_mq_create_ext_entry(mq);
     if (!new_req)
         goto ERR;
 
-    OX_MQ_ENQUEUE(&q->sq_free, new_req, &q->sq_free_mutex, &q->stats.sq_free);
+    new_req->slot = req->slot;
+    q->sq_slots[req->slot] = new_req;
 
-    return 0;
+    ox_mq_ring_push (&q->sq_free, new_req);
+    u_atomic_inc(&q->stats.sq_free);
+    ox_mq_waitq_wake (&q->sq_space);
+
+    return;
 
 ERR:
     log_err (" [ox-mq: WARNING: timeout entry is out of list, not possible "
                         "to allocate new entry. Queue size is now smaller.\n");
-    return -1;
 }
 
-static void ox_mq_check_queue_to (struct ox_mq *mq, struct ox_mq_queue *q)
+static inline uint64_t ox_mq_wheel_expire (struct ox_mq_wheel *w,
+                                                       struct ox_mq_entry *req)
+{
+    return req->wtime / w->tick_usec + w->to_ticks;
+}
+
+/* Links an entry to the slot that covers tick 'expire', expire >= w->cur */
+static void ox_mq_wheel_insert (struct ox_mq_wheel *w, struct ox_mq_entry *req,
+                                                               uint64_t expire)
+{
+    uint64_t delta = expire - w->cur;
+    int level = 0;
+
+    while (level < OX_MQ_WHEEL_LEVELS - 1 &&
+                        delta >> (OX_MQ_WHEEL_BITS * (level + 1)))
+        level++;
+
+    /* Clamp to the wheel range, the entry is checked again at the slot */
+    if (delta >> (OX_MQ_WHEEL_BITS * OX_MQ_WHEEL_LEVELS))
+        expire = w->cur + (1ULL << (OX_MQ_WHEEL_BITS * OX_MQ_WHEEL_LEVELS))-1;
+
+    LIST_INSERT_HEAD (&w->slot[level][(expire >> (OX_MQ_WHEEL_BITS * level))
+                                        & OX_MQ_WHEEL_MASK], req, to_entry);
+    req->to_linked = 1;
+}
+
+static inline void ox_mq_wheel_unlink (struct ox_mq_entry *req)
+{
+    if (req->to_linked) {
+        LIST_REMOVE (req, to_entry);
+        req->to_linked = 0;
+    }
+}
+
+/* Moves the entries armed by the SQ thread into the wheel */
+static void ox_mq_wheel_drain_arm (struct ox_mq_wheel *w)
 {
     struct ox_mq_entry *req;
-    struct ox_mq_entry **to_list;
-    void **to_opaque;
-    int to_count, i;
+    uint64_t expire;
 
-    to_count = 0;
-    to_list = NULL;
-    pthread_mutex_lock (&q->sq_wait_mutex);
+    while ((req = ox_mq_ring_pop (&w->arm))) {
+        __atomic_store_n (&req->to_arm, 0, __ATOMIC_SEQ_CST);
+        ox_mq_wheel_unlink (req);
 
-    /* Check and process the list of timeout requests */
-    TAILQ_FOREACH (req, &q->sq_wait, entry) {
-        if (ox_mq_check_entry_to(mq, req)) {
+        if (__atomic_load_n (&req->status, __ATOMIC_ACQUIRE) != OX_MQ_WAITING)
+            continue;
 
-            ox_mq_process_to_entry (mq, q, req);
-            if (to_count)
-                to_list = realloc (to_list, sizeof (void *) * to_count + 1);
-            else
-                to_list = malloc (sizeof (void *));
+        expire = ox_mq_wheel_expire (w, req);
+        ox_mq_wheel_insert (w, req, MAX(expire, w->cur + 1));
+    }
+}
 
-            to_list[to_count] = req;
-            u_atomic_inc(&mq->stats.timeout);
-            to_count++;
+/* Moves the entries of a higher level slot to the lower levels */
+static void ox_mq_wheel_cascade (struct ox_mq_wheel *w, int level)
+{
+    struct ox_mq_wheel_slot *slot;
+    struct ox_mq_entry *req;
+    uint64_t expire;
 
-        }
+    slot = &w->slot[level][(w->cur >> (OX_MQ_WHEEL_BITS * level)) &
+                                                             OX_MQ_WHEEL_MASK];
+    while (!LIST_EMPTY (slot)) {
+        req = LIST_FIRST (slot);
+        ox_mq_wheel_unlink (req);
+
+        /* Completed entries leave the wheel here */
+        if (__atomic_load_n (&req->status, __ATOMIC_ACQUIRE) != OX_MQ_WAITING)
+            continue;
+
+        expire = ox_mq_wheel_expire (w, req);
+        ox_mq_wheel_insert (w, req, MAX(expire, w->cur));
     }
+}
 
-    pthread_mutex_unlock (&q->sq_wait_mutex);
+static void ox_mq_timeout_list (struct ox_mq *mq, struct ox_mq_queue *q,
+                                  struct ox_mq_entry **to_list, int to_count)
+{
+    void **to_opaque;
+    int i;
 
-    if (to_count)
-        to_opaque = malloc (sizeof (void *) * to_count);
+    to_opaque = malloc (sizeof (void *) * to_count);
+    if (!to_opaque) {
+        log_err (" [ox-mq (%s): WARNING: Not possible to process timeout "
+                                           "requests]", mq->config->name);
+        return;
+    }
 
     for (i = 0; i < to_count; i++)
         to_opaque[i] = to_list[i]->opaque;
 
     /* Call user defined timeout function */
-    if (to_count)
+    if (mq->config->to_fn)
         mq->config->to_fn (to_opaque, to_count);
 
     /* Complete the list of timeout requests, if flag enabled */
@@ -585,23 +1159,88 @@ static void ox_mq_check_queue_to (struct ox_mq *mq, struct ox_mq_queue *q)
     while (i) {
         i--;
         if (mq->config->to_fn && (mq->config->flags & OX_MQ_TO_COMPLETE))
-            if (ox_mq_complete_req(mq, to_list[i]))
+            if (ox_mq_post_cq (mq, q, to_opaque[i]))
                 log_err (" [ox-mq (%s): WARNING: Not possible to post "
                         "completion for a timeout request]", mq->config->name);
-        to_list[i]->status = OX_MQ_TIMEOUT_COMPLETED;
+
+        /* If it fails, a late completion already set OX_MQ_TIMEOUT_BACK */
+        ox_mq_cas_status (to_list[i], OX_MQ_TIMEOUT, OX_MQ_TIMEOUT_COMPLETED);
     }
 
-    if (to_count) {
-        free (to_opaque);
-        free (to_list);
+    free (to_opaque);
+}
+
+/*
+ * Advances the wheel of a queue up to tick 'now'. Only the slots that the
+ * wheel passes are visited, the cost is O(expired) and not O(outstanding).
+ */
+static void ox_mq_wheel_run (struct ox_mq *mq, struct ox_mq_queue *q,
+                                                                  uint64_t now)
+{
+    struct ox_mq_wheel *w = &q->wheel;
+    struct ox_mq_wheel_slot *slot;
+    struct ox_mq_entry *req;
+    struct ox_mq_entry **to_list = NULL, **tmp;
+    uint64_t expire;
+    int to_count = 0, level;
+
+    ox_mq_wheel_drain_arm (w);
+
+    while (w->cur < now) {
+        w->cur++;
+
+        /* Cascade the higher levels each time a lower level wraps */
+        for (level = 1; level < OX_MQ_WHEEL_LEVELS; level++) {
+            if (w->cur & ((1ULL << (OX_MQ_WHEEL_BITS * level)) - 1))
+                break;
+            ox_mq_wheel_cascade (w, level);
+        }
+
+        slot = &w->slot[0][w->cur & OX_MQ_WHEEL_MASK];
+        while (!LIST_EMPTY (slot)) {
+            req = LIST_FIRST (slot);
+            ox_mq_wheel_unlink (req);
+
+            if (__atomic_load_n (&req->status, __ATOMIC_ACQUIRE) !=
+                                                                 OX_MQ_WAITING)
+                continue;
+
+            /* Entry was completed and is waiting again */
+            expire = ox_mq_wheel_expire (w, req);
+            if (expire > w->cur) {
+                ox_mq_wheel_insert (w, req, expire);
+                continue;
+            }
+
+            /* Completion path got the entry first */
+            if (!ox_mq_cas_status (req, OX_MQ_WAITING, OX_MQ_TIMEOUT))
+                continue;
+
+            ox_mq_process_to_entry (mq, q, req);
+
+            tmp = realloc (to_list, sizeof (void *) * (to_count + 1));
+            if (!tmp) {
+                log_err (" [ox-mq (%s): WARNING: timeout list is full, "
+                        "request is not completed]", mq->config->name);
+                continue;
+            }
+            to_list = tmp;
+            to_list[to_count] = req;
+            u_atomic_inc(&mq->stats.timeout);
+            to_count++;
+        }
     }
+
+    if (to_count)
+        ox_mq_timeout_list (mq, q, to_list, to_count);
+
+    free (to_list);
 }
 
 /*
- * This thread checks all sq_wait queues for timeout requests.
+ * This thread advances the timer wheels of all queues once per wheel tick.
  *
  * If a timeout entry id found, the follow steps are performed:
- *  - Remove the entry from sq_wait;
  *  - Set timeout entry status to OX_MQ_TIMEOUT;
  *  - Allocate a new entry;
  *  - Insert the new entry to the sq_free;
@@ -620,15 +1259,20 @@ static void ox_mq_check_queue_to (struct ox_mq *mq, struct ox_mq_queue *q)
 static void *ox_mq_to_thread (void *arg)
 {
     struct ox_mq *mq = (struct ox_mq *) arg;
-    int exit, i;
+    uint64_t tick_usec = mq->queues[0].wheel.tick_usec;
+    int exit, i, cstate;
 
     do {
-        usleep (mq->config->to_usec);
+        usleep (tick_usec);
         if (mq->stop)
             break;
 
+        /* Do not get cancelled while holding ext_mutex */
+        pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, &cstate);
         for (i = 0; i < mq->config->n_queues; i++)
-            ox_mq_check_queue_to(mq, &mq->queues[i]);
+            ox_mq_wheel_run (mq, &mq->queues[i],
+                                            ox_mq_clock_usec () / tick_usec);
+        pthread_setcancelstate (cstate, NULL);
 
         exit = mq->config->n_queues;
         for (i = 0; i < mq->config->n_queues; i++) {
@@ -644,8 +1288,6 @@ static void *ox_mq_to_thread (void *arg)
 
 static int ox_mq_start_to (struct ox_mq *mq)
 {
-    LIST_INIT (&mq->ext_list);
-
     if (pthread_create(&mq->to_tid, NULL, ox_mq_to_thread, mq))
         return -1;
 
@@ -671,10 +1313,11 @@ struct ox_mq *ox_mq_init (struct ox_mq_config *config)
 
     ox_mq_init_stats(&mq->stats);
     mq->stop = 0;
+    LIST_INIT (&mq->ext_list);
+    pthread_mutex_init (&mq->ext_mutex, NULL);
 
     for (i = 0; i < config->n_queues; i++) {
-        if (ox_mq_init_queue (&mq->queues[i], config->q_size,
-                                               config->sq_fn, config->cq_fn)) {
+        if (ox_mq_init_queue (&mq->queues[i], config, i)) {
             ox_mq_free_queues (mq, i);
             goto FREE_Q;
         }
@@ -691,14 +1334,19 @@ struct ox_mq *ox_mq_init (struct ox_mq_config *config)
 
     memcpy (mq->config, config, sizeof(struct ox_mq_config));
 
+    /* cpu sets are copied to the queues, the user array may be released */
+    mq->config->cpus = NULL;
+
     if (mq->config->to_usec && ox_mq_start_to(mq))
         goto FREE_ALL;
 
+    pthread_mutex_lock (&mq_mutex);
     if (!mq_count)
         LIST_INIT(&mq_head);
 
     LIST_INSERT_HEAD(&mq_head, mq, entry);
     mq_count++;
+    pthread_mutex_unlock (&mq_mutex);
 
     log_info (" [ox-mq (%s): Multi queue started (nq: %d, qs: %d)]\n",
                            mq->config->name, config->n_queues, config->q_size);
@@ -732,12 +1380,15 @@ void ox_mq_destroy (struct ox_mq *mq)
     if (mq->config->to_usec) {
         pthread_cancel(mq->to_tid);
         pthread_join (mq->to_tid, NULL);
-        ox_mq_free_ext_list (mq);
     }
     ox_mq_free_queues(mq, mq->config->n_queues);
+    ox_mq_free_ext_list (mq);
+    pthread_mutex_destroy (&mq->ext_mutex);
 
+    pthread_mutex_lock (&mq_mutex);
     LIST_REMOVE(mq, entry);
     mq_count--;
+    pthread_mutex_unlock (&mq_mutex);
 
     log_info (" [ox-mq (%s): Multi queue stopped]\n", mq->config->name);
 
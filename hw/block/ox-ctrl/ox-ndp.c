@@ -0,0 +1,448 @@
+/* OX: Open-Channel NVM Express SSD Controller
+ *  - Near-data processing job engine
+ */
+
+#include "qemu/osdep.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include <pthread.h>
+#include <sys/queue.h>
+#include "hw/block/ox-ctrl/include/ssd.h"
+#include "hw/block/ox-ctrl/include/ox-ndp.h"
+
+extern struct core_struct core;
+
+#define NDP_THREADS         2
+#define NDP_CHUNK_LBAS      64  /* LBAs read from the FTL at a time */
+
+struct ox_ndp_params {
+    uint8_t     kernel;
+    uint8_t     rec_shift;
+    uint16_t    field_off;
+    uint64_t    arg;
+};
+
+struct ox_ndp_job {
+    NvmeRequest                 *req;
+    uint64_t                    slba;   /* FTL LBA */
+    uint64_t                    nlb;
+    uint64_t                    prp;
+    uint64_t                    *cmp_prp; /* Compare: host page per LBA */
+    struct ox_ndp_params        par;
+    TAILQ_ENTRY(ox_ndp_job)     entry;
+};
+
+struct ox_ndp_daemon {
+    uint8_t                     valid;
+    struct ox_ndp_params        par;
+};
+
+static struct ox_ndp {
+    pthread_t                   th[NDP_THREADS];
+    pthread_mutex_t             mutex;
+    pthread_cond_t              cond;       /* job queued or stop */
+    pthread_cond_t              idle_cond;  /* no job queued nor running */
+    TAILQ_HEAD(, ox_ndp_job)    jobs;
+    uint32_t                    running;
+    uint8_t                     stop;
+    uint8_t                     started;
+    struct ox_ndp_daemon        daemon[NDP_MAX_DAEMONS];
+} ndp;
+
+static const uint8_t ndp_kernels[] = {
+    NDP_KERNEL_SCAN, NDP_KERNEL_FILTER, NDP_KERNEL_AGGREGATE
+};
+
+static int ox_ndp_parse (NvmeCmd *cmd, struct ox_ndp_params *par)
+{
+    par->kernel = cmd->cdw13 & 0xff;
+    par->rec_shift = (cmd->cdw13 >> 8) & 0xff;
+    par->field_off = cmd->cdw13 >> 16;
+    par->arg = ((uint64_t) cmd->cdw15 << 32) | cmd->cdw14;
+
+    if (par->kernel < NDP_KERNEL_SCAN || par->kernel > NDP_KERNEL_AGGREGATE)
+        return -1;
+
+    /* Records never cross a LBA, so never a chunk read from the FTL */
+    if (par->rec_shift < 3 || (1 << par->rec_shift) > NVME_KERNEL_PG_SIZE)
+        return -1;
+    if (par->field_off + sizeof (uint64_t) > (1 << par->rec_shift))
+        return -1;
+
+    return 0;
+}
+
+static void ox_ndp_record (struct ox_ndp_params *par, uint8_t *rec,
+                                              uint64_t rec_id, NdpResult *res)
+{
+    uint32_t rec_sz = 1 << par->rec_shift;
+    uint64_t val;
+
+    memcpy (&val, rec + par->field_off, sizeof (uint64_t));
+    val = le64toh (val);
+
+    res->scanned++;
+    switch (par->kernel) {
+        case NDP_KERNEL_SCAN:
+            if (val != par->arg)
+                return;
+            break;
+        case NDP_KERNEL_FILTER:
+            if (val < par->arg)
+                return;
+            break;
+    }
+
+    res->matched++;
+    res->sum += val;
+    res->min = MIN(res->min, val);
+    res->max = MAX(res->max, val);
+
+    switch (par->kernel) {
+        case NDP_KERNEL_SCAN:
+            if ((res->nout + 1) * sizeof (uint64_t) > sizeof (res->data))
+                return;
+            rec_id = htole64 (rec_id);
+            memcpy (res->data + res->nout * sizeof (uint64_t), &rec_id,
+                                                        sizeof (uint64_t));
+            res->nout++;
+            break;
+        case NDP_KERNEL_FILTER:
+            if ((res->nout + 1) * rec_sz > sizeof (res->data))
+                return;
+            memcpy (res->data + res->nout * rec_sz, rec, rec_sz);
+            res->nout++;
+            break;
+    }
+}
+
+static uint16_t ox_ndp_run (struct ox_ndp_job *job, uint8_t *buf,
+                                                            NdpResult *res)
+{
+    uint32_t rec_sz = 1 << job->par.rec_shift;
+    uint64_t off, rec_id = 0;
+    uint32_t i, nlb;
+
+    memset (res, 0x0, sizeof (NdpResult));
+    res->min = AND64;
+    res->out_sz = (job->par.kernel == NDP_KERNEL_SCAN) ? sizeof (uint64_t) :
+                  (job->par.kernel == NDP_KERNEL_FILTER) ? rec_sz : 0;
+
+    for (off = 0; off < job->nlb; off += nlb) {
+        nlb = MIN(job->nlb - off, NDP_CHUNK_LBAS);
+        if (nvm_ftl_lba_read (job->slba + off, nlb, NVME_KERNEL_PG_SIZE, buf))
+            return NVME_INTERNAL_DEV_ERROR;
+
+        for (i = 0; i < nlb * NVME_KERNEL_PG_SIZE; i += rec_sz)
+            ox_ndp_record (&job->par, buf + i, rec_id++, res);
+    }
+
+    if (!res->matched)
+        res->min = 0;
+
+    res->scanned = htole64 (res->scanned);
+    res->matched = htole64 (res->matched);
+    res->sum = htole64 (res->sum);
+    res->min = htole64 (res->min);
+    res->max = htole64 (res->max);
+    res->nout = htole32 (res->nout);
+    res->out_sz = htole32 (res->out_sz);
+
+    return nvme_write_to_host (res, job->prp, sizeof (NdpResult));
+}
+
+/* Compares a LBA range with the host buffer, no data goes back to the host */
+static uint16_t ox_ndp_compare_run (struct ox_ndp_job *job, uint8_t *buf,
+                                                                uint8_t *page)
+{
+    uint64_t off;
+    uint32_t i, nlb;
+
+    for (off = 0; off < job->nlb; off += nlb) {
+        nlb = MIN(job->nlb - off, NDP_CHUNK_LBAS);
+        if (nvm_ftl_lba_read (job->slba + off, nlb, NVME_KERNEL_PG_SIZE, buf))
+            return NVME_INTERNAL_DEV_ERROR;
+
+        for (i = 0; i < nlb; i++) {
+            if (nvme_read_from_host (page, job->cmp_prp[off + i],
+                                                        NVME_KERNEL_PG_SIZE))
+                return NVME_DATA_TRAS_ERROR;
+            if (memcmp (page, buf + (uint64_t) i * NVME_KERNEL_PG_SIZE,
+                                                        NVME_KERNEL_PG_SIZE))
+                return NVME_CMP_FAILURE;
+        }
+    }
+
+    return NVME_SUCCESS;
+}
+
+static void *ox_ndp_worker (void *arg)
+{
+    struct ox_ndp_job *job;
+    NdpResult *res;
+    uint8_t *buf, *page;
+
+    buf = malloc (NDP_CHUNK_LBAS * NVME_KERNEL_PG_SIZE);
+    res = malloc (sizeof (NdpResult));
+    page = malloc (NVME_KERNEL_PG_SIZE);
+
+    pthread_mutex_lock (&ndp.mutex);
+    while (!ndp.stop || !TAILQ_EMPTY (&ndp.jobs)) {
+        job = TAILQ_FIRST (&ndp.jobs);
+        if (!job) {
+            pthread_cond_wait (&ndp.cond, &ndp.mutex);
+            continue;
+        }
+        TAILQ_REMOVE (&ndp.jobs, job, entry);
+        ndp.running++;
+        pthread_mutex_unlock (&ndp.mutex);
+
+        if (job->cmp_prp) {
+            job->req->status = (buf && page) ?
+                                ox_ndp_compare_run (job, buf, page) :
+                                NVME_INTERNAL_DEV_ERROR;
+        } else {
+            job->req->status = (buf && res) ? ox_ndp_run (job, buf, res) :
+                                                    NVME_INTERNAL_DEV_ERROR;
+            job->req->cqe.n.result = (job->req->status == NVME_SUCCESS) ?
+                                htole32 ((uint32_t) le64toh (res->matched))
+                                : 0;
+        }
+        nvme_rw_cb (job->req);
+        free (job);
+
+        pthread_mutex_lock (&ndp.mutex);
+        if (!--ndp.running && TAILQ_EMPTY (&ndp.jobs))
+            pthread_cond_broadcast (&ndp.idle_cond);
+    }
+    pthread_mutex_unlock (&ndp.mutex);
+
+    free (page);
+    free (res);
+    free (buf);
+    return NULL;
+}
+
+static void ox_ndp_queue (struct ox_ndp_job *job)
+{
+    pthread_mutex_lock (&ndp.mutex);
+    TAILQ_INSERT_TAIL (&ndp.jobs, job, entry);
+    pthread_cond_signal (&ndp.cond);
+    pthread_mutex_unlock (&ndp.mutex);
+}
+
+uint16_t ox_ndp_exec_cmd (NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
+                                                             NvmeRequest *req)
+{
+    struct ox_ndp_params par;
+    struct ox_ndp_job *job;
+    uint64_t slba = ((uint64_t) cmd->cdw11 << 32) | cmd->cdw10;
+    uint64_t nlb = (uint64_t) cmd->cdw12 + 1;
+    uint8_t id, found = 0;
+
+    /* LBA reads next to the FTL are only provided by AppNVM */
+    if (!ndp.started || core.std_ftl != FTL_ID_APPNVM)
+        return NVME_INVALID_OPCODE | NVME_DNR;
+
+    if (slba + nlb > ns->id_ns.nsze)
+        return NVME_LBA_RANGE | NVME_DNR;
+    if (!cmd->prp1)
+        return NVME_INVALID_FIELD | NVME_DNR;
+
+    if (cmd->opcode == NDP_EXEC_DAEM_REQ) {
+        id = cmd->cdw13 & 0xff;
+        pthread_mutex_lock (&ndp.mutex);
+        if (id < NDP_MAX_DAEMONS && ndp.daemon[id].valid) {
+            par = ndp.daemon[id].par;
+            found = 1;
+        }
+        pthread_mutex_unlock (&ndp.mutex);
+        if (!found)
+            return NVME_INVALID_FIELD | NVME_DNR;
+    } else if (ox_ndp_parse (cmd, &par)) {
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    job = malloc (sizeof (struct ox_ndp_job));
+    if (!job)
+        return NVME_INTERNAL_DEV_ERROR;
+
+    job->req = req;
+    job->slba = ns->start_block + slba;
+    job->nlb = nlb;
+    job->prp = cmd->prp1;
+    job->cmp_prp = NULL;
+    job->par = par;
+
+    ox_ndp_queue (job);
+
+    return NVME_NO_COMPLETE;
+}
+
+/*
+ * NVMe Compare. The range is read through the FTL and compared on the NDP
+ * workers, the host buffer is already mapped to req->nvm_io->prp and the
+ * command completes with Compare Failure at the first different LBA.
+ */
+uint16_t ox_ndp_compare (NvmeRequest *req, uint64_t slba, uint32_t nlb)
+{
+    struct ox_ndp_job *job;
+
+    if (!ndp.started || core.std_ftl != FTL_ID_APPNVM)
+        return NVME_INVALID_OPCODE | NVME_DNR;
+
+    job = malloc (sizeof (struct ox_ndp_job));
+    if (!job)
+        return NVME_INTERNAL_DEV_ERROR;
+
+    memset (&job->par, 0x0, sizeof (struct ox_ndp_params));
+    job->req = req;
+    job->slba = slba;
+    job->nlb = nlb;
+    job->prp = 0;
+    job->cmp_prp = req->nvm_io->prp;
+
+    ox_ndp_queue (job);
+
+    return NVME_NO_COMPLETE;
+}
+
+static uint16_t ox_ndp_info (NvmeCmd *cmd)
+{
+    NdpInfo info;
+    int i, ndaem = 0;
+
+    memset (&info, 0x0, sizeof (NdpInfo));
+
+    pthread_mutex_lock (&ndp.mutex);
+    for (i = 0; i < NDP_MAX_DAEMONS; i++)
+        ndaem += ndp.daemon[i].valid;
+    pthread_mutex_unlock (&ndp.mutex);
+
+    info.version = htole16 (NDP_VERSION);
+    info.nkernels = htole16 (sizeof (ndp_kernels));
+    info.max_daemons = htole16 (NDP_MAX_DAEMONS);
+    info.ndaemons = htole16 (ndaem);
+    info.lba_sz = htole32 (NVME_KERNEL_PG_SIZE);
+    info.result_sz = htole32 (NDP_RESULT_SZ);
+    memcpy (info.kernels, ndp_kernels, sizeof (ndp_kernels));
+
+    return nvme_write_to_host (&info, cmd->prp1, sizeof (NdpInfo));
+}
+
+uint16_t ox_ndp_admin_cmd (NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
+{
+    struct ox_ndp_params par;
+    uint32_t id;
+    uint8_t found = 0;
+
+    if (!ndp.started)
+        return NVME_INVALID_OPCODE | NVME_DNR;
+
+    switch (cmd->opcode) {
+        case NDP_ADM_CMD_INFO:
+            return ox_ndp_info (cmd);
+
+        case NDP_ADM_CMD_INST_DAEM:
+            if (ox_ndp_parse (cmd, &par))
+                return NVME_INVALID_FIELD | NVME_DNR;
+
+            pthread_mutex_lock (&ndp.mutex);
+            for (id = 0; id < NDP_MAX_DAEMONS; id++) {
+                if (!ndp.daemon[id].valid) {
+                    ndp.daemon[id].par = par;
+                    ndp.daemon[id].valid = 1;
+                    break;
+                }
+            }
+            pthread_mutex_unlock (&ndp.mutex);
+
+            if (id == NDP_MAX_DAEMONS)
+                return NVME_INVALID_FIELD | NVME_DNR;
+            req->cqe.n.result = htole32 (id);
+            return NVME_SUCCESS;
+
+        case NDP_ADM_CMD_DEL_DAEM:
+            id = cmd->cdw10;
+            if (id >= NDP_MAX_DAEMONS)
+                return NVME_INVALID_FIELD | NVME_DNR;
+
+            /* Queued requests took a copy of the daemon */
+            pthread_mutex_lock (&ndp.mutex);
+            found = ndp.daemon[id].valid;
+            ndp.daemon[id].valid = 0;
+            pthread_mutex_unlock (&ndp.mutex);
+
+            return (found) ? NVME_SUCCESS : NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    return NVME_INVALID_OPCODE | NVME_DNR;
+}
+
+/* Waits for the queued and running jobs, before the queues go away */
+void ox_ndp_drain (void)
+{
+    if (!ndp.started)
+        return;
+
+    pthread_mutex_lock (&ndp.mutex);
+    while (ndp.running || !TAILQ_EMPTY (&ndp.jobs))
+        pthread_cond_wait (&ndp.idle_cond, &ndp.mutex);
+    pthread_mutex_unlock (&ndp.mutex);
+}
+
+int ox_ndp_init (void)
+{
+    int i;
+
+    memset (&ndp, 0x0, sizeof (struct ox_ndp));
+    TAILQ_INIT (&ndp.jobs);
+    pthread_mutex_init (&ndp.mutex, NULL);
+    pthread_cond_init (&ndp.cond, NULL);
+    pthread_cond_init (&ndp.idle_cond, NULL);
+
+    for (i = 0; i < NDP_THREADS; i++) {
+        if (pthread_create (&ndp.th[i], NULL, ox_ndp_worker, NULL))
+            goto STOP;
+    }
+    ndp.started = 1;
+
+    log_info ("  [nvm: NDP job engine started, %d threads]\n", NDP_THREADS);
+    return 0;
+
+STOP:
+    pthread_mutex_lock (&ndp.mutex);
+    ndp.stop = 1;
+    pthread_cond_broadcast (&ndp.cond);
+    pthread_mutex_unlock (&ndp.mutex);
+    while (i--)
+        pthread_join (ndp.th[i], NULL);
+    pthread_cond_destroy (&ndp.idle_cond);
+    pthread_cond_destroy (&ndp.cond);
+    pthread_mutex_destroy (&ndp.mutex);
+    return -1;
+}
+
+void ox_ndp_exit (void)
+{
+    int i;
+
+    if (!ndp.started)
+        return;
+
+    /* Workers finish the queued jobs first */
+    pthread_mutex_lock (&ndp.mutex);
+    ndp.stop = 1;
+    pthread_cond_broadcast (&ndp.cond);
+    pthread_mutex_unlock (&ndp.mutex);
+
+    for (i = 0; i < NDP_THREADS; i++)
+        pthread_join (ndp.th[i], NULL);
+
+    pthread_cond_destroy (&ndp.idle_cond);
+    pthread_cond_destroy (&ndp.cond);
+    pthread_mutex_destroy (&ndp.mutex);
+    ndp.started = 0;
+}
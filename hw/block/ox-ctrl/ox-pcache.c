@@ -0,0 +1,348 @@
+/* OX: Open-Channel NVM Express SSD Controller
+ *  - Media manager page cache for synchronous FTL reads
+ */
+
+#include "qemu/osdep.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/queue.h>
+#include "hw/block/ox-ctrl/include/ssd.h"
+#include "hw/block/ox-ctrl/include/ox-pcache.h"
+
+extern struct core_struct core;
+
+struct ox_pcache_ent {
+    uint64_t                        key;
+    uint8_t                         valid;
+    uint32_t                        md_sz;
+    uint8_t                         *data;  /* page data followed by OOB */
+    LIST_ENTRY(ox_pcache_ent)       hentry;
+    TAILQ_ENTRY(ox_pcache_ent)      lru;
+};
+
+struct ox_pcache_ch {
+    pthread_mutex_t                 mutex;
+    uint32_t                        pg_sz;
+    uint32_t                        oob_sz;
+    uint32_t                        hbits;
+    uint32_t                        *gen;   /* per hash bucket */
+    LIST_HEAD(, ox_pcache_ent)      *hash;
+    TAILQ_HEAD(ox_pcache_lru, ox_pcache_ent) lru_head;
+    struct ox_pcache_ent            *ent;
+    uint8_t                         *buf;
+};
+
+static struct ox_pcache_ch *pcache;
+static uint16_t pcache_nch;
+static struct ox_pcache_stats pcache_st;
+
+static inline uint64_t ox_pcache_key (struct nvm_ppa_addr *ppa)
+{
+    struct nvm_ppa_addr key;
+
+    key.ppa = ppa->ppa;
+    key.g.sec = 0;
+
+    return key.ppa;
+}
+
+static inline uint32_t ox_pcache_bucket (struct ox_pcache_ch *pch,
+                                                                uint64_t key)
+{
+    return (uint32_t) ((key * 0x9e3779b97f4a7c15ULL) >> (64 - pch->hbits));
+}
+
+static struct ox_pcache_ch *ox_pcache_get_ch (struct nvm_mmgr_io_cmd *cmd)
+{
+    if (!pcache || !cmd->ch || cmd->ch->ch_id >= pcache_nch)
+        return NULL;
+
+    return &pcache[cmd->ch->ch_id];
+}
+
+/* Only full pages in controller memory (synchronous I/O) are cached */
+static struct ox_pcache_ch *ox_pcache_cmd_ch (struct nvm_mmgr_io_cmd *cmd)
+{
+    struct ox_pcache_ch *pch = ox_pcache_get_ch (cmd);
+    uint16_t sec;
+
+    if (!pch || cmd->cmdtype != MMGR_READ_PG || !cmd->sync_count)
+        return NULL;
+
+    if (!cmd->n_sectors || cmd->sec_sz * cmd->n_sectors != pch->pg_sz ||
+                                                      cmd->md_sz > pch->oob_sz)
+        return NULL;
+
+    for (sec = 0; sec < cmd->n_sectors; sec++)
+        if (!cmd->prp[sec])
+            return NULL;
+
+    return pch;
+}
+
+static struct ox_pcache_ent *ox_pcache_lookup (struct ox_pcache_ch *pch,
+                                                                uint64_t key)
+{
+    struct ox_pcache_ent *ent;
+
+    LIST_FOREACH (ent, &pch->hash[ox_pcache_bucket (pch, key)], hentry)
+        if (ent->key == key)
+            return ent;
+
+    return NULL;
+}
+
+static void ox_pcache_drop (struct ox_pcache_ch *pch, struct ox_pcache_ent *ent)
+{
+    LIST_REMOVE (ent, hentry);
+    ent->valid = 0;
+    TAILQ_REMOVE (&pch->lru_head, ent, lru);
+    TAILQ_INSERT_TAIL (&pch->lru_head, ent, lru);
+}
+
+static void ox_pcache_inval_key (struct ox_pcache_ch *pch, uint64_t key)
+{
+    struct ox_pcache_ent *ent;
+
+    pch->gen[ox_pcache_bucket (pch, key)]++;
+
+    ent = ox_pcache_lookup (pch, key);
+    if (ent) {
+        ox_pcache_drop (pch, ent);
+        __atomic_fetch_add (&pcache_st.invals, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Completes a synchronous read from the cache. Returns 1 if the page was
+ * cached, data and OOB are copied and the command status is set. On a miss,
+ * the command takes the bucket generation used by ox_pcache_fill.
+ */
+int ox_pcache_read (struct nvm_mmgr_io_cmd *cmd)
+{
+    struct ox_pcache_ch *pch = ox_pcache_cmd_ch (cmd);
+    struct ox_pcache_ent *ent;
+    uint64_t key;
+    uint16_t sec;
+
+    if (!pch)
+        return 0;
+
+    key = ox_pcache_key (&cmd->ppa);
+
+    pthread_mutex_lock (&pch->mutex);
+    ent = ox_pcache_lookup (pch, key);
+    if (!ent || ent->md_sz < cmd->md_sz) {
+        cmd->pcache_gen = pch->gen[ox_pcache_bucket (pch, key)];
+        pthread_mutex_unlock (&pch->mutex);
+        __atomic_fetch_add (&pcache_st.misses, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    for (sec = 0; sec < cmd->n_sectors; sec++)
+        memcpy ((void *) cmd->prp[sec], ent->data + cmd->sec_sz * sec,
+                                                                  cmd->sec_sz);
+    if (cmd->md_prp && cmd->md_sz)
+        memcpy ((void *) cmd->md_prp, ent->data + pch->pg_sz, cmd->md_sz);
+
+    TAILQ_REMOVE (&pch->lru_head, ent, lru);
+    TAILQ_INSERT_HEAD (&pch->lru_head, ent, lru);
+    pthread_mutex_unlock (&pch->mutex);
+
+    cmd->status = NVM_IO_SUCCESS;
+    __atomic_fetch_add (&pcache_st.hits, 1, __ATOMIC_RELAXED);
+
+    return 1;
+}
+
+/* Caches a completed synchronous read, called before the waiter returns */
+void ox_pcache_fill (struct nvm_mmgr_io_cmd *cmd)
+{
+    struct ox_pcache_ch *pch = ox_pcache_cmd_ch (cmd);
+    struct ox_pcache_ent *ent;
+    uint64_t key;
+    uint16_t sec;
+
+    if (!pch || cmd->status != NVM_IO_SUCCESS)
+        return;
+
+    key = ox_pcache_key (&cmd->ppa);
+
+    pthread_mutex_lock (&pch->mutex);
+
+    /* written or erased while the read was in the media */
+    if (pch->gen[ox_pcache_bucket (pch, key)] != cmd->pcache_gen)
+        goto UNLOCK;
+
+    ent = ox_pcache_lookup (pch, key);
+    if (ent) {
+        if (ent->md_sz >= cmd->md_sz)
+            goto UNLOCK;
+        ox_pcache_drop (pch, ent);
+    }
+
+    ent = TAILQ_LAST (&pch->lru_head, ox_pcache_lru);
+    if (ent->valid)
+        LIST_REMOVE (ent, hentry);
+
+    for (sec = 0; sec < cmd->n_sectors; sec++)
+        memcpy (ent->data + cmd->sec_sz * sec, (void *) cmd->prp[sec],
+                                                                  cmd->sec_sz);
+    ent->md_sz = (cmd->md_prp) ? cmd->md_sz : 0;
+    if (ent->md_sz)
+        memcpy (ent->data + pch->pg_sz, (void *) cmd->md_prp, ent->md_sz);
+
+    ent->key = key;
+    ent->valid = 1;
+    LIST_INSERT_HEAD (&pch->hash[ox_pcache_bucket (pch, key)], ent, hentry);
+    TAILQ_REMOVE (&pch->lru_head, ent, lru);
+    TAILQ_INSERT_HEAD (&pch->lru_head, ent, lru);
+
+    __atomic_fetch_add (&pcache_st.fills, 1, __ATOMIC_RELAXED);
+
+UNLOCK:
+    pthread_mutex_unlock (&pch->mutex);
+}
+
+/* Drops the pages of a write or of all planes of an erased block */
+void ox_pcache_inval (struct nvm_mmgr_io_cmd *cmd)
+{
+    struct ox_pcache_ch *pch = ox_pcache_get_ch (cmd);
+    struct nvm_mmgr_geometry *g;
+    struct nvm_ppa_addr ppa;
+    uint32_t pl, pg;
+
+    if (!pch)
+        return;
+
+    pthread_mutex_lock (&pch->mutex);
+    switch (cmd->cmdtype) {
+        case MMGR_WRITE_PG:
+            ox_pcache_inval_key (pch, ox_pcache_key (&cmd->ppa));
+            break;
+        case MMGR_ERASE_BLK:
+            g = cmd->ch->geometry;
+            ppa.ppa = cmd->ppa.ppa;
+            for (pl = 0; pl < g->n_of_planes; pl++) {
+                for (pg = 0; pg < g->pg_per_blk; pg++) {
+                    ppa.g.pl = pl;
+                    ppa.g.pg = pg;
+                    ox_pcache_inval_key (pch, ox_pcache_key (&ppa));
+                }
+            }
+            break;
+    }
+    pthread_mutex_unlock (&pch->mutex);
+}
+
+static void ox_pcache_free_ch (struct ox_pcache_ch *pch)
+{
+    pthread_mutex_destroy (&pch->mutex);
+    free (pch->gen);
+    free (pch->hash);
+    free (pch->ent);
+    free (pch->buf);
+}
+
+static int ox_pcache_init_ch (struct ox_pcache_ch *pch,
+                                   struct nvm_mmgr_geometry *g, uint32_t pgs)
+{
+    uint32_t i, ent_sz;
+
+    pch->pg_sz = g->pg_size;
+    pch->oob_sz = g->pg_oob_sz;
+    ent_sz = pch->pg_sz + pch->oob_sz;
+
+    for (pch->hbits = 1; (1U << pch->hbits) < pgs * 2; pch->hbits++);
+
+    pch->gen = calloc (1U << pch->hbits, sizeof (uint32_t));
+    pch->hash = calloc (1U << pch->hbits, sizeof (*pch->hash));
+    pch->ent = calloc (pgs, sizeof (struct ox_pcache_ent));
+    pch->buf = malloc ((size_t) ent_sz * pgs);
+    pthread_mutex_init (&pch->mutex, NULL);
+
+    if (!pch->gen || !pch->hash || !pch->ent || !pch->buf) {
+        ox_pcache_free_ch (pch);
+        return -1;
+    }
+
+    TAILQ_INIT (&pch->lru_head);
+    for (i = 0; i < pgs; i++) {
+        pch->ent[i].data = pch->buf + (size_t) ent_sz * i;
+        TAILQ_INSERT_TAIL (&pch->lru_head, &pch->ent[i], lru);
+    }
+
+    return 0;
+}
+
+/**
+ * Creates the cache of each channel with 'pgs' plane-pages. Channels must
+ * be configured, the geometry of each one is used. 'pgs' 0 disables it.
+ */
+int ox_pcache_init (uint16_t n_ch, uint32_t pgs)
+{
+    struct ox_pcache_ch *pc;
+    uint16_t ch_i;
+
+    if (pcache)
+        ox_pcache_exit ();
+
+    if (!pgs || !n_ch)
+        return 0;
+
+    pc = calloc (n_ch, sizeof (struct ox_pcache_ch));
+    if (!pc)
+        return -1;
+
+    for (ch_i = 0; ch_i < n_ch; ch_i++) {
+        if (ox_pcache_init_ch (&pc[ch_i], core.nvm_ch[ch_i]->geometry, pgs))
+            goto FREE;
+    }
+
+    memset (&pcache_st, 0, sizeof (struct ox_pcache_stats));
+    pcache_nch = n_ch;
+    pcache = pc;
+
+    log_info ("  [ox: Page cache started. %d pages per channel]\n", pgs);
+
+    return 0;
+
+FREE:
+    while (ch_i) {
+        ch_i--;
+        ox_pcache_free_ch (&pc[ch_i]);
+    }
+    free (pc);
+    return -1;
+}
+
+/* No I/O may be in flight */
+void ox_pcache_exit (void)
+{
+    struct ox_pcache_ch *pc = pcache;
+    uint16_t ch_i;
+
+    if (!pc)
+        return;
+
+    pcache = NULL;
+    for (ch_i = 0; ch_i < pcache_nch; ch_i++)
+        ox_pcache_free_ch (&pc[ch_i]);
+    free (pc);
+    pcache_nch = 0;
+}
+
+uint8_t ox_pcache_enabled (void)
+{
+    return pcache != NULL;
+}
+
+void ox_pcache_get_stats (struct ox_pcache_stats *st)
+{
+    st->hits = __atomic_load_n (&pcache_st.hits, __ATOMIC_RELAXED);
+    st->misses = __atomic_load_n (&pcache_st.misses, __ATOMIC_RELAXED);
+    st->fills = __atomic_load_n (&pcache_st.fills, __ATOMIC_RELAXED);
+    st->invals = __atomic_load_n (&pcache_st.invals, __ATOMIC_RELAXED);
+}
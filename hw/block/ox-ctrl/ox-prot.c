@@ -0,0 +1,248 @@
+/* OX: Open-Channel NVM Express SSD Controller
+ *  - Sector CRC32C protection between the FTL and the media managers
+ */
+
+#include "qemu/osdep.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "qemu/crc32c.h"
+#include "hw/block/ox-ctrl/include/ssd.h"
+#include "hw/block/ox-ctrl/include/ox-prot.h"
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+typedef uint32_t (ox_crc32c_fn) (uint32_t, const uint8_t *, size_t);
+
+static uint8_t prot_on;
+static struct ox_prot_stats prot_st;
+
+static uint32_t ox_crc32c_sw (uint32_t crc, const uint8_t *p, size_t len)
+{
+    return crc32c (crc, p, len);
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t ox_crc32c_sse42 (uint32_t crc, const uint8_t *p, size_t len)
+{
+    uint64_t c = crc, v;
+
+    for (; len >= 8; len -= 8, p += 8) {
+        memcpy (&v, p, 8);
+        c = __builtin_ia32_crc32di (c, v);
+    }
+    for (; len; len--, p++)
+        c = __builtin_ia32_crc32qi ((uint32_t) c, *p);
+
+    return (uint32_t) c ^ 0xffffffff;
+}
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+static uint32_t ox_crc32c_armv8 (uint32_t crc, const uint8_t *p, size_t len)
+{
+    uint64_t v;
+
+    for (; len >= 8; len -= 8, p += 8) {
+        memcpy (&v, p, 8);
+        crc = __crc32cd (crc, v);
+    }
+    for (; len; len--, p++)
+        crc = __crc32cb (crc, *p);
+
+    return crc ^ 0xffffffff;
+}
+#endif
+
+static ox_crc32c_fn *crc_fn = ox_crc32c_sw;
+static const char *crc_impl = "table";
+
+/**
+ * CRC32C with the conventions of util/crc32c.c: 'crc' is the seed
+ * (0xffffffff to start) and the result is inverted. To continue a CRC, pass
+ * the previous result inverted back.
+ */
+uint32_t ox_crc32c (uint32_t crc, const void *buf, size_t len)
+{
+    return crc_fn (crc, (const uint8_t *) buf, len);
+}
+
+const char *ox_crc32c_impl (void)
+{
+    return crc_impl;
+}
+
+void ox_prot_init (uint8_t enable)
+{
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports ("sse4.2")) {
+        crc_fn = ox_crc32c_sse42;
+        crc_impl = "sse4.2";
+    }
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+    crc_fn = ox_crc32c_armv8;
+    crc_impl = "armv8-crc";
+#endif
+
+    prot_on = enable;
+    if (enable)
+        log_info ("  [ox: Sector CRC32C protection enabled (%s)]\n", crc_impl);
+}
+
+uint8_t ox_prot_enabled (void)
+{
+    return prot_on;
+}
+
+/* Only commands with the OOB in controller memory, it is never host data */
+static uint32_t ox_prot_oob_sz (struct nvm_mmgr_io_cmd *cmd)
+{
+    uint32_t oob_sz;
+
+    if (!prot_on || !cmd->ch || !cmd->md_prp || !cmd->md_sz ||
+                                    (!cmd->sync_count && !cmd->force_sync_md))
+        return 0;
+
+    oob_sz = cmd->ch->geometry->sec_oob_sz;
+    return (oob_sz > OX_PROT_SZ) ? oob_sz : 0;
+}
+
+/*
+ * Data of a sector. Sync commands carry controller pointers, host sectors
+ * are mapped or, if they cannot be mapped, copied to '*bounce'.
+ */
+static uint8_t *ox_prot_sec_data (struct nvm_mmgr_io_cmd *cmd, uint16_t sec,
+                                            uint8_t **bounce, uint8_t *mapped)
+{
+    uint8_t *ptr;
+
+    *mapped = 0;
+    if (cmd->sync_count)
+        return (uint8_t *) cmd->prp[sec];
+
+    ptr = nvm_dma_map (cmd->prp[sec], cmd->sec_sz, NVM_DMA_FROM_HOST);
+    if (ptr) {
+        *mapped = 1;
+        return ptr;
+    }
+
+    if (!*bounce) {
+        *bounce = malloc (cmd->sec_sz);
+        if (!*bounce)
+            return NULL;
+    }
+    if (nvm_dma (*bounce, cmd->prp[sec], cmd->sec_sz, NVM_DMA_FROM_HOST))
+        return NULL;
+
+    return *bounce;
+}
+
+static uint32_t ox_prot_crc (uint8_t *data, uint32_t sec_sz, uint8_t *oob,
+                                                                uint32_t oob_sz)
+{
+    uint32_t crc;
+
+    crc = ox_crc32c (0xffffffff, data, sec_sz);
+    crc = ox_crc32c (crc ^ 0xffffffff, oob, oob_sz - OX_PROT_SZ);
+
+    /* Zero is kept for unprotected sectors */
+    return (crc) ? crc : 0xffffffff;
+}
+
+/*
+ * Walks the sectors of the command with their OOB entry. Sectors without
+ * data are skipped, in reads their OOB entries were removed by the media
+ * manager, so the entry index is the index among the sectors with data.
+ * Returns the sectors that failed the check, for reads.
+ */
+static int ox_prot_sectors (struct nvm_mmgr_io_cmd *cmd, uint8_t verify)
+{
+    uint32_t oob_sz = ox_prot_oob_sz (cmd);
+    uint32_t crc, stored = 0;
+    uint16_t sec, ent = 0;
+    uint8_t *data, *oob, *bounce = NULL, mapped;
+    int errors = 0;
+
+    if (!oob_sz)
+        return 0;
+
+    for (sec = 0; sec < cmd->n_sectors; sec++) {
+        if (!cmd->prp[sec]) {
+            if (!verify)
+                ent++;
+            continue;
+        }
+
+        if ((uint32_t) (ent + 1) * oob_sz > cmd->md_sz)
+            break;
+
+        oob = (uint8_t *) cmd->md_prp + (uint32_t) ent * oob_sz;
+        ent++;
+
+        if (verify) {
+            memcpy (&stored, oob + oob_sz - OX_PROT_SZ, OX_PROT_SZ);
+            if (!stored) {
+                __atomic_fetch_add (&prot_st.sec_unprotected, 1,
+                                                            __ATOMIC_RELAXED);
+                continue;
+            }
+        }
+
+        data = ox_prot_sec_data (cmd, sec, &bounce, &mapped);
+        if (!data)
+            continue;
+
+        crc = ox_prot_crc (data, cmd->sec_sz, oob, oob_sz);
+
+        if (mapped)
+            nvm_dma_unmap (data, cmd->sec_sz, NVM_DMA_FROM_HOST);
+
+        if (!verify) {
+            memcpy (oob + oob_sz - OX_PROT_SZ, &crc, OX_PROT_SZ);
+            __atomic_fetch_add (&prot_st.sec_protected, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        __atomic_fetch_add (&prot_st.sec_verified, 1, __ATOMIC_RELAXED);
+        if (crc != stored) {
+            __atomic_fetch_add (&prot_st.sec_errors, 1, __ATOMIC_RELAXED);
+            log_err ("[ox: CRC error. ch: %d, lun: %d, blk: %d, pl: %d, "
+                        "pg: %d, sec: %d]\n", cmd->ppa.g.ch, cmd->ppa.g.lun,
+                        cmd->ppa.g.blk, cmd->ppa.g.pl, cmd->ppa.g.pg, sec);
+            errors++;
+        }
+    }
+
+    free (bounce);
+    return errors;
+}
+
+/* Sets the CRC of the sectors before the media manager write */
+void ox_prot_write (struct nvm_mmgr_io_cmd *cmd)
+{
+    if (prot_on && cmd->cmdtype == MMGR_WRITE_PG)
+        ox_prot_sectors (cmd, 0);
+}
+
+/* Verifies a completed read, returns -1 if a sector is corrupted */
+int ox_prot_read (struct nvm_mmgr_io_cmd *cmd)
+{
+    if (!prot_on || cmd->cmdtype != MMGR_READ_PG)
+        return 0;
+
+    return (ox_prot_sectors (cmd, 1)) ? -1 : 0;
+}
+
+void ox_prot_get_stats (struct ox_prot_stats *st)
+{
+    st->sec_protected = __atomic_load_n (&prot_st.sec_protected,
+                                                            __ATOMIC_RELAXED);
+    st->sec_verified = __atomic_load_n (&prot_st.sec_verified,
+                                                            __ATOMIC_RELAXED);
+    st->sec_errors = __atomic_load_n (&prot_st.sec_errors, __ATOMIC_RELAXED);
+    st->sec_unprotected = __atomic_load_n (&prot_st.sec_unprotected,
+                                                            __ATOMIC_RELAXED);
+}
@@ -0,0 +1,110 @@
+/* OX: Open-Channel NVM Express SSD Controller
+ *  - DMA staging slot allocator of the media managers
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "hw/block/ox-ctrl/include/ox-slots.h"
+
+static inline uint64_t ox_slots_mask (struct ox_slots *sl, uint32_t w)
+{
+    uint32_t bits = sl->n_slots - w * 64;
+
+    return (bits >= 64) ? ~0ULL : (1ULL << bits) - 1;
+}
+
+/* One pass over the bitmap, returns the 1-based slot or 0 if all are busy */
+static uint32_t ox_slots_try (struct ox_slots *sl)
+{
+    uint32_t i, w, start;
+    uint64_t v, mask;
+    int bit;
+
+    start = __atomic_load_n (&sl->hint, __ATOMIC_RELAXED) % sl->n_words;
+
+    for (i = 0; i < sl->n_words; i++) {
+        w = (start + i) % sl->n_words;
+        mask = ox_slots_mask (sl, w);
+        v = __atomic_load_n (&sl->map[w], __ATOMIC_ACQUIRE);
+        while (~v & mask) {
+            bit = __builtin_ctzll (~v & mask);
+            if (__atomic_compare_exchange_n (&sl->map[w], &v, v | 1ULL << bit,
+                                0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+                if ((v | 1ULL << bit) == mask)
+                    __atomic_store_n (&sl->hint, w + 1, __ATOMIC_RELAXED);
+                return w * 64 + bit + 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* Takes a free slot, sleeps if all slots are busy */
+uint32_t ox_slots_get (struct ox_slots *sl)
+{
+    uint32_t slot;
+
+    slot = ox_slots_try (sl);
+    if (slot)
+        return slot;
+
+    pthread_mutex_lock (&sl->mutex);
+    __atomic_fetch_add (&sl->waiters, 1, __ATOMIC_SEQ_CST);
+    while (!(slot = ox_slots_try (sl)))
+        pthread_cond_wait (&sl->cond, &sl->mutex);
+    __atomic_fetch_sub (&sl->waiters, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock (&sl->mutex);
+
+    return slot;
+}
+
+void ox_slots_put (struct ox_slots *sl, uint32_t slot)
+{
+    uint32_t w;
+
+    if (!slot || slot > sl->n_slots)
+        return;
+
+    slot--;
+    w = slot / 64;
+    __atomic_fetch_and (&sl->map[w], ~(1ULL << (slot % 64)), __ATOMIC_SEQ_CST);
+
+    /* a waiter either finds the slot or is already waiting for the signal */
+    if (__atomic_load_n (&sl->waiters, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock (&sl->mutex);
+        pthread_cond_signal (&sl->cond);
+        pthread_mutex_unlock (&sl->mutex);
+    }
+}
+
+int ox_slots_init (struct ox_slots *sl, uint32_t n_slots)
+{
+    if (!n_slots)
+        return -1;
+
+    memset (sl, 0, sizeof (struct ox_slots));
+    sl->n_slots = n_slots;
+    sl->n_words = (n_slots + 63) / 64;
+    sl->map = calloc (sl->n_words, sizeof (uint64_t));
+    if (!sl->map)
+        return -1;
+
+    pthread_mutex_init (&sl->mutex, NULL);
+    pthread_cond_init (&sl->cond, NULL);
+
+    return 0;
+}
+
+void ox_slots_exit (struct ox_slots *sl)
+{
+    if (!sl->map)
+        return;
+
+    pthread_cond_destroy (&sl->cond);
+    pthread_mutex_destroy (&sl->mutex);
+    free (sl->map);
+    sl->map = NULL;
+}
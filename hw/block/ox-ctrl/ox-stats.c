@@ -0,0 +1,272 @@
+/* OX: Open-Channel NVM Express SSD Controller
+ *  - Time series of the controller telemetry
+ */
+
+#include "qemu/osdep.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "qemu/cutils.h"
+#include "qemu/timer.h"
+#include "hw/block/ox-ctrl/include/ssd.h"
+#include "hw/block/ox-ctrl/include/ox-mq.h"
+#include "hw/block/ox-ctrl/include/ox-stats.h"
+
+/* Media counters of a channel, updated by any completion thread */
+struct ox_stats_ch_ctr {
+    uint64_t    rd_bytes;
+    uint64_t    wr_bytes;
+    uint64_t    erases;
+};
+
+static struct ox_stats_ch_ctr  *stats_ch;
+static uint16_t                 stats_nch;
+
+static struct ox_stats_sample   stats_ring[OX_STATS_RING];
+static uint64_t                 stats_seq;    /* last sample, 0 if none */
+static QEMUTimer               *stats_timer;
+static uint32_t                 stats_interval; /* msec, 0: disabled */
+static ox_stats_sample_fn      *stats_notify;
+static void                    *stats_notify_arg;
+
+void ox_stats_mmgr_io (struct nvm_mmgr_io_cmd *cmd)
+{
+    struct ox_stats_ch_ctr *ctr;
+    uint64_t bytes = (uint64_t) cmd->n_sectors * cmd->sec_sz;
+    struct ox_stats_ch_ctr *chs = __atomic_load_n (&stats_ch,
+                                                            __ATOMIC_ACQUIRE);
+
+    if (!chs || cmd->ppa.g.ch >= stats_nch)
+        return;
+
+    ctr = &chs[cmd->ppa.g.ch];
+
+    switch (cmd->cmdtype) {
+        case MMGR_READ_PG:
+        case MMGR_READ_SGL:
+            __atomic_fetch_add (&ctr->rd_bytes, bytes, __ATOMIC_RELAXED);
+            break;
+        case MMGR_WRITE_PG:
+        case MMGR_WRITE_SGL:
+            __atomic_fetch_add (&ctr->wr_bytes, bytes, __ATOMIC_RELAXED);
+            break;
+        case MMGR_ERASE_BLK:
+            __atomic_fetch_add (&ctr->erases, 1, __ATOMIC_RELAXED);
+            break;
+    }
+}
+
+static void ox_stats_free_sample (struct ox_stats_sample *s)
+{
+    uint32_t i;
+
+    for (i = 0; i < s->n_mq; i++)
+        free (s->mq[i].queues);
+    free (s->mq);
+    free (s->ch);
+    memset (s, 0x0, sizeof (struct ox_stats_sample));
+}
+
+static void ox_stats_sample_mq (struct ox_mq *mq, void *arg)
+{
+    struct ox_stats_sample *s = arg;
+    struct ox_stats_mq *smq, *list;
+    struct ox_mq_queue *q;
+    uint32_t i;
+
+    list = realloc (s->mq, sizeof (struct ox_stats_mq) * (s->n_mq + 1));
+    if (!list)
+        return;
+    s->mq = list;
+
+    smq = &s->mq[s->n_mq];
+    memset (smq, 0x0, sizeof (struct ox_stats_mq));
+    smq->queues = calloc (mq->config->n_queues, sizeof (struct ox_stats_queue));
+    if (!smq->queues)
+        return;
+    s->n_mq++;
+
+    pstrcpy (smq->name, sizeof (smq->name), mq->config->name);
+    smq->timeout = u_atomic_read (&mq->stats.timeout);
+    smq->to_back = u_atomic_read (&mq->stats.to_back);
+    smq->n_queues = mq->config->n_queues;
+
+    for (i = 0; i < smq->n_queues; i++) {
+        q = &mq->queues[i];
+        smq->queues[i].sq_used = u_atomic_read (&q->stats.sq_used);
+        smq->queues[i].sq_wait = u_atomic_read (&q->stats.sq_wait);
+        smq->queues[i].cq_used = u_atomic_read (&q->stats.cq_used);
+    }
+}
+
+static uint64_t ox_stats_rate (uint64_t cur, uint64_t prev, int64_t ns)
+{
+    return (ns > 0 && cur >= prev) ?
+                    (uint64_t) ((double) (cur - prev) * 1e9 / (double) ns) : 0;
+}
+
+static void ox_stats_sample_ch (struct ox_stats_sample *s,
+                                                struct ox_stats_sample *prev)
+{
+    struct ox_stats_ch *c;
+    int64_t ns = (prev) ? s->time_ns - prev->time_ns : 0;
+    uint16_t ch_i;
+
+    s->ch = calloc (stats_nch, sizeof (struct ox_stats_ch));
+    if (!s->ch)
+        return;
+    s->n_ch = stats_nch;
+
+    for (ch_i = 0; ch_i < s->n_ch; ch_i++) {
+        c = &s->ch[ch_i];
+        c->rd_bytes = __atomic_load_n (&stats_ch[ch_i].rd_bytes,
+                                                            __ATOMIC_RELAXED);
+        c->wr_bytes = __atomic_load_n (&stats_ch[ch_i].wr_bytes,
+                                                            __ATOMIC_RELAXED);
+        c->erases = __atomic_load_n (&stats_ch[ch_i].erases, __ATOMIC_RELAXED);
+
+        if (!prev || ch_i >= prev->n_ch)
+            continue;
+        c->rd_bps = ox_stats_rate (c->rd_bytes, prev->ch[ch_i].rd_bytes, ns);
+        c->wr_bps = ox_stats_rate (c->wr_bytes, prev->ch[ch_i].wr_bytes, ns);
+    }
+}
+
+/* Hit rate of the lookups since the previous sample, or since the start */
+static uint8_t ox_stats_hit_rate (struct ox_stats_sample *s,
+                                                struct ox_stats_sample *prev)
+{
+    uint64_t hit = s->map.hit, miss = s->map.miss;
+
+    if (prev && prev->has_map && hit >= prev->map.hit &&
+                                                    miss >= prev->map.miss) {
+        hit -= prev->map.hit;
+        miss -= prev->map.miss;
+    }
+
+    return (hit + miss) ? (hit * 100) / (hit + miss) : 0;
+}
+
+static void ox_stats_sample (void)
+{
+    struct ox_stats_sample *s, *prev = NULL;
+
+    if (stats_seq)
+        prev = &stats_ring[stats_seq % OX_STATS_RING];
+
+    s = &stats_ring[(stats_seq + 1) % OX_STATS_RING];
+    ox_stats_free_sample (s);
+
+    s->time_ns = qemu_clock_get_ns (QEMU_CLOCK_REALTIME);
+
+    ox_mq_foreach (ox_stats_sample_mq, s);
+
+    s->has_gc = !nvm_ftl_gc_get (&s->gc);
+    s->has_map = !nvm_ftl_map_cache_get (&s->map);
+    if (s->has_map)
+        s->map_hit_rate = ox_stats_hit_rate (s, prev);
+
+    ox_stats_sample_ch (s, prev);
+
+    s->seq = ++stats_seq;
+
+    if (stats_notify)
+        stats_notify (s, stats_notify_arg);
+}
+
+static void ox_stats_timer_cb (void *opaque)
+{
+    ox_stats_sample ();
+
+    if (stats_interval)
+        timer_mod (stats_timer, qemu_clock_get_ms (QEMU_CLOCK_REALTIME) +
+                                                              stats_interval);
+}
+
+/* Samples every 'msec', 0 stops sampling. Called from the main loop */
+void ox_stats_set_interval (uint32_t msec)
+{
+    stats_interval = msec;
+
+    if (!stats_timer)
+        return;
+
+    if (msec)
+        timer_mod (stats_timer, qemu_clock_get_ms (QEMU_CLOCK_REALTIME) +
+                                                                        msec);
+    else
+        timer_del (stats_timer);
+}
+
+uint32_t ox_stats_interval (void)
+{
+    return stats_interval;
+}
+
+/* 'fn' is called from the main loop after each sample */
+void ox_stats_set_notify (ox_stats_sample_fn *fn, void *arg)
+{
+    stats_notify = fn;
+    stats_notify_arg = arg;
+}
+
+/* Calls 'fn' for the samples newer than sequence 'since', oldest first */
+void ox_stats_foreach (uint64_t since, ox_stats_sample_fn *fn, void *arg)
+{
+    uint64_t seq;
+
+    seq = (stats_seq > OX_STATS_RING) ? stats_seq - OX_STATS_RING + 1 : 1;
+    if (since >= seq)
+        seq = since + 1;
+
+    for (; seq <= stats_seq; seq++)
+        fn (&stats_ring[seq % OX_STATS_RING], arg);
+}
+
+/*
+ * As the latency histograms, the counters are kept across controller
+ * restarts and allocated once for the number of channels. The interval
+ * applies at the first call, later it is changed by ox_stats_set_interval.
+ */
+int ox_stats_init (uint16_t n_ch, uint32_t interval)
+{
+    struct ox_stats_ch_ctr *chs;
+
+    if (stats_ch)
+        return (n_ch <= stats_nch) ? 0 : -1;
+
+    if (!n_ch)
+        return -1;
+
+    chs = calloc (n_ch, sizeof (struct ox_stats_ch_ctr));
+    if (!chs)
+        return -1;
+
+    stats_nch = n_ch;
+    __atomic_store_n (&stats_ch, chs, __ATOMIC_RELEASE);
+
+    stats_timer = timer_new_ms (QEMU_CLOCK_REALTIME, ox_stats_timer_cb, NULL);
+    ox_stats_set_interval (interval);
+
+    return 0;
+}
+
+void ox_stats_exit (void)
+{
+    struct ox_stats_ch_ctr *chs = stats_ch;
+    uint32_t i;
+
+    if (stats_timer) {
+        timer_del (stats_timer);
+        timer_free (stats_timer);
+        stats_timer = NULL;
+    }
+
+    for (i = 0; i < OX_STATS_RING; i++)
+        ox_stats_free_sample (&stats_ring[i]);
+    stats_seq = 0;
+
+    __atomic_store_n (&stats_ch, NULL, __ATOMIC_RELEASE);
+    stats_nch = 0;
+    free (chs);
+}
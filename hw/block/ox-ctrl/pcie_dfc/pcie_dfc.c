@@ -10,7 +10,9 @@
 #include <syslog.h>
 #include <string.h>
 #include <mqueue.h>
+#include <poll.h>
 #include <sched.h>
+#include <unistd.h>
 #include "hw/block/ox-ctrl/include/ssd.h"
 #include "hw/block/ox-ctrl/include/nvme.h"
 #include "pcie_dfc.h"
@@ -18,11 +20,173 @@
 #include "hw/pci/msi.h"
 #include "hw/pci/pci.h"
 #include "qemu/host-utils.h"
+#include "qemu/main-loop.h"
+#include "qemu/rcu.h"
+#include "migration/vmstate.h"
 
 extern struct core_struct core;
 
+struct nvm_pcie pcie_dfc = {
+    .name           = "PCI_LS2085",
+};
+
+static void dfcpcie_db_ring_init (struct dfc_db_ring *ring)
+{
+    uint32_t i;
+
+    for (i = 0; i < DFC_DB_RING_SZ; i++)
+        ring->slot[i].seq = i;
+    ring->head = ring->tail = ring->done = 0;
+    ring->stop = 0;
+}
+
+/* Called by the vCPUs, returns false if the ring is full */
+static bool dfcpcie_db_push (struct dfc_db_ring *ring, uint64_t addr,
+                                                                uint64_t val)
+{
+    struct dfc_db_slot *slot;
+    uint32_t pos, seq;
+
+    pos = atomic_read(&ring->tail);
+    for (;;) {
+        slot = &ring->slot[pos & (DFC_DB_RING_SZ - 1)];
+        seq = atomic_mb_read(&slot->seq);
+        if (seq == pos) {
+            if (atomic_cmpxchg(&ring->tail, pos, pos + 1) == pos)
+                break;
+        } else if ((int32_t)(seq - pos) < 0) {
+            return false;
+        }
+        pos = atomic_read(&ring->tail);
+    }
+
+    slot->db.offset = addr;
+    slot->db.new_val = val;
+    atomic_mb_set(&slot->seq, pos + 1);
+
+    return true;
+}
+
+/* Called by the request processor only */
+static bool dfcpcie_db_pop (struct dfc_db_ring *ring, fifo_data *db)
+{
+    struct dfc_db_slot *slot = &ring->slot[ring->head & (DFC_DB_RING_SZ - 1)];
+
+    if (atomic_mb_read(&slot->seq) != ring->head + 1)
+        return false;
+
+    *db = slot->db;
+    atomic_mb_set(&slot->seq, ring->head + DFC_DB_RING_SZ);
+    ring->head++;
+
+    return true;
+}
+
+/* Called by the vCPUs, waits until the doorbells queued so far are done */
+static void dfcpcie_db_drain (struct dfc_db_ring *ring)
+{
+    uint32_t pos = atomic_mb_read(&ring->tail);
+
+    while ((int32_t)(atomic_mb_read(&ring->done) - pos) < 0 &&
+                                                    !atomic_read(&ring->stop)) {
+        event_notifier_set (&ring->notifier);
+        sched_yield ();
+    }
+}
+
+static void dfcpcie_raise_irq (NvmeCQ *cq)
+{
+    if (cq->irq_enabled) {
+        if (msix_enabled(&(core.qemu->parent_obj))) {
+
+            msix_notify(&(core.qemu->parent_obj), cq->vector);
+
+        } else if (msi_enabled(&(core.qemu->parent_obj))) {
+
+            if (!(core.nvm_nvme_ctrl->nvme_regs.vBar.intms & (1<<cq->vector))){
+                msi_notify(&(core.qemu->parent_obj), cq->vector);
+            }
+
+        } else {
+            pci_irq_pulse(&core.qemu->parent_obj);
+        }
+    }
+}
+
+static void dfcpcie_irq_flush (struct pci_ctrl *ctrl)
+{
+    NvmeCtrl *n = core.nvm_nvme_ctrl;
+    uint16_t qid;
+    int i;
+
+    for (i = 0; i < ctrl->irq_count; i++) {
+        qid = ctrl->irq_qid[i];
+        ctrl->irq_pending[qid] = 0;
+        if (n->cq[qid])
+            dfcpcie_raise_irq (n->cq[qid]);
+    }
+    ctrl->irq_count = 0;
+    ctrl->irq_batching = 0;
+}
+
+/*
+ * Dispatches up to DFC_DB_BATCH queued doorbells in order, returns how many.
+ * SQ tail doorbells only need db_mutex, the BQL is taken once for all the
+ * others and the CQs they interrupt are notified once, when it is released.
+ */
+static int dfcpcie_db_dispatch (struct pci_ctrl *ctrl)
+{
+    NvmeCtrl *n = core.nvm_nvme_ctrl;
+    fifo_data db;
+    int count = 0;
+    bool locked = false;
+
+    while (count < DFC_DB_BATCH && dfcpcie_db_pop (&ctrl->db_ring, &db)) {
+        count++;
+        if (nvme_process_sq_db_unlocked (n, db.offset, db.new_val))
+            continue;
+
+        if (!locked) {
+            qemu_mutex_lock_iothread();
+            ctrl->irq_batching = 1;
+            locked = true;
+        }
+        nvme_process_db (n, db.offset, db.new_val);
+    }
+
+    if (locked) {
+        dfcpcie_irq_flush (ctrl);
+        qemu_mutex_unlock_iothread();
+    }
+    atomic_mb_set(&ctrl->db_ring.done, ctrl->db_ring.head);
+
+    return count;
+}
+
 static void *dfcpcie_req_processor (void *arg)
 {
+    struct nvm_pcie *pcie = arg;
+    struct pci_ctrl *ctrl = pcie->ctrl;
+    struct dfc_db_ring *ring = &ctrl->db_ring;
+    struct pollfd pfd;
+
+    rcu_register_thread();
+
+    pfd.fd = event_notifier_get_fd (&ring->notifier);
+    pfd.events = POLLIN;
+
+    while (!atomic_read(&ring->stop)) {
+        if (poll (&pfd, 1, -1) < 0 && errno != EINTR) {
+            log_err ("[pcie: request processor poll: %s]\n", strerror(errno));
+            break;
+        }
+        event_notifier_test_and_clear (&ring->notifier);
+        while (dfcpcie_db_dispatch (ctrl) == DFC_DB_BATCH)
+            ;
+    }
+
+    rcu_unregister_thread();
+
     return NULL;
 }
 
@@ -42,12 +206,44 @@ static void ox_mmio_write(void *opaque, hwaddr addr, uint64_t data,
     unsigned size)
 {
     NvmeCtrl *n = core.nvm_nvme_ctrl;
+    struct pci_ctrl *ctrl = pcie_dfc.ctrl;
+    bool unlocked;
+
+    /* The BAR is dispatched without the BQL (see pcie_init_pci): doorbells
+     * are queued for the request processor and the vCPU returns at once.
+     * A full ring is drained by the processor, which never waits for us. */
+    if (addr >= 0x1000 && !qemu_mutex_iothread_locked()) {
+        while (!dfcpcie_db_push (&ctrl->db_ring, addr, data)) {
+            event_notifier_set (&ctrl->db_ring.notifier);
+            sched_yield ();
+        }
+        event_notifier_set (&ctrl->db_ring.notifier);
+        return;
+    }
 
+    /* With the BQL held (TCG, qtest), doorbells are handled in place: SQ
+     * tail doorbells locklessly, everything else takes the lock */
+    if (addr >= 0x1000 && nvme_process_sq_db_unlocked(n, addr, data)) {
+        return;
+    }
+
+    /* Register writes must not overtake the doorbells still in the ring,
+     * a CC reset would otherwise delete queues they refer to. Without the
+     * BQL only register writes get here, and the ring is waited for before
+     * taking the lock, which the request processor may need. */
+    unlocked = !qemu_mutex_iothread_locked();
+    if (unlocked) {
+        dfcpcie_db_drain (&ctrl->db_ring);
+        qemu_mutex_lock_iothread();
+    }
     if (addr < sizeof(n->nvme_regs.vBar)) {
         nvme_process_reg(n, addr, data);
     } else if (addr >= 0x1000) {
         nvme_process_db(n, addr, data);
     }
+    if (unlocked) {
+        qemu_mutex_unlock_iothread();
+    }
 }
 
 static const MemoryRegionOps ox_mmio_ops = {
@@ -60,36 +256,15 @@ static const MemoryRegionOps ox_mmio_ops = {
     },
 };
 
-static void ox_cmb_write(void *opaque, hwaddr addr, uint64_t data,
-    unsigned size)
-{
-    NvmeCtrl *n = core.nvm_nvme_ctrl;
-    memcpy(&n->cmbuf[addr], &data, size);
-}
-
-static uint64_t ox_cmb_read(void *opaque, hwaddr addr, unsigned size)
-{
-    uint64_t val;
-    NvmeCtrl *n = core.nvm_nvme_ctrl;
-
-    memcpy(&val, &n->cmbuf[addr], size);
-    return val;
-}
-
-static const MemoryRegionOps ox_cmb_ops = {
-    .read = ox_cmb_read,
-    .write = ox_cmb_write,
-    .endianness = DEVICE_LITTLE_ENDIAN,
-    .impl = {
-        .min_access_size = 2,
-        .max_access_size = 8,
-    },
-};
-
 static int pcie_init_pci (struct pci_ctrl *ctrl)
 {
     PCIDevice *pci_dev = core.qemu->pci_dev;
     uint8_t *pci_conf;
+    uint64_t cmb_sz;
+
+    dfcpcie_db_ring_init (&ctrl->db_ring);
+    if (event_notifier_init (&ctrl->db_ring.notifier, 0))
+        return -1;
 
     core.nvm_nvme_ctrl->reg_size = 1 << (32 - clz32(0x1004 +
                                 2 * (core.nvm_nvme_ctrl->num_queues + 1) * 4));
@@ -104,6 +279,9 @@ static int pcie_init_pci (struct pci_ctrl *ctrl)
 
     memory_region_init_io(&core.qemu->iomem, OBJECT(core.qemu),
             &ox_mmio_ops, core.qemu, "ox-ctrl", core.nvm_nvme_ctrl->reg_size);
+    /* Register reads are plain loads and writes lock what they need, so
+     * vCPUs ringing doorbells do not serialize on the BQL */
+    memory_region_clear_global_locking(&core.qemu->iomem);
 
     pci_register_bar(&core.qemu->parent_obj, 0, PCI_BASE_ADDRESS_SPACE_MEMORY |
                             PCI_BASE_ADDRESS_MEM_TYPE_64, &core.qemu->iomem);
@@ -113,16 +291,21 @@ static int pcie_init_pci (struct pci_ctrl *ctrl)
 
     msi_init(&core.qemu->parent_obj, 0x50, 32, true, false, NULL);
 
+    /* nvme_init runs later, the CMB size is needed for the BAR */
+    nvme_cmb_config (core.nvm_nvme_ctrl);
     if (core.nvm_nvme_ctrl->cmbsz) {
         core.nvm_nvme_ctrl->nvme_regs.vBar.cmbloc = core.nvm_nvme_ctrl->cmbloc;
         core.nvm_nvme_ctrl->nvme_regs.vBar.cmbsz  = core.nvm_nvme_ctrl->cmbsz;
 
-        core.nvm_nvme_ctrl->cmbuf = g_malloc0(NVME_CMBSZ_GETSIZE
-                                    (core.nvm_nvme_ctrl->nvme_regs.vBar.cmbsz));
+        /* The CMB is RAM in the BAR, the guest maps it and accesses it
+         * without exits, the controller uses the same host buffer */
+        cmb_sz = NVME_CMBSZ_GETSIZE(core.nvm_nvme_ctrl->nvme_regs.vBar.cmbsz);
+        core.nvm_nvme_ctrl->cmbuf = qemu_memalign(getpagesize(), cmb_sz);
+        memset (core.nvm_nvme_ctrl->cmbuf, 0x0, cmb_sz);
 
-        memory_region_init_io(&core.qemu->ctrl_mem, OBJECT(core.qemu),
-                        &ox_cmb_ops, core.qemu, "ox-cmb", NVME_CMBSZ_GETSIZE
-                        (core.nvm_nvme_ctrl->nvme_regs.vBar.cmbsz));
+        memory_region_init_ram_ptr(&core.qemu->ctrl_mem, OBJECT(core.qemu),
+                        "ox-cmb", cmb_sz, core.nvm_nvme_ctrl->cmbuf);
+        vmstate_register_ram(&core.qemu->ctrl_mem, DEVICE(core.qemu));
 
         pci_register_bar(&core.qemu->parent_obj, NVME_CMBLOC_BIR
                 (core.nvm_nvme_ctrl->nvme_regs.vBar.cmbloc),
@@ -133,29 +316,24 @@ static int pcie_init_pci (struct pci_ctrl *ctrl)
     return 0;
 }
 
-struct nvm_pcie pcie_dfc = {
-    .name           = "PCI_LS2085",
-};
-
 static void dfcpcie_isr_notify (void *opaque)
 {
     NvmeCQ *cq = opaque;
-
-    if (cq->irq_enabled) {
-        if (msix_enabled(&(core.qemu->parent_obj))) {
-
-            msix_notify(&(core.qemu->parent_obj), cq->vector);
-
-        } else if (msi_enabled(&(core.qemu->parent_obj))) {
-
-            if (!(core.nvm_nvme_ctrl->nvme_regs.vBar.intms & (1<<cq->vector))){
-                msi_notify(&(core.qemu->parent_obj), cq->vector);
-            }
-
-        } else {
-            pci_irq_pulse(&core.qemu->parent_obj);
+    struct pci_ctrl *ctrl = pcie_dfc.ctrl;
+
+    /* Doorbells dispatched together interrupt each CQ once */
+    if (ctrl->irq_batching && pthread_equal (pthread_self (),
+                                                    pcie_dfc.io_thread)) {
+        if (ctrl->irq_pending[cq->cqid])
+            return;
+        if (ctrl->irq_count < DFC_DB_BATCH) {
+            ctrl->irq_pending[cq->cqid] = 1;
+            ctrl->irq_qid[ctrl->irq_count++] = cq->cqid;
+            return;
         }
     }
+
+    dfcpcie_raise_irq (cq);
 }
 
 static void dfcpcie_reset (void)
@@ -165,8 +343,24 @@ static void dfcpcie_reset (void)
 
 static void dfcpcie_exit(void) {
     struct pci_ctrl *pcie = (struct pci_ctrl *) pcie_dfc.ctrl;
+    bool locked = qemu_mutex_iothread_locked();
+
+    /* The processor may be waiting for the BQL to dispatch a doorbell */
+    atomic_set(&pcie->db_ring.stop, 1);
+    event_notifier_set (&pcie->db_ring.notifier);
+    if (locked)
+        qemu_mutex_unlock_iothread();
+    pthread_join (pcie_dfc.io_thread, NULL);
+    if (locked)
+        qemu_mutex_lock_iothread();
+    event_notifier_cleanup (&pcie->db_ring.notifier);
+
     msix_uninit_exclusive_bar(core.qemu->pci_dev);
     memory_region_unref(&core.qemu->iomem);
+    if (core.nvm_nvme_ctrl->cmbuf) {
+        vmstate_unregister_ram(&core.qemu->ctrl_mem, DEVICE(core.qemu));
+        memory_region_unref(&core.qemu->ctrl_mem);
+    }
     free(pcie);
 }
 
@@ -63,6 +63,27 @@ typedef struct fifo_data {
 	uint64_t offset;
 } fifo_data;
 
+/* Doorbell writes queued by the vCPUs for the request processor thread */
+#define DFC_DB_RING_SZ  1024        /* power of 2 */
+#define DFC_DB_BATCH    64          /* doorbells dispatched per BQL hold */
+
+struct dfc_db_slot {
+    uint32_t    seq;
+    fifo_data   db;
+};
+
+/* Bounded lock-free ring, several vCPU producers and a single consumer. A
+ * slot is free for position 'pos' when seq == pos, and holds the doorbell
+ * of position 'pos' when seq == pos + 1. */
+struct dfc_db_ring {
+    struct dfc_db_slot  slot[DFC_DB_RING_SZ];
+    uint32_t            tail;           /* next position to enqueue */
+    uint32_t            head;           /* next position to dispatch */
+    uint32_t            done;           /* positions before are dispatched */
+    EventNotifier       notifier;
+    uint8_t             stop;
+};
+
 struct pci_ctrl {
     struct pci_device           rc;
     struct pci_device           dev;
@@ -81,6 +102,12 @@ struct pci_ctrl {
     uint32_t                    *icr[2];
     NvmeRegs                    *nvme_regs;
     DmaRegs                     dma_regs;
+    struct dfc_db_ring          db_ring;
+    /* CQs to interrupt at the end of the batch being dispatched */
+    uint8_t                     irq_batching;
+    uint16_t                    irq_count;
+    uint16_t                    irq_qid[DFC_DB_BATCH];
+    uint8_t                     irq_pending[NVME_MAX_QS + 1];
 };
 
 static inline void reset_iosqdb_bits (struct pci_ctrl *pci)
@@ -8,11 +8,126 @@
 #include "qapi/error.h"
 #include "qapi/visitor.h"
 #include "sysemu/block-backend.h"
+#include "qmp-commands.h"
+#include "qapi-event.h"
 #include "hw/block/ox-ctrl/include/ssd.h"
+#include "hw/block/ox-ctrl/include/ox-stats.h"
 
 extern struct core_struct core;
 QemuOxCtrl *qemuOxCtrl;
 
+static OxStatsSample *ox_stats_to_qapi(struct ox_stats_sample *s)
+{
+    OxStatsSample *info = g_new0(OxStatsSample, 1);
+    OxStatsMqList *mq, **mq_tail = &info->mqs;
+    OxStatsQueueList *q, **q_tail;
+    OxStatsChannelList *ch, **ch_tail = &info->channels;
+    uint32_t i, j;
+
+    info->seq = s->seq;
+    info->time_ns = s->time_ns;
+
+    for (i = 0; i < s->n_mq; i++) {
+        mq = g_new0(OxStatsMqList, 1);
+        mq->value = g_new0(OxStatsMq, 1);
+        mq->value->name = g_strdup(s->mq[i].name);
+        mq->value->timeout = s->mq[i].timeout;
+        mq->value->to_back = s->mq[i].to_back;
+        q_tail = &mq->value->queues;
+        for (j = 0; j < s->mq[i].n_queues; j++) {
+            q = g_new0(OxStatsQueueList, 1);
+            q->value = g_new0(OxStatsQueue, 1);
+            q->value->sq_used = s->mq[i].queues[j].sq_used;
+            q->value->sq_wait = s->mq[i].queues[j].sq_wait;
+            q->value->cq_used = s->mq[i].queues[j].cq_used;
+            *q_tail = q;
+            q_tail = &q->next;
+        }
+        *mq_tail = mq;
+        mq_tail = &mq->next;
+    }
+
+    if (s->has_gc) {
+        info->has_gc = true;
+        info->gc = g_new0(OxStatsGc, 1);
+        info->gc->recycled_blocks = s->gc.recycled_blks;
+        info->gc->moved_sectors = s->gc.moved_sec;
+        info->gc->padded_sectors = s->gc.pad_sec;
+        info->gc->failed_sectors = s->gc.err_sec;
+        info->gc->lost_sectors = s->gc.wro_sec;
+        info->gc->map_pages = s->gc.map_pgs;
+        info->gc->wl_moves = s->gc.wl_moves;
+        info->gc->host_sectors = s->gc.host_sec;
+        info->gc->gc_sectors = s->gc.gc_sec;
+    }
+
+    if (s->has_map) {
+        info->has_map_cache = true;
+        info->map_cache = g_new0(OxStatsMapCache, 1);
+        info->map_cache->used = s->map.used;
+        info->map_cache->hit = s->map.hit;
+        info->map_cache->miss = s->map.miss;
+        info->map_cache->evict = s->map.evict;
+        info->map_cache->hit_rate = s->map_hit_rate;
+    }
+
+    for (i = 0; i < s->n_ch; i++) {
+        ch = g_new0(OxStatsChannelList, 1);
+        ch->value = g_new0(OxStatsChannel, 1);
+        ch->value->channel = i;
+        ch->value->read_bytes = s->ch[i].rd_bytes;
+        ch->value->write_bytes = s->ch[i].wr_bytes;
+        ch->value->erases = s->ch[i].erases;
+        ch->value->read_bps = s->ch[i].rd_bps;
+        ch->value->write_bps = s->ch[i].wr_bps;
+        *ch_tail = ch;
+        ch_tail = &ch->next;
+    }
+
+    return info;
+}
+
+/* Called from the main loop after each sample */
+static void ox_stats_event(struct ox_stats_sample *s, void *opaque)
+{
+    OxStatsSample *info = ox_stats_to_qapi(s);
+
+    qapi_event_send_ox_stats(info->seq, info->time_ns, info->mqs,
+                             info->has_gc, info->gc,
+                             info->has_map_cache, info->map_cache,
+                             info->channels, &error_abort);
+    qapi_free_OxStatsSample(info);
+}
+
+static void ox_stats_append(struct ox_stats_sample *s, void *opaque)
+{
+    OxStatsSampleList ***tail = opaque;
+    OxStatsSampleList *elem = g_new0(OxStatsSampleList, 1);
+
+    elem->value = ox_stats_to_qapi(s);
+    **tail = elem;
+    *tail = &elem->next;
+}
+
+OxStatsInfo *qmp_query_ox_stats(bool has_since, int64_t since, Error **errp)
+{
+    OxStatsInfo *info;
+    OxStatsSampleList **tail;
+
+    if (!qemuOxCtrl || !DEVICE(qemuOxCtrl)->realized) {
+        error_setg(errp, "ox-ctrl: no controller found");
+        return NULL;
+    }
+
+    info = g_new0(OxStatsInfo, 1);
+    info->interval = ox_stats_interval();
+    tail = &info->samples;
+    ox_stats_foreach(has_since && since > 0 ? since : 0,
+                     ox_stats_append, &tail);
+
+    return info;
+}
+
 static int ox_init(PCIDevice *pci_dev)
 {
     int argc = 2;
@@ -36,6 +151,7 @@ static int ox_init(PCIDevice *pci_dev)
     blkconf_serial(&qemuOxCtrl->conf, &qemuOxCtrl->serial);
 
     qemuOxCtrl->pci_dev = pci_dev;
+    ox_stats_set_notify(ox_stats_event, NULL);
     nvm_init_ctrl (argc, argv, qemuOxCtrl);
 
     return 0;
@@ -52,6 +168,28 @@ static Property ox_props[] = {
     DEFINE_PROP_UINT8("debug", QemuOxCtrl, debug, 0),
     DEFINE_PROP_UINT8("lnvm", QemuOxCtrl, lnvm, 1),
     DEFINE_PROP_UINT8("volt", QemuOxCtrl, volt, 1),
+    DEFINE_PROP_STRING("ftl_cpus", QemuOxCtrl, ftl_cpus),
+    DEFINE_PROP_UINT32("ftl_poll_usec", QemuOxCtrl, ftl_poll_usec, 0),
+    DEFINE_PROP_UINT8("volt_timing", QemuOxCtrl, volt_timing, 0),
+    DEFINE_PROP_UINT32("volt_tr", QemuOxCtrl, volt_tr, 0),
+    DEFINE_PROP_UINT32("volt_tprog", QemuOxCtrl, volt_tprog, 0),
+    DEFINE_PROP_UINT32("volt_tbers", QemuOxCtrl, volt_tbers, 0),
+    DEFINE_PROP_UINT32("volt_xfer", QemuOxCtrl, volt_xfer, 0),
+    DEFINE_PROP_UINT32("volt_dma_slots", QemuOxCtrl, volt_dma_slots, 0),
+    DEFINE_PROP_UINT16("volt_ch", QemuOxCtrl, volt_ch, 0),
+    DEFINE_PROP_UINT16("volt_luns", QemuOxCtrl, volt_luns, 0),
+    DEFINE_PROP_UINT32("volt_blks", QemuOxCtrl, volt_blks, 0),
+    DEFINE_PROP_UINT32("volt_pgs", QemuOxCtrl, volt_pgs, 0),
+    DEFINE_PROP_UINT32("volt_queue", QemuOxCtrl, volt_queue, 0),
+    DEFINE_PROP_UINT8("gc_policy", QemuOxCtrl, gc_policy, 0),
+    DEFINE_PROP_UINT32("wb_pgs", QemuOxCtrl, wb_pgs, 0),
+    DEFINE_PROP_UINT16("namespaces", QemuOxCtrl, namespaces, 1),
+    DEFINE_PROP_UINT16("stripe_pgs", QemuOxCtrl, stripe_pgs, 0),
+    DEFINE_PROP_UINT8("merge", QemuOxCtrl, merge, 1),
+    DEFINE_PROP_UINT32("cmb_size_mb", QemuOxCtrl, cmb_size_mb, 0),
+    DEFINE_PROP_UINT8("oob_crc", QemuOxCtrl, oob_crc, 0),
+    DEFINE_PROP_UINT32("pcache_pages", QemuOxCtrl, pcache_pages, 64),
+    DEFINE_PROP_UINT16("fabrics_port", QemuOxCtrl, fabrics_port, 0),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -112,14 +250,213 @@ out:
     }
 }
 
+static void ox_get_map_cache_pgs(Object *obj, Visitor *v,
+                                  const char *name, void *opaque, Error **errp)
+{
+    QemuOxCtrl *qemu = OXCTRL(obj);
+
+    visit_type_uint32(v, name, &qemu->map_cache_pgs, errp);
+}
+
+/* Before realize it sets the initial size, then it resizes the cache live */
+static void ox_set_map_cache_pgs(Object *obj, Visitor *v,
+                                  const char *name, void *opaque, Error **errp)
+{
+    QemuOxCtrl *qemu = OXCTRL(obj);
+    uint32_t pgs;
+    Error *local_err = NULL;
+
+    visit_type_uint32(v, name, &pgs, &local_err);
+    if (local_err) {
+        goto out;
+    }
+    if (DEVICE(obj)->realized && nvm_ftl_map_cache_set(pgs)) {
+        error_setg(&local_err, "ox-ctrl: map cache not resized to %u pages",
+                                                                          pgs);
+        goto out;
+    }
+    qemu->map_cache_pgs = pgs;
+
+out:
+    if (local_err) {
+        error_propagate(errp, local_err);
+    }
+}
+
+/* Mapping cache counters, read-only. opaque is the counter offset */
+static void ox_get_map_cache_stat(Object *obj, Visitor *v,
+                                  const char *name, void *opaque, Error **errp)
+{
+    struct nvm_ftl_map_cache_st st;
+    uint64_t value = 0;
+
+    if (DEVICE(obj)->realized && !nvm_ftl_map_cache_get(&st)) {
+        value = *(uint64_t *)((uint8_t *)&st + (uintptr_t)opaque);
+    }
+    visit_type_uint64(v, name, &value, errp);
+}
+
+static void ox_visit_lat_st(Visitor *v, struct ox_lat_st *st, Error **errp)
+{
+    Error *err = NULL;
+
+    visit_type_uint64(v, "count", &st->count, &err);
+    visit_type_uint64(v, "min", &st->min, err ? NULL : &err);
+    visit_type_uint64(v, "max", &st->max, err ? NULL : &err);
+    visit_type_uint64(v, "mean", &st->mean, err ? NULL : &err);
+    visit_type_uint64(v, "p50", &st->p50, err ? NULL : &err);
+    visit_type_uint64(v, "p90", &st->p90, err ? NULL : &err);
+    visit_type_uint64(v, "p99", &st->p99, err ? NULL : &err);
+    visit_type_uint64(v, "p999", &st->p999, err ? NULL : &err);
+    error_propagate(errp, err);
+}
+
+static void ox_visit_lat_channels(Visitor *v, uint8_t stage, uint8_t op,
+                                                                 Error **errp)
+{
+    struct ox_lat_st st;
+    Error *err = NULL;
+    uint16_t ch, nch = ox_lat_channels();
+
+    visit_start_list(v, "channels", NULL, 0, &err);
+    if (err) {
+        goto out;
+    }
+    for (ch = 0; ch < nch && !err; ch++) {
+        if (ox_lat_get(stage, op, ch, &st) || !st.count) {
+            continue;
+        }
+        visit_start_struct(v, NULL, NULL, 0, &err);
+        if (err) {
+            break;
+        }
+        visit_type_uint16(v, "ch", &ch, &err);
+        if (!err) {
+            ox_visit_lat_st(v, &st, &err);
+        }
+        if (!err) {
+            visit_check_struct(v, &err);
+        }
+        visit_end_struct(v, NULL);
+    }
+    visit_end_list(v, NULL);
+
+out:
+    error_propagate(errp, err);
+}
+
+/*
+ * Pipeline latency histograms, read-only. One element per stage and
+ * operation with samples, in nsec, for all channels and for each channel.
+ */
+static void ox_get_latency(Object *obj, Visitor *v,
+                                  const char *name, void *opaque, Error **errp)
+{
+    struct ox_lat_st st;
+    Error *err = NULL;
+    uint8_t stage, op;
+    char *str;
+
+    visit_start_list(v, name, NULL, 0, &err);
+    if (err) {
+        goto out;
+    }
+    for (stage = 0; stage < OX_LAT_STAGES && !err; stage++) {
+        for (op = 0; op < OX_LAT_OPS && !err; op++) {
+            if (ox_lat_get(stage, op, OX_LAT_ALL_CH, &st) || !st.count) {
+                continue;
+            }
+            visit_start_struct(v, NULL, NULL, 0, &err);
+            if (err) {
+                break;
+            }
+            str = (char *)ox_lat_stage_name(stage);
+            visit_type_str(v, "stage", &str, &err);
+            str = (char *)ox_lat_op_name(op);
+            visit_type_str(v, "op", &str, err ? NULL : &err);
+            if (!err) {
+                ox_visit_lat_st(v, &st, &err);
+            }
+            if (!err) {
+                ox_visit_lat_channels(v, stage, op, &err);
+            }
+            if (!err) {
+                visit_check_struct(v, &err);
+            }
+            visit_end_struct(v, NULL);
+        }
+    }
+    visit_end_list(v, NULL);
+
+out:
+    error_propagate(errp, err);
+}
+
+static void ox_get_stats_interval(Object *obj, Visitor *v,
+                                  const char *name, void *opaque, Error **errp)
+{
+    QemuOxCtrl *qemu = OXCTRL(obj);
+
+    visit_type_uint32(v, name, &qemu->stats_interval, errp);
+}
+
+/* Telemetry sampling in msec, 0 disables it. It can be changed live */
+static void ox_set_stats_interval(Object *obj, Visitor *v,
+                                  const char *name, void *opaque, Error **errp)
+{
+    QemuOxCtrl *qemu = OXCTRL(obj);
+    uint32_t msec;
+    Error *local_err = NULL;
+
+    visit_type_uint32(v, name, &msec, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+    qemu->stats_interval = msec;
+    if (DEVICE(obj)->realized) {
+        ox_stats_set_interval(msec);
+    }
+}
+
 static void ox_instance_init(Object *obj)
 {
     qemuOxCtrl = OXCTRL(obj);
 
+    object_property_add_link(obj, "iothread", TYPE_IOTHREAD,
+                             (Object **)&qemuOxCtrl->iothread,
+                             qdev_prop_allow_set_link_before_realize,
+                             OBJ_PROP_LINK_UNREF_ON_RELEASE, NULL);
+
     object_property_add(obj, "bootindex", "int32",
                         ox_get_bootindex,
                         ox_set_bootindex, NULL, NULL, NULL);
     object_property_set_int(obj, -1, "bootindex", NULL);
+
+    object_property_add(obj, "map_cache_pgs", "uint32",
+                        ox_get_map_cache_pgs,
+                        ox_set_map_cache_pgs, NULL, NULL, NULL);
+    object_property_add(obj, "map_cache_hit", "uint64",
+                        ox_get_map_cache_stat, NULL, NULL,
+                        (void *)offsetof(struct nvm_ftl_map_cache_st, hit),
+                        NULL);
+    object_property_add(obj, "map_cache_miss", "uint64",
+                        ox_get_map_cache_stat, NULL, NULL,
+                        (void *)offsetof(struct nvm_ftl_map_cache_st, miss),
+                        NULL);
+    object_property_add(obj, "map_cache_evict", "uint64",
+                        ox_get_map_cache_stat, NULL, NULL,
+                        (void *)offsetof(struct nvm_ftl_map_cache_st, evict),
+                        NULL);
+    object_property_add(obj, "map_cache_prefetch", "uint64",
+                        ox_get_map_cache_stat, NULL, NULL,
+                        (void *)offsetof(struct nvm_ftl_map_cache_st, prefetch),
+                        NULL);
+    object_property_add(obj, "latency", "OxLatency",
+                        ox_get_latency, NULL, NULL, NULL, NULL);
+    object_property_add(obj, "stats_interval", "uint32",
+                        ox_get_stats_interval,
+                        ox_set_stats_interval, NULL, NULL, NULL);
 }
 
 static const TypeInfo ox_info = {
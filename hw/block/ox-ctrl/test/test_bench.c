@@ -0,0 +1,685 @@
+/* OX: Open-Channel NVM Express SSD Controller
+ *  - Benchmark mode, fio-style load generator
+ *
+ * Jobs are submitter threads that keep 'qd' I/Os outstanding each, without
+ * a host. FTL level I/Os are nvm_io_cmds given to nvm_submit_ftl, with the
+ * data in local buffers (RUN_TESTS DMA). MMGR level I/Os are page commands
+ * given to nvm_submit_mmgr, completed through a sync counter per slot.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include "../include/tests.h"
+#include "../include/ssd.h"
+#include "../include/ox-lat.h"
+
+extern struct core_struct core;
+
+#define BENCH_DRAIN_USEC    (5 * 1000000) /* max wait for outstanding I/Os */
+#define BENCH_SEC_SZ        NVME_KERNEL_PG_SIZE
+
+enum {
+    BENCH_WRITE = 0x0,
+    BENCH_READ  = 0x1
+};
+
+struct bench_job;
+
+struct bench_slot {
+    struct bench_job        *job;
+    uint8_t                 busy;       /* I/O outstanding */
+    volatile uint8_t        done;       /* FTL level, set by the completion */
+    uint8_t                 op;
+    uint64_t                tstart;
+    uint64_t                tend;
+    uint8_t                 *buf;
+
+    /* FTL level */
+    NvmeRequest             req;
+    struct nvm_io_cmd       *io;
+
+    /* MMGR level */
+    struct nvm_mmgr_io_cmd  mio;
+    u_atomic_t              count;
+    pthread_mutex_t         mutex;
+};
+
+struct bench_job {
+    uint16_t                id;
+    pthread_t               tid;
+    unsigned int            seed;
+    struct bench_slot       *slot;
+    uint64_t                next;       /* sequential cursor */
+    uint64_t                ios[2];
+    uint64_t                bytes[2];
+    uint64_t                errors;
+    uint64_t                erases;
+
+    /* FTL level, sectors of the job range */
+    uint64_t                start;
+    uint64_t                len;
+
+    /* MMGR level */
+    uint16_t                rd_blk;
+    uint16_t                wr_blk;
+    uint64_t                wr_next;    /* sequential (ch, lun) cursor */
+    uint32_t                *wr_pg;     /* next plane page per (ch, lun) */
+    struct nvm_io_cmd       *mmgr_io[2]; /* carry the cmdtype of the slots */
+};
+
+static struct bench_ctrl {
+    struct nvm_init_arg     *args;
+    struct bench_job        *jobs;
+    volatile uint8_t        stop;
+    uint32_t                io_sz;      /* bytes per I/O */
+    uint16_t                n_sec;      /* FTL level, sectors per I/O */
+    struct nvm_mmgr_geometry *geo;
+    struct ox_lat_hist      lat[2];
+    tests_complete_io_fn    *complete_io;
+} bench;
+
+static const char *bench_op_name[2] = { "write", "read" };
+
+static void bench_complete_io (NvmeRequest *req)
+{
+    struct bench_slot *slot = container_of (req, struct bench_slot, req);
+
+    slot->tend = ox_lat_now ();
+    __atomic_store_n (&slot->done, 1, __ATOMIC_RELEASE);
+}
+
+static inline uint8_t bench_next_op (struct bench_job *job)
+{
+    if (bench.args->bench_read == 100)
+        return BENCH_READ;
+    if (!bench.args->bench_read)
+        return BENCH_WRITE;
+
+    return ((rand_r (&job->seed) % 100) < bench.args->bench_read) ?
+                                                      BENCH_READ : BENCH_WRITE;
+}
+
+static int bench_ftl_submit (struct bench_job *job, struct bench_slot *slot)
+{
+    struct nvm_io_cmd *io = slot->io;
+    uint64_t off;
+    int i, ret;
+
+    if (bench.args->bench_rand) {
+        off = (rand_r (&job->seed) % (job->len / bench.n_sec)) * bench.n_sec;
+    } else {
+        if (job->next + bench.n_sec > job->len)
+            job->next = 0;
+        off = job->next;
+        job->next += bench.n_sec;
+    }
+
+    slot->op = bench_next_op (job);
+
+    memset (&slot->req, 0x0, sizeof (NvmeRequest));
+    slot->req.nvm_io = io;
+    slot->req.is_write = (slot->op == BENCH_WRITE);
+    slot->req.nlb = bench.n_sec;
+    slot->req.slba = job->start + off;
+    slot->req.status = NVME_SUCCESS;
+
+    io->cid = ((uint64_t) job->id << 16) | (slot - job->slot);
+    io->sec_sz = BENCH_SEC_SZ;
+    io->md_sz = 0;
+    io->cmdtype = (slot->op == BENCH_READ) ? MMGR_READ_PG : MMGR_WRITE_PG;
+    io->n_sec = bench.n_sec;
+    io->req = (void *) &slot->req;
+    io->slba = job->start + off;
+    memset (&io->status, 0x0, sizeof (struct nvm_io_status));
+    memset (&io->lat, 0x0, sizeof (struct nvm_io_lat));
+    io->status.status = NVM_IO_NEW;
+
+    for (i = 0; i < bench.n_sec; i++)
+        io->prp[i] = (uint64_t) (slot->buf + BENCH_SEC_SZ * i);
+
+    slot->done = 0;
+    slot->busy = 1;
+    slot->tstart = ox_lat_now ();
+
+    /* Other failures are completed through bench_complete_io */
+    ret = nvm_submit_ftl (io);
+    if (ret == NVME_QUEUE_FULL) {
+        slot->busy = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+static int bench_ftl_poll (struct bench_slot *slot, uint8_t *err, uint64_t *ns)
+{
+    if (!__atomic_load_n (&slot->done, __ATOMIC_ACQUIRE))
+        return 0;
+
+    *err = (slot->req.status != NVME_SUCCESS);
+    *ns = slot->tend - slot->tstart;
+
+    return 1;
+}
+
+static void bench_mmgr_prepare_cmd (struct nvm_mmgr_io_cmd *cmd,
+                    struct nvm_channel *ch, struct nvm_ppa_addr *ppa, void *buf)
+{
+    struct nvm_mmgr_geometry *g = ch->geometry;
+    int i;
+
+    memset (cmd, 0x0, sizeof (struct nvm_mmgr_io_cmd));
+    cmd->ppa = *ppa;
+    cmd->ppa.g.ch = ch->ch_mmgr_id;
+    cmd->ch = ch;
+    cmd->pg_sz = g->pg_size;
+    cmd->n_sectors = g->sec_per_pg;
+    cmd->sec_sz = g->pg_size / g->sec_per_pg;
+    cmd->md_sz = g->sec_oob_sz * g->sec_per_pg;
+
+    if (!buf)
+        return;
+
+    for (i = 0; i < cmd->n_sectors; i++)
+        cmd->prp[i] = (uint64_t) buf + cmd->sec_sz * i;
+    cmd->md_prp = (uint64_t) buf + cmd->sec_sz * cmd->n_sectors;
+}
+
+static int bench_mmgr_erase (struct nvm_channel *ch, uint16_t lun,
+                                                                  uint16_t blk)
+{
+    struct nvm_mmgr_io_cmd cmd;
+    struct nvm_ppa_addr ppa;
+    int pl;
+
+    for (pl = 0; pl < ch->geometry->n_of_planes; pl++) {
+        ppa.ppa = 0;
+        ppa.g.lun = lun;
+        ppa.g.blk = blk;
+        ppa.g.pl = pl;
+        bench_mmgr_prepare_cmd (&cmd, ch, &ppa, NULL);
+        if (nvm_submit_sync_io (ch, &cmd, NULL, MMGR_ERASE_BLK))
+            return -1;
+    }
+
+    return 0;
+}
+
+/* Erases the job blocks and writes all the pages of the read block */
+static int bench_mmgr_prepare (struct bench_job *job, uint8_t *buf)
+{
+    struct nvm_mmgr_io_cmd cmd;
+    struct nvm_channel *ch;
+    struct nvm_ppa_addr ppa;
+    uint16_t ch_i, lun;
+    uint32_t pg, pl;
+
+    for (ch_i = 0; ch_i < core.nvm_ch_count; ch_i++) {
+        ch = core.nvm_ch[ch_i];
+        for (lun = 0; lun < bench.geo->lun_per_ch; lun++) {
+            if (bench_mmgr_erase (ch, lun, job->wr_blk))
+                return -1;
+            if (!bench.args->bench_read)
+                continue;
+            if (bench_mmgr_erase (ch, lun, job->rd_blk))
+                return -1;
+
+            for (pg = 0; pg < bench.geo->pg_per_blk; pg++) {
+                for (pl = 0; pl < bench.geo->n_of_planes; pl++) {
+                    ppa.ppa = 0;
+                    ppa.g.lun = lun;
+                    ppa.g.blk = job->rd_blk;
+                    ppa.g.pg = pg;
+                    ppa.g.pl = pl;
+                    bench_mmgr_prepare_cmd (&cmd, ch, &ppa, buf);
+                    if (nvm_submit_sync_io (ch, &cmd, buf, MMGR_WRITE_PG))
+                        return -1;
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* Returns the (ch, lun) index that needs an erase, or -1 */
+static int bench_mmgr_next_ppa (struct bench_job *job, uint8_t op,
+                                                      struct nvm_ppa_addr *ppa)
+{
+    struct nvm_mmgr_geometry *g = bench.geo;
+    uint32_t pl_pgs = g->pg_per_blk * g->n_of_planes;
+    uint32_t n_lun = core.nvm_ch_count * g->lun_per_ch;
+    uint64_t i;
+
+    ppa->ppa = 0;
+
+    if (op == BENCH_READ) {
+        /* Channels first, then LUNs, planes and pages */
+        i = (bench.args->bench_rand) ? rand_r (&job->seed) : job->next++;
+        i %= (uint64_t) n_lun * pl_pgs;
+        ppa->g.ch = i % core.nvm_ch_count;
+        ppa->g.lun = (i / core.nvm_ch_count) % g->lun_per_ch;
+        ppa->g.pl = (i / n_lun) % g->n_of_planes;
+        ppa->g.pg = (i / n_lun) / g->n_of_planes;
+        ppa->g.blk = job->rd_blk;
+        return -1;
+    }
+
+    /* NAND pages are programmed in order within a block */
+    i = (bench.args->bench_rand) ? rand_r (&job->seed) : job->wr_next++;
+    i %= n_lun;
+    if (job->wr_pg[i] == pl_pgs)
+        return i;
+
+    ppa->g.ch = i % core.nvm_ch_count;
+    ppa->g.lun = i / core.nvm_ch_count;
+    ppa->g.pl = job->wr_pg[i] % g->n_of_planes;
+    ppa->g.pg = job->wr_pg[i] / g->n_of_planes;
+    ppa->g.blk = job->wr_blk;
+    job->wr_pg[i]++;
+
+    return -1;
+}
+
+static int bench_mmgr_submit (struct bench_job *job, struct bench_slot *slot,
+                                                                       int *lun)
+{
+    struct nvm_mmgr_io_cmd *cmd = &slot->mio;
+    struct nvm_ppa_addr ppa;
+
+    slot->op = bench_next_op (job);
+    *lun = bench_mmgr_next_ppa (job, slot->op, &ppa);
+    if (*lun >= 0)
+        return -1;
+
+    bench_mmgr_prepare_cmd (cmd, core.nvm_ch[ppa.g.ch], &ppa, slot->buf);
+    cmd->nvm_io = job->mmgr_io[slot->op];
+    cmd->sync_count = &slot->count;
+    cmd->sync_mutex = &slot->mutex;
+    cmd->status = NVM_IO_PROCESS;
+
+    pthread_mutex_lock (&slot->mutex);
+    u_atomic_set (&slot->count, 1);
+    pthread_mutex_unlock (&slot->mutex);
+
+    slot->busy = 1;
+    if (nvm_submit_mmgr (cmd)) {
+        cmd->status = NVM_IO_FAIL;
+        cmd->tend = cmd->tstart;
+        pthread_mutex_lock (&slot->mutex);
+        u_atomic_set (&slot->count, 0);
+        pthread_mutex_unlock (&slot->mutex);
+    }
+
+    return 0;
+}
+
+static int bench_mmgr_poll (struct bench_slot *slot, uint8_t *err,
+                                                                  uint64_t *ns)
+{
+    int count;
+
+    pthread_mutex_lock (&slot->mutex);
+    count = u_atomic_read (&slot->count);
+    pthread_mutex_unlock (&slot->mutex);
+    if (count || slot->mio.status == NVM_IO_PROCESS)
+        return 0;
+
+    *err = (slot->mio.status != NVM_IO_SUCCESS);
+    *ns = slot->mio.tend - slot->mio.tstart;
+
+    return 1;
+}
+
+/* Accounts the slot if its I/O is completed, returns 1 if so */
+static int bench_complete (struct bench_job *job, struct bench_slot *slot)
+{
+    uint64_t ns;
+    uint8_t err;
+    int ret;
+
+    ret = (bench.args->bench_level == BENCH_LEVEL_FTL) ?
+                                           bench_ftl_poll (slot, &err, &ns) :
+                                           bench_mmgr_poll (slot, &err, &ns);
+    if (!ret)
+        return 0;
+
+    if (err) {
+        job->errors++;
+    } else {
+        job->ios[slot->op]++;
+        job->bytes[slot->op] += bench.io_sz;
+        ox_lat_hist_add (&bench.lat[slot->op], ns);
+    }
+    slot->busy = 0;
+
+    return 1;
+}
+
+static int bench_drain (struct bench_job *job)
+{
+    uint64_t wait = 0;
+    int i, busy;
+
+    do {
+        busy = 0;
+        for (i = 0; i < bench.args->bench_qd; i++)
+            if (job->slot[i].busy && !bench_complete (job, &job->slot[i]))
+                busy++;
+        if (busy) {
+            if (wait >= BENCH_DRAIN_USEC)
+                return -1;
+            usleep (1);
+            wait++;
+        }
+    } while (busy);
+
+    return 0;
+}
+
+/* A full write block is erased with the job drained */
+static int bench_mmgr_reclaim (struct bench_job *job, int lun_i)
+{
+    struct nvm_channel *ch = core.nvm_ch[lun_i % core.nvm_ch_count];
+
+    if (bench_drain (job))
+        return -1;
+    if (bench_mmgr_erase (ch, lun_i / core.nvm_ch_count, job->wr_blk)) {
+        job->errors++;
+        return -1;
+    }
+    job->erases++;
+    job->wr_pg[lun_i] = 0;
+
+    return 0;
+}
+
+static void *bench_job_run (void *arg)
+{
+    struct bench_job *job = (struct bench_job *) arg;
+    struct bench_slot *slot;
+    int i, ret, lun, progress;
+
+    while (!bench.stop) {
+        progress = 0;
+        for (i = 0; i < bench.args->bench_qd && !bench.stop; i++) {
+            slot = &job->slot[i];
+            if (slot->busy) {
+                if (!bench_complete (job, slot))
+                    continue;
+                progress++;
+            }
+
+            if (bench.args->bench_level == BENCH_LEVEL_FTL) {
+                ret = bench_ftl_submit (job, slot);
+            } else {
+                ret = bench_mmgr_submit (job, slot, &lun);
+                if (ret && lun >= 0 && bench_mmgr_reclaim (job, lun)) {
+                    bench.stop = 1;
+                    break;
+                }
+            }
+            if (!ret)
+                progress++;
+        }
+        if (!progress)
+            sched_yield ();
+    }
+
+    if (bench_drain (job))
+        printf (" [bench: job %d, I/Os not completed]\n", job->id);
+
+    return NULL;
+}
+
+static int bench_check (struct nvm_init_arg *args)
+{
+    struct nvm_mmgr_geometry *g;
+    uint64_t ns_sec;
+
+    if (!core.nvm_ch_count)
+        return -1;
+    g = bench.geo = core.nvm_ch[0]->geometry;
+
+    if (args->bench_level == BENCH_LEVEL_MMGR) {
+        if (2 * args->bench_jobs >= g->blk_per_lun) {
+            printf (" Too many jobs, 2 blocks per LUN are used by each job.\n");
+            return -1;
+        }
+        bench.io_sz = g->pg_size;
+        return 0;
+    }
+
+    if (core.lnvm) {
+        printf (" FTL level needs AppNVM (LBA) mode. Use --level=mmgr.\n");
+        return -1;
+    }
+
+    bench.n_sec = args->bench_bs / BENCH_SEC_SZ;
+    if (args->bench_bs % BENCH_SEC_SZ || !bench.n_sec || bench.n_sec > 256) {
+        printf (" Block size must be a multiple of %d up to %d bytes.\n",
+                                           BENCH_SEC_SZ, BENCH_SEC_SZ * 256);
+        return -1;
+    }
+    bench.io_sz = args->bench_bs;
+
+    /* I/Os go to the first namespace */
+    ns_sec = nvm_get_ns (0)->size / BENCH_SEC_SZ;
+    if (args->bench_size / BENCH_SEC_SZ > ns_sec)
+        args->bench_size = ns_sec * BENCH_SEC_SZ;
+    if (args->bench_size / BENCH_SEC_SZ / args->bench_jobs < bench.n_sec) {
+        printf (" Size is too small for %d jobs of %d bytes.\n",
+                                        args->bench_jobs, args->bench_bs);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void bench_free (void)
+{
+    struct bench_job *job;
+    int j, i;
+
+    for (j = 0; j < bench.args->bench_jobs; j++) {
+        job = &bench.jobs[j];
+        if (job->slot) {
+            for (i = 0; i < bench.args->bench_qd; i++) {
+                free (job->slot[i].buf);
+                free (job->slot[i].io);
+                pthread_mutex_destroy (&job->slot[i].mutex);
+            }
+        }
+        free (job->slot);
+        free (job->wr_pg);
+        free (job->mmgr_io[BENCH_WRITE]);
+        free (job->mmgr_io[BENCH_READ]);
+    }
+    free (bench.jobs);
+    bench.jobs = NULL;
+}
+
+static int bench_alloc (void)
+{
+    struct nvm_init_arg *args = bench.args;
+    struct bench_job *job;
+    uint32_t buf_sz, n_lun;
+    int j, i;
+
+    bench.jobs = calloc (args->bench_jobs, sizeof (struct bench_job));
+    if (!bench.jobs)
+        return -1;
+
+    buf_sz = (args->bench_level == BENCH_LEVEL_FTL) ? bench.io_sz :
+            bench.geo->pg_size + bench.geo->sec_oob_sz * bench.geo->sec_per_pg;
+    n_lun = core.nvm_ch_count * bench.geo->lun_per_ch;
+
+    for (j = 0; j < args->bench_jobs; j++) {
+        job = &bench.jobs[j];
+        job->id = j;
+        job->seed = 0x5eed + j;
+        job->slot = calloc (args->bench_qd, sizeof (struct bench_slot));
+        if (!job->slot)
+            goto FREE;
+
+        for (i = 0; i < args->bench_qd; i++) {
+            pthread_mutex_init (&job->slot[i].mutex, NULL);
+            job->slot[i].job = job;
+            job->slot[i].buf = malloc (buf_sz);
+            if (!job->slot[i].buf)
+                goto FREE;
+            memset (job->slot[i].buf, 0xa5 ^ i, buf_sz);
+            if (args->bench_level != BENCH_LEVEL_FTL)
+                continue;
+            job->slot[i].io = calloc (1, sizeof (struct nvm_io_cmd));
+            if (!job->slot[i].io)
+                goto FREE;
+            pthread_mutex_init (&job->slot[i].io->mutex, NULL);
+        }
+
+        if (args->bench_level == BENCH_LEVEL_FTL) {
+            job->len = args->bench_size / BENCH_SEC_SZ / args->bench_jobs;
+            job->start = job->len * j;
+            continue;
+        }
+
+        job->rd_blk = bench.geo->blk_per_lun - 1 - 2 * j;
+        job->wr_blk = bench.geo->blk_per_lun - 2 - 2 * j;
+        job->wr_pg = calloc (n_lun, sizeof (uint32_t));
+        job->mmgr_io[BENCH_WRITE] = calloc (1, sizeof (struct nvm_io_cmd));
+        job->mmgr_io[BENCH_READ] = calloc (1, sizeof (struct nvm_io_cmd));
+        if (!job->wr_pg || !job->mmgr_io[BENCH_WRITE] ||
+                                                      !job->mmgr_io[BENCH_READ])
+            goto FREE;
+        job->mmgr_io[BENCH_WRITE]->cmdtype = MMGR_WRITE_PG;
+        job->mmgr_io[BENCH_READ]->cmdtype = MMGR_READ_PG;
+
+        if (bench_mmgr_prepare (job, job->slot[0].buf)) {
+            printf (" [bench: job %d, blocks not prepared]\n", j);
+            goto FREE;
+        }
+    }
+
+    return 0;
+
+FREE:
+    bench_free ();
+    return -1;
+}
+
+/* Media page writes seen by the latency histograms, including the FTL's */
+static uint64_t bench_media_writes (void)
+{
+    struct ox_lat_st st;
+
+    if (ox_lat_get (OX_LAT_MEDIA, OX_LAT_OP_WRITE, OX_LAT_ALL_CH, &st))
+        return 0;
+
+    return st.count;
+}
+
+static void bench_report (uint64_t usec, uint64_t media_pgs)
+{
+    struct ox_lat_st st;
+    uint64_t ios = 0, bytes[2] = { 0, 0 }, errors = 0, erases = 0, n;
+    double sec = (double) usec / 1000000;
+    int j, op;
+
+    printf ("\n   %-6s %10s %10s %10s %10s %10s %10s %10s\n", "", "IOPS", "MB/s",
+                          "mean", "p50", "p99", "p99.9", "max (usec)");
+
+    for (op = BENCH_READ; op >= BENCH_WRITE; op--) {
+        n = 0;
+        for (j = 0; j < bench.args->bench_jobs; j++) {
+            n += bench.jobs[j].ios[op];
+            bytes[op] += bench.jobs[j].bytes[op];
+        }
+        if (!n)
+            continue;
+        ios += n;
+
+        ox_lat_hist_summary (&bench.lat[op], &st);
+        printf ("   %-6s %10.0f %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+                bench_op_name[op], n / sec, bytes[op] / sec / 1048576,
+                st.mean / 1000.0, st.p50 / 1000.0, st.p99 / 1000.0,
+                st.p999 / 1000.0, st.max / 1000.0);
+    }
+
+    for (j = 0; j < bench.args->bench_jobs; j++) {
+        errors += bench.jobs[j].errors;
+        erases += bench.jobs[j].erases;
+    }
+
+    printf ("   %-6s %10.0f %10.1f\n", "total", ios / sec,
+                                  (bytes[0] + bytes[1]) / sec / 1048576);
+    printf ("\n   Elapsed: %.2f sec, I/Os: %lu, errors: %lu",
+                                                             sec, ios, errors);
+    if (bench.args->bench_level == BENCH_LEVEL_MMGR)
+        printf (", block erases: %lu", erases);
+    printf ("\n");
+
+    /* Data kept in the AppNVM write buffer is not counted */
+    if (bench.args->bench_level == BENCH_LEVEL_FTL && bytes[BENCH_WRITE])
+        printf ("   WAF: %.2f (media %lu MB, host %lu MB)\n",
+                (double) media_pgs * bench.geo->pg_size / bytes[BENCH_WRITE],
+                media_pgs * bench.geo->pg_size / 1048576,
+                bytes[BENCH_WRITE] / 1048576);
+}
+
+void *tests_bench (void *arg)
+{
+    struct nvm_init_arg *args = core.args_global;
+    uint64_t start, end, media_pgs;
+    int j;
+
+    memset (&bench, 0x0, sizeof (struct bench_ctrl));
+    bench.args = args;
+
+    printf ("\n OX BENCHMARK: level %s, pattern %s, read %d%%, bs %d, qd %d, "
+            "jobs %d, time %d s, size %lu MB\n",
+            (args->bench_level == BENCH_LEVEL_FTL) ? "ftl" : "mmgr",
+            (args->bench_rand) ? "rand" : "seq", args->bench_read,
+            args->bench_bs, args->bench_qd, args->bench_jobs, args->bench_time,
+            args->bench_size / 1048576);
+
+    if (bench_check (args) || bench_alloc ())
+        goto OUT;
+
+    /* FTL completions come back through the tests hook */
+    bench.complete_io = core.tests_init->complete_io;
+    core.tests_init->complete_io = bench_complete_io;
+
+    media_pgs = bench_media_writes ();
+    start = ox_lat_now ();
+
+    for (j = 0; j < args->bench_jobs; j++) {
+        if (pthread_create (&bench.jobs[j].tid, NULL, bench_job_run,
+                                                            &bench.jobs[j])) {
+            printf (" [bench: job %d not started]\n", j);
+            bench.stop = 1;
+            break;
+        }
+    }
+
+    for (end = 0; end < args->bench_time * 10 && !bench.stop; end++)
+        usleep (100000);
+    bench.stop = 1;
+
+    while (j--)
+        pthread_join (bench.jobs[j].tid, NULL);
+
+    end = ox_lat_now ();
+    media_pgs = bench_media_writes () - media_pgs;
+
+    core.tests_init->complete_io = bench.complete_io;
+
+    bench_report ((end - start) / 1000, media_pgs);
+    bench_free ();
+OUT:
+    printf ("\n");
+    return NULL;
+}
@@ -18,8 +18,7 @@ int              rand_blk[4];
 
 uint64_t tests_get_cmd_usec (struct nvm_mmgr_io_cmd *cmd)
 {
-    return (cmd->tend.tv_sec*(uint64_t)1000000+cmd->tend.tv_usec) -
-                    (cmd->tstart.tv_sec*(uint64_t)1000000+cmd->tstart.tv_usec);
+    return (cmd->tend - cmd->tstart) / 1000;
 }
 
 static struct tests_set *tests_find_set (char *name)
@@ -245,9 +244,9 @@ void *tests_admin (void *arg)
 void tests_complete_io  (NvmeRequest *req)
 {
     int i;
-    for (i = 0; i < req->nvm_io.status.total_pgs; i++) {
+    for (i = 0; i < req->nvm_io->status.total_pgs; i++) {
         pthread_mutex_lock(&usec_mutex);
-        t_usec += tests_get_cmd_usec(&req->nvm_io.mmgr_io[i]);
+        t_usec += tests_get_cmd_usec(&req->nvm_io->mmgr_io[i]);
         pthread_mutex_unlock(&usec_mutex);
 
         pthread_mutex_lock(&pgs_ok_mutex);
@@ -260,5 +259,6 @@ struct tests_init_st tests_is = {
     .init           = tests_init,
     .start          = tests_start,
     .admin          = tests_admin,
-    .complete_io    = tests_complete_io
+    .complete_io    = tests_complete_io,
+    .bench          = tests_bench
 };
\ No newline at end of file
@@ -171,6 +171,9 @@ static void tests_lnvm_free_test_req (struct tests_io_request *test_req)
     void *prp_list = (void *) cmd->prp2;
     void *ppa_list = (void *) cmd->spba;
 
+    if (req->nvm_io)
+        nvme_put_io_cmd (core.nvm_nvme_ctrl, req->nvm_io);
+
     free (prp_list);
     free (ppa_list);
     free (cmd);
@@ -38,12 +38,15 @@ void virtio_blk_init_request(VirtIOBlock *s, VirtQueue *vq,
     req->in_len = 0;
     req->next = NULL;
     req->mr_next = NULL;
+    req->dwz = NULL;
+    req->dwz_num = 0;
 }
 
 void virtio_blk_free_request(VirtIOBlockReq *req)
 {
     if (req) {
-        g_free(req);
+        g_free(req->dwz);
+        virtqueue_free_element(req);
     }
 }
 
@@ -64,7 +67,7 @@ static void virtio_blk_req_complete(VirtIOBlockReq *req, unsigned char status)
 }
 
 static int virtio_blk_handle_rw_error(VirtIOBlockReq *req, int error,
-    bool is_read)
+    bool is_read, bool acct_failed)
 {
     BlockErrorAction action = blk_get_error_action(req->dev->blk,
                                                    is_read, error);
@@ -78,7 +81,9 @@ static int virtio_blk_handle_rw_error(VirtIOBlockReq *req, int error,
         s->rq = req;
     } else if (action == BLOCK_ERROR_ACTION_REPORT) {
         virtio_blk_req_complete(req, VIRTIO_BLK_S_IOERR);
-        block_acct_failed(blk_get_stats(s->blk), &req->acct);
+        if (acct_failed) {
+            block_acct_failed(blk_get_stats(s->blk), &req->acct);
+        }
         virtio_blk_free_request(req);
     }
 
@@ -113,7 +118,7 @@ static void virtio_blk_rw_complete(void *opaque, int ret)
              * the memory until the request is completed (which will
              * happen on the other side of the migration).
              */
-            if (virtio_blk_handle_rw_error(req, -ret, is_read)) {
+            if (virtio_blk_handle_rw_error(req, -ret, is_read, true)) {
                 continue;
             }
         }
@@ -129,7 +134,7 @@ static void virtio_blk_flush_complete(void *opaque, int ret)
     VirtIOBlockReq *req = opaque;
 
     if (ret) {
-        if (virtio_blk_handle_rw_error(req, -ret, 0)) {
+        if (virtio_blk_handle_rw_error(req, -ret, false, true)) {
             return;
         }
     }
@@ -381,12 +386,195 @@ static int multireq_compare(const void *a, const void *b)
     }
 }
 
+/* A range of a discard or write zeroes batch */
+typedef struct VirtIOBlockDwzRange {
+    uint64_t sector;
+    uint32_t num_sectors;
+    uint32_t flags;
+    VirtIOBlockReq *req;
+} VirtIOBlockDwzRange;
+
+/* A discard or write zeroes operation and the requests it completes */
+typedef struct VirtIOBlockDwzOp {
+    unsigned int num_reqs;
+    VirtIOBlockReq *reqs[];
+} VirtIOBlockDwzOp;
+
+static bool virtio_blk_is_wzeroes(VirtIOBlockReq *req)
+{
+    uint32_t type = virtio_ldl_p(VIRTIO_DEVICE(req->dev), &req->out.type);
+
+    return (type & ~VIRTIO_BLK_T_BARRIER) == VIRTIO_BLK_T_WRITE_ZEROES;
+}
+
+/* Drop a reference of the operations of @req, the last one completes it */
+static void virtio_blk_dwz_put(VirtIOBlockReq *req, int ret)
+{
+    bool is_wzeroes;
+
+    if (ret && !req->dwz_ret) {
+        req->dwz_ret = ret;
+    }
+    if (--req->dwz_pending) {
+        return;
+    }
+
+    is_wzeroes = virtio_blk_is_wzeroes(req);
+    if (req->dwz_ret &&
+        virtio_blk_handle_rw_error(req, -req->dwz_ret, false, is_wzeroes)) {
+        return;
+    }
+
+    virtio_blk_req_complete(req, VIRTIO_BLK_S_OK);
+    if (is_wzeroes) {
+        block_acct_done(blk_get_stats(req->dev->blk), &req->acct);
+    }
+    virtio_blk_free_request(req);
+}
+
+static void virtio_blk_dwz_complete(void *opaque, int ret)
+{
+    VirtIOBlockDwzOp *op = opaque;
+    unsigned int i;
+
+    trace_virtio_blk_dwz_complete(op, ret);
+
+    for (i = 0; i < op->num_reqs; i++) {
+        virtio_blk_dwz_put(op->reqs[i], ret);
+    }
+    g_free(op);
+}
+
+static int dwz_range_compare(const void *a, const void *b)
+{
+    const VirtIOBlockDwzRange *r1 = a, *r2 = b;
+
+    if (r1->sector > r2->sector) {
+        return 1;
+    } else if (r1->sector < r2->sector) {
+        return -1;
+    } else {
+        return 0;
+    }
+}
+
+static void submit_dwz_op(BlockBackend *blk, VirtIOBlockDwzRange *ranges,
+                          int num, uint64_t sector, uint64_t nb_sectors,
+                          bool is_wzeroes)
+{
+    VirtIOBlockDwzOp *op;
+    unsigned int i, j;
+
+    op = g_malloc(sizeof(*op) + num * sizeof(op->reqs[0]));
+    op->num_reqs = 0;
+
+    for (i = 0; i < num; i++) {
+        for (j = 0; j < op->num_reqs; j++) {
+            if (op->reqs[j] == ranges[i].req) {
+                break;
+            }
+        }
+        if (j == op->num_reqs) {
+            op->reqs[op->num_reqs++] = ranges[i].req;
+            ranges[i].req->dwz_pending++;
+        }
+    }
+
+    trace_virtio_blk_submit_dwz(op, op->num_reqs, sector << BDRV_SECTOR_BITS,
+                                nb_sectors << BDRV_SECTOR_BITS, is_wzeroes);
+
+    if (is_wzeroes) {
+        if (op->num_reqs > 1) {
+            block_acct_merge_done(blk_get_stats(blk), BLOCK_ACCT_WRITE,
+                                  op->num_reqs - 1);
+        }
+        blk_aio_pwrite_zeroes(blk, sector << BDRV_SECTOR_BITS,
+                              nb_sectors << BDRV_SECTOR_BITS,
+                              ranges[0].flags &
+                              VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP ?
+                              BDRV_REQ_MAY_UNMAP : 0,
+                              virtio_blk_dwz_complete, op);
+    } else {
+        blk_aio_pdiscard(blk, sector << BDRV_SECTOR_BITS,
+                         nb_sectors << BDRV_SECTOR_BITS,
+                         virtio_blk_dwz_complete, op);
+    }
+}
+
+/*
+ * The ranges of all requests of the batch are sorted, and overlapping or
+ * adjacent ranges with the same flags are submitted as one operation. A
+ * request completes when all the operations covering its ranges are done.
+ */
+static void virtio_blk_submit_dwz(BlockBackend *blk, MultiReqBuffer *mrb)
+{
+    VirtIOBlock *s = mrb->reqs[0]->dev;
+    bool is_wzeroes = mrb->dwz_type == VIRTIO_BLK_T_WRITE_ZEROES;
+    uint64_t max_sectors = BDRV_REQUEST_MAX_SECTORS & ~s->sector_mask;
+    VirtIOBlockDwzRange *ranges;
+    uint64_t sector, end;
+    int i, j, start, num = 0;
+
+    for (i = 0; i < mrb->num_reqs; i++) {
+        num += mrb->reqs[i]->dwz_num;
+    }
+    ranges = g_new(VirtIOBlockDwzRange, num);
+
+    num = 0;
+    for (i = 0; i < mrb->num_reqs; i++) {
+        VirtIOBlockReq *req = mrb->reqs[i];
+
+        /* Held until all operations are submitted */
+        req->dwz_pending = 1;
+        for (j = 0; j < req->dwz_num; j++) {
+            ranges[num].sector = req->dwz[j].sector;
+            ranges[num].num_sectors = req->dwz[j].num_sectors;
+            ranges[num].flags = req->dwz[j].flags;
+            ranges[num].req = req;
+            num++;
+        }
+    }
+
+    qsort(ranges, num, sizeof(*ranges), &dwz_range_compare);
+
+    for (i = 0; i < num; ) {
+        start = i;
+        sector = ranges[i].sector;
+        end = sector + ranges[i].num_sectors;
+
+        for (i++; i < num && s->conf.request_merging; i++) {
+            uint64_t r_end = ranges[i].sector + ranges[i].num_sectors;
+
+            if (ranges[i].flags != ranges[start].flags ||
+                ranges[i].sector > end ||
+                MAX(end, r_end) - sector > max_sectors) {
+                break;
+            }
+            end = MAX(end, r_end);
+        }
+
+        submit_dwz_op(blk, &ranges[start], i - start, sector, end - sector,
+                      is_wzeroes);
+    }
+    g_free(ranges);
+
+    for (i = 0; i < mrb->num_reqs; i++) {
+        virtio_blk_dwz_put(mrb->reqs[i], 0);
+    }
+}
+
 void virtio_blk_submit_multireq(BlockBackend *blk, MultiReqBuffer *mrb)
 {
     int i = 0, start = 0, num_reqs = 0, niov = 0, nb_sectors = 0;
     uint32_t max_transfer;
     int64_t sector_num = 0;
 
+    if (mrb->dwz_type) {
+        virtio_blk_submit_dwz(blk, mrb);
+        mrb->num_reqs = 0;
+        return;
+    }
+
     if (mrb->num_reqs == 1) {
         submit_requests(blk, mrb, 0, 1, -1);
         mrb->num_reqs = 0;
@@ -468,6 +656,92 @@ static bool virtio_blk_sect_range_ok(VirtIOBlock *dev,
     return true;
 }
 
+static void virtio_blk_handle_dwz(VirtIOBlockReq *req, MultiReqBuffer *mrb,
+                                  struct iovec *iov, unsigned out_num,
+                                  uint32_t type)
+{
+    VirtIOBlock *s = req->dev;
+    bool is_wzeroes = type == VIRTIO_BLK_T_WRITE_ZEROES;
+    uint32_t max_sectors = is_wzeroes ? s->conf.max_write_zeroes_sectors :
+                                        s->conf.max_discard_sectors;
+    uint32_t valid_flags = is_wzeroes ? VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP : 0;
+    size_t size = iov_size(iov, out_num);
+    unsigned char status = VIRTIO_BLK_S_IOERR;
+    uint64_t nb_sectors = 0;
+    unsigned int i;
+
+    /* Types 10 and 12 also match the masked cases of the caller */
+    if (type != VIRTIO_BLK_T_DISCARD && type != VIRTIO_BLK_T_WRITE_ZEROES) {
+        status = VIRTIO_BLK_S_UNSUPP;
+        goto fail;
+    }
+
+    if (!virtio_vdev_has_feature(VIRTIO_DEVICE(s), is_wzeroes ?
+                                 VIRTIO_BLK_F_WRITE_ZEROES :
+                                 VIRTIO_BLK_F_DISCARD)) {
+        status = VIRTIO_BLK_S_UNSUPP;
+        goto fail;
+    }
+
+    if (!size || size % sizeof(*req->dwz) ||
+        size / sizeof(*req->dwz) > VIRTIO_BLK_MAX_DWZ_SEGS) {
+        goto fail;
+    }
+
+    /* A request stopped on error is parsed again when it is restarted */
+    g_free(req->dwz);
+    req->dwz_num = size / sizeof(*req->dwz);
+    req->dwz = g_new(struct virtio_blk_discard_write_zeroes, req->dwz_num);
+    req->dwz_ret = 0;
+    iov_to_buf(iov, out_num, 0, req->dwz, size);
+
+    for (i = 0; i < req->dwz_num; i++) {
+        struct virtio_blk_discard_write_zeroes *r = &req->dwz[i];
+
+        r->sector = le64_to_cpu(r->sector);
+        r->num_sectors = le32_to_cpu(r->num_sectors);
+        r->flags = le32_to_cpu(r->flags);
+
+        if (r->flags & ~valid_flags) {
+            status = VIRTIO_BLK_S_UNSUPP;
+            goto fail;
+        }
+        if (!r->num_sectors || r->num_sectors > max_sectors ||
+            !virtio_blk_sect_range_ok(s, r->sector,
+                            (uint64_t)r->num_sectors << BDRV_SECTOR_BITS)) {
+            goto fail;
+        }
+        nb_sectors += r->num_sectors;
+    }
+
+    trace_virtio_blk_handle_dwz(req, is_wzeroes, req->dwz_num, nb_sectors);
+
+    /* Discards are not accounted, as for the other devices */
+    if (is_wzeroes) {
+        block_acct_start(blk_get_stats(s->blk), &req->acct,
+                         nb_sectors << BDRV_SECTOR_BITS, BLOCK_ACCT_WRITE);
+    }
+
+    if (mrb->num_reqs > 0 && (mrb->num_reqs == VIRTIO_BLK_MAX_MERGE_REQS ||
+                              mrb->dwz_type != type ||
+                              !s->conf.request_merging)) {
+        virtio_blk_submit_multireq(s->blk, mrb);
+    }
+
+    assert(mrb->num_reqs < VIRTIO_BLK_MAX_MERGE_REQS);
+    mrb->reqs[mrb->num_reqs++] = req;
+    mrb->is_write = true;
+    mrb->dwz_type = type;
+    return;
+
+fail:
+    virtio_blk_req_complete(req, status);
+    if (is_wzeroes) {
+        block_acct_invalid(blk_get_stats(s->blk), BLOCK_ACCT_WRITE);
+    }
+    virtio_blk_free_request(req);
+}
+
 void virtio_blk_handle_request(VirtIOBlockReq *req, MultiReqBuffer *mrb)
 {
     uint32_t type;
@@ -540,6 +814,7 @@ void virtio_blk_handle_request(VirtIOBlockReq *req, MultiReqBuffer *mrb)
          * changes */
         if (mrb->num_reqs > 0 && (mrb->num_reqs == VIRTIO_BLK_MAX_MERGE_REQS ||
                                   is_write != mrb->is_write ||
+                                  mrb->dwz_type ||
                                   !req->dev->conf.request_merging)) {
             virtio_blk_submit_multireq(req->dev->blk, mrb);
         }
@@ -547,6 +822,7 @@ void virtio_blk_handle_request(VirtIOBlockReq *req, MultiReqBuffer *mrb)
         assert(mrb->num_reqs < VIRTIO_BLK_MAX_MERGE_REQS);
         mrb->reqs[mrb->num_reqs++] = req;
         mrb->is_write = is_write;
+        mrb->dwz_type = 0;
         break;
     }
     case VIRTIO_BLK_T_FLUSH:
@@ -555,6 +831,12 @@ void virtio_blk_handle_request(VirtIOBlockReq *req, MultiReqBuffer *mrb)
     case VIRTIO_BLK_T_SCSI_CMD:
         virtio_blk_handle_scsi(req);
         break;
+    /* Both types have the VIRTIO_BLK_T_OUT bit set */
+    case VIRTIO_BLK_T_DISCARD & ~VIRTIO_BLK_T_OUT:
+    case VIRTIO_BLK_T_WRITE_ZEROES & ~VIRTIO_BLK_T_OUT:
+        virtio_blk_handle_dwz(req, mrb, iov, out_num,
+                              type & ~VIRTIO_BLK_T_BARRIER);
+        break;
     case VIRTIO_BLK_T_GET_ID:
     {
         VirtIOBlock *s = req->dev;
@@ -716,7 +998,21 @@ static void virtio_blk_update_config(VirtIODevice *vdev, uint8_t *config)
     blkcfg.alignment_offset = 0;
     blkcfg.wce = blk_enable_write_cache(s->blk);
     virtio_stw_p(vdev, &blkcfg.num_queues, s->conf.num_queues);
-    memcpy(config, &blkcfg, sizeof(struct virtio_blk_config));
+    if (s->conf.discard) {
+        virtio_stl_p(vdev, &blkcfg.max_discard_sectors,
+                     s->conf.max_discard_sectors);
+        virtio_stl_p(vdev, &blkcfg.max_discard_seg, VIRTIO_BLK_MAX_DWZ_SEGS);
+        virtio_stl_p(vdev, &blkcfg.discard_sector_alignment,
+                     blk_size >> BDRV_SECTOR_BITS);
+    }
+    if (s->conf.write_zeroes) {
+        virtio_stl_p(vdev, &blkcfg.max_write_zeroes_sectors,
+                     s->conf.max_write_zeroes_sectors);
+        virtio_stl_p(vdev, &blkcfg.max_write_zeroes_seg,
+                     VIRTIO_BLK_MAX_DWZ_SEGS);
+        blkcfg.write_zeroes_may_unmap = 1;
+    }
+    memcpy(config, &blkcfg, s->config_size);
 }
 
 static void virtio_blk_set_config(VirtIODevice *vdev, const uint8_t *config)
@@ -724,7 +1020,8 @@ static void virtio_blk_set_config(VirtIODevice *vdev, const uint8_t *config)
     VirtIOBlock *s = VIRTIO_BLK(vdev);
     struct virtio_blk_config blkcfg;
 
-    memcpy(&blkcfg, config, sizeof(blkcfg));
+    memset(&blkcfg, 0, sizeof(blkcfg));
+    memcpy(&blkcfg, config, s->config_size);
 
     aio_context_acquire(blk_get_aio_context(s->blk));
     blk_set_enable_write_cache(s->blk, blkcfg.wce != 0);
@@ -762,6 +1059,12 @@ static uint64_t virtio_blk_get_features(VirtIODevice *vdev, uint64_t features,
     if (s->conf.num_queues > 1) {
         virtio_add_feature(&features, VIRTIO_BLK_F_MQ);
     }
+    if (s->conf.discard) {
+        virtio_add_feature(&features, VIRTIO_BLK_F_DISCARD);
+    }
+    if (s->conf.write_zeroes) {
+        virtio_add_feature(&features, VIRTIO_BLK_F_WRITE_ZEROES);
+    }
 
     return features;
 }
@@ -896,6 +1199,20 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
         error_setg(errp, "num-queues property must be larger than 0");
         return;
     }
+    if (conf->discard &&
+        (!conf->max_discard_sectors ||
+         conf->max_discard_sectors > BDRV_REQUEST_MAX_SECTORS)) {
+        error_setg(errp, "max-discard-sectors property must be between 1 "
+                   "and %d", (int)BDRV_REQUEST_MAX_SECTORS);
+        return;
+    }
+    if (conf->write_zeroes &&
+        (!conf->max_write_zeroes_sectors ||
+         conf->max_write_zeroes_sectors > BDRV_REQUEST_MAX_SECTORS)) {
+        error_setg(errp, "max-write-zeroes-sectors property must be between "
+                   "1 and %d", (int)BDRV_REQUEST_MAX_SECTORS);
+        return;
+    }
 
     blkconf_serial(&conf->conf, &conf->serial);
     blkconf_apply_backend_options(&conf->conf);
@@ -907,15 +1224,23 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
     }
     blkconf_blocksizes(&conf->conf);
 
-    virtio_init(vdev, "virtio-blk", VIRTIO_ID_BLOCK,
-                sizeof(struct virtio_blk_config));
+    /* The config space only grows when the new fields are used */
+    if (conf->discard || conf->write_zeroes) {
+        s->config_size = sizeof(struct virtio_blk_config);
+    } else {
+        s->config_size = offsetof(struct virtio_blk_config,
+                                  max_discard_sectors);
+    }
+    virtio_init(vdev, "virtio-blk", VIRTIO_ID_BLOCK, s->config_size);
 
     s->blk = conf->conf.blk;
     s->rq = NULL;
     s->sector_mask = (s->conf.conf.logical_block_size / BDRV_SECTOR_SIZE) - 1;
 
     for (i = 0; i < conf->num_queues; i++) {
-        virtio_add_queue_aio(vdev, 128, virtio_blk_handle_output);
+        VirtQueue *vq = virtio_add_queue_aio(vdev, 128,
+                                             virtio_blk_handle_output);
+        virtio_queue_set_element_pool(vq, NULL, NULL);
     }
     virtio_blk_data_plane_create(vdev, conf, &s->dataplane, &err);
     if (err != NULL) {
@@ -923,6 +1248,7 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
         virtio_cleanup(vdev);
         return;
     }
+    qemu_coroutine_increase_pool_batch_size(conf->num_queues * 128 / 2);
 
     s->change = qemu_add_vm_change_state_handler(virtio_blk_dma_restart_cb, s);
     blk_set_dev_ops(s->blk, &virtio_block_ops, s);
@@ -935,7 +1261,9 @@ static void virtio_blk_device_unrealize(DeviceState *dev, Error **errp)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
     VirtIOBlock *s = VIRTIO_BLK(dev);
+    VirtIOBlkConf *conf = &s->conf;
 
+    qemu_coroutine_decrease_pool_batch_size(conf->num_queues * 128 / 2);
     virtio_blk_data_plane_destroy(s->dataplane);
     s->dataplane = NULL;
     qemu_del_vm_change_state_handler(s->change);
@@ -970,6 +1298,12 @@ static Property virtio_blk_properties[] = {
     DEFINE_PROP_BIT("request-merging", VirtIOBlock, conf.request_merging, 0,
                     true),
     DEFINE_PROP_UINT16("num-queues", VirtIOBlock, conf.num_queues, 1),
+    DEFINE_PROP_BIT("discard", VirtIOBlock, conf.discard, 0, false),
+    DEFINE_PROP_BIT("write-zeroes", VirtIOBlock, conf.write_zeroes, 0, false),
+    DEFINE_PROP_UINT32("max-discard-sectors", VirtIOBlock,
+                       conf.max_discard_sectors, BDRV_REQUEST_MAX_SECTORS),
+    DEFINE_PROP_UINT32("max-write-zeroes-sectors", VirtIOBlock,
+                       conf.max_write_zeroes_sectors, BDRV_REQUEST_MAX_SECTORS),
     DEFINE_PROP_END_OF_LIST(),
 };
 
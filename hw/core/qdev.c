@@ -33,6 +33,7 @@
 #include "qapi/visitor.h"
 #include "qapi/qmp/qjson.h"
 #include "qemu/error-report.h"
+#include "qemu/startup-profile.h"
 #include "hw/hotplug.h"
 #include "hw/boards.h"
 #include "hw/sysbus.h"
@@ -915,7 +916,15 @@ static void device_set_realized(Object *obj, bool value, Error **errp)
         }
 
         if (dc->realize) {
+            int64_t start = startup_profile_begin();
+
             dc->realize(dev, &local_err);
+            if (start) {
+                gchar *path = object_get_canonical_path(obj);
+
+                startup_profile_end("device", path, start);
+                g_free(path);
+            }
         }
 
         if (local_err != NULL) {
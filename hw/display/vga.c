@@ -1463,10 +1463,39 @@ void vga_dirty_log_stop(VGACommonState *s)
 /*
  * graphic modes
  */
+/*
+ * Find the columns of a scanline that are covered by dirty pages, so that
+ * only those are passed to dpy_gfx_update().  A scanline of a high
+ * resolution mode spans several pages, of which a small guest update
+ * usually touches one.
+ */
+static void vga_dirty_columns(VGACommonState *s, ram_addr_t addr, int bwidth,
+                              int bits, int width, int *x0, int *x1)
+{
+    ram_addr_t end = addr + bwidth;
+    ram_addr_t first = addr & TARGET_PAGE_MASK;
+    ram_addr_t last = (end - 1) & TARGET_PAGE_MASK;
+
+    while (first < last &&
+           !memory_region_get_dirty(&s->vram, MAX(first, addr), 1,
+                                    DIRTY_MEMORY_VGA)) {
+        first += TARGET_PAGE_SIZE;
+    }
+    while (last > first &&
+           !memory_region_get_dirty(&s->vram, last, 1, DIRTY_MEMORY_VGA)) {
+        last -= TARGET_PAGE_SIZE;
+    }
+
+    *x0 = (MAX(first, addr) - addr) * 8 / bits;
+    *x1 = MIN(width, DIV_ROUND_UP((MIN(last + TARGET_PAGE_SIZE, end) - addr)
+                                  * 8, bits));
+}
+
 static void vga_draw_graphic(VGACommonState *s, int full_update)
 {
     DisplaySurface *surface = qemu_console_surface(s->con);
     int y1, y, update, linesize, y_start, double_scan, mask, depth;
+    int x0, x1, run_x0, run_x1;
     int width, height, shift_control, line_offset, bwidth, bits;
     ram_addr_t page0, page1, page_min, page_max;
     int disp_width, multi_scan, multi_run;
@@ -1636,6 +1665,7 @@ static void vga_draw_graphic(VGACommonState *s, int full_update)
     addr1 = (s->start_addr * 4);
     bwidth = (width * bits + 7) / 8;
     y_start = -1;
+    run_x0 = run_x1 = 0;
     page_min = -1;
     page_max = 0;
     d = surface_data(surface);
@@ -1652,16 +1682,29 @@ static void vga_draw_graphic(VGACommonState *s, int full_update)
         if (!(s->cr[VGA_CRTC_MODE] & 2)) {
             addr = (addr & ~0x8000) | ((y1 & 2) << 14);
         }
-        update = full_update;
         page0 = addr;
         page1 = addr + bwidth - 1;
-        update |= memory_region_get_dirty(&s->vram, page0, page1 - page0,
-                                          DIRTY_MEMORY_VGA);
+        x0 = 0;
+        x1 = disp_width;
         /* explicit invalidation for the hardware cursor */
-        update |= (s->invalidated_y_table[y >> 5] >> (y & 0x1f)) & 1;
+        update = full_update ||
+                 ((s->invalidated_y_table[y >> 5] >> (y & 0x1f)) & 1);
+        if (!update &&
+            memory_region_get_dirty(&s->vram, page0, page1 - page0,
+                                    DIRTY_MEMORY_VGA)) {
+            update = 1;
+            if (bits >= 8 && disp_width == width) {
+                vga_dirty_columns(s, addr, bwidth, bits, width, &x0, &x1);
+            }
+        }
         if (update) {
-            if (y_start < 0)
+            if (y_start < 0) {
                 y_start = y;
+                run_x0 = x0;
+                run_x1 = x1;
+            }
+            run_x0 = MIN(run_x0, x0);
+            run_x1 = MAX(run_x1, x1);
             if (page0 < page_min)
                 page_min = page0;
             if (page1 > page_max)
@@ -1674,8 +1717,8 @@ static void vga_draw_graphic(VGACommonState *s, int full_update)
         } else {
             if (y_start >= 0) {
                 /* flush to display */
-                dpy_gfx_update(s->con, 0, y_start,
-                               disp_width, y - y_start);
+                dpy_gfx_update(s->con, run_x0, y_start,
+                               run_x1 - run_x0, y - y_start);
                 y_start = -1;
             }
         }
@@ -1695,8 +1738,8 @@ static void vga_draw_graphic(VGACommonState *s, int full_update)
     }
     if (y_start >= 0) {
         /* flush to display */
-        dpy_gfx_update(s->con, 0, y_start,
-                       disp_width, y - y_start);
+        dpy_gfx_update(s->con, run_x0, y_start,
+                       run_x1 - run_x0, y - y_start);
     }
     /* reset modified pages */
     if (page_max >= page_min) {
@@ -46,6 +46,7 @@ do { \
 
 static void check_cmd(AHCIState *s, int port);
 static int handle_cmd(AHCIState *s, int port, uint8_t slot);
+static void ahci_submit_ncq(AHCIDevice *ad);
 static void ahci_reset_port(AHCIState *s, int port);
 static bool ahci_write_fis_d2h(AHCIDevice *ad);
 static void ahci_init_d2h(AHCIDevice *ad);
@@ -501,16 +502,26 @@ static void ahci_reg_init(AHCIState *s)
 
 static void check_cmd(AHCIState *s, int port)
 {
-    AHCIPortRegs *pr = &s->dev[port].port_regs;
+    AHCIDevice *ad = &s->dev[port];
+    AHCIPortRegs *pr = &ad->port_regs;
+    BlockBackend *blk = ad->port.ifs[0].blk;
     uint8_t slot;
 
     if ((pr->cmd & PORT_CMD_START) && pr->cmd_issue) {
+        /* NCQ commands issued together are submitted in one batch */
+        if (blk) {
+            blk_io_plug(blk);
+        }
         for (slot = 0; (slot < 32) && pr->cmd_issue; slot++) {
             if ((pr->cmd_issue & (1U << slot)) &&
                 !handle_cmd(s, port, slot)) {
                 pr->cmd_issue &= ~(1U << slot);
             }
         }
+        ahci_submit_ncq(ad);
+        if (blk) {
+            blk_io_unplug(blk);
+        }
     }
 }
 
@@ -581,6 +592,7 @@ static void ahci_reset_port(AHCIState *s, int port)
     pr->sig = 0xFFFFFFFF;
     d->busy_slot = -1;
     d->init_d2h_sent = false;
+    d->ncq_pending = 0;
 
     ide_state = &s->dev[port].port.ifs[0];
     if (!ide_state->blk) {
@@ -1106,7 +1118,131 @@ static void process_ncq_command(AHCIState *s, int port, uint8_t *cmd_fis,
             ncq_tfs->lba, ncq_tfs->lba + ncq_tfs->sector_count - 1,
             ide_state->nb_sectors - 1);
 
-    execute_ncq_command(ncq_tfs);
+    ad->ncq_pending |= 1U << tag;
+}
+
+/* Several NCQ commands merged into one request */
+typedef struct NCQMergedReq {
+    NCQTransferState *tfs[AHCI_MAX_CMDS];
+    int count;
+    QEMUSGList sglist;
+} NCQMergedReq;
+
+static void ncq_merged_cb(void *opaque, int ret)
+{
+    NCQMergedReq *req = opaque;
+    int i;
+
+    qemu_sglist_destroy(&req->sglist);
+    for (i = 0; i < req->count; i++) {
+        /* ahci_reset_port() must cancel the request once only */
+        req->tfs[i]->aiocb = NULL;
+        ncq_cb(req->tfs[i], ret);
+    }
+    g_free(req);
+}
+
+static void execute_ncq_merged(NCQTransferState **tfs, int count)
+{
+    AHCIDevice *ad = tfs[0]->drive;
+    IDEState *ide_state = &ad->port.ifs[0];
+    bool is_read = tfs[0]->cmd == READ_FPDMA_QUEUED;
+    NCQMergedReq *req = g_new(NCQMergedReq, 1);
+    BlockAIOCB *aiocb;
+    int i, j, nsg = 0;
+
+    for (i = 0; i < count; i++) {
+        nsg += tfs[i]->sglist.nsg;
+    }
+    qemu_sglist_init(&req->sglist, BUS(&ad->port)->parent, nsg,
+                     ad->hba->as);
+    for (i = 0; i < count; i++) {
+        NCQTransferState *ncq_tfs = tfs[i];
+
+        DPRINTF(ad->port_no, "NCQ %s %d sectors at LBA %"PRId64", tag %d, "
+                "merged\n", is_read ? "reading" : "writing",
+                ncq_tfs->sector_count, ncq_tfs->lba, ncq_tfs->tag);
+
+        ncq_tfs->halt = false;
+        dma_acct_start(ide_state->blk, &ncq_tfs->acct, &ncq_tfs->sglist,
+                       is_read ? BLOCK_ACCT_READ : BLOCK_ACCT_WRITE);
+        for (j = 0; j < ncq_tfs->sglist.nsg; j++) {
+            qemu_sglist_add(&req->sglist, ncq_tfs->sglist.sg[j].base,
+                            ncq_tfs->sglist.sg[j].len);
+        }
+        req->tfs[i] = ncq_tfs;
+    }
+    req->count = count;
+
+    if (is_read) {
+        aiocb = dma_blk_read(ide_state->blk, &req->sglist,
+                             tfs[0]->lba << BDRV_SECTOR_BITS,
+                             ncq_merged_cb, req);
+    } else {
+        aiocb = dma_blk_write(ide_state->blk, &req->sglist,
+                              tfs[0]->lba << BDRV_SECTOR_BITS,
+                              ncq_merged_cb, req);
+    }
+    for (i = 0; i < count; i++) {
+        tfs[i]->aiocb = aiocb;
+    }
+}
+
+static int ncq_tfs_cmp(const void *a, const void *b)
+{
+    const NCQTransferState *x = *(NCQTransferState * const *)a;
+    const NCQTransferState *y = *(NCQTransferState * const *)b;
+
+    if (x->cmd != y->cmd) {
+        return x->cmd - y->cmd;
+    }
+    return x->lba < y->lba ? -1 : x->lba > y->lba;
+}
+
+/* Whether @next continues @prev so that both fit in one request */
+static bool ncq_can_merge(NCQTransferState *prev, NCQTransferState *next,
+                          uint32_t sectors)
+{
+    return (next->cmd == READ_FPDMA_QUEUED ||
+            next->cmd == WRITE_FPDMA_QUEUED) &&
+           next->cmd == prev->cmd &&
+           next->lba == prev->lba + prev->sector_count &&
+           sectors + next->sector_count <= AHCI_NCQ_MERGE_MAX_SECTORS;
+}
+
+/*
+ * Submit the NCQ commands decoded by check_cmd(). Reads and writes of
+ * adjacent LBAs become a single request, as in virtio-blk; each command
+ * still completes with its own SDB FIS.
+ */
+static void ahci_submit_ncq(AHCIDevice *ad)
+{
+    NCQTransferState *batch[AHCI_MAX_CMDS];
+    uint32_t sectors;
+    int i, j, n = 0;
+
+    for (i = 0; i < AHCI_MAX_CMDS; i++) {
+        if ((ad->ncq_pending & (1U << i)) && ad->ncq_tfs[i].used) {
+            batch[n++] = &ad->ncq_tfs[i];
+        }
+    }
+    ad->ncq_pending = 0;
+
+    if (n > 1) {
+        qsort(batch, n, sizeof(batch[0]), ncq_tfs_cmp);
+    }
+    for (i = 0; i < n; i = j) {
+        sectors = batch[i]->sector_count;
+        for (j = i + 1;
+             j < n && ncq_can_merge(batch[j - 1], batch[j], sectors); j++) {
+            sectors += batch[j]->sector_count;
+        }
+        if (j - i == 1) {
+            execute_ncq_command(batch[i]);
+        } else {
+            execute_ncq_merged(&batch[i], j - i);
+        }
+    }
 }
 
 static AHCICmdHdr *get_cmd_header(AHCIState *s, uint8_t port, uint8_t slot)
@@ -214,6 +214,14 @@ e1000e_nc_receive(NetClientState *nc, const uint8_t *buf, size_t size)
     return e1000e_receive(&s->core, buf, size);
 }
 
+static ssize_t
+e1000e_nc_receive_batch(NetClientState *nc, const struct iovec *pkts,
+                        int count)
+{
+    E1000EState *s = qemu_get_nic_opaque(nc);
+    return e1000e_receive_batch(&s->core, pkts, count);
+}
+
 static void
 e1000e_set_link_status(NetClientState *nc)
 {
@@ -227,6 +235,7 @@ static NetClientInfo net_e1000e_info = {
     .can_receive = e1000e_nc_can_receive,
     .receive = e1000e_nc_receive,
     .receive_iov = e1000e_nc_receive_iov,
+    .receive_batch = e1000e_nc_receive_batch,
     .link_status_changed = e1000e_set_link_status,
 };
 
@@ -1451,6 +1451,38 @@ e1000e_rx_descr_threshold_hit(E1000ECore *core, const E1000E_RingInfo *rxi)
            e1000e_ring_len(core, rxi) >> core->rxbuf_min_shift;
 }
 
+/*
+ * RX descriptors are written back in runs of consecutive ones, with one DMA
+ * per run instead of one per descriptor.  A run is flushed when it can no
+ * longer grow and, at the latest, before the causes of the packets it
+ * completes are raised.
+ */
+static void
+e1000e_rx_wb_flush(E1000ECore *core)
+{
+    if (core->rx_wb.len) {
+        pci_dma_write(core->owner, core->rx_wb.base,
+                      core->rx_wb.buf, core->rx_wb.len);
+        core->rx_wb.len = 0;
+    }
+}
+
+static void
+e1000e_rx_wb_add(E1000ECore *core, dma_addr_t base, const uint8_t *desc)
+{
+    if (core->rx_wb.len &&
+        (core->rx_wb.base + core->rx_wb.len != base ||
+         core->rx_wb.len + core->rx_desc_len > sizeof(core->rx_wb.buf))) {
+        e1000e_rx_wb_flush(core);
+    }
+
+    if (!core->rx_wb.len) {
+        core->rx_wb.base = base;
+    }
+    memcpy(core->rx_wb.buf + core->rx_wb.len, desc, core->rx_desc_len);
+    core->rx_wb.len += core->rx_desc_len;
+}
+
 static bool
 e1000e_do_ps(E1000ECore *core, struct NetRxPkt *pkt, size_t *hdr_len)
 {
@@ -1600,7 +1632,7 @@ e1000e_write_packet_to_guest(E1000ECore *core, struct NetRxPkt *pkt,
 
         e1000e_write_rx_descr(core, desc, is_last ? core->rx_pkt : NULL,
                            rss_info, do_ps ? ps_hdr_len : 0, &bastate.written);
-        pci_dma_write(d, base, &desc, core->rx_desc_len);
+        e1000e_rx_wb_add(core, base, desc);
 
         e1000e_ring_advance(core, rxi,
                             core->rx_desc_len / E1000_MIN_RX_DESC_LEN);
@@ -1622,8 +1654,10 @@ e1000e_rx_fix_l4_csum(E1000ECore *core, struct NetRxPkt *pkt)
     }
 }
 
-ssize_t
-e1000e_receive_iov(E1000ECore *core, const struct iovec *iov, int iovcnt)
+/* Receive one packet, adding the interrupt causes it raises to *causes */
+static ssize_t
+e1000e_receive_one(E1000ECore *core, const struct iovec *iov, int iovcnt,
+                   uint32_t *causes)
 {
     static const int maximum_ethernet_hdr_len = (14 + 4);
     /* Min. octets in an ethernet frame sans FCS */
@@ -1726,16 +1760,59 @@ e1000e_receive_iov(E1000ECore *core, const struct iovec *iov, int iovcnt)
         trace_e1000e_rx_not_written_to_guest(n);
     }
 
-    if (!e1000e_intrmgr_delay_rx_causes(core, &n)) {
-        trace_e1000e_rx_interrupt_set(n);
-        e1000e_set_interrupt_cause(core, n);
+    *causes |= n;
+    return retval;
+}
+
+static void
+e1000e_receive_done(E1000ECore *core, uint32_t causes)
+{
+    e1000e_rx_wb_flush(core);
+
+    if (!e1000e_intrmgr_delay_rx_causes(core, &causes)) {
+        trace_e1000e_rx_interrupt_set(causes);
+        e1000e_set_interrupt_cause(core, causes);
     } else {
-        trace_e1000e_rx_interrupt_delayed(n);
+        trace_e1000e_rx_interrupt_delayed(causes);
     }
+}
+
+ssize_t
+e1000e_receive_iov(E1000ECore *core, const struct iovec *iov, int iovcnt)
+{
+    uint32_t causes = 0;
+    ssize_t retval;
 
+    retval = e1000e_receive_one(core, iov, iovcnt, &causes);
+    if (retval >= 0) {
+        e1000e_receive_done(core, causes);
+    }
     return retval;
 }
 
+/*
+ * Receive PKTS[0..count-1] until one cannot be, writing back descriptors in
+ * runs and raising the interrupt causes of the whole batch at once.
+ */
+ssize_t
+e1000e_receive_batch(E1000ECore *core, const struct iovec *pkts, int count)
+{
+    uint32_t causes = 0;
+    ssize_t retval = 0;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        retval = e1000e_receive_one(core, &pkts[i], 1, &causes);
+        if (retval <= 0) {
+            break;
+        }
+    }
+    if (retval >= 0) {
+        e1000e_receive_done(core, causes);
+    }
+    return i;
+}
+
 static inline bool
 e1000e_have_autoneg(E1000ECore *core)
 {
@@ -39,6 +39,7 @@
 #define E1000E_EEPROM_SIZE      (64)
 #define E1000E_MSIX_VEC_NUM     (5)
 #define E1000E_NUM_QUEUES       (2)
+#define E1000E_RX_WB_DESC_NUM   (16)
 
 typedef struct E1000Core E1000ECore;
 
@@ -76,6 +77,13 @@ struct E1000Core {
 
     struct NetRxPkt *rx_pkt;
 
+    /* Written RX descriptors not yet copied to the guest */
+    struct {
+        dma_addr_t base;
+        uint32_t len;
+        uint8_t buf[E1000E_RX_WB_DESC_NUM * E1000_MAX_RX_DESC_LEN];
+    } rx_wb;
+
     bool has_vnet;
     int max_queue_num;
 
@@ -144,3 +152,6 @@ e1000e_receive(E1000ECore *core, const uint8_t *buf, size_t size);
 
 ssize_t
 e1000e_receive_iov(E1000ECore *core, const struct iovec *iov, int iovcnt);
+
+ssize_t
+e1000e_receive_batch(E1000ECore *core, const struct iovec *pkts, int count);
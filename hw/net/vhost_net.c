@@ -51,6 +51,7 @@ static const int kernel_feature_bits[] = {
     VIRTIO_RING_F_EVENT_IDX,
     VIRTIO_NET_F_MRG_RXBUF,
     VIRTIO_F_VERSION_1,
+    VIRTIO_F_RING_PACKED,
     VHOST_INVALID_FEATURE_BIT
 };
 
@@ -62,6 +63,7 @@ static const int user_feature_bits[] = {
 
     VIRTIO_F_ANY_LAYOUT,
     VIRTIO_F_VERSION_1,
+    VIRTIO_F_RING_PACKED,
     VIRTIO_NET_F_CSUM,
     VIRTIO_NET_F_GUEST_CSUM,
     VIRTIO_NET_F_GSO,
@@ -286,6 +288,42 @@ static void vhost_net_stop_one(struct vhost_net *net,
     vhost_dev_disable_notifiers(&net->dev, dev);
 }
 
+/* Give a vhost-user backend its record of in-flight descriptors, which
+ * outlives backend restarts, creating it on the first start.
+ */
+static int vhost_net_start_inflight(VirtIODevice *dev, NetClientState *nc,
+                                    int nvqs)
+{
+    struct vhost_net *net = get_vhost_net(nc);
+    struct vhost_inflight *inflight;
+    uint16_t queue_size = virtio_queue_get_num(dev, 0);
+    int r;
+
+    if (nc->info->type != NET_CLIENT_DRIVER_VHOST_USER) {
+        return 0;
+    }
+
+    inflight = vhost_user_get_inflight(nc);
+    if (inflight->addr && (inflight->num_queues != nvqs ||
+                           inflight->queue_size != queue_size)) {
+        vhost_dev_free_inflight(inflight);
+    }
+    if (!inflight->addr) {
+        r = vhost_dev_get_inflight(&net->dev, nvqs, queue_size, inflight);
+        if (r < 0) {
+            return r;
+        }
+    }
+    return vhost_dev_set_inflight(&net->dev, inflight);
+}
+
+void vhost_net_reset_inflight(NetClientState *nc)
+{
+    if (nc && nc->info->type == NET_CLIENT_DRIVER_VHOST_USER) {
+        vhost_dev_free_inflight(vhost_user_get_inflight(nc));
+    }
+}
+
 int vhost_net_start(VirtIODevice *dev, NetClientState *ncs,
                     int total_queues)
 {
@@ -314,6 +352,12 @@ int vhost_net_start(VirtIODevice *dev, NetClientState *ncs,
         }
      }
 
+    r = vhost_net_start_inflight(dev, ncs[0].peer, total_queues * 2);
+    if (r < 0) {
+        error_report("Error setting up vhost in-flight region: %d", -r);
+        goto err;
+    }
+
     r = k->set_guest_notifiers(qbus->parent, total_queues * 2, true);
     if (r < 0) {
         error_report("Error binding guest notifier: %d", -r);
@@ -501,4 +545,8 @@ int vhost_set_vring_enable(NetClientState *nc, int enable)
 {
     return 0;
 }
+
+void vhost_net_reset_inflight(NetClientState *nc)
+{
+}
 #endif
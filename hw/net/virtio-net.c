@@ -16,6 +16,7 @@
 #include "hw/virtio/virtio.h"
 #include "net/net.h"
 #include "net/checksum.h"
+#include "net/eth.h"
 #include "net/tap.h"
 #include "qemu/error-report.h"
 #include "qemu/timer.h"
@@ -60,6 +61,46 @@ static VirtIONetQueue *virtio_net_get_subqueue(NetClientState *nc)
     return &n->vqs[nc->queue_index];
 }
 
+/* With the dataplane started the queue runs in an IOThread, which signals
+ * the guest notifier directly instead of going through the transport.
+ */
+static void virtio_net_notify(VirtIONet *n, VirtQueue *vq)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+
+    if (n->dataplane_started) {
+        if (virtio_should_notify(vdev, vq)) {
+            event_notifier_set(virtio_queue_get_guest_notifier(vq));
+        }
+    } else {
+        virtio_notify(vdev, vq);
+    }
+}
+
+static AioContext *virtio_net_queue_ctx(VirtIONet *n, int index)
+{
+    if (!n->dataplane_started) {
+        return NULL;
+    }
+    return iothread_get_aio_context(n->vqs[index].iothread);
+}
+
+/* Keep the IOThreads out while the main loop changes state they read */
+static void virtio_net_dataplane_acquire(VirtIONet *n, bool acquire)
+{
+    int i;
+
+    for (i = 0; i < n->max_queues; i++) {
+        AioContext *ctx = iothread_get_aio_context(n->vqs[i].iothread);
+
+        if (acquire) {
+            aio_context_acquire(ctx);
+        } else {
+            aio_context_release(ctx);
+        }
+    }
+}
+
 static int vq2q(int queue_index)
 {
     return queue_index / 2;
@@ -213,6 +254,145 @@ static void virtio_net_vnet_endian_status(VirtIONet *n, uint8_t status)
     }
 }
 
+static void virtio_net_handle_rx(VirtIODevice *vdev, VirtQueue *vq);
+static void virtio_net_handle_tx_bh(VirtIODevice *vdev, VirtQueue *vq);
+static void virtio_net_tx_bh(void *opaque);
+
+static void virtio_net_dataplane_move(VirtIONet *n, int index, AioContext *ctx)
+{
+    VirtIONetQueue *q = &n->vqs[index];
+    NetClientState *nc = qemu_get_subqueue(n->nic, index);
+
+    qemu_bh_delete(q->tx_bh);
+    if (ctx) {
+        q->tx_bh = aio_bh_new(ctx, virtio_net_tx_bh, q);
+    } else {
+        q->tx_bh = qemu_bh_new(virtio_net_tx_bh, q);
+    }
+    qemu_net_client_set_aio_context(nc->peer, ctx);
+}
+
+/* Context: QEMU global mutex held */
+static void virtio_net_dataplane_start(VirtIONet *n)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int queues = n->multiqueue ? n->max_queues : 1;
+    int nvqs = queues * 2;
+    int i, r;
+
+    for (i = 0; i < queues; i++) {
+        NetClientState *nc = qemu_get_subqueue(n->nic, i);
+
+        if (!qemu_net_client_has_aio_context(nc->peer)) {
+            error_report("virtio-net: netdev of queue %d cannot run in an "
+                         "IOThread, falling back to the main loop", i);
+            return;
+        }
+    }
+
+    /* The guest notifiers are signalled from the IOThreads; let the
+     * transport mask them by releasing the irqfd, as for virtio-blk.
+     */
+    n->dataplane_notifier_mask = vdev->use_guest_notifier_mask;
+    vdev->use_guest_notifier_mask = false;
+
+    r = k->set_guest_notifiers(qbus->parent, nvqs, true);
+    if (r < 0) {
+        error_report("virtio-net: failed to set guest notifiers (%d), "
+                     "falling back to the main loop", r);
+        vdev->use_guest_notifier_mask = n->dataplane_notifier_mask;
+        return;
+    }
+
+    for (i = 0; i < nvqs; i++) {
+        r = virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), i, true);
+        if (r < 0) {
+            error_report("virtio-net: failed to set host notifier (%d), "
+                         "falling back to the main loop", r);
+            while (i--) {
+                virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), i, false);
+            }
+            k->set_guest_notifiers(qbus->parent, nvqs, false);
+            vdev->use_guest_notifier_mask = n->dataplane_notifier_mask;
+            return;
+        }
+    }
+
+    n->dataplane_started = true;
+
+    for (i = 0; i < queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+        AioContext *ctx = iothread_get_aio_context(q->iothread);
+
+        aio_context_acquire(ctx);
+        virtio_net_dataplane_move(n, i, ctx);
+        virtio_queue_aio_set_host_notifier_handler(q->rx_vq, ctx,
+                                                   virtio_net_handle_rx);
+        virtio_queue_aio_set_host_notifier_handler(q->tx_vq, ctx,
+                                                   virtio_net_handle_tx_bh);
+        aio_context_release(ctx);
+    }
+
+    /* Kick right away to pick up buffers already in the rings */
+    for (i = 0; i < nvqs; i++) {
+        event_notifier_set(virtio_queue_get_host_notifier(
+                               virtio_get_queue(vdev, i)));
+    }
+}
+
+/* Context: QEMU global mutex held */
+static void virtio_net_dataplane_stop(VirtIONet *n)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int queues = n->multiqueue ? n->max_queues : 1;
+    int nvqs = queues * 2;
+    int i;
+
+    for (i = 0; i < queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+        AioContext *ctx = iothread_get_aio_context(q->iothread);
+
+        aio_context_acquire(ctx);
+        virtio_queue_aio_set_host_notifier_handler(q->rx_vq, ctx, NULL);
+        virtio_queue_aio_set_host_notifier_handler(q->tx_vq, ctx, NULL);
+        /* A pending TX is rescheduled from tx_waiting by set_status */
+        virtio_net_dataplane_move(n, i, NULL);
+        aio_context_release(ctx);
+    }
+
+    n->dataplane_started = false;
+
+    for (i = 0; i < nvqs; i++) {
+        virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), i, false);
+    }
+    k->set_guest_notifiers(qbus->parent, nvqs, false);
+    vdev->use_guest_notifier_mask = n->dataplane_notifier_mask;
+}
+
+static void virtio_net_dataplane_status(VirtIONet *n, uint8_t status)
+{
+    bool start;
+
+    if (!n->vqs[0].iothread) {
+        return;
+    }
+
+    start = virtio_net_started(n, status) && !n->vhost_started;
+    if (start == n->dataplane_started) {
+        return;
+    }
+
+    if (start) {
+        virtio_net_dataplane_start(n);
+    } else {
+        virtio_net_dataplane_stop(n);
+    }
+}
+
 static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
@@ -222,9 +402,11 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
 
     virtio_net_vnet_endian_status(n, status);
     virtio_net_vhost_status(n, status);
+    virtio_net_dataplane_status(n, status);
 
     for (i = 0; i < n->max_queues; i++) {
         NetClientState *ncs = qemu_get_subqueue(n->nic, i);
+        AioContext *ctx = virtio_net_queue_ctx(n, i);
         bool queue_started;
         q = &n->vqs[i];
 
@@ -236,12 +418,16 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
         queue_started =
             virtio_net_started(n, queue_status) && !n->vhost_started;
 
+        if (ctx) {
+            aio_context_acquire(ctx);
+        }
+
         if (queue_started) {
             qemu_flush_queued_packets(ncs);
         }
 
         if (!q->tx_waiting) {
-            continue;
+            goto next;
         }
 
         if (queue_started) {
@@ -258,6 +444,10 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
                 qemu_bh_cancel(q->tx_bh);
             }
         }
+next:
+        if (ctx) {
+            aio_context_release(ctx);
+        }
     }
 }
 
@@ -380,9 +570,22 @@ static RxFilterInfo *virtio_net_query_rxfilter(NetClientState *nc)
     return info;
 }
 
+/* The ring is about to go away; completions then only free the element */
+static void virtio_net_tx_zerocopy_detach(VirtIONetQueue *q)
+{
+    VirtIONetTxZc *zc, *next;
+
+    QTAILQ_FOREACH_SAFE(zc, &q->tx_zc, next, next) {
+        QTAILQ_REMOVE(&q->tx_zc, zc, next);
+        virtqueue_detach_element(q->tx_vq, &zc->elem, 0);
+        zc->q = NULL;
+    }
+}
+
 static void virtio_net_reset(VirtIODevice *vdev)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
+    int i;
 
     /* Reset back to compatibility mode */
     n->promisc = 1;
@@ -406,6 +609,13 @@ static void virtio_net_reset(VirtIODevice *vdev)
     memcpy(&n->mac[0], &n->nic->conf->macaddr, sizeof(n->mac));
     qemu_format_nic_info_str(qemu_get_queue(n->nic), n->mac);
     memset(n->vlans, 0, MAX_VLAN >> 3);
+
+    for (i = 0; i < n->max_queues; i++) {
+        virtio_net_tx_zerocopy_detach(&n->vqs[i]);
+    }
+
+    /* A reset guest no longer has descriptors in flight */
+    vhost_net_reset_inflight(qemu_get_queue(n->nic)->peer);
 }
 
 static void peer_test_vnet_hdr(VirtIONet *n)
@@ -533,8 +743,11 @@ static uint64_t virtio_net_get_features(VirtIODevice *vdev, uint64_t features,
         virtio_clear_feature(&features, VIRTIO_NET_F_HOST_TSO6);
         virtio_clear_feature(&features, VIRTIO_NET_F_HOST_ECN);
 
-        virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_CSUM);
-        virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_TSO4);
+        /* Receive coalescing builds TSO4 frames itself */
+        if (!n->net_conf.rx_coalesce) {
+            virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_CSUM);
+            virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_TSO4);
+        }
         virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_TSO6);
         virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_ECN);
     }
@@ -611,6 +824,9 @@ static void virtio_net_set_features(VirtIODevice *vdev, uint64_t features)
         n->curr_guest_offloads =
             virtio_net_guest_offloads_by_features(features);
         virtio_net_apply_guest_offloads(n);
+    } else if (n->net_conf.rx_coalesce) {
+        n->curr_guest_offloads =
+            virtio_net_guest_offloads_by_features(features);
     }
 
     for (i = 0;  i < n->max_queues; i++) {
@@ -681,7 +897,7 @@ static int virtio_net_handle_offloads(VirtIONet *n, uint8_t cmd,
     if (cmd == VIRTIO_NET_CTRL_GUEST_OFFLOADS_SET) {
         uint64_t supported_offloads;
 
-        if (!n->has_vnet_hdr) {
+        if (!n->has_vnet_hdr && !n->net_conf.rx_coalesce) {
             return VIRTIO_NET_ERR;
         }
 
@@ -691,7 +907,9 @@ static int virtio_net_handle_offloads(VirtIONet *n, uint8_t cmd,
         }
 
         n->curr_guest_offloads = offloads;
-        virtio_net_apply_guest_offloads(n);
+        if (n->has_vnet_hdr) {
+            virtio_net_apply_guest_offloads(n);
+        }
 
         return VIRTIO_NET_OK;
     } else {
@@ -884,6 +1102,11 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
     size_t s;
     struct iovec *iov, *iov2;
     unsigned int iov_cnt;
+    bool dataplane = n->dataplane_started;
+
+    if (dataplane) {
+        virtio_net_dataplane_acquire(n, true);
+    }
 
     for (;;) {
         elem = virtqueue_pop(vq, sizeof(VirtQueueElement));
@@ -924,6 +1147,10 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
         g_free(iov2);
         g_free(elem);
     }
+
+    if (dataplane) {
+        virtio_net_dataplane_acquire(n, false);
+    }
 }
 
 /* RX */
@@ -1017,9 +1244,12 @@ static void work_around_broken_dhclient(struct virtio_net_hdr *hdr,
 }
 
 static void receive_header(VirtIONet *n, const struct iovec *iov, int iov_cnt,
-                           const void *buf, size_t size)
+                           const void *buf, size_t size,
+                           const struct virtio_net_hdr *gso)
 {
-    if (n->has_vnet_hdr) {
+    if (gso) {
+        iov_from_buf(iov, iov_cnt, 0, gso, sizeof(*gso));
+    } else if (n->has_vnet_hdr) {
         /* FIXME this cast is evil */
         void *wbuf = (void *)buf;
         work_around_broken_dhclient(wbuf, wbuf + n->host_hdr_len,
@@ -1089,7 +1319,13 @@ static int receive_filter(VirtIONet *n, const uint8_t *buf, int size)
     return 0;
 }
 
-static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t size)
+/* Like virtio_net_receive, but the caller notifies the guest if FLUSHED.
+ * GSO, if not NULL, is the guest-endian header to use instead of the peer's.
+ */
+static ssize_t virtio_net_receive_one(NetClientState *nc, const uint8_t *buf,
+                                      size_t size,
+                                      const struct virtio_net_hdr *gso,
+                                      bool *flushed)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
@@ -1149,7 +1385,7 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
                                     sizeof(mhdr.num_buffers));
             }
 
-            receive_header(n, sg, elem->in_num, buf, size);
+            receive_header(n, sg, elem->in_num, buf, size, gso);
             offset = n->host_hdr_len;
             total += n->guest_hdr_len;
             guest_offset = n->guest_hdr_len;
@@ -1184,21 +1420,274 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
     }
 
     virtqueue_flush(q->rx_vq, i);
-    virtio_notify(vdev, q->rx_vq);
+    *flushed = true;
 
     return size;
 }
 
+static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t size)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    bool flushed = false;
+    ssize_t ret;
+
+    ret = virtio_net_receive_one(nc, buf, size, NULL, &flushed);
+    if (flushed) {
+        virtio_net_notify(n, q->rx_vq);
+    }
+    return ret;
+}
+
+/* Receive coalescing: when the peer has no vnet header, and so cannot give
+ * us large TCP frames, merge the in-order TCP/IPv4 segments of a flow that
+ * arrive together in a batch into one GUEST_TSO4 frame.
+ */
+static bool virtio_net_rx_coalescing(VirtIONet *n)
+{
+    return n->net_conf.rx_coalesce && !n->has_vnet_hdr &&
+        (n->curr_guest_offloads & (1ULL << VIRTIO_NET_F_GUEST_CSUM)) &&
+        (n->curr_guest_offloads & (1ULL << VIRTIO_NET_F_GUEST_TSO4));
+}
+
+typedef struct VirtIONetRxSeg {
+    const uint8_t *buf;
+    size_t hdr_len;             /* Ethernet + IP + TCP */
+    size_t payload;
+    uint8_t flags;
+} VirtIONetRxSeg;
+
+#define RX_COALESCE_IP      ETH_HLEN
+#define RX_COALESCE_TCP     (ETH_HLEN + sizeof(struct ip_header))
+#define TCP_FLAG_PSH        0x08
+
+/* Parse BUF as an option-less IPv4 TCP segment with payload, only ACK and
+ * maybe PSH set and valid checksums, as the guest would check them.
+ */
+static bool virtio_net_rx_coalesce_parse(const uint8_t *buf, size_t size,
+                                         VirtIONetRxSeg *seg)
+{
+    const uint8_t *ip = buf + RX_COALESCE_IP;
+    const uint8_t *tcp = buf + RX_COALESCE_TCP;
+    size_t ip_len, tcp_hlen;
+    uint8_t addrs[8];
+
+    if (size < RX_COALESCE_TCP + sizeof(tcp_header) ||
+        lduw_be_p(buf + 12) != ETH_P_IP ||
+        ip[0] != ((IP_HEADER_VERSION_4 << 4) | 5) ||
+        ip[offsetof(struct ip_header, ip_p)] != IP_PROTO_TCP ||
+        (lduw_be_p(ip + offsetof(struct ip_header, ip_off)) &
+         (IP_OFFMASK | IP_MF))) {
+        return false;
+    }
+
+    ip_len = lduw_be_p(ip + offsetof(struct ip_header, ip_len));
+    tcp_hlen = TCP_HEADER_DATA_OFFSET((tcp_header *)tcp);
+    if (ETH_HLEN + ip_len > size || tcp_hlen < sizeof(tcp_header) ||
+        sizeof(struct ip_header) + tcp_hlen >= ip_len) {
+        return false;
+    }
+
+    seg->buf = buf;
+    seg->hdr_len = RX_COALESCE_TCP + tcp_hlen;
+    seg->payload = ETH_HLEN + ip_len - seg->hdr_len;
+    seg->flags = tcp[offsetof(tcp_header, th_offset_flags) + 1];
+    if ((seg->flags & ~TCP_FLAG_PSH) != TCP_FLAG_ACK) {
+        return false;
+    }
+
+    memcpy(addrs, ip + offsetof(struct ip_header, ip_src), sizeof(addrs));
+    return net_raw_checksum((uint8_t *)ip, sizeof(struct ip_header)) == 0 &&
+        net_checksum_tcpudp(ip_len - sizeof(struct ip_header), IP_PROTO_TCP,
+                            addrs, (uint8_t *)tcp) == 0;
+}
+
+/* Whether NEXT continues FIRST, the last of whose segments ended at SEQ */
+static bool virtio_net_rx_coalesce_match(const VirtIONetRxSeg *first,
+                                         const VirtIONetRxSeg *next,
+                                         uint32_t seq)
+{
+    const uint8_t *a = first->buf, *b = next->buf;
+
+    return next->hdr_len == first->hdr_len &&
+        next->payload <= first->payload &&
+        ldl_be_p(b + RX_COALESCE_TCP + offsetof(tcp_header, th_seq)) == seq &&
+        /* MACs, type, TOS */
+        !memcmp(a, b, RX_COALESCE_IP + 2) &&
+        /* TTL, protocol */
+        !memcmp(a + RX_COALESCE_IP + 8, b + RX_COALESCE_IP + 8, 2) &&
+        /* addresses, ports */
+        !memcmp(a + RX_COALESCE_IP + 12, b + RX_COALESCE_IP + 12, 12) &&
+        /* ack */
+        !memcmp(a + RX_COALESCE_TCP + 8, b + RX_COALESCE_TCP + 8, 4) &&
+        /* options */
+        !memcmp(a + RX_COALESCE_TCP + sizeof(tcp_header),
+                b + RX_COALESCE_TCP + sizeof(tcp_header),
+                first->hdr_len - RX_COALESCE_TCP - sizeof(tcp_header));
+}
+
+/* Merge the segments at the start of PKTS that continue one another into
+ * q->rx_coalesce_buf, and describe the result in GSO.  Returns how many
+ * packets were merged; below two, nothing was.
+ */
+static int virtio_net_rx_coalesce(VirtIONetQueue *q, const struct iovec *pkts,
+                                  int count, size_t *size,
+                                  struct virtio_net_hdr *gso)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(q->n);
+    VirtIONetRxSeg first, seg;
+    uint8_t *buf = q->rx_coalesce_buf;
+    uint8_t *ip = buf + RX_COALESCE_IP;
+    uint8_t *tcp = buf + RX_COALESCE_TCP;
+    uint32_t seq, sum;
+    size_t len;
+    int i;
+
+    if (count < 2 ||
+        !virtio_net_rx_coalesce_parse(pkts[0].iov_base, pkts[0].iov_len,
+                                      &first) ||
+        (first.flags & TCP_FLAG_PSH)) {
+        return 1;
+    }
+
+    seq = ldl_be_p(first.buf + RX_COALESCE_TCP + offsetof(tcp_header, th_seq))
+        + first.payload;
+    len = first.hdr_len + first.payload;
+    seg = first;
+    for (i = 1; i < count; i++) {
+        if (!virtio_net_rx_coalesce_parse(pkts[i].iov_base, pkts[i].iov_len,
+                                          &seg) ||
+            !virtio_net_rx_coalesce_match(&first, &seg, seq) ||
+            len + seg.payload > VIRTIO_NET_RX_COALESCE_MAX) {
+            break;
+        }
+        if (i == 1) {
+            memcpy(buf, first.buf, len);
+        }
+        memcpy(buf + len, seg.buf + seg.hdr_len, seg.payload);
+        len += seg.payload;
+        seq += seg.payload;
+        if (seg.payload < first.payload || (seg.flags & TCP_FLAG_PSH)) {
+            i++;
+            break;
+        }
+    }
+    if (i < 2) {
+        return 1;
+    }
+
+    /* The window and PSH of the last segment are the current ones */
+    seg.buf = pkts[i - 1].iov_base;
+    memcpy(tcp + offsetof(tcp_header, th_win),
+           seg.buf + RX_COALESCE_TCP + offsetof(tcp_header, th_win), 2);
+    tcp[offsetof(tcp_header, th_offset_flags) + 1] =
+        seg.buf[RX_COALESCE_TCP + offsetof(tcp_header, th_offset_flags) + 1];
+
+    stw_be_p(ip + offsetof(struct ip_header, ip_len), len - ETH_HLEN);
+    stw_be_p(ip + offsetof(struct ip_header, ip_sum), 0);
+    stw_be_p(ip + offsetof(struct ip_header, ip_sum),
+             net_raw_checksum(ip, sizeof(struct ip_header)));
+
+    /* Leave the pseudo-header sum in place, as for a frame to be segmented */
+    sum = net_checksum_add(8, ip + offsetof(struct ip_header, ip_src)) +
+        IP_PROTO_TCP + (len - RX_COALESCE_TCP);
+    stw_be_p(tcp + offsetof(tcp_header, th_sum),
+             (uint16_t)~net_checksum_finish(sum));
+
+    *gso = (struct virtio_net_hdr) {
+        .flags = VIRTIO_NET_HDR_F_NEEDS_CSUM,
+        .gso_type = VIRTIO_NET_HDR_GSO_TCPV4,
+        .hdr_len = first.hdr_len,
+        .gso_size = first.payload,
+        .csum_start = RX_COALESCE_TCP,
+        .csum_offset = offsetof(tcp_header, th_sum),
+    };
+    virtio_net_hdr_swap(vdev, gso);
+    *size = len;
+    return i;
+}
+
+/* Fill RX buffers for as many packets as fit, with one notification */
+static ssize_t virtio_net_receive_batch(NetClientState *nc,
+                                        const struct iovec *pkts, int count)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    bool coalesce = virtio_net_rx_coalescing(n);
+    struct virtio_net_hdr gso;
+    bool flushed = false;
+    ssize_t ret;
+    size_t size;
+    int i, merged;
+
+    for (i = 0; i < count; i += merged) {
+        merged = coalesce ?
+            virtio_net_rx_coalesce(q, pkts + i, count - i, &size, &gso) : 1;
+        if (merged > 1) {
+            ret = virtio_net_receive_one(nc, q->rx_coalesce_buf, size, &gso,
+                                         &flushed);
+        } else {
+            ret = virtio_net_receive_one(nc, pkts[i].iov_base,
+                                         pkts[i].iov_len, NULL, &flushed);
+        }
+        if (ret <= 0) {
+            /* Left to the incoming queue, which knows how to wait */
+            break;
+        }
+    }
+    if (flushed) {
+        virtio_net_notify(n, q->rx_vq);
+    }
+    return i;
+}
+
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q);
 
+static void virtio_net_tx_zerocopy_done(void *opaque)
+{
+    VirtIONetTxZc *zc = opaque;
+    VirtIONetQueue *q = zc->q;
+
+    if (q) {
+        QTAILQ_REMOVE(&q->tx_zc, zc, next);
+        virtqueue_push(q->tx_vq, &zc->elem, 0);
+        virtio_net_notify(q->n, q->tx_vq);
+    }
+    g_free(zc);
+}
+
+/* Large frames are worth pinning instead of copying; the element goes
+ * back to the guest from virtio_net_tx_zerocopy_done.  The iovec must
+ * point only at guest memory for that.
+ */
+static bool virtio_net_tx_zerocopy(VirtIONetQueue *q, VirtQueueElement *elem,
+                                   const struct iovec *sg, unsigned int num)
+{
+    VirtIONet *n = q->n;
+    VirtIONetTxZc *zc = container_of(elem, VirtIONetTxZc, elem);
+
+    if (!n->net_conf.txzerocopy || n->needs_vnet_hdr_swap ||
+        iov_size(sg, num) < n->net_conf.txzerocopy) {
+        return false;
+    }
+
+    zc->q = q;
+    if (qemu_sendv_packet_zerocopy(qemu_get_subqueue(n->nic, q - n->vqs),
+                                   sg, num, virtio_net_tx_zerocopy_done,
+                                   zc) <= 0) {
+        return false;
+    }
+    QTAILQ_INSERT_TAIL(&q->tx_zc, zc, next);
+    return true;
+}
+
 static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
-    VirtIODevice *vdev = VIRTIO_DEVICE(n);
 
     virtqueue_push(q->tx_vq, q->async_tx.elem, 0);
-    virtio_notify(vdev, q->tx_vq);
+    virtio_net_notify(n, q->tx_vq);
 
     g_free(q->async_tx.elem);
     q->async_tx.elem = NULL;
@@ -1230,7 +1719,8 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
         struct iovec sg[VIRTQUEUE_MAX_SIZE], sg2[VIRTQUEUE_MAX_SIZE + 1], *out_sg;
         struct virtio_net_hdr_mrg_rxbuf mhdr;
 
-        elem = virtqueue_pop(q->tx_vq, sizeof(VirtQueueElement));
+        elem = virtqueue_pop(q->tx_vq, n->net_conf.txzerocopy ?
+                             sizeof(VirtIONetTxZc) : sizeof(VirtQueueElement));
         if (!elem) {
             break;
         }
@@ -1279,6 +1769,10 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
             out_sg = sg;
         }
 
+        if (virtio_net_tx_zerocopy(q, elem, out_sg, out_num)) {
+            goto next;
+        }
+
         ret = qemu_sendv_packet_async(qemu_get_subqueue(n->nic, queue_index),
                                       out_sg, out_num, virtio_net_tx_complete);
         if (ret == 0) {
@@ -1289,9 +1783,10 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 
 drop:
         virtqueue_push(q->tx_vq, elem, 0);
-        virtio_notify(vdev, q->tx_vq);
+        virtio_net_notify(n, q->tx_vq);
         g_free(elem);
 
+next:
         if (++num_packets >= n->tx_burst) {
             break;
         }
@@ -1427,6 +1922,10 @@ static void virtio_net_add_queue(VirtIONet *n, int index)
 
     n->vqs[index].tx_waiting = 0;
     n->vqs[index].n = n;
+    QTAILQ_INIT(&n->vqs[index].tx_zc);
+    if (n->net_conf.rx_coalesce) {
+        n->vqs[index].rx_coalesce_buf = g_malloc(VIRTIO_NET_RX_COALESCE_MAX);
+    }
 }
 
 static void virtio_net_del_queue(VirtIONet *n, int index)
@@ -1436,6 +1935,9 @@ static void virtio_net_del_queue(VirtIONet *n, int index)
     NetClientState *nc = qemu_get_subqueue(n->nic, index);
 
     qemu_purge_queued_packets(nc);
+    virtio_net_tx_zerocopy_detach(q);
+    g_free(q->rx_coalesce_buf);
+    q->rx_coalesce_buf = NULL;
 
     virtio_del_queue(vdev, index * 2);
     if (q->tx_timer) {
@@ -1662,6 +2164,7 @@ static NetClientInfo net_virtio_info = {
     .size = sizeof(NICState),
     .can_receive = virtio_net_can_receive,
     .receive = virtio_net_receive,
+    .receive_batch = virtio_net_receive_batch,
     .link_status_changed = virtio_net_set_link_status,
     .query_rx_filter = virtio_net_query_rxfilter,
 };
@@ -1710,6 +2213,65 @@ void virtio_net_set_netclient_name(VirtIONet *n, const char *name,
     n->netclient_type = g_strdup(type);
 }
 
+/* Binds queue pair i to the (i % count)th of the "iothreads" ids */
+static void virtio_net_set_iothreads(VirtIONet *n, Error **errp)
+{
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(n)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    gchar **ids;
+    int count, i;
+
+    if (n->net_conf.tx && !strcmp(n->net_conf.tx, "timer")) {
+        error_setg(errp, "virtio-net: iothreads requires tx=bh");
+        return;
+    }
+    if (!k->set_guest_notifiers || !k->ioeventfd_started) {
+        error_setg(errp, "virtio-net: iothreads is incompatible with this "
+                   "transport (it does not support notifiers)");
+        return;
+    }
+
+    ids = g_strsplit(n->net_conf.iothreads, ":", -1);
+    count = g_strv_length(ids);
+    if (count == 0) {
+        error_setg(errp, "virtio-net: iothreads is empty");
+        g_strfreev(ids);
+        return;
+    }
+
+    for (i = 0; i < count; i++) {
+        Object *obj = object_resolve_path_component(object_get_objects_root(),
+                                                    ids[i]);
+
+        if (!obj || !object_dynamic_cast(obj, TYPE_IOTHREAD)) {
+            error_setg(errp, "virtio-net: '%s' is not an iothread", ids[i]);
+            g_strfreev(ids);
+            return;
+        }
+    }
+
+    for (i = 0; i < n->max_queues; i++) {
+        Object *obj = object_resolve_path_component(object_get_objects_root(),
+                                                    ids[i % count]);
+
+        object_ref(obj);
+        n->vqs[i].iothread = IOTHREAD(obj);
+    }
+    g_strfreev(ids);
+}
+
+static void virtio_net_put_iothreads(VirtIONet *n)
+{
+    int i;
+
+    for (i = 0; i < n->max_queues; i++) {
+        if (n->vqs[i].iothread) {
+            object_unref(OBJECT(n->vqs[i].iothread));
+            n->vqs[i].iothread = NULL;
+        }
+    }
+}
+
 static void virtio_net_device_realize(DeviceState *dev, Error **errp)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
@@ -1740,6 +2302,18 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
         error_report("Defaulting to \"bh\"");
     }
 
+    if (n->net_conf.iothreads) {
+        Error *local_err = NULL;
+
+        virtio_net_set_iothreads(n, &local_err);
+        if (local_err) {
+            error_propagate(errp, local_err);
+            g_free(n->vqs);
+            virtio_cleanup(vdev);
+            return;
+        }
+    }
+
     for (i = 0; i < n->max_queues; i++) {
         virtio_net_add_queue(n, i);
     }
@@ -1811,6 +2385,8 @@ static void virtio_net_device_unrealize(DeviceState *dev, Error **errp)
         virtio_net_del_queue(n, i);
     }
 
+    virtio_net_put_iothreads(n);
+
     timer_del(n->announce_timer);
     timer_free(n->announce_timer);
     g_free(n->vqs);
@@ -1880,6 +2456,9 @@ static Property virtio_net_properties[] = {
                        TX_TIMER_INTERVAL),
     DEFINE_PROP_INT32("x-txburst", VirtIONet, net_conf.txburst, TX_BURST),
     DEFINE_PROP_STRING("tx", VirtIONet, net_conf.tx),
+    DEFINE_PROP_UINT32("x-txzerocopy", VirtIONet, net_conf.txzerocopy, 0),
+    DEFINE_PROP_STRING("iothreads", VirtIONet, net_conf.iothreads),
+    DEFINE_PROP_BOOL("x-rx-coalesce", VirtIONet, net_conf.rx_coalesce, false),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -21,6 +21,10 @@
 #include "hw/pci/pci.h"
 #include "hw/xen/xen.h"
 #include "qemu/range.h"
+#include "qemu/atomic.h"
+#include "qemu/main-loop.h"
+#include "qemu/event_notifier.h"
+#include "sysemu/kvm.h"
 
 #define MSIX_CAP_LENGTH 12
 
@@ -29,6 +33,24 @@
 #define MSIX_ENABLE_MASK (PCI_MSIX_FLAGS_ENABLE >> 8)
 #define MSIX_MASKALL_MASK (PCI_MSIX_FLAGS_MASKALL >> 8)
 
+/* With KVM, every vector of a device that does not manage its own irqfds
+ * (see msix_set_vector_notifiers) is given an MSI route and an irqfd the
+ * first time it is unmasked.  msix_notify then only has to write to the
+ * eventfd, which needs neither the BQL nor a trip through the memory API,
+ * so it can be done from any thread.
+ */
+typedef struct MSIXIrqfd {
+    EventNotifier notifier;
+    MSIMessage msg;
+    int virq;
+    bool bound;
+    bool failed;
+    /* Route matches the vector's message; read locklessly by msix_notify */
+    bool ready;
+} MSIXIrqfd;
+
+static void msix_irqfd_invalidate(PCIDevice *dev, unsigned int vector);
+
 MSIMessage msix_get_message(PCIDevice *dev, unsigned vector)
 {
     uint8_t *table_entry = dev->msix_table + vector * PCI_MSIX_ENTRY_SIZE;
@@ -50,6 +72,7 @@ void msix_set_message(PCIDevice *dev, int vector, struct MSIMessage msg)
     pci_set_quad(table_entry + PCI_MSIX_ENTRY_LOWER_ADDR, msg.address);
     pci_set_long(table_entry + PCI_MSIX_ENTRY_DATA, msg.data);
     table_entry[PCI_MSIX_ENTRY_VECTOR_CTRL] &= ~PCI_MSIX_ENTRY_CTRL_MASKBIT;
+    msix_irqfd_invalidate(dev, vector);
 }
 
 static uint8_t msix_pending_mask(int vector)
@@ -95,6 +118,97 @@ bool msix_is_masked(PCIDevice *dev, unsigned int vector)
     return msix_vector_masked(dev, vector, dev->msix_function_masked);
 }
 
+static void msix_irqfd_invalidate(PCIDevice *dev, unsigned int vector)
+{
+    if (dev->msix_irqfd) {
+        atomic_set(&dev->msix_irqfd[vector].ready, false);
+    }
+}
+
+/* Point the vector's irqfd at its current message, creating the route and
+ * the irqfd on first use.  Must be called with the BQL held. */
+static void msix_irqfd_bind(PCIDevice *dev, unsigned int vector)
+{
+    MSIXIrqfd *irqfd;
+    MSIMessage msg;
+    int virq;
+
+    if (!kvm_irqfds_enabled() || !kvm_msi_via_irqfd_enabled() ||
+        dev->msix_vector_use_notifier || !dev->msix_entry_used[vector] ||
+        msix_is_masked(dev, vector)) {
+        msix_irqfd_invalidate(dev, vector);
+        return;
+    }
+
+    if (!dev->msix_irqfd) {
+        dev->msix_irqfd = g_new0(MSIXIrqfd, dev->msix_entries_nr);
+    }
+    irqfd = &dev->msix_irqfd[vector];
+    if (irqfd->failed) {
+        return;
+    }
+
+    msg = msix_get_message(dev, vector);
+    if (!irqfd->bound) {
+        if (event_notifier_init(&irqfd->notifier, 0) < 0) {
+            irqfd->failed = true;
+            return;
+        }
+        virq = kvm_irqchip_add_msi_route(kvm_state, vector, dev);
+        if (virq < 0) {
+            goto fail;
+        }
+        if (kvm_irqchip_add_irqfd_notifier_gsi(kvm_state, &irqfd->notifier,
+                                               NULL, virq) < 0) {
+            kvm_irqchip_release_virq(kvm_state, virq);
+            goto fail;
+        }
+        irqfd->virq = virq;
+        irqfd->bound = true;
+    } else if (irqfd->msg.address != msg.address ||
+               irqfd->msg.data != msg.data) {
+        if (kvm_irqchip_update_msi_route(kvm_state, irqfd->virq,
+                                         msg, dev) < 0) {
+            atomic_set(&irqfd->ready, false);
+            return;
+        }
+        kvm_irqchip_commit_routes(kvm_state);
+    }
+
+    irqfd->msg = msg;
+    atomic_mb_set(&irqfd->ready, true);
+    return;
+
+fail:
+    /* Out of GSI routes, most likely; stay on the slow path */
+    event_notifier_cleanup(&irqfd->notifier);
+    irqfd->failed = true;
+}
+
+static void msix_irqfd_release_all(PCIDevice *dev)
+{
+    int vector;
+
+    if (!dev->msix_irqfd) {
+        return;
+    }
+
+    for (vector = 0; vector < dev->msix_entries_nr; ++vector) {
+        MSIXIrqfd *irqfd = &dev->msix_irqfd[vector];
+
+        if (!irqfd->bound) {
+            continue;
+        }
+        atomic_mb_set(&irqfd->ready, false);
+        kvm_irqchip_remove_irqfd_notifier_gsi(kvm_state, &irqfd->notifier,
+                                              irqfd->virq);
+        kvm_irqchip_release_virq(kvm_state, irqfd->virq);
+        event_notifier_cleanup(&irqfd->notifier);
+    }
+    g_free(dev->msix_irqfd);
+    dev->msix_irqfd = NULL;
+}
+
 static void msix_fire_vector_notifier(PCIDevice *dev,
                                       unsigned int vector, bool is_masked)
 {
@@ -117,6 +231,9 @@ static void msix_handle_mask_update(PCIDevice *dev, int vector, bool was_masked)
 {
     bool is_masked = msix_is_masked(dev, vector);
 
+    /* Called after every table write, so the message may have changed too */
+    msix_irqfd_bind(dev, vector);
+
     if (is_masked == was_masked) {
         return;
     }
@@ -376,6 +493,7 @@ void msix_uninit(PCIDevice *dev, MemoryRegion *table_bar, MemoryRegion *pba_bar)
     }
     pci_del_capability(dev, PCI_CAP_ID_MSIX, MSIX_CAP_LENGTH);
     dev->msix_cap = 0;
+    msix_irqfd_release_all(dev);
     msix_free_irq_entries(dev);
     dev->msix_entries_nr = 0;
     memory_region_del_subregion(pba_bar, &dev->msix_pba_mmio);
@@ -454,6 +572,21 @@ void msix_notify(PCIDevice *dev, unsigned vector)
         return;
     }
 
+    if (dev->msix_irqfd && atomic_read(&dev->msix_irqfd[vector].ready)) {
+        event_notifier_set(&dev->msix_irqfd[vector].notifier);
+        return;
+    }
+
+    /* A vector that was unmasked before it was declared used gets its
+     * irqfd here; without the BQL, fall back to the memory API. */
+    if (qemu_mutex_iothread_locked()) {
+        msix_irqfd_bind(dev, vector);
+        if (dev->msix_irqfd && dev->msix_irqfd[vector].ready) {
+            event_notifier_set(&dev->msix_irqfd[vector].notifier);
+            return;
+        }
+    }
+
     msg = msix_get_message(dev, vector);
 
     msi_send_message(dev, msg);
@@ -542,6 +675,8 @@ int msix_set_vector_notifiers(PCIDevice *dev,
 
     assert(use_notifier && release_notifier);
 
+    /* The device routes its vectors itself from now on */
+    msix_irqfd_release_all(dev);
     dev->msix_vector_use_notifier = use_notifier;
     dev->msix_vector_release_notifier = release_notifier;
     dev->msix_vector_poll_notifier = poll_notifier;
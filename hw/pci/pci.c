@@ -41,6 +41,7 @@
 #include "hw/hotplug.h"
 #include "hw/boards.h"
 #include "qemu/cutils.h"
+#include "migration/migration.h"
 
 //#define DEBUG_PCI
 #ifdef DEBUG_PCI
@@ -64,6 +65,8 @@ static Property pci_props[] = {
                     QEMU_PCI_CAP_SERR_BITNR, true),
     DEFINE_PROP_BIT("x-pcie-lnksta-dllla", PCIDevice, cap_present,
                     QEMU_PCIE_LNKSTA_DLLLA_BITNR, true),
+    DEFINE_PROP_SIZE("x-max-bounce-buffer-size", PCIDevice,
+                     max_bounce_buffer_size, DEFAULT_MAX_BOUNCE_BUFFER_SIZE),
     DEFINE_PROP_END_OF_LIST()
 };
 
@@ -90,6 +93,8 @@ static void pci_init_bus_master(PCIDevice *pci_dev)
     memory_region_set_enabled(&pci_dev->bus_master_enable_region, false);
     address_space_init(&pci_dev->bus_master_as,
                        &pci_dev->bus_master_enable_region, pci_dev->name);
+    pci_dev->bus_master_as.max_bounce_buffer_size =
+        pci_dev->max_bounce_buffer_size;
 }
 
 static void pcibus_machine_done(Notifier *notifier, void *data)
@@ -1279,6 +1284,9 @@ static void pci_update_mappings(PCIDevice *d)
         }
         r->addr = new_addr;
         if (r->addr != PCI_BAR_UNMAPPED) {
+            if (i == PCI_ROM_SLOT) {
+                pci_load_option_rom(d);
+            }
             trace_pci_update_mappings_add(d, pci_bus_num(d->bus),
                                           PCI_SLOT(d->devfn),
                                           PCI_FUNC(d->devfn),
@@ -2135,12 +2143,22 @@ static void pci_patch_ids(PCIDevice *pdev, uint8_t *ptr, int size)
 }
 
 /* Add an option rom for the device */
+/* The destination gets the ROM contents from the RAM migration stream */
+static void pci_option_rom_migration_notify(Notifier *notifier, void *data)
+{
+    PCIDevice *pdev = container_of(notifier, PCIDevice,
+                                   rom_migration_notifier);
+
+    if (migration_in_setup(data)) {
+        pci_load_option_rom(pdev);
+    }
+}
+
 static void pci_add_option_rom(PCIDevice *pdev, bool is_default_rom,
                                Error **errp)
 {
     int size;
     char *path;
-    void *ptr;
     char name[32];
     const VMStateDescription *vmsd;
 
@@ -2201,23 +2219,64 @@ static void pci_add_option_rom(PCIDevice *pdev, bool is_default_rom,
     pdev->has_rom = true;
     memory_region_init_ram(&pdev->rom, OBJECT(pdev), name, size, &error_fatal);
     vmstate_register_ram(&pdev->rom, &pdev->qdev);
-    ptr = memory_region_get_ram_ptr(&pdev->rom);
-    load_image(path, ptr);
-    g_free(path);
 
-    if (is_default_rom) {
-        /* Only the default rom images will be patched (if needed). */
-        pci_patch_ids(pdev, ptr, size);
+    /* Only the default rom images will be patched (if needed). */
+    pdev->rom_path = path;
+    pdev->rom_patch_ids = is_default_rom;
+
+    /*
+     * Most guests never map the ROM BAR of most devices, so the image is
+     * only read when the BAR is first mapped.  On incoming migration the
+     * contents come from the source, so read it now as before.
+     */
+    if (runstate_check(RUN_STATE_INMIGRATE)) {
+        pci_load_option_rom(pdev);
+    } else {
+        pdev->rom_migration_notifier.notify = pci_option_rom_migration_notify;
+        add_migration_state_change_notifier(&pdev->rom_migration_notifier);
     }
 
     pci_register_bar(pdev, PCI_ROM_SLOT, 0, &pdev->rom);
 }
 
+/*
+ * Read the option rom image into the ROM BAR, if that was deferred.  Must
+ * be called before accessing pdev->rom directly.
+ */
+void pci_load_option_rom(PCIDevice *pdev)
+{
+    uint8_t *ptr;
+
+    if (!pdev->rom_path) {
+        return;
+    }
+
+    ptr = memory_region_get_ram_ptr(&pdev->rom);
+    load_image(pdev->rom_path, ptr);
+    if (pdev->rom_patch_ids) {
+        pci_patch_ids(pdev, ptr, memory_region_size(&pdev->rom));
+    }
+
+    if (pdev->rom_migration_notifier.notify) {
+        remove_migration_state_change_notifier(&pdev->rom_migration_notifier);
+        pdev->rom_migration_notifier.notify = NULL;
+    }
+    g_free(pdev->rom_path);
+    pdev->rom_path = NULL;
+}
+
 static void pci_del_option_rom(PCIDevice *pdev)
 {
     if (!pdev->has_rom)
         return;
 
+    if (pdev->rom_migration_notifier.notify) {
+        remove_migration_state_change_notifier(&pdev->rom_migration_notifier);
+        pdev->rom_migration_notifier.notify = NULL;
+    }
+    g_free(pdev->rom_path);
+    pdev->rom_path = NULL;
+
     vmstate_unregister_ram(&pdev->rom, &pdev->qdev);
     pdev->has_rom = false;
 }
@@ -761,6 +761,7 @@ static int megasas_ctrl_get_info(MegasasState *s, MegasasCmd *cmd)
         uint8_t biosver[32];
         uint8_t *ptr;
 
+        pci_load_option_rom(pci_dev);
         ptr = memory_region_get_ram_ptr(&pci_dev->rom);
         memcpy(biosver, ptr + 0x41, 31);
         biosver[31] = 0;
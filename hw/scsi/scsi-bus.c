@@ -87,6 +87,26 @@ void scsi_device_unit_attention_reported(SCSIDevice *s)
     }
 }
 
+void scsi_device_io_plug(SCSIDevice *s)
+{
+    SCSIDeviceClass *sc = SCSI_DEVICE_GET_CLASS(s);
+    if (sc->io_plug) {
+        sc->io_plug(s);
+    } else {
+        blk_io_plug(s->conf.blk);
+    }
+}
+
+void scsi_device_io_unplug(SCSIDevice *s)
+{
+    SCSIDeviceClass *sc = SCSI_DEVICE_GET_CLASS(s);
+    if (sc->io_unplug) {
+        sc->io_unplug(s);
+    } else {
+        blk_io_unplug(s->conf.blk);
+    }
+}
+
 /* Create a scsi bus, and attach devices to it.  */
 void scsi_bus_new(SCSIBus *bus, size_t bus_size, DeviceState *host,
                   const SCSIBusInfo *info, const char *bus_name)
@@ -48,6 +48,7 @@ do { printf("scsi-disk: " fmt , ## __VA_ARGS__); } while (0)
 #define SCSI_DMA_BUF_SIZE           131072
 #define SCSI_MAX_INQUIRY_LEN        256
 #define SCSI_MAX_MODE_LEN           256
+#define SCSI_MAX_MERGE_REQS         32
 
 #define DEFAULT_DISCARD_GRANULARITY 4096
 #define DEFAULT_MAX_UNMAP_SIZE      (1 << 30)   /* 1 GB */
@@ -83,6 +84,18 @@ typedef struct SCSIDiskReq {
     unsigned char *status;
 } SCSIDiskReq;
 
+/* A read or write held back while the device is plugged */
+typedef struct SCSIDiskMergeReq {
+    BlockAIOCB common;
+    BlockBackend *blk;
+    int64_t offset;
+    QEMUIOVector *qiov;
+    bool is_write;
+    /* Set in the first request of a merged submission */
+    QEMUIOVector merged_qiov;
+    struct SCSIDiskMergeReq *next;
+} SCSIDiskMergeReq;
+
 #define SCSI_DISK_F_REMOVABLE             0
 #define SCSI_DISK_F_DPOFUA                1
 #define SCSI_DISK_F_NO_REMOVABLE_DEVOPS   2
@@ -104,6 +117,11 @@ typedef struct SCSIDiskState
     char *product;
     bool tray_open;
     bool tray_locked;
+    /* Reads and writes are queued here between plug and unplug, so that
+     * adjacent ones can be submitted as a single request.  */
+    int plugged;
+    int num_merge_reqs;
+    SCSIDiskMergeReq *merge_reqs[SCSI_MAX_MERGE_REQS];
 } SCSIDiskState;
 
 static int scsi_handle_rw_error(SCSIDiskReq *r, int error, bool acct_failed);
@@ -2806,6 +2824,174 @@ static int scsi_block_parse_cdb(SCSIDevice *d, SCSICommand *cmd,
 
 #endif
 
+static AioContext *scsi_disk_merge_get_aio_context(BlockAIOCB *acb)
+{
+    SCSIDiskMergeReq *req = container_of(acb, SCSIDiskMergeReq, common);
+
+    return blk_get_aio_context(req->blk);
+}
+
+/* Queued requests cannot be cancelled, they complete with the rest of
+ * their batch.  */
+static const AIOCBInfo scsi_disk_merge_aiocb_info = {
+    .aiocb_size         = sizeof(SCSIDiskMergeReq),
+    .get_aio_context    = scsi_disk_merge_get_aio_context,
+};
+
+static void scsi_disk_merge_complete(void *opaque, int ret)
+{
+    SCSIDiskMergeReq *req = opaque, *next;
+
+    if (req->next) {
+        qemu_iovec_destroy(&req->merged_qiov);
+    }
+    while (req) {
+        next = req->next;
+        req->common.cb(req->common.opaque, ret);
+        qemu_aio_unref(req);
+        req = next;
+    }
+}
+
+static void scsi_disk_submit_merged(SCSIDiskState *s, int start, int num_reqs,
+                                    int niov)
+{
+    SCSIDiskMergeReq **reqs = &s->merge_reqs[start];
+    SCSIDiskMergeReq *req = reqs[0];
+    BlockBackend *blk = s->qdev.conf.blk;
+    QEMUIOVector *qiov = req->qiov;
+    int i;
+
+    if (num_reqs > 1) {
+        qemu_iovec_init(&req->merged_qiov, niov);
+        for (i = 0; i < num_reqs; i++) {
+            qemu_iovec_concat(&req->merged_qiov, reqs[i]->qiov, 0,
+                              reqs[i]->qiov->size);
+            if (i > 0) {
+                reqs[i - 1]->next = reqs[i];
+            }
+        }
+        qiov = &req->merged_qiov;
+        block_acct_merge_done(blk_get_stats(blk),
+                              req->is_write ? BLOCK_ACCT_WRITE
+                                            : BLOCK_ACCT_READ,
+                              num_reqs - 1);
+        DPRINTF("Merged %d requests at %" PRId64 ", %zd bytes\n",
+                num_reqs, req->offset, qiov->size);
+    }
+
+    if (req->is_write) {
+        blk_aio_pwritev(blk, req->offset, qiov, 0,
+                        scsi_disk_merge_complete, req);
+    } else {
+        blk_aio_preadv(blk, req->offset, qiov, 0,
+                       scsi_disk_merge_complete, req);
+    }
+}
+
+static int scsi_disk_merge_compare(const void *a, const void *b)
+{
+    const SCSIDiskMergeReq *req1 = *(SCSIDiskMergeReq **)a,
+                           *req2 = *(SCSIDiskMergeReq **)b;
+
+    if (req1->offset > req2->offset) {
+        return 1;
+    } else if (req1->offset < req2->offset) {
+        return -1;
+    } else {
+        return 0;
+    }
+}
+
+/* Sort the queued requests, which all go in the same direction, and
+ * submit each run of adjacent ones as a single request.  Same rules as
+ * virtio_blk_submit_multireq().  */
+static void scsi_disk_submit_queued(SCSIDiskState *s)
+{
+    BlockBackend *blk = s->qdev.conf.blk;
+    int i, start = 0, num_reqs = 0, niov = 0;
+    uint32_t max_transfer;
+    int64_t offset = 0;
+    size_t size = 0;
+
+    if (s->num_merge_reqs == 0) {
+        return;
+    }
+
+    max_transfer = blk_get_max_transfer(blk);
+    qsort(s->merge_reqs, s->num_merge_reqs, sizeof(*s->merge_reqs),
+          &scsi_disk_merge_compare);
+
+    for (i = 0; i < s->num_merge_reqs; i++) {
+        SCSIDiskMergeReq *req = s->merge_reqs[i];
+
+        if (num_reqs > 0 &&
+            (offset + size != req->offset ||
+             niov > blk_get_max_iov(blk) - req->qiov->niov ||
+             req->qiov->size > max_transfer ||
+             size > max_transfer - req->qiov->size)) {
+            scsi_disk_submit_merged(s, start, num_reqs, niov);
+            num_reqs = 0;
+        }
+
+        if (num_reqs == 0) {
+            offset = req->offset;
+            size = niov = 0;
+            start = i;
+        }
+
+        size += req->qiov->size;
+        niov += req->qiov->niov;
+        num_reqs++;
+    }
+
+    scsi_disk_submit_merged(s, start, num_reqs, niov);
+    s->num_merge_reqs = 0;
+}
+
+static BlockAIOCB *scsi_disk_queue_rw(SCSIDiskState *s, int64_t offset,
+                                      QEMUIOVector *iov, bool is_write,
+                                      BlockCompletionFunc *cb,
+                                      void *cb_opaque)
+{
+    SCSIDiskMergeReq *req;
+
+    if (s->num_merge_reqs == SCSI_MAX_MERGE_REQS ||
+        (s->num_merge_reqs > 0 &&
+         s->merge_reqs[0]->is_write != is_write)) {
+        scsi_disk_submit_queued(s);
+    }
+
+    req = blk_aio_get(&scsi_disk_merge_aiocb_info, s->qdev.conf.blk,
+                      cb, cb_opaque);
+    req->blk = s->qdev.conf.blk;
+    req->offset = offset;
+    req->qiov = iov;
+    req->is_write = is_write;
+    req->next = NULL;
+    s->merge_reqs[s->num_merge_reqs++] = req;
+    return &req->common;
+}
+
+static void scsi_disk_io_plug(SCSIDevice *dev)
+{
+    SCSIDiskState *s = DO_UPCAST(SCSIDiskState, qdev, dev);
+
+    s->plugged++;
+    blk_io_plug(s->qdev.conf.blk);
+}
+
+static void scsi_disk_io_unplug(SCSIDevice *dev)
+{
+    SCSIDiskState *s = DO_UPCAST(SCSIDiskState, qdev, dev);
+
+    assert(s->plugged > 0);
+    if (--s->plugged == 0) {
+        scsi_disk_submit_queued(s);
+    }
+    blk_io_unplug(s->qdev.conf.blk);
+}
+
 static
 BlockAIOCB *scsi_dma_readv(int64_t offset, QEMUIOVector *iov,
                            BlockCompletionFunc *cb, void *cb_opaque,
@@ -2813,6 +2999,10 @@ BlockAIOCB *scsi_dma_readv(int64_t offset, QEMUIOVector *iov,
 {
     SCSIDiskReq *r = opaque;
     SCSIDiskState *s = DO_UPCAST(SCSIDiskState, qdev, r->req.dev);
+
+    if (s->plugged) {
+        return scsi_disk_queue_rw(s, offset, iov, false, cb, cb_opaque);
+    }
     return blk_aio_preadv(s->qdev.conf.blk, offset, iov, 0, cb, cb_opaque);
 }
 
@@ -2823,16 +3013,23 @@ BlockAIOCB *scsi_dma_writev(int64_t offset, QEMUIOVector *iov,
 {
     SCSIDiskReq *r = opaque;
     SCSIDiskState *s = DO_UPCAST(SCSIDiskState, qdev, r->req.dev);
+
+    if (s->plugged) {
+        return scsi_disk_queue_rw(s, offset, iov, true, cb, cb_opaque);
+    }
     return blk_aio_pwritev(s->qdev.conf.blk, offset, iov, 0, cb, cb_opaque);
 }
 
 static void scsi_disk_base_class_initfn(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
+    SCSIDeviceClass *sc = SCSI_DEVICE_CLASS(klass);
     SCSIDiskClass *sdc = SCSI_DISK_BASE_CLASS(klass);
 
     dc->fw_name = "disk";
     dc->reset = scsi_disk_reset;
+    sc->io_plug = scsi_disk_io_plug;
+    sc->io_unplug = scsi_disk_io_unplug;
     sdc->dma_readv = scsi_dma_readv;
     sdc->dma_writev = scsi_dma_writev;
     sdc->need_fua_emulation = scsi_is_cmd_fua;
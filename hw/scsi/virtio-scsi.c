@@ -57,7 +57,7 @@ void virtio_scsi_free_req(VirtIOSCSIReq *req)
 {
     qemu_iovec_destroy(&req->resp_iov);
     qemu_sglist_destroy(&req->qsgl);
-    g_free(req);
+    virtqueue_free_element(req);
 }
 
 static void virtio_scsi_complete_req(VirtIOSCSIReq *req)
@@ -554,7 +554,7 @@ static bool virtio_scsi_handle_cmd_req_prepare(VirtIOSCSI *s, VirtIOSCSIReq *req
         return false;
     }
     scsi_req_ref(req->sreq);
-    blk_io_plug(d->conf.blk);
+    scsi_device_io_plug(d);
     return true;
 }
 
@@ -564,7 +564,7 @@ static void virtio_scsi_handle_cmd_req_submit(VirtIOSCSI *s, VirtIOSCSIReq *req)
     if (scsi_req_enqueue(sreq)) {
         scsi_req_continue(sreq);
     }
-    blk_io_unplug(sreq->dev->conf.blk);
+    scsi_device_io_unplug(sreq->dev);
     scsi_req_unref(sreq);
 }
 
@@ -846,6 +846,7 @@ void virtio_scsi_common_realize(DeviceState *dev, Error **errp,
     s->event_vq = virtio_add_queue_aio(vdev, VIRTIO_SCSI_VQ_SIZE, evt);
     for (i = 0; i < s->conf.num_queues; i++) {
         s->cmd_vqs[i] = virtio_add_queue_aio(vdev, VIRTIO_SCSI_VQ_SIZE, cmd);
+        virtio_queue_set_element_pool(s->cmd_vqs[i], NULL, NULL);
     }
 
     if (s->conf.iothread) {
@@ -879,6 +880,9 @@ static void virtio_scsi_device_realize(DeviceState *dev, Error **errp)
             return;
         }
     }
+
+    qemu_coroutine_increase_pool_batch_size(s->parent_obj.conf.num_queues *
+                                            VIRTIO_SCSI_VQ_SIZE / 2);
 }
 
 static void virtio_scsi_instance_init(Object *obj)
@@ -902,6 +906,10 @@ void virtio_scsi_common_unrealize(DeviceState *dev, Error **errp)
 
 static void virtio_scsi_device_unrealize(DeviceState *dev, Error **errp)
 {
+    VirtIOSCSICommon *vs = VIRTIO_SCSI_COMMON(dev);
+
+    qemu_coroutine_decrease_pool_batch_size(vs->conf.num_queues *
+                                            VIRTIO_SCSI_VQ_SIZE / 2);
     virtio_scsi_common_unrealize(dev, errp);
 }
 
@@ -30,9 +30,13 @@
 #include "exec/address-spaces.h"
 #include "exec/memory.h"
 #include "hw/hw.h"
+#include "hw/qdev-core.h"
 #include "qemu/error-report.h"
 #include "qemu/range.h"
+#include "qemu/thread.h"
 #include "sysemu/kvm.h"
+#include "sysemu/sysemu.h"
+#include "qmp-commands.h"
 #include "trace.h"
 
 struct vfio_group_head vfio_group_list =
@@ -242,6 +246,190 @@ static int vfio_dma_map(VFIOContainer *container, hwaddr iova,
     return -errno;
 }
 
+/*
+ * Pinning the RAM of a large guest takes long, so the RAM sections mapped
+ * while the machine is being built are split in chunks that worker threads
+ * map while machine init goes on.  The type1 IOMMU pins pages under a lock
+ * per container, so the workers first fault the pages in, which does run
+ * in parallel.  Containers wait for their maps when machine init is done,
+ * maps done later are synchronous.
+ */
+#define VFIO_DMA_CHUNK_SIZE     (1ULL << 30)
+#define VFIO_DMA_MAX_WORKERS    8
+
+typedef struct VFIODMAJob {
+    VFIOContainer *container;
+    hwaddr iova;
+    ram_addr_t size;
+    void *vaddr;
+    bool readonly;
+    QSIMPLEQ_ENTRY(VFIODMAJob) next;
+} VFIODMAJob;
+
+static struct {
+    QemuMutex lock;
+    QemuCond done;
+    int nb_workers;
+    int max_workers;
+    QSIMPLEQ_HEAD(, VFIODMAJob) jobs;
+} vfio_dma;
+
+static void vfio_dma_populate(void *vaddr, ram_addr_t size, bool readonly)
+{
+#if defined(MADV_POPULATE_READ) && defined(MADV_POPULATE_WRITE)
+    /* Failures only mean that the kernel faults the pages in itself */
+    madvise(vaddr, size, readonly ? MADV_POPULATE_READ : MADV_POPULATE_WRITE);
+#endif
+}
+
+static void *vfio_dma_map_worker(void *opaque)
+{
+    VFIODMAJob *job;
+    VFIOContainer *container;
+    int ret;
+
+    qemu_mutex_lock(&vfio_dma.lock);
+    while ((job = QSIMPLEQ_FIRST(&vfio_dma.jobs))) {
+        QSIMPLEQ_REMOVE_HEAD(&vfio_dma.jobs, next);
+        qemu_mutex_unlock(&vfio_dma.lock);
+
+        container = job->container;
+        vfio_dma_populate(job->vaddr, job->size, job->readonly);
+        ret = vfio_dma_map(container, job->iova, job->size, job->vaddr,
+                           job->readonly);
+        if (ret) {
+            error_report("vfio_dma_map(%p, 0x%"HWADDR_PRIx", "
+                         "0x%"HWADDR_PRIx", %p) = %d (%m)",
+                         container, job->iova, job->size, job->vaddr, ret);
+        }
+
+        qemu_mutex_lock(&vfio_dma.lock);
+        container->dma_pending -= job->size;
+        if (ret) {
+            if (!container->dma_error) {
+                container->dma_error = ret;
+            }
+        } else {
+            container->dma_mapped += job->size;
+        }
+        if (--container->dma_jobs == 0) {
+            qemu_cond_broadcast(&vfio_dma.done);
+        }
+        g_free(job);
+    }
+    vfio_dma.nb_workers--;
+    qemu_mutex_unlock(&vfio_dma.lock);
+    return NULL;
+}
+
+static void vfio_dma_init(void)
+{
+    if (vfio_dma.max_workers) {
+        return;
+    }
+    qemu_mutex_init(&vfio_dma.lock);
+    qemu_cond_init(&vfio_dma.done);
+    QSIMPLEQ_INIT(&vfio_dma.jobs);
+    vfio_dma.max_workers = MAX(1, MIN(sysconf(_SC_NPROCESSORS_ONLN),
+                                      VFIO_DMA_MAX_WORKERS));
+}
+
+static void vfio_dma_map_queue(VFIOContainer *container, hwaddr iova,
+                               ram_addr_t size, void *vaddr, bool readonly)
+{
+    QemuThread thread;
+    VFIODMAJob *job;
+    ram_addr_t len;
+
+    trace_vfio_dma_map_queue(iova, size);
+
+    qemu_mutex_lock(&vfio_dma.lock);
+    while (size) {
+        len = MIN(size, VFIO_DMA_CHUNK_SIZE);
+        job = g_new(VFIODMAJob, 1);
+        job->container = container;
+        job->iova = iova;
+        job->size = len;
+        job->vaddr = vaddr;
+        job->readonly = readonly;
+        QSIMPLEQ_INSERT_TAIL(&vfio_dma.jobs, job, next);
+        container->dma_jobs++;
+        container->dma_pending += len;
+
+        if (vfio_dma.nb_workers < vfio_dma.max_workers) {
+            vfio_dma.nb_workers++;
+            qemu_thread_create(&thread, "vfio-dma", vfio_dma_map_worker,
+                               NULL, QEMU_THREAD_DETACHED);
+        }
+
+        iova += len;
+        vaddr += len;
+        size -= len;
+    }
+    qemu_mutex_unlock(&vfio_dma.lock);
+}
+
+/* Wait for the queued maps of @container, return the first error */
+static int vfio_dma_map_wait(VFIOContainer *container)
+{
+    int ret;
+
+    qemu_mutex_lock(&vfio_dma.lock);
+    if (container->dma_jobs) {
+        trace_vfio_dma_map_wait(container->fd, container->dma_pending);
+    }
+    while (container->dma_jobs) {
+        qemu_cond_wait(&vfio_dma.done, &vfio_dma.lock);
+    }
+    ret = container->dma_error;
+    qemu_mutex_unlock(&vfio_dma.lock);
+    return ret;
+}
+
+static void vfio_dma_machine_done(Notifier *n, void *unused)
+{
+    VFIOContainer *container = container_of(n, VFIOContainer, machine_done);
+
+    if (vfio_dma_map_wait(container) || container->error) {
+        error_report("vfio: DMA mapping failed, unable to continue");
+        exit(1);
+    }
+
+    qemu_remove_machine_init_done_notifier(n);
+    container->machine_done.notify = NULL;
+    container->initialized = true;
+}
+
+static void vfio_dma_account(VFIOContainer *container, int64_t size)
+{
+    qemu_mutex_lock(&vfio_dma.lock);
+    container->dma_mapped += size;
+    qemu_mutex_unlock(&vfio_dma.lock);
+}
+
+VfioDmaInfoList *qmp_query_vfio_dma(Error **errp)
+{
+    VfioDmaInfoList *head = NULL, *entry;
+    VFIOAddressSpace *space;
+    VFIOContainer *container;
+
+    QLIST_FOREACH(space, &vfio_address_spaces, list) {
+        QLIST_FOREACH(container, &space->containers, next) {
+            entry = g_new0(VfioDmaInfoList, 1);
+            entry->value = g_new0(VfioDmaInfo, 1);
+            qemu_mutex_lock(&vfio_dma.lock);
+            entry->value->mapped = container->dma_mapped;
+            entry->value->pending = container->dma_pending;
+            qemu_mutex_unlock(&vfio_dma.lock);
+            entry->value->complete = container->initialized;
+            entry->next = head;
+            head = entry;
+        }
+    }
+
+    return head;
+}
+
 static void vfio_host_win_add(VFIOContainer *container,
                               hwaddr min_iova, hwaddr max_iova,
                               uint64_t iova_pgsizes)
@@ -472,6 +660,12 @@ static void vfio_listener_region_add(MemoryListener *listener,
 
     llsize = int128_sub(llend, int128_make64(iova));
 
+    if (!container->initialized && !qdev_hotplug) {
+        vfio_dma_map_queue(container, iova, int128_get64(llsize),
+                           vaddr, section->readonly);
+        return;
+    }
+
     ret = vfio_dma_map(container, iova, int128_get64(llsize),
                        vaddr, section->readonly);
     if (ret) {
@@ -480,6 +674,7 @@ static void vfio_listener_region_add(MemoryListener *listener,
                      container, iova, int128_get64(llsize), vaddr, ret);
         goto fail;
     }
+    vfio_dma_account(container, int128_get64(llsize));
 
     return;
 
@@ -556,12 +751,17 @@ static void vfio_listener_region_del(MemoryListener *listener,
 
     trace_vfio_listener_region_del(iova, end);
 
+    /* Errors of queued maps are reported once machine init is done */
+    vfio_dma_map_wait(container);
+
     ret = vfio_dma_unmap(container, iova, int128_get64(llsize));
     memory_region_unref(section->mr);
     if (ret) {
         error_report("vfio_dma_unmap(%p, 0x%"HWADDR_PRIx", "
                      "0x%"HWADDR_PRIx") = %d (%m)",
                      container, iova, int128_get64(llsize), ret);
+    } else if (!memory_region_is_iommu(section->mr)) {
+        vfio_dma_account(container, -int128_get64(llsize));
     }
 
     if (container->iommu_type == VFIO_SPAPR_TCE_v2_IOMMU) {
@@ -906,6 +1106,7 @@ static int vfio_connect_container(VFIOGroup *group, AddressSpace *as)
     int ret, fd;
     VFIOAddressSpace *space;
 
+    vfio_dma_init();
     space = vfio_get_address_space(as);
 
     QLIST_FOREACH(container, &space->containers, next) {
@@ -1058,7 +1259,16 @@ static int vfio_connect_container(VFIOGroup *group, AddressSpace *as)
         goto listener_release_exit;
     }
 
-    container->initialized = true;
+    /*
+     * The RAM of cold plugged devices is still being mapped in the
+     * background, hotplugged devices mapped it synchronously.
+     */
+    if (qdev_hotplug) {
+        container->initialized = true;
+    } else {
+        container->machine_done.notify = vfio_dma_machine_done;
+        qemu_add_machine_init_done_notifier(&container->machine_done);
+    }
 
     QLIST_INIT(&container->group_list);
     QLIST_INSERT_HEAD(&space->containers, container, next);
@@ -1069,6 +1279,7 @@ static int vfio_connect_container(VFIOGroup *group, AddressSpace *as)
     return 0;
 listener_release_exit:
     vfio_listener_release(container);
+    vfio_dma_map_wait(container);
 
 free_container_exit:
     g_free(container);
@@ -1101,6 +1312,11 @@ static void vfio_disconnect_container(VFIOGroup *group)
         vfio_listener_release(container);
         QLIST_REMOVE(container, next);
 
+        if (container->machine_done.notify) {
+            qemu_remove_machine_init_done_notifier(&container->machine_done);
+        }
+        vfio_dma_map_wait(container);
+
         QLIST_FOREACH_SAFE(giommu, &container->giommu_list, giommu_next, tmp) {
             memory_region_unregister_iommu_notifier(giommu->iommu, &giommu->n);
             QLIST_REMOVE(giommu, giommu_next);
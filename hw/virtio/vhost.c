@@ -26,6 +26,7 @@
 #include "hw/virtio/virtio-bus.h"
 #include "hw/virtio/virtio-access.h"
 #include "migration/migration.h"
+#include "trace.h"
 
 /* enabled until disconnected backend stabilizes */
 #define _VHOST_DEBUG 1
@@ -540,6 +541,39 @@ static void vhost_set_memory(MemoryListener *listener,
     used_memslots = dev->mem->nregions;
 }
 
+/* Send the memory table to the backend unless it already has this very
+ * table: a transaction that removes and re-adds a region, or splits and
+ * re-merges one, leaves the table as it was, and the backend would
+ * otherwise drop and rebuild all of its translations for nothing.
+ */
+static int vhost_dev_set_mem_table(struct vhost_dev *dev)
+{
+    size_t size = offsetof(struct vhost_memory, regions) +
+        dev->mem->nregions * sizeof dev->mem->regions[0];
+    int r;
+
+    if (dev->mem_sent && dev->mem_sent->nregions == dev->mem->nregions &&
+        !memcmp(dev->mem_sent, dev->mem, size)) {
+        dev->mem_table_skipped++;
+        trace_vhost_set_mem_table(dev, dev->mem->nregions,
+                                  dev->mem_table_sent, dev->mem_table_skipped);
+        return 0;
+    }
+
+    g_free(dev->mem_sent);
+    dev->mem_sent = NULL;
+    r = dev->vhost_ops->vhost_set_mem_table(dev, dev->mem);
+    if (r < 0) {
+        VHOST_OPS_DEBUG("vhost_set_mem_table failed");
+        return -errno;
+    }
+    dev->mem_sent = g_memdup(dev->mem, size);
+    dev->mem_table_sent++;
+    trace_vhost_set_mem_table(dev, dev->mem->nregions,
+                              dev->mem_table_sent, dev->mem_table_skipped);
+    return 0;
+}
+
 static bool vhost_section(MemoryRegionSection *section)
 {
     return memory_region_is_ram(section->mr);
@@ -581,10 +615,7 @@ static void vhost_commit(MemoryListener *listener)
     }
 
     if (!dev->log_enabled) {
-        r = dev->vhost_ops->vhost_set_mem_table(dev, dev->mem);
-        if (r < 0) {
-            VHOST_OPS_DEBUG("vhost_set_mem_table failed");
-        }
+        vhost_dev_set_mem_table(dev);
         dev->memory_changed = false;
         return;
     }
@@ -596,10 +627,7 @@ static void vhost_commit(MemoryListener *listener)
     if (dev->log_size < log_size) {
         vhost_dev_log_resize(dev, log_size + VHOST_LOG_BUFFER);
     }
-    r = dev->vhost_ops->vhost_set_mem_table(dev, dev->mem);
-    if (r < 0) {
-        VHOST_OPS_DEBUG("vhost_set_mem_table failed");
-    }
+    vhost_dev_set_mem_table(dev);
     /* To log less, can only decrease log size after table update. */
     if (dev->log_size > log_size + VHOST_LOG_BUFFER) {
         vhost_dev_log_resize(dev, log_size);
@@ -945,6 +973,10 @@ static void vhost_virtqueue_stop(struct vhost_dev *dev,
     r = dev->vhost_ops->vhost_get_vring_base(dev, &state);
     if (r < 0) {
         VHOST_OPS_DEBUG("vhost VQ %d ring restore failed: %d", idx, r);
+        /* The backend is gone: resume from what it completed, leaving what
+         * it had in flight to be found again by the next one.
+         */
+        virtio_queue_restore_last_avail_idx(vdev, idx);
     } else {
         virtio_queue_set_last_avail_idx(vdev, idx, state.num);
     }
@@ -1157,6 +1189,7 @@ void vhost_dev_cleanup(struct vhost_dev *hdev)
         error_free(hdev->migration_blocker);
     }
     g_free(hdev->mem);
+    g_free(hdev->mem_sent);
     g_free(hdev->mem_sections);
     if (hdev->vhost_ops) {
         hdev->vhost_ops->vhost_backend_cleanup(hdev);
@@ -1301,10 +1334,11 @@ int vhost_dev_start(struct vhost_dev *hdev, VirtIODevice *vdev)
     if (r < 0) {
         goto fail_features;
     }
-    r = hdev->vhost_ops->vhost_set_mem_table(hdev, hdev->mem);
+    /* A (re)started backend may not have any table yet */
+    g_free(hdev->mem_sent);
+    hdev->mem_sent = NULL;
+    r = vhost_dev_set_mem_table(hdev);
     if (r < 0) {
-        VHOST_OPS_DEBUG("vhost_set_mem_table failed");
-        r = -errno;
         goto fail_mem;
     }
     for (i = 0; i < hdev->nvqs; ++i) {
@@ -1380,3 +1414,52 @@ int vhost_net_set_backend(struct vhost_dev *hdev,
 
     return -1;
 }
+
+void vhost_dev_free_inflight(struct vhost_inflight *inflight)
+{
+    if (inflight->addr) {
+        munmap(inflight->addr, inflight->size);
+        close(inflight->fd);
+        inflight->addr = NULL;
+        inflight->fd = -1;
+    }
+}
+
+/* Ask the backend for a new in-flight region; leaves INFLIGHT empty if the
+ * backend does not keep one.
+ */
+int vhost_dev_get_inflight(struct vhost_dev *dev, uint16_t num_queues,
+                           uint16_t queue_size,
+                           struct vhost_inflight *inflight)
+{
+    int r;
+
+    if (!dev->vhost_ops->vhost_get_inflight_fd) {
+        return 0;
+    }
+
+    r = dev->vhost_ops->vhost_get_inflight_fd(dev, num_queues, queue_size,
+                                              inflight);
+    if (r < 0) {
+        VHOST_OPS_DEBUG("vhost_get_inflight_fd failed");
+        return -errno;
+    }
+    return 0;
+}
+
+int vhost_dev_set_inflight(struct vhost_dev *dev,
+                           struct vhost_inflight *inflight)
+{
+    int r;
+
+    if (!dev->vhost_ops->vhost_set_inflight_fd || !inflight->addr) {
+        return 0;
+    }
+
+    r = dev->vhost_ops->vhost_set_inflight_fd(dev, inflight);
+    if (r < 0) {
+        VHOST_OPS_DEBUG("vhost_set_inflight_fd failed");
+        return -errno;
+    }
+    return 0;
+}
@@ -25,6 +25,9 @@
 #include "exec/address-spaces.h"
 #include "qapi/visitor.h"
 #include "qapi-event.h"
+#include "migration/migration.h"
+#include "block/aio.h"
+#include "block/thread-pool.h"
 #include "trace.h"
 
 #include "hw/virtio/virtio-bus.h"
@@ -32,17 +35,157 @@
 
 #define BALLOON_PAGE_SIZE  (1 << VIRTIO_BALLOON_PFN_SHIFT)
 
-static void balloon_page(void *addr, int deflate)
+static bool balloon_can_discard(void)
 {
-#if defined(__linux__)
-    if (!qemu_balloon_is_inhibited() && (!kvm_enabled() ||
-                                         kvm_has_sync_mmu())) {
-        qemu_madvise(addr, BALLOON_PAGE_SIZE,
-                deflate ? QEMU_MADV_WILLNEED : QEMU_MADV_DONTNEED);
+    return !qemu_balloon_is_inhibited() && (!kvm_enabled() ||
+                                            kvm_has_sync_mmu());
+}
+
+/* A run of ballooned pages, contiguous within one RAM region */
+typedef struct BalloonRange {
+    MemoryRegion *mr;
+    ram_addr_t offset;
+    size_t len;
+} BalloonRange;
+
+/* An inflate request, completed once its ranges are discarded */
+typedef struct BalloonDiscardReq {
+    VirtIOBalloon *s;
+    VirtQueue *vq;
+    VirtQueueElement *elem;
+    size_t elem_len;
+    GArray *ranges;
+} BalloonDiscardReq;
+
+static void balloon_range_add(GArray *ranges, MemoryRegion *mr,
+                              ram_addr_t offset, size_t len)
+{
+    BalloonRange range = { .mr = mr, .offset = offset, .len = len };
+
+    memory_region_ref(mr);
+    g_array_append_val(ranges, range);
+}
+
+static void balloon_partial_reset(VirtIOBalloon *s)
+{
+    g_free(s->pbp_bitmap);
+    s->pbp_bitmap = NULL;
+    s->pbp_block = NULL;
+}
+
+/*
+ * The guest balloons 4 KiB pages, but a huge host page can only be given
+ * back as a whole.  Remember which parts of one huge page were ballooned
+ * so far; the guest usually frees the rest of it soon after.
+ */
+static void balloon_inflate_partial(VirtIOBalloon *s, GArray *ranges,
+                                    MemoryRegion *mr, ram_addr_t offset,
+                                    size_t len)
+{
+    RAMBlock *rb = mr->ram_block;
+    size_t page_size = qemu_ram_pagesize(rb);
+    ram_addr_t base = QEMU_ALIGN_DOWN(offset, page_size);
+    unsigned long nr = page_size / BALLOON_PAGE_SIZE;
+
+    if (s->pbp_block != rb || s->pbp_base != base) {
+        balloon_partial_reset(s);
+        s->pbp_bitmap = bitmap_new(nr);
+        s->pbp_block = rb;
+        s->pbp_base = base;
+    }
+
+    bitmap_set(s->pbp_bitmap, (offset - base) / BALLOON_PAGE_SIZE,
+               len / BALLOON_PAGE_SIZE);
+    if (bitmap_full(s->pbp_bitmap, nr)) {
+        balloon_range_add(ranges, mr, base, page_size);
+        balloon_partial_reset(s);
     }
+}
+
+static void balloon_inflate_range(VirtIOBalloon *s, GArray *ranges,
+                                  MemoryRegion *mr, ram_addr_t offset,
+                                  size_t len)
+{
+    size_t page_size = qemu_ram_pagesize(mr->ram_block);
+    ram_addr_t start = QEMU_ALIGN_UP(offset, page_size);
+    ram_addr_t end = QEMU_ALIGN_DOWN(offset + len, page_size);
+
+    if (page_size <= BALLOON_PAGE_SIZE) {
+        balloon_range_add(ranges, mr, offset, len);
+        return;
+    }
+
+    if (start >= end) {
+        /* Within a single huge page */
+        balloon_inflate_partial(s, ranges, mr, offset, len);
+        return;
+    }
+    balloon_range_add(ranges, mr, start, end - start);
+    if (offset < start) {
+        balloon_inflate_partial(s, ranges, mr, offset, start - offset);
+    }
+    if (end < offset + len) {
+        balloon_inflate_partial(s, ranges, mr, end, offset + len - end);
+    }
+}
+
+static void balloon_deflate_range(MemoryRegion *mr, ram_addr_t offset,
+                                  size_t len)
+{
+#if defined(__linux__)
+    qemu_madvise(memory_region_get_ram_ptr(mr) + offset, len,
+                 QEMU_MADV_WILLNEED);
 #endif
 }
 
+/* Called from a worker thread */
+static int balloon_discard_worker(void *opaque)
+{
+    BalloonDiscardReq *req = opaque;
+    unsigned int i;
+
+    for (i = 0; i < req->ranges->len; i++) {
+        BalloonRange *range = &g_array_index(req->ranges, BalloonRange, i);
+
+        ram_block_discard_range(range->mr->ram_block, range->offset,
+                                range->len);
+    }
+    return 0;
+}
+
+static void balloon_request_complete(BalloonDiscardReq *req)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(req->s);
+    unsigned int i;
+
+    for (i = 0; i < req->ranges->len; i++) {
+        memory_region_unref(g_array_index(req->ranges, BalloonRange, i).mr);
+    }
+    g_array_free(req->ranges, true);
+
+    virtqueue_push(req->vq, req->elem, req->elem_len);
+    virtio_notify(vdev, req->vq);
+    g_free(req->elem);
+    g_free(req);
+}
+
+static void balloon_discard_cb(void *opaque, int ret)
+{
+    BalloonDiscardReq *req = opaque;
+    VirtIOBalloon *s = req->s;
+
+    balloon_request_complete(req);
+    s->discard_in_flight--;
+}
+
+/* Wait for inflate requests still being discarded */
+static void balloon_discard_drain(VirtIOBalloon *s)
+{
+    while (s->discard_in_flight) {
+        aio_poll(qemu_get_aio_context(), true);
+    }
+}
+
 static const char *balloon_stat_names[] = {
    [VIRTIO_BALLOON_S_SWAP_IN] = "stat-swap-in",
    [VIRTIO_BALLOON_S_SWAP_OUT] = "stat-swap-out",
@@ -206,20 +349,56 @@ static void balloon_stats_set_poll_interval(Object *obj, Visitor *v,
     balloon_stats_change_timer(s, 0);
 }
 
+static void balloon_flush_range(VirtIOBalloon *s, GArray *ranges,
+                                bool deflate, BalloonRange *run)
+{
+    if (!run->mr) {
+        return;
+    }
+    if (deflate) {
+        balloon_deflate_range(run->mr, run->offset, run->len);
+    } else {
+        balloon_inflate_range(s, ranges, run->mr, run->offset, run->len);
+    }
+    memory_region_unref(run->mr);
+    run->mr = NULL;
+}
+
+/*
+ * Consecutive PFNs are coalesced into runs, so that a large inflate costs
+ * one discard per run rather than one madvise() per page.  The discards
+ * then run in the thread pool; the guest only gets the element back, and
+ * thus may only deflate those pages, once they are done.
+ */
 static void virtio_balloon_handle_output(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIOBalloon *s = VIRTIO_BALLOON(vdev);
     VirtQueueElement *elem;
     MemoryRegionSection section;
+    bool deflate = (vq == s->dvq);
+    bool discard = balloon_can_discard();
 
     for (;;) {
         size_t offset = 0;
         uint32_t pfn;
+        BalloonRange run = { .mr = NULL };
+        BalloonDiscardReq *req;
+
         elem = virtqueue_pop(vq, sizeof(VirtQueueElement));
         if (!elem) {
             return;
         }
 
+        req = g_new0(BalloonDiscardReq, 1);
+        req->s = s;
+        req->vq = vq;
+        req->elem = elem;
+        req->ranges = g_array_new(false, false, sizeof(BalloonRange));
+
+        if (deflate) {
+            balloon_partial_reset(s);
+        }
+
         while (iov_to_buf(elem->out_sg, elem->out_num, offset, &pfn, 4) == 4) {
             ram_addr_t pa;
             ram_addr_t addr;
@@ -228,6 +407,10 @@ static void virtio_balloon_handle_output(VirtIODevice *vdev, VirtQueue *vq)
             pa = (ram_addr_t) p << VIRTIO_BALLOON_PFN_SHIFT;
             offset += 4;
 
+            if (!discard) {
+                continue;
+            }
+
             /* FIXME: remove get_system_memory(), but how? */
             section = memory_region_find(get_system_memory(), pa, 1);
             if (!int128_nz(section.size) || !memory_region_is_ram(section.mr))
@@ -235,20 +418,168 @@ static void virtio_balloon_handle_output(VirtIODevice *vdev, VirtQueue *vq)
 
             trace_virtio_balloon_handle_output(memory_region_name(section.mr),
                                                pa);
-            /* Using memory_region_get_ram_ptr is bending the rules a bit, but
-               should be OK because we only want a single page.  */
             addr = section.offset_within_region;
-            balloon_page(memory_region_get_ram_ptr(section.mr) + addr,
-                         !!(vq == s->dvq));
-            memory_region_unref(section.mr);
+            if (run.mr == section.mr && run.offset + run.len == addr) {
+                run.len += BALLOON_PAGE_SIZE;
+                memory_region_unref(section.mr);
+                continue;
+            }
+
+            balloon_flush_range(s, req->ranges, deflate, &run);
+            run.mr = section.mr;
+            run.offset = addr;
+            run.len = BALLOON_PAGE_SIZE;
+        }
+        balloon_flush_range(s, req->ranges, deflate, &run);
+        req->elem_len = offset;
+
+        if (!req->ranges->len) {
+            balloon_request_complete(req);
+            continue;
+        }
+
+        s->discard_in_flight++;
+        thread_pool_submit_aio(aio_get_thread_pool(qemu_get_aio_context()),
+                               balloon_discard_worker, req,
+                               balloon_discard_cb, req);
+    }
+}
+
+/*
+ * Free page reporting: each element carries, as in buffers, free ranges of
+ * guest memory that the guest will not touch until we return it.  Ranges
+ * that are contiguous in host memory are discarded with a single call.
+ */
+static void virtio_balloon_handle_report(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtQueueElement *elem;
+
+    while ((elem = virtqueue_pop(vq, sizeof(VirtQueueElement)))) {
+        unsigned int i;
+
+        if (!balloon_can_discard()) {
+            goto done;
+        }
+        for (i = 0; i < elem->in_num; i++) {
+            uint8_t *addr = elem->in_sg[i].iov_base;
+            size_t len = elem->in_sg[i].iov_len;
+            ram_addr_t offset;
+            RAMBlock *rb;
+
+            while (i + 1 < elem->in_num &&
+                   elem->in_sg[i + 1].iov_base == addr + len) {
+                len += elem->in_sg[++i].iov_len;
+            }
+
+            rb = qemu_ram_block_from_host(addr, false, &offset);
+            trace_virtio_balloon_handle_report(addr, len);
+            if (rb) {
+                ram_block_discard_range(rb, offset, len);
+            }
+        }
+
+done:
+        virtqueue_push(vq, elem, 0);
+        virtio_notify(vdev, vq);
+        g_free(elem);
+    }
+}
+
+static bool virtio_balloon_free_page_hint_enabled(VirtIOBalloon *s)
+{
+    return virtio_vdev_has_feature(VIRTIO_DEVICE(s),
+                                   VIRTIO_BALLOON_F_FREE_PAGE_HINT);
+}
+
+static void virtio_balloon_free_page_hint_set(VirtIOBalloon *s,
+                                              FreePageHintStatus status)
+{
+    s->free_page_hint_status = status;
+    trace_virtio_balloon_free_page_hint(s->free_page_hint_cmd_id, status);
+    virtio_notify_config(VIRTIO_DEVICE(s));
+}
+
+/*
+ * Free page hinting: after the guest sees a new command id in the config
+ * space it sends that id, then free pages as in buffers, then
+ * VIRTIO_BALLOON_CMD_ID_STOP.  The pages stay with the guest, we only skip
+ * them in the current migration pass.  Hints sent for an older id predate
+ * the last bitmap sync and are ignored.
+ */
+static void virtio_balloon_handle_free_page(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtIOBalloon *s = VIRTIO_BALLOON(vdev);
+    VirtQueueElement *elem;
+
+    while ((elem = virtqueue_pop(vq, sizeof(VirtQueueElement)))) {
+        unsigned int i;
+        uint32_t id;
+
+        if (elem->out_num &&
+            iov_to_buf(elem->out_sg, elem->out_num, 0, &id,
+                       sizeof(id)) == sizeof(id)) {
+            id = virtio_ldl_p(vdev, &id);
+            if (s->free_page_hint_status == FREE_PAGE_HINT_S_START &&
+                id == VIRTIO_BALLOON_CMD_ID_STOP) {
+                s->free_page_hint_status = FREE_PAGE_HINT_S_STOP;
+            } else if (s->free_page_hint_status == FREE_PAGE_HINT_S_REQUESTED &&
+                       id == s->free_page_hint_cmd_id) {
+                s->free_page_hint_status = FREE_PAGE_HINT_S_START;
+            }
+        }
+
+        if (s->free_page_hint_status == FREE_PAGE_HINT_S_START) {
+            for (i = 0; i < elem->in_num; i++) {
+                qemu_guest_free_page_hint(elem->in_sg[i].iov_base,
+                                          elem->in_sg[i].iov_len);
+            }
         }
 
-        virtqueue_push(vq, elem, offset);
+        virtqueue_push(vq, elem, 0);
         virtio_notify(vdev, vq);
         g_free(elem);
     }
 }
 
+/* Called after each migration bitmap sync, with the iothread lock held */
+static void virtio_balloon_free_page_hint_sync(Notifier *notifier, void *data)
+{
+    VirtIOBalloon *s = container_of(notifier, VirtIOBalloon,
+                                    free_page_hint_sync_notify);
+
+    if (!virtio_balloon_free_page_hint_enabled(s)) {
+        return;
+    }
+
+    /* Once the guest is stopped this was the final sync */
+    if (!runstate_is_running()) {
+        virtio_balloon_free_page_hint_set(s, FREE_PAGE_HINT_S_DONE);
+        return;
+    }
+
+    if (s->free_page_hint_cmd_id == UINT32_MAX) {
+        s->free_page_hint_cmd_id = VIRTIO_BALLOON_FREE_PAGE_HINT_CMD_ID_MIN;
+    } else {
+        s->free_page_hint_cmd_id++;
+    }
+    virtio_balloon_free_page_hint_set(s, FREE_PAGE_HINT_S_REQUESTED);
+}
+
+/* Let the guest have back the pages it hinted if migration did not finish */
+static void virtio_balloon_free_page_hint_migration(Notifier *notifier,
+                                                    void *data)
+{
+    VirtIOBalloon *s = container_of(notifier, VirtIOBalloon,
+                                    free_page_hint_migration_notify);
+    MigrationState *ms = data;
+
+    if (virtio_balloon_free_page_hint_enabled(s) &&
+        migration_has_failed(ms) &&
+        s->free_page_hint_status != FREE_PAGE_HINT_S_DONE) {
+        virtio_balloon_free_page_hint_set(s, FREE_PAGE_HINT_S_DONE);
+    }
+}
+
 static void virtio_balloon_receive_stats(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIOBalloon *s = VIRTIO_BALLOON(vdev);
@@ -301,6 +632,16 @@ out:
     }
 }
 
+/* The config space only grows for guests that can use the new fields */
+static size_t virtio_balloon_config_size(VirtIOBalloon *s)
+{
+    if (virtio_has_feature(s->host_features,
+                           VIRTIO_BALLOON_F_FREE_PAGE_HINT)) {
+        return offsetof(struct virtio_balloon_config, poison_val);
+    }
+    return offsetof(struct virtio_balloon_config, free_page_hint_cmd_id);
+}
+
 static void virtio_balloon_get_config(VirtIODevice *vdev, uint8_t *config_data)
 {
     VirtIOBalloon *dev = VIRTIO_BALLOON(vdev);
@@ -309,8 +650,22 @@ static void virtio_balloon_get_config(VirtIODevice *vdev, uint8_t *config_data)
     config.num_pages = cpu_to_le32(dev->num_pages);
     config.actual = cpu_to_le32(dev->actual);
 
+    switch (dev->free_page_hint_status) {
+    case FREE_PAGE_HINT_S_REQUESTED:
+    case FREE_PAGE_HINT_S_START:
+        config.free_page_hint_cmd_id = cpu_to_le32(dev->free_page_hint_cmd_id);
+        break;
+    case FREE_PAGE_HINT_S_DONE:
+        config.free_page_hint_cmd_id = cpu_to_le32(VIRTIO_BALLOON_CMD_ID_DONE);
+        break;
+    default:
+        config.free_page_hint_cmd_id = cpu_to_le32(VIRTIO_BALLOON_CMD_ID_STOP);
+        break;
+    }
+    config.poison_val = 0;
+
     trace_virtio_balloon_get_config(config.num_pages, config.actual);
-    memcpy(config_data, &config, sizeof(struct virtio_balloon_config));
+    memcpy(config_data, &config, virtio_balloon_config_size(dev));
 }
 
 static int build_dimm_list(Object *obj, void *opaque)
@@ -354,7 +709,7 @@ static void virtio_balloon_set_config(VirtIODevice *vdev,
     uint32_t oldactual = dev->actual;
     ram_addr_t vm_ram_size = get_current_ram_size();
 
-    memcpy(&config, config_data, sizeof(struct virtio_balloon_config));
+    memcpy(&config, config_data, virtio_balloon_config_size(dev));
     dev->actual = le32_to_cpu(config.actual);
     if (dev->actual != oldactual) {
         qapi_event_send_balloon_change(vm_ram_size -
@@ -400,6 +755,9 @@ static void virtio_balloon_save_device(VirtIODevice *vdev, QEMUFile *f)
 {
     VirtIOBalloon *s = VIRTIO_BALLOON(vdev);
 
+    /* Requests still in the thread pool would be lost on the destination */
+    balloon_discard_drain(s);
+
     qemu_put_be32(f, s->num_pages);
     qemu_put_be32(f, s->actual);
 }
@@ -417,6 +775,9 @@ static int virtio_balloon_load_device(VirtIODevice *vdev, QEMUFile *f,
     s->num_pages = qemu_get_be32(f);
     s->actual = qemu_get_be32(f);
 
+    /* The source told the guest to return its hinted pages, if any */
+    s->free_page_hint_status = FREE_PAGE_HINT_S_DONE;
+
     if (balloon_stats_enabled(s)) {
         balloon_stats_change_timer(s, s->stats_poll_interval);
     }
@@ -430,7 +791,7 @@ static void virtio_balloon_device_realize(DeviceState *dev, Error **errp)
     int ret;
 
     virtio_init(vdev, "virtio-balloon", VIRTIO_ID_BALLOON,
-                sizeof(struct virtio_balloon_config));
+                virtio_balloon_config_size(s));
 
     ret = qemu_add_balloon_handler(virtio_balloon_to_target,
                                    virtio_balloon_stat, s);
@@ -445,6 +806,25 @@ static void virtio_balloon_device_realize(DeviceState *dev, Error **errp)
     s->dvq = virtio_add_queue(vdev, 128, virtio_balloon_handle_output);
     s->svq = virtio_add_queue(vdev, 128, virtio_balloon_receive_stats);
 
+    if (virtio_has_feature(s->host_features,
+                           VIRTIO_BALLOON_F_FREE_PAGE_HINT)) {
+        s->free_page_vq = virtio_add_queue(vdev, VIRTQUEUE_MAX_SIZE,
+                                           virtio_balloon_handle_free_page);
+        s->free_page_hint_cmd_id = VIRTIO_BALLOON_FREE_PAGE_HINT_CMD_ID_MIN;
+        s->free_page_hint_status = FREE_PAGE_HINT_S_STOP;
+        s->free_page_hint_sync_notify.notify =
+            virtio_balloon_free_page_hint_sync;
+        ram_add_bitmap_sync_notifier(&s->free_page_hint_sync_notify);
+        s->free_page_hint_migration_notify.notify =
+            virtio_balloon_free_page_hint_migration;
+        add_migration_state_change_notifier(
+            &s->free_page_hint_migration_notify);
+    }
+    if (virtio_has_feature(s->host_features, VIRTIO_BALLOON_F_REPORTING)) {
+        s->reporting_vq = virtio_add_queue(vdev, 32,
+                                           virtio_balloon_handle_report);
+    }
+
     reset_stats(s);
 }
 
@@ -453,7 +833,14 @@ static void virtio_balloon_device_unrealize(DeviceState *dev, Error **errp)
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
     VirtIOBalloon *s = VIRTIO_BALLOON(dev);
 
+    balloon_discard_drain(s);
+    balloon_partial_reset(s);
     balloon_stats_destroy_timer(s);
+    if (s->free_page_vq) {
+        ram_remove_bitmap_sync_notifier(&s->free_page_hint_sync_notify);
+        remove_migration_state_change_notifier(
+            &s->free_page_hint_migration_notify);
+    }
     qemu_remove_balloon_handler(s);
     virtio_cleanup(vdev);
 }
@@ -462,6 +849,9 @@ static void virtio_balloon_device_reset(VirtIODevice *vdev)
 {
     VirtIOBalloon *s = VIRTIO_BALLOON(vdev);
 
+    balloon_discard_drain(s);
+    balloon_partial_reset(s);
+
     if (s->stats_vq_elem != NULL) {
         g_free(s->stats_vq_elem);
         s->stats_vq_elem = NULL;
@@ -486,6 +876,10 @@ VMSTATE_VIRTIO_DEVICE(balloon, 1, virtio_balloon_load, virtio_vmstate_save);
 static Property virtio_balloon_properties[] = {
     DEFINE_PROP_BIT("deflate-on-oom", VirtIOBalloon, host_features,
                     VIRTIO_BALLOON_F_DEFLATE_ON_OOM, false),
+    DEFINE_PROP_BIT("free-page-hint", VirtIOBalloon, host_features,
+                    VIRTIO_BALLOON_F_FREE_PAGE_HINT, false),
+    DEFINE_PROP_BIT("free-page-reporting", VirtIOBalloon, host_features,
+                    VIRTIO_BALLOON_F_REPORTING, false),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -1653,6 +1653,11 @@ static void virtio_pci_device_plugged(DeviceState *d, Error **errp)
         pci_set_long((uint8_t *)&cfg_mask->cap.offset, ~0x0);
         pci_set_long((uint8_t *)&cfg_mask->cap.length, ~0x0);
         pci_set_long(cfg_mask->pci_cfg_data, ~0x0);
+    } else {
+        /* Legacy drivers only see the low 32 feature bits, and packed
+         * virtqueues are a virtio 1 layout anyway.
+         */
+        virtio_clear_feature(&vdev->host_features, VIRTIO_F_RING_PACKED);
     }
 
     if (proxy->nvectors) {
@@ -23,6 +23,9 @@
 #include "hw/virtio/virtio-bus.h"
 #include "migration/migration.h"
 #include "hw/virtio/virtio-access.h"
+#include "hw/xen/xen.h"
+#include "qemu/host-utils.h"
+#include "qemu/thread.h"
 
 /*
  * The alignment to use between consumer and producer parts of vring.
@@ -59,6 +62,28 @@ typedef struct VRingUsed
     VRingUsedElem ring[0];
 } VRingUsed;
 
+typedef struct VRingPackedDesc
+{
+    uint64_t addr;
+    uint32_t len;
+    uint16_t id;
+    uint16_t flags;
+} VRingPackedDesc;
+
+typedef struct VRingPackedDescEvent
+{
+    uint16_t off_wrap;
+    uint16_t flags;
+} VRingPackedDescEvent;
+
+/* A completion of a packed virtqueue, from virtqueue_fill to virtqueue_flush */
+typedef struct VRingPackedUsedElem
+{
+    unsigned int index;
+    unsigned int len;
+    unsigned int ndescs;
+} VRingPackedUsedElem;
+
 typedef struct VRing
 {
     unsigned int num;
@@ -69,9 +94,26 @@ typedef struct VRing
     hwaddr used;
 } VRing;
 
+/* Host mapping of one ring, see vring_cache() */
+typedef struct VRingMap
+{
+    MemoryRegion *mr;   /* NULL if not mapped, e.g. the ring is not in RAM */
+    hwaddr offset;      /* of the ring in mr, for dirty tracking */
+    uint8_t *ptr;
+} VRingMap;
+
+typedef struct VRingCache
+{
+    unsigned gen;       /* VirtIODevice::vring_gen when the rings were mapped */
+    VRingMap desc;
+    VRingMap avail;
+    VRingMap used;
+} VRingCache;
+
 struct VirtQueue
 {
     VRing vring;
+    VRingCache cache;
 
     /* Next head to pop */
     uint16_t last_avail_idx;
@@ -81,6 +123,13 @@ struct VirtQueue
 
     uint16_t used_idx;
 
+    /* Packed layout only: the indexes above are ring slots, and these
+     * flip every time they wrap around the ring.
+     */
+    bool last_avail_wrap_counter;
+    bool used_wrap_counter;
+    VRingPackedUsedElem *used_elems;
+
     /* Last used index value we have signalled on */
     uint16_t signalled_used;
 
@@ -101,14 +150,43 @@ struct VirtQueue
     VirtIODevice *vdev;
     EventNotifier guest_notifier;
     EventNotifier host_notifier;
+    VirtQueueElementPool *elem_pool;
     QLIST_ENTRY(VirtQueue) node;
 };
 
+/* Elements freed by the device are kept for the next virtqueue_pop(), up to
+ * the queue size. The pool outlives the queue while elements are in flight.
+ */
+struct VirtQueueElementPool {
+    QemuSpin lock;
+    /* The queue, until it goes away, and each element in flight */
+    unsigned int refcnt;
+    unsigned int max;
+    unsigned int num;
+    QSLIST_HEAD(, VirtQueueElement) free;
+    VirtQueueElementCtor *ctor;
+    void *opaque;
+};
+
+static inline bool virtio_queue_packed(VirtQueue *vq)
+{
+    return virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED);
+}
+
+/* The rings of all the queues of VDEV must be translated again, because
+ * their address or the memory map changed.
+ */
+static void virtio_invalidate_rings(VirtIODevice *vdev)
+{
+    atomic_inc(&vdev->vring_gen);
+}
+
 /* virt queue functions */
 void virtio_queue_update_rings(VirtIODevice *vdev, int n)
 {
     VRing *vring = &vdev->vq[n].vring;
 
+    virtio_invalidate_rings(vdev);
     if (!vring->desc) {
         /* not yet setup -> nothing to do */
         return;
@@ -119,37 +197,254 @@ void virtio_queue_update_rings(VirtIODevice *vdev, int n)
                               vring->align);
 }
 
-static void vring_desc_read(VirtIODevice *vdev, VRingDesc *desc,
+static void vring_map(VRingMap *map, hwaddr pa, hwaddr len, bool is_write)
+{
+    MemoryRegion *mr;
+    hwaddr xlat, l = len;
+
+    if (!pa || !len || xen_enabled()) {
+        return;
+    }
+
+    rcu_read_lock();
+    mr = address_space_translate(&address_space_memory, pa, &xlat, &l,
+                                 is_write);
+    if (l == len && memory_access_is_direct(mr, is_write)) {
+        memory_region_ref(mr);
+        map->mr = mr;
+        map->offset = xlat;
+        map->ptr = qemu_map_ram_ptr(mr->ram_block, xlat);
+    }
+    rcu_read_unlock();
+}
+
+static void vring_unmap(VRingMap *map)
+{
+    if (map->mr) {
+        memory_region_unref(map->mr);
+    }
+    map->mr = NULL;
+    map->ptr = NULL;
+}
+
+static void vring_cache_unmap(VirtQueue *vq)
+{
+    vring_unmap(&vq->cache.desc);
+    vring_unmap(&vq->cache.avail);
+    vring_unmap(&vq->cache.used);
+}
+
+/* Translate the rings of VQ once, and again only after virtio_invalidate_rings.
+ * The rings are then accessed with host loads and stores.  A ring that does
+ * not sit in a single RAM region stays unmapped and goes through
+ * address_space_memory.
+ *
+ * Only the thread that processes VQ maps its rings, others just bump the
+ * generation.
+ */
+static VRingCache *vring_cache(VirtQueue *vq)
+{
+    VRingCache *c = &vq->cache;
+    unsigned gen = atomic_read(&vq->vdev->vring_gen);
+    unsigned num = vq->vring.num;
+
+    if (likely(c->gen == gen)) {
+        return c;
+    }
+
+    vring_cache_unmap(vq);
+    if (virtio_queue_packed(vq)) {
+        /* The device writes used descriptors back into the ring */
+        vring_map(&c->desc, vq->vring.desc, num * sizeof(VRingPackedDesc),
+                  true);
+        vring_map(&c->avail, vq->vring.avail, sizeof(VRingPackedDescEvent),
+                  false);
+        vring_map(&c->used, vq->vring.used, sizeof(VRingPackedDescEvent),
+                  true);
+    } else {
+        vring_map(&c->desc, vq->vring.desc, num * sizeof(VRingDesc), false);
+        vring_map(&c->avail, vq->vring.avail,
+                  offsetof(VRingAvail, ring[num]) + sizeof(uint16_t), false);
+        vring_map(&c->used, vq->vring.used,
+                  offsetof(VRingUsed, ring[num]) + sizeof(uint16_t), true);
+    }
+    c->gen = gen;
+    return c;
+}
+
+static inline uint16_t vring_lduw(VirtQueue *vq, VRingMap *map, hwaddr pa,
+                                  hwaddr off)
+{
+    if (map->ptr) {
+        return virtio_lduw_p(vq->vdev, map->ptr + off);
+    }
+    return virtio_lduw_phys(vq->vdev, pa + off);
+}
+
+static inline void vring_stw(VirtQueue *vq, VRingMap *map, hwaddr pa,
+                             hwaddr off, uint16_t val)
+{
+    if (map->ptr) {
+        virtio_stw_p(vq->vdev, map->ptr + off, val);
+        memory_region_set_dirty(map->mr, map->offset + off, sizeof(val));
+    } else {
+        virtio_stw_phys(vq->vdev, pa + off, val);
+    }
+}
+
+static inline void vring_stl(VirtQueue *vq, VRingMap *map, hwaddr pa,
+                             hwaddr off, uint32_t val)
+{
+    if (map->ptr) {
+        virtio_stl_p(vq->vdev, map->ptr + off, val);
+        memory_region_set_dirty(map->mr, map->offset + off, sizeof(val));
+    } else {
+        virtio_stl_phys(vq->vdev, pa + off, val);
+    }
+}
+
+static void vring_desc_read(VirtQueue *vq, VRingDesc *desc,
                             hwaddr desc_pa, int i)
 {
-    address_space_read(&address_space_memory, desc_pa + i * sizeof(VRingDesc),
-                       MEMTXATTRS_UNSPECIFIED, (void *)desc, sizeof(VRingDesc));
+    VirtIODevice *vdev = vq->vdev;
+    VRingCache *c = vring_cache(vq);
+
+    /* Indirect tables are not cached */
+    if (desc_pa == vq->vring.desc && c->desc.ptr) {
+        memcpy(desc, c->desc.ptr + i * sizeof(VRingDesc), sizeof(VRingDesc));
+    } else {
+        address_space_read(&address_space_memory,
+                           desc_pa + i * sizeof(VRingDesc),
+                           MEMTXATTRS_UNSPECIFIED, (void *)desc,
+                           sizeof(VRingDesc));
+    }
     virtio_tswap64s(vdev, &desc->addr);
     virtio_tswap32s(vdev, &desc->len);
     virtio_tswap16s(vdev, &desc->flags);
     virtio_tswap16s(vdev, &desc->next);
 }
 
+static void vring_packed_desc_read(VirtQueue *vq, VRingPackedDesc *desc,
+                                   hwaddr desc_pa, int i)
+{
+    VirtIODevice *vdev = vq->vdev;
+    VRingCache *c = vring_cache(vq);
+
+    if (desc_pa == vq->vring.desc && c->desc.ptr) {
+        memcpy(desc, c->desc.ptr + i * sizeof(VRingPackedDesc),
+               sizeof(VRingPackedDesc));
+    } else {
+        address_space_read(&address_space_memory,
+                           desc_pa + i * sizeof(VRingPackedDesc),
+                           MEMTXATTRS_UNSPECIFIED, (void *)desc,
+                           sizeof(VRingPackedDesc));
+    }
+    virtio_tswap64s(vdev, &desc->addr);
+    virtio_tswap32s(vdev, &desc->len);
+    virtio_tswap16s(vdev, &desc->id);
+    virtio_tswap16s(vdev, &desc->flags);
+}
+
+static inline uint16_t vring_packed_desc_flags(VirtQueue *vq, int i)
+{
+    return vring_lduw(vq, &vring_cache(vq)->desc, vq->vring.desc,
+                      i * sizeof(VRingPackedDesc) +
+                      offsetof(VRingPackedDesc, flags));
+}
+
+/* Write a used descriptor at slot I of the ring.  The flags hand it over
+ * to the driver, so with STRICT_ORDER they are written last.
+ */
+static void vring_packed_desc_write(VirtQueue *vq, VRingPackedDesc *desc,
+                                    int i, bool strict_order)
+{
+    VRingMap *map = &vring_cache(vq)->desc;
+    hwaddr off = i * sizeof(VRingPackedDesc);
+
+    vring_stw(vq, map, vq->vring.desc, off + offsetof(VRingPackedDesc, id),
+              desc->id);
+    vring_stl(vq, map, vq->vring.desc, off + offsetof(VRingPackedDesc, len),
+              desc->len);
+    if (strict_order) {
+        smp_wmb();
+    }
+    vring_stw(vq, map, vq->vring.desc, off + offsetof(VRingPackedDesc, flags),
+              desc->flags);
+}
+
+static inline bool vring_packed_desc_avail(uint16_t flags, bool wrap_counter)
+{
+    bool avail = flags & (1 << VRING_PACKED_DESC_F_AVAIL);
+    bool used = flags & (1 << VRING_PACKED_DESC_F_USED);
+
+    return avail != used && avail == wrap_counter;
+}
+
+/* Driver event suppression, in the area that holds the avail ring of a split
+ * virtqueue.
+ */
+static void vring_packed_event_read(VirtQueue *vq, VRingPackedDescEvent *e)
+{
+    VRingMap *map = &vring_cache(vq)->avail;
+
+    e->flags = vring_lduw(vq, map, vq->vring.avail,
+                          offsetof(VRingPackedDescEvent, flags));
+    /* Make sure off_wrap is read after flags */
+    smp_rmb();
+    e->off_wrap = vring_lduw(vq, map, vq->vring.avail,
+                             offsetof(VRingPackedDescEvent, off_wrap));
+}
+
+/* Device event suppression, in the area that holds the used ring of a split
+ * virtqueue.
+ */
+static inline void vring_packed_set_avail_event(VirtQueue *vq)
+{
+    if (!vq->notification) {
+        return;
+    }
+    vring_stw(vq, &vring_cache(vq)->used, vq->vring.used,
+              offsetof(VRingPackedDescEvent, off_wrap),
+              vq->last_avail_idx |
+              vq->last_avail_wrap_counter << VRING_PACKED_EVENT_F_WRAP_CTR);
+}
+
+static void virtio_queue_packed_set_notification(VirtQueue *vq, int enable)
+{
+    uint16_t flags = VRING_PACKED_EVENT_FLAG_DISABLE;
+
+    if (enable) {
+        if (virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+            vring_packed_set_avail_event(vq);
+            /* Make sure off_wrap is written before flags */
+            smp_wmb();
+            flags = VRING_PACKED_EVENT_FLAG_DESC;
+        } else {
+            flags = VRING_PACKED_EVENT_FLAG_ENABLE;
+        }
+    }
+    vring_stw(vq, &vring_cache(vq)->used, vq->vring.used,
+              offsetof(VRingPackedDescEvent, flags), flags);
+}
+
 static inline uint16_t vring_avail_flags(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, flags);
-    return virtio_lduw_phys(vq->vdev, pa);
+    return vring_lduw(vq, &vring_cache(vq)->avail, vq->vring.avail,
+                      offsetof(VRingAvail, flags));
 }
 
 static inline uint16_t vring_avail_idx(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, idx);
-    vq->shadow_avail_idx = virtio_lduw_phys(vq->vdev, pa);
+    vq->shadow_avail_idx = vring_lduw(vq, &vring_cache(vq)->avail,
+                                      vq->vring.avail,
+                                      offsetof(VRingAvail, idx));
     return vq->shadow_avail_idx;
 }
 
 static inline uint16_t vring_avail_ring(VirtQueue *vq, int i)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, ring[i]);
-    return virtio_lduw_phys(vq->vdev, pa);
+    return vring_lduw(vq, &vring_cache(vq)->avail, vq->vring.avail,
+                      offsetof(VRingAvail, ring[i]));
 }
 
 static inline uint16_t vring_get_used_event(VirtQueue *vq)
@@ -160,59 +455,68 @@ static inline uint16_t vring_get_used_event(VirtQueue *vq)
 static inline void vring_used_write(VirtQueue *vq, VRingUsedElem *uelem,
                                     int i)
 {
-    hwaddr pa;
+    VRingMap *map = &vring_cache(vq)->used;
+    hwaddr off = offsetof(VRingUsed, ring[i]);
+
     virtio_tswap32s(vq->vdev, &uelem->id);
     virtio_tswap32s(vq->vdev, &uelem->len);
-    pa = vq->vring.used + offsetof(VRingUsed, ring[i]);
-    address_space_write(&address_space_memory, pa, MEMTXATTRS_UNSPECIFIED,
-                       (void *)uelem, sizeof(VRingUsedElem));
+    if (map->ptr) {
+        memcpy(map->ptr + off, uelem, sizeof(VRingUsedElem));
+        memory_region_set_dirty(map->mr, map->offset + off,
+                                sizeof(VRingUsedElem));
+    } else {
+        address_space_write(&address_space_memory, vq->vring.used + off,
+                            MEMTXATTRS_UNSPECIFIED, (void *)uelem,
+                            sizeof(VRingUsedElem));
+    }
 }
 
 static uint16_t vring_used_idx(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, idx);
-    return virtio_lduw_phys(vq->vdev, pa);
+    return vring_lduw(vq, &vring_cache(vq)->used, vq->vring.used,
+                      offsetof(VRingUsed, idx));
 }
 
 static inline void vring_used_idx_set(VirtQueue *vq, uint16_t val)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, idx);
-    virtio_stw_phys(vq->vdev, pa, val);
+    vring_stw(vq, &vring_cache(vq)->used, vq->vring.used,
+              offsetof(VRingUsed, idx), val);
     vq->used_idx = val;
 }
 
 static inline void vring_used_flags_set_bit(VirtQueue *vq, int mask)
 {
-    VirtIODevice *vdev = vq->vdev;
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, flags);
-    virtio_stw_phys(vdev, pa, virtio_lduw_phys(vdev, pa) | mask);
+    VRingMap *map = &vring_cache(vq)->used;
+    hwaddr off = offsetof(VRingUsed, flags);
+
+    vring_stw(vq, map, vq->vring.used, off,
+              vring_lduw(vq, map, vq->vring.used, off) | mask);
 }
 
 static inline void vring_used_flags_unset_bit(VirtQueue *vq, int mask)
 {
-    VirtIODevice *vdev = vq->vdev;
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, flags);
-    virtio_stw_phys(vdev, pa, virtio_lduw_phys(vdev, pa) & ~mask);
+    VRingMap *map = &vring_cache(vq)->used;
+    hwaddr off = offsetof(VRingUsed, flags);
+
+    vring_stw(vq, map, vq->vring.used, off,
+              vring_lduw(vq, map, vq->vring.used, off) & ~mask);
 }
 
 static inline void vring_set_avail_event(VirtQueue *vq, uint16_t val)
 {
-    hwaddr pa;
     if (!vq->notification) {
         return;
     }
-    pa = vq->vring.used + offsetof(VRingUsed, ring[vq->vring.num]);
-    virtio_stw_phys(vq->vdev, pa, val);
+    vring_stw(vq, &vring_cache(vq)->used, vq->vring.used,
+              offsetof(VRingUsed, ring[vq->vring.num]), val);
 }
 
 void virtio_queue_set_notification(VirtQueue *vq, int enable)
 {
     vq->notification = enable;
-    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+    if (virtio_queue_packed(vq)) {
+        virtio_queue_packed_set_notification(vq, enable);
+    } else if (virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
         vring_set_avail_event(vq, vring_avail_idx(vq));
     } else if (enable) {
         vring_used_flags_unset_bit(vq, VRING_USED_F_NO_NOTIFY);
@@ -234,6 +538,12 @@ int virtio_queue_ready(VirtQueue *vq)
  * guest has added some buffers. */
 int virtio_queue_empty(VirtQueue *vq)
 {
+    if (virtio_queue_packed(vq)) {
+        uint16_t flags = vring_packed_desc_flags(vq, vq->last_avail_idx);
+
+        return !vring_packed_desc_avail(flags, vq->last_avail_wrap_counter);
+    }
+
     if (vq->shadow_avail_idx != vq->last_avail_idx) {
         return 0;
     }
@@ -267,7 +577,25 @@ static void virtqueue_unmap_sg(VirtQueue *vq, const VirtQueueElement *elem,
 void virtqueue_discard(VirtQueue *vq, const VirtQueueElement *elem,
                        unsigned int len)
 {
-    vq->last_avail_idx--;
+    if (virtio_queue_packed(vq)) {
+        if (vq->last_avail_idx < elem->ndescs) {
+            vq->last_avail_idx += vq->vring.num;
+            vq->last_avail_wrap_counter ^= 1;
+        }
+        vq->last_avail_idx -= elem->ndescs;
+    } else {
+        vq->last_avail_idx--;
+    }
+    vq->inuse--;
+    virtqueue_unmap_sg(vq, elem, len);
+}
+
+/* Forget ELEM without returning it to the guest, e.g. on reset while a
+ * backend still holds its buffers.
+ */
+void virtqueue_detach_element(VirtQueue *vq, const VirtQueueElement *elem,
+                              unsigned int len)
+{
     vq->inuse--;
     virtqueue_unmap_sg(vq, elem, len);
 }
@@ -281,6 +609,15 @@ void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
 
     virtqueue_unmap_sg(vq, elem, len);
 
+    if (virtio_queue_packed(vq)) {
+        /* Written to the ring by virtqueue_flush, see there */
+        assert(idx < vq->vring.num);
+        vq->used_elems[idx].index = elem->index;
+        vq->used_elems[idx].len = len;
+        vq->used_elems[idx].ndescs = elem->ndescs;
+        return;
+    }
+
     idx = (idx + vq->used_idx) % vq->vring.num;
 
     uelem.id = elem->index;
@@ -288,12 +625,69 @@ void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
     vring_used_write(vq, &uelem, idx);
 }
 
+static void vring_packed_used_write(VirtQueue *vq, VRingPackedUsedElem *uelem,
+                                    unsigned int head, bool wrap_counter,
+                                    bool strict_order)
+{
+    VRingPackedDesc desc = {
+        .id = uelem->index,
+        .len = uelem->len,
+    };
+
+    if (uelem->len) {
+        desc.flags |= VRING_DESC_F_WRITE;
+    }
+    if (wrap_counter) {
+        desc.flags |= (1 << VRING_PACKED_DESC_F_AVAIL) |
+                      (1 << VRING_PACKED_DESC_F_USED);
+    }
+    vring_packed_desc_write(vq, &desc, head, strict_order);
+}
+
+/* Completions go back into the slots the buffers were taken from.  The driver
+ * polls the first one, so it is written last and publishes the whole batch.
+ */
+static void virtqueue_packed_flush(VirtQueue *vq, unsigned int count)
+{
+    unsigned int i, head;
+    bool wrap_counter = vq->used_wrap_counter;
+
+    if (!count) {
+        return;
+    }
+
+    head = vq->used_idx + vq->used_elems[0].ndescs;
+    for (i = 1; i < count; i++) {
+        if (head >= vq->vring.num) {
+            head -= vq->vring.num;
+            wrap_counter ^= 1;
+        }
+        vring_packed_used_write(vq, &vq->used_elems[i], head, wrap_counter,
+                                false);
+        head += vq->used_elems[i].ndescs;
+    }
+    vring_packed_used_write(vq, &vq->used_elems[0], vq->used_idx,
+                            vq->used_wrap_counter, true);
+
+    vq->inuse -= count;
+    if (head >= vq->vring.num) {
+        head -= vq->vring.num;
+        wrap_counter ^= 1;
+    }
+    vq->used_idx = head;
+    vq->used_wrap_counter = wrap_counter;
+}
+
 void virtqueue_flush(VirtQueue *vq, unsigned int count)
 {
     uint16_t old, new;
     /* Make sure buffer is written before we update index. */
     smp_wmb();
     trace_virtqueue_flush(vq, count);
+    if (virtio_queue_packed(vq)) {
+        virtqueue_packed_flush(vq, count);
+        return;
+    }
     old = vq->used_idx;
     new = old + count;
     vring_used_idx_set(vq, new);
@@ -345,7 +739,7 @@ static unsigned int virtqueue_get_head(VirtQueue *vq, unsigned int idx)
     return head;
 }
 
-static unsigned virtqueue_read_next_desc(VirtIODevice *vdev, VRingDesc *desc,
+static unsigned virtqueue_read_next_desc(VirtQueue *vq, VRingDesc *desc,
                                          hwaddr desc_pa, unsigned int max)
 {
     unsigned int next;
@@ -365,10 +759,97 @@ static unsigned virtqueue_read_next_desc(VirtIODevice *vdev, VRingDesc *desc,
         exit(1);
     }
 
-    vring_desc_read(vdev, desc, desc_pa, next);
+    vring_desc_read(vq, desc, desc_pa, next);
     return next;
 }
 
+static void virtqueue_packed_get_avail_bytes(VirtQueue *vq,
+                                             unsigned int *in_total,
+                                             unsigned int *out_total,
+                                             unsigned max_in_bytes,
+                                             unsigned max_out_bytes)
+{
+    unsigned int idx = vq->last_avail_idx;
+    unsigned int total_bufs = 0;
+    bool wrap_counter = vq->last_avail_wrap_counter;
+
+    while (total_bufs < vq->vring.num) {
+        unsigned int max, num_bufs, i;
+        bool indirect = false;
+        VRingPackedDesc desc;
+        hwaddr desc_pa;
+
+        if (!vring_packed_desc_avail(vring_packed_desc_flags(vq, idx),
+                                     wrap_counter)) {
+            break;
+        }
+        /* Read the descriptor only after its flags */
+        smp_rmb();
+
+        max = vq->vring.num;
+        num_bufs = 0;
+        i = idx;
+        desc_pa = vq->vring.desc;
+        vring_packed_desc_read(vq, &desc, desc_pa, i);
+
+        if (desc.flags & VRING_DESC_F_INDIRECT) {
+            if (desc.len % sizeof(VRingPackedDesc)) {
+                error_report("Invalid size for indirect buffer table");
+                exit(1);
+            }
+
+            /* loop over the indirect descriptor table */
+            indirect = true;
+            max = desc.len / sizeof(VRingPackedDesc);
+            desc_pa = desc.addr;
+            i = 0;
+            vring_packed_desc_read(vq, &desc, desc_pa, i);
+        }
+
+        for (;;) {
+            /* If we've got too many, that implies a descriptor loop. */
+            if (++num_bufs > max) {
+                error_report("Looped descriptor");
+                exit(1);
+            }
+
+            if (desc.flags & VRING_DESC_F_WRITE) {
+                *in_total += desc.len;
+            } else {
+                *out_total += desc.len;
+            }
+            if (*in_total >= max_in_bytes && *out_total >= max_out_bytes) {
+                return;
+            }
+
+            /* A chain follows the ring order; an indirect table has no
+             * flags to chain, it ends with the table.
+             */
+            if (indirect) {
+                if (++i == max) {
+                    break;
+                }
+            } else {
+                if (!(desc.flags & VRING_DESC_F_NEXT)) {
+                    break;
+                }
+                if (++i == vq->vring.num) {
+                    i = 0;
+                }
+            }
+            vring_packed_desc_read(vq, &desc, desc_pa, i);
+        }
+
+        num_bufs = indirect ? 1 : num_bufs;
+        total_bufs += num_bufs;
+        idx += num_bufs;
+        if (idx >= vq->vring.num) {
+            idx -= vq->vring.num;
+            wrap_counter ^= 1;
+        }
+    }
+}
+
 void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
                                unsigned int *out_bytes,
                                unsigned max_in_bytes, unsigned max_out_bytes)
@@ -379,6 +860,12 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
     idx = vq->last_avail_idx;
 
     total_bufs = in_total = out_total = 0;
+    if (virtio_queue_packed(vq)) {
+        virtqueue_packed_get_avail_bytes(vq, &in_total, &out_total,
+                                         max_in_bytes, max_out_bytes);
+        goto done;
+    }
+
     while (virtqueue_num_heads(vq, idx)) {
         VirtIODevice *vdev = vq->vdev;
         unsigned int max, num_bufs, indirect = 0;
@@ -390,7 +877,7 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
         num_bufs = total_bufs;
         i = virtqueue_get_head(vq, idx++);
         desc_pa = vq->vring.desc;
-        vring_desc_read(vdev, &desc, desc_pa, i);
+        vring_desc_read(vq, &desc, desc_pa, i);
 
         if (desc.flags & VRING_DESC_F_INDIRECT) {
             if (desc.len % sizeof(VRingDesc)) {
@@ -409,7 +896,7 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
             max = desc.len / sizeof(VRingDesc);
             desc_pa = desc.addr;
             num_bufs = i = 0;
-            vring_desc_read(vdev, &desc, desc_pa, i);
+            vring_desc_read(vq, &desc, desc_pa, i);
         }
 
         do {
@@ -427,7 +914,7 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
             if (in_total >= max_in_bytes && out_total >= max_out_bytes) {
                 goto done;
             }
-        } while ((i = virtqueue_read_next_desc(vdev, &desc, desc_pa, max)) != max);
+        } while ((i = virtqueue_read_next_desc(vq, &desc, desc_pa, max)) != max);
 
         if (!indirect)
             total_bufs = num_bufs;
@@ -524,9 +1011,12 @@ void virtqueue_map(VirtQueueElement *elem)
                         VIRTQUEUE_MAX_SIZE, 0);
 }
 
-void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_num)
+/* Lay out the arrays of ELEM after its SZ bytes header, if ELEM is set.
+ * Return the size of the whole element.
+ */
+static size_t virtqueue_init_element(VirtQueueElement *elem, size_t sz,
+                                     unsigned out_num, unsigned in_num)
 {
-    VirtQueueElement *elem;
     size_t in_addr_ofs = QEMU_ALIGN_UP(sz, __alignof__(elem->in_addr[0]));
     size_t out_addr_ofs = in_addr_ofs + in_num * sizeof(elem->in_addr[0]);
     size_t out_addr_end = out_addr_ofs + out_num * sizeof(elem->out_addr[0]);
@@ -535,13 +1025,258 @@ void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_num)
     size_t out_sg_end = out_sg_ofs + out_num * sizeof(elem->out_sg[0]);
 
     assert(sz >= sizeof(VirtQueueElement));
-    elem = g_malloc(out_sg_end);
-    elem->out_num = out_num;
-    elem->in_num = in_num;
-    elem->in_addr = (void *)elem + in_addr_ofs;
-    elem->out_addr = (void *)elem + out_addr_ofs;
-    elem->in_sg = (void *)elem + in_sg_ofs;
-    elem->out_sg = (void *)elem + out_sg_ofs;
+    if (elem) {
+        elem->ndescs = 1;
+        elem->out_num = out_num;
+        elem->in_num = in_num;
+        elem->in_addr = (void *)elem + in_addr_ofs;
+        elem->out_addr = (void *)elem + out_addr_ofs;
+        elem->in_sg = (void *)elem + in_sg_ofs;
+        elem->out_sg = (void *)elem + out_sg_ofs;
+    }
+    return out_sg_end;
+}
+
+void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_num)
+{
+    VirtQueueElement *elem;
+
+    elem = g_malloc(virtqueue_init_element(NULL, sz, out_num, in_num));
+    elem->pool = NULL;
+    virtqueue_init_element(elem, sz, out_num, in_num);
+    return elem;
+}
+
+/* Take an element from the pool of VQ, if it has one and the cached
+ * element is large enough for the chain.
+ */
+static void *virtqueue_get_element(VirtQueue *vq, size_t sz,
+                                   unsigned out_num, unsigned in_num)
+{
+    VirtQueueElementPool *pool = vq->elem_pool;
+    VirtQueueElement *elem, *stale = NULL;
+    size_t size;
+
+    if (!pool) {
+        return virtqueue_alloc_element(sz, out_num, in_num);
+    }
+
+    size = virtqueue_init_element(NULL, sz, out_num, in_num);
+    qemu_spin_lock(&pool->lock);
+    elem = QSLIST_FIRST(&pool->free);
+    if (elem) {
+        QSLIST_REMOVE_HEAD(&pool->free, pool_next);
+        pool->num--;
+        if (elem->alloc_size < size) {
+            stale = elem;
+            elem = NULL;
+        }
+    }
+    pool->refcnt++;
+    qemu_spin_unlock(&pool->lock);
+
+    g_free(stale);
+    if (!elem) {
+        /* Round up so that the element fits most of the later chains */
+        size = pow2ceil(size);
+        elem = g_malloc(size);
+        elem->pool = pool;
+        elem->alloc_size = size;
+        if (pool->ctor) {
+            pool->ctor(elem, pool->opaque);
+        }
+    }
+    virtqueue_init_element(elem, sz, out_num, in_num);
+    return elem;
+}
+
+void virtqueue_free_element(void *elem_ptr)
+{
+    VirtQueueElement *elem = elem_ptr;
+    VirtQueueElementPool *pool = elem->pool;
+    bool last;
+
+    if (!pool) {
+        g_free(elem);
+        return;
+    }
+
+    qemu_spin_lock(&pool->lock);
+    if (pool->num < pool->max) {
+        QSLIST_INSERT_HEAD(&pool->free, elem, pool_next);
+        pool->num++;
+        elem = NULL;
+    }
+    last = --pool->refcnt == 0;
+    qemu_spin_unlock(&pool->lock);
+
+    g_free(elem);
+    if (last) {
+        g_free(pool);
+    }
+}
+
+void virtio_queue_set_element_pool(VirtQueue *vq, VirtQueueElementCtor *ctor,
+                                   void *opaque)
+{
+    VirtQueueElementPool *pool;
+
+    assert(!vq->elem_pool && vq->vring.num);
+    pool = g_new0(VirtQueueElementPool, 1);
+    qemu_spin_init(&pool->lock);
+    pool->refcnt = 1;
+    pool->max = vq->vring.num;
+    QSLIST_INIT(&pool->free);
+    pool->ctor = ctor;
+    pool->opaque = opaque;
+    vq->elem_pool = pool;
+}
+
+/* Drop the cached elements, the ones in flight are freed when they come
+ * back.
+ */
+static void virtio_queue_release_element_pool(VirtQueue *vq)
+{
+    VirtQueueElementPool *pool = vq->elem_pool;
+    VirtQueueElement *elem, *next;
+    bool last;
+
+    if (!pool) {
+        return;
+    }
+    vq->elem_pool = NULL;
+
+    qemu_spin_lock(&pool->lock);
+    elem = QSLIST_FIRST(&pool->free);
+    QSLIST_INIT(&pool->free);
+    pool->num = pool->max = 0;
+    last = --pool->refcnt == 0;
+    qemu_spin_unlock(&pool->lock);
+
+    for (; elem; elem = next) {
+        next = QSLIST_NEXT(elem, pool_next);
+        g_free(elem);
+    }
+    if (last) {
+        g_free(pool);
+    }
+}
+
+/* A packed virtqueue has no avail ring: the descriptors are taken in ring
+ * order, and the driver hands each one over with its flags.
+ */
+static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
+{
+    unsigned int i, max, ndescs = 0;
+    hwaddr desc_pa = vq->vring.desc;
+    VirtIODevice *vdev = vq->vdev;
+    VirtQueueElement *elem;
+    unsigned out_num, in_num;
+    hwaddr addr[VIRTQUEUE_MAX_SIZE];
+    struct iovec iov[VIRTQUEUE_MAX_SIZE];
+    VRingPackedDesc desc;
+    bool indirect = false;
+    uint16_t id;
+
+    if (virtio_queue_empty(vq)) {
+        return NULL;
+    }
+    /* Read the descriptors only after the flags of the first one */
+    smp_rmb();
+
+    /* When we start there are none of either input nor output. */
+    out_num = in_num = 0;
+
+    max = vq->vring.num;
+
+    if (vq->inuse >= vq->vring.num) {
+        error_report("Virtqueue size exceeded");
+        exit(1);
+    }
+
+    i = vq->last_avail_idx;
+    vring_packed_desc_read(vq, &desc, desc_pa, i);
+    id = desc.id;
+    if (desc.flags & VRING_DESC_F_INDIRECT) {
+        if (desc.len % sizeof(VRingPackedDesc)) {
+            error_report("Invalid size for indirect buffer table");
+            exit(1);
+        }
+
+        /* loop over the indirect descriptor table */
+        indirect = true;
+        ndescs = 1;
+        max = desc.len / sizeof(VRingPackedDesc);
+        desc_pa = desc.addr;
+        i = 0;
+        vring_packed_desc_read(vq, &desc, desc_pa, i);
+    }
+
+    /* Collect all the descriptors */
+    for (;;) {
+        if (desc.flags & VRING_DESC_F_WRITE) {
+            virtqueue_map_desc(&in_num, addr + out_num, iov + out_num,
+                               VIRTQUEUE_MAX_SIZE - out_num, true, desc.addr, desc.len);
+        } else {
+            if (in_num) {
+                error_report("Incorrect order for descriptors");
+                exit(1);
+            }
+            virtqueue_map_desc(&out_num, addr, iov,
+                               VIRTQUEUE_MAX_SIZE, false, desc.addr, desc.len);
+        }
+
+        /* If we've got too many, that implies a descriptor loop. */
+        if ((in_num + out_num) > max) {
+            error_report("Looped descriptor");
+            exit(1);
+        }
+
+        if (indirect) {
+            if (++i == max) {
+                break;
+            }
+        } else {
+            /* The buffer id is in the last descriptor of the chain */
+            id = desc.id;
+            if (++ndescs > max) {
+                error_report("Looped descriptor");
+                exit(1);
+            }
+            if (!(desc.flags & VRING_DESC_F_NEXT)) {
+                break;
+            }
+            if (++i == vq->vring.num) {
+                i = 0;
+            }
+        }
+        vring_packed_desc_read(vq, &desc, desc_pa, i);
+    }
+
+    /* Now copy what we have collected and mapped */
+    elem = virtqueue_get_element(vq, sz, out_num, in_num);
+    elem->index = id;
+    elem->ndescs = ndescs;
+    for (i = 0; i < out_num; i++) {
+        elem->out_addr[i] = addr[i];
+        elem->out_sg[i] = iov[i];
+    }
+    for (i = 0; i < in_num; i++) {
+        elem->in_addr[i] = addr[out_num + i];
+        elem->in_sg[i] = iov[out_num + i];
+    }
+
+    vq->last_avail_idx += ndescs;
+    if (vq->last_avail_idx >= vq->vring.num) {
+        vq->last_avail_idx -= vq->vring.num;
+        vq->last_avail_wrap_counter ^= 1;
+    }
+    if (virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_packed_set_avail_event(vq);
+    }
+    vq->inuse++;
+
+    trace_virtqueue_pop(vq, elem, elem->in_num, elem->out_num);
     return elem;
 }
 
@@ -556,6 +1291,10 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
     struct iovec iov[VIRTQUEUE_MAX_SIZE];
     VRingDesc desc;
 
+    if (virtio_queue_packed(vq)) {
+        return virtqueue_packed_pop(vq, sz);
+    }
+
     if (virtio_queue_empty(vq)) {
         return NULL;
     }
@@ -578,7 +1317,7 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
         vring_set_avail_event(vq, vq->last_avail_idx);
     }
 
-    vring_desc_read(vdev, &desc, desc_pa, i);
+    vring_desc_read(vq, &desc, desc_pa, i);
     if (desc.flags & VRING_DESC_F_INDIRECT) {
         if (desc.len % sizeof(VRingDesc)) {
             error_report("Invalid size for indirect buffer table");
@@ -589,7 +1328,7 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
         max = desc.len / sizeof(VRingDesc);
         desc_pa = desc.addr;
         i = 0;
-        vring_desc_read(vdev, &desc, desc_pa, i);
+        vring_desc_read(vq, &desc, desc_pa, i);
     }
 
     /* Collect all the descriptors */
@@ -611,10 +1350,10 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
             error_report("Looped descriptor");
             exit(1);
         }
-    } while ((i = virtqueue_read_next_desc(vdev, &desc, desc_pa, max)) != max);
+    } while ((i = virtqueue_read_next_desc(vq, &desc, desc_pa, max)) != max);
 
     /* Now copy what we have collected and mapped */
-    elem = virtqueue_alloc_element(sz, out_num, in_num);
+    elem = virtqueue_get_element(vq, sz, out_num, in_num);
     elem->index = head;
     for (i = 0; i < out_num; i++) {
         elem->out_addr[i] = addr[i];
@@ -810,13 +1549,17 @@ void virtio_reset(void *opaque)
     vdev->config_vector = VIRTIO_NO_VECTOR;
     virtio_notify_vector(vdev, vdev->config_vector);
 
+    virtio_invalidate_rings(vdev);
     for(i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+        vring_cache_unmap(&vdev->vq[i]);
         vdev->vq[i].vring.desc = 0;
         vdev->vq[i].vring.avail = 0;
         vdev->vq[i].vring.used = 0;
         vdev->vq[i].last_avail_idx = 0;
         vdev->vq[i].shadow_avail_idx = 0;
         vdev->vq[i].used_idx = 0;
+        vdev->vq[i].last_avail_wrap_counter = true;
+        vdev->vq[i].used_wrap_counter = true;
         virtio_queue_set_vector(vdev, i, VIRTIO_NO_VECTOR);
         vdev->vq[i].signalled_used = 0;
         vdev->vq[i].signalled_used_valid = false;
@@ -1031,6 +1774,7 @@ void virtio_queue_set_rings(VirtIODevice *vdev, int n, hwaddr desc,
     vdev->vq[n].vring.desc = desc;
     vdev->vq[n].vring.avail = avail;
     vdev->vq[n].vring.used = used;
+    virtio_invalidate_rings(vdev);
 }
 
 void virtio_queue_set_num(VirtIODevice *vdev, int n, int num)
@@ -1044,6 +1788,7 @@ void virtio_queue_set_num(VirtIODevice *vdev, int n, int num)
         return;
     }
     vdev->vq[n].vring.num = num;
+    virtio_invalidate_rings(vdev);
 }
 
 VirtQueue *virtio_vector_first_queue(VirtIODevice *vdev, uint16_t vector)
@@ -1162,6 +1907,7 @@ static VirtQueue *virtio_add_queue_internal(VirtIODevice *vdev, int queue_size,
     vdev->vq[i].handle_output = handle_output;
     vdev->vq[i].handle_aio_output = NULL;
     vdev->vq[i].use_aio = use_aio;
+    vdev->vq[i].used_elems = g_new0(VRingPackedUsedElem, VIRTQUEUE_MAX_SIZE);
 
     return &vdev->vq[i];
 }
@@ -1191,6 +1937,9 @@ void virtio_del_queue(VirtIODevice *vdev, int n)
 
     vdev->vq[n].vring.num = 0;
     vdev->vq[n].vring.num_default = 0;
+    virtio_queue_release_element_pool(&vdev->vq[n]);
+    g_free(vdev->vq[n].used_elems);
+    vdev->vq[n].used_elems = NULL;
 }
 
 void virtio_irq(VirtQueue *vq)
@@ -1200,6 +1949,45 @@ void virtio_irq(VirtQueue *vq)
     virtio_notify_vector(vq->vdev, vq->vector);
 }
 
+static bool vring_packed_need_event(VirtQueue *vq, bool wrap,
+                                    uint16_t off_wrap, uint16_t new,
+                                    uint16_t old)
+{
+    int off = off_wrap & ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR);
+
+    /* Compare the event with indexes that do not wrap at the ring size */
+    if (wrap != off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR) {
+        off -= vq->vring.num;
+    }
+    if (old > new) {
+        old -= vq->vring.num;
+    }
+    return vring_need_event(off, new, old);
+}
+
+static bool virtio_packed_should_notify(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VRingPackedDescEvent e;
+    uint16_t old, new;
+    bool v;
+
+    vring_packed_event_read(vq, &e);
+
+    v = vq->signalled_used_valid;
+    vq->signalled_used_valid = true;
+    old = vq->signalled_used;
+    new = vq->signalled_used = vq->used_idx;
+
+    if (e.flags == VRING_PACKED_EVENT_FLAG_DISABLE) {
+        return false;
+    } else if (e.flags == VRING_PACKED_EVENT_FLAG_ENABLE ||
+               !virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        return true;
+    }
+    return !v || vring_packed_need_event(vq, vq->used_wrap_counter,
+                                         e.off_wrap, new, old);
+}
+
 bool virtio_should_notify(VirtIODevice *vdev, VirtQueue *vq)
 {
     uint16_t old, new;
@@ -1212,6 +2000,10 @@ bool virtio_should_notify(VirtIODevice *vdev, VirtQueue *vq)
         return true;
     }
 
+    if (virtio_queue_packed(vq)) {
+        return virtio_packed_should_notify(vdev, vq);
+    }
+
     if (!virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
         return !(vring_avail_flags(vq) & VRING_AVAIL_F_NO_INTERRUPT);
     }
@@ -1270,6 +2062,13 @@ static bool virtio_virtqueue_needed(void *opaque)
     return virtio_host_has_feature(vdev, VIRTIO_F_VERSION_1);
 }
 
+static bool virtio_packed_virtqueue_needed(void *opaque)
+{
+    VirtIODevice *vdev = opaque;
+
+    return virtio_host_has_feature(vdev, VIRTIO_F_RING_PACKED);
+}
+
 static bool virtio_ringsize_needed(void *opaque)
 {
     VirtIODevice *vdev = opaque;
@@ -1316,6 +2115,32 @@ static const VMStateDescription vmstate_virtio_virtqueues = {
     }
 };
 
+static const VMStateDescription vmstate_packed_virtqueue = {
+    .name = "packed_virtqueue_state",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT16(last_avail_idx, struct VirtQueue),
+        VMSTATE_BOOL(last_avail_wrap_counter, struct VirtQueue),
+        VMSTATE_UINT16(used_idx, struct VirtQueue),
+        VMSTATE_BOOL(used_wrap_counter, struct VirtQueue),
+        VMSTATE_INT32(inuse, struct VirtQueue),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_virtio_packed_virtqueues = {
+    .name = "virtio/packed_virtqueues",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = &virtio_packed_virtqueue_needed,
+    .fields = (VMStateField[]) {
+        VMSTATE_STRUCT_VARRAY_POINTER_KNOWN(vq, struct VirtIODevice,
+                      VIRTIO_QUEUE_MAX, 0, vmstate_packed_virtqueue, VirtQueue),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static const VMStateDescription vmstate_ringsize = {
     .name = "ringsize_state",
     .version_id = 1,
@@ -1421,6 +2246,7 @@ static const VMStateDescription vmstate_virtio = {
         &vmstate_virtio_virtqueues,
         &vmstate_virtio_ringsize,
         &vmstate_virtio_extra_state,
+        &vmstate_virtio_packed_virtqueues,
         NULL
     }
 };
@@ -1487,6 +2313,10 @@ static int virtio_set_features_nocheck(VirtIODevice *vdev, uint64_t val)
     bool bad = (val & ~(vdev->host_features)) != 0;
 
     val &= vdev->host_features;
+    if ((val ^ vdev->guest_features) & (1ULL << VIRTIO_F_RING_PACKED)) {
+        /* The rings change layout */
+        virtio_invalidate_rings(vdev);
+    }
     if (k->set_features) {
         k->set_features(vdev, val);
     }
@@ -1634,9 +2464,18 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f, int version_id)
         }
     }
 
+    /* The ring addresses of virtio-1 devices come from a subsection */
+    virtio_invalidate_rings(vdev);
     for (i = 0; i < num; i++) {
         if (vdev->vq[i].vring.desc) {
             uint16_t nheads;
+
+            if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+                /* The ring state came with the packed_virtqueues
+                 * subsection; there are no indexes to check in memory.
+                 */
+                continue;
+            }
             nheads = vring_avail_idx(&vdev->vq[i]) - vdev->vq[i].last_avail_idx;
             /* Check it isn't doing strange things with descriptor numbers. */
             if (nheads > vdev->vq[i].vring.num) {
@@ -1672,6 +2511,13 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f, int version_id)
 
 void virtio_cleanup(VirtIODevice *vdev)
 {
+    int i;
+
+    for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+        vring_cache_unmap(&vdev->vq[i]);
+        virtio_queue_release_element_pool(&vdev->vq[i]);
+        g_free(vdev->vq[i].used_elems);
+    }
     qemu_del_vm_change_state_handler(vdev->vmstate);
     g_free(vdev->config);
     g_free(vdev->vq);
@@ -1710,6 +2556,27 @@ void virtio_instance_init_common(Object *proxy_obj, void *data,
     qdev_alias_all_properties(vdev, proxy_obj);
 }
 
+/* A region of guest memory moved away: drop the ring mappings, once the
+ * dispatch of the new memory map is in place.
+ */
+static void virtio_memory_listener_region_del(MemoryListener *listener,
+                                              MemoryRegionSection *section)
+{
+    VirtIODevice *vdev = container_of(listener, VirtIODevice, listener);
+
+    vdev->vring_stale = true;
+}
+
+static void virtio_memory_listener_commit(MemoryListener *listener)
+{
+    VirtIODevice *vdev = container_of(listener, VirtIODevice, listener);
+
+    if (vdev->vring_stale) {
+        vdev->vring_stale = false;
+        virtio_invalidate_rings(vdev);
+    }
+}
+
 void virtio_init(VirtIODevice *vdev, const char *name,
                  uint16_t device_id, size_t config_size)
 {
@@ -1734,6 +2601,8 @@ void virtio_init(VirtIODevice *vdev, const char *name,
         vdev->vq[i].vector = VIRTIO_NO_VECTOR;
         vdev->vq[i].vdev = vdev;
         vdev->vq[i].queue_index = i;
+        vdev->vq[i].last_avail_wrap_counter = true;
+        vdev->vq[i].used_wrap_counter = true;
     }
 
     vdev->name = name;
@@ -1747,6 +2616,9 @@ void virtio_init(VirtIODevice *vdev, const char *name,
                                                      vdev);
     vdev->device_endian = virtio_default_endian();
     vdev->use_guest_notifier_mask = true;
+
+    /* generation 0 is never current, the rings are mapped on first use */
+    vdev->vring_gen = 1;
 }
 
 hwaddr virtio_queue_get_desc_addr(VirtIODevice *vdev, int n)
@@ -1776,12 +2648,18 @@ hwaddr virtio_queue_get_desc_size(VirtIODevice *vdev, int n)
 
 hwaddr virtio_queue_get_avail_size(VirtIODevice *vdev, int n)
 {
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        return sizeof(VRingPackedDescEvent);
+    }
     return offsetof(VRingAvail, ring) +
         sizeof(uint16_t) * vdev->vq[n].vring.num;
 }
 
 hwaddr virtio_queue_get_used_size(VirtIODevice *vdev, int n)
 {
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        return sizeof(VRingPackedDescEvent);
+    }
     return offsetof(VRingUsed, ring) +
         sizeof(VRingUsedElem) * vdev->vq[n].vring.num;
 }
@@ -1792,15 +2670,48 @@ hwaddr virtio_queue_get_ring_size(VirtIODevice *vdev, int n)
 	    virtio_queue_get_used_size(vdev, n);
 }
 
+/* For a packed virtqueue the ring base also carries the wrap counter, in the
+ * same bit as the event suppression structures.
+ */
 uint16_t virtio_queue_get_last_avail_idx(VirtIODevice *vdev, int n)
 {
-    return vdev->vq[n].last_avail_idx;
+    VirtQueue *vq = &vdev->vq[n];
+
+    if (virtio_queue_packed(vq)) {
+        return vq->last_avail_idx |
+               vq->last_avail_wrap_counter << VRING_PACKED_EVENT_F_WRAP_CTR;
+    }
+    return vq->last_avail_idx;
 }
 
 void virtio_queue_set_last_avail_idx(VirtIODevice *vdev, int n, uint16_t idx)
 {
-    vdev->vq[n].last_avail_idx = idx;
-    vdev->vq[n].shadow_avail_idx = idx;
+    VirtQueue *vq = &vdev->vq[n];
+
+    if (virtio_queue_packed(vq)) {
+        vq->last_avail_wrap_counter = idx >> VRING_PACKED_EVENT_F_WRAP_CTR;
+        idx &= ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR);
+        /* A stopped backend has completed everything it took */
+        vq->used_idx = idx;
+        vq->used_wrap_counter = vq->last_avail_wrap_counter;
+    }
+    vq->last_avail_idx = idx;
+    vq->shadow_avail_idx = idx;
+}
+
+/* Make the next pop return the first element not yet in the used ring, e.g.
+ * because the backend that popped the others died with them.
+ */
+void virtio_queue_restore_last_avail_idx(VirtIODevice *vdev, int n)
+{
+    VirtQueue *vq = &vdev->vq[n];
+
+    if (!vq->vring.desc || virtio_queue_packed(vq)) {
+        return;
+    }
+
+    vq->used_idx = vring_used_idx(vq);
+    vq->last_avail_idx = vq->shadow_avail_idx = vq->used_idx;
 }
 
 void virtio_queue_invalidate_signalled_used(VirtIODevice *vdev, int n)
@@ -1855,6 +2766,22 @@ static void virtio_queue_host_notifier_aio_read(EventNotifier *n)
     }
 }
 
+/* Process the virtqueue if the guest has made buffers available, without
+ * waiting for its kick.
+ */
+static bool virtio_queue_host_notifier_aio_poll(void *opaque)
+{
+    EventNotifier *n = opaque;
+    VirtQueue *vq = container_of(n, VirtQueue, host_notifier);
+
+    if (!vq->vring.desc || virtio_queue_empty(vq)) {
+        return false;
+    }
+
+    virtio_queue_notify_aio_vq(vq);
+    return true;
+}
+
 void virtio_queue_aio_set_host_notifier_handler(VirtQueue *vq, AioContext *ctx,
                                                 VirtIOHandleOutput handle_output)
 {
@@ -1862,6 +2789,8 @@ void virtio_queue_aio_set_host_notifier_handler(VirtQueue *vq, AioContext *ctx,
         vq->handle_aio_output = handle_output;
         aio_set_event_notifier(ctx, &vq->host_notifier, true,
                                virtio_queue_host_notifier_aio_read);
+        aio_set_event_notifier_poll(ctx, &vq->host_notifier,
+                                    virtio_queue_host_notifier_aio_poll);
     } else {
         aio_set_event_notifier(ctx, &vq->host_notifier, true, NULL);
         /* Test and clear notifier before after disabling event,
@@ -1935,6 +2864,12 @@ static void virtio_device_realize(DeviceState *dev, Error **errp)
         error_propagate(errp, err);
         return;
     }
+
+    vdev->listener = (MemoryListener) {
+        .region_del = virtio_memory_listener_region_del,
+        .commit = virtio_memory_listener_commit,
+    };
+    memory_listener_register(&vdev->listener, &address_space_memory);
 }
 
 static void virtio_device_unrealize(DeviceState *dev, Error **errp)
@@ -1942,7 +2877,12 @@ static void virtio_device_unrealize(DeviceState *dev, Error **errp)
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
     VirtioDeviceClass *vdc = VIRTIO_DEVICE_GET_CLASS(dev);
     Error *err = NULL;
+    int i;
 
+    memory_listener_unregister(&vdev->listener);
+    for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+        vring_cache_unmap(&vdev->vq[i]);
+    }
     virtio_bus_device_unplugged(vdev);
 
     if (vdc->unrealize != NULL) {
@@ -26,6 +26,7 @@
 #define BLOCK_ACCOUNTING_H
 
 #include "qemu/timed-average.h"
+#include "qapi-types.h"
 
 typedef struct BlockAcctTimedStats BlockAcctTimedStats;
 
@@ -42,6 +43,15 @@ struct BlockAcctTimedStats {
     QSLIST_ENTRY(BlockAcctTimedStats) entries;
 };
 
+typedef struct BlockLatencyHistogram {
+    /* bins[i] counts the latencies in [boundaries[i - 1], boundaries[i]),
+     * taking boundaries[-1] as 0 and boundaries[nbins - 1] as infinity.
+     * The histogram is disabled when bins is NULL. */
+    int nbins;
+    uint64_t *boundaries; /* nbins - 1 ascending values, in nanoseconds */
+    uint64_t *bins;
+} BlockLatencyHistogram;
+
 typedef struct BlockAcctStats {
     uint64_t nr_bytes[BLOCK_MAX_IOTYPE];
     uint64_t nr_ops[BLOCK_MAX_IOTYPE];
@@ -51,6 +61,7 @@ typedef struct BlockAcctStats {
     uint64_t merged[BLOCK_MAX_IOTYPE];
     int64_t last_access_time_ns;
     QSLIST_HEAD(, BlockAcctTimedStats) intervals;
+    BlockLatencyHistogram latency_histogram[BLOCK_MAX_IOTYPE];
     bool account_invalid;
     bool account_failed;
 } BlockAcctStats;
@@ -78,4 +89,11 @@ int64_t block_acct_idle_time_ns(BlockAcctStats *stats);
 double block_acct_queue_depth(BlockAcctTimedStats *stats,
                               enum BlockAcctType type);
 
+/* Replace the histogram of @type by an empty one with the given bin
+ * boundaries, or disable it if @boundaries is NULL.  Returns -EINVAL
+ * unless the boundaries are non-zero and strictly ascending. */
+int block_latency_histogram_set(BlockAcctStats *stats, enum BlockAcctType type,
+                                uint64List *boundaries);
+void block_latency_histograms_clear(BlockAcctStats *stats);
+
 #endif
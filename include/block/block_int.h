@@ -32,6 +32,7 @@
 #include "qemu/timer.h"
 #include "qapi-types.h"
 #include "qemu/hbitmap.h"
+#include "qemu/interval-tree.h"
 #include "block/snapshot.h"
 #include "qemu/main-loop.h"
 #include "qemu/throttle.h"
@@ -76,6 +77,7 @@ typedef struct BdrvTrackedRequest {
     bool serialising;
     int64_t overlap_offset;
     unsigned int overlap_bytes;
+    IntervalTreeNode overlap_node; /* [overlap_offset, + overlap_bytes) */
 
     QLIST_ENTRY(BdrvTrackedRequest) list;
     Coroutine *co; /* owner, used for deadlock detection */
@@ -177,6 +179,15 @@ struct BlockDriver {
     void (*bdrv_invalidate_cache)(BlockDriverState *bs, Error **errp);
     int (*bdrv_inactivate)(BlockDriverState *bs);
 
+    /*
+     * Check whether a persistent dirty bitmap with the given name and
+     * granularity can be stored in the image on close.
+     */
+    bool (*bdrv_can_store_new_dirty_bitmap)(BlockDriverState *bs,
+                                            const char *name,
+                                            uint32_t granularity,
+                                            Error **errp);
+
     /*
      * Flushes all data for all layers by calling bdrv_co_flush for underlying
      * layers, if needed. This function is needed for deterministic
@@ -444,7 +455,7 @@ struct BlockDriverState {
 
     CoQueue flush_queue;            /* Serializing flush queue */
     BdrvTrackedRequest *active_flush_req; /* Flush request in flight */
-    unsigned int write_gen;         /* Current data generation */
+    unsigned int write_gen;         /* Current data generation, atomic */
     unsigned int flushed_gen;       /* Flushed write generation */
 
     BlockDriver *drv; /* NULL means no media */
@@ -471,7 +482,9 @@ struct BlockDriverState {
     /* Callback before write request is processed */
     NotifierWithReturnList before_write_notifiers;
 
-    /* number of in-flight serialising requests */
+    /* number of in-flight requests and serialising requests; read
+     * atomically, written under reqs_lock */
+    unsigned int in_flight;
     unsigned int serialising_in_flight;
 
     /* Offset after the highest byte written to */
@@ -497,7 +510,13 @@ struct BlockDriverState {
     QLIST_HEAD(, BdrvDirtyBitmap) dirty_bitmaps;
     int refcnt;
 
+    /* Protects tracked_requests and the overlap fields of its entries, so
+     * that requests can be submitted to the node from several coroutines
+     * without relying on them all running in the node's AioContext */
+    CoMutex reqs_lock;
     QLIST_HEAD(, BdrvTrackedRequest) tracked_requests;
+    /* The same requests by overlap range, for wait_serialising_requests() */
+    IntervalTreeRoot tracked_overlaps;
 
     /* operation blockers */
     QLIST_HEAD(, BdrvOpBlocker) op_blockers[BLOCK_OP_TYPE_MAX];
@@ -751,6 +770,7 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
  * @bs: Block device to operate on.
  * @target: Block device to write to.
  * @speed: The maximum speed, in bytes per second, or 0 for unlimited.
+ * @max_workers: How many clusters are copied in parallel, or 0 for the default.
  * @sync_mode: What parts of the disk image should be copied to the destination.
  * @sync_bitmap: The dirty bitmap if sync_mode is MIRROR_SYNC_MODE_INCREMENTAL.
  * @on_source_error: The action to take upon error reading from the source.
@@ -764,6 +784,7 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
  */
 void backup_start(const char *job_id, BlockDriverState *bs,
                   BlockDriverState *target, int64_t speed,
+                  int64_t max_workers,
                   MirrorSyncMode sync_mode, BdrvDirtyBitmap *sync_bitmap,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
@@ -33,6 +33,11 @@ const char *throttle_group_get_name(BlockBackend *blk);
 ThrottleState *throttle_group_incref(const char *name);
 void throttle_group_unref(ThrottleState *ts);
 
+void throttle_group_set_parent(const char *name, const char *parent,
+                               Error **errp);
+void throttle_group_set_limits(const char *name, ThrottleConfig *cfg,
+                               Error **errp);
+
 void throttle_group_config(BlockBackend *blk, ThrottleConfig *cfg);
 void throttle_group_get_config(BlockBackend *blk, ThrottleConfig *cfg);
 
@@ -319,4 +319,24 @@ int qcrypto_tls_session_get_key_size(QCryptoTLSSession *sess,
  */
 char *qcrypto_tls_session_get_peer_name(QCryptoTLSSession *sess);
 
+/**
+ * qcrypto_tls_session_offload_tx:
+ * @sess: the TLS session object
+ * @fd: the TCP socket the session runs over
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Hand the transmit direction of an established session
+ * over to the kernel TLS implementation of the socket @fd.
+ * On success, plain text written to @fd is sent encrypted
+ * and qcrypto_tls_session_write() must not be used any more.
+ * Receiving still goes through qcrypto_tls_session_read().
+ *
+ * Only AES-128-GCM with TLS 1.2 or 1.3 is supported.
+ *
+ * Returns: 0 on success, -1 on error
+ */
+int qcrypto_tls_session_offload_tx(QCryptoTLSSession *sess,
+                                   int fd,
+                                   Error **errp);
+
 #endif /* QCRYPTO_TLSSESSION_H */
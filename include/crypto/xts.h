@@ -32,6 +32,7 @@
 
 #define XTS_BLOCK_SIZE 16
 
+/* Encrypts or decrypts @length bytes, any multiple of XTS_BLOCK_SIZE */
 typedef void xts_cipher_func(const void *ctx,
                              size_t length,
                              uint8_t *dst,
@@ -307,6 +307,8 @@ CPUArchState *cpu_copy(CPUArchState *env);
 
 void dump_exec_info(FILE *f, fprintf_function cpu_fprintf);
 void dump_opcount_info(FILE *f, fprintf_function cpu_fprintf);
+void dump_tb_hot_info(FILE *f, fprintf_function cpu_fprintf, int count);
+void dump_tb_sample_info(FILE *f, fprintf_function cpu_fprintf, int count);
 #endif /* !CONFIG_USER_ONLY */
 
 int cpu_memory_rw_debug(CPUState *cpu, target_ulong addr,
@@ -134,6 +134,32 @@ void tlb_flush_page_by_mmuidx(CPUState *cpu, target_ulong addr, ...);
  * MMU indexes.
  */
 void tlb_flush_by_mmuidx(CPUState *cpu, ...);
+/**
+ * tlb_flush_range_by_mmuidx:
+ * @cpu: CPU whose TLB should be flushed
+ * @addr: virtual address of the start of the range
+ * @len: length of the range in bytes
+ * @idxmap: bitmap of the MMU indexes to flush
+ *
+ * Flush the pages overlapping [@addr, @addr + @len) from the TLB of the
+ * specified CPU, for the MMU indexes in @idxmap. An MMU index whose large
+ * pages overlap the range is flushed entirely, other indexes keep their
+ * entries. If called from another thread than the one running @cpu, the
+ * flush is queued and done before @cpu executes guest code again.
+ */
+void tlb_flush_range_by_mmuidx(CPUState *cpu, target_ulong addr,
+                               target_ulong len, uint16_t idxmap);
+/**
+ * tlb_flush_range_by_mmuidx_all_cpus:
+ * @src_cpu: CPU requesting the flush
+ * @addr: virtual address of the start of the range
+ * @len: length of the range in bytes
+ * @idxmap: bitmap of the MMU indexes to flush
+ *
+ * Like tlb_flush_range_by_mmuidx(), for every CPU including @src_cpu.
+ */
+void tlb_flush_range_by_mmuidx_all_cpus(CPUState *src_cpu, target_ulong addr,
+                                        target_ulong len, uint16_t idxmap);
 /**
  * tlb_set_page_with_attrs:
  * @cpu: CPU to add this TLB entry for
@@ -168,6 +194,13 @@ void tlb_set_page_with_attrs(CPUState *cpu, target_ulong vaddr,
 void tlb_set_page(CPUState *cpu, target_ulong vaddr,
                   hwaddr paddr, int prot,
                   int mmu_idx, target_ulong size);
+/**
+ * tlb_destroy:
+ * @cpu: CPU whose TLB state should be freed
+ *
+ * Free the dynamically allocated TLB state of a CPU that is going away.
+ */
+void tlb_destroy(CPUState *cpu);
 void tb_invalidate_phys_addr(AddressSpace *as, hwaddr addr);
 void probe_write(CPUArchState *env, target_ulong addr, int mmu_idx,
                  uintptr_t retaddr);
@@ -188,6 +221,22 @@ static inline void tlb_flush_page_by_mmuidx(CPUState *cpu,
 static inline void tlb_flush_by_mmuidx(CPUState *cpu, ...)
 {
 }
+
+static inline void tlb_flush_range_by_mmuidx(CPUState *cpu, target_ulong addr,
+                                             target_ulong len, uint16_t idxmap)
+{
+}
+
+static inline void tlb_flush_range_by_mmuidx_all_cpus(CPUState *src_cpu,
+                                                      target_ulong addr,
+                                                      target_ulong len,
+                                                      uint16_t idxmap)
+{
+}
+
+static inline void tlb_destroy(CPUState *cpu)
+{
+}
 #endif
 
 #define CODE_GEN_ALIGN           16 /* must be >= of the size of a icache line */
@@ -224,6 +273,16 @@ struct TranslationBlock {
 #define CF_NOCACHE     0x10000 /* To be freed after execution */
 #define CF_USE_ICOUNT  0x20000
 #define CF_IGNORE_ICOUNT 0x40000 /* Do not generate icount code */
+#define CF_PROFILE     0x80000 /* Count executions in exec_count */
+#define CF_HOT         0x100000 /* Retranslated after TB_HOT_THRESHOLD runs */
+
+    /* Set once the TB is removed from the hash table. Lookups without
+     * tb_lock may still find it, it must not be chained to anymore.
+     */
+    bool invalid;
+
+    /* Number of executions, counted by the generated code with CF_PROFILE */
+    uint64_t exec_count;
 
     void *tc_ptr;    /* pointer to the translated code */
     uint8_t *tc_search;  /* pointer to search data */
@@ -268,6 +327,29 @@ void tb_free(TranslationBlock *tb);
 void tb_flush(CPUState *cpu);
 void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr);
 
+/* With TB profiling enabled, new TBs count their executions. A TB entered
+ * from the main loop after TB_HOT_THRESHOLD executions is retranslated
+ * with CF_HOT, which gets further optimization.
+ */
+#define TB_HOT_THRESHOLD 100000
+
+extern bool tb_profile_enabled;
+void tb_profile_set(bool enable);
+
+/* The sampling profiler records one TB entry from the main loop out of
+ * tb_sample_period, and with tb_sample_mem one softmmu slow path access
+ * out of tb_sample_period, in a ring per vCPU.  While it is on, the
+ * host code of new TBs is listed in /tmp/perf-<pid>.map for perf.
+ */
+#define TB_SAMPLE_RING_SIZE 4096
+
+extern int tb_sample_period;
+extern bool tb_sample_mem;
+void tb_sample_set(int period, bool mem);
+void tb_sample_exec(CPUState *cpu, TranslationBlock *tb);
+void tb_sample_mem_access(CPUState *cpu, target_ulong addr, int size,
+                          bool is_write);
+
 #if defined(USE_DIRECT_JUMP)
 
 #if defined(CONFIG_TCG_INTERPRETER)
@@ -382,6 +464,9 @@ void tlb_fill(CPUState *cpu, target_ulong addr, MMUAccessType access_type,
 void mmap_lock(void);
 void mmap_unlock(void);
 
+/* user-exec.c */
+extern __thread uintptr_t helper_retaddr;
+
 static inline tb_page_addr_t get_page_addr_code(CPUArchState *env1, target_ulong addr)
 {
     return addr;
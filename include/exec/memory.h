@@ -31,6 +31,7 @@
 #include "qemu/notify.h"
 #include "qom/object.h"
 #include "qemu/rcu.h"
+#include "qemu/thread.h"
 
 #define RAM_ADDR_INVALID (~(ram_addr_t)0)
 
@@ -221,6 +222,9 @@ struct MemoryListener {
     void (*log_stop)(MemoryListener *listener, MemoryRegionSection *section,
                      int old, int new);
     void (*log_sync)(MemoryListener *listener, MemoryRegionSection *section);
+    /* Called once before log_sync for every section of the address space,
+     * for listeners whose dirty log is not kept per section */
+    void (*log_sync_global)(MemoryListener *listener);
     void (*log_global_start)(MemoryListener *listener);
     void (*log_global_stop)(MemoryListener *listener);
     void (*eventfd_add)(MemoryListener *listener, MemoryRegionSection *section,
@@ -237,6 +241,12 @@ struct MemoryListener {
     QTAILQ_ENTRY(MemoryListener) link;
 };
 
+typedef struct BounceBuffer BounceBuffer;
+typedef struct AddressSpaceMapClient AddressSpaceMapClient;
+
+/* Bytes of bounce buffers address_space_map() may allocate at a time */
+#define DEFAULT_MAX_BOUNCE_BUFFER_SIZE 4096
+
 /**
  * AddressSpace: describes a mapping of addresses to #MemoryRegion objects
  */
@@ -257,6 +267,16 @@ struct AddressSpace {
     struct AddressSpaceDispatch *next_dispatch;
     MemoryListener dispatch_listener;
 
+    /* Mappings of non-RAM regions, address_space_map() fails and its
+     * callers register a map client once max_bounce_buffer_size bytes of
+     * bounce buffers are in use.  bounce_buffer_size is read atomically,
+     * the rest is protected by bounce_lock. */
+    size_t max_bounce_buffer_size;
+    size_t bounce_buffer_size;
+    QemuMutex bounce_lock;
+    QLIST_HEAD(, BounceBuffer) bounce_buffers;
+    QLIST_HEAD(, AddressSpaceMapClient) map_client_list;
+
     QTAILQ_ENTRY(AddressSpace) address_spaces_link;
 };
 
@@ -1393,8 +1413,8 @@ bool address_space_access_valid(AddressSpace *as, hwaddr addr, int len, bool is_
  * May map a subset of the requested range, given by and returned in @plen.
  * May return %NULL if resources needed to perform the mapping are exhausted.
  * Use only for reads OR writes - not for read-modify-write operations.
- * Use cpu_register_map_client() to know when retrying the map operation is
- * likely to succeed.
+ * Use address_space_register_map_client() to know when retrying the map
+ * operation is likely to succeed.
  *
  * @as: #AddressSpace to be accessed
  * @addr: address within that address space
@@ -1418,6 +1438,28 @@ void *address_space_map(AddressSpace *as, hwaddr addr,
 void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
                          int is_write, hwaddr access_len);
 
+/* address_space_register_map_client: get notified when mapping may succeed
+ *
+ * @bh is scheduled once, when bounce buffer space of @as is released or at
+ * once if some is available.  A client registered with
+ * cpu_register_map_client() waits for &address_space_memory.
+ *
+ * @as: #AddressSpace where address_space_map() failed
+ * @bh: bottom half to schedule
+ */
+void address_space_register_map_client(AddressSpace *as, QEMUBH *bh);
+
+/* address_space_unregister_map_client: cancel a registration that has not
+ * been notified yet
+ *
+ * @as: #AddressSpace the client was registered with
+ * @bh: bottom half given to address_space_register_map_client()
+ */
+void address_space_unregister_map_client(AddressSpace *as, QEMUBH *bh);
+
+/* Drops the clients of an #AddressSpace being destroyed, for memory.c */
+void address_space_destroy_map_clients(AddressSpace *as);
+
 
 /* Internal functions, part of the implementation of address_space_read.  */
 MemTxResult address_space_read_continue(AddressSpace *as, hwaddr addr,
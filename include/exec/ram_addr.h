@@ -36,6 +36,17 @@ struct RAMBlock {
     /* RCU-enabled, writes protected by the ramlist lock */
     QLIST_ENTRY(RAMBlock) next;
     int fd;
+    size_t page_size;
+    /* With x-mapped-ram: position of the block's bitmap and pages in the
+     * migration file, and pages that hold data there */
+    uint64_t bitmap_offset;
+    uint64_t pages_offset;
+    unsigned long *file_bmap;
+    /* With x-lazy-restore: the same for the file being restored from */
+    uint64_t lazy_pages_offset;
+    unsigned long *lazy_bmap;
+    /* Bytes sent for this block in the current migration pass */
+    uint64_t pass_bytes;
 };
 
 static inline bool offset_in_ramblock(RAMBlock *b, ram_addr_t offset)
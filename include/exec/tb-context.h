@@ -26,9 +26,24 @@
 #define CODE_GEN_HTABLE_BITS     15
 #define CODE_GEN_HTABLE_SIZE     (1 << CODE_GEN_HTABLE_BITS)
 
+/* The code buffer is split in regions that are filled in turn. When the
+ * last one is full the oldest region is evicted, only its TBs are
+ * invalidated, instead of flushing the whole buffer.
+ */
+#define CODE_GEN_REGIONS         8
+#define CODE_GEN_REGION_MIN_SIZE (1 * 1024 * 1024)
+
 typedef struct TranslationBlock TranslationBlock;
 typedef struct TBContext TBContext;
 
+typedef struct TBRegion {
+    void *start;        /* code range of the region */
+    void *end;
+    void *ptr;          /* end of the generated code, when not current */
+    int first_tb;       /* the region owns tbs[first_tb, first_tb + nb_tbs) */
+    int nb_tbs;
+} TBRegion;
+
 struct TBContext {
 
     TranslationBlock *tbs;
@@ -37,9 +52,17 @@ struct TBContext {
     /* any access to the tbs or the page table must use this lock */
     QemuMutex tb_lock;
 
+    TBRegion regions[CODE_GEN_REGIONS];
+    int nb_regions;
+    int cur_region;
+    int region_max_tbs;
+    size_t region_size;
+
     /* statistics */
     int tb_flush_count;
     int tb_phys_invalidate_count;
+    int tb_region_evict_count;
+    int64_t smc_data_write_count;   /* writes to code pages beside the code */
 };
 
 #endif
@@ -32,6 +32,7 @@
 #define AHCI_DMA_BOUNDARY         0xffffffff
 #define AHCI_USE_CLUSTERING       0
 #define AHCI_MAX_CMDS             32
+#define AHCI_NCQ_MERGE_MAX_SECTORS 0x10000 /* as for a single command */
 #define AHCI_CMD_SZ               32
 #define AHCI_CMD_SLOT_SZ          (AHCI_MAX_CMDS * AHCI_CMD_SZ)
 #define AHCI_RX_FIS_SZ            256
@@ -284,6 +285,8 @@ struct AHCIDevice {
     bool init_d2h_sent;
     AHCICmdHdr *cur_cmd;
     NCQTransferState ncq_tfs[AHCI_MAX_CMDS];
+    /* NCQ tags decoded by check_cmd() and not submitted yet */
+    uint32_t ncq_pending;
 };
 
 typedef struct AHCIState {
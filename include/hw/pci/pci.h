@@ -279,6 +279,8 @@ struct PCIDevice {
     PCIIORegion io_regions[PCI_NUM_REGIONS];
     AddressSpace bus_master_as;
     MemoryRegion bus_master_enable_region;
+    /* Bounce buffer bytes for DMA to non-RAM, see address_space_map() */
+    uint64_t max_bounce_buffer_size;
 
     /* do not access the following fields */
     PCIConfigReadFunc *config_read;
@@ -312,6 +314,8 @@ struct PCIDevice {
     unsigned *msix_entry_used;
     /* MSIX function mask set or MSIX disabled */
     bool msix_function_masked;
+    /* KVM irqfds used by msix_notify, one per vector, allocated on demand */
+    struct MSIXIrqfd *msix_irqfd;
     /* Version id needed for VMState */
     int32_t version_id;
 
@@ -330,6 +334,11 @@ struct PCIDevice {
     MemoryRegion rom;
     uint32_t rom_bar;
 
+    /* Option rom image not read yet, see pci_load_option_rom() */
+    char *rom_path;
+    bool rom_patch_ids;
+    Notifier rom_migration_notifier;
+
     /* INTx routing notifier */
     PCIINTxRoutingNotifier intx_routing_notifier;
 
@@ -345,6 +354,7 @@ void pci_register_vga(PCIDevice *pci_dev, MemoryRegion *mem,
                       MemoryRegion *io_lo, MemoryRegion *io_hi);
 void pci_unregister_vga(PCIDevice *pci_dev);
 pcibus_t pci_get_bar_addr(PCIDevice *pci_dev, int region_num);
+void pci_load_option_rom(PCIDevice *pdev);
 
 int pci_add_capability(PCIDevice *pdev, uint8_t cap_id,
                        uint8_t offset, uint8_t size);
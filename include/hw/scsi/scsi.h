@@ -89,6 +89,9 @@ typedef struct SCSIDeviceClass {
     SCSIRequest *(*alloc_req)(SCSIDevice *s, uint32_t tag, uint32_t lun,
                               uint8_t *buf, void *hba_private);
     void (*unit_attention_reported)(SCSIDevice *s);
+    /* Bracket a batch of requests, defaults to blk_io_plug/unplug.  */
+    void (*io_plug)(SCSIDevice *s);
+    void (*io_unplug)(SCSIDevice *s);
 } SCSIDeviceClass;
 
 struct SCSIDevice
@@ -273,6 +276,8 @@ void scsi_device_purge_requests(SCSIDevice *sdev, SCSISense sense);
 void scsi_device_set_ua(SCSIDevice *sdev, SCSISense sense);
 void scsi_device_report_change(SCSIDevice *dev, SCSISense sense);
 void scsi_device_unit_attention_reported(SCSIDevice *dev);
+void scsi_device_io_plug(SCSIDevice *dev);
+void scsi_device_io_unplug(SCSIDevice *dev);
 void scsi_generic_read_device_identification(SCSIDevice *dev);
 int scsi_device_get_sense(SCSIDevice *dev, uint8_t *buf, int len, bool fixed);
 SCSIDevice *scsi_device_find(SCSIBus *bus, int channel, int target, int lun);
@@ -78,6 +78,12 @@ typedef struct VFIOContainer {
     unsigned iommu_type;
     int error;
     bool initialized;
+    /* RAM maps queued to the DMA workers, protected by their lock */
+    int dma_jobs;
+    int dma_error;
+    uint64_t dma_pending;
+    uint64_t dma_mapped;
+    Notifier machine_done;
     /*
      * This assumes the host IOMMU can support only a single
      * contiguous IOVA window.  We may need to generalize that in
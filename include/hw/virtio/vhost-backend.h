@@ -20,6 +20,7 @@ typedef enum VhostBackendType {
 
 struct vhost_dev;
 struct vhost_log;
+struct vhost_inflight;
 struct vhost_memory;
 struct vhost_vring_file;
 struct vhost_vring_state;
@@ -73,6 +74,12 @@ typedef int (*vhost_migration_done_op)(struct vhost_dev *dev,
 typedef bool (*vhost_backend_can_merge_op)(struct vhost_dev *dev,
                                            uint64_t start1, uint64_t size1,
                                            uint64_t start2, uint64_t size2);
+typedef int (*vhost_get_inflight_fd_op)(struct vhost_dev *dev,
+                                        uint16_t num_queues,
+                                        uint16_t queue_size,
+                                        struct vhost_inflight *inflight);
+typedef int (*vhost_set_inflight_fd_op)(struct vhost_dev *dev,
+                                        struct vhost_inflight *inflight);
 
 typedef struct VhostOps {
     VhostBackendType backend_type;
@@ -102,6 +109,8 @@ typedef struct VhostOps {
     vhost_requires_shm_log_op vhost_requires_shm_log;
     vhost_migration_done_op vhost_migration_done;
     vhost_backend_can_merge_op vhost_backend_can_merge;
+    vhost_get_inflight_fd_op vhost_get_inflight_fd;
+    vhost_set_inflight_fd_op vhost_set_inflight_fd;
 } VhostOps;
 
 extern const VhostOps user_ops;
@@ -35,10 +35,26 @@ struct vhost_log {
     vhost_log_chunk_t *log;
 };
 
+/* Backend-defined record of the descriptors it is processing, shared with
+ * the backend so that it survives the backend restarting.
+ */
+struct vhost_inflight {
+    int fd;
+    void *addr;
+    uint64_t size;
+    uint64_t offset;
+    uint16_t num_queues;
+    uint16_t queue_size;
+};
+
 struct vhost_memory;
 struct vhost_dev {
     MemoryListener memory_listener;
     struct vhost_memory *mem;
+    /* copy of the table the backend last accepted */
+    struct vhost_memory *mem_sent;
+    uint64_t mem_table_sent;
+    uint64_t mem_table_skipped;
     int n_mem_sections;
     MemoryRegionSection *mem_sections;
     struct vhost_virtqueue *vqs;
@@ -90,4 +106,11 @@ bool vhost_has_free_slot(void);
 int vhost_net_set_backend(struct vhost_dev *hdev,
                           struct vhost_vring_file *file);
 
+void vhost_dev_free_inflight(struct vhost_inflight *inflight);
+int vhost_dev_get_inflight(struct vhost_dev *dev, uint16_t num_queues,
+                           uint16_t queue_size,
+                           struct vhost_inflight *inflight);
+int vhost_dev_set_inflight(struct vhost_dev *dev,
+                           struct vhost_inflight *inflight);
+
 #endif
@@ -31,9 +31,22 @@ typedef struct virtio_balloon_stat_modern {
        uint64_t val;
 } VirtIOBalloonStatModern;
 
+#define VIRTIO_BALLOON_FREE_PAGE_HINT_CMD_ID_MIN 0x80000000
+
+typedef enum {
+    FREE_PAGE_HINT_S_STOP = 0,
+    FREE_PAGE_HINT_S_REQUESTED = 1,
+    FREE_PAGE_HINT_S_START = 2,
+    FREE_PAGE_HINT_S_DONE = 3,
+} FreePageHintStatus;
+
 typedef struct VirtIOBalloon {
     VirtIODevice parent_obj;
-    VirtQueue *ivq, *dvq, *svq;
+    VirtQueue *ivq, *dvq, *svq, *free_page_vq, *reporting_vq;
+    uint32_t free_page_hint_cmd_id;
+    FreePageHintStatus free_page_hint_status;
+    Notifier free_page_hint_sync_notify;
+    Notifier free_page_hint_migration_notify;
     uint32_t num_pages;
     uint32_t actual;
     uint64_t stats[VIRTIO_BALLOON_S_NR];
@@ -43,6 +56,12 @@ typedef struct VirtIOBalloon {
     int64_t stats_last_update;
     int64_t stats_poll_interval;
     uint32_t host_features;
+    /* Inflate requests whose pages are being discarded */
+    unsigned int discard_in_flight;
+    /* Huge host page of which only part was ballooned so far */
+    RAMBlock *pbp_block;
+    ram_addr_t pbp_base;
+    unsigned long *pbp_bitmap;
 } VirtIOBalloon;
 
 #endif
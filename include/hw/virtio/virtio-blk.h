@@ -39,6 +39,10 @@ struct VirtIOBlkConf
     uint32_t config_wce;
     uint32_t request_merging;
     uint16_t num_queues;
+    uint32_t discard;
+    uint32_t write_zeroes;
+    uint32_t max_discard_sectors;
+    uint32_t max_write_zeroes_sectors;
 };
 
 struct VirtIOBlockDataPlane;
@@ -56,6 +60,7 @@ typedef struct VirtIOBlock {
     bool dataplane_disabled;
     bool dataplane_started;
     struct VirtIOBlockDataPlane *dataplane;
+    size_t config_size;
 } VirtIOBlock;
 
 typedef struct VirtIOBlockReq {
@@ -70,14 +75,25 @@ typedef struct VirtIOBlockReq {
     struct VirtIOBlockReq *next;
     struct VirtIOBlockReq *mr_next;
     BlockAcctCookie acct;
+    /* Discard and write zeroes ranges, in host byte order */
+    struct virtio_blk_discard_write_zeroes *dwz;
+    unsigned int dwz_num;
+    unsigned int dwz_pending;   /* operations covering the ranges */
+    int dwz_ret;                /* first error of these operations */
 } VirtIOBlockReq;
 
 #define VIRTIO_BLK_MAX_MERGE_REQS 32
 
+/* Segments of a discard or write zeroes request */
+#define VIRTIO_BLK_MAX_DWZ_SEGS 128
+
 typedef struct MultiReqBuffer {
     VirtIOBlockReq *reqs[VIRTIO_BLK_MAX_MERGE_REQS];
     unsigned int num_reqs;
     bool is_write;
+    /* VIRTIO_BLK_T_DISCARD or VIRTIO_BLK_T_WRITE_ZEROES, 0 for reads and
+     * writes */
+    uint32_t dwz_type;
 } MultiReqBuffer;
 
 void virtio_blk_init_request(VirtIOBlock *s, VirtQueue *vq,
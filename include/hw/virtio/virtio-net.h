@@ -16,6 +16,7 @@
 
 #include "standard-headers/linux/virtio_net.h"
 #include "hw/virtio/virtio.h"
+#include "sysemu/iothread.h"
 
 #define TYPE_VIRTIO_NET "virtio-net-device"
 #define VIRTIO_NET(obj) \
@@ -35,11 +36,24 @@ typedef struct virtio_net_conf
     uint32_t txtimer;
     int32_t txburst;
     char *tx;
+    uint32_t txzerocopy;    /* smallest frame sent without copying, 0: never */
+    char *iothreads;    /* colon-separated IOThread ids, one per queue pair */
+    bool rx_coalesce;   /* merge TCP segments when the peer cannot offload */
 } virtio_net_conf;
 
 /* Maximum packet size we can receive from tap device: header + 64k */
 #define VIRTIO_NET_MAX_BUFSIZE (sizeof(struct virtio_net_hdr) + (64 << 10))
 
+/* Largest frame that receive coalescing builds: Ethernet header + 64k IP */
+#define VIRTIO_NET_RX_COALESCE_MAX (14 + 0xffff)
+
+/* A TX element whose buffers the backend is still sending from */
+typedef struct VirtIONetTxZc {
+    VirtQueueElement elem;
+    struct VirtIONetQueue *q;   /* NULL once the queue forgot about it */
+    QTAILQ_ENTRY(VirtIONetTxZc) next;
+} VirtIONetTxZc;
+
 typedef struct VirtIONetQueue {
     VirtQueue *rx_vq;
     VirtQueue *tx_vq;
@@ -49,7 +63,10 @@ typedef struct VirtIONetQueue {
     struct {
         VirtQueueElement *elem;
     } async_tx;
+    QTAILQ_HEAD(, VirtIONetTxZc) tx_zc;
+    uint8_t *rx_coalesce_buf;
     struct VirtIONet *n;
+    IOThread *iothread;   /* runs this pair when the dataplane is started */
 } VirtIONetQueue;
 
 typedef struct VirtIONet {
@@ -95,6 +112,8 @@ typedef struct VirtIONet {
     QEMUTimer *announce_timer;
     int announce_counter;
     bool needs_vnet_hdr_swap;
+    bool dataplane_started;
+    bool dataplane_notifier_mask;
 } VirtIONet;
 
 void virtio_net_set_netclient_name(VirtIONet *n, const char *name,
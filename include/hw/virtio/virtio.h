@@ -38,19 +38,31 @@ static inline hwaddr vring_align(hwaddr addr,
 }
 
 typedef struct VirtQueue VirtQueue;
+typedef struct VirtQueueElementPool VirtQueueElementPool;
 
 #define VIRTQUEUE_MAX_SIZE 1024
 
-typedef struct VirtQueueElement
+typedef struct VirtQueueElement VirtQueueElement;
+
+struct VirtQueueElement
 {
     unsigned int index;
+    /* ring descriptors the element takes in a packed virtqueue */
+    unsigned int ndescs;
     unsigned int out_num;
     unsigned int in_num;
     hwaddr *in_addr;
     hwaddr *out_addr;
     struct iovec *in_sg;
     struct iovec *out_sg;
-} VirtQueueElement;
+    /* Set when the element belongs to a queue pool */
+    VirtQueueElementPool *pool;
+    size_t alloc_size;
+    QSLIST_ENTRY(VirtQueueElement) pool_next;
+};
+
+/* Called once for each element the pool allocates, before it is popped */
+typedef void VirtQueueElementCtor(void *elem, void *opaque);
 
 #define VIRTIO_QUEUE_MAX 1024
 
@@ -92,6 +104,10 @@ struct VirtIODevice
     uint8_t device_endian;
     bool use_guest_notifier_mask;
     QLIST_HEAD(, VirtQueue) *vector_queues;
+    /* bumped when the ring mappings of the queues must be redone */
+    unsigned vring_gen;
+    bool vring_stale;
+    MemoryListener listener;
 };
 
 typedef struct VirtioDeviceClass {
@@ -148,12 +164,21 @@ VirtQueue *virtio_add_queue_aio(VirtIODevice *vdev, int queue_size,
 
 void virtio_del_queue(VirtIODevice *vdev, int n);
 
+/* Recycle the elements popped from VQ, the device must free them with
+ * virtqueue_free_element(). CTOR may be NULL.
+ */
+void virtio_queue_set_element_pool(VirtQueue *vq, VirtQueueElementCtor *ctor,
+                                   void *opaque);
+
 void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_num);
+void virtqueue_free_element(void *elem);
 void virtqueue_push(VirtQueue *vq, const VirtQueueElement *elem,
                     unsigned int len);
 void virtqueue_flush(VirtQueue *vq, unsigned int count);
 void virtqueue_discard(VirtQueue *vq, const VirtQueueElement *elem,
                        unsigned int len);
+void virtqueue_detach_element(VirtQueue *vq, const VirtQueueElement *elem,
+                              unsigned int len);
 void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
                     unsigned int len, unsigned int idx);
 
@@ -252,7 +277,9 @@ typedef struct VirtIORNGConf VirtIORNGConf;
     DEFINE_PROP_BIT64("notify_on_empty", _state, _field,  \
                       VIRTIO_F_NOTIFY_ON_EMPTY, true), \
     DEFINE_PROP_BIT64("any_layout", _state, _field, \
-                      VIRTIO_F_ANY_LAYOUT, true)
+                      VIRTIO_F_ANY_LAYOUT, true), \
+    DEFINE_PROP_BIT64("packed", _state, _field, \
+                      VIRTIO_F_RING_PACKED, false)
 
 hwaddr virtio_queue_get_desc_addr(VirtIODevice *vdev, int n);
 hwaddr virtio_queue_get_avail_addr(VirtIODevice *vdev, int n);
@@ -264,6 +291,7 @@ hwaddr virtio_queue_get_used_size(VirtIODevice *vdev, int n);
 hwaddr virtio_queue_get_ring_size(VirtIODevice *vdev, int n);
 uint16_t virtio_queue_get_last_avail_idx(VirtIODevice *vdev, int n);
 void virtio_queue_set_last_avail_idx(VirtIODevice *vdev, int n, uint16_t idx);
+void virtio_queue_restore_last_avail_idx(VirtIODevice *vdev, int n);
 void virtio_queue_invalidate_signalled_used(VirtIODevice *vdev, int n);
 VirtQueue *virtio_get_queue(VirtIODevice *vdev, int n);
 uint16_t virtio_get_queue_index(VirtQueue *vq);
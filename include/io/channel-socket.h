@@ -48,6 +48,11 @@ struct QIOChannelSocket {
     socklen_t localAddrLen;
     struct sockaddr_storage remoteAddr;
     socklen_t remoteAddrLen;
+    /* SO_ZEROCOPY is set, and the count of MSG_ZEROCOPY sends that were
+     * queued and that the kernel has reported complete */
+    bool zero_copy_enabled;
+    uint64_t zero_copy_queued;
+    uint64_t zero_copy_sent;
 };
 
 
@@ -48,6 +48,8 @@ struct QIOChannelTLS {
     QIOChannel parent;
     QIOChannel *master;
     QCryptoTLSSession *session;
+    /* The kernel encrypts what is written to the master channel */
+    bool offload_tx;
 };
 
 /**
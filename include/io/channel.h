@@ -43,6 +43,7 @@ enum QIOChannelFeature {
     QIO_CHANNEL_FEATURE_FD_PASS  = (1 << 0),
     QIO_CHANNEL_FEATURE_SHUTDOWN = (1 << 1),
     QIO_CHANNEL_FEATURE_LISTEN   = (1 << 2),
+    QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY = (1 << 3),
 };
 
 
@@ -131,6 +132,12 @@ struct QIOChannelClass {
                      off_t offset,
                      int whence,
                      Error **errp);
+    ssize_t (*io_writev_zero_copy)(QIOChannel *ioc,
+                                   const struct iovec *iov,
+                                   size_t niov,
+                                   Error **errp);
+    int (*io_flush)(QIOChannel *ioc,
+                    Error **errp);
 };
 
 /* General I/O handling functions */
@@ -297,6 +304,46 @@ ssize_t qio_channel_write(QIOChannel *ioc,
                           size_t buflen,
                           Error **errp);
 
+/**
+ * qio_channel_writev_zero_copy:
+ * @ioc: the channel object
+ * @iov: the array of memory regions to write data from
+ * @niov: the length of the @iov array
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Behaves as qio_channel_writev(), but the data may be sent
+ * straight from @iov instead of being copied first.  The memory
+ * regions must therefore stay valid, and their contents should
+ * not be relied upon to be sent as they were at the time of the
+ * call, until a later qio_channel_flush() has returned.
+ *
+ * The channel must have the QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY
+ * feature.
+ *
+ * Returns: the number of bytes sent, or QIO_CHANNEL_ERR_BLOCK
+ * if no data is available and the channel is non-blocking,
+ * or -1 on error
+ */
+ssize_t qio_channel_writev_zero_copy(QIOChannel *ioc,
+                                     const struct iovec *iov,
+                                     size_t niov,
+                                     Error **errp);
+
+/**
+ * qio_channel_flush:
+ * @ioc: the channel object
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Wait until all the data queued by qio_channel_writev_zero_copy()
+ * has been sent, so that the memory it came from can be reused.
+ * Does nothing for channels that never defer sending.
+ *
+ * Returns: 1 if some of the data had to be copied after all,
+ * 0 if it was all sent without copying, or -1 on error
+ */
+int qio_channel_flush(QIOChannel *ioc,
+                      Error **errp);
+
 /**
  * qio_channel_set_blocking:
  * @ioc: the channel object
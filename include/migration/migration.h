@@ -104,6 +104,14 @@ struct MigrationIncomingState {
     QemuMutex rp_mutex;    /* We send replies from multiple threads */
     void     *postcopy_tmp_page;
 
+    /* Pages sent by the source on the postcopy preempt channel */
+    bool           have_preempt_thread;
+    QemuThread     preempt_thread;
+    QEMUFile      *postcopy_preempt_file;
+
+    /* Faults are served from a mapped-ram file, see ram_lazy_restore_page */
+    bool           lazy_restore;
+
     QEMUBH *bh;
 
     int state;
@@ -150,6 +158,9 @@ struct MigrationState
         bool          error;
     } rp_state;
 
+    /* Channel for pages the destination faulted on, during postcopy */
+    QEMUFile *postcopy_preempt_file;
+
     double mbps;
     int64_t total_time;
     int64_t downtime;
@@ -162,6 +173,9 @@ struct MigrationState
     int64_t dirty_sync_count;
     /* Count of requests incoming from destination */
     int64_t postcopy_requests;
+    /* Memory registration statistics of an outgoing RDMA migration */
+    bool rdma_reg_cache_active;
+    RdmaRegCacheStats rdma_reg_cache;
 
     /* Flag set once the migration has been asked to enter postcopy */
     bool start_postcopy;
@@ -248,6 +262,13 @@ void migrate_compress_threads_create(void);
 void migrate_compress_threads_join(void);
 void migrate_decompress_threads_create(void);
 void migrate_decompress_threads_join(void);
+void migrate_multifd_send_threads_create(void);
+void migrate_multifd_send_threads_join(void);
+void migrate_multifd_recv_threads_create(void);
+void migrate_multifd_recv_threads_join(void);
+void migrate_multifd_recv_new_channel(QIOChannel *ioc);
+bool migrate_multifd_recv_all_channels(void);
+QIOChannel *socket_send_channel_create(Error **errp);
 uint64_t ram_bytes_remaining(void);
 uint64_t ram_bytes_transferred(void);
 uint64_t ram_bytes_total(void);
@@ -275,6 +296,14 @@ int ram_postcopy_send_discard_bitmap(MigrationState *ms);
 int ram_discard_range(MigrationIncomingState *mis, const char *block_name,
                       uint64_t start, size_t length);
 int ram_postcopy_incoming_init(MigrationIncomingState *mis);
+/* Free page hinting, see virtio-balloon */
+void qemu_guest_free_page_hint(void *addr, size_t len);
+bool ram_bitmap_range_dirty(ram_addr_t start, ram_addr_t length);
+void ram_add_bitmap_sync_notifier(Notifier *n);
+void ram_remove_bitmap_sync_notifier(Notifier *n);
+int ram_load_postcopy_preempt(QEMUFile *f, void *tmp_page);
+/* For the userfault thread during a lazy restore, see postcopy-ram.h */
+void ram_lazy_restore_page(RAMBlock *block, ram_addr_t offset, void *buf);
 
 /**
  * @migrate_add_blocker - prevent migration from proceeding
@@ -307,8 +336,18 @@ int64_t xbzrle_cache_resize(int64_t new_size);
 bool migrate_use_compression(void);
 int migrate_compress_level(void);
 int migrate_compress_threads(void);
+MigrationCompressMethod migrate_compress_method(void);
 int migrate_decompress_threads(void);
 bool migrate_use_events(void);
+bool migrate_use_multifd(void);
+int migrate_multifd_channels(void);
+bool migrate_dirty_limit(void);
+bool migrate_postcopy_preempt(void);
+bool migrate_mapped_ram(void);
+bool migrate_lazy_restore(void);
+bool migrate_zero_copy_send(void);
+int64_t migrate_vcpu_dirty_limit(void);
+int64_t migrate_rdma_reg_cache_size(void);
 
 /* Sending on the return path - generic and then for each message type */
 void migrate_send_rp_message(MigrationIncomingState *mis,
@@ -96,4 +96,33 @@ int postcopy_place_page_zero(MigrationIncomingState *mis, void *host);
  */
 void *postcopy_get_tmp_page(MigrationIncomingState *mis);
 
+/*
+ * Lazy restore from a mapped-ram file (x-lazy-restore): empty RAM and
+ * have the fault thread serve the missing pages with
+ * ram_lazy_restore_page() until postcopy_lazy_restore_finish().
+ */
+int postcopy_lazy_restore_start(void);
+
+/*
+ * Place a host page, or a zero page if @from is NULL, during a lazy
+ * restore; a page that is already there is fine.
+ * returns 0 on success
+ */
+int postcopy_lazy_place_page(void *host, void *from);
+void postcopy_lazy_restore_finish(void);
+
+/*
+ * Open the channel for urgent pages on the source, if the postcopy-preempt
+ * capability is enabled.
+ */
+int postcopy_preempt_setup(MigrationState *s, Error **errp);
+
+/*
+ * Start reading urgent pages from @ioc on the destination, and wait for
+ * the reader to finish.
+ */
+void postcopy_preempt_new_channel(MigrationIncomingState *mis,
+                                  QIOChannel *ioc);
+void postcopy_preempt_incoming_cleanup(MigrationIncomingState *mis);
+
 #endif
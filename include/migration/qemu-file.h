@@ -28,6 +28,9 @@
 #include "qemu-common.h"
 #include "exec/cpu-common.h"
 #include "io/channel.h"
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
 
 
 /* Read a chunk of data from a file at the given position.  The pos argument
@@ -102,6 +105,28 @@ typedef QEMUFile *(QEMURetPathFunc)(void *opaque);
  */
 typedef int (QEMUFileShutdownFunc)(void *opaque, bool rd, bool wr);
 
+typedef struct QEMUFileRegion {
+    void *buf;
+    size_t size;
+    int64_t pos;
+} QEMUFileRegion;
+
+/*
+ * Read or write each of @n regions of memory at its own position in the
+ * file, outside of the stream.  Only backends with a seekable file behind
+ * them provide this; the regions may be transferred in parallel.
+ * Returns 0 or a negative errno value.
+ */
+typedef int (QEMUFileRegionsFunc)(void *opaque, QEMUFileRegion *regions,
+                                  int n, bool is_write);
+
+/*
+ * Return a descriptor of the file that other threads may read with
+ * pread(), at the positions used by QEMUFileRegionsFunc, or -1.  The
+ * descriptor is owned by the QEMUFile.
+ */
+typedef int (QEMUFileGetFdFunc)(void *opaque);
+
 typedef struct QEMUFileOps {
     QEMUFileGetBufferFunc *get_buffer;
     QEMUFileCloseFunc *close;
@@ -109,6 +134,8 @@ typedef struct QEMUFileOps {
     QEMUFileWritevBufferFunc *writev_buffer;
     QEMURetPathFunc *get_return_path;
     QEMUFileShutdownFunc *shut_down;
+    QEMUFileRegionsFunc *rw_regions;
+    QEMUFileGetFdFunc *get_fd;
 } QEMUFileOps;
 
 typedef struct QEMUFileHooks {
@@ -152,6 +179,11 @@ size_t qemu_get_buffer(QEMUFile *f, uint8_t *buf, size_t size);
 size_t qemu_get_buffer_in_place(QEMUFile *f, uint8_t **buf, size_t size);
 ssize_t qemu_put_compression_data(QEMUFile *f, const uint8_t *p, size_t size,
                                   int level);
+#ifdef CONFIG_ZSTD
+ssize_t qemu_put_compression_data_zstd(QEMUFile *f, ZSTD_CCtx *cctx,
+                                       const uint8_t *p, size_t size,
+                                       int level);
+#endif
 int qemu_put_qemu_file(QEMUFile *f_des, QEMUFile *f_src);
 
 /*
@@ -163,6 +195,12 @@ int qemu_peek_byte(QEMUFile *f, int offset);
 int qemu_get_byte(QEMUFile *f);
 void qemu_file_skip(QEMUFile *f, int size);
 void qemu_update_position(QEMUFile *f, size_t size);
+void qemu_file_update_transfer(QEMUFile *f, size_t size);
+bool qemu_file_is_seekable(QEMUFile *f);
+int qemu_file_rw_regions(QEMUFile *f, QEMUFileRegion *regions, int n,
+                         bool is_write);
+void qemu_fseek(QEMUFile *f, int64_t pos);
+int qemu_file_get_fd(QEMUFile *f);
 
 static inline unsigned int qemu_get_ubyte(QEMUFile *f)
 {
@@ -179,6 +217,7 @@ int qemu_file_rate_limit(QEMUFile *f);
 void qemu_file_reset_rate_limit(QEMUFile *f);
 void qemu_file_set_rate_limit(QEMUFile *f, int64_t new_rate);
 int64_t qemu_file_get_rate_limit(QEMUFile *f);
+int64_t qemu_file_get_write_time(QEMUFile *f);
 int qemu_file_get_error(QEMUFile *f);
 void qemu_file_set_error(QEMUFile *f, int ret);
 int qemu_file_shutdown(QEMUFile *f);
@@ -50,6 +50,10 @@ typedef void (NetPoll)(NetClientState *, bool enable);
 typedef int (NetCanReceive)(NetClientState *);
 typedef ssize_t (NetReceive)(NetClientState *, const uint8_t *, size_t);
 typedef ssize_t (NetReceiveIOV)(NetClientState *, const struct iovec *, int);
+typedef ssize_t (NetReceiveBatch)(NetClientState *, const struct iovec *, int);
+typedef void (NetZerocopyDone)(void *opaque);
+typedef ssize_t (NetReceiveZerocopy)(NetClientState *, const struct iovec *,
+                                     int, NetZerocopyDone *, void *);
 typedef void (NetCleanup) (NetClientState *);
 typedef void (LinkStatusChanged)(NetClientState *);
 typedef void (NetClientDestructor)(NetClientState *);
@@ -62,6 +66,7 @@ typedef void (SetOffload)(NetClientState *, int, int, int, int, int);
 typedef void (SetVnetHdrLen)(NetClientState *, int);
 typedef int (SetVnetLE)(NetClientState *, bool);
 typedef int (SetVnetBE)(NetClientState *, bool);
+typedef void (NetSetAioContext)(NetClientState *, AioContext *);
 typedef struct SocketReadState SocketReadState;
 typedef void (SocketReadStateFinalize)(SocketReadState *rs);
 
@@ -71,6 +76,15 @@ typedef struct NetClientInfo {
     NetReceive *receive;
     NetReceive *receive_raw;
     NetReceiveIOV *receive_iov;
+    /* Takes packets PKTS[0..count-1], each contiguous, and returns how many
+     * it consumed; the others go through the incoming queue.
+     */
+    NetReceiveBatch *receive_batch;
+    /* Sends IOV without copying it.  On success the buffers belong to the
+     * client until it calls done(opaque); otherwise nothing is kept and the
+     * caller sends the packet the usual way.
+     */
+    NetReceiveZerocopy *receive_zerocopy;
     NetCanReceive *can_receive;
     NetCleanup *cleanup;
     LinkStatusChanged *link_status_changed;
@@ -84,6 +98,8 @@ typedef struct NetClientInfo {
     SetVnetHdrLen *set_vnet_hdr_len;
     SetVnetLE *set_vnet_le;
     SetVnetBE *set_vnet_be;
+    /* Moves the client's fd handlers to CTX (NULL for the main loop) */
+    NetSetAioContext *set_aio_context;
 } NetClientInfo;
 
 struct NetClientState {
@@ -151,6 +167,11 @@ void qemu_send_packet(NetClientState *nc, const uint8_t *buf, int size);
 ssize_t qemu_send_packet_raw(NetClientState *nc, const uint8_t *buf, int size);
 ssize_t qemu_send_packet_async(NetClientState *nc, const uint8_t *buf,
                                int size, NetPacketSent *sent_cb);
+int qemu_send_packet_batch_async(NetClientState *nc, const struct iovec *pkts,
+                                 int count, NetPacketSent *sent_cb);
+ssize_t qemu_sendv_packet_zerocopy(NetClientState *nc, const struct iovec *iov,
+                                   int iovcnt, NetZerocopyDone *done,
+                                   void *opaque);
 void qemu_purge_queued_packets(NetClientState *nc);
 void qemu_flush_queued_packets(NetClientState *nc);
 void qemu_format_nic_info_str(NetClientState *nc, uint8_t macaddr[6]);
@@ -163,6 +184,8 @@ void qemu_set_offload(NetClientState *nc, int csum, int tso4, int tso6,
 void qemu_set_vnet_hdr_len(NetClientState *nc, int len);
 int qemu_set_vnet_le(NetClientState *nc, bool is_le);
 int qemu_set_vnet_be(NetClientState *nc, bool is_be);
+bool qemu_net_client_has_aio_context(NetClientState *nc);
+void qemu_net_client_set_aio_context(NetClientState *nc, AioContext *ctx);
 void qemu_macaddr_default_if_unset(MACAddr *macaddr);
 int qemu_show_nic_models(const char *arg, const char *const *models);
 void qemu_check_nic_model(NICInfo *nd, const char *model);
@@ -17,6 +17,9 @@
 #include "qemu-common.h"
 #include "qapi/qmp/qlist.h"
 
+/* @tokens is a queue emitted by a JSONMessageParser.  The parser pops
+ * tokens from it but does not free the queue or the tokens.
+ */
 QObject *json_parser_parse(GQueue *tokens, va_list *ap);
 QObject *json_parser_parse_err(GQueue *tokens, va_list *ap, Error **errp);
 
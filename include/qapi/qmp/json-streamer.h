@@ -23,6 +23,12 @@ typedef struct JSONToken {
     char str[];
 } JSONToken;
 
+typedef struct JSONTokenChunk JSONTokenChunk;
+
+/* Tokens are allocated from chunks owned by the JSONMessageParser, and the
+ * queue passed to @emit is owned by it too.  Both are only valid until
+ * @emit returns.
+ */
 typedef struct JSONMessageParser
 {
     void (*emit)(struct JSONMessageParser *parser, GQueue *tokens);
@@ -30,6 +36,7 @@ typedef struct JSONMessageParser
     int brace_count;
     int bracket_count;
     GQueue *tokens;
+    JSONTokenChunk *chunks;
     uint64_t token_size;
 } JSONMessageParser;
 
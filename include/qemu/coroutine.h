@@ -92,6 +92,20 @@ Coroutine *coroutine_fn qemu_coroutine_self(void);
  */
 bool qemu_in_coroutine(void);
 
+/**
+ * Grow the coroutine pool
+ *
+ * Devices that keep many requests in flight call this when they are created,
+ * so that bursts of I/O reuse pooled coroutines instead of allocating new
+ * ones.  The pool shrinks again with qemu_coroutine_decrease_pool_batch_size().
+ */
+void qemu_coroutine_increase_pool_batch_size(unsigned int additional_pool_size);
+
+/**
+ * Undo qemu_coroutine_increase_pool_batch_size()
+ */
+void qemu_coroutine_decrease_pool_batch_size(unsigned int removing_pool_size);
+
 
 
 /**
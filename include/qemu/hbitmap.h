@@ -145,6 +145,123 @@ void hbitmap_reset_all(HBitmap *hb);
  */
 bool hbitmap_get(const HBitmap *hb, uint64_t item);
 
+/**
+ * hbitmap_next_dirty:
+ * @hb: HBitmap to operate on.
+ * @start: First bit to look at (0-based).
+ * @count: Number of bits to look at.
+ *
+ * Return the first set bit in [@start, @start + @count), or -1 if
+ * there is none.
+ */
+int64_t hbitmap_next_dirty(const HBitmap *hb, uint64_t start, uint64_t count);
+
+/**
+ * hbitmap_next_zero:
+ * @hb: HBitmap to operate on.
+ * @start: First bit to look at (0-based).
+ * @count: Number of bits to look at.
+ *
+ * Return the first clear bit in [@start, @start + @count), or -1 if
+ * there is none.  The search examines a whole word of the last level
+ * at a time.
+ */
+int64_t hbitmap_next_zero(const HBitmap *hb, uint64_t start, uint64_t count);
+
+/**
+ * hbitmap_next_dirty_area:
+ * @hb: HBitmap to operate on.
+ * @start: First bit to look at (0-based).
+ * @end: Bit after the last one to look at.
+ * @count: Location where to store the length of the area.
+ *
+ * Find the first run of set bits in [@start, @end), clipped to that
+ * range and to the size of the bitmap.  Return its first bit and store
+ * its length in *@count, or return -1 if the range has no set bit.
+ */
+int64_t hbitmap_next_dirty_area(const HBitmap *hb, uint64_t start,
+                                uint64_t end, uint64_t *count);
+
+/**
+ * hbitmap_serialization_granularity:
+ * @hb: HBitmap to operate on.
+ *
+ * Granularity of serialization chunks, used by other serialization functions.
+ * For every chunk:
+ * 1. Chunk start should be aligned to this granularity.
+ * 2. Chunk size should be aligned too, except for last chunk (for which
+ *      start + count == hb->size)
+ */
+uint64_t hbitmap_serialization_granularity(const HBitmap *hb);
+
+/**
+ * hbitmap_serialization_size:
+ * @hb: HBitmap to operate on.
+ * @start: Starting bit
+ * @count: Number of bits
+ *
+ * Return number of bytes hbitmap_(de)serialize_part needs
+ */
+uint64_t hbitmap_serialization_size(const HBitmap *hb,
+                                    uint64_t start, uint64_t count);
+
+/**
+ * hbitmap_serialize_part
+ * @hb: HBitmap to operate on.
+ * @buf: Buffer to store serialized bitmap.
+ * @start: First bit to store.
+ * @count: Number of bits to store.
+ *
+ * Stores HBitmap data corresponding to given region.  The format of saved
+ * data is linear sequence of bits, so it can be used by
+ * hbitmap_deserialize_part independently of endianness and size of
+ * HBitmap level array elements.
+ */
+void hbitmap_serialize_part(const HBitmap *hb, uint8_t *buf,
+                            uint64_t start, uint64_t count);
+
+/**
+ * hbitmap_deserialize_part
+ * @hb: HBitmap to operate on.
+ * @buf: Buffer to restore bitmap data from.
+ * @start: First bit to restore.
+ * @count: Number of bits to restore.
+ * @finish: Whether to call hbitmap_deserialize_finish automatically.
+ *
+ * Restores HBitmap data corresponding to given region.  The format is the
+ * same as for hbitmap_serialize_part.
+ *
+ * If @finish is false, caller must call hbitmap_deserialize_finish before
+ * using the bitmap.
+ */
+void hbitmap_deserialize_part(HBitmap *hb, uint8_t *buf,
+                              uint64_t start, uint64_t count,
+                              bool finish);
+
+/**
+ * hbitmap_deserialize_zeroes
+ * @hb: HBitmap to operate on.
+ * @start: First bit to restore.
+ * @count: Number of bits to restore.
+ * @finish: Whether to call hbitmap_deserialize_finish automatically.
+ *
+ * Fills the bitmap with zeroes.
+ *
+ * If @finish is false, caller must call hbitmap_deserialize_finish before
+ * using the bitmap.
+ */
+void hbitmap_deserialize_zeroes(HBitmap *hb, uint64_t start, uint64_t count,
+                                bool finish);
+
+/**
+ * hbitmap_deserialize_finish
+ * @hb: HBitmap to operate on.
+ *
+ * Repair HBitmap after calling hbitmap_deserialize_part.  Actually, all
+ * HBitmap layers are restored here from the last level.
+ */
+void hbitmap_deserialize_finish(HBitmap *hb);
+
 /**
  * hbitmap_free:
  * @hb: HBitmap to operate on.
@@ -0,0 +1,86 @@
+/*
+ * Interval tree of half-open 64-bit ranges
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_INTERVAL_TREE_H
+#define QEMU_INTERVAL_TREE_H
+
+/*
+ * Nodes are embedded in the objects they index, the tree never allocates.
+ * Each node covers [start, end), several nodes may have the same range.
+ * Lookups return the nodes overlapping a range in O(log n) per result.
+ *
+ * The tree is a treap ordered by start, each node also keeps the largest
+ * end of its subtree. It is not thread safe, callers provide the locking.
+ */
+
+typedef struct IntervalTreeNode IntervalTreeNode;
+
+struct IntervalTreeNode {
+    uint64_t start;
+    uint64_t end;
+    /* private */
+    uint64_t subtree_end;
+    IntervalTreeNode *left;
+    IntervalTreeNode *right;
+};
+
+typedef struct IntervalTreeRoot {
+    IntervalTreeNode *root;
+} IntervalTreeRoot;
+
+#define INTERVAL_TREE_ROOT_INIT { .root = NULL }
+
+static inline bool interval_tree_empty(IntervalTreeRoot *root)
+{
+    return root->root == NULL;
+}
+
+/**
+ * interval_tree_insert:
+ * @root: the tree
+ * @node: a node not in any tree, with @start and @end set
+ *
+ * @start and @end must not change while the node is in the tree, remove
+ * and insert it again instead.
+ */
+void interval_tree_insert(IntervalTreeRoot *root, IntervalTreeNode *node);
+
+/**
+ * interval_tree_remove:
+ * @root: the tree
+ * @node: a node of @root
+ */
+void interval_tree_remove(IntervalTreeRoot *root, IntervalTreeNode *node);
+
+/**
+ * interval_tree_iter_first:
+ * @root: the tree
+ * @start: first byte of the range
+ * @end: end of the range, exclusive
+ *
+ * Return the node with the lowest start that overlaps [@start, @end), or
+ * NULL. A node overlaps when node->start < @end and @start < node->end,
+ * so an empty range is overlapped by the nodes containing it strictly.
+ */
+IntervalTreeNode *interval_tree_iter_first(IntervalTreeRoot *root,
+                                           uint64_t start, uint64_t end);
+
+/**
+ * interval_tree_iter_next:
+ * @root: the tree
+ * @node: a node returned by the previous lookup of the same range
+ * @start: first byte of the range
+ * @end: end of the range, exclusive
+ *
+ * Return the next node overlapping [@start, @end) after @node, or NULL.
+ * @node must still be in the tree.
+ */
+IntervalTreeNode *interval_tree_iter_next(IntervalTreeRoot *root,
+                                          IntervalTreeNode *node,
+                                          uint64_t start, uint64_t end);
+
+#endif
@@ -383,7 +383,10 @@ unsigned long qemu_getauxval(unsigned long type);
 
 void qemu_set_tty_echo(int fd, bool echo);
 
-void os_mem_prealloc(int fd, char *area, size_t sz, Error **errp);
+/* Allocate the host pages behind [area, area + sz), touching them from up
+ * to @max_threads threads */
+void os_mem_prealloc(int fd, char *area, size_t sz, int max_threads,
+                     Error **errp);
 
 int qemu_read_password(char *buf, int buf_size);
 
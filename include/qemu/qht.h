@@ -21,6 +21,8 @@ struct qht {
  * struct qht_stats - Statistics of a QHT
  * @head_buckets: number of head buckets
  * @used_head_buckets: number of non-empty head buckets
+ * @pending_head_buckets: number of head buckets of the previous map whose
+ *                        entries have not been moved yet by an ongoing resize
  * @entries: total number of entries
  * @chain: frequency distribution representing the number of buckets in each
  *         chain, excluding empty chains.
@@ -34,6 +36,7 @@ struct qht {
 struct qht_stats {
     size_t head_buckets;
     size_t used_head_buckets;
+    size_t pending_head_buckets;
     size_t entries;
     struct qdist chain;
     struct qdist occupancy;
@@ -146,6 +149,10 @@ bool qht_reset_size(struct qht *ht, size_t n_elems);
  * @ht: QHT to be resized
  * @n_elems: number of entries the resized hash table should be optimized for
  *
+ * The new map is published right away; entries are moved to it lazily by
+ * subsequent insertions and removals. A resize still in progress from an
+ * earlier call is completed first.
+ *
  * Returns true on success.
  * Returns false if the resize was not necessary and therefore not performed.
  * See also: qht_reset_size().
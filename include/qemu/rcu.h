@@ -63,6 +63,12 @@ struct rcu_reader_data {
     /* Data used by reader only */
     unsigned depth;
 
+    /* Callbacks queued by this thread inside rcu_call_batch_begin/end */
+    unsigned batch_depth;
+    unsigned batch_count;
+    struct rcu_head *batch_head;
+    struct rcu_head **batch_tail;
+
     /* Data used for registry, protected by rcu_registry_lock */
     QLIST_ENTRY(rcu_reader_data) node;
 };
@@ -116,6 +122,9 @@ struct rcu_head {
 };
 
 extern void call_rcu1(struct rcu_head *head, RCUCBFunc *func);
+extern void rcu_call_batch_begin(void);
+extern void rcu_call_batch_end(void);
+extern void call_rcu_expedite(void);
 
 /* The operands of the minus operator must have the same type,
  * which must be the one that we specify in the cast.
@@ -0,0 +1,37 @@
+/*
+ * Startup profiling
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_STARTUP_PROFILE_H
+#define QEMU_STARTUP_PROFILE_H
+
+/*
+ * Time spent in each phase of startup, for query-startup-profile.
+ *
+ * Records are kept from startup_profile_init() until startup_profile_done(),
+ * which adds a last "startup" phase covering the whole window.  Outside it
+ * the functions below do nothing, so that e.g. device hotplug is not
+ * recorded.
+ */
+typedef struct StartupProfileRecord {
+    const char *kind;           /* "phase", "module" or "device" */
+    char *name;
+    int64_t start_ns;           /* since startup_profile_init() */
+    int64_t duration_ns;
+} StartupProfileRecord;
+
+void startup_profile_init(void);
+void startup_profile_done(void);
+
+/* Returns the start time to pass to startup_profile_end(), or 0 */
+int64_t startup_profile_begin(void);
+void startup_profile_end(const char *kind, const char *name, int64_t start);
+
+void startup_profile_foreach(void (*fn)(const StartupProfileRecord *rec,
+                                        void *opaque),
+                             void *opaque);
+
+#endif
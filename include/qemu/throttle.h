@@ -142,6 +142,10 @@ void throttle_config(ThrottleState *ts,
                      ThrottleTimers *tt,
                      ThrottleConfig *cfg);
 
+void throttle_set_config(ThrottleState *ts,
+                         QEMUClockType clock_type,
+                         ThrottleConfig *cfg);
+
 void throttle_get_config(ThrottleState *ts, ThrottleConfig *cfg);
 
 void throttle_config_init(ThrottleConfig *cfg);
@@ -151,6 +155,8 @@ bool throttle_schedule_timer(ThrottleState *ts,
                              ThrottleTimers *tt,
                              bool is_write);
 
+int64_t throttle_compute_delay(ThrottleState *ts, bool is_write, int64_t now);
+
 void throttle_account(ThrottleState *ts, bool is_write, uint64_t size);
 
 #endif
@@ -70,7 +70,10 @@ struct QEMUTimer {
     QEMUTimerList *timer_list;
     QEMUTimerCB *cb;
     void *opaque;
-    QEMUTimer *next;
+    /* position in the timer list's heap, and order among equal expiry
+     * times; only meaningful while the timer is pending */
+    unsigned int heap_index;
+    uint64_t seq;
     int scale;
 };
 
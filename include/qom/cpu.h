@@ -227,6 +227,7 @@ struct CPUWatchpoint {
 
 struct KVMState;
 struct kvm_run;
+struct kvm_dirty_gfn;
 
 #define TB_JMP_CACHE_BITS 12
 #define TB_JMP_CACHE_SIZE (1 << TB_JMP_CACHE_BITS)
@@ -280,6 +281,11 @@ struct qemu_work_item {
  * @mem_io_pc: Host Program Counter at which the memory was accessed.
  * @mem_io_vaddr: Target virtual address at which the memory was accessed.
  * @kvm_fd: vCPU file descriptor for KVM.
+ * @kvm_dirty_gfns: KVM dirty ring of the vCPU, if dirty rings are in use.
+ * @kvm_fetch_index: Next entry of @kvm_dirty_gfns to be harvested.
+ * @kvm_dirty_pages: Pages harvested from @kvm_dirty_gfns in the current
+ *   dirty limit period.
+ * @kvm_throttle_us: Time the vCPU sleeps every time its dirty ring is full.
  * @work_mutex: Lock to prevent multiple access to queued_work_*.
  * @queued_work_first: First asynchronous work pending.
  * @trace_dstate: Dynamic tracing state of events for this vCPU (bitmask).
@@ -326,6 +332,8 @@ struct CPUState {
 
     void *env_ptr; /* CPUArchState */
     struct TranslationBlock *tb_jmp_cache[TB_JMP_CACHE_SIZE];
+    struct CPUL2TLB *l2tlb; /* softmmu second-level TLB, see cputlb.c */
+    struct TBSampleRing *tb_samples; /* see tb_sample_* */
     struct GDBRegisterState *gdb_regs;
     int gdb_num_regs;
     int gdb_num_g_regs;
@@ -349,6 +357,10 @@ struct CPUState {
     bool kvm_vcpu_dirty;
     struct KVMState *kvm_state;
     struct kvm_run *kvm_run;
+    struct kvm_dirty_gfn *kvm_dirty_gfns;
+    uint32_t kvm_fetch_index;
+    uint64_t kvm_dirty_pages;
+    uint32_t kvm_throttle_us;
 
     /* Used for events with 'vcpu' and *without* the 'disabled' properties */
     DECLARE_BITMAP(trace_dstate, TRACE_VCPU_EVENT_COUNT);
@@ -63,4 +63,7 @@
 /* v1.0 compliant. */
 #define VIRTIO_F_VERSION_1		32
 
+/* This feature indicates support for the packed virtqueue layout. */
+#define VIRTIO_F_RING_PACKED		34
+
 #endif /* _LINUX_VIRTIO_CONFIG_H */
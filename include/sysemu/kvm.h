@@ -205,6 +205,9 @@ extern KVMState *kvm_state;
 /* external API */
 
 bool kvm_has_free_slot(MachineState *ms);
+bool kvm_dirty_ring_enabled(void);
+/* Throttle vCPUs that dirty more than @mbps MB/s; 0 removes the limit */
+void kvm_dirty_limit_set(uint64_t mbps);
 int kvm_has_sync_mmu(void);
 int kvm_has_vcpu_events(void);
 int kvm_has_robust_singlestep(void);
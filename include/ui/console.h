@@ -29,6 +29,8 @@
 /* in ms */
 #define GUI_REFRESH_INTERVAL_DEFAULT    30
 #define GUI_REFRESH_INTERVAL_IDLE     3000
+/* Slowest refresh for listeners with the default interval, when idle */
+#define GUI_REFRESH_INTERVAL_BACKOFF   240
 
 /* Color number is match to standard vga palette */
 enum qemu_color_names {
@@ -376,6 +378,7 @@ void graphic_console_set_hwops(QemuConsole *con,
                                void *opaque);
 
 void graphic_hw_update(QemuConsole *con);
+void qemu_console_kick_refresh(void);
 void graphic_hw_invalidate(QemuConsole *con);
 void graphic_hw_text_update(QemuConsole *con, console_ch_t *chardata);
 void graphic_hw_gl_block(QemuConsole *con, bool block);
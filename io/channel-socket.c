@@ -25,6 +25,13 @@
 #include "trace.h"
 #include "qapi/clone-visitor.h"
 
+#ifdef CONFIG_LINUX
+#include <linux/errqueue.h>
+#if defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY)
+#define QEMU_MSG_ZEROCOPY
+#endif
+#endif
+
 #define SOCKET_MAX_FDS 16
 
 SocketAddress *
@@ -110,6 +117,14 @@ qio_channel_socket_set_fd(QIOChannelSocket *sioc,
         ioc->features |= (1 << QIO_CHANNEL_FEATURE_FD_PASS);
     }
 #endif /* WIN32 */
+#ifdef QEMU_MSG_ZEROCOPY
+    /* The kernel only does zero copy sends for TCP */
+    if (sioc->localAddr.ss_family == AF_INET ||
+        sioc->localAddr.ss_family == AF_INET6) {
+        QIO_CHANNEL(sioc)->features |=
+            (1 << QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY);
+    }
+#endif
     if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &val, &len) == 0 && val) {
         QIOChannel *ioc = QIO_CHANNEL(sioc);
         ioc->features |= (1 << QIO_CHANNEL_FEATURE_LISTEN);
@@ -568,6 +583,116 @@ static ssize_t qio_channel_socket_writev(QIOChannel *ioc,
     }
     return ret;
 }
+
+#ifdef QEMU_MSG_ZEROCOPY
+static ssize_t qio_channel_socket_writev_zero_copy(QIOChannel *ioc,
+                                                   const struct iovec *iov,
+                                                   size_t niov,
+                                                   Error **errp)
+{
+    QIOChannelSocket *sioc = QIO_CHANNEL_SOCKET(ioc);
+    struct msghdr msg = { NULL, };
+    ssize_t ret;
+
+    if (!sioc->zero_copy_enabled) {
+        int v = 1;
+
+        if (setsockopt(sioc->fd, SOL_SOCKET, SO_ZEROCOPY,
+                       &v, sizeof(v)) < 0) {
+            error_setg_errno(errp, errno,
+                             "Unable to enable zero copy on socket");
+            return -1;
+        }
+        sioc->zero_copy_enabled = true;
+    }
+
+    msg.msg_iov = (struct iovec *)iov;
+    msg.msg_iovlen = niov;
+
+ retry:
+    ret = sendmsg(sioc->fd, &msg, MSG_ZEROCOPY);
+    if (ret <= 0) {
+        if (errno == EAGAIN) {
+            return QIO_CHANNEL_ERR_BLOCK;
+        }
+        if (errno == EINTR) {
+            goto retry;
+        }
+        if (errno == ENOBUFS) {
+            error_setg_errno(errp, errno,
+                             "Not enough memory to track zero copy sends, "
+                             "raise net.core.optmem_max");
+            return -1;
+        }
+        error_setg_errno(errp, errno,
+                         "Unable to write to socket");
+        return -1;
+    }
+    /* Every successful call gets one completion notification */
+    sioc->zero_copy_queued++;
+    trace_qio_channel_socket_writev_zero_copy(sioc, ret);
+    return ret;
+}
+
+/*
+ * Completions of MSG_ZEROCOPY sends come back on the socket error queue,
+ * each covering a range of calls.
+ */
+static int qio_channel_socket_flush(QIOChannel *ioc,
+                                    Error **errp)
+{
+    QIOChannelSocket *sioc = QIO_CHANNEL_SOCKET(ioc);
+    struct sock_extended_err *serr;
+    struct cmsghdr *cm;
+    char control[CMSG_SPACE(sizeof(*serr))];
+    struct msghdr msg = { NULL, };
+    int ret = 0;
+
+    while (sioc->zero_copy_sent < sioc->zero_copy_queued) {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (recvmsg(sioc->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            if (errno == EAGAIN) {
+                /* The error queue becoming non-empty is reported as POLLERR */
+                qio_channel_wait(ioc, G_IO_ERR);
+                continue;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            error_setg_errno(errp, errno,
+                             "Unable to read socket error queue");
+            return -1;
+        }
+
+        cm = CMSG_FIRSTHDR(&msg);
+        if (!cm ||
+            ((cm->cmsg_level != SOL_IP || cm->cmsg_type != IP_RECVERR) &&
+             (cm->cmsg_level != SOL_IPV6 ||
+              cm->cmsg_type != IPV6_RECVERR))) {
+            error_setg_errno(errp, EPROTO,
+                             "Unexpected message in socket error queue");
+            return -1;
+        }
+        serr = (struct sock_extended_err *)CMSG_DATA(cm);
+        if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr->ee_errno) {
+            error_setg_errno(errp, serr->ee_errno ? serr->ee_errno : EPROTO,
+                             "Zero copy send failed");
+            return -1;
+        }
+
+        /* ee_info to ee_data is the range of completed calls */
+        sioc->zero_copy_sent += serr->ee_data - serr->ee_info + 1;
+        if (serr->ee_code == SO_EE_CODE_ZEROCOPY_COPIED) {
+            ret = 1;
+        }
+    }
+    trace_qio_channel_socket_flush(sioc, ret);
+    return ret;
+}
+#endif /* QEMU_MSG_ZEROCOPY */
 #else /* WIN32 */
 static ssize_t qio_channel_socket_readv(QIOChannel *ioc,
                                         const struct iovec *iov,
@@ -771,6 +896,10 @@ static void qio_channel_socket_class_init(ObjectClass *klass,
     ioc_klass->io_set_cork = qio_channel_socket_set_cork;
     ioc_klass->io_set_delay = qio_channel_socket_set_delay;
     ioc_klass->io_create_watch = qio_channel_socket_create_watch;
+#ifdef QEMU_MSG_ZEROCOPY
+    ioc_klass->io_writev_zero_copy = qio_channel_socket_writev_zero_copy;
+    ioc_klass->io_flush = qio_channel_socket_flush;
+#endif
 }
 
 static const TypeInfo qio_channel_socket_info = {
@@ -21,6 +21,7 @@
 #include "qemu/osdep.h"
 #include "qapi/error.h"
 #include "io/channel-tls.h"
+#include "io/channel-socket.h"
 #include "trace.h"
 
 
@@ -145,6 +146,25 @@ static gboolean qio_channel_tls_handshake_io(QIOChannel *ioc,
                                              GIOCondition condition,
                                              gpointer user_data);
 
+/*
+ * Let the kernel encrypt outgoing data if it can, so that bulk writes
+ * go straight from the caller's buffers into the socket.  Failing that,
+ * gnutls keeps doing it.
+ */
+static void qio_channel_tls_offload(QIOChannelTLS *ioc)
+{
+    QIOChannelSocket *sioc;
+
+    if (!object_dynamic_cast(OBJECT(ioc->master), TYPE_QIO_CHANNEL_SOCKET)) {
+        return;
+    }
+    sioc = QIO_CHANNEL_SOCKET(ioc->master);
+
+    ioc->offload_tx = qcrypto_tls_session_offload_tx(ioc->session, sioc->fd,
+                                                     NULL) == 0;
+    trace_qio_channel_tls_offload_tx(ioc, ioc->offload_tx);
+}
+
 static void qio_channel_tls_handshake_task(QIOChannelTLS *ioc,
                                            QIOTask *task)
 {
@@ -167,6 +187,7 @@ static void qio_channel_tls_handshake_task(QIOChannelTLS *ioc,
             goto cleanup;
         }
         trace_qio_channel_tls_credentials_allow(ioc);
+        qio_channel_tls_offload(ioc);
         qio_task_complete(task);
     } else {
         GIOCondition condition;
@@ -282,6 +303,10 @@ static ssize_t qio_channel_tls_writev(QIOChannel *ioc,
     size_t i;
     ssize_t done = 0;
 
+    if (tioc->offload_tx) {
+        return qio_channel_writev(tioc->master, iov, niov, errp);
+    }
+
     for (i = 0 ; i < niov ; i++) {
         ssize_t ret = qcrypto_tls_session_write(tioc->session,
                                                 iov[i].iov_base,
@@ -38,6 +38,8 @@
 #include "hw/irq.h"
 
 #include "hw/boards.h"
+#include "qemu/main-loop.h"
+#include "qemu/rcu.h"
 
 /* This check must be after config-host.h is included */
 #ifdef CONFIG_EVENTFD
@@ -61,9 +63,16 @@
 
 #define KVM_MSI_HASHTAB_SIZE    256
 
+/* Memory address spaces (as_id) that dirty ring entries can refer to */
+#define KVM_MAX_ADDRESS_SPACES  2
+
+/* Interval at which the reaper thread harvests the dirty rings, in us */
+#define KVM_DIRTY_RING_REAP_INTERVAL    1000000
+
 struct KVMParkedVcpu {
     unsigned long vcpu_id;
     int kvm_fd;
+    uint32_t kvm_fetch_index;
     QLIST_ENTRY(KVMParkedVcpu) node;
 };
 
@@ -101,6 +110,13 @@ struct KVMState
 #endif
     KVMMemoryListener memory_listener;
     QLIST_HEAD(, KVMParkedVcpu) kvm_parked_vcpus;
+    /* Memory listeners by as_id, to look up dirty ring entries */
+    KVMMemoryListener *as_listener[KVM_MAX_ADDRESS_SPACES];
+    /* Entries per vCPU dirty ring, 0 if the dirty bitmap is used */
+    uint32_t dirty_ring_size;
+    QemuThread dirty_ring_reaper;
+    /* Per-vCPU dirty page rate limit in MB/s, 0 if unlimited */
+    uint64_t dirty_limit;
 };
 
 KVMState *kvm_state;
@@ -154,6 +170,11 @@ bool kvm_has_free_slot(MachineState *ms)
     return kvm_get_free_slot(&s->memory_listener);
 }
 
+bool kvm_dirty_ring_enabled(void)
+{
+    return kvm_state && kvm_state->dirty_ring_size;
+}
+
 static KVMSlot *kvm_alloc_slot(KVMMemoryListener *kml)
 {
     KVMSlot *slot = kvm_get_free_slot(kml);
@@ -251,6 +272,8 @@ static int kvm_set_user_memory_region(KVMMemoryListener *kml, KVMSlot *slot)
     return kvm_vm_ioctl(s, KVM_SET_USER_MEMORY_REGION, &mem);
 }
 
+static void kvm_dirty_ring_reap(KVMState *s);
+
 int kvm_destroy_vcpu(CPUState *cpu)
 {
     KVMState *s = kvm_state;
@@ -272,15 +295,26 @@ int kvm_destroy_vcpu(CPUState *cpu)
         goto err;
     }
 
+    if (cpu->kvm_dirty_gfns) {
+        kvm_dirty_ring_reap(s);
+        ret = munmap(cpu->kvm_dirty_gfns,
+                     s->dirty_ring_size * sizeof(struct kvm_dirty_gfn));
+        if (ret < 0) {
+            goto err;
+        }
+        cpu->kvm_dirty_gfns = NULL;
+    }
+
     vcpu = g_malloc0(sizeof(*vcpu));
     vcpu->vcpu_id = kvm_arch_vcpu_id(cpu);
     vcpu->kvm_fd = cpu->kvm_fd;
+    vcpu->kvm_fetch_index = cpu->kvm_fetch_index;
     QLIST_INSERT_HEAD(&kvm_state->kvm_parked_vcpus, vcpu, node);
 err:
     return ret;
 }
 
-static int kvm_get_vcpu(KVMState *s, unsigned long vcpu_id)
+static int kvm_get_vcpu(KVMState *s, CPUState *cs, unsigned long vcpu_id)
 {
     struct KVMParkedVcpu *cpu;
 
@@ -290,6 +324,8 @@ static int kvm_get_vcpu(KVMState *s, unsigned long vcpu_id)
 
             QLIST_REMOVE(cpu, node);
             kvm_fd = cpu->kvm_fd;
+            /* The ring of the vCPU carries on where it stopped */
+            cs->kvm_fetch_index = cpu->kvm_fetch_index;
             g_free(cpu);
             return kvm_fd;
         }
@@ -306,7 +342,7 @@ int kvm_init_vcpu(CPUState *cpu)
 
     DPRINTF("kvm_init_vcpu\n");
 
-    ret = kvm_get_vcpu(s, kvm_arch_vcpu_id(cpu));
+    ret = kvm_get_vcpu(s, cpu, kvm_arch_vcpu_id(cpu));
     if (ret < 0) {
         DPRINTF("kvm_create_vcpu failed\n");
         goto err;
@@ -336,6 +372,20 @@ int kvm_init_vcpu(CPUState *cpu)
             (void *)cpu->kvm_run + s->coalesced_mmio * PAGE_SIZE;
     }
 
+    if (s->dirty_ring_size) {
+        cpu->kvm_dirty_gfns = mmap(NULL, s->dirty_ring_size *
+                                   sizeof(struct kvm_dirty_gfn),
+                                   PROT_READ | PROT_WRITE, MAP_SHARED,
+                                   cpu->kvm_fd,
+                                   PAGE_SIZE * KVM_DIRTY_LOG_PAGE_OFFSET);
+        if (cpu->kvm_dirty_gfns == MAP_FAILED) {
+            cpu->kvm_dirty_gfns = NULL;
+            ret = -errno;
+            DPRINTF("mmap'ing vcpu dirty ring failed\n");
+            goto err;
+        }
+    }
+
     ret = kvm_arch_init_vcpu(cpu);
 err:
     return ret;
@@ -501,6 +551,190 @@ static int kvm_physical_sync_dirty_bitmap(KVMMemoryListener *kml,
     return ret;
 }
 
+/*
+ * Dirty rings
+ *
+ * With KVM_CAP_DIRTY_LOG_RING, KVM appends the GFN of every page that a vCPU
+ * dirties to a ring shared with that vCPU, instead of setting a bit in the
+ * dirty bitmap of the slot.  Harvesting the rings costs time proportional
+ * to the number of dirtied pages rather than to the size of guest RAM.
+ *
+ * The rings are harvested under the BQL: by a reaper thread once a second,
+ * at every dirty log sync, and by a vCPU that finds its ring full.
+ */
+
+static void kvm_dirty_ring_mark_page(KVMState *s, uint32_t as_id,
+                                     uint32_t slot_id, uint64_t offset)
+{
+    KVMMemoryListener *kml;
+    KVMSlot *mem;
+    ram_addr_t ram_addr;
+
+    if (as_id >= KVM_MAX_ADDRESS_SPACES || !s->as_listener[as_id] ||
+        slot_id >= s->nr_slots) {
+        return;
+    }
+    kml = s->as_listener[as_id];
+    mem = &kml->slots[slot_id];
+
+    /* The slot may have gone away since the page was dirtied */
+    if (offset >= mem->memory_size / getpagesize()) {
+        return;
+    }
+    ram_addr = qemu_ram_addr_from_host(mem->ram + offset * getpagesize());
+    if (ram_addr == RAM_ADDR_INVALID) {
+        return;
+    }
+    cpu_physical_memory_set_dirty_range(ram_addr, getpagesize(),
+                                        tcg_enabled() ? DIRTY_CLIENTS_ALL :
+                                                        DIRTY_CLIENTS_NOCODE);
+}
+
+/* Returns the number of entries harvested from the ring of @cpu */
+static uint32_t kvm_dirty_ring_reap_one(KVMState *s, CPUState *cpu)
+{
+    struct kvm_dirty_gfn *gfns = cpu->kvm_dirty_gfns, *cur;
+    uint32_t ring_mask = s->dirty_ring_size - 1;
+    uint32_t fetch = cpu->kvm_fetch_index;
+    uint32_t i, count = 0;
+
+    for (;;) {
+        cur = &gfns[(fetch + count) & ring_mask];
+        if (!(atomic_read(&cur->flags) & KVM_DIRTY_GFN_F_DIRTY)) {
+            break;
+        }
+        smp_rmb();
+        kvm_dirty_ring_mark_page(s, cur->slot >> 16, cur->slot & 0xffff,
+                                 cur->offset);
+        if (++count == s->dirty_ring_size) {
+            break;
+        }
+    }
+    if (!count) {
+        return 0;
+    }
+
+    /* Hand the entries back to KVM only after they have been read */
+    smp_mb();
+    for (i = 0; i < count; i++) {
+        atomic_set(&gfns[(fetch + i) & ring_mask].flags,
+                   KVM_DIRTY_GFN_F_RESET);
+    }
+    cpu->kvm_fetch_index = fetch + count;
+    cpu->kvm_dirty_pages += count;
+
+    return count;
+}
+
+/* Called with the BQL held */
+static void kvm_dirty_ring_reap(KVMState *s)
+{
+    CPUState *cpu;
+    uint64_t total = 0;
+
+    rcu_read_lock();
+    CPU_FOREACH(cpu) {
+        if (cpu->kvm_dirty_gfns) {
+            total += kvm_dirty_ring_reap_one(s, cpu);
+        }
+    }
+    rcu_read_unlock();
+
+    if (total) {
+        /* Write protect the harvested pages again */
+        kvm_vm_ioctl(s, KVM_RESET_DIRTY_RINGS);
+    }
+    trace_kvm_dirty_ring_reap(total);
+}
+
+/* Adjust how long each vCPU sleeps when its dirty ring fills up, so that
+ * the ring fills up no faster than the dirty limit allows.  Only vCPUs
+ * that actually fill their ring are slowed down.  Called with the BQL
+ * held, right after a reap, once every KVM_DIRTY_RING_REAP_INTERVAL.
+ */
+static void kvm_dirty_limit_update(KVMState *s)
+{
+    uint64_t limit = atomic_read(&s->dirty_limit);
+    uint64_t ring_bytes = (uint64_t)s->dirty_ring_size * getpagesize();
+    int64_t target_full_us, measured_full_us, sleep_us;
+    uint64_t rate;
+    CPUState *cpu;
+
+    rcu_read_lock();
+    CPU_FOREACH(cpu) {
+        rate = (cpu->kvm_dirty_pages * getpagesize() * 1000000 /
+                KVM_DIRTY_RING_REAP_INTERVAL) >> 20;
+        cpu->kvm_dirty_pages = 0;
+
+        if (!limit) {
+            atomic_set(&cpu->kvm_throttle_us, 0);
+            continue;
+        }
+
+        /* Time between two full rings, at the limit and as measured */
+        target_full_us = ring_bytes * 1000000 / (limit << 20);
+        sleep_us = atomic_read(&cpu->kvm_throttle_us);
+        if (!rate) {
+            sleep_us /= 2;
+        } else {
+            measured_full_us = ring_bytes * 1000000 / (rate << 20);
+            sleep_us += (target_full_us - measured_full_us) / 2;
+        }
+        sleep_us = MAX(0, MIN(sleep_us, MIN(target_full_us, UINT32_MAX)));
+
+        atomic_set(&cpu->kvm_throttle_us, sleep_us);
+        trace_kvm_dirty_limit_throttle(cpu->cpu_index, rate, sleep_us);
+    }
+    rcu_read_unlock();
+}
+
+void kvm_dirty_limit_set(uint64_t mbps)
+{
+    if (kvm_dirty_ring_enabled()) {
+        atomic_set(&kvm_state->dirty_limit, mbps);
+    }
+}
+
+/* Called by a vCPU thread whose dirty ring is full, without the BQL */
+static void kvm_dirty_limit_throttle(KVMState *s, CPUState *cpu)
+{
+    uint32_t sleep_us = atomic_read(&cpu->kvm_throttle_us);
+    uint32_t slice_us;
+
+    /* Sleep in slices so that the vCPU still responds to pause requests
+     * and to the limit being lifted. */
+    while (sleep_us && !atomic_read(&cpu->exit_request) &&
+           atomic_read(&s->dirty_limit)) {
+        slice_us = MIN(sleep_us, 10000);
+        g_usleep(slice_us);
+        sleep_us -= slice_us;
+    }
+}
+
+static void *kvm_dirty_ring_reaper_thread(void *opaque)
+{
+    KVMState *s = opaque;
+
+    rcu_register_thread();
+
+    for (;;) {
+        g_usleep(KVM_DIRTY_RING_REAP_INTERVAL);
+
+        qemu_mutex_lock_iothread();
+        kvm_dirty_ring_reap(s);
+        kvm_dirty_limit_update(s);
+        qemu_mutex_unlock_iothread();
+    }
+
+    return NULL;
+}
+
+static void do_kvm_dirty_ring_flush(void *arg)
+{
+    /* Nothing to do: leaving KVM_RUN is enough for the processor to flush
+     * the GFNs it logged (e.g. with PML) to the ring of the vCPU. */
+}
+
 static void kvm_coalesce_mmio_region(MemoryListener *listener,
                                      MemoryRegionSection *secion,
                                      hwaddr start, hwaddr size)
@@ -874,12 +1108,30 @@ static void kvm_log_sync(MemoryListener *listener,
     KVMMemoryListener *kml = container_of(listener, KVMMemoryListener, listener);
     int r;
 
+    if (kvm_state->dirty_ring_size) {
+        kvm_dirty_ring_reap(kvm_state);
+        return;
+    }
+
     r = kvm_physical_sync_dirty_bitmap(kml, section);
     if (r < 0) {
         abort();
     }
 }
 
+/* Make sure that the rings hold every page dirtied so far, then harvest
+ * them, so that the following log_sync calls have nothing left to do.
+ */
+static void kvm_log_sync_global(MemoryListener *listener)
+{
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        run_on_cpu(cpu, do_kvm_dirty_ring_flush, NULL);
+    }
+    kvm_dirty_ring_reap(kvm_state);
+}
+
 static void kvm_mem_ioeventfd_add(MemoryListener *listener,
                                   MemoryRegionSection *section,
                                   bool match_data, uint64_t data,
@@ -956,6 +1208,8 @@ void kvm_memory_listener_register(KVMState *s, KVMMemoryListener *kml,
 
     kml->slots = g_malloc0(s->nr_slots * sizeof(KVMSlot));
     kml->as_id = as_id;
+    assert(as_id < KVM_MAX_ADDRESS_SPACES);
+    s->as_listener[as_id] = kml;
 
     for (i = 0; i < s->nr_slots; i++) {
         kml->slots[i].slot = i;
@@ -966,6 +1220,9 @@ void kvm_memory_listener_register(KVMState *s, KVMMemoryListener *kml,
     kml->listener.log_start = kvm_log_start;
     kml->listener.log_stop = kvm_log_stop;
     kml->listener.log_sync = kvm_log_sync;
+    if (s->dirty_ring_size) {
+        kml->listener.log_sync_global = kvm_log_sync_global;
+    }
     kml->listener.priority = 10;
 
     memory_listener_register(&kml->listener, as);
@@ -1734,6 +1991,33 @@ static int kvm_init(MachineState *ms)
     kvm_ioeventfd_any_length_allowed =
         (kvm_check_extension(s, KVM_CAP_IOEVENTFD_ANY_LENGTH) > 0);
 
+    s->dirty_ring_size = machine_kvm_dirty_ring_size(ms);
+    if (s->dirty_ring_size) {
+        uint64_t ring_bytes = (uint64_t)s->dirty_ring_size *
+                              sizeof(struct kvm_dirty_gfn);
+        int max_bytes = kvm_vm_check_extension(s, KVM_CAP_DIRTY_LOG_RING);
+
+        if (max_bytes <= 0) {
+            error_report("warning: KVM dirty ring not supported by the host, "
+                         "using the dirty bitmap");
+            s->dirty_ring_size = 0;
+        } else if (ring_bytes > max_bytes) {
+            error_report("kvm-dirty-ring-size %" PRIu32 " is too large, "
+                         "the host supports at most %zu entries",
+                         s->dirty_ring_size,
+                         max_bytes / sizeof(struct kvm_dirty_gfn));
+            ret = -EINVAL;
+            goto err;
+        } else {
+            ret = kvm_vm_enable_cap(s, KVM_CAP_DIRTY_LOG_RING, 0, ring_bytes);
+            if (ret < 0) {
+                error_report("Enabling the KVM dirty ring failed: %s",
+                             strerror(-ret));
+                goto err;
+            }
+        }
+    }
+
     ret = kvm_arch_init(ms, s);
     if (ret < 0) {
         goto err;
@@ -1759,6 +2043,12 @@ static int kvm_init(MachineState *ms)
 
     s->many_ioeventfds = kvm_check_many_ioeventfds();
 
+    if (s->dirty_ring_size) {
+        qemu_thread_create(&s->dirty_ring_reaper, "kvm-reaper",
+                           kvm_dirty_ring_reaper_thread, s,
+                           QEMU_THREAD_DETACHED);
+    }
+
     cpu_interrupt_handler = kvm_handle_interrupt;
 
     return 0;
@@ -1973,6 +2263,14 @@ int kvm_cpu_exec(CPUState *cpu)
             DPRINTF("irq_window_open\n");
             ret = EXCP_INTERRUPT;
             break;
+        case KVM_EXIT_DIRTY_RING_FULL:
+            trace_kvm_dirty_ring_full(cpu->cpu_index);
+            kvm_dirty_limit_throttle(kvm_state, cpu);
+            qemu_mutex_lock_iothread();
+            kvm_dirty_ring_reap(kvm_state);
+            qemu_mutex_unlock_iothread();
+            ret = 0;
+            break;
         case KVM_EXIT_SHUTDOWN:
             DPRINTF("shutdown\n");
             qemu_system_reset_request();
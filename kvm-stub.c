@@ -160,4 +160,13 @@ bool kvm_has_free_slot(MachineState *ms)
 {
     return false;
 }
+
+bool kvm_dirty_ring_enabled(void)
+{
+    return false;
+}
+
+void kvm_dirty_limit_set(uint64_t mbps)
+{
+}
 #endif
@@ -560,6 +560,7 @@ abi_long target_mmap(abi_ulong start, abi_ulong len, int prot,
     page_dump(stdout);
     printf("\n");
 #endif
+    tb_cache_mmap(start, len, prot, (flags & MAP_ANONYMOUS) ? -1 : fd, offset);
     tb_invalidate_phys_range(start, start + len);
     mmap_unlock();
     return start;
@@ -665,6 +666,7 @@ int target_munmap(abi_ulong start, abi_ulong len)
 
     if (ret == 0) {
         page_set_flags(start, start + len, 0);
+        tb_cache_munmap(start, len);
         tb_invalidate_phys_range(start, start + len);
     }
     mmap_unlock();
@@ -743,6 +745,7 @@ abi_long target_mremap(abi_ulong old_addr, abi_ulong old_size,
         prot = page_get_flags(old_addr);
         page_set_flags(old_addr, old_addr + old_size, 0);
         page_set_flags(new_addr, new_addr + new_size, prot | PAGE_VALID);
+        tb_cache_munmap(old_addr, old_size);
     }
     tb_invalidate_phys_range(new_addr, new_addr + new_size);
     mmap_unlock();
@@ -422,6 +422,14 @@ abi_ulong mmap_find_vma(abi_ulong, abi_ulong);
 void mmap_fork_start(void);
 void mmap_fork_end(int child);
 
+/* tbcache.c */
+void tb_cache_init(const char *dir, const char *cpu_model);
+void tb_cache_mmap(abi_ulong start, abi_ulong len, int prot, int fd,
+                   abi_ulong offset);
+void tb_cache_munmap(abi_ulong start, abi_ulong len);
+bool tb_cache_load(CPUState *cpu, TranslationBlock *tb);
+void tb_cache_store(CPUState *cpu, TranslationBlock *tb);
+
 /* main.c */
 extern unsigned long guest_stack_size;
 
@@ -0,0 +1,457 @@
+/*
+ *  Persistent translation cache
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The ops that the translator emits for a TB are saved to a per-ELF file in
+ * the cache directory, named after the build-id of the ELF and a tag of the
+ * QEMU binary, target and CPU model.  Later processes mapping the same ELF
+ * at the same address load the ops back instead of decoding the guest code
+ * again; register allocation and code generation still run.  Host code is
+ * not cached: it embeds host addresses (helpers, TBs, guest_base) that the
+ * backends have no relocations for.
+ *
+ * A record is keyed on the guest pc, the offset in the file, cs_base, the TB
+ * flags and cflags, and carries a CRC of the guest code it was translated
+ * from, checked against the mapping before use.  Records are appended with
+ * a single write, so processes sharing the directory do not need to lock;
+ * a torn or corrupted record ends the parsing of the file.
+ *
+ * All of it runs under mmap_lock.
+ */
+
+#include "qemu/osdep.h"
+#include <sys/stat.h>
+
+#include "qemu.h"
+#include "tcg.h"
+#include "qemu/crc32c.h"
+#include "exec/log.h"
+
+#define TBC_MAGIC       0x43425451      /* "QTBC" */
+#define TBC_MAX_FILE    (64 * 1024 * 1024)
+#define TBC_ID_MAX      64
+#define TBC_NT_GNU_BUILD_ID 3
+
+typedef struct TBCacheRecord {
+    uint32_t magic;
+    uint32_t tag;
+    uint32_t len;               /* of what follows, a multiple of 8 */
+    uint32_t crc;               /* of what follows */
+    uint64_t pc;
+    uint64_t file_off;
+    uint64_t cs_base;
+    uint32_t flags;
+    uint32_t cflags;
+    uint32_t code_crc;
+    uint16_t size;
+    uint16_t icount;
+    uint32_t ops_len;           /* of the op stream that follows */
+    uint32_t reserved;
+} TBCacheRecord;
+
+typedef struct TBCacheFile {
+    char *path;
+    dev_t dev;
+    ino_t ino;
+    off_t st_size;
+    time_t mtime;
+    bool loaded;
+    int wfd;
+    off_t wsize;
+    gchar *data;
+    GHashTable *index;
+} TBCacheFile;
+
+typedef struct TBCacheMap {
+    abi_ulong start;
+    abi_ulong end;
+    abi_ulong offset;
+    TBCacheFile *file;
+} TBCacheMap;
+
+static char *tbc_dir;
+static uint32_t tbc_tag;
+static GPtrArray *tbc_files;
+static GArray *tbc_maps;
+static GByteArray *tbc_buf;
+
+static uint64_t tbc_rd(const uint8_t *p, int size, bool be)
+{
+    uint64_t v = 0;
+    int i;
+
+    for (i = 0; i < size; i++) {
+        v |= (uint64_t)p[be ? size - 1 - i : i] << (i * 8);
+    }
+    return v;
+}
+
+/* Copies the GNU build-id note of the ELF file open on fd to id. */
+static int tbc_build_id(int fd, uint8_t *id)
+{
+    uint8_t eh[64], ph[56], notes[4096];
+    uint64_t phoff, off, sz, pos, namesz, descsz;
+    int phentsize, phnum, i;
+    bool is64, be;
+
+    if (pread(fd, eh, sizeof(eh), 0) != sizeof(eh)
+        || memcmp(eh, ELFMAG, SELFMAG) != 0) {
+        return -1;
+    }
+    is64 = eh[EI_CLASS] == ELFCLASS64;
+    be = eh[EI_DATA] == ELFDATA2MSB;
+    if (is64) {
+        phoff = tbc_rd(eh + 32, 8, be);
+        phentsize = tbc_rd(eh + 54, 2, be);
+        phnum = tbc_rd(eh + 56, 2, be);
+    } else {
+        phoff = tbc_rd(eh + 28, 4, be);
+        phentsize = tbc_rd(eh + 42, 2, be);
+        phnum = tbc_rd(eh + 44, 2, be);
+    }
+    if (phentsize < (is64 ? 56 : 32)) {
+        return -1;
+    }
+
+    for (i = 0; i < phnum; i++) {
+        if (pread(fd, ph, is64 ? 56 : 32, phoff + i * phentsize)
+            != (is64 ? 56 : 32)) {
+            return -1;
+        }
+        if (tbc_rd(ph, 4, be) != PT_NOTE) {
+            continue;
+        }
+        off = tbc_rd(ph + (is64 ? 8 : 4), is64 ? 8 : 4, be);
+        sz = tbc_rd(ph + (is64 ? 32 : 16), is64 ? 8 : 4, be);
+        sz = MIN(sz, sizeof(notes));
+        if (pread(fd, notes, sz, off) != sz) {
+            continue;
+        }
+        for (pos = 0; pos + 12 <= sz; ) {
+            namesz = tbc_rd(notes + pos, 4, be);
+            descsz = tbc_rd(notes + pos + 4, 4, be);
+            if (tbc_rd(notes + pos + 8, 4, be) == TBC_NT_GNU_BUILD_ID
+                && namesz == 4 && pos + 16 <= sz
+                && memcmp(notes + pos + 12, "GNU", 4) == 0
+                && descsz && descsz <= TBC_ID_MAX
+                && pos + 16 + descsz <= sz) {
+                memcpy(id, notes + pos + 16, descsz);
+                return descsz;
+            }
+            pos += 12 + ROUND_UP(namesz, 4) + ROUND_UP(descsz, 4);
+        }
+    }
+    return -1;
+}
+
+static guint tbc_key_hash(gconstpointer p)
+{
+    const TBCacheRecord *r = p;
+
+    return r->pc ^ (r->pc >> 32) ^ r->flags ^ r->cflags;
+}
+
+static gboolean tbc_key_equal(gconstpointer a, gconstpointer b)
+{
+    const TBCacheRecord *ra = a, *rb = b;
+
+    return ra->pc == rb->pc && ra->file_off == rb->file_off
+        && ra->cs_base == rb->cs_base && ra->flags == rb->flags
+        && ra->cflags == rb->cflags;
+}
+
+static void tbc_file_load(TBCacheFile *f)
+{
+    gsize len, pos;
+    TBCacheRecord r;
+
+    f->loaded = true;
+    f->index = g_hash_table_new(tbc_key_hash, tbc_key_equal);
+    if (!g_file_get_contents(f->path, &f->data, &len, NULL)) {
+        return;
+    }
+
+    for (pos = 0; pos + sizeof(r) <= len; pos += sizeof(r) + r.len) {
+        memcpy(&r, f->data + pos, sizeof(r));
+        if (r.magic != TBC_MAGIC || r.len > len - pos - sizeof(r)
+            || r.len % 8 || r.ops_len > r.len
+            || crc32c(0xffffffff, (uint8_t *)f->data + pos + sizeof(r),
+                      r.len) != r.crc) {
+            break;
+        }
+        if (r.tag == tbc_tag) {
+            /* later records replace stale ones */
+            g_hash_table_replace(f->index, f->data + pos, f->data + pos);
+        }
+    }
+}
+
+static TBCacheFile *tbc_file_get(int fd)
+{
+    uint8_t id[TBC_ID_MAX];
+    TBCacheFile *f;
+    struct stat st;
+    GString *name;
+    int i, n;
+
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        return NULL;
+    }
+    for (i = 0; i < tbc_files->len; i++) {
+        f = g_ptr_array_index(tbc_files, i);
+        if (f->dev == st.st_dev && f->ino == st.st_ino
+            && f->st_size == st.st_size && f->mtime == st.st_mtime) {
+            return f;
+        }
+    }
+
+    n = tbc_build_id(fd, id);
+    if (n < 0) {
+        return NULL;
+    }
+    name = g_string_new(tbc_dir);
+    g_string_append_c(name, '/');
+    for (i = 0; i < n; i++) {
+        g_string_append_printf(name, "%02x", id[i]);
+    }
+    g_string_append_printf(name, "-%08x.tbc", tbc_tag);
+
+    f = g_new0(TBCacheFile, 1);
+    f->path = g_string_free(name, false);
+    f->dev = st.st_dev;
+    f->ino = st.st_ino;
+    f->st_size = st.st_size;
+    f->mtime = st.st_mtime;
+    f->wfd = -1;
+    g_ptr_array_add(tbc_files, f);
+    return f;
+}
+
+static TBCacheMap *tbc_find_map(abi_ulong pc)
+{
+    int i;
+
+    for (i = 0; i < tbc_maps->len; i++) {
+        TBCacheMap *m = &g_array_index(tbc_maps, TBCacheMap, i);
+        if (pc >= m->start && pc < m->end) {
+            return m;
+        }
+    }
+    return NULL;
+}
+
+void tb_cache_munmap(abi_ulong start, abi_ulong len)
+{
+    abi_ulong end = start + len;
+    int i;
+
+    if (!tbc_dir) {
+        return;
+    }
+    for (i = 0; i < tbc_maps->len; i++) {
+        TBCacheMap *m = &g_array_index(tbc_maps, TBCacheMap, i);
+        TBCacheMap tail;
+
+        if (end <= m->start || start >= m->end) {
+            continue;
+        }
+        if (start > m->start && end < m->end) {
+            tail = *m;
+            tail.offset += end - m->start;
+            tail.start = end;
+            m->end = start;
+            g_array_append_val(tbc_maps, tail);
+        } else if (start > m->start) {
+            m->end = start;
+        } else if (end < m->end) {
+            m->offset += end - m->start;
+            m->start = end;
+        } else {
+            g_array_remove_index_fast(tbc_maps, i--);
+        }
+    }
+}
+
+void tb_cache_mmap(abi_ulong start, abi_ulong len, int prot, int fd,
+                   abi_ulong offset)
+{
+    TBCacheMap m;
+
+    if (!tbc_dir) {
+        return;
+    }
+    tb_cache_munmap(start, len);
+    if (fd < 0 || !(prot & PROT_EXEC) || !len) {
+        return;
+    }
+
+    m.file = tbc_file_get(fd);
+    if (m.file) {
+        m.start = start;
+        m.end = start + len;
+        m.offset = offset;
+        g_array_append_val(tbc_maps, m);
+    }
+}
+
+static bool tbc_usable(CPUState *cpu, TranslationBlock *tb)
+{
+    return !singlestep && !cpu->singlestep_enabled
+        && QTAILQ_EMPTY(&cpu->breakpoints)
+        && !(tb->cflags & (CF_NOCACHE | CF_PROFILE))
+        && !qemu_loglevel_mask(CPU_LOG_TB_IN_ASM | CPU_LOG_TB_OP);
+}
+
+static void tbc_key(TBCacheRecord *r, TBCacheMap *m, TranslationBlock *tb)
+{
+    r->pc = tb->pc;
+    r->file_off = m->offset + (tb->pc - m->start);
+    r->cs_base = tb->cs_base;
+    r->flags = tb->flags;
+    r->cflags = tb->cflags;
+}
+
+/* Rebuilds the ops of tb from the cache in place of the translator. */
+bool tb_cache_load(CPUState *cpu, TranslationBlock *tb)
+{
+    const TBCacheRecord *r;
+    TBCacheRecord key;
+    TBCacheMap *m;
+
+    if (!tbc_dir || !tbc_usable(cpu, tb)) {
+        return false;
+    }
+    m = tbc_find_map(tb->pc);
+    if (!m) {
+        return false;
+    }
+    if (!m->file->loaded) {
+        tbc_file_load(m->file);
+    }
+
+    tbc_key(&key, m, tb);
+    r = g_hash_table_lookup(m->file->index, &key);
+    if (!r || !r->size || r->size > m->end - tb->pc
+        || page_check_range(tb->pc, r->size, PAGE_READ) < 0
+        || crc32c(0xffffffff, g2h(tb->pc), r->size) != r->code_crc) {
+        return false;
+    }
+
+    if (!tcg_load_ops(&tcg_ctx, (uintptr_t)tb, (const uint8_t *)(r + 1),
+                      r->ops_len)) {
+        tcg_func_start(&tcg_ctx);
+        return false;
+    }
+    tb->size = r->size;
+    tb->icount = r->icount;
+    return true;
+}
+
+/* Appends the ops just emitted by the translator for tb to the cache. */
+void tb_cache_store(CPUState *cpu, TranslationBlock *tb)
+{
+    static const uint8_t zero[8];
+    TBCacheRecord r = { .magic = TBC_MAGIC, .tag = tbc_tag };
+    TBCacheFile *f;
+    TBCacheMap *m;
+
+    if (!tbc_dir || !tbc_usable(cpu, tb) || !tb->size) {
+        return;
+    }
+    m = tbc_find_map(tb->pc);
+    if (!m || tb->size > m->end - tb->pc) {
+        return;
+    }
+    f = m->file;
+    if (f->wfd < 0) {
+        struct stat st;
+
+        f->wfd = open(f->path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+                      0644);
+        if (f->wfd < 0) {
+            return;
+        }
+        f->wsize = fstat(f->wfd, &st) < 0 ? TBC_MAX_FILE : st.st_size;
+    }
+    if (f->wsize >= TBC_MAX_FILE) {
+        return;
+    }
+
+    g_byte_array_set_size(tbc_buf, sizeof(r));
+    if (!tcg_save_ops(&tcg_ctx, (uintptr_t)tb, tbc_buf)) {
+        return;
+    }
+    r.ops_len = tbc_buf->len - sizeof(r);
+    g_byte_array_append(tbc_buf, zero, -tbc_buf->len & 7);
+
+    tbc_key(&r, m, tb);
+    r.len = tbc_buf->len - sizeof(r);
+    r.crc = crc32c(0xffffffff, tbc_buf->data + sizeof(r), r.len);
+    r.code_crc = crc32c(0xffffffff, g2h(tb->pc), tb->size);
+    r.size = tb->size;
+    r.icount = tb->icount;
+    memcpy(tbc_buf->data, &r, sizeof(r));
+
+    if (write(f->wfd, tbc_buf->data, tbc_buf->len) == tbc_buf->len) {
+        f->wsize += tbc_buf->len;
+    }
+}
+
+void tb_cache_init(const char *dir, const char *cpu_model)
+{
+    uint8_t id[TBC_ID_MAX];
+    GString *ident;
+    struct stat st;
+    int fd, n;
+
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        fprintf(stderr, "qemu: cannot create translation cache %s: %s\n",
+                dir, strerror(errno));
+        return;
+    }
+
+    /* the op streams are only valid for this very binary */
+    ident = g_string_new(QEMU_VERSION " " TARGET_NAME " ");
+    g_string_append(ident, cpu_model);
+    fd = open("/proc/self/exe", O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "qemu: translation cache disabled, "
+                "cannot identify the QEMU binary\n");
+        if (fd >= 0) {
+            close(fd);
+        }
+        g_string_free(ident, true);
+        return;
+    }
+    n = tbc_build_id(fd, id);
+    if (n > 0) {
+        g_string_append_len(ident, (const gchar *)id, n);
+    } else {
+        g_string_append_printf(ident, "%" PRIu64 " %" PRIu64 " %" PRIu64,
+                               (uint64_t)st.st_ino, (uint64_t)st.st_size,
+                               (uint64_t)st.st_mtime);
+    }
+    close(fd);
+
+    tbc_tag = crc32c(0xffffffff, (const uint8_t *)ident->str, ident->len);
+    g_string_free(ident, true);
+
+    tbc_dir = g_strdup(dir);
+    tbc_files = g_ptr_array_new();
+    tbc_maps = g_array_new(false, false, sizeof(TBCacheMap));
+    tbc_buf = g_byte_array_new();
+}
@@ -35,7 +35,10 @@
 
 static unsigned memory_region_transaction_depth;
 static bool memory_region_update_pending;
+static bool memory_region_update_all;
 static bool ioeventfd_update_pending;
+/* regions changed by the current transaction, with their containers */
+static GHashTable *memory_region_dirty;
 static bool global_dirty_log = false;
 
 static QTAILQ_HEAD(memory_listeners, MemoryListener) memory_listeners
@@ -238,6 +241,10 @@ struct FlatView {
     FlatRange *ranges;
     unsigned nr;
     unsigned nr_allocated;
+    /* the view depends only on the tree of root and of the alias targets */
+    MemoryRegion *root;
+    MemoryRegion **deps;
+    unsigned nr_deps;
 };
 
 typedef struct AddressSpaceOps AddressSpaceOps;
@@ -260,6 +267,23 @@ static void flatview_init(FlatView *view)
     view->ranges = NULL;
     view->nr = 0;
     view->nr_allocated = 0;
+    view->root = NULL;
+    view->deps = NULL;
+    view->nr_deps = 0;
+}
+
+/* Record that the view renders the tree of MR through an alias */
+static void flatview_add_dep(FlatView *view, MemoryRegion *mr)
+{
+    unsigned i;
+
+    for (i = 0; i < view->nr_deps; i++) {
+        if (view->deps[i] == mr) {
+            return;
+        }
+    }
+    view->deps = g_renew(MemoryRegion *, view->deps, view->nr_deps + 1);
+    view->deps[view->nr_deps++] = mr;
 }
 
 /* Insert a range into a given position.  Caller is responsible for maintaining
@@ -287,6 +311,7 @@ static void flatview_destroy(FlatView *view)
         memory_region_unref(view->ranges[i].mr);
     }
     g_free(view->ranges);
+    g_free(view->deps);
     g_free(view);
 }
 
@@ -645,6 +670,7 @@ static void render_memory_region(FlatView *view,
     if (mr->alias) {
         int128_subfrom(&base, int128_make64(mr->alias->addr));
         int128_subfrom(&base, int128_make64(mr->alias_offset));
+        flatview_add_dep(view, mr->alias);
         render_memory_region(view, mr->alias, base, clip, readonly);
         return;
     }
@@ -704,6 +730,7 @@ static FlatView *generate_memory_topology(MemoryRegion *mr)
 
     view = g_new(FlatView, 1);
     flatview_init(view);
+    view->root = mr;
 
     if (mr) {
         render_memory_region(view, mr, int128_zero(),
@@ -899,16 +926,68 @@ static void address_space_update_topology(AddressSpace *as)
     address_space_update_ioeventfds(as);
 }
 
+/* Whether the regions changed by the transaction may change the view of AS.
+ * The view only depends on the regions below its root and below the alias
+ * targets met while rendering it, and a change marks the changed region and
+ * all its containers.
+ */
+static bool address_space_needs_update(AddressSpace *as)
+{
+    FlatView *view = as->current_map;
+    unsigned i;
+
+    if (memory_region_update_all || view->root != as->root) {
+        return true;
+    }
+    if (!memory_region_dirty || !view->root) {
+        return false;
+    }
+    if (g_hash_table_lookup(memory_region_dirty, view->root)) {
+        return true;
+    }
+    for (i = 0; i < view->nr_deps; i++) {
+        if (g_hash_table_lookup(memory_region_dirty, view->deps[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
 void memory_region_transaction_begin(void)
 {
     qemu_flush_coalesced_mmio_buffer();
     ++memory_region_transaction_depth;
 }
 
+/* The rendering of MR changed, so did the view of the address spaces that
+ * contain MR, directly or through an alias.
+ */
+static void memory_region_mark_dirty(MemoryRegion *mr)
+{
+    if (!memory_region_dirty) {
+        memory_region_dirty = g_hash_table_new(NULL, NULL);
+    }
+    for (; mr; mr = mr->container) {
+        g_hash_table_add(memory_region_dirty, mr);
+    }
+    memory_region_update_pending = true;
+}
+
+/* A change that may affect any region, e.g. the global dirty log */
+static void memory_region_mark_all_dirty(void)
+{
+    memory_region_update_all = true;
+    memory_region_update_pending = true;
+}
+
 static void memory_region_clear_pending(void)
 {
     memory_region_update_pending = false;
+    memory_region_update_all = false;
     ioeventfd_update_pending = false;
+    if (memory_region_dirty) {
+        g_hash_table_remove_all(memory_region_dirty);
+    }
 }
 
 void memory_region_transaction_commit(void)
@@ -919,13 +998,26 @@ void memory_region_transaction_commit(void)
     --memory_region_transaction_depth;
     if (!memory_region_transaction_depth) {
         if (memory_region_update_pending) {
+            /* Each address space retires a FlatView and a dispatch tree;
+             * hand them to call_rcu as one batch.
+             */
+            rcu_call_batch_begin();
             MEMORY_LISTENER_CALL_GLOBAL(begin, Forward);
 
+            /* Only render again the address spaces that see the change, a
+             * BAR move then costs the size of the views that map it rather
+             * than of all the address spaces of all the devices.
+             */
             QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
-                address_space_update_topology(as);
+                if (address_space_needs_update(as)) {
+                    address_space_update_topology(as);
+                } else if (ioeventfd_update_pending) {
+                    address_space_update_ioeventfds(as);
+                }
             }
 
             MEMORY_LISTENER_CALL_GLOBAL(commit, Forward);
+            rcu_call_batch_end();
         } else if (ioeventfd_update_pending) {
             QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
                 address_space_update_ioeventfds(as);
@@ -1582,7 +1674,9 @@ void memory_region_set_log(MemoryRegion *mr, bool log, unsigned client)
 
     memory_region_transaction_begin();
     mr->dirty_log_mask = (mr->dirty_log_mask & ~mask) | (log * mask);
-    memory_region_update_pending |= mr->enabled;
+    if (mr->enabled) {
+        memory_region_mark_dirty(mr);
+    }
     memory_region_transaction_commit();
 }
 
@@ -1633,7 +1727,9 @@ void memory_region_set_readonly(MemoryRegion *mr, bool readonly)
     if (mr->readonly != readonly) {
         memory_region_transaction_begin();
         mr->readonly = readonly;
-        memory_region_update_pending |= mr->enabled;
+        if (mr->enabled) {
+            memory_region_mark_dirty(mr);
+        }
         memory_region_transaction_commit();
     }
 }
@@ -1643,7 +1739,9 @@ void memory_region_rom_device_set_romd(MemoryRegion *mr, bool romd_mode)
     if (mr->romd_mode != romd_mode) {
         memory_region_transaction_begin();
         mr->romd_mode = romd_mode;
-        memory_region_update_pending |= mr->enabled;
+        if (mr->enabled) {
+            memory_region_mark_dirty(mr);
+        }
         memory_region_transaction_commit();
     }
 }
@@ -1923,7 +2021,9 @@ static void memory_region_update_container_subregions(MemoryRegion *subregion)
     }
     QTAILQ_INSERT_TAIL(&mr->subregions, subregion, subregions_link);
 done:
-    memory_region_update_pending |= mr->enabled && subregion->enabled;
+    if (mr->enabled && subregion->enabled) {
+        memory_region_mark_dirty(mr);
+    }
     memory_region_transaction_commit();
 }
 
@@ -1962,7 +2062,9 @@ void memory_region_del_subregion(MemoryRegion *mr,
     subregion->container = NULL;
     QTAILQ_REMOVE(&mr->subregions, subregion, subregions_link);
     memory_region_unref(subregion);
-    memory_region_update_pending |= mr->enabled && subregion->enabled;
+    if (mr->enabled && subregion->enabled) {
+        memory_region_mark_dirty(mr);
+    }
     memory_region_transaction_commit();
 }
 
@@ -1973,7 +2075,7 @@ void memory_region_set_enabled(MemoryRegion *mr, bool enabled)
     }
     memory_region_transaction_begin();
     mr->enabled = enabled;
-    memory_region_update_pending = true;
+    memory_region_mark_dirty(mr);
     memory_region_transaction_commit();
 }
 
@@ -1989,7 +2091,7 @@ void memory_region_set_size(MemoryRegion *mr, uint64_t size)
     }
     memory_region_transaction_begin();
     mr->size = s;
-    memory_region_update_pending = true;
+    memory_region_mark_dirty(mr);
     memory_region_transaction_commit();
 }
 
@@ -2026,7 +2128,9 @@ void memory_region_set_alias_offset(MemoryRegion *mr, hwaddr offset)
 
     memory_region_transaction_begin();
     mr->alias_offset = offset;
-    memory_region_update_pending |= mr->enabled;
+    if (mr->enabled) {
+        memory_region_mark_dirty(mr);
+    }
     memory_region_transaction_commit();
 }
 
@@ -2131,9 +2235,18 @@ bool memory_region_present(MemoryRegion *container, hwaddr addr)
 
 void address_space_sync_dirty_bitmap(AddressSpace *as)
 {
+    MemoryListener *listener;
     FlatView *view;
     FlatRange *fr;
 
+    QTAILQ_FOREACH(listener, &memory_listeners, link) {
+        if (listener->log_sync_global &&
+            (!listener->address_space_filter ||
+             listener->address_space_filter == as)) {
+            listener->log_sync_global(listener);
+        }
+    }
+
     view = address_space_get_flatview(as);
     FOR_EACH_FLAT_RANGE(fr, view) {
         MEMORY_LISTENER_UPDATE_REGION(fr, as, Forward, log_sync);
@@ -2149,7 +2262,7 @@ void memory_global_dirty_log_start(void)
 
     /* Refresh DIRTY_LOG_MIGRATION bit.  */
     memory_region_transaction_begin();
-    memory_region_update_pending = true;
+    memory_region_mark_all_dirty();
     memory_region_transaction_commit();
 }
 
@@ -2159,7 +2272,7 @@ void memory_global_dirty_log_stop(void)
 
     /* Refresh DIRTY_LOG_MIGRATION bit.  */
     memory_region_transaction_begin();
-    memory_region_update_pending = true;
+    memory_region_mark_all_dirty();
     memory_region_transaction_commit();
 
     MEMORY_LISTENER_CALL_GLOBAL(log_global_stop, Reverse);
@@ -2248,10 +2361,17 @@ void address_space_init(AddressSpace *as, MemoryRegion *root, const char *name)
     flatview_init(as->current_map);
     as->ioeventfd_nb = 0;
     as->ioeventfds = NULL;
+    as->max_bounce_buffer_size = DEFAULT_MAX_BOUNCE_BUFFER_SIZE;
+    as->bounce_buffer_size = 0;
+    qemu_mutex_init(&as->bounce_lock);
+    QLIST_INIT(&as->bounce_buffers);
+    QLIST_INIT(&as->map_client_list);
     QTAILQ_INSERT_TAIL(&address_spaces, as, address_spaces_link);
     as->name = g_strdup(name ? name : "anonymous");
     address_space_init_dispatch(as);
-    memory_region_update_pending |= root->enabled;
+    if (root->enabled) {
+        memory_region_mark_dirty(root);
+    }
     memory_region_transaction_commit();
 }
 
@@ -2267,6 +2387,8 @@ static void do_address_space_destroy(AddressSpace *as)
     }
 
     flatview_unref(as->current_map);
+    address_space_destroy_map_clients(as);
+    qemu_mutex_destroy(&as->bounce_lock);
     g_free(as->name);
     g_free(as->ioeventfds);
     memory_region_unref(as->root);
@@ -36,6 +36,7 @@
 #include "exec/address-spaces.h"
 #include "io/channel-buffer.h"
 #include "io/channel-tls.h"
+#include "sysemu/kvm.h"
 
 #define MAX_THROTTLE  (32 << 20)      /* Migration transfer speed throttling */
 
@@ -54,6 +55,12 @@
 /* Define default autoconverge cpu throttle migration parameters */
 #define DEFAULT_MIGRATE_CPU_THROTTLE_INITIAL 20
 #define DEFAULT_MIGRATE_CPU_THROTTLE_INCREMENT 10
+/* Default number of multifd connections, besides the main stream */
+#define DEFAULT_MIGRATE_MULTIFD_CHANNELS 2
+/* Default per-vCPU dirty page rate for dirty-limit, in MB/s */
+#define DEFAULT_MIGRATE_VCPU_DIRTY_LIMIT 1
+/* Default memory kept registered by RDMA migration without pin-all */
+#define DEFAULT_MIGRATE_RDMA_REG_CACHE_SIZE (1024 * 1024 * 1024)
 
 /* Migration XBZRLE default cache size */
 #define DEFAULT_MIGRATE_CACHE_SIZE (64 * 1024 * 1024)
@@ -89,6 +96,10 @@ MigrationState *migrate_get_current(void)
             .decompress_threads = DEFAULT_MIGRATE_DECOMPRESS_THREAD_COUNT,
             .cpu_throttle_initial = DEFAULT_MIGRATE_CPU_THROTTLE_INITIAL,
             .cpu_throttle_increment = DEFAULT_MIGRATE_CPU_THROTTLE_INCREMENT,
+            .x_multifd_channels = DEFAULT_MIGRATE_MULTIFD_CHANNELS,
+            .compress_method = MIGRATION_COMPRESS_METHOD_ZLIB,
+            .vcpu_dirty_limit = DEFAULT_MIGRATE_VCPU_DIRTY_LIMIT,
+            .rdma_reg_cache_size = DEFAULT_MIGRATE_RDMA_REG_CACHE_SIZE,
         },
     };
 
@@ -296,11 +307,41 @@ void migrate_send_rp_req_pages(MigrationIncomingState *mis, const char *rbname,
     }
 }
 
+/*
+ * The extra multifd and postcopy preempt connections are opened to the
+ * same address as the main stream, so only plain sockets can be used.
+ */
+static bool migrate_multifd_check_uri(const char *uri, Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+    const char *cap;
+
+    if (migrate_use_multifd()) {
+        cap = "x-multifd";
+    } else if (migrate_postcopy_preempt()) {
+        cap = "postcopy-preempt";
+    } else {
+        return true;
+    }
+    if (!strstart(uri, "tcp:", NULL) && !strstart(uri, "unix:", NULL)) {
+        error_setg(errp, "%s requires a tcp: or unix: migration URI", cap);
+        return false;
+    }
+    if (s->parameters.tls_creds) {
+        error_setg(errp, "%s is not compatible with TLS", cap);
+        return false;
+    }
+    return true;
+}
+
 void qemu_start_incoming_migration(const char *uri, Error **errp)
 {
     const char *p;
 
     qapi_event_send_migration(MIGRATION_STATUS_SETUP, &error_abort);
+    if (strcmp(uri, "defer") && !migrate_multifd_check_uri(uri, errp)) {
+        return;
+    }
     if (!strcmp(uri, "defer")) {
         deferred_incoming_migration(errp);
     } else if (strstart(uri, "tcp:", &p)) {
@@ -332,6 +373,7 @@ static void process_incoming_migration_bh(void *opaque)
                           MIGRATION_STATUS_FAILED);
         error_report_err(local_err);
         migrate_decompress_threads_join();
+        migrate_multifd_recv_threads_join();
         exit(EXIT_FAILURE);
     }
 
@@ -356,6 +398,7 @@ static void process_incoming_migration_bh(void *opaque)
         runstate_set(global_state_get_runstate());
     }
     migrate_decompress_threads_join();
+    migrate_multifd_recv_threads_join();
     /*
      * This must happen after any state changes since as soon as an external
      * observer sees this event they might start to prod at the VM assuming
@@ -409,6 +452,7 @@ static void process_incoming_migration_co(void *opaque)
                           MIGRATION_STATUS_FAILED);
         error_report("load of migration failed: %s", strerror(-ret));
         migrate_decompress_threads_join();
+        migrate_multifd_recv_threads_join();
         exit(EXIT_FAILURE);
     }
 
@@ -421,6 +465,7 @@ void migration_fd_process_incoming(QEMUFile *f)
     Coroutine *co = qemu_coroutine_create(process_incoming_migration_co, f);
 
     migrate_decompress_threads_create();
+    migrate_multifd_recv_threads_create();
     qemu_file_set_blocking(f, false);
     qemu_coroutine_enter(co);
 }
@@ -566,6 +611,10 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
     params->cpu_throttle_increment = s->parameters.cpu_throttle_increment;
     params->tls_creds = g_strdup(s->parameters.tls_creds);
     params->tls_hostname = g_strdup(s->parameters.tls_hostname);
+    params->x_multifd_channels = s->parameters.x_multifd_channels;
+    params->compress_method = s->parameters.compress_method;
+    params->vcpu_dirty_limit = s->parameters.vcpu_dirty_limit;
+    params->rdma_reg_cache_size = s->parameters.rdma_reg_cache_size;
 
     return params;
 }
@@ -602,6 +651,15 @@ static void get_xbzrle_cache_stats(MigrationInfo *info)
     }
 }
 
+static void get_rdma_reg_cache_stats(MigrationInfo *info, MigrationState *s)
+{
+    if (s->rdma_reg_cache_active) {
+        info->has_rdma_reg_cache = true;
+        info->rdma_reg_cache = g_memdup(&s->rdma_reg_cache,
+                                        sizeof(*info->rdma_reg_cache));
+    }
+}
+
 static void populate_ram_info(MigrationInfo *info, MigrationState *s)
 {
     info->has_ram = true;
@@ -662,6 +720,7 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         }
 
         get_xbzrle_cache_stats(info);
+        get_rdma_reg_cache_stats(info, s);
         break;
     case MIGRATION_STATUS_POSTCOPY_ACTIVE:
         /* Mostly the same as active; TODO add some postcopy stats */
@@ -685,9 +744,11 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         }
 
         get_xbzrle_cache_stats(info);
+        get_rdma_reg_cache_stats(info, s);
         break;
     case MIGRATION_STATUS_COMPLETED:
         get_xbzrle_cache_stats(info);
+        get_rdma_reg_cache_stats(info, s);
 
         info->has_status = true;
         info->has_total_time = true;
@@ -743,6 +804,15 @@ void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
             s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_RAM] =
                 false;
         }
+        if (migrate_use_multifd()) {
+            /* Same as above, the multifd receive threads write straight
+             * into guest RAM.
+             */
+            error_report("Postcopy is not currently compatible with "
+                         "x-multifd");
+            s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_RAM] =
+                false;
+        }
         /* This check is reasonably expensive, so only when it's being
          * set the first time, also it's only the destination that needs
          * special support.
@@ -757,6 +827,48 @@ void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
                 false;
         }
     }
+
+    if (migrate_postcopy_preempt() && !migrate_postcopy_ram()) {
+        error_report("postcopy-preempt requires postcopy-ram");
+        s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_PREEMPT] = false;
+    }
+
+    if (migrate_mapped_ram() &&
+        (migrate_postcopy_ram() || migrate_use_multifd())) {
+        error_report("x-mapped-ram cannot be used with postcopy-ram or "
+                     "x-multifd");
+        s->enabled_capabilities[MIGRATION_CAPABILITY_X_MAPPED_RAM] = false;
+    }
+
+    if (migrate_lazy_restore()) {
+        if (!migrate_mapped_ram()) {
+            error_report("x-lazy-restore requires x-mapped-ram");
+            s->enabled_capabilities[MIGRATION_CAPABILITY_X_LAZY_RESTORE] =
+                false;
+        } else if (runstate_check(RUN_STATE_INMIGRATE) &&
+                   !postcopy_ram_supported_by_host()) {
+            /* The pages are placed with userfaultfd as postcopy does */
+            error_report("x-lazy-restore is not supported");
+            s->enabled_capabilities[MIGRATION_CAPABILITY_X_LAZY_RESTORE] =
+                false;
+        }
+    }
+
+    if (migrate_zero_copy_send() && !migrate_use_multifd()) {
+        error_report("zero-copy-send requires x-multifd");
+        s->enabled_capabilities[MIGRATION_CAPABILITY_ZERO_COPY_SEND] = false;
+    }
+
+    if (migrate_dirty_limit()) {
+        if (!kvm_dirty_ring_enabled()) {
+            error_report("dirty-limit requires KVM with kvm-dirty-ring-size "
+                         "set");
+            s->enabled_capabilities[MIGRATION_CAPABILITY_DIRTY_LIMIT] = false;
+        } else if (migrate_auto_converge()) {
+            error_report("dirty-limit is not compatible with auto-converge");
+            s->enabled_capabilities[MIGRATION_CAPABILITY_DIRTY_LIMIT] = false;
+        }
+    }
 }
 
 void qmp_migrate_set_parameters(bool has_compress_level,
@@ -773,6 +885,14 @@ void qmp_migrate_set_parameters(bool has_compress_level,
                                 const char *tls_creds,
                                 bool has_tls_hostname,
                                 const char *tls_hostname,
+                                bool has_x_multifd_channels,
+                                int64_t x_multifd_channels,
+                                bool has_compress_method,
+                                MigrationCompressMethod compress_method,
+                                bool has_vcpu_dirty_limit,
+                                int64_t vcpu_dirty_limit,
+                                bool has_rdma_reg_cache_size,
+                                int64_t rdma_reg_cache_size,
                                 Error **errp)
 {
     MigrationState *s = migrate_get_current();
@@ -808,6 +928,32 @@ void qmp_migrate_set_parameters(bool has_compress_level,
                    "cpu_throttle_increment",
                    "an integer in the range of 1 to 99");
     }
+    if (has_x_multifd_channels &&
+            (x_multifd_channels < 1 || x_multifd_channels > 255)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x_multifd_channels",
+                   "is invalid, it should be in the range of 1 to 255");
+        return;
+    }
+    if (has_vcpu_dirty_limit && vcpu_dirty_limit < 1) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "vcpu_dirty_limit",
+                   "is invalid, it should be at least 1");
+        return;
+    }
+    if (has_rdma_reg_cache_size && rdma_reg_cache_size < 0) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "rdma_reg_cache_size",
+                   "is invalid, it should be positive or 0");
+        return;
+    }
+#ifndef CONFIG_ZSTD
+    if (has_compress_method &&
+            compress_method == MIGRATION_COMPRESS_METHOD_ZSTD) {
+        error_setg(errp, "zstd compression is not supported by this QEMU");
+        return;
+    }
+#endif
 
     if (has_compress_level) {
         s->parameters.compress_level = compress_level;
@@ -832,6 +978,18 @@ void qmp_migrate_set_parameters(bool has_compress_level,
         g_free(s->parameters.tls_hostname);
         s->parameters.tls_hostname = g_strdup(tls_hostname);
     }
+    if (has_x_multifd_channels) {
+        s->parameters.x_multifd_channels = x_multifd_channels;
+    }
+    if (has_compress_method) {
+        s->parameters.compress_method = compress_method;
+    }
+    if (has_vcpu_dirty_limit) {
+        s->parameters.vcpu_dirty_limit = vcpu_dirty_limit;
+    }
+    if (has_rdma_reg_cache_size) {
+        s->parameters.rdma_reg_cache_size = rdma_reg_cache_size;
+    }
 }
 
 
@@ -886,10 +1044,16 @@ static void migrate_fd_cleanup(void *opaque)
         qemu_mutex_lock_iothread();
 
         migrate_compress_threads_join();
+        migrate_multifd_send_threads_join();
         qemu_fclose(s->to_dst_file);
         s->to_dst_file = NULL;
     }
 
+    if (s->postcopy_preempt_file) {
+        qemu_fclose(s->postcopy_preempt_file);
+        s->postcopy_preempt_file = NULL;
+    }
+
     assert((s->state != MIGRATION_STATUS_ACTIVE) &&
            (s->state != MIGRATION_STATUS_POSTCOPY_ACTIVE));
 
@@ -942,6 +1106,9 @@ static void migrate_fd_cancel(MigrationState *s)
     if (s->state == MIGRATION_STATUS_CANCELLING && f) {
         qemu_file_shutdown(f);
     }
+    if (s->state == MIGRATION_STATUS_CANCELLING && s->postcopy_preempt_file) {
+        qemu_file_shutdown(s->postcopy_preempt_file);
+    }
 }
 
 void add_migration_state_change_notifier(Notifier *notify)
@@ -1007,6 +1174,8 @@ MigrationState *migrate_init(const MigrationParams *params)
     s->start_postcopy = false;
     s->postcopy_after_devices = false;
     s->postcopy_requests = 0;
+    s->rdma_reg_cache_active = false;
+    memset(&s->rdma_reg_cache, 0, sizeof(s->rdma_reg_cache));
     s->migration_thread_running = false;
     s->last_req_rb = NULL;
     error_free(s->error);
@@ -1095,6 +1264,10 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         return;
     }
 
+    if (!migrate_multifd_check_uri(uri, errp)) {
+        return;
+    }
+
     s = migrate_init(&params);
 
     if (strstart(uri, "tcp:", &p)) {
@@ -1198,6 +1371,42 @@ bool migrate_postcopy_ram(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_RAM];
 }
 
+bool migrate_postcopy_preempt(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_PREEMPT];
+}
+
+bool migrate_mapped_ram(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_MAPPED_RAM];
+}
+
+bool migrate_lazy_restore(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_LAZY_RESTORE];
+}
+
+bool migrate_zero_copy_send(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_ZERO_COPY_SEND];
+}
+
 bool migrate_auto_converge(void)
 {
     MigrationState *s;
@@ -1243,6 +1452,15 @@ int migrate_compress_threads(void)
     return s->parameters.compress_threads;
 }
 
+MigrationCompressMethod migrate_compress_method(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.compress_method;
+}
+
 int migrate_decompress_threads(void)
 {
     MigrationState *s;
@@ -1252,6 +1470,51 @@ int migrate_decompress_threads(void)
     return s->parameters.decompress_threads;
 }
 
+bool migrate_use_multifd(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_MULTIFD];
+}
+
+int migrate_multifd_channels(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.x_multifd_channels;
+}
+
+bool migrate_dirty_limit(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_DIRTY_LIMIT];
+}
+
+int64_t migrate_vcpu_dirty_limit(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.vcpu_dirty_limit;
+}
+
+int64_t migrate_rdma_reg_cache_size(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.rdma_reg_cache_size;
+}
+
 bool migrate_use_events(void)
 {
     MigrationState *s;
@@ -1819,6 +2082,9 @@ static void *migration_thread(void *opaque)
     trace_migration_thread_after_loop();
     /* If we enabled cpu throttling for auto-converge, turn it off. */
     cpu_throttle_stop();
+    if (migrate_dirty_limit()) {
+        kvm_dirty_limit_set(0);
+    }
     end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
 
     qemu_mutex_lock_iothread();
@@ -1828,6 +2094,12 @@ static void *migration_thread(void *opaque)
         s->total_time = end_time - s->total_time;
         if (!entered_postcopy) {
             s->downtime = end_time - start_time;
+            trace_migration_downtime(s->expected_downtime, s->downtime);
+            if (migrate_use_events()) {
+                qapi_event_send_migration_downtime(s->expected_downtime,
+                                                   s->downtime,
+                                                   &error_abort);
+            }
         }
         if (s->total_time) {
             s->mbps = (((double) transferred_bytes * 8.0) /
@@ -1852,6 +2124,8 @@ static void *migration_thread(void *opaque)
 
 void migrate_fd_connect(MigrationState *s)
 {
+    Error *local_err = NULL;
+
     /* This is a best 1st approximation. ns to ms */
     s->expected_downtime = max_downtime/1000000;
     s->cleanup_bh = qemu_bh_new(migrate_fd_cleanup, s);
@@ -1877,7 +2151,16 @@ void migrate_fd_connect(MigrationState *s)
         }
     }
 
+    if (postcopy_preempt_setup(s, &local_err)) {
+        error_report_err(local_err);
+        migrate_set_state(&s->state, MIGRATION_STATUS_SETUP,
+                          MIGRATION_STATUS_FAILED);
+        migrate_fd_cleanup(s);
+        return;
+    }
+
     migrate_compress_threads_create();
+    migrate_multifd_send_threads_create();
     qemu_thread_create(&s->thread, "migration", migration_thread, s,
                        QEMU_THREAD_JOINABLE);
     s->migration_thread_running = true;
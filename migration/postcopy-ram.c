@@ -24,6 +24,7 @@
 #include "sysemu/sysemu.h"
 #include "sysemu/balloon.h"
 #include "qemu/error-report.h"
+#include "qemu/rcu.h"
 #include "trace.h"
 
 /* Arbitrary limit on size of each discard command,
@@ -277,6 +278,9 @@ int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
 {
     trace_postcopy_ram_incoming_cleanup_entry();
 
+    /* No more pages may be placed once the userfaults are unregistered */
+    postcopy_preempt_incoming_cleanup(mis);
+
     if (mis->have_fault_thread) {
         uint64_t tmp64;
 
@@ -468,6 +472,12 @@ static void *postcopy_ram_fault_thread(void *opaque)
                                                 qemu_ram_get_idstr(rb),
                                                 rb_offset);
 
+        if (mis->lazy_restore) {
+            /* There is no source, the page comes from the file */
+            ram_lazy_restore_page(rb, rb_offset, postcopy_get_tmp_page(mis));
+            continue;
+        }
+
         /*
          * Send the request to the source - we want to request one
          * of our host page sizes (which is >= TPS)
@@ -614,6 +624,101 @@ void *postcopy_get_tmp_page(MigrationIncomingState *mis)
     return mis->postcopy_tmp_page;
 }
 
+/*
+ * Lazy restore reuses the postcopy machinery without a source: RAM is
+ * emptied and registered with userfaultfd, the fault thread reads the
+ * faulting pages from the file and ram.c fills in the rest behind it.
+ * There is no incoming migration to hang the state on, so it has its own.
+ */
+static MigrationIncomingState *lazy_mis;
+
+int postcopy_lazy_restore_start(void)
+{
+    assert(!lazy_mis);
+    lazy_mis = g_new0(MigrationIncomingState, 1);
+    lazy_mis->lazy_restore = true;
+
+    if (qemu_ram_foreach_block(nhp_range, lazy_mis) ||
+        qemu_ram_foreach_block(init_range, lazy_mis) ||
+        postcopy_ram_enable_notify(lazy_mis)) {
+        postcopy_lazy_restore_finish();
+        return -1;
+    }
+
+    trace_postcopy_lazy_restore_start();
+    return 0;
+}
+
+/*
+ * Place the host page at @from, or a zero page if @from is NULL, at
+ * @host.  The fault thread and the prefetch thread race to place the
+ * same pages, so a page that is already there is not an error.
+ * Returns 0 or a negative errno value.
+ */
+int postcopy_lazy_place_page(void *host, void *from)
+{
+    MigrationIncomingState *mis = lazy_mis;
+    int ret;
+
+    if (from) {
+        struct uffdio_copy copy_struct;
+
+        copy_struct.dst = (uint64_t)(uintptr_t)host;
+        copy_struct.src = (uint64_t)(uintptr_t)from;
+        copy_struct.len = getpagesize();
+        copy_struct.mode = 0;
+        ret = ioctl(mis->userfault_fd, UFFDIO_COPY, &copy_struct);
+    } else {
+        struct uffdio_zeropage zero_struct;
+
+        zero_struct.range.start = (uint64_t)(uintptr_t)host;
+        zero_struct.range.len = getpagesize();
+        zero_struct.mode = 0;
+        ret = ioctl(mis->userfault_fd, UFFDIO_ZEROPAGE, &zero_struct);
+    }
+    if (ret && errno != EEXIST) {
+        int e = errno;
+        error_report("%s: %s host: %p", __func__, strerror(e), host);
+
+        return -e;
+    }
+
+    return 0;
+}
+
+/* Called once every page has been placed, or on a failed start */
+void postcopy_lazy_restore_finish(void)
+{
+    MigrationIncomingState *mis = lazy_mis;
+
+    if (mis->have_fault_thread) {
+        uint64_t tmp64 = 1;
+
+        qemu_ram_foreach_block(cleanup_range, mis);
+        if (write(mis->userfault_quit_fd, &tmp64, 8) == 8) {
+            qemu_thread_join(&mis->fault_thread);
+        } else {
+            error_report("%s: incrementing userfault_quit_fd: %s", __func__,
+                         strerror(errno));
+        }
+        close(mis->userfault_fd);
+        close(mis->userfault_quit_fd);
+    }
+
+    qemu_balloon_inhibit(false);
+
+    if (enable_mlock && os_mlock() < 0) {
+        error_report("mlock: %s", strerror(errno));
+    }
+
+    if (mis->postcopy_tmp_page) {
+        munmap(mis->postcopy_tmp_page, getpagesize());
+    }
+    g_free(mis);
+    lazy_mis = NULL;
+    trace_postcopy_lazy_restore_finish();
+}
+
 #else
 /* No target OS support, stubs just fail */
 bool postcopy_ram_supported_by_host(void)
@@ -671,6 +776,23 @@ void *postcopy_get_tmp_page(MigrationIncomingState *mis)
     return NULL;
 }
 
+int postcopy_lazy_restore_start(void)
+{
+    error_report("%s: No OS support", __func__);
+    return -1;
+}
+
+int postcopy_lazy_place_page(void *host, void *from)
+{
+    assert(0);
+    return -1;
+}
+
+void postcopy_lazy_restore_finish(void)
+{
+    assert(0);
+}
+
 #endif
 
 /* ------------------------------------------------------------------------- */
@@ -757,3 +879,94 @@ void postcopy_discard_send_finish(MigrationState *ms, PostcopyDiscardState *pds)
 
     g_free(pds);
 }
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Postcopy preempt channel
+ *
+ * Pages the destination faults on are sent on a separate connection, so
+ * that they don't queue up behind the background pages already sitting in
+ * the socket buffers of the main stream.  The connection is opened to the
+ * same address as the main stream when the migration starts.
+ */
+
+/* Called on the source when the main stream has been connected */
+int postcopy_preempt_setup(MigrationState *s, Error **errp)
+{
+    QIOChannel *ioc;
+
+    if (!migrate_postcopy_preempt()) {
+        return 0;
+    }
+
+    ioc = socket_send_channel_create(errp);
+    if (!ioc) {
+        return -1;
+    }
+    s->postcopy_preempt_file = qemu_fopen_channel_output(ioc);
+    object_unref(OBJECT(ioc));
+    trace_postcopy_preempt_setup();
+    return 0;
+}
+
+static void *postcopy_preempt_thread(void *opaque)
+{
+    MigrationIncomingState *mis = opaque;
+    void *tmp_page;
+    int ret;
+
+    rcu_register_thread();
+    trace_postcopy_preempt_thread_entry();
+
+    tmp_page = qemu_memalign(getpagesize(), getpagesize());
+    ret = ram_load_postcopy_preempt(mis->postcopy_preempt_file, tmp_page);
+    qemu_vfree(tmp_page);
+
+    if (ret < 0) {
+        error_report("%s: loading urgent pages failed: %d", __func__, ret);
+        /* Fail the main stream too, rather than wait for pages forever */
+        qemu_file_shutdown(mis->from_src_file);
+    }
+
+    trace_postcopy_preempt_thread_exit(ret);
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/* Called on the destination for the connection after the main stream */
+void postcopy_preempt_new_channel(MigrationIncomingState *mis,
+                                  QIOChannel *ioc)
+{
+    if (mis->have_preempt_thread) {
+        error_report("postcopy-preempt: unexpected connection");
+        return;
+    }
+
+    trace_postcopy_preempt_new_channel();
+    qio_channel_set_blocking(ioc, true, NULL);
+    mis->postcopy_preempt_file = qemu_fopen_channel_input(ioc);
+    mis->have_preempt_thread = true;
+    qemu_thread_create(&mis->preempt_thread, "postcopy/preempt",
+                       postcopy_preempt_thread, mis, QEMU_THREAD_JOINABLE);
+}
+
+/*
+ * Wait for the preempt channel reader on the destination.  The source ends
+ * the channel when it has sent all of RAM; if the main stream failed, don't
+ * wait for it.
+ */
+void postcopy_preempt_incoming_cleanup(MigrationIncomingState *mis)
+{
+    if (!mis->have_preempt_thread) {
+        return;
+    }
+
+    if (qemu_file_get_error(mis->from_src_file)) {
+        qemu_file_shutdown(mis->postcopy_preempt_file);
+    }
+    qemu_thread_join(&mis->preempt_thread);
+    qemu_fclose(mis->postcopy_preempt_file);
+    mis->postcopy_preempt_file = NULL;
+    mis->have_preempt_thread = false;
+}
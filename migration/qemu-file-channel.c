@@ -25,6 +25,7 @@
 #include "qemu/osdep.h"
 #include "migration/qemu-file.h"
 #include "io/channel-socket.h"
+#include "io/channel-file.h"
 #include "qemu/iov.h"
 
 
@@ -167,14 +168,136 @@ static const QEMUFileOps channel_output_ops = {
 };
 
 
+/*
+ * A regular file behind the channel is accessed with positioned I/O, so
+ * that the stream can be seeked and x-mapped-ram works as with savevm.
+ * Stream positions are file offsets, the file must be at its start.
+ */
+static int channel_file_fd(void *opaque)
+{
+    return QIO_CHANNEL_FILE(opaque)->fd;
+}
+
+static int channel_file_pio(int fd, void *buf, size_t size, int64_t pos,
+                            bool is_write)
+{
+    ssize_t len;
+
+    while (size) {
+        if (is_write) {
+            len = pwrite(fd, buf, size, pos);
+        } else {
+            len = pread(fd, buf, size, pos);
+        }
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        if (len == 0) {
+            return -EIO;
+        }
+        buf = (uint8_t *)buf + len;
+        size -= len;
+        pos += len;
+    }
+    return 0;
+}
+
+static ssize_t channel_file_writev_buffer(void *opaque,
+                                          struct iovec *iov,
+                                          int iovcnt,
+                                          int64_t pos)
+{
+    ssize_t done = 0;
+    int i, ret;
+
+    for (i = 0; i < iovcnt; i++) {
+        ret = channel_file_pio(channel_file_fd(opaque), iov[i].iov_base,
+                               iov[i].iov_len, pos + done, true);
+        if (ret < 0) {
+            return ret;
+        }
+        done += iov[i].iov_len;
+    }
+    return done;
+}
+
+static ssize_t channel_file_get_buffer(void *opaque,
+                                       uint8_t *buf,
+                                       int64_t pos,
+                                       size_t size)
+{
+    ssize_t len;
+
+    do {
+        len = pread(channel_file_fd(opaque), buf, size, pos);
+    } while (len < 0 && errno == EINTR);
+
+    return len < 0 ? -errno : len;
+}
+
+static int channel_file_rw_regions(void *opaque, QEMUFileRegion *regions,
+                                   int n, bool is_write)
+{
+    int i, ret;
+
+    for (i = 0; i < n; i++) {
+        ret = channel_file_pio(channel_file_fd(opaque), regions[i].buf,
+                               regions[i].size, regions[i].pos, is_write);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+static const QEMUFileOps channel_file_input_ops = {
+    .get_buffer = channel_file_get_buffer,
+    .close = channel_close,
+    .set_blocking = channel_set_blocking,
+    .rw_regions = channel_file_rw_regions,
+    .get_fd = channel_file_fd,
+};
+
+
+static const QEMUFileOps channel_file_output_ops = {
+    .writev_buffer = channel_file_writev_buffer,
+    .close = channel_close,
+    .set_blocking = channel_set_blocking,
+    .rw_regions = channel_file_rw_regions,
+    .get_fd = channel_file_fd,
+};
+
+static bool channel_is_regular_file(QIOChannel *ioc)
+{
+    struct stat st;
+    int fd;
+
+    if (!object_dynamic_cast(OBJECT(ioc), TYPE_QIO_CHANNEL_FILE)) {
+        return false;
+    }
+    fd = QIO_CHANNEL_FILE(ioc)->fd;
+    return fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+           lseek(fd, 0, SEEK_CUR) == 0;
+}
+
+
 QEMUFile *qemu_fopen_channel_input(QIOChannel *ioc)
 {
     object_ref(OBJECT(ioc));
+    if (channel_is_regular_file(ioc)) {
+        return qemu_fopen_ops(ioc, &channel_file_input_ops);
+    }
     return qemu_fopen_ops(ioc, &channel_input_ops);
 }
 
 QEMUFile *qemu_fopen_channel_output(QIOChannel *ioc)
 {
     object_ref(OBJECT(ioc));
+    if (channel_is_regular_file(ioc)) {
+        return qemu_fopen_ops(ioc, &channel_file_output_ops);
+    }
     return qemu_fopen_ops(ioc, &channel_output_ops);
 }
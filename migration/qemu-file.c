@@ -28,6 +28,7 @@
 #include "qemu/iov.h"
 #include "qemu/sockets.h"
 #include "qemu/coroutine.h"
+#include "qemu/timer.h"
 #include "migration/migration.h"
 #include "migration/qemu-file.h"
 #include "trace.h"
@@ -42,6 +43,8 @@ struct QEMUFile {
 
     int64_t bytes_xfer;
     int64_t xfer_limit;
+    /* time spent in writev_buffer, in ns */
+    int64_t write_ns;
 
     int64_t pos; /* start of buffer when writing, end of buffer
                     when reading */
@@ -149,8 +152,11 @@ void qemu_fflush(QEMUFile *f)
     }
 
     if (f->iovcnt > 0) {
+        int64_t start = get_clock();
+
         expect = iov_size(f->iov, f->iovcnt);
         ret = f->ops->writev_buffer(f->opaque, f->iov, f->iovcnt, f->pos);
+        f->write_ns += get_clock() - start;
     }
 
     if (ret >= 0) {
@@ -273,6 +279,62 @@ void qemu_update_position(QEMUFile *f, size_t size)
     f->pos += size;
 }
 
+/*
+ * Account for data that was sent on another channel on behalf of this
+ * stream, so that rate limiting and the bandwidth estimate include it.
+ */
+void qemu_file_update_transfer(QEMUFile *f, size_t size)
+{
+    f->pos += size;
+    f->bytes_xfer += size;
+}
+
+bool qemu_file_is_seekable(QEMUFile *f)
+{
+    return f->ops->rw_regions != NULL;
+}
+
+/*
+ * Transfer memory regions at fixed positions in the file, bypassing the
+ * stream buffer.
+ */
+int qemu_file_rw_regions(QEMUFile *f, QEMUFileRegion *regions, int n,
+                         bool is_write)
+{
+    int ret;
+
+    ret = qemu_file_get_error(f);
+    if (ret) {
+        return ret;
+    }
+
+    ret = f->ops->rw_regions(f->opaque, regions, n, is_write);
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+    }
+    return ret;
+}
+
+/*
+ * Continue the stream at @pos, e.g. to skip over the regions written
+ * with qemu_file_rw_regions().  Buffered input is dropped.
+ */
+void qemu_fseek(QEMUFile *f, int64_t pos)
+{
+    if (qemu_file_is_writable(f)) {
+        qemu_fflush(f);
+    } else {
+        f->buf_index = 0;
+        f->buf_size = 0;
+    }
+    f->pos = pos;
+}
+
+int qemu_file_get_fd(QEMUFile *f)
+{
+    return f->ops->get_fd ? f->ops->get_fd(f->opaque) : -1;
+}
+
 /** Closes the file
  *
  * Returns negative error value if any error happened on previous operations or
@@ -559,6 +621,12 @@ int64_t qemu_file_get_rate_limit(QEMUFile *f)
     return f->xfer_limit;
 }
 
+/* Total time spent writing out the buffered data, in ns */
+int64_t qemu_file_get_write_time(QEMUFile *f)
+{
+    return f->write_ns;
+}
+
 void qemu_file_set_rate_limit(QEMUFile *f, int64_t limit)
 {
     f->xfer_limit = limit;
@@ -656,6 +724,46 @@ ssize_t qemu_put_compression_data(QEMUFile *f, const uint8_t *p, size_t size,
     return blen + sizeof(int32_t);
 }
 
+#ifdef CONFIG_ZSTD
+/* Same as qemu_put_compression_data(), but using zstd and the
+ * compression context @cctx, which is reused across calls.
+ */
+ssize_t qemu_put_compression_data_zstd(QEMUFile *f, ZSTD_CCtx *cctx,
+                                       const uint8_t *p, size_t size,
+                                       int level)
+{
+    ssize_t blen = IO_BUF_SIZE - f->buf_index - sizeof(int32_t);
+    size_t ret;
+
+    if (blen < ZSTD_compressBound(size)) {
+        if (!qemu_file_is_writable(f)) {
+            return -1;
+        }
+        qemu_fflush(f);
+        blen = IO_BUF_SIZE - sizeof(int32_t);
+        if (blen < ZSTD_compressBound(size)) {
+            return -1;
+        }
+    }
+    ret = ZSTD_compressCCtx(cctx, f->buf + f->buf_index + sizeof(int32_t),
+                            blen, p, size, level);
+    if (ZSTD_isError(ret)) {
+        error_report("Compress Failed: %s", ZSTD_getErrorName(ret));
+        return 0;
+    }
+    blen = ret;
+    qemu_put_be32(f, blen);
+    if (f->ops->writev_buffer) {
+        add_to_iovec(f, f->buf + f->buf_index, blen);
+    }
+    f->buf_index += blen;
+    if (f->buf_index == IO_BUF_SIZE) {
+        qemu_fflush(f);
+    }
+    return blen + sizeof(int32_t);
+}
+#endif
+
 /* Put the data in the buffer of f_src to the buffer of f_des, and
  * then reset the buf_index of f_src to 0.
  */
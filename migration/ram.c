@@ -30,6 +30,7 @@
 #include "cpu.h"
 #include <zlib.h>
 #include "qapi-event.h"
+#include "qapi/error.h"
 #include "qemu/cutils.h"
 #include "qemu/bitops.h"
 #include "qemu/bitmap.h"
@@ -41,8 +42,12 @@
 #include "migration/page_cache.h"
 #include "qemu/error-report.h"
 #include "trace.h"
+#include "trace/control.h"
 #include "exec/ram_addr.h"
 #include "qemu/rcu_queue.h"
+#include "qemu/iov.h"
+#include "io/channel.h"
+#include "sysemu/kvm.h"
 
 #ifdef DEBUG_MIGRATION_RAM
 #define DPRINTF(fmt, ...) \
@@ -68,6 +73,7 @@ static uint64_t bitmap_sync_count;
 #define RAM_SAVE_FLAG_XBZRLE   0x40
 /* 0x80 is reserved in migration.h start with 0x100 next */
 #define RAM_SAVE_FLAG_COMPRESS_PAGE    0x100
+#define RAM_SAVE_FLAG_MULTIFD_SYNC     0x200
 
 static const uint8_t ZERO_TARGET_PAGE[TARGET_PAGE_SIZE];
 
@@ -157,6 +163,37 @@ typedef struct AccountingInfo {
 } AccountingInfo;
 
 static AccountingInfo acct_info;
+static uint64_t bytes_transferred;
+
+/* Where the time of the current pass goes, for MIGRATION_PASS_STATS and
+ * the migration_pass_stats trace event.  A pass starts with a bitmap sync
+ * and ends with the next one, or with ram_save_complete.  The per-page
+ * timers are only read when someone is listening; all times are in ns.
+ */
+static struct {
+    bool enabled;
+    int64_t start;
+    int64_t sync;
+    int64_t scan;
+    int64_t compress;
+    int64_t send_start;
+    uint64_t bytes_start;
+    uint64_t dirty_pages;
+    /* bytes credited to bytes_transferred that no block can claim */
+    uint64_t unattributed;
+} pass_stats;
+
+static inline int64_t pass_stats_clock(void)
+{
+    return pass_stats.enabled ? qemu_clock_get_ns(QEMU_CLOCK_REALTIME) : 0;
+}
+
+static inline void pass_stats_add(int64_t *counter, int64_t start)
+{
+    if (pass_stats.enabled) {
+        *counter += qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start;
+    }
+}
 
 static void acct_clear(void)
 {
@@ -223,9 +260,17 @@ uint64_t xbzrle_mig_pages_overflow(void)
 static RAMBlock *last_seen_block;
 /* This is the last block from where we have sent data */
 static RAMBlock *last_sent_block;
+/* Same, on the postcopy preempt channel */
+static RAMBlock *preempt_last_sent_block;
 static ram_addr_t last_offset;
 static QemuMutex migration_bitmap_mutex;
 static uint64_t migration_dirty_pages;
+/* Pages dropped by qemu_guest_free_page_hint(), not yet subtracted from
+ * migration_dirty_pages; that one is only updated by the migration thread.
+ */
+static unsigned long migration_hinted_pages;
+static NotifierList ram_bitmap_sync_notifiers =
+    NOTIFIER_LIST_INITIALIZER(ram_bitmap_sync_notifiers);
 static uint32_t last_version;
 static bool ram_bulk_stage;
 
@@ -260,6 +305,11 @@ struct CompressParam {
     QemuCond cond;
     RAMBlock *block;
     ram_addr_t offset;
+    unsigned int npages;
+#ifdef CONFIG_ZSTD
+    /* Kept for the whole migration so that its tables are reused */
+    ZSTD_CCtx *zstd_cctx;
+#endif
 };
 typedef struct CompressParam CompressParam;
 
@@ -271,10 +321,22 @@ struct DecompressParam {
     void *des;
     uint8_t *compbuf;
     int len;
+    size_t size;
+#ifdef CONFIG_ZSTD
+    ZSTD_DCtx *zstd_dctx;
+#endif
 };
 typedef struct DecompressParam DecompressParam;
 
+/* With zstd, runs of consecutive pages are compressed as a single frame.
+ * Keep a frame well within the QEMUFile buffer of the compression thread.
+ */
+#define COMPRESS_BATCH_PAGES MAX(1, (28 * 1024) / TARGET_PAGE_SIZE)
+
+static bool comp_zstd;
 static CompressParam *comp_param;
+/* Used by the migration thread for the first page of each block */
+static CompressParam comp_main_param;
 static QemuThread *compress_threads;
 /* comp_done_cond is used to wake up the migration thread when
  * one of the compression threads has finished the compression.
@@ -290,25 +352,29 @@ static DecompressParam *decomp_param;
 static QemuThread *decompress_threads;
 static QemuMutex decomp_done_lock;
 static QemuCond decomp_done_cond;
+static bool decomp_zstd;
+static size_t decomp_buf_size;
 
-static int do_compress_ram_page(QEMUFile *f, RAMBlock *block,
-                                ram_addr_t offset);
+static int do_compress_ram_page(CompressParam *param, RAMBlock *block,
+                                ram_addr_t offset, unsigned int npages);
 
 static void *do_data_compress(void *opaque)
 {
     CompressParam *param = opaque;
     RAMBlock *block;
     ram_addr_t offset;
+    unsigned int npages;
 
     qemu_mutex_lock(&param->mutex);
     while (!param->quit) {
         if (param->block) {
             block = param->block;
             offset = param->offset;
+            npages = param->npages;
             param->block = NULL;
             qemu_mutex_unlock(&param->mutex);
 
-            do_compress_ram_page(param->file, block, offset);
+            do_compress_ram_page(param, block, offset, npages);
 
             qemu_mutex_lock(&comp_done_lock);
             param->done = true;
@@ -352,7 +418,14 @@ void migrate_compress_threads_join(void)
         qemu_fclose(comp_param[i].file);
         qemu_mutex_destroy(&comp_param[i].mutex);
         qemu_cond_destroy(&comp_param[i].cond);
+#ifdef CONFIG_ZSTD
+        ZSTD_freeCCtx(comp_param[i].zstd_cctx);
+#endif
     }
+#ifdef CONFIG_ZSTD
+    ZSTD_freeCCtx(comp_main_param.zstd_cctx);
+    comp_main_param.zstd_cctx = NULL;
+#endif
     qemu_mutex_destroy(&comp_done_lock);
     qemu_cond_destroy(&comp_done_cond);
     g_free(compress_threads);
@@ -369,11 +442,17 @@ void migrate_compress_threads_create(void)
         return;
     }
     compression_switch = true;
+    comp_zstd = migrate_compress_method() == MIGRATION_COMPRESS_METHOD_ZSTD;
     thread_count = migrate_compress_threads();
     compress_threads = g_new0(QemuThread, thread_count);
     comp_param = g_new0(CompressParam, thread_count);
     qemu_cond_init(&comp_done_cond);
     qemu_mutex_init(&comp_done_lock);
+#ifdef CONFIG_ZSTD
+    if (comp_zstd) {
+        comp_main_param.zstd_cctx = ZSTD_createCCtx();
+    }
+#endif
     for (i = 0; i < thread_count; i++) {
         /* comp_param[i].file is just used as a dummy buffer to save data,
          * set its ops to empty.
@@ -381,6 +460,11 @@ void migrate_compress_threads_create(void)
         comp_param[i].file = qemu_fopen_ops(NULL, &empty_ops);
         comp_param[i].done = true;
         comp_param[i].quit = false;
+#ifdef CONFIG_ZSTD
+        if (comp_zstd) {
+            comp_param[i].zstd_cctx = ZSTD_createCCtx();
+        }
+#endif
         qemu_mutex_init(&comp_param[i].mutex);
         qemu_cond_init(&comp_param[i].cond);
         qemu_thread_create(compress_threads + i, "compress",
@@ -389,10 +473,712 @@ void migrate_compress_threads_create(void)
     }
 }
 
+/* Multiple connections (multifd) for RAM pages
+ *
+ * Each multifd channel is a separate socket to the destination, driven by
+ * its own thread on both sides.  The migration thread collects normal pages
+ * into batches of MULTIFD_PAGES_PER_PACKET pages from a single RAMBlock and
+ * hands each batch to an idle channel, which sends a MultiFDPacket header
+ * naming the block and the page offsets followed by the page contents.  The
+ * destination places the pages straight into guest RAM.
+ *
+ * The migration thread does not look for zero pages in what it queues to
+ * the channels; each sender thread does, for its own batch, and only
+ * flags zero pages in the packet header.  Their data is not sent.  Bytes
+ * and pages are accounted when the migration thread next hands a batch to
+ * the channel, or at the end of the round.
+ *
+ * Everything else, including XBZRLE pages and the zero pages found while
+ * XBZRLE is in use, stays on the main stream.  At the end of every round
+ * the source asks each channel to send a sync packet and puts
+ * RAM_SAVE_FLAG_MULTIFD_SYNC on the main stream; the destination does not
+ * go past that point in the main stream, nor in any channel, until every
+ * channel has reached its sync packet.  A page is sent
+ * at most once per round, so later copies of a page can never be overtaken
+ * by earlier ones.
+ *
+ * With zero-copy-send the page data is handed to the kernel by reference
+ * (MSG_ZEROCOPY) and only the header is copied.  Until the kernel reports
+ * the send complete it may read the page at any time, which is harmless:
+ * a page dirtied meanwhile is caught by the next migration_bitmap_sync()
+ * and sent again.  Each channel waits for its completions before sending
+ * the sync packet, so the sends of a round are over when the round closes,
+ * and in particular the last one has left before migration completes.
+ */
+
+#define MULTIFD_MAGIC 0x11223344U
+#define MULTIFD_VERSION 2
+#define MULTIFD_PAGES_PER_PACKET 64
+
+#define MULTIFD_FLAG_SYNC (1 << 0)
+
+/* Sent once at the start of each channel */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t id;
+} QEMU_PACKED MultiFDInit;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t flags;
+    uint32_t num;
+    uint32_t unused;
+    /* Bit i set: page i is all zeroes, and its data is not sent */
+    uint64_t zero_pages;
+    char ramblock[256];
+    uint64_t offset[MULTIFD_PAGES_PER_PACKET];
+} QEMU_PACKED MultiFDPacket;
+
+QEMU_BUILD_BUG_ON(MULTIFD_PAGES_PER_PACKET > 64);
+
+typedef struct {
+    RAMBlock *block;
+    unsigned int num;
+    ram_addr_t offset[MULTIFD_PAGES_PER_PACKET];
+} MultiFDPages;
+
+typedef struct {
+    int id;
+    QemuThread thread;
+    QIOChannel *c;
+    /* posted when there is a job for the thread, or it must quit */
+    QemuSemaphore sem;
+    /* protects the fields below */
+    QemuMutex mutex;
+    bool quit;
+    bool pending_job;
+    bool sync;
+    MultiFDPages *pages;
+    /* sent since the migration thread last accounted them */
+    uint64_t normal_pages;
+    uint64_t zero_pages;
+    uint64_t bytes_sent;
+    MultiFDPacket packet;
+    struct iovec iov[MULTIFD_PAGES_PER_PACKET + 1];
+} MultiFDSendParams;
+
+static struct {
+    MultiFDSendParams *params;
+    int count;
+    /* one count per idle channel */
+    QemuSemaphore channels_ready;
+    /* batch being filled by the migration thread */
+    MultiFDPages *pages;
+    int next_channel;
+    int error;
+} *multifd_send_state;
+
+static int multifd_writev_all(QIOChannel *c, struct iovec *iov,
+                              unsigned int niov, bool zero_copy,
+                              Error **errp)
+{
+    while (niov > 0) {
+        ssize_t len = zero_copy ?
+                      qio_channel_writev_zero_copy(c, iov, niov, errp) :
+                      qio_channel_writev(c, iov, niov, errp);
+
+        if (len == QIO_CHANNEL_ERR_BLOCK) {
+            qio_channel_wait(c, G_IO_OUT);
+            continue;
+        }
+        if (len < 0) {
+            return -1;
+        }
+        iov_discard_front(&iov, &niov, len);
+    }
+    return 0;
+}
+
+static int multifd_readv_all(QIOChannel *c, struct iovec *iov,
+                             unsigned int niov, Error **errp)
+{
+    while (niov > 0) {
+        ssize_t len = qio_channel_readv(c, iov, niov, errp);
+
+        if (len == QIO_CHANNEL_ERR_BLOCK) {
+            qio_channel_wait(c, G_IO_IN);
+            continue;
+        }
+        if (len < 0) {
+            return -1;
+        }
+        if (len == 0) {
+            error_setg(errp, "multifd: unexpected end of channel");
+            return -1;
+        }
+        iov_discard_front(&iov, &niov, len);
+    }
+    return 0;
+}
+
+static int multifd_send_packet(MultiFDSendParams *p, bool sync, Error **errp)
+{
+    MultiFDPages *pages = p->pages;
+    MultiFDPacket *packet = &p->packet;
+    uint64_t zero_pages = 0;
+    unsigned int i, niov = 1;
+    uint8_t *host;
+
+    packet->magic = cpu_to_be32(MULTIFD_MAGIC);
+    packet->flags = cpu_to_be32(sync ? MULTIFD_FLAG_SYNC : 0);
+    packet->num = cpu_to_be32(pages->num);
+    memset(packet->ramblock, 0, sizeof(packet->ramblock));
+    if (pages->num) {
+        pstrcpy(packet->ramblock, sizeof(packet->ramblock),
+                pages->block->idstr);
+    }
+
+    p->iov[0].iov_base = packet;
+    p->iov[0].iov_len = sizeof(*packet);
+    for (i = 0; i < pages->num; i++) {
+        packet->offset[i] = cpu_to_be64(pages->offset[i]);
+        host = pages->block->host + pages->offset[i];
+        if (is_zero_range(host, TARGET_PAGE_SIZE)) {
+            zero_pages |= 1ULL << i;
+            continue;
+        }
+        p->iov[niov].iov_base = host;
+        p->iov[niov].iov_len = TARGET_PAGE_SIZE;
+        niov++;
+    }
+    packet->zero_pages = cpu_to_be64(zero_pages);
+
+    if (migrate_zero_copy_send()) {
+        /* The header is reused for the next packet, so it is copied */
+        if (multifd_writev_all(p->c, p->iov, 1, false, errp) < 0 ||
+            multifd_writev_all(p->c, p->iov + 1, niov - 1, true, errp) < 0) {
+            return -1;
+        }
+    } else if (multifd_writev_all(p->c, p->iov, niov, false, errp) < 0) {
+        return -1;
+    }
+
+    qemu_mutex_lock(&p->mutex);
+    p->normal_pages += niov - 1;
+    p->zero_pages += pages->num - (niov - 1);
+    p->bytes_sent += sizeof(*packet) + (niov - 1) * TARGET_PAGE_SIZE;
+    qemu_mutex_unlock(&p->mutex);
+    return 0;
+}
+
+/*
+ * Account for what channel @p sent since the last call, on behalf of the
+ * main stream @f.  Called by the migration thread with p->mutex held.
+ */
+static void multifd_account(MultiFDSendParams *p, QEMUFile *f)
+{
+    qemu_file_update_transfer(f, p->bytes_sent);
+    bytes_transferred += p->bytes_sent;
+    /* multifd_queue_page already charged the pages to their block */
+    pass_stats.unattributed += p->bytes_sent;
+    acct_info.norm_pages += p->normal_pages;
+    acct_info.dup_pages += p->zero_pages;
+    p->bytes_sent = 0;
+    p->normal_pages = 0;
+    p->zero_pages = 0;
+}
+
+static void *multifd_send_thread(void *opaque)
+{
+    MultiFDSendParams *p = opaque;
+    MultiFDInit init = {
+        .magic = cpu_to_be32(MULTIFD_MAGIC),
+        .version = cpu_to_be32(MULTIFD_VERSION),
+        .id = cpu_to_be32(p->id),
+    };
+    struct iovec iov = { .iov_base = &init, .iov_len = sizeof(init) };
+    Error *local_err = NULL;
+    QIOChannel *c;
+
+    c = socket_send_channel_create(&local_err);
+    if (!c) {
+        goto out;
+    }
+    qemu_mutex_lock(&p->mutex);
+    p->c = c;
+    qemu_mutex_unlock(&p->mutex);
+
+    if (migrate_zero_copy_send() &&
+        !qio_channel_has_feature(c, QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY)) {
+        error_setg(&local_err, "multifd: zero-copy-send needs a tcp: "
+                   "migration URI on Linux");
+        goto out;
+    }
+    if (multifd_writev_all(p->c, &iov, 1, false, &local_err) < 0) {
+        goto out;
+    }
+    trace_multifd_send_thread_start(p->id);
+    qemu_sem_post(&multifd_send_state->channels_ready);
+
+    while (true) {
+        qemu_sem_wait(&p->sem);
+        qemu_mutex_lock(&p->mutex);
+        if (p->pending_job) {
+            bool sync = p->sync;
+
+            p->sync = false;
+            qemu_mutex_unlock(&p->mutex);
+
+            /* Close the round only once its pages have really been sent */
+            if (sync && migrate_zero_copy_send() &&
+                qio_channel_flush(p->c, &local_err) < 0) {
+                goto out;
+            }
+            if (multifd_send_packet(p, sync, &local_err) < 0) {
+                goto out;
+            }
+
+            qemu_mutex_lock(&p->mutex);
+            p->pages->num = 0;
+            p->pending_job = false;
+            qemu_mutex_unlock(&p->mutex);
+            qemu_sem_post(&multifd_send_state->channels_ready);
+        } else if (p->quit) {
+            qemu_mutex_unlock(&p->mutex);
+            break;
+        } else {
+            qemu_mutex_unlock(&p->mutex);
+        }
+    }
+
+out:
+    if (local_err) {
+        if (!atomic_read(&p->quit)) {
+            error_report_err(local_err);
+        } else {
+            error_free(local_err);
+        }
+        atomic_set(&multifd_send_state->error, 1);
+        /* wake up the migration thread if it waits for this channel */
+        qemu_sem_post(&multifd_send_state->channels_ready);
+    }
+    trace_multifd_send_thread_end(p->id);
+    return NULL;
+}
+
+void migrate_multifd_send_threads_create(void)
+{
+    int i, thread_count;
+
+    if (!migrate_use_multifd()) {
+        return;
+    }
+    thread_count = migrate_multifd_channels();
+    multifd_send_state = g_new0(typeof(*multifd_send_state), 1);
+    multifd_send_state->params = g_new0(MultiFDSendParams, thread_count);
+    multifd_send_state->count = thread_count;
+    multifd_send_state->pages = g_new0(MultiFDPages, 1);
+    qemu_sem_init(&multifd_send_state->channels_ready, 0);
+    for (i = 0; i < thread_count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        p->id = i;
+        p->pages = g_new0(MultiFDPages, 1);
+        qemu_mutex_init(&p->mutex);
+        qemu_sem_init(&p->sem, 0);
+        qemu_thread_create(&p->thread, "multifd_send", multifd_send_thread,
+                           p, QEMU_THREAD_JOINABLE);
+    }
+}
+
+void migrate_multifd_send_threads_join(void)
+{
+    MigrationState *s = migrate_get_current();
+    int i;
+
+    if (!multifd_send_state) {
+        return;
+    }
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        atomic_set(&p->quit, true);
+        if (p->c && s->state != MIGRATION_STATUS_COMPLETED) {
+            /* Don't wait for a destination that went away */
+            qio_channel_shutdown(p->c, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+        }
+        qemu_mutex_unlock(&p->mutex);
+        qemu_sem_post(&p->sem);
+    }
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_thread_join(&p->thread);
+        if (p->c) {
+            object_unref(OBJECT(p->c));
+        }
+        qemu_mutex_destroy(&p->mutex);
+        qemu_sem_destroy(&p->sem);
+        g_free(p->pages);
+    }
+    qemu_sem_destroy(&multifd_send_state->channels_ready);
+    g_free(multifd_send_state->pages);
+    g_free(multifd_send_state->params);
+    g_free(multifd_send_state);
+    multifd_send_state = NULL;
+}
+
+/* Hand the batch being filled over to an idle channel */
+static int multifd_send_pages(QEMUFile *f)
+{
+    MultiFDPages *pages = multifd_send_state->pages;
+    MultiFDSendParams *p;
+    int i;
+
+    if (atomic_read(&multifd_send_state->error)) {
+        return -1;
+    }
+    qemu_sem_wait(&multifd_send_state->channels_ready);
+    if (atomic_read(&multifd_send_state->error)) {
+        return -1;
+    }
+
+    /* Holding a channels_ready count guarantees that one is idle */
+    for (i = multifd_send_state->next_channel;;
+         i = (i + 1) % multifd_send_state->count) {
+        p = &multifd_send_state->params[i];
+        qemu_mutex_lock(&p->mutex);
+        if (!p->pending_job) {
+            break;
+        }
+        qemu_mutex_unlock(&p->mutex);
+    }
+    multifd_send_state->next_channel = (i + 1) % multifd_send_state->count;
+    multifd_account(p, f);
+    multifd_send_state->pages = p->pages;
+    p->pages = pages;
+    p->pending_job = true;
+    qemu_mutex_unlock(&p->mutex);
+    qemu_sem_post(&p->sem);
+
+    return 0;
+}
+
+static int multifd_queue_page(QEMUFile *f, RAMBlock *block,
+                              ram_addr_t offset)
+{
+    MultiFDPages *pages = multifd_send_state->pages;
+
+    if (pages->num && pages->block != block) {
+        if (multifd_send_pages(f) < 0) {
+            return -1;
+        }
+        pages = multifd_send_state->pages;
+    }
+
+    pages->block = block;
+    pages->offset[pages->num++] = offset;
+    block->pass_bytes += TARGET_PAGE_SIZE;
+    if (pages->num == MULTIFD_PAGES_PER_PACKET) {
+        return multifd_send_pages(f);
+    }
+    return 0;
+}
+
+/*
+ * Close the current round: flush the partial batch, have every channel
+ * send a sync packet behind its pages and mark the point in the main
+ * stream.
+ */
+static int multifd_send_sync_main(QEMUFile *f)
+{
+    int i;
+
+    if (!migrate_use_multifd()) {
+        return 0;
+    }
+    if (multifd_send_state->pages->num && multifd_send_pages(f) < 0) {
+        goto err;
+    }
+
+    /* Wait for all the channels to be idle */
+    for (i = 0; i < multifd_send_state->count; i++) {
+        if (atomic_read(&multifd_send_state->error)) {
+            goto err;
+        }
+        qemu_sem_wait(&multifd_send_state->channels_ready);
+    }
+    if (atomic_read(&multifd_send_state->error)) {
+        goto err;
+    }
+
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        multifd_account(p, f);
+        p->sync = true;
+        p->pending_job = true;
+        qemu_mutex_unlock(&p->mutex);
+        qemu_sem_post(&p->sem);
+    }
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_MULTIFD_SYNC);
+    return 0;
+
+err:
+    error_report("multifd: channel failure");
+    qemu_file_set_error(f, -EIO);
+    return -1;
+}
+
+typedef struct {
+    int id;
+    QemuThread thread;
+    QIOChannel *c;
+    /* posted once all the channels have reached a sync packet */
+    QemuSemaphore sem_sync;
+    bool quit;
+    MultiFDPacket packet;
+    struct iovec iov[MULTIFD_PAGES_PER_PACKET];
+} MultiFDRecvParams;
+
+static struct {
+    MultiFDRecvParams *params;
+    int count;
+    /* channels connected so far */
+    int connected;
+    /* channels that have not reached the current sync packet yet */
+    int pending_sync;
+    QEMUBH *sync_bh;
+    /* the incoming coroutine, while it waits for pending_sync */
+    Coroutine *co;
+    int error;
+} *multifd_recv_state;
+
+static int multifd_recv_packet(MultiFDRecvParams *p, uint32_t *flags,
+                               Error **errp)
+{
+    MultiFDPacket *packet = &p->packet;
+    struct iovec iov = { .iov_base = packet, .iov_len = sizeof(*packet) };
+    RAMBlock *block;
+    uint64_t zero_pages;
+    uint32_t i, num, niov = 0;
+    int ret;
+
+    if (multifd_readv_all(p->c, &iov, 1, errp) < 0) {
+        return -1;
+    }
+    if (be32_to_cpu(packet->magic) != MULTIFD_MAGIC) {
+        error_setg(errp, "multifd: bad packet magic %x",
+                   be32_to_cpu(packet->magic));
+        return -1;
+    }
+    *flags = be32_to_cpu(packet->flags);
+    num = be32_to_cpu(packet->num);
+    if (num > MULTIFD_PAGES_PER_PACKET) {
+        error_setg(errp, "multifd: bad number of pages %u", num);
+        return -1;
+    }
+    zero_pages = be64_to_cpu(packet->zero_pages);
+    if (num < 64 && zero_pages >> num) {
+        error_setg(errp, "multifd: bad zero page mask %" PRIx64, zero_pages);
+        return -1;
+    }
+    if (!num) {
+        return 0;
+    }
+
+    packet->ramblock[sizeof(packet->ramblock) - 1] = 0;
+    rcu_read_lock();
+    block = qemu_ram_block_by_name(packet->ramblock);
+    if (!block) {
+        error_setg(errp, "multifd: unknown RAM block %s", packet->ramblock);
+        ret = -1;
+        goto out;
+    }
+    for (i = 0; i < num; i++) {
+        ram_addr_t offset = be64_to_cpu(packet->offset[i]);
+
+        if ((offset & ~TARGET_PAGE_MASK) ||
+            !offset_in_ramblock(block, offset + TARGET_PAGE_SIZE - 1)) {
+            error_setg(errp, "multifd: illegal RAM offset " RAM_ADDR_FMT,
+                       offset);
+            ret = -1;
+            goto out;
+        }
+        if (zero_pages & (1ULL << i)) {
+            ram_handle_compressed(block->host + offset, 0, TARGET_PAGE_SIZE);
+            continue;
+        }
+        p->iov[niov].iov_base = block->host + offset;
+        p->iov[niov].iov_len = TARGET_PAGE_SIZE;
+        niov++;
+    }
+    ret = multifd_readv_all(p->c, p->iov, niov, errp);
+
+out:
+    rcu_read_unlock();
+    return ret;
+}
+
+static void *multifd_recv_thread(void *opaque)
+{
+    MultiFDRecvParams *p = opaque;
+    MultiFDInit init;
+    struct iovec iov = { .iov_base = &init, .iov_len = sizeof(init) };
+    Error *local_err = NULL;
+    uint32_t flags;
+
+    rcu_register_thread();
+
+    if (multifd_readv_all(p->c, &iov, 1, &local_err) < 0) {
+        goto out;
+    }
+    if (be32_to_cpu(init.magic) != MULTIFD_MAGIC ||
+        be32_to_cpu(init.version) != MULTIFD_VERSION) {
+        error_setg(&local_err, "multifd: bad channel header");
+        goto out;
+    }
+    trace_multifd_recv_thread_start(p->id, be32_to_cpu(init.id));
+
+    while (!atomic_read(&p->quit)) {
+        if (multifd_recv_packet(p, &flags, &local_err) < 0) {
+            break;
+        }
+        if (flags & MULTIFD_FLAG_SYNC) {
+            if (atomic_fetch_dec(&multifd_recv_state->pending_sync) == 1) {
+                qemu_bh_schedule(multifd_recv_state->sync_bh);
+            }
+            qemu_sem_wait(&p->sem_sync);
+        }
+    }
+
+out:
+    if (local_err) {
+        if (!atomic_read(&p->quit)) {
+            error_report_err(local_err);
+            atomic_set(&multifd_recv_state->error, 1);
+            qemu_bh_schedule(multifd_recv_state->sync_bh);
+        } else {
+            error_free(local_err);
+        }
+    }
+    trace_multifd_recv_thread_end(p->id);
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static void multifd_recv_sync_bh(void *opaque)
+{
+    Coroutine *co = multifd_recv_state->co;
+
+    if (co) {
+        multifd_recv_state->co = NULL;
+        qemu_coroutine_enter(co);
+    }
+}
+
+void migrate_multifd_recv_threads_create(void)
+{
+    int i, thread_count;
+
+    if (!migrate_use_multifd()) {
+        return;
+    }
+    thread_count = migrate_multifd_channels();
+    multifd_recv_state = g_new0(typeof(*multifd_recv_state), 1);
+    multifd_recv_state->params = g_new0(MultiFDRecvParams, thread_count);
+    multifd_recv_state->count = thread_count;
+    multifd_recv_state->pending_sync = thread_count;
+    multifd_recv_state->sync_bh = qemu_bh_new(multifd_recv_sync_bh, NULL);
+    for (i = 0; i < thread_count; i++) {
+        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+
+        p->id = i;
+        qemu_sem_init(&p->sem_sync, 0);
+    }
+}
+
+void migrate_multifd_recv_threads_join(void)
+{
+    int i;
+
+    if (!multifd_recv_state) {
+        return;
+    }
+    for (i = 0; i < multifd_recv_state->connected; i++) {
+        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+
+        atomic_set(&p->quit, true);
+        qio_channel_shutdown(p->c, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+        qemu_sem_post(&p->sem_sync);
+        qemu_thread_join(&p->thread);
+        object_unref(OBJECT(p->c));
+    }
+    for (i = 0; i < multifd_recv_state->count; i++) {
+        qemu_sem_destroy(&multifd_recv_state->params[i].sem_sync);
+    }
+    qemu_bh_delete(multifd_recv_state->sync_bh);
+    g_free(multifd_recv_state->params);
+    g_free(multifd_recv_state);
+    multifd_recv_state = NULL;
+}
+
+/* Called from the main loop for each connection after the main stream */
+void migrate_multifd_recv_new_channel(QIOChannel *ioc)
+{
+    MultiFDRecvParams *p;
+
+    if (!multifd_recv_state ||
+        multifd_recv_state->connected == multifd_recv_state->count) {
+        error_report("multifd: unexpected connection");
+        return;
+    }
+    p = &multifd_recv_state->params[multifd_recv_state->connected++];
+    object_ref(OBJECT(ioc));
+    p->c = ioc;
+    qio_channel_set_blocking(ioc, true, NULL);
+    qemu_thread_create(&p->thread, "multifd_recv", multifd_recv_thread, p,
+                       QEMU_THREAD_JOINABLE);
+}
+
+bool migrate_multifd_recv_all_channels(void)
+{
+    return multifd_recv_state &&
+           multifd_recv_state->connected == multifd_recv_state->count;
+}
+
+/*
+ * Called when the main stream reaches RAM_SAVE_FLAG_MULTIFD_SYNC: wait for
+ * all the channels to reach their sync packet, then let everybody go on.
+ */
+static int multifd_recv_sync_main(void)
+{
+    int i;
+
+    if (!multifd_recv_state) {
+        error_report("multifd: sync received but x-multifd is not enabled");
+        return -EINVAL;
+    }
+    if (!qemu_in_coroutine()) {
+        error_report("multifd: sync received outside of incoming migration");
+        return -EINVAL;
+    }
+
+    while (atomic_read(&multifd_recv_state->pending_sync) &&
+           !atomic_read(&multifd_recv_state->error)) {
+        multifd_recv_state->co = qemu_coroutine_self();
+        qemu_coroutine_yield();
+    }
+    if (atomic_read(&multifd_recv_state->error)) {
+        return -EIO;
+    }
+
+    atomic_set(&multifd_recv_state->pending_sync, multifd_recv_state->count);
+    for (i = 0; i < multifd_recv_state->connected; i++) {
+        qemu_sem_post(&multifd_recv_state->params[i].sem_sync);
+    }
+    return 0;
+}
+
 /**
  * save_page_header: Write page header to wire
  *
  * If this is the 1st block, it also writes the block identification
+ * and remembers it as last_sent_block
  *
  * Returns: Number of bytes written
  *
@@ -413,6 +1199,7 @@ static size_t save_page_header(QEMUFile *f, RAMBlock *block, ram_addr_t offset)
         qemu_put_byte(f, len);
         qemu_put_buffer(f, (uint8_t *)block->idstr, len);
         size += 1 + len;
+        last_sent_block = block;
     }
     return size;
 }
@@ -480,6 +1267,7 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t **current_data,
 {
     int encoded_len = 0, bytes_xbzrle;
     uint8_t *prev_cached_page;
+    int64_t encode_start;
 
     if (!cache_is_cached(XBZRLE.cache, current_addr, bitmap_sync_count)) {
         acct_info.xbzrle_cache_miss++;
@@ -502,9 +1290,11 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t **current_data,
     memcpy(XBZRLE.current_buf, *current_data, TARGET_PAGE_SIZE);
 
     /* XBZRLE encoding (if there is no overflow) */
+    encode_start = pass_stats_clock();
     encoded_len = xbzrle_encode_buffer(prev_cached_page, XBZRLE.current_buf,
                                        TARGET_PAGE_SIZE, XBZRLE.encoded_buf,
                                        TARGET_PAGE_SIZE);
+    pass_stats_add(&pass_stats.compress, encode_start);
     if (encoded_len == 0) {
         DPRINTF("Skipping unmodified page\n");
         return 0;
@@ -583,6 +1373,81 @@ static inline bool migration_bitmap_clear_dirty(ram_addr_t addr)
     return ret;
 }
 
+/*
+ * ram_bitmap_range_dirty: whether [start, start + length) of the ram address
+ * space still has pages to send in this pass
+ *
+ * A racy hint for transports preparing the memory ahead of the sender, e.g.
+ * RDMA registration.  Called under rcu_read_lock().
+ */
+bool ram_bitmap_range_dirty(ram_addr_t start, ram_addr_t length)
+{
+    struct BitmapRcu *bitmap_rcu = atomic_rcu_read(&migration_bitmap_rcu);
+    unsigned long first = start >> TARGET_PAGE_BITS;
+    unsigned long last = (start + length) >> TARGET_PAGE_BITS;
+
+    if (!bitmap_rcu) {
+        return false;
+    }
+    if (atomic_read(&ram_bulk_stage)) {
+        return true;
+    }
+    return find_next_bit(bitmap_rcu->bmap, last, first) < last;
+}
+
+/*
+ * qemu_guest_free_page_hint: the guest reported [addr, addr + len) free
+ *
+ * Drops those pages from the current pass.  The hint must have been
+ * gathered after the last bitmap sync: a page the guest reuses later gets
+ * dirtied again and is caught by the next sync, but one reused before the
+ * sync would be lost.  Called with the iothread lock held.
+ */
+void qemu_guest_free_page_hint(void *addr, size_t len)
+{
+    RAMBlock *block;
+    ram_addr_t offset, page, end;
+    unsigned long *bitmap;
+    size_t used_len;
+    unsigned long cleared = 0;
+
+    rcu_read_lock();
+    if (!atomic_rcu_read(&migration_bitmap_rcu)) {
+        goto out;
+    }
+    bitmap = atomic_rcu_read(&migration_bitmap_rcu)->bmap;
+
+    for (; len > 0; len -= used_len, addr += used_len) {
+        block = qemu_ram_block_from_host(addr, false, &offset);
+        if (!block || offset >= block->used_length) {
+            /* The guest may report pages of a block being unplugged */
+            break;
+        }
+        used_len = MIN(len, block->used_length - offset);
+
+        page = (block->offset + offset) >> TARGET_PAGE_BITS;
+        end = (block->offset + offset + used_len) >> TARGET_PAGE_BITS;
+        for (; page < end; page++) {
+            cleared += test_and_clear_bit(page, bitmap);
+        }
+    }
+    atomic_add(&migration_hinted_pages, cleared);
+    trace_qemu_guest_free_page_hint(cleared);
+
+out:
+    rcu_read_unlock();
+}
+
+void ram_add_bitmap_sync_notifier(Notifier *n)
+{
+    notifier_list_add(&ram_bitmap_sync_notifiers, n);
+}
+
+void ram_remove_bitmap_sync_notifier(Notifier *n)
+{
+    notifier_remove(n);
+}
+
 static void migration_bitmap_sync_range(ram_addr_t start, ram_addr_t length)
 {
     unsigned long *bitmap;
@@ -607,14 +1472,86 @@ static void migration_bitmap_sync_init(void)
     iterations_prev = 0;
 }
 
+/* Report the pass that ends at @now */
+static void migration_pass_stats_emit(int64_t now)
+{
+    MigrationState *s = migrate_get_current();
+    MigrationBlockStatsList *blocks = NULL, *entry;
+    RAMBlock *block;
+    int64_t send = s->to_dst_file ?
+                   qemu_file_get_write_time(s->to_dst_file) : 0;
+
+    send -= pass_stats.send_start;
+    trace_migration_pass_stats(bitmap_sync_count, now - pass_stats.start,
+                               pass_stats.sync, pass_stats.scan,
+                               pass_stats.compress, send,
+                               pass_stats.dirty_pages,
+                               bytes_transferred - pass_stats.bytes_start,
+                               s->expected_downtime);
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        if (!block->pass_bytes) {
+            continue;
+        }
+        trace_migration_pass_stats_block(block->idstr, block->pass_bytes);
+        if (migrate_use_events()) {
+            entry = g_new0(MigrationBlockStatsList, 1);
+            entry->value = g_new0(MigrationBlockStats, 1);
+            entry->value->id = g_strdup(block->idstr);
+            entry->value->bytes = block->pass_bytes;
+            entry->next = blocks;
+            blocks = entry;
+        }
+        block->pass_bytes = 0;
+    }
+    rcu_read_unlock();
+
+    if (migrate_use_events()) {
+        qapi_event_send_migration_pass_stats(
+            bitmap_sync_count, (now - pass_stats.start) / 1000,
+            pass_stats.sync / 1000, pass_stats.scan / 1000,
+            pass_stats.compress / 1000, send / 1000,
+            pass_stats.dirty_pages,
+            bytes_transferred - pass_stats.bytes_start,
+            s->expected_downtime, blocks, &error_abort);
+        qapi_free_MigrationBlockStatsList(blocks);
+    }
+}
+
+/* Start a new pass, whose bitmap sync ran from @start to @end */
+static void migration_pass_stats_start(int64_t start, int64_t end,
+                                       uint64_t dirty_pages)
+{
+    MigrationState *s = migrate_get_current();
+
+    pass_stats.enabled = migrate_use_events() ||
+                         trace_event_get_state(TRACE_MIGRATION_PASS_STATS);
+    pass_stats.start = start;
+    pass_stats.sync = end - start;
+    pass_stats.scan = 0;
+    pass_stats.compress = 0;
+    pass_stats.send_start = s->to_dst_file ?
+                            qemu_file_get_write_time(s->to_dst_file) : 0;
+    pass_stats.bytes_start = bytes_transferred;
+    pass_stats.dirty_pages = dirty_pages;
+}
+
 static void migration_bitmap_sync(void)
 {
     RAMBlock *block;
-    uint64_t num_dirty_pages_init = migration_dirty_pages;
+    uint64_t num_dirty_pages_init;
     MigrationState *s = migrate_get_current();
     int64_t end_time;
     int64_t bytes_xfer_now;
+    int64_t sync_start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
 
+    migration_dirty_pages -= atomic_xchg(&migration_hinted_pages, 0);
+    num_dirty_pages_init = migration_dirty_pages;
+
+    if (bitmap_sync_count) {
+        migration_pass_stats_emit(sync_start);
+    }
     bitmap_sync_count++;
 
     if (!bytes_xfer_prev) {
@@ -638,12 +1575,15 @@ static void migration_bitmap_sync(void)
 
     trace_migration_bitmap_sync_end(migration_dirty_pages
                                     - num_dirty_pages_init);
+    migration_pass_stats_start(sync_start,
+                               qemu_clock_get_ns(QEMU_CLOCK_REALTIME),
+                               migration_dirty_pages - num_dirty_pages_init);
     num_dirty_pages_period += migration_dirty_pages - num_dirty_pages_init;
     end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
 
     /* more than 1 second = 1000 millisecons */
     if (end_time > start_time + 1000) {
-        if (migrate_auto_converge()) {
+        if (migrate_auto_converge() || migrate_dirty_limit()) {
             /* The following detection logic can be refined later. For now:
                Check to see if the dirtied bytes is 50% more than the approx.
                amount of bytes that just got transferred since the last time we
@@ -657,7 +1597,11 @@ static void migration_bitmap_sync(void)
                (dirty_rate_high_cnt++ >= 2)) {
                     trace_migration_throttle();
                     dirty_rate_high_cnt = 0;
-                    mig_throttle_guest_down();
+                    if (migrate_dirty_limit()) {
+                        kvm_dirty_limit_set(migrate_vcpu_dirty_limit());
+                    } else {
+                        mig_throttle_guest_down();
+                    }
              }
              bytes_xfer_prev = bytes_xfer_now;
         }
@@ -682,6 +1626,9 @@ static void migration_bitmap_sync(void)
     if (migrate_use_events()) {
         qapi_event_send_migration_pass(bitmap_sync_count, NULL);
     }
+
+    /* Free page hints gathered before this point are stale now */
+    notifier_list_notify(&ram_bitmap_sync_notifiers, NULL);
 }
 
 /**
@@ -764,6 +1711,9 @@ static int ram_save_page(QEMUFile *f, PageSearchStatus *pss,
                 acct_info.dup_pages++;
             }
         }
+    } else if (migrate_use_multifd() &&
+               (ram_bulk_stage || !migrate_use_xbzrle())) {
+        /* The multifd channel looks for zero pages itself */
     } else {
         pages = save_zero_page(f, block, offset, p, bytes_transferred);
         if (pages > 0) {
@@ -783,6 +1733,17 @@ static int ram_save_page(QEMUFile *f, PageSearchStatus *pss,
         }
     }
 
+    /* Normal pages go to a multifd channel, unless xbzrle handed us a
+     * copy from its cache, which may change before the channel sends it.
+     */
+    if (pages == -1 && migrate_use_multifd() &&
+        p == block->host + pss->offset) {
+        if (multifd_queue_page(f, block, pss->offset) < 0) {
+            qemu_file_set_error(f, -EIO);
+        }
+        pages = 1;
+    }
+
     /* XBZRLE overflow or normal page */
     if (pages == -1) {
         *bytes_transferred += save_page_header(f, block,
@@ -802,16 +1763,29 @@ static int ram_save_page(QEMUFile *f, PageSearchStatus *pss,
     return pages;
 }
 
-static int do_compress_ram_page(QEMUFile *f, RAMBlock *block,
-                                ram_addr_t offset)
+static ssize_t put_compressed_data(QEMUFile *f, CompressParam *param,
+                                   const uint8_t *p, size_t size)
+{
+#ifdef CONFIG_ZSTD
+    if (comp_zstd) {
+        return qemu_put_compression_data_zstd(f, param->zstd_cctx, p, size,
+                                              migrate_compress_level());
+    }
+#endif
+    return qemu_put_compression_data(f, p, size, migrate_compress_level());
+}
+
+static int do_compress_ram_page(CompressParam *param, RAMBlock *block,
+                                ram_addr_t offset, unsigned int npages)
 {
+    QEMUFile *f = param->file;
     int bytes_sent, blen;
     uint8_t *p = block->host + (offset & TARGET_PAGE_MASK);
 
     bytes_sent = save_page_header(f, block, offset |
                                   RAM_SAVE_FLAG_COMPRESS_PAGE);
-    blen = qemu_put_compression_data(f, p, TARGET_PAGE_SIZE,
-                                     migrate_compress_level());
+    blen = put_compressed_data(f, param, p,
+                               (size_t)npages * TARGET_PAGE_SIZE);
     if (blen < 0) {
         bytes_sent = 0;
         qemu_file_set_error(migrate_get_current()->to_dst_file, blen);
@@ -823,17 +1797,27 @@ static int do_compress_ram_page(QEMUFile *f, RAMBlock *block,
     return bytes_sent;
 }
 
-static uint64_t bytes_transferred;
+/* Pages queued by the migration thread for the next zstd frame */
+static struct {
+    RAMBlock *block;
+    ram_addr_t offset;
+    unsigned int npages;
+} comp_batch;
+
+static void compress_batch_submit(QEMUFile *f, uint64_t *bytes_transferred);
 
 static void flush_compressed_data(QEMUFile *f)
 {
     int idx, len, thread_count;
+    int64_t wait_start;
 
     if (!migrate_use_compression()) {
         return;
     }
+    compress_batch_submit(f, &bytes_transferred);
     thread_count = migrate_compress_threads();
 
+    wait_start = pass_stats_clock();
     qemu_mutex_lock(&comp_done_lock);
     for (idx = 0; idx < thread_count; idx++) {
         while (!comp_param[idx].done) {
@@ -841,6 +1825,7 @@ static void flush_compressed_data(QEMUFile *f)
         }
     }
     qemu_mutex_unlock(&comp_done_lock);
+    pass_stats_add(&pass_stats.compress, wait_start);
 
     for (idx = 0; idx < thread_count; idx++) {
         qemu_mutex_lock(&comp_param[idx].mutex);
@@ -853,14 +1838,16 @@ static void flush_compressed_data(QEMUFile *f)
 }
 
 static inline void set_compress_params(CompressParam *param, RAMBlock *block,
-                                       ram_addr_t offset)
+                                       ram_addr_t offset, unsigned int npages)
 {
     param->block = block;
     param->offset = offset;
+    param->npages = npages;
 }
 
 static int compress_page_with_multi_thread(QEMUFile *f, RAMBlock *block,
                                            ram_addr_t offset,
+                                           unsigned int npages,
                                            uint64_t *bytes_transferred)
 {
     int idx, thread_count, bytes_xmit = -1, pages = -1;
@@ -873,11 +1860,11 @@ static int compress_page_with_multi_thread(QEMUFile *f, RAMBlock *block,
                 comp_param[idx].done = false;
                 bytes_xmit = qemu_put_qemu_file(f, comp_param[idx].file);
                 qemu_mutex_lock(&comp_param[idx].mutex);
-                set_compress_params(&comp_param[idx], block, offset);
+                set_compress_params(&comp_param[idx], block, offset, npages);
                 qemu_cond_signal(&comp_param[idx].cond);
                 qemu_mutex_unlock(&comp_param[idx].mutex);
-                pages = 1;
-                acct_info.norm_pages++;
+                pages = npages;
+                acct_info.norm_pages += npages;
                 *bytes_transferred += bytes_xmit;
                 break;
             }
@@ -888,9 +1875,45 @@ static int compress_page_with_multi_thread(QEMUFile *f, RAMBlock *block,
             qemu_cond_wait(&comp_done_cond, &comp_done_lock);
         }
     }
-    qemu_mutex_unlock(&comp_done_lock);
+    qemu_mutex_unlock(&comp_done_lock);
+
+    return pages;
+}
+
+static void compress_batch_submit(QEMUFile *f, uint64_t *bytes_transferred)
+{
+    if (!comp_batch.npages) {
+        return;
+    }
+    compress_page_with_multi_thread(f, comp_batch.block,
+                                    comp_batch.offset | RAM_SAVE_FLAG_CONTINUE,
+                                    comp_batch.npages, bytes_transferred);
+    comp_batch.npages = 0;
+}
+
+/* Queue a page for compression with zstd.  The page is only handed to a
+ * compression thread together with the pages that follow it, once the run
+ * is broken or the batch is full.
+ *
+ * Returns: Number of pages queued, i.e. 1.
+ */
+static int compress_batch_add(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
+                              uint64_t *bytes_transferred)
+{
+    if (comp_batch.npages &&
+        (comp_batch.block != block ||
+         comp_batch.offset + comp_batch.npages * TARGET_PAGE_SIZE != offset)) {
+        compress_batch_submit(f, bytes_transferred);
+    }
+    if (!comp_batch.npages) {
+        comp_batch.block = block;
+        comp_batch.offset = offset;
+    }
+    if (++comp_batch.npages == COMPRESS_BATCH_PAGES) {
+        compress_batch_submit(f, bytes_transferred);
+    }
 
-    return pages;
+    return 1;
 }
 
 /**
@@ -945,8 +1968,8 @@ static int ram_save_compressed_page(QEMUFile *f, PageSearchStatus *pss,
                 /* Make sure the first page is sent out before other pages */
                 bytes_xmit = save_page_header(f, block, offset |
                                               RAM_SAVE_FLAG_COMPRESS_PAGE);
-                blen = qemu_put_compression_data(f, p, TARGET_PAGE_SIZE,
-                                                 migrate_compress_level());
+                blen = put_compressed_data(f, &comp_main_param, p,
+                                           TARGET_PAGE_SIZE);
                 if (blen > 0) {
                     *bytes_transferred += bytes_xmit + blen;
                     acct_info.norm_pages++;
@@ -957,11 +1980,15 @@ static int ram_save_compressed_page(QEMUFile *f, PageSearchStatus *pss,
                 }
             }
         } else {
-            offset |= RAM_SAVE_FLAG_CONTINUE;
-            pages = save_zero_page(f, block, offset, p, bytes_transferred);
-            if (pages == -1) {
-                pages = compress_page_with_multi_thread(f, block, offset,
-                                                        bytes_transferred);
+            pages = save_zero_page(f, block, offset | RAM_SAVE_FLAG_CONTINUE,
+                                   p, bytes_transferred);
+            if (pages == -1 && comp_zstd) {
+                pages = compress_batch_add(f, block, offset,
+                                           bytes_transferred);
+            } else if (pages == -1) {
+                pages = compress_page_with_multi_thread(f, block,
+                                            offset | RAM_SAVE_FLAG_CONTINUE,
+                                            1, bytes_transferred);
             }
         }
     }
@@ -1236,9 +2263,12 @@ static int ram_save_target_page(MigrationState *ms, QEMUFile *f,
     if (migration_bitmap_clear_dirty(dirty_ram_abs)) {
         unsigned long *unsentmap;
         if (compression_switch && migrate_use_compression()) {
+            int64_t compress_start = pass_stats_clock();
+
             res = ram_save_compressed_page(f, pss,
                                            last_stage,
                                            bytes_transferred);
+            pass_stats_add(&pass_stats.compress, compress_start);
         } else {
             res = ram_save_page(f, pss, last_stage,
                                 bytes_transferred);
@@ -1251,13 +2281,6 @@ static int ram_save_target_page(MigrationState *ms, QEMUFile *f,
         if (unsentmap) {
             clear_bit(dirty_ram_abs >> TARGET_PAGE_BITS, unsentmap);
         }
-        /* Only update last_sent_block if a block was actually sent; xbzrle
-         * might have decided the page was identical so didn't bother writing
-         * to the stream.
-         */
-        if (res > 0) {
-            last_sent_block = pss->block;
-        }
     }
 
     return res;
@@ -1304,6 +2327,51 @@ static int ram_save_host_page(MigrationState *ms, QEMUFile *f,
     return pages;
 }
 
+/**
+ * ram_save_host_page_urgent: Send a host page that the destination faulted
+ *   on over the postcopy preempt channel
+ *
+ * The page does not have to wait behind the background pages that fill
+ * the buffers of the main stream, so it reaches the destination after
+ * about one round trip.  The channel keeps its own RAM_SAVE_FLAG_CONTINUE
+ * state, and is flushed right away.
+ *
+ * Returns: Number of pages written, or negative on error.
+ *
+ * @ms: The current migration state.
+ * @f: QEMUFile of the main stream, credited with the bytes sent
+ * @pss: Data about the state of the current dirty page scan
+ * @last_stage: if we are at the completion stage
+ * @bytes_transferred: increase it with the number of transferred bytes
+ * @dirty_ram_abs: Address of the start of the dirty page in ram_addr_t space
+ */
+static int ram_save_host_page_urgent(MigrationState *ms, QEMUFile *f,
+                                     PageSearchStatus *pss,
+                                     bool last_stage,
+                                     uint64_t *bytes_transferred,
+                                     ram_addr_t dirty_ram_abs)
+{
+    QEMUFile *pf = ms->postcopy_preempt_file;
+    RAMBlock *main_last_sent_block = last_sent_block;
+    int64_t start = qemu_ftell(pf);
+    int pages, ret;
+
+    last_sent_block = preempt_last_sent_block;
+    pages = ram_save_host_page(ms, pf, pss, last_stage, bytes_transferred,
+                               dirty_ram_abs);
+    preempt_last_sent_block = last_sent_block;
+    last_sent_block = main_last_sent_block;
+
+    qemu_fflush(pf);
+    qemu_file_update_transfer(f, qemu_ftell(pf) - start);
+    ret = qemu_file_get_error(pf);
+    if (ret) {
+        qemu_file_set_error(f, ret);
+        return ret;
+    }
+    return pages;
+}
+
 /**
  * ram_find_and_save_block: Finds a dirty page and sends it to f
  *
@@ -1326,9 +2394,12 @@ static int ram_find_and_save_block(QEMUFile *f, bool last_stage,
     PageSearchStatus pss;
     MigrationState *ms = migrate_get_current();
     int pages = 0;
-    bool again, found;
+    bool again, found, urgent;
     ram_addr_t dirty_ram_abs; /* Address of the start of the dirty page in
                                  ram_addr_t space */
+    uint64_t bytes_before = *bytes_transferred;
+    uint64_t unattributed_before = pass_stats.unattributed;
+    int64_t scan_start;
 
     pss.block = last_seen_block;
     pss.offset = last_offset;
@@ -1341,19 +2412,31 @@ static int ram_find_and_save_block(QEMUFile *f, bool last_stage,
     do {
         again = true;
         found = get_queued_page(ms, &pss, &dirty_ram_abs);
+        urgent = found && ms->postcopy_preempt_file;
 
         if (!found) {
             /* priority queue empty, so just search for something dirty */
+            scan_start = pass_stats_clock();
             found = find_dirty_block(f, &pss, &again, &dirty_ram_abs);
+            pass_stats_add(&pass_stats.scan, scan_start);
         }
 
-        if (found) {
+        if (urgent) {
+            pages = ram_save_host_page_urgent(ms, f, &pss,
+                                              last_stage, bytes_transferred,
+                                              dirty_ram_abs);
+        } else if (found) {
             pages = ram_save_host_page(ms, f, &pss,
                                        last_stage, bytes_transferred,
                                        dirty_ram_abs);
         }
     } while (!pages && again);
 
+    if (pss.block) {
+        pss.block->pass_bytes += *bytes_transferred - bytes_before -
+                                 (pass_stats.unattributed -
+                                  unattributed_before);
+    }
     last_seen_block = pss.block;
     last_offset = pss.offset;
 
@@ -1422,6 +2505,8 @@ static void ram_migration_cleanup(void *opaque)
     if (bitmap) {
         memory_global_dirty_log_stop();
         call_rcu(bitmap, migration_bitmap_free, rcu);
+        /* The bitmaps are large, free them without waiting for a batch */
+        call_rcu_expedite();
     }
 
     XBZRLE_cache_lock();
@@ -1434,15 +2519,28 @@ static void ram_migration_cleanup(void *opaque)
         XBZRLE.current_buf = NULL;
     }
     XBZRLE_cache_unlock();
+
+    if (migrate_mapped_ram()) {
+        RAMBlock *block;
+
+        rcu_read_lock();
+        QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+            g_free(block->file_bmap);
+            block->file_bmap = NULL;
+        }
+        rcu_read_unlock();
+    }
 }
 
 static void reset_ram_globals(void)
 {
     last_seen_block = NULL;
     last_sent_block = NULL;
+    preempt_last_sent_block = NULL;
     last_offset = 0;
     last_version = ram_list.version;
     ram_bulk_stage = true;
+    comp_batch.npages = 0;
 }
 
 #define MAX_WAIT 50 /* ms, half buffered_file limit */
@@ -1868,6 +2966,409 @@ err:
     return ret;
 }
 
+/* Mapped RAM (x-mapped-ram capability)
+ *
+ * Instead of going through the stream, every RAMBlock gets a fixed place
+ * in the file, chosen in ram_save_setup: a bitmap of the pages that hold
+ * data, then room for all of its pages.  Dirty pages are written there
+ * straight from guest RAM with large, parallel requests; zero pages are
+ * only cleared in the bitmap.  A page written in an earlier round is
+ * simply overwritten.  The stream itself carries the two offsets in the
+ * block list and then skips over the block's place in the file.
+ *
+ * The file has to be seekable: savevm/loadvm, or a plain file passed as
+ * fd: to migrate and -incoming.
+ */
+
+#define MAPPED_RAM_ALIGN    (1024 * 1024)
+/* Regions handed to the file at once */
+#define MAPPED_RAM_REGIONS  1024
+
+static size_t mapped_ram_bitmap_size(ram_addr_t length)
+{
+    return DIV_ROUND_UP(length >> TARGET_PAGE_BITS, 64) * sizeof(uint64_t);
+}
+
+/* Add a page to @regions, merging it with the previous one if adjacent */
+static int mapped_ram_add_page(QEMUFile *f, QEMUFileRegion *regions, int *n,
+                               void *host, int64_t pos, bool is_write)
+{
+    QEMUFileRegion *last = *n ? &regions[*n - 1] : NULL;
+    int ret;
+
+    if (last && (uint8_t *)last->buf + last->size == host &&
+        last->pos + last->size == pos) {
+        last->size += TARGET_PAGE_SIZE;
+        return 0;
+    }
+    if (*n == MAPPED_RAM_REGIONS) {
+        ret = qemu_file_rw_regions(f, regions, *n, is_write);
+        *n = 0;
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    regions[*n].buf = host;
+    regions[*n].size = TARGET_PAGE_SIZE;
+    regions[*n].pos = pos;
+    (*n)++;
+    return 0;
+}
+
+static int ram_save_mapped_block(QEMUFile *f, RAMBlock *block)
+{
+    unsigned long npages = block->used_length >> TARGET_PAGE_BITS;
+    size_t bmap_size = mapped_ram_bitmap_size(block->used_length);
+    QEMUFileRegion *regions, bmap_region;
+    uint64_t *bmap;
+    unsigned long i;
+    int n = 0, ret = 0;
+
+    if (!block->file_bmap) {
+        error_report("RAM block %s has no place in the file", block->idstr);
+        return -EINVAL;
+    }
+
+    regions = g_new(QEMUFileRegion, MAPPED_RAM_REGIONS);
+    for (i = 0; i < npages && !ret; i++) {
+        ram_addr_t offset = (ram_addr_t)i << TARGET_PAGE_BITS;
+        uint8_t *host = block->host + offset;
+
+        if (!migration_bitmap_clear_dirty(block->offset + offset)) {
+            continue;
+        }
+        if (is_zero_range(host, TARGET_PAGE_SIZE)) {
+            clear_bit(i, block->file_bmap);
+            acct_info.dup_pages++;
+            continue;
+        }
+        set_bit(i, block->file_bmap);
+        acct_info.norm_pages++;
+        bytes_transferred += TARGET_PAGE_SIZE;
+        ret = mapped_ram_add_page(f, regions, &n, host,
+                                  block->pages_offset + offset, true);
+    }
+    if (!ret && n) {
+        ret = qemu_file_rw_regions(f, regions, n, true);
+    }
+    g_free(regions);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* The bitmap is stored as little endian 64-bit words */
+    bmap = g_malloc0(bmap_size);
+    for (i = find_first_bit(block->file_bmap, npages); i < npages;
+         i = find_next_bit(block->file_bmap, npages, i + 1)) {
+        bmap[i / 64] |= 1ULL << (i % 64);
+    }
+    for (i = 0; i < bmap_size / sizeof(uint64_t); i++) {
+        cpu_to_le64s(&bmap[i]);
+    }
+    bmap_region.buf = bmap;
+    bmap_region.size = bmap_size;
+    bmap_region.pos = block->bitmap_offset;
+    ret = qemu_file_rw_regions(f, &bmap_region, 1, true);
+    g_free(bmap);
+
+    return ret;
+}
+
+/* Write all the dirty pages to their place in the file */
+static int ram_save_mapped(QEMUFile *f)
+{
+    RAMBlock *block;
+    int ret;
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        ret = ram_save_mapped_block(f, block);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+/* Choose the place of @block in the file, and skip the stream past it */
+static void ram_save_mapped_setup(QEMUFile *f, RAMBlock *block)
+{
+    int64_t pos = qemu_ftell(f) + 2 * sizeof(uint64_t);
+
+    block->bitmap_offset = QEMU_ALIGN_UP(pos, MAPPED_RAM_ALIGN);
+    block->pages_offset =
+        QEMU_ALIGN_UP(block->bitmap_offset +
+                      mapped_ram_bitmap_size(block->used_length),
+                      MAPPED_RAM_ALIGN);
+    g_free(block->file_bmap);
+    block->file_bmap = bitmap_new(block->used_length >> TARGET_PAGE_BITS);
+
+    qemu_put_be64(f, block->bitmap_offset);
+    qemu_put_be64(f, block->pages_offset);
+    qemu_fseek(f, block->pages_offset + block->used_length);
+}
+
+/* Read the bitmap of @block from the file, NULL on error */
+static unsigned long *mapped_ram_load_bitmap(QEMUFile *f, RAMBlock *block,
+                                             uint64_t bitmap_offset)
+{
+    unsigned long npages = block->used_length >> TARGET_PAGE_BITS;
+    size_t bmap_size = mapped_ram_bitmap_size(block->used_length);
+    QEMUFileRegion bmap_region;
+    unsigned long *bitmap;
+    uint64_t *bmap;
+    unsigned long i;
+
+    bmap = g_malloc(bmap_size);
+    bmap_region.buf = bmap;
+    bmap_region.size = bmap_size;
+    bmap_region.pos = bitmap_offset;
+    if (qemu_file_rw_regions(f, &bmap_region, 1, false) < 0) {
+        g_free(bmap);
+        return NULL;
+    }
+
+    bitmap = bitmap_new(npages);
+    for (i = 0; i < npages; i++) {
+        if (le64_to_cpu(bmap[i / 64]) & (1ULL << (i % 64))) {
+            set_bit(i, bitmap);
+        }
+    }
+    g_free(bmap);
+
+    return bitmap;
+}
+
+/* Read the pages of @block that hold data, and clear the other ones */
+static int ram_load_mapped_block(QEMUFile *f, RAMBlock *block,
+                                 uint64_t bitmap_offset,
+                                 uint64_t pages_offset)
+{
+    unsigned long npages = block->used_length >> TARGET_PAGE_BITS;
+    QEMUFileRegion *regions;
+    unsigned long *bitmap;
+    unsigned long i;
+    int n = 0, ret = 0;
+
+    bitmap = mapped_ram_load_bitmap(f, block, bitmap_offset);
+    if (!bitmap) {
+        return -EIO;
+    }
+
+    regions = g_new(QEMUFileRegion, MAPPED_RAM_REGIONS);
+    for (i = 0; i < npages && !ret; i++) {
+        ram_addr_t offset = (ram_addr_t)i << TARGET_PAGE_BITS;
+        uint8_t *host = block->host + offset;
+
+        if (!test_bit(i, bitmap)) {
+            ram_handle_compressed(host, 0, TARGET_PAGE_SIZE);
+            continue;
+        }
+        ret = mapped_ram_add_page(f, regions, &n, host,
+                                  pages_offset + offset, false);
+    }
+    if (!ret && n) {
+        ret = qemu_file_rw_regions(f, regions, n, false);
+    }
+    g_free(regions);
+    g_free(bitmap);
+
+    return ret;
+}
+
+/* Lazy restore (x-lazy-restore capability)
+ *
+ * When loading from a mapped-ram file, the block list only records where
+ * each block is and reads its bitmap; RAM is then emptied and handed to
+ * userfaultfd, so that the VM can run before any page has been read.  A
+ * page the guest touches is read by the postcopy fault thread through
+ * ram_lazy_restore_page, while a thread here reads the whole file in
+ * large chunks behind it.  Whoever comes second finds the page placed.
+ *
+ * The file is read with pread() on its own descriptor, since the stream
+ * is closed as soon as the device state is loaded; this is why a plain
+ * file is needed rather than the block layer of loadvm.
+ */
+
+/* Bytes read at once by the prefetch thread */
+#define LAZY_RESTORE_CHUNK  (2 * 1024 * 1024)
+
+static struct {
+    bool active;
+    int fd;
+    int ret;
+    QemuThread thread;
+    QEMUBH *bh;
+} lazy_restore;
+
+/* Whether any target page of [@offset, @offset + @size) is in the file */
+static bool ram_lazy_restore_has_data(RAMBlock *block, ram_addr_t offset,
+                                      size_t size)
+{
+    unsigned long first = offset >> TARGET_PAGE_BITS;
+    unsigned long last = (offset + size) >> TARGET_PAGE_BITS;
+
+    return block->lazy_bmap &&
+           find_next_bit(block->lazy_bmap, last, first) < last;
+}
+
+/*
+ * Read [@offset, @offset + @size) of @block from the file into @buf, the
+ * pages that are not in it are cleared.  Returns 0 or -errno.
+ */
+static int ram_lazy_restore_read(RAMBlock *block, ram_addr_t offset,
+                                 uint8_t *buf, size_t size)
+{
+    unsigned long first = offset >> TARGET_PAGE_BITS;
+    unsigned long last = (offset + size) >> TARGET_PAGE_BITS;
+    unsigned long i;
+    ssize_t len;
+
+    do {
+        len = pread(lazy_restore.fd, buf, size,
+                    block->lazy_pages_offset + offset);
+    } while (len < 0 && errno == EINTR);
+    if (len < 0) {
+        return -errno;
+    }
+    /* Only trailing pages without data can be missing from the file */
+    memset(buf + len, 0, size - len);
+
+    for (i = find_next_zero_bit(block->lazy_bmap, last, first); i < last;
+         i = find_next_zero_bit(block->lazy_bmap, last, i + 1)) {
+        memset(buf + ((i - first) << TARGET_PAGE_BITS), 0, TARGET_PAGE_SIZE);
+    }
+    return 0;
+}
+
+/* Place the host page of @block at @offset, using @buf to read it */
+static int ram_lazy_restore_place(RAMBlock *block, ram_addr_t offset,
+                                  uint8_t *buf)
+{
+    size_t pagesize = getpagesize();
+    int ret;
+
+    if (!ram_lazy_restore_has_data(block, offset, pagesize)) {
+        return postcopy_lazy_place_page(block->host + offset, NULL);
+    }
+    ret = ram_lazy_restore_read(block, offset, buf, pagesize);
+    if (ret < 0) {
+        return ret;
+    }
+    return postcopy_lazy_place_page(block->host + offset, buf);
+}
+
+void ram_lazy_restore_page(RAMBlock *block, ram_addr_t offset, void *buf)
+{
+    int ret = ram_lazy_restore_place(block, offset, buf);
+
+    if (ret < 0) {
+        error_report("Failed to restore page " RAM_ADDR_FMT " of %s: %s",
+                     offset, block->idstr, strerror(-ret));
+        atomic_set(&lazy_restore.ret, ret);
+    }
+}
+
+static void *ram_lazy_restore_thread(void *opaque)
+{
+    size_t pagesize = getpagesize();
+    uint8_t *buf = qemu_memalign(pagesize, LAZY_RESTORE_CHUNK);
+    RAMBlock *block;
+    ram_addr_t offset, off;
+    size_t size;
+    int ret = 0;
+
+    rcu_register_thread();
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        for (offset = 0; !ret && offset < block->used_length;
+             offset += size) {
+            size = MIN(LAZY_RESTORE_CHUNK, block->used_length - offset);
+            if (ram_lazy_restore_has_data(block, offset, size)) {
+                ret = ram_lazy_restore_read(block, offset, buf, size);
+            }
+            for (off = 0; !ret && off < size; off += pagesize) {
+                bool data = ram_lazy_restore_has_data(block, offset + off,
+                                                      pagesize);
+
+                ret = postcopy_lazy_place_page(block->host + offset + off,
+                                               data ? buf + off : NULL);
+            }
+        }
+        if (ret) {
+            error_report("Failed to restore RAM block %s: %s",
+                         block->idstr, strerror(-ret));
+            atomic_set(&lazy_restore.ret, ret);
+            break;
+        }
+    }
+    rcu_read_unlock();
+    rcu_unregister_thread();
+
+    qemu_vfree(buf);
+    qemu_bh_schedule(lazy_restore.bh);
+    return NULL;
+}
+
+static void ram_lazy_restore_bh(void *opaque)
+{
+    RAMBlock *block;
+
+    qemu_thread_join(&lazy_restore.thread);
+    qemu_bh_delete(lazy_restore.bh);
+    lazy_restore.bh = NULL;
+
+    if (atomic_read(&lazy_restore.ret) < 0) {
+        /* Pages are missing from a running guest, it cannot go on */
+        error_report("Lazy RAM restore failed");
+        exit(EXIT_FAILURE);
+    }
+
+    postcopy_lazy_restore_finish();
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        g_free(block->lazy_bmap);
+        block->lazy_bmap = NULL;
+    }
+    rcu_read_unlock();
+    close(lazy_restore.fd);
+    lazy_restore.active = false;
+    trace_ram_lazy_restore_done();
+}
+
+/* Called once the block list has been loaded from @f */
+static int ram_lazy_restore_start(QEMUFile *f)
+{
+    int fd = qemu_file_get_fd(f);
+
+    if (fd < 0) {
+        error_report("x-lazy-restore needs a plain file passed as fd:");
+        return -EINVAL;
+    }
+    if (lazy_restore.active) {
+        error_report("A lazy RAM restore is already in progress");
+        return -EBUSY;
+    }
+
+    lazy_restore.fd = qemu_dup(fd);
+    if (lazy_restore.fd < 0) {
+        error_report("x-lazy-restore: %s", strerror(errno));
+        return -errno;
+    }
+    if (postcopy_lazy_restore_start()) {
+        close(lazy_restore.fd);
+        return -EINVAL;
+    }
+
+    lazy_restore.active = true;
+    lazy_restore.ret = 0;
+    lazy_restore.bh = qemu_bh_new(ram_lazy_restore_bh, NULL);
+    qemu_thread_create(&lazy_restore.thread, "ram/lazy-restore",
+                       ram_lazy_restore_thread, NULL, QEMU_THREAD_JOINABLE);
+    trace_ram_lazy_restore_start();
+    return 0;
+}
+
 
 /* Each of ram_save_setup, ram_save_iterate and ram_save_complete has
  * long-running RCU critical section.  When rcu-reclaims in the code
@@ -1880,6 +3381,11 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     RAMBlock *block;
     int64_t ram_bitmap_pages; /* Size of bitmap in pages, including gaps */
 
+    if (migrate_mapped_ram() && !qemu_file_is_seekable(f)) {
+        error_report("x-mapped-ram needs a seekable file, as with savevm");
+        return -EINVAL;
+    }
+
     dirty_rate_high_cnt = 0;
     bitmap_sync_count = 0;
     migration_bitmap_sync_init();
@@ -1938,6 +3444,7 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
      * gaps due to alignment or unplugs.
      */
     migration_dirty_pages = ram_bytes_total() >> TARGET_PAGE_BITS;
+    atomic_set(&migration_hinted_pages, 0);
 
     memory_global_dirty_log_start();
     migration_bitmap_sync();
@@ -1950,6 +3457,10 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
         qemu_put_byte(f, strlen(block->idstr));
         qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
         qemu_put_be64(f, block->used_length);
+        block->pass_bytes = 0;
+        if (migrate_mapped_ram()) {
+            ram_save_mapped_setup(f, block);
+        }
     }
 
     rcu_read_unlock();
@@ -1979,6 +3490,16 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
 
     ram_control_before_iterate(f, RAM_CONTROL_ROUND);
 
+    if (migrate_mapped_ram()) {
+        /* All the dirty pages in one go; they do not use the stream */
+        ret = ram_save_mapped(f);
+        rcu_read_unlock();
+        ram_control_after_iterate(f, RAM_CONTROL_ROUND);
+        qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+        bytes_transferred += 8;
+        return ret < 0 ? ret : 1;
+    }
+
     t0 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     i = 0;
     while ((ret = qemu_file_rate_limit(f)) == 0) {
@@ -2016,6 +3537,7 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
      */
     ram_control_after_iterate(f, RAM_CONTROL_ROUND);
 
+    multifd_send_sync_main(f);
     qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
     bytes_transferred += 8;
 
@@ -2030,6 +3552,8 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
 /* Called with iothread lock */
 static int ram_save_complete(QEMUFile *f, void *opaque)
 {
+    MigrationState *ms = migrate_get_current();
+
     rcu_read_lock();
 
     if (!migration_in_postcopy(migrate_get_current())) {
@@ -2038,10 +3562,19 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
 
     ram_control_before_iterate(f, RAM_CONTROL_FINISH);
 
+    if (migrate_mapped_ram()) {
+        int ret = ram_save_mapped(f);
+
+        if (ret < 0) {
+            rcu_read_unlock();
+            return ret;
+        }
+    }
+
     /* try transferring iterative blocks of memory */
 
     /* flush all remaining blocks regardless of rate limiting */
-    while (true) {
+    while (!migrate_mapped_ram()) {
         int pages;
 
         pages = ram_find_and_save_block(f, true, &bytes_transferred);
@@ -2056,8 +3589,17 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
 
     rcu_read_unlock();
 
+    migration_pass_stats_emit(qemu_clock_get_ns(QEMU_CLOCK_REALTIME));
+
+    multifd_send_sync_main(f);
     qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
 
+    if (ms->postcopy_preempt_file) {
+        /* No more urgent pages; let the destination close the channel */
+        qemu_put_be64(ms->postcopy_preempt_file, RAM_SAVE_FLAG_EOS);
+        qemu_fflush(ms->postcopy_preempt_file);
+    }
+
     return 0;
 }
 
@@ -2129,32 +3671,34 @@ static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
  * f: Stream to read from
  * flags: Page flags (mostly to see if it's a continuation of previous block)
  */
-static inline RAMBlock *ram_block_from_stream(QEMUFile *f,
-                                              int flags)
+/* Last block received on the main stream, for RAM_SAVE_FLAG_CONTINUE */
+static RAMBlock *last_recv_block;
+
+static inline RAMBlock *ram_block_from_stream(QEMUFile *f, int flags,
+                                              RAMBlock **last_block)
 {
-    static RAMBlock *block = NULL;
     char id[256];
     uint8_t len;
 
     if (flags & RAM_SAVE_FLAG_CONTINUE) {
-        if (!block) {
+        if (!*last_block) {
             error_report("Ack, bad migration stream!");
             return NULL;
         }
-        return block;
+        return *last_block;
     }
 
     len = qemu_get_byte(f);
     qemu_get_buffer(f, (uint8_t *)id, len);
     id[len] = 0;
 
-    block = qemu_ram_block_by_name(id);
-    if (!block) {
+    *last_block = qemu_ram_block_by_name(id);
+    if (!*last_block) {
         error_report("Can't find block %s", id);
         return NULL;
     }
 
-    return block;
+    return *last_block;
 }
 
 static inline void *host_from_ram_block_offset(RAMBlock *block,
@@ -2184,23 +3728,33 @@ static void *do_data_decompress(void *opaque)
     unsigned long pagesize;
     uint8_t *des;
     int len;
+    size_t size;
 
     qemu_mutex_lock(&param->mutex);
     while (!param->quit) {
         if (param->des) {
             des = param->des;
             len = param->len;
+            size = param->size;
             param->des = 0;
             qemu_mutex_unlock(&param->mutex);
 
-            pagesize = TARGET_PAGE_SIZE;
             /* uncompress() will return failed in some case, especially
              * when the page is dirted when doing the compression, it's
              * not a problem because the dirty page will be retransferred
              * and uncompress() won't break the data in other pages.
              */
-            uncompress((Bytef *)des, &pagesize,
-                       (const Bytef *)param->compbuf, len);
+#ifdef CONFIG_ZSTD
+            if (decomp_zstd) {
+                ZSTD_decompressDCtx(param->zstd_dctx, des, size,
+                                    param->compbuf, len);
+            } else
+#endif
+            {
+                pagesize = size;
+                uncompress((Bytef *)des, &pagesize,
+                           (const Bytef *)param->compbuf, len);
+            }
 
             qemu_mutex_lock(&decomp_done_lock);
             param->done = true;
@@ -2244,10 +3798,25 @@ void migrate_decompress_threads_create(void)
     decomp_param = g_new0(DecompressParam, thread_count);
     qemu_mutex_init(&decomp_done_lock);
     qemu_cond_init(&decomp_done_cond);
+    decomp_zstd = migrate_compress_method() == MIGRATION_COMPRESS_METHOD_ZSTD;
+#ifdef CONFIG_ZSTD
+    if (decomp_zstd) {
+        decomp_buf_size = ZSTD_compressBound(COMPRESS_BATCH_PAGES *
+                                             TARGET_PAGE_SIZE);
+    } else
+#endif
+    {
+        decomp_buf_size = compressBound(TARGET_PAGE_SIZE);
+    }
     for (i = 0; i < thread_count; i++) {
         qemu_mutex_init(&decomp_param[i].mutex);
         qemu_cond_init(&decomp_param[i].cond);
-        decomp_param[i].compbuf = g_malloc0(compressBound(TARGET_PAGE_SIZE));
+        decomp_param[i].compbuf = g_malloc0(decomp_buf_size);
+#ifdef CONFIG_ZSTD
+        if (decomp_zstd) {
+            decomp_param[i].zstd_dctx = ZSTD_createDCtx();
+        }
+#endif
         decomp_param[i].done = true;
         decomp_param[i].quit = false;
         qemu_thread_create(decompress_threads + i, "decompress",
@@ -2272,6 +3841,9 @@ void migrate_decompress_threads_join(void)
         qemu_mutex_destroy(&decomp_param[i].mutex);
         qemu_cond_destroy(&decomp_param[i].cond);
         g_free(decomp_param[i].compbuf);
+#ifdef CONFIG_ZSTD
+        ZSTD_freeDCtx(decomp_param[i].zstd_dctx);
+#endif
     }
     g_free(decompress_threads);
     g_free(decomp_param);
@@ -2279,23 +3851,55 @@ void migrate_decompress_threads_join(void)
     decomp_param = NULL;
 }
 
-static void decompress_data_with_multi_threads(QEMUFile *f,
-                                               void *host, int len)
+/* Size of the data in a compressed frame, or 0 if it does not describe
+ * whole pages inside @block starting at @offset.
+ */
+static size_t decompressed_size(RAMBlock *block, ram_addr_t offset,
+                                const uint8_t *buf, int len)
 {
-    int idx, thread_count;
+#ifdef CONFIG_ZSTD
+    if (decomp_zstd) {
+        unsigned long long size = ZSTD_getFrameContentSize(buf, len);
+
+        if (size == ZSTD_CONTENTSIZE_UNKNOWN ||
+            size == ZSTD_CONTENTSIZE_ERROR || !size ||
+            size > COMPRESS_BATCH_PAGES * TARGET_PAGE_SIZE ||
+            size & ~TARGET_PAGE_MASK ||
+            !offset_in_ramblock(block, offset + size - 1)) {
+            return 0;
+        }
+        return size;
+    }
+#endif
+    return TARGET_PAGE_SIZE;
+}
+
+static int decompress_data_with_multi_threads(QEMUFile *f, RAMBlock *block,
+                                              ram_addr_t offset,
+                                              void *host, int len)
+{
+    int idx, thread_count, ret = 0;
+    DecompressParam *param;
 
     thread_count = migrate_decompress_threads();
     qemu_mutex_lock(&decomp_done_lock);
     while (true) {
         for (idx = 0; idx < thread_count; idx++) {
             if (decomp_param[idx].done) {
-                decomp_param[idx].done = false;
-                qemu_mutex_lock(&decomp_param[idx].mutex);
-                qemu_get_buffer(f, decomp_param[idx].compbuf, len);
-                decomp_param[idx].des = host;
-                decomp_param[idx].len = len;
-                qemu_cond_signal(&decomp_param[idx].cond);
-                qemu_mutex_unlock(&decomp_param[idx].mutex);
+                param = &decomp_param[idx];
+                qemu_mutex_lock(&param->mutex);
+                qemu_get_buffer(f, param->compbuf, len);
+                param->size = decompressed_size(block, offset,
+                                                param->compbuf, len);
+                if (param->size) {
+                    param->done = false;
+                    param->des = host;
+                    param->len = len;
+                    qemu_cond_signal(&param->cond);
+                } else {
+                    ret = -EINVAL;
+                }
+                qemu_mutex_unlock(&param->mutex);
                 break;
             }
         }
@@ -2306,6 +3910,8 @@ static void decompress_data_with_multi_threads(QEMUFile *f,
         }
     }
     qemu_mutex_unlock(&decomp_done_lock);
+
+    return ret;
 }
 
 /*
@@ -2323,14 +3929,17 @@ int ram_postcopy_incoming_init(MigrationIncomingState *mis)
  * Called in postcopy mode by ram_load().
  * rcu_read_lock is taken prior to this being called.
  */
-static int ram_load_postcopy(QEMUFile *f)
+/*
+ * @last_block: block of the previous page in this stream
+ * @postcopy_host_page: temporary page that is later 'placed'
+ */
+static int ram_load_postcopy(QEMUFile *f, RAMBlock **last_block,
+                             void *postcopy_host_page)
 {
     int flags = 0, ret = 0;
     bool place_needed = false;
     bool matching_page_sizes = qemu_host_page_size == TARGET_PAGE_SIZE;
     MigrationIncomingState *mis = migration_incoming_get_current();
-    /* Temporary page that is later 'placed' */
-    void *postcopy_host_page = postcopy_get_tmp_page(mis);
     void *last_host = NULL;
     bool all_zero = false;
 
@@ -2348,7 +3957,7 @@ static int ram_load_postcopy(QEMUFile *f)
         trace_ram_load_postcopy_loop((uint64_t)addr, flags);
         place_needed = false;
         if (flags & (RAM_SAVE_FLAG_COMPRESS | RAM_SAVE_FLAG_PAGE)) {
-            RAMBlock *block = ram_block_from_stream(f, flags);
+            RAMBlock *block = ram_block_from_stream(f, flags, last_block);
 
             host = host_from_ram_block_offset(block, addr);
             if (!host) {
@@ -2441,6 +4050,25 @@ static int ram_load_postcopy(QEMUFile *f)
     return ret;
 }
 
+/*
+ * Load the pages that the source sends on the postcopy preempt channel,
+ * until it ends the channel with RAM_SAVE_FLAG_EOS.  Called from the
+ * thread reading that channel.
+ *
+ * @tmp_page: temporary host page, distinct from the main stream's one
+ */
+int ram_load_postcopy_preempt(QEMUFile *f, void *tmp_page)
+{
+    RAMBlock *last_block = NULL;
+    int ret;
+
+    rcu_read_lock();
+    ret = ram_load_postcopy(f, &last_block, tmp_page);
+    rcu_read_unlock();
+
+    return ret;
+}
+
 static int ram_load(QEMUFile *f, void *opaque, int version_id)
 {
     int flags = 0, ret = 0;
@@ -2466,11 +4094,15 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
     rcu_read_lock();
 
     if (postcopy_running) {
-        ret = ram_load_postcopy(f);
+        MigrationIncomingState *mis = migration_incoming_get_current();
+
+        ret = ram_load_postcopy(f, &last_recv_block,
+                                postcopy_get_tmp_page(mis));
     }
 
     while (!postcopy_running && !ret && !(flags & RAM_SAVE_FLAG_EOS)) {
         ram_addr_t addr, total_ram_bytes;
+        RAMBlock *block = NULL;
         void *host = NULL;
         uint8_t ch;
 
@@ -2480,7 +4112,7 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
 
         if (flags & (RAM_SAVE_FLAG_COMPRESS | RAM_SAVE_FLAG_PAGE |
                      RAM_SAVE_FLAG_COMPRESS_PAGE | RAM_SAVE_FLAG_XBZRLE)) {
-            RAMBlock *block = ram_block_from_stream(f, flags);
+            block = ram_block_from_stream(f, flags, &last_recv_block);
 
             host = host_from_ram_block_offset(block, addr);
             if (!host) {
@@ -2523,8 +4155,33 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                     ret = -EINVAL;
                 }
 
+                if (!ret && migrate_mapped_ram()) {
+                    uint64_t bitmap_offset = qemu_get_be64(f);
+                    uint64_t pages_offset = qemu_get_be64(f);
+
+                    if (!qemu_file_is_seekable(f)) {
+                        error_report("x-mapped-ram needs a seekable file");
+                        ret = -EINVAL;
+                        break;
+                    }
+                    if (migrate_lazy_restore()) {
+                        g_free(block->lazy_bmap);
+                        block->lazy_bmap =
+                            mapped_ram_load_bitmap(f, block, bitmap_offset);
+                        block->lazy_pages_offset = pages_offset;
+                        ret = block->lazy_bmap ? 0 : -EIO;
+                    } else {
+                        ret = ram_load_mapped_block(f, block, bitmap_offset,
+                                                    pages_offset);
+                    }
+                    qemu_fseek(f, pages_offset + length);
+                }
+
                 total_ram_bytes -= length;
             }
+            if (!ret && migrate_lazy_restore()) {
+                ret = ram_lazy_restore_start(f);
+            }
             break;
 
         case RAM_SAVE_FLAG_COMPRESS:
@@ -2538,12 +4195,17 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
 
         case RAM_SAVE_FLAG_COMPRESS_PAGE:
             len = qemu_get_be32(f);
-            if (len < 0 || len > compressBound(TARGET_PAGE_SIZE)) {
+            if (len < 0 || len > decomp_buf_size) {
                 error_report("Invalid compressed data length: %d", len);
                 ret = -EINVAL;
                 break;
             }
-            decompress_data_with_multi_threads(f, host, len);
+            ret = decompress_data_with_multi_threads(f, block, addr,
+                                                     host, len);
+            if (ret < 0) {
+                error_report("Invalid compressed data at " RAM_ADDR_FMT,
+                             addr);
+            }
             break;
 
         case RAM_SAVE_FLAG_XBZRLE:
@@ -2554,6 +4216,9 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 break;
             }
             break;
+        case RAM_SAVE_FLAG_MULTIFD_SYNC:
+            ret = multifd_recv_sync_main();
+            break;
         case RAM_SAVE_FLAG_EOS:
             /* normal exit */
             break;
@@ -25,6 +25,10 @@
 #include "qemu/sockets.h"
 #include "qemu/bitmap.h"
 #include "qemu/coroutine.h"
+#include "qemu/thread.h"
+#include "qemu/queue.h"
+#include "qemu/rcu.h"
+#include "qemu/timer.h"
 #include <sys/socket.h>
 #include <netdb.h>
 #include <arpa/inet.h>
@@ -50,6 +54,16 @@
 
 #define RDMA_REG_CHUNK_SHIFT 20 /* 1 MB */
 
+/*
+ * Without pin-all, memory is registered locally by regions of several chunks,
+ * or of one page of the backing if it is larger, so that huge pages are never
+ * split across registrations.  The wire protocol still talks about chunks.
+ */
+#define RDMA_REG_REGION_SHIFT 23 /* 8 MB */
+
+/* Regions registered ahead of the sender by the prefetch thread */
+#define RDMA_REG_PREFETCH 2
+
 /*
  * This is only for non-live state being migrated.
  * Instead of RDMA_WRITE messages, we use RDMA_SEND
@@ -209,6 +223,25 @@ static void network_to_caps(RDMACapabilities *cap)
     cap->flags = ntohl(cap->flags);
 }
 
+/*
+ * A range of a RAMBlock registered with one MR when not pinning everything.
+ *
+ * On the source, registered regions are kept in an LRU and unregistered on
+ * both sides when the registered memory goes over rdma-reg-cache-size.  On
+ * the dest, a region stays registered while the source holds the key of one
+ * of its chunks, see RDMALocalBlock.reg_bitmap.
+ */
+typedef struct RDMARegion {
+    uint8_t       *start;
+    uint64_t       length;
+    struct ibv_mr *mr;
+    int            block_index;
+    bool           queued;      /* (Source) waiting for the prefetch thread */
+    bool           cached;      /* (Source) in the LRU */
+    QTAILQ_ENTRY(RDMARegion) lru;
+    QSIMPLEQ_ENTRY(RDMARegion) next_queued;
+} RDMARegion;
+
 /*
  * Representation of a RAMBlock from an RDMA perspective.
  * This is not transmitted, only local.
@@ -231,7 +264,10 @@ typedef struct RDMALocalBlock {
     bool           is_ram_block;
     int            nb_chunks;
     unsigned long *transit_bitmap;
-    unsigned long *unregister_bitmap;
+    RDMARegion    *regions;
+    int            nb_regions;
+    int            region_chunk_shift; /* chunks per region, log2 */
+    unsigned long *reg_bitmap;      /* (Only dest) chunk keys given out */
 } RDMALocalBlock;
 
 /*
@@ -370,8 +406,23 @@ typedef struct RDMAContext {
     int total_registrations;
     int total_writes;
 
-    int unregister_current, unregister_next;
-    uint64_t unregistrations[RDMA_SIGNALED_SEND_MAX];
+    /*
+     * Registration cache of the source, least recently used region first.
+     * reg_lock protects the regions, the LRU and the prefetch queue against
+     * the prefetch thread.
+     */
+    QemuMutex reg_lock;
+    QemuCond reg_cond;
+    QTAILQ_HEAD(, RDMARegion) reg_lru;
+    uint64_t reg_cache_size;            /* 0: unlimited */
+    uint64_t reg_cached;
+    RdmaRegCacheStats *reg_stats;       /* NULL on the dest */
+
+    QSIMPLEQ_HEAD(, RDMARegion) reg_queue;
+    int reg_nb_queued;
+    QemuThread reg_thread;
+    bool reg_thread_running;
+    bool reg_thread_quit;
 
     GHashTable *blockmap;
 } RDMAContext;
@@ -541,6 +592,63 @@ static inline uint8_t *ram_chunk_end(const RDMALocalBlock *rdma_ram_block,
     return result;
 }
 
+static inline RDMARegion *ram_chunk_region(const RDMALocalBlock *block,
+                                           uint64_t chunk)
+{
+    return &block->regions[chunk >> block->region_chunk_shift];
+}
+
+/* First and last chunk of a region */
+static inline uint64_t region_first_chunk(const RDMALocalBlock *rdma_ram_block,
+                                          const RDMARegion *region)
+{
+    return ram_chunk_index(rdma_ram_block->local_host_addr, region->start);
+}
+
+static inline uint64_t region_last_chunk(const RDMALocalBlock *rdma_ram_block,
+                                         const RDMARegion *region)
+{
+    return ram_chunk_index(rdma_ram_block->local_host_addr,
+                           region->start + region->length - 1);
+}
+
+/*
+ * Split a block in regions of RDMA_REG_REGION_SHIFT, rounded up to the page
+ * size of its backing.  Blocks that are not guest RAM are only ever
+ * registered as a whole and get a single region.
+ */
+static void rdma_init_regions(RDMALocalBlock *block)
+{
+    unsigned int shift = RDMA_REG_REGION_SHIFT;
+    uint64_t region_size, offset;
+    ram_addr_t rb_offset;
+    RAMBlock *rb;
+    int i;
+
+    if (block->is_ram_block) {
+        rb = qemu_ram_block_from_host(block->local_host_addr, false,
+                                      &rb_offset);
+        if (rb && qemu_ram_pagesize(rb) > (1ULL << shift)) {
+            shift = ctz64(qemu_ram_pagesize(rb));
+        }
+    } else {
+        shift = MAX(shift, 64 - clz64(block->length));
+    }
+
+    block->region_chunk_shift = shift - RDMA_REG_CHUNK_SHIFT;
+    region_size = 1ULL << shift;
+    block->nb_regions = DIV_ROUND_UP(block->length, region_size);
+    block->regions = g_new0(RDMARegion, block->nb_regions);
+
+    for (i = 0; i < block->nb_regions; i++) {
+        offset = (uint64_t)i << shift;
+        block->regions[i].start = block->local_host_addr + offset;
+        block->regions[i].length = MIN(region_size, block->length - offset);
+        block->regions[i].block_index = block->index;
+    }
+    block->reg_bitmap = bitmap_new(block->nb_chunks);
+}
+
 static int rdma_add_block(RDMAContext *rdma, const char *block_name,
                          void *host_addr,
                          ram_addr_t block_offset, uint64_t length)
@@ -578,11 +686,10 @@ static int rdma_add_block(RDMAContext *rdma, const char *block_name,
     block->nb_chunks = ram_chunk_index(host_addr, host_addr + length) + 1UL;
     block->transit_bitmap = bitmap_new(block->nb_chunks);
     bitmap_clear(block->transit_bitmap, 0, block->nb_chunks);
-    block->unregister_bitmap = bitmap_new(block->nb_chunks);
-    bitmap_clear(block->unregister_bitmap, 0, block->nb_chunks);
     block->remote_keys = g_new0(uint32_t, block->nb_chunks);
 
     block->is_ram_block = local->init ? false : true;
+    rdma_init_regions(block);
 
     if (rdma->blockmap) {
         g_hash_table_insert(rdma->blockmap, (void *)(uintptr_t)block_offset, block);
@@ -664,12 +771,28 @@ static int rdma_delete_block(RDMAContext *rdma, RDMALocalBlock *block)
         block->mr = NULL;
     }
 
+    for (x = 0; x < block->nb_regions; x++) {
+        RDMARegion *region = &block->regions[x];
+
+        if (region->cached) {
+            QTAILQ_REMOVE(&rdma->reg_lru, region, lru);
+            rdma->reg_cached -= region->length;
+        }
+        if (region->mr) {
+            ibv_dereg_mr(region->mr);
+            rdma->total_registrations--;
+        }
+    }
+    g_free(block->regions);
+    block->regions = NULL;
+    block->nb_regions = 0;
+
+    g_free(block->reg_bitmap);
+    block->reg_bitmap = NULL;
+
     g_free(block->transit_bitmap);
     block->transit_bitmap = NULL;
 
-    g_free(block->unregister_bitmap);
-    block->unregister_bitmap = NULL;
-
     g_free(block->remote_keys);
     block->remote_keys = NULL;
 
@@ -1084,6 +1207,24 @@ static int qemu_rdma_alloc_qp(RDMAContext *rdma)
     return 0;
 }
 
+/*
+ * Register guest memory, accounting the time it took on the source.
+ * Can be called from the prefetch thread.
+ */
+static struct ibv_mr *qemu_rdma_reg_mr(RDMAContext *rdma, void *addr,
+                                       size_t length, int access)
+{
+    int64_t start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+    struct ibv_mr *mr = ibv_reg_mr(rdma->pd, addr, length, access);
+
+    if (mr && rdma->reg_stats) {
+        atomic_inc(&rdma->reg_stats->registrations);
+        atomic_add(&rdma->reg_stats->registration_time,
+                   qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start);
+    }
+    return mr;
+}
+
 static int qemu_rdma_reg_whole_ram_blocks(RDMAContext *rdma)
 {
     int i;
@@ -1091,7 +1232,7 @@ static int qemu_rdma_reg_whole_ram_blocks(RDMAContext *rdma)
 
     for (i = 0; i < local->nb_blocks; i++) {
         local->block[i].mr =
-            ibv_reg_mr(rdma->pd,
+            qemu_rdma_reg_mr(rdma,
                     local->block[i].local_host_addr,
                     local->block[i].length,
                     IBV_ACCESS_LOCAL_WRITE |
@@ -1147,10 +1288,279 @@ static int qemu_rdma_search_ram_block(RDMAContext *rdma,
     return 0;
 }
 
+/*
+ * Source: queue for the prefetch thread the regions following @region that
+ * are still to be sent in this pass and fit in the cache.
+ * Called with reg_lock held.
+ */
+static void qemu_rdma_reg_prefetch(RDMAContext *rdma, RDMALocalBlock *block,
+                                   RDMARegion *region)
+{
+    int i = region - block->regions;
+    int last = MIN(i + RDMA_REG_PREFETCH, block->nb_regions - 1);
+    RDMARegion *next;
+    bool dirty;
+
+    if (!rdma->reg_thread_running || !block->is_ram_block) {
+        return;
+    }
+
+    for (i++; i <= last && rdma->reg_nb_queued < RDMA_REG_PREFETCH; i++) {
+        next = &block->regions[i];
+        if (next->mr || next->queued) {
+            continue;
+        }
+        if (rdma->reg_cache_size &&
+            rdma->reg_cached + next->length > rdma->reg_cache_size) {
+            break;
+        }
+
+        rcu_read_lock();
+        dirty = ram_bitmap_range_dirty(block->offset +
+                                       (next->start - block->local_host_addr),
+                                       next->length);
+        rcu_read_unlock();
+        if (!dirty) {
+            continue;
+        }
+
+        trace_qemu_rdma_reg_prefetch(block->index, i);
+        next->queued = true;
+        next->cached = true;
+        rdma->reg_cached += next->length;
+        QTAILQ_INSERT_TAIL(&rdma->reg_lru, next, lru);
+        QSIMPLEQ_INSERT_TAIL(&rdma->reg_queue, next, next_queued);
+        rdma->reg_nb_queued++;
+        qemu_cond_broadcast(&rdma->reg_cond);
+    }
+}
+
+static void *qemu_rdma_reg_prefetch_thread(void *opaque)
+{
+    RDMAContext *rdma = opaque;
+    RDMARegion *region;
+    struct ibv_mr *mr;
+
+    qemu_mutex_lock(&rdma->reg_lock);
+    while (!rdma->reg_thread_quit) {
+        region = QSIMPLEQ_FIRST(&rdma->reg_queue);
+        if (!region) {
+            qemu_cond_wait(&rdma->reg_cond, &rdma->reg_lock);
+            continue;
+        }
+        QSIMPLEQ_REMOVE_HEAD(&rdma->reg_queue, next_queued);
+        qemu_mutex_unlock(&rdma->reg_lock);
+
+        mr = qemu_rdma_reg_mr(rdma, region->start, region->length, 0);
+
+        qemu_mutex_lock(&rdma->reg_lock);
+        if (mr) {
+            region->mr = mr;
+            rdma->total_registrations++;
+            rdma->reg_stats->prefetched++;
+        } else {
+            /* Only a hint, the sender will register it itself */
+            trace_qemu_rdma_reg_prefetch_failed(region->block_index,
+                                                region->length);
+            QTAILQ_REMOVE(&rdma->reg_lru, region, lru);
+            region->cached = false;
+            rdma->reg_cached -= region->length;
+        }
+        rdma->reg_stats->cached = rdma->reg_cached;
+        region->queued = false;
+        rdma->reg_nb_queued--;
+        qemu_cond_broadcast(&rdma->reg_cond);
+    }
+    qemu_mutex_unlock(&rdma->reg_lock);
+
+    return NULL;
+}
+
+/*
+ * Source: return the MR of @region, registering it on a miss, and make it
+ * the most recently used region.
+ */
+static struct ibv_mr *qemu_rdma_reg_cache_get(RDMAContext *rdma,
+                                              RDMALocalBlock *block,
+                                              RDMARegion *region)
+{
+    struct ibv_mr *mr;
+
+    qemu_mutex_lock(&rdma->reg_lock);
+    while (region->queued) {
+        qemu_cond_wait(&rdma->reg_cond, &rdma->reg_lock);
+    }
+
+    if (region->mr) {
+        rdma->reg_stats->hits++;
+    } else {
+        rdma->reg_stats->misses++;
+        trace_qemu_rdma_register_and_get_keys(region->length, region->start);
+        region->mr = qemu_rdma_reg_mr(rdma, region->start, region->length, 0);
+        if (!region->mr) {
+            qemu_mutex_unlock(&rdma->reg_lock);
+            return NULL;
+        }
+        rdma->total_registrations++;
+    }
+
+    if (region->cached) {
+        QTAILQ_REMOVE(&rdma->reg_lru, region, lru);
+    } else {
+        region->cached = true;
+        rdma->reg_cached += region->length;
+    }
+    QTAILQ_INSERT_TAIL(&rdma->reg_lru, region, lru);
+
+    qemu_rdma_reg_prefetch(rdma, block, region);
+    rdma->reg_stats->cached = rdma->reg_cached;
+    mr = region->mr;
+    qemu_mutex_unlock(&rdma->reg_lock);
+
+    return mr;
+}
+
+/*
+ * Source: the caller does not expect to send from this chunk again soon,
+ * make its region the next one to evict.
+ */
+static void qemu_rdma_reg_cache_hint(RDMAContext *rdma, uint64_t index,
+                                     uint64_t chunk)
+{
+    RDMALocalBlock *block = &rdma->local_ram_blocks.block[index];
+    RDMARegion *region;
+
+    if (!block->nb_regions) {
+        return;
+    }
+    region = ram_chunk_region(block, chunk);
+
+    qemu_mutex_lock(&rdma->reg_lock);
+    if (region->cached && !region->queued) {
+        QTAILQ_REMOVE(&rdma->reg_lru, region, lru);
+        QTAILQ_INSERT_HEAD(&rdma->reg_lru, region, lru);
+    }
+    qemu_mutex_unlock(&rdma->reg_lock);
+}
+
+static bool qemu_rdma_region_in_transit(RDMALocalBlock *block,
+                                        RDMARegion *region)
+{
+    uint64_t first = region_first_chunk(block, region);
+    uint64_t end = region_last_chunk(block, region) + 1;
+
+    return find_next_bit(block->transit_bitmap, end, first) < end;
+}
+
+/*
+ * Source: unregister an evicted region, first on the dest for the chunks
+ * whose keys it gave us.  No write may be in flight to the region.
+ */
+static int qemu_rdma_unregister_region(RDMAContext *rdma, RDMARegion *region)
+{
+    RDMALocalBlock *block = &rdma->local_ram_blocks.block[region->block_index];
+    uint64_t chunk, first = region_first_chunk(block, region);
+    uint64_t last = region_last_chunk(block, region);
+    RDMARegister *regs = g_new0(RDMARegister, last - first + 1);
+    RDMAControlHeader resp = { .type = RDMA_CONTROL_UNREGISTER_FINISHED };
+    RDMAControlHeader head = { .type = RDMA_CONTROL_UNREGISTER_REQUEST };
+    int ret = 0;
+
+    for (chunk = first; chunk <= last; chunk++) {
+        if (!block->remote_keys[chunk]) {
+            continue;
+        }
+        /* Not register_to_network(), the key is a chunk, not an address */
+        regs[head.repeat].key.chunk = htonll(chunk);
+        regs[head.repeat].current_index = htonl(region->block_index);
+        head.repeat++;
+    }
+
+    trace_qemu_rdma_unregister_region(region->block_index,
+                                      region - block->regions, head.repeat);
+
+    if (head.repeat) {
+        head.len = head.repeat * sizeof(RDMARegister);
+        ret = qemu_rdma_exchange_send(rdma, &head, (uint8_t *) regs,
+                                      &resp, NULL, NULL);
+        if (ret < 0) {
+            goto out;
+        }
+        for (chunk = first; chunk <= last; chunk++) {
+            block->remote_keys[chunk] = 0;
+        }
+    }
+
+    ret = ibv_dereg_mr(region->mr);
+    if (ret != 0) {
+        perror("unregistration region failed");
+        ret = -ret;
+        goto out;
+    }
+    region->mr = NULL;
+
+out:
+    g_free(regs);
+    return ret;
+}
+
+/*
+ * Source: unregister the least recently used regions until the registered
+ * memory fits in rdma-reg-cache-size again.  Regions being prefetched or
+ * written are skipped, as well as @keep, the one about to be written.
+ */
+static int qemu_rdma_reg_cache_evict(RDMAContext *rdma, RDMARegion *keep)
+{
+    RDMALocalBlock *block;
+    RDMARegion *region;
+    int ret = 0;
+
+    if (!rdma->reg_cache_size) {
+        return 0;
+    }
+
+    qemu_mutex_lock(&rdma->reg_lock);
+    while (rdma->reg_cached > rdma->reg_cache_size) {
+        QTAILQ_FOREACH(region, &rdma->reg_lru, lru) {
+            block = &rdma->local_ram_blocks.block[region->block_index];
+            if (region != keep && !region->queued &&
+                !qemu_rdma_region_in_transit(block, region)) {
+                break;
+            }
+        }
+        if (!region) {
+            break;
+        }
+
+        QTAILQ_REMOVE(&rdma->reg_lru, region, lru);
+        region->cached = false;
+        rdma->reg_cached -= region->length;
+        qemu_mutex_unlock(&rdma->reg_lock);
+
+        /* The prefetch thread only touches queued regions */
+        ret = qemu_rdma_unregister_region(rdma, region);
+
+        qemu_mutex_lock(&rdma->reg_lock);
+        if (ret < 0) {
+            break;
+        }
+        rdma->total_registrations--;
+        rdma->reg_stats->evictions++;
+    }
+    rdma->reg_stats->cached = rdma->reg_cached;
+    qemu_mutex_unlock(&rdma->reg_lock);
+
+    return ret;
+}
+
 /*
  * Register a chunk with IB. If the chunk was already registered
  * previously, then skip.
  *
+ * A range within a single region is registered with the MR of the whole
+ * region: through the registration cache on the source, and kept until the
+ * source unregisters all its chunks on the dest.
+ *
  * Also return the keys associated with the registration needed
  * to perform the actual RDMA operation.
  */
@@ -1159,6 +1569,8 @@ static int qemu_rdma_register_and_get_keys(RDMAContext *rdma,
         uint32_t *lkey, uint32_t *rkey, int chunk,
         uint8_t *chunk_start, uint8_t *chunk_end)
 {
+    struct ibv_mr *mr;
+
     if (block->mr) {
         if (lkey) {
             *lkey = block->mr->lkey;
@@ -1169,48 +1581,83 @@ static int qemu_rdma_register_and_get_keys(RDMAContext *rdma,
         return 0;
     }
 
-    /* allocate memory to store chunk MRs */
-    if (!block->pmr) {
-        block->pmr = g_new0(struct ibv_mr *, block->nb_chunks);
-    }
+    if (block->nb_regions &&
+        ram_chunk_region(block, chunk) ==
+        ram_chunk_region(block, ram_chunk_index(block->local_host_addr,
+                                                chunk_end - 1))) {
+        RDMARegion *region = ram_chunk_region(block, chunk);
 
-    /*
-     * If 'rkey', then we're the destination, so grant access to the source.
-     *
-     * If 'lkey', then we're the source VM, so grant access only to ourselves.
-     */
-    if (!block->pmr[chunk]) {
-        uint64_t len = chunk_end - chunk_start;
+        if (rkey) {
+            if (!region->mr) {
+                trace_qemu_rdma_register_and_get_keys(region->length,
+                                                      region->start);
+                region->mr = qemu_rdma_reg_mr(rdma, region->start,
+                                              region->length,
+                                              IBV_ACCESS_LOCAL_WRITE |
+                                              IBV_ACCESS_REMOTE_WRITE);
+                if (!region->mr) {
+                    goto err;
+                }
+                rdma->total_registrations++;
+            }
+            set_bit(chunk, block->reg_bitmap);
+            mr = region->mr;
+        } else {
+            mr = qemu_rdma_reg_cache_get(rdma, block, region);
+            if (!mr) {
+                goto err;
+            }
+        }
+    } else {
+        /* allocate memory to store chunk MRs */
+        if (!block->pmr) {
+            block->pmr = g_new0(struct ibv_mr *, block->nb_chunks);
+        }
 
-        trace_qemu_rdma_register_and_get_keys(len, chunk_start);
+        /*
+         * If 'rkey', then we're the destination, so grant access to the
+         * source.
+         *
+         * If 'lkey', then we're the source VM, so grant access only to
+         * ourselves.
+         */
+        if (!block->pmr[chunk]) {
+            uint64_t len = chunk_end - chunk_start;
 
-        block->pmr[chunk] = ibv_reg_mr(rdma->pd,
-                chunk_start, len,
-                (rkey ? (IBV_ACCESS_LOCAL_WRITE |
-                        IBV_ACCESS_REMOTE_WRITE) : 0));
+            trace_qemu_rdma_register_and_get_keys(len, chunk_start);
 
-        if (!block->pmr[chunk]) {
-            perror("Failed to register chunk!");
-            fprintf(stderr, "Chunk details: block: %d chunk index %d"
-                            " start %" PRIuPTR " end %" PRIuPTR
-                            " host %" PRIuPTR
-                            " local %" PRIuPTR " registrations: %d\n",
-                            block->index, chunk, (uintptr_t)chunk_start,
-                            (uintptr_t)chunk_end, host_addr,
-                            (uintptr_t)block->local_host_addr,
-                            rdma->total_registrations);
-            return -1;
+            block->pmr[chunk] = qemu_rdma_reg_mr(rdma,
+                    chunk_start, len,
+                    (rkey ? (IBV_ACCESS_LOCAL_WRITE |
+                            IBV_ACCESS_REMOTE_WRITE) : 0));
+
+            if (!block->pmr[chunk]) {
+                goto err;
+            }
+            rdma->total_registrations++;
         }
-        rdma->total_registrations++;
+        mr = block->pmr[chunk];
     }
 
     if (lkey) {
-        *lkey = block->pmr[chunk]->lkey;
+        *lkey = mr->lkey;
     }
     if (rkey) {
-        *rkey = block->pmr[chunk]->rkey;
+        *rkey = mr->rkey;
     }
     return 0;
+
+err:
+    perror("Failed to register chunk!");
+    fprintf(stderr, "Chunk details: block: %d chunk index %d"
+                    " start %" PRIuPTR " end %" PRIuPTR
+                    " host %" PRIuPTR
+                    " local %" PRIuPTR " registrations: %d\n",
+                    block->index, chunk, (uintptr_t)chunk_start,
+                    (uintptr_t)chunk_end, host_addr,
+                    (uintptr_t)block->local_host_addr,
+                    rdma->total_registrations);
+    return -1;
 }
 
 /*
@@ -1238,111 +1685,6 @@ const char *print_wrid(int wrid)
     return wrid_desc[wrid];
 }
 
-/*
- * RDMA requires memory registration (mlock/pinning), but this is not good for
- * overcommitment.
- *
- * In preparation for the future where LRU information or workload-specific
- * writable writable working set memory access behavior is available to QEMU
- * it would be nice to have in place the ability to UN-register/UN-pin
- * particular memory regions from the RDMA hardware when it is determine that
- * those regions of memory will likely not be accessed again in the near future.
- *
- * While we do not yet have such information right now, the following
- * compile-time option allows us to perform a non-optimized version of this
- * behavior.
- *
- * By uncommenting this option, you will cause *all* RDMA transfers to be
- * unregistered immediately after the transfer completes on both sides of the
- * connection. This has no effect in 'rdma-pin-all' mode, only regular mode.
- *
- * This will have a terrible impact on migration performance, so until future
- * workload information or LRU information is available, do not attempt to use
- * this feature except for basic testing.
- */
-//#define RDMA_UNREGISTRATION_EXAMPLE
-
-/*
- * Perform a non-optimized memory unregistration after every transfer
- * for demonstration purposes, only if pin-all is not requested.
- *
- * Potential optimizations:
- * 1. Start a new thread to run this function continuously
-        - for bit clearing
-        - and for receipt of unregister messages
- * 2. Use an LRU.
- * 3. Use workload hints.
- */
-static int qemu_rdma_unregister_waiting(RDMAContext *rdma)
-{
-    while (rdma->unregistrations[rdma->unregister_current]) {
-        int ret;
-        uint64_t wr_id = rdma->unregistrations[rdma->unregister_current];
-        uint64_t chunk =
-            (wr_id & RDMA_WRID_CHUNK_MASK) >> RDMA_WRID_CHUNK_SHIFT;
-        uint64_t index =
-            (wr_id & RDMA_WRID_BLOCK_MASK) >> RDMA_WRID_BLOCK_SHIFT;
-        RDMALocalBlock *block =
-            &(rdma->local_ram_blocks.block[index]);
-        RDMARegister reg = { .current_index = index };
-        RDMAControlHeader resp = { .type = RDMA_CONTROL_UNREGISTER_FINISHED,
-                                 };
-        RDMAControlHeader head = { .len = sizeof(RDMARegister),
-                                   .type = RDMA_CONTROL_UNREGISTER_REQUEST,
-                                   .repeat = 1,
-                                 };
-
-        trace_qemu_rdma_unregister_waiting_proc(chunk,
-                                                rdma->unregister_current);
-
-        rdma->unregistrations[rdma->unregister_current] = 0;
-        rdma->unregister_current++;
-
-        if (rdma->unregister_current == RDMA_SIGNALED_SEND_MAX) {
-            rdma->unregister_current = 0;
-        }
-
-
-        /*
-         * Unregistration is speculative (because migration is single-threaded
-         * and we cannot break the protocol's inifinband message ordering).
-         * Thus, if the memory is currently being used for transmission,
-         * then abort the attempt to unregister and try again
-         * later the next time a completion is received for this memory.
-         */
-        clear_bit(chunk, block->unregister_bitmap);
-
-        if (test_bit(chunk, block->transit_bitmap)) {
-            trace_qemu_rdma_unregister_waiting_inflight(chunk);
-            continue;
-        }
-
-        trace_qemu_rdma_unregister_waiting_send(chunk);
-
-        ret = ibv_dereg_mr(block->pmr[chunk]);
-        block->pmr[chunk] = NULL;
-        block->remote_keys[chunk] = 0;
-
-        if (ret != 0) {
-            perror("unregistration chunk failed");
-            return -ret;
-        }
-        rdma->total_registrations--;
-
-        reg.key.chunk = chunk;
-        register_to_network(rdma, &reg);
-        ret = qemu_rdma_exchange_send(rdma, &head, (uint8_t *) &reg,
-                                &resp, NULL, NULL);
-        if (ret < 0) {
-            return ret;
-        }
-
-        trace_qemu_rdma_unregister_waiting_complete(chunk);
-    }
-
-    return 0;
-}
-
 static uint64_t qemu_rdma_make_wrid(uint64_t wr_id, uint64_t index,
                                          uint64_t chunk)
 {
@@ -1354,34 +1696,6 @@ static uint64_t qemu_rdma_make_wrid(uint64_t wr_id, uint64_t index,
     return result;
 }
 
-/*
- * Set bit for unregistration in the next iteration.
- * We cannot transmit right here, but will unpin later.
- */
-static void qemu_rdma_signal_unregister(RDMAContext *rdma, uint64_t index,
-                                        uint64_t chunk, uint64_t wr_id)
-{
-    if (rdma->unregistrations[rdma->unregister_next] != 0) {
-        error_report("rdma migration: queue is full");
-    } else {
-        RDMALocalBlock *block = &(rdma->local_ram_blocks.block[index]);
-
-        if (!test_and_set_bit(chunk, block->unregister_bitmap)) {
-            trace_qemu_rdma_signal_unregister_append(chunk,
-                                                     rdma->unregister_next);
-
-            rdma->unregistrations[rdma->unregister_next++] =
-                    qemu_rdma_make_wrid(wr_id, index, chunk);
-
-            if (rdma->unregister_next == RDMA_SIGNALED_SEND_MAX) {
-                rdma->unregister_next = 0;
-            }
-        } else {
-            trace_qemu_rdma_signal_unregister_already(chunk);
-        }
-    }
-}
-
 /*
  * Consult the connection manager to see a work request
  * (of any kind) has completed.
@@ -1439,18 +1753,6 @@ static uint64_t qemu_rdma_poll(RDMAContext *rdma, uint64_t *wr_id_out,
         if (rdma->nb_sent > 0) {
             rdma->nb_sent--;
         }
-
-        if (!rdma->pin_all) {
-            /*
-             * FYI: If one wanted to signal a specific chunk to be unregistered
-             * using LRU or workload-specific information, this is the function
-             * you would call to do so. That chunk would then get asynchronously
-             * unregistered later.
-             */
-#ifdef RDMA_UNREGISTRATION_EXAMPLE
-            qemu_rdma_signal_unregister(rdma, index, chunk, wc.wr_id);
-#endif
-        }
     } else {
         trace_qemu_rdma_poll_other(print_wrid(wr_id), wr_id, rdma->nb_sent);
     }
@@ -1905,9 +2207,10 @@ retry:
     chunk_end = ram_chunk_end(block, chunk + chunks);
 
     if (!rdma->pin_all) {
-#ifdef RDMA_UNREGISTRATION_EXAMPLE
-        qemu_rdma_unregister_waiting(rdma);
-#endif
+        ret = qemu_rdma_reg_cache_evict(rdma, ram_chunk_region(block, chunk));
+        if (ret < 0) {
+            return ret;
+        }
     }
 
     while (test_bit(chunk, block->transit_bitmap)) {
@@ -2204,6 +2507,15 @@ static void qemu_rdma_cleanup(RDMAContext *rdma)
     struct rdma_cm_event *cm_event;
     int ret, idx;
 
+    if (rdma->reg_thread_running) {
+        qemu_mutex_lock(&rdma->reg_lock);
+        rdma->reg_thread_quit = true;
+        qemu_cond_broadcast(&rdma->reg_cond);
+        qemu_mutex_unlock(&rdma->reg_lock);
+        qemu_thread_join(&rdma->reg_thread);
+        rdma->reg_thread_running = false;
+    }
+
     if (rdma->cm_id && rdma->connected) {
         if (rdma->error_state) {
             RDMAControlHeader head = { .len = 0,
@@ -2410,6 +2722,13 @@ static int qemu_rdma_connect(RDMAContext *rdma, Error **errp)
 
     rdma->control_ready_expected = 1;
     rdma->nb_sent = 0;
+
+    if (!rdma->pin_all) {
+        rdma->reg_thread_running = true;
+        qemu_thread_create(&rdma->reg_thread, "rdma/reg",
+                           qemu_rdma_reg_prefetch_thread, rdma,
+                           QEMU_THREAD_JOINABLE);
+    }
     return 0;
 
 err_rdma_source_connect:
@@ -2504,6 +2823,10 @@ static void *qemu_rdma_data_init(const char *host_port, Error **errp)
         rdma = g_new0(RDMAContext, 1);
         rdma->current_index = -1;
         rdma->current_chunk = -1;
+        qemu_mutex_init(&rdma->reg_lock);
+        qemu_cond_init(&rdma->reg_cond);
+        QTAILQ_INIT(&rdma->reg_lru);
+        QSIMPLEQ_INIT(&rdma->reg_queue);
 
         addr = inet_parse(host_port, NULL);
         if (addr != NULL) {
@@ -2690,7 +3013,9 @@ static int qemu_rdma_drain_cq(QEMUFile *f, RDMAContext *rdma)
         }
     }
 
-    qemu_rdma_unregister_waiting(rdma);
+    if (!rdma->pin_all) {
+        return qemu_rdma_reg_cache_evict(rdma, NULL);
+    }
 
     return 0;
 }
@@ -2830,13 +3155,12 @@ static int qio_channel_rdma_close(QIOChannel *ioc,
  *        Initiate an transfer this size.
  *
  *    @size == 0 :
- *        A 'hint' or 'advice' that means that we wish to speculatively
- *        and asynchronously unregister this memory. In this case, there is no
- *        guarantee that the unregister will actually happen, for example,
- *        if the memory is being actively transmitted. Additionally, the memory
- *        may be re-registered at any future time if a write within the same
- *        chunk was requested again, even if you attempted to unregister it
- *        here.
+ *        A 'hint' or 'advice' that this memory will not be transferred again
+ *        soon.  Its region becomes the first one the registration cache
+ *        evicts, which happens once the registered memory exceeds
+ *        rdma-reg-cache-size and the memory is not being transmitted.  The
+ *        memory is registered again if a write within the same region is
+ *        requested later.
  *
  *    @size < 0 : TODO, not yet supported
  *        Unregister the memory NOW. This means that the caller does not
@@ -2905,14 +3229,14 @@ static size_t qemu_rdma_save_page(QEMUFile *f, void *opaque,
             goto err;
         }
 
-        qemu_rdma_signal_unregister(rdma, index, chunk, 0);
+        qemu_rdma_reg_cache_hint(rdma, index, chunk);
 
         /*
          * TODO: Synchronous, guaranteed unregistration (should not occur during
-         * fast-path). Otherwise, unregisters will process on the next call to
-         * qemu_rdma_drain_cq()
+         * fast-path). Otherwise, the region is evicted on the next call to
+         * qemu_rdma_drain_cq() if the cache is full
         if (size < 0) {
-            qemu_rdma_unregister_waiting(rdma);
+            qemu_rdma_reg_cache_evict(rdma, NULL);
         }
         */
     }
@@ -3315,10 +3639,44 @@ static int qemu_rdma_registration_handle(QEMUFile *f, void *opaque)
                 trace_qemu_rdma_registration_handle_unregister_loop(count,
                            reg->current_index, reg->key.chunk);
 
+                if (reg->current_index >= rdma->local_ram_blocks.nb_blocks) {
+                    error_report("rdma: 'unregister' bad block index %u"
+                                 " (vs %d)",
+                                 (unsigned int)reg->current_index,
+                                 rdma->local_ram_blocks.nb_blocks);
+                    ret = -ENOENT;
+                    goto out;
+                }
                 block = &(rdma->local_ram_blocks.block[reg->current_index]);
+                if (reg->key.chunk >= block->nb_chunks) {
+                    error_report("rdma: bad unregister chunk for block %s"
+                        " chunk: %" PRIx64,
+                        block->block_name, reg->key.chunk);
+                    ret = -ERANGE;
+                    goto out;
+                }
+
+                if (block->pmr && block->pmr[reg->key.chunk]) {
+                    ret = ibv_dereg_mr(block->pmr[reg->key.chunk]);
+                    block->pmr[reg->key.chunk] = NULL;
+                } else {
+                    /* The region goes once none of its chunks is in use */
+                    RDMARegion *region;
+                    uint64_t end;
 
-                ret = ibv_dereg_mr(block->pmr[reg->key.chunk]);
-                block->pmr[reg->key.chunk] = NULL;
+                    if (!test_and_clear_bit(reg->key.chunk,
+                                            block->reg_bitmap)) {
+                        continue;
+                    }
+                    region = ram_chunk_region(block, reg->key.chunk);
+                    end = region_last_chunk(block, region) + 1;
+                    if (find_next_bit(block->reg_bitmap, end,
+                                region_first_chunk(block, region)) < end) {
+                        continue;
+                    }
+                    ret = ibv_dereg_mr(region->mr);
+                    region->mr = NULL;
+                }
 
                 if (ret != 0) {
                     perror("rdma unregistration chunk failed");
@@ -3672,6 +4030,10 @@ void rdma_start_outgoing_migration(void *opaque,
         goto err;
     }
 
+    rdma->reg_cache_size = migrate_rdma_reg_cache_size();
+    rdma->reg_stats = &s->rdma_reg_cache;
+    rdma->reg_stats->cache_size = rdma->reg_cache_size;
+
     ret = qemu_rdma_source_init(rdma, errp,
         s->enabled_capabilities[MIGRATION_CAPABILITY_RDMA_PIN_ALL]);
 
@@ -3688,6 +4050,8 @@ void rdma_start_outgoing_migration(void *opaque,
 
     trace_rdma_start_outgoing_migration_after_rdma_connect();
 
+    s->rdma_reg_cache_active = !rdma->pin_all;
+
     s->to_dst_file = qemu_fopen_rdma(rdma, "wb");
     migrate_fd_connect(s);
     return;
@@ -167,6 +167,86 @@ static ssize_t block_get_buffer(void *opaque, uint8_t *buf, int64_t pos,
     return bdrv_load_vmstate(opaque, buf, pos, size);
 }
 
+/* Requests of at most this size, and this many in flight, for regions */
+#define BLOCK_REGION_CHUNK      (8 * 1024 * 1024)
+#define BLOCK_REGION_WORKERS    16
+
+typedef struct {
+    BlockDriverState *bs;
+    QEMUFileRegion *regions;
+    int n;
+    bool is_write;
+    /* next chunk to transfer */
+    int cur;
+    size_t cur_offset;
+    int in_flight;
+    int ret;
+} BlockRegionsState;
+
+static void coroutine_fn block_region_worker(void *opaque)
+{
+    BlockRegionsState *s = opaque;
+
+    while (!s->ret && s->cur < s->n) {
+        QEMUFileRegion *r = &s->regions[s->cur];
+        size_t len = MIN(r->size - s->cur_offset, BLOCK_REGION_CHUNK);
+        struct iovec iov = {
+            .iov_base = (uint8_t *)r->buf + s->cur_offset,
+            .iov_len = len,
+        };
+        int64_t pos = r->pos + s->cur_offset;
+        QEMUIOVector qiov;
+        int ret;
+
+        s->cur_offset += len;
+        if (s->cur_offset == r->size) {
+            s->cur++;
+            s->cur_offset = 0;
+        }
+        if (!len) {
+            continue;
+        }
+
+        qemu_iovec_init_external(&qiov, &iov, 1);
+        if (s->is_write) {
+            ret = bdrv_writev_vmstate(s->bs, &qiov, pos);
+        } else {
+            ret = bdrv_readv_vmstate(s->bs, &qiov, pos);
+        }
+        if (ret < 0 && !s->ret) {
+            s->ret = ret;
+        }
+    }
+    s->in_flight--;
+}
+
+/*
+ * Split the regions in large requests and keep several of them in flight,
+ * so that a fast device (and O_DIRECT, with cache=none) is kept busy.
+ */
+static int block_rw_regions(void *opaque, QEMUFileRegion *regions, int n,
+                            bool is_write)
+{
+    BlockRegionsState s = {
+        .bs = opaque,
+        .regions = regions,
+        .n = n,
+        .is_write = is_write,
+    };
+    int i;
+
+    for (i = 0; i < BLOCK_REGION_WORKERS; i++) {
+        Coroutine *co = qemu_coroutine_create(block_region_worker, &s);
+
+        s.in_flight++;
+        qemu_coroutine_enter(co);
+    }
+    while (s.in_flight) {
+        aio_poll(bdrv_get_aio_context(s.bs), true);
+    }
+    return s.ret;
+}
+
 static int bdrv_fclose(void *opaque)
 {
     return bdrv_flush(opaque);
@@ -174,12 +254,14 @@ static int bdrv_fclose(void *opaque)
 
 static const QEMUFileOps bdrv_read_ops = {
     .get_buffer = block_get_buffer,
-    .close =      bdrv_fclose
+    .close =      bdrv_fclose,
+    .rw_regions = block_rw_regions,
 };
 
 static const QEMUFileOps bdrv_write_ops = {
     .writev_buffer  = block_writev_buffer,
-    .close          = bdrv_fclose
+    .close          = bdrv_fclose,
+    .rw_regions     = block_rw_regions,
 };
 
 static QEMUFile *qemu_fopen_bdrv(BlockDriverState *bs, int is_writable)
@@ -21,7 +21,9 @@
 #include "qapi/error.h"
 #include "migration/migration.h"
 #include "migration/qemu-file.h"
+#include "migration/postcopy-ram.h"
 #include "io/channel-socket.h"
+#include "qapi/clone-visitor.h"
 #include "trace.h"
 
 
@@ -55,6 +57,26 @@ static SocketAddress *unix_build_address(const char *path)
 }
 
 
+/* Address of the current outgoing migration, for the multifd channels */
+static SocketAddress *outgoing_saddr;
+
+QIOChannel *socket_send_channel_create(Error **errp)
+{
+    QIOChannelSocket *sioc;
+
+    if (!outgoing_saddr) {
+        error_setg(errp, "Not a socket migration");
+        return NULL;
+    }
+
+    sioc = qio_channel_socket_new();
+    if (qio_channel_socket_connect_sync(sioc, outgoing_saddr, errp) < 0) {
+        object_unref(OBJECT(sioc));
+        return NULL;
+    }
+    return QIO_CHANNEL(sioc);
+}
+
 struct SocketConnectData {
     MigrationState *s;
     char *hostname;
@@ -100,6 +122,9 @@ static void socket_start_outgoing_migration(MigrationState *s,
         data->hostname = g_strdup(saddr->u.inet.data->host);
     }
 
+    qapi_free_SocketAddress(outgoing_saddr);
+    outgoing_saddr = QAPI_CLONE(SocketAddress, saddr);
+
     qio_channel_socket_connect_async(sioc,
                                      saddr,
                                      socket_outgoing_migration,
@@ -129,6 +154,7 @@ static gboolean socket_accept_incoming_migration(QIOChannel *ioc,
                                                  GIOCondition condition,
                                                  gpointer opaque)
 {
+    MigrationIncomingState *mis = migration_incoming_get_current();
     QIOChannelSocket *sioc;
     Error *err = NULL;
 
@@ -142,10 +168,26 @@ static gboolean socket_accept_incoming_migration(QIOChannel *ioc,
 
     trace_migration_socket_incoming_accepted();
 
-    migration_channel_process_incoming(migrate_get_current(),
-                                       QIO_CHANNEL(sioc));
+    if (migrate_use_multifd() && migration_incoming_get_current()) {
+        /* Connections after the main stream carry multifd pages */
+        migrate_multifd_recv_new_channel(QIO_CHANNEL(sioc));
+    } else if (migrate_postcopy_preempt() && mis) {
+        /* The connection after the main stream carries urgent pages */
+        postcopy_preempt_new_channel(mis, QIO_CHANNEL(sioc));
+    } else {
+        migration_channel_process_incoming(migrate_get_current(),
+                                           QIO_CHANNEL(sioc));
+    }
     object_unref(OBJECT(sioc));
 
+    if (migrate_use_multifd() && !migrate_multifd_recv_all_channels()) {
+        return TRUE; /* keep listening */
+    }
+    mis = migration_incoming_get_current();
+    if (migrate_postcopy_preempt() && mis && !mis->have_preempt_thread) {
+        return TRUE; /* keep listening */
+    }
+
 out:
     /* Close listening socket as its no longer needed */
     qio_channel_close(ioc, NULL);
@@ -12,6 +12,7 @@
  */
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/host-utils.h"
 #include "include/migration/migration.h"
 
 /*
@@ -24,13 +25,23 @@
 
   length = uleb128 encoded integer
  */
-int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
-                         uint8_t *dst, int dlen)
+
+/* The encoder below is shared by all implementations, which differ only in
+ * how they find the end of a run: xbzrle_zrun_end() returns the offset of
+ * the first byte at or after @i that differs between the two pages, and
+ * xbzrle_nzrun_end() the offset of the first byte that is the same in both,
+ * or @slen if there is none.
+ */
+typedef int XbzrleRunEnd(const uint8_t *old_buf, const uint8_t *new_buf,
+                         int i, int slen);
+
+static inline __attribute__((always_inline))
+int xbzrle_encode(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                  uint8_t *dst, int dlen,
+                  XbzrleRunEnd *zrun_end, XbzrleRunEnd *nzrun_end)
 {
-    uint32_t zrun_len = 0, nzrun_len = 0;
-    int d = 0, i = 0;
-    long res;
-    uint8_t *nzrun_start = NULL;
+    uint32_t zrun_len, nzrun_len;
+    int d = 0, i = 0, start;
 
     g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
                sizeof(long)));
@@ -41,28 +52,9 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
             return -1;
         }
 
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] == new_buf[i]) {
-            zrun_len++;
-            i++;
-            res--;
-        }
-
-        /* word at a time for speed */
-        if (!res) {
-            while (i < slen &&
-                   (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
-                i += sizeof(long);
-                zrun_len += sizeof(long);
-            }
-
-            /* go over the rest */
-            while (i < slen && old_buf[i] == new_buf[i]) {
-                zrun_len++;
-                i++;
-            }
-        }
+        start = i;
+        i = zrun_end(old_buf, new_buf, i, slen);
+        zrun_len = i - start;
 
         /* buffer unchanged */
         if (zrun_len == slen) {
@@ -76,56 +68,267 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
 
         d += uleb128_encode_small(dst + d, zrun_len);
 
-        zrun_len = 0;
-        nzrun_start = new_buf + i;
-
         /* overflow */
         if (d + 2 > dlen) {
             return -1;
         }
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] != new_buf[i]) {
-            i++;
-            nzrun_len++;
-            res--;
-        }
-
-        /* word at a time for speed, use of 32-bit long okay */
-        if (!res) {
-            /* truncation to 32-bit long okay */
-            unsigned long mask = (unsigned long)0x0101010101010101ULL;
-            while (i < slen) {
-                unsigned long xor;
-                xor = *(unsigned long *)(old_buf + i)
-                    ^ *(unsigned long *)(new_buf + i);
-                if ((xor - mask) & ~xor & (mask << 7)) {
-                    /* found the end of an nzrun within the current long */
-                    while (old_buf[i] != new_buf[i]) {
-                        nzrun_len++;
-                        i++;
-                    }
-                    break;
-                } else {
-                    i += sizeof(long);
-                    nzrun_len += sizeof(long);
-                }
-            }
-        }
+
+        start = i;
+        i = nzrun_end(old_buf, new_buf, i, slen);
+        nzrun_len = i - start;
 
         d += uleb128_encode_small(dst + d, nzrun_len);
         /* overflow */
         if (d + nzrun_len > dlen) {
             return -1;
         }
-        memcpy(dst + d, nzrun_start, nzrun_len);
+        memcpy(dst + d, new_buf + start, nzrun_len);
         d += nzrun_len;
-        nzrun_len = 0;
     }
 
     return d;
 }
 
+static inline int xbzrle_zrun_end(const uint8_t *old_buf,
+                                  const uint8_t *new_buf, int i, int slen)
+{
+    /* not aligned to sizeof(long) */
+    while (i % sizeof(long) && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+
+    /* word at a time for speed */
+    if (!(i % sizeof(long))) {
+        while (i < slen &&
+               (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
+            i += sizeof(long);
+        }
+
+        /* go over the rest */
+        while (i < slen && old_buf[i] == new_buf[i]) {
+            i++;
+        }
+    }
+    return i;
+}
+
+static inline int xbzrle_nzrun_end(const uint8_t *old_buf,
+                                   const uint8_t *new_buf, int i, int slen)
+{
+    /* not aligned to sizeof(long) */
+    while (i % sizeof(long) && old_buf[i] != new_buf[i]) {
+        i++;
+    }
+
+    /* word at a time for speed, use of 32-bit long okay */
+    if (!(i % sizeof(long))) {
+        /* truncation to 32-bit long okay */
+        unsigned long mask = (unsigned long)0x0101010101010101ULL;
+        while (i < slen) {
+            unsigned long xor;
+            xor = *(unsigned long *)(old_buf + i)
+                ^ *(unsigned long *)(new_buf + i);
+            if ((xor - mask) & ~xor & (mask << 7)) {
+                /* found the end of an nzrun within the current long */
+                while (old_buf[i] != new_buf[i]) {
+                    i++;
+                }
+                break;
+            }
+            i += sizeof(long);
+        }
+    }
+    return i;
+}
+
+static int xbzrle_encode_buffer_long(uint8_t *old_buf, uint8_t *new_buf,
+                                     int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode(old_buf, new_buf, slen, dst, dlen,
+                         xbzrle_zrun_end, xbzrle_nzrun_end);
+}
+
+#if defined(__aarch64__) && !defined(HOST_WORDS_BIGENDIAN)
+#include "arm_neon.h"
+
+/* One nibble per byte of the 16 compared, all ones where the bytes match */
+static inline uint64_t xbzrle_eq_mask_neon(const uint8_t *a, const uint8_t *b)
+{
+    uint8x16_t eq = vceqq_u8(vld1q_u8(a), vld1q_u8(b));
+
+    return vget_lane_u64(vreinterpret_u64_u8(
+                             vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+}
+
+static int xbzrle_zrun_end_neon(const uint8_t *old_buf,
+                                const uint8_t *new_buf, int i, int slen)
+{
+    for (; i + 16 <= slen; i += 16) {
+        uint64_t eq = xbzrle_eq_mask_neon(old_buf + i, new_buf + i);
+
+        if (eq != -1ULL) {
+            return i + ctz64(~eq) / 4;
+        }
+    }
+    return xbzrle_zrun_end(old_buf, new_buf, i, slen);
+}
+
+static int xbzrle_nzrun_end_neon(const uint8_t *old_buf,
+                                 const uint8_t *new_buf, int i, int slen)
+{
+    for (; i + 16 <= slen; i += 16) {
+        uint64_t eq = xbzrle_eq_mask_neon(old_buf + i, new_buf + i);
+
+        if (eq) {
+            return i + ctz64(eq) / 4;
+        }
+    }
+    return xbzrle_nzrun_end(old_buf, new_buf, i, slen);
+}
+
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen)
+{
+    return xbzrle_encode(old_buf, new_buf, slen, dst, dlen,
+                         xbzrle_zrun_end_neon, xbzrle_nzrun_end_neon);
+}
+#elif defined CONFIG_AVX2_OPT
+#include <cpuid.h>
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static int xbzrle_zrun_end_avx2(const uint8_t *old_buf,
+                                const uint8_t *new_buf, int i, int slen)
+{
+    for (; i + 32 <= slen; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(old_buf + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(new_buf + i));
+        uint32_t eq = _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+
+        if (eq != 0xFFFFFFFF) {
+            return i + ctz32(~eq);
+        }
+    }
+    return xbzrle_zrun_end(old_buf, new_buf, i, slen);
+}
+
+static int xbzrle_nzrun_end_avx2(const uint8_t *old_buf,
+                                 const uint8_t *new_buf, int i, int slen)
+{
+    for (; i + 32 <= slen; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(old_buf + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(new_buf + i));
+        uint32_t eq = _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+
+        if (eq) {
+            return i + ctz32(eq);
+        }
+    }
+    return xbzrle_nzrun_end(old_buf, new_buf, i, slen);
+}
+
+static int xbzrle_encode_buffer_avx2(uint8_t *old_buf, uint8_t *new_buf,
+                                     int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode(old_buf, new_buf, slen, dst, dlen,
+                         xbzrle_zrun_end_avx2, xbzrle_nzrun_end_avx2);
+}
+#pragma GCC pop_options
+
+#ifdef CONFIG_AVX512BW_OPT
+#pragma GCC push_options
+#pragma GCC target("avx512bw")
+
+static int xbzrle_zrun_end_avx512(const uint8_t *old_buf,
+                                  const uint8_t *new_buf, int i, int slen)
+{
+    for (; i + 64 <= slen; i += 64) {
+        __m512i a = _mm512_loadu_si512(old_buf + i);
+        __m512i b = _mm512_loadu_si512(new_buf + i);
+        uint64_t eq = _mm512_cmpeq_epi8_mask(a, b);
+
+        if (eq != -1ULL) {
+            return i + ctz64(~eq);
+        }
+    }
+    return xbzrle_zrun_end(old_buf, new_buf, i, slen);
+}
+
+static int xbzrle_nzrun_end_avx512(const uint8_t *old_buf,
+                                   const uint8_t *new_buf, int i, int slen)
+{
+    for (; i + 64 <= slen; i += 64) {
+        __m512i a = _mm512_loadu_si512(old_buf + i);
+        __m512i b = _mm512_loadu_si512(new_buf + i);
+        uint64_t eq = _mm512_cmpeq_epi8_mask(a, b);
+
+        if (eq) {
+            return i + ctz64(eq);
+        }
+    }
+    return xbzrle_nzrun_end(old_buf, new_buf, i, slen);
+}
+
+static int xbzrle_encode_buffer_avx512(uint8_t *old_buf, uint8_t *new_buf,
+                                       int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode(old_buf, new_buf, slen, dst, dlen,
+                         xbzrle_zrun_end_avx512, xbzrle_nzrun_end_avx512);
+}
+#pragma GCC pop_options
+#endif
+
+/* The vector registers must also be enabled by the OS (XCR0) */
+static bool xbzrle_cpu_has(unsigned int ebx_bit, uint32_t xcr0_bits)
+{
+    unsigned int a, b, c, d;
+    uint32_t xcr0_lo, xcr0_hi;
+
+    if (__get_cpuid_max(0, NULL) < 7) {
+        return false;
+    }
+    __cpuid(1, a, b, c, d);
+    if (!(c & bit_OSXSAVE)) {
+        return false;
+    }
+    asm("xgetbv" : "=a" (xcr0_lo), "=d" (xcr0_hi) : "c" (0));
+    if ((xcr0_lo & xcr0_bits) != xcr0_bits) {
+        return false;
+    }
+
+    __cpuid_count(7, 0, a, b, c, d);
+    return b & ebx_bit;
+}
+
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen)
+         __attribute__ ((ifunc("xbzrle_encode_buffer_ifunc")));
+
+static void *xbzrle_encode_buffer_ifunc(void)
+{
+    typeof(xbzrle_encode_buffer) *func = xbzrle_encode_buffer_long;
+
+    /* SSE and AVX state, plus the opmask and ZMM state for AVX-512 */
+    if (xbzrle_cpu_has(bit_AVX2, 0x06)) {
+        func = xbzrle_encode_buffer_avx2;
+    }
+#ifdef CONFIG_AVX512BW_OPT
+    if (xbzrle_cpu_has(bit_AVX512BW, 0xe6)) {
+        func = xbzrle_encode_buffer_avx512;
+    }
+#endif
+    return func;
+}
+#else
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_buffer_long(old_buf, new_buf, slen, dst, dlen);
+}
+#endif
+
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
 {
     int i = 0, d = 0;
@@ -338,21 +338,17 @@ void monitor_flush(Monitor *mon)
 /* flush at every end of line */
 static void monitor_puts(Monitor *mon, const char *str)
 {
-    char c;
+    const char *nl;
 
     qemu_mutex_lock(&mon->out_lock);
-    for(;;) {
-        c = *str++;
-        if (c == '\0')
-            break;
-        if (c == '\n') {
-            qstring_append_chr(mon->outbuf, '\r');
-        }
-        qstring_append_chr(mon->outbuf, c);
-        if (c == '\n') {
-            monitor_flush_locked(mon);
-        }
-    }
+    /* Copy whole lines at once, large QMP replies are a single line */
+    while ((nl = strchr(str, '\n')) != NULL) {
+        qstring_append_len(mon->outbuf, str, nl - str);
+        qstring_append(mon->outbuf, "\r\n");
+        monitor_flush_locked(mon);
+        str = nl + 1;
+    }
+    qstring_append(mon->outbuf, str);
     qemu_mutex_unlock(&mon->out_lock);
 }
 
@@ -1055,6 +1051,28 @@ static void hmp_info_opcount(Monitor *mon, const QDict *qdict)
     dump_opcount_info((FILE *)mon, monitor_fprintf);
 }
 
+static void hmp_info_tb_hot(Monitor *mon, const QDict *qdict)
+{
+    int count = qdict_get_try_int(qdict, "count", 10);
+
+    if (count <= 0) {
+        monitor_printf(mon, "invalid count %d\n", count);
+        return;
+    }
+    dump_tb_hot_info((FILE *)mon, monitor_fprintf, count);
+}
+
+static void hmp_info_tb_samples(Monitor *mon, const QDict *qdict)
+{
+    int count = qdict_get_try_int(qdict, "count", 10);
+
+    if (count <= 0) {
+        monitor_printf(mon, "invalid count %d\n", count);
+        return;
+    }
+    dump_tb_sample_info((FILE *)mon, monitor_fprintf, count);
+}
+
 static void hmp_info_history(Monitor *mon, const QDict *qdict)
 {
     int i;
@@ -1176,6 +1194,37 @@ static void hmp_singlestep(Monitor *mon, const QDict *qdict)
     }
 }
 
+static void hmp_tb_profile(Monitor *mon, const QDict *qdict)
+{
+    const char *option = qdict_get_try_str(qdict, "option");
+    if (!option || !strcmp(option, "on")) {
+        tb_profile_set(true);
+    } else if (!strcmp(option, "off")) {
+        tb_profile_set(false);
+    } else {
+        monitor_printf(mon, "unexpected option %s\n", option);
+    }
+}
+
+static void hmp_tb_sample(Monitor *mon, const QDict *qdict)
+{
+    const char *option = qdict_get_try_str(qdict, "option");
+    int period = qdict_get_try_int(qdict, "period", 100);
+    bool mem = qdict_get_try_bool(qdict, "mem", false);
+
+    if (!option || !strcmp(option, "on")) {
+        if (period <= 0) {
+            monitor_printf(mon, "invalid period %d\n", period);
+            return;
+        }
+        tb_sample_set(period, mem);
+    } else if (!strcmp(option, "off")) {
+        tb_sample_set(0, false);
+    } else {
+        monitor_printf(mon, "unexpected option %s\n", option);
+    }
+}
+
 static void hmp_gdbserver(Monitor *mon, const QDict *qdict)
 {
     const char *device = qdict_get_try_str(qdict, "device");
@@ -4328,6 +4377,13 @@ GICCapabilityList *qmp_query_gic_capabilities(Error **errp)
 }
 #endif
 
+#ifndef CONFIG_LINUX
+VfioDmaInfoList *qmp_query_vfio_dma(Error **errp)
+{
+    return NULL;
+}
+#endif
+
 HotpluggableCPUList *qmp_query_hotpluggable_cpus(Error **errp)
 {
     MachineState *ms = MACHINE(qdev_get_machine());
@@ -20,7 +20,7 @@
 #include "qapi/error.h"
 #include "nbd-internal.h"
 
-static int nbd_errno_to_system_errno(int err)
+int nbd_errno_to_system_errno(int err)
 {
     switch (err) {
     case NBD_SUCCESS:
@@ -407,14 +407,192 @@ static QIOChannel *nbd_receive_starttls(QIOChannel *ioc,
     return QIO_CHANNEL(tioc);
 }
 
+static int nbd_send_option_request(QIOChannel *ioc, uint32_t opt,
+                                   uint32_t len, const char *data,
+                                   Error **errp)
+{
+    uint64_t magic = cpu_to_be64(NBD_OPTS_MAGIC);
+    uint32_t be_opt = cpu_to_be32(opt);
+    uint32_t be_len = cpu_to_be32(len);
+
+    if (write_sync(ioc, &magic, sizeof(magic)) != sizeof(magic)) {
+        error_setg(errp, "Failed to send option magic");
+        return -1;
+    }
+    if (write_sync(ioc, &be_opt, sizeof(be_opt)) != sizeof(be_opt)) {
+        error_setg(errp, "Failed to send option number");
+        return -1;
+    }
+    if (write_sync(ioc, &be_len, sizeof(be_len)) != sizeof(be_len)) {
+        error_setg(errp, "Failed to send option length");
+        return -1;
+    }
+    if (len && write_sync(ioc, (char *)data, len) != len) {
+        error_setg(errp, "Failed to send option data");
+        return -1;
+    }
+    return 0;
+}
+
+/* Read the header of a reply to option @opt.  Return 1 and fill in
+ * @type and @len on success, otherwise behave like nbd_handle_reply_err.
+ */
+static int nbd_receive_option_reply(QIOChannel *ioc, uint32_t opt,
+                                    uint32_t *type, uint32_t *len,
+                                    Error **errp)
+{
+    uint64_t magic;
+    uint32_t reply_opt;
+    int ret;
+
+    if (read_sync(ioc, &magic, sizeof(magic)) != sizeof(magic)) {
+        error_setg(errp, "failed to read option magic");
+        return -1;
+    }
+    if (be64_to_cpu(magic) != NBD_REP_MAGIC) {
+        error_setg(errp, "Unexpected option magic");
+        return -1;
+    }
+    if (read_sync(ioc, &reply_opt, sizeof(reply_opt)) != sizeof(reply_opt)) {
+        error_setg(errp, "failed to read option");
+        return -1;
+    }
+    reply_opt = be32_to_cpu(reply_opt);
+    if (reply_opt != opt) {
+        error_setg(errp, "Unexpected option type %" PRIx32 " expected %"
+                   PRIx32, reply_opt, opt);
+        return -1;
+    }
+    if (read_sync(ioc, type, sizeof(*type)) != sizeof(*type)) {
+        error_setg(errp, "failed to read option type");
+        return -1;
+    }
+    *type = be32_to_cpu(*type);
+    ret = nbd_handle_reply_err(ioc, opt, *type, errp);
+    if (ret <= 0) {
+        return ret;
+    }
+    if (read_sync(ioc, len, sizeof(*len)) != sizeof(*len)) {
+        error_setg(errp, "failed to read option length");
+        return -1;
+    }
+    *len = be32_to_cpu(*len);
+    return 1;
+}
+
+/* Return 1 if the server agreed to send structured replies, 0 if it
+ * does not support them, -1 on error.
+ */
+static int nbd_receive_structured_reply(QIOChannel *ioc, Error **errp)
+{
+    uint32_t type, len;
+    int ret;
+
+    TRACE("Requesting structured replies");
+    if (nbd_send_option_request(ioc, NBD_OPT_STRUCTURED_REPLY, 0, NULL,
+                                errp) < 0) {
+        return -1;
+    }
+    ret = nbd_receive_option_reply(ioc, NBD_OPT_STRUCTURED_REPLY,
+                                   &type, &len, errp);
+    if (ret <= 0) {
+        return ret;
+    }
+    if (type != NBD_REP_ACK || len != 0) {
+        error_setg(errp, "Unexpected reply %" PRIx32 " to structured "
+                   "reply request", type);
+        return -1;
+    }
+    return 1;
+}
+
+/* Select the base:allocation meta context for export @name.  Return 1
+ * and set @id if the server knows it, 0 if it does not, -1 on error.
+ */
+static int nbd_receive_base_allocation(QIOChannel *ioc, const char *name,
+                                       uint32_t *id, Error **errp)
+{
+    size_t name_len = strlen(name);
+    size_t query_len = strlen(NBD_META_BASE_ALLOCATION);
+    size_t data_len = 4 + name_len + 4 + 4 + query_len;
+    char *data = g_malloc(data_len);
+    char *p = data;
+    uint32_t type, len;
+    bool found = false;
+    int ret;
+
+    /* Export name, then a single query */
+    stl_be_p(p, name_len);
+    memcpy(p + 4, name, name_len);
+    p += 4 + name_len;
+    stl_be_p(p, 1);
+    stl_be_p(p + 4, query_len);
+    memcpy(p + 8, NBD_META_BASE_ALLOCATION, query_len);
+
+    TRACE("Requesting meta context " NBD_META_BASE_ALLOCATION);
+    ret = nbd_send_option_request(ioc, NBD_OPT_SET_META_CONTEXT, data_len,
+                                  data, errp);
+    g_free(data);
+    if (ret < 0) {
+        return -1;
+    }
+
+    while (1) {
+        char reply_name[NBD_MAX_NAME_SIZE + 1];
+
+        ret = nbd_receive_option_reply(ioc, NBD_OPT_SET_META_CONTEXT,
+                                       &type, &len, errp);
+        if (ret <= 0) {
+            return ret;
+        }
+        if (type == NBD_REP_ACK) {
+            if (len != 0) {
+                error_setg(errp, "length too long for option end");
+                return -1;
+            }
+            break;
+        }
+        if (type != NBD_REP_META_CONTEXT) {
+            error_setg(errp, "Unexpected reply type %" PRIx32 " expected %x",
+                       type, NBD_REP_META_CONTEXT);
+            return -1;
+        }
+        if (len < sizeof(*id) || len - sizeof(*id) > NBD_MAX_NAME_SIZE) {
+            error_setg(errp, "incorrect meta context reply length");
+            return -1;
+        }
+        if (read_sync(ioc, id, sizeof(*id)) != sizeof(*id)) {
+            error_setg(errp, "failed to read meta context id");
+            return -1;
+        }
+        *id = be32_to_cpu(*id);
+        len -= sizeof(*id);
+        if (read_sync(ioc, reply_name, len) != len) {
+            error_setg(errp, "failed to read meta context name");
+            return -1;
+        }
+        reply_name[len] = '\0';
+        if (strcmp(reply_name, NBD_META_BASE_ALLOCATION)) {
+            error_setg(errp, "Unexpected meta context '%s'", reply_name);
+            return -1;
+        }
+        TRACE("Meta context " NBD_META_BASE_ALLOCATION " has id %" PRIu32,
+              *id);
+        found = true;
+    }
+
+    return found;
+}
+
 
 int nbd_receive_negotiate(QIOChannel *ioc, const char *name, uint16_t *flags,
                           QCryptoTLSCreds *tlscreds, const char *hostname,
                           QIOChannel **outioc,
-                          off_t *size, Error **errp)
+                          off_t *size, NBDExtensions *ext, Error **errp)
 {
     char buf[256];
     uint64_t magic, s;
+    NBDExtensions want = { 0 };
     int rc;
 
     TRACE("Receiving negotiation tlscreds=%p hostname=%s.",
@@ -425,6 +603,10 @@ int nbd_receive_negotiate(QIOChannel *ioc, const char *name, uint16_t *flags,
     if (outioc) {
         *outioc = NULL;
     }
+    if (ext) {
+        want = *ext;
+        memset(ext, 0, sizeof(*ext));
+    }
     if (tlscreds && !outioc) {
         error_setg(errp, "Output I/O channel required for TLS");
         goto fail;
@@ -515,6 +697,22 @@ int nbd_receive_negotiate(QIOChannel *ioc, const char *name, uint16_t *flags,
             if (nbd_receive_query_exports(ioc, name, errp) < 0) {
                 goto fail;
             }
+
+            if (want.structured_reply) {
+                int ret = nbd_receive_structured_reply(ioc, errp);
+                if (ret < 0) {
+                    goto fail;
+                }
+                ext->structured_reply = ret;
+            }
+            if (want.base_allocation && ext->structured_reply) {
+                int ret = nbd_receive_base_allocation(
+                    ioc, name, &ext->base_allocation_id, errp);
+                if (ret < 0) {
+                    goto fail;
+                }
+                ext->base_allocation = ret;
+            }
         }
         /* write the export name */
         magic = cpu_to_be64(magic);
@@ -736,27 +934,62 @@ ssize_t nbd_send_request(QIOChannel *ioc, struct nbd_request *request)
 
 ssize_t nbd_receive_reply(QIOChannel *ioc, struct nbd_reply *reply)
 {
-    uint8_t buf[NBD_REPLY_SIZE];
+    uint8_t buf[NBD_STRUCTURED_REPLY_SIZE];
     uint32_t magic;
     ssize_t ret;
 
-    ret = read_sync(ioc, buf, sizeof(buf));
+    ret = read_sync(ioc, buf, NBD_REPLY_SIZE);
     if (ret < 0) {
         return ret;
     }
 
-    if (ret != sizeof(buf)) {
+    if (ret != NBD_REPLY_SIZE) {
         LOG("read failed");
         return -EINVAL;
     }
 
+    magic = ldl_be_p(buf);
+    if (magic == NBD_STRUCTURED_REPLY_MAGIC) {
+        /* Structured reply chunk
+           [ 0 ..  3]    magic   (NBD_STRUCTURED_REPLY_MAGIC)
+           [ 4 ..  5]    flags
+           [ 6 ..  7]    type
+           [ 8 .. 15]    handle
+           [16 .. 19]    length of the payload
+         */
+        do {
+            /* The header has started arriving, wait for the rest of it */
+            ret = read_sync(ioc, buf + NBD_REPLY_SIZE,
+                            NBD_STRUCTURED_REPLY_SIZE - NBD_REPLY_SIZE);
+            if (ret == -EAGAIN) {
+                qio_channel_wait(ioc, G_IO_IN);
+            }
+        } while (ret == -EAGAIN);
+        if (ret != NBD_STRUCTURED_REPLY_SIZE - NBD_REPLY_SIZE) {
+            LOG("read failed");
+            return ret < 0 ? ret : -EINVAL;
+        }
+
+        reply->structured = true;
+        reply->error  = 0;
+        reply->flags  = lduw_be_p(buf + 4);
+        reply->type   = lduw_be_p(buf + 6);
+        reply->handle = ldq_be_p(buf + 8);
+        reply->length = ldl_be_p(buf + 16);
+
+        TRACE("Got chunk: { flags = %" PRIx16 ", .type = %" PRIu16
+              ", handle = %" PRIu64 ", length = %" PRIu32 " }",
+              reply->flags, reply->type, reply->handle, reply->length);
+        return 0;
+    }
+
     /* Reply
        [ 0 ..  3]    magic   (NBD_REPLY_MAGIC)
        [ 4 ..  7]    error   (0 == no error)
        [ 7 .. 15]    handle
      */
 
-    magic = ldl_be_p(buf);
+    reply->structured = false;
     reply->error  = ldl_be_p(buf + 4);
     reply->handle = ldq_be_p(buf + 8);
 
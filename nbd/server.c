@@ -64,7 +64,9 @@ struct NBDExport {
     off_t dev_offset;
     off_t size;
     uint16_t nbdflags;
+    int max_requests;   /* in flight per client */
     QTAILQ_HEAD(, NBDClient) clients;
+    int nb_clients;     /* atomic, for nbd_export_find */
     QTAILQ_ENTRY(NBDExport) next;
 
     AioContext *ctx;
@@ -86,6 +88,9 @@ struct NBDClient {
 
     Coroutine *recv_coroutine;
 
+    bool structured_reply;
+    bool base_allocation;       /* base:allocation meta context selected */
+
     CoMutex send_lock;
     Coroutine *send_coroutine;
 
@@ -96,11 +101,15 @@ struct NBDClient {
     bool closing;
 };
 
+/* Meta context id sent for base:allocation */
+#define NBD_META_ID_BASE_ALLOCATION 0
+
 /* That's all folks */
 
 static void nbd_set_handlers(NBDClient *client);
 static void nbd_unset_handlers(NBDClient *client);
 static void nbd_update_can_read(NBDClient *client);
+static NBDExport *nbd_export_find_replica(NBDExport *exp);
 
 static gboolean nbd_negotiate_continue(QIOChannel *ioc,
                                        GIOCondition condition,
@@ -192,10 +201,10 @@ static ssize_t nbd_negotiate_drop_sync(QIOChannel *ioc, size_t size)
 
 */
 
-static int nbd_negotiate_send_rep(QIOChannel *ioc, uint32_t type, uint32_t opt)
+static int nbd_negotiate_send_rep_len(QIOChannel *ioc, uint32_t type,
+                                      uint32_t opt, uint32_t len)
 {
     uint64_t magic;
-    uint32_t len;
 
     TRACE("Reply opt=%" PRIx32 " type=%" PRIx32, type, opt);
 
@@ -214,7 +223,7 @@ static int nbd_negotiate_send_rep(QIOChannel *ioc, uint32_t type, uint32_t opt)
         LOG("write failed (rep type)");
         return -EINVAL;
     }
-    len = cpu_to_be32(0);
+    len = cpu_to_be32(len);
     if (nbd_negotiate_write(ioc, &len, sizeof(len)) != sizeof(len)) {
         LOG("write failed (rep data length)");
         return -EINVAL;
@@ -222,6 +231,11 @@ static int nbd_negotiate_send_rep(QIOChannel *ioc, uint32_t type, uint32_t opt)
     return 0;
 }
 
+static int nbd_negotiate_send_rep(QIOChannel *ioc, uint32_t type, uint32_t opt)
+{
+    return nbd_negotiate_send_rep_len(ioc, type, opt, 0);
+}
+
 static int nbd_negotiate_send_rep_list(QIOChannel *ioc, NBDExport *exp)
 {
     uint64_t magic, name_len;
@@ -275,6 +289,9 @@ static int nbd_negotiate_handle_list(NBDClient *client, uint32_t length)
 
     /* For each export, send a NBD_REP_SERVER reply. */
     QTAILQ_FOREACH(exp, &exports, next) {
+        if (nbd_export_find_replica(exp)) {
+            continue;
+        }
         if (nbd_negotiate_send_rep_list(client->ioc, exp)) {
             return -EINVAL;
         }
@@ -310,13 +327,163 @@ static int nbd_negotiate_handle_export_name(NBDClient *client, uint32_t length)
         goto fail;
     }
 
+    /* Negotiation runs in the main loop, the export may be in an IOThread */
+    aio_context_acquire(client->exp->ctx);
     QTAILQ_INSERT_TAIL(&client->exp->clients, client, next);
+    atomic_inc(&client->exp->nb_clients);
     nbd_export_get(client->exp);
+    aio_context_release(client->exp->ctx);
     rc = 0;
 fail:
     return rc;
 }
 
+static int nbd_negotiate_handle_structured_reply(NBDClient *client,
+                                                 uint32_t length)
+{
+    if (length) {
+        if (nbd_negotiate_drop_sync(client->ioc, length) != length) {
+            return -EIO;
+        }
+        return nbd_negotiate_send_rep(client->ioc, NBD_REP_ERR_INVALID,
+                                      NBD_OPT_STRUCTURED_REPLY);
+    }
+
+    TRACE("Client uses structured replies");
+    client->structured_reply = true;
+    return nbd_negotiate_send_rep(client->ioc, NBD_REP_ACK,
+                                  NBD_OPT_STRUCTURED_REPLY);
+}
+
+static int nbd_negotiate_send_meta_context(QIOChannel *ioc, uint32_t opt,
+                                           uint32_t id, const char *name)
+{
+    uint32_t len = strlen(name);
+
+    if (nbd_negotiate_send_rep_len(ioc, NBD_REP_META_CONTEXT, opt,
+                                   sizeof(id) + len) < 0) {
+        return -EINVAL;
+    }
+    id = cpu_to_be32(id);
+    if (nbd_negotiate_write(ioc, &id, sizeof(id)) != sizeof(id)) {
+        LOG("write failed (meta context id)");
+        return -EINVAL;
+    }
+    if (nbd_negotiate_write(ioc, (char *)name, len) != len) {
+        LOG("write failed (meta context name)");
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/* Handle NBD_OPT_LIST_META_CONTEXT and NBD_OPT_SET_META_CONTEXT.  The
+ * only context we offer is base:allocation.
+ */
+static int nbd_negotiate_handle_meta_context(NBDClient *client,
+                                             uint32_t opt, uint32_t length)
+{
+    char name[NBD_MAX_NAME_SIZE + 1];
+    uint32_t len, nb_queries;
+    bool base_allocation = false;
+    uint32_t reply = NBD_REP_ERR_INVALID;
+
+    /* Client sends:
+        [ 0 ..   3]   export name length
+        ...           export name
+        [ 0 ..   3]   number of queries
+        [ 0 ..   3]   query length
+        ...           query (repeated for each query)
+     */
+    if (!client->structured_reply) {
+        goto drop;
+    }
+    if (length < sizeof(len)) {
+        goto drop;
+    }
+    if (nbd_negotiate_read(client->ioc, &len, sizeof(len)) != sizeof(len)) {
+        return -EIO;
+    }
+    length -= sizeof(len);
+    len = be32_to_cpu(len);
+    if (len > NBD_MAX_NAME_SIZE || len > length) {
+        goto drop;
+    }
+    if (nbd_negotiate_read(client->ioc, name, len) != len) {
+        return -EIO;
+    }
+    length -= len;
+    name[len] = '\0';
+    if (!nbd_export_find(name)) {
+        reply = NBD_REP_ERR_UNKNOWN;
+        goto drop;
+    }
+
+    if (length < sizeof(nb_queries)) {
+        goto drop;
+    }
+    if (nbd_negotiate_read(client->ioc, &nb_queries, sizeof(nb_queries)) !=
+        sizeof(nb_queries)) {
+        return -EIO;
+    }
+    length -= sizeof(nb_queries);
+    nb_queries = be32_to_cpu(nb_queries);
+
+    if (!nb_queries) {
+        /* Listing with no query returns every context */
+        base_allocation = opt == NBD_OPT_LIST_META_CONTEXT;
+    }
+    while (nb_queries--) {
+        if (length < sizeof(len)) {
+            goto drop;
+        }
+        if (nbd_negotiate_read(client->ioc, &len, sizeof(len)) !=
+            sizeof(len)) {
+            return -EIO;
+        }
+        length -= sizeof(len);
+        len = be32_to_cpu(len);
+        if (len > length) {
+            goto drop;
+        }
+        if (len > NBD_MAX_NAME_SIZE) {
+            /* Too long to be anything we know */
+            if (nbd_negotiate_drop_sync(client->ioc, len) != len) {
+                return -EIO;
+            }
+        } else {
+            if (nbd_negotiate_read(client->ioc, name, len) != len) {
+                return -EIO;
+            }
+            name[len] = '\0';
+            TRACE("Client queried meta context '%s'", name);
+            if (!strcmp(name, NBD_META_BASE_ALLOCATION)) {
+                base_allocation = true;
+            }
+        }
+        length -= len;
+    }
+    if (length) {
+        goto drop;
+    }
+
+    if (base_allocation &&
+        nbd_negotiate_send_meta_context(client->ioc, opt,
+                                        NBD_META_ID_BASE_ALLOCATION,
+                                        NBD_META_BASE_ALLOCATION) < 0) {
+        return -EINVAL;
+    }
+    if (opt == NBD_OPT_SET_META_CONTEXT) {
+        client->base_allocation = base_allocation;
+    }
+    return nbd_negotiate_send_rep(client->ioc, NBD_REP_ACK, opt);
+
+drop:
+    if (nbd_negotiate_drop_sync(client->ioc, length) != length) {
+        return -EIO;
+    }
+    return nbd_negotiate_send_rep(client->ioc, reply, opt);
+}
+
 
 static QIOChannel *nbd_negotiate_handle_starttls(NBDClient *client,
                                                  uint32_t length)
@@ -505,6 +672,23 @@ static int nbd_negotiate_options(NBDClient *client)
                     return ret;
                 }
                 break;
+
+            case NBD_OPT_STRUCTURED_REPLY:
+                ret = nbd_negotiate_handle_structured_reply(client, length);
+                if (ret < 0) {
+                    return ret;
+                }
+                break;
+
+            case NBD_OPT_LIST_META_CONTEXT:
+            case NBD_OPT_SET_META_CONTEXT:
+                ret = nbd_negotiate_handle_meta_context(client, clientflags,
+                                                        length);
+                if (ret < 0) {
+                    return ret;
+                }
+                break;
+
             default:
                 TRACE("Unsupported option 0x%" PRIx32, clientflags);
                 if (nbd_negotiate_drop_sync(client->ioc, length) != length) {
@@ -544,8 +728,11 @@ static coroutine_fn int nbd_negotiate(NBDClientNewData *data)
     NBDClient *client = data->client;
     char buf[8 + 8 + 8 + 128];
     int rc;
+    /* All clients of an export share its BlockBackend, so a flush from
+     * one of them covers writes completed by the others.  */
     const uint16_t myflags = (NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_TRIM |
-                              NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA);
+                              NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA |
+                              NBD_FLAG_CAN_MULTI_CONN);
     bool oldStyle;
 
     /* Old style negotiation header without options
@@ -695,7 +882,8 @@ static ssize_t nbd_send_reply(QIOChannel *ioc, struct nbd_reply *reply)
     return 0;
 }
 
-#define MAX_NBD_REQUESTS 16
+/* Extents returned for one NBD_CMD_BLOCK_STATUS without NBD_CMD_FLAG_REQ_ONE */
+#define NBD_MAX_BLOCK_STATUS_EXTENTS 128
 
 void nbd_client_get(NBDClient *client)
 {
@@ -718,8 +906,17 @@ void nbd_client_put(NBDClient *client)
         }
         g_free(client->tlsaclname);
         if (client->exp) {
+            AioContext *ctx = client->exp->ctx;
+
+            if (ctx) {
+                aio_context_acquire(ctx);
+            }
             QTAILQ_REMOVE(&client->exp->clients, client, next);
+            atomic_dec(&client->exp->nb_clients);
             nbd_export_put(client->exp);
+            if (ctx) {
+                aio_context_release(ctx);
+            }
         }
         g_free(client);
     }
@@ -749,7 +946,7 @@ static NBDRequest *nbd_request_get(NBDClient *client)
 {
     NBDRequest *req;
 
-    assert(client->nb_requests <= MAX_NBD_REQUESTS - 1);
+    assert(client->nb_requests <= client->exp->max_requests - 1);
     client->nb_requests++;
     nbd_update_can_read(client);
 
@@ -817,6 +1014,7 @@ NBDExport *nbd_export_new(BlockBackend *blk, off_t dev_offset, off_t size,
     exp->blk = blk;
     exp->dev_offset = dev_offset;
     exp->nbdflags = nbdflags;
+    exp->max_requests = MAX_NBD_REQUESTS;
     exp->size = size < 0 ? blk_getlength(blk) : size;
     if (exp->size < 0) {
         error_setg_errno(errp, -exp->size,
@@ -848,12 +1046,34 @@ fail:
     return NULL;
 }
 
+/* Exports sharing a name are replicas of one image served from different
+ * AioContexts.  Return the one with the fewest clients.
+ */
 NBDExport *nbd_export_find(const char *name)
 {
-    NBDExport *exp;
+    NBDExport *exp, *found = NULL;
     QTAILQ_FOREACH(exp, &exports, next) {
-        if (strcmp(name, exp->name) == 0) {
-            return exp;
+        if (strcmp(name, exp->name) == 0 &&
+            (!found ||
+             atomic_read(&exp->nb_clients) <
+             atomic_read(&found->nb_clients))) {
+            found = exp;
+        }
+    }
+
+    return found;
+}
+
+/* Return an export named like @exp that precedes it in the list, if any */
+static NBDExport *nbd_export_find_replica(NBDExport *exp)
+{
+    NBDExport *e;
+    QTAILQ_FOREACH(e, &exports, next) {
+        if (e == exp) {
+            break;
+        }
+        if (strcmp(e->name, exp->name) == 0) {
+            return e;
         }
     }
 
@@ -930,6 +1150,13 @@ BlockBackend *nbd_export_get_blockdev(NBDExport *exp)
     return exp->blk;
 }
 
+/* Number of requests each client can have in flight, for new requests */
+void nbd_export_set_max_requests(NBDExport *exp, int max_requests)
+{
+    assert(max_requests > 0);
+    exp->max_requests = max_requests;
+}
+
 void nbd_export_close_all(void)
 {
     NBDExport *exp, *next;
@@ -970,6 +1197,212 @@ static ssize_t nbd_co_send_reply(NBDRequest *req, struct nbd_reply *reply,
     return rc;
 }
 
+static void set_be_chunk(uint8_t *buf, uint16_t flags, uint16_t type,
+                         uint64_t handle, uint32_t length)
+{
+    /* Structured reply chunk
+       [ 0 ..  3]    magic   (NBD_STRUCTURED_REPLY_MAGIC)
+       [ 4 ..  5]    flags
+       [ 6 ..  7]    type
+       [ 8 .. 15]    handle
+       [16 .. 19]    length of the payload
+     */
+    stl_be_p(buf, NBD_STRUCTURED_REPLY_MAGIC);
+    stw_be_p(buf + 4, flags);
+    stw_be_p(buf + 6, type);
+    stq_be_p(buf + 8, handle);
+    stl_be_p(buf + 16, length);
+}
+
+static ssize_t nbd_co_send_iov(NBDClient *client, struct iovec *iov,
+                               unsigned niov)
+{
+    size_t size = iov_size(iov, niov);
+    ssize_t ret;
+
+    g_assert(qemu_in_coroutine());
+    qemu_co_mutex_lock(&client->send_lock);
+    client->send_coroutine = qemu_coroutine_self();
+    nbd_set_handlers(client);
+
+    ret = nbd_wr_syncv(client->ioc, iov, niov, size, false);
+
+    client->send_coroutine = NULL;
+    nbd_set_handlers(client);
+    qemu_co_mutex_unlock(&client->send_lock);
+    return ret == size ? 0 : -EIO;
+}
+
+static ssize_t nbd_co_send_structured_error(NBDRequest *req,
+                                            uint64_t handle, int error)
+{
+    uint8_t buf[NBD_STRUCTURED_REPLY_SIZE + 6];
+    struct iovec iov = { .iov_base = buf, .iov_len = sizeof(buf) };
+
+    TRACE("Sending error chunk to client: { .error = %d, handle = %" PRIu64
+          " }", error, handle);
+
+    /* Error, then the length of a message that we do not send */
+    set_be_chunk(buf, NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_ERROR, handle, 6);
+    stl_be_p(buf + NBD_STRUCTURED_REPLY_SIZE,
+             system_errno_to_nbd_errno(error));
+    stw_be_p(buf + NBD_STRUCTURED_REPLY_SIZE + 4, 0);
+    return nbd_co_send_iov(req->client, &iov, 1);
+}
+
+/* Return the length of the extent that starts at @offset in the export
+ * and is at most @bytes long, and store its NBD_STATE_* bits in @flags.
+ */
+static int64_t nbd_export_block_status(NBDExport *exp, uint64_t offset,
+                                       uint32_t bytes, uint32_t *flags)
+{
+    BlockDriverState *bs = blk_bs(exp->blk);
+    BlockDriverState *file;
+    uint64_t start = offset + exp->dev_offset;
+    uint64_t end = start + bytes;
+    int64_t sector_num = start >> BDRV_SECTOR_BITS;
+    int nb_sectors = DIV_ROUND_UP(end, BDRV_SECTOR_SIZE) - sector_num;
+    int64_t ret;
+    int pnum;
+
+    ret = bdrv_get_block_status_above(bs, NULL, sector_num, nb_sectors,
+                                      &pnum, &file);
+    if (ret < 0) {
+        return ret;
+    }
+    if (!pnum) {
+        *flags = 0;
+        return bytes;
+    }
+
+    *flags = 0;
+    if (!(ret & BDRV_BLOCK_DATA)) {
+        *flags |= NBD_STATE_HOLE;
+    }
+    if (ret & BDRV_BLOCK_ZERO) {
+        *flags |= NBD_STATE_ZERO;
+    }
+    return MIN((uint64_t)(sector_num + pnum) << BDRV_SECTOR_BITS, end) - start;
+}
+
+/* Answer NBD_CMD_READ with one chunk per extent, so that zero ranges are
+ * neither read nor sent.  Return a negative value if the connection must
+ * be dropped, otherwise 0 with *error set if reading failed before the
+ * final chunk was sent.
+ */
+static ssize_t nbd_co_send_sparse_read(NBDRequest *req,
+                                       struct nbd_request *request,
+                                       int *error)
+{
+    NBDExport *exp = req->client->exp;
+    uint8_t buf[NBD_STRUCTURED_REPLY_SIZE + 12];
+    struct iovec iov[2];
+    uint32_t pos = 0;
+    uint32_t flags;
+    int64_t len;
+    ssize_t ret;
+
+    *error = 0;
+    if (!request->len) {
+        set_be_chunk(buf, NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_NONE,
+                     request->handle, 0);
+        iov[0].iov_base = buf;
+        iov[0].iov_len = NBD_STRUCTURED_REPLY_SIZE;
+        return nbd_co_send_iov(req->client, iov, 1);
+    }
+
+    while (pos < request->len) {
+        uint64_t offset = request->from + pos;
+        uint16_t done;
+        unsigned niov;
+
+        len = nbd_export_block_status(exp, offset, request->len - pos,
+                                      &flags);
+        if (len < 0) {
+            *error = -len;
+            return 0;
+        }
+        done = pos + len == request->len ? NBD_REPLY_FLAG_DONE : 0;
+
+        iov[0].iov_base = buf;
+        if (flags & NBD_STATE_ZERO) {
+            set_be_chunk(buf, done, NBD_REPLY_TYPE_OFFSET_HOLE,
+                         request->handle, 12);
+            stq_be_p(buf + NBD_STRUCTURED_REPLY_SIZE, offset);
+            stl_be_p(buf + NBD_STRUCTURED_REPLY_SIZE + 8, len);
+            iov[0].iov_len = NBD_STRUCTURED_REPLY_SIZE + 12;
+            niov = 1;
+        } else {
+            ret = blk_pread(exp->blk, offset + exp->dev_offset,
+                            req->data + pos, len);
+            if (ret < 0) {
+                *error = -ret;
+                return 0;
+            }
+            set_be_chunk(buf, done, NBD_REPLY_TYPE_OFFSET_DATA,
+                         request->handle, 8 + len);
+            stq_be_p(buf + NBD_STRUCTURED_REPLY_SIZE, offset);
+            iov[0].iov_len = NBD_STRUCTURED_REPLY_SIZE + 8;
+            iov[1].iov_base = req->data + pos;
+            iov[1].iov_len = len;
+            niov = 2;
+        }
+
+        ret = nbd_co_send_iov(req->client, iov, niov);
+        if (ret < 0) {
+            return ret;
+        }
+        pos += len;
+    }
+    return 0;
+}
+
+/* Answer NBD_CMD_BLOCK_STATUS for the base:allocation context.  Return
+ * values are as for nbd_co_send_sparse_read().
+ */
+static ssize_t nbd_co_send_block_status(NBDRequest *req,
+                                        struct nbd_request *request,
+                                        int *error)
+{
+    NBDExport *exp = req->client->exp;
+    unsigned max_extents = request->type & NBD_CMD_FLAG_REQ_ONE ?
+                           1 : NBD_MAX_BLOCK_STATUS_EXTENTS;
+    size_t size = NBD_STRUCTURED_REPLY_SIZE + 4 + max_extents * 8;
+    uint8_t *buf = g_malloc(size);
+    uint8_t *p = buf + NBD_STRUCTURED_REPLY_SIZE + 4;
+    struct iovec iov = { .iov_base = buf };
+    unsigned nb_extents = 0;
+    uint32_t pos = 0;
+    uint32_t flags;
+    int64_t len;
+    ssize_t ret = 0;
+
+    *error = 0;
+    while (pos < request->len && nb_extents < max_extents) {
+        len = nbd_export_block_status(exp, request->from + pos,
+                                      request->len - pos, &flags);
+        if (len < 0) {
+            *error = -len;
+            goto out;
+        }
+        stl_be_p(p, len);
+        stl_be_p(p + 4, flags);
+        p += 8;
+        nb_extents++;
+        pos += len;
+    }
+
+    set_be_chunk(buf, NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_BLOCK_STATUS,
+                 request->handle, 4 + nb_extents * 8);
+    stl_be_p(buf + NBD_STRUCTURED_REPLY_SIZE, NBD_META_ID_BASE_ALLOCATION);
+    iov.iov_len = p - buf;
+    ret = nbd_co_send_iov(req->client, &iov, 1);
+
+out:
+    g_free(buf);
+    return ret;
+}
+
 /* Collect a client request.  Return 0 if request looks valid, -EAGAIN
  * to keep trying the collection, -EIO to drop connection right away,
  * and any other negative value to report an error to the client
@@ -979,7 +1412,7 @@ static ssize_t nbd_co_receive_request(NBDRequest *req,
                                       struct nbd_request *request)
 {
     NBDClient *client = req->client;
-    uint32_t command;
+    uint32_t command, valid_flags;
     ssize_t rc;
 
     g_assert(qemu_in_coroutine());
@@ -1052,7 +1485,11 @@ static ssize_t nbd_co_receive_request(NBDRequest *req,
         rc = command == NBD_CMD_WRITE ? -ENOSPC : -EINVAL;
         goto out;
     }
-    if (request->type & ~NBD_CMD_MASK_COMMAND & ~NBD_CMD_FLAG_FUA) {
+    valid_flags = NBD_CMD_FLAG_FUA;
+    if (command == NBD_CMD_BLOCK_STATUS) {
+        valid_flags |= NBD_CMD_FLAG_REQ_ONE;
+    }
+    if (request->type & ~NBD_CMD_MASK_COMMAND & ~valid_flags) {
         LOG("unsupported flags (got 0x%x)",
             request->type & ~NBD_CMD_MASK_COMMAND);
         rc = -EINVAL;
@@ -1078,6 +1515,7 @@ static void nbd_trip(void *opaque)
     ssize_t ret;
     uint32_t command;
     int flags;
+    int error;
 
     TRACE("Reading request.");
     if (client->closing) {
@@ -1095,12 +1533,12 @@ static void nbd_trip(void *opaque)
 
     reply.handle = request.handle;
     reply.error = 0;
+    command = request.type & NBD_CMD_MASK_COMMAND;
 
     if (ret < 0) {
         reply.error = -ret;
         goto error_reply;
     }
-    command = request.type & NBD_CMD_MASK_COMMAND;
 
     if (client->closing) {
         /*
@@ -1123,6 +1561,18 @@ static void nbd_trip(void *opaque)
             }
         }
 
+        if (client->structured_reply) {
+            if (nbd_co_send_sparse_read(req, &request, &error) < 0) {
+                goto out;
+            }
+            if (error) {
+                LOG("reading from file failed");
+                reply.error = error;
+                goto error_reply;
+            }
+            break;
+        }
+
         ret = blk_pread(exp->blk, request.from + exp->dev_offset,
                         req->data, request.len);
         if (ret < 0) {
@@ -1191,14 +1641,37 @@ static void nbd_trip(void *opaque)
             goto out;
         }
         break;
+    case NBD_CMD_BLOCK_STATUS:
+        TRACE("Request type is BLOCK_STATUS");
+        if (!client->base_allocation || !request.len) {
+            reply.error = EINVAL;
+            goto error_reply;
+        }
+        if (nbd_co_send_block_status(req, &request, &error) < 0) {
+            goto out;
+        }
+        if (error) {
+            LOG("block status failed");
+            reply.error = error;
+            goto error_reply;
+        }
+        break;
     default:
         LOG("invalid request type (%" PRIu32 ") received", request.type);
         reply.error = EINVAL;
     error_reply:
+        /* Replies to these commands must be structured once negotiated */
+        if (client->structured_reply &&
+            (command == NBD_CMD_READ || command == NBD_CMD_BLOCK_STATUS)) {
+            ret = nbd_co_send_structured_error(req, reply.handle,
+                                               reply.error);
+        } else {
+            ret = nbd_co_send_reply(req, &reply, 0);
+        }
         /* We must disconnect after NBD_CMD_WRITE if we did not
          * read the payload.
          */
-        if (nbd_co_send_reply(req, &reply, 0) < 0 || !req->complete) {
+        if (ret < 0 || !req->complete) {
             goto out;
         }
         break;
@@ -1255,7 +1728,7 @@ static void nbd_unset_handlers(NBDClient *client)
 static void nbd_update_can_read(NBDClient *client)
 {
     bool can_read = client->recv_coroutine ||
-                    client->nb_requests < MAX_NBD_REQUESTS;
+                    client->nb_requests < client->exp->max_requests;
 
     if (can_read != client->can_read) {
         client->can_read = can_read;
@@ -1273,18 +1746,23 @@ static coroutine_fn void nbd_co_client_start(void *opaque)
     NBDExport *exp = client->exp;
 
     if (exp) {
+        aio_context_acquire(exp->ctx);
         nbd_export_get(exp);
+        aio_context_release(exp->ctx);
     }
     if (nbd_negotiate(data)) {
         client_close(client);
         goto out;
     }
     qemu_co_mutex_init(&client->send_lock);
-    nbd_set_handlers(client);
 
+    aio_context_acquire(client->exp->ctx);
+    nbd_set_handlers(client);
     if (exp) {
         QTAILQ_INSERT_TAIL(&exp->clients, client, next);
+        atomic_inc(&exp->nb_clients);
     }
+    aio_context_release(client->exp->ctx);
 out:
     g_free(data);
 }
@@ -0,0 +1,453 @@
+/*
+ * AF_XDP network backend
+ *
+ * Frames move between the interface and QEMU through a UMEM area shared
+ * with the kernel, without going through the network stack.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <net/if.h>
+#include <xdp/xsk.h>
+
+#include "net/net.h"
+#include "clients.h"
+#include "block/aio.h"
+#include "qemu/main-loop.h"
+#include "qemu/error-report.h"
+#include "qemu/iov.h"
+#include "qemu/cutils.h"
+#include "qapi/error.h"
+
+/* Descriptors taken from the RX ring and handed to the peer at a time */
+#define AF_XDP_BATCH 64
+
+typedef struct AFXDPState {
+    NetClientState       nc;
+    struct xsk_socket    *xsk;
+    struct xsk_umem      *umem;
+    struct xsk_ring_cons rx;
+    struct xsk_ring_prod tx;
+    struct xsk_ring_cons cq;
+    struct xsk_ring_prod fq;
+    char                 ifname[IFNAMSIZ];
+    int                  fd;
+    AioContext           *ctx;          /* NULL when polled by the main loop */
+    QEMUBH               *tx_bh;        /* wakes the kernel for queued TX */
+    bool                 read_poll;
+    bool                 write_poll;
+    uint32_t             outstanding_tx;
+    char                 *buffer;       /* the UMEM */
+    uint64_t             *pool;         /* free UMEM frames */
+    uint32_t             n_pool;
+} AFXDPState;
+
+static void af_xdp_send(void *opaque);
+static void af_xdp_writable(void *opaque);
+
+static void af_xdp_update_fd_handler(AFXDPState *s)
+{
+    IOHandler *fd_read = s->read_poll ? af_xdp_send : NULL;
+    IOHandler *fd_write = s->write_poll ? af_xdp_writable : NULL;
+
+    if (s->fd < 0) {
+        return;
+    }
+    if (s->ctx) {
+        aio_set_fd_handler(s->ctx, s->fd, false, fd_read, fd_write, s);
+    } else {
+        qemu_set_fd_handler(s->fd, fd_read, fd_write, s);
+    }
+}
+
+static void af_xdp_read_poll(AFXDPState *s, bool enable)
+{
+    if (s->read_poll != enable) {
+        s->read_poll = enable;
+        af_xdp_update_fd_handler(s);
+    }
+}
+
+static void af_xdp_write_poll(AFXDPState *s, bool enable)
+{
+    if (s->write_poll != enable) {
+        s->write_poll = enable;
+        af_xdp_update_fd_handler(s);
+    }
+}
+
+static void af_xdp_poll(NetClientState *nc, bool enable)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+
+    af_xdp_read_poll(s, enable);
+    af_xdp_write_poll(s, enable);
+}
+
+/* Returns the frames the kernel has finished transmitting to the pool */
+static void af_xdp_complete_tx(AFXDPState *s)
+{
+    uint32_t idx = 0;
+    uint32_t done, i;
+
+    done = xsk_ring_cons__peek(&s->cq, XSK_RING_CONS__DEFAULT_NUM_DESCS, &idx);
+    for (i = 0; i < done; i++) {
+        s->pool[s->n_pool++] = *xsk_ring_cons__comp_addr(&s->cq, idx++);
+    }
+    if (done) {
+        xsk_ring_cons__release(&s->cq, done);
+        s->outstanding_tx -= done;
+    }
+}
+
+/* One wakeup covers every descriptor submitted since the last one, so a
+ * virtio-net TX burst costs a single syscall.
+ */
+static void af_xdp_kick_tx(void *opaque)
+{
+    AFXDPState *s = opaque;
+
+    if (s->outstanding_tx && xsk_ring_prod__needs_wakeup(&s->tx)) {
+        /* EAGAIN, EBUSY and ENOBUFS only mean the kernel is busy */
+        sendto(s->fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+    }
+}
+
+static void af_xdp_writable(void *opaque)
+{
+    AFXDPState *s = opaque;
+
+    af_xdp_complete_tx(s);
+    af_xdp_write_poll(s, false);
+    qemu_flush_queued_packets(&s->nc);
+}
+
+static ssize_t af_xdp_receive_iov(NetClientState *nc,
+                                  const struct iovec *iov, int iovcnt)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+    size_t size = iov_size(iov, iovcnt);
+    struct xdp_desc *desc;
+    uint32_t idx;
+
+    if (size > XSK_UMEM__DEFAULT_FRAME_SIZE) {
+        /* Does not fit in a frame; drop it like an oversized frame */
+        return size;
+    }
+
+    if (!s->n_pool) {
+        af_xdp_complete_tx(s);
+    }
+    if (!s->n_pool || !xsk_ring_prod__reserve(&s->tx, 1, &idx)) {
+        af_xdp_kick_tx(s);
+        af_xdp_write_poll(s, true);
+        return 0;
+    }
+
+    desc = xsk_ring_prod__tx_desc(&s->tx, idx);
+    desc->addr = s->pool[--s->n_pool];
+    desc->len = iov_to_buf(iov, iovcnt, 0,
+                           xsk_umem__get_data(s->buffer, desc->addr), size);
+    xsk_ring_prod__submit(&s->tx, 1);
+    s->outstanding_tx++;
+
+    qemu_bh_schedule(s->tx_bh);
+    return size;
+}
+
+static ssize_t af_xdp_receive(NetClientState *nc,
+                              const uint8_t *buf, size_t size)
+{
+    struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len = size,
+    };
+
+    return af_xdp_receive_iov(nc, &iov, 1);
+}
+
+static void af_xdp_fq_refill(AFXDPState *s, uint32_t n)
+{
+    uint32_t i, idx = 0;
+
+    n = MIN(n, s->n_pool);
+    if (!n || !xsk_ring_prod__reserve(&s->fq, n, &idx)) {
+        return;
+    }
+    for (i = 0; i < n; i++) {
+        *xsk_ring_prod__fill_addr(&s->fq, idx++) = s->pool[--s->n_pool];
+    }
+    xsk_ring_prod__submit(&s->fq, n);
+
+    if (xsk_ring_prod__needs_wakeup(&s->fq)) {
+        recvfrom(s->fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+    }
+}
+
+static void af_xdp_send_completed(NetClientState *nc, ssize_t len)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+
+    af_xdp_read_poll(s, true);
+}
+
+static void af_xdp_send(void *opaque)
+{
+    AFXDPState *s = opaque;
+    struct iovec pkts[AF_XDP_BATCH];
+    uint32_t idx = 0;
+    uint32_t i, n;
+    int queued;
+
+    n = xsk_ring_cons__peek(&s->rx, AF_XDP_BATCH, &idx);
+    if (!n) {
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        const struct xdp_desc *desc = xsk_ring_cons__rx_desc(&s->rx, idx + i);
+
+        pkts[i].iov_base = xsk_umem__get_data(s->buffer, desc->addr);
+        pkts[i].iov_len = desc->len;
+    }
+
+    /* Whatever the peer does not take directly is copied into its queue,
+     * so every frame can go back to the fill ring afterwards.
+     */
+    queued = qemu_send_packet_batch_async(&s->nc, pkts, n,
+                                          af_xdp_send_completed);
+
+    for (i = 0; i < n; i++) {
+        const struct xdp_desc *desc = xsk_ring_cons__rx_desc(&s->rx, idx + i);
+
+        /* RX descriptors point past the headroom; keep the frame start */
+        s->pool[s->n_pool++] = desc->addr &
+                               ~(uint64_t)(XSK_UMEM__DEFAULT_FRAME_SIZE - 1);
+    }
+    xsk_ring_cons__release(&s->rx, n);
+    af_xdp_fq_refill(s, n);
+
+    if (queued < (int)n) {
+        af_xdp_read_poll(s, false);
+    }
+}
+
+static void af_xdp_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+    bool read_poll = s->read_poll;
+    bool write_poll = s->write_poll;
+
+    if (s->ctx == ctx) {
+        return;
+    }
+
+    s->read_poll = false;
+    s->write_poll = false;
+    af_xdp_update_fd_handler(s);
+
+    af_xdp_kick_tx(s);
+    qemu_bh_delete(s->tx_bh);
+    if (ctx) {
+        s->tx_bh = aio_bh_new(ctx, af_xdp_kick_tx, s);
+    } else {
+        s->tx_bh = qemu_bh_new(af_xdp_kick_tx, s);
+    }
+
+    s->ctx = ctx;
+    s->read_poll = read_poll;
+    s->write_poll = write_poll;
+    af_xdp_update_fd_handler(s);
+}
+
+static void af_xdp_cleanup(NetClientState *nc)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+
+    qemu_purge_queued_packets(nc);
+
+    af_xdp_poll(nc, false);
+    s->fd = -1;
+    if (s->tx_bh) {
+        qemu_bh_delete(s->tx_bh);
+        s->tx_bh = NULL;
+    }
+
+    /* Detaches the XDP program along with the last socket */
+    xsk_socket__delete(s->xsk);
+    s->xsk = NULL;
+    xsk_umem__delete(s->umem);
+    s->umem = NULL;
+
+    g_free(s->pool);
+    s->pool = NULL;
+    qemu_vfree(s->buffer);
+    s->buffer = NULL;
+}
+
+static int af_xdp_umem_create(AFXDPState *s, Error **errp)
+{
+    struct xsk_umem_config config = {
+        .fill_size = XSK_RING_PROD__DEFAULT_NUM_DESCS,
+        .comp_size = XSK_RING_CONS__DEFAULT_NUM_DESCS,
+        .frame_size = XSK_UMEM__DEFAULT_FRAME_SIZE,
+        .frame_headroom = 0,
+    };
+    /* Enough frames for all four rings to be full at once */
+    uint64_t n_descs = (XSK_RING_PROD__DEFAULT_NUM_DESCS +
+                        XSK_RING_CONS__DEFAULT_NUM_DESCS) * 2;
+    uint64_t size = n_descs * XSK_UMEM__DEFAULT_FRAME_SIZE;
+    int64_t i;
+    int ret;
+
+    s->buffer = qemu_memalign(getpagesize(), size);
+    memset(s->buffer, 0, size);
+
+    ret = xsk_umem__create(&s->umem, s->buffer, size, &s->fq, &s->cq,
+                           &config);
+    if (ret) {
+        qemu_vfree(s->buffer);
+        s->buffer = NULL;
+        error_setg_errno(errp, -ret, "failed to create UMEM for '%s'",
+                         s->ifname);
+        return -1;
+    }
+
+    s->pool = g_new(uint64_t, n_descs);
+    for (i = n_descs - 1; i >= 0; i--) {
+        s->pool[s->n_pool++] = i * XSK_UMEM__DEFAULT_FRAME_SIZE;
+    }
+    return 0;
+}
+
+static int af_xdp_socket_create(AFXDPState *s,
+                                const NetdevAFXDPOptions *opts,
+                                int queue_id, Error **errp)
+{
+    struct xsk_socket_config cfg = {
+        .rx_size = XSK_RING_CONS__DEFAULT_NUM_DESCS,
+        .tx_size = XSK_RING_PROD__DEFAULT_NUM_DESCS,
+        .bind_flags = XDP_USE_NEED_WAKEUP,
+        .xdp_flags = XDP_FLAGS_UPDATE_IF_NOEXIST,
+    };
+    int ret = -EINVAL;
+
+    if (opts->has_mode) {
+        cfg.xdp_flags |= opts->mode == AFXDP_MODE_NATIVE ?
+                         XDP_FLAGS_DRV_MODE : XDP_FLAGS_SKB_MODE;
+    }
+
+    /* Try zero-copy first unless copying was asked for or implied */
+    if (!(opts->has_force_copy && opts->force_copy) &&
+        !(opts->has_mode && opts->mode == AFXDP_MODE_SKB)) {
+        cfg.bind_flags |= XDP_ZEROCOPY;
+        ret = xsk_socket__create(&s->xsk, s->ifname, queue_id, s->umem,
+                                 &s->rx, &s->tx, &cfg);
+        cfg.bind_flags &= ~XDP_ZEROCOPY;
+    }
+    if (ret) {
+        cfg.bind_flags |= XDP_COPY;
+        ret = xsk_socket__create(&s->xsk, s->ifname, queue_id, s->umem,
+                                 &s->rx, &s->tx, &cfg);
+    }
+    if (ret) {
+        error_setg_errno(errp, -ret, "failed to create AF_XDP socket for "
+                         "queue %d of '%s'", queue_id, s->ifname);
+        return -1;
+    }
+    s->fd = xsk_socket__fd(s->xsk);
+
+    if (opts->has_busy_poll && opts->busy_poll) {
+        int usecs = opts->busy_poll;
+
+        if (setsockopt(s->fd, SOL_SOCKET, SO_BUSY_POLL,
+                       &usecs, sizeof(usecs)) < 0) {
+            error_setg_errno(errp, errno, "failed to enable busy polling "
+                             "on '%s'", s->ifname);
+            return -1;
+        }
+#ifdef SO_PREFER_BUSY_POLL
+        {
+            int one = 1, budget = AF_XDP_BATCH;
+
+            /* Best effort: older kernels lack these */
+            setsockopt(s->fd, SOL_SOCKET, SO_PREFER_BUSY_POLL,
+                       &one, sizeof(one));
+            setsockopt(s->fd, SOL_SOCKET, SO_BUSY_POLL_BUDGET,
+                       &budget, sizeof(budget));
+        }
+#endif
+    }
+
+    af_xdp_fq_refill(s, XSK_RING_PROD__DEFAULT_NUM_DESCS);
+    return 0;
+}
+
+static NetClientInfo net_af_xdp_info = {
+    .type = NET_CLIENT_DRIVER_AF_XDP,
+    .size = sizeof(AFXDPState),
+    .receive = af_xdp_receive,
+    .receive_iov = af_xdp_receive_iov,
+    .poll = af_xdp_poll,
+    .cleanup = af_xdp_cleanup,
+    .set_aio_context = af_xdp_set_aio_context,
+};
+
+int net_init_af_xdp(const Netdev *netdev,
+                    const char *name, NetClientState *peer, Error **errp)
+{
+    const NetdevAFXDPOptions *opts = &netdev->u.af_xdp;
+    NetClientState *nc, *nc0 = NULL;
+    int64_t queues, start_queue, i;
+    Error *err = NULL;
+    AFXDPState *s;
+
+    assert(netdev->type == NET_CLIENT_DRIVER_AF_XDP);
+
+    if (!if_nametoindex(opts->ifname)) {
+        error_setg_errno(errp, errno, "failed to find interface '%s'",
+                         opts->ifname);
+        return -1;
+    }
+
+    queues = opts->has_queues ? opts->queues : 1;
+    start_queue = opts->has_start_queue ? opts->start_queue : 0;
+    if (queues < 1 || queues > MAX_QUEUE_NUM || start_queue < 0) {
+        error_setg(errp, "invalid queues=%" PRId64 ",start-queue=%" PRId64
+                   " for '%s'", queues, start_queue, opts->ifname);
+        return -1;
+    }
+
+    for (i = 0; i < queues; i++) {
+        nc = qemu_new_net_client(&net_af_xdp_info, peer, "af-xdp", name);
+        nc->queue_index = i;
+        snprintf(nc->info_str, sizeof(nc->info_str),
+                 "ifname=%s,queue=%" PRId64, opts->ifname, start_queue + i);
+        if (!nc0) {
+            nc0 = nc;
+        }
+
+        s = DO_UPCAST(AFXDPState, nc, nc);
+        s->fd = -1;
+        pstrcpy(s->ifname, sizeof(s->ifname), opts->ifname);
+
+        if (af_xdp_umem_create(s, &err) < 0 ||
+            af_xdp_socket_create(s, opts, start_queue + i, &err) < 0) {
+            goto err;
+        }
+
+        s->tx_bh = qemu_bh_new(af_xdp_kick_tx, s);
+        af_xdp_read_poll(s, true);
+    }
+
+    return 0;
+
+err:
+    qemu_del_net_client(nc0);
+    error_propagate(errp, err);
+    return -1;
+}
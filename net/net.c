@@ -520,6 +520,20 @@ int qemu_set_vnet_be(NetClientState *nc, bool is_be)
 #endif
 }
 
+bool qemu_net_client_has_aio_context(NetClientState *nc)
+{
+    return nc && nc->info->set_aio_context;
+}
+
+void qemu_net_client_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    if (!nc || !nc->info->set_aio_context) {
+        return;
+    }
+
+    nc->info->set_aio_context(nc, ctx);
+}
+
 int qemu_can_send_packet(NetClientState *sender)
 {
     int vm_running = runstate_is_running();
@@ -667,6 +681,63 @@ ssize_t qemu_send_packet_async(NetClientState *sender,
                                              buf, size, sent_cb);
 }
 
+/* Send COUNT packets, each contiguous in PKTS[i], with one call into a peer
+ * that implements receive_batch, as long as no filter or queued packet is in
+ * the way.  The packets it does not take go through qemu_send_packet_async.
+ *
+ * Returns the index of the first packet that was queued, which like a zero
+ * return from qemu_send_packet_async means that the sender must stop until
+ * SENT_CB is called, or COUNT if none was.
+ */
+int qemu_send_packet_batch_async(NetClientState *sender,
+                                 const struct iovec *pkts, int count,
+                                 NetPacketSent *sent_cb)
+{
+    NetClientState *peer = sender->peer;
+    int i = 0, queued = count;
+
+    if (sender->link_down || !peer) {
+        return count;
+    }
+
+    if (peer->info->receive_batch && !peer->link_down &&
+        !peer->receive_disabled &&
+        QTAILQ_EMPTY(&sender->filters) && QTAILQ_EMPTY(&peer->filters) &&
+        !qemu_net_queue_busy(peer->incoming_queue) &&
+        qemu_can_send_packet(sender)) {
+        i = peer->info->receive_batch(peer, pkts, count);
+        i = MAX(i, 0);
+    }
+
+    for (; i < count; i++) {
+        if (qemu_send_packet_async(sender, pkts[i].iov_base, pkts[i].iov_len,
+                                   sent_cb) == 0 && queued == count) {
+            queued = i;
+        }
+    }
+    return queued;
+}
+
+ssize_t qemu_sendv_packet_zerocopy(NetClientState *sender,
+                                   const struct iovec *iov, int iovcnt,
+                                   NetZerocopyDone *done, void *opaque)
+{
+    NetClientState *peer = sender->peer;
+
+    /* Filters and the incoming queue may hold on to the packet, and the
+     * queue must not be overtaken.
+     */
+    if (sender->link_down || !peer || !peer->info->receive_zerocopy ||
+        peer->link_down || peer->receive_disabled ||
+        !QTAILQ_EMPTY(&sender->filters) || !QTAILQ_EMPTY(&peer->filters) ||
+        qemu_net_queue_busy(peer->incoming_queue) ||
+        !qemu_can_send_packet(sender)) {
+        return -ENOTSUP;
+    }
+
+    return peer->info->receive_zerocopy(peer, iov, iovcnt, done, opaque);
+}
+
 void qemu_send_packet(NetClientState *nc, const uint8_t *buf, int size)
 {
     qemu_send_packet_async(nc, buf, size, NULL);
@@ -945,6 +1016,9 @@ static int (* const net_client_init_fun[NET_CLIENT_DRIVER__MAX])(
 #endif
 #ifdef CONFIG_NETMAP
         [NET_CLIENT_DRIVER_NETMAP]    = net_init_netmap,
+#endif
+#ifdef CONFIG_AF_XDP
+        [NET_CLIENT_DRIVER_AF_XDP]    = net_init_af_xdp,
 #endif
         [NET_CLIENT_DRIVER_DUMP]      = net_init_dump,
 #ifdef CONFIG_NET_BRIDGE
@@ -25,6 +25,7 @@
 #include "net/queue.h"
 #include "qemu/queue.h"
 #include "net/net.h"
+#include "qemu/iov.h"
 
 /* The delivery handler may only return zero if it will call
  * qemu_net_queue_flush() when it determines that it is once again able
@@ -40,15 +41,26 @@
  * unbounded queueing.
  */
 
+/* Packets that fit in NET_QUEUE_SLAB_SIZE bytes are copied into one of
+ * NET_QUEUE_SLABS slabs allocated together the first time the queue has to
+ * hold a packet; larger ones, or any beyond the slabs, use the heap.
+ */
+#define NET_QUEUE_SLAB_SIZE 2048
+#define NET_QUEUE_SLABS     128
+
 struct NetPacket {
     QTAILQ_ENTRY(NetPacket) entry;
     NetClientState *sender;
     unsigned flags;
     int size;
     NetPacketSent *sent_cb;
+    bool in_slab;
     uint8_t data[0];
 };
 
+#define NET_QUEUE_SLAB_STRIDE \
+    QEMU_ALIGN_UP(sizeof(NetPacket) + NET_QUEUE_SLAB_SIZE, sizeof(void *))
+
 struct NetQueue {
     void *opaque;
     uint32_t nq_maxlen;
@@ -57,6 +69,10 @@ struct NetQueue {
 
     QTAILQ_HEAD(packets, NetPacket) packets;
 
+    uint8_t *slabs;
+    NetPacket **free_slabs;
+    unsigned nr_free_slabs;
+
     unsigned delivering : 1;
 };
 
@@ -78,15 +94,58 @@ NetQueue *qemu_new_net_queue(NetQueueDeliverFunc *deliver, void *opaque)
     return queue;
 }
 
+static NetPacket *qemu_net_queue_alloc(NetQueue *queue, size_t size)
+{
+    NetPacket *packet;
+    int i;
+
+    if (size > NET_QUEUE_SLAB_SIZE) {
+        goto heap;
+    }
+
+    if (!queue->slabs) {
+        queue->slabs = g_malloc(NET_QUEUE_SLABS * NET_QUEUE_SLAB_STRIDE);
+        queue->free_slabs = g_new(NetPacket *, NET_QUEUE_SLABS);
+        for (i = 0; i < NET_QUEUE_SLABS; i++) {
+            queue->free_slabs[i] = (NetPacket *)(queue->slabs +
+                                    (NET_QUEUE_SLABS - 1 - i) *
+                                    NET_QUEUE_SLAB_STRIDE);
+        }
+        queue->nr_free_slabs = NET_QUEUE_SLABS;
+    }
+
+    if (queue->nr_free_slabs) {
+        packet = queue->free_slabs[--queue->nr_free_slabs];
+        packet->in_slab = true;
+        return packet;
+    }
+
+heap:
+    packet = g_malloc(sizeof(NetPacket) + size);
+    packet->in_slab = false;
+    return packet;
+}
+
+static void qemu_net_queue_free(NetQueue *queue, NetPacket *packet)
+{
+    if (packet->in_slab) {
+        queue->free_slabs[queue->nr_free_slabs++] = packet;
+    } else {
+        g_free(packet);
+    }
+}
+
 void qemu_del_net_queue(NetQueue *queue)
 {
     NetPacket *packet, *next;
 
     QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
         QTAILQ_REMOVE(&queue->packets, packet, entry);
-        g_free(packet);
+        qemu_net_queue_free(queue, packet);
     }
 
+    g_free(queue->free_slabs);
+    g_free(queue->slabs);
     g_free(queue);
 }
 
@@ -102,7 +161,7 @@ static void qemu_net_queue_append(NetQueue *queue,
     if (queue->nq_count >= queue->nq_maxlen && !sent_cb) {
         return; /* drop if queue full and no callback */
     }
-    packet = g_malloc(sizeof(NetPacket) + size);
+    packet = qemu_net_queue_alloc(queue, size);
     packet->sender = sender;
     packet->flags = flags;
     packet->size = size;
@@ -127,11 +186,9 @@ void qemu_net_queue_append_iov(NetQueue *queue,
     if (queue->nq_count >= queue->nq_maxlen && !sent_cb) {
         return; /* drop if queue full and no callback */
     }
-    for (i = 0; i < iovcnt; i++) {
-        max_len += iov[i].iov_len;
-    }
+    max_len = iov_size(iov, iovcnt);
 
-    packet = g_malloc(sizeof(NetPacket) + max_len);
+    packet = qemu_net_queue_alloc(queue, max_len);
     packet->sender = sender;
     packet->sent_cb = sent_cb;
     packet->flags = flags;
@@ -243,7 +300,7 @@ void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
             if (packet->sent_cb) {
                 packet->sent_cb(packet->sender, 0);
             }
-            g_free(packet);
+            qemu_net_queue_free(queue, packet);
         }
     }
 }
@@ -273,7 +330,15 @@ bool qemu_net_queue_flush(NetQueue *queue)
             packet->sent_cb(packet->sender, ret);
         }
 
-        g_free(packet);
+        qemu_net_queue_free(queue, packet);
     }
     return true;
 }
+
+/* A sender that bypasses qemu_net_queue_send must not overtake the packets
+ * that are queued or being delivered.
+ */
+bool qemu_net_queue_busy(NetQueue *queue)
+{
+    return queue->delivering || !QTAILQ_EMPTY(&queue->packets);
+}
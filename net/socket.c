@@ -33,6 +33,24 @@
 #include "qemu/sockets.h"
 #include "qemu/iov.h"
 #include "qemu/main-loop.h"
+#include "qemu/queue.h"
+
+#ifdef CONFIG_MSG_ZEROCOPY
+#include <linux/errqueue.h>
+
+/* A datagram sent with MSG_ZEROCOPY, waiting for the kernel to let go */
+typedef struct NetSocketZcReq {
+    uint32_t id;
+    NetZerocopyDone *done;
+    void *opaque;
+    QTAILQ_ENTRY(NetSocketZcReq) next;
+} NetSocketZcReq;
+#endif
+
+#ifdef CONFIG_RECVMMSG
+/* Datagrams read by one recvmmsg call */
+#define SOCKET_RX_BATCH 8
+#endif
 
 typedef struct NetSocketState {
     NetClientState nc;
@@ -44,13 +62,33 @@ typedef struct NetSocketState {
     IOHandler *send_fn;           /* differs between SOCK_STREAM/SOCK_DGRAM */
     bool read_poll;               /* waiting to receive data? */
     bool write_poll;              /* waiting to transmit data? */
+#ifdef CONFIG_RECVMMSG
+    uint8_t (*dgram_buf)[NET_BUFSIZE]; /* SOCKET_RX_BATCH datagrams (only SOCK_DGRAM) */
+#endif
+#ifdef CONFIG_MSG_ZEROCOPY
+    int zerocopy;                 /* SO_ZEROCOPY: 1 set, -1 refused, 0 untried */
+    uint32_t zc_next_id;          /* id the kernel gives the next zerocopy send */
+    QTAILQ_HEAD(, NetSocketZcReq) zc_reqs;
+#endif
 } NetSocketState;
 
 static void net_socket_accept(void *opaque);
 static void net_socket_writable(void *opaque);
 
+#ifdef CONFIG_MSG_ZEROCOPY
+static void net_socket_readable(void *opaque);
+#endif
+
 static void net_socket_update_fd_handler(NetSocketState *s)
 {
+#ifdef CONFIG_MSG_ZEROCOPY
+    /* Completions arrive as POLLERR, which comes with the read handler */
+    if (!QTAILQ_EMPTY(&s->zc_reqs)) {
+        qemu_set_fd_handler(s->fd, net_socket_readable,
+                            s->write_poll ? net_socket_writable : NULL, s);
+        return;
+    }
+#endif
     qemu_set_fd_handler(s->fd,
                         s->read_poll ? s->send_fn : NULL,
                         s->write_poll ? net_socket_writable : NULL,
@@ -131,6 +169,105 @@ static ssize_t net_socket_receive_dgram(NetClientState *nc, const uint8_t *buf,
     return ret;
 }
 
+#ifdef CONFIG_MSG_ZEROCOPY
+static void net_socket_zerocopy_done(NetSocketState *s, uint32_t lo,
+                                     uint32_t hi)
+{
+    NetSocketZcReq *req, *next;
+
+    QTAILQ_FOREACH_SAFE(req, &s->zc_reqs, next, next) {
+        if (req->id - lo <= hi - lo) {
+            QTAILQ_REMOVE(&s->zc_reqs, req, next);
+            req->done(req->opaque);
+            g_free(req);
+        }
+    }
+}
+
+/* Reads the ranges of zerocopy sends the kernel has completed */
+static void net_socket_zerocopy_poll(NetSocketState *s)
+{
+    for (;;) {
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err)) +
+                     CMSG_SPACE(sizeof(struct sockaddr_in))];
+        struct msghdr msg = {
+            .msg_control = control,
+            .msg_controllen = sizeof(control),
+        };
+        struct cmsghdr *cm;
+
+        if (recvmsg(s->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            break;
+        }
+        for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            struct sock_extended_err *ee = (void *)CMSG_DATA(cm);
+
+            if (ee->ee_origin == SO_EE_ORIGIN_ZEROCOPY && ee->ee_errno == 0) {
+                net_socket_zerocopy_done(s, ee->ee_info, ee->ee_data);
+            }
+        }
+    }
+    if (QTAILQ_EMPTY(&s->zc_reqs)) {
+        net_socket_update_fd_handler(s);
+    }
+}
+
+static void net_socket_readable(void *opaque)
+{
+    NetSocketState *s = opaque;
+
+    net_socket_zerocopy_poll(s);
+    if (s->read_poll && s->fd != -1) {
+        s->send_fn(s);
+    }
+}
+
+static ssize_t net_socket_receive_zerocopy(NetClientState *nc,
+                                           const struct iovec *iov, int iovcnt,
+                                           NetZerocopyDone *done, void *opaque)
+{
+    NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
+    struct msghdr msg = {
+        .msg_name = &s->dgram_dst,
+        .msg_namelen = sizeof(s->dgram_dst),
+        .msg_iov = (struct iovec *)iov,
+        .msg_iovlen = iovcnt,
+    };
+    NetSocketZcReq *req;
+    ssize_t ret;
+
+    if (s->zerocopy == 0) {
+        int one = 1;
+
+        s->zerocopy = setsockopt(s->fd, SOL_SOCKET, SO_ZEROCOPY,
+                                 &one, sizeof(one)) < 0 ? -1 : 1;
+    }
+    if (s->zerocopy < 0) {
+        return -ENOTSUP;
+    }
+
+    do {
+        ret = sendmsg(s->fd, &msg, MSG_ZEROCOPY);
+    } while (ret == -1 && errno == EINTR);
+    if (ret == -1) {
+        /* ENOBUFS: too much pinned memory; the copying path will cope */
+        return -errno;
+    }
+
+    req = g_new(NetSocketZcReq, 1);
+    req->id = s->zc_next_id++;
+    req->done = done;
+    req->opaque = opaque;
+    if (QTAILQ_EMPTY(&s->zc_reqs)) {
+        QTAILQ_INSERT_TAIL(&s->zc_reqs, req, next);
+        net_socket_update_fd_handler(s);
+    } else {
+        QTAILQ_INSERT_TAIL(&s->zc_reqs, req, next);
+    }
+    return ret;
+}
+#endif
+
 static void net_socket_send_completed(NetClientState *nc, ssize_t len)
 {
     NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
@@ -189,6 +326,50 @@ static void net_socket_send(void *opaque)
     }
 }
 
+#ifdef CONFIG_RECVMMSG
+static void net_socket_send_dgram(void *opaque)
+{
+    NetSocketState *s = opaque;
+    struct mmsghdr msgs[SOCKET_RX_BATCH];
+    struct iovec iov[SOCKET_RX_BATCH];
+    bool eof = false;
+    int i, n;
+
+    memset(msgs, 0, sizeof(msgs));
+    for (i = 0; i < SOCKET_RX_BATCH; i++) {
+        iov[i].iov_base = s->dgram_buf[i];
+        iov[i].iov_len = sizeof(s->dgram_buf[i]);
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    do {
+        n = recvmmsg(s->fd, msgs, SOCKET_RX_BATCH, MSG_DONTWAIT, NULL);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) {
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (msgs[i].msg_len == 0) {
+            /* end of connection */
+            eof = true;
+            break;
+        }
+        iov[i].iov_len = msgs[i].msg_len;
+    }
+    n = i;
+
+    if (n && qemu_send_packet_batch_async(&s->nc, iov, n,
+                                          net_socket_send_completed) < n) {
+        net_socket_read_poll(s, false);
+    }
+    if (eof || n == 0) {
+        net_socket_read_poll(s, false);
+        net_socket_write_poll(s, false);
+    }
+}
+#else
 static void net_socket_send_dgram(void *opaque)
 {
     NetSocketState *s = opaque;
@@ -208,6 +389,7 @@ static void net_socket_send_dgram(void *opaque)
         net_socket_read_poll(s, false);
     }
 }
+#endif
 
 static int net_socket_mcast_create(struct sockaddr_in *mcastaddr, struct in_addr *localaddr)
 {
@@ -297,6 +479,10 @@ fail:
 static void net_socket_cleanup(NetClientState *nc)
 {
     NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
+#ifdef CONFIG_MSG_ZEROCOPY
+    /* Closing the socket drops the kernel's interest in the buffers */
+    net_socket_zerocopy_done(s, 0, UINT32_MAX);
+#endif
     if (s->fd != -1) {
         net_socket_read_poll(s, false);
         net_socket_write_poll(s, false);
@@ -308,12 +494,19 @@ static void net_socket_cleanup(NetClientState *nc)
         closesocket(s->listen_fd);
         s->listen_fd = -1;
     }
+#ifdef CONFIG_RECVMMSG
+    g_free(s->dgram_buf);
+    s->dgram_buf = NULL;
+#endif
 }
 
 static NetClientInfo net_dgram_socket_info = {
     .type = NET_CLIENT_DRIVER_SOCKET,
     .size = sizeof(NetSocketState),
     .receive = net_socket_receive_dgram,
+#ifdef CONFIG_MSG_ZEROCOPY
+    .receive_zerocopy = net_socket_receive_zerocopy,
+#endif
     .cleanup = net_socket_cleanup,
 };
 
@@ -366,6 +559,12 @@ static NetSocketState *net_socket_fd_init_dgram(NetClientState *peer,
     s->fd = fd;
     s->listen_fd = -1;
     s->send_fn = net_socket_send_dgram;
+#ifdef CONFIG_RECVMMSG
+    s->dgram_buf = g_malloc(SOCKET_RX_BATCH * sizeof(*s->dgram_buf));
+#endif
+#ifdef CONFIG_MSG_ZEROCOPY
+    QTAILQ_INIT(&s->zc_reqs);
+#endif
     net_socket_rs_init(&s->rs, net_socket_rs_finalize);
     net_socket_read_poll(s, true);
 
@@ -40,22 +40,27 @@
 #include "qemu-common.h"
 #include "qemu/cutils.h"
 #include "qemu/error-report.h"
+#include "block/aio.h"
 
 #include "net/tap.h"
 
 #include "net/vhost_net.h"
 
+/* Packets read by tap_send before handing them to the peer */
+#define TAP_RX_BATCH 8
+
 typedef struct TAPState {
     NetClientState nc;
     int fd;
     char down_script[1024];
     char down_script_arg[128];
-    uint8_t buf[NET_BUFSIZE];
+    uint8_t buf[TAP_RX_BATCH][NET_BUFSIZE];
     bool read_poll;
     bool write_poll;
     bool using_vnet_hdr;
     bool has_ufo;
     bool enabled;
+    AioContext *ctx;              /* NULL when polled by the main loop */
     VHostNetState *vhost_net;
     unsigned host_vnet_hdr_len;
     Notifier exit;
@@ -69,10 +74,14 @@ static void tap_writable(void *opaque);
 
 static void tap_update_fd_handler(TAPState *s)
 {
-    qemu_set_fd_handler(s->fd,
-                        s->read_poll && s->enabled ? tap_send : NULL,
-                        s->write_poll && s->enabled ? tap_writable : NULL,
-                        s);
+    IOHandler *fd_read = s->read_poll && s->enabled ? tap_send : NULL;
+    IOHandler *fd_write = s->write_poll && s->enabled ? tap_writable : NULL;
+
+    if (s->ctx) {
+        aio_set_fd_handler(s->ctx, s->fd, false, fd_read, fd_write, s);
+    } else {
+        qemu_set_fd_handler(s->fd, fd_read, fd_write, s);
+    }
 }
 
 static void tap_read_poll(TAPState *s, bool enable)
@@ -179,16 +188,15 @@ static void tap_send_completed(NetClientState *nc, ssize_t len)
     tap_read_poll(s, true);
 }
 
-static void tap_send(void *opaque)
+/* Read up to TAP_RX_BATCH packets into s->buf and describe them in PKTS */
+static int tap_read_batch(TAPState *s, struct iovec *pkts)
 {
-    TAPState *s = opaque;
-    int size;
-    int packets = 0;
+    int n, size;
 
-    while (true) {
-        uint8_t *buf = s->buf;
+    for (n = 0; n < TAP_RX_BATCH; n++) {
+        uint8_t *buf = s->buf[n];
 
-        size = tap_read_packet(s->fd, s->buf, sizeof(s->buf));
+        size = tap_read_packet(s->fd, buf, sizeof(s->buf[n]));
         if (size <= 0) {
             break;
         }
@@ -198,11 +206,35 @@ static void tap_send(void *opaque)
             size -= s->host_vnet_hdr_len;
         }
 
-        size = qemu_send_packet_async(&s->nc, buf, size, tap_send_completed);
-        if (size == 0) {
+        pkts[n].iov_base = buf;
+        pkts[n].iov_len = size;
+    }
+    return n;
+}
+
+static void tap_send(void *opaque)
+{
+    TAPState *s = opaque;
+    struct iovec pkts[TAP_RX_BATCH];
+    int n;
+    int packets = 0;
+
+    while (true) {
+        n = tap_read_batch(s, pkts);
+        if (n == 0) {
+            break;
+        }
+
+        /* The peer gets the whole batch at once, and can notify the guest
+         * once for it.
+         */
+        if (qemu_send_packet_batch_async(&s->nc, pkts, n,
+                                         tap_send_completed) < n) {
             tap_read_poll(s, false);
             break;
-        } else if (size < 0) {
+        }
+        if (n < TAP_RX_BATCH) {
+            /* drained */
             break;
         }
 
@@ -212,7 +244,7 @@ static void tap_send(void *opaque)
          * packets that are processed per tap_send() callback to prevent
          * stalling the guest.
          */
-        packets++;
+        packets += n;
         if (packets >= 50) {
             break;
         }
@@ -334,6 +366,26 @@ static void tap_poll(NetClientState *nc, bool enable)
     tap_write_poll(s, enable);
 }
 
+static void tap_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+    bool read_poll = s->read_poll;
+    bool write_poll = s->write_poll;
+
+    if (s->ctx == ctx) {
+        return;
+    }
+
+    s->read_poll = false;
+    s->write_poll = false;
+    tap_update_fd_handler(s);
+
+    s->ctx = ctx;
+    s->read_poll = read_poll;
+    s->write_poll = write_poll;
+    tap_update_fd_handler(s);
+}
+
 int tap_get_fd(NetClientState *nc)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
@@ -359,6 +411,7 @@ static NetClientInfo net_tap_info = {
     .set_vnet_hdr_len = tap_set_vnet_hdr_len,
     .set_vnet_le = tap_set_vnet_le,
     .set_vnet_be = tap_set_vnet_be,
+    .set_aio_context = tap_set_aio_context,
 };
 
 static TAPState *net_tap_fd_init(NetClientState *peer,
@@ -12,6 +12,7 @@
 #include "clients.h"
 #include "net/vhost_net.h"
 #include "net/vhost-user.h"
+#include "hw/virtio/vhost.h"
 #include "sysemu/char.h"
 #include "qemu/config-file.h"
 #include "qemu/error-report.h"
@@ -24,6 +25,7 @@ typedef struct VhostUserState {
     VHostNetState *vhost_net;
     guint watch;
     uint64_t acked_features;
+    struct vhost_inflight inflight;     /* kept across reconnections */
     bool started;
 } VhostUserState;
 
@@ -46,6 +48,13 @@ uint64_t vhost_user_get_acked_features(NetClientState *nc)
     return s->acked_features;
 }
 
+struct vhost_inflight *vhost_user_get_inflight(NetClientState *nc)
+{
+    VhostUserState *s = DO_UPCAST(VhostUserState, nc, nc);
+    assert(nc->info->type == NET_CLIENT_DRIVER_VHOST_USER);
+    return &s->inflight;
+}
+
 static void vhost_user_stop(int queues, NetClientState *ncs[])
 {
     VhostUserState *s;
@@ -155,6 +164,7 @@ static void vhost_user_cleanup(NetClientState *nc)
         g_free(s->vhost_net);
         s->vhost_net = NULL;
     }
+    vhost_dev_free_inflight(&s->inflight);
     if (s->chr) {
         qemu_chr_add_handlers(s->chr, NULL, NULL, NULL, NULL);
         qemu_chr_fe_release(s->chr);
@@ -1,6 +1,8 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is set associative: a page can live in any of the
+ * CACHE_WAYS entries of the set selected by its address, and the
+ * least recently used entry of the set is replaced
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -29,6 +31,9 @@
 /* the page in cache will not be replaced in two cycles */
 #define CACHED_PAGE_LIFETIME 2
 
+/* entries per set */
+#define CACHE_WAYS 4
+
 typedef struct CacheItem CacheItem;
 
 struct CacheItem {
@@ -43,6 +48,7 @@ struct PageCache {
     int64_t max_num_items;
     uint64_t max_item_age;
     int64_t num_items;
+    unsigned int num_ways;
 };
 
 PageCache *cache_init(int64_t num_pages, unsigned int page_size)
@@ -71,6 +77,7 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
     cache->num_items = 0;
     cache->max_item_age = 0;
     cache->max_num_items = num_pages;
+    cache->num_ways = MIN(num_pages, CACHE_WAYS);
 
     DPRINTF("Setting cache buckets to %" PRId64 "\n", cache->max_num_items);
 
@@ -108,28 +115,61 @@ void cache_fini(PageCache *cache)
     g_free(cache);
 }
 
-static size_t cache_get_cache_pos(const PageCache *cache,
-                                  uint64_t address)
+/* First entry of the set that @address maps to */
+static CacheItem *cache_get_set(const PageCache *cache, uint64_t address)
 {
+    size_t set;
+
+    g_assert(cache);
+    g_assert(cache->page_cache);
     g_assert(cache->max_num_items);
-    return (address / cache->page_size) & (cache->max_num_items - 1);
+
+    set = (address / cache->page_size) &
+          (cache->max_num_items / cache->num_ways - 1);
+
+    return &cache->page_cache[set * cache->num_ways];
 }
 
+/* The entry holding @addr, or NULL if it is not cached */
 static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
+    CacheItem *set = cache_get_set(cache, addr);
+    unsigned int i;
 
-    g_assert(cache);
-    g_assert(cache->page_cache);
+    for (i = 0; i < cache->num_ways; i++) {
+        if (set[i].it_addr == addr) {
+            return &set[i];
+        }
+    }
+    return NULL;
+}
 
-    pos = cache_get_cache_pos(cache, addr);
+/* The entry to use for @addr: the one already holding it, else an empty
+ * one, else the least recently used one of the set
+ */
+static CacheItem *cache_get_victim(const PageCache *cache, uint64_t addr)
+{
+    CacheItem *set = cache_get_set(cache, addr);
+    CacheItem *victim = NULL;
+    unsigned int i;
 
-    return &cache->page_cache[pos];
+    for (i = 0; i < cache->num_ways; i++) {
+        if (set[i].it_addr == addr) {
+            return &set[i];
+        }
+        if (!victim || !set[i].it_data ||
+            (victim->it_data && set[i].it_age < victim->it_age)) {
+            victim = &set[i];
+        }
+    }
+    return victim;
 }
 
 uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
 {
-    return cache_get_by_addr(cache, addr)->it_data;
+    CacheItem *it = cache_get_by_addr(cache, addr);
+
+    return it ? it->it_data : NULL;
 }
 
 bool cache_is_cached(const PageCache *cache, uint64_t addr,
@@ -139,7 +179,7 @@ bool cache_is_cached(const PageCache *cache, uint64_t addr,
 
     it = cache_get_by_addr(cache, addr);
 
-    if (it->it_addr == addr) {
+    if (it) {
         /* update the it_age when the cache hit */
         it->it_age = current_age;
         return true;
@@ -154,11 +194,11 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
     CacheItem *it;
 
     /* actual update of entry */
-    it = cache_get_by_addr(cache, addr);
+    it = cache_get_victim(cache, addr);
 
     if (it->it_data && it->it_addr != addr &&
         it->it_age + CACHED_PAGE_LIFETIME > current_age) {
-        /* the cache page is fresh, don't replace it */
+        /* even the oldest page of the set is fresh, don't replace it */
         return -1;
     }
     /* allocate page */
@@ -209,7 +249,7 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
         old_it = &cache->page_cache[i];
         if (old_it->it_addr != -1) {
             /* check for collision, if there is, keep MRU page */
-            new_it = cache_get_by_addr(new_cache, old_it->it_addr);
+            new_it = cache_get_victim(new_cache, old_it->it_addr);
             if (new_it->it_data && new_it->it_age >= old_it->it_age) {
                 /* keep the MRU page */
                 g_free(old_it->it_data);
@@ -229,6 +269,7 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
     cache->page_cache = new_cache->page_cache;
     cache->max_num_items = new_cache->max_num_items;
     cache->num_items = new_cache->num_items;
+    cache->num_ways = new_cache->num_ways;
 
     g_free(new_cache);
 
@@ -28,6 +28,7 @@
 #include "qapi/qmp-output-visitor.h"
 #include "qapi/qmp/qerror.h"
 #include "qapi/qmp/qjson.h"
+#include "qapi/qmp/types.h"
 #include "qemu/cutils.h"
 #include "qemu/config-file.h"
 #include "qemu/option.h"
@@ -59,6 +60,10 @@ enum {
     OPTION_PATTERN = 260,
     OPTION_FLUSH_INTERVAL = 261,
     OPTION_NO_DRAIN = 262,
+    OPTION_RANDOM = 263,
+    OPTION_RWMIXREAD = 264,
+    OPTION_JOBS = 265,
+    OPTION_RUNTIME = 266,
 };
 
 typedef enum OutputFormat {
@@ -149,6 +154,8 @@ static void QEMU_NORETURN help(void)
            "  '--output' takes the format in which the output must be done (human or json)\n"
            "  '-n' skips the target volume creation (useful if the volume is created\n"
            "       prior to running qemu-img)\n"
+           "  '-m' number of parallel coroutines for convert (1 to 16, default 8)\n"
+           "  '-W' allows convert to write to the target out of order\n"
            "\n"
            "Parameters to check subcommand:\n"
            "  '-r' tries to repair any inconsistencies that are found during the check.\n"
@@ -1431,6 +1438,8 @@ enum ImgConvertBlockStatus {
     BLK_BACKING_FILE,
 };
 
+#define MAX_COROUTINES 16
+
 typedef struct ImgConvertState {
     BlockBackend **src;
     int64_t *src_sectors;
@@ -1447,15 +1456,30 @@ typedef struct ImgConvertState {
     int min_sparse;
     size_t cluster_sectors;
     size_t buf_sectors;
+
+    /* Copy loop, shared by the worker coroutines.  lock protects
+     * sector_num and the block status fields above. */
+    CoMutex lock;
+    int64_t sector_num;
+    int64_t allocated_done;
+    bool wr_in_order;
+    int64_t wr_offs;
+    int num_coroutines;
+    int running_coroutines;
+    Coroutine *co[MAX_COROUTINES];
+    int64_t wait_sector_num[MAX_COROUTINES];
+    int ret;
 } ImgConvertState;
 
-static void convert_select_part(ImgConvertState *s, int64_t sector_num)
+static void convert_select_part(ImgConvertState *s, int64_t sector_num,
+                                int *src_cur, int64_t *src_cur_offset)
 {
-    assert(sector_num >= s->src_cur_offset);
-    while (sector_num - s->src_cur_offset >= s->src_sectors[s->src_cur]) {
-        s->src_cur_offset += s->src_sectors[s->src_cur];
-        s->src_cur++;
-        assert(s->src_cur < s->src_num);
+    *src_cur = 0;
+    *src_cur_offset = 0;
+    while (sector_num - *src_cur_offset >= s->src_sectors[*src_cur]) {
+        *src_cur_offset += s->src_sectors[*src_cur];
+        (*src_cur)++;
+        assert(*src_cur < s->src_num);
     }
 }
 
@@ -1464,7 +1488,7 @@ static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
     int64_t ret;
     int n;
 
-    convert_select_part(s, sector_num);
+    convert_select_part(s, sector_num, &s->src_cur, &s->src_cur_offset);
 
     assert(s->total_sectors > sector_num);
     n = MIN(s->total_sectors - sector_num, BDRV_REQUEST_MAX_SECTORS);
@@ -1527,8 +1551,8 @@ static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
     return n;
 }
 
-static int convert_read(ImgConvertState *s, int64_t sector_num, int nb_sectors,
-                        uint8_t *buf)
+static int coroutine_fn convert_co_read(ImgConvertState *s, int64_t sector_num,
+                                        int nb_sectors, uint8_t *buf)
 {
     int n;
     int ret;
@@ -1536,19 +1560,26 @@ static int convert_read(ImgConvertState *s, int64_t sector_num, int nb_sectors,
     assert(nb_sectors <= s->buf_sectors);
     while (nb_sectors > 0) {
         BlockBackend *blk;
-        int64_t bs_sectors;
+        int src_cur;
+        int64_t bs_sectors, src_cur_offset;
+        QEMUIOVector qiov;
+        struct iovec iov;
 
         /* In the case of compression with multiple source files, we can get a
          * nb_sectors that spreads into the next part. So we must be able to
-         * read across multiple BDSes for one convert_read() call. */
-        convert_select_part(s, sector_num);
-        blk = s->src[s->src_cur];
-        bs_sectors = s->src_sectors[s->src_cur];
-
-        n = MIN(nb_sectors, bs_sectors - (sector_num - s->src_cur_offset));
-        ret = blk_pread(blk,
-                        (sector_num - s->src_cur_offset) << BDRV_SECTOR_BITS,
-                        buf, n << BDRV_SECTOR_BITS);
+         * read across multiple BDSes for one convert_co_read() call. */
+        convert_select_part(s, sector_num, &src_cur, &src_cur_offset);
+        blk = s->src[src_cur];
+        bs_sectors = s->src_sectors[src_cur];
+
+        n = MIN(nb_sectors, bs_sectors - (sector_num - src_cur_offset));
+        iov.iov_base = buf;
+        iov.iov_len = n << BDRV_SECTOR_BITS;
+        qemu_iovec_init_external(&qiov, &iov, 1);
+
+        ret = blk_co_preadv(blk,
+                            (sector_num - src_cur_offset) << BDRV_SECTOR_BITS,
+                            n << BDRV_SECTOR_BITS, &qiov, 0);
         if (ret < 0) {
             return ret;
         }
@@ -1561,15 +1592,18 @@ static int convert_read(ImgConvertState *s, int64_t sector_num, int nb_sectors,
     return 0;
 }
 
-static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
-                         const uint8_t *buf)
+static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
+                                         int nb_sectors, uint8_t *buf,
+                                         enum ImgConvertBlockStatus status)
 {
     int ret;
+    QEMUIOVector qiov;
+    struct iovec iov;
 
     while (nb_sectors > 0) {
         int n = nb_sectors;
 
-        switch (s->status) {
+        switch (status) {
         case BLK_BACKING_FILE:
             /* If we have a backing file, leave clusters unallocated that are
              * unallocated in the source image, so that the backing file is
@@ -1603,8 +1637,12 @@ static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
             if (!s->min_sparse ||
                 is_allocated_sectors_min(buf, n, &n, s->min_sparse))
             {
-                ret = blk_pwrite(s->target, sector_num << BDRV_SECTOR_BITS,
-                                 buf, n << BDRV_SECTOR_BITS, 0);
+                iov.iov_base = buf;
+                iov.iov_len = n << BDRV_SECTOR_BITS;
+                qemu_iovec_init_external(&qiov, &iov, 1);
+
+                ret = blk_co_pwritev(s->target, sector_num << BDRV_SECTOR_BITS,
+                                     n << BDRV_SECTOR_BITS, &qiov, 0);
                 if (ret < 0) {
                     return ret;
                 }
@@ -1616,8 +1654,9 @@ static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
             if (s->has_zero_init) {
                 break;
             }
-            ret = blk_pwrite_zeroes(s->target, sector_num << BDRV_SECTOR_BITS,
-                                    n << BDRV_SECTOR_BITS, 0);
+            ret = blk_co_pwrite_zeroes(s->target,
+                                       sector_num << BDRV_SECTOR_BITS,
+                                       n << BDRV_SECTOR_BITS, 0);
             if (ret < 0) {
                 return ret;
             }
@@ -1632,11 +1671,120 @@ static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
     return 0;
 }
 
+/*
+ * Worker coroutine of convert.  Each worker takes the next extent under
+ * s->lock, reads it into its own buffer and writes it out; with
+ * s->wr_in_order, it waits until all extents before it have been written.
+ */
+static void coroutine_fn convert_co_do_copy(void *opaque)
+{
+    ImgConvertState *s = opaque;
+    uint8_t *buf;
+    int ret, i;
+    int index = -1;
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] == qemu_coroutine_self()) {
+            index = i;
+            break;
+        }
+    }
+    assert(index >= 0);
+
+    s->running_coroutines++;
+    buf = blk_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
+
+    while (1) {
+        int n;
+        int64_t sector_num;
+        enum ImgConvertBlockStatus status;
+
+        qemu_co_mutex_lock(&s->lock);
+        if (s->ret != -EINPROGRESS || s->sector_num >= s->total_sectors) {
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+        n = convert_iteration_sectors(s, s->sector_num);
+        if (n < 0) {
+            qemu_co_mutex_unlock(&s->lock);
+            s->ret = n;
+            break;
+        }
+        sector_num = s->sector_num;
+        status = s->status;
+        if (!s->min_sparse && status == BLK_ZERO) {
+            n = MIN(n, s->buf_sectors);
+        }
+        /* Let the other workers go on with the following extents */
+        s->sector_num += n;
+        qemu_co_mutex_unlock(&s->lock);
+
+        if (status == BLK_DATA || (!s->min_sparse && status == BLK_ZERO)) {
+            s->allocated_done += n;
+            qemu_progress_print(100.0 * s->allocated_done /
+                                s->allocated_sectors, 0);
+        }
+
+        if (status == BLK_DATA) {
+            ret = convert_co_read(s, sector_num, n, buf);
+            if (ret < 0) {
+                error_report("error while reading sector %" PRId64
+                             ": %s", sector_num, strerror(-ret));
+                s->ret = ret;
+            }
+        } else if (!s->min_sparse && status == BLK_ZERO) {
+            memset(buf, 0, n * BDRV_SECTOR_SIZE);
+            status = BLK_DATA;
+        }
+
+        if (s->wr_in_order) {
+            while (s->wr_offs != sector_num && s->ret == -EINPROGRESS) {
+                s->wait_sector_num[index] = sector_num;
+                qemu_coroutine_yield();
+            }
+            s->wait_sector_num[index] = -1;
+        }
+
+        if (s->ret == -EINPROGRESS) {
+            ret = convert_co_write(s, sector_num, n, buf, status);
+            if (ret < 0) {
+                error_report("error while writing sector %" PRId64
+                             ": %s", sector_num, strerror(-ret));
+                s->ret = ret;
+            }
+        }
+
+        if (s->wr_in_order) {
+            /* Wake up the worker holding the next extent, or all of them
+             * if the conversion failed.  A worker is never woken up by one
+             * it woke up itself, as its wait_sector_num is -1 meanwhile. */
+            s->wr_offs = sector_num + n;
+            for (i = 0; i < s->num_coroutines; i++) {
+                if (s->co[i] && s->wait_sector_num[i] != -1 &&
+                    (s->wait_sector_num[i] == s->wr_offs ||
+                     s->ret != -EINPROGRESS)) {
+                    qemu_coroutine_enter(s->co[i]);
+                    if (s->ret == -EINPROGRESS) {
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    qemu_vfree(buf);
+    s->co[index] = NULL;
+    s->running_coroutines--;
+    if (!s->running_coroutines && s->ret == -EINPROGRESS) {
+        /* The whole image has been copied */
+        s->ret = 0;
+    }
+}
+
 static int convert_do_copy(ImgConvertState *s)
 {
-    uint8_t *buf = NULL;
-    int64_t sector_num, allocated_done;
-    int ret;
+    int64_t sector_num;
+    int ret, i;
     int n;
 
     /* Check whether we have zero initialisation or can get it efficiently */
@@ -1663,7 +1811,6 @@ static int convert_do_copy(ImgConvertState *s)
         }
         s->buf_sectors = s->cluster_sectors;
     }
-    buf = blk_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
 
     /* Calculate allocated sectors for progress */
     s->allocated_sectors = 0;
@@ -1685,57 +1832,32 @@ static int convert_do_copy(ImgConvertState *s)
     s->src_cur = 0;
     s->src_cur_offset = 0;
     s->sector_next_status = 0;
+    s->sector_num = 0;
+    s->allocated_done = 0;
+    s->wr_offs = 0;
+    s->ret = -EINPROGRESS;
+    qemu_co_mutex_init(&s->lock);
 
-    sector_num = 0;
-    allocated_done = 0;
-
-    while (sector_num < s->total_sectors) {
-        n = convert_iteration_sectors(s, sector_num);
-        if (n < 0) {
-            ret = n;
-            goto fail;
-        }
-        if (s->status == BLK_DATA || (!s->min_sparse && s->status == BLK_ZERO))
-        {
-            allocated_done += n;
-            qemu_progress_print(100.0 * allocated_done / s->allocated_sectors,
-                                0);
-        }
-
-        if (s->status == BLK_DATA) {
-            ret = convert_read(s, sector_num, n, buf);
-            if (ret < 0) {
-                error_report("error while reading sector %" PRId64
-                             ": %s", sector_num, strerror(-ret));
-                goto fail;
-            }
-        } else if (!s->min_sparse && s->status == BLK_ZERO) {
-            n = MIN(n, s->buf_sectors);
-            memset(buf, 0, n * BDRV_SECTOR_SIZE);
-            s->status = BLK_DATA;
-        }
-
-        ret = convert_write(s, sector_num, n, buf);
-        if (ret < 0) {
-            error_report("error while writing sector %" PRId64
-                         ": %s", sector_num, strerror(-ret));
-            goto fail;
-        }
+    for (i = 0; i < s->num_coroutines; i++) {
+        s->co[i] = qemu_coroutine_create(convert_co_do_copy, s);
+        s->wait_sector_num[i] = -1;
+        qemu_coroutine_enter(s->co[i]);
+    }
 
-        sector_num += n;
+    while (s->ret == -EINPROGRESS) {
+        main_loop_wait(false);
     }
 
-    if (s->compressed) {
+    if (s->compressed && !s->ret) {
         /* signal EOF to align */
         ret = blk_write_compressed(s->target, 0, NULL, 0);
         if (ret < 0) {
-            goto fail;
+            return ret;
         }
     }
 
-    ret = 0;
+    ret = s->ret;
 fail:
-    qemu_vfree(buf);
     return ret;
 }
 
@@ -1764,6 +1886,8 @@ static int img_convert(int argc, char **argv)
     QemuOpts *sn_opts = NULL;
     ImgConvertState state;
     bool image_opts = false;
+    bool wr_in_order = true;
+    long num_coroutines = 8;
 
     fmt = NULL;
     out_fmt = "raw";
@@ -1779,7 +1903,7 @@ static int img_convert(int argc, char **argv)
             {"image-opts", no_argument, 0, OPTION_IMAGE_OPTS},
             {0, 0, 0, 0}
         };
-        c = getopt_long(argc, argv, "hf:O:B:ce6o:s:l:S:pt:T:qn",
+        c = getopt_long(argc, argv, "hf:O:B:ce6o:s:l:S:pt:T:qnm:W",
                         long_options, NULL);
         if (c == -1) {
             break;
@@ -1871,6 +1995,18 @@ static int img_convert(int argc, char **argv)
         case 'n':
             skip_create = 1;
             break;
+        case 'm':
+            if (qemu_strtol(optarg, NULL, 0, &num_coroutines) ||
+                num_coroutines < 1 || num_coroutines > MAX_COROUTINES) {
+                error_report("Invalid number of coroutines. Allowed number of"
+                             " coroutines is between 1 and %d", MAX_COROUTINES);
+                ret = -1;
+                goto fail_getopt;
+            }
+            break;
+        case 'W':
+            wr_in_order = false;
+            break;
         case OPTION_OBJECT:
             opts = qemu_opts_parse_noisily(&qemu_object_opts,
                                            optarg, true);
@@ -1884,6 +2020,12 @@ static int img_convert(int argc, char **argv)
         }
     }
 
+    if (!wr_in_order && compress) {
+        error_report("Out of order write and compress are mutually exclusive");
+        ret = -1;
+        goto fail_getopt;
+    }
+
     if (qemu_opts_foreach(&qemu_object_opts,
                           user_creatable_add_opts_foreach,
                           NULL, NULL)) {
@@ -2119,6 +2261,12 @@ static int img_convert(int argc, char **argv)
         cluster_sectors = bdi.cluster_size / BDRV_SECTOR_SIZE;
     }
 
+    /* Compressed clusters are appended to the image in the order they are
+     * written; keep that order deterministic. */
+    if (compress) {
+        wr_in_order = true;
+    }
+
     state = (ImgConvertState) {
         .src                = blk,
         .src_sectors        = bs_sectors,
@@ -2130,6 +2278,8 @@ static int img_convert(int argc, char **argv)
         .min_sparse         = min_sparse,
         .cluster_sectors    = cluster_sectors,
         .buf_sectors        = bufsectors,
+        .wr_in_order        = wr_in_order,
+        .num_coroutines     = num_coroutines,
     };
     ret = convert_do_copy(&state);
 
@@ -3469,23 +3619,209 @@ out_no_progress:
     return 0;
 }
 
-typedef struct BenchData {
+/*
+ * Latency histogram: values below BENCH_LAT_SUB nanoseconds have a bucket
+ * each, larger ones are split into BENCH_LAT_SUB buckets per power of two,
+ * which keeps percentiles within about 1.5% of the exact value.
+ */
+#define BENCH_LAT_BITS 6
+#define BENCH_LAT_SUB (1 << BENCH_LAT_BITS)
+#define BENCH_LAT_BUCKETS ((64 - BENCH_LAT_BITS + 1) << BENCH_LAT_BITS)
+
+typedef struct BenchStats {
+    uint64_t requests;
+    uint64_t bytes;
+    uint64_t lat_min;
+    uint64_t lat_max;
+    uint64_t lat_sum;
+    uint64_t lat_hist[BENCH_LAT_BUCKETS];
+} BenchStats;
+
+typedef struct BenchData BenchData;
+
+typedef struct BenchReq {
+    BenchData *b;
+    QEMUIOVector qiov;
+    bool write;
+    int64_t start;
+} BenchReq;
+
+struct BenchData {
     BlockBackend *blk;
     uint64_t image_size;
     bool write;
+    bool random;
+    int rwmix_read;
     int bufsize;
     int step;
     int nrreq;
     int n;
     int flush_interval;
     bool drain_on_flush;
+    int64_t end_time;
     uint8_t *buf;
-    QEMUIOVector *qiov;
+    BenchReq *reqs;
+    BenchReq **free_reqs;
+    int nr_free;
+    GRand *rand;
 
     int in_flight;
     bool in_flush;
     uint64_t offset;
-} BenchData;
+
+    BenchStats *rd_stats;
+    BenchStats *wr_stats;
+};
+
+static int bench_lat_index(uint64_t ns)
+{
+    int msb;
+
+    if (ns < BENCH_LAT_SUB) {
+        return ns;
+    }
+    msb = 63 - clz64(ns);
+    return ((msb - BENCH_LAT_BITS + 1) << BENCH_LAT_BITS) +
+           ((ns >> (msb - BENCH_LAT_BITS)) & (BENCH_LAT_SUB - 1));
+}
+
+/* Lowest latency that falls into bucket @index */
+static uint64_t bench_lat_value(int index)
+{
+    int shift;
+
+    if (index < BENCH_LAT_SUB) {
+        return index;
+    }
+    shift = (index >> BENCH_LAT_BITS) - 1;
+    return (uint64_t)(BENCH_LAT_SUB | (index & (BENCH_LAT_SUB - 1))) << shift;
+}
+
+static void bench_stats_add(BenchStats *st, uint64_t bytes, uint64_t ns)
+{
+    if (!st->requests || ns < st->lat_min) {
+        st->lat_min = ns;
+    }
+    st->lat_max = MAX(st->lat_max, ns);
+    st->lat_sum += ns;
+    st->lat_hist[bench_lat_index(ns)]++;
+    st->requests++;
+    st->bytes += bytes;
+}
+
+static void bench_stats_merge(BenchStats *dst, const BenchStats *src)
+{
+    int i;
+
+    if (!src->requests) {
+        return;
+    }
+    if (!dst->requests || src->lat_min < dst->lat_min) {
+        dst->lat_min = src->lat_min;
+    }
+    dst->lat_max = MAX(dst->lat_max, src->lat_max);
+    dst->lat_sum += src->lat_sum;
+    for (i = 0; i < BENCH_LAT_BUCKETS; i++) {
+        dst->lat_hist[i] += src->lat_hist[i];
+    }
+    dst->requests += src->requests;
+    dst->bytes += src->bytes;
+}
+
+static uint64_t bench_stats_percentile(const BenchStats *st, double p)
+{
+    uint64_t target = p / 100 * st->requests;
+    uint64_t seen = 0;
+    int i;
+
+    if (target < p / 100 * st->requests || !target) {
+        target++;
+    }
+
+    for (i = 0; i < BENCH_LAT_BUCKETS; i++) {
+        seen += st->lat_hist[i];
+        if (seen >= target) {
+            return MIN(MAX(bench_lat_value(i), st->lat_min), st->lat_max);
+        }
+    }
+    return st->lat_max;
+}
+
+static const struct {
+    const char *name;
+    double value;
+} bench_percentiles[] = {
+    { "50", 50 }, { "90", 90 }, { "99", 99 }, { "99.9", 99.9 },
+    { "99.99", 99.99 },
+};
+
+static void bench_stats_print(const char *op, const BenchStats *st,
+                              int64_t elapsed)
+{
+    double secs = elapsed / 1e9;
+    int i;
+
+    if (!st->requests) {
+        return;
+    }
+    printf("%s: %" PRIu64 " requests, %.0f IOPS, %.2f MiB/s\n",
+           op, st->requests, st->requests / secs,
+           st->bytes / secs / (1024 * 1024));
+    printf("  latency (us): min=%.1f avg=%.1f max=%.1f\n",
+           st->lat_min / 1e3, (double)st->lat_sum / st->requests / 1e3,
+           st->lat_max / 1e3);
+    printf("  percentiles (us):");
+    for (i = 0; i < ARRAY_SIZE(bench_percentiles); i++) {
+        printf(" %sth=%.1f", bench_percentiles[i].name,
+               bench_stats_percentile(st, bench_percentiles[i].value) / 1e3);
+    }
+    printf("\n");
+}
+
+static QDict *bench_stats_to_qdict(const BenchStats *st, int64_t elapsed)
+{
+    QDict *dict = qdict_new();
+    QDict *pct = qdict_new();
+    double secs = elapsed / 1e9;
+    int i;
+
+    qdict_put(dict, "requests", qint_from_int(st->requests));
+    qdict_put(dict, "bytes", qint_from_int(st->bytes));
+    qdict_put(dict, "iops", qfloat_from_double(st->requests / secs));
+    qdict_put(dict, "bandwidth", qfloat_from_double(st->bytes / secs));
+    qdict_put(dict, "lat-min-ns", qint_from_int(st->lat_min));
+    qdict_put(dict, "lat-avg-ns",
+              qint_from_int(st->requests ? st->lat_sum / st->requests : 0));
+    qdict_put(dict, "lat-max-ns", qint_from_int(st->lat_max));
+    for (i = 0; i < ARRAY_SIZE(bench_percentiles); i++) {
+        qdict_put(pct, bench_percentiles[i].name,
+                  qint_from_int(st->requests ?
+                                bench_stats_percentile(st,
+                                    bench_percentiles[i].value) : 0));
+    }
+    qdict_put(dict, "lat-percentiles-ns", pct);
+
+    return dict;
+}
+
+static uint64_t bench_next_offset(BenchData *b)
+{
+    uint64_t offset;
+
+    if (b->random) {
+        uint64_t nr_blocks = b->image_size / b->bufsize;
+        uint64_t r = ((uint64_t)g_rand_int(b->rand) << 32) |
+                     g_rand_int(b->rand);
+        return (r % nr_blocks) * b->bufsize;
+    }
+
+    offset = b->offset;
+    b->offset += b->step;
+    b->offset %= b->image_size;
+    return offset;
+}
+
+static void bench_submit(BenchData *b);
 
 static void bench_undrained_flush_cb(void *opaque, int ret)
 {
@@ -3495,65 +3831,94 @@ static void bench_undrained_flush_cb(void *opaque, int ret)
     }
 }
 
-static void bench_cb(void *opaque, int ret)
+static void bench_flush_cb(void *opaque, int ret)
 {
     BenchData *b = opaque;
+
+    bench_undrained_flush_cb(opaque, ret);
+
+    /* Just finished a flush with drained queue: Start next requests */
+    assert(b->in_flight == 0);
+    b->in_flush = false;
+    bench_submit(b);
+}
+
+static void bench_cb(void *opaque, int ret)
+{
+    BenchReq *req = opaque;
+    BenchData *b = req->b;
     BlockAIOCB *acb;
+    int64_t now = get_clock();
+    int remaining;
 
     if (ret < 0) {
         error_report("Failed request: %s", strerror(-ret));
         exit(EXIT_FAILURE);
     }
 
-    if (b->in_flush) {
-        /* Just finished a flush with drained queue: Start next requests */
-        assert(b->in_flight == 0);
-        b->in_flush = false;
-    } else if (b->in_flight > 0) {
-        int remaining = b->n - b->in_flight;
+    bench_stats_add(req->write ? b->wr_stats : b->rd_stats, b->bufsize,
+                    now - req->start);
+    b->free_reqs[b->nr_free++] = req;
 
-        b->n--;
-        b->in_flight--;
+    remaining = b->n - b->in_flight;
+    b->n--;
+    b->in_flight--;
 
-        /* Time for flush? Drain queue if requested, then flush */
-        if (b->flush_interval && remaining % b->flush_interval == 0) {
-            if (!b->in_flight || !b->drain_on_flush) {
-                BlockCompletionFunc *cb;
+    /* Out of time? Only wait for the requests still in flight */
+    if (b->end_time && now >= b->end_time) {
+        b->n = b->in_flight;
+        return;
+    }
 
-                if (b->drain_on_flush) {
-                    b->in_flush = true;
-                    cb = bench_cb;
-                } else {
-                    cb = bench_undrained_flush_cb;
-                }
+    /* Time for flush? Drain queue if requested, then flush */
+    if (b->flush_interval && remaining % b->flush_interval == 0) {
+        if (!b->in_flight || !b->drain_on_flush) {
+            BlockCompletionFunc *cb;
 
-                acb = blk_aio_flush(b->blk, cb, b);
-                if (!acb) {
-                    error_report("Failed to issue flush request");
-                    exit(EXIT_FAILURE);
-                }
-            }
             if (b->drain_on_flush) {
-                return;
+                b->in_flush = true;
+                cb = bench_flush_cb;
+            } else {
+                cb = bench_undrained_flush_cb;
+            }
+
+            acb = blk_aio_flush(b->blk, cb, b);
+            if (!acb) {
+                error_report("Failed to issue flush request");
+                exit(EXIT_FAILURE);
             }
         }
+        if (b->drain_on_flush) {
+            return;
+        }
     }
 
+    bench_submit(b);
+}
+
+static void bench_submit(BenchData *b)
+{
+    BlockAIOCB *acb;
+
     while (b->n > b->in_flight && b->in_flight < b->nrreq) {
-        if (b->write) {
-            acb = blk_aio_pwritev(b->blk, b->offset, b->qiov, 0,
-                                  bench_cb, b);
+        BenchReq *req = b->free_reqs[--b->nr_free];
+        uint64_t offset = bench_next_offset(b);
+
+        req->write = b->write &&
+                     g_rand_int_range(b->rand, 0, 100) >= b->rwmix_read;
+        req->start = get_clock();
+        if (req->write) {
+            acb = blk_aio_pwritev(b->blk, offset, &req->qiov, 0,
+                                  bench_cb, req);
         } else {
-            acb = blk_aio_preadv(b->blk, b->offset, b->qiov, 0,
-                                 bench_cb, b);
+            acb = blk_aio_preadv(b->blk, offset, &req->qiov, 0,
+                                 bench_cb, req);
         }
         if (!acb) {
             error_report("Failed to issue request");
             exit(EXIT_FAILURE);
         }
         b->in_flight++;
-        b->offset += b->step;
-        b->offset %= b->image_size;
     }
 }
 
@@ -3564,21 +3929,28 @@ static int img_bench(int argc, char **argv)
     bool quiet = false;
     bool image_opts = false;
     bool is_write = false;
+    bool is_random = false;
+    int rwmix_read = 0;
     int count = 75000;
+    bool has_count = false;
     int depth = 64;
+    int nr_jobs = 1;
+    int64_t runtime = 0;
     int64_t offset = 0;
     size_t bufsize = 4096;
     int pattern = 0;
     size_t step = 0;
     int flush_interval = 0;
     bool drain_on_flush = true;
+    OutputFormat output_format = OFORMAT_HUMAN;
     int64_t image_size;
     BlockBackend *blk = NULL;
-    BenchData data = {};
+    BenchData *jobs = NULL;
+    BenchStats *rd_stats = NULL, *wr_stats = NULL;
     int flags = 0;
     bool writethrough = false;
-    struct timeval t1, t2;
-    int i;
+    int64_t t1, t2;
+    int i, j;
 
     for (;;) {
         static const struct option long_options[] = {
@@ -3587,6 +3959,11 @@ static int img_bench(int argc, char **argv)
             {"image-opts", no_argument, 0, OPTION_IMAGE_OPTS},
             {"pattern", required_argument, 0, OPTION_PATTERN},
             {"no-drain", no_argument, 0, OPTION_NO_DRAIN},
+            {"random", no_argument, 0, OPTION_RANDOM},
+            {"rwmixread", required_argument, 0, OPTION_RWMIXREAD},
+            {"jobs", required_argument, 0, OPTION_JOBS},
+            {"runtime", required_argument, 0, OPTION_RUNTIME},
+            {"output", required_argument, 0, OPTION_OUTPUT},
             {0, 0, 0, 0}
         };
         c = getopt_long(argc, argv, "hc:d:f:no:qs:S:t:w", long_options, NULL);
@@ -3608,6 +3985,7 @@ static int img_bench(int argc, char **argv)
                 error_report("Invalid request count specified");
                 return 1;
             }
+            has_count = true;
             break;
         }
         case 'd':
@@ -3708,6 +4086,53 @@ static int img_bench(int argc, char **argv)
         case OPTION_NO_DRAIN:
             drain_on_flush = false;
             break;
+        case OPTION_RANDOM:
+            is_random = true;
+            break;
+        case OPTION_RWMIXREAD:
+        {
+            char *end;
+            errno = 0;
+            rwmix_read = strtoul(optarg, &end, 0);
+            if (errno || *end || rwmix_read > 100) {
+                error_report("Invalid read percentage specified");
+                return 1;
+            }
+            break;
+        }
+        case OPTION_JOBS:
+        {
+            char *end;
+            errno = 0;
+            nr_jobs = strtoul(optarg, &end, 0);
+            if (errno || *end || nr_jobs < 1 || nr_jobs > 256) {
+                error_report("Invalid number of jobs specified");
+                return 1;
+            }
+            break;
+        }
+        case OPTION_RUNTIME:
+        {
+            char *end;
+            errno = 0;
+            runtime = strtoul(optarg, &end, 0);
+            if (errno || *end || runtime < 1 || runtime > INT_MAX) {
+                error_report("Invalid run time specified");
+                return 1;
+            }
+            break;
+        }
+        case OPTION_OUTPUT:
+            if (!strcmp(optarg, "json")) {
+                output_format = OFORMAT_JSON;
+            } else if (!strcmp(optarg, "human")) {
+                output_format = OFORMAT_HUMAN;
+            } else {
+                error_report("--output must be used with human or json "
+                             "as argument.");
+                return 1;
+            }
+            break;
         case OPTION_IMAGE_OPTS:
             image_opts = true;
             break;
@@ -3724,6 +4149,15 @@ static int img_bench(int argc, char **argv)
         ret = -1;
         goto out;
     }
+    if (!is_write && rwmix_read) {
+        error_report("--rwmixread is only available in write tests");
+        ret = -1;
+        goto out;
+    }
+    if (runtime && !has_count) {
+        /* Run until the time is up */
+        count = INT_MAX;
+    }
     if (flush_interval && flush_interval < depth) {
         error_report("Flush interval can't be smaller than depth");
         ret = -1;
@@ -3741,51 +4175,134 @@ static int img_bench(int argc, char **argv)
         ret = image_size;
         goto out;
     }
+    if (is_random && image_size < bufsize) {
+        error_report("Image is smaller than the buffer size");
+        ret = -1;
+        goto out;
+    }
 
-    data = (BenchData) {
-        .blk            = blk,
-        .image_size     = image_size,
-        .bufsize        = bufsize,
-        .step           = step ?: bufsize,
-        .nrreq          = depth,
-        .n              = count,
-        .offset         = offset,
-        .write          = is_write,
-        .flush_interval = flush_interval,
-        .drain_on_flush = drain_on_flush,
-    };
-    printf("Sending %d %s requests, %d bytes each, %d in parallel "
-           "(starting at offset %" PRId64 ", step size %d)\n",
-           data.n, data.write ? "write" : "read", data.bufsize, data.nrreq,
-           data.offset, data.step);
-    if (flush_interval) {
-        printf("Sending flush every %d requests\n", flush_interval);
+    if (output_format == OFORMAT_HUMAN) {
+        printf("Sending %d %s%s requests, %d bytes each, %d in parallel",
+               count, is_random ? "random " : "",
+               !is_write ? "read" : rwmix_read ? "read/write" : "write",
+               (int)bufsize, depth);
+        if (!is_random) {
+            printf(" (starting at offset %" PRId64 ", step size %d)",
+                   offset, (int)(step ?: bufsize));
+        }
+        printf("\n");
+        if (nr_jobs > 1) {
+            printf("Running %d jobs\n", nr_jobs);
+        }
+        if (runtime) {
+            printf("Running for at most %" PRId64 " seconds\n", runtime);
+        }
+        if (flush_interval) {
+            printf("Sending flush every %d requests\n", flush_interval);
+        }
     }
 
-    data.buf = blk_blockalign(blk, data.nrreq * data.bufsize);
-    memset(data.buf, pattern, data.nrreq * data.bufsize);
+    rd_stats = g_new0(BenchStats, nr_jobs + 1);
+    wr_stats = g_new0(BenchStats, nr_jobs + 1);
+
+    /* Sequential jobs start at evenly spaced offsets of the image */
+    jobs = g_new0(BenchData, nr_jobs);
+    for (i = 0; i < nr_jobs; i++) {
+        BenchData *b = &jobs[i];
+
+        *b = (BenchData) {
+            .blk            = blk,
+            .image_size     = image_size,
+            .bufsize        = bufsize,
+            .step           = step ?: bufsize,
+            .nrreq          = depth,
+            .n              = count,
+            .offset         = (offset + QEMU_ALIGN_DOWN(image_size / nr_jobs,
+                                                        bufsize) * i)
+                              % image_size,
+            .write          = is_write,
+            .random         = is_random,
+            .rwmix_read     = rwmix_read,
+            .flush_interval = flush_interval,
+            .drain_on_flush = drain_on_flush,
+            .rand           = g_rand_new_with_seed(i),
+            .rd_stats       = &rd_stats[i + 1],
+            .wr_stats       = &wr_stats[i + 1],
+        };
 
-    data.qiov = g_new(QEMUIOVector, data.nrreq);
-    for (i = 0; i < data.nrreq; i++) {
-        qemu_iovec_init(&data.qiov[i], 1);
-        qemu_iovec_add(&data.qiov[i],
-                       data.buf + i * data.bufsize, data.bufsize);
+        b->buf = blk_blockalign(blk, b->nrreq * b->bufsize);
+        memset(b->buf, pattern, b->nrreq * b->bufsize);
+
+        b->reqs = g_new0(BenchReq, b->nrreq);
+        b->free_reqs = g_new(BenchReq *, b->nrreq);
+        for (j = 0; j < b->nrreq; j++) {
+            b->reqs[j].b = b;
+            qemu_iovec_init(&b->reqs[j].qiov, 1);
+            qemu_iovec_add(&b->reqs[j].qiov,
+                           b->buf + j * b->bufsize, b->bufsize);
+            b->free_reqs[j] = &b->reqs[j];
+        }
+        b->nr_free = b->nrreq;
     }
 
-    gettimeofday(&t1, NULL);
-    bench_cb(&data, 0);
+    t1 = get_clock();
+    for (i = 0; i < nr_jobs; i++) {
+        jobs[i].end_time = runtime ? t1 + runtime * NANOSECONDS_PER_SECOND : 0;
+        bench_submit(&jobs[i]);
+    }
 
-    while (data.n > 0) {
-        main_loop_wait(false);
+    for (i = 0; i < nr_jobs; i++) {
+        while (jobs[i].n > 0) {
+            main_loop_wait(false);
+        }
+    }
+    t2 = get_clock();
+
+    /* Totals go to the first entry */
+    for (i = 0; i < nr_jobs; i++) {
+        bench_stats_merge(&rd_stats[0], &rd_stats[i + 1]);
+        bench_stats_merge(&wr_stats[0], &wr_stats[i + 1]);
     }
-    gettimeofday(&t2, NULL);
 
-    printf("Run completed in %3.3f seconds.\n",
-           (t2.tv_sec - t1.tv_sec)
-           + ((double)(t2.tv_usec - t1.tv_usec) / 1000000));
+    if (output_format == OFORMAT_JSON) {
+        QDict *dict = qdict_new();
+        QString *str;
+
+        qdict_put(dict, "elapsed-ns", qint_from_int(t2 - t1));
+        qdict_put(dict, "jobs", qint_from_int(nr_jobs));
+        if (rd_stats[0].requests) {
+            qdict_put(dict, "read", bench_stats_to_qdict(&rd_stats[0],
+                                                         t2 - t1));
+        }
+        if (wr_stats[0].requests) {
+            qdict_put(dict, "write", bench_stats_to_qdict(&wr_stats[0],
+                                                          t2 - t1));
+        }
+        str = qobject_to_json_pretty(QOBJECT(dict));
+        printf("%s\n", qstring_get_str(str));
+        QDECREF(str);
+        QDECREF(dict);
+    } else {
+        printf("Run completed in %3.3f seconds.\n", (t2 - t1) / 1e9);
+        bench_stats_print("read", &rd_stats[0], t2 - t1);
+        bench_stats_print("write", &wr_stats[0], t2 - t1);
+    }
 
 out:
-    qemu_vfree(data.buf);
+    if (jobs) {
+        for (i = 0; i < nr_jobs; i++) {
+            for (j = 0; j < jobs[i].nrreq; j++) {
+                qemu_iovec_destroy(&jobs[i].reqs[j].qiov);
+            }
+            g_free(jobs[i].reqs);
+            g_free(jobs[i].free_reqs);
+            g_rand_free(jobs[i].rand);
+            qemu_vfree(jobs[i].buf);
+        }
+        g_free(jobs);
+    }
+    g_free(rd_stats);
+    g_free(wr_stats);
     blk_unref(blk);
 
     if (ret) {
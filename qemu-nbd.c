@@ -35,6 +35,7 @@
 #include "io/channel-socket.h"
 #include "crypto/init.h"
 #include "trace/control.h"
+#include "qemu/rcu.h"
 
 #include <getopt.h>
 #include <libgen.h>
@@ -48,10 +49,28 @@
 #define QEMU_NBD_OPT_OBJECT        260
 #define QEMU_NBD_OPT_TLSCREDS      261
 #define QEMU_NBD_OPT_IMAGE_OPTS    262
+#define QEMU_NBD_OPT_IOTHREADS     263
+#define QEMU_NBD_OPT_MAX_REQUESTS  264
 
 #define MBR_SIZE 512
 
-static NBDExport *exp;
+/* A worker serves its clients from its own AioContext in a thread, or from
+ * the main loop if ctx is NULL.  Read-only images are opened once per worker
+ * so that no BlockBackend is shared between threads.
+ */
+typedef struct NBDWorker {
+    QemuThread thread;
+    AioContext *ctx;
+    BlockBackend *blk;
+    NBDExport *exp;
+    bool stopping;
+} NBDWorker;
+
+static NBDWorker *workers;
+static int nb_workers;
+static int next_worker;
+static int nb_exports;
+static QEMUBH *client_closed_bh;
 static bool newproto;
 static int verbose;
 static char *srcpath;
@@ -79,6 +98,10 @@ static void usage(const char *name)
 "  -k, --socket=PATH         path to the unix socket\n"
 "                            (default '"SOCKET_PATH"')\n"
 "  -e, --shared=NUM          device can be shared by NUM clients (default '1')\n"
+"      --iothreads=NUM       serve the clients from NUM I/O threads, more than\n"
+"                            one requires --read-only (default: main loop)\n"
+"      --max-requests=NUM    allow NUM requests in flight per client\n"
+"                            (default '%d')\n"
 "  -t, --persistent          don't exit on the last connection\n"
 "  -v, --verbose             display extra debugging information\n"
 "  -x, --export-name=NAME    expose export by name\n"
@@ -112,13 +135,13 @@ static void usage(const char *name)
 "                            '[ID_OR_NAME]'\n"
 "  -n, --nocache             disable host cache\n"
 "      --cache=MODE          set cache mode (none, writeback, ...)\n"
-"      --aio=MODE            set AIO mode (native or threads)\n"
+"      --aio=MODE            set AIO mode (native, io_uring or threads)\n"
 "      --discard=MODE        set discard mode (ignore, unmap)\n"
 "      --detect-zeroes=MODE  set detect-zeroes mode (off, on, unmap)\n"
 "      --image-opts          treat FILE as a full set of image options\n"
 "\n"
 "Report bugs to <qemu-devel@nongnu.org>\n"
-    , name, NBD_DEFAULT_PORT, "DEVICE");
+    , name, NBD_DEFAULT_PORT, "DEVICE", MAX_NBD_REQUESTS);
 }
 
 static void version(const char *name)
@@ -268,7 +291,7 @@ static void *nbd_client_thread(void *arg)
 
     ret = nbd_receive_negotiate(QIO_CHANNEL(sioc), NULL, &nbdflags,
                                 NULL, NULL, NULL,
-                                &size, &local_error);
+                                &size, NULL, &local_error);
     if (ret < 0) {
         if (local_error) {
             error_report_err(local_error);
@@ -319,30 +342,62 @@ out:
 
 static int nbd_can_accept(void)
 {
-    return nb_fds < shared;
+    return atomic_read(&nb_fds) < shared;
 }
 
+/* Called from the thread of the export's AioContext */
 static void nbd_export_closed(NBDExport *exp)
 {
     assert(state == TERMINATING);
-    state = TERMINATED;
+    if (atomic_fetch_dec(&nb_exports) == 1) {
+        atomic_set(&state, TERMINATED);
+        qemu_notify_event();
+    }
 }
 
 static void nbd_update_server_watch(void);
 
-static void nbd_client_closed(NBDClient *client)
+static void nbd_client_closed_bh(void *opaque)
 {
-    nb_fds--;
-    if (nb_fds == 0 && !persistent && state == RUNNING) {
+    if (atomic_read(&nb_fds) == 0 && !persistent && state == RUNNING) {
         state = TERMINATE;
     }
     nbd_update_server_watch();
+}
+
+/* Called from the thread of the client's export, the server socket and the
+ * exit condition are left to the main loop.
+ */
+static void nbd_client_closed(NBDClient *client)
+{
+    atomic_dec(&nb_fds);
+    qemu_bh_schedule(client_closed_bh);
     nbd_client_put(client);
 }
 
+static void *nbd_worker_run(void *opaque)
+{
+    NBDWorker *w = opaque;
+
+    rcu_register_thread();
+    while (!atomic_read(&w->stopping)) {
+        aio_poll(w->ctx, true);
+    }
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static void nbd_worker_stop(NBDWorker *w)
+{
+    atomic_set(&w->stopping, true);
+    aio_notify(w->ctx);
+    qemu_thread_join(&w->thread);
+}
+
 static gboolean nbd_accept(QIOChannel *ioc, GIOCondition cond, gpointer opaque)
 {
     QIOChannelSocket *cioc;
+    NBDWorker *w;
 
     cioc = qio_channel_socket_accept(QIO_CHANNEL_SOCKET(ioc),
                                      NULL);
@@ -355,9 +410,13 @@ static gboolean nbd_accept(QIOChannel *ioc, GIOCondition cond, gpointer opaque)
         return TRUE;
     }
 
-    nb_fds++;
+    atomic_inc(&nb_fds);
     nbd_update_server_watch();
-    nbd_client_new(newproto ? NULL : exp, cioc,
+
+    /* Named exports go to the least loaded worker in nbd_export_find() */
+    w = &workers[next_worker];
+    next_worker = (next_worker + 1) % nb_workers;
+    nbd_client_new(newproto ? NULL : w->exp, cioc,
                    tlscreds, NULL, nbd_client_closed);
     object_unref(OBJECT(cioc));
 
@@ -464,6 +523,7 @@ int main(int argc, char **argv)
 {
     BlockBackend *blk;
     BlockDriverState *bs;
+    NBDWorker *w;
     off_t dev_offset = 0;
     uint16_t nbdflags = 0;
     bool disconnect = false;
@@ -502,6 +562,9 @@ int main(int argc, char **argv)
         { "export-name", required_argument, NULL, 'x' },
         { "tls-creds", required_argument, NULL, QEMU_NBD_OPT_TLSCREDS },
         { "image-opts", no_argument, NULL, QEMU_NBD_OPT_IMAGE_OPTS },
+        { "iothreads", required_argument, NULL, QEMU_NBD_OPT_IOTHREADS },
+        { "max-requests", required_argument, NULL,
+          QEMU_NBD_OPT_MAX_REQUESTS },
         { "trace", required_argument, NULL, 'T' },
         { NULL, 0, NULL, 0 }
     };
@@ -510,6 +573,10 @@ int main(int argc, char **argv)
     char *end;
     int flags = BDRV_O_RDWR;
     int partition = -1;
+    int iothreads = 0;
+    int max_requests = MAX_NBD_REQUESTS;
+    long num;
+    int i;
     int ret = 0;
     bool seen_cache = false;
     bool seen_discard = false;
@@ -567,6 +634,8 @@ int main(int argc, char **argv)
             seen_aio = true;
             if (!strcmp(optarg, "native")) {
                 flags |= BDRV_O_NATIVE_AIO;
+            } else if (!strcmp(optarg, "io_uring")) {
+                flags |= BDRV_O_IO_URING;
             } else if (!strcmp(optarg, "threads")) {
                 /* this is the default */
             } else {
@@ -710,6 +779,22 @@ int main(int argc, char **argv)
         case QEMU_NBD_OPT_IMAGE_OPTS:
             imageOpts = true;
             break;
+        case QEMU_NBD_OPT_IOTHREADS:
+            if (qemu_strtol(optarg, NULL, 0, &num) < 0 ||
+                num < 1 || num > INT_MAX) {
+                error_report("Invalid I/O thread number '%s'", optarg);
+                exit(EXIT_FAILURE);
+            }
+            iothreads = num;
+            break;
+        case QEMU_NBD_OPT_MAX_REQUESTS:
+            if (qemu_strtol(optarg, NULL, 0, &num) < 0 ||
+                num < 1 || num > INT_MAX) {
+                error_report("Invalid request number '%s'", optarg);
+                exit(EXIT_FAILURE);
+            }
+            max_requests = num;
+            break;
         case 'T':
             g_free(trace_file);
             trace_file = trace_opt_parse(optarg);
@@ -723,6 +808,11 @@ int main(int argc, char **argv)
         exit(EXIT_FAILURE);
     }
 
+    if (iothreads > 1 && (flags & BDRV_O_RDWR)) {
+        error_report("More than one I/O thread requires --read-only");
+        exit(EXIT_FAILURE);
+    }
+
     if (qemu_opts_foreach(&qemu_object_opts,
                           user_creatable_add_opts_foreach,
                           NULL, NULL)) {
@@ -861,65 +951,90 @@ int main(int argc, char **argv)
         }
         options = qemu_opts_to_qdict(opts, NULL);
         qemu_opts_reset(&file_opts);
-        blk = blk_new_open(NULL, NULL, options, flags, &local_err);
-    } else {
-        if (fmt) {
-            options = qdict_new();
-            qdict_put(options, "driver", qstring_from_str(fmt));
-        }
-        blk = blk_new_open(srcpath, NULL, options, flags, &local_err);
+    } else if (fmt) {
+        options = qdict_new();
+        qdict_put(options, "driver", qstring_from_str(fmt));
     }
 
-    if (!blk) {
-        error_reportf_err(local_err, "Failed to blk_new_open '%s': ",
-                          argv[optind]);
-        exit(EXIT_FAILURE);
-    }
-    bs = blk_bs(blk);
+    nb_workers = MAX(iothreads, 1);
+    workers = g_new0(NBDWorker, nb_workers);
+    client_closed_bh = qemu_bh_new(nbd_client_closed_bh, NULL);
+
+    for (i = 0; i < nb_workers; i++) {
+        w = &workers[i];
+
+        /* The block layer takes the options and consumes the entries */
+        blk = blk_new_open(imageOpts ? NULL : srcpath, NULL,
+                           options ? qdict_clone_shallow(options) : NULL,
+                           flags, &local_err);
+        if (!blk) {
+            error_reportf_err(local_err, "Failed to blk_new_open '%s': ",
+                              argv[optind]);
+            exit(EXIT_FAILURE);
+        }
+        bs = blk_bs(blk);
+        w->blk = blk;
 
-    blk_set_enable_write_cache(blk, !writethrough);
+        blk_set_enable_write_cache(blk, !writethrough);
 
-    if (sn_opts) {
-        ret = bdrv_snapshot_load_tmp(bs,
+        if (sn_opts) {
+            ret = bdrv_snapshot_load_tmp(bs,
                                      qemu_opt_get(sn_opts, SNAPSHOT_OPT_ID),
                                      qemu_opt_get(sn_opts, SNAPSHOT_OPT_NAME),
                                      &local_err);
-    } else if (sn_id_or_name) {
-        ret = bdrv_snapshot_load_tmp_by_id_or_name(bs, sn_id_or_name,
-                                                   &local_err);
-    }
-    if (ret < 0) {
-        error_reportf_err(local_err, "Failed to load snapshot: ");
-        exit(EXIT_FAILURE);
-    }
-
-    bs->detect_zeroes = detect_zeroes;
-    fd_size = blk_getlength(blk);
-    if (fd_size < 0) {
-        error_report("Failed to determine the image length: %s",
-                     strerror(-fd_size));
-        exit(EXIT_FAILURE);
-    }
-
-    if (partition != -1) {
-        ret = find_partition(blk, partition, &dev_offset, &fd_size);
+        } else if (sn_id_or_name) {
+            ret = bdrv_snapshot_load_tmp_by_id_or_name(bs, sn_id_or_name,
+                                                       &local_err);
+        }
         if (ret < 0) {
-            error_report("Could not find partition %d: %s", partition,
-                         strerror(-ret));
+            error_reportf_err(local_err, "Failed to load snapshot: ");
             exit(EXIT_FAILURE);
         }
-    }
 
-    exp = nbd_export_new(blk, dev_offset, fd_size, nbdflags, nbd_export_closed,
-                         &local_err);
-    if (!exp) {
-        error_report_err(local_err);
-        exit(EXIT_FAILURE);
-    }
-    if (export_name) {
-        nbd_export_set_name(exp, export_name);
-        newproto = true;
+        bs->detect_zeroes = detect_zeroes;
+
+        /* The replicas of a read-only image have the same layout */
+        if (i == 0) {
+            fd_size = blk_getlength(blk);
+            if (fd_size < 0) {
+                error_report("Failed to determine the image length: %s",
+                             strerror(-fd_size));
+                exit(EXIT_FAILURE);
+            }
+
+            if (partition != -1) {
+                ret = find_partition(blk, partition, &dev_offset, &fd_size);
+                if (ret < 0) {
+                    error_report("Could not find partition %d: %s",
+                                 partition, strerror(-ret));
+                    exit(EXIT_FAILURE);
+                }
+            }
+        }
+
+        if (iothreads) {
+            w->ctx = aio_context_new(&local_err);
+            if (!w->ctx) {
+                error_report_err(local_err);
+                exit(EXIT_FAILURE);
+            }
+            blk_set_aio_context(blk, w->ctx);
+        }
+
+        w->exp = nbd_export_new(blk, dev_offset, fd_size, nbdflags,
+                                nbd_export_closed, &local_err);
+        if (!w->exp) {
+            error_report_err(local_err);
+            exit(EXIT_FAILURE);
+        }
+        nbd_export_set_max_requests(w->exp, max_requests);
+        if (export_name) {
+            nbd_export_set_name(w->exp, export_name);
+            newproto = true;
+        }
+        nb_exports++;
     }
+    QDECREF(options);
 
     server_ioc = qio_channel_socket_new();
     if (qio_channel_socket_listen_sync(server_ioc, saddr, &local_err) < 0) {
@@ -941,6 +1056,14 @@ int main(int argc, char **argv)
         memset(&client_thread, 0, sizeof(client_thread));
     }
 
+    for (i = 0; i < nb_workers; i++) {
+        w = &workers[i];
+        if (w->ctx) {
+            qemu_thread_create(&w->thread, "nbd-iothread", nbd_worker_run, w,
+                               QEMU_THREAD_JOINABLE);
+        }
+    }
+
     nbd_update_server_watch();
 
     /* now when the initialization is (almost) complete, chdir("/")
@@ -956,13 +1079,31 @@ int main(int argc, char **argv)
         main_loop_wait(false);
         if (state == TERMINATE) {
             state = TERMINATING;
-            nbd_export_close(exp);
-            nbd_export_put(exp);
-            exp = NULL;
+            for (i = 0; i < nb_workers; i++) {
+                AioContext *ctx = blk_get_aio_context(workers[i].blk);
+
+                aio_context_acquire(ctx);
+                nbd_export_close(workers[i].exp);
+                nbd_export_put(workers[i].exp);
+                workers[i].exp = NULL;
+                aio_context_release(ctx);
+            }
         }
-    } while (state != TERMINATED);
-
-    blk_unref(blk);
+    } while (atomic_read(&state) != TERMINATED);
+
+    for (i = 0; i < nb_workers; i++) {
+        w = &workers[i];
+        if (w->ctx) {
+            nbd_worker_stop(w);
+            aio_context_acquire(w->ctx);
+            blk_set_aio_context(w->blk, qemu_get_aio_context());
+            aio_context_release(w->ctx);
+            aio_context_unref(w->ctx);
+        }
+        blk_unref(w->blk);
+    }
+    g_free(workers);
+    qemu_bh_delete(client_closed_bh);
     if (sockpath) {
         unlink(sockpath);
     }
@@ -36,6 +36,7 @@ DEF("machine", HAS_ARG, QEMU_OPTION_machine, \
     "                kernel_irqchip=on|off|split controls accelerated irqchip support (default=off)\n"
     "                vmport=on|off|auto controls emulation of vmport (default: auto)\n"
     "                kvm_shadow_mem=size of KVM shadow MMU in bytes\n"
+    "                kvm-dirty-ring-size=n entries per vCPU in the KVM dirty ring (default=0, off)\n"
     "                dump-guest-core=on|off include guest memory in a core dump (default=on)\n"
     "                mem-merge=on|off controls memory merge support (default: on)\n"
     "                igd-passthru=on|off controls IGD GFX passthrough support (default=off)\n"
@@ -66,6 +67,10 @@ value based on accel. For accel=xen the default is off otherwise the default
 is on.
 @item kvm_shadow_mem=size
 Defines the size of the KVM shadow MMU.
+@item kvm-dirty-ring-size=@var{n}
+Track dirty guest memory with per-vCPU dirty rings of @var{n} entries
+instead of the per-slot dirty bitmap, if the host kernel supports it.
+@var{n} must be a power of two; 0, the default, uses the bitmap.
 @item dump-guest-core=on|off
 Include guest memory in a core dump. The default is on.
 @item mem-merge=on|off
@@ -518,7 +523,7 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "       [,cyls=c,heads=h,secs=s[,trans=t]][,snapshot=on|off]\n"
     "       [,cache=writethrough|writeback|none|directsync|unsafe][,format=f]\n"
     "       [,serial=s][,addr=A][,rerror=ignore|stop|report]\n"
-    "       [,werror=ignore|stop|report|enospc][,id=name][,aio=threads|native]\n"
+    "       [,werror=ignore|stop|report|enospc][,id=name][,aio=threads|native|io_uring]\n"
     "       [,readonly=on|off][,copy-on-read=on|off]\n"
     "       [,discard=ignore|unmap][,detect-zeroes=on|off|unmap]\n"
     "       [[,bps=b]|[[,bps_rd=r][,bps_wr=w]]]\n"
@@ -561,7 +566,7 @@ These options have the same definition as they have in @option{-hdachs}.
 @item cache=@var{cache}
 @var{cache} is "none", "writeback", "unsafe", "directsync" or "writethrough" and controls how the host cache is used to access block data.
 @item aio=@var{aio}
-@var{aio} is "threads", or "native" and selects between pthread based disk I/O and native Linux AIO.
+@var{aio} is "threads", "native" or "io_uring" and selects between pthread based disk I/O, native Linux AIO and Linux io_uring.  Unlike native Linux AIO, io_uring does not require cache.direct=on.
 @item discard=@var{discard}
 @var{discard} is one of "ignore" (or "off") or "unmap" (or "on") and controls whether @dfn{discard} (also known as @dfn{trim} or @dfn{unmap}) requests are ignored or passed to the filesystem.  Some machine types may not support discard requests.
 @item format=@var{format}
@@ -1671,6 +1676,12 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "                attach to the existing netmap-enabled network interface 'name', or to a\n"
     "                VALE port (created on the fly) called 'name' ('nmname' is name of the \n"
     "                netmap device, defaults to '/dev/netmap')\n"
+#endif
+#ifdef CONFIG_AF_XDP
+    "-netdev af-xdp,id=str,ifname=name[,mode=native|skb][,force-copy=on|off]\n"
+    "         [,queues=n][,start-queue=m][,busy-poll=usecs]\n"
+    "                attach to queues m..m+n-1 of network interface 'name' using\n"
+    "                AF_XDP sockets, optionally busy-polling for 'usecs'\n"
 #endif
     "-netdev vhost-user,id=str,chardev=dev[,vhostforce=on|off]\n"
     "                configure a vhost-user network, backed by a chardev 'dev'\n"
@@ -2123,6 +2134,25 @@ qemu -m 512 -object memory-backend-file,id=mem,size=512M,mem-path=/hugetlbfs,sha
      -device virtio-net-pci,netdev=net0
 @end example
 
+@item -netdev af-xdp,id=@var{id},ifname=@var{name}[,mode=native|skb][,force-copy=on|off][,queues=@var{n}][,start-queue=@var{m}][,busy-poll=@var{usecs}]
+
+Attach to queues @var{m} to @var{m}+@var{n}-1 of the host network interface
+@var{name} with one AF_XDP socket per queue.  Frames move through memory
+shared with the kernel instead of the network stack.  Zero-copy is used
+when the driver supports it, unless @option{force-copy} is on or
+@option{mode} is @code{skb}.  The interface should have as many combined
+channels as queues are used, and traffic must be steered to them, for
+example with @command{ethtool -N}.  @option{busy-poll} sets
+@code{SO_BUSY_POLL} on the sockets.  Put the netdev on a virtio-net device
+with @option{iothreads} to poll it outside the main loop.
+
+Example:
+@example
+qemu -object iothread,id=io0 -object iothread,id=io1 \
+     -netdev af-xdp,id=net0,ifname=eth1,queues=2,busy-poll=50 \
+     -device virtio-net-pci,netdev=net0,mq=on,vectors=6,iothreads=io0:io1
+@end example
+
 @item -net dump[,vlan=@var{n}][,file=@var{file}][,len=@var{len}]
 Dump network traffic on VLAN @var{n} to file @var{file} (@file{qemu-vlan0.pcap} by default).
 At most @var{len} bytes (64k by default) per packet are stored. The file format is
@@ -2496,6 +2526,11 @@ stalled requests and force a reestablishment of the session. The timeout
 is specified in seconds. The default is 0 which means no timeout. Libiscsi
 1.15.0 or greater is required for this feature.
 
+The @option{sessions} parameter opens several iSCSI sessions, each with its
+own TCP connection, to the target of a LUN. Read, write and other data
+commands are spread over the sessions, which helps when a single connection
+cannot saturate the network. The default is 1, the maximum is 16.
+
 Example (without authentication):
 @example
 qemu-system-i386 -iscsi initiator-name=iqn.2001-04.com.example:my-initiator \
@@ -2522,7 +2557,7 @@ DEF("iscsi", HAS_ARG, QEMU_OPTION_iscsi,
     "-iscsi [user=user][,password=password]\n"
     "       [,header-digest=CRC32C|CR32C-NONE|NONE-CRC32C|NONE\n"
     "       [,initiator-name=initiator-iqn][,id=target-iqn]\n"
-    "       [,timeout=timeout]\n"
+    "       [,timeout=timeout][,sessions=n]\n"
     "                iSCSI session parameters\n", QEMU_ARCH_ALL)
 STEXI
 
@@ -2629,11 +2664,17 @@ The following options are also supported:
 The full URL when passing options to the driver explicitly.
 
 @item readahead
-The amount of data to read ahead with each range request to the remote server.
+The largest amount of data to read ahead of sequential reads, in range requests
+of its own. The readahead starts at 64k and doubles with each sequential read.
 This value may optionally have the suffix 'T', 'G', 'M', 'K', 'k' or 'b'. If it
 does not have a suffix, it will be assumed to be in bytes. The value must be a
 multiple of 512 bytes. It defaults to 256k.
 
+@item cache-size
+The size of the cache of the data downloaded from the remote server, which is
+kept in 64k blocks and evicted least recently used first. 0 disables the cache.
+It takes the same suffixes as @option{readahead} and defaults to 16M.
+
 @item sslverify
 Whether to verify the remote server's certificate when connecting over SSL. It
 can have the value 'on' or 'off'. It defaults to 'on'.
@@ -3360,12 +3401,12 @@ re-inject them.
 ETEXI
 
 DEF("icount", HAS_ARG, QEMU_OPTION_icount, \
-    "-icount [shift=N|auto][,align=on|off][,sleep=on|off,rr=record|replay,rrfile=<filename>]\n" \
+    "-icount [shift=N|auto][,align=on|off][,sleep=on|off,rr=record|replay,rrfile=<filename>,rrcompress=on|off]\n" \
     "                enable virtual instruction counter with 2^N clock ticks per\n" \
     "                instruction, enable aligning the host and virtual clocks\n" \
     "                or disable real time cpu sleeping\n", QEMU_ARCH_ALL)
 STEXI
-@item -icount [shift=@var{N}|auto][,rr=record|replay,rrfile=@var{filename}]
+@item -icount [shift=@var{N}|auto][,rr=record|replay,rrfile=@var{filename},rrcompress=on|off]
 @findex -icount
 Enable virtual instruction counter.  The virtual cpu will execute one
 instruction every 2^@var{N} ns of virtual time.  If @code{auto} is specified
@@ -3398,6 +3439,8 @@ when the shift value is high (how high depends on the host machine).
 When @option{rr} option is specified deterministic record/replay is enabled.
 Replay log is written into @var{filename} file in record mode and
 read from this file in replay mode.
+With @option{rrcompress=on} the log is compressed with zstd in record mode.
+Compressed logs are recognized automatically in replay mode.
 ETEXI
 
 DEF("watchdog", HAS_ARG, QEMU_OPTION_watchdog, \
@@ -3777,6 +3820,14 @@ The @option{share} boolean option determines whether the memory
 region is marked as private to QEMU, or shared. The latter allows
 a co-operating external process to access the QEMU memory region.
 
+When the memory is preallocated, with @option{prealloc=on} or
+@option{-mem-prealloc}, the pages are touched by several threads in
+parallel.  The @option{prealloc-threads} option sets how many, and
+defaults to the number of vCPUs; it cannot exceed the number of host
+CPUs.  The NUMA policy set with @option{host-nodes} and @option{policy}
+is in place before any page is touched, so it applies whichever thread
+allocates a page.
+
 @item -object rng-random,id=@var{id},filename=@var{/dev/random}
 
 Creates a random number generator backend which obtains entropy from
@@ -3887,6 +3938,15 @@ Dump the network traffic on netdev @var{dev} to the file specified by
 The file format is libpcap, so it can be analyzed with tools such as tcpdump
 or Wireshark.
 
+@item -object iothread,id=@var{id}[,poll-max-ns=@var{ns}][,poll-grow=@var{factor}][,poll-shrink=@var{factor}]
+
+Creates a dedicated event loop thread that devices can be assigned to.  Before
+blocking, the thread busy-polls its event sources for up to @var{poll-max-ns}
+nanoseconds (32768 by default, 0 disables polling).  The polling time adapts
+to the workload: it is multiplied by @var{poll-grow} (default 2) while events
+arrive shortly after polling stopped and divided by @var{poll-shrink} (by
+default reset to 0) when they take longer than @var{poll-max-ns}.
+
 @item -object secret,id=@var{id},data=@var{string},format=@var{raw|base64}[,keyid=@var{secretid},iv=@var{string}]
 @item -object secret,id=@var{id},file=@var{filename},format=@var{raw|base64}[,keyid=@var{secretid},iv=@var{string}]
 
@@ -64,10 +64,18 @@ static QEMUClock qemu_clocks[QEMU_CLOCK_MAX];
  * reenabling the clock can call all the notifiers.
  */
 
+/* The active timers are kept in a binary min-heap ordered by expiry time,
+ * with ties broken by the order in which the timers were armed, so that
+ * arming or deleting a timer is O(log n) and the earliest one is always
+ * active_timers[0].
+ */
 struct QEMUTimerList {
     QEMUClock *clock;
     QemuMutex active_timers_lock;
-    QEMUTimer *active_timers;
+    QEMUTimer **active_timers;
+    unsigned int n_active_timers;
+    unsigned int active_timers_size;
+    uint64_t next_seq;
     QLIST_ENTRY(QEMUTimerList) list;
     QEMUTimerListNotifyCB *notify_cb;
     void *notify_opaque;
@@ -94,6 +102,12 @@ static bool timer_expired_ns(QEMUTimer *timer_head, int64_t current_time)
     return timer_head && (timer_head->expire_time <= current_time);
 }
 
+/* The earliest active timer, or NULL */
+static inline QEMUTimer *timerlist_head(QEMUTimerList *timer_list)
+{
+    return timer_list->n_active_timers ? timer_list->active_timers[0] : NULL;
+}
+
 QEMUTimerList *timerlist_new(QEMUClockType type,
                              QEMUTimerListNotifyCB *cb,
                              void *opaque)
@@ -118,6 +132,7 @@ void timerlist_free(QEMUTimerList *timer_list)
         QLIST_REMOVE(timer_list, list);
     }
     qemu_mutex_destroy(&timer_list->active_timers_lock);
+    g_free(timer_list->active_timers);
     g_free(timer_list);
 }
 
@@ -174,7 +189,7 @@ void qemu_clock_enable(QEMUClockType type, bool enabled)
 
 bool timerlist_has_timers(QEMUTimerList *timer_list)
 {
-    return !!timer_list->active_timers;
+    return !!atomic_read(&timer_list->n_active_timers);
 }
 
 bool qemu_clock_has_timers(QEMUClockType type)
@@ -188,11 +203,11 @@ bool timerlist_expired(QEMUTimerList *timer_list)
     int64_t expire_time;
 
     qemu_mutex_lock(&timer_list->active_timers_lock);
-    if (!timer_list->active_timers) {
+    if (!timer_list->n_active_timers) {
         qemu_mutex_unlock(&timer_list->active_timers_lock);
         return false;
     }
-    expire_time = timer_list->active_timers->expire_time;
+    expire_time = timerlist_head(timer_list)->expire_time;
     qemu_mutex_unlock(&timer_list->active_timers_lock);
 
     return expire_time < qemu_clock_get_ns(timer_list->clock->type);
@@ -223,11 +238,11 @@ int64_t timerlist_deadline_ns(QEMUTimerList *timer_list)
      * the caller should notice the change and there is no race condition.
      */
     qemu_mutex_lock(&timer_list->active_timers_lock);
-    if (!timer_list->active_timers) {
+    if (!timer_list->n_active_timers) {
         qemu_mutex_unlock(&timer_list->active_timers_lock);
         return -1;
     }
-    expire_time = timer_list->active_timers->expire_time;
+    expire_time = timerlist_head(timer_list)->expire_time;
     qemu_mutex_unlock(&timer_list->active_timers_lock);
 
     delta = expire_time - qemu_clock_get_ns(timer_list->clock->type);
@@ -352,43 +367,110 @@ void timer_free(QEMUTimer *ts)
     g_free(ts);
 }
 
-static void timer_del_locked(QEMUTimerList *timer_list, QEMUTimer *ts)
+static inline bool timer_before(QEMUTimer *a, QEMUTimer *b)
 {
-    QEMUTimer **pt, *t;
+    return a->expire_time < b->expire_time ||
+           (a->expire_time == b->expire_time && a->seq < b->seq);
+}
 
-    ts->expire_time = -1;
-    pt = &timer_list->active_timers;
-    for(;;) {
-        t = *pt;
-        if (!t)
-            break;
-        if (t == ts) {
-            *pt = t->next;
+static inline void timer_heap_set(QEMUTimerList *timer_list,
+                                  unsigned int i, QEMUTimer *ts)
+{
+    timer_list->active_timers[i] = ts;
+    ts->heap_index = i;
+}
+
+static void timer_heap_up(QEMUTimerList *timer_list, unsigned int i)
+{
+    QEMUTimer *ts = timer_list->active_timers[i];
+
+    while (i > 0) {
+        unsigned int parent = (i - 1) / 2;
+
+        if (!timer_before(ts, timer_list->active_timers[parent])) {
             break;
         }
-        pt = &t->next;
+        timer_heap_set(timer_list, i, timer_list->active_timers[parent]);
+        i = parent;
     }
+    timer_heap_set(timer_list, i, ts);
 }
 
-static bool timer_mod_ns_locked(QEMUTimerList *timer_list,
-                                QEMUTimer *ts, int64_t expire_time)
+static void timer_heap_down(QEMUTimerList *timer_list, unsigned int i)
 {
-    QEMUTimer **pt, *t;
+    QEMUTimer *ts = timer_list->active_timers[i];
+    unsigned int n = timer_list->n_active_timers;
 
-    /* add the timer in the sorted list */
-    pt = &timer_list->active_timers;
     for (;;) {
-        t = *pt;
-        if (!timer_expired_ns(t, expire_time)) {
+        unsigned int child = 2 * i + 1;
+
+        if (child >= n) {
+            break;
+        }
+        if (child + 1 < n &&
+            timer_before(timer_list->active_timers[child + 1],
+                         timer_list->active_timers[child])) {
+            child++;
+        }
+        if (!timer_before(timer_list->active_timers[child], ts)) {
             break;
         }
-        pt = &t->next;
+        timer_heap_set(timer_list, i, timer_list->active_timers[child]);
+        i = child;
     }
+    timer_heap_set(timer_list, i, ts);
+}
+
+static void timer_del_locked(QEMUTimerList *timer_list, QEMUTimer *ts)
+{
+    unsigned int i = ts->heap_index;
+    QEMUTimer *last;
+
+    if (ts->expire_time == -1) {
+        return;
+    }
+    ts->expire_time = -1;
+
+    assert(timer_list->active_timers[i] == ts);
+    atomic_set(&timer_list->n_active_timers,
+               timer_list->n_active_timers - 1);
+    last = timer_list->active_timers[timer_list->n_active_timers];
+    if (last != ts) {
+        /* Move the last timer into the hole, then restore the order */
+        timer_heap_set(timer_list, i, last);
+        timer_heap_down(timer_list, i);
+        timer_heap_up(timer_list, last->heap_index);
+    }
+}
+
+/* (Re)arm @ts, which may already be active; returns true if it became the
+ * earliest timer of the list */
+static bool timer_mod_ns_locked(QEMUTimerList *timer_list,
+                                QEMUTimer *ts, int64_t expire_time)
+{
+    bool pending = ts->expire_time != -1;
+
     ts->expire_time = MAX(expire_time, 0);
-    ts->next = *pt;
-    *pt = ts;
+    ts->seq = timer_list->next_seq++;
+
+    if (pending) {
+        timer_heap_down(timer_list, ts->heap_index);
+        timer_heap_up(timer_list, ts->heap_index);
+    } else {
+        if (timer_list->n_active_timers == timer_list->active_timers_size) {
+            timer_list->active_timers_size =
+                MAX(timer_list->active_timers_size * 2, 16);
+            timer_list->active_timers =
+                g_renew(QEMUTimer *, timer_list->active_timers,
+                        timer_list->active_timers_size);
+        }
+        timer_heap_set(timer_list, timer_list->n_active_timers, ts);
+        atomic_set(&timer_list->n_active_timers,
+                   timer_list->n_active_timers + 1);
+        timer_heap_up(timer_list, ts->heap_index);
+    }
 
-    return pt == &timer_list->active_timers;
+    return timerlist_head(timer_list) == ts;
 }
 
 static void timerlist_rearm(QEMUTimerList *timer_list)
@@ -420,7 +502,6 @@ void timer_mod_ns(QEMUTimer *ts, int64_t expire_time)
     bool rearm;
 
     qemu_mutex_lock(&timer_list->active_timers_lock);
-    timer_del_locked(timer_list, ts);
     rearm = timer_mod_ns_locked(timer_list, ts, expire_time);
     qemu_mutex_unlock(&timer_list->active_timers_lock);
 
@@ -439,9 +520,6 @@ void timer_mod_anticipate_ns(QEMUTimer *ts, int64_t expire_time)
 
     qemu_mutex_lock(&timer_list->active_timers_lock);
     if (ts->expire_time == -1 || ts->expire_time > expire_time) {
-        if (ts->expire_time != -1) {
-            timer_del_locked(timer_list, ts);
-        }
         rearm = timer_mod_ns_locked(timer_list, ts, expire_time);
     } else {
         rearm = false;
@@ -482,7 +560,7 @@ bool timerlist_run_timers(QEMUTimerList *timer_list)
     void *opaque;
 
     qemu_event_reset(&timer_list->timers_done_ev);
-    if (!timer_list->clock->enabled || !timer_list->active_timers) {
+    if (!timer_list->clock->enabled || !timerlist_has_timers(timer_list)) {
         goto out;
     }
 
@@ -510,16 +588,14 @@ bool timerlist_run_timers(QEMUTimerList *timer_list)
     current_time = qemu_clock_get_ns(timer_list->clock->type);
     for(;;) {
         qemu_mutex_lock(&timer_list->active_timers_lock);
-        ts = timer_list->active_timers;
+        ts = timerlist_head(timer_list);
         if (!timer_expired_ns(ts, current_time)) {
             qemu_mutex_unlock(&timer_list->active_timers_lock);
             break;
         }
 
         /* remove timer from the list before calling the callback */
-        timer_list->active_timers = ts->next;
-        ts->next = NULL;
-        ts->expire_time = -1;
+        timer_del_locked(timer_list, ts);
         cb = ts->cb;
         opaque = ts->opaque;
         qemu_mutex_unlock(&timer_list->active_timers_lock);
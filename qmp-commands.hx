@@ -1216,8 +1216,9 @@ EQMP
 
     {
         .name       = "drive-backup",
-        .args_type  = "job-id:s?,sync:s,device:B,target:s,speed:i?,mode:s?,"
-                      "format:s?,bitmap:s?,on-source-error:s?,on-target-error:s?",
+        .args_type  = "job-id:s?,sync:s,device:B,target:s,speed:i?,"
+                      "max-workers:i?,mode:s?,format:s?,bitmap:s?,"
+                      "on-source-error:s?,on-target-error:s?",
         .mhandler.cmd_new = qmp_marshal_drive_backup,
     },
 
@@ -1253,6 +1254,8 @@ Arguments:
 - "mode": whether and how QEMU should create a new image
           (NewImageMode, optional, default 'absolute-paths')
 - "speed": the maximum speed, in bytes per second (json-int, optional)
+- "max-workers": how many clusters are copied in parallel, from 1 to 64,
+                 default 8 (json-int, optional)
 - "on-source-error": the action to take on an error on the source, default
                      'report'.  'stop' and 'enospc' can only be used
                      if the block device supports io-status.
@@ -1273,7 +1276,7 @@ EQMP
     {
         .name       = "blockdev-backup",
         .args_type  = "job-id:s?,sync:s,device:B,target:B,speed:i?,"
-                      "on-source-error:s?,on-target-error:s?",
+                      "max-workers:i?,on-source-error:s?,on-target-error:s?",
         .mhandler.cmd_new = qmp_marshal_blockdev_backup,
     },
 
@@ -1296,6 +1299,8 @@ Arguments:
           sectors allocated in the topmost image, or "none" to only replicate
           new I/O (MirrorSyncMode).
 - "speed": the maximum speed, in bytes per second (json-int, optional)
+- "max-workers": how many clusters are copied in parallel, from 1 to 64,
+                 default 8 (json-int, optional)
 - "on-source-error": the action to take on an error on the source, default
                      'report'.  'stop' and 'enospc' can only be used
                      if the block device supports io-status.
@@ -1435,7 +1440,7 @@ EQMP
 
     {
         .name       = "block-dirty-bitmap-add",
-        .args_type  = "node:B,name:s,granularity:i?",
+        .args_type  = "node:B,name:s,granularity:i?,persistent:b?",
         .mhandler.cmd_new = qmp_marshal_block_dirty_bitmap_add,
     },
 
@@ -1452,6 +1457,9 @@ Arguments:
 - "node": device/node on which to create dirty bitmap (json-string)
 - "name": name of the new dirty bitmap (json-string)
 - "granularity": granularity to track writes with (int, optional)
+- "persistent": store the bitmap in the image file on close, and load it
+                again when the image is opened (json-bool, optional,
+                default false; only supported by qcow2)
 
 Example:
 
@@ -2072,7 +2080,7 @@ EQMP
 
     {
         .name       = "block_set_io_throttle",
-        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l,bps_max:l?,bps_rd_max:l?,bps_wr_max:l?,iops_max:l?,iops_rd_max:l?,iops_wr_max:l?,bps_max_length:l?,bps_rd_max_length:l?,bps_wr_max_length:l?,iops_max_length:l?,iops_rd_max_length:l?,iops_wr_max_length:l?,iops_size:l?,group:s?",
+        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l,bps_max:l?,bps_rd_max:l?,bps_wr_max:l?,iops_max:l?,iops_rd_max:l?,iops_wr_max:l?,bps_max_length:l?,bps_rd_max_length:l?,bps_wr_max_length:l?,iops_max_length:l?,iops_rd_max_length:l?,iops_wr_max_length:l?,iops_size:l?,group:s?,parent-group:s?",
         .mhandler.cmd_new = qmp_marshal_block_set_io_throttle,
     },
 
@@ -2105,6 +2113,8 @@ Arguments:
 - "iops_wr_max_length": maximum length of the @iops_wr_max burst period, in seconds (json-int, optional)
 - "iops_size":  I/O size in bytes when limiting (json-int, optional)
 - "group": throttle group name (json-string, optional)
+- "parent-group": name of the group that the device's group is nested in,
+                  or "" to detach it from its parent (json-string, optional)
 
 Example:
 
@@ -2125,6 +2135,91 @@ Example:
                                                "iops_size": 0 } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "block-latency-histogram-set",
+        .args_type  = "device:B,boundaries:q?,boundaries-read:q?,"
+                      "boundaries-write:q?,boundaries-flush:q?",
+        .mhandler.cmd_new = qmp_marshal_block_latency_histogram_set,
+    },
+
+SQMP
+block-latency-histogram-set
+---------------------------
+
+Set up the latency histograms of a block device, reported by
+query-blockstats.  The histograms are reset to zero.
+
+Arguments:
+
+- "device": block device name (json-string)
+- "boundaries": bin boundaries of the histograms whose own boundaries are
+                not given, in nanoseconds (json-array, optional)
+- "boundaries-read": bin boundaries of the read histogram
+                     (json-array, optional)
+- "boundaries-write": bin boundaries of the write histogram
+                      (json-array, optional)
+- "boundaries-flush": bin boundaries of the flush histogram
+                      (json-array, optional)
+
+Histograms with no boundaries are removed.
+
+Example:
+
+-> { "execute": "block-latency-histogram-set",
+     "arguments": { "device": "drive0",
+                    "boundaries": [ 100000, 1000000, 10000000 ],
+                    "boundaries-flush": [ 10000000 ] } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block-set-throttle-group",
+        .args_type  = "group:s,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l,bps_max:l?,bps_rd_max:l?,bps_wr_max:l?,iops_max:l?,iops_rd_max:l?,iops_wr_max:l?,bps_max_length:l?,bps_rd_max_length:l?,bps_wr_max_length:l?,iops_max_length:l?,iops_rd_max_length:l?,iops_wr_max_length:l?,iops_size:l?,parent:s?",
+        .mhandler.cmd_new = qmp_marshal_block_set_throttle_group,
+    },
+
+SQMP
+block-set-throttle-group
+------------------------
+
+Change the limits of a throttle group that has no devices, creating it if
+needed.  Such a group is typically the parent of other groups: I/O going
+through a group is also accounted to, and limited by, all the groups above
+it.
+
+Arguments:
+
+- "group": throttle group name (json-string)
+- "parent": name of the group that "group" is nested in, or "" to detach
+            it from its parent (json-string, optional)
+
+The limits take the same arguments as block_set_io_throttle.
+
+Example:
+
+-> { "execute": "block-set-throttle-group", "arguments": { "group": "tenant1",
+                                               "bps": 10000000,
+                                               "bps_rd": 0,
+                                               "bps_wr": 0,
+                                               "iops": 0,
+                                               "iops_rd": 0,
+                                               "iops_wr": 0 } }
+<- { "return": {} }
+
+-> { "execute": "block_set_io_throttle", "arguments": { "device": "virtio0",
+                                               "group": "vm1",
+                                               "parent-group": "tenant1",
+                                               "bps": 2000000,
+                                               "bps_rd": 0,
+                                               "bps_wr": 0,
+                                               "iops": 0,
+                                               "iops_rd": 0,
+                                               "iops_wr": 0 } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -2760,6 +2855,17 @@ Each json-object contain the following:
         - "avg_wr_queue_depth": average number of pending write
                                 operations in the defined interval
                                 (json-number).
+    - "rd_latency_histogram": histogram of read latencies, present once
+                              set up by block-latency-histogram-set
+                              (json-object, optional) with members:
+        - "boundaries": ascending bin boundaries, in nanoseconds
+                        (json-array of json-int)
+        - "bins": number of operations in each bin, one more than
+                  "boundaries" (json-array of json-int)
+    - "wr_latency_histogram": histogram of write latencies, as above
+                              (json-object, optional)
+    - "flush_latency_histogram": histogram of flush latencies, as above
+                                 (json-object, optional)
 - "parent": Contains recursively the statistics of the underlying
             protocol (e.g. the host file for a qcow2 image). If there is
             no underlying protocol, this field is omitted
@@ -2941,6 +3047,12 @@ Return a json-array. Each iothread is represented by a json-object, which contai
 
 - "id": name of iothread (json-str)
 - "thread-id": ID of the underlying host thread (json-int)
+- "poll-max-ns": maximum polling time in ns, 0 if disabled (json-int)
+- "poll-grow": polling time growth factor (json-int)
+- "poll-shrink": polling time shrink factor (json-int)
+- "poll-ns": current polling time in ns (json-int)
+- "poll-hits": polls that found an event (json-int)
+- "poll-misses": polls that timed out before blocking (json-int)
 
 Example:
 
@@ -2949,11 +3061,23 @@ Example:
       "return":[
          {
             "id":"iothread0",
-            "thread-id":3134
+            "thread-id":3134,
+            "poll-max-ns":32768,
+            "poll-grow":0,
+            "poll-shrink":0,
+            "poll-ns":8000,
+            "poll-hits":10431,
+            "poll-misses":2201
          },
          {
             "id":"iothread1",
-            "thread-id":3135
+            "thread-id":3135,
+            "poll-max-ns":0,
+            "poll-grow":0,
+            "poll-shrink":0,
+            "poll-ns":0,
+            "poll-hits":0,
+            "poll-misses":0
          }
       ]
    }
@@ -3483,6 +3607,42 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_query_uuid,
     },
 
+SQMP
+query-startup-profile
+---------------------
+
+Show how long each step of QEMU startup took.
+
+Return a json-array of json-objects with the following information:
+
+- "kind": "phase", "module" or "device" (json-string)
+- "name": phase name, module group or QOM path of the device (json-string)
+- "start-ns": start of the step, in ns since QEMU started (json-int)
+- "duration-ns": duration of the step in ns (json-int)
+
+Example:
+
+-> { "execute": "query-startup-profile" }
+<- { "return": [
+       { "kind": "module", "name": "qom",
+         "start-ns": 2117, "duration-ns": 412003 },
+       { "kind": "phase", "name": "configure-accelerator",
+         "start-ns": 9270111, "duration-ns": 20513322 },
+       { "kind": "device", "name": "/machine/peripheral/net0",
+         "start-ns": 61029882, "duration-ns": 1193457 },
+       { "kind": "phase", "name": "startup",
+         "start-ns": 0, "duration-ns": 98411060 }
+     ]
+   }
+
+EQMP
+
+    {
+        .name       = "query-startup-profile",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_query_startup_profile,
+    },
+
 SQMP
 query-command-line-options
 --------------------------
@@ -3592,6 +3752,20 @@ The main json-object contains the following:
            that the XBZRLE encoding was bigger than just sent the
            whole page, and then we sent the whole page instead (as as
            normal page).
+- "rdma-reg-cache": only present for an outgoing RDMA migration that
+  registers memory on demand (without the rdma-pin-all capability).
+  It is a json-object with the following information:
+         - "cache-size": memory kept registered at most, 0 if unlimited
+         - "cached": memory currently registered in bytes
+         - "registrations": number of memory registrations
+         - "registration-time": time spent registering memory in
+           microseconds
+         - "prefetched": number of regions registered ahead of the pages
+           sent from them
+         - "hits": pages sent from an already registered region
+         - "misses": pages that needed the region to be registered
+         - "evictions": number of regions unregistered to respect
+           "cache-size"
 
 Examples:
 
@@ -3723,6 +3897,12 @@ Enable/Disable migration capabilities
 - "compress": use multiple compression threads to accelerate live migration
 - "events": generate events for each migration state change
 - "postcopy-ram": postcopy mode for live migration
+- "x-multifd": send RAM pages over several parallel connections
+- "dirty-limit": throttle down only the vCPUs that dirty memory fast
+- "postcopy-preempt": send faulted postcopy pages on a separate connection
+- "x-mapped-ram": give RAM pages fixed offsets in a savevm file
+- "zero-copy-send": send multifd pages without copying them
+- "x-lazy-restore": load RAM from a mapped-ram file on demand
 
 Arguments:
 
@@ -3753,6 +3933,12 @@ Query current migration capabilities
          - "compress": Multiple compression threads state (json-bool)
          - "events": Migration state change event state (json-bool)
          - "postcopy-ram": postcopy ram state (json-bool)
+         - "x-multifd": multiple connections state (json-bool)
+         - "dirty-limit": per-vCPU dirty limit state (json-bool)
+         - "postcopy-preempt": postcopy preempt channel state (json-bool)
+         - "x-mapped-ram": mapped RAM state (json-bool)
+         - "zero-copy-send": zero copy multifd state (json-bool)
+         - "x-lazy-restore": lazy RAM restore state (json-bool)
 
 Arguments:
 
@@ -3766,7 +3952,13 @@ Example:
      {"state": false, "capability": "zero-blocks"},
      {"state": false, "capability": "compress"},
      {"state": true, "capability": "events"},
-     {"state": false, "capability": "postcopy-ram"}
+     {"state": false, "capability": "postcopy-ram"},
+     {"state": false, "capability": "x-multifd"},
+     {"state": false, "capability": "dirty-limit"},
+     {"state": false, "capability": "postcopy-preempt"},
+     {"state": false, "capability": "x-mapped-ram"},
+     {"state": false, "capability": "zero-copy-send"},
+     {"state": false, "capability": "x-lazy-restore"}
    ]}
 
 EQMP
@@ -3790,6 +3982,15 @@ Set migration parameters
                           throttled for auto-converge (json-int)
 - "cpu-throttle-increment": set throttle increasing percentage for
                             auto-converge (json-int)
+- "x-multifd-channels": set the number of connections used by x-multifd
+                        (json-int)
+- "compress-method": set the compression algorithm, "zlib" or "zstd"
+                     (json-string)
+- "vcpu-dirty-limit": set the per-vCPU dirty page rate in MB/s that
+                      dirty-limit throttles down to (json-int)
+- "rdma-reg-cache-size": set the memory in bytes kept registered by an RDMA
+                         migration without rdma-pin-all, 0 for unlimited
+                         (json-int)
 
 Arguments:
 
@@ -3803,7 +4004,7 @@ EQMP
     {
         .name       = "migrate-set-parameters",
         .args_type  =
-            "compress-level:i?,compress-threads:i?,decompress-threads:i?,cpu-throttle-initial:i?,cpu-throttle-increment:i?",
+            "compress-level:i?,compress-threads:i?,decompress-threads:i?,cpu-throttle-initial:i?,cpu-throttle-increment:i?,x-multifd-channels:i?,compress-method:s?,vcpu-dirty-limit:i?,rdma-reg-cache-size:i?",
         .mhandler.cmd_new = qmp_marshal_migrate_set_parameters,
     },
 SQMP
@@ -3820,6 +4021,12 @@ Query current migration parameters
                                     throttled (json-int)
          - "cpu-throttle-increment" : throttle increasing percentage for
                                       auto-converge (json-int)
+         - "x-multifd-channels" : number of x-multifd connections (json-int)
+         - "compress-method" : compression algorithm (json-string)
+         - "vcpu-dirty-limit" : per-vCPU dirty page rate limit in MB/s
+                                (json-int)
+         - "rdma-reg-cache-size" : memory kept registered by RDMA migration
+                                   in bytes (json-int)
 
 Arguments:
 
@@ -3832,7 +4039,11 @@ Example:
          "cpu-throttle-increment": 10,
          "compress-threads": 8,
          "compress-level": 1,
-         "cpu-throttle-initial": 20
+         "cpu-throttle-initial": 20,
+         "x-multifd-channels": 2,
+         "compress-method": "zlib",
+         "vcpu-dirty-limit": 1,
+         "rdma-reg-cache-size": 1073741824
       }
    }
 
@@ -3947,6 +4158,87 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_query_target,
     },
 
+    {
+        .name       = "query-tb-hash",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_query_tb_hash,
+    },
+
+SQMP
+query-tb-hash
+-------------
+
+Return statistics of the hash table of translated blocks.
+
+Arguments: None
+
+Example:
+
+-> { "execute": "query-tb-hash" }
+<- { "return":
+     { "head-buckets": 8192, "used-head-buckets": 3146,
+       "pending-head-buckets": 0, "entries": 3564,
+       "chain": [ { "value": 1, "count": 3126 },
+                  { "value": 2, "count": 20 } ],
+       "occupancy": [ { "value": 0, "count": 5046 },
+                      { "value": 0.125, "count": 12 },
+                      { "value": 0.25, "count": 2752 },
+                      { "value": 0.5, "count": 350 },
+                      { "value": 0.75, "count": 40 },
+                      { "value": 1, "count": 2 } ] }
+   }
+
+EQMP
+
+    {
+        .name       = "query-vfio-dma",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_query_vfio_dma,
+    },
+
+SQMP
+query-vfio-dma
+--------------
+
+Return the progress of the guest RAM mappings of each VFIO container.
+
+Arguments: None
+
+Example:
+
+-> { "execute": "query-vfio-dma" }
+<- { "return": [ { "mapped": 412316860416, "pending": 687194767360,
+                   "complete": false } ] }
+
+EQMP
+
+    {
+        .name       = "query-ox-stats",
+        .args_type  = "since:l?",
+        .mhandler.cmd_new = qmp_marshal_query_ox_stats,
+    },
+
+SQMP
+query-ox-stats
+--------------
+
+Return the telemetry samples of the ox-ctrl controller, oldest first.  The
+controller keeps the last 128 samples, taken every "stats_interval"
+milliseconds (a property of the ox-ctrl device, 0 disables sampling).
+
+Arguments:
+
+- "since": only return the samples with a greater "seq" (json-int, optional)
+
+Example:
+
+-> { "execute": "query-ox-stats", "arguments": { "since": 41 } }
+<- { "return": { "interval": 1000,
+                 "samples": [ { "seq": 42, "time-ns": 1476526800123456789,
+                                "mqs": [], "channels": [] } ] } }
+
+EQMP
+
     {
         .name       = "query-tpm",
         .args_type  = "",
@@ -16,6 +16,7 @@
 #include "qemu/osdep.h"
 #include "qemu-version.h"
 #include "qemu/cutils.h"
+#include "qemu/startup-profile.h"
 #include "monitor/monitor.h"
 #include "sysemu/sysemu.h"
 #include "qmp-commands.h"
@@ -81,6 +82,30 @@ KvmInfo *qmp_query_kvm(Error **errp)
     return info;
 }
 
+static void startup_profile_add_entry(const StartupProfileRecord *rec,
+                                      void *opaque)
+{
+    StartupProfileEntryList ***tail = opaque;
+    StartupProfileEntryList *entry = g_new0(StartupProfileEntryList, 1);
+
+    entry->value = g_new0(StartupProfileEntry, 1);
+    entry->value->kind = g_strdup(rec->kind);
+    entry->value->name = g_strdup(rec->name);
+    entry->value->start_ns = rec->start_ns;
+    entry->value->duration_ns = rec->duration_ns;
+
+    **tail = entry;
+    *tail = &entry->next;
+}
+
+StartupProfileEntryList *qmp_query_startup_profile(Error **errp)
+{
+    StartupProfileEntryList *head = NULL, **tail = &head;
+
+    startup_profile_foreach(startup_profile_add_entry, &tail);
+    return head;
+}
+
 UuidInfo *qmp_query_uuid(Error **errp)
 {
     UuidInfo *info = g_malloc0(sizeof(*info));
@@ -220,13 +220,11 @@ out:
     return NULL;
 }
 
-/* Note: the token object returned by parser_context_peek_token or
- * parser_context_pop_token is deleted as soon as parser_context_pop_token
- * is called again.
+/* Note: tokens belong to the JSONMessageParser that emitted them, and stay
+ * valid until its emit callback returns.
  */
 static JSONToken *parser_context_pop_token(JSONParserContext *ctxt)
 {
-    g_free(ctxt->current);
     assert(!g_queue_is_empty(ctxt->buf));
     ctxt->current = g_queue_pop_head(ctxt->buf);
     return ctxt->current;
@@ -255,14 +253,7 @@ static JSONParserContext *parser_context_new(GQueue *tokens)
 /* to support error propagation, ctxt->err must be freed separately */
 static void parser_context_free(JSONParserContext *ctxt)
 {
-    if (ctxt) {
-        while (!g_queue_is_empty(ctxt->buf)) {
-            parser_context_pop_token(ctxt);
-        }
-        g_free(ctxt->current);
-        g_queue_free(ctxt->buf);
-        g_free(ctxt);
-    }
+    g_free(ctxt);
 }
 
 /**
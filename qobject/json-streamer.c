@@ -20,18 +20,60 @@
 #define MAX_TOKEN_COUNT (2ULL << 20)
 #define MAX_NESTING (1ULL << 10)
 
-static void json_message_free_token(void *token, void *opaque)
+/* Tokens of a message are carved out of chunks of this size, so that
+ * lexing a message does not cost one heap allocation per token.
+ */
+#define TOKEN_CHUNK_SIZE 4096
+
+struct JSONTokenChunk {
+    JSONTokenChunk *next;
+    size_t size;
+    size_t used;
+    char data[];
+};
+
+static JSONToken *json_message_alloc_token(JSONMessageParser *parser,
+                                           size_t size)
 {
-    g_free(token);
+    JSONTokenChunk *chunk = parser->chunks;
+    JSONToken *token;
+
+    size = QEMU_ALIGN_UP(size, sizeof(void *));
+    if (!chunk || chunk->used + size > chunk->size) {
+        size_t chunk_size = MAX(size, TOKEN_CHUNK_SIZE);
+
+        chunk = g_malloc(sizeof(*chunk) + chunk_size);
+        chunk->size = chunk_size;
+        chunk->used = 0;
+        chunk->next = parser->chunks;
+        parser->chunks = chunk;
+    }
+
+    token = (JSONToken *)(chunk->data + chunk->used);
+    chunk->used += size;
+    return token;
 }
 
+/* Drop the tokens of the last message.  The oldest chunk is kept for the
+ * next message unless it was sized for an oversized token.
+ */
 static void json_message_free_tokens(JSONMessageParser *parser)
 {
-    if (parser->tokens) {
-        g_queue_foreach(parser->tokens, json_message_free_token, NULL);
-        g_queue_free(parser->tokens);
-        parser->tokens = NULL;
+    JSONTokenChunk *chunk, *next;
+
+    g_queue_clear(parser->tokens);
+    parser->token_size = 0;
+
+    for (chunk = parser->chunks; chunk; chunk = next) {
+        next = chunk->next;
+        if (!next && chunk->size == TOKEN_CHUNK_SIZE) {
+            chunk->used = 0;
+            parser->chunks = chunk;
+            return;
+        }
+        g_free(chunk);
     }
+    parser->chunks = NULL;
 }
 
 static void json_message_process_token(JSONLexer *lexer, GString *input,
@@ -39,7 +81,7 @@ static void json_message_process_token(JSONLexer *lexer, GString *input,
 {
     JSONMessageParser *parser = container_of(lexer, JSONMessageParser, lexer);
     JSONToken *token;
-    GQueue *tokens;
+    GQueue *tokens = parser->tokens;
 
     switch (type) {
     case JSON_LCURLY:
@@ -58,7 +100,8 @@ static void json_message_process_token(JSONLexer *lexer, GString *input,
         break;
     }
 
-    token = g_malloc(sizeof(JSONToken) + input->len + 1);
+    token = json_message_alloc_token(parser,
+                                     sizeof(JSONToken) + input->len + 1);
     token->type = type;
     memcpy(token->str, input->str, input->len);
     token->str[input->len] = 0;
@@ -89,21 +132,16 @@ static void json_message_process_token(JSONLexer *lexer, GString *input,
 
 out_emit_bad:
     /*
-     * Clear out token list and tell the parser to emit an error
-     * indication by passing it a NULL list
+     * Tell the parser to emit an error indication by passing it a NULL
+     * list; the tokens are dropped below
      */
-    json_message_free_tokens(parser);
+    tokens = NULL;
 out_emit:
     /* send current list of tokens to parser and reset tokenizer */
     parser->brace_count = 0;
     parser->bracket_count = 0;
-    /* parser->emit takes ownership of parser->tokens.  Remove our own
-     * reference to parser->tokens before handing it out to parser->emit.
-     */
-    tokens = parser->tokens;
-    parser->tokens = g_queue_new();
     parser->emit(parser, tokens);
-    parser->token_size = 0;
+    json_message_free_tokens(parser);
 }
 
 void json_message_parser_init(JSONMessageParser *parser,
@@ -113,6 +151,7 @@ void json_message_parser_init(JSONMessageParser *parser,
     parser->brace_count = 0;
     parser->bracket_count = 0;
     parser->tokens = g_queue_new();
+    parser->chunks = NULL;
     parser->token_size = 0;
 
     json_lexer_init(&parser->lexer, json_message_process_token);
@@ -131,6 +170,12 @@ int json_message_parser_flush(JSONMessageParser *parser)
 
 void json_message_parser_destroy(JSONMessageParser *parser)
 {
+    JSONTokenChunk *chunk, *next;
+
     json_lexer_destroy(&parser->lexer);
-    json_message_free_tokens(parser);
+    g_queue_free(parser->tokens);
+    for (chunk = parser->chunks; chunk; chunk = next) {
+        next = chunk->next;
+        g_free(chunk);
+    }
 }
@@ -147,6 +147,16 @@ static void to_json(const QObject *obj, QString *str, int pretty, int indent)
         qstring_append(str, "\"");
 
         for (; *ptr; ptr = end) {
+            /* Copy runs of printable ASCII in one go */
+            for (end = (char *)ptr; *end >= 0x20 && *end < 0x7F &&
+                            *end != '\"' && *end != '\\'; end++) {
+                /* nothing */
+            }
+            if (end != ptr) {
+                qstring_append_len(str, ptr, end - ptr);
+                continue;
+            }
+
             cp = mod_utf8_codepoint(ptr, 6, &end);
             switch (cp) {
             case '\"':
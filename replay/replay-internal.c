@@ -15,6 +15,13 @@
 #include "replay-internal.h"
 #include "qemu/error-report.h"
 #include "sysemu/sysemu.h"
+#include "qemu/atomic.h"
+#include "qemu/bswap.h"
+#include "qemu/queue.h"
+#include "qemu/thread.h"
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
 
 unsigned int replay_data_kind = -1;
 static unsigned int replay_has_unread_data;
@@ -29,10 +36,269 @@ static QemuMutex lock;
 /* File for replay writing */
 FILE *replay_file;
 
+/*
+ * The log goes through REPLAY_BUF_COUNT buffers of REPLAY_BUF_SIZE bytes.
+ * In record mode the events are appended to the current buffer, full
+ * buffers are handed to a thread that compresses them if needed and writes
+ * them out. In play mode the same thread reads the log ahead into the free
+ * buffers. The current buffer is only accessed under the replay mutex.
+ *
+ * A compressed log is a sequence of zstd frames, each preceded by its
+ * compressed and raw sizes as big endian 32-bit values.
+ */
+#define REPLAY_BUF_SIZE     (1 << 20)
+#define REPLAY_BUF_COUNT    4
+
+typedef struct ReplayBuf {
+    uint8_t *data;
+    size_t len;
+    size_t pos;
+    QSIMPLEQ_ENTRY(ReplayBuf) next;
+} ReplayBuf;
+
+static struct {
+    QemuThread thread;
+    QemuMutex lock;
+    QemuCond cond;
+    /* buffers to be written in record mode, read ahead in play mode */
+    QSIMPLEQ_HEAD(, ReplayBuf) full;
+    QSIMPLEQ_HEAD(, ReplayBuf) free;
+    ReplayBuf bufs[REPLAY_BUF_COUNT];
+    ReplayBuf *cur;
+    bool compress;
+    bool running;
+    bool stop;
+    bool eof;
+    bool error;
+    /* play mode: the log was read to the end */
+    bool over;
+} replay_log;
+
+static bool replay_log_write(const uint8_t *buf, size_t len, void *scratch)
+{
+#ifdef CONFIG_ZSTD
+    if (replay_log.compress) {
+        size_t cap = ZSTD_compressBound(REPLAY_BUF_SIZE);
+        uint8_t hdr[8];
+        size_t clen;
+
+        clen = ZSTD_compress(scratch, cap, buf, len, 1);
+        if (ZSTD_isError(clen)) {
+            error_report("replay: compression failed: %s",
+                         ZSTD_getErrorName(clen));
+            return false;
+        }
+        stl_be_p(hdr, clen);
+        stl_be_p(hdr + 4, len);
+        return fwrite(hdr, 1, sizeof(hdr), replay_file) == sizeof(hdr) &&
+               fwrite(scratch, 1, clen, replay_file) == clen;
+    }
+#endif
+    return fwrite(buf, 1, len, replay_file) == len;
+}
+
+/* Returns the number of bytes read, 0 at the end of the log, -1 on error */
+static ssize_t replay_log_read(uint8_t *buf, void *scratch)
+{
+    size_t len;
+
+#ifdef CONFIG_ZSTD
+    if (replay_log.compress) {
+        size_t cap = ZSTD_compressBound(REPLAY_BUF_SIZE);
+        uint8_t hdr[8];
+        size_t clen;
+
+        if (fread(hdr, 1, sizeof(hdr), replay_file) != sizeof(hdr)) {
+            return 0;
+        }
+        clen = ldl_be_p(hdr);
+        len = ldl_be_p(hdr + 4);
+        if (clen > cap || len > REPLAY_BUF_SIZE ||
+            fread(scratch, 1, clen, replay_file) != clen ||
+            ZSTD_decompress(buf, REPLAY_BUF_SIZE, scratch, clen) != len) {
+            return -1;
+        }
+        return len;
+    }
+#endif
+    len = fread(buf, 1, REPLAY_BUF_SIZE, replay_file);
+    return ferror(replay_file) ? -1 : len;
+}
+
+static void *replay_log_writer(void *opaque)
+{
+    void *scratch = opaque;
+    ReplayBuf *b;
+    bool ok = true;
+
+    qemu_mutex_lock(&replay_log.lock);
+    for (;;) {
+        while (QSIMPLEQ_EMPTY(&replay_log.full) && !replay_log.stop) {
+            qemu_cond_wait(&replay_log.cond, &replay_log.lock);
+        }
+        b = QSIMPLEQ_FIRST(&replay_log.full);
+        if (!b) {
+            break;
+        }
+        QSIMPLEQ_REMOVE_HEAD(&replay_log.full, next);
+        qemu_mutex_unlock(&replay_log.lock);
+
+        if (ok && !replay_log_write(b->data, b->len, scratch)) {
+            error_report("replay: cannot write the log");
+            ok = false;
+        }
+        b->len = 0;
+
+        qemu_mutex_lock(&replay_log.lock);
+        replay_log.error |= !ok;
+        QSIMPLEQ_INSERT_TAIL(&replay_log.free, b, next);
+        qemu_cond_broadcast(&replay_log.cond);
+    }
+    qemu_mutex_unlock(&replay_log.lock);
+    return NULL;
+}
+
+static void *replay_log_reader(void *opaque)
+{
+    void *scratch = opaque;
+    ReplayBuf *b;
+    ssize_t len;
+
+    qemu_mutex_lock(&replay_log.lock);
+    while (!replay_log.eof) {
+        while (QSIMPLEQ_EMPTY(&replay_log.free) && !replay_log.stop) {
+            qemu_cond_wait(&replay_log.cond, &replay_log.lock);
+        }
+        if (replay_log.stop) {
+            break;
+        }
+        b = QSIMPLEQ_FIRST(&replay_log.free);
+        QSIMPLEQ_REMOVE_HEAD(&replay_log.free, next);
+        qemu_mutex_unlock(&replay_log.lock);
+
+        len = replay_log_read(b->data, scratch);
+
+        qemu_mutex_lock(&replay_log.lock);
+        if (len > 0) {
+            b->pos = 0;
+            b->len = len;
+            QSIMPLEQ_INSERT_TAIL(&replay_log.full, b, next);
+        } else {
+            QSIMPLEQ_INSERT_TAIL(&replay_log.free, b, next);
+            replay_log.error |= len < 0;
+            replay_log.eof = true;
+        }
+        qemu_cond_broadcast(&replay_log.cond);
+    }
+    qemu_mutex_unlock(&replay_log.lock);
+    return NULL;
+}
+
+void replay_log_start(bool compress)
+{
+    void *scratch = NULL;
+    int i;
+
+    memset(&replay_log, 0, sizeof(replay_log));
+    qemu_mutex_init(&replay_log.lock);
+    qemu_cond_init(&replay_log.cond);
+    QSIMPLEQ_INIT(&replay_log.full);
+    QSIMPLEQ_INIT(&replay_log.free);
+    for (i = 0; i < REPLAY_BUF_COUNT; i++) {
+        replay_log.bufs[i].data = g_malloc(REPLAY_BUF_SIZE);
+        QSIMPLEQ_INSERT_TAIL(&replay_log.free, &replay_log.bufs[i], next);
+    }
+    replay_log.cur = QSIMPLEQ_FIRST(&replay_log.free);
+    QSIMPLEQ_REMOVE_HEAD(&replay_log.free, next);
+    replay_log.compress = compress;
+#ifdef CONFIG_ZSTD
+    if (compress) {
+        scratch = g_malloc(ZSTD_compressBound(REPLAY_BUF_SIZE));
+    }
+#endif
+
+    if (replay_mode == REPLAY_MODE_RECORD) {
+        qemu_thread_create(&replay_log.thread, "replay-writer",
+                           replay_log_writer, scratch, QEMU_THREAD_JOINABLE);
+    } else {
+        qemu_thread_create(&replay_log.thread, "replay-reader",
+                           replay_log_reader, scratch, QEMU_THREAD_JOINABLE);
+    }
+    replay_log.running = true;
+}
+
+/* Record mode: queue the current buffer and take a free one */
+static void replay_log_submit(void)
+{
+    qemu_mutex_lock(&replay_log.lock);
+    QSIMPLEQ_INSERT_TAIL(&replay_log.full, replay_log.cur, next);
+    qemu_cond_broadcast(&replay_log.cond);
+    while (QSIMPLEQ_EMPTY(&replay_log.free)) {
+        qemu_cond_wait(&replay_log.cond, &replay_log.lock);
+    }
+    replay_log.cur = QSIMPLEQ_FIRST(&replay_log.free);
+    QSIMPLEQ_REMOVE_HEAD(&replay_log.free, next);
+    qemu_mutex_unlock(&replay_log.lock);
+}
+
+/* Play mode: release the current buffer and take the next one read ahead */
+static bool replay_log_fetch(void)
+{
+    ReplayBuf *b;
+
+    qemu_mutex_lock(&replay_log.lock);
+    while (QSIMPLEQ_EMPTY(&replay_log.full) && !replay_log.eof) {
+        qemu_cond_wait(&replay_log.cond, &replay_log.lock);
+    }
+    b = QSIMPLEQ_FIRST(&replay_log.full);
+    if (b) {
+        QSIMPLEQ_REMOVE_HEAD(&replay_log.full, next);
+        QSIMPLEQ_INSERT_TAIL(&replay_log.free, replay_log.cur, next);
+        replay_log.cur = b;
+        qemu_cond_broadcast(&replay_log.cond);
+    } else {
+        replay_log.over = true;
+    }
+    qemu_mutex_unlock(&replay_log.lock);
+    return b != NULL;
+}
+
+/* Writes out everything recorded so far and stops the log thread */
+bool replay_log_stop(void)
+{
+    bool ok;
+    int i;
+
+    if (!replay_log.running) {
+        return true;
+    }
+    if (replay_mode == REPLAY_MODE_RECORD && replay_log.cur->len) {
+        replay_log_submit();
+    }
+
+    qemu_mutex_lock(&replay_log.lock);
+    replay_log.stop = true;
+    qemu_cond_broadcast(&replay_log.cond);
+    qemu_mutex_unlock(&replay_log.lock);
+    qemu_thread_join(&replay_log.thread);
+    replay_log.running = false;
+    ok = !replay_log.error;
+
+    for (i = 0; i < REPLAY_BUF_COUNT; i++) {
+        g_free(replay_log.bufs[i].data);
+    }
+    qemu_cond_destroy(&replay_log.cond);
+    qemu_mutex_destroy(&replay_log.lock);
+    return ok;
+}
+
 void replay_put_byte(uint8_t byte)
 {
     if (replay_file) {
-        putc(byte, replay_file);
+        if (replay_log.cur->len == REPLAY_BUF_SIZE) {
+            replay_log_submit();
+        }
+        replay_log.cur->data[replay_log.cur->len++] = byte;
     }
 }
 
@@ -63,9 +329,20 @@ void replay_put_qword(int64_t qword)
 
 void replay_put_array(const uint8_t *buf, size_t size)
 {
+    size_t n;
+
     if (replay_file) {
         replay_put_dword(size);
-        fwrite(buf, 1, size, replay_file);
+        while (size) {
+            if (replay_log.cur->len == REPLAY_BUF_SIZE) {
+                replay_log_submit();
+            }
+            n = MIN(size, REPLAY_BUF_SIZE - replay_log.cur->len);
+            memcpy(replay_log.cur->data + replay_log.cur->len, buf, n);
+            replay_log.cur->len += n;
+            buf += n;
+            size -= n;
+        }
     }
 }
 
@@ -73,7 +350,11 @@ uint8_t replay_get_byte(void)
 {
     uint8_t byte = 0;
     if (replay_file) {
-        byte = getc(replay_file);
+        if (replay_log.cur->pos == replay_log.cur->len &&
+            !replay_log_fetch()) {
+            return byte;
+        }
+        byte = replay_log.cur->data[replay_log.cur->pos++];
     }
     return byte;
 }
@@ -111,11 +392,28 @@ int64_t replay_get_qword(void)
     return qword;
 }
 
+static size_t replay_get_buf(uint8_t *buf, size_t size)
+{
+    size_t n, done = 0;
+
+    while (done < size) {
+        if (replay_log.cur->pos == replay_log.cur->len &&
+            !replay_log_fetch()) {
+            break;
+        }
+        n = MIN(size - done, replay_log.cur->len - replay_log.cur->pos);
+        memcpy(buf + done, replay_log.cur->data + replay_log.cur->pos, n);
+        replay_log.cur->pos += n;
+        done += n;
+    }
+    return done;
+}
+
 void replay_get_array(uint8_t *buf, size_t *size)
 {
     if (replay_file) {
         *size = replay_get_dword();
-        if (fread(buf, 1, *size, replay_file) != *size) {
+        if (replay_get_buf(buf, *size) != *size) {
             error_report("replay read error");
         }
     }
@@ -126,7 +424,7 @@ void replay_get_array_alloc(uint8_t **buf, size_t *size)
     if (replay_file) {
         *size = replay_get_dword();
         *buf = g_malloc(*size);
-        if (fread(*buf, 1, *size, replay_file) != *size) {
+        if (replay_get_buf(*buf, *size) != *size) {
             error_report("replay read error");
         }
     }
@@ -135,11 +433,11 @@ void replay_get_array_alloc(uint8_t **buf, size_t *size)
 void replay_check_error(void)
 {
     if (replay_file) {
-        if (feof(replay_file)) {
+        if (replay_log.over) {
             error_report("replay file is over");
             qemu_system_vmstop_request_prepare();
             qemu_system_vmstop_request(RUN_STATE_PAUSED);
-        } else if (ferror(replay_file)) {
+        } else if (atomic_read(&replay_log.error)) {
             error_report("replay file is over or something goes wrong");
             qemu_system_vmstop_request_prepare();
             qemu_system_vmstop_request(RUN_STATE_INTERNAL_ERROR);
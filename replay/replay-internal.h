@@ -84,6 +84,12 @@ int64_t replay_get_qword(void);
 void replay_get_array(uint8_t *buf, size_t *size);
 void replay_get_array_alloc(uint8_t **buf, size_t *size);
 
+/*! Starts the thread writing the log or reading it ahead */
+void replay_log_start(bool compress);
+/*! Writes out the buffered events and stops the log thread.
+    \return false if the log could not be written or read */
+bool replay_log_stop(void);
+
 /* Mutex functions for protecting replay log file */
 
 void replay_mutex_init(void);
@@ -18,17 +18,21 @@
 #include "qemu/main-loop.h"
 #include "sysemu/sysemu.h"
 #include "qemu/error-report.h"
+#include "qemu/bswap.h"
 
 /* Current version of the replay mechanism.
    Increase it when file format changes. */
 #define REPLAY_VERSION              0xe02004
 /* Size of replay log header */
 #define HEADER_SIZE                 (sizeof(uint32_t) + sizeof(uint64_t))
+/* Header flags, following the version */
+#define REPLAY_FLAG_ZSTD            1
 
 ReplayMode replay_mode = REPLAY_MODE_NONE;
 
 /* Name of replay file  */
 static char *replay_filename;
+static bool replay_compress;
 ReplayState replay_state;
 static GSList *replay_blockers;
 
@@ -207,7 +211,7 @@ out:
     return res;
 }
 
-static void replay_enable(const char *fname, int mode)
+static void replay_enable(const char *fname, int mode, bool compress)
 {
     const char *fmode = NULL;
     assert(!replay_file);
@@ -244,14 +248,30 @@ static void replay_enable(const char *fname, int mode)
     /* skip file header for RECORD and check it for PLAY */
     if (replay_mode == REPLAY_MODE_RECORD) {
         fseek(replay_file, HEADER_SIZE, SEEK_SET);
+        replay_compress = compress;
+        replay_log_start(replay_compress);
     } else if (replay_mode == REPLAY_MODE_PLAY) {
-        unsigned int version = replay_get_dword();
-        if (version != REPLAY_VERSION) {
+        uint8_t header[HEADER_SIZE];
+        uint64_t flags;
+
+        if (fread(header, 1, HEADER_SIZE, replay_file) != HEADER_SIZE ||
+            ldl_be_p(header) != REPLAY_VERSION) {
             fprintf(stderr, "Replay: invalid input log file version\n");
             exit(1);
         }
-        /* go to the beginning */
-        fseek(replay_file, HEADER_SIZE, SEEK_SET);
+        flags = ldq_be_p(header + sizeof(uint32_t));
+        if (flags & ~REPLAY_FLAG_ZSTD) {
+            fprintf(stderr, "Replay: unsupported input log file flags\n");
+            exit(1);
+        }
+#ifndef CONFIG_ZSTD
+        if (flags & REPLAY_FLAG_ZSTD) {
+            fprintf(stderr, "Replay: compressed log needs zstd support\n");
+            exit(1);
+        }
+#endif
+        replay_compress = flags & REPLAY_FLAG_ZSTD;
+        replay_log_start(replay_compress);
         replay_fetch_data_kind();
     }
 
@@ -262,6 +282,7 @@ void replay_configure(QemuOpts *opts)
 {
     const char *fname;
     const char *rr;
+    bool compress;
     ReplayMode mode = REPLAY_MODE_NONE;
     Location loc;
 
@@ -291,7 +312,15 @@ void replay_configure(QemuOpts *opts)
         exit(1);
     }
 
-    replay_enable(fname, mode);
+    compress = qemu_opt_get_bool(opts, "rrcompress", false);
+#ifndef CONFIG_ZSTD
+    if (compress) {
+        error_report("rrcompress requires zstd support");
+        exit(1);
+    }
+#endif
+
+    replay_enable(fname, mode, compress);
 
 out:
     loc_pop(&loc);
@@ -328,12 +357,24 @@ void replay_finish(void)
     /* finalize the file */
     if (replay_file) {
         if (replay_mode == REPLAY_MODE_RECORD) {
+            uint8_t header[HEADER_SIZE];
+
             /* write end event */
             replay_put_event(EVENT_END);
+            if (!replay_log_stop()) {
+                error_report("Replay: the log file is incomplete");
+            }
 
             /* write header */
+            stl_be_p(header, REPLAY_VERSION);
+            stq_be_p(header + sizeof(uint32_t),
+                     replay_compress ? REPLAY_FLAG_ZSTD : 0);
             fseek(replay_file, 0, SEEK_SET);
-            replay_put_dword(REPLAY_VERSION);
+            if (fwrite(header, 1, HEADER_SIZE, replay_file) != HEADER_SIZE) {
+                error_report("Replay: cannot write the log file header");
+            }
+        } else {
+            replay_log_stop();
         }
 
         fclose(replay_file);
@@ -20,11 +20,17 @@ All backends must generate their contents through the 'tracetool.out' routine.
 Backend attributes
 ------------------
 
-========= ====================================================================
-Attribute Description
-========= ====================================================================
-PUBLIC    If exists and is set to 'True', the backend is considered "public".
-========= ====================================================================
+=========================== ==================================================
+Attribute                   Description
+=========================== ==================================================
+PUBLIC                      If exists and is set to 'True', the backend is
+                            considered "public".
+CHECK_TRACE_EVENT_GET_STATE If exists and is set to 'True', the backend only
+                            runs when the event is enabled.  The generated
+                            trace_<event> checks the event state once for
+                            all such backends, so their code must not check
+                            it again.
+=========================== ==================================================
 
 
 Backend functions
@@ -106,8 +112,25 @@ class Wrapper:
             assert exists(backend)
         assert tracetool.format.exists(self._format)
 
+    def _check_state(self, backend):
+        return tracetool.try_import("tracetool.backend." + backend,
+                                    "CHECK_TRACE_EVENT_GET_STATE", False)[1]
+
+    @property
+    def check_trace_event_get_state(self):
+        """Whether any backend runs only for enabled events."""
+        return any(self._check_state(b) for b in self._backends)
+
+    @property
+    def nocheck_trace_event_get_state(self):
+        """Whether any backend runs regardless of the event state."""
+        return not all(self._check_state(b) for b in self._backends)
+
     def _run_function(self, name, *args, **kwargs):
+        check = kwargs.pop("check_trace_event_get_state", None)
         for backend in self._backends:
+            if check is not None and self._check_state(backend) != check:
+                continue
             func = tracetool.try_import("tracetool.backend." + backend,
                                         name % self._format, None)[1]
             if func is not None:
@@ -116,8 +139,9 @@ class Wrapper:
     def generate_begin(self, events):
         self._run_function("generate_%s_begin", events)
 
-    def generate(self, event):
-        self._run_function("generate_%s", event)
+    def generate(self, event, check_trace_event_get_state=None):
+        self._run_function("generate_%s", event,
+                           check_trace_event_get_state=check_trace_event_get_state)
 
     def generate_end(self, events):
         self._run_function("generate_%s_end", events)
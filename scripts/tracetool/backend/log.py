@@ -17,6 +17,7 @@ from tracetool import out
 
 
 PUBLIC = True
+CHECK_TRACE_EVENT_GET_STATE = True
 
 
 def generate_h_begin(events):
@@ -30,13 +31,7 @@ def generate_h(event):
     if len(event.args) > 0:
         argnames = ", " + argnames
 
-    if "vcpu" in event.properties:
-        # already checked on the generic format code
-        cond = "true"
-    else:
-        cond = "trace_event_get_state(%s)" % ("TRACE_" + event.name.upper())
-
-    out('        if (%(cond)s) {',
+    out('        {',
         '            struct timeval _now;',
         '            gettimeofday(&_now, NULL);',
         '            qemu_log_mask(LOG_TRACE, "%%d@%%zd.%%06zd:%(name)s " %(fmt)s "\\n",',
@@ -44,7 +39,6 @@ def generate_h(event):
         '                          (size_t)_now.tv_sec, (size_t)_now.tv_usec',
         '                          %(argnames)s);',
         '        }',
-        cond=cond,
         name=event.name,
         fmt=event.fmt.rstrip("\n"),
         argnames=argnames)
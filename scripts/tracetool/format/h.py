@@ -43,16 +43,28 @@ def generate(events, backend):
         out('',
             'static inline void %(api)s(%(args)s)',
             '{',
-            '    if (%(cond)s) {',
             api=e.api(),
-            args=e.args,
-            cond=cond)
+            args=e.args)
 
         if "disable" not in e.properties:
-            backend.generate(e)
+            # Backends that honour the event state share a single check,
+            # so a disabled event costs one load and branch and does not
+            # call into any backend.
+            if backend.check_trace_event_get_state:
+                if "vcpu" in e.properties:
+                    check_cond = cond
+                else:
+                    check_cond = "trace_event_get_state(TRACE_%s)" % \
+                                 e.name.upper()
+                out('    if (%(cond)s) {', cond=check_cond)
+                backend.generate(e, check_trace_event_get_state=True)
+                out('    }')
+            if backend.nocheck_trace_event_get_state:
+                out('    if (%(cond)s) {', cond=cond)
+                backend.generate(e, check_trace_event_get_state=False)
+                out('    }')
 
-        out('    }',
-            '}')
+        out('}')
 
     backend.generate_end(events)
 
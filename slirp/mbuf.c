@@ -18,7 +18,8 @@
 #include "qemu/osdep.h"
 #include "slirp.h"
 
-#define MBUF_THRESH 30
+/* Number of free mbufs kept for reuse */
+#define MBUF_THRESH 256
 
 /*
  * Find a nice value for msize
@@ -58,15 +59,14 @@ void m_cleanup(Slirp *slirp)
  * Get an mbuf from the free list, if there are none
  * malloc one
  *
- * Because fragmentation can occur if we alloc new mbufs and
- * free old mbufs, we mark all mbufs above mbuf_thresh as M_DOFREE,
- * which tells m_free to actually free() it
+ * m_free keeps up to MBUF_THRESH mbufs on the free list, however many
+ * are in use, so that a busy stack does not malloc() each packet; any
+ * beyond that are really free()d.
  */
 struct mbuf *
 m_get(Slirp *slirp)
 {
 	register struct mbuf *m;
-	int flags = 0;
 
 	DEBUG_CALL("m_get");
 
@@ -74,17 +74,16 @@ m_get(Slirp *slirp)
 		m = (struct mbuf *)malloc(SLIRP_MSIZE);
 		if (m == NULL) goto end_error;
 		slirp->mbuf_alloced++;
-		if (slirp->mbuf_alloced > MBUF_THRESH)
-			flags = M_DOFREE;
 		m->slirp = slirp;
 	} else {
 		m = (struct mbuf *) slirp->m_freelist.qh_link;
 		remque(m);
+		slirp->mbuf_nfree--;
 	}
 
 	/* Insert it in the used list */
 	insque(m,&slirp->m_usedlist);
-	m->m_flags = (flags | M_USEDLIST);
+	m->m_flags = M_USEDLIST;
 
 	/* Initialise it */
 	m->m_size = SLIRP_MSIZE - offsetof(struct mbuf, m_dat);
@@ -118,12 +117,15 @@ m_free(struct mbuf *m)
 	/*
 	 * Either free() it or put it on the free list
 	 */
-	if (m->m_flags & M_DOFREE) {
+	if (m->m_flags & M_FREELIST) {
+		/* Already free */
+	} else if (m->slirp->mbuf_nfree >= MBUF_THRESH) {
 		m->slirp->mbuf_alloced--;
 		free(m);
-	} else if ((m->m_flags & M_FREELIST) == 0) {
+	} else {
 		insque(m,&m->slirp->m_freelist);
 		m->m_flags = M_FREELIST; /* Clobber other flags */
+		m->slirp->mbuf_nfree++;
 	}
   } /* if(m) */
 }
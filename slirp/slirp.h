@@ -179,6 +179,7 @@ struct Slirp {
     struct quehead m_freelist;
     struct quehead m_usedlist;
     int mbuf_alloced;
+    int mbuf_nfree;
 
     /* if states */
     struct quehead if_fastq;   /* fast queue (for interactive data) */
@@ -198,13 +199,13 @@ struct Slirp {
 
     /* tcp states */
     struct socket tcb;
-    struct socket *tcp_last_so;
+    struct socket *tcp_cache[SO_CACHE_SIZE];
     tcp_seq tcp_iss;        /* tcp initial send seq # */
     uint32_t tcp_now;       /* for RFC 1323 timestamps */
 
     /* udp states */
     struct socket udb;
-    struct socket *udp_last_so;
+    struct socket *udp_cache[SO_CACHE_SIZE];
 
     /* icmp states */
     struct socket icmp;
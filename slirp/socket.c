@@ -16,13 +16,47 @@
 static void sofcantrcvmore(struct socket *so);
 static void sofcantsendmore(struct socket *so);
 
-struct socket *solookup(struct socket **last, struct socket *head,
+static uint32_t sockaddr_hash(struct sockaddr_storage *a)
+{
+    switch (a->ss_family) {
+    case AF_INET:
+    {
+        struct sockaddr_in *a4 = (struct sockaddr_in *) a;
+        return a4->sin_addr.s_addr ^ a4->sin_port;
+    }
+    case AF_INET6:
+    {
+        struct sockaddr_in6 *a6 = (struct sockaddr_in6 *) a;
+        uint32_t w;
+
+        memcpy(&w, &a6->sin6_addr.s6_addr[12], sizeof(w));
+        return w ^ a6->sin6_port;
+    }
+    default:
+        g_assert_not_reached();
+    }
+}
+
+/*
+ * Find the socket for a packet.  CACHE is a direct-mapped table of
+ * SO_CACHE_SIZE recently found sockets, so that established connections
+ * are found without walking the whole list.
+ */
+struct socket *solookup(struct socket **cache, struct socket *head,
         struct sockaddr_storage *lhost, struct sockaddr_storage *fhost)
 {
-    struct socket *so = *last;
+    struct socket **slot;
+    struct socket *so;
+    uint32_t h;
 
-    /* Optimisation */
-    if (so != head && sockaddr_equal(&(so->lhost.ss), lhost)
+    h = sockaddr_hash(lhost);
+    if (fhost) {
+        h = h * 31 + sockaddr_hash(fhost);
+    }
+    slot = &cache[(h * 0x9e3779b1) >> (32 - SO_CACHE_BITS)];
+
+    so = *slot;
+    if (so && sockaddr_equal(&(so->lhost.ss), lhost)
             && (!fhost || sockaddr_equal(&so->fhost.ss, fhost))) {
         return so;
     }
@@ -30,7 +64,11 @@ struct socket *solookup(struct socket **last, struct socket *head,
     for (so = head->so_next; so != head; so = so->so_next) {
         if (sockaddr_equal(&(so->lhost.ss), lhost)
                 && (!fhost || sockaddr_equal(&so->fhost.ss, fhost))) {
-            *last = so;
+            if (so->so_cache_slot && *so->so_cache_slot == so) {
+                *so->so_cache_slot = NULL;
+            }
+            *slot = so;
+            so->so_cache_slot = slot;
             return so;
         }
     }
@@ -71,10 +109,8 @@ sofree(struct socket *so)
 	sofree(so->extra);
 	so->extra=NULL;
   }
-  if (so == slirp->tcp_last_so) {
-      slirp->tcp_last_so = &slirp->tcb;
-  } else if (so == slirp->udp_last_so) {
-      slirp->udp_last_so = &slirp->udb;
+  if (so->so_cache_slot && *so->so_cache_slot == so) {
+      *so->so_cache_slot = NULL;
   } else if (so == slirp->icmp_last_so) {
       slirp->icmp_last_so = &slirp->icmp;
   }
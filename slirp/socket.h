@@ -11,6 +11,10 @@
 #define SO_EXPIRE 240000
 #define SO_EXPIREFAST 10000
 
+/* Size of the hashed cache in front of the TCP and UDP socket lists */
+#define SO_CACHE_BITS 10
+#define SO_CACHE_SIZE (1 << SO_CACHE_BITS)
+
 /*
  * Our socket structure
  */
@@ -23,6 +27,7 @@ struct socket {
   int pollfds_idx;                 /* GPollFD GArray index */
 
   Slirp *slirp;			   /* managing slirp instance */
+  struct socket **so_cache_slot;   /* solookup cache entry, if any */
 
 			/* XXX union these with not-yet-used sbuf params */
   struct mbuf *so_m;	           /* Pointer to the original SYN packet,
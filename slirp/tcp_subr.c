@@ -53,7 +53,6 @@ tcp_init(Slirp *slirp)
 {
     slirp->tcp_iss = 1;		/* wrong */
     slirp->tcb.so_next = slirp->tcb.so_prev = &slirp->tcb;
-    slirp->tcp_last_so = &slirp->tcb;
 }
 
 void tcp_cleanup(Slirp *slirp)
@@ -325,9 +324,6 @@ tcp_close(struct tcpcb *tp)
 	}
 	free(tp);
         so->so_tcpcb = NULL;
-	/* clobber input socket cache if we're closing the cached connection */
-	if (so == slirp->tcp_last_so)
-		slirp->tcp_last_so = &slirp->tcb;
 	closesocket(so->s);
 	sbfree(&so->so_rcv);
 	sbfree(&so->so_snd);
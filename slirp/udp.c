@@ -48,7 +48,6 @@ void
 udp_init(Slirp *slirp)
 {
     slirp->udb.so_next = slirp->udb.so_prev = &slirp->udb;
-    slirp->udp_last_so = &slirp->udb;
 }
 
 void udp_cleanup(Slirp *slirp)
@@ -163,7 +162,7 @@ udp_input(register struct mbuf *m, int iphlen)
 	/*
 	 * Locate pcb for datagram.
 	 */
-	so = solookup(&slirp->udp_last_so, &slirp->udb, &lhost, NULL);
+	so = solookup(slirp->udp_cache, &slirp->udb, &lhost, NULL);
 
 	if (so == NULL) {
 	  /*
@@ -85,7 +85,7 @@ void udp6_input(struct mbuf *m)
         goto bad;
     }
 
-    so = solookup(&slirp->udp_last_so, &slirp->udb,
+    so = solookup(slirp->udp_cache, &slirp->udb,
                   (struct sockaddr_storage *) &lhost, NULL);
 
     if (so == NULL) {
@@ -152,6 +152,11 @@ WORD_TYPE helper_le_ld_name(CPUArchState *env, target_ulong addr,
 
     /* Adjust the given return address.  */
     retaddr -= GETPC_ADJ;
+#ifndef SOFTMMU_CODE_ACCESS
+    if (unlikely(tb_sample_mem)) {
+        tb_sample_mem_access(ENV_GET_CPU(env), addr, DATA_SIZE, false);
+    }
+#endif
 
     if (a_bits > 0 && (addr & ((1 << a_bits) - 1)) != 0) {
         cpu_unaligned_access(ENV_GET_CPU(env), addr, READ_ACCESS_TYPE,
@@ -226,6 +231,11 @@ WORD_TYPE helper_be_ld_name(CPUArchState *env, target_ulong addr,
 
     /* Adjust the given return address.  */
     retaddr -= GETPC_ADJ;
+#ifndef SOFTMMU_CODE_ACCESS
+    if (unlikely(tb_sample_mem)) {
+        tb_sample_mem_access(ENV_GET_CPU(env), addr, DATA_SIZE, false);
+    }
+#endif
 
     if (a_bits > 0 && (addr & ((1 << a_bits) - 1)) != 0) {
         cpu_unaligned_access(ENV_GET_CPU(env), addr, READ_ACCESS_TYPE,
@@ -336,6 +346,9 @@ void helper_le_st_name(CPUArchState *env, target_ulong addr, DATA_TYPE val,
 
     /* Adjust the given return address.  */
     retaddr -= GETPC_ADJ;
+    if (unlikely(tb_sample_mem)) {
+        tb_sample_mem_access(ENV_GET_CPU(env), addr, DATA_SIZE, true);
+    }
 
     if (a_bits > 0 && (addr & ((1 << a_bits) - 1)) != 0) {
         cpu_unaligned_access(ENV_GET_CPU(env), addr, MMU_DATA_STORE,
@@ -419,6 +432,9 @@ void helper_be_st_name(CPUArchState *env, target_ulong addr, DATA_TYPE val,
 
     /* Adjust the given return address.  */
     retaddr -= GETPC_ADJ;
+    if (unlikely(tb_sample_mem)) {
+        tb_sample_mem_access(ENV_GET_CPU(env), addr, DATA_SIZE, true);
+    }
 
     if (a_bits > 0 && (addr & ((1 << a_bits) - 1)) != 0) {
         cpu_unaligned_access(ENV_GET_CPU(env), addr, MMU_DATA_STORE,
@@ -302,7 +302,8 @@ static inline void gen_goto_tb(DisasContext *s, int n, uint64_t dest)
         } else if (s->singlestep_enabled) {
             gen_exception_internal(EXCP_DEBUG);
         } else {
-            tcg_gen_exit_tb(0);
+            /* Not linkable, but the lookup validates the target mapping */
+            tcg_gen_lookup_and_goto_ptr();
             s->is_jmp = DISAS_TB_JUMP;
         }
     }
@@ -1795,13 +1796,70 @@ static void gen_load_exclusive(DisasContext *s, int rt, int rt2,
 }
 
 #ifdef CONFIG_USER_ONLY
+/* In user mode the store is a compare-and-swap against the values seen by
+ * the load exclusive, as for AArch32.  Pairs of 64-bit registers have no
+ * host operation wide enough and still exit to the cpu loop, which does
+ * the store with the other CPUs stopped.
+ */
 static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
-                                TCGv_i64 addr, int size, int is_pair)
+                                TCGv_i64 inaddr, int size, int is_pair)
 {
-    tcg_gen_mov_i64(cpu_exclusive_test, addr);
-    tcg_gen_movi_i32(cpu_exclusive_info,
-                     size | is_pair << 2 | (rd << 4) | (rt << 9) | (rt2 << 14));
-    gen_exception_internal_insn(s, 4, EXCP_STREX);
+    TCGLabel *fail_label;
+    TCGLabel *done_label;
+    TCGv_i64 addr, tmp;
+
+    if (is_pair && size == 3) {
+        tcg_gen_mov_i64(cpu_exclusive_test, inaddr);
+        tcg_gen_movi_i32(cpu_exclusive_info, size | is_pair << 2 |
+                         (rd << 4) | (rt << 9) | (rt2 << 14));
+        gen_exception_internal_insn(s, 4, EXCP_STREX);
+        return;
+    }
+
+    fail_label = gen_new_label();
+    done_label = gen_new_label();
+    addr = tcg_temp_local_new_i64();
+
+    /* Copy input into a local temp so it is not trashed when the
+     * basic block ends at the branch insn.
+     */
+    tcg_gen_mov_i64(addr, inaddr);
+    tcg_gen_brcond_i64(TCG_COND_NE, addr, cpu_exclusive_addr, fail_label);
+
+    tmp = tcg_temp_new_i64();
+    if (is_pair) {
+        TCGv_i64 cmp = tcg_temp_new_i64();
+        TCGv_i64 val = tcg_temp_new_i64();
+
+        /* Both 32-bit registers as one 64-bit access */
+        if (s->be_data == MO_BE) {
+            tcg_gen_concat32_i64(cmp, cpu_exclusive_high, cpu_exclusive_val);
+            tcg_gen_concat32_i64(val, cpu_reg(s, rt2), cpu_reg(s, rt));
+        } else {
+            tcg_gen_concat32_i64(cmp, cpu_exclusive_val, cpu_exclusive_high);
+            tcg_gen_concat32_i64(val, cpu_reg(s, rt), cpu_reg(s, rt2));
+        }
+        tcg_gen_atomic_cmpxchg_i64(tmp, addr, cmp, val, get_mem_index(s),
+                                   MO_64 | MO_ALIGN | s->be_data);
+        tcg_gen_setcond_i64(TCG_COND_NE, tmp, tmp, cmp);
+
+        tcg_temp_free_i64(val);
+        tcg_temp_free_i64(cmp);
+    } else {
+        tcg_gen_atomic_cmpxchg_i64(tmp, addr, cpu_exclusive_val,
+                                   cpu_reg(s, rt), get_mem_index(s),
+                                   size | MO_ALIGN | s->be_data);
+        tcg_gen_setcond_i64(TCG_COND_NE, tmp, tmp, cpu_exclusive_val);
+    }
+    tcg_gen_mov_i64(cpu_reg(s, rd), tmp);
+    tcg_temp_free_i64(tmp);
+    tcg_temp_free_i64(addr);
+    tcg_gen_br(done_label);
+
+    gen_set_label(fail_label);
+    tcg_gen_movi_i64(cpu_reg(s, rd), 1);
+    gen_set_label(done_label);
+    tcg_gen_movi_i64(cpu_exclusive_addr, -1);
 }
 #else
 static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
@@ -9520,8 +9578,8 @@ static void disas_simd_3same_int(DisasContext *s, uint32_t insn)
             case 0x10: /* ADD, SUB */
             {
                 static NeonGenTwoOpFn * const fns[3][2] = {
-                    { gen_helper_neon_add_u8, gen_helper_neon_sub_u8 },
-                    { gen_helper_neon_add_u16, gen_helper_neon_sub_u16 },
+                    { tcg_gen_vec_add8_i32, tcg_gen_vec_sub8_i32 },
+                    { tcg_gen_vec_add16_i32, tcg_gen_vec_sub16_i32 },
                     { tcg_gen_add_i32, tcg_gen_sub_i32 },
                 };
                 genfn = fns[size][u];
@@ -9578,8 +9636,8 @@ static void disas_simd_3same_int(DisasContext *s, uint32_t insn)
             if (opcode == 0xf || opcode == 0x12) {
                 /* SABA, UABA, MLA, MLS: accumulating ops */
                 static NeonGenTwoOpFn * const fns[3][2] = {
-                    { gen_helper_neon_add_u8, gen_helper_neon_sub_u8 },
-                    { gen_helper_neon_add_u16, gen_helper_neon_sub_u16 },
+                    { tcg_gen_vec_add8_i32, tcg_gen_vec_sub8_i32 },
+                    { tcg_gen_vec_add16_i32, tcg_gen_vec_sub16_i32 },
                     { tcg_gen_add_i32, tcg_gen_sub_i32 },
                 };
                 bool is_sub = (opcode == 0x12 && u); /* MLS */
@@ -10331,9 +10389,9 @@ static void disas_simd_two_reg_misc(DisasContext *s, uint32_t insn)
                     if (u) {
                         TCGv_i32 tcg_zero = tcg_const_i32(0);
                         if (size) {
-                            gen_helper_neon_sub_u16(tcg_res, tcg_zero, tcg_op);
+                            tcg_gen_vec_sub16_i32(tcg_res, tcg_zero, tcg_op);
                         } else {
-                            gen_helper_neon_sub_u8(tcg_res, tcg_zero, tcg_op);
+                            tcg_gen_vec_sub8_i32(tcg_res, tcg_zero, tcg_op);
                         }
                         tcg_temp_free_i32(tcg_zero);
                     } else {
@@ -10592,7 +10650,7 @@ static void disas_simd_indexed(DisasContext *s, uint32_t insn)
             case 0x8: /* MUL */
             {
                 static NeonGenTwoOpFn * const fns[2][2] = {
-                    { gen_helper_neon_add_u16, gen_helper_neon_sub_u16 },
+                    { tcg_gen_vec_add16_i32, tcg_gen_vec_sub16_i32 },
                     { tcg_gen_add_i32, tcg_gen_sub_i32 },
                 };
                 NeonGenTwoOpFn *genfn;
@@ -4068,8 +4068,9 @@ static inline void gen_goto_tb(DisasContext *s, int n, target_ulong dest)
         gen_set_pc_im(s, dest);
         tcg_gen_exit_tb((uintptr_t)s->tb + n);
     } else {
+        /* Cross-page: the lookup validates the target mapping */
         gen_set_pc_im(s, dest);
-        tcg_gen_exit_tb(0);
+        tcg_gen_lookup_and_goto_ptr();
     }
 }
 
@@ -4406,8 +4407,8 @@ static void gen_nop_hint(DisasContext *s, int val)
 static inline void gen_neon_add(int size, TCGv_i32 t0, TCGv_i32 t1)
 {
     switch (size) {
-    case 0: gen_helper_neon_add_u8(t0, t0, t1); break;
-    case 1: gen_helper_neon_add_u16(t0, t0, t1); break;
+    case 0: tcg_gen_vec_add8_i32(t0, t0, t1); break;
+    case 1: tcg_gen_vec_add16_i32(t0, t0, t1); break;
     case 2: tcg_gen_add_i32(t0, t0, t1); break;
     default: abort();
     }
@@ -4416,8 +4417,8 @@ static inline void gen_neon_add(int size, TCGv_i32 t0, TCGv_i32 t1)
 static inline void gen_neon_rsb(int size, TCGv_i32 t0, TCGv_i32 t1)
 {
     switch (size) {
-    case 0: gen_helper_neon_sub_u8(t0, t1, t0); break;
-    case 1: gen_helper_neon_sub_u16(t0, t1, t0); break;
+    case 0: tcg_gen_vec_sub8_i32(t0, t1, t0); break;
+    case 1: tcg_gen_vec_sub16_i32(t0, t1, t0); break;
     case 2: tcg_gen_sub_i32(t0, t1, t0); break;
     default: return;
     }
@@ -5739,8 +5740,8 @@ static int disas_neon_data_insn(DisasContext *s, uint32_t insn)
                 gen_neon_add(size, tmp, tmp2);
             } else { /* VSUB */
                 switch (size) {
-                case 0: gen_helper_neon_sub_u8(tmp, tmp, tmp2); break;
-                case 1: gen_helper_neon_sub_u16(tmp, tmp, tmp2); break;
+                case 0: tcg_gen_vec_sub8_i32(tmp, tmp, tmp2); break;
+                case 1: tcg_gen_vec_sub16_i32(tmp, tmp, tmp2); break;
                 case 2: tcg_gen_sub_i32(tmp, tmp, tmp2); break;
                 default: abort();
                 }
@@ -7722,8 +7723,8 @@ static void gen_logicq_cc(TCGv_i32 lo, TCGv_i32 hi)
    regular stores.
 
    In system emulation mode only one CPU will be running at once, so
-   this sequence is effectively atomic.  In user emulation mode we
-   throw an exception and handle the atomic operation elsewhere.  */
+   this sequence is effectively atomic.  In user emulation mode the
+   store is a host compare-and-swap.  */
 static void gen_load_exclusive(DisasContext *s, int rt, int rt2,
                                TCGv_i32 addr, int size)
 {
@@ -7769,13 +7770,74 @@ static void gen_clrex(DisasContext *s)
 }
 
 #ifdef CONFIG_USER_ONLY
+/* In user mode the store is a compare-and-swap against the value seen by
+ * the load exclusive.  Unlike a real monitor this also succeeds when the
+ * memory was changed and then changed back in between, which does not
+ * matter for the lock-free sequences guest code builds from ldrex/strex.
+ */
 static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
                                 TCGv_i32 addr, int size)
 {
-    tcg_gen_extu_i32_i64(cpu_exclusive_test, addr);
-    tcg_gen_movi_i32(cpu_exclusive_info,
-                     size | (rd << 4) | (rt << 8) | (rt2 << 12));
-    gen_exception_internal_insn(s, 4, EXCP_STREX);
+    TCGv_i32 t0, t1, t2;
+    TCGv_i64 extaddr;
+    TCGv taddr;
+    TCGLabel *done_label;
+    TCGLabel *fail_label;
+    TCGMemOp opc = size | MO_ALIGN | s->be_data;
+
+    fail_label = gen_new_label();
+    done_label = gen_new_label();
+    extaddr = tcg_temp_new_i64();
+    tcg_gen_extu_i32_i64(extaddr, addr);
+    tcg_gen_brcond_i64(TCG_COND_NE, extaddr, cpu_exclusive_addr, fail_label);
+    tcg_temp_free_i64(extaddr);
+
+    taddr = tcg_temp_new();
+    tcg_gen_extu_i32_tl(taddr, addr);
+    t0 = tcg_temp_new_i32();
+    t1 = load_reg(s, rt);
+    if (size == 3) {
+        TCGv_i64 o64 = tcg_temp_new_i64();
+        TCGv_i64 n64 = tcg_temp_new_i64();
+        TCGv_i64 c64 = tcg_temp_new_i64();
+
+        /* Rt is at the lower address, exclusive_val holds it in the
+           low half */
+        t2 = load_reg(s, rt2);
+        if (s->be_data == MO_BE) {
+            tcg_gen_concat_i32_i64(n64, t2, t1);
+            tcg_gen_rotri_i64(c64, cpu_exclusive_val, 32);
+        } else {
+            tcg_gen_concat_i32_i64(n64, t1, t2);
+            tcg_gen_mov_i64(c64, cpu_exclusive_val);
+        }
+        tcg_temp_free_i32(t2);
+
+        tcg_gen_atomic_cmpxchg_i64(o64, taddr, c64, n64,
+                                   get_mem_index(s), opc);
+        tcg_gen_setcond_i64(TCG_COND_NE, o64, o64, c64);
+        tcg_gen_extrl_i64_i32(t0, o64);
+
+        tcg_temp_free_i64(c64);
+        tcg_temp_free_i64(n64);
+        tcg_temp_free_i64(o64);
+    } else {
+        t2 = tcg_temp_new_i32();
+        tcg_gen_extrl_i64_i32(t2, cpu_exclusive_val);
+        tcg_gen_atomic_cmpxchg_i32(t0, taddr, t2, t1, get_mem_index(s), opc);
+        tcg_gen_setcond_i32(TCG_COND_NE, t0, t0, t2);
+        tcg_temp_free_i32(t2);
+    }
+    tcg_temp_free_i32(t1);
+    tcg_temp_free(taddr);
+    tcg_gen_mov_i32(cpu_R[rd], t0);
+    tcg_temp_free_i32(t0);
+    tcg_gen_br(done_label);
+
+    gen_set_label(fail_label);
+    tcg_gen_movi_i32(cpu_R[rd], 1);
+    gen_set_label(done_label);
+    tcg_gen_movi_i64(cpu_exclusive_addr, -1);
 }
 #else
 static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
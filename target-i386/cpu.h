@@ -1458,6 +1458,8 @@ uint64_t cpu_get_tsc(CPUX86State *env);
 #define MMU_KSMAP_IDX   0
 #define MMU_USER_IDX    1
 #define MMU_KNOSMAP_IDX 2
+#define X86_MMU_IDX_ALL ((1 << MMU_KSMAP_IDX) | (1 << MMU_USER_IDX) | \
+                         (1 << MMU_KNOSMAP_IDX))
 static inline int cpu_mmu_index(CPUX86State *env, bool ifetch)
 {
     return (env->hflags & HF_CPL_MASK) == 3 ? MMU_USER_IDX :
@@ -180,7 +180,8 @@ void helper_invlpg(CPUX86State *env, target_ulong addr)
     X86CPU *cpu = x86_env_get_cpu(env);
 
     cpu_svm_check_intercept_param(env, SVM_EXIT_INVLPG, 0);
-    tlb_flush_page(CPU(cpu), addr);
+    tlb_flush_range_by_mmuidx(CPU(cpu), addr, TARGET_PAGE_SIZE,
+                              X86_MMU_IDX_ALL);
 }
 
 void helper_rdtsc(CPUX86State *env)
@@ -477,7 +477,8 @@ void helper_invlpga(CPUX86State *env, int aflag)
 
     /* XXX: could use the ASID to see if it is needed to do the
        flush */
-    tlb_flush_page(CPU(cpu), addr);
+    tlb_flush_range_by_mmuidx(CPU(cpu), addr, TARGET_PAGE_SIZE,
+                              X86_MMU_IDX_ALL);
 }
 
 void helper_svm_check_intercept_param(CPUX86State *env, uint32_t type,
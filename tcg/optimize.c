@@ -43,6 +43,25 @@ struct tcg_temp_info {
 static struct tcg_temp_info temps[TCG_MAX_TEMPS];
 static TCGTempSet temps_used;
 
+/* Constants held by globals and local temps when a branch to a label is
+   taken.  With several branches to the label, only the constants that all
+   of them agree on are kept.  */
+struct tcg_label_const {
+    uint16_t temp;
+    tcg_target_ulong val;
+    tcg_target_ulong mask;
+};
+
+struct tcg_label_info {
+    bool defined;
+    bool backward;      /* a branch to the label follows its definition */
+    bool seen;          /* a branch to the label was processed */
+    int nb_consts;
+    struct tcg_label_const *consts;
+};
+
+static struct tcg_label_info *labels;
+
 static inline bool temp_is_const(TCGArg arg)
 {
     return temps[arg].is_const;
@@ -70,6 +89,30 @@ static void reset_all_temps(int nb_temps)
     bitmap_zero(temps_used.l, nb_temps);
 }
 
+/* Whether the value of TEMP survives the end of a basic block.  */
+static inline bool temp_survives_bb(TCGContext *s, TCGArg temp)
+{
+    return temp < s->nb_globals || s->temps[temp].temp_local;
+}
+
+/* Keep only what is still known at the start of the next basic block:
+   the constants held by globals and local temps.  Normal temps are dead
+   there and copies are dropped.  */
+static void reset_temps_bb_end(TCGContext *s, int nb_temps)
+{
+    int i;
+
+    for (i = find_first_bit(temps_used.l, nb_temps); i < nb_temps;
+         i = find_next_bit(temps_used.l, nb_temps, i + 1)) {
+        if (temps[i].is_const && temp_survives_bb(s, i)) {
+            temps[i].next_copy = i;
+            temps[i].prev_copy = i;
+        } else {
+            clear_bit(i, temps_used.l);
+        }
+    }
+}
+
 /* Initialize and activate a temporary.  */
 static void init_temp_info(TCGArg temp)
 {
@@ -538,10 +581,172 @@ static bool swap_commutative2(TCGArg *p1, TCGArg *p2)
     return false;
 }
 
+/* Record the constants known when branching to L.  */
+static void label_record(TCGContext *s, TCGLabel *l, int nb_temps)
+{
+    struct tcg_label_info *li = &labels[l->id];
+    int i, n;
+
+    if (li->backward) {
+        return;
+    }
+
+    if (li->seen) {
+        for (i = n = 0; i < li->nb_consts; i++) {
+            struct tcg_label_const *c = &li->consts[i];
+
+            if (test_bit(c->temp, temps_used.l) && temps[c->temp].is_const
+                && temps[c->temp].val == c->val) {
+                li->consts[n++] = *c;
+            }
+        }
+        li->nb_consts = n;
+        return;
+    }
+
+    n = 0;
+    for (i = find_first_bit(temps_used.l, nb_temps); i < nb_temps;
+         i = find_next_bit(temps_used.l, nb_temps, i + 1)) {
+        n += temps[i].is_const && temp_survives_bb(s, i);
+    }
+
+    li->seen = true;
+    li->nb_consts = n;
+    if (n == 0) {
+        return;
+    }
+
+    li->consts = tcg_malloc(n * sizeof(struct tcg_label_const));
+    n = 0;
+    for (i = find_first_bit(temps_used.l, nb_temps); i < nb_temps;
+         i = find_next_bit(temps_used.l, nb_temps, i + 1)) {
+        if (temps[i].is_const && temp_survives_bb(s, i)) {
+            li->consts[n].temp = i;
+            li->consts[n].val = temps[i].val;
+            li->consts[n].mask = temps[i].mask;
+            n++;
+        }
+    }
+}
+
+/* Set up the known state at the definition of L, merging the fallthrough
+   path, if any, with the branches recorded for L.  Labels that are the
+   target of a backward branch start with nothing known.  */
+static void label_enter(TCGContext *s, TCGLabel *l, int nb_temps,
+                        bool fallthrough)
+{
+    struct tcg_label_info *li = &labels[l->id];
+    TCGTempSet keep;
+    int i;
+
+    if (li->backward) {
+        reset_all_temps(nb_temps);
+        return;
+    }
+
+    if (fallthrough) {
+        reset_temps_bb_end(s, nb_temps);
+        if (li->seen) {
+            bitmap_zero(keep.l, nb_temps);
+            for (i = 0; i < li->nb_consts; i++) {
+                struct tcg_label_const *c = &li->consts[i];
+
+                if (test_bit(c->temp, temps_used.l)
+                    && temps[c->temp].val == c->val) {
+                    set_bit(c->temp, keep.l);
+                }
+            }
+            bitmap_and(temps_used.l, temps_used.l, keep.l, nb_temps);
+        }
+        return;
+    }
+
+    reset_all_temps(nb_temps);
+    for (i = 0; li->seen && i < li->nb_consts; i++) {
+        struct tcg_label_const *c = &li->consts[i];
+
+        init_temp_info(c->temp);
+        temps[c->temp].is_const = true;
+        temps[c->temp].val = c->val;
+        temps[c->temp].mask = c->mask;
+    }
+}
+
+/* Find the labels that are the target of a backward branch.  */
+static void init_label_info(TCGContext *s)
+{
+    int oi, label;
+
+    labels = tcg_malloc(s->nb_labels * sizeof(struct tcg_label_info));
+    memset(labels, 0, s->nb_labels * sizeof(struct tcg_label_info));
+
+    for (oi = s->gen_op_buf[0].next; oi != 0; oi = s->gen_op_buf[oi].next) {
+        TCGOp * const op = &s->gen_op_buf[oi];
+        TCGArg * const args = &s->gen_opparam_buf[op->args];
+
+        switch (op->opc) {
+        case INDEX_op_set_label:
+            labels[arg_label(args[0])->id].defined = true;
+            continue;
+        case INDEX_op_br:
+            label = arg_label(args[0])->id;
+            break;
+        case INDEX_op_brcond_i32:
+        case INDEX_op_brcond_i64:
+            label = arg_label(args[3])->id;
+            break;
+        case INDEX_op_brcond2_i32:
+            label = arg_label(args[5])->id;
+            break;
+        default:
+            continue;
+        }
+        if (labels[label].defined) {
+            labels[label].backward = true;
+        }
+    }
+}
+
+/* Update the known state at the end of a basic block, once OP is final.
+   Constants held by globals and local temps are carried to the
+   fallthrough path and to the target of a branch.  */
+static void tcg_opt_bb_end(TCGContext *s, TCGOp *op, TCGArg *args,
+                           int nb_temps, bool *fallthrough)
+{
+    switch (op->opc) {
+    case INDEX_op_br:
+        label_record(s, arg_label(args[0]), nb_temps);
+        reset_all_temps(nb_temps);
+        *fallthrough = false;
+        break;
+    case INDEX_op_brcond_i32:
+    case INDEX_op_brcond_i64:
+        reset_temps_bb_end(s, nb_temps);
+        label_record(s, arg_label(args[3]), nb_temps);
+        break;
+    case INDEX_op_brcond2_i32:
+        reset_temps_bb_end(s, nb_temps);
+        label_record(s, arg_label(args[5]), nb_temps);
+        break;
+    case INDEX_op_set_label:
+        label_enter(s, arg_label(args[0]), nb_temps, *fallthrough);
+        *fallthrough = true;
+        break;
+    case INDEX_op_exit_tb:
+        reset_all_temps(nb_temps);
+        *fallthrough = false;
+        break;
+    default:
+        reset_all_temps(nb_temps);
+        break;
+    }
+}
+
 /* Propagate constants and copies, fold constant expressions. */
 void tcg_optimize(TCGContext *s)
 {
     int oi, oi_next, nb_temps, nb_globals;
+    bool fallthrough = true;
 
     /* Array VALS has an element for each temp.
        If this temp holds a constant then its value is kept in VALS' element.
@@ -551,6 +756,7 @@ void tcg_optimize(TCGContext *s)
     nb_temps = s->nb_temps;
     nb_globals = s->nb_globals;
     reset_all_temps(nb_temps);
+    init_label_info(s);
 
     for (oi = s->gen_op_buf[0].next; oi != 0; oi = oi_next) {
         tcg_target_ulong mask, partmask, affected;
@@ -984,9 +1190,19 @@ void tcg_optimize(TCGContext *s)
            allocator where needed and possible.  Also detect copies. */
         switch (opc) {
         CASE_OP_32_64(mov):
+            if (temp_is_const(args[0]) && temp_is_const(args[1])
+                && temps[args[0]].val == temps[args[1]].val) {
+                /* The destination already holds the value.  */
+                tcg_op_remove(s, op);
+                break;
+            }
             tcg_opt_gen_mov(s, op, args, args[0], args[1]);
             break;
         CASE_OP_32_64(movi):
+            if (temp_is_const(args[0]) && temps[args[0]].val == args[1]) {
+                tcg_op_remove(s, op);
+                break;
+            }
             tcg_opt_gen_movi(s, op, args, args[0], args[1]);
             break;
 
@@ -1060,9 +1276,9 @@ void tcg_optimize(TCGContext *s)
             tmp = do_constant_folding_cond(opc, args[0], args[1], args[2]);
             if (tmp != 2) {
                 if (tmp) {
-                    reset_all_temps(nb_temps);
                     op->opc = INDEX_op_br;
                     args[0] = args[3];
+                    tcg_opt_bb_end(s, op, args, nb_temps, &fallthrough);
                 } else {
                     tcg_op_remove(s, op);
                 }
@@ -1134,9 +1350,9 @@ void tcg_optimize(TCGContext *s)
             if (tmp != 2) {
                 if (tmp) {
             do_brcond_true:
-                    reset_all_temps(nb_temps);
                     op->opc = INDEX_op_br;
                     args[0] = args[5];
+                    tcg_opt_bb_end(s, op, args, nb_temps, &fallthrough);
                 } else {
             do_brcond_false:
                     tcg_op_remove(s, op);
@@ -1147,12 +1363,12 @@ void tcg_optimize(TCGContext *s)
                 /* Simplify LT/GE comparisons vs zero to a single compare
                    vs the high word of the input.  */
             do_brcond_high:
-                reset_all_temps(nb_temps);
                 op->opc = INDEX_op_brcond_i32;
                 args[0] = args[1];
                 args[1] = args[3];
                 args[2] = args[4];
                 args[3] = args[5];
+                tcg_opt_bb_end(s, op, args, nb_temps, &fallthrough);
             } else if (args[4] == TCG_COND_EQ) {
                 /* Simplify EQ comparisons where one of the pairs
                    can be simplified.  */
@@ -1171,11 +1387,11 @@ void tcg_optimize(TCGContext *s)
                     goto do_default;
                 }
             do_brcond_low:
-                reset_all_temps(nb_temps);
                 op->opc = INDEX_op_brcond_i32;
                 args[1] = args[2];
                 args[2] = args[4];
                 args[3] = args[5];
+                tcg_opt_bb_end(s, op, args, nb_temps, &fallthrough);
             } else if (args[4] == TCG_COND_NE) {
                 /* Simplify NE comparisons where one of the pairs
                    can be simplified.  */
@@ -1277,11 +1493,11 @@ void tcg_optimize(TCGContext *s)
         do_default:
             /* Default case: we know nothing about operation (or were unable
                to compute the operation result) so no propagation is done.
-               We trash everything if the operation is the end of a basic
-               block, otherwise we only trash the output args.  "mask" is
-               the non-zero bits mask for the first output arg.  */
+               At the end of a basic block we keep only the constants that
+               survive it, otherwise we only trash the output args.  "mask"
+               is the non-zero bits mask for the first output arg.  */
             if (def->flags & TCG_OPF_BB_END) {
-                reset_all_temps(nb_temps);
+                tcg_opt_bb_end(s, op, args, nb_temps, &fallthrough);
             } else {
         do_reset_output:
                 for (i = 0; i < nb_oargs; i++) {
@@ -28,6 +28,8 @@
 #include "exec/exec-all.h"
 #include "tcg.h"
 #include "tcg-op.h"
+#include "exec/helper-proto.h"
+#include "exec/helper-gen.h"
 #include "trace-tcg.h"
 #include "trace/mem.h"
 
@@ -1741,6 +1743,172 @@ void tcg_gen_muls2_i64(TCGv_i64 rl, TCGv_i64 rh, TCGv_i64 arg1, TCGv_i64 arg2)
     }
 }
 
+/* Lane-wise operations on 8, 16 or 32-bit lanes packed in a scalar, for
+   guest SIMD code.  The carry out of each lane is cut by clearing the
+   lane's top bit before the add and fixing it up after.  */
+
+static void gen_addv_mask_i32(TCGv_i32 d, TCGv_i32 a, TCGv_i32 b, uint32_t m)
+{
+    TCGv_i32 t1 = tcg_temp_new_i32();
+    TCGv_i32 t2 = tcg_temp_new_i32();
+    TCGv_i32 t3 = tcg_temp_new_i32();
+
+    tcg_gen_andi_i32(t1, a, ~m);
+    tcg_gen_andi_i32(t2, b, ~m);
+    tcg_gen_xor_i32(t3, a, b);
+    tcg_gen_add_i32(d, t1, t2);
+    tcg_gen_andi_i32(t3, t3, m);
+    tcg_gen_xor_i32(d, d, t3);
+
+    tcg_temp_free_i32(t1);
+    tcg_temp_free_i32(t2);
+    tcg_temp_free_i32(t3);
+}
+
+static void gen_subv_mask_i32(TCGv_i32 d, TCGv_i32 a, TCGv_i32 b, uint32_t m)
+{
+    TCGv_i32 t1 = tcg_temp_new_i32();
+    TCGv_i32 t2 = tcg_temp_new_i32();
+    TCGv_i32 t3 = tcg_temp_new_i32();
+
+    tcg_gen_ori_i32(t1, a, m);
+    tcg_gen_andi_i32(t2, b, ~m);
+    tcg_gen_eqv_i32(t3, a, b);
+    tcg_gen_sub_i32(d, t1, t2);
+    tcg_gen_andi_i32(t3, t3, m);
+    tcg_gen_xor_i32(d, d, t3);
+
+    tcg_temp_free_i32(t1);
+    tcg_temp_free_i32(t2);
+    tcg_temp_free_i32(t3);
+}
+
+void tcg_gen_vec_add8_i32(TCGv_i32 d, TCGv_i32 a, TCGv_i32 b)
+{
+    gen_addv_mask_i32(d, a, b, 0x80808080u);
+}
+
+void tcg_gen_vec_add16_i32(TCGv_i32 d, TCGv_i32 a, TCGv_i32 b)
+{
+    gen_addv_mask_i32(d, a, b, 0x80008000u);
+}
+
+void tcg_gen_vec_sub8_i32(TCGv_i32 d, TCGv_i32 a, TCGv_i32 b)
+{
+    gen_subv_mask_i32(d, a, b, 0x80808080u);
+}
+
+void tcg_gen_vec_sub16_i32(TCGv_i32 d, TCGv_i32 a, TCGv_i32 b)
+{
+    gen_subv_mask_i32(d, a, b, 0x80008000u);
+}
+
+static void gen_addv_mask_i64(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b, uint64_t m)
+{
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    TCGv_i64 t2 = tcg_temp_new_i64();
+    TCGv_i64 t3 = tcg_temp_new_i64();
+
+    tcg_gen_andi_i64(t1, a, ~m);
+    tcg_gen_andi_i64(t2, b, ~m);
+    tcg_gen_xor_i64(t3, a, b);
+    tcg_gen_add_i64(d, t1, t2);
+    tcg_gen_andi_i64(t3, t3, m);
+    tcg_gen_xor_i64(d, d, t3);
+
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t2);
+    tcg_temp_free_i64(t3);
+}
+
+static void gen_subv_mask_i64(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b, uint64_t m)
+{
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    TCGv_i64 t2 = tcg_temp_new_i64();
+    TCGv_i64 t3 = tcg_temp_new_i64();
+
+    tcg_gen_ori_i64(t1, a, m);
+    tcg_gen_andi_i64(t2, b, ~m);
+    tcg_gen_eqv_i64(t3, a, b);
+    tcg_gen_sub_i64(d, t1, t2);
+    tcg_gen_andi_i64(t3, t3, m);
+    tcg_gen_xor_i64(d, d, t3);
+
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t2);
+    tcg_temp_free_i64(t3);
+}
+
+void tcg_gen_vec_add8_i64(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    gen_addv_mask_i64(d, a, b, 0x8080808080808080ull);
+}
+
+void tcg_gen_vec_add16_i64(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    gen_addv_mask_i64(d, a, b, 0x8000800080008000ull);
+}
+
+void tcg_gen_vec_add32_i64(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    TCGv_i64 t2 = tcg_temp_new_i64();
+
+    tcg_gen_andi_i64(t1, a, ~0xffffffffull);
+    tcg_gen_add_i64(t2, a, b);
+    tcg_gen_add_i64(t1, t1, b);
+    tcg_gen_deposit_i64(d, t1, t2, 0, 32);
+
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t2);
+}
+
+void tcg_gen_vec_sub8_i64(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    gen_subv_mask_i64(d, a, b, 0x8080808080808080ull);
+}
+
+void tcg_gen_vec_sub16_i64(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    gen_subv_mask_i64(d, a, b, 0x8000800080008000ull);
+}
+
+void tcg_gen_vec_sub32_i64(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    TCGv_i64 t2 = tcg_temp_new_i64();
+
+    tcg_gen_andi_i64(t1, b, ~0xffffffffull);
+    tcg_gen_sub_i64(t2, a, b);
+    tcg_gen_sub_i64(t1, a, t1);
+    tcg_gen_deposit_i64(d, t1, t2, 0, 32);
+
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t2);
+}
+
+/* Apply FN to the OPRSZ bytes at offsets AOFS and BOFS from BASE, 64 bits
+   at a time, storing the result at DOFS.  OPRSZ is a multiple of 8.  */
+void tcg_gen_vec_op3_i64(TCGv_ptr base, tcg_target_long dofs,
+                         tcg_target_long aofs, tcg_target_long bofs,
+                         uint32_t oprsz, TCGVecOp3Fn_i64 *fn)
+{
+    TCGv_i64 t0 = tcg_temp_new_i64();
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    uint32_t i;
+
+    tcg_debug_assert(oprsz % 8 == 0);
+    for (i = 0; i < oprsz; i += 8) {
+        tcg_gen_ld_i64(t0, base, aofs + i);
+        tcg_gen_ld_i64(t1, base, bofs + i);
+        fn(t0, t0, t1);
+        tcg_gen_st_i64(t0, base, dofs + i);
+    }
+
+    tcg_temp_free_i64(t0);
+    tcg_temp_free_i64(t1);
+}
+
 /* Size changing operations.  */
 
 void tcg_gen_extrl_i64_i32(TCGv_i32 ret, TCGv_i64 arg)
@@ -1849,6 +2017,18 @@ void tcg_gen_goto_tb(unsigned idx)
     tcg_gen_op1i(INDEX_op_goto_tb, idx);
 }
 
+void tcg_gen_lookup_and_goto_ptr(void)
+{
+    if (TCG_TARGET_HAS_goto_ptr && !qemu_loglevel_mask(CPU_LOG_TB_NOCHAIN)) {
+        TCGv_ptr ptr = tcg_temp_new_ptr();
+        gen_helper_lookup_tb_ptr(ptr, tcg_ctx.tcg_env);
+        tcg_gen_op1i(INDEX_op_goto_ptr, GET_TCGV_PTR(ptr));
+        tcg_temp_free_ptr(ptr);
+    } else {
+        tcg_gen_exit_tb(0);
+    }
+}
+
 static inline TCGMemOp tcg_canonicalize_memop(TCGMemOp op, bool is64, bool st)
 {
     /* Trigger the asserts within as early as possible.  */
@@ -1958,3 +2138,190 @@ void tcg_gen_qemu_st_i64(TCGv_i64 val, TCGv addr, TCGArg idx, TCGMemOp memop)
                                addr, trace_mem_get_info(memop, 1));
     gen_ldst_i64(INDEX_op_qemu_st_i64, val, addr, memop, idx);
 }
+
+static void gen_atomic_ext_i32(TCGv_i32 ret, TCGv_i32 val, TCGMemOp opc)
+{
+    switch (opc & MO_SSIZE) {
+    case MO_SB:
+        tcg_gen_ext8s_i32(ret, val);
+        break;
+    case MO_UB:
+        tcg_gen_ext8u_i32(ret, val);
+        break;
+    case MO_SW:
+        tcg_gen_ext16s_i32(ret, val);
+        break;
+    case MO_UW:
+        tcg_gen_ext16u_i32(ret, val);
+        break;
+    default:
+        tcg_gen_mov_i32(ret, val);
+        break;
+    }
+}
+
+typedef void (*gen_atomic_cx_i32)(TCGv_i32, TCGv_env, TCGv,
+                                  TCGv_i32, TCGv_i32, TCGv_i32);
+typedef void (*gen_atomic_cx_i64)(TCGv_i64, TCGv_env, TCGv,
+                                  TCGv_i64, TCGv_i64, TCGv_i32);
+typedef void (*gen_atomic_op_i32)(TCGv_i32, TCGv_env, TCGv,
+                                  TCGv_i32, TCGv_i32);
+typedef void (*gen_atomic_op_i64)(TCGv_i64, TCGv_env, TCGv,
+                                  TCGv_i64, TCGv_i32);
+
+/* Indexed by MO_SIZE | MO_BSWAP of the canonicalized memop */
+static void * const table_cmpxchg[16] = {
+    [MO_8] = gen_helper_atomic_cmpxchgb,
+    [MO_16 | MO_LE] = gen_helper_atomic_cmpxchgw_le,
+    [MO_16 | MO_BE] = gen_helper_atomic_cmpxchgw_be,
+    [MO_32 | MO_LE] = gen_helper_atomic_cmpxchgl_le,
+    [MO_32 | MO_BE] = gen_helper_atomic_cmpxchgl_be,
+    [MO_64 | MO_LE] = gen_helper_atomic_cmpxchgq_le,
+    [MO_64 | MO_BE] = gen_helper_atomic_cmpxchgq_be,
+};
+
+/*
+ * The atomic operations run as helpers: host atomic instructions on the
+ * guest memory in user mode, a load and a store through the TLB with the
+ * softmmu.  The result is the value loaded from memory, or the value
+ * stored for the *_fetch operations, extended according to MEMOP.
+ */
+void tcg_gen_atomic_cmpxchg_i32(TCGv_i32 retv, TCGv addr, TCGv_i32 cmpv,
+                                TCGv_i32 newv, TCGArg idx, TCGMemOp memop)
+{
+    gen_atomic_cx_i32 gen;
+    TCGv_i32 oi;
+
+    memop = tcg_canonicalize_memop(memop, 0, 0);
+    gen = table_cmpxchg[memop & (MO_SIZE | MO_BSWAP)];
+    tcg_debug_assert(gen != NULL);
+
+    oi = tcg_const_i32(make_memop_idx(memop & ~MO_SIGN, idx));
+    gen(retv, tcg_ctx.tcg_env, addr, cmpv, newv, oi);
+    tcg_temp_free_i32(oi);
+
+    if (memop & MO_SIGN) {
+        gen_atomic_ext_i32(retv, retv, memop);
+    }
+}
+
+void tcg_gen_atomic_cmpxchg_i64(TCGv_i64 retv, TCGv addr, TCGv_i64 cmpv,
+                                TCGv_i64 newv, TCGArg idx, TCGMemOp memop)
+{
+    gen_atomic_cx_i64 gen;
+    TCGv_i32 oi, c32, n32, r32;
+
+    memop = tcg_canonicalize_memop(memop, 1, 0);
+    if ((memop & MO_SIZE) == MO_64) {
+        gen = table_cmpxchg[memop & (MO_SIZE | MO_BSWAP)];
+        tcg_debug_assert(gen != NULL);
+
+        oi = tcg_const_i32(make_memop_idx(memop, idx));
+        gen(retv, tcg_ctx.tcg_env, addr, cmpv, newv, oi);
+        tcg_temp_free_i32(oi);
+        return;
+    }
+
+    c32 = tcg_temp_new_i32();
+    n32 = tcg_temp_new_i32();
+    r32 = tcg_temp_new_i32();
+
+    tcg_gen_extrl_i64_i32(c32, cmpv);
+    tcg_gen_extrl_i64_i32(n32, newv);
+    tcg_gen_atomic_cmpxchg_i32(r32, addr, c32, n32, idx, memop & ~MO_SIGN);
+    tcg_temp_free_i32(c32);
+    tcg_temp_free_i32(n32);
+
+    if (memop & MO_SIGN) {
+        gen_atomic_ext_i32(r32, r32, memop);
+        tcg_gen_ext_i32_i64(retv, r32);
+    } else {
+        tcg_gen_extu_i32_i64(retv, r32);
+    }
+    tcg_temp_free_i32(r32);
+}
+
+static void do_atomic_op_i32(TCGv_i32 ret, TCGv addr, TCGv_i32 val,
+                             TCGArg idx, TCGMemOp memop, void * const table[])
+{
+    gen_atomic_op_i32 gen;
+    TCGv_i32 oi;
+
+    memop = tcg_canonicalize_memop(memop, 0, 0);
+    gen = table[memop & (MO_SIZE | MO_BSWAP)];
+    tcg_debug_assert(gen != NULL);
+
+    oi = tcg_const_i32(make_memop_idx(memop & ~MO_SIGN, idx));
+    gen(ret, tcg_ctx.tcg_env, addr, val, oi);
+    tcg_temp_free_i32(oi);
+
+    if (memop & MO_SIGN) {
+        gen_atomic_ext_i32(ret, ret, memop);
+    }
+}
+
+static void do_atomic_op_i64(TCGv_i64 ret, TCGv addr, TCGv_i64 val,
+                             TCGArg idx, TCGMemOp memop, void * const table[])
+{
+    gen_atomic_op_i64 gen;
+    TCGv_i32 oi, v32, r32;
+
+    memop = tcg_canonicalize_memop(memop, 1, 0);
+    if ((memop & MO_SIZE) == MO_64) {
+        gen = table[memop & (MO_SIZE | MO_BSWAP)];
+        tcg_debug_assert(gen != NULL);
+
+        oi = tcg_const_i32(make_memop_idx(memop, idx));
+        gen(ret, tcg_ctx.tcg_env, addr, val, oi);
+        tcg_temp_free_i32(oi);
+        return;
+    }
+
+    v32 = tcg_temp_new_i32();
+    r32 = tcg_temp_new_i32();
+
+    tcg_gen_extrl_i64_i32(v32, val);
+    do_atomic_op_i32(r32, addr, v32, idx, memop & ~MO_SIGN, table);
+    tcg_temp_free_i32(v32);
+
+    if (memop & MO_SIGN) {
+        gen_atomic_ext_i32(r32, r32, memop);
+        tcg_gen_ext_i32_i64(ret, r32);
+    } else {
+        tcg_gen_extu_i32_i64(ret, r32);
+    }
+    tcg_temp_free_i32(r32);
+}
+
+#define GEN_ATOMIC_HELPER(NAME)                                         \
+static void * const table_##NAME[16] = {                                \
+    [MO_8] = gen_helper_atomic_##NAME##b,                               \
+    [MO_16 | MO_LE] = gen_helper_atomic_##NAME##w_le,                   \
+    [MO_16 | MO_BE] = gen_helper_atomic_##NAME##w_be,                   \
+    [MO_32 | MO_LE] = gen_helper_atomic_##NAME##l_le,                   \
+    [MO_32 | MO_BE] = gen_helper_atomic_##NAME##l_be,                   \
+    [MO_64 | MO_LE] = gen_helper_atomic_##NAME##q_le,                   \
+    [MO_64 | MO_BE] = gen_helper_atomic_##NAME##q_be,                   \
+};                                                                      \
+void tcg_gen_atomic_##NAME##_i32                                        \
+    (TCGv_i32 ret, TCGv addr, TCGv_i32 val, TCGArg idx, TCGMemOp memop) \
+{                                                                       \
+    do_atomic_op_i32(ret, addr, val, idx, memop, table_##NAME);         \
+}                                                                       \
+void tcg_gen_atomic_##NAME##_i64                                        \
+    (TCGv_i64 ret, TCGv addr, TCGv_i64 val, TCGArg idx, TCGMemOp memop) \
+{                                                                       \
+    do_atomic_op_i64(ret, addr, val, idx, memop, table_##NAME);         \
+}
+
+GEN_ATOMIC_HELPER(xchg)
+GEN_ATOMIC_HELPER(fetch_add)
+GEN_ATOMIC_HELPER(fetch_and)
+GEN_ATOMIC_HELPER(fetch_or)
+GEN_ATOMIC_HELPER(fetch_xor)
+GEN_ATOMIC_HELPER(add_fetch)
+GEN_ATOMIC_HELPER(and_fetch)
+GEN_ATOMIC_HELPER(or_fetch)
+GEN_ATOMIC_HELPER(xor_fetch)
+
+#undef GEN_ATOMIC_HELPER
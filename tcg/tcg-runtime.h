@@ -14,3 +14,50 @@ DEF_HELPER_FLAGS_2(sar_i64, TCG_CALL_NO_RWG_SE, s64, s64, s64)
 
 DEF_HELPER_FLAGS_2(mulsh_i64, TCG_CALL_NO_RWG_SE, s64, s64, s64)
 DEF_HELPER_FLAGS_2(muluh_i64, TCG_CALL_NO_RWG_SE, i64, i64, i64)
+
+#ifdef NEED_CPU_H
+DEF_HELPER_FLAGS_1(lookup_tb_ptr, TCG_CALL_NO_WG_SE, ptr, env)
+
+#define GEN_ATOMIC_HELPERS(NAME)                                        \
+    DEF_HELPER_FLAGS_4(atomic_ ## NAME ## b, TCG_CALL_NO_WG,             \
+                       i32, env, tl, i32, i32)                          \
+    DEF_HELPER_FLAGS_4(atomic_ ## NAME ## w_le, TCG_CALL_NO_WG,          \
+                       i32, env, tl, i32, i32)                          \
+    DEF_HELPER_FLAGS_4(atomic_ ## NAME ## w_be, TCG_CALL_NO_WG,          \
+                       i32, env, tl, i32, i32)                          \
+    DEF_HELPER_FLAGS_4(atomic_ ## NAME ## l_le, TCG_CALL_NO_WG,          \
+                       i32, env, tl, i32, i32)                          \
+    DEF_HELPER_FLAGS_4(atomic_ ## NAME ## l_be, TCG_CALL_NO_WG,          \
+                       i32, env, tl, i32, i32)                          \
+    DEF_HELPER_FLAGS_4(atomic_ ## NAME ## q_le, TCG_CALL_NO_WG,          \
+                       i64, env, tl, i64, i32)                          \
+    DEF_HELPER_FLAGS_4(atomic_ ## NAME ## q_be, TCG_CALL_NO_WG,          \
+                       i64, env, tl, i64, i32)
+
+DEF_HELPER_FLAGS_5(atomic_cmpxchgb, TCG_CALL_NO_WG,
+                   i32, env, tl, i32, i32, i32)
+DEF_HELPER_FLAGS_5(atomic_cmpxchgw_le, TCG_CALL_NO_WG,
+                   i32, env, tl, i32, i32, i32)
+DEF_HELPER_FLAGS_5(atomic_cmpxchgw_be, TCG_CALL_NO_WG,
+                   i32, env, tl, i32, i32, i32)
+DEF_HELPER_FLAGS_5(atomic_cmpxchgl_le, TCG_CALL_NO_WG,
+                   i32, env, tl, i32, i32, i32)
+DEF_HELPER_FLAGS_5(atomic_cmpxchgl_be, TCG_CALL_NO_WG,
+                   i32, env, tl, i32, i32, i32)
+DEF_HELPER_FLAGS_5(atomic_cmpxchgq_le, TCG_CALL_NO_WG,
+                   i64, env, tl, i64, i64, i32)
+DEF_HELPER_FLAGS_5(atomic_cmpxchgq_be, TCG_CALL_NO_WG,
+                   i64, env, tl, i64, i64, i32)
+
+GEN_ATOMIC_HELPERS(xchg)
+GEN_ATOMIC_HELPERS(fetch_add)
+GEN_ATOMIC_HELPERS(fetch_and)
+GEN_ATOMIC_HELPERS(fetch_or)
+GEN_ATOMIC_HELPERS(fetch_xor)
+GEN_ATOMIC_HELPERS(add_fetch)
+GEN_ATOMIC_HELPERS(and_fetch)
+GEN_ATOMIC_HELPERS(or_fetch)
+GEN_ATOMIC_HELPERS(xor_fetch)
+
+#undef GEN_ATOMIC_HELPERS
+#endif /* NEED_CPU_H */
@@ -412,6 +412,9 @@ void tcg_prologue_init(TCGContext *s)
 
     tcg_register_jit(s->code_gen_buffer, total_size);
 
+    /* Backends with goto_ptr must provide the return path for it.  */
+    tcg_debug_assert(!TCG_TARGET_HAS_goto_ptr || s->code_gen_epilogue);
+
 #ifdef DEBUG_DISAS
     if (qemu_loglevel_mask(CPU_LOG_TB_OUT_ASM)) {
         qemu_log("PROLOGUE: [size=%zu]\n", prologue_size);
@@ -426,6 +429,7 @@ void tcg_func_start(TCGContext *s)
 {
     tcg_pool_reset(s);
     s->nb_temps = s->nb_globals;
+    s->nb_host_ptrs = 0;
 
     /* No temps have been previously allocated for size or locality.  */
     memset(s->free_temps, 0, sizeof(s->free_temps));
@@ -2500,6 +2504,262 @@ static void tcg_reg_alloc_call(TCGContext *s, int nb_oargs, int nb_iargs,
     }
 }
 
+#ifdef CONFIG_LINUX_USER
+/* Op streams of the linux-user translation cache.  The ops of a TB are
+   saved in list order, as emitted by the translator and before any
+   optimization.  Host pointers are replaced by indexes: labels by their
+   id, helpers by their slot in all_helpers and the TB argument of
+   exit_tb by the exit index plus one.  A TB that loaded any other host
+   pointer through tcg_const_ptr cannot be saved.  The stream is only
+   meaningful to the QEMU binary that wrote it.  */
+
+typedef struct TCGOpsHeader {
+    uint32_t nb_temps;          /* not counting the globals */
+    uint32_t nb_labels;
+    uint32_t nb_ops;
+    uint32_t nb_params;
+} TCGOpsHeader;
+
+typedef struct TCGOpsTemp {
+    uint8_t base_type;
+    uint8_t type;
+    uint8_t temp_local;
+    uint8_t temp_allocated;
+} TCGOpsTemp;
+
+typedef struct TCGOpsOp {
+    uint8_t opc;
+    uint8_t callo;
+    uint8_t calli;
+    uint8_t nb_args;
+} TCGOpsOp;
+
+static int tcg_op_label_arg(TCGOpcode opc)
+{
+    switch (opc) {
+    case INDEX_op_set_label:
+    case INDEX_op_br:
+        return 0;
+    case INDEX_op_brcond_i32:
+    case INDEX_op_brcond_i64:
+        return 3;
+    case INDEX_op_brcond2_i32:
+        return 5;
+    default:
+        return -1;
+    }
+}
+
+bool tcg_save_ops(TCGContext *s, uintptr_t tb, GByteArray *buf)
+{
+    TCGOpsHeader h = {
+        .nb_temps = s->nb_temps - s->nb_globals,
+        .nb_labels = s->nb_labels,
+    };
+    guint start = buf->len;
+    TCGOp *op;
+    int i, oi;
+
+    if (s->nb_host_ptrs) {
+        return false;
+    }
+
+    g_byte_array_set_size(buf, start + sizeof(h));
+    for (i = s->nb_globals; i < s->nb_temps; i++) {
+        TCGTemp *ts = &s->temps[i];
+        TCGOpsTemp t = {
+            .base_type = ts->base_type,
+            .type = ts->type,
+            .temp_local = ts->temp_local,
+            .temp_allocated = ts->temp_allocated,
+        };
+        g_byte_array_append(buf, (guint8 *)&t, sizeof(t));
+    }
+
+    for (oi = s->gen_op_buf[0].next; oi != 0; oi = op->next) {
+        const TCGArg *args;
+        TCGOpsOp o;
+        int nb_args, label;
+
+        op = &s->gen_op_buf[oi];
+        args = &s->gen_opparam_buf[op->args];
+        if (op->opc == INDEX_op_call) {
+            nb_args = op->callo + op->calli + 2;
+        } else {
+            nb_args = tcg_op_defs[op->opc].nb_args;
+        }
+        label = tcg_op_label_arg(op->opc);
+
+        o = (TCGOpsOp){
+            .opc = op->opc,
+            .callo = op->callo,
+            .calli = op->calli,
+            .nb_args = nb_args,
+        };
+        g_byte_array_append(buf, (guint8 *)&o, sizeof(o));
+
+        for (i = 0; i < nb_args; i++) {
+            uint64_t v = args[i];
+
+            if (i == label) {
+                v = arg_label(args[i])->id;
+            } else if (op->opc == INDEX_op_call
+                       && i == op->callo + op->calli) {
+                TCGHelperInfo *info;
+
+                info = g_hash_table_lookup(s->helpers,
+                                           (gpointer)(uintptr_t)args[i]);
+                if (!info) {
+                    goto fail;
+                }
+                v = info - all_helpers;
+            } else if (op->opc == INDEX_op_exit_tb && args[i]) {
+                if (args[i] - tb > TB_EXIT_MASK) {
+                    goto fail;
+                }
+                v = args[i] - tb + 1;
+            }
+            g_byte_array_append(buf, (guint8 *)&v, sizeof(v));
+        }
+        h.nb_ops++;
+        h.nb_params += nb_args;
+    }
+
+    memcpy(buf->data + start, &h, sizeof(h));
+    return true;
+
+ fail:
+    g_byte_array_set_size(buf, start);
+    return false;
+}
+
+/* Rebuilds the ops of a TB saved by tcg_save_ops, in place of the
+   translator.  Called after tcg_func_start; on failure the context is
+   left half-built and must be restarted with tcg_func_start.  */
+bool tcg_load_ops(TCGContext *s, uintptr_t tb, const uint8_t *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    TCGLabel **labels = NULL;
+    TCGOpsHeader h;
+    uint32_t n;
+    int i, pi;
+
+    if (len < sizeof(h)) {
+        return false;
+    }
+    memcpy(&h, p, sizeof(h));
+    p += sizeof(h);
+    if (h.nb_temps > TCG_MAX_TEMPS - s->nb_globals
+        || h.nb_ops >= OPC_BUF_SIZE
+        || h.nb_params > OPPARAM_BUF_SIZE
+        || h.nb_labels > h.nb_ops
+        || len != sizeof(h) + (uint64_t)h.nb_temps * sizeof(TCGOpsTemp)
+                  + (uint64_t)h.nb_ops * sizeof(TCGOpsOp)
+                  + (uint64_t)h.nb_params * sizeof(uint64_t)) {
+        return false;
+    }
+
+    for (n = 0; n < h.nb_temps; n++) {
+        TCGOpsTemp t;
+        TCGTemp *ts;
+
+        memcpy(&t, p, sizeof(t));
+        p += sizeof(t);
+        if (t.base_type >= TCG_TYPE_COUNT || t.type >= TCG_TYPE_COUNT) {
+            return false;
+        }
+        ts = tcg_temp_alloc(s);
+        ts->base_type = t.base_type;
+        ts->type = t.type;
+        ts->temp_local = t.temp_local != 0;
+        ts->temp_allocated = t.temp_allocated != 0;
+    }
+
+    if (h.nb_labels) {
+        labels = tcg_malloc(h.nb_labels * sizeof(TCGLabel *));
+        for (n = 0; n < h.nb_labels; n++) {
+            labels[n] = gen_new_label();
+        }
+    }
+
+    for (n = 0, pi = 0; n < h.nb_ops; n++) {
+        const TCGOpDef *def;
+        TCGArg *args;
+        TCGOpsOp o;
+        int nb_targs, label;
+
+        memcpy(&o, p, sizeof(o));
+        p += sizeof(o);
+        if (o.opc >= NB_OPS) {
+            return false;
+        }
+        def = &tcg_op_defs[o.opc];
+        if (o.opc == INDEX_op_call) {
+            nb_targs = o.callo + o.calli;
+            if (o.callo > 2 || o.calli > 15 || o.nb_args != nb_targs + 2) {
+                return false;
+            }
+        } else {
+            nb_targs = def->nb_oargs + def->nb_iargs;
+            if (o.callo || o.calli || o.nb_args != def->nb_args) {
+                return false;
+            }
+        }
+        if (pi + o.nb_args > h.nb_params) {
+            return false;
+        }
+        label = tcg_op_label_arg(o.opc);
+
+        args = &s->gen_opparam_buf[pi];
+        for (i = 0; i < o.nb_args; i++) {
+            uint64_t v;
+
+            memcpy(&v, p, sizeof(v));
+            p += sizeof(v);
+            if (i < nb_targs) {
+                if (v >= s->nb_temps
+                    && !(o.opc == INDEX_op_call && i >= o.callo
+                         && (TCGArg)v == TCG_CALL_DUMMY_ARG)) {
+                    return false;
+                }
+            } else if (i == label) {
+                if (v >= h.nb_labels) {
+                    return false;
+                }
+                v = label_arg(labels[v]);
+            } else if (o.opc == INDEX_op_call && i == nb_targs) {
+                if (v >= ARRAY_SIZE(all_helpers)) {
+                    return false;
+                }
+                v = (uintptr_t)all_helpers[v].func;
+            } else if (o.opc == INDEX_op_exit_tb && v) {
+                if (v > TB_EXIT_MASK + 1) {
+                    return false;
+                }
+                v = tb + v - 1;
+            }
+            args[i] = v;
+        }
+
+        s->gen_op_buf[n + 1] = (TCGOp){
+            .opc = o.opc,
+            .callo = o.callo,
+            .calli = o.calli,
+            .args = pi,
+            .prev = n,
+            .next = n + 2
+        };
+        pi += o.nb_args;
+    }
+
+    s->gen_op_buf[0].prev = h.nb_ops;
+    s->gen_op_buf[h.nb_ops].next = 0;
+    s->gen_next_op_idx = h.nb_ops + 1;
+    s->gen_next_parm_idx = pi;
+    return true;
+}
+#endif
+
 #ifdef CONFIG_PROFILER
 
 static int64_t tcg_table_op_count[NB_OPS];
@@ -2558,6 +2818,10 @@ int tcg_gen_code(TCGContext *s, TranslationBlock *tb)
 
 #ifdef USE_TCG_OPTIMIZATIONS
     tcg_optimize(s);
+    if (tb->cflags & CF_HOT) {
+        /* Folding exposes more copies and constants, go over it again */
+        tcg_optimize(s);
+    }
 #endif
 
 #ifdef CONFIG_PROFILER
@@ -1254,6 +1254,43 @@ static void large_dict(void)
     g_string_free(gstr, true);
 }
 
+/* Strings longer than a token chunk, next to many short tokens */
+static void large_list(void)
+{
+    GString *gstr = g_string_new("[");
+    QObject *obj;
+    QString *json;
+    QList *list;
+    char *big;
+    int i;
+
+    big = g_malloc(10001);
+    for (i = 0; i < 10000; i++) {
+        big[i] = 'a' + i % 26;
+    }
+    big[i] = 0;
+
+    for (i = 0; i < 1000; i++) {
+        g_string_append_printf(gstr, "%d, \"%s\\n\", ", i,
+                               i % 100 ? "x" : big);
+    }
+    g_string_append(gstr, "null]");
+
+    obj = qobject_from_json(gstr->str);
+    g_assert(obj != NULL);
+    list = qobject_to_qlist(obj);
+    g_assert(list != NULL);
+    g_assert_cmpint(qlist_size(list), ==, 2001);
+
+    json = qobject_to_json(obj);
+    g_assert_cmpstr(qstring_get_str(json), ==, gstr->str);
+
+    QDECREF(json);
+    qobject_decref(obj);
+    g_free(big);
+    g_string_free(gstr, true);
+}
+
 static void simple_list(void)
 {
     int i;
@@ -1520,6 +1557,7 @@ int main(int argc, char **argv)
 
     g_test_add_func("/dicts/simple_dict", simple_dict);
     g_test_add_func("/dicts/large_dict", large_dict);
+    g_test_add_func("/lists/large_list", large_list);
     g_test_add_func("/lists/simple_list", simple_list);
 
     g_test_add_func("/whitespace/simple_whitespace", simple_whitespace);
@@ -9,6 +9,7 @@
 #include "qemu/atomic.h"
 #include "qemu/qht.h"
 #include "qemu/rcu.h"
+#include "qemu/timer.h"
 #include "exec/tb-hash-xx.h"
 
 struct thread_stats {
@@ -20,13 +21,15 @@ struct thread_stats {
     size_t not_rm;
     size_t rz;
     size_t not_rz;
+    int64_t max_update_ns;
 };
 
 struct thread_info {
     void (*func)(struct thread_info *);
     struct thread_stats stats;
     uint64_t r;
-    bool write_op; /* writes alternate between insertions and removals */
+    uint64_t write_r; /* separate RNG for write_op, not correlated with r */
+    bool write_op; /* insertion or removal, picked with insert_rate */
     bool resize_down;
 } QEMU_ALIGNED(64); /* avoid false sharing among threads */
 
@@ -55,8 +58,11 @@ static unsigned int n_rz_threads = 1;
 static QemuThread *rz_threads;
 
 static double update_rate; /* 0.0 to 1.0 */
+static double insert_rate = 0.5; /* 0.0 to 1.0 */
 static uint64_t update_threshold;
+static uint64_t insert_threshold;
 static uint64_t resize_threshold;
+static bool measure_latency;
 
 static size_t qht_n_elems = DEFAULT_QHT_N_ELEMS;
 static int qht_mode;
@@ -79,7 +85,10 @@ static const char commands_string[] =
     " -l = lookup range of keys (will be rounded up to pow2)\n"
     " -r = update range of keys (will be rounded up to pow2)\n"
     "\n"
-    " -u = update rate (0.0 to 100.0), 50/50 split of insertions/removals\n"
+    " -u = update rate (0.0 to 100.0)\n"
+    " -i = insertions among updates (0.0 to 100.0, default 50), the rest\n"
+    "      are removals\n"
+    " -L = measure the latency of updates\n"
     "\n"
     " -R = enable auto-resize\n"
     " -S = resize rate (0.0 to 100.0)\n"
@@ -157,6 +166,11 @@ static void do_rw(struct thread_info *info)
             stats->not_rd++;
         }
     } else {
+        int64_t start = 0;
+
+        if (measure_latency) {
+            start = get_clock();
+        }
         p = &keys[info->r & (update_range - 1)];
         hash = h(*p);
         if (info->write_op) {
@@ -182,7 +196,12 @@ static void do_rw(struct thread_info *info)
                 stats->not_rm++;
             }
         }
-        info->write_op = !info->write_op;
+        if (measure_latency) {
+            stats->max_update_ns = MAX(stats->max_update_ns,
+                                       get_clock() - start);
+        }
+        info->write_r = xorshift64star(info->write_r);
+        info->write_op = info->write_r < insert_threshold;
     }
 }
 
@@ -213,7 +232,8 @@ static void prepare_thread_info(struct thread_info *info, int i)
 {
     /* seed for the RNG; each thread should have a different one */
     info->r = (i + 1) ^ time(NULL);
-    /* the first update will be a write */
+    info->write_r = ~info->r;
+    /* the first update will be an insertion */
     info->write_op = true;
     /* the first resize will be down */
     info->resize_down = true;
@@ -264,6 +284,7 @@ static void pr_params(void)
         printf(" # resize threads   %u\n", n_rz_threads);
     }
     printf(" update rate:       %f%%\n", update_rate * 100.0);
+    printf(" insert rate:       %f%% of updates\n", insert_rate * 100.0);
     printf(" offset:            %ld\n", populate_offset);
     printf(" initial key range: %zu\n", init_range);
     printf(" lookup range:      %lu\n", lookup_range);
@@ -297,6 +318,7 @@ static void htable_init(void)
 
     /* compute thresholds */
     do_threshold(update_rate, &update_threshold);
+    do_threshold(insert_rate, &insert_threshold);
     do_threshold(resize_rate, &resize_threshold);
 
     if (resize_rate) {
@@ -349,7 +371,26 @@ static void add_stats(struct thread_stats *s, struct thread_info *info, int n)
 
         s->rz += stats->rz;
         s->not_rz += stats->not_rz;
+
+        s->max_update_ns = MAX(s->max_update_ns, stats->max_update_ns);
+    }
+}
+
+static void pr_qht_stats(void)
+{
+    struct qht_stats hst;
+
+    qht_statistics_init(&ht, &hst);
+    printf(" Table:             %zu entries, %zu/%zu head buckets used\n",
+           hst.entries, hst.used_head_buckets, hst.head_buckets);
+    printf(" Chain length:      %.3f buckets avg\n", qdist_avg(&hst.chain));
+    printf(" Chain occupancy:   %.2f%% avg\n",
+           qdist_avg(&hst.occupancy) * 100);
+    if (hst.pending_head_buckets) {
+        printf(" Resize pending:    %zu head buckets\n",
+               hst.pending_head_buckets);
     }
+    qht_statistics_destroy(&hst);
 }
 
 static void pr_stats(void)
@@ -383,6 +424,10 @@ static void pr_stats(void)
     tx = (s.rd + s.not_rd + s.in + s.not_in + s.rm + s.not_rm) / 1e6 / duration;
     printf(" Throughput:        %.2f MT/s\n", tx);
     printf(" Throughput/thread: %.2f MT/s/thread\n", tx / n_rw_threads);
+    if (measure_latency) {
+        printf(" Max update time:   %.2f us\n", s.max_update_ns / 1e3);
+    }
+    pr_qht_stats();
 }
 
 static void run_test(void)
@@ -412,7 +457,7 @@ static void parse_args(int argc, char *argv[])
     int c;
 
     for (;;) {
-        c = getopt(argc, argv, "d:D:g:k:K:l:hn:N:o:r:Rs:S:u:");
+        c = getopt(argc, argv, "d:D:g:i:k:K:l:Lhn:N:o:r:Rs:S:u:");
         if (c < 0) {
             break;
         }
@@ -433,6 +478,12 @@ static void parse_args(int argc, char *argv[])
         case 'h':
             usage_complete(argc, argv);
             exit(0);
+        case 'i':
+            insert_rate = atof(optarg) / 100.0;
+            if (insert_rate > 1.0) {
+                insert_rate = 1.0;
+            }
+            break;
         case 'k':
             init_size = atol(optarg);
             break;
@@ -442,6 +493,9 @@ static void parse_args(int argc, char *argv[])
         case 'l':
             lookup_range = pow2ceil(atol(optarg));
             break;
+        case 'L':
+            measure_latency = true;
+            break;
         case 'n':
             n_rw_threads = atoi(optarg);
             break;
@@ -634,6 +634,164 @@ static void test_hbitmap_truncate_shrink_large(TestHBitmapData *data,
     hbitmap_test_truncate(data, size, -diff, 0);
 }
 
+static void test_hbitmap_serialize(TestHBitmapData *data,
+                                   const void *unused)
+{
+    HBitmap *hb2;
+    uint64_t gran, size, buf_size;
+    uint8_t *buf;
+
+    hbitmap_test_init(data, L3 + 7, 1);
+    hbitmap_test_set(data, 0, 1);
+    hbitmap_test_set(data, L1 + 3, 70);
+    hbitmap_test_set(data, L3 - 5, 12);
+
+    size = L3 + 7;
+    gran = hbitmap_serialization_granularity(data->hb);
+    g_assert_cmpint(gran, ==, 128);
+    buf_size = hbitmap_serialization_size(data->hb, 0, size);
+    buf = g_malloc0(buf_size);
+    hbitmap_serialize_part(data->hb, buf, 0, size);
+
+    /* Restore in two chunks, the first one aligned to the granularity */
+    hb2 = hbitmap_alloc(size, 1);
+    hbitmap_deserialize_part(hb2, buf, 0, gran * 2, false);
+    hbitmap_deserialize_part(hb2, buf + hbitmap_serialization_size(hb2, 0,
+                                                                   gran * 2),
+                             gran * 2, size - gran * 2, true);
+
+    g_assert_cmpint(hbitmap_count(hb2), ==, hbitmap_count(data->hb));
+    g_assert(hbitmap_get(hb2, 0));
+    g_assert(hbitmap_get(hb2, L1 + 72));
+    g_assert(!hbitmap_get(hb2, L1 + 74));
+    g_assert(hbitmap_get(hb2, L3 + 6));
+
+    hbitmap_deserialize_zeroes(hb2, 0, size, true);
+    g_assert_cmpint(hbitmap_count(hb2), ==, 0);
+
+    hbitmap_free(hb2);
+    g_free(buf);
+}
+
+static bool hbitmap_test_shadow_get(TestHBitmapData *data, uint64_t i)
+{
+    return (data->bits[i >> LOG_BITS_PER_LONG] &
+            (1UL << (i & (BITS_PER_LONG - 1)))) != 0;
+}
+
+/* Compare hbitmap_next_dirty_area with a linear scan of the shadow bitmap */
+static void hbitmap_test_check_areas(TestHBitmapData *data, uint64_t start)
+{
+    uint64_t i = start, count;
+    int64_t next;
+
+    for (;;) {
+        next = hbitmap_next_dirty_area(data->hb, i, data->size, &count);
+        while (i < (next < 0 ? data->size : next)) {
+            g_assert(!hbitmap_test_shadow_get(data, i));
+            i++;
+        }
+        if (next < 0) {
+            break;
+        }
+        g_assert_cmpint(count, >, 0);
+        while (count--) {
+            g_assert(hbitmap_test_shadow_get(data, i));
+            i++;
+        }
+        g_assert(i == data->size || !hbitmap_test_shadow_get(data, i));
+    }
+}
+
+static void test_hbitmap_next_zero(TestHBitmapData *data,
+                                   const void *unused)
+{
+    hbitmap_test_init(data, L2 + 3, 0);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 0, L2 + 3), ==, 0);
+
+    hbitmap_test_set(data, 0, L1 * 3 + 5);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 0, L2 + 3), ==, L1 * 3 + 5);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 7, L1 * 3 - 2), ==, -1);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, L1 * 3 + 6, 1), ==,
+                    L1 * 3 + 6);
+
+    hbitmap_test_set(data, L1 * 3 + 5, L2 - L1 * 3 - 5 + 3);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 0, L2 + 3), ==, -1);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, L2 + 2, 100), ==, -1);
+
+    hbitmap_test_reset(data, L2 + 2, 1);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 0, L2 + 3), ==, L2 + 2);
+}
+
+static void test_hbitmap_next_dirty_area(TestHBitmapData *data,
+                                         const void *unused)
+{
+    uint64_t count;
+
+    hbitmap_test_init(data, L3, 0);
+    hbitmap_test_check_areas(data, 0);
+
+    hbitmap_test_set(data, 1, 1);
+    hbitmap_test_set(data, L1 - 1, L1 + 2);
+    hbitmap_test_set(data, L2 - 3, L2);
+    hbitmap_test_set(data, L3 - 1, 1);
+    hbitmap_test_check_areas(data, 0);
+    hbitmap_test_check_areas(data, L1);
+    hbitmap_test_check_areas(data, L2 + 5);
+
+    /* The area is clipped to the requested range */
+    g_assert_cmpint(hbitmap_next_dirty_area(data->hb, L1, L1 + 1, &count),
+                    ==, L1);
+    g_assert_cmpint(count, ==, 1);
+    g_assert_cmpint(hbitmap_next_dirty_area(data->hb, 2, L1 - 1, &count),
+                    ==, -1);
+}
+
+static void test_hbitmap_next_dirty_area_granularity(TestHBitmapData *data,
+                                                     const void *unused)
+{
+    uint64_t count;
+
+    hbitmap_test_init(data, L2, 2);
+    hbitmap_set(data->hb, 9, 1);
+    hbitmap_set(data->hb, 17, 8);
+
+    /* Areas are made of whole granularity-sized groups */
+    g_assert_cmpint(hbitmap_next_dirty_area(data->hb, 0, L2, &count), ==, 8);
+    g_assert_cmpint(count, ==, 4);
+    g_assert_cmpint(hbitmap_next_dirty_area(data->hb, 10, L2, &count), ==, 10);
+    g_assert_cmpint(count, ==, 2);
+    g_assert_cmpint(hbitmap_next_dirty_area(data->hb, 12, L2, &count), ==, 16);
+    g_assert_cmpint(count, ==, 12);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 16, L2), ==, 28);
+    g_assert_cmpint(hbitmap_next_dirty_area(data->hb, 28, L2, &count), ==, -1);
+}
+
+static void test_hbitmap_merge(TestHBitmapData *data,
+                               const void *unused)
+{
+    HBitmap *hb2;
+
+    hbitmap_test_init(data, L3, 0);
+    hbitmap_test_set(data, L1 - 1, L1 + 2);
+    hbitmap_test_set(data, L2, 3);
+
+    hb2 = hbitmap_alloc(L3, 0);
+    hbitmap_set(hb2, 0, L1);
+    hbitmap_set(hb2, L2 + 1, 5);
+    hbitmap_set(hb2, L3 - 1, 1);
+    g_assert(hbitmap_merge(data->hb, hb2));
+
+    /* Mirror the merge in the shadow bitmap; the count must include B */
+    hbitmap_test_set(data, 0, L1);
+    hbitmap_test_set(data, L2 + 1, 5);
+    hbitmap_test_set(data, L3 - 1, 1);
+    g_assert_cmpint(hbitmap_count(data->hb), ==, L1 * 2 + 1 + 6 + 1);
+    hbitmap_test_check_areas(data, 0);
+
+    hbitmap_free(hb2);
+}
+
 static void hbitmap_test_add(const char *testpath,
                                    void (*test_func)(TestHBitmapData *data, const void *user_data))
 {
@@ -661,6 +819,7 @@ int main(int argc, char **argv)
     hbitmap_test_add("/hbitmap/reset/general", test_hbitmap_reset);
     hbitmap_test_add("/hbitmap/reset/all", test_hbitmap_reset_all);
     hbitmap_test_add("/hbitmap/granularity", test_hbitmap_granularity);
+    hbitmap_test_add("/hbitmap/serialize", test_hbitmap_serialize);
 
     hbitmap_test_add("/hbitmap/truncate/nop", test_hbitmap_truncate_nop);
     hbitmap_test_add("/hbitmap/truncate/grow/negligible",
@@ -683,6 +842,12 @@ int main(int argc, char **argv)
                      test_hbitmap_truncate_grow_large);
     hbitmap_test_add("/hbitmap/truncate/shrink/large",
                      test_hbitmap_truncate_shrink_large);
+
+    hbitmap_test_add("/hbitmap/next_zero", test_hbitmap_next_zero);
+    hbitmap_test_add("/hbitmap/next_dirty_area", test_hbitmap_next_dirty_area);
+    hbitmap_test_add("/hbitmap/next_dirty_area/granularity",
+                     test_hbitmap_next_dirty_area_granularity);
+    hbitmap_test_add("/hbitmap/merge", test_hbitmap_merge);
     g_test_run();
 
     return 0;
@@ -0,0 +1,149 @@
+/*
+ * Interval tree unit-tests.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/interval-tree.h"
+
+#define N_NODES     512
+#define MAX_START   4096
+#define MAX_LEN     128
+
+typedef struct TestNode {
+    IntervalTreeNode node;
+    bool in_tree;
+} TestNode;
+
+static bool overlaps(IntervalTreeNode *n, uint64_t start, uint64_t end)
+{
+    return n->start < end && start < n->end;
+}
+
+/* Every overlapping node is returned once, in start order */
+static void check_lookup(IntervalTreeRoot *root, TestNode *nodes, int n,
+                         uint64_t start, uint64_t end)
+{
+    IntervalTreeNode *it, *prev = NULL;
+    int i, expected = 0, found = 0;
+
+    for (i = 0; i < n; i++) {
+        if (nodes[i].in_tree && overlaps(&nodes[i].node, start, end)) {
+            expected++;
+        }
+    }
+
+    for (it = interval_tree_iter_first(root, start, end); it;
+         it = interval_tree_iter_next(root, it, start, end)) {
+        g_assert(overlaps(it, start, end));
+        g_assert(container_of(it, TestNode, node)->in_tree);
+        if (prev) {
+            g_assert_cmpuint(prev->start, <=, it->start);
+        }
+        prev = it;
+        found++;
+    }
+    g_assert_cmpint(found, ==, expected);
+}
+
+static void test_interval_tree_empty(void)
+{
+    IntervalTreeRoot root = INTERVAL_TREE_ROOT_INIT;
+
+    g_assert(interval_tree_empty(&root));
+    g_assert(interval_tree_iter_first(&root, 0, UINT64_MAX) == NULL);
+}
+
+static void test_interval_tree_bounds(void)
+{
+    IntervalTreeRoot root = INTERVAL_TREE_ROOT_INIT;
+    IntervalTreeNode a = { .start = 10, .end = 20 };
+    IntervalTreeNode zero = { .start = 30, .end = 30 };
+
+    interval_tree_insert(&root, &a);
+    interval_tree_insert(&root, &zero);
+
+    /* Touching ranges do not overlap */
+    g_assert(interval_tree_iter_first(&root, 0, 10) == NULL);
+    g_assert(interval_tree_iter_first(&root, 20, 30) == NULL);
+    g_assert(interval_tree_iter_first(&root, 19, 20) == &a);
+    g_assert(interval_tree_iter_first(&root, 0, 11) == &a);
+
+    /* Empty ranges are overlapped by the nodes containing them strictly */
+    g_assert(interval_tree_iter_first(&root, 15, 15) == &a);
+    g_assert(interval_tree_iter_first(&root, 10, 10) == NULL);
+    g_assert(interval_tree_iter_first(&root, 29, 31) == &zero);
+
+    interval_tree_remove(&root, &a);
+    g_assert(interval_tree_iter_first(&root, 0, 25) == NULL);
+    interval_tree_remove(&root, &zero);
+    g_assert(interval_tree_empty(&root));
+}
+
+static void test_interval_tree_duplicates(void)
+{
+    IntervalTreeRoot root = INTERVAL_TREE_ROOT_INIT;
+    TestNode nodes[8];
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(nodes); i++) {
+        nodes[i].node.start = 100;
+        nodes[i].node.end = 200;
+        nodes[i].in_tree = true;
+        interval_tree_insert(&root, &nodes[i].node);
+    }
+    check_lookup(&root, nodes, ARRAY_SIZE(nodes), 150, 151);
+
+    for (i = 0; i < ARRAY_SIZE(nodes); i += 2) {
+        interval_tree_remove(&root, &nodes[i].node);
+        nodes[i].in_tree = false;
+    }
+    check_lookup(&root, nodes, ARRAY_SIZE(nodes), 0, 1000);
+}
+
+static void test_interval_tree_random(void)
+{
+    IntervalTreeRoot root = INTERVAL_TREE_ROOT_INIT;
+    TestNode *nodes = g_new0(TestNode, N_NODES);
+    uint64_t start;
+    int i, op;
+
+    for (op = 0; op < 20 * N_NODES; op++) {
+        i = g_test_rand_int_range(0, N_NODES);
+        if (nodes[i].in_tree) {
+            interval_tree_remove(&root, &nodes[i].node);
+            nodes[i].in_tree = false;
+        } else {
+            start = g_test_rand_int_range(0, MAX_START);
+            nodes[i].node.start = start;
+            nodes[i].node.end = start + g_test_rand_int_range(0, MAX_LEN);
+            interval_tree_insert(&root, &nodes[i].node);
+            nodes[i].in_tree = true;
+        }
+
+        start = g_test_rand_int_range(0, MAX_START);
+        check_lookup(&root, nodes, N_NODES, start,
+                     start + g_test_rand_int_range(0, MAX_LEN));
+    }
+
+    for (i = 0; i < N_NODES; i++) {
+        if (nodes[i].in_tree) {
+            interval_tree_remove(&root, &nodes[i].node);
+        }
+    }
+    g_assert(interval_tree_empty(&root));
+    g_free(nodes);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/interval-tree/empty", test_interval_tree_empty);
+    g_test_add_func("/interval-tree/bounds", test_interval_tree_bounds);
+    g_test_add_func("/interval-tree/duplicates",
+                    test_interval_tree_duplicates);
+    g_test_add_func("/interval-tree/random", test_interval_tree_random);
+    return g_test_run();
+}
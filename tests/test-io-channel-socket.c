@@ -522,6 +522,69 @@ static void test_io_channel_ipv4_fd(void)
 }
 
 
+static void test_io_channel_ipv4_zero_copy(void)
+{
+    SocketAddress *listen_addr = g_new0(SocketAddress, 1);
+    SocketAddress *connect_addr = g_new0(SocketAddress, 1);
+    QIOChannel *src, *dst;
+    char wbuf[8192], rbuf[8192];
+    struct iovec iov[2] = {
+        { .iov_base = wbuf, .iov_len = sizeof(wbuf) / 2 },
+        { .iov_base = wbuf + sizeof(wbuf) / 2, .iov_len = sizeof(wbuf) / 2 },
+    };
+    size_t done = 0;
+    ssize_t ret;
+
+    listen_addr->type = SOCKET_ADDRESS_KIND_INET;
+    listen_addr->u.inet.data = g_new(InetSocketAddress, 1);
+    *listen_addr->u.inet.data = (InetSocketAddress) {
+        .host = g_strdup("127.0.0.1"),
+        .port = NULL, /* Auto-select */
+    };
+
+    connect_addr->type = SOCKET_ADDRESS_KIND_INET;
+    connect_addr->u.inet.data = g_new(InetSocketAddress, 1);
+    *connect_addr->u.inet.data = (InetSocketAddress) {
+        .host = g_strdup("127.0.0.1"),
+        .port = NULL, /* Filled in later */
+    };
+
+    test_io_channel_setup_sync(listen_addr, connect_addr, &src, &dst);
+
+    if (!qio_channel_has_feature(src, QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY)) {
+        /* Only Linux has MSG_ZEROCOPY; elsewhere it must fail cleanly */
+        Error *err = NULL;
+
+        ret = qio_channel_writev_zero_copy(src, iov, 2, &err);
+        g_assert_cmpint(ret, ==, -1);
+        g_assert(err);
+        error_free(err);
+        goto cleanup;
+    }
+
+    memset(wbuf, 0x5a, sizeof(wbuf));
+    ret = qio_channel_writev_zero_copy(src, iov, 2, &error_abort);
+    g_assert_cmpint(ret, ==, sizeof(wbuf));
+
+    /* Loopback always ends up copying, which flush must report */
+    g_assert_cmpint(qio_channel_flush(src, &error_abort), >=, 0);
+
+    while (done < sizeof(rbuf)) {
+        ret = qio_channel_read(dst, rbuf + done, sizeof(rbuf) - done,
+                               &error_abort);
+        g_assert_cmpint(ret, >, 0);
+        done += ret;
+    }
+    g_assert(memcmp(wbuf, rbuf, sizeof(wbuf)) == 0);
+
+ cleanup:
+    object_unref(OBJECT(src));
+    object_unref(OBJECT(dst));
+    qapi_free_SocketAddress(listen_addr);
+    qapi_free_SocketAddress(connect_addr);
+}
+
+
 int main(int argc, char **argv)
 {
     bool has_ipv4, has_ipv6;
@@ -547,6 +610,8 @@ int main(int argc, char **argv)
                         test_io_channel_ipv4_async);
         g_test_add_func("/io/channel/socket/ipv4-fd",
                         test_io_channel_ipv4_fd);
+        g_test_add_func("/io/channel/socket/ipv4-zero-copy",
+                        test_io_channel_ipv4_zero_copy);
     }
     if (has_ipv6) {
         g_test_add_func("/io/channel/socket/ipv6-sync",
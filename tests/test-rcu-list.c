@@ -276,6 +276,40 @@ static void gtest_rcuq_many(void)
     rcu_qtest("rcuqtest", gtest_seconds / 2, 20);
 }
 
+/* Hands a whole list to the reclaimer with one call_rcu batch */
+static void gtest_rcuq_batch(void)
+{
+    long long n_removed_local = 0;
+    long long n_reclaims_before;
+    struct list_element *el, *prev_el;
+
+    rcu_qtest_init();
+    synchronize_rcu();
+    n_reclaims_before = n_reclaims;
+
+    rcu_call_batch_begin();
+    QLIST_FOREACH_SAFE_RCU(prev_el, &Q_list_head, entry, el) {
+        QLIST_REMOVE_RCU(prev_el, entry);
+        call_rcu1(&prev_el->rcu, reclaim_list_el);
+        n_removed_local++;
+    }
+
+    /* The callbacks stay with this thread until the batch ends */
+    synchronize_rcu();
+    g_assert_cmpint(n_reclaims, ==, n_reclaims_before);
+    rcu_call_batch_end();
+
+    qemu_mutex_lock(&counts_mutex);
+    n_nodes_removed += n_removed_local;
+    qemu_mutex_unlock(&counts_mutex);
+    synchronize_rcu();
+    while (n_nodes_removed > n_reclaims) {
+        g_usleep(100);
+        synchronize_rcu();
+    }
+    g_assert_cmpint(n_nodes_removed, ==, n_reclaims);
+}
+
 
 int main(int argc, char *argv[])
 {
@@ -293,6 +327,7 @@ int main(int argc, char *argv[])
             g_test_add_func("/rcu/qlist/single-threaded", gtest_rcuq_one);
             g_test_add_func("/rcu/qlist/short-few", gtest_rcuq_few);
             g_test_add_func("/rcu/qlist/long-many", gtest_rcuq_many);
+            g_test_add_func("/rcu/qlist/batch", gtest_rcuq_batch);
             g_test_in_charge = 1;
             return g_test_run();
         }
@@ -648,6 +648,40 @@ static void test_groups(void)
     g_assert(blkp3->throttle_state == NULL);
 }
 
+static void test_group_parents(void)
+{
+    ThrottleConfig cfg1;
+    BlockBackend *blk1;
+    Error *err = NULL;
+
+    blk1 = blk_new();
+    throttle_group_register_blk(blk1, "leaf");
+
+    throttle_group_set_parent("leaf", "tenant", &error_abort);
+
+    /* A group without devices is configured by name */
+    throttle_config_init(&cfg1);
+    cfg1.buckets[THROTTLE_BPS_TOTAL].avg = 100000;
+    throttle_group_set_limits("tenant", &cfg1, &error_abort);
+
+    /* ... but one with devices is not */
+    throttle_group_set_limits("leaf", &cfg1, &err);
+    error_free_or_abort(&err);
+
+    /* Loops are not allowed */
+    throttle_group_set_parent("tenant", "leaf", &err);
+    error_free_or_abort(&err);
+    throttle_group_set_parent("leaf", "leaf", &err);
+    error_free_or_abort(&err);
+
+    throttle_group_set_parent("nonexistent", "tenant", &err);
+    error_free_or_abort(&err);
+
+    throttle_group_set_parent("leaf", NULL, &error_abort);
+    throttle_group_unregister_blk(blk1);
+    g_assert(blk_get_public(blk1)->throttle_state == NULL);
+}
+
 int main(int argc, char **argv)
 {
     qemu_init_main_loop(&error_fatal);
@@ -673,6 +707,7 @@ int main(int argc, char **argv)
     g_test_add_func("/throttle/config_functions",   test_config_functions);
     g_test_add_func("/throttle/accounting",         test_accounting);
     g_test_add_func("/throttle/groups",             test_groups);
+    g_test_add_func("/throttle/group_parents",      test_group_parents);
     return g_test_run();
 }
 
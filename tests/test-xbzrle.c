@@ -174,6 +174,43 @@ static void test_encode_decode(void)
     }
 }
 
+/* Many short runs, so that run boundaries fall at every offset within
+ * the vectors compared by the encoder
+ */
+static void test_encode_decode_short_runs(void)
+{
+    uint8_t *buffer = g_malloc0(PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE * 2);
+    uint8_t *test = g_malloc0(PAGE_SIZE);
+    int i, j, rc, dlen;
+
+    for (j = 0; j < 1000; j++) {
+        memset(buffer, 0, PAGE_SIZE);
+        memset(test, 0, PAGE_SIZE);
+        i = g_test_rand_int_range(0, 100);
+        while (i < PAGE_SIZE) {
+            int len = g_test_rand_int_range(1, 100);
+
+            for (; len > 0 && i < PAGE_SIZE; len--, i++) {
+                buffer[i] = g_test_rand_int_range(1, 256);
+            }
+            i += g_test_rand_int_range(1, 100);
+        }
+
+        dlen = xbzrle_encode_buffer(test, buffer, PAGE_SIZE, compressed,
+                                    PAGE_SIZE * 2);
+        g_assert(dlen > 0);
+
+        rc = xbzrle_decode_buffer(compressed, dlen, test, PAGE_SIZE);
+        g_assert(rc > 0);
+        g_assert(memcmp(test, buffer, PAGE_SIZE) == 0);
+    }
+
+    g_free(buffer);
+    g_free(compressed);
+    g_free(test);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -186,6 +223,8 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/encode_decode_short_runs",
+                    test_encode_decode_short_runs);
 
     return g_test_run();
 }
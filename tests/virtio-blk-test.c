@@ -68,7 +68,7 @@ static QPCIBus *pci_test_start(void)
     cmdline = g_strdup_printf("-drive if=none,id=drive0,file=%s,format=raw "
                         "-drive if=none,id=drive1,file=/dev/null,format=raw "
                         "-device virtio-blk-pci,id=drv0,drive=drive0,"
-                        "addr=%x.%x",
+                        "discard=on,write-zeroes=on,addr=%x.%x",
                         tmp_path, PCI_SLOT, PCI_FN);
     qtest_start(cmdline);
     unlink(tmp_path);
@@ -138,7 +138,10 @@ static uint64_t virtio_blk_request(QGuestAllocator *alloc, QVirtioBlkReq *req,
     uint64_t addr;
     uint8_t status = 0xFF;
 
-    g_assert_cmpuint(data_size % 512, ==, 0);
+    if (req->type != VIRTIO_BLK_T_DISCARD &&
+        req->type != VIRTIO_BLK_T_WRITE_ZEROES) {
+        g_assert_cmpuint(data_size % 512, ==, 0);
+    }
     addr = guest_alloc(alloc, sizeof(*req) + data_size);
 
     virtio_blk_fix_request(req);
@@ -150,6 +153,45 @@ static uint64_t virtio_blk_request(QGuestAllocator *alloc, QVirtioBlkReq *req,
     return addr;
 }
 
+/* Discard and write zeroes segments are little endian */
+static void virtio_blk_dwz_seg(struct virtio_blk_discard_write_zeroes *seg,
+                               uint64_t sector, uint32_t num_sectors,
+                               uint32_t flags)
+{
+    seg->sector = cpu_to_le64(sector);
+    seg->num_sectors = cpu_to_le32(num_sectors);
+    seg->flags = cpu_to_le32(flags);
+}
+
+static void test_dwz(const QVirtioBus *bus, QVirtioDevice *dev,
+                     QGuestAllocator *alloc, QVirtQueue *vq, uint32_t type,
+                     struct virtio_blk_discard_write_zeroes *segs, int nseg,
+                     uint8_t expected)
+{
+    QVirtioBlkReq req;
+    uint64_t req_addr;
+    uint32_t free_head;
+    size_t size = nseg * sizeof(*segs);
+
+    req.type = type;
+    req.ioprio = 1;
+    req.sector = 0;
+    req.data = (char *)segs;
+
+    req_addr = virtio_blk_request(alloc, &req, size);
+
+    free_head = qvirtqueue_add(vq, req_addr, 16, false, true);
+    qvirtqueue_add(vq, req_addr + 16, size, false, true);
+    qvirtqueue_add(vq, req_addr + 16 + size, 1, true, false);
+
+    qvirtqueue_kick(bus, dev, vq, free_head);
+
+    qvirtio_wait_queue_isr(bus, dev, vq, QVIRTIO_BLK_TIMEOUT_US);
+    g_assert_cmpint(readb(req_addr + 16 + size), ==, expected);
+
+    guest_free(alloc, req_addr);
+}
+
 static void test_basic(const QVirtioBus *bus, QVirtioDevice *dev,
             QGuestAllocator *alloc, QVirtQueue *vq, uint64_t device_specific)
 {
@@ -274,6 +316,66 @@ static void test_basic(const QVirtioBus *bus, QVirtioDevice *dev,
 
         guest_free(alloc, req_addr);
     }
+
+    if (features & (1u << VIRTIO_BLK_F_WRITE_ZEROES)) {
+        struct virtio_blk_discard_write_zeroes segs[2];
+        char *zeroes = g_malloc0(512);
+
+        /* Two adjacent segments over the sector written with "TEST" */
+        virtio_blk_dwz_seg(&segs[0], 1, 1, 0);
+        virtio_blk_dwz_seg(&segs[1], 0, 1, VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP);
+        test_dwz(bus, dev, alloc, vq, VIRTIO_BLK_T_WRITE_ZEROES, segs, 2, 0);
+
+        /* Read request */
+        req.type = VIRTIO_BLK_T_IN;
+        req.ioprio = 1;
+        req.sector = 0;
+        req.data = g_malloc0(512);
+
+        req_addr = virtio_blk_request(alloc, &req, 512);
+
+        g_free(req.data);
+
+        free_head = qvirtqueue_add(vq, req_addr, 16, false, true);
+        qvirtqueue_add(vq, req_addr + 16, 512, true, true);
+        qvirtqueue_add(vq, req_addr + 528, 1, true, false);
+
+        qvirtqueue_kick(bus, dev, vq, free_head);
+
+        qvirtio_wait_queue_isr(bus, dev, vq, QVIRTIO_BLK_TIMEOUT_US);
+        status = readb(req_addr + 528);
+        g_assert_cmpint(status, ==, 0);
+
+        data = g_malloc(512);
+        memread(req_addr + 16, data, 512);
+        g_assert(memcmp(data, zeroes, 512) == 0);
+        g_free(data);
+        g_free(zeroes);
+
+        guest_free(alloc, req_addr);
+
+        /* Out of range */
+        virtio_blk_dwz_seg(&segs[0], TEST_IMAGE_SIZE / 512, 1, 0);
+        test_dwz(bus, dev, alloc, vq, VIRTIO_BLK_T_WRITE_ZEROES, segs, 1,
+                 VIRTIO_BLK_S_IOERR);
+    }
+
+    if (features & (1u << VIRTIO_BLK_F_DISCARD)) {
+        struct virtio_blk_discard_write_zeroes segs[2];
+
+        virtio_blk_dwz_seg(&segs[0], 0, 8, 0);
+        virtio_blk_dwz_seg(&segs[1], 16, 8, 0);
+        test_dwz(bus, dev, alloc, vq, VIRTIO_BLK_T_DISCARD, segs, 2, 0);
+
+        /* Discard has no flags */
+        virtio_blk_dwz_seg(&segs[0], 0, 8, VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP);
+        test_dwz(bus, dev, alloc, vq, VIRTIO_BLK_T_DISCARD, segs, 1,
+                 VIRTIO_BLK_S_UNSUPP);
+
+        /* Write zeroes without the out bit must not run as a discard */
+        virtio_blk_dwz_seg(&segs[0], 0, 8, 0);
+        test_dwz(bus, dev, alloc, vq, 12, segs, 1, VIRTIO_BLK_S_UNSUPP);
+    }
 }
 
 static void pci_basic(void)
@@ -25,6 +25,12 @@
 
 static void do_spawn_thread(ThreadPool *pool);
 
+/* Requests are spread over several queues, each with its own lock, so that
+ * submitters and workers do not all serialize on a single mutex.  Each
+ * worker has a home queue and steals from the others when it is empty.
+ */
+#define THREAD_POOL_QUEUES 8
+
 typedef struct ThreadPoolElement ThreadPoolElement;
 
 enum ThreadState {
@@ -33,22 +39,31 @@ enum ThreadState {
     THREAD_DONE,
 };
 
+typedef struct ThreadPoolQueue {
+    QemuMutex lock;
+    QTAILQ_HEAD(, ThreadPoolElement) request_list;
+} ThreadPoolQueue;
+
 struct ThreadPoolElement {
     BlockAIOCB common;
     ThreadPool *pool;
+    ThreadPoolQueue *queue;
     ThreadPoolFunc *func;
     void *arg;
 
-    /* Moving state out of THREAD_QUEUED is protected by lock.  After
-     * that, only the worker thread can write to it.  Reads and writes
-     * of state and ret are ordered with memory barriers.
+    /* Moving state out of THREAD_QUEUED is protected by queue->lock.
+     * After that, only the worker thread can write to it.  Reads and
+     * writes of state and ret are ordered with memory barriers.
      */
     enum ThreadState state;
     int ret;
 
-    /* Access to this list is protected by lock.  */
+    /* Access to this list is protected by queue->lock.  */
     QTAILQ_ENTRY(ThreadPoolElement) reqs;
 
+    /* Pushed atomically to done_list once state is THREAD_DONE.  */
+    QSLIST_ENTRY(ThreadPoolElement) done;
+
     /* Access to this list is protected by the global mutex.  */
     QLIST_ENTRY(ThreadPoolElement) all;
 };
@@ -64,44 +79,93 @@ struct ThreadPool {
 
     /* The following variables are only accessed from one AioContext. */
     QLIST_HEAD(, ThreadPoolElement) head;
+    QSLIST_HEAD(, ThreadPoolElement) completed;
+    unsigned next_queue;
+
+    ThreadPoolQueue queues[THREAD_POOL_QUEUES];
+
+    /* Requests completed by the workers, not yet seen by completion_bh. */
+    QSLIST_HEAD(, ThreadPoolElement) done_list;
+
+    /* The following variables are accessed with atomics.  A worker
+     * decrements idle_threads before reading queued, and a submitter
+     * increments queued before reading idle_threads; so either the
+     * submitter spawns a new thread, or the worker sees the request.
+     */
+    int queued;          /* requests waiting in one of the queues */
+    int idle_threads;
 
     /* The following variables are protected by lock.  */
-    QTAILQ_HEAD(, ThreadPoolElement) request_list;
     int cur_threads;
-    int idle_threads;
     int new_threads;     /* backlog of threads we need to create */
     int pending_threads; /* threads created but not running yet */
+    int started_threads; /* used to pick the home queue of a worker */
     bool stopping;
 };
 
+/* Take a request from the worker's home queue or, failing that, from
+ * the first other queue that has one.  The caller took a token from
+ * pool->sem, so a request is guaranteed to be waiting somewhere.
+ */
+static ThreadPoolElement *thread_pool_dequeue(ThreadPool *pool, int home)
+{
+    ThreadPoolElement *req;
+    int i;
+
+    for (i = home; ; i = (i + 1) % THREAD_POOL_QUEUES) {
+        ThreadPoolQueue *queue = &pool->queues[i];
+
+        qemu_mutex_lock(&queue->lock);
+        req = QTAILQ_FIRST(&queue->request_list);
+        if (req) {
+            QTAILQ_REMOVE(&queue->request_list, req, reqs);
+            req->state = THREAD_ACTIVE;
+        }
+        qemu_mutex_unlock(&queue->lock);
+
+        if (req) {
+            atomic_dec(&pool->queued);
+            return req;
+        }
+    }
+}
+
+static void thread_pool_done(ThreadPool *pool, ThreadPoolElement *req)
+{
+    QSLIST_INSERT_HEAD_ATOMIC(&pool->done_list, req, done);
+    qemu_bh_schedule(pool->completion_bh);
+}
+
 static void *worker_thread(void *opaque)
 {
     ThreadPool *pool = opaque;
+    int home;
 
     qemu_mutex_lock(&pool->lock);
     pool->pending_threads--;
+    home = pool->started_threads++ % THREAD_POOL_QUEUES;
     do_spawn_thread(pool);
+    qemu_mutex_unlock(&pool->lock);
 
-    while (!pool->stopping) {
+    for (;;) {
         ThreadPoolElement *req;
         int ret;
 
-        do {
-            pool->idle_threads++;
-            qemu_mutex_unlock(&pool->lock);
-            ret = qemu_sem_timedwait(&pool->sem, 10000);
+        atomic_inc(&pool->idle_threads);
+        ret = qemu_sem_timedwait(&pool->sem, 10000);
+        atomic_dec(&pool->idle_threads);
+
+        if (ret == -1 || atomic_read(&pool->stopping)) {
             qemu_mutex_lock(&pool->lock);
-            pool->idle_threads--;
-        } while (ret == -1 && !QTAILQ_EMPTY(&pool->request_list));
-        if (ret == -1 || pool->stopping) {
-            break;
+            if (pool->stopping || !atomic_read(&pool->queued)) {
+                break;
+            }
+            /* A request was queued while we were timing out.  */
+            qemu_mutex_unlock(&pool->lock);
+            continue;
         }
 
-        req = QTAILQ_FIRST(&pool->request_list);
-        QTAILQ_REMOVE(&pool->request_list, req, reqs);
-        req->state = THREAD_ACTIVE;
-        qemu_mutex_unlock(&pool->lock);
-
+        req = thread_pool_dequeue(pool, home);
         ret = req->func(req->arg);
 
         req->ret = ret;
@@ -109,9 +173,7 @@ static void *worker_thread(void *opaque)
         smp_wmb();
         req->state = THREAD_DONE;
 
-        qemu_mutex_lock(&pool->lock);
-
-        qemu_bh_schedule(pool->completion_bh);
+        thread_pool_done(pool, req);
     }
 
     pool->cur_threads--;
@@ -153,7 +215,9 @@ static void spawn_thread(ThreadPool *pool)
      * starving the current vcpu.
      *
      * If there are no idle threads, ask the main thread to create one, so we
-     * inherit the correct affinity instead of the vcpu affinity.
+     * inherit the correct affinity instead of the vcpu affinity.  For a pool
+     * that belongs to an IOThread, that is the IOThread's affinity, which
+     * keeps the workers on the same NUMA node.
      */
     if (!pool->pending_threads) {
         qemu_bh_schedule(pool->new_thread_bh);
@@ -163,14 +227,20 @@ static void spawn_thread(ThreadPool *pool)
 static void thread_pool_completion_bh(void *opaque)
 {
     ThreadPool *pool = opaque;
-    ThreadPoolElement *elem, *next;
-
-restart:
-    QLIST_FOREACH_SAFE(elem, &pool->head, all, next) {
-        if (elem->state != THREAD_DONE) {
-            continue;
+    ThreadPoolElement *elem;
+
+    for (;;) {
+        /* Grab everything that has completed so far in one go.  */
+        if (QSLIST_EMPTY(&pool->completed)) {
+            QSLIST_MOVE_ATOMIC(&pool->completed, &pool->done_list);
+            if (QSLIST_EMPTY(&pool->completed)) {
+                break;
+            }
         }
 
+        elem = QSLIST_FIRST(&pool->completed);
+        QSLIST_REMOVE_HEAD(&pool->completed, done);
+
         trace_thread_pool_complete(pool, elem, elem->common.opaque,
                                    elem->ret);
         QLIST_REMOVE(elem, all);
@@ -180,16 +250,15 @@ restart:
             smp_rmb();
 
             /* Schedule ourselves in case elem->common.cb() calls aio_poll() to
-             * wait for another request that completed at the same time.
+             * wait for another request of this batch.
              */
-            qemu_bh_schedule(pool->completion_bh);
+            if (!QSLIST_EMPTY(&pool->completed)) {
+                qemu_bh_schedule(pool->completion_bh);
+            }
 
             elem->common.cb(elem->common.opaque, elem->ret);
-            qemu_aio_unref(elem);
-            goto restart;
-        } else {
-            qemu_aio_unref(elem);
         }
+        qemu_aio_unref(elem);
     }
 }
 
@@ -197,10 +266,12 @@ static void thread_pool_cancel(BlockAIOCB *acb)
 {
     ThreadPoolElement *elem = (ThreadPoolElement *)acb;
     ThreadPool *pool = elem->pool;
+    ThreadPoolQueue *queue = elem->queue;
+    bool canceled = false;
 
     trace_thread_pool_cancel(elem, elem->common.opaque);
 
-    qemu_mutex_lock(&pool->lock);
+    qemu_mutex_lock(&queue->lock);
     if (elem->state == THREAD_QUEUED &&
         /* No thread has yet started working on elem. we can try to "steal"
          * the item from the worker if we can get a signal from the
@@ -208,14 +279,18 @@ static void thread_pool_cancel(BlockAIOCB *acb)
          * the lock taken and ensure that elem will remain THREAD_QUEUED.
          */
         qemu_sem_timedwait(&pool->sem, 0) == 0) {
-        QTAILQ_REMOVE(&pool->request_list, elem, reqs);
-        qemu_bh_schedule(pool->completion_bh);
+        QTAILQ_REMOVE(&queue->request_list, elem, reqs);
+        atomic_dec(&pool->queued);
 
         elem->state = THREAD_DONE;
         elem->ret = -ECANCELED;
+        canceled = true;
     }
+    qemu_mutex_unlock(&queue->lock);
 
-    qemu_mutex_unlock(&pool->lock);
+    if (canceled) {
+        thread_pool_done(pool, elem);
+    }
 }
 
 static AioContext *thread_pool_get_aio_context(BlockAIOCB *acb)
@@ -236,6 +311,7 @@ BlockAIOCB *thread_pool_submit_aio(ThreadPool *pool,
         BlockCompletionFunc *cb, void *opaque)
 {
     ThreadPoolElement *req;
+    ThreadPoolQueue *queue;
 
     req = qemu_aio_get(&thread_pool_aiocb_info, NULL, cb, opaque);
     req->func = func;
@@ -247,12 +323,20 @@ BlockAIOCB *thread_pool_submit_aio(ThreadPool *pool,
 
     trace_thread_pool_submit(pool, req, arg);
 
-    qemu_mutex_lock(&pool->lock);
-    if (pool->idle_threads == 0 && pool->cur_threads < pool->max_threads) {
-        spawn_thread(pool);
+    queue = &pool->queues[pool->next_queue++ % THREAD_POOL_QUEUES];
+    req->queue = queue;
+    qemu_mutex_lock(&queue->lock);
+    QTAILQ_INSERT_TAIL(&queue->request_list, req, reqs);
+    qemu_mutex_unlock(&queue->lock);
+
+    atomic_inc(&pool->queued);
+    if (atomic_read(&pool->idle_threads) == 0) {
+        qemu_mutex_lock(&pool->lock);
+        if (pool->cur_threads < pool->max_threads) {
+            spawn_thread(pool);
+        }
+        qemu_mutex_unlock(&pool->lock);
     }
-    QTAILQ_INSERT_TAIL(&pool->request_list, req, reqs);
-    qemu_mutex_unlock(&pool->lock);
     qemu_sem_post(&pool->sem);
     return &req->common;
 }
@@ -287,6 +371,8 @@ void thread_pool_submit(ThreadPool *pool, ThreadPoolFunc *func, void *arg)
 
 static void thread_pool_init_one(ThreadPool *pool, AioContext *ctx)
 {
+    int i;
+
     if (!ctx) {
         ctx = qemu_get_aio_context();
     }
@@ -301,7 +387,12 @@ static void thread_pool_init_one(ThreadPool *pool, AioContext *ctx)
     pool->new_thread_bh = aio_bh_new(ctx, spawn_thread_bh_fn, pool);
 
     QLIST_INIT(&pool->head);
-    QTAILQ_INIT(&pool->request_list);
+    QSLIST_INIT(&pool->completed);
+    QSLIST_INIT(&pool->done_list);
+    for (i = 0; i < THREAD_POOL_QUEUES; i++) {
+        qemu_mutex_init(&pool->queues[i].lock);
+        QTAILQ_INIT(&pool->queues[i].request_list);
+    }
 }
 
 ThreadPool *thread_pool_new(AioContext *ctx)
@@ -313,6 +404,8 @@ ThreadPool *thread_pool_new(AioContext *ctx)
 
 void thread_pool_free(ThreadPool *pool)
 {
+    int i;
+
     if (!pool) {
         return;
     }
@@ -327,7 +420,7 @@ void thread_pool_free(ThreadPool *pool)
     pool->new_threads = 0;
 
     /* Wait for worker threads to terminate */
-    pool->stopping = true;
+    atomic_set(&pool->stopping, true);
     while (pool->cur_threads > 0) {
         qemu_sem_post(&pool->sem);
         qemu_cond_wait(&pool->worker_stopped, &pool->lock);
@@ -336,6 +429,9 @@ void thread_pool_free(ThreadPool *pool)
     qemu_mutex_unlock(&pool->lock);
 
     qemu_bh_delete(pool->completion_bh);
+    for (i = 0; i < THREAD_POOL_QUEUES; i++) {
+        qemu_mutex_destroy(&pool->queues[i].lock);
+    }
     qemu_sem_destroy(&pool->sem);
     qemu_cond_destroy(&pool->worker_stopped);
     qemu_mutex_destroy(&pool->lock);
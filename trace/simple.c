@@ -13,6 +13,7 @@
 #include <pthread.h>
 #endif
 #include "qemu/timer.h"
+#include "qemu/atomic.h"
 #include "trace.h"
 #include "trace/control.h"
 #include "trace/simple.h"
@@ -29,9 +30,6 @@
 /** Records were dropped event ID */
 #define DROPPED_EVENT_ID (~(uint64_t)0 - 1)
 
-/** Trace record is valid */
-#define TRACE_RECORD_VALID ((uint64_t)1 << 63)
-
 /*
  * Trace records are written out by a dedicated thread.  The thread waits for
  * records to become available, writes them out, and then waits again.
@@ -44,13 +42,37 @@ static bool trace_available;
 static bool trace_writeout_enabled;
 
 enum {
-    TRACE_BUF_LEN = 4096 * 64,
+    TRACE_BUF_LEN = 4096 * 16,
     TRACE_BUF_FLUSH_THRESHOLD = TRACE_BUF_LEN / 4,
 };
 
-uint8_t trace_buf[TRACE_BUF_LEN];
-static volatile gint trace_idx;
-static unsigned int writeout_idx;
+/*
+ * Each thread that traces gets its own ring buffer, so recording an event
+ * touches no shared cacheline.  The owning thread is the only producer and
+ * the writeout thread the only consumer: the producer publishes a record by
+ * advancing @head, the consumer frees space by advancing @tail.  Both are
+ * free-running and wrap modulo TRACE_BUF_LEN.
+ *
+ * Buffers are never freed.  When a thread exits its buffer is released
+ * and the next thread to trace picks it up, together with any records that
+ * were not written out yet.
+ */
+struct TraceThreadBuf {
+    TraceThreadBuf *next;
+    unsigned int head;
+    unsigned int tail;
+    bool in_use;
+    bool busy;
+    uint8_t buf[TRACE_BUF_LEN];
+};
+
+static TraceThreadBuf *trace_bufs;
+static __thread TraceThreadBuf *trace_thread_buf;
+#ifndef _WIN32
+static pthread_key_t trace_thread_key;
+static bool trace_thread_key_created;
+#endif
+
 static volatile gint dropped_events;
 static uint32_t trace_pid;
 static FILE *trace_fp;
@@ -72,53 +94,128 @@ typedef struct {
 } TraceLogHeader;
 
 
-static void read_from_buffer(unsigned int idx, void *dataptr, size_t size);
-static unsigned int write_to_buffer(unsigned int idx, void *dataptr, size_t size);
+static void read_from_buffer(TraceThreadBuf *tbuf, unsigned int idx,
+                             void *dataptr, size_t size)
+{
+    unsigned int off = idx % TRACE_BUF_LEN;
+    size_t first = MIN(size, TRACE_BUF_LEN - off);
+
+    memcpy(dataptr, &tbuf->buf[off], first);
+    memcpy((uint8_t *)dataptr + first, tbuf->buf, size - first);
+}
 
-static void clear_buffer_range(unsigned int idx, size_t len)
+static unsigned int write_to_buffer(TraceThreadBuf *tbuf, unsigned int idx,
+                                    const void *dataptr, size_t size)
 {
-    uint32_t num = 0;
-    while (num < len) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
+    unsigned int off = idx % TRACE_BUF_LEN;
+    size_t first = MIN(size, TRACE_BUF_LEN - off);
+
+    memcpy(&tbuf->buf[off], dataptr, first);
+    memcpy(tbuf->buf, (const uint8_t *)dataptr + first, size - first);
+    return idx + size; /* most callers wants to know where to write next */
+}
+
+#ifndef _WIN32
+static void trace_thread_buf_release(void *opaque)
+{
+    TraceThreadBuf *tbuf = opaque;
+
+    atomic_mb_set(&tbuf->in_use, false);
+}
+#endif
+
+/**
+ * Get the calling thread's trace buffer, reusing one released by a thread
+ * that exited if possible
+ *
+ * Returns NULL if no memory is available.
+ */
+static TraceThreadBuf *trace_thread_buf_get(void)
+{
+    TraceThreadBuf *tbuf = trace_thread_buf;
+
+    if (tbuf) {
+        return tbuf;
+    }
+
+    for (tbuf = atomic_rcu_read(&trace_bufs); tbuf; tbuf = tbuf->next) {
+        if (!atomic_read(&tbuf->in_use) &&
+            !atomic_cmpxchg(&tbuf->in_use, false, true)) {
+            break;
+        }
+    }
+
+    if (!tbuf) {
+        TraceThreadBuf *old;
+
+        /* don't use g_malloc, can deadlock when traced */
+        tbuf = calloc(1, sizeof(*tbuf));
+        if (!tbuf) {
+            return NULL;
         }
-        trace_buf[idx++] = 0;
-        num++;
+        tbuf->in_use = true;
+        do {
+            old = atomic_read(&trace_bufs);
+            tbuf->next = old;
+        } while (atomic_cmpxchg(&trace_bufs, old, tbuf) != old);
+    }
+
+#ifndef _WIN32
+    if (trace_thread_key_created) {
+        pthread_setspecific(trace_thread_key, tbuf);
     }
+#endif
+    trace_thread_buf = tbuf;
+    return tbuf;
 }
+
 /**
- * Read a trace record from the trace buffer
+ * Find the oldest record that is ready to be written out
  *
- * @idx         Trace buffer index
- * @record      Trace record to fill
+ * @length      Filled with the length of the record
  *
- * Returns false if the record is not valid.
+ * Records from different threads are merged by timestamp.  Returns the
+ * buffer that holds the record, or NULL if all buffers are empty.
  */
-static bool get_trace_record(unsigned int idx, TraceRecord **recordptr)
+static TraceThreadBuf *get_trace_record(uint32_t *length)
 {
-    uint64_t event_flag = 0;
+    TraceThreadBuf *tbuf, *oldest = NULL;
+    uint64_t oldest_ns = 0;
     TraceRecord record;
-    /* read the event flag to see if its a valid record */
-    read_from_buffer(idx, &record, sizeof(event_flag));
 
-    if (!(record.event & TRACE_RECORD_VALID)) {
-        return false;
+    for (tbuf = atomic_rcu_read(&trace_bufs); tbuf; tbuf = tbuf->next) {
+        if (atomic_read(&tbuf->head) == tbuf->tail) {
+            continue;
+        }
+
+        smp_rmb(); /* read memory barrier before accessing record */
+        read_from_buffer(tbuf, tbuf->tail, &record, sizeof(TraceRecord));
+        if (!oldest || record.timestamp_ns < oldest_ns) {
+            oldest = tbuf;
+            oldest_ns = record.timestamp_ns;
+            *length = record.length;
+        }
     }
+    return oldest;
+}
 
-    smp_rmb(); /* read memory barrier before accessing record */
-    /* read the record header to know record length */
-    read_from_buffer(idx, &record, sizeof(TraceRecord));
-    *recordptr = malloc(record.length); /* don't use g_malloc, can deadlock when traced */
-    /* make a copy of record to avoid being overwritten */
-    read_from_buffer(idx, *recordptr, record.length);
-    smp_rmb(); /* memory barrier before clearing valid flag */
-    (*recordptr)->event &= ~TRACE_RECORD_VALID;
-    /* clear the trace buffer range for consumed record otherwise any byte
-     * with its MSB set may be considered as a valid event id when the writer
-     * thread crosses this range of buffer again.
-     */
-    clear_buffer_range(idx, record.length);
-    return true;
+/**
+ * Write out the record at the tail of @tbuf and free its space
+ */
+static void write_trace_record(TraceThreadBuf *tbuf, uint32_t length)
+{
+    unsigned int off = tbuf->tail % TRACE_BUF_LEN;
+    size_t first = MIN(length, TRACE_BUF_LEN - off);
+    size_t unused __attribute__ ((unused));
+
+    /* Write straight from the ring, in two pieces if it wraps */
+    unused = fwrite(&tbuf->buf[off], first, 1, trace_fp);
+    if (length > first) {
+        unused = fwrite(tbuf->buf, length - first, 1, trace_fp);
+    }
+
+    /* the record must be read before the producer may overwrite it */
+    atomic_mb_set(&tbuf->tail, tbuf->tail + length);
 }
 
 /**
@@ -152,12 +249,12 @@ static void wait_for_trace_records_available(void)
 
 static gpointer writeout_thread(gpointer opaque)
 {
-    TraceRecord *recordptr;
+    TraceThreadBuf *tbuf;
     union {
         TraceRecord rec;
         uint8_t bytes[sizeof(TraceRecord) + sizeof(uint64_t)];
     } dropped;
-    unsigned int idx = 0;
+    uint32_t length;
     int dropped_count;
     size_t unused __attribute__ ((unused));
 
@@ -177,11 +274,8 @@ static gpointer writeout_thread(gpointer opaque)
             unused = fwrite(&dropped.rec, dropped.rec.length, 1, trace_fp);
         }
 
-        while (get_trace_record(idx, &recordptr)) {
-            unused = fwrite(recordptr, recordptr->length, 1, trace_fp);
-            writeout_idx += recordptr->length;
-            free(recordptr); /* don't use g_free, can deadlock when traced */
-            idx = writeout_idx % TRACE_BUF_LEN;
+        while ((tbuf = get_trace_record(&length)) != NULL) {
+            write_trace_record(tbuf, length);
         }
 
         fflush(trace_fp);
@@ -191,84 +285,65 @@ static gpointer writeout_thread(gpointer opaque)
 
 void trace_record_write_u64(TraceBufferRecord *rec, uint64_t val)
 {
-    rec->rec_off = write_to_buffer(rec->rec_off, &val, sizeof(uint64_t));
+    rec->rec_off = write_to_buffer(rec->tbuf, rec->rec_off,
+                                   &val, sizeof(uint64_t));
 }
 
 void trace_record_write_str(TraceBufferRecord *rec, const char *s, uint32_t slen)
 {
     /* Write string length first */
-    rec->rec_off = write_to_buffer(rec->rec_off, &slen, sizeof(slen));
+    rec->rec_off = write_to_buffer(rec->tbuf, rec->rec_off,
+                                   &slen, sizeof(slen));
     /* Write actual string now */
-    rec->rec_off = write_to_buffer(rec->rec_off, (void*)s, slen);
+    rec->rec_off = write_to_buffer(rec->tbuf, rec->rec_off, s, slen);
 }
 
 int trace_record_start(TraceBufferRecord *rec, TraceEventID event, size_t datasize)
 {
-    unsigned int idx, rec_off, old_idx, new_idx;
+    TraceThreadBuf *tbuf = trace_thread_buf_get();
     uint32_t rec_len = sizeof(TraceRecord) + datasize;
-    uint64_t event_u64 = event;
-    uint64_t timestamp_ns = get_clock();
-
-    do {
-        old_idx = g_atomic_int_get(&trace_idx);
-        smp_rmb();
-        new_idx = old_idx + rec_len;
-
-        if (new_idx - writeout_idx > TRACE_BUF_LEN) {
-            /* Trace Buffer Full, Event dropped ! */
-            g_atomic_int_inc(&dropped_events);
-            return -ENOSPC;
-        }
-    } while (!g_atomic_int_compare_and_exchange(&trace_idx, old_idx, new_idx));
-
-    idx = old_idx % TRACE_BUF_LEN;
+    TraceRecord record;
+    unsigned int head;
 
-    rec_off = idx;
-    rec_off = write_to_buffer(rec_off, &event_u64, sizeof(event_u64));
-    rec_off = write_to_buffer(rec_off, &timestamp_ns, sizeof(timestamp_ns));
-    rec_off = write_to_buffer(rec_off, &rec_len, sizeof(rec_len));
-    rec_off = write_to_buffer(rec_off, &trace_pid, sizeof(trace_pid));
+    /* A record is already being written by this thread, e.g. the event
+     * fired in a signal handler.  Drop it rather than interleave the two.
+     */
+    if (!tbuf || tbuf->busy) {
+        g_atomic_int_inc(&dropped_events);
+        return -ENOSPC;
+    }
 
-    rec->tbuf_idx = idx;
-    rec->rec_off  = (idx + sizeof(TraceRecord)) % TRACE_BUF_LEN;
-    return 0;
-}
+    tbuf->busy = true;
+    barrier();
 
-static void read_from_buffer(unsigned int idx, void *dataptr, size_t size)
-{
-    uint8_t *data_ptr = dataptr;
-    uint32_t x = 0;
-    while (x < size) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
-        }
-        data_ptr[x++] = trace_buf[idx++];
+    head = tbuf->head;
+    if (head + rec_len - atomic_read(&tbuf->tail) > TRACE_BUF_LEN) {
+        /* Trace Buffer Full, Event dropped ! */
+        tbuf->busy = false;
+        g_atomic_int_inc(&dropped_events);
+        return -ENOSPC;
     }
-}
 
-static unsigned int write_to_buffer(unsigned int idx, void *dataptr, size_t size)
-{
-    uint8_t *data_ptr = dataptr;
-    uint32_t x = 0;
-    while (x < size) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
-        }
-        trace_buf[idx++] = data_ptr[x++];
-    }
-    return idx; /* most callers wants to know where to write next */
+    record.event = event;
+    record.timestamp_ns = get_clock();
+    record.length = rec_len;
+    record.pid = trace_pid;
+
+    rec->tbuf = tbuf;
+    rec->rec_off = write_to_buffer(tbuf, head, &record, sizeof(TraceRecord));
+    return 0;
 }
 
 void trace_record_finish(TraceBufferRecord *rec)
 {
-    TraceRecord record;
-    read_from_buffer(rec->tbuf_idx, &record, sizeof(TraceRecord));
-    smp_wmb(); /* write barrier before marking as valid */
-    record.event |= TRACE_RECORD_VALID;
-    write_to_buffer(rec->tbuf_idx, &record, sizeof(TraceRecord));
+    TraceThreadBuf *tbuf = rec->tbuf;
+
+    smp_wmb(); /* write barrier before publishing the record */
+    atomic_set(&tbuf->head, rec->rec_off);
+    barrier();
+    tbuf->busy = false;
 
-    if (((unsigned int)g_atomic_int_get(&trace_idx) - writeout_idx)
-        > TRACE_BUF_FLUSH_THRESHOLD) {
+    if (rec->rec_off - atomic_read(&tbuf->tail) > TRACE_BUF_FLUSH_THRESHOLD) {
         flush_trace_file(false);
     }
 }
@@ -374,6 +449,10 @@ bool st_init(void)
     GThread *thread;
 
     trace_pid = getpid();
+#ifndef _WIN32
+    trace_thread_key_created =
+        !pthread_key_create(&trace_thread_key, trace_thread_buf_release);
+#endif
 
     thread = trace_thread_create(writeout_thread);
     if (!thread) {
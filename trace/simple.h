@@ -21,8 +21,10 @@ void st_set_trace_file(const char *file);
 bool st_init(void);
 void st_flush_trace_buffer(void);
 
+typedef struct TraceThreadBuf TraceThreadBuf;
+
 typedef struct {
-    unsigned int tbuf_idx;
+    TraceThreadBuf *tbuf;
     unsigned int rec_off;
 } TraceBufferRecord;
 
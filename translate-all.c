@@ -54,7 +54,9 @@
 #include "translate-all.h"
 #include "qemu/bitmap.h"
 #include "qemu/timer.h"
+#include "qemu/error-report.h"
 #include "exec/log.h"
+#include "qmp-commands.h"
 
 //#define DEBUG_TB_INVALIDATE
 //#define DEBUG_FLUSH
@@ -68,12 +70,20 @@
 
 #define SMC_BITMAP_USE_THRESHOLD 10
 
+/* Code is tracked per line of 1/64th of a page (64 bytes for 4K pages), so
+ * that writes to data sharing a page with code are told apart without a
+ * bitmap.
+ */
+#define SMC_LINE_BITS  MAX(TARGET_PAGE_BITS - 6, 0)
+
 typedef struct PageDesc {
     /* list of TBs intersecting this ram page */
     TranslationBlock *first_tb;
 #ifdef CONFIG_SOFTMMU
+    /* lines of the page that may hold code, a superset of the TB ranges */
+    uint64_t code_lines;
     /* in order to optimize self modifying code, we count the number
-       of lookups we do to a given page to use a bitmap */
+       of writes to code lines of a given page to use a bitmap */
     unsigned int code_write_count;
     unsigned long *code_bitmap;
 #else
@@ -119,6 +129,12 @@ static void *l1_map[V_L1_SIZE];
 
 /* code generation context */
 TCGContext tcg_ctx;
+bool tb_profile_enabled;
+
+/* sampling profiler */
+int tb_sample_period;
+bool tb_sample_mem;
+static FILE *tb_perf_map;
 
 /* translation block context */
 #ifdef CONFIG_USER_ONLY
@@ -154,6 +170,7 @@ void tb_lock_reset(void)
 }
 
 static TranslationBlock *tb_find_pc(uintptr_t tc_ptr);
+static void tb_perf_map_add(TranslationBlock *tb, int size);
 
 void cpu_gen_init(void)
 {
@@ -761,18 +778,109 @@ bool tcg_enabled(void)
     return tcg_ctx.code_gen_buffer != NULL;
 }
 
-/* Allocate a new translation block. Flush the translation buffer if
-   too many translation blocks or too much generated code. */
+/* Make 'r' the region where code is generated */
+static void tb_region_enter(TBRegion *r)
+{
+    tcg_ctx.code_gen_ptr = r->start;
+    /* Same margin as tcg_prologue_init, see there */
+    tcg_ctx.code_gen_highwater = r->end - 1024;
+}
+
+/* Split the code buffer once the prologue has been generated, user mode
+   emulation only generates it after tcg_exec_init. */
+static void tb_regions_init(void)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    size_t size = tcg_ctx.code_gen_buffer_size;
+    int i, n;
+
+    n = MIN(CODE_GEN_REGIONS, MAX(1, size / CODE_GEN_REGION_MIN_SIZE));
+    ctx->nb_regions = n;
+    ctx->region_size = (size / n) & ~(size_t)(CODE_GEN_ALIGN - 1);
+    ctx->region_max_tbs = tcg_ctx.code_gen_max_blocks / n;
+    for (i = 0; i < n; i++) {
+        TBRegion *r = &ctx->regions[i];
+
+        r->start = tcg_ctx.code_gen_buffer + i * ctx->region_size;
+        r->end = (i == n - 1) ?
+            tcg_ctx.code_gen_buffer + size : r->start + ctx->region_size;
+        r->ptr = r->start;
+        r->first_tb = i * ctx->region_max_tbs;
+        r->nb_tbs = 0;
+    }
+    ctx->cur_region = 0;
+    tb_region_enter(&ctx->regions[0]);
+}
+
+/* Invalidate the TBs of a region, TBs of other regions that jump to them
+   are unlinked by tb_phys_invalidate. */
+static void tb_region_evict(TBRegion *r)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    CPUState *cpu;
+    int i;
+
+    for (i = 0; i < r->nb_tbs; i++) {
+        TranslationBlock *tb = &ctx->tbs[r->first_tb + i];
+
+        /* Already invalidated TBs are in no list anymore */
+        if (!tb->invalid) {
+            tb_phys_invalidate(tb, -1);
+        }
+    }
+    ctx->nb_tbs -= r->nb_tbs;
+    r->nb_tbs = 0;
+    r->ptr = r->start;
+
+    /* The TB executed last may be gone, do not chain to it */
+    CPU_FOREACH(cpu) {
+        cpu->tb_flushed = true;
+    }
+    ctx->tb_region_evict_count++;
+}
+
+/* The current region is full, move to the next one evicting its TBs. With
+   a single region this is a full flush. */
+static void tb_region_advance(CPUState *cpu)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    TBRegion *r;
+
+    if (ctx->nb_regions <= 1) {
+        tb_flush(cpu);
+        return;
+    }
+
+    ctx->regions[ctx->cur_region].ptr = tcg_ctx.code_gen_ptr;
+    ctx->cur_region = (ctx->cur_region + 1) % ctx->nb_regions;
+    r = &ctx->regions[ctx->cur_region];
+    if (r->nb_tbs) {
+        tb_region_evict(r);
+    }
+    tb_region_enter(r);
+}
+
+/* Allocate a new translation block in the current region. Returns NULL
+   if the region has no more translation blocks. */
 static TranslationBlock *tb_alloc(target_ulong pc)
 {
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    TBRegion *r;
     TranslationBlock *tb;
 
-    if (tcg_ctx.tb_ctx.nb_tbs >= tcg_ctx.code_gen_max_blocks) {
+    if (!ctx->nb_regions) {
+        tb_regions_init();
+    }
+    r = &ctx->regions[ctx->cur_region];
+    if (r->nb_tbs >= ctx->region_max_tbs) {
         return NULL;
     }
-    tb = &tcg_ctx.tb_ctx.tbs[tcg_ctx.tb_ctx.nb_tbs++];
+    tb = &ctx->tbs[r->first_tb + r->nb_tbs++];
+    ctx->nb_tbs++;
     tb->pc = pc;
     tb->cflags = 0;
+    tb->invalid = false;
+    tb->exec_count = 0;
     return tb;
 }
 
@@ -781,9 +889,12 @@ void tb_free(TranslationBlock *tb)
     /* In practice this is mostly used for single use temporary TB
        Ignore the hard cases and just back up if this TB happens to
        be the last one generated.  */
-    if (tcg_ctx.tb_ctx.nb_tbs > 0 &&
-            tb == &tcg_ctx.tb_ctx.tbs[tcg_ctx.tb_ctx.nb_tbs - 1]) {
+    TBRegion *r = &tcg_ctx.tb_ctx.regions[tcg_ctx.tb_ctx.cur_region];
+
+    if (r->nb_tbs > 0 &&
+            tb == &tcg_ctx.tb_ctx.tbs[r->first_tb + r->nb_tbs - 1]) {
         tcg_ctx.code_gen_ptr = tb->tc_ptr;
+        r->nb_tbs--;
         tcg_ctx.tb_ctx.nb_tbs--;
     }
 }
@@ -811,6 +922,9 @@ static void page_flush_tb_1(int level, void **lp)
         for (i = 0; i < V_L2_SIZE; ++i) {
             pd[i].first_tb = NULL;
             invalidate_page_bitmap(pd + i);
+#ifdef CONFIG_SOFTMMU
+            pd[i].code_lines = 0;
+#endif
         }
     } else {
         void **pp = *lp;
@@ -858,7 +972,7 @@ void tb_flush(CPUState *cpu)
     qht_reset_size(&tcg_ctx.tb_ctx.htable, CODE_GEN_HTABLE_SIZE);
     page_flush_tb();
 
-    tcg_ctx.code_gen_ptr = tcg_ctx.code_gen_buffer;
+    tb_regions_init();
     /* XXX: flush processor icache at this point if cache flush is
        expensive */
     tcg_ctx.tb_ctx.tb_flush_count++;
@@ -990,6 +1104,8 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     uint32_t h;
     tb_page_addr_t phys_pc;
 
+    atomic_set(&tb->invalid, true);
+
     /* remove the TB from the hash list */
     phys_pc = tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK);
     h = tb_hash_func(phys_pc, tb->pc, tb->flags);
@@ -1010,8 +1126,8 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     /* remove the TB from the hash list */
     h = tb_jmp_cache_hash_func(tb->pc);
     CPU_FOREACH(cpu) {
-        if (cpu->tb_jmp_cache[h] == tb) {
-            cpu->tb_jmp_cache[h] = NULL;
+        if (atomic_read(&cpu->tb_jmp_cache[h]) == tb) {
+            atomic_set(&cpu->tb_jmp_cache[h], NULL);
         }
     }
 
@@ -1026,31 +1142,46 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
 }
 
 #ifdef CONFIG_SOFTMMU
+/* Offsets [*start, *end[ of part N of TB in its page */
+static inline void tb_page_range(TranslationBlock *tb, int n,
+                                 int *start, int *end)
+{
+    /* NOTE: this is subtle as a TB may span two physical pages */
+    if (n == 0) {
+        *start = tb->pc & ~TARGET_PAGE_MASK;
+        *end = MIN(*start + tb->size, TARGET_PAGE_SIZE);
+    } else {
+        *start = 0;
+        *end = (tb->pc + tb->size) & ~TARGET_PAGE_MASK;
+    }
+}
+
+static inline uint64_t page_code_lines(int start, int end)
+{
+    int first = start >> SMC_LINE_BITS;
+    int last = (end - 1) >> SMC_LINE_BITS;
+
+    if (end <= start) {
+        return 0;
+    }
+    return (~0ULL >> (63 - last)) & (~0ULL << first);
+}
+
 static void build_page_bitmap(PageDesc *p)
 {
     int n, tb_start, tb_end;
     TranslationBlock *tb;
 
     p->code_bitmap = bitmap_new(TARGET_PAGE_SIZE);
+    p->code_lines = 0;
 
     tb = p->first_tb;
     while (tb != NULL) {
         n = (uintptr_t)tb & 3;
         tb = (TranslationBlock *)((uintptr_t)tb & ~3);
-        /* NOTE: this is subtle as a TB may span two physical pages */
-        if (n == 0) {
-            /* NOTE: tb_end may be after the end of the page, but
-               it is not a problem */
-            tb_start = tb->pc & ~TARGET_PAGE_MASK;
-            tb_end = tb_start + tb->size;
-            if (tb_end > TARGET_PAGE_SIZE) {
-                tb_end = TARGET_PAGE_SIZE;
-            }
-        } else {
-            tb_start = 0;
-            tb_end = ((tb->pc + tb->size) & ~TARGET_PAGE_MASK);
-        }
+        tb_page_range(tb, n, &tb_start, &tb_end);
         bitmap_set(p->code_bitmap, tb_start, tb_end - tb_start);
+        p->code_lines |= page_code_lines(tb_start, tb_end);
         tb = tb->page_next[n];
     }
 }
@@ -1067,6 +1198,9 @@ static inline void tb_alloc_page(TranslationBlock *tb,
 #ifndef CONFIG_USER_ONLY
     bool page_already_protected;
 #endif
+#ifdef CONFIG_SOFTMMU
+    int tb_start, tb_end;
+#endif
 
     tb->page_addr[n] = page_addr;
     p = page_find_alloc(page_addr >> TARGET_PAGE_BITS, 1);
@@ -1075,7 +1209,17 @@ static inline void tb_alloc_page(TranslationBlock *tb,
     page_already_protected = p->first_tb != NULL;
 #endif
     p->first_tb = (TranslationBlock *)((uintptr_t)tb | n);
-    invalidate_page_bitmap(p);
+
+#ifdef CONFIG_SOFTMMU
+    /* Extend the code tracking rather than dropping it, so that a page
+     * where code is generated often keeps its bitmap.
+     */
+    tb_page_range(tb, n, &tb_start, &tb_end);
+    p->code_lines |= page_code_lines(tb_start, tb_end);
+    if (p->code_bitmap) {
+        bitmap_set(p->code_bitmap, tb_start, tb_end - tb_start);
+    }
+#endif
 
 #if defined(CONFIG_USER_ONLY)
     if (p->flags & PAGE_WRITE) {
@@ -1160,12 +1304,18 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     if (use_icount && !(cflags & CF_IGNORE_ICOUNT)) {
         cflags |= CF_USE_ICOUNT;
     }
+    if (tb_profile_enabled && !(cflags & CF_NOCACHE)) {
+        cflags |= CF_PROFILE;
+    }
 
     tb = tb_alloc(pc);
     if (unlikely(!tb)) {
  buffer_overflow:
-        /* flush must be done */
-        tb_flush(cpu);
+        /* drop the partial TB and evict the oldest region */
+        if (tb) {
+            tb_free(tb);
+        }
+        tb_region_advance(cpu);
         /* cannot fail at this point */
         tb = tb_alloc(pc);
         assert(tb != NULL);
@@ -1186,7 +1336,14 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     tcg_func_start(&tcg_ctx);
 
     tcg_ctx.cpu = ENV_GET_CPU(env);
+#ifdef CONFIG_LINUX_USER
+    if (!tb_cache_load(cpu, tb)) {
+        gen_intermediate_code(env, tb);
+        tb_cache_store(cpu, tb);
+    }
+#else
     gen_intermediate_code(env, tb);
+#endif
     tcg_ctx.cpu = NULL;
 
     trace_translate_block(tb, tb->pc, tb->tc_ptr);
@@ -1240,6 +1397,10 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     }
 #endif
 
+    if (unlikely(tb_perf_map)) {
+        tb_perf_map_add(tb, gen_code_size);
+    }
+
     tcg_ctx.code_gen_ptr = (void *)
         ROUND_UP((uintptr_t)gen_code_buf + gen_code_size + search_size,
                  CODE_GEN_ALIGN);
@@ -1380,6 +1541,7 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
     /* if no code remaining, no need to continue to use slow writes */
     if (!p->first_tb) {
         invalidate_page_bitmap(p);
+        p->code_lines = 0;
         tlb_unprotect_code(start);
     }
 #endif
@@ -1413,6 +1575,15 @@ void tb_invalidate_phys_page_fast(tb_page_addr_t start, int len)
     if (!p) {
         return;
     }
+    /* A write to a line without code, e.g. data next to the code of a
+     * guest JIT, needs neither the bitmap nor an invalidation.  A page
+     * without TBs goes on so that the range invalidation unprotects it.
+     */
+    if (p->first_tb && !(p->code_lines &
+          (1ULL << ((start & ~TARGET_PAGE_MASK) >> SMC_LINE_BITS)))) {
+        tcg_ctx.tb_ctx.smc_data_write_count++;
+        return;
+    }
     if (!p->code_bitmap &&
         ++p->code_write_count >= SMC_BITMAP_USE_THRESHOLD) {
         /* build code bitmap */
@@ -1507,20 +1678,26 @@ static bool tb_invalidate_phys_page(tb_page_addr_t addr, uintptr_t pc)
    tb[1].tc_ptr. Return NULL if not found */
 static TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
 {
-    int m_min, m_max, m;
-    uintptr_t v;
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    int m_min, m_max, m, k;
+    uintptr_t v, end;
     TranslationBlock *tb;
+    TBRegion *r;
 
-    if (tcg_ctx.tb_ctx.nb_tbs <= 0) {
+    if (ctx->nb_tbs <= 0 || tc_ptr < (uintptr_t)tcg_ctx.code_gen_buffer) {
         return NULL;
     }
-    if (tc_ptr < (uintptr_t)tcg_ctx.code_gen_buffer ||
-        tc_ptr >= (uintptr_t)tcg_ctx.code_gen_ptr) {
+    /* the last region also holds the remainder of the buffer */
+    k = (tc_ptr - (uintptr_t)tcg_ctx.code_gen_buffer) / ctx->region_size;
+    k = MIN(k, ctx->nb_regions - 1);
+    r = &ctx->regions[k];
+    end = (uintptr_t)(k == ctx->cur_region ? tcg_ctx.code_gen_ptr : r->ptr);
+    if (r->nb_tbs <= 0 || tc_ptr >= end) {
         return NULL;
     }
     /* binary search (cf Knuth) */
-    m_min = 0;
-    m_max = tcg_ctx.tb_ctx.nb_tbs - 1;
+    m_min = r->first_tb;
+    m_max = r->first_tb + r->nb_tbs - 1;
     while (m_min <= m_max) {
         m = (m_min + m_max) >> 1;
         tb = &tcg_ctx.tb_ctx.tbs[m];
@@ -1679,6 +1856,10 @@ static void print_qht_statistics(FILE *f, fprintf_function cpu_fprintf,
     cpu_fprintf(f, "TB hash buckets     %zu/%zu (%0.2f%% head buckets used)\n",
                 hst.used_head_buckets, hst.head_buckets,
                 (double)hst.used_head_buckets / hst.head_buckets * 100);
+    if (hst.pending_head_buckets) {
+        cpu_fprintf(f, "TB hash resize      %zu old head buckets pending\n",
+                    hst.pending_head_buckets);
+    }
 
     hgram_opts =  QDIST_PR_BORDER | QDIST_PR_LABELS;
     hgram_opts |= QDIST_PR_100X   | QDIST_PR_PERCENT;
@@ -1704,10 +1885,45 @@ static void print_qht_statistics(FILE *f, fprintf_function cpu_fprintf,
     g_free(hgram);
 }
 
+static TbHashHistogramEntryList *tb_hash_histogram(const struct qdist *dist)
+{
+    TbHashHistogramEntryList *head = NULL;
+    size_t i;
+
+    for (i = dist->n; i-- > 0; ) {
+        TbHashHistogramEntryList *entry = g_new0(TbHashHistogramEntryList, 1);
+
+        entry->value = g_new0(TbHashHistogramEntry, 1);
+        entry->value->value = dist->entries[i].x;
+        entry->value->count = dist->entries[i].count;
+        entry->next = head;
+        head = entry;
+    }
+    return head;
+}
+
+TbHashStats *qmp_query_tb_hash(Error **errp)
+{
+    TbHashStats *info = g_new0(TbHashStats, 1);
+    struct qht_stats hst;
+
+    qht_statistics_init(&tcg_ctx.tb_ctx.htable, &hst);
+    info->head_buckets = hst.head_buckets;
+    info->used_head_buckets = hst.used_head_buckets;
+    info->pending_head_buckets = hst.pending_head_buckets;
+    info->entries = hst.entries;
+    info->chain = tb_hash_histogram(&hst.chain);
+    info->occupancy = tb_hash_histogram(&hst.occupancy);
+    qht_statistics_destroy(&hst);
+
+    return info;
+}
+
 void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
 {
-    int i, target_code_size, max_target_code_size;
+    int i, k, target_code_size, max_target_code_size;
     int direct_jmp_count, direct_jmp2_count, cross_page;
+    ptrdiff_t code_size;
     TranslationBlock *tb;
     struct qht_stats hst;
 
@@ -1716,27 +1932,36 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
     cross_page = 0;
     direct_jmp_count = 0;
     direct_jmp2_count = 0;
-    for (i = 0; i < tcg_ctx.tb_ctx.nb_tbs; i++) {
-        tb = &tcg_ctx.tb_ctx.tbs[i];
-        target_code_size += tb->size;
-        if (tb->size > max_target_code_size) {
-            max_target_code_size = tb->size;
-        }
-        if (tb->page_addr[1] != -1) {
-            cross_page++;
-        }
-        if (tb->jmp_reset_offset[0] != TB_JMP_RESET_OFFSET_INVALID) {
-            direct_jmp_count++;
-            if (tb->jmp_reset_offset[1] != TB_JMP_RESET_OFFSET_INVALID) {
-                direct_jmp2_count++;
+    code_size = 0;
+    for (k = 0; k < tcg_ctx.tb_ctx.nb_regions; k++) {
+        TBRegion *r = &tcg_ctx.tb_ctx.regions[k];
+        void *ptr = (k == tcg_ctx.tb_ctx.cur_region) ?
+            tcg_ctx.code_gen_ptr : r->ptr;
+
+        code_size += ptr - r->start;
+        for (i = r->first_tb; i < r->first_tb + r->nb_tbs; i++) {
+            tb = &tcg_ctx.tb_ctx.tbs[i];
+            target_code_size += tb->size;
+            if (tb->size > max_target_code_size) {
+                max_target_code_size = tb->size;
+            }
+            if (tb->page_addr[1] != -1) {
+                cross_page++;
+            }
+            if (tb->jmp_reset_offset[0] != TB_JMP_RESET_OFFSET_INVALID) {
+                direct_jmp_count++;
+                if (tb->jmp_reset_offset[1] != TB_JMP_RESET_OFFSET_INVALID) {
+                    direct_jmp2_count++;
+                }
             }
         }
     }
     /* XXX: avoid using doubles ? */
     cpu_fprintf(f, "Translation buffer state:\n");
     cpu_fprintf(f, "gen code size       %td/%zd\n",
-                tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer,
-                tcg_ctx.code_gen_highwater - tcg_ctx.code_gen_buffer);
+                code_size, tcg_ctx.code_gen_buffer_size);
+    cpu_fprintf(f, "code regions        %d (current %d)\n",
+                tcg_ctx.tb_ctx.nb_regions, tcg_ctx.tb_ctx.cur_region);
     cpu_fprintf(f, "TB count            %d/%d\n",
             tcg_ctx.tb_ctx.nb_tbs, tcg_ctx.code_gen_max_blocks);
     cpu_fprintf(f, "TB avg target size  %d max=%d bytes\n",
@@ -1744,12 +1969,8 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
                     tcg_ctx.tb_ctx.nb_tbs : 0,
             max_target_code_size);
     cpu_fprintf(f, "TB avg host size    %td bytes (expansion ratio: %0.1f)\n",
-            tcg_ctx.tb_ctx.nb_tbs ? (tcg_ctx.code_gen_ptr -
-                                     tcg_ctx.code_gen_buffer) /
-                                     tcg_ctx.tb_ctx.nb_tbs : 0,
-                target_code_size ? (double) (tcg_ctx.code_gen_ptr -
-                                             tcg_ctx.code_gen_buffer) /
-                                             target_code_size : 0);
+            tcg_ctx.tb_ctx.nb_tbs ? code_size / tcg_ctx.tb_ctx.nb_tbs : 0,
+            target_code_size ? (double) code_size / target_code_size : 0);
     cpu_fprintf(f, "cross page TB count %d (%d%%)\n", cross_page,
             tcg_ctx.tb_ctx.nb_tbs ? (cross_page * 100) /
                                     tcg_ctx.tb_ctx.nb_tbs : 0);
@@ -1767,8 +1988,12 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
 
     cpu_fprintf(f, "\nStatistics:\n");
     cpu_fprintf(f, "TB flush count      %d\n", tcg_ctx.tb_ctx.tb_flush_count);
+    cpu_fprintf(f, "TB region evictions %d\n",
+            tcg_ctx.tb_ctx.tb_region_evict_count);
     cpu_fprintf(f, "TB invalidate count %d\n",
             tcg_ctx.tb_ctx.tb_phys_invalidate_count);
+    cpu_fprintf(f, "SMC data writes     %" PRId64 "\n",
+            tcg_ctx.tb_ctx.smc_data_write_count);
     cpu_fprintf(f, "TLB flush count     %d\n", tlb_flush_count);
     tcg_dump_info(f, cpu_fprintf);
 }
@@ -1778,6 +2003,71 @@ void dump_opcount_info(FILE *f, fprintf_function cpu_fprintf)
     tcg_dump_op_count(f, cpu_fprintf);
 }
 
+void tb_profile_set(bool enable)
+{
+    if (tb_profile_enabled == enable) {
+        return;
+    }
+    tb_profile_enabled = enable;
+
+    /* Start over so that all TBs are translated with or without counters */
+    tb_lock();
+    tb_flush(first_cpu);
+    tb_unlock();
+}
+
+/* Show the COUNT most executed TBs */
+void dump_tb_hot_info(FILE *f, fprintf_function cpu_fprintf, int count)
+{
+    TranslationBlock **top, *tb;
+    int i, j, k, n;
+
+    if (!tb_profile_enabled) {
+        cpu_fprintf(f, "TB profiling is off, enable it with 'tb-profile on'\n");
+        return;
+    }
+
+    top = g_new(TranslationBlock *, count);
+    n = 0;
+
+    tb_lock();
+    for (k = 0; k < tcg_ctx.tb_ctx.nb_regions; k++) {
+        TBRegion *r = &tcg_ctx.tb_ctx.regions[k];
+
+        for (i = r->first_tb; i < r->first_tb + r->nb_tbs; i++) {
+            tb = &tcg_ctx.tb_ctx.tbs[i];
+            if (!(tb->cflags & CF_PROFILE) || tb->invalid ||
+                !tb->exec_count) {
+                continue;
+            }
+            if (n < count) {
+                j = n++;
+            } else if (top[n - 1]->exec_count < tb->exec_count) {
+                j = n - 1;
+            } else {
+                continue;
+            }
+            while (j > 0 && top[j - 1]->exec_count < tb->exec_count) {
+                top[j] = top[j - 1];
+                j--;
+            }
+            top[j] = tb;
+        }
+    }
+
+    cpu_fprintf(f, "%-4s %-18s %-10s %-6s %-20s\n",
+                "rank", "pc", "flags", "size", "executions");
+    for (i = 0; i < n; i++) {
+        tb = top[i];
+        cpu_fprintf(f, "%-4d " TARGET_FMT_lx " 0x%08x %-6u %-20" PRIu64 "%s\n",
+                    i + 1, tb->pc, tb->flags, tb->size, tb->exec_count,
+                    (tb->cflags & CF_HOT) ? " hot" : "");
+    }
+    tb_unlock();
+
+    g_free(top);
+}
+
 #else /* CONFIG_USER_ONLY */
 
 void cpu_interrupt(CPUState *cpu, int mask)
@@ -2057,3 +2347,206 @@ int page_unprotect(target_ulong address, uintptr_t pc)
     return 0;
 }
 #endif /* CONFIG_USER_ONLY */
+
+typedef struct TBSample {
+    uint64_t addr;      /* TB pc, or guest address of a memory access */
+    uint32_t info;      /* TB_SAMPLE_* and the size of a memory access */
+} TBSample;
+
+#define TB_SAMPLE_MEM   0x100
+#define TB_SAMPLE_WRITE 0x200
+
+typedef struct TBSampleRing {
+    uint64_t total;     /* samples recorded, the ring keeps the last ones */
+    int exec_countdown;
+    int mem_countdown;
+    TBSample s[TB_SAMPLE_RING_SIZE];
+} TBSampleRing;
+
+static inline void tb_sample_push(CPUState *cpu, uint64_t addr,
+                                  uint32_t info)
+{
+    TBSampleRing *r = cpu->tb_samples;
+    TBSample *s = &r->s[r->total++ & (TB_SAMPLE_RING_SIZE - 1)];
+
+    s->addr = addr;
+    s->info = info;
+}
+
+static TBSampleRing *tb_sample_ring(CPUState *cpu)
+{
+    if (unlikely(!cpu->tb_samples)) {
+        cpu->tb_samples = g_new0(TBSampleRing, 1);
+    }
+    return cpu->tb_samples;
+}
+
+/* Called by cpu_tb_exec, TBs entered through a direct jump are not seen */
+void tb_sample_exec(CPUState *cpu, TranslationBlock *tb)
+{
+    TBSampleRing *r = tb_sample_ring(cpu);
+
+    if (--r->exec_countdown > 0) {
+        return;
+    }
+    r->exec_countdown = tb_sample_period;
+    tb_sample_push(cpu, tb->pc, 0);
+}
+
+/* Called by the softmmu load/store helpers, i.e. on a TLB miss, an I/O
+ * or an unaligned access.
+ */
+void tb_sample_mem_access(CPUState *cpu, target_ulong addr, int size,
+                          bool is_write)
+{
+    TBSampleRing *r = tb_sample_ring(cpu);
+
+    if (--r->mem_countdown > 0) {
+        return;
+    }
+    r->mem_countdown = tb_sample_period;
+    tb_sample_push(cpu, addr, TB_SAMPLE_MEM | size |
+                   (is_write ? TB_SAMPLE_WRITE : 0));
+}
+
+/* Lines of the perf JIT map are "START SIZE name", in hex */
+static void tb_perf_map_add(TranslationBlock *tb, int size)
+{
+    const char *sym = lookup_symbol(tb->pc);
+
+    fprintf(tb_perf_map, "%" PRIxPTR " %x guest_" TARGET_FMT_lx "%s%s\n",
+            (uintptr_t)tb->tc_ptr, size, tb->pc, *sym ? "_" : "", sym);
+    fflush(tb_perf_map);
+}
+
+/* PERIOD 0 turns sampling off, the samples are kept until the next start */
+void tb_sample_set(int period, bool mem)
+{
+    CPUState *cpu;
+    char name[64];
+
+    if (period && !tb_perf_map) {
+        snprintf(name, sizeof(name), "/tmp/perf-%d.map", (int)getpid());
+        tb_perf_map = fopen(name, "a");
+        if (!tb_perf_map) {
+            error_report("Could not open %s: %s", name, strerror(errno));
+        }
+    } else if (!period && tb_perf_map) {
+        fclose(tb_perf_map);
+        tb_perf_map = NULL;
+    }
+
+    if (period) {
+        CPU_FOREACH(cpu) {
+            if (cpu->tb_samples) {
+                memset(cpu->tb_samples, 0, sizeof(TBSampleRing));
+            }
+        }
+    }
+    tb_sample_mem = period && mem;
+    tb_sample_period = period;
+
+    /* Translate again so that the map covers all the code that runs */
+    if (period) {
+        tb_lock();
+        tb_flush(first_cpu);
+        tb_unlock();
+    }
+}
+
+#ifndef CONFIG_USER_ONLY
+static int tb_sample_cmp(const void *a, const void *b)
+{
+    const uint64_t *x = a, *y = b;
+
+    return *x < *y ? -1 : *x > *y;
+}
+
+typedef struct TBSampleCount {
+    uint64_t addr;
+    size_t count;
+} TBSampleCount;
+
+static int tb_sample_count_cmp(const void *a, const void *b)
+{
+    const TBSampleCount *x = a, *y = b;
+
+    return x->count > y->count ? -1 : x->count < y->count;
+}
+
+static void tb_sample_print_top(FILE *f, fprintf_function cpu_fprintf,
+                                const char *what, uint64_t *v, size_t n,
+                                int count, bool symbols)
+{
+    TBSampleCount *top;
+    size_t i, nb = 0;
+
+    if (!n) {
+        return;
+    }
+    qsort(v, n, sizeof(*v), tb_sample_cmp);
+    top = g_new(TBSampleCount, n);
+    for (i = 0; i < n; i++) {
+        if (nb && top[nb - 1].addr == v[i]) {
+            top[nb - 1].count++;
+        } else {
+            top[nb].addr = v[i];
+            top[nb++].count = 1;
+        }
+    }
+    qsort(top, nb, sizeof(*top), tb_sample_count_cmp);
+
+    cpu_fprintf(f, "%-4s %-18s %-8s %-6s\n", "rank", what, "samples", "%");
+    for (i = 0; i < nb && i < count; i++) {
+        cpu_fprintf(f, "%-4zu " TARGET_FMT_lx " %-8zu %5.1f %s\n",
+                    i + 1, (target_ulong)top[i].addr, top[i].count,
+                    top[i].count * 100.0 / n,
+                    symbols ? lookup_symbol(top[i].addr) : "");
+    }
+    g_free(top);
+}
+
+/* Show the COUNT most sampled TBs and pages of the last samples */
+void dump_tb_sample_info(FILE *f, fprintf_function cpu_fprintf, int count)
+{
+    CPUState *cpu;
+    uint64_t *exec, *mem;
+    size_t n_exec = 0, n_mem = 0, n;
+    int nb_cpus = 0;
+
+    cpu_fprintf(f, "sampling %s, period %d%s\n",
+                tb_sample_period ? "on" : "off", tb_sample_period,
+                tb_sample_mem ? ", memory accesses" : "");
+
+    CPU_FOREACH(cpu) {
+        nb_cpus++;
+    }
+    exec = g_new(uint64_t, nb_cpus * TB_SAMPLE_RING_SIZE);
+    mem = g_new(uint64_t, nb_cpus * TB_SAMPLE_RING_SIZE);
+
+    CPU_FOREACH(cpu) {
+        TBSampleRing *r = cpu->tb_samples;
+        size_t i;
+
+        if (!r) {
+            continue;
+        }
+        cpu_fprintf(f, "cpu %d: %" PRIu64 " samples\n",
+                    cpu->cpu_index, r->total);
+        n = MIN(r->total, TB_SAMPLE_RING_SIZE);
+        for (i = 0; i < n; i++) {
+            if (r->s[i].info & TB_SAMPLE_MEM) {
+                mem[n_mem++] = r->s[i].addr & TARGET_PAGE_MASK;
+            } else {
+                exec[n_exec++] = r->s[i].addr;
+            }
+        }
+    }
+
+    tb_sample_print_top(f, cpu_fprintf, "pc", exec, n_exec, count, true);
+    tb_sample_print_top(f, cpu_fprintf, "page", mem, n_mem, count, false);
+
+    g_free(exec);
+    g_free(mem);
+}
+#endif
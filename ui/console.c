@@ -167,6 +167,9 @@ struct DisplayState {
     QEMUTimer *gui_timer;
     uint64_t last_update;
     uint64_t update_interval;
+    /* Interval for listeners without their own, backs off when idle */
+    uint64_t default_interval;
+    bool updated;
     bool refreshing;
     bool have_gfx;
     bool have_text;
@@ -199,9 +202,22 @@ static void gui_update(void *opaque)
     dpy_refresh(ds);
     ds->refreshing = false;
 
+    /*
+     * Nothing was drawn since the last refresh: poll the display devices
+     * less and less often, down to GUI_REFRESH_INTERVAL_BACKOFF.  Drawing
+     * or input brings the interval back to the default.
+     */
+    if (ds->updated || !ds->default_interval) {
+        ds->default_interval = GUI_REFRESH_INTERVAL_DEFAULT;
+    } else {
+        ds->default_interval = MIN(ds->default_interval * 2,
+                                   GUI_REFRESH_INTERVAL_BACKOFF);
+    }
+    ds->updated = false;
+
     QLIST_FOREACH(dcl, &ds->listeners, next) {
         dcl_interval = dcl->update_interval ?
-            dcl->update_interval : GUI_REFRESH_INTERVAL_DEFAULT;
+            dcl->update_interval : ds->default_interval;
         if (interval > dcl_interval) {
             interval = dcl_interval;
         }
@@ -252,6 +268,23 @@ static void gui_setup_refresh(DisplayState *ds)
     ds->have_text = have_text;
 }
 
+/* Go back to the default refresh rate, e.g. because of user input */
+void qemu_console_kick_refresh(void)
+{
+    DisplayState *ds = display_state;
+
+    if (!ds || !ds->gui_timer ||
+        ds->default_interval <= GUI_REFRESH_INTERVAL_DEFAULT) {
+        return;
+    }
+
+    ds->default_interval = GUI_REFRESH_INTERVAL_DEFAULT;
+    if (!ds->refreshing) {
+        timer_mod_anticipate(ds->gui_timer,
+                             ds->last_update + GUI_REFRESH_INTERVAL_DEFAULT);
+    }
+}
+
 void graphic_hw_update(QemuConsole *con)
 {
     if (!con) {
@@ -1493,6 +1526,7 @@ void dpy_gfx_update(QemuConsole *con, int x, int y, int w, int h)
     if (!qemu_console_is_visible(con)) {
         return;
     }
+    s->updated = true;
     QLIST_FOREACH(dcl, &s->listeners, next) {
         if (con != (dcl->con ? dcl->con : active_console)) {
             continue;
@@ -1511,6 +1545,7 @@ void dpy_gfx_replace_surface(QemuConsole *con,
     DisplayChangeListener *dcl;
 
     con->surface = surface;
+    s->updated = true;
     QLIST_FOREACH(dcl, &s->listeners, next) {
         if (con != (dcl->con ? dcl->con : active_console)) {
             continue;
@@ -1567,6 +1602,7 @@ void dpy_gfx_copy(QemuConsole *con, int src_x, int src_y,
     if (!qemu_console_is_visible(con)) {
         return;
     }
+    s->updated = true;
     QLIST_FOREACH(dcl, &s->listeners, next) {
         if (con != (dcl->con ? dcl->con : active_console)) {
             continue;
@@ -1605,6 +1641,7 @@ void dpy_text_update(QemuConsole *con, int x, int y, int w, int h)
     if (!qemu_console_is_visible(con)) {
         return;
     }
+    s->updated = true;
     QLIST_FOREACH(dcl, &s->listeners, next) {
         if (con != (dcl->con ? dcl->con : active_console)) {
             continue;
@@ -342,6 +342,7 @@ void qemu_input_event_sync_impl(void)
     QemuInputHandlerState *s;
 
     trace_input_event_sync();
+    qemu_console_kick_refresh();
 
     QTAILQ_FOREACH(s, &handlers, node) {
         if (!s->events) {
@@ -2879,7 +2879,9 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
     line_bytes = MIN(server_stride, guest_ll);
 
     for (;;) {
-        int x;
+        DECLARE_BITMAP(changed, VNC_MAX_WIDTH / VNC_DIRTY_PIXELS_PER_BIT);
+        int x, end, chunks = DIV_ROUND_UP(width, VNC_DIRTY_PIXELS_PER_BIT);
+        int row_dirty = 0;
         uint8_t *guest_ptr, *server_ptr;
         unsigned long offset = find_next_bit((unsigned long *) &vd->guest.dirty,
                                              height * VNC_DIRTY_BPL(&vd->guest),
@@ -2891,7 +2893,7 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
         y = offset / VNC_DIRTY_BPL(&vd->guest);
         x = offset % VNC_DIRTY_BPL(&vd->guest);
 
-        server_ptr = server_row0 + y * server_stride + x * cmp_bytes;
+        server_ptr = server_row0 + y * server_stride;
 
         if (vd->guest.format != VNC_SERVER_FB_FORMAT) {
             qemu_pixman_linebuf_fill(tmpbuf, vd->guest.fb, width, 0, y);
@@ -2899,30 +2901,52 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
         } else {
             guest_ptr = guest_row0 + y * guest_stride;
         }
-        guest_ptr += x * cmp_bytes;
 
-        for (; x < DIV_ROUND_UP(width, VNC_DIRTY_PIXELS_PER_BIT);
-             x++, guest_ptr += cmp_bytes, server_ptr += cmp_bytes) {
-            int _cmp_bytes = cmp_bytes;
-            if (!test_and_clear_bit(x, vd->guest.dirty[y])) {
-                continue;
-            }
-            if ((x + 1) * cmp_bytes > line_bytes) {
-                _cmp_bytes = line_bytes - x * cmp_bytes;
-            }
-            assert(_cmp_bytes >= 0);
-            if (memcmp(server_ptr, guest_ptr, _cmp_bytes) == 0) {
+        bitmap_zero(changed, chunks);
+
+        /*
+         * Compare each run of dirty chunks with a single memcmp, which is
+         * vectorized by the C library.  Only runs that differ are checked
+         * and copied chunk by chunk.
+         */
+        for (; x < chunks; x = find_next_bit(vd->guest.dirty[y], chunks, end)) {
+            int run_bytes;
+
+            end = find_next_zero_bit(vd->guest.dirty[y], chunks, x);
+            run_bytes = MIN(end * cmp_bytes, line_bytes) - x * cmp_bytes;
+            assert(run_bytes >= 0);
+            if (memcmp(server_ptr + x * cmp_bytes, guest_ptr + x * cmp_bytes,
+                       run_bytes) == 0) {
                 continue;
             }
-            memcpy(server_ptr, guest_ptr, _cmp_bytes);
-            if (!vd->non_adaptive) {
-                vnc_rect_updated(vd, x * VNC_DIRTY_PIXELS_PER_BIT,
-                                 y, &tv);
+
+            for (; x < end; x++) {
+                int _cmp_bytes = cmp_bytes;
+                if ((x + 1) * cmp_bytes > line_bytes) {
+                    _cmp_bytes = line_bytes - x * cmp_bytes;
+                }
+                if (memcmp(server_ptr + x * cmp_bytes,
+                           guest_ptr + x * cmp_bytes, _cmp_bytes) == 0) {
+                    continue;
+                }
+                memcpy(server_ptr + x * cmp_bytes, guest_ptr + x * cmp_bytes,
+                       _cmp_bytes);
+                if (!vd->non_adaptive) {
+                    vnc_rect_updated(vd, x * VNC_DIRTY_PIXELS_PER_BIT,
+                                     y, &tv);
+                }
+                set_bit(x, changed);
+                row_dirty++;
             }
+        }
+        bitmap_clear(vd->guest.dirty[y], 0, chunks);
+
+        /* Mark the whole row dirty for each client at once */
+        if (row_dirty) {
             QTAILQ_FOREACH(vs, &vd->clients, next) {
-                set_bit(x, vs->dirty[y]);
+                bitmap_or(vs->dirty[y], vs->dirty[y], changed, chunks);
             }
-            has_dirty++;
+            has_dirty += row_dirty;
         }
 
         y++;
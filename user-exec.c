@@ -23,6 +23,8 @@
 #include "tcg.h"
 #include "qemu/bitops.h"
 #include "exec/cpu_ldst.h"
+#include "exec/helper-proto.h"
+#include "qemu/atomic.h"
 #include "translate-all.h"
 
 #undef EAX
@@ -40,6 +42,56 @@
 
 //#define DEBUG_SIGNAL
 
+/* Host return address of the atomic helper accessing guest memory, or 0 */
+__thread uintptr_t helper_retaddr;
+
+#if HOST_LONG_BITS == 32
+static QemuSpin atomic_serial_lock;
+
+static uint64_t atomic_serial_cmpxchg64(uint64_t *haddr, uint64_t cmpv,
+                                        uint64_t newv)
+{
+    uint64_t old;
+
+    /* Take write faults before the lock, a fault must not leave it held */
+    atomic_fetch_add((uint32_t *)haddr, 0);
+    atomic_fetch_add((uint32_t *)haddr + 1, 0);
+
+    qemu_spin_lock(&atomic_serial_lock);
+    old = *haddr;
+    if (old == cmpv) {
+        *haddr = newv;
+    }
+    qemu_spin_unlock(&atomic_serial_lock);
+    return old;
+}
+#endif
+
+#define ATOMIC_BE 0
+#define DATA_SIZE 1
+#include "atomic_template.h"
+
+#define DATA_SIZE 2
+#include "atomic_template.h"
+
+#define DATA_SIZE 4
+#include "atomic_template.h"
+
+#define DATA_SIZE 8
+#include "atomic_template.h"
+#undef ATOMIC_BE
+
+#define ATOMIC_BE 1
+#define DATA_SIZE 2
+#include "atomic_template.h"
+
+#define DATA_SIZE 4
+#include "atomic_template.h"
+
+#define DATA_SIZE 8
+#include "atomic_template.h"
+#undef ATOMIC_BE
+
 /* exit the current TB from a signal handler. The host registers are
    restored in a state compatible with the CPU emulator
  */
@@ -65,6 +117,11 @@ static inline int handle_cpu_signal(uintptr_t pc, unsigned long address,
     printf("qemu: SIGSEGV pc=0x%08lx address=%08lx w=%d oldset=0x%08lx\n",
            pc, address, is_write, *(unsigned long *)old_set);
 #endif
+    /* A fault in an atomic helper belongs to the insn that called it */
+    if (helper_retaddr) {
+        pc = helper_retaddr;
+    }
+
     /* XXX: locking issue */
     if (is_write && h2g_valid(address)) {
         switch (page_unprotect(h2g(address), pc)) {
@@ -83,6 +140,7 @@ static inline int handle_cpu_signal(uintptr_t pc, unsigned long address,
              * currently executing TB was modified and must be exited
              * immediately.
              */
+            helper_retaddr = 0;
             cpu_exit_tb_from_sighandler(current_cpu, old_set);
             g_assert_not_reached();
         default:
@@ -106,6 +164,7 @@ static inline int handle_cpu_signal(uintptr_t pc, unsigned long address,
         return 1; /* the MMU fault was handled without causing real CPU fault */
     }
     /* now we have a real cpu fault */
+    helper_retaddr = 0;
     cpu_restore_state(cpu, pc);
 
     sigprocmask(SIG_SETMASK, old_set, NULL);
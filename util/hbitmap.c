@@ -378,6 +378,225 @@ bool hbitmap_get(const HBitmap *hb, uint64_t item)
     return (hb->levels[HBITMAP_LEVELS - 1][pos >> BITS_PER_LEVEL] & bit) != 0;
 }
 
+int64_t hbitmap_next_dirty(const HBitmap *hb, uint64_t start, uint64_t count)
+{
+    HBitmapIter hbi;
+    int64_t next;
+
+    if (!count || (start >> hb->granularity) >= hb->size) {
+        return -1;
+    }
+
+    hbitmap_iter_init(&hbi, hb, start);
+    next = hbitmap_iter_next(&hbi);
+    if (next < 0) {
+        return -1;
+    }
+
+    /* The iterator returns the first item of a granularity-sized group */
+    next = MAX(next, start);
+    if (next - start >= count) {
+        return -1;
+    }
+    return next;
+}
+
+int64_t hbitmap_next_zero(const HBitmap *hb, uint64_t start, uint64_t count)
+{
+    const unsigned long *words = hb->levels[HBITMAP_LEVELS - 1];
+    uint64_t pos = start >> hb->granularity;
+    uint64_t end, last_word, j;
+    unsigned long cur;
+    int64_t next;
+
+    if (!count || pos >= hb->size) {
+        return -1;
+    }
+
+    end = ((start + (count - 1)) >> hb->granularity) + 1;
+    end = MIN(end, hb->size);
+    last_word = (end - 1) >> BITS_PER_LEVEL;
+
+    /* Look at BITS_PER_LONG items at a time: a word with any clear bit
+     * has a nonzero complement.
+     */
+    j = pos >> BITS_PER_LEVEL;
+    cur = ~words[j] & (~0UL << (pos & (BITS_PER_LONG - 1)));
+    while (!cur) {
+        if (++j > last_word) {
+            return -1;
+        }
+        cur = ~words[j];
+    }
+
+    pos = (j << BITS_PER_LEVEL) + ctzl(cur);
+    if (pos >= end) {
+        return -1;
+    }
+    next = pos << hb->granularity;
+    return MAX(next, start);
+}
+
+int64_t hbitmap_next_dirty_area(const HBitmap *hb, uint64_t start,
+                                uint64_t end, uint64_t *count)
+{
+    int64_t first, next_zero;
+
+    end = MIN(end, hb->size << hb->granularity);
+    if (start >= end) {
+        return -1;
+    }
+
+    first = hbitmap_next_dirty(hb, start, end - start);
+    if (first < 0) {
+        return -1;
+    }
+
+    next_zero = hbitmap_next_zero(hb, first, end - first);
+    *count = (next_zero < 0 ? end : next_zero) - first;
+    return first;
+}
+
+uint64_t hbitmap_serialization_granularity(const HBitmap *hb)
+{
+    /* Require at least 64 bit granularity to be safe on both 64 bit and 32 bit
+     * hosts.
+     */
+    assert(hb->granularity < 64 - 6);
+    return UINT64_C(64) << hb->granularity;
+}
+
+/* Start should be aligned to serialization granularity, chunk size should be
+ * aligned to serialization granularity too, except for last chunk.
+ */
+static void serialization_chunk(const HBitmap *hb,
+                                uint64_t start, uint64_t count,
+                                unsigned long **first_el, uint64_t *el_count)
+{
+    uint64_t last = start + count - 1;
+    uint64_t gran = hbitmap_serialization_granularity(hb);
+
+    assert((start & (gran - 1)) == 0);
+    assert((last >> hb->granularity) < hb->size);
+    if ((last >> hb->granularity) != hb->size - 1) {
+        assert((count & (gran - 1)) == 0);
+    }
+
+    start = (start >> hb->granularity) >> BITS_PER_LEVEL;
+    last = (last >> hb->granularity) >> BITS_PER_LEVEL;
+
+    *first_el = &hb->levels[HBITMAP_LEVELS - 1][start];
+    *el_count = last - start + 1;
+}
+
+uint64_t hbitmap_serialization_size(const HBitmap *hb,
+                                    uint64_t start, uint64_t count)
+{
+    uint64_t el_count;
+    unsigned long *cur;
+
+    if (!count) {
+        return 0;
+    }
+    serialization_chunk(hb, start, count, &cur, &el_count);
+
+    return el_count * sizeof(unsigned long);
+}
+
+void hbitmap_serialize_part(const HBitmap *hb, uint8_t *buf,
+                            uint64_t start, uint64_t count)
+{
+    uint64_t el_count;
+    unsigned long *cur, *end;
+
+    if (!count) {
+        return;
+    }
+    serialization_chunk(hb, start, count, &cur, &el_count);
+    end = cur + el_count;
+
+    while (cur != end) {
+        unsigned long el =
+            (BITS_PER_LONG == 32 ? cpu_to_le32(*cur) : cpu_to_le64(*cur));
+
+        memcpy(buf, &el, sizeof(el));
+        buf += sizeof(el);
+        cur++;
+    }
+}
+
+void hbitmap_deserialize_part(HBitmap *hb, uint8_t *buf,
+                              uint64_t start, uint64_t count,
+                              bool finish)
+{
+    uint64_t el_count;
+    unsigned long *cur, *end;
+
+    if (!count) {
+        return;
+    }
+    serialization_chunk(hb, start, count, &cur, &el_count);
+    end = cur + el_count;
+
+    while (cur != end) {
+        memcpy(cur, buf, sizeof(*cur));
+
+        if (BITS_PER_LONG == 32) {
+            le32_to_cpus((uint32_t *)cur);
+        } else {
+            le64_to_cpus((uint64_t *)cur);
+        }
+
+        buf += sizeof(unsigned long);
+        cur++;
+    }
+    if (finish) {
+        hbitmap_deserialize_finish(hb);
+    }
+}
+
+void hbitmap_deserialize_zeroes(HBitmap *hb, uint64_t start, uint64_t count,
+                                bool finish)
+{
+    uint64_t el_count;
+    unsigned long *first;
+
+    if (!count) {
+        return;
+    }
+    serialization_chunk(hb, start, count, &first, &el_count);
+
+    memset(first, 0, el_count * sizeof(unsigned long));
+    if (finish) {
+        hbitmap_deserialize_finish(hb);
+    }
+}
+
+void hbitmap_deserialize_finish(HBitmap *bitmap)
+{
+    int64_t i, size, prev_size;
+    int lev;
+
+    /* restore levels starting from penultimate to zero level, assuming
+     * that the last level is ok */
+    size = MAX((bitmap->size + BITS_PER_LONG - 1) >> BITS_PER_LEVEL, 1);
+    for (lev = HBITMAP_LEVELS - 1; lev-- > 0; ) {
+        prev_size = size;
+        size = MAX((size + BITS_PER_LONG - 1) >> BITS_PER_LEVEL, 1);
+        memset(bitmap->levels[lev], 0, size * sizeof(unsigned long));
+
+        for (i = 0; i < prev_size; ++i) {
+            if (bitmap->levels[lev + 1][i]) {
+                bitmap->levels[lev][i >> BITS_PER_LEVEL] |=
+                    1UL << (i & (BITS_PER_LONG - 1));
+            }
+        }
+    }
+
+    bitmap->levels[0][0] |= 1UL << (BITS_PER_LONG - 1);
+    bitmap->count = hb_count_between(bitmap, 0, bitmap->size - 1);
+}
+
 void hbitmap_free(HBitmap *hb)
 {
     unsigned i;
@@ -470,6 +689,8 @@ void hbitmap_truncate(HBitmap *hb, uint64_t size)
  */
 bool hbitmap_merge(HBitmap *a, const HBitmap *b)
 {
+    const unsigned long *src, *upper;
+    unsigned long *dst;
     int i;
     uint64_t j;
 
@@ -481,15 +702,33 @@ bool hbitmap_merge(HBitmap *a, const HBitmap *b)
         return true;
     }
 
-    /* This merge is O(size), as BITS_PER_LONG and HBITMAP_LEVELS are constant.
-     * It may be possible to improve running times for sparsely populated maps
-     * by using hbitmap_iter_next, but this is suboptimal for dense maps.
+    /* The upper levels are at most 1/BITS_PER_LONG of the last one; OR
+     * them whole, in a loop simple enough for the compiler to vectorize.
      */
-    for (i = HBITMAP_LEVELS - 1; i >= 0; i--) {
+    for (i = HBITMAP_LEVELS - 2; i >= 0; i--) {
         for (j = 0; j < a->sizes[i]; j++) {
             a->levels[i][j] |= b->levels[i][j];
         }
     }
 
+    /* In the last level only visit the words that are nonzero in B, as
+     * marked by the level above, and keep A's count up to date.
+     */
+    i = HBITMAP_LEVELS - 1;
+    dst = a->levels[i];
+    src = b->levels[i];
+    upper = b->levels[i - 1];
+    for (j = 0; j < b->sizes[i - 1]; j++) {
+        unsigned long mark = upper[j];
+
+        while (mark) {
+            uint64_t k = (j << BITS_PER_LEVEL) + ctzl(mark);
+
+            mark &= mark - 1;
+            a->count += ctpopl(src[k] & ~dst[k]);
+            dst[k] |= src[k];
+        }
+    }
+
     return true;
 }
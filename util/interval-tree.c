@@ -0,0 +1,161 @@
+/*
+ * Interval tree of half-open 64-bit ranges
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/interval-tree.h"
+
+/*
+ * Nodes are ordered by start, then by address so that equal ranges can be
+ * told apart. Treap priorities come from hashing the node address, which
+ * keeps the tree balanced in expectation without storing them.
+ */
+static inline uint64_t it_prio(IntervalTreeNode *n)
+{
+    uint64_t x = (uintptr_t)n;
+
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    return x;
+}
+
+static inline bool it_before(IntervalTreeNode *a, IntervalTreeNode *b)
+{
+    return a->start < b->start ||
+           (a->start == b->start && (uintptr_t)a < (uintptr_t)b);
+}
+
+static void it_update(IntervalTreeNode *n)
+{
+    n->subtree_end = n->end;
+    if (n->left && n->left->subtree_end > n->subtree_end) {
+        n->subtree_end = n->left->subtree_end;
+    }
+    if (n->right && n->right->subtree_end > n->subtree_end) {
+        n->subtree_end = n->right->subtree_end;
+    }
+}
+
+/* Split @t into the nodes ordered before @key and the other ones */
+static void it_split(IntervalTreeNode *t, IntervalTreeNode *key,
+                     IntervalTreeNode **l, IntervalTreeNode **r)
+{
+    if (!t) {
+        *l = *r = NULL;
+        return;
+    }
+    if (it_before(t, key)) {
+        it_split(t->right, key, &t->right, r);
+        *l = t;
+    } else {
+        it_split(t->left, key, l, &t->left);
+        *r = t;
+    }
+    it_update(t);
+}
+
+/* All nodes of @l are ordered before the nodes of @r */
+static IntervalTreeNode *it_merge(IntervalTreeNode *l, IntervalTreeNode *r)
+{
+    if (!l) {
+        return r;
+    }
+    if (!r) {
+        return l;
+    }
+    if (it_prio(l) > it_prio(r)) {
+        l->right = it_merge(l->right, r);
+        it_update(l);
+        return l;
+    }
+    r->left = it_merge(l, r->left);
+    it_update(r);
+    return r;
+}
+
+static IntervalTreeNode *it_insert(IntervalTreeNode *t, IntervalTreeNode *node)
+{
+    if (!t || it_prio(node) > it_prio(t)) {
+        it_split(t, node, &node->left, &node->right);
+        it_update(node);
+        return node;
+    }
+    if (it_before(node, t)) {
+        t->left = it_insert(t->left, node);
+    } else {
+        t->right = it_insert(t->right, node);
+    }
+    it_update(t);
+    return t;
+}
+
+static IntervalTreeNode *it_remove(IntervalTreeNode *t, IntervalTreeNode *node)
+{
+    assert(t);
+    if (t == node) {
+        return it_merge(t->left, t->right);
+    }
+    if (it_before(node, t)) {
+        t->left = it_remove(t->left, node);
+    } else {
+        t->right = it_remove(t->right, node);
+    }
+    it_update(t);
+    return t;
+}
+
+/* Lowest node of @t overlapping [@start, @end), ordered after @after if set */
+static IntervalTreeNode *it_search(IntervalTreeNode *t,
+                                   IntervalTreeNode *after,
+                                   uint64_t start, uint64_t end)
+{
+    IntervalTreeNode *n;
+
+    while (t && t->subtree_end > start) {
+        if (after && !it_before(after, t)) {
+            t = t->right;
+            continue;
+        }
+        n = it_search(t->left, after, start, end);
+        if (n) {
+            return n;
+        }
+        /* The right subtree starts at or after t */
+        if (t->start >= end) {
+            return NULL;
+        }
+        if (t->end > start) {
+            return t;
+        }
+        t = t->right;
+    }
+    return NULL;
+}
+
+void interval_tree_insert(IntervalTreeRoot *root, IntervalTreeNode *node)
+{
+    root->root = it_insert(root->root, node);
+}
+
+void interval_tree_remove(IntervalTreeRoot *root, IntervalTreeNode *node)
+{
+    root->root = it_remove(root->root, node);
+    node->left = node->right = NULL;
+}
+
+IntervalTreeNode *interval_tree_iter_first(IntervalTreeRoot *root,
+                                           uint64_t start, uint64_t end)
+{
+    return it_search(root->root, NULL, start, end);
+}
+
+IntervalTreeNode *interval_tree_iter_next(IntervalTreeRoot *root,
+                                          IntervalTreeNode *node,
+                                          uint64_t start, uint64_t end)
+{
+    return it_search(root->root, node, start, end);
+}
@@ -20,6 +20,7 @@
 #endif
 #include "qemu/queue.h"
 #include "qemu/module.h"
+#include "qemu/startup-profile.h"
 
 typedef struct ModuleEntry
 {
@@ -91,6 +92,13 @@ static void module_load(module_init_type type);
 
 void module_call_init(module_init_type type)
 {
+    static const char *const type_names[MODULE_INIT_MAX] = {
+        [MODULE_INIT_BLOCK] = "block",
+        [MODULE_INIT_OPTS] = "opts",
+        [MODULE_INIT_QAPI] = "qapi",
+        [MODULE_INIT_QOM] = "qom",
+    };
+    int64_t start = startup_profile_begin();
     ModuleTypeList *l;
     ModuleEntry *e;
 
@@ -100,6 +108,8 @@ void module_call_init(module_init_type type)
     QTAILQ_FOREACH(e, l, node) {
         e->init();
     }
+
+    startup_profile_end("module", type_names[type], start);
 }
 
 #ifdef CONFIG_MODULES
@@ -39,6 +39,7 @@
 #include <libgen.h>
 #include <sys/signal.h>
 #include "qemu/cutils.h"
+#include "qemu/thread.h"
 
 #ifdef CONFIG_LINUX
 #include <sys/syscall.h>
@@ -311,18 +312,105 @@ char *qemu_get_exec_dir(void)
     return g_strdup(exec_dir);
 }
 
-static sigjmp_buf sigjump;
+/* One contiguous chunk of the area being preallocated */
+typedef struct MemsetThread {
+    char *addr;
+    size_t numpages;
+    size_t hpagesize;
+    QemuThread pgthread;
+    sigjmp_buf env;
+} MemsetThread;
 
-static void sigbus_handler(int signal)
+/* Where the SIGBUS handler returns to, in the thread touching pages */
+static __thread sigjmp_buf *sigbus_env;
+static bool memset_thread_failed;
+
+static void sigbus_handler(int signum)
+{
+    if (sigbus_env) {
+        siglongjmp(*sigbus_env, 1);
+    }
+    /* Not one of ours: the faulting access is retried and kills us */
+    signal(SIGBUS, SIG_DFL);
+}
+
+static void *do_touch_pages(void *arg)
+{
+    MemsetThread *memset_args = arg;
+    char *addr = memset_args->addr;
+    sigset_t set;
+    size_t i;
+
+    /* qemu_thread_create() blocks all signals, but a SIGBUS caused by a
+     * page fault must be handled or it kills the process */
+    sigemptyset(&set);
+    sigaddset(&set, SIGBUS);
+    pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+
+    sigbus_env = &memset_args->env;
+    if (sigsetjmp(memset_args->env, 1)) {
+        atomic_set(&memset_thread_failed, true);
+    } else {
+        /* MAP_POPULATE silently ignores failures */
+        for (i = 0; i < memset_args->numpages; i++) {
+            memset(addr, 0, 1);
+            addr += memset_args->hpagesize;
+        }
+    }
+    sigbus_env = NULL;
+    return NULL;
+}
+
+/* Touch @numpages pages from @area with up to @max_threads threads, each
+ * taking a contiguous chunk.  Returns true if a page could not be
+ * allocated.
+ */
+static bool touch_all_pages(char *area, size_t hpagesize, size_t numpages,
+                            int max_threads)
 {
-    siglongjmp(sigjump, 1);
+    MemsetThread *threads;
+    size_t numpages_per_thread, leftover;
+    long host_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    char *addr = area;
+    int i, num_threads;
+
+    num_threads = MAX(max_threads, 1);
+    if (host_cpus > 0) {
+        num_threads = MIN(num_threads, host_cpus);
+    }
+    num_threads = MIN(num_threads, numpages);
+    if (!num_threads) {
+        return false;
+    }
+
+    memset_thread_failed = false;
+    threads = g_new0(MemsetThread, num_threads);
+    numpages_per_thread = numpages / num_threads;
+    leftover = numpages % num_threads;
+    for (i = 0; i < num_threads; i++) {
+        threads[i].addr = addr;
+        threads[i].numpages = numpages_per_thread + (i < leftover);
+        threads[i].hpagesize = hpagesize;
+        qemu_thread_create(&threads[i].pgthread, "touch_pages",
+                           do_touch_pages, &threads[i],
+                           QEMU_THREAD_JOINABLE);
+        addr += threads[i].numpages * hpagesize;
+    }
+    for (i = 0; i < num_threads; i++) {
+        qemu_thread_join(&threads[i].pgthread);
+    }
+    g_free(threads);
+
+    return memset_thread_failed;
 }
 
-void os_mem_prealloc(int fd, char *area, size_t memory, Error **errp)
+void os_mem_prealloc(int fd, char *area, size_t memory, int max_threads,
+                     Error **errp)
 {
     int ret;
     struct sigaction act, oldact;
-    sigset_t set, oldset;
+    size_t hpagesize = qemu_fd_getpagesize(fd);
+    size_t numpages = DIV_ROUND_UP(memory, hpagesize);
 
     memset(&act, 0, sizeof(act));
     act.sa_handler = &sigbus_handler;
@@ -335,23 +423,9 @@ void os_mem_prealloc(int fd, char *area, size_t memory, Error **errp)
         return;
     }
 
-    /* unblock SIGBUS */
-    sigemptyset(&set);
-    sigaddset(&set, SIGBUS);
-    pthread_sigmask(SIG_UNBLOCK, &set, &oldset);
-
-    if (sigsetjmp(sigjump, 1)) {
+    if (touch_all_pages(area, hpagesize, numpages, max_threads)) {
         error_setg(errp, "os_mem_prealloc: Insufficient free host memory "
             "pages available to allocate guest RAM\n");
-    } else {
-        int i;
-        size_t hpagesize = qemu_fd_getpagesize(fd);
-        size_t numpages = DIV_ROUND_UP(memory, hpagesize);
-
-        /* MAP_POPULATE silently ignores failures */
-        for (i = 0; i < numpages; i++) {
-            memset(area + (hpagesize * i), 0, 1);
-        }
     }
 
     ret = sigaction(SIGBUS, &oldact, NULL);
@@ -360,7 +434,6 @@ void os_mem_prealloc(int fd, char *area, size_t memory, Error **errp)
         perror("os_mem_prealloc: failed to reinstall signal handler");
         exit(1);
     }
-    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
 }
 
 
@@ -22,8 +22,8 @@
  * - Writes (i.e. insertions/removals) can be concurrent with writes to
  *   different buckets; writes to the same bucket are serialized through a lock.
  * - Optional auto-resizing: the hash table resizes up if the load surpasses
- *   a certain threshold. Resizing is done concurrently with readers; writes
- *   are serialized with the resize operation.
+ *   a certain threshold. Resizing is done concurrently with readers and
+ *   writers; no operation has to wait for the whole table to be copied.
  *
  * The key structure is the bucket, which is cacheline-sized. Buckets
  * contain a few hash values and pointers; the u32 hash values are stored in
@@ -43,10 +43,23 @@
  * just-removed entry. This makes lookups slightly faster, since the moment an
  * invalid entry is found, the (failed) lookup is over.
  *
- * Resizing is done by taking all bucket spinlocks (so that no other writers can
- * race with us) and then copying all entries into a new hash map. Then, the
- * ht->map pointer is set, and the old map is freed once no RCU readers can see
- * it anymore.
+ * Resizing is incremental. A new, empty map is created and published in
+ * ht->map right away, pointing to the old one through map->old. The entries
+ * of each old head bucket are then copied to the new map lazily:
+ * - A writer first migrates the old head bucket that its hash maps to, so
+ *   that all entries with that hash are in the new map when it takes the new
+ *   bucket lock. It then migrates one more old bucket, so that the resize
+ *   completes even if the writes only touch a few buckets.
+ * - A migration holds the old head bucket's lock and is a write section of
+ *   its seqlock. Readers that find map->old set look up the new bucket and
+ *   then, unless it has been migrated, the old one, retrying if the old
+ *   bucket's seqlock changed meanwhile. Readers thus remain lock-free.
+ * - Migrated entries stay in the old map, which readers that fetched ht->map
+ *   before the resize may still be looking at.
+ * Once the last old bucket is migrated, map->old is cleared and the old map
+ * is freed once no RCU readers can see it anymore. A new resize only starts
+ * after the previous one has completed. Operations that need to see the whole
+ * table (iteration, reset) first complete any pending migration.
  *
  * Writers check for concurrent resizes by comparing ht->map before and after
  * acquiring their bucket lock. If they don't match, a resize has occured
@@ -119,6 +132,12 @@ QEMU_BUILD_BUG_ON(sizeof(struct qht_bucket) > QHT_BUCKET_ALIGN);
  * @n_added_buckets: number of added (i.e. "non-head") buckets
  * @n_added_buckets_threshold: threshold to trigger an upward resize once the
  *                             number of added buckets surpasses it.
+ * @old: map being resized away from, or NULL once all of its head buckets
+ *       have been migrated to this one.
+ * @n_old_buckets: number of head buckets in @old.
+ * @n_old_pending: number of head buckets in @old still to be migrated.
+ * @old_next: next head bucket in @old for writers to migrate.
+ * @migrated: flags for the head buckets of @old that have been migrated.
  *
  * Buckets are tracked in what we call a "map", i.e. this structure.
  */
@@ -128,6 +147,11 @@ struct qht_map {
     size_t n_buckets;
     size_t n_added_buckets;
     size_t n_added_buckets_threshold;
+    struct qht_map *old;
+    size_t n_old_buckets;
+    size_t n_old_pending;
+    size_t old_next;
+    bool *migrated;
 };
 
 /* trigger a resize when n_added_buckets > n_buckets / div */
@@ -135,6 +159,7 @@ struct qht_map {
 
 static void qht_do_resize(struct qht *ht, struct qht_map *new);
 static void qht_grow_maybe(struct qht *ht);
+static void qht_map_migrate_all(struct qht *ht);
 
 #ifdef QHT_DEBUG
 
@@ -233,7 +258,8 @@ static inline bool qht_map_is_stale__locked(struct qht *ht, struct qht_map *map)
 }
 
 /*
- * Grab all bucket locks, and set @pmap after making sure the map isn't stale.
+ * Grab all bucket locks, and set @pmap after making sure the map isn't stale
+ * and that it holds all the entries, i.e. no migration is pending.
  *
  * Pairs with qht_map_unlock_buckets(), hence the pass-by-reference.
  *
@@ -246,14 +272,19 @@ void qht_map_lock_buckets__no_stale(struct qht *ht, struct qht_map **pmap)
 
     map = atomic_rcu_read(&ht->map);
     qht_map_lock_buckets(map);
-    if (likely(!qht_map_is_stale__locked(ht, map))) {
+    if (likely(!qht_map_is_stale__locked(ht, map) &&
+               !atomic_read(&map->n_old_pending))) {
         *pmap = map;
         return;
     }
     qht_map_unlock_buckets(map);
 
-    /* we raced with a resize; acquire ht->lock to see the updated ht->map */
+    /*
+     * We raced with a resize, or one is in progress; acquire ht->lock to see
+     * the updated ht->map, and complete the resize.
+     */
     qemu_mutex_lock(&ht->lock);
+    qht_map_migrate_all(ht);
     map = ht->map;
     qht_map_lock_buckets(map);
     qemu_mutex_unlock(&ht->lock);
@@ -301,6 +332,15 @@ static inline bool qht_map_needs_resize(struct qht_map *map)
     return atomic_read(&map->n_added_buckets) > map->n_added_buckets_threshold;
 }
 
+/* whether the entries with @hash might still be in map->old */
+static inline bool qht_map_hash_pending(struct qht_map *map, uint32_t hash)
+{
+    if (likely(!atomic_read(&map->n_old_pending))) {
+        return false;
+    }
+    return !atomic_read(&map->migrated[hash & (map->n_old_buckets - 1)]);
+}
+
 static inline void qht_chain_destroy(struct qht_bucket *head)
 {
     struct qht_bucket *curr = head->next;
@@ -322,6 +362,7 @@ static void qht_map_destroy(struct qht_map *map)
         qht_chain_destroy(&map->buckets[i]);
     }
     qemu_vfree(map->buckets);
+    g_free(map->migrated);
     g_free(map);
 }
 
@@ -342,6 +383,12 @@ static struct qht_map *qht_map_create(size_t n_buckets)
         map->n_added_buckets_threshold = 1;
     }
 
+    map->old = NULL;
+    map->n_old_buckets = 0;
+    map->n_old_pending = 0;
+    map->old_next = 0;
+    map->migrated = NULL;
+
     map->buckets = qemu_memalign(QHT_BUCKET_ALIGN,
                                  sizeof(*map->buckets) * n_buckets);
     for (i = 0; i < n_buckets; i++) {
@@ -364,6 +411,9 @@ void qht_init(struct qht *ht, size_t n_elems, unsigned int mode)
 /* call only when there are no readers/writers left */
 void qht_destroy(struct qht *ht)
 {
+    if (ht->map->old) {
+        qht_map_destroy(ht->map->old);
+    }
     qht_map_destroy(ht->map);
     memset(ht, 0, sizeof(*ht));
 }
@@ -418,6 +468,7 @@ bool qht_reset_size(struct qht *ht, size_t n_elems)
     n_buckets = qht_elems_to_buckets(n_elems);
 
     qemu_mutex_lock(&ht->lock);
+    qht_map_migrate_all(ht);
     map = ht->map;
     if (n_buckets != map->n_buckets) {
         new = qht_map_create(n_buckets);
@@ -476,6 +527,39 @@ void *qht_lookup__slowpath(struct qht_bucket *b, qht_lookup_func_t func,
     return ret;
 }
 
+/*
+ * Look up both the head bucket @b of @map and, unless it has been migrated,
+ * the corresponding head bucket of the map being resized away from. The
+ * latter's seqlock covers the whole lookup, so that entries being moved
+ * between the two are not missed.
+ */
+static __attribute__((noinline))
+void *qht_lookup__resizing(struct qht_map *map, struct qht_bucket *b,
+                           qht_lookup_func_t func, const void *userp,
+                           uint32_t hash)
+{
+    struct qht_map *old = atomic_rcu_read(&map->old);
+    struct qht_bucket *ob;
+    unsigned int version;
+    size_t idx;
+    void *ret;
+
+    if (unlikely(old == NULL)) {
+        return qht_lookup__slowpath(b, func, userp, hash);
+    }
+    idx = hash & (map->n_old_buckets - 1);
+    ob = &old->buckets[idx];
+
+    do {
+        version = seqlock_read_begin(&ob->sequence);
+        ret = qht_lookup__slowpath(b, func, userp, hash);
+        if (ret == NULL && !atomic_read(&map->migrated[idx])) {
+            ret = qht_do_lookup(ob, func, userp, hash);
+        }
+    } while (seqlock_read_retry(&ob->sequence, version));
+    return ret;
+}
+
 void *qht_lookup(struct qht *ht, qht_lookup_func_t func, const void *userp,
                  uint32_t hash)
 {
@@ -486,6 +570,9 @@ void *qht_lookup(struct qht *ht, qht_lookup_func_t func, const void *userp,
 
     map = atomic_rcu_read(&ht->map);
     b = qht_map_to_bucket(map, hash);
+    if (unlikely(atomic_read(&map->n_old_pending))) {
+        return qht_lookup__resizing(map, b, func, userp, hash);
+    }
 
     version = seqlock_read_begin(&b->sequence);
     ret = qht_do_lookup(b, func, userp, hash);
@@ -545,6 +632,146 @@ static bool qht_insert__locked(struct qht *ht, struct qht_map *map,
     return true;
 }
 
+/*
+ * Copy the entries of the @idx-th head bucket of map->old to @map.
+ *
+ * The entries are left in place for readers that still see the old map; the
+ * copy in @map is the one that writers modify from now on.
+ *
+ * Call under an RCU read-critical section, without any bucket lock held.
+ */
+static void qht_map_migrate_bucket(struct qht *ht, struct qht_map *map,
+                                   size_t idx)
+{
+    struct qht_map *old = atomic_rcu_read(&map->old);
+    struct qht_bucket *head;
+    struct qht_bucket *b;
+    int i;
+
+    if (old == NULL) {
+        return;
+    }
+    head = &old->buckets[idx];
+
+    qemu_spin_lock(&head->lock);
+    if (atomic_read(&map->migrated[idx])) {
+        qemu_spin_unlock(&head->lock);
+        return;
+    }
+    seqlock_write_begin(&head->sequence);
+    b = head;
+    do {
+        for (i = 0; i < QHT_BUCKET_ENTRIES; i++) {
+            struct qht_bucket *new;
+
+            if (b->pointers[i] == NULL) {
+                goto done;
+            }
+            new = qht_map_to_bucket(map, b->hashes[i]);
+            qemu_spin_lock(&new->lock);
+            qht_insert__locked(ht, map, new, b->pointers[i], b->hashes[i],
+                               NULL);
+            qemu_spin_unlock(&new->lock);
+        }
+        b = b->next;
+    } while (b);
+ done:
+    atomic_set(&map->migrated[idx], true);
+    seqlock_write_end(&head->sequence);
+    qemu_spin_unlock(&head->lock);
+
+    if (atomic_fetch_dec(&map->n_old_pending) == 1) {
+        atomic_rcu_set(&map->old, NULL);
+        call_rcu(old, qht_map_destroy, rcu);
+    }
+}
+
+/* migrate the head bucket of ht->map->old that @hash maps to */
+static void qht_migrate_hash(struct qht *ht, uint32_t hash)
+{
+    struct qht_map *map;
+
+    rcu_read_lock();
+    map = atomic_rcu_read(&ht->map);
+    if (atomic_read(&map->n_old_pending)) {
+        qht_map_migrate_bucket(ht, map, hash & (map->n_old_buckets - 1));
+    }
+    rcu_read_unlock();
+}
+
+/* migrate the next head bucket of ht->map->old, if any */
+static void qht_migrate_next(struct qht *ht)
+{
+    struct qht_map *map;
+    size_t idx;
+
+    rcu_read_lock();
+    map = atomic_rcu_read(&ht->map);
+    if (atomic_read(&map->n_old_pending)) {
+        idx = atomic_fetch_inc(&map->old_next);
+        if (idx < map->n_old_buckets) {
+            qht_map_migrate_bucket(ht, map, idx);
+        }
+    }
+    rcu_read_unlock();
+}
+
+/* call with ht->lock held */
+static void qht_map_migrate_all(struct qht *ht)
+{
+    struct qht_map *map = ht->map;
+    size_t i;
+
+    if (!atomic_read(&map->n_old_pending)) {
+        return;
+    }
+    rcu_read_lock();
+    for (i = 0; i < map->n_old_buckets; i++) {
+        qht_map_migrate_bucket(ht, map, i);
+    }
+    rcu_read_unlock();
+}
+
+/*
+ * Like qht_bucket_lock__no_stale(), but also make sure that all the entries
+ * with @hash are in the returned bucket, i.e. that none of them is still
+ * waiting to be migrated from the map being resized away from.
+ */
+static inline
+struct qht_bucket *qht_bucket_lock__migrated(struct qht *ht, uint32_t hash,
+                                             struct qht_map **pmap)
+{
+    struct qht_bucket *b;
+
+    for (;;) {
+        b = qht_bucket_lock__no_stale(ht, hash, pmap);
+        if (likely(!qht_map_hash_pending(*pmap, hash))) {
+            return b;
+        }
+        qemu_spin_unlock(&b->lock);
+        qht_migrate_hash(ht, hash);
+    }
+}
+
+/*
+ * Call with ht->lock held.
+ *
+ * Publish @new, whose head buckets are filled lazily from the current map.
+ */
+static void qht_do_resize_incremental(struct qht *ht, struct qht_map *new)
+{
+    struct qht_map *old = ht->map;
+
+    g_assert_cmpuint(new->n_buckets, !=, old->n_buckets);
+    g_assert(!atomic_read(&old->n_old_pending));
+
+    new->old = old;
+    new->n_old_buckets = old->n_buckets;
+    new->n_old_pending = old->n_buckets;
+    new->migrated = g_new0(bool, old->n_buckets);
+    atomic_rcu_set(&ht->map, new);
+}
+
 static __attribute__((noinline)) void qht_grow_maybe(struct qht *ht)
 {
     struct qht_map *map;
@@ -557,13 +784,13 @@ static __attribute__((noinline)) void qht_grow_maybe(struct qht *ht)
         return;
     }
     map = ht->map;
-    /* another thread might have just performed the resize we were after */
-    if (qht_map_needs_resize(map)) {
-        struct qht_map *new = qht_map_create(map->n_buckets * 2);
-
-        qht_map_lock_buckets(map);
-        qht_do_resize(ht, new);
-        qht_map_unlock_buckets(map);
+    /*
+     * Another thread might have just performed the resize we were after.
+     * Also let the previous resize complete first; inserts will keep
+     * migrating its buckets, and retry.
+     */
+    if (qht_map_needs_resize(map) && !atomic_read(&map->n_old_pending)) {
+        qht_do_resize_incremental(ht, qht_map_create(map->n_buckets * 2));
     }
     qemu_mutex_unlock(&ht->lock);
 }
@@ -578,12 +805,14 @@ bool qht_insert(struct qht *ht, void *p, uint32_t hash)
     /* NULL pointers are not supported */
     qht_debug_assert(p);
 
-    b = qht_bucket_lock__no_stale(ht, hash, &map);
+    b = qht_bucket_lock__migrated(ht, hash, &map);
     ret = qht_insert__locked(ht, map, b, p, hash, &needs_resize);
     qht_bucket_debug__locked(b);
     qemu_spin_unlock(&b->lock);
 
-    if (unlikely(needs_resize) && ht->mode & QHT_MODE_AUTO_RESIZE) {
+    if (unlikely(atomic_read(&map->n_old_pending))) {
+        qht_migrate_next(ht);
+    } else if (unlikely(needs_resize) && ht->mode & QHT_MODE_AUTO_RESIZE) {
         qht_grow_maybe(ht);
     }
     return ret;
@@ -684,10 +913,14 @@ bool qht_remove(struct qht *ht, const void *p, uint32_t hash)
     /* NULL pointers are not supported */
     qht_debug_assert(p);
 
-    b = qht_bucket_lock__no_stale(ht, hash, &map);
+    b = qht_bucket_lock__migrated(ht, hash, &map);
     ret = qht_remove__locked(map, b, p, hash);
     qht_bucket_debug__locked(b);
     qemu_spin_unlock(&b->lock);
+
+    if (unlikely(atomic_read(&map->n_old_pending))) {
+        qht_migrate_next(ht);
+    }
     return ret;
 }
 
@@ -722,8 +955,7 @@ void qht_iter(struct qht *ht, qht_iter_func_t func, void *userp)
 {
     struct qht_map *map;
 
-    map = atomic_rcu_read(&ht->map);
-    qht_map_lock_buckets(map);
+    qht_map_lock_buckets__no_stale(ht, &map);
     /* Note: ht here is merely for carrying ht->mode; ht->map won't be read */
     qht_map_iter__all_locked(ht, map, func, userp);
     qht_map_unlock_buckets(map);
@@ -766,14 +998,9 @@ bool qht_resize(struct qht *ht, size_t n_elems)
     size_t ret = false;
 
     qemu_mutex_lock(&ht->lock);
+    qht_map_migrate_all(ht);
     if (n_buckets != ht->map->n_buckets) {
-        struct qht_map *new;
-        struct qht_map *old = ht->map;
-
-        new = qht_map_create(n_buckets);
-        qht_map_lock_buckets(old);
-        qht_do_resize(ht, new);
-        qht_map_unlock_buckets(old);
+        qht_do_resize_incremental(ht, qht_map_create(n_buckets));
         ret = true;
     }
     qemu_mutex_unlock(&ht->lock);
@@ -781,50 +1008,65 @@ bool qht_resize(struct qht *ht, size_t n_elems)
     return ret;
 }
 
+/* count the buckets and entries in the chain starting at @head */
+static void qht_chain_statistics(struct qht_bucket *head, size_t *pbuckets,
+                                 size_t *pentries)
+{
+    struct qht_bucket *b;
+    unsigned int version;
+    size_t buckets;
+    size_t entries;
+    int j;
+
+    do {
+        version = seqlock_read_begin(&head->sequence);
+        buckets = 0;
+        entries = 0;
+        b = head;
+        do {
+            for (j = 0; j < QHT_BUCKET_ENTRIES; j++) {
+                if (atomic_read(&b->pointers[j]) == NULL) {
+                    break;
+                }
+                entries++;
+            }
+            buckets++;
+            b = atomic_rcu_read(&b->next);
+        } while (b);
+    } while (seqlock_read_retry(&head->sequence, version));
+
+    *pbuckets = buckets;
+    *pentries = entries;
+}
+
 /* pass @stats to qht_statistics_destroy() when done */
 void qht_statistics_init(struct qht *ht, struct qht_stats *stats)
 {
     struct qht_map *map;
+    struct qht_map *old;
     int i;
 
+    rcu_read_lock();
     map = atomic_rcu_read(&ht->map);
 
     stats->used_head_buckets = 0;
+    stats->pending_head_buckets = 0;
     stats->entries = 0;
     qdist_init(&stats->chain);
     qdist_init(&stats->occupancy);
     /* bail out if the qht has not yet been initialized */
     if (unlikely(map == NULL)) {
         stats->head_buckets = 0;
+        rcu_read_unlock();
         return;
     }
     stats->head_buckets = map->n_buckets;
 
     for (i = 0; i < map->n_buckets; i++) {
-        struct qht_bucket *head = &map->buckets[i];
-        struct qht_bucket *b;
-        unsigned int version;
         size_t buckets;
         size_t entries;
-        int j;
-
-        do {
-            version = seqlock_read_begin(&head->sequence);
-            buckets = 0;
-            entries = 0;
-            b = head;
-            do {
-                for (j = 0; j < QHT_BUCKET_ENTRIES; j++) {
-                    if (atomic_read(&b->pointers[j]) == NULL) {
-                        break;
-                    }
-                    entries++;
-                }
-                buckets++;
-                b = atomic_rcu_read(&b->next);
-            } while (b);
-        } while (seqlock_read_retry(&head->sequence, version));
 
+        qht_chain_statistics(&map->buckets[i], &buckets, &entries);
         if (entries) {
             qdist_inc(&stats->chain, buckets);
             qdist_inc(&stats->occupancy,
@@ -835,6 +1077,23 @@ void qht_statistics_init(struct qht *ht, struct qht_stats *stats)
             qdist_inc(&stats->occupancy, 0);
         }
     }
+
+    /* entries still waiting to be migrated count too */
+    old = atomic_rcu_read(&map->old);
+    if (old) {
+        for (i = 0; i < map->n_old_buckets; i++) {
+            size_t buckets;
+            size_t entries;
+
+            if (atomic_read(&map->migrated[i])) {
+                continue;
+            }
+            qht_chain_statistics(&old->buckets[i], &buckets, &entries);
+            stats->pending_head_buckets++;
+            stats->entries += entries;
+        }
+    }
+    rcu_read_unlock();
 }
 
 void qht_statistics_destroy(struct qht_stats *stats)
@@ -46,6 +46,9 @@ QemuEvent rcu_gp_event;
 static QemuMutex rcu_registry_lock;
 static QemuMutex rcu_sync_lock;
 
+/* Number of grace periods completed, written under rcu_sync_lock */
+static unsigned long rcu_gp_completed;
+
 /*
  * Check whether a quiescent state was crossed between the beginning of
  * update_counter_and_wait and now.
@@ -139,7 +142,22 @@ static void wait_for_readers(void)
 
 void synchronize_rcu(void)
 {
+    unsigned long completed;
+
+    /* Order the caller's removals before sampling rcu_gp_completed.  */
+    smp_mb();
+    completed = atomic_read(&rcu_gp_completed);
+
     qemu_mutex_lock(&rcu_sync_lock);
+
+    /* If two grace periods completed while we waited for rcu_sync_lock,
+     * the second one started after we were called and covers us too.
+     */
+    if (atomic_read(&rcu_gp_completed) - completed >= 2) {
+        qemu_mutex_unlock(&rcu_sync_lock);
+        return;
+    }
+
     qemu_mutex_lock(&rcu_registry_lock);
 
     if (!QLIST_EMPTY(&registry)) {
@@ -163,6 +181,7 @@ void synchronize_rcu(void)
         wait_for_readers();
     }
 
+    atomic_mb_set(&rcu_gp_completed, rcu_gp_completed + 1);
     qemu_mutex_unlock(&rcu_registry_lock);
     qemu_mutex_unlock(&rcu_sync_lock);
 }
@@ -177,14 +196,21 @@ static struct rcu_head dummy;
 static struct rcu_head *head = &dummy, **tail = &dummy.next;
 static int rcu_call_count;
 static QemuEvent rcu_call_ready_event;
+static bool rcu_call_expedited;
 
-static void enqueue(struct rcu_head *node)
+/* Append the list from @first to the node whose next field is @last_next.  */
+static void enqueue_list(struct rcu_head *first, struct rcu_head **last_next)
 {
     struct rcu_head **old_tail;
 
-    node->next = NULL;
-    old_tail = atomic_xchg(&tail, &node->next);
-    atomic_mb_set(old_tail, node);
+    *last_next = NULL;
+    old_tail = atomic_xchg(&tail, last_next);
+    atomic_mb_set(old_tail, first);
+}
+
+static void enqueue(struct rcu_head *node)
+{
+    enqueue_list(node, &node->next);
 }
 
 static struct rcu_head *try_dequeue(void)
@@ -242,6 +268,9 @@ static void *call_rcu_thread(void *opaque)
          * added before synchronize_rcu() starts.
          */
         while (n == 0 || (n < RCU_CALL_MIN_SIZE && ++tries <= 5)) {
+            if (n && atomic_xchg(&rcu_call_expedited, false)) {
+                break;
+            }
             g_usleep(10000);
             if (n == 0) {
                 qemu_event_reset(&rcu_call_ready_event);
@@ -280,11 +309,45 @@ static void *call_rcu_thread(void *opaque)
 void call_rcu1(struct rcu_head *node, void (*func)(struct rcu_head *node))
 {
     node->func = func;
+    if (rcu_reader.batch_depth) {
+        *rcu_reader.batch_tail = node;
+        rcu_reader.batch_tail = &node->next;
+        rcu_reader.batch_count++;
+        return;
+    }
     enqueue(node);
     atomic_inc(&rcu_call_count);
     qemu_event_set(&rcu_call_ready_event);
 }
 
+void rcu_call_batch_begin(void)
+{
+    if (rcu_reader.batch_depth++ == 0) {
+        rcu_reader.batch_head = NULL;
+        rcu_reader.batch_tail = &rcu_reader.batch_head;
+        rcu_reader.batch_count = 0;
+    }
+}
+
+void rcu_call_batch_end(void)
+{
+    assert(rcu_reader.batch_depth != 0);
+    if (--rcu_reader.batch_depth > 0 || rcu_reader.batch_count == 0) {
+        return;
+    }
+
+    /* One exchange on the shared queue for the whole batch.  */
+    enqueue_list(rcu_reader.batch_head, rcu_reader.batch_tail);
+    atomic_add(&rcu_call_count, rcu_reader.batch_count);
+    qemu_event_set(&rcu_call_ready_event);
+}
+
+void call_rcu_expedite(void)
+{
+    atomic_set(&rcu_call_expedited, true);
+    qemu_event_set(&rcu_call_ready_event);
+}
+
 void rcu_register_thread(void)
 {
     assert(rcu_reader.ctr == 0);
@@ -0,0 +1,67 @@
+/*
+ * Startup profiling
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qemu/timer.h"
+#include "qemu/startup-profile.h"
+#include "trace.h"
+
+static int64_t startup_epoch;
+static bool startup_profiling;
+static GArray *startup_records;
+
+void startup_profile_init(void)
+{
+    startup_epoch = get_clock();
+    startup_records = g_array_new(false, false, sizeof(StartupProfileRecord));
+    startup_profiling = true;
+}
+
+/* Record the whole of startup as the last phase and stop recording */
+void startup_profile_done(void)
+{
+    startup_profile_end("phase", "startup", startup_epoch);
+    startup_profiling = false;
+}
+
+int64_t startup_profile_begin(void)
+{
+    return startup_profiling ? get_clock() : 0;
+}
+
+void startup_profile_end(const char *kind, const char *name, int64_t start)
+{
+    StartupProfileRecord rec;
+
+    if (!startup_profiling || !start) {
+        return;
+    }
+
+    rec.kind = kind;
+    rec.name = g_strdup(name);
+    rec.start_ns = start - startup_epoch;
+    rec.duration_ns = get_clock() - start;
+    g_array_append_val(startup_records, rec);
+
+    trace_startup_profile(kind, name, rec.start_ns, rec.duration_ns);
+}
+
+void startup_profile_foreach(void (*fn)(const StartupProfileRecord *rec,
+                                        void *opaque),
+                             void *opaque)
+{
+    guint i;
+
+    if (!startup_records) {
+        return;
+    }
+
+    for (i = 0; i < startup_records->len; i++) {
+        fn(&g_array_index(startup_records, StartupProfileRecord, i), opaque);
+    }
+}
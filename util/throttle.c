@@ -181,6 +181,22 @@ static bool throttle_compute_timer(ThrottleState *ts,
     return false;
 }
 
+/* Leak the buckets and return how long the next operation of this type
+ * has to wait.  Unlike throttle_schedule_timer() this does not arm any
+ * timer, so that the caller can combine several ThrottleStates.
+ *
+ * @is_write:   the type of operation
+ * @now:        the current clock timestamp
+ * @ret:        the time to wait in ns, or 0 if the operation can go through
+ */
+int64_t throttle_compute_delay(ThrottleState *ts, bool is_write, int64_t now)
+{
+    int64_t next_timestamp;
+
+    throttle_compute_timer(ts, is_write, now, &next_timestamp);
+    return next_timestamp - now;
+}
+
 /* Add timers to event loop */
 void throttle_timers_attach_aio_context(ThrottleTimers *tt,
                                         AioContext *new_context)
@@ -388,15 +404,15 @@ static void throttle_cancel_timer(QEMUTimer *timer)
     timer_del(timer);
 }
 
-/* Used to configure the throttle
+/* Configure a ThrottleState that has no timers of its own
  *
  * @ts: the throttle state we are working on
- * @tt: the throttle timers we use in this aio context
+ * @clock_type: the clock used to leak the buckets
  * @cfg: the config to set
  */
-void throttle_config(ThrottleState *ts,
-                     ThrottleTimers *tt,
-                     ThrottleConfig *cfg)
+void throttle_set_config(ThrottleState *ts,
+                         QEMUClockType clock_type,
+                         ThrottleConfig *cfg)
 {
     int i;
 
@@ -406,7 +422,22 @@ void throttle_config(ThrottleState *ts,
         throttle_fix_bucket(&ts->cfg.buckets[i]);
     }
 
-    ts->previous_leak = qemu_clock_get_ns(tt->clock_type);
+    ts->previous_leak = qemu_clock_get_ns(clock_type);
+}
+
+/* Used to configure the throttle
+ *
+ * @ts: the throttle state we are working on
+ * @tt: the throttle timers we use in this aio context
+ * @cfg: the config to set
+ */
+void throttle_config(ThrottleState *ts,
+                     ThrottleTimers *tt,
+                     ThrottleConfig *cfg)
+{
+    int i;
+
+    throttle_set_config(ts, tt->clock_type, cfg);
 
     for (i = 0; i < 2; i++) {
         throttle_cancel_timer(tt->timers[i]);
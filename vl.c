@@ -121,6 +121,7 @@ int main(int argc, char **argv)
 #include "crypto/init.h"
 #include "sysemu/replay.h"
 #include "qapi/qmp/qerror.h"
+#include "qemu/startup-profile.h"
 
 #define MAX_VIRTIO_CONSOLES 1
 #define MAX_SCLP_CONSOLES 1
@@ -459,6 +460,9 @@ static QemuOptsList qemu_icount_opts = {
         }, {
             .name = "rrfile",
             .type = QEMU_OPT_STRING,
+        }, {
+            .name = "rrcompress",
+            .type = QEMU_OPT_BOOL,
         },
         { /* end of list */ }
     },
@@ -2964,7 +2968,9 @@ int main(int argc, char **argv, char **envp)
     Error *main_loop_err = NULL;
     Error *err = NULL;
     bool list_data_dirs = false;
+    int64_t phase;
 
+    startup_profile_init();
     qemu_init_cpu_loop();
     qemu_mutex_lock_iothread();
 
@@ -4238,11 +4244,13 @@ int main(int argc, char **argv, char **envp)
     page_size_init();
     socket_init();
 
+    phase = startup_profile_begin();
     if (qemu_opts_foreach(qemu_find_opts("object"),
                           user_creatable_add_opts_foreach,
                           object_create_initial, NULL)) {
         exit(1);
     }
+    startup_profile_end("phase", "object-create-initial", phase);
 
     if (qemu_opts_foreach(qemu_find_opts("chardev"),
                           chardev_init_func, NULL, NULL)) {
@@ -4273,7 +4281,9 @@ int main(int argc, char **argv, char **envp)
         exit(1);
     }
 
+    phase = startup_profile_begin();
     configure_accelerator(current_machine);
+    startup_profile_end("phase", "configure-accelerator", phase);
 
     if (qtest_chrdev) {
         qtest_init(qtest_chrdev, qtest_log, &error_fatal);
@@ -4355,15 +4365,19 @@ int main(int argc, char **argv, char **envp)
 #endif
     }
 
+    phase = startup_profile_begin();
     if (net_init_clients() < 0) {
         exit(1);
     }
+    startup_profile_end("phase", "net-init", phase);
 
+    phase = startup_profile_begin();
     if (qemu_opts_foreach(qemu_find_opts("object"),
                           user_creatable_add_opts_foreach,
                           object_create_delayed, NULL)) {
         exit(1);
     }
+    startup_profile_end("phase", "object-create-delayed", phase);
 
 #ifdef CONFIG_TPM
     if (tpm_init() < 0) {
@@ -4464,7 +4478,9 @@ int main(int argc, char **argv, char **envp)
     current_machine->boot_order = boot_order;
     current_machine->cpu_model = cpu_model;
 
+    phase = startup_profile_begin();
     machine_class->init(current_machine);
+    startup_profile_end("phase", "machine-init", phase);
 
     realtime_init();
 
@@ -4489,12 +4505,14 @@ int main(int argc, char **argv, char **envp)
     igd_gfx_passthru();
 
     /* init generic devices */
+    phase = startup_profile_begin();
     rom_set_order_override(FW_CFG_ORDER_OVERRIDE_DEVICE);
     if (qemu_opts_foreach(qemu_find_opts("device"),
                           device_init_func, NULL, NULL)) {
         exit(1);
     }
     rom_reset_order_override();
+    startup_profile_end("phase", "device-init", phase);
 
     /* Did we create any drives that we failed to create a device for? */
     drive_check_orphaned();
@@ -4554,12 +4572,14 @@ int main(int argc, char **argv, char **envp)
         exit(1);
     }
 
+    phase = startup_profile_begin();
     qdev_machine_creation_done();
 
     /* TODO: once all bus devices are qdevified, this should be done
      * when bus is created by qdev.c */
     qemu_register_reset(qbus_reset_all_fn, sysbus_get_default());
     qemu_run_machine_init_done_notifiers();
+    startup_profile_end("phase", "machine-done", phase);
 
     if (rom_check_and_register_reset() != 0) {
         error_report("rom check and register reset failed");
@@ -4572,12 +4592,16 @@ int main(int argc, char **argv, char **envp)
        reading from the other reads, because timer polling functions query
        clock values from the log. */
     replay_checkpoint(CHECKPOINT_RESET);
+    phase = startup_profile_begin();
     qemu_system_reset(VMRESET_SILENT);
+    startup_profile_end("phase", "system-reset", phase);
     register_global_state();
     if (loadvm) {
+        phase = startup_profile_begin();
         if (load_vmstate(loadvm) < 0) {
             autostart = 0;
         }
+        startup_profile_end("phase", "loadvm", phase);
     }
 
     qdev_prop_check_globals();
@@ -4601,6 +4625,7 @@ int main(int argc, char **argv, char **envp)
     os_setup_post();
 
     trace_init_vcpu_events();
+    startup_profile_done();
     main_loop();
     replay_disable_events();
 
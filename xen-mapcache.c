@@ -48,6 +48,9 @@
  */
 #define NON_MCACHE_MEMORY_SIZE (80 * 1024 * 1024)
 
+/* Part of max_mcache_size kept for idle chained entries, as a shift */
+#define MCACHE_IDLE_SHIFT 6
+
 typedef struct MapCacheEntry {
     hwaddr paddr_index;
     uint8_t *vaddr_base;
@@ -55,6 +58,9 @@ typedef struct MapCacheEntry {
     uint8_t lock;
     hwaddr size;
     struct MapCacheEntry *next;
+    /* Unlocked chained entry, on the idle LRU list */
+    bool idle;
+    QTAILQ_ENTRY(MapCacheEntry) idle_next;
 } MapCacheEntry;
 
 typedef struct MapCacheRev {
@@ -69,6 +75,14 @@ typedef struct MapCache {
     unsigned long nr_buckets;
     QTAILQ_HEAD(map_cache_head, MapCacheRev) locked_entries;
 
+    /* Chained entries are created when the bucket's first entry is locked
+     * with another size, which DMA mappings do all the time.  Once
+     * unlocked they are kept mapped, most recently used first, so that
+     * the next request for the same buffer need not map it again. */
+    QTAILQ_HEAD(map_cache_idle_head, MapCacheEntry) idle_entries;
+    hwaddr idle_size;
+    hwaddr max_idle_size;
+
     /* For most cases (>99.9%), the page address is the same. */
     MapCacheEntry *last_entry;
     unsigned long max_mcache_size;
@@ -112,6 +126,7 @@ void xen_map_cache_init(phys_offset_to_gaddr_t f, void *opaque)
     qemu_mutex_init(&mapcache->lock);
 
     QTAILQ_INIT(&mapcache->locked_entries);
+    QTAILQ_INIT(&mapcache->idle_entries);
 
     if (geteuid() == 0) {
         rlimit_as.rlim_cur = RLIM_INFINITY;
@@ -135,6 +150,9 @@ void xen_map_cache_init(phys_offset_to_gaddr_t f, void *opaque)
 
     setrlimit(RLIMIT_AS, &rlimit_as);
 
+    mapcache->max_idle_size = mapcache->max_mcache_size >> MCACHE_IDLE_SHIFT;
+    mapcache->max_mcache_size -= mapcache->max_idle_size;
+
     mapcache->nr_buckets =
         (((mapcache->max_mcache_size >> XC_PAGE_SHIFT) +
           (1UL << (MCACHE_BUCKET_SHIFT - XC_PAGE_SHIFT)) - 1) >>
@@ -199,6 +217,58 @@ static void xen_remap_bucket(MapCacheEntry *entry,
     g_free(err);
 }
 
+static void xen_map_cache_free_entry(MapCacheEntry *entry)
+{
+    MapCacheEntry *pentry = &mapcache->entry[entry->paddr_index %
+                                             mapcache->nr_buckets];
+
+    while (pentry->next != entry) {
+        pentry = pentry->next;
+    }
+    pentry->next = entry->next;
+
+    if (mapcache->last_entry == entry) {
+        mapcache->last_entry = NULL;
+    }
+    if (munmap(entry->vaddr_base, entry->size) != 0) {
+        perror("unmap fails");
+        exit(-1);
+    }
+    g_free(entry->valid_mapping);
+    g_free(entry);
+}
+
+static void xen_map_cache_idle_remove(MapCacheEntry *entry)
+{
+    if (entry->idle) {
+        QTAILQ_REMOVE(&mapcache->idle_entries, entry, idle_next);
+        mapcache->idle_size -= entry->size;
+        entry->idle = false;
+    }
+}
+
+/* Put an unlocked chained entry at the head of the idle list, and unmap
+ * the least recently used ones once they take too much address space. */
+static void xen_map_cache_idle_add(MapCacheEntry *entry)
+{
+    MapCacheEntry *victim;
+
+    xen_map_cache_idle_remove(entry);
+    QTAILQ_INSERT_HEAD(&mapcache->idle_entries, entry, idle_next);
+    mapcache->idle_size += entry->size;
+    entry->idle = true;
+
+    while (mapcache->idle_size > mapcache->max_idle_size) {
+        victim = QTAILQ_LAST(&mapcache->idle_entries, map_cache_idle_head);
+        if (victim == entry) {
+            break;
+        }
+        trace_xen_map_cache_evict(victim->paddr_index, victim->size);
+        xen_map_cache_idle_remove(victim);
+        xen_map_cache_free_entry(victim);
+    }
+}
+
 static uint8_t *xen_map_cache_unlocked(hwaddr phys_addr, hwaddr size,
                                        uint8_t lock)
 {
@@ -246,8 +316,23 @@ tryagain:
         cache_size = MCACHE_BUCKET_SIZE;
     }
 
-    entry = &mapcache->entry[address_index % mapcache->nr_buckets];
+    /* Look for a mapping of the range first, idle entries included */
+    pentry = NULL;
+    for (entry = &mapcache->entry[address_index % mapcache->nr_buckets];
+         entry; pentry = entry, entry = entry->next) {
+        if (entry->vaddr_base && entry->paddr_index == address_index &&
+            entry->size == cache_size &&
+            test_bits(address_offset >> XC_PAGE_SHIFT,
+                      test_bit_size >> XC_PAGE_SHIFT,
+                      entry->valid_mapping)) {
+            break;
+        }
+    }
 
+    if (!entry) {
+        pentry = NULL;
+        entry = &mapcache->entry[address_index % mapcache->nr_buckets];
+    }
     while (entry && entry->lock && entry->vaddr_base &&
             (entry->paddr_index != address_index || entry->size != cache_size ||
              !test_bits(address_offset >> XC_PAGE_SHIFT,
@@ -260,7 +345,12 @@ tryagain:
         entry = g_malloc0(sizeof (MapCacheEntry));
         pentry->next = entry;
         xen_remap_bucket(entry, cache_size, address_index);
+        if (!lock) {
+            xen_map_cache_idle_add(entry);
+        }
     } else if (!entry->lock) {
+        /* Idle entries are taken off the list while their size changes */
+        xen_map_cache_idle_remove(entry);
         if (!entry->vaddr_base || entry->paddr_index != address_index ||
                 entry->size != cache_size ||
                 !test_bits(address_offset >> XC_PAGE_SHIFT,
@@ -268,6 +358,9 @@ tryagain:
                     entry->valid_mapping)) {
             xen_remap_bucket(entry, cache_size, address_index);
         }
+        if (!lock && pentry) {
+            xen_map_cache_idle_add(entry);
+        }
     }
 
     if(!test_bits(address_offset >> XC_PAGE_SHIFT,
@@ -396,13 +489,7 @@ static void xen_invalidate_map_cache_entry_unlocked(uint8_t *buffer)
         return;
     }
 
-    pentry->next = entry->next;
-    if (munmap(entry->vaddr_base, entry->size) != 0) {
-        perror("unmap fails");
-        exit(-1);
-    }
-    g_free(entry->valid_mapping);
-    g_free(entry);
+    xen_map_cache_idle_add(entry);
 }
 
 void xen_invalidate_map_cache_entry(uint8_t *buffer)
@@ -416,6 +503,7 @@ void xen_invalidate_map_cache(void)
 {
     unsigned long i;
     MapCacheRev *reventry;
+    MapCacheEntry *idle;
 
     /* Flush pending AIO before destroying the mapcache */
     bdrv_drain_all();
@@ -428,6 +516,11 @@ void xen_invalidate_map_cache(void)
                 reventry->paddr_index, reventry->vaddr_req);
     }
 
+    while ((idle = QTAILQ_FIRST(&mapcache->idle_entries)) != NULL) {
+        xen_map_cache_idle_remove(idle);
+        xen_map_cache_free_entry(idle);
+    }
+
     for (i = 0; i < mapcache->nr_buckets; i++) {
         MapCacheEntry *entry = &mapcache->entry[i];
 